@@ -32,7 +32,12 @@ LOCAL_MODULE := trustme.cml.libcommon
 LOCAL_MODULE_TAGS := optional
 LOCAL_SRC_FILES := \
 	event.c \
+	uring.c \
 	list.c \
+	ilist.c \
+	hashmap.c \
+	omap.c \
+	bitmap.c \
 	logf.c \
 	mem.c \
 	str.c \
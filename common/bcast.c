@@ -0,0 +1,200 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "bcast.h"
+
+#include "macro.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_memfd_create
+#define SYS_memfd_create 319
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+// a reader gives up after that many torn snapshots
+#define BCAST_READ_RETRIES 64
+
+#define BCAST_PAGE_SIZE 4096
+
+int
+bcast_page_new(bcast_page_t **page)
+{
+	ASSERT(page);
+
+	int memfd = syscall(SYS_memfd_create, "bcast", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		ERROR_ERRNO("Failed to create memfd for broadcast page");
+		return -1;
+	}
+	if (ftruncate(memfd, BCAST_PAGE_SIZE) < 0) {
+		ERROR_ERRNO("Failed to resize broadcast page");
+		goto error;
+	}
+
+	*page = mmap(NULL, BCAST_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (*page == MAP_FAILED) {
+		ERROR_ERRNO("Failed to map broadcast page");
+		goto error;
+	}
+
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+		ERROR_ERRNO("Failed to seal broadcast page");
+		munmap(*page, BCAST_PAGE_SIZE);
+		goto error;
+	}
+	/* Keeps our own mapping writable but refuses any new one (since Linux 5.1).
+	 * Without it, readers could reopen the memfd writable through /proc and
+	 * forge the state of all other readers, so the page must not be shared. */
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0) {
+		ERROR_ERRNO("Could not seal broadcast page against future writes");
+		munmap(*page, BCAST_PAGE_SIZE);
+		goto error;
+	}
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SEAL) < 0)
+		WARN_ERRNO("Could not seal seals of broadcast page");
+
+	__atomic_store_n(&(*page)->magic, BCAST_MAGIC, __ATOMIC_RELEASE);
+	return memfd;
+
+error:
+	close(memfd);
+	return -1;
+}
+
+int
+bcast_page_open_ro(int memfd)
+{
+	char *path = mem_printf("/proc/self/fd/%d", memfd);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		ERROR_ERRNO("Failed to reopen broadcast page %s read-only", path);
+
+	mem_free(path);
+	return fd;
+}
+
+const bcast_page_t *
+bcast_page_map(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size != BCAST_PAGE_SIZE) {
+		ERROR("Invalid broadcast page fd %d", fd);
+		return NULL;
+	}
+
+	const bcast_page_t *page = mmap(NULL, BCAST_PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		ERROR_ERRNO("Failed to map broadcast page");
+		return NULL;
+	}
+	return page;
+}
+
+void
+bcast_page_unmap(const bcast_page_t *page)
+{
+	IF_NULL_RETURN(page);
+
+	if (munmap((void *)page, BCAST_PAGE_SIZE) < 0)
+		WARN_ERRNO("Failed to unmap broadcast page");
+}
+
+void
+bcast_page_write(bcast_page_t *page, const bcast_state_t *state)
+{
+	ASSERT(page);
+	ASSERT(state);
+
+	uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&page->state, state, sizeof(page->state));
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void
+bcast_page_kill(bcast_page_t *page)
+{
+	ASSERT(page);
+
+	uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&page->magic, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int
+bcast_page_read(const bcast_page_t *page, bcast_state_t *state, uint32_t *seq)
+{
+	ASSERT(page);
+	ASSERT(state);
+
+	for (int i = 0; i < BCAST_READ_RETRIES; i++) {
+		uint32_t begin = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->magic, __ATOMIC_RELAXED) != BCAST_MAGIC) {
+			errno = ESTALE;
+			return -1;
+		}
+		if (begin & 1) {
+			sched_yield();
+			continue;
+		}
+
+		memcpy(state, &page->state, sizeof(*state));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == begin) {
+			state->dns[BCAST_DNS_LEN - 1] = '\0';
+			if (seq)
+				*seq = begin;
+			return 0;
+		}
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
@@ -0,0 +1,126 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file bcast.h
+ *
+ * A broadcast page is a single sealed memfd page which one writer shares with
+ * many readers in other processes. The state on the page is guarded by a
+ * sequence lock: the writer makes the sequence number odd while it updates the
+ * state and even again afterwards, readers retry until they copied the state
+ * under the same even sequence number. Readers thus never block the writer and
+ * never need a round trip to it.
+ *
+ * Readers get the page through a read-only file descriptor, see
+ * bcast_page_open_ro(), which can neither be mapped writable nor resized.
+ */
+
+#ifndef COMMON_BCAST_H
+#define COMMON_BCAST_H
+
+#include <stdint.h>
+
+#define BCAST_MAGIC 0x74736362u // "bcst"
+
+#define BCAST_DNS_LEN 64
+
+// the clock of the host is not synchronized with a time source
+#define BCAST_FLAG_TIME_UNSYNCED (1u << 0)
+
+/**
+ * State which is published on the page.
+ */
+typedef struct bcast_state {
+	int32_t connectivity; /* container_connectivity_t of the root network namespace */
+	uint32_t flags;	      /* BCAST_FLAG_* */
+	int64_t btime;	      /* boot time of cmld in seconds since the epoch */
+	char dns[BCAST_DNS_LEN]; /* dns server of the host, empty if none */
+} bcast_state_t;
+
+typedef struct bcast_page {
+	uint32_t magic; /* BCAST_MAGIC, 0 once the writer abandoned the page */
+	uint32_t seq;	/* odd while the writer updates the state */
+	bcast_state_t state;
+} bcast_page_t;
+
+/**
+ * Creates a new sealed memfd holding a zeroed broadcast page and maps it
+ * writable for the caller, which is the only writer of the page. Fails if the
+ * kernel cannot seal the page against new writable mappings (Linux < 5.1).
+ *
+ * @param page set to the writable mapping of the page
+ * @return the memfd or -1 on error
+ */
+int
+bcast_page_new(bcast_page_t **page);
+
+/**
+ * Reopens the memfd of a broadcast page read-only. Only the returned fd
+ * should be passed to readers.
+ *
+ * @return the read-only fd or -1 on error
+ */
+int
+bcast_page_open_ro(int memfd);
+
+/**
+ * Maps the broadcast page of the given fd read-only.
+ *
+ * @return the mapping or NULL if the fd does not hold a broadcast page
+ */
+const bcast_page_t *
+bcast_page_map(int fd);
+
+/**
+ * Unmaps a broadcast page mapped by bcast_page_new() or bcast_page_map().
+ */
+void
+bcast_page_unmap(const bcast_page_t *page);
+
+/**
+ * Publishes the given state on the page. Must only be called by the single
+ * writer of the page.
+ */
+void
+bcast_page_write(bcast_page_t *page, const bcast_state_t *state);
+
+/**
+ * Marks the page as abandoned. Readers fail with ESTALE afterwards and should
+ * fetch the new page of the writer.
+ */
+void
+bcast_page_kill(bcast_page_t *page);
+
+/**
+ * Copies a consistent snapshot of the state on the page.
+ *
+ * @param state filled with the published state
+ * @param seq if not NULL, set to the sequence number of the snapshot, which
+ *            changes with each update
+ * @return 0 on success, -1 with errno ESTALE if the page was abandoned or
+ *         EAGAIN if the writer kept updating the page while reading
+ */
+int
+bcast_page_read(const bcast_page_t *page, bcast_state_t *state, uint32_t *seq);
+
+#endif /* COMMON_BCAST_H */
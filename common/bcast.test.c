@@ -0,0 +1,138 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "munit.h"
+
+#include "bcast.h"
+#include "logf.h"
+#include "macro.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static MunitResult
+test_bcast_read_write(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	bcast_page_t *page = NULL;
+	int memfd = bcast_page_new(&page);
+	munit_assert_int(memfd, >=, 0);
+
+	int fd = bcast_page_open_ro(memfd);
+	munit_assert_int(fd, >=, 0);
+	const bcast_page_t *ro = bcast_page_map(fd);
+	munit_assert_not_null(ro);
+
+	bcast_state_t state = { 0 };
+	uint32_t seq0, seq1;
+	munit_assert_int(bcast_page_read(ro, &state, &seq0), ==, 0);
+	munit_assert_int(state.connectivity, ==, 0);
+
+	bcast_state_t pub = { .connectivity = 2, .btime = 1234 };
+	strcpy(pub.dns, "10.0.0.1");
+	bcast_page_write(page, &pub);
+
+	munit_assert_int(bcast_page_read(ro, &state, &seq1), ==, 0);
+	munit_assert_uint32(seq1, !=, seq0);
+	munit_assert_int(state.connectivity, ==, 2);
+	munit_assert_int64(state.btime, ==, 1234);
+	munit_assert_string_equal(state.dns, "10.0.0.1");
+
+	// readers can neither write nor resize the page
+	munit_assert_ptr_equal(mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0),
+			       MAP_FAILED);
+	munit_assert_int(ftruncate(memfd, 8192), ==, -1);
+
+	// an abandoned page is stale
+	bcast_page_kill(page);
+	munit_assert_int(bcast_page_read(ro, &state, NULL), ==, -1);
+	munit_assert_int(errno, ==, ESTALE);
+
+	bcast_page_unmap(ro);
+	bcast_page_unmap(page);
+	close(fd);
+	close(memfd);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_bcast_torn(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	bcast_page_t *page = NULL;
+	int memfd = bcast_page_new(&page);
+	munit_assert_int(memfd, >=, 0);
+
+	// a writer which never finishes its update
+	page->seq++;
+
+	bcast_state_t state;
+	munit_assert_int(bcast_page_read(page, &state, NULL), ==, -1);
+	munit_assert_int(errno, ==, EAGAIN);
+
+	bcast_page_unmap(page);
+	close(memfd);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/read write",		/* name */
+		test_bcast_read_write,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/torn",		/* name */
+		test_bcast_torn,	/* test */
+		setup,			/* setup */
+		NULL,			/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite bcast_suite = {
+	"/bcast",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
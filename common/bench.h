@@ -0,0 +1,65 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+/**
+ * @file bench.h
+ *
+ * Helpers for the munit based micro benchmarks of common.bench.
+ *
+ * Each benchmark times its hot loop and reports the result with bench_report().
+ * Results are compared against the baseline stored in the file given by
+ * COMMON_BENCH_BASELINE (default: common.bench.baseline). Benchmarks without
+ * a baseline record their result as new baseline. A benchmark fails if it is
+ * slower than its baseline by more than COMMON_BENCH_TOLERANCE percent
+ * (default: 50).
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "munit.h"
+
+#include <stdint.h>
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t
+bench_now_ns(void);
+
+/**
+ * Reports the time a benchmark needed for ops operations and checks it
+ * against the stored baseline.
+ *
+ * @param name name of the benchmark
+ * @param params the munit parameters of the benchmark, which become part of the
+ *               name of the baseline entry
+ * @param ops number of operations done in ns nanoseconds
+ * @param ns elapsed time in nanoseconds
+ * @return MUNIT_OK or MUNIT_FAIL if the benchmark regressed
+ */
+MunitResult
+bench_report(const char *name, const MunitParameter params[], uint64_t ops, uint64_t ns);
+
+#endif /* BENCH_H */
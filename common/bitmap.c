@@ -0,0 +1,138 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "bitmap.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define BITMAP_WORD_BITS 64
+#define BITMAP_WORDS(size) (((size) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define BITMAP_MASK(bit) ((uint64_t)1 << ((bit) % BITMAP_WORD_BITS))
+
+struct bitmap {
+	size_t size;	 /**< number of bits */
+	uint64_t *words; /**< BITMAP_WORDS(size) words, unused bits of the last one stay 0 */
+};
+
+bitmap_t *
+bitmap_new(size_t size)
+{
+	bitmap_t *bm = mem_new0(bitmap_t, 1);
+	bm->size = size;
+	bm->words = mem_new0(uint64_t, MAX(BITMAP_WORDS(size), (size_t)1));
+
+	return bm;
+}
+
+void
+bitmap_free(bitmap_t *bm)
+{
+	IF_NULL_RETURN(bm);
+
+	mem_free(bm->words);
+	mem_free(bm);
+}
+
+size_t
+bitmap_size(const bitmap_t *bm)
+{
+	ASSERT(bm);
+	return bm->size;
+}
+
+bool
+bitmap_test(const bitmap_t *bm, size_t bit)
+{
+	ASSERT(bm);
+	IF_TRUE_RETVAL(bit >= bm->size, false);
+
+	return bm->words[bit / BITMAP_WORD_BITS] & BITMAP_MASK(bit);
+}
+
+void
+bitmap_set(bitmap_t *bm, size_t bit)
+{
+	ASSERT(bm);
+	ASSERT(bit < bm->size);
+
+	bm->words[bit / BITMAP_WORD_BITS] |= BITMAP_MASK(bit);
+}
+
+void
+bitmap_clear(bitmap_t *bm, size_t bit)
+{
+	ASSERT(bm);
+	ASSERT(bit < bm->size);
+
+	bm->words[bit / BITMAP_WORD_BITS] &= ~BITMAP_MASK(bit);
+}
+
+void
+bitmap_clear_all(bitmap_t *bm)
+{
+	ASSERT(bm);
+
+	memset(bm->words, 0, BITMAP_WORDS(bm->size) * sizeof(uint64_t));
+}
+
+ssize_t
+bitmap_find_zero(size_t n, const bitmap_t *const maps[])
+{
+	size_t size = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		if (!maps[i])
+			continue;
+		ASSERT(!size || size == maps[i]->size);
+		size = maps[i]->size;
+	}
+
+	for (size_t w = 0; w < BITMAP_WORDS(size); w++) {
+		uint64_t used = 0;
+		for (size_t i = 0; i < n; i++)
+			used |= maps[i] ? maps[i]->words[w] : 0;
+		if (used == UINT64_MAX)
+			continue;
+
+		size_t bit = w * BITMAP_WORD_BITS + __builtin_ctzll(~used);
+		return bit < size ? (ssize_t)bit : -1;
+	}
+
+	return -1;
+}
+
+ssize_t
+bitmap_alloc(bitmap_t *bm)
+{
+	ASSERT(bm);
+
+	ssize_t bit = bitmap_find_zero(1, (const bitmap_t *const[]){ bm });
+	if (bit >= 0)
+		bitmap_set(bm, bit);
+
+	return bit;
+}
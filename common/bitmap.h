@@ -0,0 +1,102 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+/**
+ * @file bitmap.h
+ *
+ * Implements a fixed size bitmap to allocate small integer ids, e.g. offsets of
+ * address or uid ranges. Free ids are found word by word, i.e. 64 ids at once.
+ */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct bitmap bitmap_t;
+
+/**
+ * Creates a bitmap of size bits which are all cleared.
+ */
+bitmap_t *
+bitmap_new(size_t size);
+
+/**
+ * Frees the bitmap.
+ */
+void
+bitmap_free(bitmap_t *bm);
+
+/**
+ * Returns the number of bits of the bitmap.
+ */
+size_t
+bitmap_size(const bitmap_t *bm);
+
+/**
+ * Returns whether bit is set. Bits beyond the size of the bitmap are never set.
+ */
+bool
+bitmap_test(const bitmap_t *bm, size_t bit);
+
+/**
+ * Sets bit, which must be smaller than the size of the bitmap.
+ */
+void
+bitmap_set(bitmap_t *bm, size_t bit);
+
+/**
+ * Clears bit, which must be smaller than the size of the bitmap.
+ */
+void
+bitmap_clear(bitmap_t *bm, size_t bit);
+
+/**
+ * Clears all bits of the bitmap.
+ */
+void
+bitmap_clear_all(bitmap_t *bm);
+
+/**
+ * Finds the lowest bit which is cleared in all of the given bitmaps, which
+ * must be of the same size. NULL entries are skipped.
+ *
+ * @param n Number of bitmaps.
+ * @param maps The bitmaps to be checked.
+ * @return The lowest free bit or -1 if there is none.
+ */
+ssize_t
+bitmap_find_zero(size_t n, const bitmap_t *const maps[]);
+
+/**
+ * Sets the lowest bit which is cleared in the bitmap.
+ *
+ * @return The set bit or -1 if all bits are set.
+ */
+ssize_t
+bitmap_alloc(bitmap_t *bm);
+
+#endif /* BITMAP_H */
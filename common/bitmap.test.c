@@ -0,0 +1,121 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "munit.h"
+
+#include "bitmap.h"
+#include "logf.h"
+#include "macro.h"
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	// No clean-up needed for now
+}
+
+static MunitResult
+test_bitmap_alloc(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// not a multiple of the word size, thus the last word is used partially
+	bitmap_t *bm = bitmap_new(130);
+
+	for (ssize_t i = 0; i < 130; i++)
+		munit_assert_int(bitmap_alloc(bm), ==, i);
+	munit_assert_int(bitmap_alloc(bm), ==, -1);
+
+	// freed bits are reused lowest first, also across words
+	bitmap_clear(bm, 100);
+	bitmap_clear(bm, 3);
+	munit_assert_false(bitmap_test(bm, 3));
+	munit_assert_int(bitmap_alloc(bm), ==, 3);
+	munit_assert_int(bitmap_alloc(bm), ==, 100);
+	munit_assert_false(bitmap_test(bm, 130));
+
+	bitmap_clear_all(bm);
+	munit_assert_int(bitmap_alloc(bm), ==, 0);
+
+	bitmap_free(bm);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_bitmap_find_zero(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	bitmap_t *used = bitmap_new(70);
+	bitmap_t *reserved = bitmap_new(70);
+
+	for (size_t i = 0; i < 64; i++)
+		bitmap_set(used, i);
+	bitmap_set(reserved, 64);
+	bitmap_set(reserved, 66);
+
+	munit_assert_int(bitmap_find_zero(2, (const bitmap_t *const[]){ used, reserved }), ==, 65);
+	munit_assert_int(bitmap_find_zero(2, (const bitmap_t *const[]){ used, NULL }), ==, 64);
+
+	for (size_t i = 64; i < 70; i++)
+		bitmap_set(used, i);
+	munit_assert_int(bitmap_find_zero(1, (const bitmap_t *const[]){ used }), ==, -1);
+
+	bitmap_free(used);
+	bitmap_free(reserved);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/alloc",		/* name */
+		test_bitmap_alloc,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/find zero",		/* name */
+		test_bitmap_find_zero,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite bitmap_suite = {
+	"/bitmap",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
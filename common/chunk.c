@@ -0,0 +1,108 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "chunk.h"
+
+#include "macro.h"
+#include "mem.h"
+
+/* a boundary is found on average every 2^16 bytes after the minimum size */
+#define CHUNK_MASK 0xffffULL
+
+struct chunker {
+	uint64_t hash;
+	size_t len;
+};
+
+static uint64_t chunk_gear[256];
+static bool chunk_gear_initialized = false;
+
+/*
+ * The gear table has to be the same wherever chunks are computed, so it is
+ * filled by a fixed seeded splitmix64 generator instead of being random.
+ */
+static void
+chunk_gear_init(void)
+{
+	uint64_t x = 0x636d6c2d63686e6bULL;
+
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		chunk_gear[i] = z ^ (z >> 31);
+	}
+	chunk_gear_initialized = true;
+}
+
+chunker_t *
+chunker_new(void)
+{
+	if (!chunk_gear_initialized)
+		chunk_gear_init();
+
+	return mem_new0(chunker_t, 1);
+}
+
+size_t
+chunker_scan(chunker_t *chunker, const uint8_t *buf, size_t len, bool *boundary)
+{
+	ASSERT(chunker);
+	ASSERT(boundary);
+
+	uint64_t hash = chunker->hash;
+	size_t i = 0;
+
+	*boundary = false;
+
+	/* the hash is not evaluated before the minimum size, so just skip it */
+	if (chunker->len < CHUNK_SIZE_MIN) {
+		i = MIN(len, CHUNK_SIZE_MIN - chunker->len);
+		chunker->len += i;
+	}
+
+	for (; i < len; i++) {
+		hash = (hash << 1) + chunk_gear[buf[i]];
+		if (++chunker->len >= CHUNK_SIZE_MAX || (chunker->len >= CHUNK_SIZE_MIN &&
+							  !(hash & CHUNK_MASK))) {
+			*boundary = true;
+			i++;
+			break;
+		}
+	}
+
+	if (*boundary) {
+		chunker->hash = 0;
+		chunker->len = 0;
+	} else {
+		chunker->hash = hash;
+	}
+
+	return i;
+}
+
+void
+chunker_free(chunker_t *chunker)
+{
+	mem_free(chunker);
+}
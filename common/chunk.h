@@ -0,0 +1,72 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file chunk.h
+ *
+ * Content defined chunking of files. Chunk boundaries are found by a gear
+ * rolling hash over the data, so that they only depend on the content around
+ * them and not on its offset. An insertion or removal in a file thus only
+ * changes the chunks covering it, the remaining chunks are the same as in
+ * the original file. This allows to find the data two versions of a file
+ * have in common, e.g. for delta updates of images.
+ */
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bounds of the chunk size. The average size is about 64 KiB above the minimum.
+ */
+#define CHUNK_SIZE_MIN (16 * 1024)
+#define CHUNK_SIZE_MAX (256 * 1024)
+
+typedef struct chunker chunker_t;
+
+/**
+ * Creates a new chunker for scanning a stream of data from its start.
+ */
+chunker_t *
+chunker_new(void);
+
+/**
+ * Scans up to len bytes of buf, which continue the data scanned before, for
+ * the end of the current chunk.
+ * @param boundary set to true if the current chunk ends within buf; the next
+ *        call then starts a new chunk
+ * @return the number of bytes of buf belonging to the current chunk
+ */
+size_t
+chunker_scan(chunker_t *chunker, const uint8_t *buf, size_t len, bool *boundary);
+
+/**
+ * Frees the given chunker.
+ */
+void
+chunker_free(chunker_t *chunker);
+
+#endif /* CHUNK_H */
@@ -0,0 +1,144 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "munit.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BASELINE_DEFAULT "common.bench.baseline"
+#define BENCH_TOLERANCE_DEFAULT 50
+#define BENCH_NAME_MAX 256
+
+extern MunitSuite event_bench_suite;
+extern MunitSuite list_bench_suite;
+extern MunitSuite file_bench_suite;
+extern MunitSuite protobuf_bench_suite;
+extern MunitSuite ssl_util_bench_suite;
+
+uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const char *
+bench_baseline_file(void)
+{
+	const char *file = getenv("COMMON_BENCH_BASELINE");
+	return file ? file : BENCH_BASELINE_DEFAULT;
+}
+
+/*
+ * Looks up the baseline of the given benchmark. munit runs every test in a
+ * forked child, so the file is the only state shared between benchmarks;
+ * new entries are appended and the last entry of a name wins.
+ */
+static double
+bench_baseline_get(const char *key)
+{
+	FILE *f = fopen(bench_baseline_file(), "r");
+	if (!f)
+		return 0;
+
+	// names contain spaces, the value is the last field of the line
+	char line[BENCH_NAME_MAX + 32];
+	double baseline = 0;
+	while (fgets(line, sizeof(line), f)) {
+		char *sep = strrchr(line, ' ');
+		if (!sep)
+			continue;
+		*sep = '\0';
+		if (!strcmp(line, key))
+			baseline = strtod(sep + 1, NULL);
+	}
+
+	fclose(f);
+	return baseline;
+}
+
+static void
+bench_baseline_add(const char *key, double ns_per_op)
+{
+	FILE *f = fopen(bench_baseline_file(), "a");
+	if (!f) {
+		munit_logf(MUNIT_LOG_WARNING, "Failed to store baseline in %s",
+			   bench_baseline_file());
+		return;
+	}
+	fprintf(f, "%s %.3f\n", key, ns_per_op);
+	fclose(f);
+}
+
+MunitResult
+bench_report(const char *name, const MunitParameter params[], uint64_t ops, uint64_t ns)
+{
+	char key[BENCH_NAME_MAX];
+	size_t len = snprintf(key, sizeof(key), "%s", name);
+	for (int i = 0; params && params[i].name && len < sizeof(key); i++)
+		len += snprintf(key + len, sizeof(key) - len, "/%s=%s", params[i].name,
+				params[i].value);
+
+	double ns_per_op = ops ? (double)ns / ops : (double)ns;
+	double baseline = bench_baseline_get(key);
+
+	if (baseline <= 0) {
+		munit_logf(MUNIT_LOG_INFO, "%s: %.1f ns/op (new baseline)", key, ns_per_op);
+		bench_baseline_add(key, ns_per_op);
+		return MUNIT_OK;
+	}
+
+	const char *tolerance_env = getenv("COMMON_BENCH_TOLERANCE");
+	int tolerance = tolerance_env ? atoi(tolerance_env) : BENCH_TOLERANCE_DEFAULT;
+	double change = (ns_per_op - baseline) * 100 / baseline;
+
+	munit_logf(MUNIT_LOG_INFO, "%s: %.1f ns/op (baseline %.1f ns/op, %+.1f%%)", key,
+		   ns_per_op, baseline, change);
+
+	if (change > tolerance) {
+		munit_logf(MUNIT_LOG_WARNING, "%s regressed by %.1f%% (tolerance %d%%)", key, change,
+			   tolerance);
+		return MUNIT_FAIL;
+	}
+	return MUNIT_OK;
+}
+
+int
+main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)])
+{
+	int failed = 0;
+
+	failed += munit_suite_main(&event_bench_suite, NULL, argc, argv);
+	failed += munit_suite_main(&list_bench_suite, NULL, argc, argv);
+	failed += munit_suite_main(&file_bench_suite, NULL, argc, argv);
+	failed += munit_suite_main(&protobuf_bench_suite, NULL, argc, argv);
+	failed += munit_suite_main(&ssl_util_bench_suite, NULL, argc, argv);
+
+	return failed;
+}
@@ -1,8 +1,23 @@
 #include "munit.h"
 
 extern MunitSuite mem_suite;
+extern MunitSuite list_suite;
+extern MunitSuite str_suite;
+extern MunitSuite logf_suite;
+extern MunitSuite hashmap_suite;
+extern MunitSuite omap_suite;
+extern MunitSuite bitmap_suite;
+extern MunitSuite event_suite;
+extern MunitSuite file_suite;
 extern MunitSuite macro_suite;
+extern MunitSuite proc_suite;
 extern MunitSuite ssl_util_suite;
+extern MunitSuite merkle_suite;
+extern MunitSuite fd_suite;
+extern MunitSuite drbg_suite;
+extern MunitSuite uring_suite;
+extern MunitSuite logstore_suite;
+extern MunitSuite bcast_suite;
 
 int
 main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)])
@@ -10,8 +25,23 @@ main(int argc, char *argv[MUNIT_ARRAY_PARAM(argc + 1)])
 	int failed = 0;
 
 	failed += munit_suite_main(&mem_suite, NULL, argc, argv);
+	failed += munit_suite_main(&list_suite, NULL, argc, argv);
+	failed += munit_suite_main(&str_suite, NULL, argc, argv);
+	failed += munit_suite_main(&logf_suite, NULL, argc, argv);
+	failed += munit_suite_main(&hashmap_suite, NULL, argc, argv);
+	failed += munit_suite_main(&omap_suite, NULL, argc, argv);
+	failed += munit_suite_main(&bitmap_suite, NULL, argc, argv);
+	failed += munit_suite_main(&event_suite, NULL, argc, argv);
+	failed += munit_suite_main(&file_suite, NULL, argc, argv);
 	failed += munit_suite_main(&macro_suite, NULL, argc, argv);
+	failed += munit_suite_main(&proc_suite, NULL, argc, argv);
 	failed += munit_suite_main(&ssl_util_suite, NULL, argc, argv);
+	failed += munit_suite_main(&merkle_suite, NULL, argc, argv);
+	failed += munit_suite_main(&fd_suite, NULL, argc, argv);
+	failed += munit_suite_main(&drbg_suite, NULL, argc, argv);
+	failed += munit_suite_main(&uring_suite, NULL, argc, argv);
+	failed += munit_suite_main(&logstore_suite, NULL, argc, argv);
+	failed += munit_suite_main(&bcast_suite, NULL, argc, argv);
 
 	return failed;
 }
@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -45,6 +46,7 @@
 #include "mem.h"
 #include "proc.h"
 #include "file.h"
+#include "str.h"
 
 #ifdef ANDROID
 #define DEV_MAPPER "/dev/device-mapper"
@@ -55,9 +57,13 @@
 #endif
 
 #define TABLE_LOAD_RETRIES 10
+#define CRYPTFS_POOL_PREFIX "cml-pool-"
 #define INTEGRITY_TAG_SIZE 32
 #define CRYPTO_TYPE_AUTHENC "capi:authenc(hmac(sha256),xts(aes))-random"
 #define CRYPTO_TYPE "aes-xts-plain64"
+// AES-256-XTS takes 512 bit keys, the only XTS variant of blk-crypto
+#define CRYPTO_INLINE_KEY_HEX_LEN 128
+#define CRYPTO_INLINE_MODE "AES-256-XTS"
 
 /* taken from vold */
 #define DEVMAPPER_BUFFER_SIZE 4096
@@ -69,10 +75,27 @@
 #define DM_EXISTS_FLAG 0x00000004
 #endif
 
+/*
+ * udev flags as defined by libdevmapper, passed to the kernel in the upper
+ * half of the event_nr cookie. cmld creates the device nodes itself, thus
+ * udev rules must not race with it on the uevents of resume, rename and remove.
+ */
+#define DM_UDEV_FLAGS_SHIFT 16
+#define DM_UDEV_DISABLE_DM_RULES_FLAG 0x0001
+#define DM_UDEV_DISABLE_SUBSYSTEM_RULES_FLAG 0x0002
+#define DM_UDEV_DISABLE_DISK_RULES_FLAG 0x0004
+#define DM_UDEV_DISABLE_OTHER_RULES_FLAG 0x0008
+#define DM_UDEV_DISABLE_LIBRARY_FALLBACK 0x0020
+#define DM_UDEV_DISABLE_ALL                                                                        \
+	((DM_UDEV_DISABLE_DM_RULES_FLAG | DM_UDEV_DISABLE_SUBSYSTEM_RULES_FLAG |                   \
+	  DM_UDEV_DISABLE_DISK_RULES_FLAG | DM_UDEV_DISABLE_OTHER_RULES_FLAG |                     \
+	  DM_UDEV_DISABLE_LIBRARY_FALLBACK)                                                        \
+	 << DM_UDEV_FLAGS_SHIFT)
+
 /******************************************************************************/
 
 static unsigned long
-get_provided_data_sectors(const char *real_blk_name);
+get_provided_data_sectors(const char *real_blk_name, unsigned *sector_size);
 
 #ifdef __GNU_LIBRARY__
 #define dm_ioctl(...) ioctl(__VA_ARGS__)
@@ -112,6 +135,77 @@ ioctl_init(struct dm_ioctl *io, size_t dataSize, const char *name, unsigned flag
 		strncpy(io->name, name, sizeof(io->name) - 1);
 }
 
+// number of empty dm devices kept ready by cryptfs_pool_fill()
+static unsigned cryptfs_pool_size = 0;
+
+int
+cryptfs_pool_fill(unsigned n)
+{
+	char buffer[DM_CRYPT_BUF_SIZE];
+	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+	int created = 0;
+
+	cryptfs_pool_size = n;
+	IF_TRUE_RETVAL(n == 0, 0);
+
+	int fd = open(DEV_MAPPER, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Cannot open device-mapper");
+		return -1;
+	}
+
+	for (unsigned i = 0; i < n; i++) {
+		char name[DM_NAME_LEN];
+		snprintf(name, sizeof(name), CRYPTFS_POOL_PREFIX "%u", i);
+		ioctl_init(io, sizeof(buffer), name, 0);
+
+		if (!dm_ioctl(fd, DM_DEV_CREATE, io)) {
+			created++;
+		} else if (errno != EBUSY) {
+			ERROR_ERRNO("Cannot create empty dm device %s", name);
+			break;
+		}
+	}
+	close(fd);
+
+	TRACE("Created %d empty dm devices", created);
+	return created;
+}
+
+/*
+ * Creates an empty dm device, preferably by taking one of the devices created
+ * by cryptfs_pool_fill() and renaming it.
+ */
+static int
+cryptfs_dev_create(int fd, const char *name)
+{
+	char buffer[DM_CRYPT_BUF_SIZE];
+	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+
+	for (unsigned i = 0; i < cryptfs_pool_size; i++) {
+		char pool_name[DM_NAME_LEN];
+		snprintf(pool_name, sizeof(pool_name), CRYPTFS_POOL_PREFIX "%u", i);
+		ioctl_init(io, sizeof(buffer), pool_name, 0);
+		// the new name follows the ioctl header
+		strncpy(buffer + io->data_start, name, DM_NAME_LEN - 1);
+		io->event_nr = DM_UDEV_DISABLE_ALL;
+
+		// ENXIO if taken by someone else before
+		if (!dm_ioctl(fd, DM_DEV_RENAME, io)) {
+			DEBUG("Took dm device %s from pool for %s", pool_name, name);
+			return 0;
+		}
+	}
+
+	for (int i = 0; i < TABLE_LOAD_RETRIES; i++) {
+		ioctl_init(io, sizeof(buffer), name, 0);
+		if (!dm_ioctl(fd, DM_DEV_CREATE, io))
+			return 0;
+		usleep(500000);
+	}
+	return -1;
+}
+
 static unsigned long
 get_blkdev_size(int fd)
 {
@@ -157,7 +251,7 @@ convert_key_to_hex_ascii(unsigned char *master_key, unsigned int keysize,
 
 static int
 load_integrity_mapping_table(int fd, const char *real_blk_name, const char *meta_blk_name,
-			     const char *name, int fs_size)
+			     const char *name, int fs_size, unsigned sector_size)
 {
 	// General variables
 	int ioctl_ret;
@@ -167,7 +261,10 @@ load_integrity_mapping_table(int fd, const char *real_blk_name, const char *meta
 	struct dm_target_spec *tgt;
 	struct dm_ioctl *mapping_io;
 	char *integrity_params;
-	char *extra_params = mem_printf("1 meta_device:%s", meta_blk_name);
+	char *extra_params = sector_size > 512 ?
+				     mem_printf("2 meta_device:%s block_size:%u", meta_blk_name,
+						sector_size) :
+				     mem_printf("1 meta_device:%s", meta_blk_name);
 	int mapping_counter;
 
 	mapping_io = (struct dm_ioctl *)mapping_buffer;
@@ -221,16 +318,69 @@ load_integrity_mapping_table(int fd, const char *real_blk_name, const char *meta
 	return mapping_counter + 1;
 }
 
+/*
+ * Builds the optional parameters of the crypt target, prefixed by their count.
+ */
+/*
+ * The performance flags only exist for dm-crypt, dm-default-key hands the
+ * encryption to the inline crypto engine of the storage anyway.
+ */
+static char *
+crypto_extra_params_new(bool integrity, bool default_key, unsigned flags, unsigned sector_size)
+{
+	str_t *opts = str_new(NULL);
+	int n = 1;
+
+	if (integrity)
+		str_append_printf(opts, "integrity:%d:aead", INTEGRITY_TAG_SIZE);
+	else
+		str_append(opts, "allow_discards");
+
+	if (default_key)
+		flags &= CRYPTFS_INLINE_CRYPT;
+
+	if (flags & CRYPTFS_SAME_CPU_CRYPT) {
+		str_append(opts, " same_cpu_crypt");
+		n++;
+	}
+	if (flags & CRYPTFS_SUBMIT_FROM_CRYPT_CPUS) {
+		str_append(opts, " submit_from_crypt_cpus");
+		n++;
+	}
+	if (flags & CRYPTFS_NO_READ_WORKQUEUE) {
+		str_append(opts, " no_read_workqueue");
+		n++;
+	}
+	if (flags & CRYPTFS_NO_WRITE_WORKQUEUE) {
+		str_append(opts, " no_write_workqueue");
+		n++;
+	}
+	if (sector_size > 512) {
+		str_append_printf(opts, " sector_size:%u", sector_size);
+		n++;
+	}
+	// inline encryption numbers its data units in sectors of sector_size
+	if ((flags & CRYPTFS_INLINE_CRYPT) && sector_size > 512) {
+		str_append(opts, " iv_large_sectors");
+		n++;
+	}
+
+	char *params = mem_printf("%d %s", n, str_buffer(opts));
+	str_free(opts, true);
+	return params;
+}
+
 static int
 load_crypto_mapping_table(int fd, const char *real_blk_name, const char *master_key_ascii,
-			  const char *name, int fs_size, bool integrity)
+			  const char *name, int fs_size, bool integrity, const char *target,
+			  unsigned flags, unsigned sector_size)
 {
 	char buffer[DM_CRYPT_BUF_SIZE];
 	struct dm_ioctl *io;
 	struct dm_target_spec *tgt;
 	char *crypt_params;
-	char *extra_params = integrity ? mem_printf("1 integrity:%d:aead", INTEGRITY_TAG_SIZE) :
-					 mem_printf("1 allow_discards");
+	char *extra_params = crypto_extra_params_new(integrity, !strcmp(target, "default-key"),
+						     flags, sector_size);
 
 	const char *crypto_type = integrity ? CRYPTO_TYPE_AUTHENC : CRYPTO_TYPE;
 
@@ -250,7 +400,7 @@ load_crypto_mapping_table(int fd, const char *real_blk_name, const char *master_
 	tgt->status = 0;
 	tgt->sector_start = 0;
 	tgt->length = fs_size;
-	strcpy(tgt->target_type, "crypt");
+	strncpy(tgt->target_type, target, sizeof(tgt->target_type) - 1);
 
 	crypt_params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
 	snprintf(crypt_params,
@@ -305,45 +455,23 @@ load_crypto_mapping_table(int fd, const char *real_blk_name, const char *master_
 // [1] https://www.kernel.org/doc/html/latest/admin-guide/device-mapper/dm-integrity.html
 // [2] https://wiki.gentoo.org/wiki/Device-mapper#Integrity
 static int
-create_integrity_blk_dev(const char *real_blk_name, const char *meta_blk_name, const char *name,
-			 const unsigned long fs_size)
+create_integrity_blk_dev(int fd, const char *real_blk_name, const char *meta_blk_name,
+			 const char *name, const unsigned long fs_size, unsigned sector_size)
 {
-	int fd;
-	int ioctl_ret;
 	int load_count = -1;
-	char create_buffer[DM_INTEGRITY_BUF_SIZE];
-	struct dm_ioctl *create_io;
-	int create_counter;
-
-	// Open device mapper
-	if ((fd = open(DEV_MAPPER, O_RDWR)) < 0) {
-		ERROR_ERRNO("Cannot open device-mapper");
-	}
 
 	// Create blk device
-	// Initialize create_io struct
-	create_io = (struct dm_ioctl *)create_buffer;
-	ioctl_init(create_io, DM_INTEGRITY_BUF_SIZE, name, 0);
-
-	for (create_counter = 0; create_counter < TABLE_LOAD_RETRIES; create_counter++) {
-		ioctl_ret = dm_ioctl(fd, DM_DEV_CREATE, create_io);
-		if (!ioctl_ret) {
-			DEBUG("Creating block device worked!");
-			break;
-		}
-
-		usleep(500000);
-	}
-
-	if (create_counter >= TABLE_LOAD_RETRIES) {
-		ERROR_ERRNO("Failed to create block device after %d tries", create_counter);
+	if (cryptfs_dev_create(fd, name) < 0) {
+		ERROR_ERRNO("Failed to create block device after %d tries", TABLE_LOAD_RETRIES);
 		goto errout;
 	}
+	DEBUG("Creating block device worked!");
 
 	// Load Integrity map table
 	DEBUG("Loading Integrity mapping table");
 
-	load_count = load_integrity_mapping_table(fd, real_blk_name, meta_blk_name, name, fs_size);
+	load_count = load_integrity_mapping_table(fd, real_blk_name, meta_blk_name, name, fs_size,
+						  sector_size);
 	if (load_count < 0) {
 		ERROR("Error while loading mapping table");
 		goto errout;
@@ -351,116 +479,60 @@ create_integrity_blk_dev(const char *real_blk_name, const char *meta_blk_name, c
 		INFO("Loading integrity map took %d tries", load_count);
 	}
 
-	// Resume this device to activate it
-	DEBUG("Resuming the blk device");
-	ioctl_init(create_io, DM_INTEGRITY_BUF_SIZE, name, 0);
-
-	ioctl_ret = dm_ioctl(fd, DM_DEV_SUSPEND, create_io);
-	if (ioctl_ret != 0) {
-		ERROR_ERRNO("Cannot resume the dm-integrity device (ioctl ret: %d, errno:%d)",
-			    ioctl_ret, errno);
-		goto errout;
-	}
-
-	close(fd);
 	return 0;
 
 errout:
 	ERROR("Failed integrity block creation");
-	close(fd);
 	return -1;
 }
 
 static int
-create_crypto_blk_dev(const char *real_blk_name, const char *master_key, const char *name,
-		      unsigned long fs_size, bool integrity)
+create_crypto_blk_dev(int fd, const char *real_blk_name, const char *master_key, const char *name,
+		      unsigned long fs_size, bool integrity, const char *target, unsigned flags,
+		      unsigned sector_size)
 {
-	char buffer[DM_CRYPT_BUF_SIZE];
-	struct dm_ioctl *io;
-	int fd;
-	int retval = -1;
 	int load_count;
-	int i;
-	int ioctl_ret;
 
-	DEBUG("Creating crypto blk device");
-	if ((fd = open(DEV_MAPPER, O_RDWR)) < 0) {
-		ERROR("Cannot open device-mapper\n");
-		goto errout;
-	}
-
-	io = (struct dm_ioctl *)buffer;
-	ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
+	DEBUG("Creating crypto blk device (%s)", target);
 
-	for (i = 0; i < TABLE_LOAD_RETRIES; i++) {
-		ioctl_ret = dm_ioctl(fd, DM_DEV_CREATE, io);
-
-		if (!ioctl_ret) {
-			DEBUG("Cryptp DM_DEV_CREATE worked!");
-			break;
-		}
-		usleep(500000);
-	}
-
-	if (i == TABLE_LOAD_RETRIES) {
+	if (cryptfs_dev_create(fd, name) < 0) {
 		/* We failed to load the table, return an error */
 		ERROR("Cannot create dm-crypt device");
-		goto errout;
+		return -1;
 	}
+	DEBUG("Cryptp DM_DEV_CREATE worked!");
 
-	load_count =
-		load_crypto_mapping_table(fd, real_blk_name, master_key, name, fs_size, integrity);
+	load_count = load_crypto_mapping_table(fd, real_blk_name, master_key, name, fs_size,
+					       integrity, target, flags, sector_size);
 	if (load_count < 0) {
 		ERROR("Cannot load dm-crypt mapping table");
-		goto errout;
+		return -1;
 	} else if (load_count > 1) {
 		INFO("Took %d tries to load dmcrypt table.\n", load_count);
 	}
 
-	/* Resume this device to activate it */
-	ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-
-	if (dm_ioctl(fd, DM_DEV_SUSPEND, io)) {
-		ERROR_ERRNO("Cannot resume the dm-crypt device\n");
-		goto errout;
-	}
-
-	/* We made it here with no errors.  Woot! */
-	retval = 0;
-
-errout:
-	close(fd); /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
-	DEBUG("Returning %d from create_crypte_bkl_dev", retval);
-	return retval;
+	return 0;
 }
 
-/* TODO:
- * maybe we need to wait a bit before device is created 
+/*
+ * Resumes the dm device to activate its loaded table and creates the device
+ * node from the device number the resume ioctl reports back. udev rules are
+ * disabled for the resulting uevent, thus nobody else touches the node and
+ * there is no need to wait for it to show up.
  */
 static char *
-create_device_node(const char *name)
+resume_blk_dev_new(int fd, const char *name)
 {
-	char *buffer = mem_new(char, DEVMAPPER_BUFFER_SIZE);
-
-	int fd = open(DEV_MAPPER, O_RDWR);
-	if (fd < 0) {
-		ERROR_ERRNO("Error opening devmapper");
-		mem_free(buffer);
-		return NULL;
-	}
-
+	char buffer[DM_CRYPT_BUF_SIZE];
 	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
 
-	ioctl_init(io, DEVMAPPER_BUFFER_SIZE, name, 0);
-	if (dm_ioctl(fd, DM_DEV_STATUS, io)) {
-		if (errno != ENXIO) {
-			ERROR_ERRNO("DM_DEV_STATUS ioctl failed for lookup");
-		}
-		mem_free(buffer);
-		close(fd);
+	ioctl_init(io, sizeof(buffer), name, 0);
+	io->event_nr = DM_UDEV_DISABLE_ALL;
+
+	if (dm_ioctl(fd, DM_DEV_SUSPEND, io)) {
+		ERROR_ERRNO("Cannot resume dm device %s", name);
 		return NULL;
 	}
-	close(fd);
 
 	/* should not be necassery for android */
 	mkdir("/dev/block", 00777);
@@ -470,36 +542,27 @@ create_device_node(const char *name)
 	unlink(device);
 	if (mknod(device, S_IFBLK | 00777, io->dev) != 0) {
 		ERROR_ERRNO("Cannot mknod device %s", device);
-		mem_free(buffer);
 		mem_free(device);
 		return NULL;
 	}
-	mem_free(buffer);
 	return device;
 }
 
 static int
-delete_integrity_blk_dev(const char *name)
+delete_integrity_blk_dev(int fd, const char *name)
 {
-	int fd;
 	char buffer[DM_INTEGRITY_BUF_SIZE];
 	struct dm_ioctl *io;
-	int ret = -1;
-
-	fd = open(DEV_MAPPER, O_RDWR);
-	if (fd < 0) {
-		ERROR_ERRNO("Cannot open device-mapper");
-		goto error;
-	}
 
 	io = (struct dm_ioctl *)buffer;
 
 	ioctl_init(io, DM_INTEGRITY_BUF_SIZE, name, 0);
+	io->event_nr = DM_UDEV_DISABLE_ALL;
 	if (dm_ioctl(fd, DM_DEV_REMOVE, io) < 0) {
-		ret = errno;
+		int ret = errno;
 		if (errno != ENXIO)
 			ERROR_ERRNO("Cannot remove dm-integrity device");
-		goto error;
+		return ret;
 	}
 
 	/* remove device node if necessary */
@@ -509,15 +572,15 @@ delete_integrity_blk_dev(const char *name)
 
 	DEBUG("Successfully deleted dm-integrity device");
 	/* We made it here with no errors.  Woot! */
-	ret = 0;
-
-error:
-	close(fd);
-	return ret;
+	return 0;
 }
 
+/*
+ * Reads provided_data_sectors from the integrity superblock. If one exists,
+ * sector_size is set to the block size the volume was formatted with.
+ */
 static unsigned long
-get_provided_data_sectors(const char *real_blk_name)
+get_provided_data_sectors(const char *real_blk_name, unsigned *sector_size)
 {
 	int fd;
 	unsigned long provided_data_sectors = 0;
@@ -550,46 +613,109 @@ get_provided_data_sectors(const char *real_blk_name)
 		goto errout;
 	}
 
+	// 28 Bytes offset from start of superblock for log2_sectors_per_block
+	uint8_t log2_sectors_per_block = 0;
+	lseek(fd, 28, SEEK_SET);
+	if (read(fd, &log2_sectors_per_block, 1) == 1 && log2_sectors_per_block <= 3)
+		*sector_size = 512U << log2_sectors_per_block;
+
 errout:
 	DEBUG("Returning: provided_data_sectors= %ld", provided_data_sectors);
 	close(fd);
 	return provided_data_sectors;
 }
 
+/*
+ * Checks whether the disk of blk_dev has an inline crypto engine supporting
+ * AES-256-XTS with data units of sector_size bytes. The supported data unit
+ * sizes are reported as bitmask by the request queue (since Linux 5.18).
+ */
+static bool
+cryptfs_inline_crypt_supported(const char *blk_dev, unsigned sector_size)
+{
+	struct stat st;
+	IF_TRUE_RETVAL(stat(blk_dev, &st) < 0 || !S_ISBLK(st.st_mode), false);
+
+	// partitions have no queue of their own, but share the one of their disk
+	char *mode = mem_printf("/sys/dev/block/%u:%u/queue/crypto/modes/" CRYPTO_INLINE_MODE,
+				major(st.st_rdev), minor(st.st_rdev));
+	if (!file_exists(mode)) {
+		mem_free(mode);
+		mode = mem_printf("/sys/dev/block/%u:%u/../queue/crypto/modes/" CRYPTO_INLINE_MODE,
+				  major(st.st_rdev), minor(st.st_rdev));
+	}
+	char *sizes = file_read_new(mode, 64);
+	mem_free(mode);
+	IF_NULL_RETVAL(sizes, false);
+
+	bool ret = strtoul(sizes, NULL, 0) & sector_size;
+	mem_free(sizes);
+	return ret;
+}
+
+/*
+ * Checks whether a device-mapper target is available, loading its module if
+ * necessary. Kernels before 5.11 lack the ioctl and report no target.
+ */
+static bool
+cryptfs_dm_target_exists(int dm_fd, const char *target)
+{
+	char buffer[DEVMAPPER_BUFFER_SIZE];
+	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+
+	ioctl_init(io, sizeof(buffer), target, 0);
+	return dm_ioctl(dm_fd, DM_GET_TARGET_VERSION, io) == 0;
+}
+
 static char *
-cryptfs_setup_volume_integrity_new(const char *label, const char *real_blkdev,
-				   const char *meta_blkdev, const char *key, unsigned long fs_size)
+cryptfs_setup_volume_integrity_new(int dm_fd, const char *label, const char *real_blkdev,
+				   const char *meta_blkdev, const char *key, unsigned long fs_size,
+				   unsigned flags, unsigned sector_size)
 {
 	bool initial_format = false;
 	char *crypto_blkdev = NULL;
+	char *integrity_dev = NULL;
 	char *integrity_dev_label = mem_printf("%s-%s", label, "integrity");
 	DEBUG("cryptfs_setup_volume_new");
 
-	/* check if meta device is initialized */
-	initial_format = get_provided_data_sectors(meta_blkdev) != fs_size;
+	/* integrity blocks must not straddle the end of the device */
+	fs_size -= fs_size % (sector_size / 512);
+
+	/* check if meta device is initialized, an existing volume keeps its sector size */
+	unsigned format_sector_size = sector_size;
+	initial_format = get_provided_data_sectors(meta_blkdev, &sector_size) != fs_size;
+	if (initial_format)
+		sector_size = format_sector_size;
+	else if (sector_size != format_sector_size)
+		WARN("Keeping sector size %u of existing volume %s", sector_size, label);
 
-	if (create_integrity_blk_dev(real_blkdev, meta_blkdev, integrity_dev_label, fs_size) < 0) {
+	if (create_integrity_blk_dev(dm_fd, real_blkdev, meta_blkdev, integrity_dev_label, fs_size,
+				     sector_size) < 0) {
 		DEBUG("create_integrity_blk_dev failed!");
 		goto error;
 	}
 
-	char *integrity_dev = create_device_node(integrity_dev_label);
-	mem_free(integrity_dev_label);
+	integrity_dev = resume_blk_dev_new(dm_fd, integrity_dev_label);
 	if (!integrity_dev) {
 		ERROR("Could not create device node");
-		return NULL;
+		goto error;
 	} else {
 		DEBUG("Successfully created device node");
 	}
 
-	if (create_crypto_blk_dev(integrity_dev, key, label, fs_size, true) < 0) {
+	if (create_crypto_blk_dev(dm_fd, integrity_dev, key, label, fs_size, true, "crypt", flags,
+				  sector_size) < 0) {
 		ERROR("Could not create crypto block device");
-		return NULL;
+		goto error;
 	}
 
-	crypto_blkdev = create_device_node(label);
+	crypto_blkdev = resume_blk_dev_new(dm_fd, label);
+	IF_NULL_GOTO(crypto_blkdev, error);
 
-	if (initial_format) {
+	if (initial_format && (flags & CRYPTFS_LAZY_INIT)) {
+		INFO("Not wiping new integrity volume %s, sectors are initialized on first write",
+		     label);
+	} else if (initial_format) {
 		/*
 		 * format crypto device, otherwise I/O errors may occur
 		 * also during write attempts which are not bound to
@@ -617,19 +743,23 @@ cryptfs_setup_volume_integrity_new(const char *label, const char *real_blkdev,
 		mem_free(zeros);
 		close(fd);
 	}
+	mem_free(integrity_dev_label);
+	mem_free(integrity_dev);
 	return crypto_blkdev;
 error:
 	mem_free(integrity_dev_label);
+	mem_free(integrity_dev);
 	mem_free(crypto_blkdev);
 	return NULL;
 }
 
 char *
 cryptfs_setup_volume_new(const char *label, const char *real_blkdev, const char *key,
-			 const char *meta_blkdev)
+			 const char *meta_blkdev, unsigned flags, unsigned sector_size)
 {
 	int fd;
 	unsigned long fs_size;
+	char *crypto_blkdev = NULL;
 
 	/* Update the fs_size field to be the size of the volume */
 	if ((fd = open(real_blkdev, O_RDONLY)) < 0) {
@@ -646,21 +776,64 @@ cryptfs_setup_volume_new(const char *label, const char *real_blkdev, const char
 		DEBUG("Crypto blk device size: %lu", fs_size);
 	}
 
-	if (meta_blkdev)
-		return cryptfs_setup_volume_integrity_new(label, real_blkdev, meta_blkdev, key,
-							  fs_size);
-
-	// do dmcrypt device setup only
-
 	/* Use only the first 64 hex digits of master key for 512 bit xts mode */
-	IF_TRUE_RETVAL(strlen(key) < 65, NULL);
-	char enc_key[65];
-	snprintf(enc_key, 65, "%s", key);
+	IF_TRUE_RETVAL(!meta_blkdev && strlen(key) < 65, NULL);
+
+	if (sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1))) {
+		ERROR("Invalid sector size %u for volume %s", sector_size, label);
+		return NULL;
+	}
 
-	if (create_crypto_blk_dev(real_blkdev, enc_key, label, fs_size, false) < 0)
+	// all device-mapper ioctls of this setup share one control fd
+	int dm_fd = open(DEV_MAPPER, O_RDWR | O_CLOEXEC);
+	if (dm_fd < 0) {
+		ERROR_ERRNO("Cannot open device-mapper");
 		return NULL;
+	}
 
-	return create_device_node(label);
+	if (meta_blkdev) {
+		if (flags & CRYPTFS_INLINE_CRYPT)
+			DEBUG("No inline encryption for volume %s with integrity", label);
+		crypto_blkdev = cryptfs_setup_volume_integrity_new(dm_fd, label, real_blkdev,
+								   meta_blkdev, key, fs_size,
+								   flags & ~CRYPTFS_INLINE_CRYPT,
+								   sector_size);
+		close(dm_fd);
+		return crypto_blkdev;
+	}
+
+	if ((flags & CRYPTFS_INLINE_CRYPT) && strlen(key) < CRYPTO_INLINE_KEY_HEX_LEN) {
+		WARN("Key too short for inline encryption of volume %s", label);
+		flags &= ~CRYPTFS_INLINE_CRYPT;
+	}
+
+	/*
+	 * Both targets write the same format for inline encrypted volumes, so
+	 * dm-crypt can take over if dm-default-key is missing.
+	 */
+	const char *target = "crypt";
+	if ((flags & CRYPTFS_INLINE_CRYPT) &&
+	    cryptfs_inline_crypt_supported(real_blkdev, sector_size)) {
+		if (cryptfs_dm_target_exists(dm_fd, "default-key"))
+			target = "default-key";
+		else
+			WARN("%s supports inline encryption, but dm-default-key is missing",
+			     real_blkdev);
+	}
+	INFO("Encrypting volume %s with %s%s", label, target,
+	     (flags & CRYPTFS_INLINE_CRYPT) ? " in the inline crypto format" : "");
+
+	// legacy volumes use only the first 64 hex digits of master key for 256 bit xts mode
+	char enc_key[CRYPTO_INLINE_KEY_HEX_LEN + 1];
+	snprintf(enc_key, (flags & CRYPTFS_INLINE_CRYPT) ? CRYPTO_INLINE_KEY_HEX_LEN + 1 : 65,
+		 "%s", key);
+
+	if (create_crypto_blk_dev(dm_fd, real_blkdev, enc_key, label, fs_size, false, target,
+				  flags, sector_size) == 0)
+		crypto_blkdev = resume_blk_dev_new(dm_fd, label);
+
+	close(dm_fd);
+	return crypto_blkdev;
 }
 
 int
@@ -680,6 +853,7 @@ cryptfs_delete_blk_dev(const char *name)
 	io = (struct dm_ioctl *)buffer;
 
 	ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
+	io->event_nr = DM_UDEV_DISABLE_ALL;
 	if (dm_ioctl(fd, DM_DEV_REMOVE, io) < 0) {
 		ret = errno;
 		if (errno != ENXIO)
@@ -695,7 +869,7 @@ cryptfs_delete_blk_dev(const char *name)
 	DEBUG("Successfully deleted dm-crypt device");
 
 	char *integrity_dev_name = mem_printf("%s-%s", name, "integrity");
-	if (delete_integrity_blk_dev(integrity_dev_name) < 0) {
+	if (delete_integrity_blk_dev(fd, integrity_dev_name) < 0) {
 		mem_free(integrity_dev_name);
 		goto error;
 	}
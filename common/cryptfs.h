@@ -34,14 +34,55 @@
 
 #include <stdbool.h>
 
+/* dm-crypt performance flags, see cryptfs_setup_volume_new() */
+#define CRYPTFS_NO_READ_WORKQUEUE (1 << 0)
+#define CRYPTFS_NO_WRITE_WORKQUEUE (1 << 1)
+#define CRYPTFS_SAME_CPU_CRYPT (1 << 2)
+#define CRYPTFS_SUBMIT_FROM_CRYPT_CPUS (1 << 3)
+/*
+ * Do not wipe a new integrity volume, which writes its whole size once. Its
+ * sectors get valid tags when they are written first, reading a sector which
+ * has never been written fails with an I/O error. File systems only read what
+ * they have written, ext4 zeroes its inode tables lazily in the background.
+ */
+#define CRYPTFS_LAZY_INIT (1 << 4)
+/*
+ * Encrypt volumes without integrity by the inline crypto engine of the
+ * storage through dm-default-key (blk-crypto) if the disk of the volume has
+ * one, and by dm-crypt otherwise. Such volumes use AES-256-XTS with data
+ * units of the sector size, which dm-crypt can read and write as well, so
+ * they stay usable on kernels without dm-default-key. This changes the
+ * format of new and existing volumes, so it has to be set before they are
+ * created.
+ */
+#define CRYPTFS_INLINE_CRYPT (1 << 5)
+
 char *
 cryptfs_get_device_path_new(const char *label);
 
+/**
+ * Sets up a dm-crypt device on top of real_blk_dev, with dm-integrity in
+ * between if meta_blk_dev is given.
+ * @param flags Bitmask of CRYPTFS_* flags tuning the dm-crypt target.
+ * @param sector_size Encryption sector size in bytes (512 to 4096). It is only
+ *        applied when a volume is formatted, existing integrity volumes keep theirs.
+ * @return The path of the device node, which has to be freed by the caller, or NULL.
+ */
 char *
 cryptfs_setup_volume_new(const char *label, const char *real_blk_dev, const char *ascii_key,
-			 const char *meta_blk_dev);
+			 const char *meta_blk_dev, unsigned flags, unsigned sector_size);
 
 int
 cryptfs_delete_blk_dev(const char *name);
 
+/**
+ * Creates empty device-mapper devices, which are taken by
+ * cryptfs_setup_volume_new() instead of creating new ones. Devices still left
+ * from an earlier call are kept, so this can be called again to refill the pool.
+ * @param n The number of devices to keep ready.
+ * @return The number of devices created or -1 on error.
+ */
+int
+cryptfs_pool_fill(unsigned n);
+
 #endif /* CRYPTFS_H */
@@ -30,9 +30,18 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#define DIR_WALK_BUF_SIZE 32768
+#define DIR_WALK_MAX_THREADS 16
+// bounds the number of open directory fds, further subdirs are walked inline
+#define DIR_WALK_MAX_QUEUED 256
+
 int
 dir_foreach(const char *path, int (*func)(const char *path, const char *file, void *data),
 	    void *data)
@@ -300,3 +309,172 @@ dir_copy_folder(const char *source, const char *target,
 	dir_copy_params_free(params);
 	return ret;
 }
+
+struct dir_walk_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+typedef struct dir_walk {
+	int (*func)(int dirfd, const char *name, const struct stat *s, void *data);
+	void *data;
+	int queue[DIR_WALK_MAX_QUEUED];
+	size_t queued;
+	unsigned int busy;
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} dir_walk_t;
+
+/*
+ * Hands the opened directory fd over to the idle workers.
+ * Returns -1 if the queue is full and the caller has to walk fd itself.
+ */
+static int
+dir_walk_push(dir_walk_t *w, int fd)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->queued < DIR_WALK_MAX_QUEUED) {
+		w->queue[w->queued++] = fd;
+		pthread_cond_signal(&w->cond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+static int
+dir_walk_dir(dir_walk_t *w, int fd, char *buf)
+{
+	int ret = 0;
+	long n;
+
+	while ((n = syscall(SYS_getdents64, fd, buf, DIR_WALK_BUF_SIZE)) > 0) {
+		for (long off = 0; off < n;) {
+			struct dir_walk_dirent64 *d = (struct dir_walk_dirent64 *)(buf + off);
+			off += d->d_reclen;
+
+			if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+				continue;
+
+			struct stat s;
+			if (fstatat(fd, d->d_name, &s, AT_SYMLINK_NOFOLLOW) < 0) {
+				WARN_ERRNO("Could not stat %s", d->d_name);
+				ret = -1;
+				continue;
+			}
+			if (w->func(fd, d->d_name, &s, w->data) < 0)
+				ret = -1;
+
+			if (!S_ISDIR(s.st_mode))
+				continue;
+
+			int sub = openat(fd, d->d_name,
+					 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub < 0) {
+				WARN_ERRNO("Could not open dir %s", d->d_name);
+				ret = -1;
+				continue;
+			}
+			if (!dir_walk_push(w, sub))
+				continue;
+
+			// queue is full, buf is still in use by this level
+			char *sub_buf = mem_alloc(DIR_WALK_BUF_SIZE);
+			if (dir_walk_dir(w, sub, sub_buf) < 0)
+				ret = -1;
+			mem_free(sub_buf);
+			close(sub);
+		}
+	}
+	if (n < 0) {
+		WARN_ERRNO("Could not read dir entries");
+		ret = -1;
+	}
+	return ret;
+}
+
+static void *
+dir_walk_worker(void *data)
+{
+	dir_walk_t *w = data;
+	char *buf = mem_alloc(DIR_WALK_BUF_SIZE);
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->queued && w->busy)
+			pthread_cond_wait(&w->cond, &w->lock);
+		// nothing queued and nobody left who could queue more
+		if (!w->queued)
+			break;
+
+		int fd = w->queue[--w->queued];
+		w->busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		int ret = dir_walk_dir(w, fd, buf);
+		close(fd);
+
+		pthread_mutex_lock(&w->lock);
+		if (ret < 0)
+			w->failed = true;
+		if (!--w->busy && !w->queued)
+			pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	mem_free(buf);
+	return NULL;
+}
+
+int
+dir_walk_parallel(const char *path,
+		  int (*func)(int dirfd, const char *name, const struct stat *s, void *data),
+		  void *data, unsigned int threads)
+{
+	IF_NULL_RETVAL(path, -1);
+	IF_NULL_RETVAL(func, -1);
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		WARN_ERRNO("Could not open dir %s", path);
+		return -1;
+	}
+
+	if (!threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	threads = MIN(threads, (unsigned int)DIR_WALK_MAX_THREADS);
+
+	dir_walk_t w = { .func = func, .data = data, .queued = 0, .busy = 0, .failed = false };
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	w.queue[w.queued++] = fd;
+
+	pthread_t tids[DIR_WALK_MAX_THREADS];
+	unsigned int started = 0;
+
+	// the calling thread takes part in the walk
+	for (; started < threads - 1; started++) {
+		if (pthread_create(&tids[started], NULL, dir_walk_worker, &w)) {
+			WARN("Could not start thread for walking %s", path);
+			break;
+		}
+	}
+	dir_walk_worker(&w);
+
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+
+	DEBUG("Walked %s using %u threads%s", path, started + 1, w.failed ? " with errors" : "");
+	return w.failed ? -1 : 0;
+}
@@ -67,4 +67,22 @@ int
 dir_copy_folder(const char *source, const char *target,
 		bool (*filter)(const char *file, void *data), void *filter_data);
 
+/**
+ * Walk the tree below path and call a callback for each contained entry with
+ * the fd of the containing directory, the entry name and its lstat() result.
+ * The root directory itself is not reported and symlinks are not followed.
+ * Directories are read by several threads in parallel, thus the callback has
+ * to be thread safe. Entries of a directory are reported before its contents.
+ * @param path The path of the directory.
+ * @param func The callback to be called for each entry. Return <0 to mark the
+ * walk as failed, the remaining entries are still reported.
+ * @param data A data object given to each callback function.
+ * @param threads The number of threads to use, 0 uses one per online cpu.
+ * @returns -1 if a directory could not be read or a callback failed, 0 otherwise.
+ */
+int
+dir_walk_parallel(const char *path,
+		  int (*func)(int dirfd, const char *name, const struct stat *s, void *data),
+		  void *data, unsigned int threads);
+
 #endif /* DIR_H */
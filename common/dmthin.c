@@ -0,0 +1,355 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#define _GNU_SOURCE
+
+#include "dmthin.h"
+#include "cryptfs.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/dm-ioctl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef ANDROID
+#define DEV_MAPPER "/dev/device-mapper"
+#else
+#define DEV_MAPPER "/dev/mapper/control"
+#endif
+
+#define DMTHIN_BUF_SIZE 4096
+
+/* 64K data blocks, a trade-off between metadata size and snapshot granularity */
+#define DMTHIN_BLOCK_SECTORS 128
+
+/* see the udev flags in cryptfs.c, cmld creates the device nodes itself */
+#define DM_UDEV_DISABLE_ALL (0x002f << 16)
+
+#ifdef __GNU_LIBRARY__
+#define dm_ioctl(...) ioctl(__VA_ARGS__)
+#else
+/* see cryptfs.c, the dm requests overflow the int request of the musl wrapper */
+static int
+dm_ioctl(int fd, unsigned long int request, ...)
+{
+	void *args;
+	va_list ap;
+	int result;
+	va_start(ap, request);
+	args = va_arg(ap, void *);
+	result = syscall(__NR_ioctl, fd, request, args);
+	va_end(ap);
+	return result;
+}
+#endif
+
+static void
+dmthin_ioctl_init(struct dm_ioctl *io, size_t size, const char *name, unsigned flags)
+{
+	memset(io, 0, size);
+	io->data_size = size;
+	io->data_start = sizeof(struct dm_ioctl);
+	io->version[0] = 4;
+	io->version[1] = 0;
+	io->version[2] = 0;
+	io->flags = flags;
+
+	if (name)
+		strncpy(io->name, name, sizeof(io->name) - 1);
+}
+
+static int
+dmthin_control_open(void)
+{
+	int fd = open(DEV_MAPPER, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		ERROR_ERRNO("Cannot open device-mapper");
+	return fd;
+}
+
+/*
+ * Creates the dm device name with a single target of the given type and
+ * activates it. The device node is created from the device number the resume
+ * ioctl reports back.
+ */
+static char *
+dmthin_dev_create_new(int fd, const char *name, const char *type, uint64_t sectors,
+		      const char *params)
+{
+	char buffer[DMTHIN_BUF_SIZE];
+	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+	struct dm_target_spec *tgt = (struct dm_target_spec *)&buffer[sizeof(struct dm_ioctl)];
+	char *tgt_params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
+	size_t params_size = sizeof(buffer) - (tgt_params - buffer);
+
+	if (strlen(params) >= params_size) {
+		ERROR("Table parameters of dm device %s too long", name);
+		return NULL;
+	}
+
+	dmthin_ioctl_init(io, sizeof(buffer), name, 0);
+	if (dm_ioctl(fd, DM_DEV_CREATE, io)) {
+		ERROR_ERRNO("Cannot create dm device %s", name);
+		return NULL;
+	}
+
+	dmthin_ioctl_init(io, sizeof(buffer), name, 0);
+	io->target_count = 1;
+	tgt->sector_start = 0;
+	tgt->length = sectors;
+	strncpy(tgt->target_type, type, sizeof(tgt->target_type) - 1);
+	strcpy(tgt_params, params);
+	if (dm_ioctl(fd, DM_TABLE_LOAD, io)) {
+		ERROR_ERRNO("Cannot load %s table of dm device %s", type, name);
+		goto err;
+	}
+
+	dmthin_ioctl_init(io, sizeof(buffer), name, 0);
+	io->event_nr = DM_UDEV_DISABLE_ALL;
+	if (dm_ioctl(fd, DM_DEV_SUSPEND, io)) {
+		ERROR_ERRNO("Cannot resume dm device %s", name);
+		goto err;
+	}
+
+	char *device = cryptfs_get_device_path_new(name);
+	unlink(device);
+	if (mknod(device, S_IFBLK | 0600, io->dev) < 0) {
+		ERROR_ERRNO("Cannot mknod device %s", device);
+		mem_free(device);
+		goto err;
+	}
+	return device;
+
+err:
+	dmthin_ioctl_init(io, sizeof(buffer), name, 0);
+	io->event_nr = DM_UDEV_DISABLE_ALL;
+	dm_ioctl(fd, DM_DEV_REMOVE, io);
+	return NULL;
+}
+
+/*
+ * Sends a message to the pool target, which is how thin devices are managed.
+ */
+static int
+dmthin_pool_message(const char *pool, const char *fmt, ...)
+{
+	char buffer[DMTHIN_BUF_SIZE];
+	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+	struct dm_target_msg *msg = (struct dm_target_msg *)&buffer[sizeof(struct dm_ioctl)];
+	size_t msg_size = sizeof(buffer) - sizeof(struct dm_ioctl) - sizeof(struct dm_target_msg);
+
+	int fd = dmthin_control_open();
+	IF_TRUE_RETVAL(fd < 0, -1);
+
+	dmthin_ioctl_init(io, sizeof(buffer), pool, 0);
+	msg->sector = 0;
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(msg->message, msg_size, fmt, ap);
+	va_end(ap);
+
+	int ret = dm_ioctl(fd, DM_TARGET_MSG, io);
+	if (ret < 0) {
+		int err = errno;
+		DEBUG_ERRNO("Message '%s' to thin pool %s failed", msg->message, pool);
+		errno = err;
+	}
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+int
+dmthin_pool_activate(const char *pool, const char *meta_dev, const char *data_dev)
+{
+	char buffer[DMTHIN_BUF_SIZE];
+	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+	int ret = -1;
+
+	IF_NULL_RETVAL(pool, -1);
+	IF_NULL_RETVAL(meta_dev, -1);
+	IF_NULL_RETVAL(data_dev, -1);
+
+	int fd = dmthin_control_open();
+	IF_TRUE_RETVAL(fd < 0, -1);
+
+	char *device = cryptfs_get_device_path_new(pool);
+
+	// the pool survives restarts of cmld, only its device node may be missing
+	dmthin_ioctl_init(io, sizeof(buffer), pool, 0);
+	if (!dm_ioctl(fd, DM_DEV_STATUS, io)) {
+		DEBUG("Thin pool %s is already active", pool);
+		unlink(device);
+		if (mknod(device, S_IFBLK | 0600, io->dev) < 0)
+			ERROR_ERRNO("Cannot mknod device %s", device);
+		else
+			ret = 0;
+		goto out;
+	}
+
+	int data_fd = open(data_dev, O_RDONLY | O_CLOEXEC);
+	uint64_t data_size = 0;
+	if (data_fd < 0 || ioctl(data_fd, BLKGETSIZE64, &data_size) < 0) {
+		ERROR_ERRNO("Cannot get size of thin pool data device %s", data_dev);
+		if (data_fd >= 0)
+			close(data_fd);
+		goto out;
+	}
+	close(data_fd);
+
+	uint64_t sectors = data_size / 512;
+	sectors -= sectors % DMTHIN_BLOCK_SECTORS;
+	IF_TRUE_GOTO_ERROR(sectors == 0, out);
+
+	// fail writes when the pool is full instead of queueing them
+	char *params = mem_printf("%s %s %d 0 1 error_if_no_space", meta_dev, data_dev,
+				  DMTHIN_BLOCK_SECTORS);
+	char *pool_dev = dmthin_dev_create_new(fd, pool, "thin-pool", sectors, params);
+	mem_free(params);
+	if (pool_dev) {
+		INFO("Activated thin pool %s on %s (metadata on %s)", pool, data_dev, meta_dev);
+		mem_free(pool_dev);
+		ret = 0;
+	}
+out:
+	mem_free(device);
+	close(fd);
+	return ret;
+}
+
+int
+dmthin_pool_get_usage(const char *pool, dmthin_usage_t *usage)
+{
+	char buffer[DMTHIN_BUF_SIZE];
+	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+
+	IF_NULL_RETVAL(pool, -1);
+	IF_NULL_RETVAL(usage, -1);
+
+	int fd = dmthin_control_open();
+	IF_TRUE_RETVAL(fd < 0, -1);
+
+	dmthin_ioctl_init(io, sizeof(buffer), pool, 0);
+	int ret = dm_ioctl(fd, DM_TABLE_STATUS, io);
+	close(fd);
+	if (ret < 0 || io->target_count != 1 || (io->flags & DM_BUFFER_FULL_FLAG)) {
+		ERROR_ERRNO("Cannot get status of thin pool %s", pool);
+		return -1;
+	}
+
+	// <transaction id> <used meta>/<total meta> <used data>/<total data> ...
+	struct dm_target_spec *tgt = (struct dm_target_spec *)&buffer[io->data_start];
+	const char *status = (const char *)(tgt + 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+	if (sscanf(status, "%*u %" SCNu64 "/%" SCNu64 " %" SCNu64 "/%" SCNu64, &usage->meta_used,
+		   &usage->meta_total, &usage->data_used, &usage->data_total) != 4) {
+		ERROR("Cannot parse status '%s' of thin pool %s", status, pool);
+		return -1;
+	}
+	usage->block_size = DMTHIN_BLOCK_SECTORS * 512;
+	return 0;
+}
+
+int
+dmthin_create(const char *pool, uint32_t id)
+{
+	IF_NULL_RETVAL(pool, -1);
+	IF_TRUE_RETVAL(id > DMTHIN_ID_MAX, -1);
+
+	return dmthin_pool_message(pool, "create_thin %" PRIu32, id);
+}
+
+int
+dmthin_snapshot(const char *pool, uint32_t origin_id, uint32_t id)
+{
+	IF_NULL_RETVAL(pool, -1);
+	IF_TRUE_RETVAL(id > DMTHIN_ID_MAX || origin_id > DMTHIN_ID_MAX, -1);
+
+	return dmthin_pool_message(pool, "create_snap %" PRIu32 " %" PRIu32, id, origin_id);
+}
+
+int
+dmthin_delete(const char *pool, uint32_t id)
+{
+	IF_NULL_RETVAL(pool, -1);
+	IF_TRUE_RETVAL(id > DMTHIN_ID_MAX, -1);
+
+	return dmthin_pool_message(pool, "delete %" PRIu32, id);
+}
+
+char *
+dmthin_activate_new(const char *pool, const char *name, uint32_t id, uint64_t size)
+{
+	IF_NULL_RETVAL(pool, NULL);
+	IF_NULL_RETVAL(name, NULL);
+
+	int fd = dmthin_control_open();
+	IF_TRUE_RETVAL(fd < 0, NULL);
+
+	char *pool_dev = cryptfs_get_device_path_new(pool);
+	char *params = mem_printf("%s %" PRIu32, pool_dev, id);
+	char *dev = dmthin_dev_create_new(fd, name, "thin", size / 512, params);
+	mem_free(params);
+	mem_free(pool_dev);
+	close(fd);
+	return dev;
+}
+
+int
+dmthin_deactivate(const char *name)
+{
+	char buffer[DMTHIN_BUF_SIZE];
+	struct dm_ioctl *io = (struct dm_ioctl *)buffer;
+
+	IF_NULL_RETVAL(name, -1);
+
+	int fd = dmthin_control_open();
+	IF_TRUE_RETVAL(fd < 0, -1);
+
+	dmthin_ioctl_init(io, sizeof(buffer), name, 0);
+	io->event_nr = DM_UDEV_DISABLE_ALL;
+	int ret = dm_ioctl(fd, DM_DEV_REMOVE, io);
+	int err = errno;
+	close(fd);
+	if (ret < 0) {
+		if (err != ENXIO)
+			ERROR_ERRNO("Cannot remove thin device %s", name);
+		errno = err;
+		return -1;
+	}
+
+	char *device = cryptfs_get_device_path_new(name);
+	unlink(device);
+	mem_free(device);
+	return 0;
+}
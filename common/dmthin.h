@@ -0,0 +1,104 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+/**
+ * @file dmthin.h
+ *
+ * Thin provisioning of block devices with the device-mapper thin-pool target.
+ * A pool keeps the data of all its thin devices on one data device and their
+ * block mappings on a metadata device. Thin devices are identified by a 24 bit
+ * id in the pool, allocate their blocks on first write and can be snapshotted
+ * instantly, snapshots share all blocks with their origin until they are written.
+ */
+
+#ifndef DMTHIN_H
+#define DMTHIN_H
+
+#include <stdint.h>
+
+/* thin device ids are 24 bit values */
+#define DMTHIN_ID_MAX 0xffffff
+
+typedef struct dmthin_usage {
+	uint64_t data_used;	///< used data blocks
+	uint64_t data_total;	///< total data blocks
+	uint64_t meta_used;	///< used metadata blocks
+	uint64_t meta_total;	///< total metadata blocks
+	uint64_t block_size;	///< size of a data block in bytes
+} dmthin_usage_t;
+
+/**
+ * Activates the pool on the given metadata and data devices, unless it is
+ * already active. A metadata device whose superblock is zeroed is formatted
+ * as an empty pool by the kernel.
+ * @return 0 on success, -1 otherwise
+ */
+int
+dmthin_pool_activate(const char *pool, const char *meta_dev, const char *data_dev);
+
+/**
+ * Retrieves the number of used and total blocks of the pool.
+ * @return 0 on success, -1 otherwise
+ */
+int
+dmthin_pool_get_usage(const char *pool, dmthin_usage_t *usage);
+
+/**
+ * Creates a new empty thin device with the given id in the pool.
+ * @return 0 on success, -1 otherwise (errno is EEXIST if the id is taken)
+ */
+int
+dmthin_create(const char *pool, uint32_t id);
+
+/**
+ * Creates a snapshot of the thin device origin_id as new thin device id. The
+ * origin must not be active.
+ * @return 0 on success, -1 otherwise (errno is EEXIST if the id is taken)
+ */
+int
+dmthin_snapshot(const char *pool, uint32_t origin_id, uint32_t id);
+
+/**
+ * Deletes a thin device and releases its blocks. It must not be active.
+ * @return 0 on success, -1 otherwise
+ */
+int
+dmthin_delete(const char *pool, uint32_t id);
+
+/**
+ * Activates the thin device id of the pool as block device name with the
+ * given size.
+ * @return The path of the device node, which has to be freed by the caller, or NULL.
+ */
+char *
+dmthin_activate_new(const char *pool, const char *name, uint32_t id, uint64_t size);
+
+/**
+ * Deactivates a thin device activated by dmthin_activate_new().
+ * @return 0 on success, -1 otherwise (errno is ENXIO if it was not active)
+ */
+int
+dmthin_deactivate(const char *name);
+
+#endif /* DMTHIN_H */
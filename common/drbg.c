@@ -0,0 +1,332 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "drbg.h"
+
+#include "macro.h"
+#include "file.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DRBG_KEY_LEN 32
+#define DRBG_BLOCK_LEN 64
+#define DRBG_BUF_LEN (8 * DRBG_BLOCK_LEN)
+#define DRBG_SEED_LEN 32
+
+#define DRBG_ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define DRBG_QUARTERROUND(x, a, b, c, d)                                                           \
+	do {                                                                                       \
+		x[a] += x[b];                                                                      \
+		x[d] = DRBG_ROTL32(x[d] ^ x[a], 16);                                               \
+		x[c] += x[d];                                                                      \
+		x[b] = DRBG_ROTL32(x[b] ^ x[c], 12);                                               \
+		x[a] += x[b];                                                                      \
+		x[d] = DRBG_ROTL32(x[d] ^ x[a], 8);                                                \
+		x[c] += x[d];                                                                      \
+		x[b] = DRBG_ROTL32(x[b] ^ x[c], 7);                                                \
+	} while (0)
+
+/*
+ * The state lives on its own page which is wiped in forked children (if the
+ * kernel supports MADV_WIPEONFORK), excluded from core dumps and locked in
+ * memory if possible.
+ */
+struct drbg_state {
+	bool seeded;
+	uint8_t key[DRBG_KEY_LEN];
+	uint8_t buf[DRBG_BUF_LEN]; //!< output not handed out yet is at the end
+	size_t avail;		   //!< number of bytes left in buf
+	size_t generated;	   //!< number of bytes since the last reseed
+	time_t reseeded;	   //!< monotonic time of the last reseed
+	pid_t pid;		   //!< process which seeded the state
+};
+
+struct drbg_source {
+	const char *name;
+	drbg_source_t source;
+	void *data;
+	bool failed; //!< only log the first failure of a row as warning
+};
+
+static pthread_mutex_t drbg_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct drbg_state *drbg_state = NULL;
+static bool drbg_wipeonfork = false;
+static struct drbg_source drbg_sources[DRBG_SOURCES_MAX];
+static size_t drbg_sources_n = 0;
+
+static uint32_t
+drbg_load32_le(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+drbg_store32_le(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+/*
+ * ChaCha20 block function (RFC 8439) with a zero nonce, which is fine as the
+ * key is never used for more than one buffer.
+ */
+static void
+drbg_chacha20_block(const uint8_t *key, uint32_t counter, uint8_t *out)
+{
+	uint32_t in[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+	uint32_t x[16];
+
+	for (int i = 0; i < 8; i++)
+		in[4 + i] = drbg_load32_le(key + 4 * i);
+	in[12] = counter;
+	memcpy(x, in, sizeof(x));
+
+	for (int i = 0; i < 10; i++) {
+		DRBG_QUARTERROUND(x, 0, 4, 8, 12);
+		DRBG_QUARTERROUND(x, 1, 5, 9, 13);
+		DRBG_QUARTERROUND(x, 2, 6, 10, 14);
+		DRBG_QUARTERROUND(x, 3, 7, 11, 15);
+		DRBG_QUARTERROUND(x, 0, 5, 10, 15);
+		DRBG_QUARTERROUND(x, 1, 6, 11, 12);
+		DRBG_QUARTERROUND(x, 2, 7, 8, 13);
+		DRBG_QUARTERROUND(x, 3, 4, 9, 14);
+	}
+
+	for (int i = 0; i < 16; i++)
+		drbg_store32_le(out + 4 * i, x[i] + in[i]);
+
+	OPENSSL_cleanse(in, sizeof(in));
+	OPENSSL_cleanse(x, sizeof(x));
+}
+
+/*
+ * Fills the buffer with fresh output and replaces the key with its first
+ * bytes (fast key erasure).
+ */
+static void
+drbg_refill(struct drbg_state *s)
+{
+	for (uint32_t i = 0; i < DRBG_BUF_LEN / DRBG_BLOCK_LEN; i++)
+		drbg_chacha20_block(s->key, i, s->buf + i * DRBG_BLOCK_LEN);
+
+	memcpy(s->key, s->buf, DRBG_KEY_LEN);
+	OPENSSL_cleanse(s->buf, DRBG_KEY_LEN);
+	s->avail = DRBG_BUF_LEN - DRBG_KEY_LEN;
+}
+
+static time_t
+drbg_now(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return ts.tv_sec;
+}
+
+static int
+drbg_getrandom(uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = getrandom(buf + done, len - done, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR_ERRNO("Failed to get random bytes from the kernel");
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+static struct drbg_state *
+drbg_state_get(void)
+{
+	if (drbg_state)
+		return drbg_state;
+
+	void *p = mmap(NULL, sizeof(struct drbg_state), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		ERROR_ERRNO("Failed to map drbg state");
+		return NULL;
+	}
+
+#ifdef MADV_WIPEONFORK
+	drbg_wipeonfork = madvise(p, sizeof(struct drbg_state), MADV_WIPEONFORK) == 0;
+#endif
+	if (!drbg_wipeonfork)
+		DEBUG("MADV_WIPEONFORK not supported, detecting forks by pid");
+	if (madvise(p, sizeof(struct drbg_state), MADV_DONTDUMP) < 0)
+		DEBUG_ERRNO("Failed to exclude drbg state from core dumps");
+	if (mlock(p, sizeof(struct drbg_state)) < 0)
+		DEBUG_ERRNO("Failed to lock drbg state in memory");
+
+	drbg_state = p;
+	return drbg_state;
+}
+
+static int
+drbg_reseed_locked(struct drbg_state *s)
+{
+	uint8_t seed[DRBG_SEED_LEN];
+	unsigned int key_len = DRBG_KEY_LEN;
+	int ret = -1;
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	IF_NULL_RETVAL_ERROR(ctx, -1);
+
+	// the old key keeps what previous seeds contributed
+	IF_TRUE_GOTO_ERROR(!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL), out);
+	IF_TRUE_GOTO_ERROR(!EVP_DigestUpdate(ctx, s->key, DRBG_KEY_LEN), out);
+
+	IF_TRUE_GOTO(drbg_getrandom(seed, DRBG_SEED_LEN) < 0, out);
+	IF_TRUE_GOTO_ERROR(!EVP_DigestUpdate(ctx, seed, DRBG_SEED_LEN), out);
+
+	for (size_t i = 0; i < drbg_sources_n; i++) {
+		struct drbg_source *src = &drbg_sources[i];
+		if (src->source(seed, DRBG_SEED_LEN, src->data) < 0) {
+			if (!src->failed)
+				WARN("Seed source %s not available, skipping it", src->name);
+			src->failed = true;
+			continue;
+		}
+		if (src->failed)
+			INFO("Seed source %s available again", src->name);
+		src->failed = false;
+		IF_TRUE_GOTO_ERROR(!EVP_DigestUpdate(ctx, seed, DRBG_SEED_LEN), out);
+	}
+
+	IF_TRUE_GOTO_ERROR(!EVP_DigestFinal_ex(ctx, s->key, &key_len), out);
+
+	// drop output of the old key
+	OPENSSL_cleanse(s->buf, DRBG_BUF_LEN);
+	s->avail = 0;
+	s->generated = 0;
+	s->reseeded = drbg_now();
+	s->pid = getpid();
+	s->seeded = true;
+	TRACE("Reseeded drbg from the kernel and %zu sources", drbg_sources_n);
+	ret = 0;
+out:
+	OPENSSL_cleanse(seed, DRBG_SEED_LEN);
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+static bool
+drbg_needs_reseed(const struct drbg_state *s)
+{
+	if (!s->seeded)
+		return true;
+	// without MADV_WIPEONFORK, a child still has a seeded copy of the state
+	if (!drbg_wipeonfork && s->pid != getpid())
+		return true;
+	if (s->generated >= DRBG_RESEED_BYTES)
+		return true;
+	return drbg_now() - s->reseeded >= DRBG_RESEED_INTERVAL;
+}
+
+int
+drbg_add_source(const char *name, drbg_source_t source, void *data)
+{
+	ASSERT(name);
+	ASSERT(source);
+
+	int ret = -1;
+	pthread_mutex_lock(&drbg_lock);
+	if (drbg_sources_n >= DRBG_SOURCES_MAX) {
+		ERROR("Too many seed sources, cannot add %s", name);
+		goto out;
+	}
+	drbg_sources[drbg_sources_n++] =
+		(struct drbg_source){ .name = name, .source = source, .data = data };
+	DEBUG("Added seed source %s", name);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&drbg_lock);
+	return ret;
+}
+
+int
+drbg_source_file(uint8_t *buf, size_t len, void *data)
+{
+	const char *path = data;
+	int ret = file_read(path, (char *)buf, len);
+	return (ret > 0 && (size_t)ret == len) ? 0 : -1;
+}
+
+int
+drbg_reseed(void)
+{
+	int ret = -1;
+	pthread_mutex_lock(&drbg_lock);
+	struct drbg_state *s = drbg_state_get();
+	if (s)
+		ret = drbg_reseed_locked(s);
+	pthread_mutex_unlock(&drbg_lock);
+	return ret;
+}
+
+int
+drbg_bytes(void *buf, size_t len)
+{
+	uint8_t *out = buf;
+	int ret = -1;
+
+	pthread_mutex_lock(&drbg_lock);
+	struct drbg_state *s = drbg_state_get();
+	IF_NULL_GOTO(s, unlock);
+	if (drbg_needs_reseed(s))
+		IF_TRUE_GOTO(drbg_reseed_locked(s) < 0, unlock);
+
+	while (len > 0) {
+		if (s->avail == 0)
+			drbg_refill(s);
+		size_t n = MIN(len, s->avail);
+		uint8_t *p = s->buf + DRBG_BUF_LEN - s->avail;
+		memcpy(out, p, n);
+		OPENSSL_cleanse(p, n);
+		s->avail -= n;
+		s->generated += n;
+		out += n;
+		len -= n;
+	}
+	ret = 0;
+unlock:
+	pthread_mutex_unlock(&drbg_lock);
+	return ret;
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file drbg.h
+ *
+ * Deterministic random bit generator serving random bytes, e.g. pairing
+ * secrets, nonces and keys, from userspace memory instead of reading a random
+ * device or asking the TPM on every request.
+ *
+ * The generator is ChaCha20 with fast key erasure: each block of output is
+ * produced under a fresh key which is taken from the previous block, and
+ * handed out bytes are wiped from the buffer, thus earlier output cannot be
+ * reconstructed from the state. The key is derived as SHA256 over the old key,
+ * getrandom() and all registered seed sources (e.g. a hardware RNG or the
+ * TPM). It is reseeded after DRBG_RESEED_BYTES of output, after
+ * DRBG_RESEED_INTERVAL seconds and in forked children, which never share the
+ * output of their parent.
+ *
+ * All functions are thread-safe.
+ */
+
+#ifndef DRBG_H
+#define DRBG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DRBG_RESEED_BYTES (1 << 20)
+#define DRBG_RESEED_INTERVAL 300
+#define DRBG_SOURCES_MAX 4
+
+/**
+ * Seed source which fills buf with len bytes of entropy.
+ * @return 0 on success, -1 if the source is (currently) not available
+ */
+typedef int (*drbg_source_t)(uint8_t *buf, size_t len, void *data);
+
+/**
+ * Registers an additional seed source which is mixed in at each (re)seed
+ * along with getrandom(). A failing source is skipped. Call drbg_reseed() to
+ * mix in a new source at once.
+ *
+ * @param name Name of the source for logging, has to stay valid.
+ * @return 0 on success, -1 if DRBG_SOURCES_MAX sources are registered
+ */
+int
+drbg_add_source(const char *name, drbg_source_t source, void *data);
+
+/**
+ * Seed source reading from the device or file whose path is given as data,
+ * e.g. "/dev/hw_random".
+ */
+int
+drbg_source_file(uint8_t *buf, size_t len, void *data);
+
+/**
+ * Reseeds the generator from getrandom() and all registered sources.
+ * @return 0 on success, -1 otherwise
+ */
+int
+drbg_reseed(void);
+
+/**
+ * Fills buf with len random bytes, seeding the generator on first use.
+ * @return 0 on success, -1 if the generator could not be seeded
+ */
+int
+drbg_bytes(void *buf, size_t len);
+
+#endif /* DRBG_H */
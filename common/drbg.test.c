@@ -0,0 +1,168 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "drbg.h"
+#include "logf.h"
+#include "macro.h"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int drbg_test_source_calls = 0;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	// No clean-up needed for now
+}
+
+static int
+drbg_test_source(uint8_t *buf, size_t len, UNUSED void *data)
+{
+	memset(buf, 0x42, len);
+	drbg_test_source_calls++;
+	return 0;
+}
+
+static MunitResult
+test_drbg_bytes(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t zero[32] = { 0 };
+	uint8_t a[32], b[32];
+	uint8_t large[4096];
+
+	munit_assert_int(drbg_bytes(a, sizeof(a)), ==, 0);
+	munit_assert_int(drbg_bytes(b, sizeof(b)), ==, 0);
+	munit_assert_memory_not_equal(sizeof(a), a, zero);
+	munit_assert_memory_not_equal(sizeof(a), a, b);
+
+	// spans several refills of the internal buffer
+	munit_assert_int(drbg_bytes(large, sizeof(large)), ==, 0);
+	for (size_t i = 32; i < sizeof(large); i += 32)
+		munit_assert_memory_not_equal(32, large, large + i);
+
+	munit_assert_int(drbg_bytes(a, 0), ==, 0);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_drbg_source(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t a[16];
+
+	munit_assert_int(drbg_add_source("test", drbg_test_source, NULL), ==, 0);
+	munit_assert_int(drbg_test_source_calls, ==, 0);
+	munit_assert_int(drbg_reseed(), ==, 0);
+	munit_assert_int(drbg_test_source_calls, ==, 1);
+
+	// no reseed until the schedule requires it
+	munit_assert_int(drbg_bytes(a, sizeof(a)), ==, 0);
+	munit_assert_int(drbg_test_source_calls, ==, 1);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_drbg_fork(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t parent[32], child[32];
+	int fds[2];
+
+	// make sure the parent is seeded before forking
+	munit_assert_int(drbg_bytes(parent, sizeof(parent)), ==, 0);
+	munit_assert_int(pipe(fds), ==, 0);
+
+	pid_t pid = fork();
+	munit_assert_int(pid, >=, 0);
+	if (pid == 0) {
+		close(fds[0]);
+		if (drbg_bytes(child, sizeof(child)) < 0 ||
+		    write(fds[1], child, sizeof(child)) != sizeof(child))
+			_exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+
+	munit_assert_int(drbg_bytes(parent, sizeof(parent)), ==, 0);
+	munit_assert_int(read(fds[0], child, sizeof(child)), ==, sizeof(child));
+	close(fds[0]);
+
+	int status;
+	munit_assert_int(waitpid(pid, &status, 0), ==, pid);
+	munit_assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	// the child must not repeat the output of its parent
+	munit_assert_memory_not_equal(sizeof(parent), parent, child);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"drbg_bytes",		/* name */
+		test_drbg_bytes,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"drbg_source",		/* name */
+		test_drbg_source,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"drbg_fork",		/* name */
+		test_drbg_fork,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite drbg_suite = {
+	"test_drbg: ",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
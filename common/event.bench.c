@@ -0,0 +1,159 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "munit.h"
+#include "bench.h"
+
+#include "event.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static char *n_values[] = { "100", "10000", NULL };
+
+static MunitParameterEnum n_params[] = {
+	{ "n", n_values },
+	{ NULL, NULL },
+};
+
+static int expired;
+static int io_remaining;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	expired = 0;
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	event_reset();
+}
+
+static void
+expire_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	expired++;
+}
+
+static MunitResult
+bench_timer_add_expire(const MunitParameter params[], UNUSED void *data)
+{
+	int n = atoi(munit_parameters_get(params, "n"));
+	event_timer_t **timers = mem_new0(event_timer_t *, n);
+
+	// timers without timeout, so that no time is spent waiting
+	for (int i = 0; i < n; i++)
+		timers[i] = event_timer_new(0, 1, &expire_cb, NULL);
+
+	// time adding n pending timers and expiring all of them
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < n; i++)
+		event_add_timer(timers[i]);
+	event_loop();
+	uint64_t elapsed = bench_now_ns() - start;
+
+	munit_assert_int(expired, ==, n);
+
+	for (int i = 0; i < n; i++)
+		event_timer_free(timers[i]);
+	mem_free(timers);
+
+	return bench_report("/event/timer add expire", params, n, elapsed);
+}
+
+static void
+io_ping_cb(int fd, UNUSED unsigned events, event_io_t *io, void *data)
+{
+	int wfd = (int)(intptr_t)data;
+	char c;
+
+	munit_assert_int(read(fd, &c, 1), ==, 1);
+	if (--io_remaining == 0) {
+		event_remove_io(io);
+		return;
+	}
+	munit_assert_int(write(wfd, &c, 1), ==, 1);
+}
+
+static MunitResult
+bench_io_dispatch(const MunitParameter params[], UNUSED void *data)
+{
+	int n = atoi(munit_parameters_get(params, "n"));
+	int pipefd[2];
+	munit_assert_int(pipe(pipefd), ==, 0);
+
+	// every dispatch reads one byte and triggers the next one
+	event_io_t *io = event_io_new(pipefd[0], EVENT_IO_READ, &io_ping_cb,
+				      (void *)(intptr_t)pipefd[1]);
+	event_add_io(io);
+	io_remaining = n;
+
+	uint64_t start = bench_now_ns();
+	munit_assert_int(write(pipefd[1], "x", 1), ==, 1);
+	event_loop();
+	uint64_t elapsed = bench_now_ns() - start;
+
+	munit_assert_int(io_remaining, ==, 0);
+
+	event_io_free(io);
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	return bench_report("/event/io dispatch", params, n, elapsed);
+}
+
+static MunitTest tests[] = {
+	{
+		"/timer add expire",	/* name */
+		bench_timer_add_expire, /* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		n_params		/* parameters */
+	},
+	{
+		"/io dispatch",		/* name */
+		bench_io_dispatch,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		n_params		/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite event_bench_suite = {
+	"/event",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
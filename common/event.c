@@ -21,24 +21,40 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define _GNU_SOURCE
+
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
 #include "event.h"
 
 #include "mem.h"
-#include "list.h"
+#include "ilist.h"
+#include "hashmap.h"
 #include "macro.h"
+#include "probe.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <time.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <dlfcn.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 #define timespec_cmp(a, b, CMP)                                                                    \
 	(((a)->tv_sec == (b)->tv_sec) ? ((a)->tv_nsec CMP(b)->tv_nsec) :                           \
 					((a)->tv_sec CMP(b)->tv_sec))
@@ -69,7 +85,8 @@
 		(result)->tv_nsec = (a)->tv_nsec;                                                  \
 	} while (0)
 
-#define timespec_now(result) ASSERT(clock_gettime(CLOCK_MONOTONIC_RAW, result) >= 0)
+// CLOCK_MONOTONIC (not _RAW) so that deadlines can be armed on a timerfd as well
+#define timespec_now(result) ASSERT(clock_gettime(CLOCK_MONOTONIC, result) >= 0)
 
 #define timespec_debug(msg, a)                                                                     \
 	DEBUG(msg ": (%s)->tv_sec=%u, (%s)->tv_nsec=%09u", #a, (unsigned)(a)->tv_sec, #a,          \
@@ -81,8 +98,13 @@ struct event_timer {
 	void *data;		  /**< a data pointer to pass to the callback function */
 	struct timespec diff;	  /**< interval, relative value */
 	struct timespec next;	  /**< next timeout, absolute value */
+	struct timespec slack;	  /**< how much later than next the timer may expire */
 	int repeat;		  /**< how often to repeat, -1 means repeat indefinitely */
 	int repeated;		  /**< how often the timer already expired */
+	size_t heap_index;	  /**< position in the timer heap, EVENT_TIMER_NOT_QUEUED if not added */
+	event_prio_t prio;	  /**< priority class, selects the timer heap */
+	uint64_t seq;		  /**< insertion order, keeps timers with equal deadlines in FIFO order */
+	event_base_t *base;	  /**< the event base the timer was added to */
 };
 
 struct event_io {
@@ -91,6 +113,11 @@ struct event_io {
 	void *data;		  /**< a data pointer to pass to the callback function */
 	int fd;			  /**< the file descriptor which should be watched */
 	unsigned events;	  /**< mask of events to listen for */
+	bool internal;		  /**< internal helper io which does not keep event_loop() alive */
+	event_prio_t prio;	  /**< priority class */
+	unsigned deferred_events; /**< events of an edge-triggered io over budget, 0 if none */
+	ilist_node_t deferred_node; /**< links the io into io_deferred of base */
+	event_base_t *base;	  /**< the event base the io was added to */
 };
 
 struct event_inotify {
@@ -101,6 +128,8 @@ struct event_inotify {
 	uint32_t mask;		  /**< a bit-mask of events to be watched for */
 	int wd;			  /**< the watch descriptor */
 	bool todo;		  /**< helper variable for event_inotify_handler() */
+	event_base_t *base;	  /**< the event base the inotify watch was added to */
+	ilist_node_t node;	  /**< links the watch into its bucket of base */
 };
 
 struct event_signal {
@@ -108,53 +137,509 @@ struct event_signal {
 		     void *data); /**< the function to call when the event is triggered */
 	void *data;		  /**< a data pointer to pass to the callback function */
 	int signum;		  /**< the signal number of interes */
-	bool todo;		  /**< helper variable for event_signal_handler() */
+	bool todo;		  /**< helper variable for event_signal_dispatch() */
+	bool added;		  /**< whether the signal event is in its bucket */
+	event_prio_t prio;	  /**< priority class */
+	ilist_node_t node;	  /**< links the signal event into event_signal_buckets[signum] */
+};
+
+struct event_task {
+	int (*func)(event_task_t *task,
+		    void *data); /**< the step function, called until it returns EVENT_TASK_DONE */
+	void *data;		 /**< the state of the task passed to the step function */
+	uint64_t slice_ns;	 /**< time budget of a slice */
+	ilist_node_t node;	 /**< links the task into task_list of base */
+	event_base_t *base;	 /**< the event base the task was added to */
+};
+
+#define EVENT_STATS_SLOTS 256
+
+/*
+ * Optional instrumentation, see event_stats_enable(). Callbacks are identified
+ * by their function pointer and type in a fixed size open addressing table.
+ */
+typedef struct event_base_stats {
+	event_stats_t slots[EVENT_STATS_SLOTS];
+	size_t used;
+	event_loop_stats_t loop;
+} event_base_stats_t;
+
+typedef struct event_post {
+	void (*func)(void *data);
+	void *data;
+	ilist_node_t node;
+} event_post_t;
+
+#define EVENT_EPOLL_EVENTS_MIN 64
+#define EVENT_EPOLL_EVENTS_MAX 4096
+
+typedef struct event_timer_heap {
+	event_timer_t **timers; /**< min-heap ordered by deadline */
+	size_t len;		/**< number of timers in timers */
+	size_t size;		/**< allocated slots of timers */
+} event_timer_heap_t;
+
+/*
+ * All per-loop state lives in an event base. Each base must only be
+ * manipulated by the thread running its loop; other threads hand over work
+ * with event_base_post().
+ *
+ * Active timers are kept in a binary min-heap per priority class ordered by
+ * their next deadline, so the next timeout can be read at the heap roots and
+ * expired timers are popped one by one instead of rescanning a list after
+ * each callback.
+ *
+ * Each iteration dispatches the ready ios, expired timers and (in the main
+ * loop) received signals of one priority class after the other. Low priority
+ * callbacks are limited to EVENT_PRIO_LOW_BUDGET per iteration; ready
+ * edge-triggered ios over budget are kept in io_deferred, since epoll would
+ * not report them again. As long as low priority work is left, the next
+ * epoll_wait does not block.
+ *
+ * Cooperative tasks come last: each iteration runs a slice of the task at the
+ * head of task_list, which is moved to the tail afterwards if it is not done.
+ *
+ * Optional timerfd backend: a single timerfd is armed for the deadline at the
+ * heap root and its expiry arrives as an ordinary io event. Thus, epoll_wait
+ * does not need a (rounded up) millisecond timeout any more.
+ *
+ * The result array for epoll_wait starts small and is doubled each time a
+ * wakeup fills it completely, so bursts of ready fds are picked up in one
+ * call instead of several rounds through the loop.
+ */
+struct event_base {
+	int epoll_fd;		      /**< the epoll instance of this loop */
+	unsigned io_active;	      /**< number of non-internal ios added to epoll_fd */
+	struct epoll_event *epoll_events; /**< result array for epoll_wait */
+	size_t epoll_events_size;     /**< allocated slots of epoll_events */
+	size_t epoll_ready;	      /**< results of the last epoll_wait not dispatched yet */
+	ilist_t io_deferred;	      /**< ready edge-triggered low priority ios over budget */
+	unsigned low_budget;	      /**< low priority callbacks left in this iteration */
+	bool backlog;		      /**< low priority work was left over budget */
+	event_timer_heap_t timer_heaps[EVENT_PRIO_COUNT]; /**< active timers per priority */
+	size_t timer_count;	      /**< number of timers in all timer_heaps */
+	ilist_t task_list;	      /**< added cooperative tasks in round-robin order */
+	event_task_t *task_running;   /**< the task of the current slice, NULL if removed */
+	uint64_t timer_seq;	      /**< sequence counter for event_timer_t.seq */
+	bool timer_handling;	      /**< set while expired timers are processed */
+	bool timerfd_enabled;	      /**< use the timerfd backend */
+	int timerfd;		      /**< the timerfd, -1 if not created yet */
+	event_io_t *timerfd_io;	      /**< internal io for timerfd */
+	struct timespec timerfd_armed; /**< deadline timerfd is currently armed for */
+	ilist_t *inotify_buckets;     /**< hash table of inotify watches, keyed by wd */
+	size_t inotify_nbuckets;      /**< number of buckets, a power of two */
+	size_t inotify_count;	      /**< number of added inotify watches */
+	int inotify_fd;		      /**< the inotify instance, -1 if not created yet */
+	event_io_t *inotify_io;	      /**< io for inotify_fd */
+	int wakeup_fd;		      /**< eventfd to wake up the loop from other threads */
+	event_io_t *wakeup_io;	      /**< internal io for wakeup_fd */
+	pthread_mutex_t post_lock;    /**< protects post_list */
+	ilist_t post_list;	      /**< work posted by other threads */
+	event_base_stats_t *stats;    /**< callback statistics, NULL if disabled */
+	bool stop;		      /**< set by event_base_break() */
+	bool persistent;	      /**< loop keeps running without any events (worker loops) */
+	pthread_t thread;	      /**< the worker thread, see event_base_start_thread() */
+	bool thread_running;	      /**< whether thread is valid */
 };
 
-static list_t *event_timer_list = NULL;
-static list_t *event_signal_list = NULL;
-static list_t *event_inotify_list = NULL;
-static bool event_signal_received0[NSIG] = { false };
-static bool event_signal_received1[NSIG] = { false };
-static bool *event_signal_received = event_signal_received0;
-static unsigned event_io_active = 0;
+#define EVENT_BASE_INITIALIZER                                                                     \
+	{                                                                                          \
+		.epoll_fd = -1, .io_active = 0, .epoll_events = NULL, .epoll_events_size = 0,      \
+		.epoll_ready = 0, .io_deferred = ILIST_INITIALIZER, .low_budget = 0,               \
+		.backlog = false, .timer_heaps = { { NULL, 0, 0 } }, .timer_count = 0,             \
+		.task_list = ILIST_INITIALIZER, .task_running = NULL, .timer_seq = 0,              \
+		.timer_handling = false, .timerfd_enabled = false, .timerfd = -1,                  \
+		.timerfd_io = NULL, .timerfd_armed = { 0, 0 }, .inotify_buckets = NULL,            \
+		.inotify_nbuckets = 0, .inotify_count = 0, .inotify_fd = -1, .inotify_io = NULL,    \
+		.wakeup_fd = -1, .wakeup_io = NULL, .post_lock = PTHREAD_MUTEX_INITIALIZER,        \
+		.post_list = ILIST_INITIALIZER, .stats = NULL, .stop = false,                      \
+		.persistent = false, .thread_running = false                                       \
+	}
+
+// the main loop which is run by event_loop() and handles signals
+static event_base_t event_base_main = EVENT_BASE_INITIALIZER;
+// the loop run by the calling thread, NULL for the main loop
+static __thread event_base_t *event_base_self = NULL;
+
+// signal events by signal number
+static ilist_t event_signal_buckets[NSIG];
+static size_t event_signal_count = 0;
+// set by event_signalfd_cb() or, for signals which are not blocked, by event_sa_handler()
+static volatile sig_atomic_t event_signal_received[NSIG];
+static volatile sig_atomic_t event_signal_pending = 0;
+// received signals were latched into the todo flags of their signal events
+static bool event_signal_latched = false;
+// the signals handled by event_init(), blocked and read from event_signalfd if available
+static sigset_t event_signal_mask;
+static int event_signalfd = -1;
+static event_io_t *event_signalfd_io = NULL;
 static bool event_initialized = false;
 
+struct event_child {
+	void (*func)(pid_t pid, int status, event_child_t *child,
+		     void *data); /**< the callback function */
+	void *data;		  /**< payload for the callback function */
+	pid_t pid;		  /**< the child process of interest */
+	int pidfd;		  /**< readable once the child terminated, -1 if unsupported */
+	event_io_t *io;		  /**< watches pidfd */
+	bool added;		  /**< whether the child event is in event_child_map */
+};
+
+// all added child events by pid
+static hashmap_t *event_child_map = NULL;
+// reaps the children without pidfd, registered as long as there are any
+static event_signal_t *event_child_sig = NULL;
+static size_t event_child_sig_count = 0;
+
+event_base_t *
+event_base_current(void)
+{
+	return event_base_self ? event_base_self : &event_base_main;
+}
+
 /******************************************************************************/
 
-static int
-event_timeout(void)
+static uint64_t
+event_stats_now_ns(void)
 {
-	struct timespec next, now, diff;
-	event_timer_t *timer;
-	list_t *l;
+	struct timespec now;
+	timespec_now(&now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
 
-	if (!event_timer_list)
-		return -1;
+static uint64_t
+event_stats_begin(const event_base_t *base)
+{
+	return base->stats ? event_stats_now_ns() : 0;
+}
+
+static void
+event_stats_end(event_base_t *base, event_stats_type_t type, void *func, uint64_t begin)
+{
+	event_base_stats_t *stats = base->stats;
+
+	// stats might have been enabled by the callback itself
+	if (!stats || !begin)
+		return;
+
+	uint64_t ns = event_stats_now_ns() - begin;
+	size_t h = ((uintptr_t)func >> 4) % EVENT_STATS_SLOTS;
+	event_stats_t *slot = NULL;
+
+	for (size_t i = 0; i < EVENT_STATS_SLOTS; i++) {
+		event_stats_t *cur = &stats->slots[(h + i) % EVENT_STATS_SLOTS];
+		if (cur->func == func && cur->type == type) {
+			slot = cur;
+			break;
+		}
+		if (!cur->func) {
+			cur->func = func;
+			cur->type = type;
+			stats->used++;
+			slot = cur;
+			break;
+		}
+	}
+	if (!slot) {
+		TRACE("Event stats table full, dropping sample of %p", func);
+		return;
+	}
+
+	// decades starting at 10us, the last bucket collects everything above 1s
+	size_t bucket = 0;
+	for (uint64_t limit = 10000; bucket < EVENT_STATS_HIST_BUCKETS - 1 && ns >= limit;
+	     limit *= 10)
+		bucket++;
+
+	slot->calls++;
+	slot->total_ns += ns;
+	slot->max_ns = MAX(slot->max_ns, ns);
+	slot->hist[bucket]++;
+}
+
+static void
+event_stats_wakeup(event_base_t *base, int n)
+{
+	IF_NULL_RETURN_TRACE(base->stats);
+	IF_TRUE_RETURN_TRACE(n < 0);
+
+	event_loop_stats_t *loop = &base->stats->loop;
+
+	// 0, 1, 2-3, 4-7, ... events per epoll_wait wakeup
+	size_t bucket = 0;
+	for (int i = n; i > 0 && bucket < EVENT_STATS_WAKEUP_BUCKETS - 1; i >>= 1)
+		bucket++;
+
+	loop->wakeups++;
+	loop->events += n;
+	loop->wakeup_hist[bucket]++;
+}
+
+static void
+event_stats_lag(event_base_t *base, const struct timespec *deadline, const struct timespec *now)
+{
+	IF_NULL_RETURN_TRACE(base->stats);
+
+	struct timespec diff;
+	event_loop_stats_t *loop = &base->stats->loop;
+
+	timespec_sub(now, deadline, &diff);
+	uint64_t ns = (uint64_t)diff.tv_sec * 1000000000ULL + (uint64_t)diff.tv_nsec;
+
+	loop->lag_count++;
+	loop->lag_total_ns += ns;
+	loop->lag_max_ns = MAX(loop->lag_max_ns, ns);
+}
+
+void
+event_stats_enable(bool enable)
+{
+	event_base_t *base = event_base_current();
+
+	if (enable && !base->stats) {
+		base->stats = mem_new0(event_base_stats_t, 1);
+	} else if (!enable && base->stats) {
+		mem_free(base->stats);
+	}
+	DEBUG("%s event loop instrumentation", enable ? "Enabled" : "Disabled");
+}
+
+bool
+event_stats_enabled(void)
+{
+	return event_base_current()->stats != NULL;
+}
+
+void
+event_stats_reset(void)
+{
+	event_base_t *base = event_base_current();
+
+	if (base->stats)
+		memset(base->stats, 0, sizeof(event_base_stats_t));
+}
+
+void
+event_stats_foreach(void (*func)(const event_stats_t *stats, void *data), void *data)
+{
+	event_base_stats_t *stats = event_base_current()->stats;
+
+	IF_NULL_RETURN(func);
+	IF_NULL_RETURN_TRACE(stats);
+
+	for (size_t i = 0; i < EVENT_STATS_SLOTS; i++) {
+		if (stats->slots[i].func)
+			func(&stats->slots[i], data);
+	}
+}
+
+int
+event_stats_get_loop(event_loop_stats_t *loop)
+{
+	event_base_stats_t *stats = event_base_current()->stats;
+
+	IF_NULL_RETVAL(loop, -1);
+	IF_NULL_RETVAL_TRACE(stats, -1);
+
+	*loop = stats->loop;
+	return 0;
+}
+
+const char *
+event_stats_type_to_string(event_stats_type_t type)
+{
+	switch (type) {
+	case EVENT_STATS_TYPE_IO:
+		return "io";
+	case EVENT_STATS_TYPE_TIMER:
+		return "timer";
+	case EVENT_STATS_TYPE_SIGNAL:
+		return "signal";
+	case EVENT_STATS_TYPE_INOTIFY:
+		return "inotify";
+	case EVENT_STATS_TYPE_CHILD:
+		return "child";
+	case EVENT_STATS_TYPE_TASK:
+		return "task";
+	}
+	return "unknown";
+}
+
+char *
+event_stats_func_name(const void *func)
+{
+	Dl_info info;
+
+	// static callbacks are not exported, report their offset in the binary instead
+	if (!dladdr(func, &info) || !info.dli_fname)
+		return mem_printf("%p", func);
+	if (info.dli_sname)
+		return mem_strdup(info.dli_sname);
+
+	const char *file = strrchr(info.dli_fname, '/');
+	return mem_printf("%s+0x%" PRIxPTR, file ? file + 1 : info.dli_fname,
+			  (uintptr_t)func - (uintptr_t)info.dli_fbase);
+}
+
+/******************************************************************************/
+
+#define EVENT_TIMER_NOT_QUEUED ((size_t)-1)
+
+static bool
+event_timer_before(const event_timer_t *a, const event_timer_t *b)
+{
+	if (a->next.tv_sec != b->next.tv_sec || a->next.tv_nsec != b->next.tv_nsec)
+		return timespec_cmp(&a->next, &b->next, <);
+	return a->seq < b->seq;
+}
+
+static void
+event_timer_heap_set(event_timer_heap_t *heap, size_t i, event_timer_t *timer)
+{
+	heap->timers[i] = timer;
+	timer->heap_index = i;
+}
+
+static void
+event_timer_heap_sift_up(event_timer_heap_t *heap, size_t i)
+{
+	event_timer_t *timer = heap->timers[i];
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!event_timer_before(timer, heap->timers[parent]))
+			break;
+		event_timer_heap_set(heap, i, heap->timers[parent]);
+		i = parent;
+	}
+	event_timer_heap_set(heap, i, timer);
+}
+
+static void
+event_timer_heap_sift_down(event_timer_heap_t *heap, size_t i)
+{
+	event_timer_t *timer = heap->timers[i];
+
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= heap->len)
+			break;
+		if (child + 1 < heap->len &&
+		    event_timer_before(heap->timers[child + 1], heap->timers[child]))
+			child++;
+		if (!event_timer_before(heap->timers[child], timer))
+			break;
+		event_timer_heap_set(heap, i, heap->timers[child]);
+		i = child;
+	}
+	event_timer_heap_set(heap, i, timer);
+}
+
+static void
+event_timer_heap_push(event_base_t *base, event_timer_t *timer)
+{
+	event_timer_heap_t *heap = &base->timer_heaps[timer->prio];
+
+	if (heap->len == heap->size) {
+		heap->size = heap->size ? 2 * heap->size : 16;
+		heap->timers = mem_renew(event_timer_t *, heap->timers, heap->size);
+	}
+	event_timer_heap_set(heap, heap->len++, timer);
+	event_timer_heap_sift_up(heap, timer->heap_index);
+	timer->base = base;
+	base->timer_count++;
+}
+
+static void
+event_timer_heap_delete(event_base_t *base, event_timer_t *timer)
+{
+	event_timer_heap_t *heap = &base->timer_heaps[timer->prio];
+	size_t i = timer->heap_index;
 
-	l = event_timer_list;
-	timer = l->data;
+	ASSERT(i < heap->len && heap->timers[i] == timer);
 
-	ASSERT(timer);
+	timer->heap_index = EVENT_TIMER_NOT_QUEUED;
+	timer->base = NULL;
+	base->timer_count--;
+	if (--heap->len == i)
+		return;
+
+	// move last element into the gap and restore the heap property
+	event_timer_heap_set(heap, i, heap->timers[heap->len]);
+	if (i > 0 && event_timer_before(heap->timers[i], heap->timers[(i - 1) / 2]))
+		event_timer_heap_sift_up(heap, i);
+	else
+		event_timer_heap_sift_down(heap, i);
+}
 
-	timespec_set(&timer->next, &next);
+static event_timer_t *
+event_timer_heap_peek(const event_timer_heap_t *heap)
+{
+	return heap->len ? heap->timers[0] : NULL;
+}
+
+/*
+ * Lowers wakeup to the latest time at which the timers in the subtree at i
+ * have to expire, i.e. the minimum of their deadlines plus slack. As a deadline
+ * is not before the one of the parent, a subtree whose root deadline is not
+ * before wakeup cannot lower it.
+ */
+static void
+event_timer_heap_wakeup(const event_timer_heap_t *heap, size_t i, struct timespec *wakeup,
+			bool *found)
+{
+	struct timespec latest;
 
-	// find the smallest next time in list
-	for (l = l->next; l; l = l->next) {
-		timer = l->data;
+	if (i >= heap->len)
+		return;
 
-		ASSERT(timer);
+	const event_timer_t *timer = heap->timers[i];
+	if (*found && !timespec_cmp(&timer->next, wakeup, <))
+		return;
 
-		if (timespec_cmp(&next, &timer->next, >))
-			timespec_set(&timer->next, &next);
+	timespec_add(&timer->next, &timer->slack, &latest);
+	if (!*found || timespec_cmp(&latest, wakeup, <)) {
+		timespec_set(&latest, wakeup);
+		*found = true;
 	}
+	event_timer_heap_wakeup(heap, 2 * i + 1, wakeup, found);
+	event_timer_heap_wakeup(heap, 2 * i + 2, wakeup, found);
+}
+
+/*
+ * Determines when the loop has to wake up for the timers of all priority
+ * classes. Timers whose slack windows overlap this time then expire together,
+ * without slack it is the earliest deadline.
+ *
+ * @return false if there are no timers
+ */
+static bool
+event_timer_wakeup(const event_base_t *base, struct timespec *wakeup)
+{
+	bool found = false;
+
+	for (int prio = 0; prio < EVENT_PRIO_COUNT; prio++)
+		event_timer_heap_wakeup(&base->timer_heaps[prio], 0, wakeup, &found);
+	return found;
+}
+
+static void
+event_timerfd_rearm(event_base_t *base);
+
+static int
+event_timeout(event_base_t *base)
+{
+	struct timespec now, wakeup, diff;
+
+	if (!event_timer_wakeup(base, &wakeup))
+		return -1;
 
 	timespec_now(&now);
 
-	if (timespec_cmp(&next, &now, <))
+	if (timespec_cmp(&wakeup, &now, <))
 		return 0;
 
-	timespec_sub(&next, &now, &diff);
+	timespec_sub(&wakeup, &now, &diff);
 
 	// should not happen, because timeout was an int too
 	ASSERT(diff.tv_sec <= (INT_MAX / 1000));
@@ -163,50 +648,63 @@ event_timeout(void)
 	return (diff.tv_sec * 1000) + ((diff.tv_nsec + 999999L) / 1000000L);
 }
 
+/*
+ * Runs the expired timers of one priority class. Low priority timers are
+ * charged to the budget of the iteration, the rest stays expired in the heap.
+ */
 static void
-event_timeout_handler(void)
+event_timeout_handler(event_base_t *base, event_prio_t prio)
 {
+	event_timer_heap_t *heap = &base->timer_heaps[prio];
 	struct timespec now;
+	event_timer_t *timer;
 
-	IF_NULL_RETURN(event_timer_list);
+	if (!heap->len)
+		return;
 
 	timespec_now(&now);
+	base->timer_handling = true;
 
-	for (list_t *l = event_timer_list; l;) {
-		event_timer_t *timer = l->data;
+	// timer->func might add or remove timers, thus always re-read the root
+	while ((timer = event_timer_heap_peek(heap)) && timespec_cmp(&now, &timer->next, >)) {
+		if (prio == EVENT_PRIO_LOW) {
+			if (!base->low_budget) {
+				base->backlog = true;
+				break;
+			}
+			base->low_budget--;
+		}
 
-		ASSERT(timer);
+		// how late the timer expires compared to its deadline
+		if (base->stats)
+			event_stats_lag(base, &timer->next, &now);
 
-		if (timespec_cmp(&now, &timer->next, >)) {
-			if (!timer->repeated) {
-				event_remove_timer(timer);
-			} else {
-				if (timer->repeated > 0)
-					timer->repeated--;
-				if (!timer->repeated)
-					event_remove_timer(timer);
-				else
-					timespec_add(&timer->diff, &timer->next, &timer->next);
-
-				TRACE("Handling timer event %p (func=%p, data=%p, diff=%u.%09us, repeat=%d)",
-				      (void *)timer, CAST_FUNCPTR_VOIDPTR timer->func, timer->data,
-				      (unsigned)timer->diff.tv_sec, (unsigned)timer->diff.tv_nsec,
-				      timer->repeat);
-
-				(timer->func)(timer, timer->data);
-			}
+		if (!timer->repeated) {
+			event_remove_timer(timer);
+			continue;
+		}
 
-			// event_timer_remove modifies the timer list
-			// and timer->func might modify the timer list
-			// so we will start again at its head...
-			if (event_timer_list)
-				l = event_timer_list;
-			else
-				break;
+		if (timer->repeated > 0)
+			timer->repeated--;
+		if (!timer->repeated) {
+			event_remove_timer(timer);
 		} else {
-			l = l->next;
+			timespec_add(&timer->diff, &timer->next, &timer->next);
+			event_timer_heap_sift_down(heap, timer->heap_index);
 		}
+
+		TRACE("Handling timer event %p (func=%p, data=%p, diff=%u.%09us, repeat=%d)",
+		      (void *)timer, CAST_FUNCPTR_VOIDPTR timer->func, timer->data,
+		      (unsigned)timer->diff.tv_sec, (unsigned)timer->diff.tv_nsec, timer->repeat);
+
+		void *func = CAST_FUNCPTR_VOIDPTR timer->func;
+		uint64_t begin = event_stats_begin(base);
+		(timer->func)(timer, timer->data);
+		event_stats_end(base, EVENT_STATS_TYPE_TIMER, func, begin);
 	}
+
+	base->timer_handling = false;
+	event_timerfd_rearm(base);
 }
 
 event_timer_t *
@@ -224,44 +722,105 @@ event_timer_new(int timeout, int repeat, void (*func)(event_timer_t *timer, void
 	timer->diff.tv_nsec = (timeout % 1000) * 1000000L;
 	timer->next.tv_sec = 0;
 	timer->next.tv_nsec = 0;
+	timer->slack.tv_sec = 0;
+	timer->slack.tv_nsec = 0;
 	timer->repeat = repeat;
+	timer->heap_index = EVENT_TIMER_NOT_QUEUED;
+	timer->prio = EVENT_PRIO_NORMAL;
+	timer->seq = 0;
+	timer->base = NULL;
 
 	return timer;
 }
 
+void
+event_timer_set_prio(event_timer_t *timer, event_prio_t prio)
+{
+	IF_NULL_RETURN(timer);
+	IF_FALSE_RETURN(prio < EVENT_PRIO_COUNT);
+
+	event_base_t *base = timer->base;
+	if (!base) {
+		timer->prio = prio;
+		return;
+	}
+
+	// an active timer keeps its deadline in the heap of its new class
+	event_timer_heap_delete(base, timer);
+	timer->prio = prio;
+	event_timer_heap_push(base, timer);
+}
+
+void
+event_timer_set_slack(event_timer_t *timer, int slack)
+{
+	IF_NULL_RETURN(timer);
+	IF_FALSE_RETURN(slack >= 0);
+
+	timer->slack.tv_sec = slack / 1000;
+	timer->slack.tv_nsec = (slack % 1000) * 1000000L;
+
+	// an active timer keeps its deadline, only the wakeup may move
+	if (timer->base)
+		event_timerfd_rearm(timer->base);
+}
+
 void
 event_timer_free(event_timer_t *timer)
 {
 	IF_NULL_RETURN(timer);
 
+	if (timer->base) {
+		WARN("Freeing timer %p which is still added to the event loop", (void *)timer);
+		event_timer_heap_delete(timer->base, timer);
+	}
+
 	mem_free(timer);
 }
 
 void
-event_add_timer(event_timer_t *timer)
+event_base_add_timer(event_base_t *base, event_timer_t *timer)
 {
 	struct timespec now;
 
+	IF_NULL_RETURN(base);
 	IF_NULL_RETURN(timer);
 
 	timespec_now(&now);
 	timespec_add(&now, &timer->diff, &timer->next);
 	timer->repeated = timer->repeat;
+	timer->seq = base->timer_seq++;
 
-	event_timer_list = list_append(event_timer_list, timer);
+	// adding an already active timer just rearms it
+	if (timer->base)
+		event_remove_timer(timer);
+	event_timer_heap_push(base, timer);
+	event_timerfd_rearm(base);
 
 	TRACE("Added timer event %p (func=%p, data=%p, diff=%u.%09us, repeat=%d)", (void *)timer,
 	      CAST_FUNCPTR_VOIDPTR timer->func, timer->data, (unsigned)timer->diff.tv_sec,
 	      (unsigned)timer->diff.tv_nsec, timer->repeat);
 }
 
+void
+event_add_timer(event_timer_t *timer)
+{
+	event_base_add_timer(event_base_current(), timer);
+}
+
 void
 event_remove_timer(event_timer_t *timer)
 {
 	IF_NULL_RETURN(timer);
 
-	TRACE("Removing timer event %p from list %p", (void *)timer, (void *)event_timer_list);
-	event_timer_list = list_remove(event_timer_list, timer);
+	event_base_t *base = timer->base;
+	if (!base)
+		return;
+
+	TRACE("Removing timer event %p from heap (%zu timers)", (void *)timer, base->timer_count);
+
+	event_timer_heap_delete(base, timer);
+	event_timerfd_rearm(base);
 
 	TRACE("Removed timer event %p (func=%p, data=%p, diff=%u.%09us, repeat=%d)", (void *)timer,
 	      CAST_FUNCPTR_VOIDPTR timer->func, timer->data, (unsigned)timer->diff.tv_sec,
@@ -271,40 +830,26 @@ event_remove_timer(event_timer_t *timer)
 /******************************************************************************/
 
 static int
-event_epoll_fd(int reset)
+event_epoll_fd(event_base_t *base, int reset)
 {
-	static int fd = -1;
+	int fd = base->epoll_fd;
 
 	if (fd < 0 || (fd >= 0 && reset == 1)) {
 		if (fd >= 0 && close(fd) < 0) {
 			ERROR_ERRNO("Failed to cleanly close old epoll fd");
 		}
 
-		fd = epoll_create(1);
+		fd = epoll_create1(EPOLL_CLOEXEC);
 
 		ASSERT(fd >= 0);
 
 		DEBUG("epoll_create returned %d", fd);
-
-		// set close-on-exec flag
-		int oldflags;
-		oldflags = fcntl(fd, F_GETFD, 0);
-		if (oldflags < 0)
-			WARN_ERRNO("fcntl failed");
-		oldflags |= FD_CLOEXEC;
-		if (fcntl(fd, F_SETFD, oldflags) < 0)
-			WARN_ERRNO("fcntl failed");
+		base->epoll_fd = fd;
 	}
 
 	return fd;
 }
 
-static void
-event_reset_fd(void)
-{
-	event_epoll_fd(1);
-}
-
 // compiling with -Wall, -Werror
 // must cast types appropriately in wrapper functions
 static void
@@ -328,26 +873,122 @@ wrapped_remove_inotify(void *elem)
 	event_inotify_free(elem);
 }
 
+static void
+event_base_release(event_base_t *base, bool close_epoll)
+{
+	// internal ios are gone with the old epoll fd, they are created again on demand
+	if (base->timerfd >= 0) {
+		event_io_free(base->timerfd_io);
+		close(base->timerfd);
+		base->timerfd = -1;
+	}
+	if (base->wakeup_fd >= 0) {
+		event_io_free(base->wakeup_io);
+		close(base->wakeup_fd);
+		base->wakeup_fd = -1;
+	}
+
+	if (base->timer_count) {
+		TRACE("Resetting event timers");
+		for (int prio = 0; prio < EVENT_PRIO_COUNT; prio++) {
+			event_timer_heap_t *heap = &base->timer_heaps[prio];
+			while (heap->len)
+				wrapped_remove_timer(heap->timers[heap->len - 1]);
+		}
+	}
+
+	if (!ilist_is_empty(&base->task_list)) {
+		TRACE("Resetting event tasks");
+		while (base->task_list.head)
+			event_remove_task(ilist_entry(base->task_list.head, event_task_t, node));
+	}
+
+	// pending results refer to ios of the old epoll fd
+	base->epoll_ready = 0;
+	for (ilist_node_t *n; (n = ilist_pop(&base->io_deferred));)
+		ilist_entry(n, event_io_t, deferred_node)->deferred_events = 0;
+	base->backlog = false;
+	if (base->inotify_count) {
+		TRACE("Resetting event inotify watches");
+		// removing a watch may rehash other watches on the same wd, thus rescan
+		for (size_t i = 0; base->inotify_count && i < base->inotify_nbuckets;) {
+			if (base->inotify_buckets[i].head) {
+				wrapped_remove_inotify(ilist_entry(base->inotify_buckets[i].head,
+								   event_inotify_t, node));
+				i = 0;
+			} else {
+				i++;
+			}
+		}
+	}
+	mem_free(base->inotify_buckets);
+	base->inotify_nbuckets = 0;
+	if (base->inotify_fd >= 0) {
+		event_io_free(base->inotify_io);
+		close(base->inotify_fd);
+		base->inotify_fd = -1;
+	}
+
+	pthread_mutex_lock(&base->post_lock);
+	for (ilist_node_t *n; (n = ilist_pop(&base->post_list));) {
+		event_post_t *post = ilist_entry(n, event_post_t, node);
+		mem_free(post);
+	}
+	pthread_mutex_unlock(&base->post_lock);
+
+	if (close_epoll && base->epoll_fd >= 0) {
+		close(base->epoll_fd);
+		base->epoll_fd = -1;
+	}
+}
+
+static void
+event_signalfd_watch(void);
+
 void
 event_reset()
 {
-	TRACE("Resetting event epoll fd");
-	event_reset_fd();
+	event_base_t *base = event_base_current();
 
-	if (event_timer_list) {
-		TRACE("Resetting event timers");
-		list_foreach(event_timer_list, wrapped_remove_timer);
-		event_timer_list = NULL;
+	TRACE("Resetting event epoll fd");
+	event_epoll_fd(base, 1);
+
+	event_base_release(base, false);
+
+	if (base == &event_base_main && event_child_map) {
+		TRACE("Resetting event child handlers");
+		// the ios are gone with the old epoll fd
+		size_t iter = 0;
+		const void *key;
+		void *value;
+		while (hashmap_next(event_child_map, &iter, &key, &value)) {
+			event_child_t *child = value;
+			event_io_free(child->io);
+			if (child->pidfd >= 0)
+				close(child->pidfd);
+			mem_free(child);
+		}
+		hashmap_free(event_child_map);
+		event_child_map = NULL;
+		event_child_sig = NULL; // freed with the signal buckets below
+		event_child_sig_count = 0;
 	}
-	if (event_signal_list) {
-		TRACE("Resetting event signal handler list");
-		list_foreach(event_signal_list, wrapped_remove_signal);
-		event_signal_list = NULL;
+
+	if (base == &event_base_main && event_signal_count) {
+		TRACE("Resetting event signal handlers");
+		for (int signum = 1; signum < NSIG; signum++) {
+			ilist_t *bucket = &event_signal_buckets[signum];
+			while (bucket->head)
+				wrapped_remove_signal(
+					ilist_entry(bucket->head, event_signal_t, node));
+		}
 	}
-	if (event_inotify_list) {
-		TRACE("Resetting event inotify list");
-		list_foreach(event_inotify_list, wrapped_remove_inotify);
-		event_inotify_list = NULL;
+
+	if (base == &event_base_main && event_signalfd_io) {
+		// the io is gone with the old epoll fd, the signalfd itself stays valid
+		event_io_free(event_signalfd_io);
+		event_signalfd_io = NULL;
+		event_signalfd_watch();
 	}
 }
 
@@ -365,10 +1006,23 @@ event_io_new(int fd, unsigned events,
 	io->data = data;
 	io->fd = fd;
 	io->events = events;
+	io->internal = false;
+	io->prio = EVENT_PRIO_NORMAL;
+	io->deferred_events = 0;
+	io->base = NULL;
 
 	return io;
 }
 
+void
+event_io_set_prio(event_io_t *io, event_prio_t prio)
+{
+	IF_NULL_RETURN(io);
+	IF_FALSE_RETURN(prio < EVENT_PRIO_COUNT);
+
+	io->prio = prio;
+}
+
 void
 event_io_free(event_io_t *io)
 {
@@ -378,51 +1032,159 @@ event_io_free(event_io_t *io)
 }
 
 void
-event_add_io(event_io_t *io)
+event_base_add_io(event_base_t *base, event_io_t *io)
 {
 	struct epoll_event epoll_event;
 
+	IF_NULL_RETURN(base);
 	IF_NULL_RETURN(io);
 
 	epoll_event.events = 0;
 	epoll_event.events |= (io->events & EVENT_IO_READ) ? EPOLLIN : 0;
 	epoll_event.events |= (io->events & EVENT_IO_WRITE) ? EPOLLOUT : 0;
 	epoll_event.events |= (io->events & EVENT_IO_PRI) ? EPOLLPRI : 0;
+	epoll_event.events |= (io->events & EVENT_IO_EDGE) ? EPOLLET : 0;
 	epoll_event.data.ptr = io;
 
-	if (epoll_ctl(event_epoll_fd(0), EPOLL_CTL_ADD, io->fd, &epoll_event) < 0)
+	if (epoll_ctl(event_epoll_fd(base, 0), EPOLL_CTL_ADD, io->fd, &epoll_event) < 0) {
 		WARN_ERRNO("epoll_ctl failed"); // TODO: handle error?
-	else
-		event_io_active++;
+	} else {
+		io->base = base;
+		if (!io->internal)
+			base->io_active++;
+	}
 
 	TRACE("Added io event %p (func=%p, data=%p, fd=%d, events=0x%x)", (void *)io,
 	      CAST_FUNCPTR_VOIDPTR io->func, io->data, io->fd, io->events);
 }
 
+void
+event_add_io(event_io_t *io)
+{
+	event_base_add_io(event_base_current(), io);
+}
+
 void
 event_remove_io(event_io_t *io)
 {
 	IF_NULL_RETURN(io);
 	TRACE("Removing io event %p", (void *)io);
 
-	if (epoll_ctl(event_epoll_fd(0), EPOLL_CTL_DEL, io->fd, NULL) < 0)
+	event_base_t *base = io->base ? io->base : event_base_current();
+
+	// drop results which are not dispatched yet, the io may be freed afterwards
+	for (size_t i = 0; i < base->epoll_ready; i++) {
+		if (base->epoll_events[i].data.ptr == io)
+			base->epoll_events[i].data.ptr = NULL;
+	}
+	if (io->deferred_events) {
+		ilist_unlink(&base->io_deferred, &io->deferred_node);
+		io->deferred_events = 0;
+	}
+
+	if (epoll_ctl(event_epoll_fd(base, 0), EPOLL_CTL_DEL, io->fd, NULL) < 0) {
 		WARN_ERRNO("epoll_ctl failed"); // TODO: handle error?
-	else
-		event_io_active--;
+	} else {
+		io->base = NULL;
+		if (!io->internal)
+			base->io_active--;
+	}
 
 	TRACE("Removed io event %p (func=%p, data=%p, fd=%d, events=0x%x)", (void *)io,
 	      CAST_FUNCPTR_VOIDPTR io->func, io->data, io->fd, io->events);
 	//TODO unlink?
 }
 
-static int
-event_epoll(int timeout)
+static void
+event_io_dispatch(event_base_t *base, event_io_t *io, unsigned e)
 {
-	struct epoll_event epoll_events[128];
-	int n, i;
+	TRACE("Handling io event %p (func=%p, data=%p, fd=%d, events=0x%x)", (void *)io,
+	      CAST_FUNCPTR_VOIDPTR io->func, io->data, io->fd, io->events);
+
+	// internal ios only acknowledge, inotify watches are accounted separately
+	void *func = CAST_FUNCPTR_VOIDPTR io->func;
+	bool nested = io->internal || io == base->inotify_io;
+	uint64_t begin = nested ? 0 : event_stats_begin(base);
+	PROBE3(event_io_begin, io->fd, e, func);
+	(io->func)(io->fd, e, io, io->data);
+	PROBE2(event_io_end, io->fd, func);
+	event_stats_end(base, EVENT_STATS_TYPE_IO, func, begin);
+
+	TRACE("Finished io handling");
+}
+
+/*
+ * Dispatches the ready ios of one priority class from the results of the last
+ * epoll_wait. Low priority ios are charged to the budget of the iteration,
+ * starting with the edge-triggered ones deferred by the previous iteration.
+ */
+static void
+event_io_handler(event_base_t *base, event_prio_t prio)
+{
+	if (prio == EVENT_PRIO_LOW) {
+		for (ilist_node_t *n; base->low_budget && (n = ilist_pop(&base->io_deferred));) {
+			event_io_t *io = ilist_entry(n, event_io_t, deferred_node);
+			unsigned e = io->deferred_events;
+
+			io->deferred_events = 0;
+			base->low_budget--;
+			event_io_dispatch(base, io, e);
+		}
+	}
+
+	// callbacks may remove ios and thus clear entries, so always re-read the array
+	for (size_t i = 0; i < base->epoll_ready; i++) {
+		event_io_t *io = base->epoll_events[i].data.ptr;
+		uint32_t events = base->epoll_events[i].events;
+		unsigned e;
+
+		if (!io || io->prio != prio)
+			continue;
+
+		e = 0;
+		e |= (events & EPOLLIN) ? EVENT_IO_READ : 0;
+		e |= (events & EPOLLOUT) ? EVENT_IO_WRITE : 0;
+		e |= (events & EPOLLERR) ? EVENT_IO_EXCEPT : 0;
+		e |= (events & EPOLLHUP) ? EVENT_IO_EXCEPT : 0;
+		e |= (events & EPOLLPRI) ? EVENT_IO_PRI : 0;
+
+		if (prio == EVENT_PRIO_LOW) {
+			if (!base->low_budget) {
+				// level-triggered ios are reported again by the next epoll_wait
+				base->backlog = true;
+				if ((io->events & EVENT_IO_EDGE) && !io->deferred_events) {
+					io->deferred_events = e;
+					ilist_append(&base->io_deferred, &io->deferred_node);
+				} else if (io->deferred_events) {
+					io->deferred_events |= e;
+				}
+				continue;
+			}
+			base->low_budget--;
+		}
+
+		event_io_dispatch(base, io, e);
+	}
+}
+
+static int
+event_epoll(event_base_t *base, int timeout)
+{
+	struct epoll_event *epoll_events;
+	int n;
+
+	if (!base->epoll_events) {
+		base->epoll_events_size = EVENT_EPOLL_EVENTS_MIN;
+		base->epoll_events = mem_new(struct epoll_event, base->epoll_events_size);
+	}
+	epoll_events = base->epoll_events;
 
 	TRACE("Calling epoll_wait with timeout=%ums", timeout);
-	n = epoll_wait(event_epoll_fd(0), epoll_events, ELEMENTSOF(epoll_events), timeout);
+	PROBE1(event_epoll_wait, timeout);
+	n = epoll_wait(event_epoll_fd(base, 0), epoll_events, base->epoll_events_size, timeout);
+	PROBE1(event_epoll_wakeup, n);
+	if (base->stats)
+		event_stats_wakeup(base, n);
 	if (n < 0) {
 		if (errno == EINTR) // caused by suspend (no real error)
 			TRACE_ERRNO("epoll_wait interrupted by system");
@@ -430,51 +1192,203 @@ event_epoll(int timeout)
 			DEBUG_ERRNO("epoll_wait failed");
 
 	} else if (n > 0) {
-		for (i = 0; i < n; i++) {
-			event_io_t *io = epoll_events[i].data.ptr;
-			uint32_t events = epoll_events[i].events;
-			unsigned e;
+		base->epoll_ready = n;
+	} // else timeout
 
-			ASSERT(io);
+	return n;
+}
+
+static void
+event_signal_latch(void);
+static void
+event_signal_prio_handler(event_prio_t prio);
+static void
+event_task_handler(event_base_t *base);
+
+/*
+ * Dispatches the results of the last epoll_wait together with the expired
+ * timers and received signals, one priority class after the other.
+ */
+static void
+event_base_dispatch(event_base_t *base)
+{
+	bool is_main = (base == &event_base_main);
+	size_t n = base->epoll_ready;
+
+	base->low_budget = EVENT_PRIO_LOW_BUDGET;
+	base->backlog = false;
+
+	for (int prio = 0; prio < EVENT_PRIO_COUNT; prio++) {
+		event_io_handler(base, prio);
+		// signals read from the (high priority) signalfd io are latched at once
+		if (is_main && prio == EVENT_PRIO_HIGH)
+			event_signal_latch();
+		event_timeout_handler(base, prio);
+		if (is_main)
+			event_signal_prio_handler(prio);
+	}
+	base->epoll_ready = 0;
+	event_timerfd_rearm(base);
+
+	event_task_handler(base);
+
+	if (!ilist_is_empty(&base->io_deferred))
+		base->backlog = true;
+
+	// a full array indicates that more fds are ready, fetch them at once next time
+	if (n == base->epoll_events_size && base->epoll_events_size < EVENT_EPOLL_EVENTS_MAX) {
+		base->epoll_events_size *= 2;
+		base->epoll_events =
+			mem_renew(struct epoll_event, base->epoll_events, base->epoll_events_size);
+		TRACE("Increased epoll event array to %zu entries", base->epoll_events_size);
+	}
+}
+
+/******************************************************************************/
+
+static void
+event_timerfd_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	uint64_t expirations;
+
+	if (!(events & EVENT_IO_READ))
+		return;
 
-			e = 0;
-			e |= (events & EPOLLIN) ? EVENT_IO_READ : 0;
-			e |= (events & EPOLLOUT) ? EVENT_IO_WRITE : 0;
-			e |= (events & EPOLLERR) ? EVENT_IO_EXCEPT : 0;
-			e |= (events & EPOLLHUP) ? EVENT_IO_EXCEPT : 0;
-			e |= (events & EPOLLPRI) ? EVENT_IO_PRI : 0;
+	// the timerfd is non-blocking, a spurious wakeup after rearming yields EAGAIN
+	// the expired timers are dispatched with their priority class after all ios
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		WARN_ERRNO("Failed to read from timerfd");
+}
 
-			TRACE("Handling io event %p (func=%p, data=%p, fd=%d, events=0x%x)",
-			      (void *)io, CAST_FUNCPTR_VOIDPTR io->func, io->data, io->fd,
-			      io->events);
+static void
+event_timerfd_rearm(event_base_t *base)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
 
-			(io->func)(io->fd, e, io, io->data);
+	// the handler rearms once after all expired timers were processed
+	if (!base->timerfd_enabled || base->timer_handling)
+		return;
 
-			TRACE("Finished io handling");
+	if (base->timerfd < 0) {
+		base->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (base->timerfd < 0) {
+			WARN_ERRNO("Could not create timerfd, falling back to epoll timeouts");
+			base->timerfd_enabled = false;
+			return;
 		}
-	} // else timeout
 
-	return n;
+		base->timerfd_io =
+			event_io_new(base->timerfd, EVENT_IO_READ, &event_timerfd_cb, base);
+		// the timerfd must not keep the event loop alive on its own
+		base->timerfd_io->internal = true;
+		base->timerfd_io->prio = EVENT_PRIO_HIGH;
+		event_base_add_io(base, base->timerfd_io);
+		base->timerfd_armed.tv_sec = 0;
+		base->timerfd_armed.tv_nsec = 0;
+	}
+
+	// a zero it_value disarms the timerfd if there are no timers left
+	event_timer_wakeup(base, &its.it_value);
+
+	if (its.it_value.tv_sec == base->timerfd_armed.tv_sec &&
+	    its.it_value.tv_nsec == base->timerfd_armed.tv_nsec)
+		return;
+
+	if (timerfd_settime(base->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		WARN_ERRNO("Could not arm timerfd");
+		return;
+	}
+	timespec_set(&its.it_value, &base->timerfd_armed);
+}
+
+static void
+event_timerfd_close(event_base_t *base)
+{
+	if (base->timerfd < 0)
+		return;
+
+	event_remove_io(base->timerfd_io);
+	event_io_free(base->timerfd_io);
+	close(base->timerfd);
+	base->timerfd = -1;
+}
+
+void
+event_timer_use_timerfd(bool enable)
+{
+	event_base_t *base = event_base_current();
+
+	if (enable == base->timerfd_enabled)
+		return;
+
+	base->timerfd_enabled = enable;
+	if (enable)
+		event_timerfd_rearm(base);
+	else
+		event_timerfd_close(base);
+
+	DEBUG("%s timerfd backend for timer events", enable ? "Enabled" : "Disabled");
 }
 
 /******************************************************************************/
 
+static size_t
+event_inotify_hash(const event_base_t *base, int wd)
+{
+	// watch descriptors are small integers handed out in ascending order
+	return (size_t)wd & (base->inotify_nbuckets - 1);
+}
+
+static void
+event_inotify_bucket_insert(event_base_t *base, event_inotify_t *inotify)
+{
+	size_t h = event_inotify_hash(base, inotify->wd);
+	ilist_append(&base->inotify_buckets[h], &inotify->node);
+}
+
+static void
+event_inotify_bucket_remove(event_base_t *base, event_inotify_t *inotify)
+{
+	size_t h = event_inotify_hash(base, inotify->wd);
+	ilist_unlink(&base->inotify_buckets[h], &inotify->node);
+}
+
+static void
+event_inotify_table_grow(event_base_t *base)
+{
+	size_t old_nbuckets = base->inotify_nbuckets;
+	ilist_t *old_buckets = base->inotify_buckets;
+
+	// keep the load factor below one
+	if (base->inotify_count < old_nbuckets)
+		return;
+
+	base->inotify_nbuckets = old_nbuckets ? 2 * old_nbuckets : 64;
+	base->inotify_buckets = mem_new0(ilist_t, base->inotify_nbuckets);
+
+	for (size_t i = 0; i < old_nbuckets; i++) {
+		for (ilist_node_t *n; (n = ilist_pop(&old_buckets[i]));)
+			event_inotify_bucket_insert(base, ilist_entry(n, event_inotify_t, node));
+	}
+	mem_free(old_buckets);
+}
+
 static void
-event_inotify_handler(int wd, const char *path, uint32_t mask)
+event_inotify_handler(event_base_t *base, int wd, const char *path, uint32_t mask)
 {
-	for (list_t *l = event_inotify_list; l; l = l->next) {
-		event_inotify_t *inotify = l->data;
+	IF_FALSE_RETURN(base->inotify_nbuckets);
+
+	size_t h = event_inotify_hash(base, wd);
 
-		ASSERT(inotify);
+	ilist_foreach(&base->inotify_buckets[h], n) {
+		event_inotify_t *inotify = ilist_entry(n, event_inotify_t, node);
 
 		// mark all elements before any inotify->func is called
 		inotify->todo = true;
 	}
 
-	for (list_t *l = event_inotify_list; l;) {
-		event_inotify_t *inotify = l->data;
-
-		ASSERT(inotify);
+	for (ilist_node_t *n = base->inotify_buckets[h].head; n;) {
+		event_inotify_t *inotify = ilist_entry(n, event_inotify_t, node);
 
 		/* inotify events on the same path get the same watch descriptor!
 		 * therefore we have to check for a match in the mask additionally */
@@ -485,6 +1399,8 @@ event_inotify_handler(int wd, const char *path, uint32_t mask)
 			      (void *)inotify, CAST_FUNCPTR_VOIDPTR inotify->func, inotify->data,
 			      wd, inotify->path, inotify->mask);
 
+			void *func = CAST_FUNCPTR_VOIDPTR inotify->func;
+			uint64_t begin = event_stats_begin(base);
 			if (path) {
 				char *full_path = mem_printf("%s/%s", inotify->path, path);
 				(inotify->func)(full_path, mask, inotify, inotify->data);
@@ -492,23 +1408,28 @@ event_inotify_handler(int wd, const char *path, uint32_t mask)
 			} else {
 				(inotify->func)(inotify->path, mask, inotify, inotify->data);
 			}
+			event_stats_end(base, EVENT_STATS_TYPE_INOTIFY, func, begin);
 
-			// inotify->func might modify the inotify list
-			// so we will start again at its head
-			if (event_inotify_list)
-				l = event_inotify_list;
-			else
-				break;
+			// inotify->func might modify the watches, even grow the table,
+			// so we will start again at the head of the bucket
+			h = event_inotify_hash(base, wd);
+			n = base->inotify_buckets[h].head;
 		} else {
-			l = l->next;
+			n = n->next;
 		}
 	}
 }
 
+#define EVENT_INOTIFY_BATCH 32
+
 static void
-event_inotify_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+event_inotify_cb(int fd, unsigned events, UNUSED event_io_t *io, void *data)
 {
-	char buf[(8 * (sizeof(struct inotify_event) + NAME_MAX + 1))] __attribute__((aligned(8)));
+	char buf[(EVENT_INOTIFY_BATCH * (sizeof(struct inotify_event) + NAME_MAX + 1))]
+		__attribute__((aligned(8)));
+	struct inotify_event *batch[ELEMENTSOF(buf) / sizeof(struct inotify_event)];
+	size_t batch_len = 0;
+	event_base_t *base = data;
 	char *p;
 	ssize_t n;
 
@@ -521,9 +1442,14 @@ event_inotify_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *da
 	if (!n)
 		return;
 
+	/* Collect the whole buffer first and drop events which are identical
+	 * to the preceding event (same wd, mask and name), so that bursts on
+	 * the same path result in a single callback. Non-adjacent events are
+	 * kept, e.g. create, delete, create must not end as create, delete. */
 	for (p = buf; p < buf + n;) {
 		struct inotify_event *e = (struct inotify_event *)p;
 		const char *name = e->len ? e->name : NULL;
+		bool duplicate = false;
 
 		TRACE("Read inotify event %s%s%s%s%s%s%s%s%s%s%s%s%s%s%s"
 		      "(wd=%d, mask=0x%08x, cookie=0x%08x, name=%s)",
@@ -543,28 +1469,40 @@ event_inotify_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *da
 		      e->mask & IN_Q_OVERFLOW ? "IN_Q_OVERFLOW " : "",
 		      e->mask & IN_IGNORED ? "IN_IGNORED " : "", e->wd, e->mask, e->cookie, name);
 
-		event_inotify_handler(e->wd, name, e->mask);
+		if (batch_len) {
+			struct inotify_event *b = batch[batch_len - 1];
+			duplicate = b->wd == e->wd && b->mask == e->mask && b->len == e->len &&
+				    (!e->len || !strcmp(b->name, e->name));
+		}
+
+		if (duplicate)
+			TRACE("Coalesced inotify event (wd=%d, mask=0x%08x)", e->wd, e->mask);
+		else if (batch_len < ELEMENTSOF(batch))
+			batch[batch_len++] = e;
 
 		p += sizeof(struct inotify_event) + e->len;
 	}
+
+	for (size_t i = 0; i < batch_len; i++) {
+		struct inotify_event *e = batch[i];
+		event_inotify_handler(base, e->wd, e->len ? e->name : NULL, e->mask);
+	}
 }
 
 static int
-event_inotify_fd(void)
+event_inotify_fd(event_base_t *base)
 {
-	static int fd = -1;
-
-	if (fd >= 0)
-		return fd;
+	if (base->inotify_fd >= 0)
+		return base->inotify_fd;
 
-	fd = inotify_init();
-	if (fd < 0)
+	base->inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (base->inotify_fd < 0)
 		FATAL_ERRNO("Could not init inotify");
 
-	event_io_t *io = event_io_new(fd, EVENT_IO_READ, &event_inotify_cb, NULL);
-	event_add_io(io);
+	base->inotify_io = event_io_new(base->inotify_fd, EVENT_IO_READ, &event_inotify_cb, base);
+	event_base_add_io(base, base->inotify_io);
 
-	return fd;
+	return base->inotify_fd;
 }
 
 event_inotify_t *
@@ -585,6 +1523,7 @@ event_inotify_new(const char *path, uint32_t mask,
 	inotify->mask = mask;
 	inotify->wd = -1;
 	inotify->todo = false;
+	inotify->base = NULL;
 
 	return inotify;
 }
@@ -601,18 +1540,22 @@ event_inotify_free(event_inotify_t *inotify)
 }
 
 int
-event_add_inotify(event_inotify_t *inotify)
+event_base_add_inotify(event_base_t *base, event_inotify_t *inotify)
 {
+	IF_NULL_RETVAL(base, -1);
 	IF_NULL_RETVAL(inotify, -1);
 
-	inotify->wd =
-		inotify_add_watch(event_inotify_fd(), inotify->path, inotify->mask | IN_MASK_ADD);
+	inotify->wd = inotify_add_watch(event_inotify_fd(base), inotify->path,
+					inotify->mask | IN_MASK_ADD);
 	if (inotify->wd < 0) {
 		WARN_ERRNO("Could not add inotify watch for %s", inotify->path);
 		return -1;
 	}
 
-	event_inotify_list = list_append(event_inotify_list, inotify);
+	inotify->base = base;
+	base->inotify_count++;
+	event_inotify_table_grow(base);
+	event_inotify_bucket_insert(base, inotify);
 
 	TRACE("Added inotify event %p (func=%p, data=%p, wd=%d, path=%s, mask=0x%08x)",
 	      (void *)inotify, CAST_FUNCPTR_VOIDPTR inotify->func, inotify->data, inotify->wd,
@@ -621,36 +1564,59 @@ event_add_inotify(event_inotify_t *inotify)
 	return 0;
 }
 
+int
+event_add_inotify(event_inotify_t *inotify)
+{
+	return event_base_add_inotify(event_base_current(), inotify);
+}
+
 void
 event_remove_inotify(event_inotify_t *inotify)
 {
 	IF_NULL_RETURN(inotify);
 
+	event_base_t *base = inotify->base ? inotify->base : event_base_current();
+
 	TRACE("Removing inotify event %p", (void *)inotify);
-	event_inotify_list = list_remove(event_inotify_list, inotify);
+	if (inotify->base) {
+		event_inotify_bucket_remove(base, inotify);
+		base->inotify_count--;
+	}
+	inotify->base = NULL;
+
+	/* check if there are other handlers on the same watch descriptor */
+	ilist_t others_list = ILIST_INITIALIZER;
+	if (base->inotify_nbuckets) {
+		ilist_t *bucket = &base->inotify_buckets[event_inotify_hash(base, inotify->wd)];
+		ilist_foreach_safe(bucket, n, tmp) {
+			event_inotify_t *inotify_cur = ilist_entry(n, event_inotify_t, node);
+			if (inotify_cur->wd == inotify->wd) {
+				ilist_unlink(bucket, n);
+				ilist_append(&others_list, n);
+			}
+		}
+	}
 
-	/* walk through list and check if there are other handlers on the same
-	 * watch descriptor */
 	bool others = false;
-	for (list_t *l = event_inotify_list; l; l = l->next) {
-		event_inotify_t *inotify_cur = l->data;
-		if (inotify_cur->wd == inotify->wd) {
-			if (!others)
-				/* If the handler is the first of the others it should overwrite the mask */
-				inotify_cur->wd = inotify_add_watch(
-					event_inotify_fd(), inotify_cur->path, inotify_cur->mask);
-			else
-				/* There was already another handler which reset the mask, so we add now */
-				inotify_cur->wd =
-					inotify_add_watch(event_inotify_fd(), inotify_cur->path,
-							  inotify_cur->mask | IN_MASK_ADD);
-			others = true;
-		}
+	for (ilist_node_t *n; (n = ilist_pop(&others_list));) {
+		event_inotify_t *inotify_cur = ilist_entry(n, event_inotify_t, node);
+
+		if (!others)
+			/* If the handler is the first of the others it should overwrite the mask */
+			inotify_cur->wd = inotify_add_watch(event_inotify_fd(base), inotify_cur->path,
+							    inotify_cur->mask);
+		else
+			/* There was already another handler which reset the mask, so we add now */
+			inotify_cur->wd = inotify_add_watch(event_inotify_fd(base), inotify_cur->path,
+							    inotify_cur->mask | IN_MASK_ADD);
+		// the path might refer to a new inode by now, thus rehash
+		event_inotify_bucket_insert(base, inotify_cur);
+		others = true;
 	}
 
 	if (!others) {
 		/* If there were no other handlers with the same watch descriptor we remove it completely */
-		if (inotify_rm_watch(event_inotify_fd(), inotify->wd) < 0) {
+		if (inotify_rm_watch(event_inotify_fd(base), inotify->wd) < 0) {
 			WARN_ERRNO("Could not remove inotify watch for %s", inotify->path);
 			return;
 		}
@@ -677,10 +1643,21 @@ event_signal_new(int signum, void (*func)(int signum, event_signal_t *sig, void
 	sig->data = data;
 	sig->signum = signum;
 	sig->todo = false;
+	sig->added = false;
+	sig->prio = EVENT_PRIO_NORMAL;
 
 	return sig;
 }
 
+void
+event_signal_set_prio(event_signal_t *sig, event_prio_t prio)
+{
+	IF_NULL_RETURN(sig);
+	IF_FALSE_RETURN(prio < EVENT_PRIO_COUNT);
+
+	sig->prio = prio;
+}
+
 void
 event_signal_free(event_signal_t *sig)
 {
@@ -693,8 +1670,11 @@ void
 event_add_signal(event_signal_t *sig)
 {
 	IF_NULL_RETURN(sig);
+	IF_TRUE_RETURN(sig->added);
 
-	event_signal_list = list_append(event_signal_list, sig);
+	ilist_append(&event_signal_buckets[sig->signum], &sig->node);
+	sig->added = true;
+	event_signal_count++;
 
 	TRACE("Added signal event %p (func=%p, data=%p, signal=%d (%s))", (void *)sig,
 	      CAST_FUNCPTR_VOIDPTR sig->func, sig->data, sig->signum, strsignal(sig->signum));
@@ -705,69 +1685,371 @@ event_remove_signal(event_signal_t *sig)
 {
 	IF_NULL_RETURN(sig);
 
+	IF_FALSE_RETURN_TRACE(sig->added);
+
 	TRACE("Removing signal event %p from list", (void *)sig);
-	event_signal_list = list_remove(event_signal_list, sig);
+	ilist_unlink(&event_signal_buckets[sig->signum], &sig->node);
+	sig->added = false;
+	sig->todo = false;
+	event_signal_count--;
 
 	TRACE("Removed signal event %p (func=%p, data=%p, signal=%d (%s))", (void *)sig,
 	      CAST_FUNCPTR_VOIDPTR sig->func, sig->data, sig->signum, strsignal(sig->signum));
 }
 
 static void
-event_signal_handler(void)
+event_signal_dispatch(int signum, event_prio_t prio)
 {
-	bool *received;
+	ilist_t *bucket = &event_signal_buckets[signum];
 
-	TRACE("event_signal_handler() called");
+	for (ilist_node_t *n = bucket->head; n;) {
+		event_signal_t *sig = ilist_entry(n, event_signal_t, node);
 
-	/* We have two arrays to allow atomic switching from one array to the
-	 * other to guarantee that we do not miss signals entirely. It is still
-	 * possible that the handler is only called once for multiple signals
-	 * of the same type.
-	 */
-	received = event_signal_received;
-	if (event_signal_received == event_signal_received0)
-		event_signal_received = event_signal_received1;
-	else
-		event_signal_received = event_signal_received0;
+		if (!sig->todo || sig->prio != prio) {
+			n = n->next;
+			continue;
+		}
+		sig->todo = false;
+
+		TRACE("Handling signal event %p (func=%p, data=%p, signal=%d (%s))", (void *)sig,
+		      CAST_FUNCPTR_VOIDPTR sig->func, sig->data, sig->signum,
+		      strsignal(sig->signum));
 
-	for (list_t *l = event_signal_list; l; l = l->next) {
-		event_signal_t *sig = l->data;
+		void *func = CAST_FUNCPTR_VOIDPTR sig->func;
+		uint64_t begin = event_stats_begin(&event_base_main);
+		(sig->func)(sig->signum, sig, sig->data);
+		event_stats_end(&event_base_main, EVENT_STATS_TYPE_SIGNAL, func, begin);
 
-		ASSERT(sig);
+		// sig->func might modify the bucket of this signal
+		// so we will start again at its head
+		n = bucket->head;
+	}
+}
+
+static void
+event_signal_latch(void)
+{
+	if (!event_signal_pending)
+		return;
+
+	TRACE("event_signal_latch() called");
+
+	/* The flags are cleared before the callbacks are invoked, thus a signal
+	 * which is received meanwhile is handled in the next round and never missed.
+	 * Multiple signals of the same type may still be handled by one callback. */
+	event_signal_pending = 0;
+	for (int signum = 1; signum < NSIG; signum++) {
+		if (!event_signal_received[signum])
+			continue;
+		event_signal_received[signum] = 0;
 
 		// mark all elements before any sig->func is called
-		sig->todo = true;
+		ilist_foreach(&event_signal_buckets[signum], n)
+			ilist_entry(n, event_signal_t, node)->todo = true;
+		event_signal_latched = true;
 	}
+}
 
-	for (list_t *l = event_signal_list; l;) {
-		event_signal_t *sig = l->data;
+static void
+event_signal_prio_handler(event_prio_t prio)
+{
+	if (!event_signal_latched)
+		return;
+
+	for (int signum = 1; signum < NSIG; signum++)
+		event_signal_dispatch(signum, prio);
+
+	// the last class leaves no marked signal events behind
+	if (prio == EVENT_PRIO_COUNT - 1)
+		event_signal_latched = false;
+}
+
+static void
+event_signal_handler(void)
+{
+	event_signal_latch();
+	for (int prio = 0; prio < EVENT_PRIO_COUNT; prio++)
+		event_signal_prio_handler(prio);
+}
+
+static void
+event_signal_raise(int signum)
+{
+	event_signal_received[signum] = 1;
+	event_signal_pending = 1;
+}
+
+/******************************************************************************/
+
+static size_t
+event_child_pid_hash(const void *key)
+{
+	return *(const pid_t *)key;
+}
 
-		ASSERT(sig);
-		ASSERT(sig->signum > 0);
-		ASSERT(sig->signum < NSIG);
+static bool
+event_child_pid_equal(const void *key1, const void *key2)
+{
+	return *(const pid_t *)key1 == *(const pid_t *)key2;
+}
 
-		if (sig->todo && received[sig->signum]) {
-			sig->todo = false;
+event_child_t *
+event_child_new(pid_t pid, void (*func)(pid_t pid, int status, event_child_t *child, void *data),
+		void *data)
+{
+	event_child_t *child;
 
-			TRACE("Handling signal event %p (func=%p, data=%p, signal=%d (%s))",
-			      (void *)sig, CAST_FUNCPTR_VOIDPTR sig->func, sig->data, sig->signum,
-			      strsignal(sig->signum));
+	IF_NULL_RETVAL(func, NULL);
+	IF_FALSE_RETVAL(pid > 0, NULL);
 
-			(sig->func)(sig->signum, sig, sig->data);
+	child = mem_new0(event_child_t, 1);
+	child->func = func;
+	child->data = data;
+	child->pid = pid;
+	child->pidfd = -1;
 
-			// sig->func might modify the signal list
-			// so we will start again at its head
-			if (event_signal_list)
-				l = event_signal_list;
-			else
+	return child;
+}
+
+void
+event_child_free(event_child_t *child)
+{
+	IF_NULL_RETURN(child);
+
+	event_remove_child(child);
+	mem_free(child);
+}
+
+/*
+ * Reaps the child if it terminated and invokes its callback, which may free
+ * the child event. Returns true if the child has been reaped.
+ */
+static bool
+event_child_reap(event_child_t *child)
+{
+	int status = -1;
+
+	pid_t ret = waitpid(child->pid, &status, WNOHANG);
+	IF_TRUE_RETVAL_TRACE(ret == 0 || (ret < 0 && errno == EINTR), false);
+
+	if (ret < 0)
+		WARN_ERRNO("Could not reap child %d", child->pid);
+	else
+		TRACE("Reaped child %d (status=%d)", child->pid, status);
+
+	event_remove_child(child);
+
+	TRACE("Handling child event %p (func=%p, data=%p, pid=%d)", (void *)child,
+	      CAST_FUNCPTR_VOIDPTR child->func, child->data, child->pid);
+	void *func = CAST_FUNCPTR_VOIDPTR child->func;
+	uint64_t begin = event_stats_begin(&event_base_main);
+	(child->func)(child->pid, status, child, child->data);
+	event_stats_end(&event_base_main, EVENT_STATS_TYPE_CHILD, func, begin);
+	return true;
+}
+
+static void
+event_child_pidfd_cb(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	event_child_reap(data);
+}
+
+/*
+ * Fallback for kernels without pidfds: checks each child without pidfd, since
+ * waiting for any child could steal the status of a child waited for elsewhere.
+ */
+static void
+event_child_sigchld_cb(UNUSED int signum, UNUSED event_signal_t *sig, UNUSED void *data)
+{
+	// a callback may add or remove children, thus the iteration starts over after a reap
+	for (bool reaped = true; reaped && event_child_map;) {
+		size_t iter = 0;
+		const void *key;
+		void *value;
+
+		reaped = false;
+		while (hashmap_next(event_child_map, &iter, &key, &value)) {
+			event_child_t *child = value;
+			if (child->pidfd < 0 && event_child_reap(child)) {
+				reaped = true;
 				break;
-		} else {
-			l = l->next;
+			}
+		}
+	}
+}
+
+int
+event_add_child(event_child_t *child)
+{
+	IF_NULL_RETVAL(child, -1);
+	IF_TRUE_RETVAL(child->added, 0);
+
+	if (!event_child_map)
+		event_child_map = hashmap_new(event_child_pid_hash, event_child_pid_equal);
+	if (hashmap_get(event_child_map, &child->pid)) {
+		WARN("Child %d is already watched", child->pid);
+		return -1;
+	}
+	hashmap_put(event_child_map, &child->pid, child);
+	child->added = true;
+
+	// the pidfd becomes readable once the child terminated, else fall back to SIGCHLD
+	child->pidfd = syscall(SYS_pidfd_open, child->pid, 0);
+	if (child->pidfd >= 0) {
+		child->io = event_io_new(child->pidfd, EVENT_IO_READ, event_child_pidfd_cb, child);
+		child->io->prio = EVENT_PRIO_HIGH;
+		event_base_add_io(&event_base_main, child->io);
+	} else {
+		TRACE_ERRNO("No pidfd for child %d, falling back to SIGCHLD", child->pid);
+		if (!event_child_sig_count++) {
+			event_child_sig = event_signal_new(SIGCHLD, event_child_sigchld_cb, NULL);
+			event_child_sig->prio = EVENT_PRIO_HIGH;
+			event_add_signal(event_child_sig);
 		}
 	}
 
-	for (int i = 0; i < NSIG; i++)
-		received[i] = false;
+	TRACE("Added child event %p (func=%p, data=%p, pid=%d, pidfd=%d)", (void *)child,
+	      CAST_FUNCPTR_VOIDPTR child->func, child->data, child->pid, child->pidfd);
+
+	// the child may have terminated before, so check it in the next iteration
+	if (child->pidfd < 0)
+		event_signal_raise(SIGCHLD);
+	return 0;
+}
+
+void
+event_remove_child(event_child_t *child)
+{
+	IF_NULL_RETURN(child);
+	IF_FALSE_RETURN_TRACE(child->added);
+
+	hashmap_remove(event_child_map, &child->pid);
+	child->added = false;
+
+	if (child->pidfd >= 0) {
+		event_remove_io(child->io);
+		event_io_free(child->io);
+		child->io = NULL;
+		close(child->pidfd);
+		child->pidfd = -1;
+	} else if (!--event_child_sig_count) {
+		event_remove_signal(event_child_sig);
+		event_signal_free(event_child_sig);
+		event_child_sig = NULL;
+	}
+
+	TRACE("Removed child event %p (func=%p, data=%p, pid=%d)", (void *)child,
+	      CAST_FUNCPTR_VOIDPTR child->func, child->data, child->pid);
+}
+
+/******************************************************************************/
+
+event_task_t *
+event_task_new(int slice, int (*func)(event_task_t *task, void *data), void *data)
+{
+	event_task_t *task;
+
+	IF_FALSE_RETVAL(slice > 0, NULL);
+	IF_NULL_RETVAL(func, NULL);
+
+	task = mem_new0(event_task_t, 1);
+	task->func = func;
+	task->data = data;
+	task->slice_ns = (uint64_t)slice * 1000000ULL;
+	task->base = NULL;
+
+	return task;
+}
+
+void
+event_task_free(event_task_t *task)
+{
+	IF_NULL_RETURN(task);
+
+	if (task->base) {
+		WARN("Freeing task %p which is still added to the event loop", (void *)task);
+		event_remove_task(task);
+	}
+
+	mem_free(task);
+}
+
+void
+event_base_add_task(event_base_t *base, event_task_t *task)
+{
+	IF_NULL_RETURN(base);
+	IF_NULL_RETURN(task);
+	IF_TRUE_RETURN(task->base);
+
+	ilist_append(&base->task_list, &task->node);
+	task->base = base;
+
+	TRACE("Added task %p (func=%p, data=%p, slice=%" PRIu64 "ns)", (void *)task,
+	      CAST_FUNCPTR_VOIDPTR task->func, task->data, task->slice_ns);
+}
+
+void
+event_add_task(event_task_t *task)
+{
+	event_base_add_task(event_base_current(), task);
+}
+
+void
+event_remove_task(event_task_t *task)
+{
+	IF_NULL_RETURN(task);
+
+	event_base_t *base = task->base;
+	IF_NULL_RETURN_TRACE(base);
+
+	ilist_unlink(&base->task_list, &task->node);
+	task->base = NULL;
+	// tells event_task_handler() that the step function removed its own task
+	if (base->task_running == task)
+		base->task_running = NULL;
+
+	TRACE("Removed task %p (func=%p, data=%p)", (void *)task, CAST_FUNCPTR_VOIDPTR task->func,
+	      task->data);
+}
+
+/*
+ * Runs one slice of the task at the head of the list. The step function is
+ * called at least once, thus a task always makes progress.
+ */
+static void
+event_task_handler(event_base_t *base)
+{
+	if (!base->task_list.head)
+		return;
+
+	event_task_t *task = ilist_entry(base->task_list.head, event_task_t, node);
+	void *func = CAST_FUNCPTR_VOIDPTR task->func;
+	uint64_t begin = event_stats_now_ns();
+	uint64_t now = begin;
+	int ret;
+
+	TRACE("Running slice of task %p (func=%p, data=%p)", (void *)task, func, task->data);
+
+	base->task_running = task;
+	do {
+		ret = (task->func)(task, task->data);
+		if (base->task_running != task)
+			break;
+		now = event_stats_now_ns();
+	} while (ret == EVENT_TASK_AGAIN && now - begin < task->slice_ns);
+
+	event_stats_end(base, EVENT_STATS_TYPE_TASK, func, begin);
+	if (!base->task_running)
+		return;
+	base->task_running = NULL;
+
+	if (ret == EVENT_TASK_DONE) {
+		event_remove_task(task);
+	} else {
+		// round-robin, the other tasks get the next slices
+		ilist_unlink(&base->task_list, &task->node);
+		ilist_append(&base->task_list, &task->node);
+	}
 }
 
 /******************************************************************************/
@@ -784,7 +2066,51 @@ event_sa_handler(int signum)
 {
 	TRACE("Received signal %d (%s)", signum, strsignal(signum));
 	if (signum < NSIG)
-		event_signal_received[signum] = true;
+		event_signal_raise(signum);
+}
+
+#define EVENT_SIGNALFD_BATCH 16
+
+static void
+event_signalfd_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	struct signalfd_siginfo info[EVENT_SIGNALFD_BATCH];
+	ssize_t len;
+
+	if (!(events & EVENT_IO_READ))
+		return;
+
+	while ((len = read(fd, info, sizeof(info))) > 0) {
+		for (size_t i = 0; i < (size_t)len / sizeof(info[0]); i++) {
+			TRACE("Received signal %u (%s) from pid %u", info[i].ssi_signo,
+			      strsignal(info[i].ssi_signo), info[i].ssi_pid);
+			if (info[i].ssi_signo < NSIG)
+				event_signal_raise(info[i].ssi_signo);
+		}
+		if ((size_t)len < sizeof(info))
+			break;
+	}
+	// the signal events are dispatched with their priority class after all ios
+	if (len < 0 && errno != EAGAIN)
+		WARN_ERRNO("Failed to read from signalfd");
+}
+
+static void
+event_signalfd_watch(void)
+{
+	IF_TRUE_RETURN(event_signalfd < 0 || event_signalfd_io);
+
+	event_signalfd_io = event_io_new(event_signalfd, EVENT_IO_READ, &event_signalfd_cb, NULL);
+	event_signalfd_io->internal = true;
+	event_signalfd_io->prio = EVENT_PRIO_HIGH;
+	event_base_add_io(&event_base_main, event_signalfd_io);
+}
+
+void
+event_signal_unblock(void)
+{
+	if (event_signalfd >= 0)
+		pthread_sigmask(SIG_UNBLOCK, &event_signal_mask, NULL);
 }
 
 void
@@ -793,45 +2119,267 @@ event_init(void)
 	if (event_initialized)
 		return;
 
+	static const int signals[] = { SIGTERM, SIGQUIT, SIGINT,  SIGALRM, SIGCHLD,
+				       SIGPIPE, SIGUSR1, SIGUSR2, SIGHUP };
 	struct sigaction action;
 
 	action.sa_handler = event_sa_handler;
 	ASSERT(sigemptyset(&action.sa_mask) >= 0);
 	action.sa_flags = 0;
 
-	event_sigaction(SIGTERM, &action, NULL);
-	event_sigaction(SIGQUIT, &action, NULL);
-	event_sigaction(SIGINT, &action, NULL);
-	event_sigaction(SIGALRM, &action, NULL);
-	event_sigaction(SIGCHLD, &action, NULL);
-	event_sigaction(SIGPIPE, &action, NULL);
-	event_sigaction(SIGUSR1, &action, NULL);
-	event_sigaction(SIGUSR2, &action, NULL);
-	event_sigaction(SIGHUP, &action, NULL);
+	sigemptyset(&event_signal_mask);
+	for (size_t i = 0; i < ELEMENTSOF(signals); i++) {
+		event_sigaction(signals[i], &action, NULL);
+		sigaddset(&event_signal_mask, signals[i]);
+	}
+
+	/* Deliver the signals through a signalfd in epoll instead of interrupting
+	 * epoll_wait(). For this, they are blocked in this and all threads created
+	 * afterwards. The handler remains as fallback for threads which were
+	 * already running and for children which unblocked the signals. */
+	event_signalfd = signalfd(-1, &event_signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (event_signalfd < 0) {
+		WARN_ERRNO("Could not create signalfd, falling back to signal handlers");
+	} else {
+		pthread_sigmask(SIG_BLOCK, &event_signal_mask, NULL);
+		// the signal mask is inherited through exec, thus unblock in forked children
+		pthread_atfork(NULL, NULL, &event_signal_unblock);
+		event_signalfd_watch();
+	}
 
 	event_initialized = true;
 }
 
+/******************************************************************************/
+
+static void
+event_wakeup_cb(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	event_base_t *base = data;
+	uint64_t count;
+	ilist_t posted = ILIST_INITIALIZER;
+
+	if (!(events & EVENT_IO_READ))
+		return;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		WARN_ERRNO("Failed to read from wakeup eventfd");
+
+	pthread_mutex_lock(&base->post_lock);
+	ilist_splice(&posted, &base->post_list);
+	pthread_mutex_unlock(&base->post_lock);
+
+	for (ilist_node_t *n; (n = ilist_pop(&posted));) {
+		event_post_t *post = ilist_entry(n, event_post_t, node);
+
+		TRACE("Handling posted work (func=%p, data=%p)", CAST_FUNCPTR_VOIDPTR post->func,
+		      post->data);
+
+		post->func(post->data);
+		mem_free(post);
+	}
+}
+
+static int
+event_base_wakeup_fd(event_base_t *base)
+{
+	if (base->wakeup_fd >= 0)
+		return base->wakeup_fd;
+
+	base->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (base->wakeup_fd < 0)
+		FATAL_ERRNO("Could not create wakeup eventfd");
+
+	base->wakeup_io = event_io_new(base->wakeup_fd, EVENT_IO_READ, &event_wakeup_cb, base);
+	base->wakeup_io->internal = true;
+	event_base_add_io(base, base->wakeup_io);
+
+	return base->wakeup_fd;
+}
+
+event_base_t *
+event_base_new(void)
+{
+	event_base_t *base = mem_new(event_base_t, 1);
+
+	*base = (event_base_t)EVENT_BASE_INITIALIZER;
+	// a worker loop waits for posted work even if nothing else is registered
+	base->persistent = true;
+
+	event_epoll_fd(base, 0);
+	event_base_wakeup_fd(base);
+
+	return base;
+}
+
 void
-event_loop(void)
+event_base_free(event_base_t *base)
 {
-	if (!event_initialized) {
-		WARN("Called event_loop() without prior initialization through event_init(). Signals might have been lost!.");
-		event_init();
+	IF_NULL_RETURN(base);
+	IF_TRUE_RETURN(base == &event_base_main);
+
+	if (base->thread_running)
+		event_base_join_thread(base);
+
+	event_base_release(base, true);
+	pthread_mutex_destroy(&base->post_lock);
+	mem_free(base->stats);
+	for (int prio = 0; prio < EVENT_PRIO_COUNT; prio++)
+		mem_free(base->timer_heaps[prio].timers);
+	mem_free(base->epoll_events);
+	mem_free(base);
+}
+
+event_base_t *
+event_base_main_get(void)
+{
+	return &event_base_main;
+}
+
+int
+event_base_post(event_base_t *base, void (*func)(void *data), void *data)
+{
+	uint64_t one = 1;
+
+	IF_NULL_RETVAL(base, -1);
+	IF_NULL_RETVAL(func, -1);
+
+	event_post_t *post = mem_new0(event_post_t, 1);
+	post->func = func;
+	post->data = data;
+
+	/* The eventfd of the main base is created lazily under post_lock. This is
+	 * safe from any thread, as epoll_ctl may be called while the owning thread
+	 * waits in epoll_wait. */
+	pthread_mutex_lock(&base->post_lock);
+	int fd = event_base_wakeup_fd(base);
+	ilist_append(&base->post_list, &post->node);
+	pthread_mutex_unlock(&base->post_lock);
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		WARN_ERRNO("Failed to wake up event loop %p", (void *)base);
+		return -1;
 	}
-	DEBUG("Starting event loop");
 
-	while (event_signal_list || event_timer_list || event_io_active) {
+	return 0;
+}
+
+static void
+event_base_break_cb(void *data)
+{
+	event_base_t *base = data;
+
+	base->stop = true;
+}
+
+void
+event_base_break(event_base_t *base)
+{
+	IF_NULL_RETURN(base);
+
+	if (base == event_base_current())
+		base->stop = true;
+	else
+		event_base_post(base, &event_base_break_cb, base);
+}
+
+void
+event_base_loop(event_base_t *base)
+{
+	IF_NULL_RETURN(base);
+
+	bool is_main = (base == &event_base_main);
+	event_base_t *self_old = event_base_self;
+
+	event_base_self = is_main ? NULL : base;
+	base->stop = false;
+
+	while (!base->stop &&
+	       (base->persistent || base->timer_count || base->io_active ||
+		!ilist_is_empty(&base->task_list) || (is_main && event_signal_count))) {
 		int timeout;
 
-		event_signal_handler();
+		// signals are process wide and only dispatched by the main loop, the
+		// callbacks of signals raised outside of the signalfd may end the loop
+		if (is_main && event_signal_pending) {
+			event_signal_handler();
+			continue;
+		}
+
+		// low priority work left over budget and tasks only wait for more urgent events
+		if (base->backlog || !ilist_is_empty(&base->task_list))
+			timeout = 0;
+		else if (base->timerfd_enabled)
+			timeout = -1; // timer expiry wakes up through event_timerfd_cb()
+		else
+			timeout = event_timeout(base);
 
-		timeout = event_timeout();
-		if (!event_epoll(timeout))
-			event_timeout_handler();
+		event_epoll(base, timeout);
+		event_base_dispatch(base);
 
 		TRACE("Handled event");
 	}
 
+	event_base_self = self_old;
+}
+
+static void *
+event_base_thread_main(void *data)
+{
+	event_base_t *base = data;
+
+	DEBUG("Starting worker event loop %p", (void *)base);
+	event_base_loop(base);
+	DEBUG("Leaving worker event loop %p", (void *)base);
+
+	return NULL;
+}
+
+int
+event_base_start_thread(event_base_t *base)
+{
+	IF_NULL_RETVAL(base, -1);
+	IF_TRUE_RETVAL(base == &event_base_main, -1);
+	IF_TRUE_RETVAL(base->thread_running, -1);
+
+	// worker threads must not receive process signals, those are handled by the main loop
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(&base->thread, NULL, &event_base_thread_main, base);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		errno = ret;
+		ERROR_ERRNO("Could not start worker thread for event loop %p", (void *)base);
+		return -1;
+	}
+
+	base->thread_running = true;
+	return 0;
+}
+
+void
+event_base_join_thread(event_base_t *base)
+{
+	IF_NULL_RETURN(base);
+	IF_FALSE_RETURN(base->thread_running);
+
+	event_base_break(base);
+	pthread_join(base->thread, NULL);
+	base->thread_running = false;
+}
+
+void
+event_loop(void)
+{
+	if (!event_initialized) {
+		WARN("Called event_loop() without prior initialization through event_init(). Signals might have been lost!.");
+		event_init();
+	}
+	DEBUG("Starting event loop");
+
+	event_base_loop(&event_base_main);
+
 	DEBUG("Leaving event loop");
 }
@@ -31,12 +31,40 @@
  * registered callback functions for I/O and signal events will be invoked whenever
  * one of the monitored events or signals occur, respectively. Both I/O and signal
  * events will be active until they get explicitly removed.
+ *
+ * All events are registered with an event base, i.e. one epoll based loop.
+ * The functions without a base parameter operate on the loop of the calling
+ * thread, which is the main loop run by event_loop() unless the thread runs
+ * a worker loop created by event_base_new(). A base must only be modified
+ * by the thread running it; other threads hand over work by event_base_post().
+ * Signals are process-wide and always dispatched by the main loop.
  */
 
 #ifndef EVENT_H
 #define EVENT_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+typedef struct event_base event_base_t;
+
+/**
+ * Priority classes of timer, I/O and signal events. Each loop iteration first
+ * dispatches all ready high priority events, then the normal and finally the
+ * low priority ones, thus a flood of bulk events cannot delay e.g. control
+ * commands or child handling for long. At most EVENT_PRIO_LOW_BUDGET low
+ * priority callbacks are run per iteration; remaining ones are dispatched in
+ * the next iteration after a non-blocking poll for more urgent events.
+ */
+typedef enum {
+	EVENT_PRIO_HIGH = 0,
+	EVENT_PRIO_NORMAL, /**< default of all events */
+	EVENT_PRIO_LOW,
+	EVENT_PRIO_COUNT
+} event_prio_t;
+
+#define EVENT_PRIO_LOW_BUDGET 16
 
 typedef struct event_timer event_timer_t;
 
@@ -63,6 +91,30 @@ event_timer_new(int timeout, int repeat, void (*func)(event_timer_t *timer, void
 void
 event_timer_free(event_timer_t *timer);
 
+/**
+ * Sets the priority class of the timer (default EVENT_PRIO_NORMAL).
+ * An active timer keeps its deadline.
+ *
+ * @param timer The timer.
+ * @param prio The priority class.
+ */
+void
+event_timer_set_prio(event_timer_t *timer, event_prio_t prio);
+
+/**
+ * Sets the slack of the timer (default 0), i.e. how much later than its
+ * deadline it may expire. The loop wakes up at the earliest deadline plus
+ * slack of all timers and then runs every timer whose deadline has passed,
+ * thus timers with overlapping slack windows expire in a single wakeup.
+ * Periodic timers do not drift, their next deadline is based on the last one.
+ * Meant for timers which are not latency critical, e.g. polls and retries.
+ *
+ * @param timer The timer.
+ * @param slack The slack in milliseconds.
+ */
+void
+event_timer_set_slack(event_timer_t *timer, int slack);
+
 /**
  * Adds the timer to the event loop.
  *
@@ -71,6 +123,15 @@ event_timer_free(event_timer_t *timer);
 void
 event_add_timer(event_timer_t *timer);
 
+/**
+ * Adds the timer to the given event loop.
+ *
+ * @param base The event loop the timer should be added to.
+ * @param timer The timer to be added.
+ */
+void
+event_base_add_timer(event_base_t *base, event_timer_t *timer);
+
 /**
  * Removes the timer from the event loop.
  *
@@ -79,10 +140,27 @@ event_add_timer(event_timer_t *timer);
 void
 event_remove_timer(event_timer_t *timer);
 
+/**
+ * Selects the timerfd backend for timer events. Instead of converting the next
+ * deadline to a millisecond epoll_wait timeout, a single CLOCK_MONOTONIC timerfd
+ * is armed for the earliest deadline and handled as an ordinary I/O event.
+ * Falls back to epoll timeouts if the timerfd cannot be created.
+ *
+ * @param enable true to use the timerfd backend, false for epoll timeouts (default).
+ */
+void
+event_timer_use_timerfd(bool enable);
+
 #define EVENT_IO_READ (1 << 0)
 #define EVENT_IO_WRITE (1 << 1)
 #define EVENT_IO_EXCEPT (1 << 2)
 #define EVENT_IO_PRI (1 << 3)
+/**
+ * Request edge-triggered notification (EPOLLET) for an I/O event. The callback
+ * is only invoked again after new data arrived, so it must consume the
+ * (non-blocking) fd until read/recv fails with EAGAIN.
+ */
+#define EVENT_IO_EDGE (1 << 4)
 
 typedef struct event_io event_io_t;
 
@@ -91,7 +169,8 @@ typedef struct event_io event_io_t;
  *
  * @param fd The file descriptor to be monitored.
  * @param events Bitwise-or'd events to be monitored on the fd.
- *               May be a combination of EVENT_IO_READ, EVENT_IO_WRITE, and EVENT_IO_EXCEPT.
+ *               May be a combination of EVENT_IO_READ, EVENT_IO_WRITE, and EVENT_IO_EXCEPT,
+ *               optionally together with EVENT_IO_EDGE.
  * @param func A pointer to the callback function.
  * @param data Payload data to be passed to the callback function.
  * @return The newly created I/O event.
@@ -108,6 +187,18 @@ event_io_new(int fd, unsigned events,
 void
 event_io_free(event_io_t *io);
 
+/**
+ * Sets the priority class of the I/O event (default EVENT_PRIO_NORMAL).
+ * Ready low priority I/O events which exceed the budget of an iteration are
+ * reported again in the next iteration, edge-triggered ones are queued by the
+ * loop until then.
+ *
+ * @param io The I/O event.
+ * @param prio The priority class.
+ */
+void
+event_io_set_prio(event_io_t *io, event_prio_t prio);
+
 /**
  * Adds the I/O event to the event loop.
  *
@@ -116,6 +207,15 @@ event_io_free(event_io_t *io);
 void
 event_add_io(event_io_t *io);
 
+/**
+ * Adds the I/O event to the given event loop.
+ *
+ * @param base The event loop the I/O event should be added to.
+ * @param io The I/O event to be added.
+ */
+void
+event_base_add_io(event_base_t *base, event_io_t *io);
+
 /**
  * Removes the I/O event from the event loop.
  *
@@ -148,6 +248,9 @@ event_inotify_free(event_inotify_t *inotify);
 int
 event_add_inotify(event_inotify_t *inotify);
 
+int
+event_base_add_inotify(event_base_t *base, event_inotify_t *inotify);
+
 void
 event_remove_inotify(event_inotify_t *inotify);
 
@@ -172,6 +275,17 @@ event_signal_new(int signum, void (*func)(int signum, event_signal_t *sig, void
 void
 event_signal_free(event_signal_t *sig);
 
+/**
+ * Sets the priority class of the signal event (default EVENT_PRIO_NORMAL).
+ * Signals are not budgeted, the class only orders their callbacks relative to
+ * the I/O and timer events of the same iteration.
+ *
+ * @param sig The signal event.
+ * @param prio The priority class.
+ */
+void
+event_signal_set_prio(event_signal_t *sig, event_prio_t prio);
+
 /**
  * Adds the signal event to the event loop.
  *
@@ -188,14 +302,134 @@ event_add_signal(event_signal_t *sig);
 void
 event_remove_signal(event_signal_t *sig);
 
+typedef struct event_child event_child_t;
+
+/**
+ * Creates a new child event, whose callback is invoked once the child process
+ * pid terminated and has been reaped. In contrast to a SIGCHLD signal event,
+ * only this very child is waited for, so the status of other children is
+ * never stolen, and a SIGCHLD only costs the callbacks of the exited children.
+ *
+ * @param pid The child process of interest.
+ * @param func A pointer to the callback function, which gets the wait status
+ *             of the child (-1 if it could not be reaped). The child event is
+ *             removed from the loop before, so the callback may free it.
+ * @param data Payload data that will be passed to the callback function.
+ * @return The newly created child event.
+ */
+event_child_t *
+event_child_new(pid_t pid, void (*func)(pid_t pid, int status, event_child_t *child, void *data),
+		void *data);
+
+/**
+ * Frees the child event, removing it from the event loop if necessary.
+ *
+ * @param child The child event to be freed.
+ */
+void
+event_child_free(event_child_t *child);
+
+/**
+ * Adds the child event to the main event loop. The child is watched through a
+ * pidfd or, if the kernel does not support pidfds, checked on each SIGCHLD.
+ * Only one child event may be added per pid.
+ *
+ * @param child The child event to be added to the event loop.
+ * @return 0 on success, -1 otherwise.
+ */
+int
+event_add_child(event_child_t *child);
+
+/**
+ * Removes the child event from the event loop without reaping the child.
+ *
+ * @param child The child event to be removed from the event loop.
+ */
+void
+event_remove_child(event_child_t *child);
+
+/**
+ * A cooperative task splits long-running work into short steps, so that the
+ * loop stays responsive in between. Its state lives in the data passed to the
+ * step function, which processes the next piece of work on each call. After
+ * all ready events of an iteration were dispatched, the loop runs a slice of
+ * one task, i.e. calls its step function until either the time budget of the
+ * slice is used up or the task is done. Added tasks are served round-robin and
+ * keep the loop from blocking in epoll_wait.
+ */
+typedef struct event_task event_task_t;
+
+#define EVENT_TASK_DONE 0
+#define EVENT_TASK_AGAIN 1
+
+// default time budget of a slice in milliseconds
+#define EVENT_TASK_SLICE 5
+
+/**
+ * Creates a new cooperative task.
+ *
+ * @param slice The time budget of a slice in milliseconds, e.g. EVENT_TASK_SLICE.
+ * @param func The step function, returns EVENT_TASK_AGAIN to be called again or
+ *             EVENT_TASK_DONE once all work is done. The task is removed from the
+ *             loop afterwards; func may also remove and free the task itself.
+ * @param data Payload data, i.e. the state of the task, passed to func.
+ * @return The newly created task.
+ */
+event_task_t *
+event_task_new(int slice, int (*func)(event_task_t *task, void *data), void *data);
+
+/**
+ * Frees the allocated memory of the task.
+ *
+ * @param task The task to be freed.
+ */
+void
+event_task_free(event_task_t *task);
+
+/**
+ * Adds the task to the event loop of the calling thread.
+ *
+ * @param task The task to be added.
+ */
+void
+event_add_task(event_task_t *task);
+
+/**
+ * Adds the task to the given event loop.
+ *
+ * @param base The event loop the task should be added to.
+ * @param task The task to be added.
+ */
+void
+event_base_add_task(event_base_t *base, event_task_t *task);
+
+/**
+ * Removes the task from its event loop, i.e. cancels the remaining work.
+ *
+ * @param task The task to be removed.
+ */
+void
+event_remove_task(event_task_t *task);
+
 /**
  * Initializes the event loop. Should be called before event_add_signal() is used;
  * otherwise, signals that occur before event_loop() is started might be lost and
  * not get delivered to their registered signal handlers.
+ * If supported, the handled signals are blocked and read from a signalfd in the
+ * main event loop. Threads created afterwards inherit the blocked signals.
  */
 void
 event_init(void);
 
+/**
+ * Unblocks the signals which event_init() delivers through a signalfd. As the
+ * signal mask is inherited through exec, this is done automatically in children
+ * created by fork(). Children created by clone() have to call it themselves
+ * before they exec.
+ */
+void
+event_signal_unblock(void);
+
 /**
  * Invokes the event loop that handles all registered timer, I/O, and signal
  * events. The function returns if there are no more registered timer, I/O, and
@@ -204,4 +438,175 @@ event_init(void);
 void
 event_loop(void);
 
+/**
+ * Creates a new worker event loop. In contrast to the main loop, a worker
+ * loop keeps running without registered events until event_base_break()
+ * is called, so that it can always receive work by event_base_post().
+ *
+ * @return The newly created event loop.
+ */
+event_base_t *
+event_base_new(void);
+
+/**
+ * Stops the worker thread (if any) and frees the event loop including all
+ * of its registered timers and inotify watches. I/O events are not freed.
+ *
+ * @param base The worker event loop to be freed.
+ */
+void
+event_base_free(event_base_t *base);
+
+/**
+ * Returns the main event loop which is run by event_loop().
+ */
+event_base_t *
+event_base_main_get(void);
+
+/**
+ * Returns the event loop of the calling thread, i.e. the worker loop it runs
+ * or the main loop.
+ */
+event_base_t *
+event_base_current(void);
+
+/**
+ * Executes func(data) in the context of the given event loop. This function
+ * may be called from any thread; the loop is woken up through an eventfd.
+ *
+ * @param base The event loop which should execute the function.
+ * @param func The function to be called.
+ * @param data Payload data passed to func.
+ * @return 0 on success, -1 otherwise.
+ */
+int
+event_base_post(event_base_t *base, void (*func)(void *data), void *data);
+
+/**
+ * Makes event_base_loop() return after the current iteration.
+ * May be called from any thread.
+ *
+ * @param base The event loop to be stopped.
+ */
+void
+event_base_break(event_base_t *base);
+
+/**
+ * Runs the given event loop in the calling thread until event_base_break()
+ * is called or, for the main loop, there are no more registered events.
+ *
+ * @param base The event loop to be run.
+ */
+void
+event_base_loop(event_base_t *base);
+
+/**
+ * Runs the given worker event loop in a newly created thread. All signals
+ * are blocked in the worker thread.
+ *
+ * @param base The worker event loop to be run.
+ * @return 0 on success, -1 otherwise.
+ */
+int
+event_base_start_thread(event_base_t *base);
+
+/**
+ * Stops the worker event loop and waits for its thread to finish.
+ *
+ * @param base The worker event loop to be stopped.
+ */
+void
+event_base_join_thread(event_base_t *base);
+
+typedef enum {
+	EVENT_STATS_TYPE_IO = 0,
+	EVENT_STATS_TYPE_TIMER,
+	EVENT_STATS_TYPE_SIGNAL,
+	EVENT_STATS_TYPE_INOTIFY,
+	EVENT_STATS_TYPE_CHILD,
+	EVENT_STATS_TYPE_TASK
+} event_stats_type_t;
+
+// callback wall times: <10us, <100us, <1ms, <10ms, <100ms, <1s, >=1s
+#define EVENT_STATS_HIST_BUCKETS 7
+// events per epoll_wait wakeup: 0, 1, 2-3, 4-7, ..., 64-127, >=128
+#define EVENT_STATS_WAKEUP_BUCKETS 9
+
+typedef struct event_stats {
+	event_stats_type_t type;
+	void *func;				 /**< the callback function */
+	uint64_t calls;				 /**< number of invocations */
+	uint64_t total_ns;			 /**< accumulated wall time */
+	uint64_t max_ns;			 /**< longest invocation */
+	uint64_t hist[EVENT_STATS_HIST_BUCKETS]; /**< histogram of wall times */
+} event_stats_t;
+
+typedef struct event_loop_stats {
+	uint64_t wakeups;				   /**< number of epoll_wait returns */
+	uint64_t events;				   /**< number of returned io events */
+	uint64_t wakeup_hist[EVENT_STATS_WAKEUP_BUCKETS]; /**< histogram of events per wakeup */
+	uint64_t lag_count;				   /**< number of expired timers */
+	uint64_t lag_total_ns; /**< accumulated delay between timer deadline and dispatch */
+	uint64_t lag_max_ns;   /**< maximum delay between timer deadline and dispatch */
+} event_loop_stats_t;
+
+/**
+ * Enables or disables the instrumentation of the event loop of the calling
+ * thread. If enabled, the wall time of each io, timer, signal and inotify
+ * callback is recorded per callback function, as well as the number of events
+ * per epoll_wait wakeup and the loop lag, i.e. how late timers are dispatched.
+ * Disabling drops all collected data.
+ *
+ * @param enable true to start collecting statistics.
+ */
+void
+event_stats_enable(bool enable);
+
+/**
+ * Returns true if the event loop of the calling thread collects statistics.
+ */
+bool
+event_stats_enabled(void);
+
+/**
+ * Clears the statistics collected so far.
+ */
+void
+event_stats_reset(void);
+
+/**
+ * Calls func for the statistics of each callback seen so far.
+ *
+ * @param func Function called for each callback.
+ * @param data Payload data passed to func.
+ */
+void
+event_stats_foreach(void (*func)(const event_stats_t *stats, void *data), void *data);
+
+/**
+ * Copies the loop wide statistics.
+ *
+ * @param loop Destination of the statistics.
+ * @return 0 on success, -1 if instrumentation is disabled.
+ */
+int
+event_stats_get_loop(event_loop_stats_t *loop);
+
+/**
+ * Returns a string representation of the given callback type.
+ */
+const char *
+event_stats_type_to_string(event_stats_type_t type);
+
+/**
+ * Resolves a callback function pointer to its symbol name or, for callbacks
+ * which are not exported, to "<binary>+0x<offset>" which can be resolved
+ * offline, e.g. by addr2line. The returned string has to be freed by the caller.
+ *
+ * @param func The callback function pointer.
+ * @return Newly allocated name of the callback.
+ */
+char *
+event_stats_func_name(const void *func);
+
 #endif /* EVENT_H */
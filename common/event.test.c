@@ -0,0 +1,777 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "munit.h"
+
+#include "event.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TIMER_COUNT 8
+
+static int fired[TIMER_COUNT * 4];
+static int fired_len;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	fired_len = 0;
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	event_reset();
+}
+
+static void
+record_cb(UNUSED event_timer_t *timer, void *data)
+{
+	munit_assert_int(fired_len, <, (int)ELEMENTSOF(fired));
+	fired[fired_len++] = (int)(intptr_t)data;
+}
+
+static MunitResult
+test_timers_fire_in_deadline_order(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// timeouts are added out of order, the heap has to sort them
+	const int timeouts[TIMER_COUNT] = { 35, 5, 25, 15, 30, 10, 20, 0 };
+	event_timer_t *timers[TIMER_COUNT];
+
+	for (int i = 0; i < TIMER_COUNT; i++) {
+		timers[i] = event_timer_new(timeouts[i], 1, &record_cb,
+					    (void *)(intptr_t)timeouts[i]);
+		event_add_timer(timers[i]);
+	}
+
+	event_loop();
+
+	munit_assert_int(fired_len, ==, TIMER_COUNT);
+	for (int i = 1; i < fired_len; i++)
+		munit_assert_int(fired[i - 1], <, fired[i]);
+
+	for (int i = 0; i < TIMER_COUNT; i++)
+		event_timer_free(timers[i]);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_timerfd_backend(const MunitParameter params[], void *data)
+{
+	// same expectations as for the epoll timeout backend
+	event_timer_use_timerfd(true);
+	MunitResult res = test_timers_fire_in_deadline_order(params, data);
+	event_timer_use_timerfd(false);
+
+	return res;
+}
+
+static event_timer_t *victim = NULL;
+
+static void
+remove_victim_cb(event_timer_t *timer, void *data)
+{
+	record_cb(timer, data);
+	event_remove_timer(victim);
+}
+
+static MunitResult
+test_timer_repeat_and_remove(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// repeating timer fires exactly 'repeat' times
+	event_timer_t *rep = event_timer_new(1, 3, &record_cb, (void *)(intptr_t)1);
+	// removing a pending timer from a callback prevents it from firing
+	event_timer_t *killer = event_timer_new(2, 1, &remove_victim_cb, (void *)(intptr_t)2);
+	victim = event_timer_new(50, 1, &record_cb, (void *)(intptr_t)3);
+
+	event_add_timer(rep);
+	event_add_timer(killer);
+	event_add_timer(victim);
+
+	event_loop();
+
+	int ones = 0;
+	for (int i = 0; i < fired_len; i++) {
+		munit_assert_int(fired[i], !=, 3);
+		if (fired[i] == 1)
+			ones++;
+	}
+	munit_assert_int(ones, ==, 3);
+	munit_assert_int(fired_len, ==, 4);
+
+	event_timer_free(rep);
+	event_timer_free(killer);
+	event_timer_free(victim);
+
+	return MUNIT_OK;
+}
+
+static struct timespec slack_fired[2];
+
+static void
+slack_cb(UNUSED event_timer_t *timer, void *data)
+{
+	record_cb(timer, data);
+	clock_gettime(CLOCK_MONOTONIC, &slack_fired[(intptr_t)data]);
+}
+
+static int64_t
+slack_ms_since(const struct timespec *start, const struct timespec *t)
+{
+	return (t->tv_sec - start->tv_sec) * 1000 + (t->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static MunitResult
+test_timer_slack_coalesce(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	struct timespec start;
+
+	// the early timer may wait for the later one, both expire in one wakeup
+	event_timer_t *early = event_timer_new(10, 1, &slack_cb, (void *)(intptr_t)0);
+	event_timer_set_slack(early, 200);
+	event_timer_t *late = event_timer_new(60, 1, &slack_cb, (void *)(intptr_t)1);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	event_add_timer(early);
+	event_add_timer(late);
+
+	event_loop();
+
+	munit_assert_int(fired_len, ==, 2);
+	munit_assert_int(fired[0], ==, 0);
+	munit_assert_int(fired[1], ==, 1);
+	munit_assert_int64(slack_ms_since(&start, &slack_fired[0]), >=, 60);
+	munit_assert_int64(slack_ms_since(&slack_fired[0], &slack_fired[1]), <, 5);
+
+	event_timer_free(early);
+	event_timer_free(late);
+
+	return MUNIT_OK;
+}
+
+static event_timer_t *keepalive = NULL;
+static event_base_t *worker = NULL;
+static pthread_t worker_thread;
+
+static void
+back_on_main_cb(void *data)
+{
+	// runs on the main loop, removing the last timer ends event_loop()
+	munit_assert_ptr_equal(event_base_current(), event_base_main_get());
+	munit_assert_true(pthread_equal(*(pthread_t *)data, worker_thread));
+	event_remove_timer(keepalive);
+}
+
+static void
+on_worker_cb(UNUSED void *data)
+{
+	munit_assert_ptr_equal(event_base_current(), worker);
+	worker_thread = pthread_self();
+	event_base_post(event_base_main_get(), &back_on_main_cb, &worker_thread);
+}
+
+static MunitResult
+test_worker_loop_post(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	keepalive = event_timer_new(5000, 1, &record_cb, (void *)(intptr_t)1);
+	event_add_timer(keepalive);
+
+	worker = event_base_new();
+	munit_assert_int(event_base_start_thread(worker), ==, 0);
+	munit_assert_int(event_base_post(worker, &on_worker_cb, NULL), ==, 0);
+
+	event_loop();
+
+	// the keepalive timer was removed before it expired
+	munit_assert_int(fired_len, ==, 0);
+
+	event_base_free(worker);
+	event_timer_free(keepalive);
+
+	return MUNIT_OK;
+}
+
+static int attrib_a, attrib_b;
+static uint32_t c_masks[8];
+static int c_masks_len;
+
+static void
+attrib_cb(const char *path, uint32_t mask, UNUSED event_inotify_t *inotify, UNUSED void *data)
+{
+	if (!strcmp(strrchr(path, '/'), "/c")) {
+		if (c_masks_len < (int)ELEMENTSOF(c_masks))
+			c_masks[c_masks_len++] = mask;
+		return;
+	}
+
+	munit_assert_true(mask & IN_ATTRIB);
+	if (!strcmp(strrchr(path, '/'), "/a"))
+		attrib_a++;
+	else if (!strcmp(strrchr(path, '/'), "/b"))
+		attrib_b++;
+}
+
+static void
+break_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	event_base_break(event_base_current());
+}
+
+static MunitResult
+test_inotify_coalesce(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char dir[] = "/tmp/event.test.XXXXXX";
+	munit_assert_not_null(mkdtemp(dir));
+
+	char *a = mem_printf("%s/a", dir);
+	char *b = mem_printf("%s/b", dir);
+	close(open(a, O_CREAT | O_WRONLY, 0600));
+	close(open(b, O_CREAT | O_WRONLY, 0600));
+
+	char *c = mem_printf("%s/c", dir);
+
+	event_inotify_t *inotify =
+		event_inotify_new(dir, IN_ATTRIB | IN_CREATE | IN_DELETE, &attrib_cb, NULL);
+	munit_assert_int(event_add_inotify(inotify), ==, 0);
+
+	// a, a, b, a: only the consecutive a is merged, the last a must still be seen
+	chmod(a, 0640);
+	chmod(a, 0600);
+	chmod(b, 0640);
+	chmod(a, 0640);
+
+	// create, delete, create: the final state is "created"
+	close(open(c, O_CREAT | O_WRONLY, 0600));
+	unlink(c);
+	close(open(c, O_CREAT | O_WRONLY, 0600));
+
+	event_timer_t *timer = event_timer_new(50, 1, &break_cb, NULL);
+	event_add_timer(timer);
+	event_loop();
+
+	munit_assert_int(attrib_a, ==, 2);
+	munit_assert_int(attrib_b, ==, 1);
+	munit_assert_int(c_masks_len, ==, 3);
+	munit_assert_true(c_masks[0] & IN_CREATE);
+	munit_assert_true(c_masks[1] & IN_DELETE);
+	munit_assert_true(c_masks[2] & IN_CREATE);
+
+	event_remove_inotify(inotify);
+	event_inotify_free(inotify);
+	event_timer_free(timer);
+	unlink(a);
+	unlink(b);
+	unlink(c);
+	rmdir(dir);
+	mem_free(a);
+	mem_free(b);
+	mem_free(c);
+
+	return MUNIT_OK;
+}
+
+#define IO_COUNT 200
+
+static int io_calls;
+
+static void
+edge_read_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	char c;
+	munit_assert_true(events & EVENT_IO_READ);
+	// consume only one of two bytes, an edge-triggered io must not fire again
+	munit_assert_int(read(fd, &c, 1), ==, 1);
+	io_calls++;
+}
+
+static MunitResult
+test_io_edge_burst(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int fds[IO_COUNT][2];
+	event_io_t *ios[IO_COUNT];
+
+	io_calls = 0;
+	// more ready fds than the initial epoll array holds
+	for (int i = 0; i < IO_COUNT; i++) {
+		munit_assert_int(pipe2(fds[i], O_NONBLOCK | O_CLOEXEC), ==, 0);
+		munit_assert_int(write(fds[i][1], "ab", 2), ==, 2);
+		ios[i] = event_io_new(fds[i][0], EVENT_IO_READ | EVENT_IO_EDGE, &edge_read_cb, NULL);
+		event_add_io(ios[i]);
+	}
+
+	event_timer_t *timer = event_timer_new(50, 1, &break_cb, NULL);
+	event_add_timer(timer);
+	event_loop();
+
+	munit_assert_int(io_calls, ==, IO_COUNT);
+
+	for (int i = 0; i < IO_COUNT; i++) {
+		event_remove_io(ios[i]);
+		event_io_free(ios[i]);
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	event_timer_free(timer);
+
+	return MUNIT_OK;
+}
+
+static int child_status[2];
+static int child_calls;
+
+static void
+child_cb(UNUSED pid_t pid, int status, event_child_t *child, void *data)
+{
+	child_status[(intptr_t)data] = status;
+	child_calls++;
+	event_child_free(child);
+}
+
+static pid_t
+fork_exit(int code)
+{
+	pid_t pid = fork();
+	munit_assert_int(pid, >=, 0);
+	if (pid == 0)
+		_exit(code);
+	return pid;
+}
+
+static MunitResult
+test_child_reap(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	event_init();
+	child_calls = 0;
+
+	pid_t other = fork_exit(7);
+	for (int i = 0; i < 2; i++) {
+		event_child_t *child =
+			event_child_new(fork_exit(3 + i), &child_cb, (void *)(intptr_t)i);
+		munit_assert_int(event_add_child(child), ==, 0);
+	}
+	// the loop returns once both child events are done
+	event_loop();
+
+	munit_assert_int(child_calls, ==, 2);
+	for (int i = 0; i < 2; i++) {
+		munit_assert_true(WIFEXITED(child_status[i]));
+		munit_assert_int(WEXITSTATUS(child_status[i]), ==, 3 + i);
+	}
+
+	// a child without child event is left to whoever waits for it
+	int status;
+	munit_assert_int(waitpid(other, &status, 0), ==, other);
+	munit_assert_int(WEXITSTATUS(status), ==, 7);
+
+	return MUNIT_OK;
+}
+
+static int signal_calls[2];
+
+static void
+signal_cb(int signum, event_signal_t *sig, UNUSED void *data)
+{
+	signal_calls[signum == SIGUSR2]++;
+	event_remove_signal(sig);
+	event_signal_free(sig);
+}
+
+static void
+signal_timer_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	// only the bucket of the raised signal has been dispatched
+	munit_assert_int(signal_calls[0], ==, 1);
+	munit_assert_int(signal_calls[1], ==, 0);
+	munit_assert_int(raise(SIGUSR2), ==, 0);
+}
+
+static MunitResult
+test_signal_dispatch(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	event_init();
+	signal_calls[0] = signal_calls[1] = 0;
+
+	event_add_signal(event_signal_new(SIGUSR1, &signal_cb, NULL));
+	event_add_signal(event_signal_new(SIGUSR2, &signal_cb, NULL));
+	event_add_timer(event_timer_new(10, 1, &signal_timer_cb, NULL));
+
+	munit_assert_int(raise(SIGUSR1), ==, 0);
+	// the loop returns once both signal events removed themselves
+	event_loop();
+
+	munit_assert_int(signal_calls[0], ==, 1);
+	munit_assert_int(signal_calls[1], ==, 1);
+
+	return MUNIT_OK;
+}
+
+static void
+prio_read_cb(int fd, UNUSED unsigned events, event_io_t *io, void *data)
+{
+	char c;
+	munit_assert_int(read(fd, &c, 1), ==, 1);
+	munit_assert_int(fired_len, <, (int)ELEMENTSOF(fired));
+	fired[fired_len++] = (int)(intptr_t)data;
+	event_remove_io(io);
+	event_io_free(io);
+}
+
+static MunitResult
+test_io_prio_order(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// ios are registered in reverse order of their priority classes
+	const event_prio_t prios[] = { EVENT_PRIO_LOW, EVENT_PRIO_NORMAL, EVENT_PRIO_HIGH };
+	int fds[ELEMENTSOF(prios)][2];
+
+	for (size_t i = 0; i < ELEMENTSOF(prios); i++) {
+		munit_assert_int(pipe2(fds[i], O_NONBLOCK | O_CLOEXEC), ==, 0);
+		munit_assert_int(write(fds[i][1], "a", 1), ==, 1);
+		event_io_t *io = event_io_new(fds[i][0], EVENT_IO_READ, &prio_read_cb,
+					      (void *)(intptr_t)prios[i]);
+		event_io_set_prio(io, prios[i]);
+		event_add_io(io);
+	}
+	// an expired timer is dispatched after the ios of its own class
+	event_timer_t *timer = event_timer_new(0, 1, &record_cb, (void *)(intptr_t)10);
+	event_add_timer(timer);
+	// the loop returns once all ios removed themselves
+	event_loop();
+
+	munit_assert_int(fired_len, ==, 4);
+	munit_assert_int(fired[0], ==, EVENT_PRIO_HIGH);
+	munit_assert_int(fired[1], ==, EVENT_PRIO_NORMAL);
+	munit_assert_int(fired[2], ==, 10);
+	munit_assert_int(fired[3], ==, EVENT_PRIO_LOW);
+
+	for (size_t i = 0; i < ELEMENTSOF(prios); i++) {
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	event_timer_free(timer);
+
+	return MUNIT_OK;
+}
+
+#define LOW_COUNT (EVENT_PRIO_LOW_BUDGET + 4)
+
+static int low_calls;
+static int low_calls_seen;
+static int high_fds[2];
+
+static void
+low_edge_cb(int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	char buf[4];
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	// the high priority io becomes ready while low priority ones are pending
+	if (!low_calls++)
+		munit_assert_int(write(high_fds[1], "a", 1), ==, 1);
+}
+
+static void
+high_cb(int fd, UNUSED unsigned events, event_io_t *io, UNUSED void *data)
+{
+	char c;
+	munit_assert_int(read(fd, &c, 1), ==, 1);
+	low_calls_seen = low_calls;
+	event_remove_io(io);
+	event_io_free(io);
+}
+
+static MunitResult
+test_io_prio_budget(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int fds[LOW_COUNT][2];
+	event_io_t *ios[LOW_COUNT];
+
+	low_calls = 0;
+	low_calls_seen = -1;
+	munit_assert_int(pipe2(high_fds, O_NONBLOCK | O_CLOEXEC), ==, 0);
+	event_io_t *high = event_io_new(high_fds[0], EVENT_IO_READ, &high_cb, NULL);
+	event_io_set_prio(high, EVENT_PRIO_HIGH);
+	event_add_io(high);
+
+	for (int i = 0; i < LOW_COUNT; i++) {
+		munit_assert_int(pipe2(fds[i], O_NONBLOCK | O_CLOEXEC), ==, 0);
+		munit_assert_int(write(fds[i][1], "ab", 2), ==, 2);
+		ios[i] = event_io_new(fds[i][0], EVENT_IO_READ | EVENT_IO_EDGE, &low_edge_cb, NULL);
+		event_io_set_prio(ios[i], EVENT_PRIO_LOW);
+		event_add_io(ios[i]);
+	}
+
+	event_timer_t *timer = event_timer_new(50, 1, &break_cb, NULL);
+	event_add_timer(timer);
+	event_loop();
+
+	// the high priority io preempted the low priority ones over budget
+	munit_assert_int(low_calls_seen, ==, EVENT_PRIO_LOW_BUDGET);
+	// the deferred edge-triggered ios were not lost
+	munit_assert_int(low_calls, ==, LOW_COUNT);
+
+	for (int i = 0; i < LOW_COUNT; i++) {
+		event_remove_io(ios[i]);
+		event_io_free(ios[i]);
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	close(high_fds[0]);
+	close(high_fds[1]);
+	event_timer_free(timer);
+
+	return MUNIT_OK;
+}
+
+#define TASK_STEPS 40
+
+static int task_steps[2];
+static int task_steps_other;
+static int tick_calls;
+static event_timer_t *tick_timer;
+
+static int
+task_step_cb(UNUSED event_task_t *task, void *data)
+{
+	int i = (int)(intptr_t)data;
+
+	// each step takes a millisecond, thus a slice covers several steps
+	usleep(1000);
+	if (++task_steps[i] < TASK_STEPS)
+		return EVENT_TASK_AGAIN;
+
+	// the first task to finish records the progress of the other one
+	if (task_steps[!i] < TASK_STEPS)
+		task_steps_other = task_steps[!i];
+	else
+		event_remove_timer(tick_timer);
+	return EVENT_TASK_DONE;
+}
+
+static void
+tick_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	tick_calls++;
+}
+
+static MunitResult
+test_task_slices(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	event_task_t *tasks[2];
+
+	task_steps[0] = task_steps[1] = 0;
+	task_steps_other = -1;
+	tick_calls = 0;
+	tick_timer = event_timer_new(2, EVENT_TIMER_REPEAT_FOREVER, &tick_cb, NULL);
+	event_add_timer(tick_timer);
+	for (int i = 0; i < 2; i++) {
+		tasks[i] = event_task_new(EVENT_TASK_SLICE, &task_step_cb, (void *)(intptr_t)i);
+		event_add_task(tasks[i]);
+	}
+	// the loop returns once both tasks are done and the timer is removed
+	event_loop();
+
+	munit_assert_int(task_steps[0], ==, TASK_STEPS);
+	munit_assert_int(task_steps[1], ==, TASK_STEPS);
+	// the tasks took turns instead of running to completion one after the other
+	munit_assert_int(task_steps_other, >, 0);
+	munit_assert_int(task_steps_other, <, TASK_STEPS);
+	// the timer was served in between the slices
+	munit_assert_int(tick_calls, >=, 10);
+
+	for (int i = 0; i < 2; i++)
+		event_task_free(tasks[i]);
+	event_timer_free(tick_timer);
+
+	return MUNIT_OK;
+}
+
+static event_task_t *task_victim;
+static int task_victim_steps;
+
+static int
+task_victim_cb(UNUSED event_task_t *task, UNUSED void *data)
+{
+	task_victim_steps++;
+	return EVENT_TASK_AGAIN;
+}
+
+static int
+task_cancel_cb(event_task_t *task, UNUSED void *data)
+{
+	// cancel the other task and release this one from within its step function
+	event_remove_task(task_victim);
+	event_task_free(task_victim);
+	event_remove_task(task);
+	event_task_free(task);
+	return EVENT_TASK_AGAIN;
+}
+
+static MunitResult
+test_task_remove(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	task_victim_steps = 0;
+	task_victim = event_task_new(EVENT_TASK_SLICE, &task_victim_cb, NULL);
+	event_add_task(task_victim);
+	event_add_task(event_task_new(EVENT_TASK_SLICE, &task_cancel_cb, NULL));
+	// the loop returns once no task is left
+	event_loop();
+
+	// the victim ran for a single slice before it was cancelled
+	munit_assert_int(task_victim_steps, >, 0);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/timers fire in deadline order",  /* name */
+		test_timers_fire_in_deadline_order, /* test */
+		setup,				    /* setup */
+		tear_down,			    /* tear_down */
+		MUNIT_TEST_OPTION_NONE,		    /* options */
+		NULL				    /* parameters */
+	},
+	{
+		"/timerfd backend",	/* name */
+		test_timerfd_backend,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/worker loop post",	/* name */
+		test_worker_loop_post,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/inotify coalesce",	/* name */
+		test_inotify_coalesce,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/io edge burst",	/* name */
+		test_io_edge_burst,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/timer repeat and remove",   /* name */
+		test_timer_repeat_and_remove, /* test */
+		setup,			      /* setup */
+		tear_down,		      /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	      /* options */
+		NULL			      /* parameters */
+	},
+	{
+		"/timer slack coalesce",   /* name */
+		test_timer_slack_coalesce, /* test */
+		setup,			   /* setup */
+		tear_down,		   /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	   /* options */
+		NULL			   /* parameters */
+	},
+	{
+		"/child reap",		/* name */
+		test_child_reap,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/signal dispatch",	/* name */
+		test_signal_dispatch,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/io prio order",	/* name */
+		test_io_prio_order,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/io prio budget",	/* name */
+		test_io_prio_budget,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/task slices",		/* name */
+		test_task_slices,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/task remove",		/* name */
+		test_task_remove,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite event_suite = {
+	"/event",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
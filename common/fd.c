@@ -24,10 +24,36 @@
 #include "fd.h"
 
 #include "macro.h"
+#include "mem.h"
+#include "event.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/syscall.h>
+
+/*
+ * Waits until fd is ready for events (POLLIN or POLLOUT) instead of retrying
+ * right away, which would spin on a non-blocking fd while the peer is slow.
+ * @return 0 if ready, -1 with errno ETIMEDOUT after FD_POLL_TIMEOUT ms or on error
+ */
+static int
+fd_poll(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, FD_POLL_TIMEOUT);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return ret < 0 ? -1 : 0;
+}
 
 int
 fd_write(int fd, const char *buf, size_t len)
@@ -40,12 +66,16 @@ fd_write(int fd, const char *buf, size_t len)
 		ret = write(fd, buf, remain);
 
 		if (ret < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				TRACE_ERRNO("Writing to fd %d: Blocked, retrying...", fd);
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    fd_poll(fd, POLLOUT) == 0) {
+				TRACE("Writing to fd %d: Blocked, waited for it", fd);
 				continue;
 			}
 			ERROR_ERRNO("Failed to write to fd %d", fd);
-			return ret;
+			IF_TRUE_RETVAL(remain == len, -1);
+			break;
 		}
 
 		remain -= ret;
@@ -59,6 +89,46 @@ fd_write(int fd, const char *buf, size_t len)
 	return len - remain;
 }
 
+ssize_t
+fd_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t written = 0;
+
+	while (iovcnt > 0) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    fd_poll(fd, POLLOUT) == 0) {
+				TRACE("Writing to fd %d: Blocked, waited for it", fd);
+				continue;
+			}
+			ERROR_ERRNO("Failed to write to fd %d", fd);
+			return written ? written : -1;
+		}
+		if (ret == 0)
+			break;
+
+		written += ret;
+		// skip what has been written completely and advance into a partially written buffer
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+		TRACE("Writing to fd %d: Wrote %zd bytes, %d buffers remaining.", fd, written,
+		      iovcnt);
+	}
+
+	return written;
+}
+
 int
 fd_read(int fd, char *buf, size_t len)
 {
@@ -70,11 +140,15 @@ fd_read(int fd, char *buf, size_t len)
 		ret = read(fd, buf, remain);
 
 		if (ret < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				TRACE("Reading from fd %d: Blocked, retrying...", fd);
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    fd_poll(fd, POLLIN) == 0) {
+				TRACE("Reading from fd %d: Blocked, waited for it", fd);
 				continue;
 			}
-			return ret;
+			IF_TRUE_RETVAL(remain == len, -1);
+			break;
 		}
 
 		remain -= ret;
@@ -88,6 +162,148 @@ fd_read(int fd, char *buf, size_t len)
 	return len - remain;
 }
 
+ssize_t
+fd_write_partial(int fd, const char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = write(fd, buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (done == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				return done ? (ssize_t)done : -1;
+			break;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+ssize_t
+fd_read_partial(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = read(fd, buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (done == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				return done ? (ssize_t)done : -1;
+			break;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+struct fd_transfer {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t done;
+	bool write;
+	event_io_t *io;
+	fd_transfer_cb_t cb;
+	void *data;
+};
+
+static void
+fd_transfer_finish(fd_transfer_t *transfer, ssize_t ret)
+{
+	if (transfer->io) {
+		event_remove_io(transfer->io);
+		event_io_free(transfer->io);
+	}
+	transfer->cb(transfer->fd, ret, transfer->data);
+	mem_free(transfer);
+}
+
+/*
+ * Continues the transfer as far as possible without blocking.
+ * @return true if the transfer is finished (the callback has been invoked)
+ */
+static bool
+fd_transfer_step(fd_transfer_t *transfer)
+{
+	size_t remain = transfer->len - transfer->done;
+	char *buf = transfer->buf + transfer->done;
+	ssize_t ret = transfer->write ? fd_write_partial(transfer->fd, buf, remain) :
+					fd_read_partial(transfer->fd, buf, remain);
+
+	if (ret < 0) {
+		IF_TRUE_RETVAL(errno == EAGAIN || errno == EWOULDBLOCK, false);
+		fd_transfer_finish(transfer, transfer->done ? (ssize_t)transfer->done : -1);
+		return true;
+	}
+
+	// a partial transfer stopped because the fd would block, otherwise
+	// it is complete or ended early, e.g. on eof
+	transfer->done += ret;
+	IF_TRUE_RETVAL(ret > 0 && transfer->done < transfer->len, false);
+
+	fd_transfer_finish(transfer, transfer->done);
+	return true;
+}
+
+static void
+fd_transfer_cb(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	fd_transfer_step(data);
+}
+
+static fd_transfer_t *
+fd_transfer_new(int fd, char *buf, size_t len, bool write, fd_transfer_cb_t cb, void *data)
+{
+	ASSERT(cb);
+
+	fd_transfer_t *transfer = mem_new0(fd_transfer_t, 1);
+	transfer->fd = fd;
+	transfer->buf = buf;
+	transfer->len = len;
+	transfer->write = write;
+	transfer->cb = cb;
+	transfer->data = data;
+
+	IF_TRUE_RETVAL(fd_transfer_step(transfer), NULL);
+
+	transfer->io = event_io_new(fd, write ? EVENT_IO_WRITE : EVENT_IO_READ, &fd_transfer_cb,
+				    transfer);
+	event_add_io(transfer->io);
+	return transfer;
+}
+
+fd_transfer_t *
+fd_write_async(int fd, const char *buf, size_t len, fd_transfer_cb_t cb, void *data)
+{
+	return fd_transfer_new(fd, (char *)buf, len, true, cb, data);
+}
+
+fd_transfer_t *
+fd_read_async(int fd, char *buf, size_t len, fd_transfer_cb_t cb, void *data)
+{
+	return fd_transfer_new(fd, buf, len, false, cb, data);
+}
+
+void
+fd_transfer_cancel(fd_transfer_t *transfer)
+{
+	IF_NULL_RETURN(transfer);
+
+	event_remove_io(transfer->io);
+	event_io_free(transfer->io);
+	mem_free(transfer);
+}
+
 int
 fd_make_non_blocking(int fd)
 {
@@ -112,3 +328,16 @@ fd_is_closed(int fd)
 	errno = 0;
 	return fcntl(fd, F_GETFD) == -1 && errno == EBADF;
 }
+
+void
+fd_close_all_except(int keep_fd)
+{
+#ifdef __NR_close_range
+	if (syscall(__NR_close_range, STDERR_FILENO + 1, keep_fd - 1, 0) == 0 &&
+	    syscall(__NR_close_range, keep_fd + 1, ~0U, 0) == 0)
+		return;
+#endif
+	for (int fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++)
+		if (fd != keep_fd)
+			close(fd);
+}
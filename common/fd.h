@@ -32,29 +32,111 @@
 #define FD_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Maximum time in milliseconds fd_write(), fd_writev() and fd_read() wait for
+ * a non-blocking fd to become ready before giving up with ETIMEDOUT.
+ */
+#define FD_POLL_TIMEOUT 5000
 
 /**
  * Writes the given buffer of the given length to the given file descriptor,
- * looping over write() as necessary.
+ * looping over write() as necessary. If the fd is non-blocking, it waits in
+ * poll() for the fd to become writable, at most FD_POLL_TIMEOUT ms each time.
  *
  * @param fd the file descriptor to write to
  * @param buf pointer to the buffer
  * @param len length of the buffer
+ * @return the number of bytes written, less than len if an error occurred
+ *         after some progress, or -1 if nothing could be written
  */
 int
 fd_write(const int fd, const char *buf, size_t len);
 
+/**
+ * Writes the given buffers to the given file descriptor with as few writev()
+ * calls as possible, looping and waiting like fd_write() as necessary. The iovec
+ * array is modified to keep track of partial writes.
+ *
+ * @param fd the file descriptor to write to
+ * @param iov array of buffers to write in order
+ * @param iovcnt number of buffers in iov
+ * @return the number of bytes written, or -1 if nothing could be written
+ */
+ssize_t
+fd_writev(const int fd, struct iovec *iov, int iovcnt);
+
 /*
  * Reads the specified amount of bytes from the given file descriptor to the given buffer,
- * looping over read() as necessary.
+ * looping over read() and waiting like fd_write() as necessary.
  *
  * @param fd the file descriptor to read from
  * @param buf pointer to the buffer
  * @param number of bytes to read (must fit into given buffer!)
+ * @return the number of bytes read, less than len on eof or if an error occurred
+ *         after some progress, or -1 if nothing could be read
  */
 int
 fd_read(int fd, char *buf, size_t len);
 
+/**
+ * Writes as much of the buffer as possible without waiting for a non-blocking fd.
+ *
+ * @return the number of bytes written, or -1 if nothing could be written
+ *         (errno EAGAIN if the fd would block)
+ */
+ssize_t
+fd_write_partial(int fd, const char *buf, size_t len);
+
+/**
+ * Reads as much as available into the buffer without waiting for a non-blocking fd.
+ *
+ * @return the number of bytes read, 0 on eof, or -1 if nothing could be read
+ *         (errno EAGAIN if the fd would block)
+ */
+ssize_t
+fd_read_partial(int fd, char *buf, size_t len);
+
+typedef struct fd_transfer fd_transfer_t;
+
+/**
+ * Invoked by the event loop once an asynchronous transfer has finished.
+ *
+ * @param fd the file descriptor of the transfer
+ * @param len the number of bytes transferred, less than requested on eof or
+ *            if an error occurred after some progress, -1 if nothing was transferred
+ * @param data the data pointer given when the transfer was started
+ */
+typedef void (*fd_transfer_cb_t)(int fd, ssize_t len, void *data);
+
+/**
+ * Writes the buffer to a non-blocking fd. What can be written right away is
+ * written immediately, the rest is written from an event_io_t in the event
+ * loop whenever the fd becomes writable. The buffer must stay valid until the
+ * callback has been invoked.
+ *
+ * @return the pending transfer, or NULL if it already finished, i.e., the
+ *         callback has already been invoked
+ */
+fd_transfer_t *
+fd_write_async(int fd, const char *buf, size_t len, fd_transfer_cb_t cb, void *data);
+
+/**
+ * Reads len bytes from a non-blocking fd like fd_write_async() writes them.
+ *
+ * @return the pending transfer, or NULL if it already finished
+ */
+fd_transfer_t *
+fd_read_async(int fd, char *buf, size_t len, fd_transfer_cb_t cb, void *data);
+
+/**
+ * Stops a pending transfer without invoking its callback.
+ */
+void
+fd_transfer_cancel(fd_transfer_t *transfer);
+
 /**
  * Makes the given file descriptor non-blocking by setting the O_NONBLOCK flag.
  *
@@ -73,4 +155,14 @@ fd_make_non_blocking(int fd);
 int
 fd_is_closed(int fd);
 
+/**
+ * Closes all fds but stdin, stdout, stderr and keep_fd, e.g. in a forked
+ * helper process, so that it does not hold references on sockets of its
+ * parent which would hide their eof.
+ *
+ * @param keep_fd the file descriptor which stays open
+ */
+void
+fd_close_all_except(int keep_fd);
+
 #endif // FD_H
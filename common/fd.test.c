@@ -0,0 +1,166 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "munit.h"
+
+#include "fd.h"
+#include "event.h"
+#include "logf.h"
+#include "macro.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	event_reset();
+}
+
+static MunitResult
+test_fd_partial(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int fds[2];
+	char buf[8];
+
+	munit_assert_int(pipe2(fds, O_NONBLOCK | O_CLOEXEC), ==, 0);
+
+	// nothing available is not eof
+	munit_assert_int(fd_read_partial(fds[0], buf, sizeof(buf)), ==, -1);
+	munit_assert_int(errno, ==, EAGAIN);
+
+	munit_assert_int(fd_write_partial(fds[1], "abc", 3), ==, 3);
+	munit_assert_int(fd_read_partial(fds[0], buf, sizeof(buf)), ==, 3);
+	munit_assert_memory_equal(3, buf, "abc");
+
+	// a full pipe returns the progress so far and then EAGAIN
+	char chunk[4096] = { 0 };
+	ssize_t ret;
+	while ((ret = fd_write_partial(fds[1], chunk, sizeof(chunk))) == sizeof(chunk))
+		;
+	munit_assert_int(ret, <, (ssize_t)sizeof(chunk));
+	if (ret > 0)
+		munit_assert_int(fd_write_partial(fds[1], chunk, sizeof(chunk)), ==, -1);
+	munit_assert_int(errno, ==, EAGAIN);
+
+	close(fds[1]);
+	while (fd_read_partial(fds[0], chunk, sizeof(chunk)) > 0)
+		;
+	munit_assert_int(fd_read_partial(fds[0], buf, sizeof(buf)), ==, 0);
+	close(fds[0]);
+
+	return MUNIT_OK;
+}
+
+static ssize_t transfer_len;
+
+static void
+transfer_cb(UNUSED int fd, ssize_t len, UNUSED void *data)
+{
+	transfer_len = len;
+	event_base_break(event_base_current());
+}
+
+static void
+write_cb(UNUSED event_timer_t *timer, void *data)
+{
+	int *fd = data;
+	munit_assert_int(write(*fd, "defg", 4), ==, 4);
+}
+
+static MunitResult
+test_fd_read_async(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int fds[2];
+	char buf[7] = { 0 };
+
+	munit_assert_int(pipe2(fds, O_NONBLOCK | O_CLOEXEC), ==, 0);
+	munit_assert_int(write(fds[1], "abc", 3), ==, 3);
+
+	transfer_len = 0;
+	fd_transfer_t *transfer = fd_read_async(fds[0], buf, sizeof(buf), &transfer_cb, NULL);
+	munit_assert_not_null(transfer);
+	munit_assert_int(transfer_len, ==, 0);
+
+	// the rest arrives later, the transfer resumes from the event loop
+	event_timer_t *timer = event_timer_new(20, 1, &write_cb, &fds[1]);
+	event_add_timer(timer);
+	event_loop();
+
+	munit_assert_int(transfer_len, ==, 7);
+	munit_assert_memory_equal(7, buf, "abcdefg");
+
+	event_timer_free(timer);
+
+	// a transfer which can complete right away finishes immediately
+	munit_assert_int(write(fds[1], "xy", 2), ==, 2);
+	munit_assert_null(fd_read_async(fds[0], buf, 2, &transfer_cb, NULL));
+	munit_assert_int(transfer_len, ==, 2);
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/partial",		/* name */
+		test_fd_partial,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/read async",		/* name */
+		test_fd_read_async,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite fd_suite = {
+	"/fd",			/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
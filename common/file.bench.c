@@ -0,0 +1,111 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "munit.h"
+#include "bench.h"
+
+#include "file.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_FILE_SIZE (32 * 1024 * 1024)
+
+static char *bs_values[] = { "512", "4096", "65536", "1048576", NULL };
+
+static MunitParameterEnum bs_params[] = {
+	{ "bs", bs_values },
+	{ NULL, NULL },
+};
+
+static char dir[] = "/tmp/file.bench.XXXXXX";
+static char *src, *dst;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	strcpy(dir, "/tmp/file.bench.XXXXXX");
+	munit_assert_not_null(mkdtemp(dir));
+	src = mem_printf("%s/src", dir);
+	dst = mem_printf("%s/dst", dir);
+
+	// dense input, holes would be skipped by the copy
+	uint8_t *buf = mem_alloc(BENCH_FILE_SIZE);
+	munit_rand_memory(BENCH_FILE_SIZE, buf);
+	munit_assert_int(file_write(src, (char *)buf, BENCH_FILE_SIZE), ==, BENCH_FILE_SIZE);
+	mem_free(buf);
+
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	unlink(src);
+	unlink(dst);
+	rmdir(dir);
+	mem_free(src);
+	mem_free(dst);
+}
+
+static MunitResult
+bench_file_copy(const MunitParameter params[], UNUSED void *data)
+{
+	size_t bs = strtoul(munit_parameters_get(params, "bs"), NULL, 10);
+
+	uint64_t start = bench_now_ns();
+	munit_assert_int(file_copy(src, dst, -1, bs, 0), ==, 0);
+	uint64_t elapsed = bench_now_ns() - start;
+
+	munit_assert_int(file_size(dst), ==, BENCH_FILE_SIZE);
+
+	// report per MiB copied
+	return bench_report("/file/copy", params, BENCH_FILE_SIZE >> 20, elapsed);
+}
+
+static MunitTest tests[] = {
+	{
+		"/copy",		/* name */
+		bench_file_copy,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		bs_params		/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite file_bench_suite = {
+	"/file",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
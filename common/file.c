@@ -21,6 +21,8 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <unistd.h>
 
@@ -33,8 +35,16 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <linux/fs.h>
+#include <linux/netlink.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <alloca.h>
+#include <poll.h>
+#include <time.h>
 
 /******************************************************************************/
 
@@ -78,6 +88,87 @@ file_is_blk(const char *file)
 	return !lstat(file, &s) && S_ISBLK(s.st_mode);
 }
 
+static bool
+file_blk_exists(const char *file)
+{
+	struct stat s;
+
+	// device mapper nodes may be symlinks created by udev
+	return !stat(file, &s) && S_ISBLK(s.st_mode);
+}
+
+/*
+ * Opens a socket receiving kernel uevents, which is used to get woken up
+ * once a device node has been created.
+ */
+static int
+file_uevent_sock_new(void)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+
+	int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			  NETLINK_KOBJECT_UEVENT);
+	if (sock < 0) {
+		DEBUG_ERRNO("Cannot open uevent socket");
+		return -1;
+	}
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		DEBUG_ERRNO("Cannot bind uevent socket");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static unsigned
+file_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int
+file_wait_blk(const char *file, unsigned timeout)
+{
+	IF_TRUE_RETVAL_TRACE(file_blk_exists(file), 0);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// subscribe before checking again to not miss the uevent of the device
+	int sock = file_uevent_sock_new();
+	int ret = -1;
+
+	for (unsigned elapsed = 0; elapsed < timeout; elapsed = file_elapsed_ms(&start)) {
+		if (file_blk_exists(file)) {
+			ret = 0;
+			break;
+		}
+
+		DEBUG("Waiting for block device %s (%u/%u ms)", file, elapsed, timeout);
+		if (sock < 0) {
+			usleep(1000);
+			continue;
+		}
+
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		if (poll(&pfd, 1, timeout - elapsed) < 0 && errno != EINTR)
+			break;
+
+		// any uevent may be the one of our device, just drain and check again
+		char buf[2048];
+		while (recv(sock, buf, sizeof(buf), 0) > 0)
+			;
+	}
+	if (ret < 0)
+		ret = file_blk_exists(file) ? 0 : -1;
+
+	if (sock >= 0)
+		close(sock);
+	return ret;
+}
+
 bool
 file_is_mountpoint(const char *file)
 {
@@ -101,58 +192,233 @@ file_is_socket(const char *file)
 	return !lstat(file, &s) && S_ISSOCK(s.st_mode);
 }
 
+#define FILE_COPY_BUFSIZE (1024 * 1024)
+
+/*
+ * Copies len bytes from the current position of in_fd to the current position
+ * of out_fd, or until end of file if len is negative. The buffer is a multiple
+ * of bs close to FILE_COPY_BUFSIZE.
+ */
+static int
+file_copy_buffered(int in_fd, int out_fd, off_t len, size_t bs)
+{
+	size_t bufsize = MAX(bs, (FILE_COPY_BUFSIZE / bs) * bs);
+	char *buf = mem_alloc(bufsize);
+	int ret = 0;
+
+	while (len != 0) {
+		size_t n = (len > 0 && (off_t)bufsize > len) ? (size_t)len : bufsize;
+		ssize_t rlen = read(in_fd, buf, n);
+
+		if (rlen < 0 && errno == EINTR)
+			continue;
+		if (rlen < 0) {
+			ret = -1;
+			break;
+		}
+		if (rlen == 0)
+			break;
+		if (fd_write(out_fd, buf, rlen) != rlen) {
+			ret = -1;
+			break;
+		}
+		if (len > 0)
+			len -= rlen;
+	}
+
+	mem_free(buf);
+	return ret;
+}
+
+/*
+ * Copies len bytes at offset off of in_fd to offset out_off of out_fd. The
+ * data is moved inside the kernel with copy_file_range() or sendfile() as
+ * long as the involved file systems support it (*method is lowered on the
+ * first failure), otherwise through a userspace buffer.
+ */
+static int
+file_copy_range(int in_fd, off_t off, int out_fd, off_t out_off, off_t len, size_t bs,
+		int *method)
+{
+	while (len > 0 && *method == 2) {
+		ssize_t n = copy_file_range(in_fd, &off, out_fd, &out_off, len, 0);
+		if (n > 0) {
+			len -= n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n == 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+			   errno == EOPNOTSUPP || errno == EBADF) {
+			TRACE_ERRNO("copy_file_range not usable, falling back to sendfile");
+			*method = 1;
+		} else {
+			return -1;
+		}
+	}
+	while (len > 0 && *method == 1) {
+		if (lseek(out_fd, out_off, SEEK_SET) < 0)
+			return -1;
+		ssize_t n = sendfile(out_fd, in_fd, &off, MIN(len, (off_t)0x7ffff000));
+		if (n > 0) {
+			len -= n;
+			out_off += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n == 0 || errno == ENOSYS || errno == EINVAL) {
+			TRACE_ERRNO("sendfile not usable, falling back to buffered copy");
+			*method = 0;
+		} else {
+			return -1;
+		}
+	}
+	if (len > 0) {
+		if (lseek(in_fd, off, SEEK_SET) < 0 || lseek(out_fd, out_off, SEEK_SET) < 0)
+			return -1;
+		return file_copy_buffered(in_fd, out_fd, len, bs);
+	}
+	return 0;
+}
+
+/*
+ * Copies len bytes of the regular file in_fd to offset out_off of out_fd.
+ * If out_fd is a regular file, only the data segments reported by SEEK_DATA
+ * and SEEK_HOLE are copied and the holes are kept by extending the file at
+ * the end, thus sparse images do not inflate.
+ */
+static int
+file_copy_regular(int in_fd, int out_fd, off_t out_off, off_t len, size_t bs, bool sparse)
+{
+	int method = 2;
+	off_t off = 0;
+
+	while (off < len) {
+		off_t data = off, hole = len;
+
+		if (sparse) {
+			data = lseek(in_fd, off, SEEK_DATA);
+			if (data < 0 && errno == ENXIO) {
+				break; // only a hole until end of file
+			} else if (data < 0) {
+				TRACE_ERRNO("SEEK_DATA not supported, copying all data");
+				sparse = false;
+				data = off;
+			} else {
+				hole = lseek(in_fd, data, SEEK_HOLE);
+				if (hole < 0)
+					hole = len;
+			}
+		}
+		if (data >= len)
+			break;
+		hole = MIN(hole, len);
+
+		if (file_copy_range(in_fd, data, out_fd, out_off + data, hole - data, bs,
+				    &method) < 0)
+			return -1;
+		off = hole;
+	}
+
+	if (sparse && ftruncate(out_fd, out_off + len) < 0)
+		return -1;
+
+	return 0;
+}
+
+int
+file_clone(const char *in_file, const char *out_file)
+{
+	IF_NULL_RETVAL(in_file, -1);
+	IF_NULL_RETVAL(out_file, -1);
+
+#ifdef FICLONE
+	int in_fd = open(in_file, O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		DEBUG_ERRNO("Could not open input file %s", in_file);
+		return -1;
+	}
+
+	int out_fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 00666);
+	if (out_fd < 0) {
+		DEBUG_ERRNO("Could not create output file %s", out_file);
+		close(in_fd);
+		return -1;
+	}
+
+	int ret = ioctl(out_fd, FICLONE, in_fd);
+	if (ret < 0) {
+		int err = errno;
+		DEBUG_ERRNO("Could not clone %s to %s", in_file, out_file);
+		unlink(out_file);
+		errno = err;
+	}
+
+	close(out_fd);
+	close(in_fd);
+	return ret < 0 ? -1 : 0;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
 int
 file_copy(const char *in_file, const char *out_file, ssize_t count, size_t bs, off_t seek)
 {
 	int in_fd, out_fd, ret = 0;
-	ssize_t i;
-	unsigned char *buf;
+	struct stat in_st, out_st;
 
 	IF_NULL_RETVAL(in_file, -1);
 	IF_NULL_RETVAL(out_file, -1);
 	IF_FALSE_RETVAL(bs, -1);
 
-	in_fd = open(in_file, O_RDONLY);
+	in_fd = open(in_file, O_RDONLY | O_CLOEXEC);
 	if (in_fd < 0) {
 		DEBUG("Could not open input file %s", in_file);
 		return -1;
 	}
 
-	out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 00666);
+	out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00666);
 	if (out_fd < 0) {
 		DEBUG("Could not open output file %s", out_file);
 		close(in_fd);
 		return -1;
 	}
 
-	buf = alloca(bs); // TODO: use mem_new for big bs...
-
-	ret = lseek(out_fd, seek * bs, SEEK_SET);
-	if (ret < 0) {
-		DEBUG("Could not lseek in output file %s", out_file);
+	if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0) {
+		DEBUG_ERRNO("Could not stat %s or %s", in_file, out_file);
+		ret = -1;
 		goto out;
 	}
 
-	for (i = 0; i != count; i++) {
-		ssize_t len;
-
-		len = read(in_fd, buf, bs);
-
-		if (len == 0) {
-			goto out;
-		} else if (len < 0) {
-			DEBUG("Could not read from input file %s", in_file);
+	if (!S_ISREG(in_st.st_mode)) {
+		// devices and pipes have no usable size, stream them until end of file
+		if (lseek(out_fd, seek * bs, SEEK_SET) < 0) {
+			DEBUG("Could not lseek in output file %s", out_file);
 			ret = -1;
 			goto out;
-		} else /* if (len > 0) */ {
-			if (write(out_fd, buf, len) < 0) {
-				DEBUG("Could not write to output file %s", out_file);
-				ret = -1;
-				goto out;
-			}
 		}
+		ret = file_copy_buffered(in_fd, out_fd, count < 0 ? -1 : (off_t)(count * bs), bs);
+		if (ret < 0)
+			DEBUG_ERRNO("Could not copy %s to %s", in_file, out_file);
+		goto out;
 	}
 
+	off_t len = in_st.st_size;
+	if (count >= 0 && (off_t)count * (off_t)bs < len)
+		len = (off_t)count * bs;
+
+#ifdef FICLONE
+	// a reflink shares the extents of the source on btrfs and xfs, nothing is copied
+	if (seek == 0 && len == in_st.st_size && S_ISREG(out_st.st_mode) &&
+	    ioctl(out_fd, FICLONE, in_fd) == 0) {
+		TRACE("Cloned %s to %s", in_file, out_file);
+		goto out;
+	}
+#endif
+
+	ret = file_copy_regular(in_fd, out_fd, seek * bs, len, bs, S_ISREG(out_st.st_mode));
+	if (ret < 0)
+		DEBUG_ERRNO("Could not copy %s to %s", in_file, out_file);
+
 out:
 	close(out_fd);
 	close(in_fd);
@@ -304,6 +570,127 @@ file_read_new(const char *file, size_t maxlen)
 	return buf;
 }
 
+#define FILE_MAP_READ_CHUNK 4096
+
+struct file_map {
+	const uint8_t *data;
+	size_t size;
+	bool mapped; //!< data is mapped, otherwise it is a heap buffer
+	unsigned refs;
+};
+
+/*
+ * Reads the whole fd into a heap buffer, for files which do not report their
+ * size such as in procfs.
+ */
+static int
+file_map_read(int fd, file_map_t *map)
+{
+	size_t size = FILE_MAP_READ_CHUNK, len = 0;
+	uint8_t *buf = mem_alloc(size);
+
+	for (;;) {
+		if (len == size) {
+			size *= 2;
+			buf = mem_renew(uint8_t, buf, size);
+		}
+		ssize_t ret = read(fd, buf + len, size - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			mem_free(buf);
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+
+	map->data = buf;
+	map->size = len;
+	map->mapped = false;
+	return 0;
+}
+
+file_map_t *
+file_map_ro(const char *file)
+{
+	struct stat s;
+
+	IF_NULL_RETVAL(file, NULL);
+
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		DEBUG_ERRNO("Could not open input file %s", file);
+		return NULL;
+	}
+	if (fstat(fd, &s) < 0) {
+		DEBUG_ERRNO("Could not stat input file %s", file);
+		close(fd);
+		return NULL;
+	}
+
+	file_map_t *map = mem_new0(file_map_t, 1);
+	map->refs = 1;
+
+	if (S_ISREG(s.st_mode) && s.st_size > 0 && (uint64_t)s.st_size <= SIZE_MAX) {
+		void *addr = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+			map->data = addr;
+			map->size = s.st_size;
+			map->mapped = true;
+			close(fd);
+			return map;
+		}
+		// e.g. a large file on a 32 bit system
+		DEBUG_ERRNO("Could not map input file %s, reading it", file);
+	}
+
+	if (file_map_read(fd, map) < 0) {
+		DEBUG_ERRNO("Could not read from input file %s", file);
+		mem_free(map);
+		map = NULL;
+	}
+	close(fd);
+	return map;
+}
+
+const uint8_t *
+file_map_data(const file_map_t *map)
+{
+	ASSERT(map);
+	return map->data;
+}
+
+size_t
+file_map_size(const file_map_t *map)
+{
+	ASSERT(map);
+	return map->size;
+}
+
+file_map_t *
+file_map_ref(file_map_t *map)
+{
+	IF_NULL_RETVAL(map, NULL);
+	__atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+	return map;
+}
+
+void
+file_map_unref(file_map_t *map)
+{
+	IF_NULL_RETURN(map);
+	IF_TRUE_RETURN(__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) > 0);
+
+	void *data = (void *)map->data;
+	if (map->mapped)
+		munmap(data, map->size);
+	else
+		mem_free(data);
+	mem_free(map);
+}
+
 off_t
 file_size(const char *file)
 {
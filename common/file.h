@@ -31,6 +31,8 @@
 #define FILE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 bool
@@ -48,18 +50,45 @@ file_is_dir(const char *file);
 bool
 file_is_blk(const char *file);
 
+/**
+ * Waits until the block device node appears in the dev file system, e.g.,
+ * of a loop or device mapper device. Instead of polling, the function sleeps
+ * until the next kernel uevent.
+ * @param file The path of the device node.
+ * @param timeout The timeout in milliseconds.
+ * @return 0 if the device node appeared, else -1.
+ */
+int
+file_wait_blk(const char *file, unsigned timeout);
+
 bool
 file_is_mountpoint(const char *file);
 
 bool
 file_is_socket(const char *file);
 
+/**
+ * Clone a regular file by reflinking its extents (FICLONE), thus no data is copied
+ * and both files share their storage until one of them is modified. This is only
+ * supported by some file systems, e.g., btrfs and xfs. Nothing is copied as a
+ * fallback, use file_copy() instead if a copy is acceptable as well.
+ * @param in_file The file to be cloned.
+ * @param out_file The clone to be created, must not exist.
+ * @return -1 on error (errno is EOPNOTSUPP, EXDEV or EINVAL if the file system
+ *         does not support reflinks) else 0.
+ */
+int
+file_clone(const char *in_file, const char *out_file);
+
 /**
  * Copy a file.
+ * Regular files are reflinked if possible (FICLONE), otherwise copied inside the
+ * kernel (copy_file_range/sendfile) with a buffered copy as last resort. Holes of
+ * a regular input file are preserved if the output is a regular file as well.
  * @param in_file The file to be read.
  * @param out_file The file to be written.
  * @param count Copy count input blocks, may be -1 to copy until end of file.
- * @param bs Read and write up to bs bytes at a time.
+ * @param bs Block size for count and seek, buffered copies use a multiple of it.
  * @param seek Skip seek blocks at start of output.
  * @return -1 on error else 0.
  */
@@ -133,6 +162,49 @@ file_read(const char *file, char *buf, size_t len);
 char *
 file_read_new(const char *file, size_t maxlen);
 
+/**
+ * Read-only view of the content of a file, e.g. a config, certificate or
+ * signature which is hashed and parsed without copying it to the heap first.
+ * Views are reference counted and may be shared between threads.
+ */
+typedef struct file_map file_map_t;
+
+/**
+ * Maps a file read-only. Regular files are mapped from the page cache, files
+ * without a size (e.g. in procfs) or which cannot be mapped are read into a
+ * buffer instead. The file must not be truncated while it is mapped, thus
+ * files should be replaced by a rename instead of being rewritten in place.
+ * @param file The file name.
+ * @return The view with a reference count of 1 or NULL on error.
+ */
+file_map_t *
+file_map_ro(const char *file);
+
+/**
+ * Returns the content of the view, which is not nul terminated.
+ */
+const uint8_t *
+file_map_data(const file_map_t *map);
+
+/**
+ * Returns the size of the view in bytes.
+ */
+size_t
+file_map_size(const file_map_t *map);
+
+/**
+ * Takes another reference to the view.
+ * @return map
+ */
+file_map_t *
+file_map_ref(file_map_t *map);
+
+/**
+ * Drops a reference to the view, which is unmapped with the last one.
+ */
+void
+file_map_unref(file_map_t *map);
+
 /**
  * Return the size of the given file or -1 on error.
  * @param file The file name.
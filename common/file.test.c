@@ -0,0 +1,245 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "munit.h"
+
+#include "file.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HOLE_SIZE (4 * 1024 * 1024)
+
+static char dir[] = "/tmp/file.test.XXXXXX";
+static char *src, *dst;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	strcpy(dir, "/tmp/file.test.XXXXXX");
+	munit_assert_not_null(mkdtemp(dir));
+	src = mem_printf("%s/src", dir);
+	dst = mem_printf("%s/dst", dir);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	unlink(src);
+	unlink(dst);
+	rmdir(dir);
+	mem_free(src);
+	mem_free(dst);
+}
+
+static MunitResult
+test_copy_sparse(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// data, a large hole, data and a trailing hole
+	int fd = open(src, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	munit_assert_int(fd, >=, 0);
+	munit_assert_int(pwrite(fd, "head", 4, 0), ==, 4);
+	munit_assert_int(pwrite(fd, "tail", 4, HOLE_SIZE), ==, 4);
+	munit_assert_int(ftruncate(fd, 2 * HOLE_SIZE), ==, 0);
+	close(fd);
+
+	munit_assert_int(file_copy(src, dst, -1, 512, 0), ==, 0);
+
+	struct stat st;
+	munit_assert_int(stat(dst, &st), ==, 0);
+	munit_assert_int(st.st_size, ==, 2 * HOLE_SIZE);
+	// holes must not be written out (with a reflink nothing is allocated at all)
+	munit_assert_int(st.st_blocks * 512, <, HOLE_SIZE);
+
+	char buf[4];
+	fd = open(dst, O_RDONLY);
+	munit_assert_int(pread(fd, buf, 4, 0), ==, 4);
+	munit_assert_memory_equal(4, buf, "head");
+	munit_assert_int(pread(fd, buf, 4, HOLE_SIZE), ==, 4);
+	munit_assert_memory_equal(4, buf, "tail");
+	munit_assert_int(pread(fd, buf, 4, HOLE_SIZE / 2), ==, 4);
+	munit_assert_memory_equal(4, buf, "\0\0\0\0");
+	close(fd);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_copy_count_seek(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	munit_assert_int(file_write(src, "0123456789", -1), ==, 10);
+
+	// copy two blocks of four bytes to the second block of the output
+	munit_assert_int(file_copy(src, dst, 2, 4, 1), ==, 0);
+	munit_assert_int(file_size(dst), ==, 12);
+
+	char buf[12];
+	munit_assert_int(file_read(dst, buf, sizeof(buf)), ==, 12);
+	munit_assert_memory_equal(4, buf, "\0\0\0\0");
+	munit_assert_memory_equal(8, buf + 4, "01234567");
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_clone(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	munit_assert_int(file_write(src, "0123456789", -1), ==, 10);
+
+	if (file_clone(src, dst) < 0) {
+		// e.g. tmpfs or ext4 do not support reflinks, no partial clone must be left
+		munit_assert_true(errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL ||
+				  errno == ENOTTY);
+		munit_assert_false(file_exists(dst));
+		return MUNIT_OK;
+	}
+
+	char buf[10];
+	munit_assert_int(file_read(dst, buf, sizeof(buf)), ==, 10);
+	munit_assert_memory_equal(10, buf, "0123456789");
+	// an existing file is never overwritten
+	munit_assert_int(file_clone(src, dst), ==, -1);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_map_ro(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	const char content[] = "signed config";
+
+	munit_assert_int(file_write(src, content, strlen(content)), ==, (int)strlen(content));
+	file_map_t *map = file_map_ro(src);
+	munit_assert_not_null(map);
+	munit_assert_size(file_map_size(map), ==, strlen(content));
+	munit_assert_memory_equal(strlen(content), file_map_data(map), content);
+
+	// the view stays valid until the last reference is dropped
+	munit_assert_ptr_equal(file_map_ref(map), map);
+	file_map_unref(map);
+	munit_assert_memory_equal(strlen(content), file_map_data(map), content);
+	file_map_unref(map);
+
+	// empty files and files without a size are read instead
+	munit_assert_int(file_write(dst, "", 0), ==, 0);
+	map = file_map_ro(dst);
+	munit_assert_not_null(map);
+	munit_assert_size(file_map_size(map), ==, 0);
+	file_map_unref(map);
+
+	map = file_map_ro("/proc/self/status");
+	munit_assert_not_null(map);
+	munit_assert_size(file_map_size(map), >, 0);
+	munit_assert_memory_equal(5, file_map_data(map), "Name:");
+	file_map_unref(map);
+
+	munit_assert_null(file_map_ro("/nonexistent/file"));
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_wait_blk(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	struct timespec start, end;
+
+	// neither a missing node nor a regular file is a block device
+	munit_assert_int(file_write(src, "x", 1), ==, 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	munit_assert_int(file_wait_blk(src, 50), ==, -1);
+	munit_assert_int(file_wait_blk("/nonexistent/dev", 50), ==, -1);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// both calls give up after their timeout
+	long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	munit_assert_long(ms, >=, 100);
+	munit_assert_long(ms, <, 2000);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/copy sparse",		/* name */
+		test_copy_sparse,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/copy count seek",	/* name */
+		test_copy_count_seek,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/clone",		/* name */
+		test_clone,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/map ro",		/* name */
+		test_map_ro,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/wait blk",		/* name */
+		test_wait_blk,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite file_suite = {
+	"/file",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
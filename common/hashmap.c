@@ -0,0 +1,241 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "hashmap.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASHMAP_SIZE_MIN 16
+
+typedef struct hashmap_slot {
+	const void *key; /**< the key, NULL for a free slot */
+	void *value;
+	size_t hash;
+} hashmap_slot_t;
+
+struct hashmap {
+	hashmap_hash_t hash;
+	hashmap_equal_t equal;
+	hashmap_slot_t *slots;
+	size_t size;  /**< number of slots, a power of two */
+	size_t count; /**< number of used slots */
+};
+
+hashmap_t *
+hashmap_new(hashmap_hash_t hash, hashmap_equal_t equal)
+{
+	IF_NULL_RETVAL(hash, NULL);
+	IF_NULL_RETVAL(equal, NULL);
+
+	hashmap_t *map = mem_new0(hashmap_t, 1);
+	map->hash = hash;
+	map->equal = equal;
+	map->size = HASHMAP_SIZE_MIN;
+	map->slots = mem_new0(hashmap_slot_t, map->size);
+
+	return map;
+}
+
+hashmap_t *
+hashmap_new_str(void)
+{
+	return hashmap_new(&hashmap_str_hash, &hashmap_str_equal);
+}
+
+void
+hashmap_free(hashmap_t *map)
+{
+	IF_NULL_RETURN(map);
+
+	mem_free(map->slots);
+	mem_free(map);
+}
+
+/*
+ * Returns the index of the slot holding key or of the free slot ending its
+ * probe sequence, where key would be inserted.
+ */
+static size_t
+hashmap_find(const hashmap_t *map, const void *key, size_t hash)
+{
+	size_t mask = map->size - 1;
+
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		const hashmap_slot_t *slot = &map->slots[i];
+		if (!slot->key)
+			return i;
+		if (slot->hash == hash && map->equal(slot->key, key))
+			return i;
+	}
+}
+
+static void
+hashmap_resize(hashmap_t *map, size_t size)
+{
+	hashmap_slot_t *old_slots = map->slots;
+	size_t old_size = map->size;
+
+	map->size = size;
+	map->slots = mem_new0(hashmap_slot_t, size);
+
+	for (size_t i = 0; i < old_size; i++) {
+		if (!old_slots[i].key)
+			continue;
+		size_t j = hashmap_find(map, old_slots[i].key, old_slots[i].hash);
+		map->slots[j] = old_slots[i];
+	}
+	mem_free(old_slots);
+}
+
+void *
+hashmap_put(hashmap_t *map, const void *key, void *value)
+{
+	ASSERT(map);
+	IF_NULL_RETVAL(key, NULL);
+
+	// keep the load factor below 3/4, so probe sequences stay short
+	if (4 * (map->count + 1) > 3 * map->size)
+		hashmap_resize(map, 2 * map->size);
+
+	size_t hash = map->hash(key);
+	hashmap_slot_t *slot = &map->slots[hashmap_find(map, key, hash)];
+	void *old_value = NULL;
+
+	if (slot->key)
+		old_value = slot->value;
+	else
+		map->count++;
+
+	slot->key = key;
+	slot->value = value;
+	slot->hash = hash;
+
+	return old_value;
+}
+
+void *
+hashmap_get(const hashmap_t *map, const void *key)
+{
+	ASSERT(map);
+	IF_NULL_RETVAL(key, NULL);
+
+	const hashmap_slot_t *slot = &map->slots[hashmap_find(map, key, map->hash(key))];
+	return slot->key ? slot->value : NULL;
+}
+
+bool
+hashmap_contains(const hashmap_t *map, const void *key)
+{
+	ASSERT(map);
+	IF_NULL_RETVAL(key, false);
+
+	return map->slots[hashmap_find(map, key, map->hash(key))].key != NULL;
+}
+
+void *
+hashmap_remove(hashmap_t *map, const void *key)
+{
+	ASSERT(map);
+	IF_NULL_RETVAL(key, NULL);
+
+	size_t mask = map->size - 1;
+	size_t i = hashmap_find(map, key, map->hash(key));
+	if (!map->slots[i].key)
+		return NULL;
+
+	void *value = map->slots[i].value;
+	map->count--;
+
+	/* Shift back entries of the probe sequence which would not be found
+	 * anymore once slot i is free, i.e. whose home slot is not in (i, j]. */
+	for (size_t j = (i + 1) & mask;; j = (j + 1) & mask) {
+		hashmap_slot_t *slot = &map->slots[j];
+		if (!slot->key)
+			break;
+		size_t home = slot->hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			map->slots[i] = *slot;
+			i = j;
+		}
+	}
+	memset(&map->slots[i], 0, sizeof(hashmap_slot_t));
+
+	return value;
+}
+
+void
+hashmap_clear(hashmap_t *map)
+{
+	ASSERT(map);
+
+	memset(map->slots, 0, map->size * sizeof(hashmap_slot_t));
+	map->count = 0;
+}
+
+size_t
+hashmap_count(const hashmap_t *map)
+{
+	ASSERT(map);
+	return map->count;
+}
+
+bool
+hashmap_next(const hashmap_t *map, size_t *iter, const void **key, void **value)
+{
+	ASSERT(map);
+	ASSERT(iter);
+
+	for (; *iter < map->size; (*iter)++) {
+		const hashmap_slot_t *slot = &map->slots[*iter];
+		if (!slot->key)
+			continue;
+		if (key)
+			*key = slot->key;
+		if (value)
+			*value = slot->value;
+		(*iter)++;
+		return true;
+	}
+	return false;
+}
+
+size_t
+hashmap_str_hash(const void *key)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (const unsigned char *p = key; *p; p++) {
+		hash ^= *p;
+		hash *= 0x100000001b3ULL;
+	}
+	return (size_t)hash;
+}
+
+bool
+hashmap_str_equal(const void *key1, const void *key2)
+{
+	return !strcmp(key1, key2);
+}
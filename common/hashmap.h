@@ -0,0 +1,127 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file hashmap.h
+ *
+ * Implements a hash map with open addressing and linear probing. Keys and
+ * values are not copied, thus a key must stay valid and unchanged as long as
+ * it is part of the map. The hash and compare functions for the keys are
+ * given on creation, hashmap_new_str() creates a map with string keys.
+ *
+ * Removal shifts the following entries of the probe sequence back, thus the
+ * map does not degrade by tombstones.
+ */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct hashmap hashmap_t;
+
+typedef size_t (*hashmap_hash_t)(const void *key);
+typedef bool (*hashmap_equal_t)(const void *key1, const void *key2);
+
+/**
+ * Creates an empty hash map using the given hash and compare functions.
+ */
+hashmap_t *
+hashmap_new(hashmap_hash_t hash, hashmap_equal_t equal);
+
+/**
+ * Creates an empty hash map with NUL terminated strings as keys.
+ */
+hashmap_t *
+hashmap_new_str(void);
+
+/**
+ * Frees the map. Keys and values are left untouched.
+ */
+void
+hashmap_free(hashmap_t *map);
+
+/**
+ * Inserts value for key. An existing value for an equal key is replaced,
+ * together with its key.
+ *
+ * @return The replaced value or NULL if there was none.
+ */
+void *
+hashmap_put(hashmap_t *map, const void *key, void *value);
+
+/**
+ * Returns the value for key or NULL if key is not part of the map.
+ */
+void *
+hashmap_get(const hashmap_t *map, const void *key);
+
+/**
+ * Returns true if and only if key is part of the map.
+ */
+bool
+hashmap_contains(const hashmap_t *map, const void *key);
+
+/**
+ * Removes key from the map.
+ *
+ * @return The value which was stored for key or NULL if there was none.
+ */
+void *
+hashmap_remove(hashmap_t *map, const void *key);
+
+/**
+ * Removes all entries from the map.
+ */
+void
+hashmap_clear(hashmap_t *map);
+
+/**
+ * Returns the number of entries of the map.
+ */
+size_t
+hashmap_count(const hashmap_t *map);
+
+/**
+ * Iterates over the entries in no particular order. *iter must be 0 for the
+ * first call. The map must not be modified during the iteration.
+ *
+ * @return true if key and value were set to the next entry, false at the end.
+ */
+bool
+hashmap_next(const hashmap_t *map, size_t *iter, const void **key, void **value);
+
+/**
+ * FNV-1a hash of a NUL terminated string, to be used as hashmap_hash_t.
+ */
+size_t
+hashmap_str_hash(const void *key);
+
+/**
+ * Compares two NUL terminated strings, to be used as hashmap_equal_t.
+ */
+bool
+hashmap_str_equal(const void *key1, const void *key2);
+
+#endif /* HASHMAP_H */
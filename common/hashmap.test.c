@@ -0,0 +1,169 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "hashmap.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdint.h>
+
+#define N_KEYS 1000
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	// No clean-up needed for now
+}
+
+
+static MunitResult
+test_hashmap_str(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	hashmap_t *map = hashmap_new_str();
+	char *keys[N_KEYS];
+	int values[N_KEYS];
+
+	for (int i = 0; i < N_KEYS; i++) {
+		keys[i] = mem_printf("key-%d", i);
+		values[i] = i;
+		munit_assert_null(hashmap_put(map, keys[i], &values[i]));
+	}
+	munit_assert_size(hashmap_count(map), ==, N_KEYS);
+
+	// lookups use equal keys, not the very same pointers
+	char *key = mem_strdup("key-123");
+	munit_assert_ptr_equal(hashmap_get(map, key), &values[123]);
+	munit_assert_null(hashmap_get(map, "key-1000"));
+	munit_assert_false(hashmap_contains(map, "key"));
+
+	// replacing returns the old value
+	int other = -1;
+	munit_assert_ptr_equal(hashmap_put(map, key, &other), &values[123]);
+	munit_assert_ptr_equal(hashmap_get(map, "key-123"), &other);
+	munit_assert_size(hashmap_count(map), ==, N_KEYS);
+	munit_assert_ptr_equal(hashmap_remove(map, "key-123"), &other);
+	munit_assert_null(hashmap_remove(map, "key-123"));
+	mem_free(key);
+
+	// remove every third key, all others must still be found
+	for (int i = 0; i < N_KEYS; i += 3) {
+		if (i != 123)
+			munit_assert_ptr_equal(hashmap_remove(map, keys[i]), &values[i]);
+	}
+	for (int i = 0; i < N_KEYS; i++) {
+		if (i % 3 && i != 123)
+			munit_assert_ptr_equal(hashmap_get(map, keys[i]), &values[i]);
+		else
+			munit_assert_false(hashmap_contains(map, keys[i]));
+	}
+
+	size_t n = 0, iter = 0;
+	const void *k;
+	void *v;
+	while (hashmap_next(map, &iter, &k, &v)) {
+		munit_assert_ptr_equal(hashmap_get(map, k), v);
+		n++;
+	}
+	munit_assert_size(n, ==, hashmap_count(map));
+
+	hashmap_clear(map);
+	munit_assert_size(hashmap_count(map), ==, 0);
+	munit_assert_null(hashmap_get(map, keys[1]));
+
+	for (int i = 0; i < N_KEYS; i++)
+		mem_free(keys[i]);
+	hashmap_free(map);
+	return MUNIT_OK;
+}
+
+static size_t
+collide_hash(UNUSED const void *key)
+{
+	return 7;
+}
+
+static bool
+uint_equal(const void *key1, const void *key2)
+{
+	return key1 == key2;
+}
+
+static MunitResult
+test_hashmap_collisions(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// all keys share one probe sequence which wraps around the end of the table
+	hashmap_t *map = hashmap_new(&collide_hash, &uint_equal);
+
+	for (uintptr_t i = 1; i <= 10; i++)
+		hashmap_put(map, (void *)i, (void *)(i * 10));
+
+	for (uintptr_t i = 1; i <= 10; i += 2)
+		munit_assert_ptr_equal(hashmap_remove(map, (void *)i), (void *)(i * 10));
+	for (uintptr_t i = 2; i <= 10; i += 2)
+		munit_assert_ptr_equal(hashmap_get(map, (void *)i), (void *)(i * 10));
+	munit_assert_size(hashmap_count(map), ==, 5);
+
+	hashmap_free(map);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/string keys",		/* name */
+		test_hashmap_str,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/collisions",		 /* name */
+		test_hashmap_collisions, /* test */
+		setup,			 /* setup */
+		tear_down,		 /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	 /* options */
+		NULL			 /* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite hashmap_suite = {
+	"/hashmap",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
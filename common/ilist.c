@@ -0,0 +1,171 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "ilist.h"
+#include "macro.h"
+
+void
+ilist_init(ilist_t *list)
+{
+	ASSERT(list);
+
+	list->head = NULL;
+	list->tail = NULL;
+	list->len = 0;
+}
+
+void
+ilist_append(ilist_t *list, ilist_node_t *node)
+{
+	ASSERT(list);
+	ASSERT(node);
+
+	node->next = NULL;
+	node->prev = list->tail;
+
+	if (list->tail)
+		list->tail->next = node;
+	else
+		list->head = node;
+
+	list->tail = node;
+	list->len++;
+}
+
+void
+ilist_prepend(ilist_t *list, ilist_node_t *node)
+{
+	ASSERT(list);
+	ASSERT(node);
+
+	node->prev = NULL;
+	node->next = list->head;
+
+	if (list->head)
+		list->head->prev = node;
+	else
+		list->tail = node;
+
+	list->head = node;
+	list->len++;
+}
+
+void
+ilist_unlink(ilist_t *list, ilist_node_t *node)
+{
+	ASSERT(list);
+	ASSERT(node);
+	ASSERT(list->len > 0);
+
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		list->head = node->next; // node was the head
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		list->tail = node->prev; // node was the tail
+
+	node->next = NULL;
+	node->prev = NULL;
+	list->len--;
+}
+
+ilist_node_t *
+ilist_pop(ilist_t *list)
+{
+	ASSERT(list);
+
+	ilist_node_t *node = list->head;
+	if (node)
+		ilist_unlink(list, node);
+	return node;
+}
+
+void
+ilist_splice(ilist_t *list, ilist_t *from)
+{
+	ASSERT(list);
+	ASSERT(from);
+
+	if (!from->head)
+		return;
+
+	if (list->tail) {
+		list->tail->next = from->head;
+		from->head->prev = list->tail;
+	} else {
+		list->head = from->head;
+	}
+	list->tail = from->tail;
+	list->len += from->len;
+
+	ilist_init(from);
+}
+
+bool
+ilist_contains(const ilist_t *list, const ilist_node_t *node)
+{
+	ASSERT(list);
+	IF_NULL_RETVAL(node, false);
+
+	ilist_foreach(list, n) {
+		if (n == node)
+			return true;
+	}
+	return false;
+}
+
+ilist_node_t *
+ilist_nth(const ilist_t *list, unsigned int n)
+{
+	ASSERT(list);
+
+	if (n >= list->len)
+		return NULL;
+
+	// walk from the closer end
+	ilist_node_t *node;
+	if (n < list->len / 2) {
+		for (node = list->head; n > 0; n--)
+			node = node->next;
+	} else {
+		for (node = list->tail, n = list->len - 1 - n; n > 0; n--)
+			node = node->prev;
+	}
+	return node;
+}
+
+unsigned int
+ilist_length(const ilist_t *list)
+{
+	ASSERT(list);
+	return list->len;
+}
+
+bool
+ilist_is_empty(const ilist_t *list)
+{
+	ASSERT(list);
+	return list->head == NULL;
+}
@@ -0,0 +1,139 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file ilist.h
+ *
+ * Implements an intrusive doubly linked list. In contrast to list.h, the
+ * elements embed an ilist_node_t and the list header keeps head and tail, so
+ * appending, prepending and unlinking are O(1) and need no allocation.
+ * The element containing a node is obtained with ilist_entry().
+ *
+ * A node must be linked into at most one list at a time, but an element may
+ * embed several nodes to be part of several lists.
+ */
+
+#ifndef ILIST_H
+#define ILIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct ilist_node ilist_node_t;
+struct ilist_node {
+	ilist_node_t *next;
+	ilist_node_t *prev;
+};
+
+typedef struct ilist {
+	ilist_node_t *head;
+	ilist_node_t *tail;
+	unsigned int len;
+} ilist_t;
+
+#define ILIST_INITIALIZER                                                                          \
+	{                                                                                          \
+		.head = NULL, .tail = NULL, .len = 0                                               \
+	}
+
+/**
+ * Returns a pointer to the element of the given type which embeds node as member.
+ */
+#define ilist_entry(node, type, member) ((type *)((char *)(node)-offsetof(type, member)))
+
+/**
+ * Iterates over all nodes of the list. The current node must not be unlinked.
+ */
+#define ilist_foreach(list, node) for (ilist_node_t *node = (list)->head; node; node = node->next)
+
+/**
+ * Iterates over all nodes of the list. The current node may be unlinked (and freed).
+ */
+#define ilist_foreach_safe(list, node, tmp)                                                        \
+	for (ilist_node_t *node = (list)->head, *tmp = node ? node->next : NULL; node;            \
+	     node = tmp, tmp = node ? node->next : NULL)
+
+/**
+ * Initializes an empty list.
+ */
+void
+ilist_init(ilist_t *list);
+
+/**
+ * Puts node at the end of the list so that it becomes the new list tail.
+ */
+void
+ilist_append(ilist_t *list, ilist_node_t *node);
+
+/**
+ * Puts node at the start of the list so that it becomes the new list head.
+ */
+void
+ilist_prepend(ilist_t *list, ilist_node_t *node);
+
+/**
+ * Removes node from the list. The node must be part of the list.
+ */
+void
+ilist_unlink(ilist_t *list, ilist_node_t *node);
+
+/**
+ * Removes the head of the list and returns it.
+ *
+ * @return The former head of the list or NULL if the list is empty.
+ */
+ilist_node_t *
+ilist_pop(ilist_t *list);
+
+/**
+ * Moves all nodes of from to the end of list, leaving from empty.
+ */
+void
+ilist_splice(ilist_t *list, ilist_t *from);
+
+/**
+ * Returns true if and only if node is part of the list.
+ * Note that this has to walk the list.
+ */
+bool
+ilist_contains(const ilist_t *list, const ilist_node_t *node);
+
+/**
+ * Returns the n'th node of the list or NULL if the list has fewer nodes.
+ */
+ilist_node_t *
+ilist_nth(const ilist_t *list, unsigned int n);
+
+/**
+ * Returns the number of nodes in the list.
+ */
+unsigned int
+ilist_length(const ilist_t *list);
+
+/**
+ * Returns true if the list has no nodes.
+ */
+bool
+ilist_is_empty(const ilist_t *list);
+
+#endif /* ILIST_H */
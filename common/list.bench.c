@@ -0,0 +1,120 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "munit.h"
+#include "bench.h"
+
+#include "list.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdlib.h>
+
+static char *n_values[] = { "1000", "10000", NULL };
+
+static MunitParameterEnum n_params[] = {
+	{ "n", n_values },
+	{ NULL, NULL },
+};
+
+// lookups of the last element, each one walks the whole list
+#define LIST_FIND_LOOKUPS 100
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+}
+
+static MunitResult
+bench_list_append(const MunitParameter params[], UNUSED void *data)
+{
+	int n = atoi(munit_parameters_get(params, "n"));
+	list_t *list = NULL;
+
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < n; i++)
+		list = list_append(list, (void *)(intptr_t)i);
+	uint64_t elapsed = bench_now_ns() - start;
+
+	munit_assert_uint(list_length(list), ==, n);
+	list_delete(list);
+
+	return bench_report("/list/append", params, n, elapsed);
+}
+
+static MunitResult
+bench_list_find(const MunitParameter params[], UNUSED void *data)
+{
+	int n = atoi(munit_parameters_get(params, "n"));
+	list_t *list = NULL;
+
+	for (int i = 0; i < n; i++)
+		list = list_append(list, (void *)(intptr_t)i);
+
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < LIST_FIND_LOOKUPS; i++)
+		munit_assert_not_null(list_find(list, (void *)(intptr_t)(n - 1)));
+	uint64_t elapsed = bench_now_ns() - start;
+
+	list_delete(list);
+
+	// report per visited element to compare list sizes
+	return bench_report("/list/find", params, (uint64_t)n * LIST_FIND_LOOKUPS, elapsed);
+}
+
+static MunitTest tests[] = {
+	{
+		"/append",		/* name */
+		bench_list_append,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		n_params		/* parameters */
+	},
+	{
+		"/find",		/* name */
+		bench_list_find,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		n_params		/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite list_bench_suite = {
+	"/list",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
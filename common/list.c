@@ -27,11 +27,100 @@
 #include "macro.h"
 #include "mem.h"
 
+#include <pthread.h>
+
+/*
+ * List elements are carved from slabs of LIST_SLAB_NODES elements instead of
+ * being allocated one by one. Unlinked elements are kept in a free list of the
+ * calling thread for reuse, thus most list operations do not call malloc or
+ * free at all. When a thread exits, its free elements are handed over to a
+ * global spare list, which is refilled from before a new slab is allocated.
+ * Slabs are never returned to the system.
+ */
+#define LIST_SLAB_NODES 64
+
+static __thread list_t *list_node_free_list = NULL;
+
+static pthread_mutex_t list_node_spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static list_t *list_node_spare_list = NULL;
+
+static pthread_once_t list_node_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t list_node_key;
+
+static void
+list_node_thread_exit(UNUSED void *arg)
+{
+	IF_NULL_RETURN_TRACE(list_node_free_list);
+
+	list_t *tail = list_node_free_list;
+	while (tail->next)
+		tail = tail->next;
+
+	pthread_mutex_lock(&list_node_spare_lock);
+	tail->next = list_node_spare_list;
+	list_node_spare_list = list_node_free_list;
+	pthread_mutex_unlock(&list_node_spare_lock);
+
+	list_node_free_list = NULL;
+}
+
+static void
+list_node_key_create(void)
+{
+	if (pthread_key_create(&list_node_key, &list_node_thread_exit))
+		WARN("Could not create thread key, free list elements of exiting threads are lost");
+}
+
+static void
+list_node_refill(void)
+{
+	pthread_once(&list_node_key_once, &list_node_key_create);
+	// any non NULL value makes sure the destructor is called on thread exit
+	pthread_setspecific(list_node_key, &list_node_free_list);
+
+	pthread_mutex_lock(&list_node_spare_lock);
+	list_node_free_list = list_node_spare_list;
+	list_node_spare_list = NULL;
+	pthread_mutex_unlock(&list_node_spare_lock);
+
+	if (list_node_free_list)
+		return;
+
+	list_t *slab = mem_new(list_t, LIST_SLAB_NODES);
+	for (int i = LIST_SLAB_NODES - 1; i >= 0; i--) {
+		slab[i].next = list_node_free_list;
+		list_node_free_list = &slab[i];
+	}
+}
+
+static list_t *
+list_node_new(void *data)
+{
+	if (!list_node_free_list)
+		list_node_refill();
+
+	list_t *e = list_node_free_list;
+	list_node_free_list = e->next;
+
+	e->data = data;
+	e->next = NULL;
+	e->prev = NULL;
+	return e;
+}
+
+static void
+list_node_free(list_t *e)
+{
+	e->data = NULL;
+	e->prev = NULL;
+	e->next = list_node_free_list;
+	list_node_free_list = e;
+}
+
 list_t *
 list_append(list_t *list, void *data)
 {
-	list_t *e = mem_new(list_t, 1);
-	e->data = data;
+	list_t *e = list_node_new(data);
 
 	list_t *tail = list_tail(list);
 	e->prev = tail;
@@ -90,7 +179,7 @@ list_unlink(list_t *list, list_t *elem)
 		head = elem->next; // elem was the head
 	if (elem->next)
 		elem->next->prev = elem->prev;
-	mem_free(elem);
+	list_node_free(elem);
 
 	return head;
 }
@@ -155,8 +244,7 @@ list_nth_data(list_t *list, unsigned int n)
 list_t *
 list_prepend(list_t *list, void *data)
 {
-	list_t *e = mem_new(list_t, 1);
-	e->data = data;
+	list_t *e = list_node_new(data);
 
 	e->prev = NULL;
 	e->next = list;
@@ -185,9 +273,8 @@ list_replace(list_t *list, list_t *elem, void *data)
 			list); // this also handles the case that list is NULL
 
 	list_t *head = list;
-	list_t *e = mem_new(list_t, 1);
+	list_t *e = list_node_new(data);
 
-	e->data = data;
 	e->prev = elem->prev;
 	e->next = elem->next;
 
@@ -199,7 +286,7 @@ list_replace(list_t *list, list_t *elem, void *data)
 	if (elem->next)
 		elem->next->prev = e;
 
-	mem_free(elem);
+	list_node_free(elem);
 
 	return head;
 }
@@ -0,0 +1,208 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "ilist.h"
+#include "list.h"
+#include "logf.h"
+#include "macro.h"
+
+#include <pthread.h>
+
+typedef struct {
+	int value;
+	ilist_node_t node;
+} item_t;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	// No clean-up needed for now
+}
+
+static MunitResult
+test_list_append_remove(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int values[200];
+	list_t *list = NULL;
+
+	// more elements than fit in one slab
+	for (int i = 0; i < 200; i++) {
+		values[i] = i;
+		list = list_append(list, &values[i]);
+	}
+	munit_assert_uint(list_length(list), ==, 200);
+	munit_assert_ptr_equal(list_nth_data(list, 150), &values[150]);
+
+	list = list_remove(list, &values[0]);
+	list = list_remove(list, &values[199]);
+	list = list_remove(list, &values[100]);
+	munit_assert_uint(list_length(list), ==, 197);
+	munit_assert_ptr_equal(list->data, &values[1]);
+	munit_assert_ptr_equal(list_tail(list)->data, &values[198]);
+	munit_assert_ptr_equal(list_nth_data(list, 99), &values[101]);
+
+	// unlinked elements are reused, the list stays consistent
+	list = list_prepend(list, &values[0]);
+	list = list_replace(list, list_nth(list, 1), &values[199]);
+	munit_assert_ptr_equal(list_nth_data(list, 1), &values[199]);
+	munit_assert_ptr_null(list->prev);
+	munit_assert_ptr_equal(list->next->prev, list);
+
+	list_delete(list);
+	return MUNIT_OK;
+}
+
+static void *
+list_thread(UNUSED void *arg)
+{
+	int value = 0;
+	list_t *list = NULL;
+
+	for (int i = 0; i < 100; i++)
+		list = list_append(list, &value);
+	munit_assert_uint(list_length(list), ==, 100);
+	list_delete(list);
+	return NULL;
+}
+
+static MunitResult
+test_list_threads(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	pthread_t threads[4];
+
+	for (int i = 0; i < 4; i++)
+		munit_assert_int(pthread_create(&threads[i], NULL, &list_thread, NULL), ==, 0);
+	for (int i = 0; i < 4; i++)
+		munit_assert_int(pthread_join(threads[i], NULL), ==, 0);
+
+	// elements of exited threads are handed over to other threads
+	list_thread(NULL);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_ilist(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	item_t items[5];
+	ilist_t list = ILIST_INITIALIZER;
+
+	munit_assert_true(ilist_is_empty(&list));
+	munit_assert_null(ilist_pop(&list));
+
+	for (int i = 0; i < 5; i++) {
+		items[i].value = i;
+		if (i % 2)
+			ilist_prepend(&list, &items[i].node);
+		else
+			ilist_append(&list, &items[i].node);
+	}
+
+	// 3 1 0 2 4
+	int expected[] = { 3, 1, 0, 2, 4 };
+	int n = 0;
+	ilist_foreach(&list, node) {
+		munit_assert_int(ilist_entry(node, item_t, node)->value, ==, expected[n++]);
+	}
+	munit_assert_int(n, ==, 5);
+	munit_assert_uint(ilist_length(&list), ==, 5);
+	munit_assert_ptr_equal(ilist_nth(&list, 1), &items[1].node);
+	munit_assert_ptr_equal(ilist_nth(&list, 3), &items[2].node);
+	munit_assert_null(ilist_nth(&list, 5));
+
+	// unlink head, tail and middle node while iterating
+	ilist_foreach_safe(&list, node, tmp) {
+		item_t *item = ilist_entry(node, item_t, node);
+		if (item->value != 1)
+			ilist_unlink(&list, node);
+	}
+	munit_assert_uint(ilist_length(&list), ==, 1);
+	munit_assert_ptr_equal(list.head, &items[1].node);
+	munit_assert_ptr_equal(list.tail, &items[1].node);
+	munit_assert_true(ilist_contains(&list, &items[1].node));
+	munit_assert_false(ilist_contains(&list, &items[0].node));
+
+	ilist_t other = ILIST_INITIALIZER;
+	ilist_append(&other, &items[3].node);
+	ilist_append(&other, &items[4].node);
+	ilist_splice(&list, &other);
+	munit_assert_true(ilist_is_empty(&other));
+	munit_assert_uint(ilist_length(&list), ==, 3);
+	munit_assert_ptr_equal(list.tail, &items[4].node);
+	munit_assert_ptr_equal(items[3].node.prev, &items[1].node);
+
+	munit_assert_ptr_equal(ilist_pop(&list), &items[1].node);
+	munit_assert_ptr_equal(ilist_pop(&list), &items[3].node);
+	munit_assert_ptr_equal(ilist_pop(&list), &items[4].node);
+	munit_assert_true(ilist_is_empty(&list));
+	munit_assert_null(list.tail);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/list append and remove", /* name */
+		test_list_append_remove,   /* test */
+		setup,			   /* setup */
+		tear_down,		   /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	   /* options */
+		NULL			   /* parameters */
+	},
+	{
+		"/list in threads",	/* name */
+		test_list_threads,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/intrusive list",	/* name */
+		test_ilist,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite list_suite = {
+	"/list",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -33,6 +33,8 @@
 
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <syslog.h>
@@ -144,35 +146,403 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 
 /******************************************************************************/
 
+// default number of ring buffer slots for logf_async_start
+#define LOGF_ASYNC_SLOTS 512
+// messages are truncated to this length (including the null byte) in async mode
+#define LOGF_ASYNC_MSG_LEN 512
+// size of the per handler buffer in which the writer thread collects lines for a file
+#define LOGF_ASYNC_BATCH_LEN (64 * 1024)
+// the writer thread wakes up at least this often
+#define LOGF_ASYNC_IDLE_MS 500
+// logf_async_flush gives up after this time, e.g., if a handler is stuck
+#define LOGF_ASYNC_FLUSH_TIMEOUT_MS 1000
+
 static list_t *logf_handler_list = NULL;
 
+unsigned char logf_handlers_prio = LOGF_PRIO_SILENT;
+
+typedef struct {
+	char *name;
+	logf_prio_t prio;
+} logf_module_conf_t;
+
+static logf_module_t *logf_module_list = NULL;
+static list_t *logf_module_conf_list = NULL;
+static logf_prio_t logf_module_prio = 0; //!< set for all modules, 0 for their default
+static pthread_mutex_t logf_module_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct logf_handler {
 	void (*func)(logf_prio_t prio, const char *msg, void *data);
 	void *data;
 	logf_prio_t prio;
+	char *batch; //!< lines of logf_file_write not yet written by the writer thread
+	size_t batch_len;
 };
 
-void
-logf_write(logf_prio_t prio, const char *msg)
+typedef struct {
+	unsigned long seq; //!< position for which the slot is free (pos) or filled (pos + 1)
+	logf_prio_t prio;
+	struct timeval tv;
+	char msg[LOGF_ASYNC_MSG_LEN];
+} logf_async_slot_t;
+
+/*
+ * Bounded multi producer ring buffer. Producers claim a position by a CAS on
+ * enqueue_pos and publish the slot by its sequence number, so logging never
+ * blocks on the writer thread, which is the only consumer.
+ */
+static struct {
+	logf_async_slot_t *slots;
+	unsigned long mask;
+	unsigned long enqueue_pos;
+	unsigned long dequeue_pos;
+	unsigned long dropped; //!< messages dropped since the last notice
+	unsigned long dropped_total;
+	bool running;
+	bool stop;
+	bool sleeping;
+	pid_t pid; //!< the process running the writer thread, children log synchronously
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} logf_async = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// protects logf_handler_list against the writer thread while it is running
+static pthread_mutex_t logf_handler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread bool logf_in_writer = false;
+// time the message currently dispatched was logged at, NULL for now
+static __thread const struct timeval *logf_msg_tv = NULL;
+
+static void
+logf_file_batch(logf_handler_t *h, logf_prio_t prio, const char *msg);
+
+static void
+logf_file_account(FILE *stream, size_t len);
+
+static void
+logf_handlers_update_prio(void)
+{
+	unsigned char prio = LOGF_PRIO_SILENT;
+
+	for (list_t *l = logf_handler_list; l; l = l->next) {
+		logf_handler_t *h = l->data;
+		if (h && h->func && h->prio < prio)
+			prio = h->prio;
+	}
+	logf_handlers_prio = prio;
+}
+
+static void
+logf_write_handlers(logf_prio_t prio, const char *msg)
 {
 	for (list_t *l = logf_handler_list; l; l = l->next) {
 		logf_handler_t *h = l->data;
-		if (h && h->func && prio >= h->prio) {
+		if (!h || !h->func || prio < h->prio)
+			continue;
+		if (logf_in_writer && h->func == &logf_file_write)
+			logf_file_batch(h, prio, msg);
+		else
 			(h->func)(prio, msg, h->data);
+	}
+}
+
+static bool
+logf_async_is_active(void)
+{
+	return !logf_in_writer && __atomic_load_n(&logf_async.running, __ATOMIC_ACQUIRE) &&
+	       logf_async.pid == getpid();
+}
+
+static void
+logf_async_wakeup(void)
+{
+	// pairs with the fence in logf_async_main, see there
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&logf_async.sleeping, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&logf_async.mutex);
+	pthread_cond_signal(&logf_async.cond);
+	pthread_mutex_unlock(&logf_async.mutex);
+}
+
+static void
+logf_async_enqueue(logf_prio_t prio, const char *msg)
+{
+	logf_async_slot_t *slot;
+	unsigned long pos = __atomic_load_n(&logf_async.enqueue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		slot = &logf_async.slots[pos & logf_async.mask];
+		long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&logf_async.enqueue_pos, &pos, pos + 1,
+							true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			// not yet consumed by the writer thread, the ring is full
+			__atomic_fetch_add(&logf_async.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&logf_async.enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->prio = prio;
+	gettimeofday(&slot->tv, NULL);
+	size_t len = strlen(msg);
+	if (len < sizeof(slot->msg)) {
+		memcpy(slot->msg, msg, len + 1);
+	} else {
+		memcpy(slot->msg, msg, sizeof(slot->msg) - 4);
+		memcpy(slot->msg + sizeof(slot->msg) - 4, "...", 4);
+	}
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	logf_async_wakeup();
+}
+
+static bool
+logf_async_pending(void)
+{
+	unsigned long pos = logf_async.dequeue_pos;
+	logf_async_slot_t *slot = &logf_async.slots[pos & logf_async.mask];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1 ||
+	       __atomic_load_n(&logf_async.dropped, __ATOMIC_RELAXED);
+}
+
+static void
+logf_async_write_batches(void)
+{
+	for (list_t *l = logf_handler_list; l; l = l->next) {
+		logf_handler_t *h = l->data;
+		if (!h || !h->batch_len)
+			continue;
+
+		int fd = fileno(h->data);
+		size_t done = 0;
+		while (done < h->batch_len) {
+			ssize_t n = write(fd, h->batch + done, h->batch_len - done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		h->batch_len = 0;
+		logf_file_account(h->data, done);
+	}
+}
+
+/*
+ * Dispatches all published messages to the handlers. Only called by the
+ * writer thread or, after it was joined, by logf_async_stop.
+ * @return the number of messages dispatched
+ */
+static unsigned long
+logf_async_drain(void)
+{
+	unsigned long count = 0;
+
+	pthread_mutex_lock(&logf_handler_lock);
+
+	for (;; count++) {
+		unsigned long pos = logf_async.dequeue_pos;
+		logf_async_slot_t *slot = &logf_async.slots[pos & logf_async.mask];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+
+		logf_msg_tv = &slot->tv;
+		logf_write_handlers(slot->prio, slot->msg);
+		logf_msg_tv = NULL;
+
+		__atomic_store_n(&slot->seq, pos + logf_async.mask + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&logf_async.dequeue_pos, pos + 1, __ATOMIC_RELEASE);
+	}
+
+	unsigned long dropped = __atomic_exchange_n(&logf_async.dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		char buf[64];
+		__atomic_fetch_add(&logf_async.dropped_total, dropped, __ATOMIC_RELAXED);
+		snprintf(buf, sizeof(buf), "Log buffer overflow, dropped %lu messages", dropped);
+		logf_write_handlers(LOGF_PRIO_WARN, buf);
+	}
+
+	logf_async_write_batches();
+
+	pthread_mutex_unlock(&logf_handler_lock);
+
+	return count;
+}
+
+static void *
+logf_async_main(UNUSED void *arg)
+{
+	logf_in_writer = true;
+
+	for (;;) {
+		bool stop = __atomic_load_n(&logf_async.stop, __ATOMIC_ACQUIRE);
+		if (logf_async_drain() > 0)
+			continue;
+		if (stop)
+			break;
+
+		/*
+		 * Producers only signal if they see sleeping set. Either a producer
+		 * sees it or we see its message in logf_async_pending, so no wakeup
+		 * gets lost.
+		 */
+		pthread_mutex_lock(&logf_async.mutex);
+		__atomic_store_n(&logf_async.sleeping, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!logf_async_pending() && !__atomic_load_n(&logf_async.stop, __ATOMIC_ACQUIRE)) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += LOGF_ASYNC_IDLE_MS / 1000;
+			ts.tv_nsec += (LOGF_ASYNC_IDLE_MS % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&logf_async.cond, &logf_async.mutex, &ts);
 		}
+		__atomic_store_n(&logf_async.sleeping, false, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&logf_async.mutex);
+	}
+
+	return NULL;
+}
+
+int
+logf_async_start(unsigned int slots)
+{
+	static bool atexit_registered = false;
+
+	if (logf_async_is_active())
+		return 0;
+
+	if (slots == 0)
+		slots = LOGF_ASYNC_SLOTS;
+	IF_TRUE_RETVAL((slots & (slots - 1)) != 0, -1);
+
+	if (logf_async.mask + 1 != slots) {
+		mem_free(logf_async.slots);
+		logf_async.slots = mem_new(logf_async_slot_t, slots);
+		logf_async.mask = slots - 1;
+	}
+	for (unsigned long i = 0; i < slots; i++)
+		logf_async.slots[i].seq = i;
+	logf_async.enqueue_pos = 0;
+	logf_async.dequeue_pos = 0;
+	logf_async.dropped = 0;
+	logf_async.stop = false;
+	logf_async.sleeping = false;
+	logf_async.pid = getpid();
+
+	// write batches are allocated up front, the writer thread should not need malloc
+	for (list_t *l = logf_handler_list; l; l = l->next) {
+		logf_handler_t *h = l->data;
+		if (h && h->func == &logf_file_write && h->data && !h->batch)
+			h->batch = mem_alloc(LOGF_ASYNC_BATCH_LEN);
+	}
+
+	if (pthread_create(&logf_async.thread, NULL, logf_async_main, NULL)) {
+		ERROR("Could not create log writer thread");
+		return -1;
+	}
+	__atomic_store_n(&logf_async.running, true, __ATOMIC_RELEASE);
+
+	if (!atexit_registered) {
+		atexit(logf_async_stop);
+		atexit_registered = true;
 	}
+
+	return 0;
+}
+
+void
+logf_async_flush(void)
+{
+	if (!logf_async_is_active())
+		return;
+
+	unsigned long pos = __atomic_load_n(&logf_async.enqueue_pos, __ATOMIC_ACQUIRE);
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000L };
+
+	for (int i = 0; i < LOGF_ASYNC_FLUSH_TIMEOUT_MS; i++) {
+		if ((long)(__atomic_load_n(&logf_async.dequeue_pos, __ATOMIC_ACQUIRE) - pos) >= 0 &&
+		    !__atomic_load_n(&logf_async.dropped, __ATOMIC_RELAXED))
+			return;
+		logf_async_wakeup();
+		nanosleep(&ts, NULL);
+	}
+}
+
+void
+logf_async_stop(void)
+{
+	if (!logf_async_is_active())
+		return;
+
+	__atomic_store_n(&logf_async.stop, true, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&logf_async.mutex);
+	pthread_cond_signal(&logf_async.cond);
+	pthread_mutex_unlock(&logf_async.mutex);
+	pthread_join(logf_async.thread, NULL);
+
+	__atomic_store_n(&logf_async.running, false, __ATOMIC_RELEASE);
+	// messages of producers which raced with the shutdown
+	logf_async_drain();
+}
+
+unsigned long
+logf_async_get_dropped(void)
+{
+	return __atomic_load_n(&logf_async.dropped_total, __ATOMIC_RELAXED) +
+	       __atomic_load_n(&logf_async.dropped, __ATOMIC_RELAXED);
+}
+
+void
+logf_write(logf_prio_t prio, const char *msg)
+{
+	if (!logf_async_is_active()) {
+		logf_write_handlers(prio, msg);
+		return;
+	}
+
+	if (prio < LOGF_PRIO_FATAL) {
+		logf_async_enqueue(prio, msg);
+		return;
+	}
+
+	// the process is about to abort, write everything out synchronously
+	logf_async_flush();
+	pthread_mutex_lock(&logf_handler_lock);
+	logf_write_handlers(prio, msg);
+	pthread_mutex_unlock(&logf_handler_lock);
 }
 
 logf_handler_t *
 logf_register(void (*func)(logf_prio_t prio, const char *msg, void *data), void *data)
 {
-	logf_handler_t *handler = mem_new(logf_handler_t, 1);
+	logf_handler_t *handler = mem_new0(logf_handler_t, 1);
+	bool async = logf_async_is_active();
 
 	handler->func = func;
 	handler->data = data;
 	handler->prio = LOGF_PRIO_TRACE;
+	if (async && func == &logf_file_write && data)
+		handler->batch = mem_alloc(LOGF_ASYNC_BATCH_LEN);
 
+	if (async)
+		pthread_mutex_lock(&logf_handler_lock);
 	logf_handler_list = list_append(logf_handler_list, handler);
+	if (async)
+		pthread_mutex_unlock(&logf_handler_lock);
+
+	logf_handlers_update_prio();
 
 	return handler;
 }
@@ -180,7 +550,21 @@ logf_register(void (*func)(logf_prio_t prio, const char *msg, void *data), void
 void
 logf_unregister(logf_handler_t *handler)
 {
+	bool async = logf_async_is_active();
+
+	// messages logged before should still reach the handler
+	logf_async_flush();
+
+	if (async)
+		pthread_mutex_lock(&logf_handler_lock);
 	logf_handler_list = list_remove(logf_handler_list, handler);
+	if (async)
+		pthread_mutex_unlock(&logf_handler_lock);
+
+	logf_handlers_update_prio();
+
+	if (handler)
+		mem_free(handler->batch);
 }
 
 void
@@ -188,6 +572,100 @@ logf_handler_set_prio(logf_handler_t *handler, logf_prio_t prio)
 {
 	ASSERT(handler);
 	handler->prio = prio;
+	logf_handlers_update_prio();
+}
+
+/******************************************************************************/
+
+/*
+ * Checks if the base name of file without its extension equals name.
+ */
+static bool
+logf_module_match(const char *file, const char *name)
+{
+	const char *base = strrchr(file, '/');
+	base = base ? base + 1 : file;
+
+	size_t len = strcspn(base, ".");
+	return strlen(name) == len && !strncmp(base, name, len);
+}
+
+static logf_module_conf_t *
+logf_module_conf_get(const char *name)
+{
+	for (list_t *l = logf_module_conf_list; l; l = l->next) {
+		logf_module_conf_t *conf = l->data;
+		if (!strcmp(conf->name, name))
+			return conf;
+	}
+	return NULL;
+}
+
+static logf_prio_t
+logf_module_conf_prio(const logf_module_t *module)
+{
+	for (list_t *l = logf_module_conf_list; l; l = l->next) {
+		logf_module_conf_t *conf = l->data;
+		if (logf_module_match(module->file, conf->name))
+			return conf->prio;
+	}
+	return logf_module_prio ? logf_module_prio : (logf_prio_t)module->default_prio;
+}
+
+int
+logf_module_register(logf_module_t *module, logf_prio_t prio)
+{
+	pthread_mutex_lock(&logf_module_lock);
+	if (!module->prio) {
+		module->prio = logf_module_conf_prio(module);
+		module->next = logf_module_list;
+		logf_module_list = module;
+	}
+	pthread_mutex_unlock(&logf_module_lock);
+
+	return prio >= module->prio;
+}
+
+int
+logf_module_set_prio(const char *name, logf_prio_t prio)
+{
+	if (prio < LOGF_PRIO_TRACE || prio > LOGF_PRIO_SILENT)
+		return -1;
+
+	pthread_mutex_lock(&logf_module_lock);
+
+	if (name) {
+		logf_module_conf_t *conf = logf_module_conf_get(name);
+		if (!conf) {
+			conf = mem_new0(logf_module_conf_t, 1);
+			conf->name = mem_strdup(name);
+			logf_module_conf_list = list_append(logf_module_conf_list, conf);
+		}
+		conf->prio = prio;
+	} else {
+		logf_module_prio = prio;
+	}
+
+	for (logf_module_t *module = logf_module_list; module; module = module->next)
+		module->prio = logf_module_conf_prio(module);
+
+	pthread_mutex_unlock(&logf_module_lock);
+
+	return 0;
+}
+
+logf_prio_t
+logf_module_get_prio(const char *name)
+{
+	logf_prio_t prio = logf_module_prio ? logf_module_prio : LOGF_MODULE_DEFAULT_PRIO;
+
+	pthread_mutex_lock(&logf_module_lock);
+	logf_module_conf_t *conf = name ? logf_module_conf_get(name) : NULL;
+	if (conf)
+		prio = conf->prio;
+	pthread_mutex_unlock(&logf_module_lock);
+
+	return prio;
 }
 
 /******************************************************************************/
@@ -231,29 +709,192 @@ logf_file_new(const char *name)
 	return f;
 }
 
+/*
+ * Size based rotation of the files opened by logf_file_new_rotating(). The
+ * handlers only know the stream, thus the rotation state is looked up by it.
+ */
+typedef struct {
+	FILE *stream;
+	char *name;
+	char *path; //!< current segment
+	size_t size;
+	size_t max_size;
+	size_t sync_size;
+	size_t unsynced; //!< bytes written since the last sync
+	pid_t pid;	 //!< process rotating the file, children only append
+	void (*rotated_cb)(const char *segment, void *data);
+	void *data;
+} logf_rotate_t;
+
+static list_t *logf_rotate_list = NULL;
+static pthread_mutex_t logf_rotate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *
+logf_file_new_rotating(const char *name, size_t max_size, size_t sync_size,
+		       void (*rotated_cb)(const char *segment, void *data), void *data)
+{
+	IF_TRUE_RETVAL(!max_size, NULL);
+
+	logf_rotate_t *r = mem_new0(logf_rotate_t, 1);
+	r->path = logf_file_new_name(name);
+	r->stream = fopen(r->path, "w");
+	if (!r->stream) {
+		mem_free(r->path);
+		mem_free(r);
+		return NULL;
+	}
+	r->name = mem_strdup(name);
+	r->max_size = max_size;
+	r->sync_size = sync_size;
+	r->pid = getpid();
+	r->rotated_cb = rotated_cb;
+	r->data = data;
+
+	pthread_mutex_lock(&logf_rotate_lock);
+	__atomic_store_n(&logf_rotate_list, list_append(logf_rotate_list, r), __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&logf_rotate_lock);
+
+	return r->stream;
+}
+
+void
+logf_file_free(void *file)
+{
+	IF_NULL_RETURN(file);
+
+	pthread_mutex_lock(&logf_rotate_lock);
+	for (list_t *l = logf_rotate_list; l; l = l->next) {
+		logf_rotate_t *r = l->data;
+		if (r->stream != file)
+			continue;
+		__atomic_store_n(&logf_rotate_list, list_unlink(logf_rotate_list, l),
+				 __ATOMIC_RELEASE);
+		mem_free(r->name);
+		mem_free(r->path);
+		mem_free(r);
+		break;
+	}
+	pthread_mutex_unlock(&logf_rotate_lock);
+
+	fclose(file);
+}
+
 static void
-logf_file_write_timestamp(FILE *stream)
+logf_file_sync(logf_rotate_t *r)
 {
-	char buf1[64], buf2[64];
-	struct timeval tv;
-	struct tm *tm;
+	fflush(r->stream);
+	fdatasync(fileno(r->stream));
+	r->unsynced = 0;
+}
 
-	IF_TRUE_RETURN_ERROR_ERRNO((gettimeofday(&tv, NULL) < 0));
+/*
+ * Continues the file in a new segment. The stream stays the same, its fd is
+ * replaced by the one of the new segment.
+ * @return the full segment or NULL if the file could not be rotated
+ */
+static char *
+logf_file_rotate(logf_rotate_t *r)
+{
+	logf_file_sync(r);
+
+	char *path = logf_file_new_name(r->name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0 || dup2(fd, fileno(r->stream)) < 0) {
+		// keep appending to the current segment, retry after another max_size bytes
+		if (fd >= 0)
+			close(fd);
+		mem_free(path);
+		r->size = 0;
+		return NULL;
+	}
+	close(fd);
 
-	tm = localtime(&tv.tv_sec);
-	IF_NULL_RETURN_ERROR_ERRNO(tm);
+	char *segment = r->path;
+	r->path = path;
+	r->size = 0;
+	return segment;
+}
 
-	if (!stream)
-		return;
+/*
+ * Accounts len bytes written to stream, which is rotated and synced if it was
+ * opened by logf_file_new_rotating().
+ */
+static void
+logf_file_account(FILE *stream, size_t len)
+{
+	logf_rotate_t *r = NULL;
+	char *segment = NULL;
 
-	if (!strftime(buf1, sizeof(buf1) - 1, "%Y-%m-%dT%H:%M:%S", tm))
+	if (!__atomic_load_n(&logf_rotate_list, __ATOMIC_ACQUIRE))
 		return;
 
-	if (!strftime(buf2, sizeof(buf2) - 1, "%z", tm))
-		return;
+	pthread_mutex_lock(&logf_rotate_lock);
+	for (list_t *l = logf_rotate_list; l; l = l->next) {
+		logf_rotate_t *e = l->data;
+		if (e->stream == stream) {
+			r = e;
+			break;
+		}
+	}
+	if (r && r->pid == getpid()) {
+		r->size += len;
+		r->unsynced += len;
+		if (r->size >= r->max_size)
+			segment = logf_file_rotate(r);
+		else if (r->sync_size && r->unsynced >= r->sync_size)
+			logf_file_sync(r);
+	}
+	pthread_mutex_unlock(&logf_rotate_lock);
+
+	if (segment && r->rotated_cb)
+		r->rotated_cb(segment, r->data);
+	mem_free(segment);
+}
+
+/*
+ * Formats the timestamp of the message currently logged into buf. The date
+ * part is only formatted once per second.
+ * @return the length of the timestamp or -1 on error
+ */
+static int
+logf_timestamp(char *buf, size_t len)
+{
+	static __thread time_t cached_sec = -1;
+	static __thread char date[32], zone[16];
+	struct timeval now;
+	const struct timeval *tv = logf_msg_tv;
+
+	if (!tv) {
+		if (gettimeofday(&now, NULL) < 0)
+			return -1;
+		tv = &now;
+	}
+
+	if (tv->tv_sec != cached_sec) {
+		struct tm tm;
+		if (!localtime_r(&tv->tv_sec, &tm))
+			return -1;
+		if (!strftime(date, sizeof(date) - 1, "%Y-%m-%dT%H:%M:%S", &tm))
+			return -1;
+		if (!strftime(zone, sizeof(zone) - 1, "%z", &tm))
+			return -1;
+		cached_sec = tv->tv_sec;
+	}
 
 	// rfc3339 format: 2014-05-23T21:29:11.150495+02:00
-	fprintf(stream, "%s.%06u%s ", buf1, (unsigned)tv.tv_usec, buf2);
+	return snprintf(buf, len, "%s.%06u%s ", date, (unsigned)tv->tv_usec, zone);
+}
+
+static int
+logf_file_write_timestamp(FILE *stream)
+{
+	char buf[64];
+
+	int n = stream ? logf_timestamp(buf, sizeof(buf)) : -1;
+	if (n < 0 || fputs(buf, stream) < 0)
+		return 0;
+
+	return n;
 }
 
 static const char *
@@ -283,9 +924,44 @@ logf_file_write(logf_prio_t prio, const char *msg, void *data)
 	if (!data)
 		return;
 
-	logf_file_write_timestamp(data);
-	fprintf(data, "[%u] %s %s\n", getpid(), prio_str(prio), msg);
+	int n = logf_file_write_timestamp(data);
+	int len = fprintf(data, "[%u] %s %s\n", getpid(), prio_str(prio), msg);
 	fflush(data);
+
+	if (len > 0)
+		logf_file_account(data, n + len);
+}
+
+/*
+ * Appends a line in the format of logf_file_write to the batch of the handler,
+ * which is written to its file at the end of each drain of the ring buffer.
+ */
+static void
+logf_file_batch(logf_handler_t *h, logf_prio_t prio, const char *msg)
+{
+	char prefix[128];
+
+	if (!h->batch) {
+		logf_file_write(prio, msg, h->data);
+		return;
+	}
+
+	int n = logf_timestamp(prefix, sizeof(prefix));
+	if (n < 0)
+		n = 0;
+	n += snprintf(prefix + n, sizeof(prefix) - n, "[%u] %s ", logf_async.pid, prio_str(prio));
+
+	size_t msg_len = strlen(msg);
+	size_t line_len = n + msg_len + 1;
+	if (h->batch_len + line_len > LOGF_ASYNC_BATCH_LEN)
+		logf_async_write_batches();
+	if (line_len > LOGF_ASYNC_BATCH_LEN)
+		return;
+
+	memcpy(h->batch + h->batch_len, prefix, n);
+	memcpy(h->batch + h->batch_len + n, msg, msg_len);
+	h->batch[h->batch_len + line_len - 1] = '\n';
+	h->batch_len += line_len;
 }
 
 void
@@ -52,6 +52,10 @@
  * // Log to the kernel ring buffer using tag `sometag' (may be viewed with the `dmesg' command):
  * logf_register(&logf_klog_write, logf_klog_new("sometag"));
  * @endcode
+ *
+ * Besides the compile time threshold LOGF_LOG_MIN_PRIO, each module (source file) has a runtime
+ * log level, which can be changed by logf_module_set_prio. Messages below the level of their
+ * module or below the levels of all handlers are discarded before their arguments are formatted.
  */
 
 #ifndef LOGF_H
@@ -69,6 +73,30 @@ typedef enum {
 
 typedef struct logf_handler logf_handler_t;
 
+/**
+ * Runtime log level of a module. Each translation unit has its own instance,
+ * which is registered on its first log message.
+ */
+typedef struct logf_module {
+	unsigned char prio; //!< 0 until the module is registered
+	unsigned char default_prio;
+	const char *file;
+	struct logf_module *next;
+} logf_module_t;
+
+/**
+ * The lowest priority of all registered handlers. Only used by logf_enabled.
+ */
+extern unsigned char logf_handlers_prio;
+
+/**
+ * This function is only implicitly used by logf_enabled. Registers the module
+ * and sets its configured log level.
+ * @return 1 if messages of priority prio are logged for the module, 0 otherwise
+ */
+int
+logf_module_register(logf_module_t *module, logf_prio_t prio);
+
 /**
  * This function is only implicitly used by the logging macros defined in macro.h
  */
@@ -114,42 +142,64 @@ logf_message_file_errno(logf_prio_t prio, const char *file, int line, const char
 #ifndef LOGF_LOG_MIN_PRIO
 #define LOGF_LOG_MIN_PRIO LOGF_PRIO_INFO
 #endif
+#define LOGF_MODULE_DEFAULT_PRIO LOGF_LOG_MIN_PRIO
 
 #define logf_message_guard(level, ...)                                                             \
 	do {                                                                                       \
-		if (level >= LOGF_LOG_MIN_PRIO)                                                    \
+		if (logf_enabled(level))                                                           \
 			logf_message(level, __VA_ARGS__);                                          \
 	} while (0)
 #define logf_message_errno_guard(level, ...)                                                       \
 	do {                                                                                       \
-		if (level >= LOGF_LOG_MIN_PRIO)                                                    \
+		if (logf_enabled(level))                                                           \
 			logf_message_errno(level, __VA_ARGS__);                                    \
 	} while (0)
 
 #else /* DEBUG_BUILD */
 // DEBUG BUILD: log DEBUG level and higher, include BOTH file name AND line number
 //
-// To enable TRACE for a particular module:
-// Define LOGF_LOG_MIN_PRIO before including logf.h (or macro.h):
+// TRACE messages are compiled in but disabled at runtime. To enable TRACE for a
+// particular module, use logf_module_set_prio (e.g. by `cml-control log_level trace uevent')
+// or define LOGF_LOG_MIN_PRIO before including logf.h (or macro.h):
 //      #define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 //      #include <macro.h>
 #ifndef LOGF_LOG_MIN_PRIO
-#define LOGF_LOG_MIN_PRIO LOGF_PRIO_DEBUG
+#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
+#define LOGF_MODULE_DEFAULT_PRIO LOGF_PRIO_DEBUG
+#else
+#define LOGF_MODULE_DEFAULT_PRIO LOGF_LOG_MIN_PRIO
 #endif
 
 #define logf_message_guard(level, ...)                                                             \
 	do {                                                                                       \
-		if (level >= LOGF_LOG_MIN_PRIO)                                                    \
+		if (logf_enabled(level))                                                           \
 			logf_message_file(level, __FILE__, __LINE__, __VA_ARGS__);                 \
 	} while (0)
 #define logf_message_errno_guard(level, ...)                                                       \
 	do {                                                                                       \
-		if (level >= LOGF_LOG_MIN_PRIO)                                                    \
+		if (logf_enabled(level))                                                           \
 			logf_message_file_errno(level, __FILE__, __LINE__, __VA_ARGS__);           \
 	} while (0)
 
 #endif /* DEBUG_BUILD */
 
+#if defined(__GNUC__)
+static logf_module_t logf_this_module __attribute__((unused)) = { 0, LOGF_MODULE_DEFAULT_PRIO,
+								  __BASE_FILE__, NULL };
+#else
+static logf_module_t logf_this_module = { 0, LOGF_MODULE_DEFAULT_PRIO, __FILE__, NULL };
+#endif
+
+/**
+ * Checks whether messages of priority level are logged in the current module, e.g., to
+ * skip preparing expensive debug output. Costs two byte comparisons once the module is
+ * registered, levels below LOGF_LOG_MIN_PRIO are removed at compile time.
+ */
+#define logf_enabled(level)                                                                        \
+	((level) >= LOGF_LOG_MIN_PRIO && (level) >= logf_this_module.prio &&                       \
+	 (level) >= logf_handlers_prio &&                                                          \
+	 (logf_this_module.prio || logf_module_register(&logf_this_module, level)))
+
 #define logf_fatal(...) logf_message_guard(LOGF_PRIO_FATAL, __VA_ARGS__)
 #define logf_fatal_errno(...) logf_message_errno_guard(LOGF_PRIO_FATAL, __VA_ARGS__)
 
@@ -197,6 +247,65 @@ logf_unregister(logf_handler_t *handler);
 void
 logf_handler_set_prio(logf_handler_t *handler, logf_prio_t prio);
 
+/**
+ * Sets the runtime log level of the modules (source files) with the given
+ * name, e.g., "uevent" for daemon/uevent.c. The level also applies to modules
+ * which are registered later on.
+ * Levels below LOGF_LOG_MIN_PRIO of the module have no effect.
+ *
+ * @param name Base name of the source file without extension,
+ * 	NULL to set the level of all modules without an explicitly set level.
+ * @param prio The lowest priority logged.
+ * @return 0 on success, -1 if prio is invalid
+ */
+int
+logf_module_set_prio(const char *name, logf_prio_t prio);
+
+/**
+ * Returns the runtime log level of the modules with the given name or the
+ * default level if name is NULL or has no explicitly set level.
+ */
+logf_prio_t
+logf_module_get_prio(const char *name);
+
+/**
+ * Moves the writing of log messages to a writer thread. Afterwards, logging only
+ * copies the message with its timestamp into a lock-free ring buffer, which the
+ * writer thread dispatches to the registered handlers. Lines for files are
+ * collected and written with one write per batch. Messages longer than 511
+ * characters are truncated. If the ring is full, messages are dropped and a
+ * warning with their number is logged later.
+ * FATAL messages are written synchronously after the ring has been flushed.
+ * Child processes created afterwards log synchronously. The writer thread
+ * is stopped by logf_async_stop, at the latest when the process exits.
+ *
+ * @param slots Number of messages the ring buffer can hold, a power of 2;
+ * 	0 for the default size.
+ * @return 0 on success, -1 on error
+ */
+int
+logf_async_start(unsigned int slots);
+
+/**
+ * Waits, for a bounded time, until the writer thread has written all
+ * messages logged so far.
+ */
+void
+logf_async_flush(void);
+
+/**
+ * Writes all pending messages and stops the writer thread. Logging is
+ * synchronous again afterwards.
+ */
+void
+logf_async_stop(void);
+
+/**
+ * Returns the number of log messages dropped due to a full ring buffer.
+ */
+unsigned long
+logf_async_get_dropped(void);
+
 /**
  * Generates a logfile name by appending a unique timestamp to the filename.
  * The result is in RFC3339 format, e.g., `<name>.2014-05-23T21:29:11.150495+02:00'.
@@ -218,6 +327,35 @@ logf_file_new_name(const char *name);
 void *
 logf_file_new(const char *name);
 
+/**
+ * Opens a log file for logf_file_write like logf_file_new(), which is written
+ * in segments. Once the current segment exceeds max_size bytes, the file is
+ * continued in a new segment, named with the time of the rotation.
+ * The file is synced to storage whenever sync_size bytes have been written
+ * since the last sync (0 for never) and before it is rotated, thus the
+ * writes reach the flash in batches.
+ *
+ * @param name Name of the log file.
+ * @param max_size Size of a segment in bytes.
+ * @param sync_size Number of bytes written between two syncs, 0 to not sync.
+ * @param rotated_cb Called with the path of each full segment, may be NULL.
+ *	It is called by the thread writing the log and must not log itself.
+ * @param data Data passed to rotated_cb.
+ * @return A pointer to the log file or NULL on error.
+ */
+void *
+logf_file_new_rotating(const char *name, size_t max_size, size_t sync_size,
+		       void (*rotated_cb)(const char *segment, void *data), void *data);
+
+/**
+ * Closes a log file opened by logf_file_new() or logf_file_new_rotating(),
+ * whose handler has been unregistered.
+ *
+ * @param file The log file.
+ */
+void
+logf_file_free(void *file);
+
 /**
  * Logs to stdout/stderr or to a file.
  * Cannot be used in conjunction with unit tests; use logf_test_write instead.
@@ -0,0 +1,260 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MSG_MAX 512
+
+static char *msgs[MSG_MAX];
+static int msgs_len = 0;
+static pthread_t msgs_thread;
+
+static sem_t handler_entered;
+static sem_t handler_release;
+static bool handler_block = false;
+
+static void
+collect_write(UNUSED logf_prio_t prio, const char *msg, UNUSED void *data)
+{
+	if (handler_block) {
+		handler_block = false;
+		sem_post(&handler_entered);
+		sem_wait(&handler_release);
+	}
+
+	msgs_thread = pthread_self();
+	if (msgs_len < MSG_MAX)
+		msgs[msgs_len++] = mem_strdup(msg);
+}
+
+static void
+collect_clear(void)
+{
+	for (int i = 0; i < msgs_len; i++)
+		mem_free(msgs[i]);
+	msgs_len = 0;
+}
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	collect_clear();
+}
+
+static MunitResult
+test_logf_async_order(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_handler_t *h = logf_register(&collect_write, NULL);
+
+	munit_assert_int(logf_async_start(0), ==, 0);
+	for (int i = 0; i < 300; i++)
+		INFO("message %d", i);
+	logf_async_flush();
+
+	munit_assert_int(msgs_len, ==, 300);
+	munit_assert_false(pthread_equal(msgs_thread, pthread_self()));
+	for (int i = 0; i < 300; i++) {
+		char expected[32];
+		snprintf(expected, sizeof(expected), "message %d", i);
+		munit_assert_not_null(strstr(msgs[i], expected));
+	}
+
+	// synchronous again after stop
+	logf_async_stop();
+	INFO("sync");
+	munit_assert_int(msgs_len, ==, 301);
+	munit_assert_true(pthread_equal(msgs_thread, pthread_self()));
+
+	logf_unregister(h);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_logf_async_drop(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_handler_t *h = logf_register(&collect_write, NULL);
+
+	sem_init(&handler_entered, 0, 0);
+	sem_init(&handler_release, 0, 0);
+	handler_block = true;
+
+	munit_assert_int(logf_async_start(4), ==, 0);
+	INFO("first");
+	sem_wait(&handler_entered);
+
+	// the slot of the first message is still in use, three more fit
+	for (int i = 0; i < 10; i++)
+		INFO("burst %d", i);
+	munit_assert_ulong(logf_async_get_dropped(), ==, 7);
+
+	sem_post(&handler_release);
+	logf_async_flush();
+	logf_async_stop();
+
+	munit_assert_int(msgs_len, ==, 5);
+	munit_assert_not_null(strstr(msgs[0], "first"));
+	for (int i = 0; i < 3; i++) {
+		char expected[32];
+		snprintf(expected, sizeof(expected), "burst %d", i);
+		munit_assert_not_null(strstr(msgs[i + 1], expected));
+	}
+	munit_assert_string_equal(msgs[4], "Log buffer overflow, dropped 7 messages");
+	munit_assert_ulong(logf_async_get_dropped(), ==, 7);
+
+	logf_unregister(h);
+	sem_destroy(&handler_entered);
+	sem_destroy(&handler_release);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_logf_async_file(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char line[1024];
+	FILE *f = tmpfile();
+	munit_assert_not_null(f);
+
+	munit_assert_int(logf_async_start(0), ==, 0);
+	logf_handler_t *h = logf_register(&logf_file_write, f);
+	for (int i = 0; i < 5; i++)
+		WARN("line %d", i);
+	logf_async_stop();
+	logf_unregister(h);
+
+	rewind(f);
+	for (int i = 0; i < 5; i++) {
+		char expected[32];
+		munit_assert_not_null(fgets(line, sizeof(line), f));
+		snprintf(expected, sizeof(expected), "line %d\n", i);
+		munit_assert_not_null(strstr(line, "<WARN> "));
+		munit_assert_not_null(strstr(line, expected));
+	}
+	munit_assert_null(fgets(line, sizeof(line), f));
+
+	fclose(f);
+	return MUNIT_OK;
+}
+
+static int arg_evaluations = 0;
+
+static int
+count_evaluation(void)
+{
+	return ++arg_evaluations;
+}
+
+static MunitResult
+test_logf_module_prio(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	logf_handler_t *h = logf_register(&collect_write, NULL);
+
+	// this file is the module "logf"
+	munit_assert_int(logf_module_set_prio("logf", LOGF_PRIO_INFO), ==, 0);
+	munit_assert_int(logf_module_get_prio("logf"), ==, LOGF_PRIO_INFO);
+	DEBUG("hidden %d", count_evaluation());
+	munit_assert_int(msgs_len, ==, 0);
+	munit_assert_int(arg_evaluations, ==, 0);
+	munit_assert_false(logf_enabled(LOGF_PRIO_DEBUG));
+
+	munit_assert_int(logf_module_set_prio("logf", LOGF_PRIO_TRACE), ==, 0);
+	TRACE("shown %d", count_evaluation());
+	munit_assert_int(msgs_len, ==, 1);
+	munit_assert_int(arg_evaluations, ==, 1);
+	munit_assert_not_null(strstr(msgs[0], "shown 1"));
+
+	// other modules and the default are not affected
+	munit_assert_int(logf_module_get_prio("uevent"), ==, logf_module_get_prio(NULL));
+	munit_assert_int(logf_module_set_prio(NULL, LOGF_PRIO_ERROR), ==, 0);
+	TRACE("still shown");
+	munit_assert_int(msgs_len, ==, 2);
+
+	munit_assert_int(logf_module_set_prio("logf", 0), ==, -1);
+	munit_assert_int(logf_module_set_prio("logf", LOGF_PRIO_DEBUG), ==, 0);
+	munit_assert_int(logf_module_set_prio(NULL, LOGF_PRIO_DEBUG), ==, 0);
+
+	logf_unregister(h);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/async order",		/* name */
+		test_logf_async_order,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/async drop",		/* name */
+		test_logf_async_drop,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/module prio",		/* name */
+		test_logf_module_prio,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/async file",		/* name */
+		test_logf_async_file,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite logf_suite = {
+	"/logf",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -0,0 +1,414 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "logstore.h"
+
+#include "macro.h"
+#include "mem.h"
+#include "list.h"
+#include "dir.h"
+#include "logf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define LOGSTORE_SUFFIX ".gz"
+#define LOGSTORE_TMP_SUFFIX ".gz.tmp"
+
+// plain segments are synced in batches of this size
+#define LOGSTORE_SYNC_SIZE (256 * 1024)
+// chunk size for compressing a segment
+#define LOGSTORE_BUF_SIZE (64 * 1024)
+// initial size of the line buffer of a reader
+#define LOGSTORE_LINE_SIZE 256
+
+/* a log opened by logstore_file_new(), which lives as long as the process */
+typedef struct {
+	char *dir;
+	char *base; //!< file name of the log without the timestamp of a segment
+	size_t max_size;
+} logstore_t;
+
+typedef struct {
+	logstore_t *store;
+	char *segment;
+} logstore_job_t;
+
+/* the background thread compressing full segments */
+static struct {
+	list_t *jobs;
+	bool started;
+	bool busy; //!< a job is processed outside the lock
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; //!< signals queued as well as finished jobs
+} logstore_worker = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+struct logstore_reader {
+	gzFile gz;
+	char *line;
+	size_t size;
+};
+
+typedef struct {
+	char *file;
+	off_t size;
+} logstore_segment_t;
+
+typedef struct {
+	const logstore_t *store;
+	logstore_segment_t *segments;
+	size_t n;
+} logstore_scan_t;
+
+static bool
+logstore_has_suffix(const char *file, const char *suffix)
+{
+	size_t len = strlen(file), suffix_len = strlen(suffix);
+	return len >= suffix_len && !strcmp(file + len - suffix_len, suffix);
+}
+
+static bool
+logstore_is_segment(const logstore_t *store, const char *file)
+{
+	size_t len = strlen(store->base);
+	return !strncmp(file, store->base, len) && file[len] == '.';
+}
+
+/*
+ * Compresses the segment into <segment>.gz and removes the plain segment once
+ * the compressed one is on storage.
+ */
+static int
+logstore_compress(const char *segment)
+{
+	char *gz_file = mem_printf("%s%s", segment, LOGSTORE_SUFFIX);
+	char *tmp_file = mem_printf("%s%s", segment, LOGSTORE_TMP_SUFFIX);
+	uint8_t *buf = mem_alloc(LOGSTORE_BUF_SIZE);
+	gzFile gz = NULL;
+	int out = -1;
+	int ret = -1;
+
+	int in = open(segment, O_RDONLY | O_CLOEXEC);
+	IF_TRUE_GOTO_WARN(in < 0, err);
+
+	out = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	IF_TRUE_GOTO_WARN(out < 0, err);
+
+	// gzclose() closes the fd passed to zlib, out is kept to sync the file
+	int gz_fd = dup(out);
+	IF_TRUE_GOTO_WARN(gz_fd < 0, err);
+	gz = gzdopen(gz_fd, "wb6");
+	if (!gz) {
+		close(gz_fd);
+		goto err;
+	}
+
+	for (;;) {
+		ssize_t n = read(in, buf, LOGSTORE_BUF_SIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		IF_TRUE_GOTO_WARN(n < 0, err);
+		if (n == 0)
+			break;
+		IF_TRUE_GOTO_WARN(gzwrite(gz, buf, n) != n, err);
+	}
+
+	int gz_ret = gzclose(gz);
+	gz = NULL;
+	IF_TRUE_GOTO_WARN(gz_ret != Z_OK, err);
+	IF_TRUE_GOTO_WARN(fdatasync(out) < 0, err);
+	IF_TRUE_GOTO_WARN(rename(tmp_file, gz_file) < 0, err);
+
+	if (unlink(segment) < 0)
+		WARN_ERRNO("Could not remove compressed log segment %s", segment);
+	TRACE("Compressed log segment %s", segment);
+	ret = 0;
+err:
+	if (ret < 0) {
+		WARN("Could not compress log segment %s, keeping it uncompressed", segment);
+		if (out >= 0)
+			unlink(tmp_file);
+	}
+	if (gz)
+		gzclose(gz);
+	if (out >= 0)
+		close(out);
+	if (in >= 0)
+		close(in);
+	mem_free(buf);
+	mem_free(tmp_file);
+	mem_free(gz_file);
+	return ret;
+}
+
+static int
+logstore_scan_cb(const char *path, const char *file, void *data)
+{
+	logstore_scan_t *scan = data;
+
+	if (!logstore_is_segment(scan->store, file) || !logstore_has_suffix(file, LOGSTORE_SUFFIX))
+		return 0;
+
+	char *full = mem_printf("%s/%s", path, file);
+	struct stat st;
+	if (stat(full, &st) == 0) {
+		scan->segments = mem_renew(logstore_segment_t, scan->segments, scan->n + 1);
+		scan->segments[scan->n].file = full;
+		scan->segments[scan->n].size = st.st_blocks * 512;
+		scan->n++;
+	} else {
+		mem_free(full);
+	}
+	return 0;
+}
+
+static int
+logstore_segment_cmp(const void *a, const void *b)
+{
+	return strcmp(((const logstore_segment_t *)a)->file,
+		      ((const logstore_segment_t *)b)->file);
+}
+
+/*
+ * Removes the oldest compressed segments of the log until the remaining ones
+ * fit into its storage budget. Segment names end with the time of their
+ * creation, thus the oldest segments sort first.
+ */
+static void
+logstore_prune(const logstore_t *store)
+{
+	logstore_scan_t scan = { .store = store, .segments = NULL, .n = 0 };
+	uint64_t total = 0;
+
+	IF_TRUE_RETURN(dir_foreach(store->dir, logstore_scan_cb, &scan) < 0);
+
+	qsort(scan.segments, scan.n, sizeof(logstore_segment_t), logstore_segment_cmp);
+	for (size_t i = 0; i < scan.n; i++)
+		total += scan.segments[i].size;
+
+	for (size_t i = 0; i < scan.n; i++) {
+		const char *file = scan.segments[i].file;
+		if (total > store->max_size) {
+			DEBUG("Removing log segment %s to stay within %zu bytes", file,
+			      store->max_size);
+			if (unlink(file) < 0)
+				WARN_ERRNO("Could not remove log segment %s", file);
+			total -= scan.segments[i].size;
+		}
+		mem_free(scan.segments[i].file);
+	}
+	mem_free(scan.segments);
+}
+
+static void *
+logstore_worker_main(UNUSED void *arg)
+{
+	pthread_mutex_lock(&logstore_worker.mutex);
+	for (;;) {
+		while (!logstore_worker.jobs)
+			pthread_cond_wait(&logstore_worker.cond, &logstore_worker.mutex);
+
+		logstore_job_t *job = logstore_worker.jobs->data;
+		logstore_worker.jobs = list_unlink(logstore_worker.jobs, logstore_worker.jobs);
+		logstore_worker.busy = true;
+		pthread_mutex_unlock(&logstore_worker.mutex);
+
+		logstore_compress(job->segment);
+		logstore_prune(job->store);
+		mem_free(job->segment);
+		mem_free(job);
+
+		pthread_mutex_lock(&logstore_worker.mutex);
+		logstore_worker.busy = false;
+		pthread_cond_broadcast(&logstore_worker.cond);
+	}
+	return NULL;
+}
+
+static int
+logstore_worker_start(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&logstore_worker.mutex);
+	if (!logstore_worker.started) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&logstore_worker.thread, &attr, logstore_worker_main, NULL))
+			ret = -1;
+		else
+			logstore_worker.started = true;
+		pthread_attr_destroy(&attr);
+	}
+	pthread_mutex_unlock(&logstore_worker.mutex);
+
+	return ret;
+}
+
+/*
+ * Queues the segment for compression. Called by the thread writing the log,
+ * thus it must not log.
+ */
+static void
+logstore_queue(logstore_t *store, const char *segment)
+{
+	logstore_job_t *job = mem_new0(logstore_job_t, 1);
+	job->store = store;
+	job->segment = mem_strdup(segment);
+
+	pthread_mutex_lock(&logstore_worker.mutex);
+	if (logstore_worker.started) {
+		logstore_worker.jobs = list_append(logstore_worker.jobs, job);
+		pthread_cond_broadcast(&logstore_worker.cond);
+		job = NULL;
+	}
+	pthread_mutex_unlock(&logstore_worker.mutex);
+
+	if (job) {
+		mem_free(job->segment);
+		mem_free(job);
+	}
+}
+
+static void
+logstore_rotated_cb(const char *segment, void *data)
+{
+	logstore_queue(data, segment);
+}
+
+/*
+ * Queues plain segments of previous runs for compression and removes
+ * leftovers of interrupted compressions.
+ */
+static int
+logstore_recover_cb(const char *path, const char *file, void *data)
+{
+	logstore_t *store = data;
+
+	IF_FALSE_RETVAL(logstore_is_segment(store, file), 0);
+	IF_TRUE_RETVAL(logstore_has_suffix(file, LOGSTORE_SUFFIX), 0);
+
+	char *full = mem_printf("%s/%s", path, file);
+	if (logstore_has_suffix(file, LOGSTORE_TMP_SUFFIX)) {
+		if (unlink(full) < 0)
+			WARN_ERRNO("Could not remove %s", full);
+	} else {
+		logstore_queue(store, full);
+	}
+	mem_free(full);
+	return 0;
+}
+
+void *
+logstore_file_new(const char *name, size_t segment_size, size_t max_size)
+{
+	ASSERT(name);
+
+	logstore_t *store = mem_new0(logstore_t, 1);
+	const char *slash = strrchr(name, '/');
+	store->dir = slash ? mem_strndup(name, MAX(slash - name, 1)) : mem_strdup(".");
+	store->base = mem_strdup(slash ? slash + 1 : name);
+	store->max_size = max_size;
+
+	if (logstore_worker_start() < 0)
+		WARN("Could not start log compression thread, segments stay uncompressed");
+	else
+		dir_foreach(store->dir, logstore_recover_cb, store);
+
+	void *file = logf_file_new_rotating(name, segment_size, LOGSTORE_SYNC_SIZE,
+					    logstore_rotated_cb, store);
+	if (!file) {
+		// compressions of older segments may still refer to the store
+		WARN("Could not open log file %s", name);
+	}
+	return file;
+}
+
+void
+logstore_flush(void)
+{
+	pthread_mutex_lock(&logstore_worker.mutex);
+	while (logstore_worker.jobs || logstore_worker.busy)
+		pthread_cond_wait(&logstore_worker.cond, &logstore_worker.mutex);
+	pthread_mutex_unlock(&logstore_worker.mutex);
+}
+
+logstore_reader_t *
+logstore_reader_new(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	IF_TRUE_RETVAL_TRACE(fd < 0, NULL);
+
+	// zlib reads plain files transparently
+	gzFile gz = gzdopen(fd, "rb");
+	if (!gz) {
+		close(fd);
+		return NULL;
+	}
+
+	logstore_reader_t *reader = mem_new0(logstore_reader_t, 1);
+	reader->gz = gz;
+	reader->size = LOGSTORE_LINE_SIZE;
+	reader->line = mem_alloc(reader->size);
+	return reader;
+}
+
+const char *
+logstore_reader_getline(logstore_reader_t *reader)
+{
+	ASSERT(reader);
+	size_t len = 0;
+
+	for (;;) {
+		if (reader->size - len < 2) {
+			reader->size *= 2;
+			reader->line = mem_realloc(reader->line, reader->size);
+		}
+		if (!gzgets(reader->gz, reader->line + len, reader->size - len))
+			break;
+		len += strlen(reader->line + len);
+		if (len && reader->line[len - 1] == '\n')
+			break;
+	}
+
+	return len ? reader->line : NULL;
+}
+
+void
+logstore_reader_free(logstore_reader_t *reader)
+{
+	IF_NULL_RETURN(reader);
+
+	gzclose(reader->gz);
+	mem_free(reader->line);
+	mem_free(reader);
+}
@@ -0,0 +1,81 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file logstore.h
+ *
+ * Storage of log files on flash with bounded footprint. A log is written in
+ * segments of limited size (see logf_file_new_rotating()) and synced in
+ * batches. Full segments are compressed with gzip on a background thread and
+ * the oldest compressed segments are removed once they exceed the storage
+ * budget of the log. Each segment is thus written once in plain and once in
+ * compressed form and never rewritten afterwards.
+ *
+ * Readers do not need to care about compression, plain and compressed
+ * segments are read alike.
+ */
+
+#ifndef LOGSTORE_H
+#define LOGSTORE_H
+
+#include <stddef.h>
+
+/**
+ * Opens the log file name for logf_file_write, see logf_file_new_rotating().
+ * Segments left uncompressed, e.g. by a previous run, are compressed as well.
+ *
+ * @param name Name of the log file, segments are named <name>.<timestamp>.
+ * @param segment_size Size of a segment in bytes.
+ * @param max_size Storage budget of the compressed segments of the log in bytes.
+ * @return A pointer to the log file or NULL on error.
+ */
+void *
+logstore_file_new(const char *name, size_t segment_size, size_t max_size);
+
+/**
+ * Waits until all full segments queued so far have been compressed.
+ */
+void
+logstore_flush(void);
+
+typedef struct logstore_reader logstore_reader_t;
+
+/**
+ * Opens the plain or compressed log segment at path for reading.
+ * @return the reader or NULL on error
+ */
+logstore_reader_t *
+logstore_reader_new(const char *path);
+
+/**
+ * Returns the next line of the segment including its newline (the last line
+ * may lack it). The line is valid until the next call.
+ * @return the line or NULL at the end of the segment or on error
+ */
+const char *
+logstore_reader_getline(logstore_reader_t *reader);
+
+void
+logstore_reader_free(logstore_reader_t *reader);
+
+#endif /* LOGSTORE_H */
@@ -0,0 +1,227 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "logstore.h"
+#include "logf.h"
+#include "dir.h"
+#include "file.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char dir[] = "/tmp/logstore.test.XXXXXX";
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	strcpy(dir, "/tmp/logstore.test.XXXXXX");
+	munit_assert_not_null(mkdtemp(dir));
+	return NULL;
+}
+
+static int
+unlink_cb(const char *path, const char *file, UNUSED void *data)
+{
+	char *full = mem_printf("%s/%s", path, file);
+	unlink(full);
+	mem_free(full);
+	return 0;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	dir_foreach(dir, unlink_cb, NULL);
+	rmdir(dir);
+}
+
+typedef struct {
+	const char *prefix;
+	int plain;
+	int compressed;
+	int tmp;
+	int lines;
+	bool old_line;
+} count_t;
+
+static int
+count_cb(const char *path, const char *file, void *data)
+{
+	count_t *count = data;
+
+	if (strncmp(file, count->prefix, strlen(count->prefix)))
+		return 0;
+	if (strstr(file, ".tmp")) {
+		count->tmp++;
+		return 0;
+	}
+	if (!strstr(file, ".gz")) {
+		count->plain++;
+		return 0;
+	}
+	count->compressed++;
+
+	char *full = mem_printf("%s/%s", path, file);
+	logstore_reader_t *reader = logstore_reader_new(full);
+	munit_assert_not_null(reader);
+	const char *line;
+	while ((line = logstore_reader_getline(reader))) {
+		munit_assert_char(line[strlen(line) - 1], ==, '\n');
+		if (!strcmp(line, "old line\n"))
+			count->old_line = true;
+		else if (strstr(line, "logstore line"))
+			count->lines++;
+	}
+	logstore_reader_free(reader);
+	mem_free(full);
+	return 0;
+}
+
+static MunitResult
+test_logstore_rotate(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char *name = mem_printf("%s/test", dir);
+	char *stale = mem_printf("%s.1970-01-01T00:00:00.000000+0000", name);
+	char *stale_tmp = mem_printf("%s.1970-01-01T00:00:01.000000+0000.gz.tmp", name);
+	munit_assert_int(file_printf(stale, "old line\n"), >=, 0);
+	munit_assert_int(file_printf(stale_tmp, "garbage"), >=, 0);
+
+	FILE *f = logstore_file_new(name, 512, 1024 * 1024);
+	munit_assert_not_null(f);
+	logf_handler_t *h = logf_register(&logf_file_write, f);
+	for (int i = 0; i < 32; i++)
+		WARN("logstore line %d", i);
+	logf_unregister(h);
+	logstore_flush();
+
+	count_t count = { .prefix = "test." };
+	munit_assert_int(dir_foreach(dir, count_cb, &count), ==, 0);
+	// only the current segment is left uncompressed
+	munit_assert_int(count.plain, ==, 1);
+	munit_assert_int(count.tmp, ==, 0);
+	munit_assert_int(count.compressed, >=, 3);
+	munit_assert_true(count.old_line);
+	munit_assert_int(count.lines, >, 0);
+	munit_assert_int(count.lines, <, 32);
+
+	logf_file_free(f);
+	mem_free(stale_tmp);
+	mem_free(stale);
+	mem_free(name);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_logstore_prune(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char *name = mem_printf("%s/pruned", dir);
+
+	// no compressed segment fits into the budget
+	FILE *f = logstore_file_new(name, 512, 1);
+	munit_assert_not_null(f);
+	logf_handler_t *h = logf_register(&logf_file_write, f);
+	for (int i = 0; i < 32; i++)
+		WARN("logstore line %d", i);
+	logf_unregister(h);
+	logstore_flush();
+
+	count_t count = { .prefix = "pruned." };
+	munit_assert_int(dir_foreach(dir, count_cb, &count), ==, 0);
+	munit_assert_int(count.plain, ==, 1);
+	munit_assert_int(count.compressed, ==, 0);
+
+	logf_file_free(f);
+	mem_free(name);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_logstore_reader_plain(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char *file = mem_printf("%s/plain", dir);
+	char long_line[1000];
+
+	memset(long_line, 'x', sizeof(long_line) - 1);
+	long_line[sizeof(long_line) - 1] = '\0';
+	munit_assert_int(file_printf(file, "first\n%s\nlast", long_line), >=, 0);
+
+	logstore_reader_t *reader = logstore_reader_new(file);
+	munit_assert_not_null(reader);
+	munit_assert_string_equal(logstore_reader_getline(reader), "first\n");
+	const char *line = logstore_reader_getline(reader);
+	munit_assert_size(strlen(line), ==, sizeof(long_line));
+	munit_assert_string_equal(logstore_reader_getline(reader), "last");
+	munit_assert_null(logstore_reader_getline(reader));
+	logstore_reader_free(reader);
+
+	munit_assert_null(logstore_reader_new("/nonexistent/log"));
+
+	mem_free(file);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/rotate",		/* name */
+		test_logstore_rotate,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/prune",		/* name */
+		test_logstore_prune,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/reader plain",	    /* name */
+		test_logstore_reader_plain, /* test */
+		setup,			    /* setup */
+		tear_down,		    /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	    /* options */
+		NULL			    /* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite logstore_suite = {
+	"/logstore",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -27,11 +27,21 @@
 #include <linux/loop.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <errno.h>
+#include <stdbool.h>
 
 #include "loopdev.h"
 
 #include "macro.h"
 #include "mem.h"
+#include "dir.h"
+#include "file.h"
+
+#include <string.h>
+
+#ifndef LOOP_CTL_ADD
+#define LOOP_CTL_ADD 0x4C80
+#endif
 
 #ifndef LOOP_CTL_GET_FREE
 #define LOOP_CTL_GET_FREE 0x4C82
@@ -43,22 +53,49 @@
 #define LOOP_DEV_PREFIX "/dev/loop"
 #endif
 
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+	__u32 fd;
+	__u32 block_size;
+	struct loop_info64 info;
+	__u64 __reserved[8];
+};
+#endif
+
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
 #define LOOP_CONTROL "/dev/loop-control"
 
+// kept open, a loop device is allocated for every image of a starting container
+static int loopdev_control_fd = -1;
+
+static int
+loopdev_open_control(void)
+{
+	if (loopdev_control_fd < 0) {
+		loopdev_control_fd = open(LOOP_CONTROL, O_RDONLY | O_CLOEXEC);
+		if (loopdev_control_fd < 0)
+			ERROR_ERRNO("Cannot open %s", LOOP_CONTROL);
+	}
+	return loopdev_control_fd;
+}
+
 char *
 loopdev_new(void)
 {
-	int fd, i;
+	int i;
 
-	fd = open(LOOP_CONTROL, O_RDONLY);
-	if (fd < 0) {
-		ERROR_ERRNO("Cannot open %s", LOOP_CONTROL);
-		return NULL;
-	}
+	IF_TRUE_RETVAL(loopdev_open_control() < 0, NULL);
 
 	//i = ioctl(loop_fd, LOOP_CTL_ADD);
-	i = ioctl(fd, LOOP_CTL_GET_FREE);
-	close(fd);
+	i = ioctl(loopdev_control_fd, LOOP_CTL_GET_FREE);
 	if (i < 0) {
 		ERROR("Cannot get free loop device");
 		return NULL;
@@ -70,6 +107,44 @@ loopdev_new(void)
 	return mem_printf("%s%d", LOOP_DEV_PREFIX, i);
 }
 
+static int
+loopdev_count_free_cb(const char *path, const char *file, UNUSED void *data)
+{
+	IF_TRUE_RETVAL(strncmp(file, "loop", 4), 0);
+
+	// unattached loop devices have a size of 0
+	char *size_file = mem_printf("%s/%s/size", path, file);
+	char *size = file_read_new(size_file, 32);
+	int ret = (size && !strcmp(size, "0\n")) ? 1 : 0;
+
+	mem_free(size);
+	mem_free(size_file);
+	return ret;
+}
+
+int
+loopdev_pool_fill(unsigned n)
+{
+	int n_free = dir_foreach("/sys/block", loopdev_count_free_cb, NULL);
+	IF_TRUE_RETVAL(n_free < 0, -1);
+	IF_TRUE_RETVAL((unsigned)n_free >= n, 0);
+
+	IF_TRUE_RETVAL(loopdev_open_control() < 0, -1);
+
+	int created = 0;
+	for (unsigned i = n_free; i < n; i++) {
+		// a negative index lets the kernel choose the next free one
+		int dev = ioctl(loopdev_control_fd, LOOP_CTL_ADD, -1);
+		if (dev < 0) {
+			ERROR_ERRNO("Cannot add loop device");
+			break;
+		}
+		TRACE("Added loop device %s%d", LOOP_DEV_PREFIX, dev);
+		created++;
+	}
+	return created;
+}
+
 void
 loopdev_free(char *dev)
 {
@@ -79,48 +154,48 @@ loopdev_free(char *dev)
 int
 loopdev_wait(const char *dev, unsigned timeout)
 {
-	unsigned i;
+	return file_wait_blk(dev, timeout);
+}
 
-	for (i = 0; i < timeout; i++) {
-		struct stat st;
+/*
+ * Attaches the image to the loop device and sets it up in one go.
+ * Returns -1 with errno ENOTTY or EINVAL if the kernel does not support
+ * LOOP_CONFIGURE (before 5.8).
+ */
+static int
+loopdev_configure(int dev_fd, int img_fd, unsigned flags)
+{
+	struct loop_config config;
+	memset(&config, 0, sizeof(config));
 
-		DEBUG("Checking loop device %s (%i/%i)", dev, i, timeout);
-		if (stat(dev, &st) || !S_ISBLK(st.st_mode))
-			usleep(1000);
-		else
-			return 0;
-	}
+	config.fd = img_fd;
+	/* so we do not need a detach of the loop device after umount */
+	config.info.lo_flags = LO_FLAGS_AUTOCLEAR;
+	if (flags & LOOPDEV_RDONLY)
+		config.info.lo_flags |= LO_FLAGS_READ_ONLY;
+	if (flags & LOOPDEV_DIRECT_IO)
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
 
-	return -1;
+	return ioctl(dev_fd, LOOP_CONFIGURE, &config);
 }
 
 /*
  * Taken from:
  * http://stackoverflow.com/questions/11295154/how-do-i-loop-mount-programmatically
  */
-
-int
-loopdev_setup_device(const char *img, const char *dev)
+static int
+loopdev_set_fd_and_status(int dev_fd, int img_fd, const char *dev, unsigned flags)
 {
 	struct loop_info64 info;
 	memset(&info, 0, sizeof(info));
-	int img_fd, dev_fd = -1;
-
-	img_fd = open(img, O_RDWR | O_EXCL);
-	if (img_fd < 0) {
-		ERROR_ERRNO("Could not open image file %s", img);
-		goto error;
-	}
-
-	dev_fd = open(dev, O_RDWR);
-	if (dev_fd < 0) {
-		ERROR_ERRNO("Could not open device %s", dev);
-		goto error;
-	}
 
 	if (ioctl(dev_fd, LOOP_SET_FD, img_fd) < 0) {
-		ERROR_ERRNO("Failed to set fd of loop device %s", dev);
-		goto error;
+		// EBUSY if someone else grabbed the device meanwhile
+		if (errno == EBUSY)
+			DEBUG_ERRNO("Failed to set fd of loop device %s", dev);
+		else
+			ERROR_ERRNO("Failed to set fd of loop device %s", dev);
+		return -1;
 	}
 
 	if (ioctl(dev_fd, LOOP_GET_STATUS64, &info) < 0) {
@@ -136,16 +211,116 @@ loopdev_setup_device(const char *img, const char *dev)
 		goto error;
 	}
 
+	// not supported by every file system, the device works without it
+	if ((flags & LOOPDEV_DIRECT_IO) && ioctl(dev_fd, LOOP_SET_DIRECT_IO, 1) < 0)
+		DEBUG_ERRNO("Could not enable direct I/O for loop device %s", dev);
+
+	return 0;
+error:
+	ioctl(dev_fd, LOOP_CLR_FD, 0);
+	return -1;
+}
+
+int
+loopdev_setup_device_flags(const char *img, const char *dev, unsigned flags)
+{
+	int img_fd, dev_fd = -1;
+	int errsv;
+	int img_flags = (flags & LOOPDEV_RDONLY) ? O_RDONLY : O_RDWR | O_EXCL;
+
+	img_fd = open(img, img_flags | O_CLOEXEC);
+	if (img_fd < 0) {
+		ERROR_ERRNO("Could not open image file %s", img);
+		goto error;
+	}
+
+	dev_fd = open(dev, ((flags & LOOPDEV_RDONLY) ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+	if (dev_fd < 0) {
+		ERROR_ERRNO("Could not open device %s", dev);
+		goto error;
+	}
+
+	if (loopdev_configure(dev_fd, img_fd, flags) < 0) {
+		if (errno == EBUSY) {
+			DEBUG_ERRNO("Failed to configure loop device %s", dev);
+			goto error;
+		}
+		if (errno != ENOTTY && errno != EINVAL) {
+			ERROR_ERRNO("Failed to configure loop device %s", dev);
+			goto error;
+		}
+		// older kernel
+		if (loopdev_set_fd_and_status(dev_fd, img_fd, dev, flags) < 0)
+			goto error;
+	}
+
 	close(img_fd);
 	return dev_fd;
 
 error:
+	errsv = errno;
 	if (img_fd >= 0)
 		close(img_fd);
-
-	if (dev_fd >= 0) {
-		ioctl(dev_fd, LOOP_CLR_FD, 0);
+	if (dev_fd >= 0)
 		close(dev_fd);
+	errno = errsv;
+	return -1;
+}
+
+int
+loopdev_setup_device(const char *img, const char *dev)
+{
+	return loopdev_setup_device_flags(img, dev, 0);
+}
+
+typedef struct {
+	struct stat img;
+	char *dev;
+	int fd;
+} loopdev_find_t;
+
+static int
+loopdev_find_attached_cb(UNUSED const char *path, const char *file, void *data)
+{
+	loopdev_find_t *find = data;
+	struct loop_info64 info;
+
+	IF_TRUE_RETVAL(strncmp(file, "loop", 4), 0);
+
+	char *dev = mem_printf("%s%s", LOOP_DEV_PREFIX, file + 4);
+	int fd = open(dev, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		mem_free(dev);
+		return 0;
+	}
+
+	// the status is taken from the open device, so it cannot be detached meanwhile
+	if (ioctl(fd, LOOP_GET_STATUS64, &info) < 0 || !(info.lo_flags & LO_FLAGS_READ_ONLY) ||
+	    info.lo_device != find->img.st_dev || info.lo_inode != find->img.st_ino) {
+		close(fd);
+		mem_free(dev);
+		return 0;
 	}
+
+	find->dev = dev;
+	find->fd = fd;
 	return -1;
 }
+
+int
+loopdev_find_attached(const char *img, char **dev)
+{
+	loopdev_find_t find = { .dev = NULL, .fd = -1 };
+
+	ASSERT(img);
+	ASSERT(dev);
+
+	IF_TRUE_RETVAL(stat(img, &find.img) < 0, -1);
+
+	dir_foreach("/sys/block", loopdev_find_attached_cb, &find);
+	if (find.fd >= 0)
+		TRACE("Found loop device %s with %s attached", find.dev, img);
+
+	*dev = find.dev;
+	return find.fd;
+}
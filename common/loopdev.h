@@ -40,6 +40,14 @@
 char *
 loopdev_new(void);
 
+/**
+ * Makes sure that at least n unattached loop devices exist, so that
+ * loopdev_new() returns a device whose node is already there.
+ * @return The number of loop devices created or -1 on error.
+ */
+int
+loopdev_pool_fill(unsigned n);
+
 /**
  * Free the device path of a loop device.
  * @param dev The device string, e.g. /dev/loop0 as returned by loopdev_new().
@@ -49,7 +57,8 @@ void
 loopdev_free(char *dev);
 
 /**
- * Wait until the loop device appears in the dev file system.
+ * Wait until the loop device appears in the dev file system, see
+ * file_wait_blk().
  * @param dev The path for the loop device, e.g. /dev/loop0.
  * Call loopdev_new() to get one.
  * @param timeout The timeout in milliseconds.
@@ -66,9 +75,37 @@ loopdev_wait(const char *dev, unsigned timeout);
  * Call loopdev_new() to get one.
  * @return A file descriptor for the loop device or -1 in case of an
  * error. The caller must close the file descriptor after calling mount.
+ * errno is set to EBUSY if the loop device is already in use, e.g. because
+ * another thread or process took it after loopdev_new() returned it.
  */
 
 int
 loopdev_setup_device(const char *img, const char *dev);
 
+/// attach the image read-only
+#define LOOPDEV_RDONLY (1 << 0)
+/// bypass the page cache of the image file, so image pages are not cached twice
+#define LOOPDEV_DIRECT_IO (1 << 1)
+
+/**
+ * Setup a loop device for an image file like loopdev_setup_device(), using
+ * LOOP_CONFIGURE if the kernel supports it.
+ * @param flags A combination of LOOPDEV_RDONLY and LOOPDEV_DIRECT_IO. Direct
+ * I/O is silently not used if the file system of the image does not support it.
+ */
+int
+loopdev_setup_device_flags(const char *img, const char *dev, unsigned flags);
+
+/**
+ * Looks for a loop device which already has the image file attached read-only,
+ * e.g. for another container. Mounting the same device again shares the super
+ * block and thus the page cache of the file system with the existing mounts.
+ * @param img The path to an image file.
+ * @param dev Set to the newly allocated path of the loop device if one is found.
+ * @return A read-only file descriptor for the loop device, which keeps it
+ * attached until it is closed after calling mount, or -1 if there is none.
+ */
+int
+loopdev_find_attached(const char *img, char **dev);
+
 #endif /* LOOPDEV_H */
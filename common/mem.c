@@ -22,12 +22,16 @@
  */
 
 #define _GNU_SOURCE
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
+#define MEM_PROFILE_IMPL
 #include "mem.h"
 #include "macro.h"
 
@@ -114,6 +118,143 @@ mem_printf(const char *fmt, ...)
 	return p;
 }
 
+// the first block is not grown beyond this on reset, larger peaks are rare
+#define MEM_ARENA_KEEP_MAX (1024 * 1024)
+#define MEM_ARENA_ALIGN __BIGGEST_ALIGNMENT__
+#define MEM_ARENA_ALIGN_UP(off) (((off) + MEM_ARENA_ALIGN - 1) & ~(size_t)(MEM_ARENA_ALIGN - 1))
+
+typedef struct mem_arena_block {
+	struct mem_arena_block *prev;
+	size_t base; ///< offset of the block within the arena
+	size_t size;
+	size_t used;
+	unsigned char data[] __attribute__((aligned(MEM_ARENA_ALIGN)));
+} mem_arena_block_t;
+
+struct mem_arena {
+	mem_arena_block_t *block; ///< the current block, earlier ones are linked by prev
+	size_t block_size;
+};
+
+static mem_arena_block_t *
+mem_arena_block_new(mem_arena_block_t *prev, size_t size)
+{
+	mem_arena_block_t *block = mem_alloc(sizeof(mem_arena_block_t) + size);
+	block->prev = prev;
+	block->base = prev ? prev->base + prev->size : 0;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+mem_arena_t *
+mem_arena_new(size_t block_size)
+{
+	mem_arena_t *arena = mem_new(mem_arena_t, 1);
+	arena->block_size = MEM_ARENA_ALIGN_UP(block_size ? block_size : 1);
+	arena->block = mem_arena_block_new(NULL, arena->block_size);
+	return arena;
+}
+
+void
+mem_arena_free(mem_arena_t *arena)
+{
+	IF_NULL_RETURN(arena);
+
+	while (arena->block) {
+		mem_arena_block_t *prev = arena->block->prev;
+		free(arena->block);
+		arena->block = prev;
+	}
+	mem_free(arena);
+}
+
+void *
+mem_arena_alloc(mem_arena_t *arena, size_t size)
+{
+	ASSERT(arena);
+
+	mem_arena_block_t *block = arena->block;
+	size_t off = MEM_ARENA_ALIGN_UP(block->used);
+
+	if (off > block->size || size > block->size - off) {
+		DEBUG_THRESHOLD(size);
+		size_t block_size = MAX(arena->block_size, MEM_ARENA_ALIGN_UP(size));
+		ASSERT(block_size >= size);
+		block = arena->block = mem_arena_block_new(block, block_size);
+		off = 0;
+	}
+	block->used = off + size;
+	return block->data + off;
+}
+
+void *
+mem_arena_alloc0(mem_arena_t *arena, size_t size)
+{
+	void *p = mem_arena_alloc(arena, size);
+	memset(p, 0, size);
+	return p;
+}
+
+char *
+mem_arena_strdup(mem_arena_t *arena, const char *str)
+{
+	ASSERT(str);
+	size_t len = strlen(str) + 1;
+	return memcpy(mem_arena_alloc(arena, len), str, len);
+}
+
+char *
+mem_arena_printf(mem_arena_t *arena, const char *fmt, ...)
+{
+	va_list ap, aq;
+	ASSERT(fmt);
+
+	va_start(ap, fmt);
+	va_copy(aq, ap);
+	int len = vsnprintf(NULL, 0, fmt, aq);
+	va_end(aq);
+	ASSERT(len >= 0);
+
+	char *p = mem_arena_alloc(arena, (size_t)len + 1);
+	vsnprintf(p, (size_t)len + 1, fmt, ap);
+	va_end(ap);
+	return p;
+}
+
+size_t
+mem_arena_mark(const mem_arena_t *arena)
+{
+	ASSERT(arena);
+	return arena->block->base + arena->block->used;
+}
+
+void
+mem_arena_reset(mem_arena_t *arena, size_t mark)
+{
+	ASSERT(arena);
+
+	mem_arena_block_t *block = arena->block;
+	size_t peak = block->base + block->used;
+
+	// drop the blocks started after the mark
+	while (block->prev && block->base >= mark) {
+		arena->block = block->prev;
+		free(block);
+		block = arena->block;
+	}
+	ASSERT(mark >= block->base && mark - block->base <= block->used);
+	block->used = mark - block->base;
+
+	if (mark == 0 && peak > block->size) {
+		size_t size = MEM_ARENA_ALIGN_UP(MIN(peak, (size_t)MEM_ARENA_KEEP_MAX));
+		if (size > block->size) {
+			free(block);
+			arena->block = mem_arena_block_new(NULL, size);
+		}
+	}
+}
+
 void
 mem_free_array(void **array, size_t size)
 {
@@ -132,3 +273,521 @@ mem_free_array(void **array, size_t size)
 		mem_free(array);
 	}
 }
+
+#ifdef MEM_PROFILE
+#include <pthread.h>
+
+/*
+ * Live allocations are tracked in an open addressing hash table keyed by
+ * their address, which is allocated directly by calloc(3) and never from
+ * the profiled functions.
+ */
+typedef struct {
+	void *mem;
+	mem_profile_site_t *site;
+	mem_profile_owner_t *owner;
+	size_t size;
+} mem_profile_entry_t;
+
+#define MEM_PROFILE_TABLE_MIN 4096
+
+static pthread_mutex_t mem_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static mem_profile_entry_t *mem_profile_table = NULL;
+static size_t mem_profile_table_size = 0;
+static size_t mem_profile_table_used = 0;
+static mem_profile_site_t *mem_profile_sites = NULL;
+static mem_profile_owner_t *mem_profile_owners = NULL;
+
+// the owner of the allocations of the calling thread, see MEM_PROFILE_OWNER_SCOPE()
+static __thread mem_profile_owner_t *mem_profile_owner_current = NULL;
+
+static size_t
+mem_profile_hash(const void *mem, size_t table_size)
+{
+	uint64_t h = (uint64_t)(uintptr_t)mem * 0x9e3779b97f4a7c15ull;
+	return (size_t)(h >> 32) & (table_size - 1);
+}
+
+static size_t
+mem_profile_lookup(const void *mem)
+{
+	size_t i = mem_profile_hash(mem, mem_profile_table_size);
+	while (mem_profile_table[i].mem && mem_profile_table[i].mem != mem)
+		i = (i + 1) & (mem_profile_table_size - 1);
+	return i;
+}
+
+/*
+ * Frees an owner once it has been released and is referenced neither by an
+ * allocation nor by the scope of a thread. Called with mem_profile_lock held.
+ */
+static void
+mem_profile_owner_put(mem_profile_owner_t *owner)
+{
+	if (!owner->freed || owner->live_count || owner->scopes)
+		return;
+
+	for (mem_profile_owner_t **o = &mem_profile_owners; *o; o = &(*o)->next) {
+		if (*o == owner) {
+			*o = owner->next;
+			break;
+		}
+	}
+	free(owner);
+}
+
+static void
+mem_profile_remove_at(size_t i)
+{
+	mem_profile_entry_t *e = &mem_profile_table[i];
+	e->site->live_count--;
+	e->site->live_bytes -= e->size;
+	if (e->owner) {
+		e->owner->live_count--;
+		e->owner->live_bytes -= e->size;
+		mem_profile_owner_put(e->owner);
+	}
+	mem_profile_table_used--;
+
+	// move back the following entries of the probe sequence into the gap
+	size_t mask = mem_profile_table_size - 1;
+	for (size_t j = (i + 1) & mask; mem_profile_table[j].mem; j = (j + 1) & mask) {
+		size_t k = mem_profile_hash(mem_profile_table[j].mem, mem_profile_table_size);
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			mem_profile_table[i] = mem_profile_table[j];
+			i = j;
+		}
+	}
+	mem_profile_table[i].mem = NULL;
+}
+
+/*
+ * Nothing must be logged while holding mem_profile_lock, as logging allocates.
+ * Thus a failure to grow the table is not fatal, the allocation is just not
+ * tracked if the table is full.
+ */
+static bool
+mem_profile_grow(void)
+{
+	size_t size = mem_profile_table_size ? 2 * mem_profile_table_size : MEM_PROFILE_TABLE_MIN;
+	mem_profile_entry_t *table = calloc(size, sizeof(mem_profile_entry_t));
+	if (!table)
+		return false;
+
+	mem_profile_entry_t *old = mem_profile_table;
+	size_t old_size = mem_profile_table_size;
+	mem_profile_table = table;
+	mem_profile_table_size = size;
+
+	for (size_t i = 0; i < old_size; i++) {
+		if (old[i].mem)
+			mem_profile_table[mem_profile_lookup(old[i].mem)] = old[i];
+	}
+	free(old);
+	return true;
+}
+
+static void
+mem_profile_track(mem_profile_site_t *site, void *mem, size_t size)
+{
+	pthread_mutex_lock(&mem_profile_lock);
+
+	if (2 * (mem_profile_table_used + 1) > mem_profile_table_size && !mem_profile_grow() &&
+	    mem_profile_table_used + 1 >= mem_profile_table_size)
+		goto out;
+
+	if (site->count++ == 0) {
+		site->next = mem_profile_sites;
+		mem_profile_sites = site;
+	}
+	site->bytes += size;
+	site->live_count++;
+	site->live_bytes += size;
+	site->peak_bytes = MAX(site->peak_bytes, site->live_bytes);
+
+	mem_profile_owner_t *owner = mem_profile_owner_current;
+	if (owner && owner->freed)
+		owner = NULL;
+	if (owner) {
+		owner->live_count++;
+		owner->live_bytes += size;
+		owner->peak_bytes = MAX(owner->peak_bytes, owner->live_bytes);
+	}
+
+	size_t i = mem_profile_lookup(mem);
+	// released by free(3) instead of mem_free() and now reused
+	if (mem_profile_table[i].mem) {
+		mem_profile_remove_at(i);
+		i = mem_profile_lookup(mem);
+	}
+	mem_profile_table[i] = (mem_profile_entry_t){
+		.mem = mem, .site = site, .owner = owner, .size = size
+	};
+	mem_profile_table_used++;
+out:
+	pthread_mutex_unlock(&mem_profile_lock);
+}
+
+static void
+mem_profile_untrack(void *mem)
+{
+	pthread_mutex_lock(&mem_profile_lock);
+	if (mem_profile_table) {
+		size_t i = mem_profile_lookup(mem);
+		// not allocated by mem_* if not found
+		if (mem_profile_table[i].mem)
+			mem_profile_remove_at(i);
+	}
+	pthread_mutex_unlock(&mem_profile_lock);
+}
+
+void *
+mem_profile_alloc(mem_profile_site_t *site, size_t size)
+{
+	void *p = mem_alloc(size);
+	mem_profile_track(site, p, size);
+	return p;
+}
+
+void *
+mem_profile_alloc0(mem_profile_site_t *site, size_t size)
+{
+	void *p = mem_alloc0(size);
+	mem_profile_track(site, p, size);
+	return p;
+}
+
+void *
+mem_profile_realloc(mem_profile_site_t *site, void *mem, size_t size)
+{
+	if (mem)
+		mem_profile_untrack(mem);
+	void *p = mem_realloc(mem, size);
+	mem_profile_track(site, p, size);
+	return p;
+}
+
+char *
+mem_profile_strdup(mem_profile_site_t *site, const char *str)
+{
+	char *p = mem_strdup(str);
+	mem_profile_track(site, p, strlen(p) + 1);
+	return p;
+}
+
+char *
+mem_profile_strndup(mem_profile_site_t *site, const char *str, size_t len)
+{
+	char *p = mem_strndup(str, len);
+	mem_profile_track(site, p, strlen(p) + 1);
+	return p;
+}
+
+unsigned char *
+mem_profile_memcpy(mem_profile_site_t *site, const unsigned char *mem, size_t size)
+{
+	unsigned char *p = mem_memcpy(mem, size);
+	mem_profile_track(site, p, size);
+	return p;
+}
+
+char *
+mem_profile_vprintf(mem_profile_site_t *site, const char *fmt, va_list ap)
+{
+	char *p = mem_vprintf(fmt, ap);
+	mem_profile_track(site, p, strlen(p) + 1);
+	return p;
+}
+
+char *
+mem_profile_printf(mem_profile_site_t *site, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	char *p = mem_profile_vprintf(site, fmt, ap);
+	va_end(ap);
+	return p;
+}
+
+void
+mem_profile_free(void *mem)
+{
+	mem_profile_untrack(mem);
+	free(mem);
+}
+
+static int
+mem_profile_cmp_live(const void *a, const void *b)
+{
+	const mem_profile_site_t *x = a, *y = b;
+	return (x->live_bytes < y->live_bytes) - (x->live_bytes > y->live_bytes);
+}
+
+int
+mem_profile_foreach(void (*func)(const mem_profile_site_t *site, void *data), void *data)
+{
+	ASSERT(func);
+
+	// copy the counters, func may allocate
+	pthread_mutex_lock(&mem_profile_lock);
+	size_t n = 0;
+	for (mem_profile_site_t *site = mem_profile_sites; site; site = site->next)
+		n++;
+	mem_profile_site_t *sites = calloc(n ? n : 1, sizeof(mem_profile_site_t));
+	if (sites) {
+		n = 0;
+		for (mem_profile_site_t *site = mem_profile_sites; site; site = site->next)
+			sites[n++] = *site;
+	}
+	pthread_mutex_unlock(&mem_profile_lock);
+	IF_NULL_RETVAL_ERROR(sites, -1);
+
+	qsort(sites, n, sizeof(mem_profile_site_t), mem_profile_cmp_live);
+	for (size_t i = 0; i < n; i++) {
+		sites[i].next = NULL;
+		func(&sites[i], data);
+	}
+
+	free(sites);
+	return 0;
+}
+
+/*
+ * The subsystem of a call site, i.e. its MEM_TAG or the name of its file.
+ */
+static void
+mem_profile_site_tag(const mem_profile_site_t *site, char *name)
+{
+	if (site->tag) {
+		snprintf(name, MEM_PROFILE_NAME_LEN, "%s", site->tag);
+		return;
+	}
+
+	const char *base = strrchr(site->file, '/');
+	base = base ? base + 1 : site->file;
+	const char *ext = strrchr(base, '.');
+	int len = ext ? (int)(ext - base) : (int)strlen(base);
+	snprintf(name, MEM_PROFILE_NAME_LEN, "%.*s", len, base);
+}
+
+static int
+mem_profile_cmp_tag_live(const void *a, const void *b)
+{
+	const mem_profile_tag_t *x = a, *y = b;
+	return (x->live_bytes < y->live_bytes) - (x->live_bytes > y->live_bytes);
+}
+
+int
+mem_profile_foreach_tag(void (*func)(const mem_profile_tag_t *tag, void *data), void *data)
+{
+	ASSERT(func);
+
+	pthread_mutex_lock(&mem_profile_lock);
+	size_t n = 0;
+	for (mem_profile_site_t *site = mem_profile_sites; site; site = site->next)
+		n++;
+	// at most one tag per site
+	mem_profile_tag_t *tags = calloc(n ? n : 1, sizeof(mem_profile_tag_t));
+	if (tags) {
+		n = 0;
+		for (mem_profile_site_t *site = mem_profile_sites; site; site = site->next) {
+			char name[MEM_PROFILE_NAME_LEN];
+			mem_profile_site_tag(site, name);
+
+			size_t i = 0;
+			while (i < n && strcmp(tags[i].name, name))
+				i++;
+			if (i == n)
+				memcpy(tags[n++].name, name, sizeof(name));
+			tags[i].count += site->count;
+			tags[i].bytes += site->bytes;
+			tags[i].live_count += site->live_count;
+			tags[i].live_bytes += site->live_bytes;
+		}
+	}
+	pthread_mutex_unlock(&mem_profile_lock);
+	IF_NULL_RETVAL_ERROR(tags, -1);
+
+	qsort(tags, n, sizeof(mem_profile_tag_t), mem_profile_cmp_tag_live);
+	for (size_t i = 0; i < n; i++)
+		func(&tags[i], data);
+
+	free(tags);
+	return 0;
+}
+
+mem_profile_owner_t *
+mem_profile_owner_new(const char *name)
+{
+	ASSERT(name);
+
+	mem_profile_owner_t *owner = calloc(1, sizeof(mem_profile_owner_t));
+	ASSERT(owner);
+	snprintf(owner->name, sizeof(owner->name), "%s", name);
+
+	pthread_mutex_lock(&mem_profile_lock);
+	owner->next = mem_profile_owners;
+	mem_profile_owners = owner;
+	pthread_mutex_unlock(&mem_profile_lock);
+	return owner;
+}
+
+void
+mem_profile_owner_free(mem_profile_owner_t *owner)
+{
+	IF_NULL_RETURN(owner);
+
+	pthread_mutex_lock(&mem_profile_lock);
+	owner->freed = true;
+	mem_profile_owner_put(owner);
+	pthread_mutex_unlock(&mem_profile_lock);
+}
+
+mem_profile_owner_t *
+mem_profile_owner_enter(mem_profile_owner_t *owner)
+{
+	mem_profile_owner_t *prev = mem_profile_owner_current;
+
+	if (owner) {
+		pthread_mutex_lock(&mem_profile_lock);
+		owner->scopes++;
+		pthread_mutex_unlock(&mem_profile_lock);
+	}
+	mem_profile_owner_current = owner;
+	return prev;
+}
+
+void
+mem_profile_owner_leave(mem_profile_owner_t **prev)
+{
+	mem_profile_owner_t *owner = mem_profile_owner_current;
+
+	if (owner) {
+		pthread_mutex_lock(&mem_profile_lock);
+		owner->scopes--;
+		mem_profile_owner_put(owner);
+		pthread_mutex_unlock(&mem_profile_lock);
+	}
+	mem_profile_owner_current = *prev;
+}
+
+static int
+mem_profile_cmp_owner_live(const void *a, const void *b)
+{
+	const mem_profile_owner_t *x = a, *y = b;
+	return (x->live_bytes < y->live_bytes) - (x->live_bytes > y->live_bytes);
+}
+
+int
+mem_profile_foreach_owner(void (*func)(const mem_profile_owner_t *owner, void *data), void *data)
+{
+	ASSERT(func);
+
+	pthread_mutex_lock(&mem_profile_lock);
+	size_t n = 0;
+	for (mem_profile_owner_t *owner = mem_profile_owners; owner; owner = owner->next)
+		n++;
+	mem_profile_owner_t *owners = calloc(n ? n : 1, sizeof(mem_profile_owner_t));
+	if (owners) {
+		n = 0;
+		for (mem_profile_owner_t *owner = mem_profile_owners; owner; owner = owner->next)
+			owners[n++] = *owner;
+	}
+	pthread_mutex_unlock(&mem_profile_lock);
+	IF_NULL_RETVAL_ERROR(owners, -1);
+
+	qsort(owners, n, sizeof(mem_profile_owner_t), mem_profile_cmp_owner_live);
+	for (size_t i = 0; i < n; i++) {
+		owners[i].next = NULL;
+		func(&owners[i], data);
+	}
+
+	free(owners);
+	return 0;
+}
+#else
+int
+mem_profile_foreach(UNUSED void (*func)(const mem_profile_site_t *site, void *data),
+		    UNUSED void *data)
+{
+	return -1;
+}
+
+int
+mem_profile_foreach_tag(UNUSED void (*func)(const mem_profile_tag_t *tag, void *data),
+			UNUSED void *data)
+{
+	return -1;
+}
+
+mem_profile_owner_t *
+mem_profile_owner_new(UNUSED const char *name)
+{
+	return NULL;
+}
+
+void
+mem_profile_owner_free(UNUSED mem_profile_owner_t *owner)
+{
+}
+
+int
+mem_profile_foreach_owner(UNUSED void (*func)(const mem_profile_owner_t *owner, void *data),
+			  UNUSED void *data)
+{
+	return -1;
+}
+#endif /* MEM_PROFILE */
+
+static size_t mem_trim_pending = 0;
+
+void
+mem_trim_hint(size_t size)
+{
+	__atomic_add_fetch(&mem_trim_pending, size, __ATOMIC_RELAXED);
+}
+
+bool
+mem_trim(void)
+{
+	IF_TRUE_RETVAL(__atomic_load_n(&mem_trim_pending, __ATOMIC_RELAXED) < MEM_TRIM_MIN, false);
+	__atomic_store_n(&mem_trim_pending, 0, __ATOMIC_RELAXED);
+
+#ifdef __GLIBC__
+	// trims all arenas, including those of the worker threads
+	malloc_trim(0);
+	return true;
+#else
+	return false;
+#endif
+}
+
+typedef struct {
+	size_t n;
+	size_t max_sites;
+} mem_profile_log_t;
+
+static void
+mem_profile_log_cb(const mem_profile_site_t *site, void *data)
+{
+	mem_profile_log_t *log = data;
+	if (log->n++ >= log->max_sites)
+		return;
+
+	INFO("%s:%d: %" PRIu64 " bytes live in %" PRIu64 " allocations (peak %" PRIu64
+	     "), %" PRIu64 " bytes in %" PRIu64 " allocations in total",
+	     site->file, site->line, site->live_bytes, site->live_count, site->peak_bytes,
+	     site->bytes, site->count);
+}
+
+void
+mem_profile_log(size_t max_sites)
+{
+	mem_profile_log_t log = { .n = 0, .max_sites = max_sites };
+
+	INFO("Allocation profile, call sites with the most live bytes first:");
+	if (mem_profile_foreach(&mem_profile_log_cb, &log) < 0)
+		WARN("Allocations are not profiled, build with MEM_PROFILE=y");
+	else if (log.n > max_sites)
+		INFO("... %zu more call sites", log.n - max_sites);
+}
@@ -32,8 +32,10 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 
 /**
@@ -196,4 +198,263 @@ mem_free_array(void **array, size_t size);
 		(struct_type *)mem_realloc((mem), _total_len);                                     \
 	})
 
+/**
+ * An arena for short-lived allocations, e.g. the temporaries of an event
+ * callback. Allocations are taken from larger blocks by bumping an offset and
+ * are not freed individually, but all at once by resetting the arena.
+ */
+typedef struct mem_arena mem_arena_t;
+
+/**
+ * Creates an arena whose blocks have at least block_size bytes.
+ */
+mem_arena_t *
+mem_arena_new(size_t block_size);
+
+/**
+ * Frees the arena including all memory allocated from it.
+ */
+void
+mem_arena_free(mem_arena_t *arena);
+
+/**
+ * Allocates size bytes from the arena, suitably aligned for any type.
+ * The memory is not initialized. Aborts if the allocation fails.
+ */
+void *
+mem_arena_alloc(mem_arena_t *arena, size_t size);
+
+/**
+ * Like mem_arena_alloc() but sets the memory to zero.
+ */
+void *
+mem_arena_alloc0(mem_arena_t *arena, size_t size);
+
+/**
+ * Duplicates a string into the arena.
+ */
+char *
+mem_arena_strdup(mem_arena_t *arena, const char *str);
+
+/**
+ * Prints to a string allocated from the arena.
+ */
+char *
+mem_arena_printf(mem_arena_t *arena, const char *fmt, ...)
+#if defined(__GNUC__)
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+
+/**
+ * Returns the current fill level of the arena, which marks the start of a scope.
+ */
+size_t
+mem_arena_mark(const mem_arena_t *arena);
+
+/**
+ * Releases everything allocated from the arena since mark was taken by
+ * mem_arena_mark(), 0 releases everything. Once the arena is reset
+ * completely, its first block is grown to the peak usage of the previous
+ * round, so that regular workloads are served from a single block.
+ */
+void
+mem_arena_reset(mem_arena_t *arena, size_t mark);
+
+/**
+ * Allocation counters of a single call site of the mem_* functions.
+ */
+typedef struct mem_profile_site {
+	const char *file;
+	const char *tag; ///< MEM_TAG of the source file, NULL if not defined
+	int line;
+	uint64_t count;	     ///< number of allocations
+	uint64_t bytes;	     ///< total number of bytes allocated
+	uint64_t live_count; ///< allocations which have not been freed yet
+	uint64_t live_bytes; ///< bytes which have not been freed yet
+	uint64_t peak_bytes; ///< maximum of live_bytes
+	struct mem_profile_site *next;
+} mem_profile_site_t;
+
+/**
+ * Calls func for a snapshot of the counters of each call site which has
+ * allocated memory, sorted by live bytes, largest first. func may allocate.
+ * Memory allocated by mem_* but released with free(3) instead of mem_free()
+ * stays live, as does memory reallocated by other means.
+ *
+ * @return 0, or -1 if allocations are not profiled (not built with MEM_PROFILE)
+ */
+int
+mem_profile_foreach(void (*func)(const mem_profile_site_t *site, void *data), void *data);
+
+/**
+ * Logs the counters of the max_sites call sites with the most live bytes.
+ */
+void
+mem_profile_log(size_t max_sites);
+
+#define MEM_PROFILE_NAME_LEN 64
+
+/**
+ * Allocation counters of the call sites of a subsystem. A source file may
+ * define MEM_TAG as a string literal before including any header to account
+ * its allocations to a subsystem, e.g. all container modules to "container".
+ * Otherwise they are accounted to the name of the file without extension.
+ */
+typedef struct mem_profile_tag {
+	char name[MEM_PROFILE_NAME_LEN];
+	uint64_t count;	     ///< number of allocations
+	uint64_t bytes;	     ///< total number of bytes allocated
+	uint64_t live_count; ///< allocations which have not been freed yet
+	uint64_t live_bytes; ///< bytes which have not been freed yet
+} mem_profile_tag_t;
+
+/**
+ * Calls func for the counters of each subsystem, sorted by live bytes,
+ * largest first. func may allocate.
+ *
+ * @return 0, or -1 if allocations are not profiled
+ */
+int
+mem_profile_foreach_tag(void (*func)(const mem_profile_tag_t *tag, void *data), void *data);
+
+/**
+ * An owner of allocations, e.g. a container. Allocations made while the
+ * calling thread is in the scope of an owner (see MEM_PROFILE_OWNER_SCOPE())
+ * are accounted to it in addition to their call site, reallocations to the
+ * owner of the scope of mem_realloc().
+ */
+typedef struct mem_profile_owner {
+	char name[MEM_PROFILE_NAME_LEN];
+	uint64_t live_count; ///< allocations which have not been freed yet
+	uint64_t live_bytes; ///< bytes which have not been freed yet
+	uint64_t peak_bytes; ///< maximum of live_bytes
+	unsigned scopes;     ///< threads in the scope of the owner
+	bool freed;	     ///< released by mem_profile_owner_free(), but still referenced
+	struct mem_profile_owner *next;
+} mem_profile_owner_t;
+
+/**
+ * Creates an owner, NULL if allocations are not profiled.
+ */
+mem_profile_owner_t *
+mem_profile_owner_new(const char *name);
+
+/**
+ * Releases an owner. Its allocations which are still live stay accounted to
+ * it, and it is reported as freed, until they are freed as well.
+ */
+void
+mem_profile_owner_free(mem_profile_owner_t *owner);
+
+/**
+ * Calls func for a snapshot of the counters of each owner, sorted by live
+ * bytes, largest first. func may allocate.
+ *
+ * @return 0, or -1 if allocations are not profiled
+ */
+int
+mem_profile_foreach_owner(void (*func)(const mem_profile_owner_t *owner, void *data), void *data);
+
+/**
+ * Notes that a large transient buffer of size bytes has been freed, which
+ * malloc(3) may keep in the heap instead of returning it to the kernel.
+ * May be called from any thread.
+ */
+void
+mem_trim_hint(size_t size);
+
+/**
+ * Returns free heap memory to the kernel by malloc_trim(3) if at least
+ * MEM_TRIM_MIN bytes have been hinted by mem_trim_hint() since the last trim.
+ * Meant to be called periodically.
+ *
+ * @return true if the heap has been trimmed
+ */
+bool
+mem_trim(void);
+
+#define MEM_TRIM_MIN (4 * 1024 * 1024)
+
+#ifdef MEM_PROFILE
+/*
+ * Allocation profiling: each call of the mem_* allocators is tagged with a
+ * static mem_profile_site_t of its call site and the allocation is tracked
+ * until it is released by mem_free().
+ */
+#ifndef MEM_TAG
+#define MEM_TAG NULL
+#endif
+
+// clang-format off
+#define MEM_PROFILE_SITE()                                                                         \
+	__extension__({                                                                            \
+		static mem_profile_site_t _mem_profile_site = { .file = __FILE__,                  \
+								.tag = MEM_TAG,                    \
+								.line = __LINE__ };                \
+		&_mem_profile_site;                                                                \
+	})
+// clang-format on
+
+mem_profile_owner_t *
+mem_profile_owner_enter(mem_profile_owner_t *owner);
+void
+mem_profile_owner_leave(mem_profile_owner_t **prev);
+
+/*
+ * Accounts the allocations of the calling thread to owner until the end of
+ * the enclosing block, nested scopes restore the previous owner.
+ */
+#define MEM_PROFILE_OWNER_SCOPE(owner)                                                             \
+	mem_profile_owner_t *_mem_profile_owner_prev                                               \
+		__attribute__((cleanup(mem_profile_owner_leave), unused)) =                        \
+			mem_profile_owner_enter(owner)
+
+void *
+mem_profile_alloc(mem_profile_site_t *site, size_t size);
+void *
+mem_profile_alloc0(mem_profile_site_t *site, size_t size);
+void *
+mem_profile_realloc(mem_profile_site_t *site, void *mem, size_t size);
+char *
+mem_profile_strdup(mem_profile_site_t *site, const char *str);
+char *
+mem_profile_strndup(mem_profile_site_t *site, const char *str, size_t len);
+unsigned char *
+mem_profile_memcpy(mem_profile_site_t *site, const unsigned char *mem, size_t size);
+char *
+mem_profile_vprintf(mem_profile_site_t *site, const char *fmt, va_list ap);
+char *
+mem_profile_printf(mem_profile_site_t *site, const char *fmt, ...)
+#if defined(__GNUC__)
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+void
+mem_profile_free(void *mem);
+
+// mem.c itself defines the plain functions
+#ifndef MEM_PROFILE_IMPL
+#define mem_alloc(size) mem_profile_alloc(MEM_PROFILE_SITE(), size)
+#define mem_alloc0(size) mem_profile_alloc0(MEM_PROFILE_SITE(), size)
+#define mem_realloc(mem, size) mem_profile_realloc(MEM_PROFILE_SITE(), mem, size)
+#define mem_strdup(str) mem_profile_strdup(MEM_PROFILE_SITE(), str)
+#define mem_strndup(str, len) mem_profile_strndup(MEM_PROFILE_SITE(), str, len)
+#define mem_memcpy(mem, size) mem_profile_memcpy(MEM_PROFILE_SITE(), mem, size)
+#define mem_vprintf(fmt, ap) mem_profile_vprintf(MEM_PROFILE_SITE(), fmt, ap)
+#define mem_printf(...) mem_profile_printf(MEM_PROFILE_SITE(), __VA_ARGS__)
+#endif
+
+#undef mem_free
+#define mem_free(ptr)                                                                              \
+	do {                                                                                       \
+		if (ptr) {                                                                         \
+			mem_profile_free(ptr);                                                     \
+			ptr = NULL;                                                                \
+		}                                                                                  \
+	} while (0)
+#else
+#define MEM_PROFILE_OWNER_SCOPE(owner) (void)(owner)
+#endif /* MEM_PROFILE */
+
 #endif /* MEM_H */
@@ -281,7 +281,227 @@ test_integer_overflow_in_mem_renew_is_detected(UNUSED const MunitParameter param
 	return MUNIT_FAIL;
 }
 
+static MunitResult
+test_arena(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	mem_arena_t *arena = mem_arena_new(64);
+	munit_assert_not_null(arena);
+
+	// allocations are aligned and do not overlap
+	char *a = mem_arena_strdup(arena, "first");
+	struct complex_t *s = mem_arena_alloc0(arena, sizeof(struct complex_t));
+	munit_assert_size((uintptr_t)s % __BIGGEST_ALIGNMENT__, ==, 0);
+	munit_assert_false(s->flag);
+	munit_assert_int(s->int_field, ==, 0);
+	s->int_field = 0xdead;
+	munit_assert_string_equal(a, "first");
+
+	// a scope releases only its own allocations, even across blocks
+	size_t mark = mem_arena_mark(arena);
+	char *b = mem_arena_printf(arena, "%s/%d", "path", 42);
+	munit_assert_string_equal(b, "path/42");
+	char *big = mem_arena_alloc(arena, 1000);
+	memset(big, 'x', 1000);
+	mem_arena_reset(arena, mark);
+	munit_assert_size(mem_arena_mark(arena), ==, mark);
+	munit_assert_string_equal(a, "first");
+	munit_assert_int(s->int_field, ==, 0xdead);
+
+	// after a full reset, the peak usage fits in the first block
+	big = mem_arena_alloc(arena, 1000);
+	mem_arena_reset(arena, 0);
+	munit_assert_size(mem_arena_mark(arena), ==, 0);
+	char *c = mem_arena_alloc(arena, 1000);
+	munit_assert_size(mem_arena_mark(arena), ==, 1000);
+	memset(c, 'y', 1000);
+	mem_arena_reset(arena, 0);
+
+	mem_arena_free(arena);
+	return MUNIT_OK;
+}
+
+typedef struct {
+	int line;
+	mem_profile_site_t site;
+	bool found;
+} profile_find_t;
+
+static void
+profile_find_cb(const mem_profile_site_t *site, void *data)
+{
+	profile_find_t *find = data;
+	if (site->line == find->line && strstr(site->file, "mem.test.c")) {
+		find->site = *site;
+		find->found = true;
+	}
+}
+
+#ifdef MEM_PROFILE
+static profile_find_t
+profile_find(int line)
+{
+	profile_find_t find = { .line = line, .found = false };
+	munit_assert_int(mem_profile_foreach(&profile_find_cb, &find), ==, 0);
+	return find;
+}
+#endif
+
+static MunitResult
+test_profile(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+#ifdef MEM_PROFILE
+	char *bufs[4];
+	int alloc_line = __LINE__ + 2;
+	for (int i = 0; i < 4; i++)
+		bufs[i] = mem_alloc(100);
+
+	profile_find_t find = profile_find(alloc_line);
+	munit_assert_true(find.found);
+	munit_assert_uint64(find.site.count, ==, 4);
+	munit_assert_uint64(find.site.live_count, ==, 4);
+	munit_assert_uint64(find.site.live_bytes, ==, 400);
+
+	// reallocations are accounted to the site of mem_realloc()
+	int realloc_line = __LINE__ + 1;
+	bufs[0] = mem_realloc(bufs[0], 1000);
+	munit_assert_uint64(profile_find(realloc_line).site.live_bytes, ==, 1000);
+	munit_assert_uint64(profile_find(alloc_line).site.live_bytes, ==, 300);
+
+	for (int i = 0; i < 4; i++)
+		mem_free(bufs[i]);
+
+	find = profile_find(alloc_line);
+	munit_assert_uint64(find.site.live_count, ==, 0);
+	munit_assert_uint64(find.site.live_bytes, ==, 0);
+	munit_assert_uint64(find.site.peak_bytes, ==, 400);
+	munit_assert_uint64(find.site.bytes, ==, 400);
+	munit_assert_uint64(profile_find(realloc_line).site.live_bytes, ==, 0);
+#else
+	munit_assert_int(mem_profile_foreach(&profile_find_cb, NULL), ==, -1);
+#endif
+	return MUNIT_OK;
+}
+
+static void
+profile_find_tag_cb(const mem_profile_tag_t *tag, void *data)
+{
+	mem_profile_tag_t *find = data;
+	if (!strcmp(tag->name, find->name))
+		*find = *tag;
+}
+
+static void
+profile_find_owner_cb(const mem_profile_owner_t *owner, void *data)
+{
+	mem_profile_owner_t *find = data;
+	if (!strcmp(owner->name, find->name))
+		*find = *owner;
+}
+
+static MunitResult
+test_profile_owner(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+#ifdef MEM_PROFILE
+	// this file defines no MEM_TAG, so its name is the tag
+	mem_profile_tag_t tag = { .name = "mem.test" };
+	munit_assert_int(mem_profile_foreach_tag(&profile_find_tag_cb, &tag), ==, 0);
+	uint64_t tag_live = tag.live_bytes;
+
+	mem_profile_owner_t *owner = mem_profile_owner_new("test-owner");
+	char *outside = mem_alloc(10);
+	char *inside, *nested;
+	{
+		MEM_PROFILE_OWNER_SCOPE(owner);
+		inside = mem_alloc(100);
+		{
+			MEM_PROFILE_OWNER_SCOPE(NULL);
+			nested = mem_alloc(1000);
+		}
+		mem_free(outside);
+		outside = mem_alloc(200);
+	}
+
+	mem_profile_owner_t find = { .name = "test-owner" };
+	munit_assert_int(mem_profile_foreach_owner(&profile_find_owner_cb, &find), ==, 0);
+	munit_assert_uint64(find.live_count, ==, 2);
+	munit_assert_uint64(find.live_bytes, ==, 300);
+	munit_assert_uint(find.scopes, ==, 0);
+
+	munit_assert_int(mem_profile_foreach_tag(&profile_find_tag_cb, &tag), ==, 0);
+	munit_assert_uint64(tag.live_bytes, ==, tag_live + 1300);
+
+	// live allocations keep a released owner
+	mem_profile_owner_free(owner);
+	mem_free(inside);
+	find.live_count = 0;
+	munit_assert_int(mem_profile_foreach_owner(&profile_find_owner_cb, &find), ==, 0);
+	munit_assert_true(find.freed);
+	munit_assert_uint64(find.live_count, ==, 1);
+	munit_assert_uint64(find.peak_bytes, ==, 300);
+
+	mem_free(outside);
+	mem_free(nested);
+	find.freed = false;
+	munit_assert_int(mem_profile_foreach_owner(&profile_find_owner_cb, &find), ==, 0);
+	munit_assert_false(find.freed);
+#else
+	munit_assert_null(mem_profile_owner_new("test-owner"));
+	munit_assert_int(mem_profile_foreach_owner(&profile_find_owner_cb, NULL), ==, -1);
+	munit_assert_int(mem_profile_foreach_tag(&profile_find_tag_cb, NULL), ==, -1);
+#endif
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_trim(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// a trim consumes all hints so far
+	mem_trim();
+	mem_trim_hint(MEM_TRIM_MIN / 2);
+	munit_assert_false(mem_trim());
+	mem_trim_hint(MEM_TRIM_MIN / 2);
+#ifdef __GLIBC__
+	munit_assert_true(mem_trim());
+#else
+	mem_trim();
+#endif
+	munit_assert_false(mem_trim());
+	return MUNIT_OK;
+}
+
 static MunitTest tests[] = {
+	{
+		"/profile",		/* name */
+		test_profile,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/profile owner",	/* name */
+		test_profile_owner,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/trim",		/* name */
+		test_trim,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/arena",		/* name */
+		test_arena,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
 	{
 		"/allocate primitives and structs",	  /* name */
 		test_can_allocate_primitives_and_structs, /* test */
@@ -0,0 +1,179 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "merkle.h"
+
+#include "macro.h"
+#include "mem.h"
+
+#include <openssl/evp.h>
+#include <string.h>
+
+#define MERKLE_PREFIX_LEAF 0x00
+#define MERKLE_PREFIX_NODE 0x01
+
+struct merkle_tree {
+	size_t n;			 //!< number of leaves
+	size_t levels;			 //!< number of levels including leaves and root
+	size_t *level_offset;		 //!< index of the first node of each level in nodes
+	uint8_t (*nodes)[MERKLE_HASH_LEN]; //!< all levels, starting with the leaves
+};
+
+static int
+merkle_hash(uint8_t prefix, const uint8_t *data1, size_t len1, const uint8_t *data2,
+	    size_t len2, uint8_t *out)
+{
+	int ret = -1;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	IF_NULL_RETVAL_ERROR(ctx, -1);
+
+	IF_FALSE_GOTO(EVP_DigestInit_ex(ctx, EVP_sha256(), NULL), out);
+	IF_FALSE_GOTO(EVP_DigestUpdate(ctx, &prefix, 1), out);
+	IF_FALSE_GOTO(EVP_DigestUpdate(ctx, data1, len1), out);
+	if (data2)
+		IF_FALSE_GOTO(EVP_DigestUpdate(ctx, data2, len2), out);
+	IF_FALSE_GOTO(EVP_DigestFinal_ex(ctx, out, NULL), out);
+	ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+size_t
+merkle_proof_max_len(size_t n)
+{
+	size_t len = 0;
+
+	for (; n > 1; n = (n + 1) / 2)
+		len++;
+	return len;
+}
+
+merkle_tree_t *
+merkle_tree_new(const uint8_t *const leaves[], const size_t leaves_len[], size_t n)
+{
+	IF_TRUE_RETVAL(n == 0, NULL);
+
+	merkle_tree_t *tree = mem_new0(merkle_tree_t, 1);
+	tree->n = n;
+	tree->levels = merkle_proof_max_len(n) + 1;
+	tree->level_offset = mem_new0(size_t, tree->levels);
+
+	size_t nodes = 0;
+	for (size_t count = n, l = 0; l < tree->levels; count = (count + 1) / 2, l++) {
+		tree->level_offset[l] = nodes;
+		nodes += count;
+	}
+	tree->nodes = mem_alloc0(nodes * MERKLE_HASH_LEN);
+
+	for (size_t i = 0; i < n; i++) {
+		IF_TRUE_GOTO(merkle_hash(MERKLE_PREFIX_LEAF, leaves[i], leaves_len[i], NULL, 0,
+					 tree->nodes[i]),
+			     err);
+	}
+
+	for (size_t count = n, l = 1; l < tree->levels; l++) {
+		uint8_t(*below)[MERKLE_HASH_LEN] = tree->nodes + tree->level_offset[l - 1];
+		uint8_t(*level)[MERKLE_HASH_LEN] = tree->nodes + tree->level_offset[l];
+
+		for (size_t i = 0; i + 1 < count; i += 2) {
+			IF_TRUE_GOTO(merkle_hash(MERKLE_PREFIX_NODE, below[i], MERKLE_HASH_LEN,
+						 below[i + 1], MERKLE_HASH_LEN, level[i / 2]),
+				     err);
+		}
+		if (count % 2)
+			memcpy(level[count / 2], below[count - 1], MERKLE_HASH_LEN);
+		count = (count + 1) / 2;
+	}
+
+	return tree;
+err:
+	merkle_tree_free(tree);
+	return NULL;
+}
+
+void
+merkle_tree_free(merkle_tree_t *tree)
+{
+	IF_NULL_RETURN(tree);
+
+	mem_free(tree->level_offset);
+	mem_free(tree->nodes);
+	mem_free(tree);
+}
+
+const uint8_t *
+merkle_tree_get_root(const merkle_tree_t *tree)
+{
+	ASSERT(tree);
+	return tree->nodes[tree->level_offset[tree->levels - 1]];
+}
+
+size_t
+merkle_tree_get_proof(const merkle_tree_t *tree, size_t index, const uint8_t *proof[])
+{
+	ASSERT(tree);
+	ASSERT(index < tree->n);
+
+	size_t len = 0;
+	for (size_t count = tree->n, l = 0; l + 1 < tree->levels; l++) {
+		size_t sibling = index ^ 1;
+		// the last node of an odd level has no sibling
+		if (sibling < count)
+			proof[len++] = tree->nodes[tree->level_offset[l] + sibling];
+		index /= 2;
+		count = (count + 1) / 2;
+	}
+	return len;
+}
+
+bool
+merkle_proof_verify(const uint8_t *leaf, size_t leaf_len, size_t index, size_t n,
+		    const uint8_t *const proof[], size_t proof_len, const uint8_t *root)
+{
+	uint8_t hash[MERKLE_HASH_LEN];
+	size_t used = 0;
+
+	IF_FALSE_RETVAL(index < n, false);
+	IF_TRUE_RETVAL(merkle_hash(MERKLE_PREFIX_LEAF, leaf, leaf_len, NULL, 0, hash), false);
+
+	for (size_t count = n; count > 1; count = (count + 1) / 2, index /= 2) {
+		size_t sibling = index ^ 1;
+		if (sibling >= count)
+			continue;
+
+		IF_FALSE_RETVAL(used < proof_len, false);
+		if (index % 2) {
+			IF_TRUE_RETVAL(merkle_hash(MERKLE_PREFIX_NODE, proof[used], MERKLE_HASH_LEN,
+						   hash, MERKLE_HASH_LEN, hash),
+				       false);
+		} else {
+			IF_TRUE_RETVAL(merkle_hash(MERKLE_PREFIX_NODE, hash, MERKLE_HASH_LEN,
+						   proof[used], MERKLE_HASH_LEN, hash),
+				       false);
+		}
+		used++;
+	}
+
+	return used == proof_len && !memcmp(hash, root, MERKLE_HASH_LEN);
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file merkle.h
+ *
+ * Merkle tree over a number of byte strings, e.g. the nonces of several
+ * attestation requests answered with one TPM quote over the root.
+ *
+ * Leaves are hashed as SHA256(0x00 || data) and inner nodes as
+ * SHA256(0x01 || left || right), thus a leaf cannot be passed off as an inner
+ * node. The last node of a level with an odd number of nodes is moved up
+ * unchanged instead of being paired with itself.
+ */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MERKLE_HASH_LEN 32
+
+typedef struct merkle_tree merkle_tree_t;
+
+/**
+ * Builds the tree over the n (> 0) leaves of the given lengths.
+ * @return the tree or NULL on error
+ */
+merkle_tree_t *
+merkle_tree_new(const uint8_t *const leaves[], const size_t leaves_len[], size_t n);
+
+void
+merkle_tree_free(merkle_tree_t *tree);
+
+/**
+ * Returns the root hash (MERKLE_HASH_LEN bytes), which is valid as long as the tree.
+ */
+const uint8_t *
+merkle_tree_get_root(const merkle_tree_t *tree);
+
+/**
+ * Stores pointers to the sibling hashes on the path from the leaf at index up
+ * to the root into proof, which must have room for at least merkle_proof_max_len()
+ * entries. The hashes are valid as long as the tree.
+ * @return the number of hashes stored in proof
+ */
+size_t
+merkle_tree_get_proof(const merkle_tree_t *tree, size_t index, const uint8_t *proof[]);
+
+/**
+ * Returns the maximum number of hashes of a proof in a tree with n leaves.
+ */
+size_t
+merkle_proof_max_len(size_t n);
+
+/**
+ * Checks that the leaf data is the leaf at index of a tree with n leaves and
+ * the given root, using the sibling hashes in proof.
+ */
+bool
+merkle_proof_verify(const uint8_t *leaf, size_t leaf_len, size_t index, size_t n,
+		    const uint8_t *const proof[], size_t proof_len, const uint8_t *root);
+
+#endif /* MERKLE_H */
@@ -0,0 +1,160 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "merkle.h"
+#include "logf.h"
+#include "macro.h"
+
+#include <openssl/sha.h>
+#include <string.h>
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	// No clean-up needed for now
+}
+
+static MunitResult
+test_merkle_root(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	const uint8_t *leaves[3] = { (const uint8_t *)"a", (const uint8_t *)"b",
+				     (const uint8_t *)"c" };
+	const size_t leaves_len[3] = { 1, 1, 1 };
+	uint8_t buf[1 + 2 * MERKLE_HASH_LEN];
+	uint8_t hash_a[MERKLE_HASH_LEN], hash_b[MERKLE_HASH_LEN], hash_c[MERKLE_HASH_LEN];
+	uint8_t hash_ab[MERKLE_HASH_LEN], root[MERKLE_HASH_LEN];
+
+	buf[0] = 0x00;
+	buf[1] = 'a';
+	SHA256(buf, 2, hash_a);
+	buf[1] = 'b';
+	SHA256(buf, 2, hash_b);
+	buf[1] = 'c';
+	SHA256(buf, 2, hash_c);
+
+	// a single leaf is the root
+	merkle_tree_t *tree = merkle_tree_new(leaves, leaves_len, 1);
+	munit_assert_not_null(tree);
+	munit_assert_memory_equal(MERKLE_HASH_LEN, merkle_tree_get_root(tree), hash_a);
+	merkle_tree_free(tree);
+
+	// the odd leaf c is moved up and paired with the inner node (a, b)
+	buf[0] = 0x01;
+	memcpy(buf + 1, hash_a, MERKLE_HASH_LEN);
+	memcpy(buf + 1 + MERKLE_HASH_LEN, hash_b, MERKLE_HASH_LEN);
+	SHA256(buf, sizeof(buf), hash_ab);
+	memcpy(buf + 1, hash_ab, MERKLE_HASH_LEN);
+	memcpy(buf + 1 + MERKLE_HASH_LEN, hash_c, MERKLE_HASH_LEN);
+	SHA256(buf, sizeof(buf), root);
+
+	tree = merkle_tree_new(leaves, leaves_len, 3);
+	munit_assert_not_null(tree);
+	munit_assert_memory_equal(MERKLE_HASH_LEN, merkle_tree_get_root(tree), root);
+	merkle_tree_free(tree);
+
+	munit_assert_null(merkle_tree_new(leaves, leaves_len, 0));
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_merkle_proof(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t nonces[33][8];
+	const uint8_t *leaves[33];
+	size_t leaves_len[33];
+
+	for (size_t i = 0; i < 33; i++) {
+		memset(nonces[i], (int)i, sizeof(nonces[i]));
+		leaves[i] = nonces[i];
+		leaves_len[i] = sizeof(nonces[i]);
+	}
+
+	for (size_t n = 1; n <= 33; n++) {
+		merkle_tree_t *tree = merkle_tree_new(leaves, leaves_len, n);
+		munit_assert_not_null(tree);
+		const uint8_t *root = merkle_tree_get_root(tree);
+
+		for (size_t i = 0; i < n; i++) {
+			const uint8_t *proof[8];
+			size_t proof_len = merkle_tree_get_proof(tree, i, proof);
+			munit_assert_size(proof_len, <=, merkle_proof_max_len(n));
+
+			munit_assert_true(merkle_proof_verify(leaves[i], leaves_len[i], i, n, proof,
+							      proof_len, root));
+			// another leaf, position or tree size does not match
+			munit_assert_false(merkle_proof_verify(leaves[(i + 1) % 33], 8, i, n,
+							       proof, proof_len, root));
+			if (n > 1)
+				munit_assert_false(merkle_proof_verify(leaves[i], 8, (i + 1) % n,
+								       n, proof, proof_len, root));
+			munit_assert_false(
+				merkle_proof_verify(leaves[i], 8, i, n, proof, proof_len + 1, root));
+			munit_assert_false(merkle_proof_verify(leaves[i], 8, n, n, proof,
+							       proof_len, root));
+		}
+		merkle_tree_free(tree);
+	}
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"merkle_root",		/* name */
+		test_merkle_root,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"merkle_proof",		/* name */
+		test_merkle_proof,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite merkle_suite = {
+	"test_merkle: ",	/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
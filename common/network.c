@@ -30,15 +30,28 @@
 #include "mem.h"
 #include "file.h"
 #include "proc.h"
+#include "nft.h"
 
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <net/route.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <linux/netlink.h>
 #include <linux/genetlink.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
 #include <linux/nl80211.h>
+#include <linux/netfilter_bridge.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter/nf_conntrack_common.h>
 
 #define IPTABLES_PATH "iptables"
 #define IP_PATH "ip"
@@ -63,16 +76,228 @@
 #define LOOPBACK_PREFIX 16
 #define LOCALHOST_IP "127.0.0.1"
 
+/* nftables tables holding the rules of one subnet or port forwarding */
+#define NFT_TABLE_MASQ "cml_masq_%s"
+#define NFT_TABLE_FWD "cml_fwd_%" PRIu16
+#define NFT_TABLE_FLOW "cml_flow_%s"
+#define NFT_TABLE_BRIDGE_PORT "cml_br_%s"
+#define NFT_FLOWTABLE "ft"
+
+/* route table of the current network namespace, to find the default route */
+#define PROC_NET_ROUTE "/proc/net/route"
+
+/* receive buffer for a single link message */
+#define NETWORK_LINK_BUF_SIZE 8192
+
+/* nftables support of the kernel, iptables is used if missing, -1 if unknown */
+static int network_nft_support = -1;
+
+/**
+ * Parses a network in the form "a.b.c.d[/prefix]".
+ */
 static int
-network_call_ip(const char *addr, uint32_t subnet, const char *interface, char *action)
+network_parse_subnet(const char *subnet, struct in_addr *addr, uint8_t *prefix)
 {
-	char *net = mem_printf("%s/%i", addr, subnet);
-	const char *const argv[] = { IP_PATH, "addr", action, net, "dev", interface, NULL };
-	int ret = proc_fork_and_execvp(argv);
+	char *net = mem_strdup(subnet);
+	char *slash = strchr(net, '/');
+	int ret = -1;
+
+	*prefix = 32;
+	if (slash) {
+		char *end;
+		*slash = '\0';
+		unsigned long p = strtoul(slash + 1, &end, 10);
+		IF_TRUE_GOTO(*end || end == slash + 1 || p > 32, out);
+		*prefix = p;
+	}
+	IF_TRUE_GOTO(inet_pton(AF_INET, net, addr) != 1, out);
+	ret = 0;
+out:
+	if (ret)
+		ERROR("Invalid network '%s'", subnet);
 	mem_free(net);
 	return ret;
 }
 
+static int
+network_parse_table(const char *table_id, uint32_t *table)
+{
+	if (!strcmp(table_id, "main")) {
+		*table = RT_TABLE_MAIN;
+	} else if (!strcmp(table_id, "local")) {
+		*table = RT_TABLE_LOCAL;
+	} else if (!strcmp(table_id, "default")) {
+		*table = RT_TABLE_DEFAULT;
+	} else {
+		char *end;
+		unsigned long t = strtoul(table_id, &end, 10);
+		if (*end || end == table_id || t > UINT32_MAX) {
+			ERROR("Invalid routing table '%s'", table_id);
+			return -1;
+		}
+		*table = t;
+	}
+	return 0;
+}
+
+/**
+ * Sends the request, waits for its ACK and frees it. Fails if req is NULL.
+ */
+static int
+network_rtnl_send(nl_msg_t *req)
+{
+	IF_NULL_RETVAL(req, -1);
+
+	return network_rtnl_send_batch(list_append(NULL, req));
+}
+
+int
+network_rtnl_send_batch(list_t *reqs)
+{
+	int ret = -1;
+
+	nl_sock_t *nl_sock = nl_sock_routing_new();
+	IF_NULL_GOTO_ERROR(nl_sock, out);
+
+	/* Send all requests at once and wait for the response messages */
+	if (nl_msg_send_kernel_verify_batch(nl_sock, reqs)) {
+		ERROR_ERRNO("failed to send %d netlink messages", list_length(reqs));
+		goto out;
+	}
+	ret = 0;
+out:
+	nl_sock_free(nl_sock);
+	for (list_t *l = reqs; l; l = l->next)
+		nl_msg_free(l->data);
+	list_delete(reqs);
+	return ret;
+}
+
+static int
+network_call_ip(const char *addr, uint32_t subnet, const char *interface, bool add)
+{
+	nl_sock_t *nl_sock = NULL;
+	nl_msg_t *req = NULL;
+	struct in_addr ipv4_addr;
+
+	IF_TRUE_RETVAL_ERROR(inet_pton(AF_INET, addr, &ipv4_addr) != 1, -1);
+	IF_TRUE_RETVAL_ERROR(subnet > 32, -1);
+
+	/* Get the interface index of the interface name */
+	unsigned int ifi_index = if_nametoindex(interface);
+	IF_FALSE_RETVAL_ERROR(ifi_index, -1);
+
+	/* Open netlink socket */
+	nl_sock = nl_sock_routing_new();
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	/* Create netlink message */
+	req = nl_msg_new();
+	IF_NULL_GOTO_ERROR(req, msg_err);
+
+	/* Prepare the request message */
+	struct ifaddrmsg ip_req = { .ifa_family = AF_INET,
+				    .ifa_prefixlen = subnet,
+				    .ifa_index = ifi_index,
+				    .ifa_scope = RT_SCOPE_UNIVERSE };
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, add ? RTM_NEWADDR : RTM_DELADDR), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK |
+						    (add ? NLM_F_CREATE | NLM_F_EXCL : 0)),
+			   msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_ip_req(req, &ip_req), msg_err);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IFA_LOCAL, (char *)&ipv4_addr, sizeof(ipv4_addr)),
+			   msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IFA_ADDRESS, (char *)&ipv4_addr,
+					     sizeof(ipv4_addr)),
+			   msg_err);
+
+	/* Send request message and wait for the response message */
+	IF_TRUE_GOTO_ERROR(nl_msg_send_kernel_verify(nl_sock, req), msg_err);
+
+	nl_msg_free(req);
+	nl_sock_free(nl_sock);
+	return 0;
+
+msg_err:
+	ERROR("failed to create/send netlink message");
+	nl_msg_free(req);
+	nl_sock_free(nl_sock);
+	return -1;
+}
+
+nl_msg_t *
+network_route_msg_new(const char *table_id, const char *net_dst, const char *gateway,
+		      const char *dev, bool add)
+{
+	nl_msg_t *req = NULL;
+	struct in_addr dst_addr, gw_addr;
+	uint8_t prefix = 0;
+	unsigned int ifi_index = 0;
+	uint32_t table;
+
+	IF_TRUE_RETVAL(network_parse_table(table_id, &table), NULL);
+	if (net_dst)
+		IF_TRUE_RETVAL(network_parse_subnet(net_dst, &dst_addr, &prefix), NULL);
+	if (gateway)
+		IF_TRUE_RETVAL_ERROR(inet_pton(AF_INET, gateway, &gw_addr) != 1, NULL);
+	if (dev) {
+		ifi_index = if_nametoindex(dev);
+		IF_FALSE_RETVAL_ERROR(ifi_index, NULL);
+	}
+
+	/* Create netlink message */
+	req = nl_msg_new();
+	IF_NULL_RETVAL_ERROR(req, NULL);
+
+	/* Prepare the request message, a delete request matches any scope */
+	struct rtmsg rt_req = { .rtm_family = AF_INET,
+				.rtm_dst_len = prefix,
+				.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC,
+				.rtm_protocol = add ? RTPROT_BOOT : RTPROT_UNSPEC,
+				.rtm_scope = !add    ? RT_SCOPE_NOWHERE :
+					     gateway ? RT_SCOPE_UNIVERSE :
+						       RT_SCOPE_LINK,
+				.rtm_type = add ? RTN_UNICAST : RTN_UNSPEC };
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, add ? RTM_NEWROUTE : RTM_DELROUTE), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK |
+						    (add ? NLM_F_CREATE | NLM_F_REPLACE : 0)),
+			   msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_rt_req(req, &rt_req), msg_err);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, RTA_TABLE, table), msg_err);
+	if (net_dst)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, RTA_DST, (char *)&dst_addr,
+						     sizeof(dst_addr)),
+				   msg_err);
+	if (gateway)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, RTA_GATEWAY, (char *)&gw_addr,
+						     sizeof(gw_addr)),
+				   msg_err);
+	if (dev)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, RTA_OIF, ifi_index), msg_err);
+
+	return req;
+
+msg_err:
+	ERROR("failed to create netlink message");
+	nl_msg_free(req);
+	return NULL;
+}
+
+/**
+ * Adds (replaces) or deletes the route to net_dst, the default route if
+ * net_dst is NULL, via gateway and/or dev in the given routing table.
+ */
+static int
+network_call_route(const char *table_id, const char *net_dst, const char *gateway,
+		   const char *dev, bool add)
+{
+	return network_rtnl_send(network_route_msg_new(table_id, net_dst, gateway, dev, add));
+}
+
 int
 network_move_link_ns(pid_t src_pid, pid_t dest_pid, const char *interface)
 {
@@ -125,7 +350,7 @@ network_set_ip_addr_of_interface(const char *addr, uint32_t subnet, const char *
 {
 	DEBUG("About to configure network interface %s with ip %s and subnet %i", interface, addr,
 	      subnet);
-	return network_call_ip(addr, subnet, interface, "add");
+	return network_call_ip(addr, subnet, interface, true);
 }
 
 int
@@ -133,7 +358,7 @@ network_remove_ip_addr_from_interface(const char *addr, uint32_t subnet, const c
 {
 	DEBUG("About to remove ip %s and subnet %i from network interface %s", addr, subnet,
 	      interface);
-	return network_call_ip(addr, subnet, interface, "del");
+	return network_call_ip(addr, subnet, interface, false);
 }
 
 int
@@ -142,9 +367,7 @@ network_setup_default_route(const char *gateway, bool add)
 	ASSERT(gateway);
 	DEBUG("%s default route via %s", add ? "Adding" : "Deleting", gateway);
 
-	const char *const argv[] = { IP_PATH, "route", add ? "replace" : "del", "default", "via",
-				     gateway, NULL };
-	return proc_fork_and_execvp(argv);
+	return network_call_route("main", NULL, gateway, NULL, add);
 }
 
 int
@@ -153,10 +376,7 @@ network_setup_default_route_table(const char *table_id, const char *gateway, boo
 	ASSERT(gateway);
 	DEBUG("%s default route via %s", add ? "Adding" : "Deleting", gateway);
 
-	const char *const argv[] = { IP_PATH,	"route",  add ? "replace" : "del",
-				     "default", "via",	  gateway,
-				     "table",	table_id, NULL };
-	return proc_fork_and_execvp(argv);
+	return network_call_route(table_id, NULL, gateway, NULL, add);
 }
 
 int
@@ -166,10 +386,7 @@ network_setup_route_table(const char *table_id, const char *net_dst, const char
 	ASSERT(dev);
 	DEBUG("%s route to %s via %s", add ? "Adding" : "Deleting", net_dst, dev);
 
-	const char *const argv[] = { IP_PATH, "route",	add ? "replace" : "del",
-				     net_dst, "dev",	dev,
-				     "table", table_id, NULL };
-	return proc_fork_and_execvp(argv);
+	return network_call_route(table_id, net_dst, NULL, dev, add);
 }
 
 int
@@ -179,9 +396,7 @@ network_setup_route(const char *net_dst, const char *dev, bool add)
 	ASSERT(dev);
 	DEBUG("%s route to %s via %s", add ? "Adding" : "Deleting", net_dst, dev);
 
-	const char *const argv[] = { IP_PATH, "route", add ? "replace" : "del", net_dst, "dev",
-				     dev,     "table", IP_ROUTING_TABLE,	NULL };
-	return proc_fork_and_execvp(argv);
+	return network_call_route(IP_ROUTING_TABLE, net_dst, NULL, dev, add);
 }
 
 int
@@ -198,13 +413,85 @@ network_iptables(const char *table, const char *chain, const char *net_src, cons
 	return proc_fork_and_execvp(argv);
 }
 
-int
-network_setup_port_forwarding(const char *srcip, uint16_t srcport, const char *dstip,
-			      uint16_t dstport, bool enable)
+static bool
+network_nft_is_supported(void)
 {
-	ASSERT(srcip);
-	ASSERT(dstip);
+	if (network_nft_support < 0) {
+		network_nft_support = nft_supported();
+		if (!network_nft_support)
+			INFO("Kernel lacks nftables support, falling back to iptables");
+	}
+	return network_nft_support;
+}
+
+static int
+network_nft_commit(nft_batch_t *batch)
+{
+	int ret = nft_batch_commit(batch);
+	nft_batch_free(batch);
+	return ret;
+}
+
+/**
+ * Starts a batch which replaces the table of the family by an empty one
+ * (enable) or deletes it if it exists.
+ */
+static nft_batch_t *
+network_nft_batch_new(uint8_t family, const char *table, bool enable)
+{
+	nft_batch_t *batch = nft_batch_new();
+	nft_batch_set_family(batch, family);
+
+	nft_batch_table(batch, table, true);
+	nft_batch_table(batch, table, false);
+	if (enable)
+		nft_batch_table(batch, table, true);
 
+	return batch;
+}
+
+static int
+network_setup_port_forwarding_nft(const char *srcip, uint16_t srcport, const char *dstip,
+				  uint16_t dstport, bool enable)
+{
+	struct in_addr src, dst, localhost = { .s_addr = htonl(INADDR_LOOPBACK) };
+	IF_TRUE_RETVAL_ERROR(inet_pton(AF_INET, srcip, &src) != 1, -1);
+	IF_TRUE_RETVAL_ERROR(inet_pton(AF_INET, dstip, &dst) != 1, -1);
+
+	char *table = mem_printf(NFT_TABLE_FWD, srcport);
+	nft_batch_t *batch = network_nft_batch_new(NFPROTO_IPV4, table, enable);
+
+	if (enable) {
+		nft_batch_add_chain(batch, table, "output", "nat", NF_INET_LOCAL_OUT,
+				    NF_IP_PRI_NAT_DST);
+		nft_batch_add_chain(batch, table, "postrouting", "nat", NF_INET_POST_ROUTING,
+				    NF_IP_PRI_NAT_SRC);
+
+		// forward local port to destination:port
+		nft_batch_rule_begin(batch, table, "output");
+		nft_batch_rule_match_ip(batch, false, localhost, 32);
+		nft_batch_rule_match_ip(batch, true, localhost, 32);
+		nft_batch_rule_match_tcp_dport(batch, srcport);
+		nft_batch_rule_nat(batch, true, dst, dstport);
+		nft_batch_rule_end(batch);
+
+		// change source address for forwarded packets
+		nft_batch_rule_begin(batch, table, "postrouting");
+		nft_batch_rule_match_ip(batch, false, localhost, 32);
+		nft_batch_rule_match_ip(batch, true, dst, 32);
+		nft_batch_rule_match_tcp_dport(batch, dstport);
+		nft_batch_rule_nat(batch, false, src, 0);
+		nft_batch_rule_end(batch);
+	}
+
+	mem_free(table);
+	return network_nft_commit(batch);
+}
+
+static int
+network_setup_port_forwarding_iptables(const char *srcip, uint16_t srcport, const char *dstip,
+				       uint16_t dstport, bool enable)
+{
 	char *src_port = mem_printf("%" PRIu16, srcport);
 	char *dst_port = mem_printf("%" PRIu16, dstport);
 	char *dst = mem_printf("%s:%" PRIu16, dstip, dstport);
@@ -234,12 +521,75 @@ network_setup_port_forwarding(const char *srcip, uint16_t srcport, const char *d
 }
 
 int
-network_setup_masquerading(const char *subnet, bool enable)
+network_setup_port_forwarding(const char *srcip, uint16_t srcport, const char *dstip,
+			      uint16_t dstport, bool enable)
 {
-	ASSERT(subnet);
+	ASSERT(srcip);
+	ASSERT(dstip);
 
-	DEBUG("%s IP forwarding from %s", enable ? "Enabling" : "Disabling", subnet);
+	if (network_nft_is_supported())
+		return network_setup_port_forwarding_nft(srcip, srcport, dstip, dstport, enable);
+
+	return network_setup_port_forwarding_iptables(srcip, srcport, dstip, dstport, enable);
+}
 
+/**
+ * Returns the name of the table of the subnet, which is kept free of
+ * the separators of the subnet notation.
+ */
+static char *
+network_nft_subnet_table_new(const char *fmt, const char *subnet)
+{
+	char *table = mem_printf(fmt, subnet);
+	for (char *c = table; *c; c++)
+		if (*c == '.' || *c == '/')
+			*c = '_';
+	return table;
+}
+
+static int
+network_setup_masquerading_nft(const char *subnet, bool enable)
+{
+	struct in_addr net;
+	uint8_t prefix;
+	IF_TRUE_RETVAL(network_parse_subnet(subnet, &net, &prefix), -1);
+
+	char *table = network_nft_subnet_table_new(NFT_TABLE_MASQ, subnet);
+	nft_batch_t *batch = network_nft_batch_new(NFPROTO_IPV4, table, enable);
+
+	if (enable) {
+		nft_batch_add_chain(batch, table, "postrouting", "nat", NF_INET_POST_ROUTING,
+				    NF_IP_PRI_NAT_SRC);
+		nft_batch_add_chain(batch, table, "forward", "filter", NF_INET_FORWARD,
+				    NF_IP_PRI_FILTER);
+
+		// outgoing
+		nft_batch_rule_begin(batch, table, "postrouting");
+		nft_batch_rule_match_ip(batch, false, net, prefix);
+		nft_batch_rule_masquerade(batch);
+		nft_batch_rule_end(batch);
+
+		nft_batch_rule_begin(batch, table, "forward");
+		nft_batch_rule_match_ip(batch, false, net, prefix);
+		nft_batch_rule_accept(batch);
+		nft_batch_rule_end(batch);
+
+		// incoming
+		nft_batch_rule_begin(batch, table, "forward");
+		nft_batch_rule_match_ip(batch, true, net, prefix);
+		nft_batch_rule_match_ct_state(batch, NF_CT_STATE_BIT(IP_CT_ESTABLISHED) |
+							     NF_CT_STATE_BIT(IP_CT_RELATED));
+		nft_batch_rule_accept(batch);
+		nft_batch_rule_end(batch);
+	}
+
+	mem_free(table);
+	return network_nft_commit(batch);
+}
+
+static int
+network_setup_masquerading_iptables(const char *subnet, bool enable)
+{
 	// outgoing
 	int error = network_iptables("nat", "POSTROUTING", subnet, "MASQUERADE", enable);
 	error |= network_iptables("filter", "FORWARD", subnet, "ACCEPT", enable);
@@ -260,7 +610,21 @@ network_setup_masquerading(const char *subnet, bool enable)
 				     NULL };
 	error |= proc_fork_and_execvp(argv);
 
-	if (error) {
+	return error ? -1 : 0;
+}
+
+int
+network_setup_masquerading(const char *subnet, bool enable)
+{
+	ASSERT(subnet);
+
+	DEBUG("%s IP forwarding from %s", enable ? "Enabling" : "Disabling", subnet);
+
+	int ret = network_nft_is_supported() ?
+			  network_setup_masquerading_nft(subnet, enable) :
+			  network_setup_masquerading_iptables(subnet, enable);
+
+	if (ret) {
 		ERROR("Failed to setup IP forwarding from %s", subnet);
 		return -1;
 	}
@@ -268,14 +632,441 @@ network_setup_masquerading(const char *subnet, bool enable)
 	return 0;
 }
 
+char *
+network_get_default_route_ifname_new(void)
+{
+	char *ifname = NULL;
+	char line[256];
+
+	FILE *fp = fopen(PROC_NET_ROUTE, "r");
+	IF_NULL_RETVAL_ERROR(fp, NULL);
+
+	// Iface Destination Gateway Flags ..., addresses in hex, skip the header line
+	while (!ifname && fgets(line, sizeof(line), fp)) {
+		char name[IFNAMSIZ];
+		unsigned long dst, gw, flags;
+		if (sscanf(line, "%15s %lx %lx %lx", name, &dst, &gw, &flags) != 4)
+			continue;
+		if (dst == 0 && (flags & RTF_UP))
+			ifname = mem_strdup(name);
+	}
+
+	fclose(fp);
+	return ifname;
+}
+
+int
+network_setup_flow_offload(const char *subnet, const char *ifname, bool enable)
+{
+	ASSERT(subnet && ifname);
+
+	struct in_addr net;
+	uint8_t prefix;
+	IF_TRUE_RETVAL(network_parse_subnet(subnet, &net, &prefix), -1);
+
+	if (!network_nft_is_supported()) {
+		WARN("Flow offload of %s requires nftables", subnet);
+		return -1;
+	}
+
+	char *uplink = NULL;
+	if (enable && !(uplink = network_get_default_route_ifname_new())) {
+		WARN("No default route to offload the flows of %s to", subnet);
+		return -1;
+	}
+
+	DEBUG("%s flow offload between %s and %s", enable ? "Enabling" : "Disabling", ifname,
+	      uplink ? uplink : "uplink");
+
+	char *table = network_nft_subnet_table_new(NFT_TABLE_FLOW, subnet);
+	nft_batch_t *batch = network_nft_batch_new(NFPROTO_IPV4, table, enable);
+
+	if (enable) {
+		const char *devs[] = { ifname, uplink };
+		nft_batch_add_flowtable(batch, table, NFT_FLOWTABLE, devs, 2);
+		nft_batch_add_chain(batch, table, "forward", "filter", NF_INET_FORWARD,
+				    NF_IP_PRI_FILTER);
+
+		// the flowtable also handles the replies of offloaded connections
+		uint8_t protos[] = { IPPROTO_TCP, IPPROTO_UDP };
+		for (size_t i = 0; i < sizeof(protos); i++) {
+			nft_batch_rule_begin(batch, table, "forward");
+			nft_batch_rule_match_ip(batch, false, net, prefix);
+			nft_batch_rule_match_l4proto(batch, protos[i]);
+			nft_batch_rule_flow_offload(batch, NFT_FLOWTABLE);
+			nft_batch_rule_end(batch);
+		}
+	}
+
+	int ret = network_nft_commit(batch);
+	if (ret)
+		WARN_ERRNO("Failed to setup flow offload for %s", subnet);
+
+	mem_free(uplink);
+	mem_free(table);
+	return ret;
+}
+
+int
+network_setup_bridge_port_filter(const char *port, const char *addr, bool enable)
+{
+	ASSERT(port && addr);
+
+	struct in_addr saddr;
+	IF_FALSE_RETVAL_ERROR(inet_aton(addr, &saddr), -1);
+
+	if (!network_nft_is_supported()) {
+		WARN("Filtering of bridge port %s requires nftables", port);
+		return -1;
+	}
+
+	DEBUG("%s filter of bridge port %s for %s", enable ? "Enabling" : "Disabling", port, addr);
+
+	char *table = mem_printf(NFT_TABLE_BRIDGE_PORT, port);
+	nft_batch_t *batch = network_nft_batch_new(NFPROTO_BRIDGE, table, enable);
+
+	if (enable) {
+		// packets to other ports and to the bridge itself
+		const char *chains[] = { "forward", "input" };
+		nft_batch_add_chain(batch, table, chains[0], "filter", NF_BR_FORWARD,
+				    NF_BR_PRI_FILTER_BRIDGED);
+		nft_batch_add_chain(batch, table, chains[1], "filter", NF_BR_LOCAL_IN,
+				    NF_BR_PRI_FILTER_BRIDGED);
+
+		for (size_t i = 0; i < ELEMENTSOF(chains); i++) {
+			nft_batch_rule_begin(batch, table, chains[i]);
+			nft_batch_rule_match_iifname(batch, port);
+			nft_batch_rule_match_protocol(batch, ETH_P_IP);
+			nft_batch_rule_match_ip(batch, false, saddr, 32);
+			nft_batch_rule_accept(batch);
+			nft_batch_rule_end(batch);
+
+			nft_batch_rule_begin(batch, table, chains[i]);
+			nft_batch_rule_match_iifname(batch, port);
+			nft_batch_rule_match_protocol(batch, ETH_P_ARP);
+			nft_batch_rule_accept(batch);
+			nft_batch_rule_end(batch);
+
+			// spoofed ipv4 and any other protocol
+			nft_batch_rule_begin(batch, table, chains[i]);
+			nft_batch_rule_match_iifname(batch, port);
+			nft_batch_rule_drop(batch);
+			nft_batch_rule_end(batch);
+		}
+	}
+
+	int ret = network_nft_commit(batch);
+	if (ret)
+		WARN_ERRNO("Failed to setup filter of bridge port %s", port);
+
+	mem_free(table);
+	return ret;
+}
+
+/**
+ * Creates a routing socket in the network namespace netns_fd, -1 for the
+ * current namespace. The socket keeps the namespace it has been created in.
+ */
+static nl_sock_t *
+network_rtnl_sock_new_netns(int netns_fd)
+{
+	if (netns_fd < 0)
+		return nl_sock_routing_new();
+
+	int own_netns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	IF_TRUE_RETVAL_ERROR(own_netns < 0, NULL);
+	if (setns(netns_fd, CLONE_NEWNET) < 0) {
+		ERROR_ERRNO("Could not join netns %d", netns_fd);
+		close(own_netns);
+		return NULL;
+	}
+	nl_sock_t *nl_sock = nl_sock_routing_new();
+	if (setns(own_netns, CLONE_NEWNET) < 0)
+		FATAL_ERRNO("Could not switch back to own netns");
+	close(own_netns);
+	return nl_sock;
+}
+
+/**
+ * Requests the link ifname, or the link with index ifindex if ifname is NULL,
+ * on nl_sock and stores the reply in buf, which must hold NETWORK_LINK_BUF_SIZE
+ * bytes.
+ * @return the RTM_NEWLINK reply or NULL on error
+ */
+static struct nlmsghdr *
+network_rtnl_get_link(const nl_sock_t *nl_sock, const char *ifname, int ifindex, char *buf)
+{
+	struct nlmsghdr *msg = NULL;
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC, .ifi_index = ifname ? 0 : ifindex };
+
+	nl_msg_t *req = nl_msg_new();
+	IF_NULL_RETVAL_ERROR(req, NULL);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_GETLINK), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), out);
+	if (ifname)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_IFNAME, ifname), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_send_kernel(nl_sock, req) < 0, out);
+
+	int len = nl_msg_receive_kernel(nl_sock, buf, NETWORK_LINK_BUF_SIZE, false);
+	IF_TRUE_GOTO_ERROR(len < 0, out);
+
+	msg = (struct nlmsghdr *)buf;
+	if (!NLMSG_OK(msg, (unsigned int)len) || msg->nlmsg_type != RTM_NEWLINK) {
+		DEBUG("Could not get link of %s", ifname ? ifname : "index");
+		msg = NULL;
+	}
+out:
+	nl_msg_free(req);
+	return msg;
+}
+
+int
+network_get_link_stats(int netns_fd, const char *ifname, network_link_stats_t *stats)
+{
+	ASSERT(ifname && stats);
+
+	int ret = -1;
+
+	nl_sock_t *nl_sock = network_rtnl_sock_new_netns(netns_fd);
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	char *buf = mem_alloc(NETWORK_LINK_BUF_SIZE);
+	struct nlmsghdr *msg = network_rtnl_get_link(nl_sock, ifname, 0, buf);
+	IF_NULL_GOTO(msg, out);
+
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	int attr_len = IFLA_PAYLOAD(msg);
+	for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attr_len);
+	     rta = RTA_NEXT(rta, attr_len)) {
+		if (rta->rta_type != IFLA_STATS64 ||
+		    RTA_PAYLOAD(rta) < sizeof(struct rtnl_link_stats64))
+			continue;
+
+		struct rtnl_link_stats64 link_stats;
+		memcpy(&link_stats, RTA_DATA(rta), sizeof(link_stats));
+		stats->rx_packets = link_stats.rx_packets;
+		stats->tx_packets = link_stats.tx_packets;
+		stats->rx_bytes = link_stats.rx_bytes;
+		stats->tx_bytes = link_stats.tx_bytes;
+		ret = 0;
+	}
+out:
+	mem_free(buf);
+	nl_sock_free(nl_sock);
+	return ret;
+}
+
+char *
+network_get_link_master_new(int netns_fd, const char *ifname)
+{
+	ASSERT(ifname);
+
+	char *master = NULL;
+	int master_index = 0;
+
+	nl_sock_t *nl_sock = network_rtnl_sock_new_netns(netns_fd);
+	IF_NULL_RETVAL_ERROR(nl_sock, NULL);
+
+	char *buf = mem_alloc(NETWORK_LINK_BUF_SIZE);
+	struct nlmsghdr *msg = network_rtnl_get_link(nl_sock, ifname, 0, buf);
+	IF_NULL_GOTO(msg, out);
+
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	int attr_len = IFLA_PAYLOAD(msg);
+	for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attr_len);
+	     rta = RTA_NEXT(rta, attr_len)) {
+		if (rta->rta_type == IFLA_MASTER && RTA_PAYLOAD(rta) >= sizeof(uint32_t))
+			master_index = *(uint32_t *)RTA_DATA(rta);
+	}
+	IF_TRUE_GOTO(master_index <= 0, out);
+
+	// the index is only valid in the namespace of the socket
+	msg = network_rtnl_get_link(nl_sock, NULL, master_index, buf);
+	IF_NULL_GOTO(msg, out);
+
+	ifi = NLMSG_DATA(msg);
+	attr_len = IFLA_PAYLOAD(msg);
+	for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attr_len);
+	     rta = RTA_NEXT(rta, attr_len)) {
+		if (rta->rta_type == IFLA_IFNAME)
+			master = mem_strndup(RTA_DATA(rta), RTA_PAYLOAD(rta));
+	}
+out:
+	mem_free(buf);
+	nl_sock_free(nl_sock);
+	return master;
+}
+
+int
+network_create_sublink(int netns_fd, const char *parent, const char *kind, const char *ifname,
+		       const uint8_t mac[6], pid_t pid)
+{
+	ASSERT(parent && kind && ifname);
+
+	bool macvlan = !strcmp(kind, "macvlan");
+	IF_FALSE_RETVAL_ERROR(macvlan || !strcmp(kind, "ipvlan"), -1);
+
+	int ret = -1;
+	nl_msg_t *req = NULL;
+	struct nlattr *linkinfo, *data;
+
+	nl_sock_t *nl_sock = network_rtnl_sock_new_netns(netns_fd);
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	// the parent is looked up by the socket, i.e. in the namespace of the parent
+	char *buf = mem_alloc(NETWORK_LINK_BUF_SIZE);
+	struct nlmsghdr *msg = network_rtnl_get_link(nl_sock, parent, 0, buf);
+	IF_NULL_GOTO_ERROR(msg, out);
+	uint32_t parent_index = ((struct ifinfomsg *)NLMSG_DATA(msg))->ifi_index;
+
+	DEBUG("Creating %s %s on %s (%u) in netns of %d", kind, ifname, parent, parent_index,
+	      pid);
+
+	req = nl_msg_new();
+	IF_NULL_GOTO_ERROR(req, out);
+
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC };
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_NEWLINK), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL |
+							 NLM_F_ACK),
+			   out);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_IFNAME, ifname), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, IFLA_LINK, parent_index), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, IFLA_NET_NS_PID, pid), out);
+	// ipvlan sub-interfaces share the mac of their parent
+	if (macvlan && mac)
+		IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IFLA_ADDRESS, (const char *)mac, 6), out);
+
+	IF_NULL_GOTO_ERROR(linkinfo = nl_msg_start_nested_attr(req, IFLA_LINKINFO), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_INFO_KIND, kind), out);
+	IF_NULL_GOTO_ERROR(data = nl_msg_start_nested_attr(req, IFLA_INFO_DATA), out);
+	if (macvlan) {
+		IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, IFLA_MACVLAN_MODE, MACVLAN_MODE_BRIDGE),
+				   out);
+	} else {
+		uint16_t mode = IPVLAN_MODE_L2;
+		IF_TRUE_GOTO_ERROR(nl_msg_add_buffer(req, IFLA_IPVLAN_MODE, (const char *)&mode,
+						     sizeof(mode)),
+				   out);
+	}
+	IF_TRUE_GOTO_ERROR(nl_msg_end_nested_attr(req, data), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_end_nested_attr(req, linkinfo), out);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_send_kernel_verify(nl_sock, req), out);
+	ret = 0;
+out:
+	mem_free(buf);
+	nl_msg_free(req);
+	nl_sock_free(nl_sock);
+	return ret;
+}
+
+int
+network_create_bridge(const char *ifname)
+{
+	ASSERT(ifname);
+
+	int ret = -1;
+	struct nlattr *linkinfo;
+
+	nl_sock_t *nl_sock = nl_sock_routing_new();
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	DEBUG("Creating bridge %s", ifname);
+
+	nl_msg_t *req = nl_msg_new();
+	IF_NULL_GOTO_ERROR(req, out);
+
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC };
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_NEWLINK), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL |
+							 NLM_F_ACK),
+			   out);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_IFNAME, ifname), out);
+
+	IF_NULL_GOTO_ERROR(linkinfo = nl_msg_start_nested_attr(req, IFLA_LINKINFO), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_INFO_KIND, "bridge"), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_end_nested_attr(req, linkinfo), out);
+
+	IF_TRUE_GOTO_ERROR(nl_msg_send_kernel_verify(nl_sock, req), out);
+	ret = 0;
+out:
+	nl_msg_free(req);
+	nl_sock_free(nl_sock);
+	return ret;
+}
+
+char *
+network_get_vf_ifname_new(const char *pf, int vf)
+{
+	ASSERT(pf);
+
+	char *ifname = NULL;
+	char *net_path = mem_printf("/sys/class/net/%s/device/virtfn%d/net", pf, vf);
+
+	DIR *dir = opendir(net_path);
+	if (!dir) {
+		ERROR_ERRNO("Could not find virtual function %d of %s", vf, pf);
+		mem_free(net_path);
+		return NULL;
+	}
+	// a virtual function exposes exactly one netdev
+	for (struct dirent *de = readdir(dir); de; de = readdir(dir)) {
+		if (de->d_name[0] == '.')
+			continue;
+		ifname = mem_strdup(de->d_name);
+		break;
+	}
+	closedir(dir);
+	mem_free(net_path);
+	return ifname;
+}
+
 int
 network_delete_link(const char *dev)
 {
 	ASSERT(dev);
 	DEBUG("Destroying network interface %s", dev);
 
-	const char *const argv[] = { IP_PATH, "link", "delete", dev, NULL };
-	return proc_fork_and_execvp(argv);
+	nl_sock_t *nl_sock = NULL;
+	nl_msg_t *req = NULL;
+
+	/* Get the interface index of the interface name */
+	unsigned int ifi_index = if_nametoindex(dev);
+	IF_FALSE_RETVAL_ERROR(ifi_index, -1);
+
+	/* Open netlink socket */
+	nl_sock = nl_sock_routing_new();
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	/* Create netlink message */
+	req = nl_msg_new();
+	IF_NULL_GOTO_ERROR(req, msg_err);
+
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC, .ifi_index = ifi_index };
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_DELLINK), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), msg_err);
+
+	/* Send request message and wait for the response message */
+	IF_TRUE_GOTO_ERROR(nl_msg_send_kernel_verify(nl_sock, req), msg_err);
+
+	nl_msg_free(req);
+	nl_sock_free(nl_sock);
+	return 0;
+
+msg_err:
+	ERROR("failed to create/send netlink message");
+	nl_msg_free(req);
+	nl_sock_free(nl_sock);
+	return -1;
 }
 
 void
@@ -294,35 +1085,23 @@ network_enable_ip_forwarding(void)
  * using either the flag IFF_UP or IFF_DOWN
  * with a netlink message using the netlink socket.
  */
-int
-network_set_flag(const char *ifi_name, const uint32_t flag)
+nl_msg_t *
+network_set_flag_msg_new(const char *ifi_name, const uint32_t flag)
 {
 	ASSERT(ifi_name && (flag == IFF_UP || flag == IFF_DOWN));
 
 	DEBUG("Bringing %s interface \"%s\"", flag == IFF_UP ? "up" : "down", ifi_name);
 
-	nl_sock_t *nl_sock = NULL;
-	unsigned int ifi_index;
-	nl_msg_t *req = NULL;
-
 	/* Get the interface index of the interface name */
-	if (!(ifi_index = if_nametoindex(ifi_name))) {
+	unsigned int ifi_index = if_nametoindex(ifi_name);
+	if (!ifi_index) {
 		ERROR("net interface name '%s' could not be resolved", ifi_name);
-		return -1;
-	}
-
-	/* Open netlink socket */
-	if (!(nl_sock = nl_sock_routing_new())) {
-		ERROR("failed to allocate netlink socket");
-		return -1;
+		return NULL;
 	}
 
 	/* Create netlink message */
-	if (!(req = nl_msg_new())) {
-		ERROR("failed to allocate netlink message");
-		nl_sock_free(nl_sock);
-		return -1;
-	}
+	nl_msg_t *req = nl_msg_new();
+	IF_NULL_RETVAL_ERROR(req, NULL);
 
 	/* Prepare the request message */
 	struct ifinfomsg link_req = { .ifi_family = AF_INET,
@@ -331,31 +1110,58 @@ network_set_flag(const char *ifi_name, const uint32_t flag)
 				      .ifi_flags = flag };
 
 	/* Fill netlink message header */
-	if (nl_msg_set_type(req, RTM_NEWLINK))
-		goto msg_err;
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_NEWLINK), msg_err);
 
 	/* Set appropriate flags for request, creating new object, exclusive access and acknowledgment response */
-	if (nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK))
-		goto msg_err;
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK), msg_err);
 
 	/* Fill link request header of request message */
-	if (nl_msg_set_link_req(req, &link_req))
-		goto msg_err;
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), msg_err);
 
-	/* Send request message and wait for the response message */
-	if (nl_msg_send_kernel_verify(nl_sock, req))
-		goto msg_err;
+	return req;
 
+msg_err:
+	ERROR("failed to create netlink message");
 	nl_msg_free(req);
-	nl_sock_free(nl_sock);
+	return NULL;
+}
 
-	return 0;
+int
+network_set_flag(const char *ifi_name, const uint32_t flag)
+{
+	return network_rtnl_send(network_set_flag_msg_new(ifi_name, flag));
+}
+
+nl_msg_t *
+network_set_master_msg_new(const char *ifi_name, const char *master)
+{
+	ASSERT(ifi_name && master);
+
+	DEBUG("Attaching interface \"%s\" to \"%s\"", ifi_name, master);
+
+	unsigned int ifi_index = if_nametoindex(ifi_name);
+	unsigned int master_index = if_nametoindex(master);
+	if (!ifi_index || !master_index) {
+		ERROR("net interface name '%s' or '%s' could not be resolved", ifi_name, master);
+		return NULL;
+	}
+
+	nl_msg_t *req = nl_msg_new();
+	IF_NULL_RETVAL_ERROR(req, NULL);
+
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC, .ifi_index = ifi_index };
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_NEWLINK), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), msg_err);
+	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, IFLA_MASTER, master_index), msg_err);
+
+	return req;
 
 msg_err:
-	ERROR("failed to create/send netlink message");
+	ERROR("failed to create netlink message");
 	nl_msg_free(req);
-	nl_sock_free(nl_sock);
-	return -1;
+	return NULL;
 }
 
 #ifdef USE_LOCALNET_ROUTING
@@ -537,25 +1343,18 @@ msg_err:
 	return -1;
 }
 
-int
-network_rtnet_move_ns(const char *ifi_name, const pid_t pid)
+nl_msg_t *
+network_rtnet_move_ns_msg_new(const char *ifi_name, const pid_t pid)
 {
 	ASSERT(ifi_name);
 
-	nl_sock_t *nl_sock = NULL;
-	nl_msg_t *req = NULL;
-
 	/* Get the interface index of the interface name */
 	unsigned int ifi_index = if_nametoindex(ifi_name);
-	IF_FALSE_RETVAL_ERROR(ifi_index, -1);
-
-	/* Open netlink socket */
-	nl_sock = nl_sock_routing_new();
-	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+	IF_FALSE_RETVAL_ERROR(ifi_index, NULL);
 
 	/* Create netlink message */
-	req = nl_msg_new();
-	IF_NULL_GOTO_ERROR(req, msg_err);
+	nl_msg_t *req = nl_msg_new();
+	IF_NULL_RETVAL_ERROR(req, NULL);
 
 	/* Prepare the request message */
 	struct ifinfomsg link_req = {
@@ -575,82 +1374,63 @@ network_rtnet_move_ns(const char *ifi_name, const pid_t pid)
 	/* Set the PID in the netlink header */
 	IF_TRUE_GOTO_ERROR(nl_msg_add_u32(req, IFLA_NET_NS_PID, pid), msg_err);
 
-	/* Send request message and wait for the response message */
-	IF_TRUE_GOTO_ERROR(nl_msg_send_kernel_verify(nl_sock, req), msg_err);
-
-	nl_msg_free(req);
-	nl_sock_free(nl_sock);
-
-	return 0;
+	return req;
 
 msg_err:
-	ERROR("failed to create/send netlink message");
+	ERROR("failed to create netlink message");
 	nl_msg_free(req);
-	nl_sock_free(nl_sock);
-	return -1;
+	return NULL;
 }
 
 int
-network_rename_ifi(const char *old_ifi_name, const char *new_ifi_name)
+network_rtnet_move_ns(const char *ifi_name, const pid_t pid)
 {
-	ASSERT(old_ifi_name && new_ifi_name);
+	return network_rtnl_send(network_rtnet_move_ns_msg_new(ifi_name, pid));
+}
 
-	nl_sock_t *nl_sock = NULL;
-	unsigned int ifi_index_old;
-	nl_msg_t *req = NULL;
+nl_msg_t *
+network_rename_ifi_msg_new(const char *old_ifi_name, const char *new_ifi_name)
+{
+	ASSERT(old_ifi_name && new_ifi_name);
 
 	/* Get the interface index of the interface name */
-	if (!(ifi_index_old = if_nametoindex(old_ifi_name))) {
+	unsigned int ifi_index_old = if_nametoindex(old_ifi_name);
+	if (!ifi_index_old) {
 		ERROR("veth interface name could not be resolved");
-		return -1;
-	}
-
-	/* Open netlink socket */
-	if (!(nl_sock = nl_sock_routing_new())) {
-		ERROR("failed to allocate netlink socket");
-		return -1;
+		return NULL;
 	}
 
 	/* Create netlink message */
-	if (!(req = nl_msg_new())) {
-		ERROR("failed to allocate netlink message");
-		nl_sock_free(nl_sock);
-		return -1;
-	}
+	nl_msg_t *req = nl_msg_new();
+	IF_NULL_RETVAL_ERROR(req, NULL);
 
 	struct ifinfomsg link_req = { .ifi_family = AF_INET, .ifi_index = ifi_index_old };
 
 	/* Fill netlink message header */
-	if (nl_msg_set_type(req, RTM_NEWLINK))
-		goto msg_err;
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_NEWLINK), msg_err);
 
 	/* Set appropriate flags for request, creating new object,
 	 *  exclusive access and acknowledgment response */
-	if (nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK))
-		goto msg_err;
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_ACK), msg_err);
 
 	/* Fill link request header of request message */
-	if (nl_msg_set_link_req(req, &link_req))
-		goto msg_err;
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), msg_err);
 
-	/* Set the PID in the netlink header */
-	if (nl_msg_add_string(req, IFLA_IFNAME, new_ifi_name))
-		goto msg_err;
+	/* Set the new name */
+	IF_TRUE_GOTO_ERROR(nl_msg_add_string(req, IFLA_IFNAME, new_ifi_name), msg_err);
 
-	/* Send request message and wait for the response message */
-	if (nl_msg_send_kernel_verify(nl_sock, req))
-		goto msg_err;
-
-	nl_msg_free(req);
-	nl_sock_free(nl_sock);
-
-	return 0;
+	return req;
 
 msg_err:
-	ERROR("failed to create/send netlink message");
+	ERROR("failed to create netlink message");
 	nl_msg_free(req);
-	nl_sock_free(nl_sock);
-	return -1;
+	return NULL;
+}
+
+int
+network_rename_ifi(const char *old_ifi_name, const char *new_ifi_name)
+{
+	return network_rtnl_send(network_rename_ifi_msg_new(old_ifi_name, new_ifi_name));
 }
 
 int
@@ -34,6 +34,7 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include "list.h"
+#include "nl.h"
 
 #include <net/if.h>
 
@@ -81,6 +82,16 @@ network_setup_route(const char *net_dst, const char *dev, bool add);
 int
 network_setup_route_table(const char *table_id, const char *net_dst, const char *dev, bool add);
 
+/**
+ * Creates the request to add (replace) or delete the route to net_dst, the
+ * default route if net_dst is NULL, via gateway and/or dev in the routing
+ * table table_id, to be sent by network_rtnl_send_batch().
+ * @return the request or NULL on error
+ */
+nl_msg_t *
+network_route_msg_new(const char *table_id, const char *net_dst, const char *gateway,
+		      const char *dev, bool add);
+
 /**
  * Add (or remove) simple iptables rule.
  */
@@ -89,18 +100,105 @@ network_iptables(const char *table, const char *chain, const char *net_src, cons
 		 bool add);
 
 /**
- * Setup a localnet portforwarding
+ * Setup a localnet portforwarding. The rules are kept in an nftables table
+ * of their own per source port, which is replaced (or deleted) atomically.
+ * Falls back to iptables if the kernel lacks nftables support.
  */
 int
 network_setup_port_forwarding(const char *srcip, uint16_t srcport, const char *dstip,
 			      uint16_t dstport, bool enable);
 
 /**
- * Enable or disable IP masquerading (forwarding) from given subnet.
+ * Enable or disable IP masquerading (forwarding) from given subnet. The rules
+ * are kept in an nftables table of their own per subnet, which is replaced
+ * (or deleted) atomically. Falls back to iptables if the kernel lacks
+ * nftables support.
  */
 int
 network_setup_masquerading(const char *subnet, bool enable);
 
+/**
+ * Enables or disables the offload of the tcp and udp connections from subnet
+ * to an nftables flowtable. Once established, the packets of these connections
+ * are forwarded between the interface ifname and the interface of the default
+ * route directly at ingress, bypassing the netfilter hooks and the rules of
+ * network_setup_masquerading(), whose NAT is applied by the flowtable.
+ * Requires nftables, there is no iptables counterpart.
+ * @return 0 on success, -1 if the flows keep the regular path
+ */
+int
+network_setup_flow_offload(const char *subnet, const char *ifname, bool enable);
+
+/**
+ * Enables or disables the nftables bridge filter of the bridge port port, which
+ * only lets ARP and IPv4 packets with the source address addr enter the bridge
+ * from the port. Packets between the ports of a bridge are not routed, thus
+ * only this filter applies to them, not the rules of network_setup_masquerading().
+ * Requires nftables, there is no ebtables counterpart.
+ * @return 0 on success, -1 on error
+ */
+int
+network_setup_bridge_port_filter(const char *port, const char *addr, bool enable);
+
+/**
+ * Returns the name of the interface of the default route of the current
+ * network namespace (newly allocated), or NULL if there is none.
+ */
+char *
+network_get_default_route_ifname_new(void);
+
+/**
+ * Packet and byte counters of a network interface.
+ */
+typedef struct network_link_stats {
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+} network_link_stats_t;
+
+/**
+ * Reads the counters of the interface ifname in the network namespace
+ * netns_fd, -1 for the current namespace.
+ * @return 0 on success, -1 on error
+ */
+int
+network_get_link_stats(int netns_fd, const char *ifname, network_link_stats_t *stats);
+
+/**
+ * Returns the (newly allocated) name of the master, e.g. a bridge, of the
+ * interface ifname in the network namespace netns_fd, -1 for the current
+ * namespace, NULL if it has none or on error.
+ */
+char *
+network_get_link_master_new(int netns_fd, const char *ifname);
+
+/**
+ * Creates a sub-interface ifname of kind "macvlan" (bridge mode) or "ipvlan"
+ * (l2 mode) on top of the interface parent in the network namespace netns_fd,
+ * -1 for the current namespace. The new interface is directly created in the
+ * network namespace of the process pid. The mac is only applied to macvlans
+ * and may be NULL to let the kernel generate one.
+ * @return 0 on success, -1 on error
+ */
+int
+network_create_sublink(int netns_fd, const char *parent, const char *kind, const char *ifname,
+		       const uint8_t mac[6], pid_t pid);
+
+/**
+ * Creates the bridge ifname without ports in the current network namespace.
+ * @return 0 on success, -1 on error, e.g. if ifname exists
+ */
+int
+network_create_bridge(const char *ifname);
+
+/**
+ * Returns the (newly allocated) name of the netdev of the virtual function vf
+ * of the SR-IOV physical function pf, NULL if it does not exist.
+ */
+char *
+network_get_vf_ifname_new(const char *pf, int vf);
+
 /**
  * Free network interface for instance to be reusable after a container restart
  */
@@ -121,6 +219,21 @@ network_enable_ip_forwarding(void);
 int
 network_set_flag(const char *ifi_name, const uint32_t flag);
 
+/**
+ * Creates the request of network_set_flag() to be sent by network_rtnl_send_batch().
+ * @return the request or NULL on error
+ */
+nl_msg_t *
+network_set_flag_msg_new(const char *ifi_name, const uint32_t flag);
+
+/**
+ * Creates the request to attach the interface ifi_name to master, e.g. as
+ * port of a bridge, to be sent by network_rtnl_send_batch().
+ * @return the request or NULL on error
+ */
+nl_msg_t *
+network_set_master_msg_new(const char *ifi_name, const char *master);
+
 /**
  * Bring up the loopback interface and shrink its subnet.
  */
@@ -178,6 +291,13 @@ network_nl80211_move_ns(const char *if_name, const pid_t pid);
 int
 network_rtnet_move_ns(const char *ifi_name, const pid_t pid);
 
+/**
+ * Creates the request of network_rtnet_move_ns() to be sent by network_rtnl_send_batch().
+ * @return the request or NULL on error
+ */
+nl_msg_t *
+network_rtnet_move_ns_msg_new(const char *ifi_name, const pid_t pid);
+
 /**
  * This function renames a network interface from old_ifi_name to new_ifi_name
  * with a netlink message using the netlink socket.
@@ -188,6 +308,23 @@ network_rtnet_move_ns(const char *ifi_name, const pid_t pid);
 int
 network_rename_ifi(const char *old_ifi_name, const char *new_ifi_name);
 
+/**
+ * Creates the request of network_rename_ifi() to be sent by network_rtnl_send_batch().
+ * @return the request or NULL on error
+ */
+nl_msg_t *
+network_rename_ifi_msg_new(const char *old_ifi_name, const char *new_ifi_name);
+
+/**
+ * Sends the list of rtnetlink requests in a single datagram and checks all
+ * ACKs. Requests refer to interfaces by their index, which is resolved when
+ * a request is created, thus e.g. a renamed interface can still be moved by
+ * a later request of the same batch. The requests and the list are freed.
+ * @return 0 if all requests succeeded, -1 otherwise
+ */
+int
+network_rtnl_send_batch(list_t *reqs);
+
 /**
  * Convert a String representing a mac address ,e.g., "00:11:22:33:44:55"
  * to the corresponding byte array.
@@ -0,0 +1,597 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "nft.h"
+#include "nl.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <net/if.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+struct nft_batch {
+	list_t *msgs;
+	nl_msg_t *rule;		//!< the rule currently built
+	struct nlattr *exprs;	//!< expression list of the current rule
+	uint8_t family;		//!< NFPROTO_* of the tables
+	bool failed;
+};
+
+/*
+ * Appends a new message with the nfgenmsg header to the batch.
+ */
+static nl_msg_t *
+nft_batch_msg_new(nft_batch_t *batch, uint16_t type, uint16_t flags, uint8_t family,
+		  uint16_t res_id)
+{
+	nl_msg_t *msg = nl_msg_new();
+	IF_NULL_RETVAL(msg, NULL);
+
+	struct nfgenmsg nfg = { .nfgen_family = family,
+				.version = NFNETLINK_V0,
+				.res_id = htons(res_id) };
+
+	if (nl_msg_set_type(msg, type) || nl_msg_set_flags(msg, NLM_F_REQUEST | flags) ||
+	    nl_msg_set_buf_unaligned(msg, (char *)&nfg, sizeof(nfg))) {
+		nl_msg_free(msg);
+		return NULL;
+	}
+
+	batch->msgs = list_append(batch->msgs, msg);
+	return msg;
+}
+
+static nl_msg_t *
+nft_batch_msg_new_nft(nft_batch_t *batch, uint16_t cmd, uint16_t flags)
+{
+	return nft_batch_msg_new(batch, (NFNL_SUBSYS_NFTABLES << 8) | cmd, flags, batch->family,
+				 0);
+}
+
+static int
+nft_batch_fail(nft_batch_t *batch)
+{
+	batch->failed = true;
+	return -1;
+}
+
+nft_batch_t *
+nft_batch_new(void)
+{
+	nft_batch_t *batch = mem_new0(nft_batch_t, 1);
+	batch->family = NFPROTO_IPV4;
+
+	if (!nft_batch_msg_new(batch, NFNL_MSG_BATCH_BEGIN, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES))
+		batch->failed = true;
+
+	return batch;
+}
+
+void
+nft_batch_free(nft_batch_t *batch)
+{
+	IF_NULL_RETURN(batch);
+
+	for (list_t *l = batch->msgs; l; l = l->next)
+		nl_msg_free(l->data);
+	list_delete(batch->msgs);
+	mem_free(batch);
+}
+
+void
+nft_batch_set_family(nft_batch_t *batch, uint8_t family)
+{
+	ASSERT(batch);
+	batch->family = family;
+}
+
+int
+nft_batch_table(nft_batch_t *batch, const char *table, bool add)
+{
+	ASSERT(batch && table);
+
+	nl_msg_t *msg = nft_batch_msg_new_nft(batch, add ? NFT_MSG_NEWTABLE : NFT_MSG_DELTABLE,
+					      add ? NLM_F_CREATE : 0);
+	if (!msg || nl_msg_add_string(msg, NFTA_TABLE_NAME, table))
+		return nft_batch_fail(batch);
+
+	return 0;
+}
+
+int
+nft_batch_add_chain(nft_batch_t *batch, const char *table, const char *chain, const char *type,
+		    uint32_t hook, int32_t prio)
+{
+	ASSERT(batch && table && chain && type);
+
+	nl_msg_t *msg = nft_batch_msg_new_nft(batch, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	IF_NULL_RETVAL(msg, nft_batch_fail(batch));
+
+	IF_TRUE_GOTO(nl_msg_add_string(msg, NFTA_CHAIN_TABLE, table), err);
+	IF_TRUE_GOTO(nl_msg_add_string(msg, NFTA_CHAIN_NAME, chain), err);
+	IF_TRUE_GOTO(nl_msg_add_string(msg, NFTA_CHAIN_TYPE, type), err);
+
+	struct nlattr *nest = nl_msg_start_nested_attr(msg, NFTA_CHAIN_HOOK | NLA_F_NESTED);
+	IF_NULL_GOTO(nest, err);
+	IF_TRUE_GOTO(nl_msg_add_u32(msg, NFTA_HOOK_HOOKNUM, htonl(hook)), err);
+	IF_TRUE_GOTO(nl_msg_add_u32(msg, NFTA_HOOK_PRIORITY, htonl(prio)), err);
+	IF_TRUE_GOTO(nl_msg_end_nested_attr(msg, nest), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_add_flowtable(nft_batch_t *batch, const char *table, const char *flowtable,
+			const char **devs, int n_devs)
+{
+	ASSERT(batch && table && flowtable && devs);
+
+	nl_msg_t *msg = nft_batch_msg_new_nft(batch, NFT_MSG_NEWFLOWTABLE, NLM_F_CREATE);
+	IF_NULL_RETVAL(msg, nft_batch_fail(batch));
+
+	IF_TRUE_GOTO(nl_msg_add_string(msg, NFTA_FLOWTABLE_TABLE, table), err);
+	IF_TRUE_GOTO(nl_msg_add_string(msg, NFTA_FLOWTABLE_NAME, flowtable), err);
+
+	struct nlattr *hook = nl_msg_start_nested_attr(msg, NFTA_FLOWTABLE_HOOK | NLA_F_NESTED);
+	IF_NULL_GOTO(hook, err);
+	IF_TRUE_GOTO(nl_msg_add_u32(msg, NFTA_FLOWTABLE_HOOK_NUM, htonl(NF_NETDEV_INGRESS)), err);
+	IF_TRUE_GOTO(nl_msg_add_u32(msg, NFTA_FLOWTABLE_HOOK_PRIORITY, htonl(0)), err);
+
+	struct nlattr *nest = nl_msg_start_nested_attr(msg, NFTA_FLOWTABLE_HOOK_DEVS | NLA_F_NESTED);
+	IF_NULL_GOTO(nest, err);
+	for (int i = 0; i < n_devs; i++)
+		IF_TRUE_GOTO(nl_msg_add_string(msg, NFTA_DEVICE_NAME, devs[i]), err);
+	IF_TRUE_GOTO(nl_msg_end_nested_attr(msg, nest), err);
+	IF_TRUE_GOTO(nl_msg_end_nested_attr(msg, hook), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_begin(nft_batch_t *batch, const char *table, const char *chain)
+{
+	ASSERT(batch && table && chain);
+	ASSERT(!batch->rule);
+
+	nl_msg_t *msg = nft_batch_msg_new_nft(batch, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+	IF_NULL_RETVAL(msg, nft_batch_fail(batch));
+
+	IF_TRUE_GOTO(nl_msg_add_string(msg, NFTA_RULE_TABLE, table), err);
+	IF_TRUE_GOTO(nl_msg_add_string(msg, NFTA_RULE_CHAIN, chain), err);
+
+	batch->exprs = nl_msg_start_nested_attr(msg, NFTA_RULE_EXPRESSIONS | NLA_F_NESTED);
+	IF_NULL_GOTO(batch->exprs, err);
+
+	batch->rule = msg;
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_end(nft_batch_t *batch)
+{
+	ASSERT(batch);
+	IF_NULL_RETVAL(batch->rule, nft_batch_fail(batch));
+
+	int ret = nl_msg_end_nested_attr(batch->rule, batch->exprs);
+	batch->rule = NULL;
+	batch->exprs = NULL;
+
+	return ret ? nft_batch_fail(batch) : 0;
+}
+
+/*
+ * Helpers to append a single expression to the current rule. Register
+ * numbers and all other integer attributes are in network byte order.
+ */
+
+static struct nlattr *
+nft_expr_begin(nft_batch_t *batch, const char *name, struct nlattr **data)
+{
+	IF_NULL_RETVAL(batch->rule, NULL);
+
+	struct nlattr *elem = nl_msg_start_nested_attr(batch->rule, NFTA_LIST_ELEM | NLA_F_NESTED);
+	IF_NULL_RETVAL(elem, NULL);
+	IF_TRUE_RETVAL(nl_msg_add_string(batch->rule, NFTA_EXPR_NAME, name), NULL);
+
+	*data = nl_msg_start_nested_attr(batch->rule, NFTA_EXPR_DATA | NLA_F_NESTED);
+	IF_NULL_RETVAL(*data, NULL);
+
+	return elem;
+}
+
+static int
+nft_expr_end(nft_batch_t *batch, struct nlattr *elem, struct nlattr *data)
+{
+	IF_TRUE_RETVAL(nl_msg_end_nested_attr(batch->rule, data), -1);
+	return nl_msg_end_nested_attr(batch->rule, elem);
+}
+
+static int
+nft_expr_add_u32(nft_batch_t *batch, int type, uint32_t val)
+{
+	return nl_msg_add_u32(batch->rule, type, htonl(val));
+}
+
+/*
+ * Adds a nested attribute holding the value of len bytes as NFTA_DATA_VALUE.
+ */
+static int
+nft_expr_add_data(nft_batch_t *batch, int type, const void *val, size_t len)
+{
+	struct nlattr *nest = nl_msg_start_nested_attr(batch->rule, type | NLA_F_NESTED);
+	IF_NULL_RETVAL(nest, -1);
+	IF_TRUE_RETVAL(nl_msg_add_buffer(batch->rule, NFTA_DATA_VALUE, val, len), -1);
+	return nl_msg_end_nested_attr(batch->rule, nest);
+}
+
+static int
+nft_expr_payload(nft_batch_t *batch, uint32_t base, uint32_t offset, uint32_t len)
+{
+	struct nlattr *data, *elem = nft_expr_begin(batch, "payload", &data);
+	IF_NULL_RETVAL(elem, -1);
+
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_PAYLOAD_DREG, NFT_REG_1), -1);
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_PAYLOAD_BASE, base), -1);
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_PAYLOAD_OFFSET, offset), -1);
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_PAYLOAD_LEN, len), -1);
+
+	return nft_expr_end(batch, elem, data);
+}
+
+static int
+nft_expr_meta(nft_batch_t *batch, uint32_t key)
+{
+	struct nlattr *data, *elem = nft_expr_begin(batch, "meta", &data);
+	IF_NULL_RETVAL(elem, -1);
+
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_META_DREG, NFT_REG_1), -1);
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_META_KEY, key), -1);
+
+	return nft_expr_end(batch, elem, data);
+}
+
+static int
+nft_expr_ct(nft_batch_t *batch, uint32_t key)
+{
+	struct nlattr *data, *elem = nft_expr_begin(batch, "ct", &data);
+	IF_NULL_RETVAL(elem, -1);
+
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_CT_DREG, NFT_REG_1), -1);
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_CT_KEY, key), -1);
+
+	return nft_expr_end(batch, elem, data);
+}
+
+/*
+ * Masks register 1 by mask of len bytes.
+ */
+static int
+nft_expr_bitwise(nft_batch_t *batch, const void *mask, size_t len)
+{
+	uint8_t xor[16] = { 0 };
+	ASSERT(len <= sizeof(xor));
+
+	struct nlattr *data, *elem = nft_expr_begin(batch, "bitwise", &data);
+	IF_NULL_RETVAL(elem, -1);
+
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_BITWISE_SREG, NFT_REG_1), -1);
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_BITWISE_DREG, NFT_REG_1), -1);
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_BITWISE_LEN, len), -1);
+	IF_TRUE_RETVAL(nft_expr_add_data(batch, NFTA_BITWISE_MASK, mask, len), -1);
+	IF_TRUE_RETVAL(nft_expr_add_data(batch, NFTA_BITWISE_XOR, xor, len), -1);
+
+	return nft_expr_end(batch, elem, data);
+}
+
+/*
+ * Compares register 1 with the value of len bytes.
+ */
+static int
+nft_expr_cmp(nft_batch_t *batch, uint32_t op, const void *val, size_t len)
+{
+	struct nlattr *data, *elem = nft_expr_begin(batch, "cmp", &data);
+	IF_NULL_RETVAL(elem, -1);
+
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_CMP_SREG, NFT_REG_1), -1);
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_CMP_OP, op), -1);
+	IF_TRUE_RETVAL(nft_expr_add_data(batch, NFTA_CMP_DATA, val, len), -1);
+
+	return nft_expr_end(batch, elem, data);
+}
+
+/*
+ * Loads the value of len bytes into register reg.
+ */
+static int
+nft_expr_immediate(nft_batch_t *batch, uint32_t reg, const void *val, size_t len)
+{
+	struct nlattr *data, *elem = nft_expr_begin(batch, "immediate", &data);
+	IF_NULL_RETVAL(elem, -1);
+
+	IF_TRUE_RETVAL(nft_expr_add_u32(batch, NFTA_IMMEDIATE_DREG, reg), -1);
+	IF_TRUE_RETVAL(nft_expr_add_data(batch, NFTA_IMMEDIATE_DATA, val, len), -1);
+
+	return nft_expr_end(batch, elem, data);
+}
+
+int
+nft_batch_rule_match_ip(nft_batch_t *batch, bool dst, struct in_addr addr, uint8_t prefix)
+{
+	ASSERT(batch);
+
+	// a zero prefix matches everything
+	IF_TRUE_RETVAL(prefix == 0, 0);
+	IF_TRUE_RETVAL(prefix > 32, nft_batch_fail(batch));
+
+	uint32_t mask = htonl(prefix == 32 ? 0xffffffff : ~(0xffffffff >> prefix));
+	uint32_t net = addr.s_addr & mask;
+
+	// source and destination address offsets in the ip header
+	IF_TRUE_GOTO(nft_expr_payload(batch, NFT_PAYLOAD_NETWORK_HEADER, dst ? 16 : 12,
+				      sizeof(net)),
+		     err);
+	if (prefix < 32)
+		IF_TRUE_GOTO(nft_expr_bitwise(batch, &mask, sizeof(mask)), err);
+	IF_TRUE_GOTO(nft_expr_cmp(batch, NFT_CMP_EQ, &net, sizeof(net)), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_match_l4proto(nft_batch_t *batch, uint8_t proto)
+{
+	ASSERT(batch);
+
+	IF_TRUE_GOTO(nft_expr_meta(batch, NFT_META_L4PROTO), err);
+	IF_TRUE_GOTO(nft_expr_cmp(batch, NFT_CMP_EQ, &proto, sizeof(proto)), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_match_iifname(nft_batch_t *batch, const char *ifname)
+{
+	ASSERT(batch && ifname);
+
+	// interface names are compared including the zero padding
+	char name[IFNAMSIZ] = { 0 };
+	IF_TRUE_RETVAL(strlen(ifname) >= sizeof(name), nft_batch_fail(batch));
+	strncpy(name, ifname, sizeof(name) - 1);
+
+	IF_TRUE_GOTO(nft_expr_meta(batch, NFT_META_IIFNAME), err);
+	IF_TRUE_GOTO(nft_expr_cmp(batch, NFT_CMP_EQ, name, sizeof(name)), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_match_protocol(nft_batch_t *batch, uint16_t proto)
+{
+	ASSERT(batch);
+
+	uint16_t nproto = htons(proto);
+
+	IF_TRUE_GOTO(nft_expr_meta(batch, NFT_META_PROTOCOL), err);
+	IF_TRUE_GOTO(nft_expr_cmp(batch, NFT_CMP_EQ, &nproto, sizeof(nproto)), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_match_tcp_dport(nft_batch_t *batch, uint16_t port)
+{
+	ASSERT(batch);
+
+	uint16_t dport = htons(port);
+
+	IF_TRUE_GOTO(nft_batch_rule_match_l4proto(batch, IPPROTO_TCP), err);
+	// destination port offset in the tcp header
+	IF_TRUE_GOTO(nft_expr_payload(batch, NFT_PAYLOAD_TRANSPORT_HEADER, 2, sizeof(dport)),
+		     err);
+	IF_TRUE_GOTO(nft_expr_cmp(batch, NFT_CMP_EQ, &dport, sizeof(dport)), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_match_ct_state(nft_batch_t *batch, uint32_t states)
+{
+	ASSERT(batch);
+
+	// the conntrack state is kept in host byte order
+	uint32_t zero = 0;
+
+	IF_TRUE_GOTO(nft_expr_ct(batch, NFT_CT_STATE), err);
+	IF_TRUE_GOTO(nft_expr_bitwise(batch, &states, sizeof(states)), err);
+	IF_TRUE_GOTO(nft_expr_cmp(batch, NFT_CMP_NEQ, &zero, sizeof(zero)), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+/*
+ * Sets the verdict (NF_ACCEPT, NF_DROP) of the matched packets.
+ */
+static int
+nft_batch_rule_verdict(nft_batch_t *batch, uint32_t code)
+{
+	struct nlattr *data, *elem = nft_expr_begin(batch, "immediate", &data);
+	IF_NULL_GOTO(elem, err);
+
+	IF_TRUE_GOTO(nft_expr_add_u32(batch, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT), err);
+
+	struct nlattr *imm =
+		nl_msg_start_nested_attr(batch->rule, NFTA_IMMEDIATE_DATA | NLA_F_NESTED);
+	IF_NULL_GOTO(imm, err);
+	struct nlattr *verdict =
+		nl_msg_start_nested_attr(batch->rule, NFTA_DATA_VERDICT | NLA_F_NESTED);
+	IF_NULL_GOTO(verdict, err);
+	IF_TRUE_GOTO(nft_expr_add_u32(batch, NFTA_VERDICT_CODE, code), err);
+	IF_TRUE_GOTO(nl_msg_end_nested_attr(batch->rule, verdict), err);
+	IF_TRUE_GOTO(nl_msg_end_nested_attr(batch->rule, imm), err);
+
+	IF_TRUE_GOTO(nft_expr_end(batch, elem, data), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_accept(nft_batch_t *batch)
+{
+	ASSERT(batch);
+	return nft_batch_rule_verdict(batch, NF_ACCEPT);
+}
+
+int
+nft_batch_rule_drop(nft_batch_t *batch)
+{
+	ASSERT(batch);
+	return nft_batch_rule_verdict(batch, NF_DROP);
+}
+
+int
+nft_batch_rule_flow_offload(nft_batch_t *batch, const char *flowtable)
+{
+	ASSERT(batch && flowtable);
+
+	struct nlattr *data, *elem = nft_expr_begin(batch, "flow_offload", &data);
+	IF_NULL_GOTO(elem, err);
+	IF_TRUE_GOTO(nl_msg_add_string(batch->rule, NFTA_FLOW_TABLE_NAME, flowtable), err);
+	IF_TRUE_GOTO(nft_expr_end(batch, elem, data), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_rule_masquerade(nft_batch_t *batch)
+{
+	ASSERT(batch);
+
+	struct nlattr *data, *elem = nft_expr_begin(batch, "masq", &data);
+	if (!elem || nft_expr_end(batch, elem, data))
+		return nft_batch_fail(batch);
+
+	return 0;
+}
+
+int
+nft_batch_rule_nat(nft_batch_t *batch, bool dnat, struct in_addr addr, uint16_t port)
+{
+	ASSERT(batch);
+
+	uint16_t nport = htons(port);
+
+	IF_TRUE_GOTO(nft_expr_immediate(batch, NFT_REG_1, &addr.s_addr, sizeof(addr.s_addr)),
+		     err);
+	if (port)
+		IF_TRUE_GOTO(nft_expr_immediate(batch, NFT_REG_2, &nport, sizeof(nport)), err);
+
+	struct nlattr *data, *elem = nft_expr_begin(batch, "nat", &data);
+	IF_NULL_GOTO(elem, err);
+
+	IF_TRUE_GOTO(nft_expr_add_u32(batch, NFTA_NAT_TYPE, dnat ? NFT_NAT_DNAT : NFT_NAT_SNAT),
+		     err);
+	IF_TRUE_GOTO(nft_expr_add_u32(batch, NFTA_NAT_FAMILY, NFPROTO_IPV4), err);
+	IF_TRUE_GOTO(nft_expr_add_u32(batch, NFTA_NAT_REG_ADDR_MIN, NFT_REG_1), err);
+	if (port)
+		IF_TRUE_GOTO(nft_expr_add_u32(batch, NFTA_NAT_REG_PROTO_MIN, NFT_REG_2), err);
+
+	IF_TRUE_GOTO(nft_expr_end(batch, elem, data), err);
+
+	return 0;
+err:
+	return nft_batch_fail(batch);
+}
+
+int
+nft_batch_commit(nft_batch_t *batch)
+{
+	ASSERT(batch);
+
+	if (batch->failed || batch->rule) {
+		ERROR("Incomplete nftables batch, not committing");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!nft_batch_msg_new(batch, NFNL_MSG_BATCH_END, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	nl_sock_t *nl_sock = nl_sock_default_new(NETLINK_NETFILTER);
+	if (!nl_sock) {
+		DEBUG_ERRNO("Could not open nfnetlink socket");
+		return -1;
+	}
+
+	int ret = nl_msg_send_kernel_batch(nl_sock, batch->msgs);
+	if (ret)
+		DEBUG_ERRNO("nftables transaction of %d messages failed",
+			    list_length(batch->msgs));
+	else
+		TRACE("nftables transaction of %d messages committed", list_length(batch->msgs));
+
+	// keep errno of the transaction
+	int err = errno;
+	nl_sock_free(nl_sock);
+	errno = err;
+
+	return ret;
+}
+
+bool
+nft_supported(void)
+{
+	nft_batch_t *batch = nft_batch_new();
+	int ret = nft_batch_commit(batch);
+	nft_batch_free(batch);
+
+	return ret == 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file nft.h
+ *
+ * Builds nftables rulesets as nfnetlink batches, so that all tables, chains
+ * and rules of a batch are committed by the kernel in one atomic transaction.
+ * Only the few expressions required for NAT and forwarding of container
+ * networks are supported. Tables are of the ip (IPv4) family, unless the
+ * batch is switched to another family, e.g. bridge, by nft_batch_set_family().
+ *
+ * A rule is built by nft_batch_rule_begin(), any number of match and one
+ * action call, and finished by nft_batch_rule_end(). Errors are sticky, i.e.
+ * nft_batch_commit() fails if any of the preceding calls failed.
+ */
+
+#ifndef NFT_H
+#define NFT_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct nft_batch nft_batch_t;
+
+/**
+ * Allocates a new empty batch.
+ */
+nft_batch_t *
+nft_batch_new(void);
+
+/**
+ * Frees the batch and all of its messages.
+ */
+void
+nft_batch_free(nft_batch_t *batch);
+
+/**
+ * Sets the family (NFPROTO_*) of the tables, chains and rules added to the
+ * batch afterwards. New batches use NFPROTO_IPV4.
+ */
+void
+nft_batch_set_family(nft_batch_t *batch, uint8_t family);
+
+/**
+ * Adds or deletes the table. Adding an existing table is not an error,
+ * deleting a table removes all of its chains and rules.
+ */
+int
+nft_batch_table(nft_batch_t *batch, const char *table, bool add);
+
+/**
+ * Adds a base chain of type ("filter" or "nat") to table, which is attached
+ * to the netfilter hook (NF_INET_* or NF_BR_* for the bridge family) with the
+ * given priority.
+ */
+int
+nft_batch_add_chain(nft_batch_t *batch, const char *table, const char *chain, const char *type,
+		    uint32_t hook, int32_t prio);
+
+/**
+ * Adds a flowtable to table, which is attached to the ingress hook of the n_devs
+ * interfaces devs. Connections offloaded to it by nft_batch_rule_flow_offload()
+ * bypass the netfilter hooks, including NAT which is applied by the flowtable.
+ */
+int
+nft_batch_add_flowtable(nft_batch_t *batch, const char *table, const char *flowtable,
+			const char **devs, int n_devs);
+
+/**
+ * Starts a new rule which is appended to chain.
+ */
+int
+nft_batch_rule_begin(nft_batch_t *batch, const char *table, const char *chain);
+
+/**
+ * Matches the source (or destination if dst is set) address against the
+ * network addr/prefix.
+ */
+int
+nft_batch_rule_match_ip(nft_batch_t *batch, bool dst, struct in_addr addr, uint8_t prefix);
+
+/**
+ * Matches packets of the transport protocol (IPPROTO_*).
+ */
+int
+nft_batch_rule_match_l4proto(nft_batch_t *batch, uint8_t proto);
+
+/**
+ * Matches packets received on the interface ifname.
+ */
+int
+nft_batch_rule_match_iifname(nft_batch_t *batch, const char *ifname);
+
+/**
+ * Matches packets of the link layer protocol (ETH_P_*), e.g. to match the ip
+ * header of packets in the bridge family.
+ */
+int
+nft_batch_rule_match_protocol(nft_batch_t *batch, uint16_t proto);
+
+/**
+ * Matches tcp packets with the destination port.
+ */
+int
+nft_batch_rule_match_tcp_dport(nft_batch_t *batch, uint16_t port);
+
+/**
+ * Matches packets whose conntrack state is one of states (NF_CT_STATE_* bits).
+ */
+int
+nft_batch_rule_match_ct_state(nft_batch_t *batch, uint32_t states);
+
+/**
+ * Accepts the matched packets.
+ */
+int
+nft_batch_rule_accept(nft_batch_t *batch);
+
+/**
+ * Drops the matched packets.
+ */
+int
+nft_batch_rule_drop(nft_batch_t *batch);
+
+/**
+ * Offloads the connection of the matched packets to the flowtable of the table
+ * of the rule, once the connection is established.
+ */
+int
+nft_batch_rule_flow_offload(nft_batch_t *batch, const char *flowtable);
+
+/**
+ * Masquerades the matched packets, only valid in nat postrouting chains.
+ */
+int
+nft_batch_rule_masquerade(nft_batch_t *batch);
+
+/**
+ * Rewrites the destination (dnat) or source address and port of the matched
+ * packets. A port of 0 keeps the port.
+ */
+int
+nft_batch_rule_nat(nft_batch_t *batch, bool dnat, struct in_addr addr, uint16_t port);
+
+/**
+ * Finishes the current rule.
+ */
+int
+nft_batch_rule_end(nft_batch_t *batch);
+
+/**
+ * Sends the batch to the kernel which applies it atomically. The batch has
+ * to be freed afterwards.
+ * @return 0 on success, -1 with errno set on error
+ */
+int
+nft_batch_commit(nft_batch_t *batch);
+
+/**
+ * Checks if the kernel supports nftables by committing an empty batch.
+ */
+bool
+nft_supported(void);
+
+#endif /* NFT_H */
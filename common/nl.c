@@ -21,8 +21,11 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define _GNU_SOURCE
+
 #include "nl.h"
 #include <sys/uio.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +35,7 @@
 #include <asm/types.h>
 #include <linux/netlink.h>
 #include <linux/genetlink.h>
+#include <linux/filter.h>
 #include <linux/xfrm.h>
 
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
@@ -304,6 +308,68 @@ nl_sock_uevent_new(pid_t udevd_pid)
 	return nl_sock_new(NETLINK_KOBJECT_UEVENT);
 }
 
+// longest action accepted by nl_sock_uevent_set_filter()
+#define NL_UEVENT_FILTER_ACTION_MAX 32
+
+int
+nl_sock_uevent_set_filter(nl_sock_t *sock, const char *const actions[])
+{
+	ASSERT(sock);
+	ASSERT(actions);
+
+	size_t n = 0;
+	for (const char *const *a = actions; *a; a++)
+		n += 2 * (strlen(*a) + 1) + 1;
+
+	/*
+	 * A kernel uevent starts with "<action>@<devpath>". For each action, the
+	 * prefix "<action>@" is compared in chunks of 4, 2 and 1 bytes, on a
+	 * mismatch the filter continues with the next action.
+	 */
+	struct sock_filter *code = mem_new0(struct sock_filter, n + 1);
+	size_t pc = 0;
+	for (const char *const *a = actions; *a; a++) {
+		size_t len = strlen(*a) + 1; // including '@'
+		if (len > NL_UEVENT_FILTER_ACTION_MAX) {
+			ERROR("uevent action %s too long for filter", *a);
+			mem_free(code);
+			return -1;
+		}
+		char prefix[NL_UEVENT_FILTER_ACTION_MAX + 1];
+		snprintf(prefix, sizeof(prefix), "%s@", *a);
+
+		// count the chunks first to compute the jump offsets to the next action
+		size_t chunks = 0;
+		for (size_t off = 0; off < len; chunks++)
+			off += (len - off >= 4) ? 4 : (len - off >= 2) ? 2 : 1;
+
+		for (size_t off = 0, i = 0; off < len; i++) {
+			size_t size = (len - off >= 4) ? 4 : (len - off >= 2) ? 2 : 1;
+			uint32_t val = 0;
+			for (size_t j = 0; j < size; j++)
+				val = (val << 8) | (unsigned char)prefix[off + j];
+
+			uint16_t width = size == 4 ? BPF_W : size == 2 ? BPF_H : BPF_B;
+			code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | width | BPF_ABS, off);
+			code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, val, 0,
+								  2 * (chunks - i - 1) + 1);
+			off += size;
+		}
+		code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	}
+	code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	struct sock_fprog prog = { .len = pc, .filter = code };
+	int ret = setsockopt(sock->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+	if (ret < 0)
+		ERROR_ERRNO("Failed to attach uevent socket filter");
+	else
+		TRACE("Attached uevent socket filter with %zu instructions", pc);
+
+	mem_free(code);
+	return ret < 0 ? -1 : 0;
+}
+
 nl_sock_t *
 nl_sock_routing_new()
 {
@@ -488,6 +554,35 @@ nl_verify_uevent_source(struct msghdr *uevent_msg, struct sockaddr_nl nladdr)
 	return 0;
 }
 
+/**
+ * Sanity checks of a received message, including the source of uevents.
+ */
+static int
+nl_msg_check(const nl_sock_t *nl, struct msghdr *m, struct sockaddr_nl nladdr, bool receive_uevent)
+{
+	if (receive_uevent && nl_verify_uevent_source(m, nladdr)) {
+		TRACE("Detected possibly malicious uevent");
+		return -1;
+	}
+
+	TRACE("Received a message from kernel");
+
+	TRACE("Sent from this address:");
+	TRACE("sockaddr_nl{nl_family: %u, nl_pad:%u, nl_pid: %u, nl_groups: %u}", nladdr.nl_family,
+	      nladdr.nl_pad, nladdr.nl_pid, nladdr.nl_groups);
+
+	TRACE("Arrived on this socket");
+	TRACE("nl_sock{fd:%d, local: nl_family: %u, nl_pad:%u, nl_pid: %u, nl_groups: %u}", nl->fd,
+	      nl->local.nl_family, nl->local.nl_pad, nl->local.nl_pid, nl->local.nl_groups);
+
+	/* Check for truncated messages */
+	IF_TRUE_RETVAL_TRACE(m->msg_flags & MSG_TRUNC, -1);
+	/* Check if protocol family fits */
+	IF_FALSE_RETVAL_TRACE(nladdr.nl_family == AF_NETLINK, -1);
+
+	return 0;
+}
+
 static int
 nl_msg_receive(const nl_sock_t *nl, char *buf, const size_t len, bool receive_uevent, bool ucred)
 {
@@ -515,30 +610,14 @@ nl_msg_receive(const nl_sock_t *nl, char *buf, const size_t len, bool receive_ue
 			TRACE("recvmsg failed");
 			if (errno == EINTR)
 				continue;
-			goto error;
+			// keep errno, e.g. for EAGAIN on non-blocking sockets
+			return -1;
 		}
 		break;
 	}
 
-	if (receive_uevent && nl_verify_uevent_source(&m, nladdr)) {
-		TRACE("Detected possibly malicious uevent");
+	if (nl_msg_check(nl, &m, nladdr, receive_uevent) < 0)
 		goto error;
-	}
-
-	TRACE("Received a message from kernel");
-
-	TRACE("Sent from this address:");
-	TRACE("sockaddr_nl{nl_family: %u, nl_pad:%u, nl_pid: %u, nl_groups: %u}", nladdr.nl_family,
-	      nladdr.nl_pad, nladdr.nl_pid, nladdr.nl_groups);
-
-	TRACE("Arrived on this socket");
-	TRACE("nl_sock{fd:%d, local: nl_family: %u, nl_pad:%u, nl_pid: %u, nl_groups: %u}", nl->fd,
-	      nl->local.nl_family, nl->local.nl_pad, nl->local.nl_pid, nl->local.nl_groups);
-
-	/* Check for truncated messages */
-	IF_TRUE_GOTO_TRACE(m.msg_flags & MSG_TRUNC, error);
-	/* Check if protocol family fits */
-	IF_FALSE_GOTO_TRACE(nladdr.nl_family == AF_NETLINK, error);
 
 	return received;
 
@@ -549,6 +628,65 @@ error:
 	return -1;
 }
 
+static int
+nl_msg_receive_batch(const nl_sock_t *nl, char *bufs[], size_t len, int received[], size_t n,
+		     bool receive_uevent)
+{
+	ASSERT(nl);
+	ASSERT(n <= NL_BATCH_MAX);
+
+	struct sockaddr_nl nladdr[NL_BATCH_MAX];
+	char control[NL_BATCH_MAX][CMSG_SPACE(sizeof(struct ucred))];
+	struct iovec iov[NL_BATCH_MAX];
+	struct mmsghdr mm[NL_BATCH_MAX];
+	int count;
+
+	memset(mm, 0, sizeof(mm));
+	for (size_t i = 0; i < n; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = len;
+		mm[i].msg_hdr.msg_name = &nladdr[i];
+		mm[i].msg_hdr.msg_namelen = sizeof(nladdr[i]);
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+		mm[i].msg_hdr.msg_control = control[i];
+		mm[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+
+	do {
+		count = recvmmsg(nl->fd, mm, n, MSG_DONTWAIT, NULL);
+	} while (count < 0 && errno == EINTR);
+
+	if (count < 0) {
+		TRACE_ERRNO("recvmmsg failed");
+		return -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		received[i] = mm[i].msg_len;
+		if (nl_msg_check(nl, &mm[i].msg_hdr, nladdr[i], receive_uevent) < 0) {
+			TRACE("Purged netlink message %d of batch, as it did not pass sanity checks",
+			      i);
+			memset(bufs[i], 0, len);
+			received[i] = -1;
+		}
+	}
+	return count;
+}
+
+int
+nl_msg_receive_uevents(const nl_sock_t *nl, char *bufs[], size_t len, int received[], size_t n)
+{
+	return nl_msg_receive_batch(nl, bufs, len, received, n, true);
+}
+
+int
+nl_msg_receive_kernel_batch(const nl_sock_t *nl, char *bufs[], size_t len, int received[],
+			    size_t n)
+{
+	return nl_msg_receive_batch(nl, bufs, len, received, n, false);
+}
+
 int
 nl_msg_receive_kernel(const nl_sock_t *nl, char *buf, const size_t len, bool receive_uevent)
 {
@@ -678,6 +816,120 @@ nl_msg_send_kernel_verify(const nl_sock_t *nl_sock, const nl_msg_t *req)
 	return nl_eval_ack(nl_sock, req->nlmsghdr.nlmsg_seq);
 }
 
+/**
+ * Sends the list of messages in one datagram, sequence numbers are
+ * assigned in order starting at 1.
+ */
+static int
+nl_msg_send_kernel_list(const nl_sock_t *nl, const list_t *msgs, size_t n)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	struct iovec *iov = mem_new0(struct iovec, n);
+
+	size_t i = 0;
+	for (const list_t *l = msgs; l; l = l->next, i++) {
+		nl_msg_t *msg = l->data;
+		/* Sequence numbers identify the message of a response */
+		msg->nlmsghdr.nlmsg_seq = i + 1;
+		iov[i].iov_base = &msg->nlmsghdr;
+		iov[i].iov_len = NLMSG_ALIGN(msg->nlmsghdr.nlmsg_len);
+	}
+
+	struct msghdr m = {
+		.msg_name = &nladdr, .msg_namelen = sizeof(nladdr), .msg_iov = iov, .msg_iovlen = n
+	};
+
+	TRACE("Sending batch of %zu messages on socket with fd %d to kernel", n, nl->fd);
+	int ret = sendmsg(nl->fd, &m, 0);
+	mem_free(iov);
+	return ret;
+}
+
+/**
+ * Receives all responses, which were queued while sending a batch.
+ * Each response is a datagram of its own. Error responses include the
+ * failed request and thus may be truncated, only their header is used.
+ * @param acks Incremented for each ACK or error response
+ * @return 0 or the first error reported by the kernel
+ */
+static int
+nl_msg_receive_batch_responses(const nl_sock_t *nl, size_t *acks)
+{
+	char *buf = mem_new0(char, NL_DEFAULT_SOCK_RCVBUF_SIZE);
+	int error = 0;
+	int rcvd;
+
+	while ((rcvd = recv(nl->fd, buf, NL_DEFAULT_SOCK_RCVBUF_SIZE, MSG_DONTWAIT)) > 0) {
+		struct nlmsghdr *msg = (struct nlmsghdr *)buf;
+		if ((size_t)rcvd < NLMSG_LENGTH(sizeof(int)) || msg->nlmsg_type != NLMSG_ERROR)
+			continue;
+
+		(*acks)++;
+
+		struct nlmsgerr *err = NLMSG_DATA(msg);
+		if (!err->error)
+			continue;
+
+		errno = -err->error;
+		WARN_ERRNO("Message %u of batch failed", msg->nlmsg_seq);
+		if (!error)
+			error = -err->error;
+	}
+	mem_free(buf);
+
+	return error;
+}
+
+int
+nl_msg_send_kernel_batch(const nl_sock_t *nl, const list_t *msgs)
+{
+	ASSERT(nl);
+
+	size_t acks = 0;
+
+	IF_TRUE_RETVAL(nl_msg_send_kernel_list(nl, msgs, list_length(msgs)) < 0, -1);
+
+	int error = nl_msg_receive_batch_responses(nl, &acks);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int
+nl_msg_send_kernel_verify_batch(const nl_sock_t *nl, const list_t *reqs)
+{
+	ASSERT(nl);
+
+	size_t n = list_length(reqs);
+	size_t acks = 0;
+
+	for (const list_t *l = reqs; l; l = l->next) {
+		nl_msg_t *req = l->data;
+		if (!(req->nlmsghdr.nlmsg_flags & NLM_F_ACK)) {
+			ERROR("nl request message must have the NLM_F_ACK flag set");
+			return -1;
+		}
+	}
+
+	IF_TRUE_RETVAL(nl_msg_send_kernel_list(nl, reqs, n) < 0, -1);
+
+	DEBUG("Batch of %zu netlink messages sent, evaluating ACKs", n);
+
+	/* The kernel processes the requests while sending, all ACKs are queued */
+	int error = nl_msg_receive_batch_responses(nl, &acks);
+	if (!error && acks != n) {
+		ERROR("Received %zu ACKs for a batch of %zu requests", acks, n);
+		error = EPROTO;
+	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
 nl_msg_t *
 nl_msg_new()
 {
@@ -42,6 +42,8 @@
 #include <linux/genetlink.h>
 #include <stdbool.h>
 
+#include "list.h"
+
 /* Define some missing netlink defines in BIONIC */
 #ifndef VETH_INFO_PEER
 #define VETH_INFO_PEER (0x01)
@@ -58,6 +60,18 @@ typedef struct nl_msg nl_msg_t;
 nl_sock_t *
 nl_sock_uevent_new(pid_t udevd_pid);
 
+/**
+ * Attaches a classic BPF socket filter to a uevent nl_sock, which lets only kernel
+ * uevents with one of the given actions pass, e.g. { "add", "remove", NULL }.
+ * Everything else, including udev monitor messages, is dropped in the kernel.
+ * Must not be used on sockets which expect netlink acks, as those are dropped as well.
+ * @param sock The uevent socket
+ * @param actions NULL terminated array of the actions to be received
+ * @return 0 on success, -1 on error
+ */
+int
+nl_sock_uevent_set_filter(nl_sock_t *sock, const char *const actions[]);
+
 /**
  * Allocates, opens and returns a nl_sock object of family NETLINK_ROUTE with various netlink options.
  * Depending on the protocol, the socket options are implicitly set.
@@ -113,10 +127,36 @@ nl_msg_send_kernel(const nl_sock_t *sock, const nl_msg_t *msg);
  * @param buf Netlink message header, which must be preallocated and large enough.
  * The buffer is filled with the message content
  * @return In case of failure, return -1, in case of success, return num of bytes received
+ *         On failure errno is EIO if a message was received but discarded, otherwise
+ *         it is the errno of recvmsg (e.g. EAGAIN for an empty non-blocking socket).
  */
 int
 nl_msg_receive_kernel(const nl_sock_t *sock, char *buf, size_t len, bool receive_uevent);
 
+#define NL_BATCH_MAX 32
+#define NL_UEVENT_BATCH_MAX NL_BATCH_MAX
+
+/**
+ * Receives up to n (at most NL_UEVENT_BATCH_MAX) uevents from a non-blocking socket
+ * with a single system call. Each uevent is checked like with nl_msg_receive_kernel().
+ * @param bufs Array of n preallocated buffers of len bytes each
+ * @param received Array of n lengths, set to the length of each received uevent
+ *                 or -1 if it did not pass the checks and was discarded
+ * @return The number of received messages or -1 with errno of recvmmsg
+ *         (e.g. EAGAIN if the socket was drained)
+ */
+int
+nl_msg_receive_uevents(const nl_sock_t *sock, char *bufs[], size_t len, int received[], size_t n);
+
+/**
+ * Receives up to n (at most NL_BATCH_MAX) messages from the kernel on a
+ * non-blocking socket with a single system call, like nl_msg_receive_uevents()
+ * but without the uevent source check.
+ */
+int
+nl_msg_receive_kernel_batch(const nl_sock_t *sock, char *bufs[], size_t len, int received[],
+			    size_t n);
+
 /**
  * Transmit a message with ACKNOWLEDGEMENT flag
  * and check the ACK response for success.
@@ -127,6 +167,27 @@ nl_msg_receive_kernel(const nl_sock_t *sock, char *buf, size_t len, bool receive
 int
 nl_msg_send_kernel_verify(const nl_sock_t *sock, const nl_msg_t *req);
 
+/**
+ * Transmit the list of messages as one batch in a single datagram, e.g. for
+ * nfnetlink transactions. The kernel processes the batch while sending,
+ * thus only error responses already queued afterwards are evaluated.
+ * The messages should not have the NLM_F_ACK flag set.
+ * @return In case of failure, return -1 and set errno to the first reported
+ *	   error, in case of success, return 0
+ */
+int
+nl_msg_send_kernel_batch(const nl_sock_t *sock, const list_t *msgs);
+
+/**
+ * Transmit the list of requests, which all must have the NLM_F_ACK flag set,
+ * in a single datagram and check the ACKs of all of them. The requests are
+ * processed in order, a failed request does not stop the following ones.
+ * @return In case of failure, return -1 and set errno to the error of the
+ *	   first failed request, in case of success, return 0
+ */
+int
+nl_msg_send_kernel_verify_batch(const nl_sock_t *sock, const list_t *reqs);
+
 /**
  * Allocates a raw netlink message, which can be completed
  * with the set/add functions.
@@ -27,15 +27,34 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <stdbool.h>
+#include <errno.h>
 
 #include <grp.h>
 
+#include "ns.h"
+
 #include "macro.h"
 #include "mem.h"
-#include "dir.h"
 #include "file.h"
+#include "proc.h"
+
+#ifndef CLONE_NEWTIME
+#define CLONE_NEWTIME 0x00000080
+#endif
+
+/*
+ * Namespaces in the order they are joined if setns() on a pidfd is not supported.
+ * The mnt namespace is joined last, as afterwards procfs shows the target's view.
+ */
+static const struct {
+	int flag;
+	const char *name;
+} ns_types[] = { { CLONE_NEWCGROUP, "cgroup" }, { CLONE_NEWIPC, "ipc" }, { CLONE_NEWNET, "net" },
+		 { CLONE_NEWUTS, "uts" },	{ CLONE_NEWPID, "pid" }, { CLONE_NEWTIME, "time" },
+		 { CLONE_NEWUSER, "user" },	{ CLONE_NEWNS, "mnt" } };
 
 int
 namespace_setuid0()
@@ -141,35 +160,11 @@ namespace_exec(pid_t namespace_pid, const int namespaces, bool become_root,
 	} else if (pid == 0) {
 		TRACE("Child to join namespaces forked");
 
-		if (namespaces & CLONE_NEWCGROUP) {
-			TRACE("Join cgroup namespace");
-			IF_TRUE_RETVAL_ERROR(do_join_namespace("cgroup", namespace_pid), -1);
-		}
-		if (namespaces & CLONE_NEWIPC) {
-			TRACE("Join ipc namespace");
-			IF_TRUE_RETVAL_ERROR(do_join_namespace("ipc", namespace_pid), -1);
-		}
-		if (namespaces & CLONE_NEWNET) {
-			TRACE("Join net namespace");
-			IF_TRUE_RETVAL_ERROR(do_join_namespace("net", namespace_pid), -1);
-		}
-		if (namespaces & CLONE_NEWUTS) {
-			TRACE("Join uts namespace");
-			IF_TRUE_RETVAL_ERROR(do_join_namespace("uts", namespace_pid), -1);
-		}
-		if (namespaces & CLONE_NEWPID) {
-			TRACE("Join pid namespace");
-			IF_TRUE_RETVAL_ERROR(do_join_namespace("pid", namespace_pid), -1);
-		}
-		if (namespaces & CLONE_NEWUSER) {
-			TRACE("Join user namespace");
-			IF_TRUE_RETVAL_ERROR(do_join_namespace("user", namespace_pid), -1);
-		}
-		//after joining the mount namespace the container init process has pid 1 in procfs
-		if (namespaces & CLONE_NEWNS) {
-			TRACE("Join mnt namespace");
-			IF_TRUE_RETVAL_ERROR(do_join_namespace("mnt", namespace_pid), -1);
-		}
+		int pidfd = proc_pidfd_open(namespace_pid);
+		IF_TRUE_RETVAL_ERROR(ns_join_pidfd(pidfd, namespace_pid, namespaces), -1);
+		if (pidfd >= 0)
+			close(pidfd);
+
 		if (become_root) {
 			TRACE("Becoming root in target namespace");
 			IF_TRUE_RETVAL(namespace_setuid0(), -1);
@@ -205,9 +200,6 @@ namespace_exec(pid_t namespace_pid, const int namespaces, bool become_root,
 	return -1;
 }
 
-#define MAX_NS 16
-static int fd[MAX_NS] = { 0 };
-
 static bool
 ns_is_self_userns_file(char *file)
 {
@@ -218,89 +210,82 @@ ns_is_self_userns_file(char *file)
 	return (s.st_dev == userns_s.st_dev) && (s.st_ino == userns_s.st_ino) ? true : false;
 }
 
-struct ns_setns_cbdata {
-	int *fd;
-	bool join_userns;
-};
-
-static int
-ns_setns_cb(const char *path, const char *file, void *data)
+static bool
+ns_is_self_userns(pid_t pid)
 {
-	struct ns_setns_cbdata *cbdata = data;
-	ASSERT(cbdata);
-
-	int *i = cbdata->fd;
-	bool join_userns = cbdata->join_userns;
-
-	IF_TRUE_RETVAL_TRACE(!join_userns && !strcmp(file, "user"), EXIT_SUCCESS);
+	char *file = mem_printf("/proc/%d/ns/user", pid);
+	bool ret = ns_is_self_userns_file(file);
+	mem_free(file);
+	return ret;
+}
 
-	char *ns_file = mem_printf("%s%s", path, file);
-	TRACE("Opening namespace file %s", ns_file);
+int
+ns_join_pidfd(int pidfd, pid_t pid, int namespaces)
+{
+	static int supported = -1;
+
+	// namespace types not supported by the kernel are left out like missing ns files
+	if (supported < 0) {
+		supported = 0;
+		for (size_t i = 0; i < sizeof(ns_types) / sizeof(ns_types[0]); i++) {
+			char *file = mem_printf("/proc/self/ns/%s", ns_types[i].name);
+			if (file_exists(file))
+				supported |= ns_types[i].flag;
+			mem_free(file);
+		}
+	}
+	namespaces &= supported;
 
-	if (ns_is_self_userns_file(ns_file)) {
+	if ((namespaces & CLONE_NEWUSER) && ns_is_self_userns(pid)) {
 		TRACE("Joining same user namespace, not allowed and also not necessary -> skip.");
-		mem_free(ns_file);
-		return EXIT_SUCCESS;
+		namespaces &= ~CLONE_NEWUSER;
 	}
+	IF_TRUE_RETVAL_TRACE(!namespaces, 0);
 
-	if (*i >= MAX_NS) {
-		ERROR("Too many namespace files found in %s", path);
-		goto error;
+	// since Linux 5.8, all namespaces are joined at once
+	if (pidfd >= 0) {
+		if (setns(pidfd, namespaces) == 0) {
+			TRACE("Successfully joined namespaces 0x%x of pid %d", namespaces, pid);
+			return 0;
+		}
+		if (errno != EINVAL) {
+			ERROR_ERRNO("Could not join namespaces 0x%x of pid %d", namespaces, pid);
+			return -1;
+		}
+		TRACE("setns() on pidfd not supported, joining namespaces one by one");
 	}
 
-	fd[*i] = open(ns_file, O_RDONLY);
-	if (fd[*i] == -1) {
-		ERROR_ERRNO("Could not open namespace file %s", ns_file);
-		goto error;
+	for (size_t i = 0; i < sizeof(ns_types) / sizeof(ns_types[0]); i++) {
+		if (!(namespaces & ns_types[i].flag))
+			continue;
+		TRACE("Join %s namespace", ns_types[i].name);
+		if (do_join_namespace(ns_types[i].name, pid) < 0) {
+			ERROR("Could not join %s namespace of pid %d", ns_types[i].name, pid);
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	*i = *i + 1;
-
-	mem_free(ns_file);
-	return EXIT_SUCCESS;
+int
+ns_join_all_pidfd(int pidfd, pid_t pid, bool userns)
+{
+	int namespaces = CLONE_NEWCGROUP | CLONE_NEWIPC | CLONE_NEWNET | CLONE_NEWUTS |
+			 CLONE_NEWPID | CLONE_NEWTIME | CLONE_NEWNS;
 
-error:
-	TRACE("An error occurred. Exiting...");
-	mem_free(ns_file);
-	exit(EXIT_FAILURE);
+	TRACE("Setting namespaces to match namespaces of pid %d", pid);
+	return ns_join_pidfd(pidfd, pid, userns ? namespaces | CLONE_NEWUSER : namespaces);
 }
 
 int
 ns_join_all(pid_t pid, bool userns)
 {
-	char *pid_string = mem_printf("%d", pid);
-
-	TRACE("Setting namespaces to match namespaces of pid %s", pid_string);
-
-	// set namespaces
-	char *folder = mem_printf("/proc/%d/ns/", pid);
-
-	int i = 0;
-	struct ns_setns_cbdata cbdata = { .fd = &i, .join_userns = userns };
+	int pidfd = proc_pidfd_open(pid);
+	int ret = ns_join_all_pidfd(pidfd, pid, userns);
 
-	if (dir_foreach(folder, &ns_setns_cb, &cbdata)) {
-		ERROR("Could not traverse PID dir in procfs, wrong PID?");
-		goto error;
-	}
-
-	for (int j = 0; j < i; j++) {
-		if (setns(fd[j], 0) == -1) { /* Join that namespace */
-			ERROR_ERRNO("Could not join namespace");
-			goto error;
-		}
-	}
-
-	TRACE("Successfully joined all namespaces");
-
-	mem_free(pid_string);
-	mem_free(folder);
-	return 0;
-
-error:
-	TRACE("An error occurred. Exiting...");
-	mem_free(pid_string);
-	mem_free(folder);
-	return -1;
+	if (pidfd >= 0)
+		close(pidfd);
+	return ret;
 }
 
 int
@@ -29,6 +29,7 @@
 #ifndef NS_H
 #define NS_H
 
+#include <stdbool.h>
 #include <unistd.h>
 
 /**
@@ -66,6 +67,32 @@ namespace_exec(pid_t ns_pid, const int namespaces, bool become_root, int (*func)
 int
 ns_join_all(pid_t pid, bool userns);
 
+/**
+ * Like ns_join_all(), but the namespaces are joined through a pidfd of the process,
+ * e.g. one cached for a container, with a single setns() call. Without a pidfd
+ * (-1) or kernel support for setns() on pidfds, the ns files of pid are used.
+ *
+ * @param pidfd pidfd of the process whose namespaces are joined or -1
+ * @param pid pid of that process
+ * @param userns switch for joining userns
+ * @returns 0 if all namespaces are changed successfully, -1 otherwise.
+ */
+int
+ns_join_all_pidfd(int pidfd, pid_t pid, bool userns);
+
+/**
+ * Joins the namespaces given by their clone flags of a process, see
+ * ns_join_all_pidfd(). Namespaces not supported by the kernel and the own
+ * user namespace are skipped.
+ *
+ * @param pidfd pidfd of the process whose namespaces are joined or -1
+ * @param pid pid of that process
+ * @param namespaces clone-flags of the namespaces to join
+ * @returns 0 if the namespaces are changed successfully, -1 otherwise.
+ */
+int
+ns_join_pidfd(int pidfd, pid_t pid, int namespaces);
+
 /**
  * Bind mount ns e.g. "net" to ns_path, which keeps the corresponding
  * namespace alive even if last process in namespace of pid dies.
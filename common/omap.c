@@ -0,0 +1,260 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "omap.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdint.h>
+
+// enough levels for millions of entries with a branching factor of 4
+#define OMAP_LEVELS 12
+
+typedef struct omap_node omap_node_t;
+struct omap_node {
+	const void *key;
+	void *value;
+	int levels;
+	omap_node_t *next[]; /**< successors on each of the levels */
+};
+
+struct omap {
+	omap_cmp_t cmp;
+	omap_node_t *head; /**< sentinel without key, has OMAP_LEVELS levels */
+	int levels;	   /**< number of levels currently in use */
+	size_t count;
+	uint32_t seed; /**< state of the level generator */
+};
+
+static omap_node_t *
+omap_node_new(const void *key, void *value, int levels)
+{
+	omap_node_t *node = mem_alloc0(sizeof(omap_node_t) + levels * sizeof(omap_node_t *));
+	node->key = key;
+	node->value = value;
+	node->levels = levels;
+	return node;
+}
+
+static int
+omap_uint_cmp(const void *key1, const void *key2)
+{
+	uintptr_t a = (uintptr_t)key1;
+	uintptr_t b = (uintptr_t)key2;
+	return (a > b) - (a < b);
+}
+
+omap_t *
+omap_new(omap_cmp_t cmp)
+{
+	IF_NULL_RETVAL(cmp, NULL);
+
+	omap_t *map = mem_new0(omap_t, 1);
+	map->cmp = cmp;
+	map->head = omap_node_new(NULL, NULL, OMAP_LEVELS);
+	map->levels = 1;
+	map->seed = (uint32_t)(uintptr_t)map | 1;
+
+	return map;
+}
+
+omap_t *
+omap_new_uint(void)
+{
+	return omap_new(&omap_uint_cmp);
+}
+
+void
+omap_clear(omap_t *map)
+{
+	ASSERT(map);
+
+	omap_node_t *node = map->head->next[0];
+	while (node) {
+		omap_node_t *next = node->next[0];
+		mem_free(node);
+		node = next;
+	}
+	for (int i = 0; i < OMAP_LEVELS; i++)
+		map->head->next[i] = NULL;
+	map->levels = 1;
+	map->count = 0;
+}
+
+void
+omap_free(omap_t *map)
+{
+	IF_NULL_RETURN(map);
+
+	omap_clear(map);
+	mem_free(map->head);
+	mem_free(map);
+}
+
+/*
+ * Each level above the first is used with probability 1/4 (xorshift32).
+ */
+static int
+omap_random_levels(omap_t *map)
+{
+	uint32_t x = map->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	map->seed = x;
+
+	int levels = 1;
+	while (levels < OMAP_LEVELS && (x & 3) == 0) {
+		levels++;
+		x >>= 2;
+	}
+	return levels;
+}
+
+/*
+ * Returns the last node with a key less than key on the lowest level (maybe
+ * the head) and stores the predecessors on each level in update, if not NULL.
+ */
+static omap_node_t *
+omap_find_less(const omap_t *map, const void *key, omap_node_t **update)
+{
+	omap_node_t *node = map->head;
+
+	for (int i = map->levels - 1; i >= 0; i--) {
+		while (node->next[i] && map->cmp(node->next[i]->key, key) < 0)
+			node = node->next[i];
+		if (update)
+			update[i] = node;
+	}
+	return node;
+}
+
+void *
+omap_put(omap_t *map, const void *key, void *value)
+{
+	ASSERT(map);
+
+	omap_node_t *update[OMAP_LEVELS];
+	omap_node_t *node = omap_find_less(map, key, update)->next[0];
+
+	if (node && map->cmp(node->key, key) == 0) {
+		void *old_value = node->value;
+		node->key = key;
+		node->value = value;
+		return old_value;
+	}
+
+	int levels = omap_random_levels(map);
+	for (; map->levels < levels; map->levels++)
+		update[map->levels] = map->head;
+
+	node = omap_node_new(key, value, levels);
+	for (int i = 0; i < levels; i++) {
+		node->next[i] = update[i]->next[i];
+		update[i]->next[i] = node;
+	}
+	map->count++;
+
+	return NULL;
+}
+
+void *
+omap_get(const omap_t *map, const void *key)
+{
+	ASSERT(map);
+
+	omap_node_t *node = omap_find_less(map, key, NULL)->next[0];
+	return (node && map->cmp(node->key, key) == 0) ? node->value : NULL;
+}
+
+void *
+omap_floor(const omap_t *map, const void *key, const void **found_key)
+{
+	ASSERT(map);
+
+	omap_node_t *node = omap_find_less(map, key, NULL);
+	if (node->next[0] && map->cmp(node->next[0]->key, key) == 0)
+		node = node->next[0];
+
+	if (node == map->head)
+		return NULL;
+	if (found_key)
+		*found_key = node->key;
+	return node->value;
+}
+
+void *
+omap_ceil(const omap_t *map, const void *key, const void **found_key)
+{
+	ASSERT(map);
+
+	omap_node_t *node = omap_find_less(map, key, NULL)->next[0];
+	if (!node)
+		return NULL;
+	if (found_key)
+		*found_key = node->key;
+	return node->value;
+}
+
+void *
+omap_remove(omap_t *map, const void *key)
+{
+	ASSERT(map);
+
+	omap_node_t *update[OMAP_LEVELS];
+	omap_node_t *node = omap_find_less(map, key, update)->next[0];
+
+	if (!node || map->cmp(node->key, key) != 0)
+		return NULL;
+
+	for (int i = 0; i < node->levels; i++)
+		update[i]->next[i] = node->next[i];
+	while (map->levels > 1 && !map->head->next[map->levels - 1])
+		map->levels--;
+
+	void *value = node->value;
+	mem_free(node);
+	map->count--;
+
+	return value;
+}
+
+size_t
+omap_count(const omap_t *map)
+{
+	ASSERT(map);
+	return map->count;
+}
+
+void
+omap_foreach(const omap_t *map, bool (*func)(const void *key, void *value, void *data),
+	     void *data)
+{
+	ASSERT(map);
+	ASSERT(func);
+
+	for (omap_node_t *node = map->head->next[0]; node; node = node->next[0]) {
+		if (!func(node->key, node->value, data))
+			return;
+	}
+}
@@ -0,0 +1,127 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file omap.h
+ *
+ * Implements an ordered map as a skiplist. Lookups, insertions and removals
+ * take O(log n) on average. Besides exact lookups, the map supports finding
+ * the greatest key less or equal to a given key (omap_floor()), which allows
+ * to look up the range a value falls into.
+ *
+ * As in hashmap.h, keys and values are not copied. Integer keys can be stored
+ * directly in the key pointer by using omap_new_uint().
+ */
+
+#ifndef OMAP_H
+#define OMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct omap omap_t;
+
+typedef int (*omap_cmp_t)(const void *key1, const void *key2);
+
+/**
+ * Creates an empty map ordered by cmp, which returns a negative value,
+ * zero or a positive value if key1 is less, equal or greater than key2.
+ */
+omap_t *
+omap_new(omap_cmp_t cmp);
+
+/**
+ * Creates an empty map with unsigned integers casted to pointers as keys,
+ * e.g. omap_put(map, (void *)(uintptr_t)uid, value).
+ */
+omap_t *
+omap_new_uint(void);
+
+/**
+ * Frees the map. Keys and values are left untouched.
+ */
+void
+omap_free(omap_t *map);
+
+/**
+ * Inserts value for key. An existing value for an equal key is replaced,
+ * together with its key.
+ *
+ * @return The replaced value or NULL if there was none.
+ */
+void *
+omap_put(omap_t *map, const void *key, void *value);
+
+/**
+ * Returns the value for key or NULL if key is not part of the map.
+ */
+void *
+omap_get(const omap_t *map, const void *key);
+
+/**
+ * Returns the value of the greatest key less or equal to key and stores
+ * that key in found_key, if not NULL.
+ *
+ * @return The value or NULL if all keys are greater than key.
+ */
+void *
+omap_floor(const omap_t *map, const void *key, const void **found_key);
+
+/**
+ * Returns the value of the smallest key greater or equal to key and stores
+ * that key in found_key, if not NULL.
+ *
+ * @return The value or NULL if all keys are less than key.
+ */
+void *
+omap_ceil(const omap_t *map, const void *key, const void **found_key);
+
+/**
+ * Removes key from the map.
+ *
+ * @return The value which was stored for key or NULL if there was none.
+ */
+void *
+omap_remove(omap_t *map, const void *key);
+
+/**
+ * Removes all entries from the map.
+ */
+void
+omap_clear(omap_t *map);
+
+/**
+ * Returns the number of entries of the map.
+ */
+size_t
+omap_count(const omap_t *map);
+
+/**
+ * Calls func for all entries in ascending order of their keys, until func
+ * returns false. The map must not be modified by func.
+ */
+void
+omap_foreach(const omap_t *map, bool (*func)(const void *key, void *value, void *data),
+	     void *data);
+
+#endif /* OMAP_H */
@@ -0,0 +1,194 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "omap.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define N_KEYS 2000
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	// No clean-up needed for now
+}
+
+
+static bool
+check_ascending(const void *key, void *value, void *data)
+{
+	uintptr_t *last = data;
+	munit_assert_uint64((uintptr_t)key, >, *last);
+	munit_assert_uint64((uintptr_t)value, ==, 2 * (uintptr_t)key);
+	*last = (uintptr_t)key;
+	return true;
+}
+
+static MunitResult
+test_omap(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	omap_t *map = omap_new_uint();
+	static bool present[10 * N_KEYS + 1];
+	memset(present, 0, sizeof(present));
+
+	// insert the multiples of ten in pseudo random order
+	for (uintptr_t i = 0, k = 1; i < N_KEYS; i++) {
+		k = (k * 7919) % N_KEYS + 1;
+		if (present[10 * k])
+			continue;
+		present[10 * k] = true;
+		munit_assert_null(omap_put(map, (void *)(10 * k), (void *)(20 * k)));
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i <= 10 * N_KEYS; i++)
+		count += present[i];
+	munit_assert_size(omap_count(map), ==, count);
+
+	uintptr_t last = 0;
+	omap_foreach(map, &check_ascending, &last);
+
+	// remove some keys, then check lookups against the reference
+	for (uintptr_t k = 10; k <= 10 * N_KEYS; k += 30) {
+		void *value = omap_remove(map, (void *)k);
+		munit_assert_ptr_equal(value, present[k] ? (void *)(2 * k) : NULL);
+		present[k] = false;
+	}
+
+	for (uintptr_t k = 0; k <= 10 * N_KEYS; k++) {
+		const void *found = NULL;
+
+		void *expected = present[k] ? (void *)(2 * k) : NULL;
+		munit_assert_ptr_equal(omap_get(map, (void *)k), expected);
+
+		uintptr_t floor = k;
+		while (floor > 0 && !present[floor])
+			floor--;
+		void *value = omap_floor(map, (void *)k, &found);
+		if (present[floor]) {
+			munit_assert_ptr_equal(found, (void *)floor);
+			munit_assert_ptr_equal(value, (void *)(2 * floor));
+		} else {
+			munit_assert_null(value);
+		}
+
+		uintptr_t ceil = k;
+		while (ceil < 10 * N_KEYS && !present[ceil])
+			ceil++;
+		value = omap_ceil(map, (void *)k, &found);
+		if (present[ceil]) {
+			munit_assert_ptr_equal(found, (void *)ceil);
+			munit_assert_ptr_equal(value, (void *)(2 * ceil));
+		} else {
+			munit_assert_null(value);
+		}
+	}
+
+	// replacing keeps the count
+	uintptr_t k = 10;
+	while (!present[k])
+		k += 10;
+	count = omap_count(map);
+	munit_assert_ptr_equal(omap_put(map, (void *)k, (void *)1), (void *)(2 * k));
+	munit_assert_size(omap_count(map), ==, count);
+	munit_assert_ptr_equal(omap_get(map, (void *)k), (void *)1);
+
+	omap_clear(map);
+	munit_assert_size(omap_count(map), ==, 0);
+	munit_assert_null(omap_floor(map, (void *)100, NULL));
+
+	omap_free(map);
+	return MUNIT_OK;
+}
+
+static int
+str_cmp(const void *key1, const void *key2)
+{
+	return strcmp(key1, key2);
+}
+
+static MunitResult
+test_omap_str(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	omap_t *map = omap_new(&str_cmp);
+	const char *found = NULL;
+
+	omap_put(map, "b", "2");
+	omap_put(map, "d", "4");
+	omap_put(map, "a", "1");
+
+	munit_assert_string_equal(omap_floor(map, "c", (const void **)&found), "2");
+	munit_assert_string_equal(found, "b");
+	munit_assert_string_equal(omap_ceil(map, "c", (const void **)&found), "4");
+	munit_assert_string_equal(found, "d");
+	munit_assert_null(omap_ceil(map, "e", NULL));
+	munit_assert_string_equal(omap_remove(map, "a"), "1");
+	munit_assert_null(omap_floor(map, "a", NULL));
+
+	omap_free(map);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/integer keys",	/* name */
+		test_omap,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/string keys",		/* name */
+		test_omap_str,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite omap_suite = {
+	"/omap",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
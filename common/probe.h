@@ -0,0 +1,61 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file probe.h
+ *
+ * Static tracepoints (USDT) at hot paths, to measure latencies on devices with
+ * bpftrace or perf without a TRACE logging build, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/sbin/cmld:cml:protobuf_send_begin { ... }'
+ *
+ * The probes are compiled in with PROBES=y, which requires sys/sdt.h from
+ * systemtap on the build host. Each one is a single nop then, which is only
+ * replaced by a breakpoint while a tracer is attached; its arguments are read
+ * from registers or the stack by the tracer. Otherwise the probes vanish and
+ * their arguments are not even evaluated. Probe arguments should be plain
+ * values or strings, all probes belong to the provider "cml".
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#ifdef CML_PROBES
+
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(cml, name)
+#define PROBE1(name, a1) DTRACE_PROBE1(cml, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(cml, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(cml, name, a1, a2, a3)
+
+#else
+
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a1) ((void)sizeof(a1))
+#define PROBE2(name, a1, a2) ((void)sizeof(a1), (void)sizeof(a2))
+#define PROBE3(name, a1, a2, a3) ((void)sizeof(a1), (void)sizeof(a2), (void)sizeof(a3))
+
+#endif /* CML_PROBES */
+
+#endif /* PROBE_H */
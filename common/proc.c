@@ -28,13 +28,56 @@
 #include "mem.h"
 #include "file.h"
 #include "dir.h"
+#include "event.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/* struct clone_args of linux/sched.h up to the cgroup member (CLONE_ARGS_SIZE_VER2) */
+struct proc_clone_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+	uint64_t set_tid;
+	uint64_t set_tid_size;
+	uint64_t cgroup;
+};
+
+extern char **environ;
+
+// pids of all children of a single thread
+#define PROC_CHILDREN_BUF_LEN 4096
+
 struct proc_killall {
 	pid_t ppid;
 	const char *name;
@@ -146,69 +189,231 @@ proc_status_get_ppid(const proc_status_t *status)
 	return status->ppid;
 }
 
+int
+proc_pidfd_open(pid_t pid)
+{
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+int
+proc_pidfd_send_signal(int pidfd, int sig)
+{
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+pid_t
+proc_clone3(uint64_t flags, int cgroup_fd, int *pidfd)
+{
+	int fd = -1;
+	struct proc_clone_args args = { .flags = flags, .exit_signal = SIGCHLD };
+
+	if (pidfd) {
+		args.flags |= CLONE_PIDFD;
+		args.pidfd = (uintptr_t)&fd;
+	}
+	if (cgroup_fd >= 0) {
+		args.flags |= CLONE_INTO_CGROUP;
+		args.cgroup = cgroup_fd;
+	}
+
+	// without a stack, the child continues on a copy of the stack like after fork()
+	pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+	if (pid > 0 && pidfd)
+		*pidfd = fd;
+	return pid;
+}
+
+/*
+ * Reads the name of process pid from /proc/<pid>/comm into buf, which
+ * is much cheaper than parsing the whole status file.
+ */
 static int
-proc_killall_cb(UNUSED const char *path, const char *file, void *data)
+proc_comm_read(pid_t pid, char *buf, size_t len)
 {
-	struct proc_killall *pk = data;
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
 
-	char *tmp = NULL;
-	pid_t pid = strtol(file, &tmp, 10);
-	if (!tmp || tmp[0] != '\0') // filename is not a number
-		return 0;
+	int n = file_read(path, buf, len - 1);
+	IF_TRUE_RETVAL_TRACE(n <= 0, -1);
 
-	proc_status_t *status = proc_status_new(pid);
-	IF_NULL_RETVAL(status, 0);
+	buf[n] = '\0';
+	if (buf[n - 1] == '\n')
+		buf[n - 1] = '\0';
+	return 0;
+}
 
-	pid_t ppid = proc_status_get_ppid(status);
-	const char *name = proc_status_get_name(status);
+/*
+ * Checks if pid still is a process named name with parent ppid (any parent
+ * if ppid is negative).
+ */
+static bool
+proc_matches(pid_t pid, pid_t ppid, const char *name)
+{
+	char comm[sizeof(((proc_status_t *)0)->name)];
 
-	if ((pk->ppid < 0 || pk->ppid == ppid) && !strcmp(name, pk->name)) {
-		DEBUG("Killing process %s with pid %d", pk->name, pid);
-		kill(pid, pk->sig);
-	}
+	IF_TRUE_RETVAL_TRACE(proc_comm_read(pid, comm, sizeof(comm)), false);
+	IF_TRUE_RETVAL_TRACE(strcmp(comm, name), false);
+
+	if (ppid < 0)
+		return true;
+
+	proc_status_t *status = proc_status_new(pid);
+	IF_NULL_RETVAL_TRACE(status, false);
 
+	bool match = (proc_status_get_ppid(status) == ppid);
 	proc_status_free(status);
-	return 0;
+	return match;
 }
 
-int
-proc_killall(pid_t ppid, const char *name, int sig)
+/*
+ * Calls func for each child of ppid found in /proc/<ppid>/task/<tid>/children.
+ * Returns -1 if the kernel does not provide the children files.
+ */
+static int
+proc_foreach_child(pid_t ppid, void (*func)(pid_t pid, void *data), void *data)
 {
-	struct proc_killall data = { ppid, name, sig };
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", ppid, ppid);
+	IF_FALSE_RETVAL_TRACE(file_exists(path), -1);
+
+	snprintf(path, sizeof(path), "/proc/%d/task", ppid);
+	DIR *dir = opendir(path);
+	IF_NULL_RETVAL_TRACE(dir, -1);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		char *tmp = NULL;
+		pid_t tid = strtol(entry->d_name, &tmp, 10);
+		if (!tmp || tmp[0] != '\0') // filename is not a number
+			continue;
 
-	DEBUG("Trying to kill %s with ppid %d", name, ppid);
-	if (dir_foreach("/proc", &proc_killall_cb, &data) < 0) {
-		WARN("Could not traverse /proc");
-		return -1;
-	}
+		snprintf(path, sizeof(path), "/proc/%d/task/%d/children", ppid, tid);
+		char *children = file_read_new(path, PROC_CHILDREN_BUF_LEN);
+		if (!children) // thread already exited
+			continue;
 
+		char *saveptr = NULL;
+		for (char *tok = strtok_r(children, " \n", &saveptr); tok;
+		     tok = strtok_r(NULL, " \n", &saveptr))
+			func(atoi(tok), data);
+		mem_free(children);
+	}
+	closedir(dir);
 	return 0;
 }
 
+/*
+ * Calls func for each process in /proc, used if no parent is given or if
+ * the children files are not available.
+ */
+struct proc_foreach {
+	void (*func)(pid_t pid, void *data);
+	void *data;
+};
+
 static int
-proc_find_cb(UNUSED const char *path, const char *file, void *data)
+proc_foreach_all_cb(UNUSED const char *path, const char *file, void *data)
 {
-	struct proc_find *pf = data;
+	struct proc_foreach *pf = data;
 
 	char *tmp = NULL;
 	pid_t pid = strtol(file, &tmp, 10);
 	if (!tmp || tmp[0] != '\0') // filename is not a number
 		return 0;
 
-	proc_status_t *status = proc_status_new(pid);
-	IF_NULL_RETVAL_TRACE(status, 0);
+	pf->func(pid, pf->data);
+	return 0;
+}
 
-	pid_t ppid = proc_status_get_ppid(status);
-	const char *name = proc_status_get_name(status);
+static int
+proc_foreach(pid_t ppid, void (*func)(pid_t pid, void *data), void *data)
+{
+	if (ppid > 0 && !proc_foreach_child(ppid, func, data))
+		return 0;
 
-	if ((pf->ppid == ppid) && !strcmp(name, pf->name)) {
-		TRACE("Found pid %d with ppid %d and name %s", pid, ppid, pf->name);
-		pf->match = pid;
-		//return -1; // TODO maybe adapt dir_foreach to allow aborting the directory traversing without indicating an error
+	struct proc_foreach pf = { func, data };
+	if (dir_foreach("/proc", &proc_foreach_all_cb, &pf) < 0) {
+		WARN("Could not traverse /proc");
+		return -1;
 	}
+	return 0;
+}
 
+struct proc_children {
+	pid_t ppid;
+	void (*func)(pid_t pid, void *data);
+	void *data;
+};
+
+static void
+proc_children_cb(pid_t pid, void *data)
+{
+	struct proc_children *pc = data;
+
+	proc_status_t *status = proc_status_new(pid);
+	IF_NULL_RETURN_TRACE(status);
+
+	if (proc_status_get_ppid(status) == pc->ppid)
+		pc->func(pid, pc->data);
 	proc_status_free(status);
-	return 0;
+}
+
+int
+proc_children_foreach(pid_t ppid, void (*func)(pid_t pid, void *data), void *data)
+{
+	IF_TRUE_RETVAL(ppid <= 0, -1);
+
+	if (!proc_foreach_child(ppid, func, data))
+		return 0;
+
+	struct proc_children pc = { ppid, func, data };
+	return proc_foreach(-1, &proc_children_cb, &pc);
+}
+
+static void
+proc_killall_cb(pid_t pid, void *data)
+{
+	struct proc_killall *pk = data;
+
+	IF_FALSE_RETURN_TRACE(proc_matches(pid, pk->ppid, pk->name));
+
+	/*
+	 * The pidfd pins the process, so if it still matches after opening the
+	 * pidfd the signal cannot hit a different process which reused the pid.
+	 */
+	int pidfd = proc_pidfd_open(pid);
+	if (pidfd < 0) {
+		DEBUG("Killing process %s with pid %d", pk->name, pid);
+		kill(pid, pk->sig);
+		return;
+	}
+
+	if (proc_matches(pid, pk->ppid, pk->name)) {
+		DEBUG("Killing process %s with pid %d", pk->name, pid);
+		if (proc_pidfd_send_signal(pidfd, pk->sig) && errno != ESRCH)
+			WARN_ERRNO("Could not signal process %s with pid %d", pk->name, pid);
+	}
+	close(pidfd);
+}
+
+int
+proc_killall(pid_t ppid, const char *name, int sig)
+{
+	struct proc_killall data = { ppid, name, sig };
+
+	DEBUG("Trying to kill %s with ppid %d", name, ppid);
+	return proc_foreach(ppid, &proc_killall_cb, &data);
+}
+
+static void
+proc_find_cb(pid_t pid, void *data)
+{
+	struct proc_find *pf = data;
+
+	IF_FALSE_RETURN_TRACE(proc_matches(pid, pf->ppid, pf->name));
+
+	TRACE("Found pid %d with ppid %d and name %s", pid, pf->ppid, pf->name);
+	pf->match = pid;
 }
 
 pid_t
@@ -216,41 +421,105 @@ proc_find(pid_t ppid, const char *name)
 {
 	struct proc_find data = { ppid, name, 0 };
 
-	if (dir_foreach("/proc", &proc_find_cb, &data) < 0) {
-		WARN("Could not traverse /proc");
-		return -1;
-	}
+	IF_TRUE_RETVAL(proc_foreach(ppid, &proc_find_cb, &data), -1);
 
 	return data.match;
 }
 
+/*
+ * posix_spawn uses clone(CLONE_VM | CLONE_VFORK) in glibc, thus neither the
+ * page tables of the whole daemon are copied nor its pages are made copy on
+ * write, as with fork. This also skips the fork handlers, so the signals which
+ * the event loop reads from its signalfd are unblocked through the attributes.
+ */
+static pid_t
+proc_spawn(const char *const *argv)
+{
+	pid_t pid;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	int ret = posix_spawnp(&pid, argv[0], NULL, &attr, (char *const *)argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (ret) {
+		errno = ret;
+		ERROR_ERRNO("Could not spawn %s", argv[0]);
+		return -1;
+	}
+	return pid;
+}
+
 int
 proc_fork_and_execvp(const char *const *argv)
 {
 	int status;
-	pid_t pid = fork();
+	pid_t pid = proc_spawn(argv);
 
-	switch (pid) {
-	case -1:
-		ERROR_ERRNO("Could not fork for %s", argv[0]);
-		return -1;
-	case 0:
-		execvp(argv[0], (char *const *)argv);
-		FATAL_ERRNO("Could not execvp %s", argv[0]);
-		return -1;
-	default:
-		if (waitpid(pid, &status, 0) != pid) {
-			ERROR_ERRNO("Could not waitpid for '%s'", argv[0]);
-		} else if (!WIFEXITED(status)) {
-			ERROR("Child '%s' terminated abnormally", argv[0]);
-		} else {
-			TRACE("%s terminated normally", argv[0]);
-			return WEXITSTATUS(status) ? -1 : 0;
-		}
+	IF_TRUE_RETVAL(pid < 0, -1);
+
+	if (waitpid(pid, &status, 0) != pid) {
+		ERROR_ERRNO("Could not waitpid for '%s'", argv[0]);
+	} else if (!WIFEXITED(status)) {
+		ERROR("Child '%s' terminated abnormally", argv[0]);
+	} else {
+		TRACE("%s terminated normally", argv[0]);
+		return WEXITSTATUS(status) ? -1 : 0;
 	}
 	return -1;
 }
 
+struct proc_spawn_async {
+	void (*func)(pid_t pid, int status, void *data);
+	void *data;
+};
+
+static void
+proc_spawn_async_child_cb(pid_t pid, int status, event_child_t *child, void *data)
+{
+	struct proc_spawn_async *spawn = data;
+
+	TRACE("Reaped spawned process %d", pid);
+	event_child_free(child);
+
+	if (spawn->func)
+		spawn->func(pid, status, spawn->data);
+	mem_free(spawn);
+}
+
+pid_t
+proc_spawn_async(const char *const *argv, void (*func)(pid_t pid, int status, void *data),
+		 void *data)
+{
+	pid_t pid = proc_spawn(argv);
+	IF_TRUE_RETVAL(pid < 0, -1);
+
+	struct proc_spawn_async *spawn = mem_new0(struct proc_spawn_async, 1);
+	spawn->func = func;
+	spawn->data = data;
+
+	event_child_t *child = event_child_new(pid, proc_spawn_async_child_cb, spawn);
+	if (event_add_child(child) < 0) {
+		// cannot happen for a fresh pid, but never leave a zombie behind
+		WARN("Could not watch spawned process %d, waiting for it", pid);
+		event_child_free(child);
+		int status = -1;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+		if (func)
+			func(pid, status, data);
+		mem_free(spawn);
+		return pid;
+	}
+
+	DEBUG("Spawned %s with pid %d", argv[0], pid);
+	return pid;
+}
+
 int
 proc_cap_last_cap(void)
 {
@@ -24,6 +24,7 @@
 #ifndef PROC_H
 #define PROC_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 typedef struct proc_status proc_status_t;
@@ -42,7 +43,10 @@ proc_status_get_ppid(const proc_status_t *status);
 
 /**
  * Kills a process/service with a given name. If ppid is bigger
- * than 0 only process with this parent pid are killed.
+ * than 0 only process with this parent pid are killed. Those are taken from
+ * the children lists of ppid instead of scanning all processes, if provided
+ * by the kernel. The signal is sent through a pidfd, if supported, so that
+ * it cannot hit another process which reused the pid in the meantime.
  * @param ppid The pid of the parent process, might be negativ.
  * @param name The process name which should be killed.
  * @param sig The signal number, e.g. SIGKILL.
@@ -51,7 +55,8 @@ int
 proc_killall(pid_t ppid, const char *name, int sig);
 
 /**
- * Returns the pid of the process matching name and ppid.
+ * Returns the pid of the process matching name and ppid. Only the children
+ * of ppid are inspected, if the kernel provides their list.
  * @param ppid The pid of the parent process.
  * @param name The process name to find.
  * @return pid of matched process, 0 if no match, -1 on error.
@@ -59,9 +64,66 @@ proc_killall(pid_t ppid, const char *name, int sig);
 pid_t
 proc_find(pid_t ppid, const char *name);
 
+/**
+ * Calls func for each child process of ppid. The children are taken from the
+ * children lists of ppid, if provided by the kernel, otherwise all processes
+ * are scanned for their parent.
+ * @param ppid The pid of the parent process.
+ * @return 0 on success, -1 on error.
+ */
+int
+proc_children_foreach(pid_t ppid, void (*func)(pid_t pid, void *data), void *data);
+
+/**
+ * Opens a pidfd for process pid. In contrast to the pid, the pidfd always
+ * refers to the same process, even after it exited and its pid was reused.
+ * The pidfd becomes readable once the process terminated, thus it can be
+ * watched with an event_io in the event loop.
+ * @return the pidfd or -1 on error, e.g. if not supported by the kernel
+ */
+int
+proc_pidfd_open(pid_t pid);
+
+/**
+ * Sends signal sig to the process referred to by pidfd.
+ * @return 0 on success, -1 on error
+ */
+int
+proc_pidfd_send_signal(int pidfd, int sig);
+
+/**
+ * Creates a child process like fork(), but through clone3(). This allows to
+ * create the child directly in the cgroup v2 directory cgroup_fd instead of
+ * migrating it afterwards, and to get a pidfd of the child without a race on
+ * its pid.
+ * @param flags additional clone flags, e.g. namespaces or CLONE_PARENT
+ * @param cgroup_fd fd of the cgroup directory to create the child in or -1
+ * @param pidfd set to a pidfd of the child if not NULL
+ * @return the pid of the child in the parent, 0 in the child, -1 on error
+ *         (errno is ENOSYS if clone3() is not supported by the kernel)
+ */
+pid_t
+proc_clone3(uint64_t flags, int cgroup_fd, int *pidfd);
+
+/**
+ * Executes argv[0] (searched in PATH) with the arguments argv and waits for
+ * its termination. The child is spawned without copying the address space.
+ * @return 0 if the child exited with status 0, -1 otherwise
+ */
 int
 proc_fork_and_execvp(const char *const *argv);
 
+/**
+ * Executes argv[0] (searched in PATH) with the arguments argv without waiting
+ * for it. Once the child terminated, it is reaped in the event loop and func is
+ * called with its pid and its status as returned by waitpid, or -1 if it
+ * could not be reaped.
+ * @return the pid of the child or -1 on error
+ */
+pid_t
+proc_spawn_async(const char *const *argv, void (*func)(pid_t pid, int status, void *data),
+		 void *data);
+
 /**
  * Returns the last cap from the running kernel
  * @return last cap of running kernel, -1 on error;
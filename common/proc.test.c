@@ -0,0 +1,275 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "proc.h"
+#include "logf.h"
+#include "macro.h"
+#include "event.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PROC_TEST_CHILD_NAME "proc.test.child"
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	// No clean-up needed for now
+}
+
+static pid_t
+proc_test_child_new(void)
+{
+	pid_t pid = fork();
+	munit_assert_int(pid, >=, 0);
+	if (pid == 0) {
+		prctl(PR_SET_NAME, PROC_TEST_CHILD_NAME);
+		for (;;)
+			pause();
+	}
+
+	// wait until the child renamed itself
+	for (int i = 0; i < 1000 && !proc_find(getpid(), PROC_TEST_CHILD_NAME); i++)
+		usleep(1000);
+	return pid;
+}
+
+static MunitResult
+test_proc_find_and_killall(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	pid_t child = proc_test_child_new();
+
+	munit_assert_int(proc_find(getpid(), PROC_TEST_CHILD_NAME), ==, child);
+	munit_assert_int(proc_find(getpid(), "proc.test.none"), ==, 0);
+	munit_assert_int(proc_find(child, PROC_TEST_CHILD_NAME), ==, 0);
+
+	// processes of other parents are not touched
+	munit_assert_int(proc_killall(child, PROC_TEST_CHILD_NAME, SIGKILL), ==, 0);
+	munit_assert_int(proc_find(getpid(), PROC_TEST_CHILD_NAME), ==, child);
+
+	munit_assert_int(proc_killall(getpid(), PROC_TEST_CHILD_NAME, SIGKILL), ==, 0);
+
+	int status;
+	munit_assert_int(waitpid(child, &status, 0), ==, child);
+	munit_assert_true(WIFSIGNALED(status));
+	munit_assert_int(WTERMSIG(status), ==, SIGKILL);
+
+	return MUNIT_OK;
+}
+
+static void
+proc_test_children_cb(pid_t pid, void *data)
+{
+	pid_t *found = data;
+	if (pid == found[0])
+		found[1] = pid;
+}
+
+static MunitResult
+test_proc_children_foreach(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	pid_t child = proc_test_child_new();
+	pid_t found[2] = { child, 0 };
+
+	munit_assert_int(proc_children_foreach(getpid(), proc_test_children_cb, found), ==, 0);
+	munit_assert_int(found[1], ==, child);
+
+	// the child itself has no children
+	found[1] = 0;
+	munit_assert_int(proc_children_foreach(child, proc_test_children_cb, found), ==, 0);
+	munit_assert_int(found[1], ==, 0);
+
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_proc_pidfd(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	pid_t child = proc_test_child_new();
+
+	int pidfd = proc_pidfd_open(child);
+	if (pidfd < 0) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+		return MUNIT_SKIP;
+	}
+
+	munit_assert_int(proc_pidfd_send_signal(pidfd, SIGTERM), ==, 0);
+
+	int status;
+	munit_assert_int(waitpid(child, &status, 0), ==, child);
+	munit_assert_true(WIFSIGNALED(status));
+	munit_assert_int(WTERMSIG(status), ==, SIGTERM);
+
+	// the pidfd still refers to the reaped child and not to a new process
+	munit_assert_int(proc_pidfd_send_signal(pidfd, SIGTERM), ==, -1);
+	close(pidfd);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_proc_fork_and_execvp(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	const char *const argv_true[] = { "true", NULL };
+	const char *const argv_false[] = { "false", NULL };
+	const char *const argv_none[] = { "proc.test.does.not.exist", NULL };
+
+	munit_assert_int(proc_fork_and_execvp(argv_true), ==, 0);
+	munit_assert_int(proc_fork_and_execvp(argv_false), ==, -1);
+	munit_assert_int(proc_fork_and_execvp(argv_none), ==, -1);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_proc_clone3(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	int pidfd = -1;
+	pid_t child = proc_clone3(0, -1, &pidfd);
+	if (child == -1 && errno == ENOSYS)
+		return MUNIT_SKIP;
+	munit_assert_int(child, >=, 0);
+
+	if (child == 0)
+		_exit(7);
+
+	// the pidfd refers to the child, it is readable once the child exited
+	munit_assert_int(pidfd, >=, 0);
+	struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+	munit_assert_int(poll(&pfd, 1, 5000), ==, 1);
+
+	int status;
+	munit_assert_int(waitpid(child, &status, 0), ==, child);
+	munit_assert_true(WIFEXITED(status));
+	munit_assert_int(WEXITSTATUS(status), ==, 7);
+	close(pidfd);
+
+	return MUNIT_OK;
+}
+
+static void
+proc_test_spawn_cb(pid_t pid, int status, void *data)
+{
+	int *result = data;
+
+	munit_assert_int(pid, >, 0);
+	munit_assert_true(WIFEXITED(status));
+	*result = WEXITSTATUS(status);
+}
+
+static MunitResult
+test_proc_spawn_async(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	const char *const argv[] = { "sh", "-c", "exit 3", NULL };
+	int result = -1;
+
+	event_init();
+	munit_assert_int(proc_spawn_async(argv, proc_test_spawn_cb, &result), >, 0);
+	munit_assert_int(result, ==, -1);
+
+	// returns once the child was reaped and its event removed
+	event_loop();
+	munit_assert_int(result, ==, 3);
+
+	event_reset();
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/proc find and killall",    /* name */
+		test_proc_find_and_killall, /* test */
+		setup,			     /* setup */
+		tear_down,		     /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	     /* options */
+		NULL			     /* parameters */
+	},
+	{
+		"/proc children foreach",    /* name */
+		test_proc_children_foreach, /* test */
+		setup,			     /* setup */
+		tear_down,		     /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	     /* options */
+		NULL			     /* parameters */
+	},
+	{
+		"/proc pidfd",		/* name */
+		test_proc_pidfd,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/proc fork and execvp",   /* name */
+		test_proc_fork_and_execvp, /* test */
+		setup,			   /* setup */
+		tear_down,		   /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	   /* options */
+		NULL			   /* parameters */
+	},
+	{
+		"/proc clone3",		/* name */
+		test_proc_clone3,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"/proc spawn async",	/* name */
+		test_proc_spawn_async,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite proc_suite = {
+	"/proc",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -0,0 +1,130 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "munit.h"
+#include "bench.h"
+
+#include "protobuf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static char *size_values[] = { "64", "4096", "262144", NULL };
+
+static MunitParameterEnum size_params[] = {
+	{ "size", size_values },
+	{ NULL, NULL },
+};
+
+#define ROUND_TRIPS 1000
+
+static int sv[2];
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	munit_assert_int(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+	// large frames have to fit into the socket at once
+	int sndbuf = 1024 * 1024;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static MunitResult
+bench_round_trip(const MunitParameter params[], bool memfd)
+{
+	uint32_t size = strtoul(munit_parameters_get(params, "size"), NULL, 10);
+	uint8_t *buf = mem_alloc(size);
+	munit_rand_memory(size, buf);
+
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < ROUND_TRIPS; i++) {
+		ssize_t sent = memfd ? protobuf_send_message_packed_memfd(sv[0], buf, size) :
+				       protobuf_send_message_packed(sv[0], buf, size);
+		munit_assert_int(sent, ==, size);
+
+		ssize_t len;
+		uint8_t *recv = protobuf_recv_message_packed_new(sv[1], &len);
+		munit_assert_int(len, ==, size);
+		mem_free(recv);
+	}
+	uint64_t elapsed = bench_now_ns() - start;
+
+	mem_free(buf);
+
+	return bench_report(memfd ? "/protobuf/round trip memfd" : "/protobuf/round trip",
+			    params, ROUND_TRIPS, elapsed);
+}
+
+static MunitResult
+bench_round_trip_stream(const MunitParameter params[], UNUSED void *data)
+{
+	return bench_round_trip(params, false);
+}
+
+static MunitResult
+bench_round_trip_memfd(const MunitParameter params[], UNUSED void *data)
+{
+	return bench_round_trip(params, true);
+}
+
+static MunitTest tests[] = {
+	{
+		"/round trip",		 /* name */
+		bench_round_trip_stream, /* test */
+		setup,			 /* setup */
+		tear_down,		 /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	 /* options */
+		size_params		 /* parameters */
+	},
+	{
+		"/round trip memfd",	/* name */
+		bench_round_trip_memfd, /* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		size_params		/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite protobuf_bench_suite = {
+	"/protobuf",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -21,6 +21,8 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define _GNU_SOURCE
+
 #include "protobuf.h"
 #include <errno.h>
 #include <stdio.h> // for protobuf-c-text.h
@@ -31,11 +33,37 @@
 #include "mem.h"
 #include "fd.h"
 #include "file.h"
+#include "event.h"
+#include "sock.h"
+#include "probe.h"
 
 #include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+#ifndef SYS_memfd_create
+#define SYS_memfd_create 319
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
 
-#define PROTOBUF_MAX_MESSAGE_SIZE 1024 * 1024
+// seals a memfd must carry before the receiver trusts its content
+#define PROTOBUF_MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
 
 // TODO update naming scheme
 
@@ -61,73 +89,418 @@ protobuf_pack_message_new(const ProtobufCMessage *message, uint8_t **ptr)
 ssize_t
 protobuf_send_message_packed(int fd, const uint8_t *buf, uint32_t buflen)
 {
-	ASSERT(buf);
+	ASSERT(buf || buflen == 0);
 
 	IF_FALSE_RETVAL(buflen < PROTOBUF_MAX_MESSAGE_SIZE, -1);
 
-	ssize_t bytes_sent = fd_write(fd, (char *)&(uint32_t){ htonl(buflen) }, sizeof(uint32_t));
-	if (-1 == bytes_sent)
-		goto error_write;
-	TRACE("sent protobuf message length (%zd bytes sent, %zu bytes expected, len=%d)",
-	      bytes_sent, sizeof(uint32_t), buflen);
-	ASSERT((size_t)bytes_sent == sizeof(uint32_t));
-
+	// length prefix and message data go out in one writev;
 	// serialized form of message with all default values has zero length
 	// => transmit its (zero) length prefix only
-	if (buflen == 0)
-		return 0;
-
-	// TODO sending large messages: might have to send multiple chunks
-	// need good (generic?!) solution that interacts nicely with event handling!
-	bytes_sent = fd_write(fd, (char *)buf, buflen);
-	if (-1 == bytes_sent)
-		goto error_write;
-	TRACE("sent protobuf message data (%zd bytes sent, %u bytes expected)", bytes_sent, buflen);
+	uint32_t len_be = htonl(buflen);
+	struct iovec iov[2] = { { .iov_base = &len_be, .iov_len = sizeof(uint32_t) },
+				{ .iov_base = (void *)buf, .iov_len = buflen } };
 
-	ASSERT((size_t)bytes_sent == buflen);
-	return bytes_sent;
+	PROBE2(protobuf_send_begin, fd, buflen);
+	ssize_t bytes_sent = fd_writev(fd, iov, buflen ? 2 : 1);
+	PROBE2(protobuf_send_end, fd, bytes_sent);
+	if (-1 == bytes_sent) {
+		DEBUG_ERRNO("Failed to write binary protobuf message to fd %d.", fd);
+		return -1;
+	}
+	TRACE("sent protobuf message (%zd bytes sent, %zu bytes expected, len=%u)", bytes_sent,
+	      sizeof(uint32_t) + buflen, buflen);
 
-error_write:
-	DEBUG_ERRNO("Failed to write binary protobuf message to fd %d.", fd);
-	return -1;
+	// the peer did not keep up within FD_POLL_TIMEOUT or went away in between
+	if ((size_t)bytes_sent != sizeof(uint32_t) + buflen) {
+		WARN("Truncated protobuf message on fd %d (%zd of %zu bytes sent)", fd, bytes_sent,
+		     sizeof(uint32_t) + buflen);
+		return -1;
+	}
+	return buflen;
 }
 
+// packing buffer kept per thread for protobuf_send_message
+#define PROTOBUF_SEND_BUF_KEEP (64 * 1024)
+static __thread uint8_t *protobuf_send_buf = NULL;
+static __thread size_t protobuf_send_buf_size = 0;
+
 ssize_t
 protobuf_send_message(int fd, const ProtobufCMessage *message)
 {
 	ASSERT(message);
 
-	uint8_t *buf = NULL;
-	uint32_t buflen = protobuf_pack_message_new(message, &buf);
-
+	PROBE2(protobuf_send_message, fd, message->descriptor->name);
+	size_t buflen = protobuf_c_message_get_packed_size(message);
 	if (!(buflen < PROTOBUF_MAX_MESSAGE_SIZE)) {
 		ERROR("Packed message exceeds PROTOBUF_MAX_MESSAGE_SIZE");
-		if (buf)
-			mem_free(buf);
-
 		return -1;
 	}
 
-	if (-1 == protobuf_send_message_packed(fd, buf, buflen)) {
+	// pack into the reusable buffer; only unusually large messages
+	// get a temporary one to avoid pinning their memory
+	uint8_t *buf = protobuf_send_buf;
+	if (buflen > protobuf_send_buf_size) {
+		if (buflen > PROTOBUF_SEND_BUF_KEEP) {
+			buf = mem_alloc(buflen);
+		} else {
+			protobuf_send_buf = mem_renew(uint8_t, protobuf_send_buf,
+						      PROTOBUF_SEND_BUF_KEEP);
+			protobuf_send_buf_size = PROTOBUF_SEND_BUF_KEEP;
+			buf = protobuf_send_buf;
+		}
+	}
+
+	size_t packed_len = buflen ? protobuf_c_message_pack(message, buf) : 0;
+	ASSERT(packed_len == buflen);
+
+	ssize_t ret = protobuf_send_message_packed(fd, buf, packed_len);
+	if (-1 == ret)
 		ERROR_ERRNO("Failed to write packed protobuf message to fd %d.", fd);
+
+	if (buf != protobuf_send_buf)
 		mem_free(buf);
+
+	return ret;
+}
+
+/******************************************************************************/
+
+/*
+ * Creates a memfd of the given size and maps it writable,
+ * the caller fills the mapping and passes it to protobuf_memfd_send().
+ */
+static int
+protobuf_memfd_new(uint32_t len, uint8_t **map)
+{
+	int memfd = syscall(SYS_memfd_create, "protobuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		DEBUG_ERRNO("Failed to create memfd, falling back to socket stream");
 		return -1;
 	}
 
-	mem_free(buf);
+	if (ftruncate(memfd, len) < 0) {
+		ERROR_ERRNO("Failed to resize memfd to %u bytes", len);
+		close(memfd);
+		return -1;
+	}
 
-	return buflen;
+	*map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (*map == MAP_FAILED) {
+		ERROR_ERRNO("Failed to map memfd of %u bytes", len);
+		close(memfd);
+		return -1;
+	}
+
+	return memfd;
+}
+
+/*
+ * Unmaps and seals the filled memfd and passes it along with the frame header.
+ * The memfd is closed in any case.
+ */
+static ssize_t
+protobuf_memfd_send(int sock, int memfd, uint8_t *map, uint32_t len)
+{
+	ssize_t ret = -1;
+
+	// writable shared mappings prevent F_SEAL_WRITE
+	munmap(map, len);
+
+	if (fcntl(memfd, F_ADD_SEALS, PROTOBUF_MEMFD_SEALS | F_SEAL_SEAL) < 0) {
+		ERROR_ERRNO("Failed to seal memfd");
+		goto out;
+	}
+
+	uint32_t header = htonl(len | PROTOBUF_FRAME_MEMFD);
+	if (sock_unix_send_fd(sock, &header, sizeof(header), memfd) != sizeof(header)) {
+		DEBUG("Failed to send memfd frame header to fd %d.", sock);
+		goto out;
+	}
+	TRACE("sent protobuf message of %u bytes as sealed memfd", len);
+	ret = len;
+out:
+	close(memfd);
+	return ret;
+}
+
+ssize_t
+protobuf_send_message_packed_memfd(int sock, const uint8_t *buf, uint32_t buflen)
+{
+	IF_FALSE_RETVAL(buflen < PROTOBUF_MAX_MESSAGE_SIZE, -1);
+
+	uint8_t *map = NULL;
+	int memfd = buflen < PROTOBUF_MEMFD_MIN_SIZE ? -1 : protobuf_memfd_new(buflen, &map);
+	if (memfd < 0)
+		return protobuf_send_message_packed(sock, buf, buflen);
+
+	memcpy(map, buf, buflen);
+	return protobuf_memfd_send(sock, memfd, map, buflen);
+}
+
+ssize_t
+protobuf_send_message_memfd(int sock, const ProtobufCMessage *message)
+{
+	ASSERT(message);
+
+	size_t buflen = protobuf_c_message_get_packed_size(message);
+	if (!(buflen < PROTOBUF_MAX_MESSAGE_SIZE)) {
+		ERROR("Packed message exceeds PROTOBUF_MAX_MESSAGE_SIZE");
+		return -1;
+	}
+
+	uint8_t *map = NULL;
+	int memfd = buflen < PROTOBUF_MEMFD_MIN_SIZE ? -1 : protobuf_memfd_new(buflen, &map);
+	if (memfd < 0)
+		return protobuf_send_message(sock, message);
+
+	// pack directly into the shared memory, the receiver maps the same pages
+	size_t packed_len = protobuf_c_message_pack(message, map);
+	ASSERT(packed_len == buflen);
+
+	return protobuf_memfd_send(sock, memfd, map, packed_len);
+}
+
+/*
+ * Maps the content of a sealed memfd received with a frame header read-only.
+ * Only memfds which can no longer be modified by the sender are accepted.
+ */
+static uint8_t *
+protobuf_memfd_map(int memfd, uint32_t len)
+{
+	int seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || (seals & PROTOBUF_MEMFD_SEALS) != PROTOBUF_MEMFD_SEALS) {
+		ERROR("Protocol violation, received memfd is not sealed");
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(memfd, &st) < 0 || st.st_size < (off_t)len) {
+		ERROR("Protocol violation, received memfd is smaller than %u bytes", len);
+		return NULL;
+	}
+
+	uint8_t *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, memfd, 0);
+	if (map == MAP_FAILED) {
+		ERROR_ERRNO("Failed to map received memfd");
+		return NULL;
+	}
+
+	return map;
+}
+
+/*
+ * Reads the length prefix of a frame. On unix sockets, a memfd possibly
+ * passed along with it is returned in memfd, otherwise memfd is -1.
+ */
+static ssize_t
+protobuf_recv_header(int fd, uint32_t *header, int *memfd)
+{
+	ssize_t bytes_read = sock_unix_recv_fd(fd, header, sizeof(uint32_t), memfd);
+	if (-1 == bytes_read) {
+		if (errno != ENOTSOCK && errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		bytes_read = 0;
+	} else if (0 == bytes_read) {
+		return 0;
+	}
+
+	// not a socket or only part of the header arrived
+	if ((size_t)bytes_read < sizeof(uint32_t)) {
+		ssize_t rest;
+		do {
+			rest = fd_read(fd, (char *)header + bytes_read,
+				       sizeof(uint32_t) - bytes_read);
+		} while (-1 == rest && errno == EINTR);
+		if (-1 == rest) {
+			if (*memfd >= 0)
+				close(*memfd);
+			*memfd = -1;
+			return -1;
+		}
+		bytes_read += rest;
+	}
+
+	return bytes_read;
+}
+
+/******************************************************************************/
+
+// dictionaries are limited to the window of deflate
+#define PROTOBUF_ZSTREAM_DICT_MAX (32 * 1024)
+// smaller messages are not worth compressing
+#define PROTOBUF_ZSTREAM_MIN_SIZE 64
+// slot and length of the packed message in front of the deflate stream
+#define PROTOBUF_ZSTREAM_HEADER_SIZE (1 + sizeof(uint32_t))
+
+typedef struct {
+	uint8_t *data;
+	size_t len;
+} protobuf_zstream_dict_t;
+
+struct protobuf_zstream {
+	z_stream strm;
+	bool deflating;
+	bool inflating;
+	protobuf_zstream_dict_t dict[256];
+};
+
+protobuf_zstream_t *
+protobuf_zstream_new(void)
+{
+	return mem_new0(protobuf_zstream_t, 1);
+}
+
+void
+protobuf_zstream_free(protobuf_zstream_t *zs)
+{
+	IF_NULL_RETURN(zs);
+
+	if (zs->deflating)
+		deflateEnd(&zs->strm);
+	if (zs->inflating)
+		inflateEnd(&zs->strm);
+	for (size_t i = 0; i < sizeof(zs->dict) / sizeof(zs->dict[0]); i++)
+		mem_free(zs->dict[i].data);
+	mem_free(zs);
+}
+
+/*
+ * Keeps the tail of the message transferred last in slot, which is
+ * the dictionary for the next message in that slot.
+ */
+static void
+protobuf_zstream_dict_update(protobuf_zstream_t *zs, uint8_t slot, const uint8_t *buf,
+			     uint32_t buflen)
+{
+	protobuf_zstream_dict_t *dict = &zs->dict[slot];
+	size_t len = MIN(buflen, (uint32_t)PROTOBUF_ZSTREAM_DICT_MAX);
+
+	if (!dict->data)
+		dict->data = mem_alloc(PROTOBUF_ZSTREAM_DICT_MAX);
+	memcpy(dict->data, buf + buflen - len, len);
+	dict->len = len;
+}
+
+ssize_t
+protobuf_zstream_deflate(protobuf_zstream_t *zs, uint8_t slot, const uint8_t *buf,
+			 uint32_t buflen, uint8_t *out, uint32_t out_size)
+{
+	ASSERT(zs);
+	ASSERT(!zs->inflating);
+
+	IF_TRUE_RETVAL_TRACE(buflen < PROTOBUF_ZSTREAM_MIN_SIZE, 0);
+	IF_TRUE_RETVAL_TRACE(out_size <= PROTOBUF_ZSTREAM_HEADER_SIZE, 0);
+
+	int ret = zs->deflating ? deflateReset(&zs->strm) :
+				  deflateInit2(&zs->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+					       -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK) {
+		ERROR("Failed to initialize deflate stream: %s", zs->strm.msg);
+		return -1;
+	}
+	zs->deflating = true;
+
+	protobuf_zstream_dict_t *dict = &zs->dict[slot];
+	if (dict->len && deflateSetDictionary(&zs->strm, dict->data, dict->len) != Z_OK) {
+		ERROR("Failed to set deflate dictionary of slot %u", slot);
+		return -1;
+	}
+
+	zs->strm.next_in = (Bytef *)buf;
+	zs->strm.avail_in = buflen;
+	zs->strm.next_out = out + PROTOBUF_ZSTREAM_HEADER_SIZE;
+	zs->strm.avail_out = out_size - PROTOBUF_ZSTREAM_HEADER_SIZE;
+
+	ret = deflate(&zs->strm, Z_FINISH);
+	if (ret == Z_OK || ret == Z_BUF_ERROR) {
+		TRACE("Message of %u bytes in slot %u does not compress", buflen, slot);
+		return 0;
+	}
+	if (ret != Z_STREAM_END) {
+		ERROR("Failed to deflate message: %s", zs->strm.msg);
+		return -1;
+	}
+
+	out[0] = slot;
+	memcpy(out + 1, &(uint32_t){ htonl(buflen) }, sizeof(uint32_t));
+	protobuf_zstream_dict_update(zs, slot, buf, buflen);
+
+	TRACE("Deflated message of %u bytes in slot %u to %lu bytes", buflen, slot,
+	      zs->strm.total_out);
+	return PROTOBUF_ZSTREAM_HEADER_SIZE + zs->strm.total_out;
 }
 
 uint8_t *
-protobuf_recv_message_packed_new(int fd, ssize_t *ret_len)
+protobuf_zstream_inflate_new(protobuf_zstream_t *zs, const uint8_t *payload, uint32_t len,
+			     uint32_t *buflen)
+{
+	ASSERT(zs);
+	ASSERT(!zs->deflating);
+	ASSERT(buflen);
+
+	if (len < PROTOBUF_ZSTREAM_HEADER_SIZE) {
+		ERROR("Protocol violation, compressed frame of %u bytes", len);
+		return NULL;
+	}
+
+	uint8_t slot = payload[0];
+	uint32_t packed_len;
+	memcpy(&packed_len, payload + 1, sizeof(uint32_t));
+	packed_len = ntohl(packed_len);
+	if (!(packed_len < PROTOBUF_MAX_MESSAGE_SIZE)) {
+		ERROR("Protocol violation, compressed message of %u bytes", packed_len);
+		return NULL;
+	}
+
+	int ret = zs->inflating ? inflateReset(&zs->strm) : inflateInit2(&zs->strm, -MAX_WBITS);
+	if (ret != Z_OK) {
+		ERROR("Failed to initialize inflate stream: %s", zs->strm.msg);
+		return NULL;
+	}
+	zs->inflating = true;
+
+	protobuf_zstream_dict_t *dict = &zs->dict[slot];
+	if (dict->len && inflateSetDictionary(&zs->strm, dict->data, dict->len) != Z_OK) {
+		ERROR("Failed to set inflate dictionary of slot %u", slot);
+		return NULL;
+	}
+
+	uint8_t *buf = mem_alloc(MAX(packed_len, 1u));
+	zs->strm.next_in = (Bytef *)payload + PROTOBUF_ZSTREAM_HEADER_SIZE;
+	zs->strm.avail_in = len - PROTOBUF_ZSTREAM_HEADER_SIZE;
+	zs->strm.next_out = buf;
+	zs->strm.avail_out = packed_len;
+
+	ret = inflate(&zs->strm, Z_FINISH);
+	if (ret != Z_STREAM_END || zs->strm.total_out != packed_len) {
+		ERROR("Failed to inflate message of %u bytes in slot %u: %s", packed_len, slot,
+		      zs->strm.msg ? zs->strm.msg : "length mismatch");
+		mem_free(buf);
+		return NULL;
+	}
+
+	protobuf_zstream_dict_update(zs, slot, buf, packed_len);
+	*buflen = packed_len;
+	return buf;
+}
+
+/******************************************************************************/
+
+/*
+ * Receives the packed message of the next frame. If *mapped is set on return,
+ * the message is a read-only mapping of a memfd frame which has to be released
+ * with munmap() instead of mem_free().
+ */
+static uint8_t *
+protobuf_recv_frame_new(int fd, protobuf_zstream_t *zs, ssize_t *ret_len, bool *mapped)
 {
 	ASSERT(ret_len);
+	ASSERT(mapped);
 	uint32_t buflen = 0;
-	ssize_t bytes_read;
-	do {
-		bytes_read = fd_read(fd, (char *)&buflen, sizeof(uint32_t));
-	} while (-1 == bytes_read && errno == EINTR);
+	int memfd = -1;
+	*mapped = false;
+
+	ssize_t bytes_read = protobuf_recv_header(fd, &buflen, &memfd);
 	if (-1 == bytes_read)
 		goto error_read;
 	if (0 == bytes_read) { // EOF / remote end closed the connection
@@ -140,16 +513,46 @@ protobuf_recv_message_packed_new(int fd, ssize_t *ret_len)
 	      bytes_read, sizeof(buflen), buflen);
 	if (((size_t)bytes_read != sizeof(buflen))) {
 		ERROR("Protocol violation!");
-		*ret_len = -1;
-		return NULL;
+		goto error_memfd;
+	}
+
+	bool compressed = zs && (buflen & PROTOBUF_FRAME_COMPRESSED);
+	if (compressed)
+		buflen &= ~PROTOBUF_FRAME_COMPRESSED;
+	bool shm = !compressed && memfd >= 0 && (buflen & PROTOBUF_FRAME_MEMFD);
+	if (shm)
+		buflen &= ~PROTOBUF_FRAME_MEMFD;
+	if (!(buflen < PROTOBUF_MAX_MESSAGE_SIZE)) {
+		ERROR("Protocol violation, message of %u bytes", buflen);
+		goto error_memfd;
+	}
+
+	if (memfd >= 0 && !shm) {
+		WARN("Ignoring file descriptor passed with ordinary frame on fd %d", fd);
+		close(memfd);
+		memfd = -1;
 	}
-	IF_FALSE_RETVAL(buflen < PROTOBUF_MAX_MESSAGE_SIZE, NULL);
 
 	if (0 == buflen) {
+		if (memfd >= 0)
+			close(memfd);
 		*ret_len = 0;
 		return NULL;
 	}
 
+	if (shm) {
+		uint8_t *map = protobuf_memfd_map(memfd, buflen);
+		close(memfd);
+		if (!map) {
+			*ret_len = -1;
+			return NULL;
+		}
+		TRACE("mapped protobuf message of %u bytes from memfd", buflen);
+		*mapped = true;
+		*ret_len = buflen;
+		return map;
+	}
+
 	uint8_t *buf = mem_alloc(buflen);
 	do {
 		bytes_read = fd_read(fd, (char *)buf, buflen);
@@ -169,23 +572,63 @@ protobuf_recv_message_packed_new(int fd, ssize_t *ret_len)
 	// TODO: what if only part of a message could be read?
 	// need good (generic?!) solution that interacts nicely with event handling!
 
+	if (compressed) {
+		uint32_t packed_len = 0;
+		uint8_t *packed = protobuf_zstream_inflate_new(zs, buf, buflen, &packed_len);
+		mem_free(buf);
+		if (!packed) {
+			*ret_len = -1;
+			return NULL;
+		}
+		if (packed_len == 0) {
+			mem_free(packed);
+			*ret_len = 0;
+			return NULL;
+		}
+		*ret_len = packed_len;
+		return packed;
+	}
+
 	*ret_len = bytes_read;
 
 	return buf;
 
+error_memfd:
+	if (memfd >= 0)
+		close(memfd);
+	*ret_len = -1;
+	return NULL;
+
 error_read:
 	DEBUG_ERRNO("Failed to read binary protobuf message from fd %d.", fd);
 	*ret_len = -1;
 	return NULL;
 }
 
+uint8_t *
+protobuf_recv_message_packed_new(int fd, ssize_t *ret_len)
+{
+	bool mapped;
+	uint8_t *buf = protobuf_recv_frame_new(fd, NULL, ret_len, &mapped);
+	if (buf && mapped) {
+		uint8_t *copy = mem_alloc(*ret_len);
+		memcpy(copy, buf, *ret_len);
+		munmap(buf, *ret_len);
+		buf = copy;
+	}
+	return buf;
+}
+
 ProtobufCMessage *
-protobuf_recv_message(int fd, const ProtobufCMessageDescriptor *descriptor)
+protobuf_recv_message_zstream(int fd, const ProtobufCMessageDescriptor *descriptor,
+			      protobuf_zstream_t *zs)
 {
 	ASSERT(descriptor);
 
 	ssize_t buflen = 0;
-	uint8_t *buf = protobuf_recv_message_packed_new(fd, &buflen);
+	bool mapped;
+	uint8_t *buf = protobuf_recv_frame_new(fd, zs, &buflen, &mapped);
+	PROBE3(protobuf_recv_frame, fd, buflen, descriptor->name);
 
 	// zero length data represents a message with all default values
 	// => use unpack to construct it (and initialize it with these defaults)
@@ -198,10 +641,20 @@ protobuf_recv_message(int fd, const ProtobufCMessageDescriptor *descriptor)
 	}
 
 	ProtobufCMessage *msg = protobuf_c_message_unpack(descriptor, NULL, buflen, buf);
-	mem_free(buf);
+	PROBE2(protobuf_recv_unpacked, fd, msg != NULL);
+	if (mapped)
+		munmap(buf, buflen);
+	else
+		mem_free(buf);
 	return msg;
 }
 
+ProtobufCMessage *
+protobuf_recv_message(int fd, const ProtobufCMessageDescriptor *descriptor)
+{
+	return protobuf_recv_message_zstream(fd, descriptor, NULL);
+}
+
 ProtobufCMessage *
 protobuf_unpack_message(const ProtobufCMessageDescriptor *descriptor, uint8_t *buf,
 			uint32_t buf_len)
@@ -240,6 +693,48 @@ protobuf_dump_message(int fd, const ProtobufCMessage *message)
 	return bytes_written;
 }
 
+/*
+ * Parses a text protobuf message from an open stream. The stream is closed.
+ * origin describes where the message comes from for error messages.
+ */
+static ProtobufCMessage *
+protobuf_message_new_from_fp(FILE *fp, const char *origin,
+			     const ProtobufCMessageDescriptor *descriptor)
+{
+	ProtobufCTextError res;
+	memset(&res, 0, sizeof(res));
+	ProtobufCMessage *msg = protobuf_c_text_from_file(descriptor, fp, &res, NULL);
+	fclose(fp);
+	if (!msg) {
+		ERROR("Failed to parse text protobuf message (%s) from %s. Reason: %s.",
+		      descriptor->name ? descriptor->name : "UNKNOWN", origin,
+		      res.error_txt ? res.error_txt : "UNKNOWN");
+		return NULL;
+	}
+	if (!res.complete) {
+		ERROR("Incomplete text protobuf message (%s) in %s.",
+		      descriptor->name ? descriptor->name : "UNKNOWN", origin);
+		protobuf_free_message(msg);
+		return NULL;
+	}
+	if (res.complete < 0) // TODO investigate why this seems to be the case...
+		WARN("Required field check wasn't performed -- libprotobuf-c is too old.");
+	return msg;
+}
+
+/*
+ * Opens a read-only stream on len bytes of buf without copying them.
+ * Empty buffers are not supported by all fmemopen implementations, thus
+ * they are served from /dev/null instead.
+ */
+static FILE *
+protobuf_fmemopen(const void *buf, size_t len)
+{
+	if (len == 0)
+		return fopen("/dev/null", "re");
+	return fmemopen((void *)buf, len, "r");
+}
+
 ProtobufCMessage *
 protobuf_message_new_from_textfile(const char *filename,
 				   const ProtobufCMessageDescriptor *descriptor)
@@ -249,29 +744,22 @@ protobuf_message_new_from_textfile(const char *filename,
 	TRACE("Reading text protobuf message (%s) from file \"%s\".",
 	      descriptor->name ? descriptor->name : "UNKNOWN", filename);
 
-	ProtobufCTextError res;
-	memset(&res, 0, sizeof(res));
-	FILE *file = fopen(filename, "r");
-	if (!file) {
+	// parse straight from the page cache, the mapping is kept until parsing is done
+	file_map_t *map = file_map_ro(filename);
+	if (!map) {
 		WARN_ERRNO("Could not open file \"%s\" for reading.", filename);
 		return NULL;
 	}
-	ProtobufCMessage *msg = protobuf_c_text_from_file(descriptor, file, &res, NULL);
-	fclose(file);
-	if (!msg) {
-		ERROR("Failed to parse text protobuf message (%s) from file \"%s\". Reason: %s.",
-		      descriptor->name ? descriptor->name : "UNKNOWN", filename,
-		      res.error_txt ? res.error_txt : "UNKNOWN");
-		return NULL;
-	}
-	if (!res.complete) {
-		ERROR("Incomplete text protobuf message (%s) in file \"%s\".",
-		      descriptor->name ? descriptor->name : "UNKNOWN", filename);
-		protobuf_free_message(msg);
+	FILE *file = protobuf_fmemopen(file_map_data(map), file_map_size(map));
+	if (!file) {
+		WARN_ERRNO("Could not open stream on file \"%s\".", filename);
+		file_map_unref(map);
 		return NULL;
 	}
-	if (res.complete < 0) // TODO investigate why this seems to be the case...
-		WARN("Required field check wasn't performed -- libprotobuf-c is too old.");
+	char *origin = mem_printf("file \"%s\"", filename);
+	ProtobufCMessage *msg = protobuf_message_new_from_fp(file, origin, descriptor);
+	mem_free(origin);
+	file_map_unref(map);
 	return msg;
 }
 
@@ -316,14 +804,13 @@ protobuf_message_new_from_buf(const uint8_t *buf, size_t buflen,
 	TRACE("Parsing text protobuf message (%s) from buffer %p (length=%zu).",
 	      descriptor->name ? descriptor->name : "UNKNOWN", buf, buflen);
 
-	char *string = mem_alloc(buflen + 1);
-	memcpy(string, buf, buflen);
-	string[buflen] = '\0';
-
-	ProtobufCMessage *msg = protobuf_message_new_from_string(string, descriptor);
-
-	mem_free(string);
-	return msg;
+	// parse in place instead of copying the buffer to a string
+	FILE *fp = protobuf_fmemopen(buf, buflen);
+	if (!fp) {
+		WARN_ERRNO("Could not open stream on buffer %p.", buf);
+		return NULL;
+	}
+	return protobuf_message_new_from_fp(fp, "buffer", descriptor);
 }
 
 ssize_t
@@ -346,3 +833,518 @@ protobuf_message_write_to_file(const char *filename, ProtobufCMessage *message)
 	}
 	return len;
 }
+
+// header of cache files, followed by the digest, the packed message and the mac
+#define PROTOBUF_CACHE_MAGIC 0x32434250 // "PBC2"
+#define PROTOBUF_CACHE_MAX_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t mac_len;
+	uint32_t digest_len;
+} protobuf_cache_header_t;
+
+// compares macs in constant time
+static bool
+protobuf_cache_mac_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	uint8_t diff = 0;
+	for (size_t i = 0; i < len; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+ProtobufCMessage *
+protobuf_message_new_from_cachefile(const char *cache_file,
+				    const ProtobufCMessageDescriptor *descriptor,
+				    const char *digest, protobuf_cache_mac_t mac)
+{
+	ASSERT(cache_file);
+	ASSERT(descriptor);
+	ASSERT(digest);
+
+	ProtobufCMessage *msg = NULL;
+	uint8_t *buf = NULL;
+	protobuf_cache_header_t header;
+	size_t digest_len = strlen(digest);
+	size_t mac_len = mac ? PROTOBUF_CACHE_MAC_LEN : 0;
+	uint8_t expected_mac[PROTOBUF_CACHE_MAC_LEN];
+
+	off_t len = file_size(cache_file);
+	if (len < (off_t)sizeof(header) || len > PROTOBUF_CACHE_MAX_SIZE) {
+		TRACE("No usable cache file \"%s\".", cache_file);
+		return NULL;
+	}
+
+	buf = mem_alloc(len);
+	if (file_read(cache_file, (char *)buf, len) != len) {
+		WARN("Could not read cache file \"%s\".", cache_file);
+		goto out;
+	}
+
+	memcpy(&header, buf, sizeof(header));
+	if (header.magic != PROTOBUF_CACHE_MAGIC || header.digest_len != digest_len ||
+	    header.mac_len != mac_len || (off_t)(sizeof(header) + digest_len + mac_len) > len) {
+		DEBUG("Invalid cache file \"%s\".", cache_file);
+		goto out;
+	}
+	if (memcmp(buf + sizeof(header), digest, digest_len)) {
+		DEBUG("Cache file \"%s\" is outdated.", cache_file);
+		goto out;
+	}
+
+	len -= mac_len;
+	if (mac && (mac(buf, len, expected_mac) < 0 ||
+		    !protobuf_cache_mac_equal(buf + len, expected_mac, mac_len))) {
+		WARN("Cache file \"%s\" is not authentic.", cache_file);
+		goto out;
+	}
+
+	size_t offset = sizeof(header) + digest_len;
+	msg = protobuf_c_message_unpack(descriptor, NULL, len - offset, buf + offset);
+	if (!msg) {
+		WARN("Failed to unpack protobuf message (%s) from cache file \"%s\".",
+		     descriptor->name ? descriptor->name : "UNKNOWN", cache_file);
+		goto out;
+	}
+
+	TRACE("Loaded protobuf message (%s) from cache file \"%s\".",
+	      descriptor->name ? descriptor->name : "UNKNOWN", cache_file);
+out:
+	mem_free(buf);
+	return msg;
+}
+
+int
+protobuf_message_write_to_cachefile(const char *cache_file, const ProtobufCMessage *message,
+				    const char *digest, protobuf_cache_mac_t mac)
+{
+	ASSERT(cache_file);
+	ASSERT(message);
+	ASSERT(digest);
+
+	protobuf_cache_header_t header = { .magic = PROTOBUF_CACHE_MAGIC,
+					   .mac_len = mac ? PROTOBUF_CACHE_MAC_LEN : 0,
+					   .digest_len = strlen(digest) };
+	size_t packed_len = protobuf_c_message_get_packed_size(message);
+	size_t mac_offset = sizeof(header) + header.digest_len + packed_len;
+	size_t len = mac_offset + header.mac_len;
+	char *tmp_file = NULL;
+	int ret = -1;
+
+	uint8_t *buf = mem_alloc(len);
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + sizeof(header), digest, header.digest_len);
+	protobuf_c_message_pack(message, buf + sizeof(header) + header.digest_len);
+	if (mac && mac(buf, mac_offset, buf + mac_offset) < 0) {
+		WARN("Could not authenticate cache file \"%s\".", cache_file);
+		goto out;
+	}
+
+	// write to a temporary file first, so that a partially written cache is never used
+	tmp_file = mem_printf("%s.tmp", cache_file);
+	if (file_write(tmp_file, (char *)buf, len) < 0) {
+		WARN("Could not write cache file \"%s\".", tmp_file);
+		unlink(tmp_file);
+		goto out;
+	}
+	if (rename(tmp_file, cache_file) < 0) {
+		WARN_ERRNO("Could not rename \"%s\" to \"%s\".", tmp_file, cache_file);
+		unlink(tmp_file);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(tmp_file);
+	mem_free(buf);
+	return ret;
+}
+
+/******************************************************************************/
+
+// initial and idle size of the per connection buffers
+#define PROTOBUF_CONN_BUF_SIZE (64 * 1024)
+// queued outgoing data after which sending is refused
+#define PROTOBUF_CONN_WBUF_MAX (8 * 1024 * 1024)
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t start; // first byte not yet consumed
+	size_t end;   // first free byte
+} protobuf_conn_buf_t;
+
+struct protobuf_conn {
+	int fd;
+	const ProtobufCMessageDescriptor *descriptor;
+	void (*recv_cb)(protobuf_conn_t *conn, ProtobufCMessage *msg, void *data);
+	void (*recv_packed_cb)(protobuf_conn_t *conn, const uint8_t *buf, uint32_t len,
+			       void *data);
+	void (*close_cb)(protobuf_conn_t *conn, void *data);
+	void *data;
+	event_io_t *io_read;
+	event_io_t *io_write;
+	bool writing; // io_write is registered, i.e., data is queued
+	protobuf_conn_buf_t rbuf;
+	protobuf_conn_buf_t wbuf;
+	bool closed;
+	bool in_cb;
+	bool free_pending;
+};
+
+/*
+ * Makes room for len more bytes behind the buffer's end, moving the
+ * unconsumed data to the front before growing the buffer.
+ */
+static void
+protobuf_conn_buf_reserve(protobuf_conn_buf_t *buf, size_t len)
+{
+	if (buf->size - buf->end >= len)
+		return;
+
+	if (buf->start > 0) {
+		memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+		buf->end -= buf->start;
+		buf->start = 0;
+		if (buf->size - buf->end >= len)
+			return;
+	}
+
+	size_t size = MAX(buf->size, (size_t)PROTOBUF_CONN_BUF_SIZE);
+	while (size - buf->end < len)
+		size *= 2;
+	buf->data = mem_renew(uint8_t, buf->data, size);
+	buf->size = size;
+}
+
+static void
+protobuf_conn_buf_consume(protobuf_conn_buf_t *buf, size_t len)
+{
+	buf->start += len;
+	if (buf->start < buf->end)
+		return;
+
+	// drained, start over at the front and give back memory of large messages
+	buf->start = buf->end = 0;
+	if (buf->size > PROTOBUF_CONN_BUF_SIZE) {
+		buf->data = mem_renew(uint8_t, buf->data, PROTOBUF_CONN_BUF_SIZE);
+		buf->size = PROTOBUF_CONN_BUF_SIZE;
+	}
+}
+
+static void
+protobuf_conn_close(protobuf_conn_t *conn)
+{
+	IF_TRUE_RETURN(conn->closed);
+
+	conn->closed = true;
+	event_remove_io(conn->io_read);
+	if (conn->writing)
+		event_remove_io(conn->io_write);
+	conn->writing = false;
+
+	if (conn->close_cb)
+		conn->close_cb(conn, conn->data);
+}
+
+/*
+ * Writes as much of the queued data as the socket takes and
+ * registers for writability if some is left.
+ */
+static int
+protobuf_conn_flush(protobuf_conn_t *conn)
+{
+	while (conn->wbuf.end > conn->wbuf.start) {
+		ssize_t n = write(conn->fd, conn->wbuf.data + conn->wbuf.start,
+				  conn->wbuf.end - conn->wbuf.start);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			DEBUG_ERRNO("Failed to write to protobuf connection on fd %d", conn->fd);
+			return -1;
+		}
+		protobuf_conn_buf_consume(&conn->wbuf, n);
+	}
+
+	bool pending = conn->wbuf.end > conn->wbuf.start;
+	if (pending && !conn->writing)
+		event_add_io(conn->io_write);
+	else if (!pending && conn->writing)
+		event_remove_io(conn->io_write);
+	conn->writing = pending;
+
+	return 0;
+}
+
+/*
+ * Passes all complete frames in the read buffer to the receive callback.
+ */
+static int
+protobuf_conn_parse(protobuf_conn_t *conn)
+{
+	protobuf_conn_buf_t *buf = &conn->rbuf;
+
+	while (!conn->free_pending && buf->end - buf->start >= sizeof(uint32_t)) {
+		uint32_t len;
+		memcpy(&len, buf->data + buf->start, sizeof(len));
+		len = ntohl(len);
+
+		if (!(len < PROTOBUF_MAX_MESSAGE_SIZE)) {
+			ERROR("Protocol violation on fd %d, message of %u bytes", conn->fd, len);
+			return -1;
+		}
+
+		if (buf->end - buf->start < sizeof(uint32_t) + len) {
+			// make sure the rest of a large frame fits into the buffer
+			protobuf_conn_buf_reserve(buf, sizeof(uint32_t) + len -
+							       (buf->end - buf->start));
+			break;
+		}
+
+		if (conn->recv_packed_cb) {
+			// the frame stays in place until the callback returned
+			conn->recv_packed_cb(conn, buf->data + buf->start + sizeof(uint32_t), len,
+					     conn->data);
+			protobuf_conn_buf_consume(buf, sizeof(uint32_t) + len);
+			continue;
+		}
+
+		ProtobufCMessage *msg = protobuf_c_message_unpack(
+			conn->descriptor, NULL, len, buf->data + buf->start + sizeof(uint32_t));
+		protobuf_conn_buf_consume(buf, sizeof(uint32_t) + len);
+		if (!msg) {
+			ERROR("Failed to unpack protobuf message on fd %d", conn->fd);
+			return -1;
+		}
+
+		conn->recv_cb(conn, msg, conn->data);
+		protobuf_free_message(msg);
+	}
+	return 0;
+}
+
+static int
+protobuf_conn_read(protobuf_conn_t *conn)
+{
+	protobuf_conn_buf_t *buf = &conn->rbuf;
+
+	while (!conn->free_pending) {
+		protobuf_conn_buf_reserve(buf, 1);
+		ssize_t n = read(conn->fd, buf->data + buf->end, buf->size - buf->end);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			DEBUG_ERRNO("Failed to read from protobuf connection on fd %d", conn->fd);
+			return -1;
+		}
+		if (n == 0) {
+			DEBUG("client on fd %d closed connection.", conn->fd);
+			return -1;
+		}
+		buf->end += n;
+
+		if (protobuf_conn_parse(conn) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+protobuf_conn_free_internal(protobuf_conn_t *conn)
+{
+	if (!conn->closed) {
+		// best effort to get out what is still queued
+		protobuf_conn_flush(conn);
+		event_remove_io(conn->io_read);
+		if (conn->writing)
+			event_remove_io(conn->io_write);
+	}
+	event_io_free(conn->io_read);
+	event_io_free(conn->io_write);
+	if (close(conn->fd) < 0)
+		WARN_ERRNO("Failed to close protobuf connection on fd %d", conn->fd);
+	mem_free(conn->rbuf.data);
+	mem_free(conn->wbuf.data);
+	mem_free(conn);
+}
+
+static void
+protobuf_conn_cb_io(UNUSED int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	protobuf_conn_t *conn = data;
+	int ret = 0;
+
+	conn->in_cb = true;
+
+	if (events & EVENT_IO_WRITE)
+		ret = protobuf_conn_flush(conn);
+
+	if (ret == 0 && (events & EVENT_IO_READ))
+		ret = protobuf_conn_read(conn);
+	else if (ret == 0 && (events & EVENT_IO_EXCEPT))
+		ret = -1;
+
+	if (ret < 0 && !conn->free_pending)
+		protobuf_conn_close(conn);
+
+	conn->in_cb = false;
+	if (conn->free_pending)
+		protobuf_conn_free_internal(conn);
+}
+
+static protobuf_conn_t *
+protobuf_conn_new_internal(int fd, void (*close_cb)(protobuf_conn_t *conn, void *data),
+			   void *data)
+{
+	if (fd_make_non_blocking(fd) < 0) {
+		ERROR_ERRNO("Could not make protobuf connection on fd %d non-blocking", fd);
+		return NULL;
+	}
+
+	protobuf_conn_t *conn = mem_new0(protobuf_conn_t, 1);
+	conn->fd = fd;
+	conn->close_cb = close_cb;
+	conn->data = data;
+
+	conn->io_read = event_io_new(fd, EVENT_IO_READ, protobuf_conn_cb_io, conn);
+	conn->io_write = event_io_new(fd, EVENT_IO_WRITE, protobuf_conn_cb_io, conn);
+	event_add_io(conn->io_read);
+
+	return conn;
+}
+
+protobuf_conn_t *
+protobuf_conn_new(int fd, const ProtobufCMessageDescriptor *descriptor,
+		  void (*recv_cb)(protobuf_conn_t *conn, ProtobufCMessage *msg, void *data),
+		  void (*close_cb)(protobuf_conn_t *conn, void *data), void *data)
+{
+	ASSERT(descriptor);
+	ASSERT(recv_cb);
+
+	protobuf_conn_t *conn = protobuf_conn_new_internal(fd, close_cb, data);
+	IF_NULL_RETVAL(conn, NULL);
+
+	conn->descriptor = descriptor;
+	conn->recv_cb = recv_cb;
+	return conn;
+}
+
+protobuf_conn_t *
+protobuf_conn_new_packed(int fd,
+			 void (*recv_cb)(protobuf_conn_t *conn, const uint8_t *buf, uint32_t len,
+					 void *data),
+			 void (*close_cb)(protobuf_conn_t *conn, void *data), void *data)
+{
+	ASSERT(recv_cb);
+
+	protobuf_conn_t *conn = protobuf_conn_new_internal(fd, close_cb, data);
+	IF_NULL_RETVAL(conn, NULL);
+
+	conn->recv_packed_cb = recv_cb;
+	return conn;
+}
+
+int
+protobuf_conn_get_fd(const protobuf_conn_t *conn)
+{
+	ASSERT(conn);
+	return conn->fd;
+}
+
+size_t
+protobuf_conn_get_queued(const protobuf_conn_t *conn)
+{
+	ASSERT(conn);
+	return conn->wbuf.end - conn->wbuf.start;
+}
+
+/*
+ * Reserves a frame of len bytes in the write buffer
+ * and returns a pointer to its payload.
+ */
+static uint8_t *
+protobuf_conn_frame_new(protobuf_conn_t *conn, uint32_t len)
+{
+	if (conn->closed) {
+		errno = EPIPE;
+		return NULL;
+	}
+
+	if (!(len < PROTOBUF_MAX_MESSAGE_SIZE)) {
+		ERROR("Packed message exceeds PROTOBUF_MAX_MESSAGE_SIZE");
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	if (protobuf_conn_get_queued(conn) + sizeof(uint32_t) + len > PROTOBUF_CONN_WBUF_MAX) {
+		WARN("Send queue of protobuf connection on fd %d is full", conn->fd);
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	protobuf_conn_buf_reserve(&conn->wbuf, sizeof(uint32_t) + len);
+	uint8_t *frame = conn->wbuf.data + conn->wbuf.end;
+	memcpy(frame, &(uint32_t){ htonl(len) }, sizeof(uint32_t));
+	conn->wbuf.end += sizeof(uint32_t) + len;
+
+	return frame + sizeof(uint32_t);
+}
+
+/*
+ * Tries to send a newly queued frame right away. If older data is still
+ * queued, the frame goes out in order from the write callback. Errors are
+ * left to the event callback, which reports the hangup through close_cb.
+ */
+static int
+protobuf_conn_send_frame(protobuf_conn_t *conn)
+{
+	IF_TRUE_RETVAL(conn->writing, 0);
+	return protobuf_conn_flush(conn);
+}
+
+int
+protobuf_conn_send_message_packed(protobuf_conn_t *conn, const uint8_t *buf, uint32_t buflen)
+{
+	ASSERT(conn);
+	ASSERT(buf || buflen == 0);
+
+	uint8_t *payload = protobuf_conn_frame_new(conn, buflen);
+	IF_NULL_RETVAL(payload, -1);
+	if (buflen)
+		memcpy(payload, buf, buflen);
+
+	return protobuf_conn_send_frame(conn);
+}
+
+int
+protobuf_conn_send_message(protobuf_conn_t *conn, const ProtobufCMessage *message)
+{
+	ASSERT(conn);
+	ASSERT(message);
+
+	uint32_t len = protobuf_c_message_get_packed_size(message);
+	uint8_t *payload = protobuf_conn_frame_new(conn, len);
+	IF_NULL_RETVAL(payload, -1);
+
+	// pack in place, no intermediate buffer
+	uint32_t actual_len = protobuf_c_message_pack(message, payload);
+	ASSERT(actual_len == len);
+
+	return protobuf_conn_send_frame(conn);
+}
+
+void
+protobuf_conn_free(protobuf_conn_t *conn)
+{
+	IF_NULL_RETURN(conn);
+
+	if (conn->in_cb) {
+		conn->free_pending = true;
+		return;
+	}
+	protobuf_conn_free_internal(conn);
+}
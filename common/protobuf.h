@@ -37,6 +37,9 @@
 #include <sys/types.h>
 #include <stdbool.h>
 
+// upper bound for the packed size of messages sent and received
+#define PROTOBUF_MAX_MESSAGE_SIZE (1024 * 1024)
+
 /**
  * Packs the given protobuf message struct
  * and returns it's binary serialized form.
@@ -76,6 +79,39 @@ protobuf_send_message_packed(int fd, const uint8_t *buf, uint32_t buflen);
 ssize_t
 protobuf_send_message(int fd, const ProtobufCMessage *message);
 
+/*
+ * Large messages between co-located daemons can be passed as shared memory
+ * instead of being copied through the socket. Such a frame has
+ * PROTOBUF_FRAME_MEMFD set in its length prefix and carries no payload;
+ * the packed message is the content of a sealed memfd, which is passed
+ * along with the length prefix as SCM_RIGHTS ancillary data on a unix socket.
+ * All receive functions accept these frames.
+ *
+ * Sending memfds is opt-in: up to PROTOBUF_MAX_MESSAGE_SIZE, creating, sealing
+ * and mapping a memfd costs more than copying the message through the socket
+ * (see the protobuf round trips of common.bench). It only pays off if the
+ * receiver keeps working on the mapping instead of copying it.
+ */
+#define PROTOBUF_FRAME_MEMFD 0x40000000u
+
+// smaller messages are always streamed by the memfd send functions
+#define PROTOBUF_MEMFD_MIN_SIZE (64 * 1024)
+
+/**
+ * Same as protobuf_send_message() but passes messages of at least
+ * PROTOBUF_MEMFD_MIN_SIZE bytes as sealed memfd. The message is packed
+ * directly into the shared memory. Must only be used on unix sockets.
+ */
+ssize_t
+protobuf_send_message_memfd(int sock, const ProtobufCMessage *message);
+
+/**
+ * Same as protobuf_send_message_packed() but passes messages of at least
+ * PROTOBUF_MEMFD_MIN_SIZE bytes as sealed memfd. Must only be used on unix sockets.
+ */
+ssize_t
+protobuf_send_message_packed_memfd(int sock, const uint8_t *buf, uint32_t buflen);
+
 /**
  * Reads a serialized protobuf message from the given file descriptor
  * (e.g. a file or socket) and deserializes it into a new message struct
@@ -91,6 +127,64 @@ protobuf_send_message(int fd, const ProtobufCMessage *message);
 ProtobufCMessage *
 protobuf_recv_message(int fd, const ProtobufCMessageDescriptor *descriptor);
 
+/*
+ * Optional compression of framed messages, which is negotiated per connection
+ * by the protocol on top. A compressed frame has PROTOBUF_FRAME_COMPRESSED set
+ * in its length prefix. Its payload consists of a one byte dictionary slot,
+ * the length of the packed message and the message as raw deflate stream,
+ * which uses the message last transferred in the same slot as preset dictionary.
+ * Senders pick the slot by message type, so that the parts repeated by
+ * consecutive status or log messages are only encoded as references to the
+ * previous one. Peers which did not negotiate compression never receive
+ * compressed frames and stay compatible.
+ */
+#define PROTOBUF_FRAME_COMPRESSED 0x80000000u
+
+/**
+ * State of one direction of a compressed message stream, i.e. the dictionaries
+ * of all slots, which both peers keep in sync by processing the same frames.
+ */
+typedef struct protobuf_zstream protobuf_zstream_t;
+
+protobuf_zstream_t *
+protobuf_zstream_new(void);
+
+void
+protobuf_zstream_free(protobuf_zstream_t *zs);
+
+/**
+ * Compresses a packed message into the payload of a compressed frame. Small
+ * messages and messages which do not get smaller are not compressed, they
+ * have to be sent in an ordinary frame.
+ *
+ * @param slot      dictionary slot, e.g. the type of the message
+ * @param out       receives the payload of the compressed frame
+ * @param out_size  size of out, the payload is only produced if it is shorter
+ * @return          the length of the payload, 0 if the message should be sent
+ *                  uncompressed or -1 on error
+ */
+ssize_t
+protobuf_zstream_deflate(protobuf_zstream_t *zs, uint8_t slot, const uint8_t *buf,
+			 uint32_t buflen, uint8_t *out, uint32_t out_size);
+
+/**
+ * Decompresses the payload of a compressed frame into a new buffer.
+ *
+ * @param buflen    receives the length of the packed message
+ * @return          the packed message or NULL on error
+ */
+uint8_t *
+protobuf_zstream_inflate_new(protobuf_zstream_t *zs, const uint8_t *payload, uint32_t len,
+			     uint32_t *buflen);
+
+/**
+ * Same as protobuf_recv_message() but also accepts compressed frames,
+ * which are decompressed with zs.
+ */
+ProtobufCMessage *
+protobuf_recv_message_zstream(int fd, const ProtobufCMessageDescriptor *descriptor,
+			      protobuf_zstream_t *zs);
+
 /**
  * Reads a serialized protobuf message from the given file descriptor
  * and returns it's packed representation
@@ -174,4 +268,115 @@ protobuf_message_new_from_buf(const uint8_t *buf, size_t buflen,
 ssize_t
 protobuf_message_write_to_file(const char *filename, ProtobufCMessage *message);
 
+// suffix appended to the name of a text file to get the name of its binary cache file
+#define PROTOBUF_CACHEFILE_SUFFIX ".cache"
+
+// length of the macs of cache files, e.g. of an HMAC-SHA256
+#define PROTOBUF_CACHE_MAC_LEN 32
+
+/**
+ * Computes the PROTOBUF_CACHE_MAC_LEN bytes mac of a cache file with a key which
+ * is not accessible offline, so that the cache cannot be forged.
+ *
+ * @return  0 on success, -1 on error
+ */
+typedef int (*protobuf_cache_mac_t)(const void *buf, size_t len, uint8_t *mac);
+
+/**
+ * Loads a message stored by protobuf_message_write_to_cachefile() from the given
+ * binary cache file. The cache is bound to the digest of its source, e.g. the
+ * hash of the text file the message was parsed from, and is only used if the
+ * given digest is equal to the one stored along with the message.
+ *
+ * @param cache_file    name of the binary cache file
+ * @param descriptor    the protobuf message descriptor that defines the message structure
+ * @param digest        NUL terminated digest of the current source of the message
+ * @param mac           authenticates the cache, NULL for an unauthenticated cache
+ * @return  a pointer to the unpacked protobuf message struct or NULL if the cache
+ *          is missing, outdated, corrupt or not authentic; must be released with
+ *          protobuf_free_message()
+ */
+ProtobufCMessage *
+protobuf_message_new_from_cachefile(const char *cache_file,
+				    const ProtobufCMessageDescriptor *descriptor,
+				    const char *digest, protobuf_cache_mac_t mac);
+
+/**
+ * Stores the packed binary representation of the given message together with
+ * the digest of its source in the given cache file. The cache only saves the
+ * parsing of the source; it does not replace the verification of the source.
+ *
+ * @param mac           authenticates the cache, NULL for an unauthenticated cache
+ * @return  0 on success, -1 on error
+ */
+int
+protobuf_message_write_to_cachefile(const char *cache_file, const ProtobufCMessage *message,
+				    const char *digest, protobuf_cache_mac_t mac);
+
+typedef struct protobuf_conn protobuf_conn_t;
+
+/**
+ * Creates a buffered connection on the given (socket) file descriptor, which
+ * is served by the event loop and does not block it. Incoming data is read in
+ * large chunks and parsed incrementally; every complete message is unpacked
+ * as defined by descriptor and passed to recv_cb, which must not free it.
+ * Outgoing messages are queued in a reused buffer and written as the socket
+ * becomes writable.
+ *
+ * @param fd        the connected file descriptor, owned by the connection from now on
+ * @param descriptor    the protobuf message descriptor of incoming messages
+ * @param recv_cb   called for each received message
+ * @param close_cb  called once if the peer closed the connection or an error occurred;
+ *                  the connection is inactive afterwards and should be freed.
+ * @param data      payload passed to the callbacks
+ * @return          the new connection or NULL on error
+ */
+protobuf_conn_t *
+protobuf_conn_new(int fd, const ProtobufCMessageDescriptor *descriptor,
+		  void (*recv_cb)(protobuf_conn_t *conn, ProtobufCMessage *msg, void *data),
+		  void (*close_cb)(protobuf_conn_t *conn, void *data), void *data);
+
+/**
+ * Same as protobuf_conn_new() but passes every complete message still packed
+ * to recv_cb, e.g., to unpack and process large messages on a worker thread.
+ * The buffer is only valid during the callback.
+ */
+protobuf_conn_t *
+protobuf_conn_new_packed(int fd,
+			 void (*recv_cb)(protobuf_conn_t *conn, const uint8_t *buf, uint32_t len,
+					 void *data),
+			 void (*close_cb)(protobuf_conn_t *conn, void *data), void *data);
+
+/**
+ * Frees the connection and closes its file descriptor, after trying to write out
+ * still queued data without blocking. May also be called from the connection's callbacks.
+ */
+void
+protobuf_conn_free(protobuf_conn_t *conn);
+
+int
+protobuf_conn_get_fd(const protobuf_conn_t *conn);
+
+/**
+ * Returns the number of bytes queued for sending, which allows the caller to throttle.
+ */
+size_t
+protobuf_conn_get_queued(const protobuf_conn_t *conn);
+
+/**
+ * Queues the given protobuf message for sending on the connection. The message
+ * is packed directly into the send queue and sent without blocking as far as
+ * the socket allows.
+ *
+ * @return 0 on success, -1 if the connection is closed or its send queue is full
+ */
+int
+protobuf_conn_send_message(protobuf_conn_t *conn, const ProtobufCMessage *message);
+
+/**
+ * Same as protobuf_conn_send_message() but for an already packed message.
+ */
+int
+protobuf_conn_send_message_packed(protobuf_conn_t *conn, const uint8_t *buf, uint32_t buflen);
+
 #endif // PROTOBUF_H
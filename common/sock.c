@@ -279,3 +279,79 @@ sock_unix_get_peer_uid(int sock, uint32_t *peer_uid)
 	*peer_uid = ucred.uid;
 	return 0;
 }
+
+ssize_t
+sock_unix_send_fd(int sock, const void *buf, size_t len, int fd)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} cmsg_buf = { 0 };
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov,
+			      .msg_iovlen = 1,
+			      .msg_control = cmsg_buf.buf,
+			      .msg_controllen = sizeof(cmsg_buf.buf) };
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	ssize_t ret;
+	do {
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1)
+		ERROR_ERRNO("Failed to pass fd %d over socket %d", fd, sock);
+
+	return ret;
+}
+
+ssize_t
+sock_unix_recv_fd(int sock, void *buf, size_t len, int *fd)
+{
+	ASSERT(fd);
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} cmsg_buf;
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov,
+			      .msg_iovlen = 1,
+			      .msg_control = cmsg_buf.buf,
+			      .msg_controllen = sizeof(cmsg_buf.buf) };
+
+	*fd = -1;
+
+	ssize_t ret;
+	do {
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (ret == -1 && errno == EINTR);
+
+	IF_TRUE_RETVAL(ret == -1, -1);
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		if (cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+			// more descriptors than expected, close all of them
+			int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (int i = 0; i < n; i++) {
+				int extra;
+				memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				close(extra);
+			}
+			continue;
+		}
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if (msg.msg_flags & MSG_CTRUNC)
+		WARN("Truncated ancillary data on socket %d", sock);
+
+	return ret;
+}
@@ -223,4 +223,31 @@ sock_inet_create_and_connect(int type, const char *node, const char *service);
 int
 sock_unix_get_peer_uid(int sock, uint32_t *peer_uid);
 
+/**
+ * Sends the given data together with a file descriptor passed
+ * as SCM_RIGHTS ancillary data over a UNIX socket.
+ *
+ * @param sock		the connected UNIX socket file descriptor
+ * @param buf		the data to send along with the descriptor (at least one byte)
+ * @param len		the length of buf
+ * @param fd		the file descriptor to pass to the peer
+ * @return		the number of bytes sent, -1 on error
+ */
+ssize_t
+sock_unix_send_fd(int sock, const void *buf, size_t len, int fd);
+
+/**
+ * Receives data from a UNIX socket and a file descriptor possibly
+ * passed along with it as SCM_RIGHTS ancillary data. Received
+ * descriptors are close-on-exec.
+ *
+ * @param sock		the UNIX socket file descriptor
+ * @param buf		the buffer to receive the data into
+ * @param len		the size of buf
+ * @param fd		set to the received file descriptor or -1 if none was passed
+ * @return		the number of bytes received, -1 on error
+ */
+ssize_t
+sock_unix_recv_fd(int sock, void *buf, size_t len, int *fd);
+
 #endif // SOCK_H
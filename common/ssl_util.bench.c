@@ -0,0 +1,111 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include "munit.h"
+#include "bench.h"
+
+#include "ssl_util.h"
+#include "file.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <openssl/evp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_FILE_SIZE (32 * 1024 * 1024)
+
+static char *algo_values[] = { "SHA1", "SHA256", "SHA512", NULL };
+
+static MunitParameterEnum algo_params[] = {
+	{ "algo", algo_values },
+	{ NULL, NULL },
+};
+
+static char file[] = "/tmp/ssl_util.bench.XXXXXX";
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	ssl_init(false, NULL);
+
+	strcpy(file, "/tmp/ssl_util.bench.XXXXXX");
+	int fd = mkstemp(file);
+	munit_assert_int(fd, >=, 0);
+	close(fd);
+
+	uint8_t *buf = mem_alloc(BENCH_FILE_SIZE);
+	munit_rand_memory(BENCH_FILE_SIZE, buf);
+	munit_assert_int(file_write(file, (char *)buf, BENCH_FILE_SIZE), ==, BENCH_FILE_SIZE);
+	mem_free(buf);
+
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	unlink(file);
+	EVP_cleanup();
+	ssl_free();
+}
+
+static MunitResult
+bench_ssl_hash_file(const MunitParameter params[], UNUSED void *data)
+{
+	unsigned int hash_len;
+
+	uint64_t start = bench_now_ns();
+	unsigned char *hash = ssl_hash_file(file, &hash_len, munit_parameters_get(params, "algo"));
+	uint64_t elapsed = bench_now_ns() - start;
+
+	munit_assert_not_null(hash);
+	mem_free(hash);
+
+	// report per MiB hashed
+	return bench_report("/ssl_util/hash file", params, BENCH_FILE_SIZE >> 20, elapsed);
+}
+
+static MunitTest tests[] = {
+	{
+		"/hash file",		/* name */
+		bench_ssl_hash_file,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		algo_params		/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite ssl_util_bench_suite = {
+	"/ssl_util",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -38,9 +38,22 @@
 #include <openssl/engine.h>
 #include <openssl/bio.h>
 #include <openssl/x509_vfy.h>
+#include <openssl/ssl.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#define TLS_client_method SSLv23_client_method
+#endif
 
 /* Properties for device CSR */
 #define COUNTRY_C_CSR "DE"
@@ -67,7 +80,52 @@
 
 #define RSA_KEY_EXPONENT RSA_F4
 /* Chunk size for reading sig-/hashfiles */
-#define SIGN_HASH_BUFFER_SIZE 4096
+// large aligned reads for hashing files, see ssl_hash_fd_update()
+#define SSL_HASH_FILE_BUFFER_SIZE (1024 * 1024)
+#define SSL_HASH_FILE_BUFFER_ALIGN 4096
+
+/* number of trust stores of root certificate files kept loaded */
+#define SSL_STORE_CACHE_LEN 4
+/* number of certificate (chain) files whose public key and verification result are kept */
+#define SSL_CERT_CACHE_LEN 32
+/* certificate chains are small, anything larger is not cached */
+#define SSL_CERT_FILE_MAXLEN (64 * 1024)
+
+/*
+ * Trust store loaded from a root certificate file. It is reloaded once the
+ * file is replaced or modified, which also invalidates the verification
+ * results obtained with the old store (by its generation).
+ */
+typedef struct {
+	char *root_cert_file;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	X509_STORE *store;
+	unsigned int generation;
+	uint64_t last_used;
+} ssl_store_cache_entry_t;
+
+/*
+ * Public key of a certificate (chain) file, identified by the SHA256 fingerprint
+ * of its content, and the trust store generation it was last verified against.
+ */
+typedef struct {
+	unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+	EVP_PKEY *key;			  // NULL for unused entries
+	unsigned int verified_generation; // 0 if not verified
+	bool verified_ignore_time;
+	time_t not_after; // earliest expiry of the certificates in the verified chain
+	uint64_t last_used;
+} ssl_cert_cache_entry_t;
+
+static ssl_store_cache_entry_t ssl_store_cache[SSL_STORE_CACHE_LEN];
+static ssl_cert_cache_entry_t ssl_cert_cache[SSL_CERT_CACHE_LEN];
+static unsigned int ssl_store_generation = 0;
+static uint64_t ssl_cache_clock = 0;
+// certificates may also be verified on worker threads
+static pthread_mutex_t ssl_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*** self provisioning flags and functions */
 #define TEST_C "DE"
@@ -156,9 +214,29 @@ error:
 	return -1;
 }
 
+static void
+ssl_cache_clear(void)
+{
+	pthread_mutex_lock(&ssl_cache_lock);
+	for (int i = 0; i < SSL_STORE_CACHE_LEN; i++) {
+		if (ssl_store_cache[i].store)
+			X509_STORE_free(ssl_store_cache[i].store);
+		mem_free(ssl_store_cache[i].root_cert_file);
+		memset(&ssl_store_cache[i], 0, sizeof(ssl_store_cache_entry_t));
+	}
+	for (int i = 0; i < SSL_CERT_CACHE_LEN; i++) {
+		if (ssl_cert_cache[i].key)
+			EVP_PKEY_free(ssl_cert_cache[i].key);
+		memset(&ssl_cert_cache[i], 0, sizeof(ssl_cert_cache_entry_t));
+	}
+	pthread_mutex_unlock(&ssl_cache_lock);
+}
+
 void
 ssl_free(void)
 {
+	ssl_cache_clear();
+
 	// free OpenSSL stuff
 	ERR_free_strings();	      // free error strings
 	EVP_cleanup();		      // cleans loaded alogrithms, ciphers and digests
@@ -835,6 +913,204 @@ cb_verify_ignore_time(int ok, X509_STORE_CTX *ctx)
 	return ok;
 }
 
+/*
+ * Returns a reference to the trust store of root_cert_file, which is loaded
+ * only if it is not cached yet or the file changed, and its generation.
+ */
+static X509_STORE *
+ssl_store_get(const char *root_cert_file, unsigned int *generation)
+{
+	struct stat st;
+	if (stat(root_cert_file, &st) < 0) {
+		ERROR_ERRNO("Could not stat root CA %s", root_cert_file);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ssl_cache_lock);
+
+	ssl_store_cache_entry_t *entry = NULL;
+	for (int i = 0; i < SSL_STORE_CACHE_LEN && !entry; i++) {
+		if (ssl_store_cache[i].root_cert_file &&
+		    !strcmp(ssl_store_cache[i].root_cert_file, root_cert_file))
+			entry = &ssl_store_cache[i];
+	}
+	if (entry && (entry->dev != st.st_dev || entry->ino != st.st_ino ||
+		      entry->size != st.st_size || entry->mtime.tv_sec != st.st_mtim.tv_sec ||
+		      entry->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+		DEBUG("Root CA %s changed, reloading", root_cert_file);
+		X509_STORE_free(entry->store);
+		entry->store = NULL;
+	}
+	if (!entry) {
+		// replace the least recently used entry
+		entry = &ssl_store_cache[0];
+		for (int i = 1; i < SSL_STORE_CACHE_LEN; i++)
+			if (ssl_store_cache[i].last_used < entry->last_used)
+				entry = &ssl_store_cache[i];
+		if (entry->store)
+			X509_STORE_free(entry->store);
+		mem_free(entry->root_cert_file);
+		memset(entry, 0, sizeof(ssl_store_cache_entry_t));
+	}
+
+	if (!entry->store) {
+		X509_STORE *store = X509_STORE_new();
+		if (!store || !X509_STORE_load_locations(store, root_cert_file, NULL)) {
+			ERROR("Failed to load root CA");
+			if (store)
+				X509_STORE_free(store);
+			mem_free(entry->root_cert_file);
+			memset(entry, 0, sizeof(ssl_store_cache_entry_t));
+			pthread_mutex_unlock(&ssl_cache_lock);
+			return NULL;
+		}
+		if (!entry->root_cert_file)
+			entry->root_cert_file = mem_strdup(root_cert_file);
+		entry->dev = st.st_dev;
+		entry->ino = st.st_ino;
+		entry->size = st.st_size;
+		entry->mtime = st.st_mtim;
+		entry->store = store;
+		entry->generation = ++ssl_store_generation;
+	}
+
+	entry->last_used = ++ssl_cache_clock;
+	X509_STORE_up_ref(entry->store);
+	X509_STORE *store = entry->store;
+	*generation = entry->generation;
+
+	pthread_mutex_unlock(&ssl_cache_lock);
+	return store;
+}
+
+/*
+ * Looks up the certificate file with the given fingerprint, must be called
+ * with ssl_cache_lock held.
+ */
+static ssl_cert_cache_entry_t *
+ssl_cert_cache_lookup(const unsigned char *fingerprint)
+{
+	for (int i = 0; i < SSL_CERT_CACHE_LEN; i++) {
+		ssl_cert_cache_entry_t *entry = &ssl_cert_cache[i];
+		if (entry->key && !memcmp(entry->fingerprint, fingerprint, SHA256_DIGEST_LENGTH)) {
+			entry->last_used = ++ssl_cache_clock;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Adds the public key of the certificate file with the given fingerprint, must be
+ * called with ssl_cache_lock held.
+ */
+static ssl_cert_cache_entry_t *
+ssl_cert_cache_add(const unsigned char *fingerprint, EVP_PKEY *key)
+{
+	ssl_cert_cache_entry_t *entry = ssl_cert_cache_lookup(fingerprint);
+	IF_TRUE_RETVAL(entry, entry);
+
+	// replace an unused or the least recently used entry
+	entry = &ssl_cert_cache[0];
+	for (int i = 1; i < SSL_CERT_CACHE_LEN && entry->key; i++)
+		if (!ssl_cert_cache[i].key || ssl_cert_cache[i].last_used < entry->last_used)
+			entry = &ssl_cert_cache[i];
+	if (entry->key)
+		EVP_PKEY_free(entry->key);
+	memset(entry, 0, sizeof(ssl_cert_cache_entry_t));
+
+	memcpy(entry->fingerprint, fingerprint, SHA256_DIGEST_LENGTH);
+	EVP_PKEY_up_ref(key);
+	entry->key = key;
+	entry->last_used = ++ssl_cache_clock;
+	return entry;
+}
+
+/*
+ * Reads a certificate (chain) file and computes the fingerprint of its content.
+ * @return the newly allocated content or NULL on error
+ */
+static char *
+ssl_cert_file_read_new(const char *cert_file, size_t *len, unsigned char *fingerprint)
+{
+	off_t size = file_size(cert_file);
+	if (size < 0 || size > SSL_CERT_FILE_MAXLEN) {
+		ERROR("Could not read certificate file %s", cert_file);
+		return NULL;
+	}
+
+	char *buf = mem_alloc(size + 1);
+	int read = file_read(cert_file, buf, size);
+	if (read < 0) {
+		ERROR("Could not read certificate file %s", cert_file);
+		mem_free(buf);
+		return NULL;
+	}
+	buf[read] = '\0';
+	*len = read;
+
+	SHA256((unsigned char *)buf, read, fingerprint);
+	return buf;
+}
+
+/* returns the earliest notAfter of the certificates in the verified chain */
+static time_t
+ssl_chain_not_after(X509_STORE_CTX *context)
+{
+	time_t not_after = 0;
+	STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(context);
+
+	for (int i = 0; chain && i < sk_X509_num(chain); i++) {
+		struct tm tm;
+		if (!ASN1_TIME_to_tm(X509_get0_notAfter(sk_X509_value(chain, i)), &tm))
+			return 0;
+		time_t t = timegm(&tm);
+		if (not_after == 0 || t < not_after)
+			not_after = t;
+	}
+	return not_after;
+}
+
+/*
+ * Returns the public key of the certificate file, which is taken from the
+ * cache if a file with the same content has been loaded before.
+ */
+static EVP_PKEY *
+ssl_cert_file_get_pubkey(const char *cert_file)
+{
+	EVP_PKEY *key = NULL;
+	X509 *cert = NULL;
+	size_t len;
+	unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+
+	char *buf = ssl_cert_file_read_new(cert_file, &len, fingerprint);
+	IF_NULL_RETVAL(buf, NULL);
+
+	pthread_mutex_lock(&ssl_cache_lock);
+	ssl_cert_cache_entry_t *entry = ssl_cert_cache_lookup(fingerprint);
+	if (entry) {
+		key = entry->key;
+		EVP_PKEY_up_ref(key);
+	}
+	pthread_mutex_unlock(&ssl_cache_lock);
+	if (key)
+		goto out;
+
+	BIO *bio = BIO_new_mem_buf(buf, len);
+	if (bio && PEM_read_bio_X509(bio, &cert, NULL, NULL) && (key = X509_get_pubkey(cert))) {
+		pthread_mutex_lock(&ssl_cache_lock);
+		ssl_cert_cache_add(fingerprint, key);
+		pthread_mutex_unlock(&ssl_cache_lock);
+	}
+	if (bio)
+		BIO_free(bio);
+	if (cert)
+		X509_free(cert);
+out:
+	mem_free(buf);
+	return key;
+}
+
 int
 ssl_verify_certificate(const char *test_cert_file, const char *root_cert_file, bool ignore_time)
 {
@@ -843,33 +1119,44 @@ ssl_verify_certificate(const char *test_cert_file, const char *root_cert_file, b
 	X509_STORE_CTX *context = NULL;
 	STACK_OF(X509) *chainstack = NULL;
 	BIO *stackbio = NULL;
+	EVP_PKEY *key = NULL;
+	char *cert_buf = NULL;
+	size_t cert_len;
+	unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+	unsigned int generation;
 	int ret = 0;
 
-	if ((store = X509_STORE_new()) == NULL) {
-		ERROR("Error in certificate verification (setup store)");
+	if (!(store = ssl_store_get(root_cert_file, &generation))) {
 		ret = -2;
 		goto end;
 	}
 
-	if ((context = X509_STORE_CTX_new()) == NULL) {
-		ERROR("Error in certificate verification (setup store_ctx)");
+	if (!(cert_buf = ssl_cert_file_read_new(test_cert_file, &cert_len, fingerprint))) {
+		ERROR("Error loading certificate chain");
 		ret = -2;
 		goto end;
 	}
 
-	if (ignore_time) {
-		DEBUG("Certificate expiration and not yet valid case will be ignored");
-		X509_STORE_set_verify_cb(store, cb_verify_ignore_time);
+	// the same chain has already been verified against the current trust store
+	pthread_mutex_lock(&ssl_cache_lock);
+	ssl_cert_cache_entry_t *entry = ssl_cert_cache_lookup(fingerprint);
+	bool verified = entry && entry->verified_generation == generation;
+	// a chain verified with ignored times must not satisfy a strict verification
+	if (verified && !ignore_time)
+		verified = !entry->verified_ignore_time && time(NULL) <= entry->not_after;
+	pthread_mutex_unlock(&ssl_cache_lock);
+	if (verified) {
+		DEBUG("Certificate %s has already been verified", test_cert_file);
+		goto end;
 	}
 
-	if (!X509_STORE_load_locations(store, root_cert_file, NULL)) {
-		ERROR("Failed to load root CA");
+	if ((context = X509_STORE_CTX_new()) == NULL) {
+		ERROR("Error in certificate verification (setup store_ctx)");
 		ret = -2;
 		goto end;
 	}
 
-	stackbio = BIO_new(BIO_s_file());
-	if (BIO_read_filename(stackbio, test_cert_file) <= 0) {
+	if (!(stackbio = BIO_new_mem_buf(cert_buf, cert_len))) {
 		ERROR("Error loading certificate chain");
 		ret = -2;
 		goto end;
@@ -906,6 +1193,12 @@ ssl_verify_certificate(const char *test_cert_file, const char *root_cert_file, b
 		goto end;
 	}
 
+	// the store is shared, thus the callback is only set for this verification
+	if (ignore_time) {
+		DEBUG("Certificate expiration and not yet valid case will be ignored");
+		X509_STORE_CTX_set_verify_cb(context, cb_verify_ignore_time);
+	}
+
 	int verify_ret = X509_verify_cert(context);
 	const char *verify_string =
 		X509_verify_cert_error_string(X509_STORE_CTX_get_error(context));
@@ -915,6 +1208,15 @@ ssl_verify_certificate(const char *test_cert_file, const char *root_cert_file, b
 	if (verify_ret == 1) {
 		DEBUG("Certificate verification successful");
 		ret = 0;
+
+		if ((key = X509_get_pubkey(test_cert))) {
+			pthread_mutex_lock(&ssl_cache_lock);
+			entry = ssl_cert_cache_add(fingerprint, key);
+			entry->verified_generation = generation;
+			entry->verified_ignore_time = ignore_time;
+			entry->not_after = ssl_chain_not_after(context);
+			pthread_mutex_unlock(&ssl_cache_lock);
+		}
 	} else {
 		if (verify_ret == 0) {
 			ret = -1;
@@ -943,6 +1245,52 @@ end:
 		sk_X509_pop_free(chainstack, X509_free);
 	if (test_cert != NULL)
 		X509_free(test_cert);
+	if (key != NULL)
+		EVP_PKEY_free(key);
+	mem_free(cert_buf);
+	return ret;
+}
+
+/*
+ * Reads fd in large aligned chunks and updates all n digests with each chunk,
+ * so that several digests of a file only need one pass over it. The file is
+ * not mmap'ed on purpose: a file which is truncated while being hashed would
+ * raise SIGBUS in the caller.
+ * @return 0 on success, -1 on error
+ */
+static int
+ssl_hash_fd_update(int fd, EVP_MD_CTX *md_ctx[], size_t n)
+{
+	int ret = -1;
+	void *buffer = NULL;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (posix_memalign(&buffer, SSL_HASH_FILE_BUFFER_ALIGN, SSL_HASH_FILE_BUFFER_SIZE)) {
+		ERROR("Error in file hashing (allocating read buffer)");
+		return -1;
+	}
+
+	for (;;) {
+		ssize_t len = read(fd, buffer, SSL_HASH_FILE_BUFFER_SIZE);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			ERROR_ERRNO("Error in file hashing (reading file failed)");
+			goto out;
+		}
+		if (len == 0)
+			break;
+		for (size_t i = 0; i < n; i++) {
+			if (!EVP_DigestUpdate(md_ctx[i], buffer, len)) {
+				ERROR("Error in file hashing (hashing file failed)");
+				goto out;
+			}
+		}
+	}
+	ret = 0;
+out:
+	free(buffer);
 	return ret;
 }
 
@@ -954,68 +1302,33 @@ ssl_verify_signature(const char *cert_file, const char *signature_file, const ch
 	ASSERT(signature_file);
 	ASSERT(signed_file);
 
-	FILE *fp = NULL;
+	file_map_t *sig_map = NULL;
+	file_map_t *signed_map = NULL;
 	int ret = 0;
 
 	// certificate variables
-	X509 *test_cert = NULL;
 	EVP_PKEY *key = NULL;
 
 	// signature variables
-	struct stat stat_buf;
-	unsigned char *signature = NULL;
-	unsigned int siglen;
 	const EVP_MD *hash_fct;
 	EVP_MD_CTX *md_ctx = NULL;
 
-	//load certificate, verify and get public key
-	if (!(fp = fopen(cert_file, "rb"))) {
-		ERROR("Error in signature verification (opening certificate file)");
-		ret = -2;
-		goto error;
-	}
-	if (PEM_read_X509(fp, &test_cert, NULL, NULL) == NULL) {
-		ERROR("Error in signature verification (loading certificate file)");
-		ret = -2;
-		goto error;
-	}
-
-	if ((key = X509_get_pubkey(test_cert)) == NULL) {
+	// get public key of certificate, cached if the certificate was loaded before
+	if ((key = ssl_cert_file_get_pubkey(cert_file)) == NULL) {
 		ERROR("Error in signature verification (loading pubkey failed)");
 		ret = -2;
 		goto error;
 	}
-	fclose(fp);
-	fp = NULL;
 
 	TRACE("Certificate loaded to verify signature");
 
 	// load signature
-	if (!(fp = fopen(signature_file, "rb"))) {
-		ERROR("Error in signature verification (opening signature file)");
-		ret = -2;
-		goto error;
-	}
-
-	// read signature file
-	if (fstat(fileno(fp), &stat_buf) == -1) {
+	if (!(sig_map = file_map_ro(signature_file))) {
 		ERROR("Error in signature verification (unable to read signature file)");
 		ret = -2;
 		goto error;
 	}
 
-	siglen = stat_buf.st_size;
-	signature = mem_new(unsigned char, siglen);
-
-	// read signature
-	if ((fread(signature, 1, siglen, fp)) != siglen) {
-		ERROR("Error in signature verification (unable to read out signature)");
-		ret = -2;
-		goto error;
-	}
-	fclose(fp);
-	fp = NULL;
-
 	TRACE("Signature loaded");
 
 	if ((hash_fct = EVP_get_digestbyname(hash_algo)) == NULL) {
@@ -1036,28 +1349,32 @@ ssl_verify_signature(const char *cert_file, const char *signature_file, const ch
 #endif
 	EVP_VerifyInit(md_ctx, hash_fct);
 
-	int len = 0;
-	unsigned char buffer[SIGN_HASH_BUFFER_SIZE];
-
-	if (!(fp = fopen(signed_file, "rb"))) {
-		ERROR("Error in signature verification (opening signed file failed)");
-		ret = -2;
-		goto error;
-	}
-
-	while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-		if (!EVP_VerifyUpdate(md_ctx, buffer, len)) {
-			ERROR("Error in signature verification (reading/hashing signed file failed");
+	// hash the signed file straight from the page cache if it can be mapped
+	int updated;
+	if ((signed_map = file_map_ro(signed_file))) {
+		if (EVP_VerifyUpdate(md_ctx, file_map_data(signed_map), file_map_size(signed_map)))
+			updated = 0;
+		else
+			updated = -1;
+	} else {
+		int fd = open(signed_file, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			ERROR("Error in signature verification (opening signed file failed)");
 			ret = -2;
 			goto error;
 		}
+		updated = ssl_hash_fd_update(fd, &md_ctx, 1);
+		close(fd);
+	}
+	if (updated < 0) {
+		ERROR("Error in signature verification (reading/hashing signed file failed");
+		ret = -2;
+		goto error;
 	}
-	fclose(fp);
-	fp = NULL;
 
 	TRACE("File hash computed to verify signature");
 
-	ret = EVP_VerifyFinal(md_ctx, signature, siglen, key);
+	ret = EVP_VerifyFinal(md_ctx, file_map_data(sig_map), file_map_size(sig_map), key);
 	if (ret != 1) {
 		ERROR("Signature verification error");
 		// any error
@@ -1072,14 +1389,12 @@ ssl_verify_signature(const char *cert_file, const char *signature_file, const ch
 	}
 
 error:
-	if (fp)
-		fclose(fp);
-	if (test_cert)
-		X509_free(test_cert);
+	if (sig_map)
+		file_map_unref(sig_map);
+	if (signed_map)
+		file_map_unref(signed_map);
 	if (key)
 		EVP_PKEY_free(key);
-	if (signature)
-		mem_free(signature);
 #if OPENSSL_VERSION_NUMBER < 0x10100000
 	EVP_MD_CTX_cleanup(md_ctx);
 #else
@@ -1090,55 +1405,23 @@ error:
 }
 
 int
-ssl_verify_signature_from_buf(uint8_t *cert_buf, size_t cert_len, const uint8_t *sig_buf,
-			      size_t sig_len, const uint8_t *buf, size_t buf_len)
+ssl_verify_signature_from_buf_pkey(EVP_PKEY *key, const char *hash_algo, const uint8_t *sig_buf,
+				   size_t sig_len, const uint8_t *buf, size_t buf_len)
 {
-	ASSERT(cert_buf);
+	ASSERT(key);
+	ASSERT(hash_algo);
 	ASSERT(sig_buf);
 	ASSERT(buf);
 
 	int ret = 0;
 
-	// certificate variables
-	X509 *cert;
-	EVP_PKEY *key = NULL;
-	BIO *mem;
-
 	// signature variables
 	const EVP_MD *hash_fct;
 	EVP_MD_CTX *md_ctx = NULL;
 
-	// load certificate
-	mem = BIO_new(BIO_s_mem());
-	BIO_write(mem, cert_buf, cert_len);
-	cert = PEM_read_bio_X509(mem, NULL, 0, NULL);
-	BIO_free(mem);
-
-	const X509_ALGOR *sig_alg = X509_get0_tbs_sigalg(cert);
-	if (!sig_alg) {
-		ERROR("Error in signature verification (Failed to parse hash-algorithm)");
-		ret = -2;
-		goto error;
-	}
-
-	const char *hash_algo = asn1_object_to_hash_algo(sig_alg->algorithm);
-	if (!hash_algo) {
-		ERROR("Error in signature verification (Unsupported hash function)");
-		ret = -2;
-		goto error;
-	}
-
-	// load public key, digest, and verify signature
-	if ((key = X509_get_pubkey(cert)) == NULL) {
-		ERROR("Error in signature verification (loading pubkey failed)");
-		ret = -2;
-		goto error;
-	}
-
 	if ((hash_fct = EVP_get_digestbyname(hash_algo)) == NULL) {
 		ERROR("Error in signature verification (unable to initialize hash function)");
-		ret = -2;
-		goto error;
+		return -2;
 	}
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000
@@ -1148,7 +1431,7 @@ ssl_verify_signature_from_buf(uint8_t *cert_buf, size_t cert_len, const uint8_t
 #else
 	if ((md_ctx = EVP_MD_CTX_new()) == NULL) {
 		ERROR("Allocating EVP_MD failed!");
-		goto error;
+		return -2;
 	}
 #endif
 	EVP_VerifyInit(md_ctx, hash_fct);
@@ -1176,79 +1459,106 @@ ssl_verify_signature_from_buf(uint8_t *cert_buf, size_t cert_len, const uint8_t
 	}
 
 error:
-	if (cert)
-		X509_free(cert);
-	if (key)
-		EVP_PKEY_free(key);
 #if OPENSSL_VERSION_NUMBER < 0x10100000
 	EVP_MD_CTX_cleanup(md_ctx);
 #else
-	if (md_ctx)
-		EVP_MD_CTX_free(md_ctx);
+	EVP_MD_CTX_free(md_ctx);
 #endif
 	return ret;
 }
 
 int
-ssl_verify_signature_from_digest(const char *cert_buf, const uint8_t *sig_buf, size_t sig_len,
-				 const uint8_t *hash, size_t hash_len)
+ssl_verify_signature_from_buf(uint8_t *cert_buf, size_t cert_len, const uint8_t *sig_buf,
+			      size_t sig_len, const uint8_t *buf, size_t buf_len)
 {
 	ASSERT(cert_buf);
 	ASSERT(sig_buf);
-	ASSERT(hash);
+	ASSERT(buf);
+
+	const char *hash_algo = NULL;
+	EVP_PKEY *key = ssl_get_pubkey_from_cert_pem_new(cert_buf, cert_len, &hash_algo);
+	IF_NULL_RETVAL(key, -2);
+
+	int ret = ssl_verify_signature_from_buf_pkey(key, hash_algo, sig_buf, sig_len, buf,
+						     buf_len);
+	EVP_PKEY_free(key);
+	return ret;
+}
+
+EVP_PKEY *
+ssl_get_pubkey_from_cert_pem_new(const uint8_t *cert_buf, size_t cert_len, const char **hash_algo)
+{
+	ASSERT(cert_buf);
 
-	int ret = 0;
 	X509 *cert;
 	EVP_PKEY *key = NULL;
 	BIO *mem;
-	EVP_PKEY_CTX *pkey_ctx = NULL;
-	const EVP_MD *hash_fct;
 
-	// load certificate, verify and get public key
-	mem = BIO_new(BIO_s_mem());
-	BIO_puts(mem, cert_buf);
+	mem = BIO_new_mem_buf(cert_buf, cert_len);
+	IF_NULL_RETVAL(mem, NULL);
 	cert = PEM_read_bio_X509(mem, NULL, 0, NULL);
 	BIO_free(mem);
 
-	if ((key = X509_get_pubkey(cert)) == NULL) {
+	if (cert == NULL || (key = X509_get_pubkey(cert)) == NULL) {
 		ERROR("Error in signature verification (loading pubkey failed)");
-		ret = -2;
 		goto error;
 	}
 
 	const X509_ALGOR *sig_alg = X509_get0_tbs_sigalg((const X509 *)cert);
 	if (!sig_alg) {
 		ERROR("Error in signature verification (Failed to parse hash-algorithm)");
-		ret = -2;
 		goto error;
 	}
 
-	const char *hash_algo = asn1_object_to_hash_algo(sig_alg->algorithm);
-	if (!hash_algo) {
+	const char *algo = asn1_object_to_hash_algo(sig_alg->algorithm);
+	if (!algo) {
 		ERROR("Error in signature verification (Unsupported hash function)");
-		ret = -2;
 		goto error;
 	}
 
-	if ((hash_fct = EVP_get_digestbyname(hash_algo)) == NULL) {
+	if (EVP_get_digestbyname(algo) == NULL) {
 		ERROR("Error in signature verification (unable to initialize hash function)");
-		ret = -2;
 		goto error;
 	}
 
+	X509_free(cert);
+	if (hash_algo)
+		*hash_algo = algo;
+	return key;
+
+error:
+	if (cert)
+		X509_free(cert);
+	if (key)
+		EVP_PKEY_free(key);
+	return NULL;
+}
+
+EVP_PKEY *
+ssl_get_pubkey_from_cert_buf_new(const char *cert_buf)
+{
+	ASSERT(cert_buf);
+
+	return ssl_get_pubkey_from_cert_pem_new((const uint8_t *)cert_buf, strlen(cert_buf), NULL);
+}
+
+int
+ssl_verify_signature_from_digest_pkey(EVP_PKEY *key, const uint8_t *sig_buf, size_t sig_len,
+				      const uint8_t *hash, size_t hash_len)
+{
+	ASSERT(key);
+	ASSERT(sig_buf);
+	ASSERT(hash);
+
+	int ret = 0;
+	EVP_PKEY_CTX *pkey_ctx = NULL;
+
 	TRACE("Verifying signature...");
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000
-	EVP_PKEY_CTX _pkey_ctx;
-	pkey_ctx = &_pkey_ctx;
-	EVP_PKEY_CTX_init(md_ctx);
-#else
 	if ((pkey_ctx = EVP_PKEY_CTX_new(key, NULL)) == NULL) {
 		ERROR("Allocating EVP_PKEY_CTX failed!");
-		ret = -2;
-		goto error;
+		return -2;
 	}
-#endif
 
 	ret = EVP_PKEY_verify_init(pkey_ctx);
 	if (ret != 1) {
@@ -1280,85 +1590,106 @@ ssl_verify_signature_from_digest(const char *cert_buf, const uint8_t *sig_buf, s
 	}
 
 error:
-	if (cert)
-		X509_free(cert);
-	if (key)
-		EVP_PKEY_free(key);
-#if OPENSSL_VERSION_NUMBER < 0x10100000
-	EVP_MD_CTX_cleanup(md_ctx);
-#else
-	if (pkey_ctx)
-		EVP_PKEY_CTX_free(pkey_ctx);
-#endif
+	EVP_PKEY_CTX_free(pkey_ctx);
 	return ret;
 }
 
-unsigned char *
-ssl_hash_file(const char *file_to_hash, unsigned int *calc_len, const char *hash_algo)
+int
+ssl_verify_signature_from_digest(const char *cert_buf, const uint8_t *sig_buf, size_t sig_len,
+				 const uint8_t *hash, size_t hash_len)
+{
+	ASSERT(cert_buf);
+	ASSERT(sig_buf);
+	ASSERT(hash);
+
+	int ret;
+	EVP_PKEY *key = ssl_get_pubkey_from_cert_buf_new(cert_buf);
+	IF_NULL_RETVAL(key, -2);
+
+	ret = ssl_verify_signature_from_digest_pkey(key, sig_buf, sig_len, hash, hash_len);
+
+	EVP_PKEY_free(key);
+	return ret;
+}
+
+int
+ssl_hash_file_multi(const char *file_to_hash, const char *hash_algos[], size_t n,
+		    unsigned char *hashes[], unsigned int hash_lens[])
 {
 	ASSERT(file_to_hash);
-	ASSERT(hash_algo);
+	ASSERT(hash_algos);
+	ASSERT(hashes);
+	ASSERT(hash_lens);
+	IF_TRUE_RETVAL(n == 0 || n > SSL_HASH_FILE_MULTI_MAX, -1);
 
-	unsigned char *ret = NULL;
-	FILE *fp = NULL;
-	const EVP_MD *hash_fct;
-	EVP_MD_CTX *md_ctx = NULL;
+	int ret = -1;
+	EVP_MD_CTX *md_ctx[SSL_HASH_FILE_MULTI_MAX] = { NULL };
 
-	if (!(fp = fopen(file_to_hash, "rb"))) {
-		ERROR("Error in file hasing (opening hash file)");
-		return NULL;
-	}
+	for (size_t i = 0; i < n; i++)
+		hashes[i] = NULL;
 
-	if ((hash_fct = EVP_get_digestbyname(hash_algo)) == NULL) {
-		ERROR("Error in file hasing (unable to initialize hash function");
-		fclose(fp);
-		return NULL;
+	int fd = open(file_to_hash, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR("Error in file hasing (opening hash file)");
+		return -1;
 	}
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000
-	EVP_MD_CTX _md_ctx;
-	md_ctx = &_md_ctx;
-	EVP_MD_CTX_init(md_ctx);
-#else
-	if ((md_ctx = EVP_MD_CTX_new()) == NULL) {
-		ERROR("Allocating EVP_MD failed!");
-		fclose(fp);
-		return NULL;
+	for (size_t i = 0; i < n; i++) {
+		/*
+		 * the EVP implementations make use of the available hardware acceleration,
+		 * e.g., the SHA extensions of x86 or the ARMv8 crypto extensions
+		 */
+		const EVP_MD *hash_fct = EVP_get_digestbyname(hash_algos[i]);
+		if (hash_fct == NULL) {
+			ERROR("Error in file hasing (unable to initialize hash function %s)",
+			      hash_algos[i]);
+			goto out;
+		}
+		if ((md_ctx[i] = EVP_MD_CTX_new()) == NULL) {
+			ERROR("Allocating EVP_MD failed!");
+			goto out;
+		}
+		if (EVP_DigestInit_ex(md_ctx[i], hash_fct, NULL) != 1) {
+			ERROR("Error in file hasing (unable to initialize hash function %s)",
+			      hash_algos[i]);
+			goto out;
+		}
 	}
-#endif
-	EVP_DigestInit(md_ctx, hash_fct);
 
-	int len = 0;
-	unsigned char buffer[SIGN_HASH_BUFFER_SIZE];
+	if (ssl_hash_fd_update(fd, md_ctx, n) < 0)
+		goto out;
 
-	while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-		if (!EVP_DigestUpdate(md_ctx, buffer, len)) {
-			ERROR("Error in file hashing (reading/hashing file failed");
-			fclose(fp);
-			goto error;
+	for (size_t i = 0; i < n; i++) {
+		hashes[i] = mem_alloc0(EVP_MAX_MD_SIZE);
+		if (EVP_DigestFinal_ex(md_ctx[i], hashes[i], &hash_lens[i]) != 1) {
+			ERROR("Error in file hashing (computing hash)");
+			goto out;
 		}
 	}
-	fclose(fp);
+	ret = 0;
 
-	ret = (unsigned char *)mem_alloc0(EVP_MAX_MD_SIZE);
-	if (EVP_DigestFinal(md_ctx, ret, calc_len) != 1) {
-		ERROR("Error in file hashing (computing hash)");
-		mem_free(ret);
-		ret = NULL;
-		goto error;
+out:
+	for (size_t i = 0; i < n; i++) {
+		if (md_ctx[i])
+			EVP_MD_CTX_free(md_ctx[i]);
+		if (ret && hashes[i]) {
+			mem_free(hashes[i]);
+			hashes[i] = NULL;
+		}
 	}
-	/* DEBUG OUTPUT
-	char *string = mem_alloc0(*calc_len*2+1);
-	for (unsigned int i = 0;  i < *calc_len;  i++) snprintf(string+2*i, 3, "%02x", ret[i]);
-	DEBUG("Calc hash: %s", string);
-	*/
+	close(fd);
+	return ret;
+}
 
-error:
-#if OPENSSL_VERSION_NUMBER < 0x10100000
-	EVP_MD_CTX_cleanup(md_ctx);
-#else
-	EVP_MD_CTX_free(md_ctx);
-#endif
+unsigned char *
+ssl_hash_file(const char *file_to_hash, unsigned int *calc_len, const char *hash_algo)
+{
+	ASSERT(file_to_hash);
+	ASSERT(hash_algo);
+
+	unsigned char *ret = NULL;
+
+	IF_TRUE_RETVAL(ssl_hash_file_multi(file_to_hash, &hash_algo, 1, &ret, calc_len), NULL);
 	return ret;
 }
 
@@ -1498,6 +1829,75 @@ error:
 	return -1;
 }
 
+int
+ssl_reencrypt_pkcs12_token(const char *token_file, const char *passphrase, EVP_PKEY *pkey,
+			   X509 *cert, STACK_OF(X509) * ca, int iter)
+{
+	ASSERT(token_file);
+	ASSERT(passphrase);
+	ASSERT(pkey);
+	ASSERT(iter > 0);
+
+	FILE *fp = NULL;
+	PKCS12 *p12 = NULL;
+	const ASN1_INTEGER *mac_iter = NULL;
+	char *passphr = mem_strdup(passphrase);
+	char *tmp_file = mem_printf("%s.tmp", token_file);
+	int ret = -1;
+
+	if (!(fp = fopen(token_file, "rb"))) {
+		ERROR("Error opening PKCS#12 file");
+		goto out;
+	}
+	p12 = d2i_PKCS12_fp(fp, NULL);
+	fclose(fp);
+	if (!p12) {
+		ERROR("Error loading PKCS#12 structure");
+		goto out;
+	}
+
+	// the MAC and the PBEs of the token have been created with the same count
+	PKCS12_get0_mac(NULL, NULL, NULL, &mac_iter, p12);
+	if ((mac_iter ? ASN1_INTEGER_get(mac_iter) : 1) == iter) {
+		ret = 0;
+		goto out;
+	}
+	PKCS12_free(p12);
+
+	if (!(p12 = PKCS12_create(passphr, TEST_FRIENDLY_NAME, pkey, cert, ca, 0, 0, iter, iter,
+				  0))) {
+		ERROR("Error creating PKCS#12 softtoken structure");
+		goto out;
+	}
+
+	// write a new file and replace the old one, so that the token is never lost
+	if (!(fp = fopen(tmp_file, "wb"))) {
+		ERROR("Error saving PKCS#12 softtoken");
+		goto out;
+	}
+	if (i2d_PKCS12_fp(fp, p12) != 1 || fflush(fp) || fsync(fileno(fp))) {
+		ERROR("Error writing PKCS#12 softtoken");
+		fclose(fp);
+		unlink(tmp_file);
+		goto out;
+	}
+	fclose(fp);
+	if (rename(tmp_file, token_file) < 0) {
+		ERROR_ERRNO("Error replacing PKCS#12 softtoken");
+		unlink(tmp_file);
+		goto out;
+	}
+
+	DEBUG("Re-encrypted PKCS#12 softtoken with %d iterations", iter);
+	ret = 1;
+out:
+	if (p12)
+		PKCS12_free(p12);
+	mem_free(tmp_file);
+	mem_free(passphr);
+	return ret;
+}
+
 static X509 *
 ssl_mkcert(EVP_PKEY *pkeyp, const char *common_name)
 {
@@ -1837,6 +2237,74 @@ error:
 	return ret;
 }
 
+SSL_CTX *
+ssl_tls_client_ctx_new(const char *ca_file, const char *cert_file, const char *key_file,
+		       bool tpmkey)
+{
+	ASSERT(ca_file);
+	ASSERT(cert_file);
+	ASSERT(key_file);
+
+	EVP_PKEY *pkey = NULL;
+	BIO *key = NULL;
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx) {
+		ERROR("Error creating TLS context");
+		return NULL;
+	}
+
+	if (!SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION)) {
+		ERROR("Error restricting TLS context to TLS 1.2 and above");
+		goto error;
+	}
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if (!SSL_CTX_load_verify_locations(ctx, ca_file, NULL)) {
+		ERROR("Error loading TLS peer CA certificate %s", ca_file);
+		goto error;
+	}
+
+	if (!SSL_CTX_use_certificate_chain_file(ctx, cert_file)) {
+		ERROR("Error loading TLS client certificate %s", cert_file);
+		goto error;
+	}
+
+	if (!tpmkey) {
+		if ((key = BIO_new_file(key_file, "r")) == NULL) {
+			ERROR("Error reading TLS client key");
+			goto error;
+		}
+		if ((pkey = PEM_read_bio_PrivateKey(key, NULL, NULL, NULL)) == NULL) {
+			ERROR("Error parsing TLS client key");
+			goto error;
+		}
+	} else {
+		// TODO same as in ssl_create_csr(), the engine prompts for the passphrase
+		if ((pkey = ENGINE_load_private_key(tpm_engine, key_file, NULL, NULL)) == NULL) {
+			ERROR("Error loading TLS client key pair into TPM");
+			goto error;
+		}
+	}
+
+	if (!SSL_CTX_use_PrivateKey(ctx, pkey) || !SSL_CTX_check_private_key(ctx)) {
+		ERROR("TLS client key does not match certificate %s", cert_file);
+		goto error;
+	}
+
+	EVP_PKEY_free(pkey);
+	BIO_free(key);
+	return ctx;
+
+error:
+	if (pkey)
+		EVP_PKEY_free(pkey);
+	if (key)
+		BIO_free(key);
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
 const char *
 asn1_object_to_hash_algo(const ASN1_OBJECT *obj)
 {
@@ -28,6 +28,7 @@
 
 #include <openssl/evp.h>
 #include <openssl/x509v3.h>
+#include <openssl/ssl.h>
 
 /**
  * reads a pkcs12 softtoken located in the file token_file, unlocked with the password passphrase,
@@ -125,6 +126,47 @@ int
 ssl_verify_signature_from_digest(const char *cert_buf, const uint8_t *sig_buf, size_t sig_len,
 				 const uint8_t *hash, size_t hash_len);
 
+/**
+ * Loads the public key of the PEM encoded certificate in cert_buf, e.g., to
+ * verify many digests with ssl_verify_signature_from_digest_pkey() without
+ * parsing the certificate again. The key has to be freed with EVP_PKEY_free().
+ * @return The public key or NULL on error.
+ */
+EVP_PKEY *
+ssl_get_pubkey_from_cert_buf_new(const char *cert_buf);
+
+/**
+ * Loads the public key of the PEM encoded certificate of cert_len bytes in cert_buf
+ * and the hash algorithm of its signature, e.g., to verify all signatures of a
+ * device with ssl_verify_signature_from_buf_pkey() without parsing its certificate
+ * again. The key has to be freed with EVP_PKEY_free().
+ * @param hash_algo set to the name of the hash algorithm (static string), may be NULL
+ * @return The public key or NULL on error.
+ */
+EVP_PKEY *
+ssl_get_pubkey_from_cert_pem_new(const uint8_t *cert_buf, size_t cert_len, const char **hash_algo);
+
+/**
+ * Same as ssl_verify_signature_from_buf() for an already loaded public key and the
+ * hash algorithm returned by ssl_get_pubkey_from_cert_pem_new(). The key is only
+ * read, thus it may be shared by concurrent verifications.
+ * @return Returns 0 on success, -1 if the verification failed and -2 in case of
+ * an unexpected verification error.
+ */
+int
+ssl_verify_signature_from_buf_pkey(EVP_PKEY *key, const char *hash_algo, const uint8_t *sig_buf,
+				   size_t sig_len, const uint8_t *buf, size_t buf_len);
+
+/**
+ * Same as ssl_verify_signature_from_digest() for an already loaded public key.
+ * The key is only read, thus it may be shared by concurrent verifications.
+ * @return Returns 0 on success, -1 if the verification failed and -2 in case of
+ * an unexpected verification error.
+ */
+int
+ssl_verify_signature_from_digest_pkey(EVP_PKEY *key, const uint8_t *sig_buf, size_t sig_len,
+				      const uint8_t *hash, size_t hash_len);
+
 /**
  * The file located in file_to_hash is hashed with the hash algorithm hash_algo.
  * @return The function reveals the hash  as return value and its length via the parameter calc_len.
@@ -133,6 +175,19 @@ ssl_verify_signature_from_digest(const char *cert_buf, const uint8_t *sig_buf, s
 unsigned char *
 ssl_hash_file(const char *file_to_hash, unsigned int *calc_len, const char *hash_algo);
 
+#define SSL_HASH_FILE_MULTI_MAX 4
+
+/**
+ * Hashes the file located in file_to_hash with each of the n hash algorithms
+ * hash_algos (at most SSL_HASH_FILE_MULTI_MAX) in a single pass over the file.
+ * The newly allocated hashes and their lengths are returned in hashes and
+ * hash_lens, which must provide room for n elements.
+ * @return 0 on success, -1 on error
+ */
+int
+ssl_hash_file_multi(const char *file_to_hash, const char *hash_algos[], size_t n,
+		    unsigned char *hashes[], unsigned int hash_lens[]);
+
 /**
  * creates a pkcs 12 softtoken located in the file token_file, locked with the password passphrase.
  * The corresponding (currently) self-signed certificate is stored in the file cert_file, if specified
@@ -148,6 +203,16 @@ ssl_create_pkcs12_token(const char *token_file, const char *cert_file, const cha
  */
 int
 ssl_newpass_pkcs12_token(const char *token_file, const char *oldpass, const char *newpass);
+
+/**
+ * re-encrypts the pkcs 12 softtoken located in the file token_file, which has been unlocked
+ * with passphrase into pkey, cert and ca, with iter iterations for its PBEs and MAC.
+ * Tokens which already use iter iterations are left untouched.
+ * @return 1 if the token was re-encrypted, 0 if it was unchanged, -1 on error
+ */
+int
+ssl_reencrypt_pkcs12_token(const char *token_file, const char *passphrase, EVP_PKEY *pkey,
+			   X509 *cert, STACK_OF(X509) * ca, int iter);
 /**
  * create a self-signed certificate from a CSR
  * csr_file is an existing x509 CSR and cert_file is the desitination file
@@ -160,6 +225,17 @@ ssl_newpass_pkcs12_token(const char *token_file, const char *oldpass, const char
 int
 ssl_self_sign_csr(const char *csr_file, const char *cert_file, const char *key_file, bool tpmkey);
 
+/**
+ * Creates a TLS client context which authenticates with the given certificate
+ * and key and only accepts peers certified by the CA in ca_file.
+ * If tpmkey is true, key_file designates the TPM-key, which requires to
+ * initialize the OpenSSL stack with the OpenSSL TPM engine, see ssl_init
+ * @return the new context, to be freed with SSL_CTX_free(), NULL on error
+ */
+SSL_CTX *
+ssl_tls_client_ctx_new(const char *ca_file, const char *cert_file, const char *key_file,
+		       bool tpmkey);
+
 /**
  * Initializes internal OpenSSL structures
  * @param use_tpm indicates whether the OpenSSL stack should be initialized using
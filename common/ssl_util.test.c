@@ -5,6 +5,9 @@
 #include "ssl_util.h"
 #include "mem.h"
 
+#include <stdlib.h>
+#include <unistd.h>
+
 // Test vectors
 
 static uint8_t cert_valid[] =
@@ -49,6 +52,14 @@ static const uint8_t sig_valid[] = {
 };
 uint8_t quote_valid[] = { 0x68, 0x61, 0x6c, 0x6c, 0x6f, 0x0a };
 
+// SHA-1 and SHA-256 of quote_valid
+static const uint8_t quote_sha1[] = { 0x56, 0xac, 0x1c, 0x08, 0xfa, 0x54, 0x79, 0xfd, 0x57, 0xc4,
+				      0xa5, 0xc6, 0x58, 0x61, 0xc4, 0xed, 0x3e, 0xd9, 0x3f, 0xf8 };
+static const uint8_t quote_sha256[] = { 0x62, 0x2c, 0xb3, 0x37, 0x1c, 0x1a, 0x08, 0x09,
+					0x6e, 0xaa, 0xc5, 0x64, 0xfb, 0x59, 0xac, 0xcc,
+					0xda, 0x1f, 0xcd, 0xbe, 0x13, 0xa9, 0xdd, 0x10,
+					0xb4, 0x86, 0xe6, 0x46, 0x3c, 0x8c, 0x25, 0x25 };
+
 static void *
 setup(UNUSED const MunitParameter params[], UNUSED void *data)
 {
@@ -81,6 +92,91 @@ test_ssl_verify_signature_from_buf(UNUSED const MunitParameter params[], UNUSED
 	return MUNIT_OK;
 }
 
+static MunitResult
+test_ssl_verify_signature_from_buf_pkey(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	const char *hash_algo = NULL;
+	EVP_PKEY *key =
+		ssl_get_pubkey_from_cert_pem_new(cert_valid, sizeof(cert_valid), &hash_algo);
+	munit_assert_not_null(key);
+	munit_assert_not_null(hash_algo);
+
+	// the loaded key is reused for several verifications
+	for (int i = 0; i < 2; i++)
+		munit_assert_int(ssl_verify_signature_from_buf_pkey(key, hash_algo, sig_valid,
+								    sizeof(sig_valid), quote_valid,
+								    sizeof(quote_valid)),
+				 ==, 0);
+
+	uint8_t quote[sizeof(quote_valid)];
+	memcpy(quote, quote_valid, sizeof(quote));
+	quote[0] ^= 1;
+	munit_assert_int(ssl_verify_signature_from_buf_pkey(key, hash_algo, sig_valid,
+							    sizeof(sig_valid), quote,
+							    sizeof(quote)),
+			 ==, -1);
+	EVP_PKEY_free(key);
+
+	munit_assert_null(ssl_get_pubkey_from_cert_pem_new(quote_valid, sizeof(quote_valid), NULL));
+
+	return MUNIT_OK;
+}
+
+static char *
+write_tmpfile_new(const uint8_t *buf, size_t len)
+{
+	char *file = mem_strdup("/tmp/ssl_util_testXXXXXX");
+	int fd = mkstemp(file);
+	munit_assert_int(fd, >=, 0);
+	close(fd);
+	munit_assert_int(file_write(file, (const char *)buf, len), ==, (int)len);
+	return file;
+}
+
+static MunitResult
+test_ssl_hash_file_multi(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	const char *algos[] = { "SHA1", "SHA256" };
+	unsigned char *hashes[2];
+	unsigned int hash_lens[2];
+
+	char *file = write_tmpfile_new(quote_valid, sizeof(quote_valid));
+	munit_assert_int(ssl_hash_file_multi(file, algos, 2, hashes, hash_lens), ==, 0);
+	munit_assert_uint(hash_lens[0], ==, sizeof(quote_sha1));
+	munit_assert_memory_equal(sizeof(quote_sha1), hashes[0], quote_sha1);
+	munit_assert_uint(hash_lens[1], ==, sizeof(quote_sha256));
+	munit_assert_memory_equal(sizeof(quote_sha256), hashes[1], quote_sha256);
+	mem_free(hashes[0]);
+	mem_free(hashes[1]);
+	unlink(file);
+	mem_free(file);
+
+	// spans several read buffers, the single pass must match the separate ones
+	size_t len = 3 * 1024 * 1024 + 7;
+	uint8_t *buf = mem_alloc(len);
+	for (size_t i = 0; i < len; i++)
+		buf[i] = i * 31 + (i >> 12);
+	file = write_tmpfile_new(buf, len);
+	mem_free(buf);
+
+	munit_assert_int(ssl_hash_file_multi(file, algos, 2, hashes, hash_lens), ==, 0);
+	for (int i = 0; i < 2; i++) {
+		unsigned int single_len;
+		unsigned char *single = ssl_hash_file(file, &single_len, algos[i]);
+		munit_assert_not_null(single);
+		munit_assert_uint(single_len, ==, hash_lens[i]);
+		munit_assert_memory_equal(single_len, single, hashes[i]);
+		mem_free(single);
+		mem_free(hashes[i]);
+	}
+	unlink(file);
+	mem_free(file);
+
+	munit_assert_int(ssl_hash_file_multi("/nonexistent", algos, 2, hashes, hash_lens), ==, -1);
+
+	return MUNIT_OK;
+}
+
 static MunitTest tests[] = {
 	{
 		"ssl_verify_signature_from_buf",    /* name */
@@ -90,6 +186,22 @@ static MunitTest tests[] = {
 		MUNIT_TEST_OPTION_NONE,		    /* options */
 		NULL				    /* parameters */
 	},
+	{
+		"ssl_verify_signature_from_buf_pkey",	 /* name */
+		test_ssl_verify_signature_from_buf_pkey, /* test */
+		setup,					 /* setup */
+		tear_down,				 /* tear_down */
+		MUNIT_TEST_OPTION_NONE,			 /* options */
+		NULL					 /* parameters */
+	},
+	{
+		"ssl_hash_file_multi",	  /* name */
+		test_ssl_hash_file_multi, /* test */
+		setup,			  /* setup */
+		tear_down,		  /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	  /* options */
+		NULL			  /* parameters */
+	},
 
 	// Mark the end of the array with an entry where the test function is NULL
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
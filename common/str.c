@@ -30,22 +30,43 @@
 #include "mem.h"
 #include "macro.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// strings up to this size (including the null byte) need no separate buffer
+#define STR_INLINE_LEN 32
+
 struct str {
-	char *buf;
+	char *buf; //!< points to inline_buf or to an allocated buffer
 	ssize_t len;
 	size_t allocated_len;
+	char inline_buf[STR_INLINE_LEN];
 };
 
+/*
+ * Makes room for len more characters and the null byte. The capacity at
+ * least doubles on each reallocation, so appending is amortized O(1).
+ */
 static void
 str_expand(str_t *str, size_t len)
 {
 	IF_NULL_RETURN(str);
 
-	if (str->len + len < str->allocated_len)
+	size_t needed = str->len + len + 1;
+	if (needed <= str->allocated_len)
 		return;
 
-	str->allocated_len = str->len + len + 1;
-	str->buf = mem_realloc(str->buf, str->allocated_len);
+	size_t allocated_len = MAX(needed, 2 * str->allocated_len);
+	if (str->buf == str->inline_buf) {
+		str->buf = mem_alloc(allocated_len);
+		memcpy(str->buf, str->inline_buf, str->len + 1);
+	} else {
+		str->buf = mem_realloc(str->buf, allocated_len);
+	}
+	str->allocated_len = allocated_len;
 }
 
 static void
@@ -82,13 +103,13 @@ str_new_len(size_t len)
 
 	str = mem_new(str_t, 1);
 
-	str->allocated_len = 0;
+	str->allocated_len = STR_INLINE_LEN;
 	str->len = 0;
-	str->buf = NULL;
-
-	str_expand(str, MAX(len, 2));
+	str->buf = str->inline_buf;
 	str->buf[0] = 0;
 
+	str_expand(str, len);
+
 	return str;
 }
 
@@ -221,6 +242,24 @@ str_insert_len(str_t *str, ssize_t pos, const char *buf, ssize_t len)
 	str->buf[str->len] = 0;
 }
 
+void
+str_reserve(str_t *str, size_t len)
+{
+	IF_NULL_RETURN(str);
+
+	if (len > (size_t)str->len)
+		str_expand(str, len - str->len);
+}
+
+void
+str_clear(str_t *str)
+{
+	IF_NULL_RETURN(str);
+
+	str->len = 0;
+	str->buf[0] = 0;
+}
+
 void
 str_truncate(str_t *str, ssize_t len)
 {
@@ -251,7 +290,11 @@ str_free(str_t *str, bool free_buf)
 
 	IF_NULL_RETVAL(str, NULL);
 
-	if (free_buf) {
+	if (str->buf == str->inline_buf) {
+		buf = free_buf ? NULL : mem_alloc(str->len + 1);
+		if (buf)
+			memcpy(buf, str->buf, str->len + 1);
+	} else if (free_buf) {
 		mem_free(str->buf);
 		buf = NULL;
 	} else {
@@ -263,15 +306,252 @@ str_free(str_t *str, bool free_buf)
 	return buf;
 }
 
+static const char str_hex_digits[] = "0123456789abcdef";
+
 str_t *
 str_hexdump_new(unsigned char *mem, size_t len)
 {
-	str_t *ret = str_new_len(len * 2 + 1);
+	str_t *ret = str_new_len(len * 3);
 
-	while (len--) {
-		str_append_printf(ret, "%02x ", *mem);
-		mem++;
+	for (size_t i = 0; i < len; i++) {
+		ret->buf[3 * i] = str_hex_digits[mem[i] >> 4];
+		ret->buf[3 * i + 1] = str_hex_digits[mem[i] & 0x0f];
+		ret->buf[3 * i + 2] = ' ';
 	}
+	ret->len = len * 3;
+	ret->buf[ret->len] = 0;
 
 	return ret;
 }
+
+static void
+str_hex_encode_scalar(char *hex, const uint8_t *bin, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		hex[2 * i] = str_hex_digits[bin[i] >> 4];
+		hex[2 * i + 1] = str_hex_digits[bin[i] & 0x0f];
+	}
+}
+
+static int
+str_hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static int
+str_hex_decode_scalar(uint8_t *bin, const char *hex, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		int hi = str_hex_nibble(hex[2 * i]);
+		int lo = str_hex_nibble(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return -1;
+		bin[i] = (hi << 4) | lo;
+	}
+	return 0;
+}
+
+#if defined(__SSE2__)
+/*
+ * Converts 16 nibbles to their lower case hex digits.
+ */
+static inline __m128i
+str_hex_digits_sse2(__m128i nibbles)
+{
+	__m128i letters = _mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9));
+	__m128i ascii = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+	return _mm_add_epi8(ascii, _mm_and_si128(letters, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+/*
+ * Converts 16 hex digits to nibbles and clears *valid if any is no hex digit.
+ */
+static inline __m128i
+str_hex_nibbles_sse2(__m128i c, int *valid)
+{
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8(-1)),
+					 _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+	// upper and lower case letters map to 0 ... 5
+	__m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8(-1)),
+					  _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff)
+		*valid = 0;
+
+	return _mm_or_si128(_mm_and_si128(is_digit, d),
+			    _mm_and_si128(is_letter, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+static size_t
+str_hex_encode_simd(char *hex, const uint8_t *bin, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(bin + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+		__m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+		_mm_storeu_si128((__m128i *)(hex + 2 * i),
+				 str_hex_digits_sse2(_mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i *)(hex + 2 * i + 16),
+				 str_hex_digits_sse2(_mm_unpackhi_epi8(hi, lo)));
+	}
+	return i;
+}
+
+static size_t
+str_hex_decode_simd(uint8_t *bin, const char *hex, size_t len, int *valid)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i n0 = str_hex_nibbles_sse2(
+			_mm_loadu_si128((const __m128i *)(hex + 2 * i)), valid);
+		__m128i n1 = str_hex_nibbles_sse2(
+			_mm_loadu_si128((const __m128i *)(hex + 2 * i + 16)), valid);
+		// each 16 bit lane holds the high nibble in its low byte and vice versa
+		__m128i lo_mask = _mm_set1_epi16(0xff);
+		__m128i b0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n0, lo_mask), 4),
+					  _mm_srli_epi16(n0, 8));
+		__m128i b1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n1, lo_mask), 4),
+					  _mm_srli_epi16(n1, 8));
+		_mm_storeu_si128((__m128i *)(bin + i), _mm_packus_epi16(b0, b1));
+	}
+	return i;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline uint8x16_t
+str_hex_digits_neon(uint8x16_t nibbles)
+{
+	uint8x16_t letters = vcgtq_u8(nibbles, vdupq_n_u8(9));
+	uint8x16_t ascii = vaddq_u8(nibbles, vdupq_n_u8('0'));
+	return vaddq_u8(ascii, vandq_u8(letters, vdupq_n_u8('a' - '0' - 10)));
+}
+
+static inline uint8x16_t
+str_hex_nibbles_neon(uint8x16_t c, int *valid)
+{
+	uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+	uint8x16_t is_digit = vcltq_u8(d, vdupq_n_u8(10));
+	uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+	uint8x16_t is_letter = vcltq_u8(l, vdupq_n_u8(6));
+
+	if (vminvq_u8(vorrq_u8(is_digit, is_letter)) != 0xff)
+		*valid = 0;
+
+	return vorrq_u8(vandq_u8(is_digit, d),
+			vandq_u8(is_letter, vaddq_u8(l, vdupq_n_u8(10))));
+}
+
+static size_t
+str_hex_encode_simd(char *hex, const uint8_t *bin, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(bin + i);
+		uint8x16x2_t digits;
+		digits.val[0] = str_hex_digits_neon(vshrq_n_u8(v, 4));
+		digits.val[1] = str_hex_digits_neon(vandq_u8(v, vdupq_n_u8(0x0f)));
+		// stores the high and low digits interleaved
+		vst2q_u8((uint8_t *)hex + 2 * i, digits);
+	}
+	return i;
+}
+
+static size_t
+str_hex_decode_simd(uint8_t *bin, const char *hex, size_t len, int *valid)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		// loads the high and low digits into separate vectors
+		uint8x16x2_t c = vld2q_u8((const uint8_t *)hex + 2 * i);
+		uint8x16_t hi = str_hex_nibbles_neon(c.val[0], valid);
+		uint8x16_t lo = str_hex_nibbles_neon(c.val[1], valid);
+		vst1q_u8(bin + i, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+	}
+	return i;
+}
+#else
+static size_t
+str_hex_encode_simd(UNUSED char *hex, UNUSED const uint8_t *bin, UNUSED size_t len)
+{
+	return 0;
+}
+
+static size_t
+str_hex_decode_simd(UNUSED uint8_t *bin, UNUSED const char *hex, UNUSED size_t len,
+		    UNUSED int *valid)
+{
+	return 0;
+}
+#endif
+
+void
+str_hex_encode(char *hex, const uint8_t *bin, size_t len)
+{
+	ASSERT(hex);
+	ASSERT(bin || len == 0);
+
+	size_t done = str_hex_encode_simd(hex, bin, len);
+	str_hex_encode_scalar(hex + 2 * done, bin + done, len - done);
+	hex[2 * len] = '\0';
+}
+
+int
+str_hex_decode(uint8_t *bin, const char *hex, size_t len)
+{
+	ASSERT(bin || len == 0);
+	ASSERT(hex);
+
+	int valid = 1;
+	size_t done = str_hex_decode_simd(bin, hex, len, &valid);
+	IF_FALSE_RETVAL_TRACE(valid, -1);
+
+	return str_hex_decode_scalar(bin + done, hex + 2 * done, len - done);
+}
+
+char *
+str_hex_encode_new(const uint8_t *bin, size_t len)
+{
+	size_t hex_len = MUL_WITH_OVERFLOW_CHECK(len, (size_t)2);
+	char *hex = mem_alloc(ADD_WITH_OVERFLOW_CHECK(hex_len, (size_t)1));
+
+	str_hex_encode(hex, bin, len);
+	return hex;
+}
+
+uint8_t *
+str_hex_decode_new(const char *hex, size_t *bin_len)
+{
+	IF_NULL_RETVAL(hex, NULL);
+	ASSERT(bin_len);
+
+	size_t len = strlen(hex);
+	size_t odd = len % 2;
+	uint8_t *bin = mem_alloc0(MAX(len / 2 + odd, (size_t)1));
+
+	// an odd leading digit is taken as a byte on its own
+	if (odd) {
+		int nibble = str_hex_nibble(hex[0]);
+		IF_TRUE_GOTO_TRACE(nibble < 0, err);
+		bin[0] = nibble;
+	}
+	IF_TRUE_GOTO_TRACE(str_hex_decode(bin + odd, hex + odd, len / 2) < 0, err);
+
+	*bin_len = len / 2 + odd;
+	return bin;
+err:
+	mem_free(bin);
+	return NULL;
+}
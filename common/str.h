@@ -34,6 +34,7 @@
 
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct str str_t;
 
@@ -179,6 +180,25 @@ str_insert_len(str_t *str, ssize_t pos, const char *buf, ssize_t len);
 void
 str_truncate(str_t *str, ssize_t len);
 
+/**
+ * Makes sure the string can hold at least len characters without
+ * reallocating its buffer.
+ *
+ * @param str The string.
+ * @param len The number of characters to reserve space for.
+ */
+void
+str_reserve(str_t *str, size_t len);
+
+/**
+ * Empties the string but keeps its buffer, so that it can be refilled
+ * without reallocating.
+ *
+ * @param str The string to be cleared.
+ */
+void
+str_clear(str_t *str);
+
 /**
  * Returns a pointer to the internal string buffer.
  *
@@ -207,6 +227,45 @@ str_length(str_t *str);
 str_t *
 str_hexdump_new(unsigned char *mem, size_t len);
 
+/**
+ * Writes the lower case hex representation of len bytes from bin to hex,
+ * followed by a null byte. hex must provide room for 2 * len + 1 characters.
+ *
+ * @param hex The output buffer
+ * @param bin The bytes to be converted
+ * @param len The number of bytes to be converted
+ */
+void
+str_hex_encode(char *hex, const uint8_t *bin, size_t len);
+
+/**
+ * Converts the 2 * len hex digits (upper or lower case) at hex to len bytes.
+ *
+ * @param bin The output buffer of len bytes
+ * @param hex The hex digits to be converted
+ * @param len The number of bytes to be written
+ * @return 0 on success, -1 if hex contains a character which is no hex digit
+ */
+int
+str_hex_decode(uint8_t *bin, const char *hex, size_t len);
+
+/**
+ * Returns a newly allocated, null terminated hex string of len bytes from bin.
+ */
+char *
+str_hex_encode_new(const uint8_t *bin, size_t len);
+
+/**
+ * Converts the null terminated hex string hex to newly allocated bytes.
+ * A string of odd length is read as if it had a leading '0'.
+ *
+ * @param hex The hex string to be converted
+ * @param bin_len Pointer to store the number of resulting bytes
+ * @return The resulting bytes or NULL if hex is no valid hex string
+ */
+uint8_t *
+str_hex_decode_new(const char *hex, size_t *bin_len);
+
 /**
  * Frees the allocated string memory.
  *
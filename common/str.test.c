@@ -0,0 +1,170 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "munit.h"
+
+#include "str.h"
+#include "logf.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <string.h>
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	// No clean-up needed for now
+}
+
+static MunitResult
+test_str_grow_and_clear(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	str_t *str = str_new("short");
+	munit_assert_string_equal(str_buffer(str), "short");
+
+	// grows from the inline buffer to the heap
+	for (int i = 0; i < 100; i++)
+		str_append_printf(str, "%02d", i);
+	munit_assert_int(str_length(str), ==, 205);
+	munit_assert_memory_equal(9, str_buffer(str), "short0001");
+
+	str_clear(str);
+	munit_assert_int(str_length(str), ==, 0);
+	munit_assert_string_equal(str_buffer(str), "");
+
+	// the buffer is kept by str_clear
+	const char *buf = str_buffer(str);
+	str_append(str, "again");
+	munit_assert_ptr_equal(str_buffer(str), buf);
+	munit_assert_string_equal(str_buffer(str), "again");
+
+	str_reserve(str, 4096);
+	buf = str_buffer(str);
+	for (int i = 0; i < 400; i++)
+		str_append(str, "0123456789");
+	munit_assert_ptr_equal(str_buffer(str), buf);
+	str_free(str, true);
+
+	// the returned buffer of a short string is owned by the caller
+	str = str_new("inline");
+	char *ret = str_free(str, false);
+	munit_assert_string_equal(ret, "inline");
+	mem_free(ret);
+
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_str_hex(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	uint8_t bin[77];
+	uint8_t out[77];
+	char hex[2 * sizeof(bin) + 1];
+
+	for (size_t i = 0; i < sizeof(bin); i++)
+		bin[i] = i * 37 + 11;
+
+	// all lengths cover the vectorized and the scalar parts
+	for (size_t len = 0; len <= sizeof(bin); len++) {
+		str_hex_encode(hex, bin, len);
+		munit_assert_size(strlen(hex), ==, 2 * len);
+		for (size_t i = 0; i < len; i++) {
+			char byte[3];
+			snprintf(byte, sizeof(byte), "%02x", bin[i]);
+			munit_assert_memory_equal(2, hex + 2 * i, byte);
+		}
+		munit_assert_int(str_hex_decode(out, hex, len), ==, 0);
+		munit_assert_memory_equal(len, out, bin);
+	}
+
+	// upper case digits are accepted
+	munit_assert_int(str_hex_decode(out, "00FFaB9c", 4), ==, 0);
+	munit_assert_memory_equal(4, out, "\x00\xff\xab\x9c");
+
+	// invalid characters are detected in both parts
+	memset(hex, '0', 2 * 40);
+	hex[5] = 'g';
+	munit_assert_int(str_hex_decode(out, hex, 40), ==, -1);
+	hex[5] = '0';
+	hex[2 * 40 - 1] = '/';
+	munit_assert_int(str_hex_decode(out, hex, 40), ==, -1);
+	hex[2 * 40 - 1] = '0';
+	hex[20] = ':';
+	munit_assert_int(str_hex_decode(out, hex, 40), ==, -1);
+
+	size_t len;
+	uint8_t *dec = str_hex_decode_new("abc", &len);
+	munit_assert_not_null(dec);
+	munit_assert_size(len, ==, 2);
+	munit_assert_memory_equal(2, dec, "\x0a\xbc");
+	mem_free(dec);
+	munit_assert_null(str_hex_decode_new("0x12", &len));
+
+	char *enc = str_hex_encode_new((const uint8_t *)"\x01\xfe", 2);
+	munit_assert_string_equal(enc, "01fe");
+	mem_free(enc);
+
+	str_t *dump = str_hexdump_new((unsigned char *)"\x12\xab", 2);
+	munit_assert_string_equal(str_buffer(dump), "12 ab ");
+	str_free(dump, true);
+
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"/str grow and clear",	  /* name */
+		test_str_grow_and_clear, /* test */
+		setup,			  /* setup */
+		tear_down,		  /* tear_down */
+		MUNIT_TEST_OPTION_NONE,	  /* options */
+		NULL			  /* parameters */
+	},
+	{
+		"/str hex",		/* name */
+		test_str_hex,		/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite str_suite = {
+	"/str",			/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
@@ -0,0 +1,428 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include "event.h"
+#include "macro.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 64
+
+typedef struct uring_op {
+	uring_cb_t cb;
+	void *data;
+	void *free_buf; //!< freed on completion, see uring_write_free()
+	// the request, kept for the synchronous fallback
+	uint8_t opcode;
+	int fd;
+	void *buf;
+	size_t len;
+	off_t offset;
+	unsigned fsync_flags;
+} uring_op_t;
+
+/*
+ * The rings shared with the kernel. The kernel consumes submissions only
+ * during io_uring_enter(), as no SQPOLL thread is used, and each submission
+ * is entered at once, thus the submission ring never holds more than one
+ * entry.
+ */
+typedef struct uring {
+	int fd;
+	pid_t pid;			//!< process which set up the ring
+	unsigned inflight;		//!< submitted and not yet completed operations
+	unsigned sq_entries;
+	unsigned cq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+	event_io_t *io; //!< watches fd for completions while operations are in flight
+	bool io_added;
+} uring_t;
+
+// the ring of the calling thread, NULL if not set up (yet)
+static __thread uring_t *uring_self = NULL;
+// set by uring_use(false) or if the ring cannot be set up
+static __thread bool uring_disabled = false;
+// operations executed synchronously whose callbacks are still pending
+static __thread size_t uring_sync_pending = 0;
+
+static void
+uring_op_complete(uring_op_t *op, ssize_t res)
+{
+	uring_cb_t cb = op->cb;
+	void *data = op->data;
+
+	if (op->free_buf) {
+		if (res >= 0 && (size_t)res < op->len)
+			WARN("Short write of %zd of %zu bytes to fd %d", res, op->len, op->fd);
+		else if (res < 0 && !cb)
+			WARN("Failed to write %zu bytes to fd %d: %s", op->len, op->fd,
+			     strerror((int)-res));
+		mem_free(op->free_buf);
+	}
+	mem_free(op);
+
+	if (cb)
+		cb(res, data);
+}
+
+static void
+uring_free(uring_t *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	event_io_free(ring->io);
+	mem_free(ring);
+}
+
+static void
+uring_cb(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	uring_t *ring = data;
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		uring_op_t *op = (uring_op_t *)(uintptr_t)cqe->user_data;
+		ssize_t res = cqe->res;
+
+		// release the entry before the callback, which may submit the next operation
+		__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+		ring->inflight--;
+		uring_op_complete(op, res);
+
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	// do not keep the loop alive without pending operations
+	if (ring->inflight == 0 && ring->io_added) {
+		event_remove_io(ring->io);
+		ring->io_added = false;
+	}
+}
+
+static bool
+uring_probe(int fd)
+{
+	const unsigned ops[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC };
+	size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = mem_alloc0(probe_len);
+	bool supported = false;
+
+	// IORING_OP_READ and _WRITE are available since the probe (Linux 5.6)
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		DEBUG_ERRNO("io_uring probe failed");
+		goto out;
+	}
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			DEBUG("io_uring does not support opcode %u", ops[i]);
+			goto out;
+		}
+	}
+	supported = true;
+out:
+	mem_free(probe);
+	return supported;
+}
+
+static uring_t *
+uring_new(void)
+{
+	struct io_uring_params p;
+	uring_t *ring = mem_new0(uring_t, 1);
+	ring->fd = -1;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		DEBUG_ERRNO("io_uring not available");
+		goto err;
+	}
+	IF_FALSE_GOTO(uring_probe(ring->fd), err);
+
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_len = ring->cq_ring_len = MAX(ring->sq_ring_len, ring->cq_ring_len);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		ERROR_ERRNO("Failed to map io_uring submission ring");
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			ERROR_ERRNO("Failed to map io_uring completion ring");
+			goto err;
+		}
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		ERROR_ERRNO("Failed to map io_uring submission entries");
+		goto err;
+	}
+
+	uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_entries = p.cq_entries;
+
+	ring->io = event_io_new(ring->fd, EVENT_IO_READ, uring_cb, ring);
+	ring->pid = getpid();
+
+	DEBUG("Set up io_uring with %u/%u entries", ring->sq_entries, ring->cq_entries);
+	return ring;
+err:
+	uring_free(ring);
+	return NULL;
+}
+
+/*
+ * Returns the ring of the calling thread, setting it up on first use, or NULL
+ * if operations have to be executed synchronously.
+ */
+static uring_t *
+uring_get(void)
+{
+	IF_TRUE_RETVAL_TRACE(uring_disabled, NULL);
+
+	// the ring (and its fd in the epoll set) is shared with the parent
+	if (uring_self && uring_self->pid != getpid()) {
+		DEBUG("Dropping io_uring of parent with %u operations in flight",
+		      uring_self->inflight);
+		uring_self->io_added = false;
+		uring_free(uring_self);
+		uring_self = NULL;
+	}
+
+	if (!uring_self) {
+		uring_self = uring_new();
+		if (!uring_self) {
+			INFO("io_uring not usable, executing file operations synchronously");
+			uring_disabled = true;
+		}
+	}
+	return uring_self;
+}
+
+static ssize_t
+uring_op_execute(const uring_op_t *op)
+{
+	ssize_t res;
+
+	switch (op->opcode) {
+	case IORING_OP_READ:
+		res = op->offset < 0 ? read(op->fd, op->buf, op->len) :
+				       pread(op->fd, op->buf, op->len, op->offset);
+		break;
+	case IORING_OP_WRITE:
+		res = op->offset < 0 ? write(op->fd, op->buf, op->len) :
+				       pwrite(op->fd, op->buf, op->len, op->offset);
+		break;
+	case IORING_OP_FSYNC:
+		res = (op->fsync_flags & IORING_FSYNC_DATASYNC) ? fdatasync(op->fd) : fsync(op->fd);
+		break;
+	default:
+		errno = EINVAL;
+		res = -1;
+	}
+	return res < 0 ? -errno : res;
+}
+
+static void
+uring_sync_cb(event_timer_t *timer, void *data)
+{
+	uring_op_t *op = data;
+
+	event_timer_free(timer);
+	uring_sync_pending--;
+	uring_op_complete(op, uring_op_execute(op));
+}
+
+/*
+ * Queues the operation on the ring and enters it to the kernel, or
+ * executes it from the event loop if there is no (free) ring.
+ */
+static int
+uring_submit(uring_op_t *op)
+{
+	uring_t *ring = uring_get();
+
+	// never exceed the completion ring, later completions could be dropped
+	if (ring && ring->inflight < ring->cq_entries) {
+		unsigned tail = *ring->sq_tail;
+		unsigned index = tail & *ring->sq_mask;
+		struct io_uring_sqe *sqe = &ring->sqes[index];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = op->opcode;
+		sqe->fd = op->fd;
+		sqe->addr = (uintptr_t)op->buf;
+		sqe->len = op->len;
+		sqe->off = op->offset < 0 ? (uint64_t)-1 : (uint64_t)op->offset;
+		sqe->fsync_flags = op->fsync_flags;
+		sqe->user_data = (uintptr_t)op;
+		ring->sq_array[index] = index;
+		__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		if (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == 1) {
+			ring->inflight++;
+			if (!ring->io_added) {
+				event_add_io(ring->io);
+				ring->io_added = true;
+			}
+			return 0;
+		}
+
+		// not consumed by the kernel, take it back
+		DEBUG_ERRNO("io_uring_enter failed, executing operation synchronously");
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	}
+
+	event_timer_t *timer = event_timer_new(0, 1, uring_sync_cb, op);
+	IF_NULL_RETVAL_ERROR(timer, -1);
+	event_add_timer(timer);
+	uring_sync_pending++;
+	return 0;
+}
+
+static int
+uring_op_submit(uint8_t opcode, int fd, void *buf, size_t len, off_t offset,
+		unsigned fsync_flags, void *free_buf, uring_cb_t cb, void *data)
+{
+	if (fd < 0 || len > UINT32_MAX) {
+		ERROR("Invalid io_uring operation on fd %d with %zu bytes", fd, len);
+		if (free_buf)
+			mem_free(free_buf);
+		return -1;
+	}
+
+	uring_op_t *op = mem_new0(uring_op_t, 1);
+	op->cb = cb;
+	op->data = data;
+	op->free_buf = free_buf;
+	op->opcode = opcode;
+	op->fd = fd;
+	op->buf = buf;
+	op->len = len;
+	op->offset = offset;
+	op->fsync_flags = fsync_flags;
+
+	if (uring_submit(op) < 0) {
+		if (free_buf)
+			mem_free(free_buf);
+		mem_free(op);
+		return -1;
+	}
+	return 0;
+}
+
+void
+uring_use(bool enable)
+{
+	uring_disabled = !enable;
+}
+
+bool
+uring_active(void)
+{
+	return uring_get() != NULL;
+}
+
+int
+uring_read(int fd, void *buf, size_t len, off_t offset, uring_cb_t cb, void *data)
+{
+	return uring_op_submit(IORING_OP_READ, fd, buf, len, offset, 0, NULL, cb, data);
+}
+
+int
+uring_write(int fd, const void *buf, size_t len, off_t offset, uring_cb_t cb, void *data)
+{
+	return uring_op_submit(IORING_OP_WRITE, fd, (void *)buf, len, offset, 0, NULL, cb, data);
+}
+
+int
+uring_write_free(int fd, void *buf, size_t len, off_t offset, uring_cb_t cb, void *data)
+{
+	return uring_op_submit(IORING_OP_WRITE, fd, buf, len, offset, 0, buf, cb, data);
+}
+
+int
+uring_fsync(int fd, bool datasync, uring_cb_t cb, void *data)
+{
+	// offset and len 0 select the whole file
+	return uring_op_submit(IORING_OP_FSYNC, fd, NULL, 0, 0,
+			       datasync ? IORING_FSYNC_DATASYNC : 0, NULL, cb, data);
+}
+
+size_t
+uring_pending(void)
+{
+	size_t pending = uring_sync_pending;
+	if (uring_self && uring_self->pid == getpid())
+		pending += uring_self->inflight;
+	return pending;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file uring.h
+ *
+ * Asynchronous reads and writes on top of the event loop, e.g. to append to a
+ * log file or to copy a file in chunks without blocking the loop in each
+ * handler. Readiness of sockets and other fds is still handled by event_io_t.
+ *
+ * Each thread running an event loop gets its own io_uring whose fd is watched
+ * by the loop, thus completions are delivered in the loop of the thread which
+ * submitted the operation. If io_uring is not available (older kernels, or
+ * disabled by the io_uring_disabled sysctl or seccomp), or was turned off by
+ * uring_use(false), operations are executed synchronously instead and the
+ * callback is still invoked from the event loop, never from the submitting
+ * function itself.
+ *
+ * Pending operations keep the event loop running. A forked child does not
+ * share the ring of its parent; operations pending at fork are dropped in the
+ * child without invoking their callbacks.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Completion callback.
+ *
+ * @param res The number of bytes read or written (0 for fsync), or a negative errno.
+ * @param data The data pointer given on submission.
+ */
+typedef void (*uring_cb_t)(ssize_t res, void *data);
+
+/**
+ * Enables or disables io_uring for operations submitted by the calling thread
+ * from now on. Enabled by default.
+ */
+void
+uring_use(bool enable);
+
+/**
+ * Returns whether operations of the calling thread are submitted to an io_uring.
+ */
+bool
+uring_active(void);
+
+/**
+ * Reads up to len bytes from fd into buf, which has to stay valid until cb is invoked.
+ *
+ * @param offset The offset in the file or -1 to use (and update) the file position.
+ * @param cb Callback invoked in the event loop on completion, may be NULL.
+ * @return 0 if the operation was submitted, -1 otherwise (cb is not invoked).
+ */
+int
+uring_read(int fd, void *buf, size_t len, off_t offset, uring_cb_t cb, void *data);
+
+/**
+ * Writes len bytes of buf to fd, buf has to stay valid until cb is invoked.
+ * Like write(2), it may write less than len bytes. Writes to a file opened with
+ * O_APPEND are appended regardless of the offset.
+ *
+ * @param offset The offset in the file or -1 to use (and update) the file position.
+ * @param cb Callback invoked in the event loop on completion, may be NULL.
+ * @return 0 if the operation was submitted, -1 otherwise (cb is not invoked).
+ */
+int
+uring_write(int fd, const void *buf, size_t len, off_t offset, uring_cb_t cb, void *data);
+
+/**
+ * Like uring_write(), but takes ownership of buf, which has been allocated by
+ * mem_alloc() and is freed on completion, also if the submission fails. Allows
+ * to send off e.g. log records without keeping them around.
+ */
+int
+uring_write_free(int fd, void *buf, size_t len, off_t offset, uring_cb_t cb, void *data);
+
+/**
+ * Flushes the data of fd to the storage device (fdatasync(2) if datasync is set).
+ *
+ * @param cb Callback invoked in the event loop on completion, may be NULL.
+ * @return 0 if the operation was submitted, -1 otherwise (cb is not invoked).
+ */
+int
+uring_fsync(int fd, bool datasync, uring_cb_t cb, void *data);
+
+/**
+ * Returns the number of operations of the calling thread which have not completed yet.
+ */
+size_t
+uring_pending(void);
+
+#endif /* URING_H */
@@ -0,0 +1,212 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "munit.h"
+
+#include "uring.h"
+#include "event.h"
+#include "logf.h"
+#include "mem.h"
+#include "macro.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORDS 16
+
+static ssize_t results[RECORDS + 2];
+static int results_len;
+
+static void *
+setup(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	// Before every test, register a logger so that the logging functionality can run.
+	logf_register(&logf_test_write, stderr);
+	results_len = 0;
+	return NULL;
+}
+
+static void
+tear_down(UNUSED void *fixture)
+{
+	uring_use(true);
+	event_reset();
+}
+
+static void
+record_cb(ssize_t res, UNUSED void *data)
+{
+	munit_assert_int(results_len, <, (int)ELEMENTSOF(results));
+	results[results_len++] = res;
+}
+
+static int
+open_tmpfile(char *file, int flags)
+{
+	strcpy(file, "/tmp/uring.test.XXXXXX");
+	int fd = mkostemp(file, flags | O_CLOEXEC);
+	munit_assert_int(fd, >=, 0);
+	return fd;
+}
+
+static void
+check_write_read(bool use_uring)
+{
+	char file[32];
+	char buf[32] = { 0 };
+	const char *msg = "hello, ring";
+
+	uring_use(use_uring);
+	results_len = 0;
+	int fd = open_tmpfile(file, 0);
+
+	munit_assert_int(uring_write(fd, msg, strlen(msg), 0, record_cb, NULL), ==, 0);
+	// completions are only delivered by the event loop
+	munit_assert_int(results_len, ==, 0);
+	munit_assert_size(uring_pending(), ==, 1);
+	event_loop();
+	munit_assert_int(results_len, ==, 1);
+	munit_assert_int(results[0], ==, (ssize_t)strlen(msg));
+
+	munit_assert_int(uring_read(fd, buf, sizeof(buf), 7, record_cb, NULL), ==, 0);
+	event_loop();
+	munit_assert_int(results_len, ==, 2);
+	munit_assert_int(results[1], ==, (ssize_t)strlen(msg) - 7);
+	munit_assert_string_equal(buf, "ring");
+	munit_assert_size(uring_pending(), ==, 0);
+
+	close(fd);
+	unlink(file);
+}
+
+static MunitResult
+test_uring_write_read(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	check_write_read(true);
+	// same results for the synchronous fallback
+	check_write_read(false);
+	return MUNIT_OK;
+}
+
+static void
+check_append(bool use_uring)
+{
+	char file[32];
+	char expected[RECORDS * 8 + 1] = { 0 };
+	char buf[sizeof(expected)] = { 0 };
+
+	uring_use(use_uring);
+	results_len = 0;
+	int fd = open_tmpfile(file, O_APPEND);
+
+	// e.g. log records, which are sent off without keeping them around
+	for (int i = 0; i < RECORDS; i++) {
+		char *record = mem_printf("rec %03d", i);
+		strcat(expected, record);
+		int ret = uring_write_free(fd, record, strlen(record), -1, NULL, NULL);
+		munit_assert_int(ret, ==, 0);
+		// wait for each write, appends may complete out of order
+		event_loop();
+	}
+	munit_assert_int(uring_fsync(fd, true, record_cb, NULL), ==, 0);
+	event_loop();
+	munit_assert_int(results_len, ==, 1);
+	munit_assert_int(results[0], ==, 0);
+
+	munit_assert_int(pread(fd, buf, sizeof(buf) - 1, 0), ==, (ssize_t)strlen(expected));
+	munit_assert_string_equal(buf, expected);
+
+	close(fd);
+	unlink(file);
+}
+
+static MunitResult
+test_uring_append(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	check_append(true);
+	check_append(false);
+	return MUNIT_OK;
+}
+
+static MunitResult
+test_uring_errors(UNUSED const MunitParameter params[], UNUSED void *data)
+{
+	char buf[8];
+	int fds[2];
+
+	munit_assert_int(uring_read(-1, buf, sizeof(buf), 0, record_cb, NULL), ==, -1);
+
+	// errors of the operation itself are reported to the callback
+	munit_assert_int(pipe(fds), ==, 0);
+	munit_assert_int(uring_read(fds[1], buf, sizeof(buf), -1, record_cb, NULL), ==, 0);
+	event_loop();
+	munit_assert_int(results_len, ==, 1);
+	munit_assert_int(results[0], ==, -EBADF);
+
+	close(fds[0]);
+	close(fds[1]);
+	return MUNIT_OK;
+}
+
+static MunitTest tests[] = {
+	{
+		"uring_write_read",	/* name */
+		test_uring_write_read,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"uring_append",		/* name */
+		test_uring_append,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+	{
+		"uring_errors",		/* name */
+		test_uring_errors,	/* test */
+		setup,			/* setup */
+		tear_down,		/* tear_down */
+		MUNIT_TEST_OPTION_NONE, /* options */
+		NULL			/* parameters */
+	},
+
+	// Mark the end of the array with an entry where the test function is NULL
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+MunitSuite uring_suite = {
+	"test_uring: ",		/* name */
+	tests,			/* tests */
+	NULL,			/* suites */
+	1,			/* iterations */
+	MUNIT_SUITE_OPTION_NONE /* options */
+};
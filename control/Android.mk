@@ -45,7 +45,7 @@ LOCAL_SRC_FILES := $(CMLD_COMMON_SRC_FILES) \
 	container.proto \
 	control.c
 
-LOCAL_STATIC_LIBRARIES += libprotobuf-c-text libc
+LOCAL_STATIC_LIBRARIES += libprotobuf-c-text libz libc
 
 LOCAL_CFLAGS += $(CMLD_COMMON_CFLAGS)
 
@@ -0,0 +1,753 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/*
+ * Load generator for cmld: creates, starts, stops and destroys containers
+ * from several concurrent control connections and reports latency
+ * percentiles per phase as well as the resource usage of cmld as JSON.
+ */
+
+#ifdef ANDROID
+#include "device/fraunhofer/common/cml/control/control.pb-c.h"
+#include "device/fraunhofer/common/cml/control/container.pb-c.h"
+#else
+#include "control.pb-c.h"
+#include "container.pb-c.h"
+#endif
+
+//#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/protobuf.h"
+#include "common/sock.h"
+#include "common/file.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// clang-format off
+#define CONTROL_SOCKET SOCK_PATH(control)
+// clang-format on
+
+// interval in which the resource usage of cmld is sampled
+#define BENCH_SAMPLE_INTERVAL_MS 100
+
+// results of the workers are sent as lines "<phase>\t<microseconds>"
+// or "error\t<phase>", which are written atomically to the shared pipe
+#define BENCH_LINE_MAX 256
+
+typedef struct {
+	const char *socket_file;
+	uint8_t *cfg;
+	size_t cfg_len;
+	uint8_t *sig;
+	size_t sig_len;
+	uint8_t *cert;
+	size_t cert_len;
+	char *key;
+	int timeout_ms;
+} bench_config_t;
+
+typedef struct {
+	char *name;
+	double *values_ms;
+	size_t n;
+	size_t size;
+} bench_series_t;
+
+typedef struct {
+	pid_t pid;
+	long rss_start_kb;
+	long rss_peak_kb;
+	long rss_end_kb;
+	unsigned long long ticks_start;
+	unsigned long long ticks_end;
+	size_t samples;
+} bench_cmld_t;
+
+static int bench_result_fd = -1;
+
+static uint64_t
+bench_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+print_usage(const char *cmd)
+{
+	printf("\n");
+	printf("Usage: %s [-s <socket file>] [-n <containers>] [-c <concurrency>] [-k <key>]\n"
+	       "          [-p <cmld pid>] [-t <timeout>] <container.conf> [<container.sig> <container.cert>]\n",
+	       cmd);
+	printf("\n");
+	printf("Creates, starts, stops and destroys <containers> containers (default 10) from the\n"
+	       "given config with <concurrency> parallel control connections (default 1).\n"
+	       "Containers are started with the given key, each phase has to finish within\n"
+	       "<timeout> seconds (default 60). Latency percentiles per phase, per step of the\n"
+	       "container start trace and the resource usage of cmld are written to stdout as JSON.\n");
+	printf("\n");
+	exit(-1);
+}
+
+/******************************************************************************/
+
+static void
+bench_report(const char *phase, uint64_t us)
+{
+	char line[BENCH_LINE_MAX];
+	int len = snprintf(line, sizeof(line), "%s\t%" PRIu64 "\n", phase, us);
+	if (len > 0 && len < (int)sizeof(line) && write(bench_result_fd, line, len) != len)
+		WARN_ERRNO("Failed to report result of %s", phase);
+}
+
+static void
+bench_report_error(const char *phase)
+{
+	char line[BENCH_LINE_MAX];
+	int len = snprintf(line, sizeof(line), "error\t%s\n", phase);
+	if (len > 0 && len < (int)sizeof(line) && write(bench_result_fd, line, len) != len)
+		WARN_ERRNO("Failed to report error in %s", phase);
+}
+
+static int
+bench_send(int sock, ControllerToDaemon *msg)
+{
+	if (protobuf_send_message(sock, (ProtobufCMessage *)msg) < 0) {
+		ERROR("Failed to send command %d to cmld", msg->command);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+bench_update_state(const DaemonToController *resp, const char *uuid, ContainerState *state)
+{
+	for (size_t i = 0; i < resp->n_container_status; i++) {
+		if (!strcmp(resp->container_status[i]->uuid, uuid))
+			*state = resp->container_status[i]->state;
+	}
+}
+
+/*
+ * Receives messages until one with the given code arrives or the timeout
+ * expires. Status changes of the observed container received meanwhile
+ * update state.
+ */
+static DaemonToController *
+bench_recv(int sock, const bench_config_t *config, DaemonToController__Code code,
+	   const char *uuid, ContainerState *state)
+{
+	uint64_t deadline = bench_now_us() + (uint64_t)config->timeout_ms * 1000;
+
+	for (uint64_t now; (now = bench_now_us()) < deadline;) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		int ret = poll(&pfd, 1, (deadline - now + 999) / 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		DaemonToController *resp = (DaemonToController *)protobuf_recv_message(
+			sock, &daemon_to_controller__descriptor);
+		if (!resp) {
+			ERROR("Failed to receive message from cmld");
+			return NULL;
+		}
+		if (uuid && state && (resp->code == DAEMON_TO_CONTROLLER__CODE__STATUS_CHANGED ||
+				      resp->code == DAEMON_TO_CONTROLLER__CODE__CONTAINER_STATUS))
+			bench_update_state(resp, uuid, state);
+		if (resp->code == code)
+			return resp;
+		protobuf_free_message((ProtobufCMessage *)resp);
+	}
+
+	ERROR("Timeout waiting for message %d from cmld", code);
+	return NULL;
+}
+
+static int
+bench_wait_state(int sock, const bench_config_t *config, const char *uuid, ContainerState *state,
+		 ContainerState expected)
+{
+	while (*state != expected) {
+		DaemonToController *resp = bench_recv(
+			sock, config, DAEMON_TO_CONTROLLER__CODE__STATUS_CHANGED, uuid, state);
+		IF_NULL_RETVAL(resp, -1);
+		protobuf_free_message((ProtobufCMessage *)resp);
+	}
+	return 0;
+}
+
+static int
+bench_response(int sock, const bench_config_t *config, const char *uuid, ContainerState *state,
+	       DaemonToController__Response expected)
+{
+	DaemonToController *resp =
+		bench_recv(sock, config, DAEMON_TO_CONTROLLER__CODE__RESPONSE, uuid, state);
+	IF_NULL_RETVAL(resp, -1);
+
+	int ret = (resp->has_response && resp->response == expected) ? 0 : -1;
+	if (ret)
+		ERROR("Unexpected response %d from cmld", resp->has_response ? (int)resp->response : -1);
+	protobuf_free_message((ProtobufCMessage *)resp);
+	return ret;
+}
+
+/*
+ * Reports the duration of every step in the Chrome trace event JSON of
+ * the last container start, e.g. {"name":"c_vol_start_child",...,"dur":1234,...}.
+ */
+static void
+bench_report_start_trace(const char *json)
+{
+	const char *key = "{\"name\":\"";
+	for (const char *p = strstr(json, key); p; p = strstr(p, key)) {
+		p += strlen(key);
+		const char *end = strchr(p, '"');
+		const char *dur = strstr(p, "\"dur\":");
+		if (!end || !dur)
+			break;
+
+		char phase[BENCH_LINE_MAX - 32];
+		int len = snprintf(phase, sizeof(phase), "trace:%.*s", (int)(end - p), p);
+		if (len > 0 && len < (int)sizeof(phase))
+			bench_report(phase, strtoull(dur + strlen("\"dur\":"), NULL, 10));
+	}
+}
+
+static char *
+bench_create(int sock, const bench_config_t *config)
+{
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__CREATE_CONTAINER;
+	msg.has_container_config_file = true;
+	msg.container_config_file.data = config->cfg;
+	msg.container_config_file.len = config->cfg_len;
+	if (config->sig && config->cert) {
+		msg.has_container_config_signature = true;
+		msg.container_config_signature.data = config->sig;
+		msg.container_config_signature.len = config->sig_len;
+		msg.has_container_config_certificate = true;
+		msg.container_config_certificate.data = config->cert;
+		msg.container_config_certificate.len = config->cert_len;
+	}
+
+	uint64_t start = bench_now_us();
+	IF_TRUE_RETVAL(bench_send(sock, &msg), NULL);
+
+	DaemonToController *resp =
+		bench_recv(sock, config, DAEMON_TO_CONTROLLER__CODE__CONTAINER_CONFIG, NULL, NULL);
+	IF_NULL_RETVAL(resp, NULL);
+
+	char *uuid = NULL;
+	if (resp->n_container_uuids == 1) {
+		uuid = mem_strdup(resp->container_uuids[0]);
+		bench_report("create", bench_now_us() - start);
+	} else {
+		ERROR("cmld failed to create container");
+	}
+
+	protobuf_free_message((ProtobufCMessage *)resp);
+	return uuid;
+}
+
+static int
+bench_start(int sock, const bench_config_t *config, char *uuid, ContainerState *state)
+{
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	ContainerStartParams params = CONTAINER_START_PARAMS__INIT;
+	params.key = config->key;
+	msg.n_container_uuids = 1;
+	msg.container_uuids = &uuid;
+
+	// observe the container to be notified when it is up
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_STATUS_START;
+	IF_TRUE_RETVAL(bench_send(sock, &msg), -1);
+	DaemonToController *resp =
+		bench_recv(sock, config, DAEMON_TO_CONTROLLER__CODE__CONTAINER_STATUS, uuid, state);
+	IF_NULL_RETVAL(resp, -1);
+	protobuf_free_message((ProtobufCMessage *)resp);
+
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START;
+	msg.container_start_params = &params;
+
+	uint64_t start = bench_now_us();
+	IF_TRUE_RETVAL(bench_send(sock, &msg), -1);
+	IF_TRUE_RETVAL(bench_response(sock, config, uuid, state,
+				      DAEMON_TO_CONTROLLER__RESPONSE__CONTAINER_START_OK),
+		       -1);
+	IF_TRUE_RETVAL(bench_wait_state(sock, config, uuid, state, CONTAINER_STATE__RUNNING), -1);
+	bench_report("start", bench_now_us() - start);
+
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_START_TRACE;
+	msg.container_start_params = NULL;
+	IF_TRUE_RETVAL(bench_send(sock, &msg), 0);
+	resp = bench_recv(sock, config, DAEMON_TO_CONTROLLER__CODE__CONTAINER_START_TRACE, uuid,
+			  state);
+	IF_NULL_RETVAL(resp, 0);
+	if (resp->container_start_trace)
+		bench_report_start_trace(resp->container_start_trace);
+	protobuf_free_message((ProtobufCMessage *)resp);
+
+	return 0;
+}
+
+static int
+bench_stop(int sock, const bench_config_t *config, char *uuid, ContainerState *state)
+{
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	ContainerStartParams params = CONTAINER_START_PARAMS__INIT;
+	params.key = config->key;
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP;
+	msg.container_start_params = &params;
+	msg.n_container_uuids = 1;
+	msg.container_uuids = &uuid;
+
+	uint64_t start = bench_now_us();
+	IF_TRUE_RETVAL(bench_send(sock, &msg), -1);
+	IF_TRUE_RETVAL(bench_response(sock, config, uuid, state,
+				      DAEMON_TO_CONTROLLER__RESPONSE__CONTAINER_STOP_OK),
+		       -1);
+	IF_TRUE_RETVAL(bench_wait_state(sock, config, uuid, state, CONTAINER_STATE__STOPPED), -1);
+	bench_report("stop", bench_now_us() - start);
+
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_STATUS_STOP;
+	msg.container_start_params = NULL;
+	return bench_send(sock, &msg);
+}
+
+static int
+bench_destroy(int sock, const bench_config_t *config, char *uuid)
+{
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__REMOVE_CONTAINER;
+	msg.n_container_uuids = 1;
+	msg.container_uuids = &uuid;
+
+	uint64_t start = bench_now_us();
+	IF_TRUE_RETVAL(bench_send(sock, &msg), -1);
+
+	// REMOVE_CONTAINER has no response, commands on a connection are handled
+	// in order, so the answer to the next one marks its completion
+	ControllerToDaemon list = CONTROLLER_TO_DAEMON__INIT;
+	list.command = CONTROLLER_TO_DAEMON__COMMAND__LIST_CONTAINERS;
+	IF_TRUE_RETVAL(bench_send(sock, &list), -1);
+	DaemonToController *resp =
+		bench_recv(sock, config, DAEMON_TO_CONTROLLER__CODE__CONTAINERS_LIST, NULL, NULL);
+	IF_NULL_RETVAL(resp, -1);
+
+	int ret = 0;
+	for (size_t i = 0; i < resp->n_container_uuids; i++) {
+		if (!strcmp(resp->container_uuids[i], uuid)) {
+			ERROR("Container %s still exists after removal", uuid);
+			ret = -1;
+		}
+	}
+	protobuf_free_message((ProtobufCMessage *)resp);
+
+	if (!ret)
+		bench_report("destroy", bench_now_us() - start);
+	return ret;
+}
+
+static void
+bench_container_cleanup(int sock, const bench_config_t *config, char *uuid, ContainerState *state)
+{
+	if (*state != CONTAINER_STATE__STOPPED)
+		bench_stop(sock, config, uuid, state);
+	bench_destroy(sock, config, uuid);
+}
+
+static int
+bench_worker(const bench_config_t *config, int worker, int concurrency, int n)
+{
+	int sock = sock_unix_create_and_connect(SOCK_STREAM, config->socket_file);
+	if (sock < 0) {
+		ERROR("Worker %d failed to connect to %s", worker, config->socket_file);
+		return -1;
+	}
+
+	for (int i = worker; i < n; i += concurrency) {
+		ContainerState state = CONTAINER_STATE__STOPPED;
+		char *uuid = bench_create(sock, config);
+		if (!uuid) {
+			bench_report_error("create");
+			continue;
+		}
+
+		if (bench_start(sock, config, uuid, &state)) {
+			bench_report_error("start");
+			bench_container_cleanup(sock, config, uuid, &state);
+		} else if (bench_stop(sock, config, uuid, &state)) {
+			bench_report_error("stop");
+			bench_container_cleanup(sock, config, uuid, &state);
+		} else if (bench_destroy(sock, config, uuid)) {
+			bench_report_error("destroy");
+		}
+
+		mem_free(uuid);
+	}
+
+	close(sock);
+	return 0;
+}
+
+/******************************************************************************/
+
+static pid_t
+bench_cmld_find(void)
+{
+	DIR *dir = opendir("/proc");
+	IF_NULL_RETVAL(dir, -1);
+
+	pid_t pid = -1;
+	for (struct dirent *de; pid < 0 && (de = readdir(dir));) {
+		char *end;
+		long p = strtol(de->d_name, &end, 10);
+		if (*end)
+			continue;
+
+		char *comm_file = mem_printf("/proc/%ld/comm", p);
+		char *comm = file_read_new(comm_file, 64);
+		if (comm && !strcmp(comm, "cmld\n"))
+			pid = p;
+		mem_free(comm);
+		mem_free(comm_file);
+	}
+
+	closedir(dir);
+	return pid;
+}
+
+static int
+bench_cmld_sample(bench_cmld_t *cmld)
+{
+	char path[64];
+	long pages = 0;
+	unsigned long long utime = 0, stime = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/statm", cmld->pid);
+	FILE *f = fopen(path, "r");
+	IF_NULL_RETVAL(f, -1);
+	int ret = fscanf(f, "%*s %ld", &pages);
+	fclose(f);
+	IF_FALSE_RETVAL(ret == 1, -1);
+
+	// utime and stime are fields 14 and 15, the command before may contain spaces
+	snprintf(path, sizeof(path), "/proc/%d/stat", cmld->pid);
+	char *stat = file_read_new(path, 1024);
+	IF_NULL_RETVAL(stat, -1);
+	char *p = strrchr(stat, ')');
+	ret = p ? sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime,
+			 &stime) :
+		  0;
+	mem_free(stat);
+	IF_FALSE_RETVAL(ret == 2, -1);
+
+	long rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+	if (!cmld->samples++) {
+		cmld->rss_start_kb = rss_kb;
+		cmld->ticks_start = utime + stime;
+	}
+	cmld->rss_peak_kb = MAX(cmld->rss_peak_kb, rss_kb);
+	cmld->rss_end_kb = rss_kb;
+	cmld->ticks_end = utime + stime;
+
+	return 0;
+}
+
+static bench_series_t *
+bench_series_get(list_t **series, const char *name)
+{
+	for (list_t *l = *series; l; l = l->next) {
+		bench_series_t *s = l->data;
+		if (!strcmp(s->name, name))
+			return s;
+	}
+
+	bench_series_t *s = mem_new0(bench_series_t, 1);
+	s->name = mem_strdup(name);
+	*series = list_append(*series, s);
+	return s;
+}
+
+static void
+bench_series_add(bench_series_t *s, double ms)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? 2 * s->size : 16;
+		s->values_ms = mem_renew(double, s->values_ms, s->size);
+	}
+	s->values_ms[s->n++] = ms;
+}
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double
+bench_percentile(const bench_series_t *s, int p)
+{
+	// nearest rank of the sorted values
+	size_t rank = (s->n * p + 99) / 100;
+	return s->values_ms[rank ? rank - 1 : 0];
+}
+
+static void
+bench_print_series(list_t *series, bool trace)
+{
+	bool first = true;
+	for (list_t *l = series; l; l = l->next) {
+		bench_series_t *s = l->data;
+		bool is_trace = !strncmp(s->name, "trace:", 6);
+		if (is_trace != trace)
+			continue;
+
+		qsort(s->values_ms, s->n, sizeof(double), bench_cmp_double);
+		printf("%s\n    \"%s\": { \"count\": %zu, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+		       "\"p99_ms\": %.3f, \"max_ms\": %.3f }",
+		       first ? "" : ",", trace ? s->name + 6 : s->name, s->n,
+		       bench_percentile(s, 50), bench_percentile(s, 90), bench_percentile(s, 99),
+		       s->values_ms[s->n - 1]);
+		first = false;
+	}
+	printf("\n  }");
+}
+
+/*
+ * Collects the results of the workers from the pipe until all of them
+ * closed it and samples cmld meanwhile.
+ */
+static void
+bench_collect(int fd, list_t **series, list_t **errors, bench_cmld_t *cmld)
+{
+	char buf[4 * BENCH_LINE_MAX];
+	size_t len = 0;
+	uint64_t next_sample = 0;
+
+	for (;;) {
+		uint64_t now = bench_now_us();
+		if (cmld->pid > 0 && now >= next_sample) {
+			if (bench_cmld_sample(cmld))
+				WARN("Failed to sample cmld (pid %d)", cmld->pid);
+			next_sample = now + BENCH_SAMPLE_INTERVAL_MS * 1000;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, BENCH_SAMPLE_INTERVAL_MS) <= 0)
+			continue;
+
+		ssize_t ret = read(fd, buf + len, sizeof(buf) - len - 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+		buf[len] = '\0';
+
+		char *line = buf, *nl;
+		while ((nl = strchr(line, '\n'))) {
+			*nl = '\0';
+			char *tab = strchr(line, '\t');
+			if (tab) {
+				*tab = '\0';
+				if (!strcmp(line, "error"))
+					bench_series_add(bench_series_get(errors, tab + 1), 0);
+				else
+					bench_series_add(bench_series_get(series, line),
+							 strtoull(tab + 1, NULL, 10) / 1000.0);
+			}
+			line = nl + 1;
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+	}
+
+	if (cmld->pid > 0)
+		bench_cmld_sample(cmld);
+}
+
+static uint8_t *
+bench_read_file_new(const char *file, size_t *len)
+{
+	off_t size = file_size(file);
+	if (size < 0)
+		FATAL("Error accessing %s.", file);
+
+	uint8_t *buf = mem_alloc(size);
+	if (file_read(file, (char *)buf, size) < 0)
+		FATAL("Error reading %s. Aborting.", file);
+
+	*len = size;
+	return buf;
+}
+
+static const struct option global_options[] = { { "socket", required_argument, 0, 's' },
+						{ "containers", required_argument, 0, 'n' },
+						{ "concurrency", required_argument, 0, 'c' },
+						{ "key", required_argument, 0, 'k' },
+						{ "pid", required_argument, 0, 'p' },
+						{ "timeout", required_argument, 0, 't' },
+						{ "help", no_argument, 0, 'h' },
+						{ 0, 0, 0, 0 } };
+
+int
+main(int argc, char *argv[])
+{
+	logf_register(&logf_test_write, stderr);
+
+	bench_config_t config = { .socket_file = CONTROL_SOCKET, .timeout_ms = 60 * 1000 };
+	int n = 10, concurrency = 1;
+	bench_cmld_t cmld = { .pid = -1 };
+
+	for (int c, option_index = 0;
+	     - 1 != (c = getopt_long(argc, argv, "+s:n:c:k:p:t:h", global_options,
+				     &option_index));) {
+		switch (c) {
+		case 's':
+			config.socket_file = optarg;
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'k':
+			config.key = optarg;
+			break;
+		case 'p':
+			cmld.pid = atoi(optarg);
+			break;
+		case 't':
+			config.timeout_ms = atoi(optarg) * 1000;
+			break;
+		default: // includes cases 'h' and '?'
+			print_usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc || n <= 0 || concurrency <= 0 || config.timeout_ms <= 0)
+		print_usage(argv[0]);
+	concurrency = MIN(concurrency, n);
+
+	if (!file_exists(config.socket_file))
+		FATAL("Could not find socket file %s. Aborting.\n", config.socket_file);
+
+	config.cfg = bench_read_file_new(argv[optind++], &config.cfg_len);
+	if (optind + 1 < argc) {
+		config.sig = bench_read_file_new(argv[optind++], &config.sig_len);
+		config.cert = bench_read_file_new(argv[optind++], &config.cert_len);
+	}
+
+	if (cmld.pid <= 0)
+		cmld.pid = bench_cmld_find();
+	if (cmld.pid <= 0)
+		WARN("Could not find cmld, its resource usage is not reported");
+
+	int pipefd[2];
+	if (pipe(pipefd))
+		FATAL_ERRNO("Failed to create result pipe");
+
+	uint64_t start = bench_now_us();
+	for (int w = 0; w < concurrency; w++) {
+		pid_t pid = fork();
+		if (pid < 0)
+			FATAL_ERRNO("Failed to fork worker %d", w);
+		if (pid == 0) {
+			close(pipefd[0]);
+			bench_result_fd = pipefd[1];
+			_exit(bench_worker(&config, w, concurrency, n) ? 1 : 0);
+		}
+	}
+	close(pipefd[1]);
+
+	list_t *series = NULL, *errors = NULL;
+	bench_collect(pipefd[0], &series, &errors, &cmld);
+	close(pipefd[0]);
+
+	int failed_workers = 0;
+	for (int status; wait(&status) > 0;) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed_workers++;
+	}
+	uint64_t wall_us = bench_now_us() - start;
+
+	printf("{\n  \"containers\": %d,\n  \"concurrency\": %d,\n  \"wall_s\": %.3f,\n", n,
+	       concurrency, wall_us / 1e6);
+	printf("  \"failed_workers\": %d,\n  \"errors\": {", failed_workers);
+	for (list_t *l = errors; l; l = l->next) {
+		bench_series_t *s = l->data;
+		printf("%s \"%s\": %zu", l == errors ? "" : ",", s->name, s->n);
+	}
+	printf(" },\n  \"phases\": {");
+	bench_print_series(series, false);
+	printf(",\n  \"start_trace\": {");
+	bench_print_series(series, true);
+	if (cmld.samples > 0) {
+		long ticks_per_s = sysconf(_SC_CLK_TCK);
+		double cpu_s = (double)(cmld.ticks_end - cmld.ticks_start) / ticks_per_s;
+		printf(",\n  \"cmld\": { \"pid\": %d, \"rss_start_kb\": %ld, \"rss_peak_kb\": %ld, "
+		       "\"rss_end_kb\": %ld, \"cpu_s\": %.2f, \"cpu_pct\": %.1f }",
+		       cmld.pid, cmld.rss_start_kb, cmld.rss_peak_kb, cmld.rss_end_kb, cpu_s,
+		       cpu_s * 100 / (wall_us / 1e6));
+	}
+	printf("\n}\n");
+
+	for (list_t *l = series; l; l = l->next) {
+		bench_series_t *s = l->data;
+		mem_free(s->name);
+		mem_free(s->values_ms);
+		mem_free(s);
+	}
+	list_delete(series);
+	for (list_t *l = errors; l; l = l->next) {
+		bench_series_t *s = l->data;
+		mem_free(s->name);
+		mem_free(s->values_ms);
+		mem_free(s);
+	}
+	list_delete(errors);
+	mem_free(config.cfg);
+	mem_free(config.sig);
+	mem_free(config.cert);
+
+	return (errors || failed_workers) ? 1 : 0;
+}
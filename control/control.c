@@ -39,7 +39,9 @@
 #include "common/uuid.h"
 
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -53,6 +55,33 @@
 #define DEFAULT_KEY                                                                                \
 	"00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
 
+// number of requests in flight in batch mode
+#define CONTROL_BATCH_WINDOW 32
+#define CONTROL_BATCH_MAX_ARGS 64
+
+/*
+ * How cmld answers a request sent by control_send_command().
+ */
+typedef struct control_request {
+	bool has_response;
+	const char *csr_file; // file the device csr of the response is written to
+	uuid_t *run_uuid;     // container of a run command, output follows until its end
+	bool exec_pty;
+} control_request_t;
+
+static const char *control_prog = NULL;
+static bool control_batch_mode = false;
+
+// responses which have not been read yet, by the csr file of the request
+static char *control_pending[CONTROL_BATCH_WINDOW];
+static size_t control_pending_len = 0;
+
+// status of all containers, caches the mapping of names to uuids
+static DaemonToController *control_containers = NULL;
+
+static void
+control_pending_drain(int sock);
+
 static void
 print_usage(const char *cmd)
 {
@@ -70,6 +99,18 @@ print_usage(const char *cmd)
 	       "        Wipes all containers on the device.\n\n");
 	printf("   reboot\n"
 	       "        Reboots the whole device, shutting down any containers which are running.\n\n");
+	printf("   live_restart\n"
+	       "        Restarts cmld in place, keeping running containers alive.\n\n");
+	printf("   event_stats [--start|--stop]\n"
+	       "        Prints the instrumentation data of cmld's event loop,\n"
+	       "        or starts/stops collecting it.\n\n");
+	printf("   mem_stats\n"
+	       "        Prints the allocation profile of cmld per call site, per subsystem\n"
+	       "        and per container, which is only collected if cmld has been built\n"
+	       "        with MEM_PROFILE=y.\n\n");
+	printf("   log_level <trace|debug|info|warn|error|silent> [<module>]\n"
+	       "        Sets the log level of cmld for the given source file (e.g. uevent)\n"
+	       "        or for all others.\n\n");
 	printf("   set_provisioned\n"
 	       "        Sets the device to provisioned state which limits certain commands\n\n");
 	printf("   create <container.conf> [<container.sig> <container.cert>]\n"
@@ -91,6 +132,15 @@ print_usage(const char *cmd)
 	       "        and optionally signature and certificate files\n\n");
 	printf("   state <container-uuid>\n"
 	       "        Prints the state of the specified container.\n\n");
+	printf("   start_trace <container-uuid>\n"
+	       "        Prints the timing of the last start of the specified container\n"
+	       "        in the Chrome trace event format.\n\n");
+	printf("   net_stats <container-uuid>\n"
+	       "        Prints the packet and byte counters of the network interfaces\n"
+	       "        of the specified container.\n\n");
+	printf("   accounting <container-uuid>\n"
+	       "        Prints the recent cpu, memory, io and network usage samples\n"
+	       "        of the specified container, if accounting is enabled.\n\n");
 	printf("   freeze <container-uuid>\n"
 	       "        Freeze the specified container.\n\n");
 	printf("   unfreeze <container-uuid>\n"
@@ -101,6 +151,10 @@ print_usage(const char *cmd)
 	       "        Deny audio access to the specified container (cgroups).\n\n");
 	printf("   wipe <container-uuid>\n"
 	       "        Wipes the specified container.\n\n");
+	printf("   set_io <container-uuid> <weight>"
+	       " [<read_bps> <write_bps> <read_iops> <write_iops>]\n"
+	       "        Sets the io weight (1-10000, default 100) and the limits (0 for\n"
+	       "        unlimited) of the specified container until it is restarted.\n\n");
 	printf("   push_guestos_config <guestos.conf> <guestos.sig> <guestos.pem>\n"
 	       "        Pushes the specified GuestOS config, signature, and certificate files.\n\n");
 	printf("   remove_guestos <guestos name>\n"
@@ -124,6 +178,11 @@ print_usage(const char *cmd)
 	       "        Prints the list of network interfaces assigned to the specified container.\n\n");
 	printf("   run <container-uuid> <command> [<arg_1> ... <arg_n>]\n"
 	       "        Runs the specified command with the given arguments inside the specified container.\n\n");
+	printf("   batch\n"
+	       "        Reads commands from stdin, one per line, and sends them over a single\n"
+	       "        connection. Requests are pipelined and container names are looked up\n"
+	       "        only once. start and stop need --key, run and change_pin are not\n"
+	       "        supported. The batch stops at the first invalid command.\n\n");
 	printf("\n");
 	exit(-1);
 }
@@ -159,6 +218,10 @@ static bool
 get_container_usb_pin_entry(uuid_t *uuid, int sock)
 {
 	bool pin_entry = false;
+
+	// the response must not be mixed up with those of pipelined requests
+	control_pending_drain(sock);
+
 	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
 	msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CMLD_HANDLES_PIN;
 	msg.n_container_uuids = 1;
@@ -184,15 +247,19 @@ get_container_usb_pin_entry(uuid_t *uuid, int sock)
 	return pin_entry;
 }
 
+static void
+control_containers_flush(void)
+{
+	if (control_containers)
+		protobuf_free_message((ProtobufCMessage *)control_containers);
+	control_containers = NULL;
+}
+
 static uuid_t *
-get_container_uuid_new(const char *identifier, int sock)
+get_container_uuid_cached_new(const char *identifier)
 {
 	uuid_t *valid_uuid = NULL;
-	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
-	msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS;
-	send_message(sock, &msg);
-
-	DaemonToController *resp = recv_message(sock);
+	DaemonToController *resp = control_containers;
 
 	uuid_t *uuid = uuid_new(identifier);
 	if (uuid) {
@@ -215,11 +282,30 @@ get_container_uuid_new(const char *identifier, int sock)
 			}
 		}
 	}
-	if (!valid_uuid)
+	return valid_uuid;
+}
+
+static uuid_t *
+get_container_uuid_new(const char *identifier, int sock)
+{
+	uuid_t *uuid = control_containers ? get_container_uuid_cached_new(identifier) : NULL;
+	if (uuid)
+		return uuid;
+
+	// not known yet or the cached list is outdated
+	control_pending_drain(sock);
+	control_containers_flush();
+
+	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
+	msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS;
+	send_message(sock, &msg);
+
+	control_containers = recv_message(sock);
+
+	if (!(uuid = get_container_uuid_cached_new(identifier)))
 		FATAL("Container with provided uuid/name does not exist!");
 
-	protobuf_free_message((ProtobufCMessage *)resp);
-	return valid_uuid;
+	return uuid;
 }
 
 static const struct option global_options[] = { { "socket", required_argument, 0, 's' },
@@ -263,38 +349,17 @@ get_password_new(const char *prompt)
 	return mem_strdup(buf);
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * Parses the command at argv[optind] along with its arguments and sends the
+ * resulting request to cmld. How cmld answers the request is returned in req.
+ */
+static void
+control_send_command(int argc, char *argv[], int sock, control_request_t *req)
 {
-	logf_register(&logf_test_write, stderr);
-
 	bool has_response = false;
-	const char *socket_file = CONTROL_SOCKET;
 	uuid_t *uuid = NULL;
-	int sock = 0;
 	bool has_container_start_params_key = false;
 
-	struct termios termios_before;
-	tcgetattr(STDIN_FILENO, &termios_before);
-
-	for (int c, option_index = 0;
-	     - 1 != (c = getopt_long(argc, argv, "+s:h", global_options, &option_index));) {
-		switch (c) {
-		case 's':
-			socket_file = optarg;
-			break;
-		default: // includes cases 'h' and '?'
-			print_usage(argv[0]);
-		}
-	}
-
-	if (!file_exists(socket_file))
-		FATAL("Could not find socket file %s. Aborting.\n", socket_file);
-
-	// need at least one more argument (i.e. command string)
-	if (optind >= argc)
-		print_usage(argv[0]);
-
 	// build ControllerToDaemon message
 	ControllerToDaemon msg = CONTROLLER_TO_DAEMON__INIT;
 
@@ -324,6 +389,45 @@ main(int argc, char *argv[])
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__REBOOT_DEVICE;
 		goto send_message;
 	}
+	if (!strcasecmp(command, "live_restart")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__LIVE_RESTART;
+		goto send_message;
+	}
+	if (!strcasecmp(command, "event_stats")) {
+		if (optind < argc && !strcmp(argv[optind], "--start")) {
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__EVENT_STATS_START;
+		} else if (optind < argc && !strcmp(argv[optind], "--stop")) {
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__EVENT_STATS_STOP;
+		} else {
+			msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_EVENT_STATS;
+			has_response = true;
+		}
+		goto send_message;
+	}
+	if (!strcasecmp(command, "mem_stats")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_MEM_STATS;
+		has_response = true;
+		goto send_message;
+	}
+	if (!strcasecmp(command, "log_level")) {
+		static const char *const prios[] = { "trace", "debug", "info",
+						     "warn",  "error", "fatal", "silent" };
+		if (optind >= argc)
+			print_usage(control_prog);
+
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__SET_LOG_LEVEL;
+		for (size_t i = 0; i < sizeof(prios) / sizeof(prios[0]); i++) {
+			if (!strcasecmp(argv[optind], prios[i])) {
+				msg.has_log_prio = true;
+				msg.log_prio = LOG_PRIORITY__TRACE + i;
+			}
+		}
+		if (!msg.has_log_prio)
+			print_usage(control_prog);
+		if (++optind < argc)
+			msg.log_module = argv[optind];
+		goto send_message;
+	}
 	if (!strcasecmp(command, "set_provisioned")) {
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__SET_PROVISIONED;
 		// TODO has response necessary?
@@ -332,7 +436,7 @@ main(int argc, char *argv[])
 	if (!strcasecmp(command, "push_guestos_config")) {
 		has_response = true;
 		if (optind + 2 >= argc)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		const char *cfgfile = argv[optind++];
 		off_t cfglen = file_size(cfgfile);
@@ -377,7 +481,7 @@ main(int argc, char *argv[])
 	if (!strcasecmp(command, "remove_guestos")) {
 		// need exactly one more argument (container config file)
 		if (optind != argc - 1)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		char *os_name = argv[optind++];
 		INFO("Removing Guestos: %s", os_name);
@@ -389,7 +493,7 @@ main(int argc, char *argv[])
 	if (!strcasecmp(command, "ca_register")) {
 		// need exactly one more argument (container config file)
 		if (optind != argc - 1)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		const char *ca_cert_file = argv[optind++];
 		off_t ca_cert_len = file_size(ca_cert_file);
@@ -410,7 +514,7 @@ main(int argc, char *argv[])
 	if (!strcasecmp(command, "pull_csr")) {
 		// need exactly one more argument (certificate file)
 		if (optind != argc - 1)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		has_response = true;
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__PULL_DEVICE_CSR;
@@ -420,7 +524,7 @@ main(int argc, char *argv[])
 		has_response = true;
 		// need exactly one more argument (certificate file)
 		if (optind != argc - 1)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		const char *dev_cert_file = argv[optind++];
 		off_t dev_cert_len = file_size(dev_cert_file);
@@ -442,7 +546,7 @@ main(int argc, char *argv[])
 		has_response = true;
 		// need at least one more argument (container config)
 		if (optind >= argc)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		const char *cfgfile = argv[optind++];
 		off_t cfglen = file_size(cfgfile);
@@ -495,12 +599,12 @@ main(int argc, char *argv[])
 
 	// need at least one more argument (container string)
 	if (optind >= argc)
-		print_usage(argv[0]);
+		print_usage(control_prog);
 
-	sock = sock_connect(socket_file);
 	uuid = get_container_uuid_new(argv[optind], sock);
 
 	ContainerStartParams container_start_params = CONTAINER_START_PARAMS__INIT;
+	ContainerIoConfig container_io_config = CONTAINER_IO_CONFIG__INIT;
 	if (!strcasecmp(command, "remove")) {
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__REMOVE_CONTAINER;
 	} else if (!strcasecmp(command, "start")) {
@@ -527,7 +631,7 @@ main(int argc, char *argv[])
 				container_start_params.setup = true;
 				break;
 			default:
-				print_usage(argv[0]);
+				print_usage(control_prog);
 				ASSERT(false); // never reached
 			}
 		}
@@ -536,6 +640,9 @@ main(int argc, char *argv[])
 		if (usb_pin_entry) {
 			printf("Please Enter your password via pin reader\n");
 		} else if (ask_for_password) {
+			// stdin carries the commands
+			if (control_batch_mode)
+				FATAL("Command %s needs --key in batch mode", command);
 			container_start_params.key = get_password_new("Password: ");
 			has_container_start_params_key = true;
 		}
@@ -561,7 +668,7 @@ main(int argc, char *argv[])
 				ask_for_password = false;
 				break;
 			default:
-				print_usage(argv[0]);
+				print_usage(control_prog);
 				ASSERT(false); // never reached
 			}
 		}
@@ -570,6 +677,9 @@ main(int argc, char *argv[])
 		if (usb_pin_entry) {
 			printf("Please Enter your password via pin reader\n");
 		} else if (ask_for_password) {
+			// stdin carries the commands
+			if (control_batch_mode)
+				FATAL("Command %s needs --key in batch mode", command);
 			container_start_params.key = get_password_new("Password: ");
 			has_container_start_params_key = true;
 		}
@@ -590,6 +700,15 @@ main(int argc, char *argv[])
 	} else if (!strcasecmp(command, "state")) {
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS;
 		has_response = true;
+	} else if (!strcasecmp(command, "start_trace")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_START_TRACE;
+		has_response = true;
+	} else if (!strcasecmp(command, "net_stats")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_NET_STATS;
+		has_response = true;
+	} else if (!strcasecmp(command, "accounting")) {
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_ACCOUNTING;
+		has_response = true;
 	} else if (!strcasecmp(command, "config")) {
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_CONFIG;
 		has_response = true;
@@ -598,7 +717,7 @@ main(int argc, char *argv[])
 		optind++;
 		// need at least one more argument (container config)
 		if (optind >= argc)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		const char *cfgfile = argv[optind++];
 		off_t cfglen = file_size(cfgfile);
@@ -642,6 +761,26 @@ main(int argc, char *argv[])
 			msg.container_config_certificate.len = certlen;
 			msg.container_config_certificate.data = cert;
 		}
+	} else if (!strcasecmp(command, "set_io")) {
+		optind++;
+		// need the weight and either none or all limits
+		if (optind >= argc || (argc - optind != 1 && argc - optind != 5))
+			print_usage(control_prog);
+
+		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_SET_IO;
+		msg.container_io_config = &container_io_config;
+		container_io_config.has_weight = true;
+		container_io_config.weight = strtoul(argv[optind++], NULL, 10);
+		if (optind < argc) {
+			container_io_config.has_read_bps = true;
+			container_io_config.read_bps = strtoull(argv[optind++], NULL, 10);
+			container_io_config.has_write_bps = true;
+			container_io_config.write_bps = strtoull(argv[optind++], NULL, 10);
+			container_io_config.has_read_iops = true;
+			container_io_config.read_iops = strtoul(argv[optind++], NULL, 10);
+			container_io_config.has_write_iops = true;
+			container_io_config.write_iops = strtoul(argv[optind++], NULL, 10);
+		}
 	} else if (!strcasecmp(command, "ifaces")) {
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_LIST_IFACES;
 		has_response = true;
@@ -665,7 +804,7 @@ main(int argc, char *argv[])
 				assign_iface_params.persistent = true;
 				break;
 			default:
-				print_usage(argv[0]);
+				print_usage(control_prog);
 				ASSERT(false); // never reached
 			}
 		}
@@ -680,7 +819,7 @@ main(int argc, char *argv[])
 	} else if (!strcasecmp(command, "run")) {
 		optind++;
 		if (optind > argc - 1)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		has_response = true;
 		msg.command = CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_CMD;
@@ -698,7 +837,7 @@ main(int argc, char *argv[])
 		}
 
 		if (optind > argc - 1)
-			print_usage(argv[0]);
+			print_usage(control_prog);
 
 		msg.exec_command = argv[optind];
 
@@ -734,152 +873,35 @@ main(int argc, char *argv[])
 
 		mem_free(newpin_verify);
 	} else
-		print_usage(argv[0]);
+		print_usage(control_prog);
 
 	msg.n_container_uuids = 1;
 	msg.container_uuids = mem_new(char *, 1);
 	msg.container_uuids[0] = mem_strdup(uuid_string(uuid));
 
 send_message:
-	if (!sock)
-		sock = sock_connect(socket_file);
 	send_message(sock, &msg);
 
+	req->has_response = has_response;
 	if (!strcasecmp(command, "run")) {
-		TRACE("[CLIENT] Processing response for run command");
-
-		if (msg.exec_pty) {
-			TRACE("[CLIENT] Setting termios for PTY");
-			struct termios termios_run = termios_before;
-			termios_run.c_cflag &= ~(ICRNL | IXON | IXOFF);
-			termios_run.c_oflag &= ~(OPOST);
-			termios_run.c_lflag &= ~(ISIG | ICANON | ECHO | ECHOCTL);
-			tcsetattr(STDIN_FILENO, TCSANOW, &termios_run);
-		}
-
 		//free exec arguments
 		TRACE("[CLIENT] Freeing %zu args at %p", msg.n_exec_args, (void *)msg.exec_args);
 		mem_free_array((void **)msg.exec_args, msg.n_exec_args);
 		TRACE("[CLIENT] after free ");
 
-		int pid = fork();
-
-		if (pid == -1) {
-			ERROR("[CLIENT] Failed to fork(), exiting...\n");
-			goto exit;
-		} else if (pid == 0) {
-			TRACE("[CLIENT] User input reading child forked, PID: %i", getpid());
-
-			char buf[128];
-			unsigned int count;
-
-			while (1) {
-				TRACE("[CLIENT] Trying to read input for exec'ed process");
-
-				if ((count = read(STDIN_FILENO, buf, 127)) > 0) {
-					buf[count] = 0;
-
-					TRACE("[CLIENT] Got input for exec'ed process: %s", buf);
-
-					ControllerToDaemon inputmsg = CONTROLLER_TO_DAEMON__INIT;
-					inputmsg.container_uuids = mem_new(char *, 1);
-					inputmsg.container_uuids[0] = (char *)uuid_string(uuid);
-					inputmsg.n_container_uuids = 1;
-					inputmsg.command =
-						CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_INPUT;
-					inputmsg.exec_input = buf;
-
-					TRACE("[CLIENT] Sending input for exec'ed process in container %s",
-					      argv[optind]);
-
-					send_message(sock, &inputmsg);
-					mem_free(inputmsg.container_uuids);
-					TRACE("[CLIENT] Sent input to cmld");
-				}
-			}
-		} else {
-			TRACE("[CLIENT] Exec'ed process outputreceiving  child forked, PID: %i",
-			      getpid());
-
-			while (1) {
-				TRACE("[CLIENT] Waiting for command output message from cmld");
-				DaemonToController *resp = recv_message(sock);
-
-				TRACE("[CLIENT] Got message from exec'ed process\n");
-
-				size_t written = 0, current = 0;
-				if (resp->code == DAEMON_TO_CONTROLLER__CODE__EXEC_OUTPUT) {
-					TRACE("[CLIENT] Message length; %zu\n",
-					      resp->exec_output.len);
-					while (written < resp->exec_output.len) {
-						TRACE("[CLIENT] Writing exec output to stdout");
-						if ((current = write(
-							     STDOUT_FILENO,
-							     resp->exec_output.data + written,
-							     resp->exec_output.len - written))) {
-							written += current;
-						}
-						fflush(stdout);
-					}
-				} else if (resp->code == DAEMON_TO_CONTROLLER__CODE__EXEC_END) {
-					TRACE("[CLIENT] Got notification of command termination. Exiting...");
-					kill(pid, SIGTERM);
-					waitpid(pid, NULL, 0);
-					goto exit;
-				} else {
-					ERROR("Detected unexpected message from cmld. Exiting");
-					goto exit;
-				}
-			}
-		}
-		ERROR_ERRNO("[CLIENT] command \"run\" failed");
-	}
-
-handle_resp:
-	// recv response if applicable
-	if (has_response) {
-		TRACE("[CLIENT] Awaiting response");
-
-		DaemonToController *resp = recv_message(sock);
-
-		TRACE("[CLIENT] Got response. Processing");
-
-		// do command-specific response processing
-		switch (resp->code) {
-		case DAEMON_TO_CONTROLLER__CODE__DEVICE_CSR: {
-			const char *dev_csr_file = argv[optind];
-			if (!resp->has_device_csr) {
-				ERROR("DEVICE_CSR_ERROR: Device not in Provisioning mode!");
-			} else if (-1 == file_write(dev_csr_file, (char *)resp->device_csr.data,
-						    resp->device_csr.len)) {
-				ERROR("writing device csr to %s", dev_csr_file);
-			} else {
-				INFO("device csr written to %s", dev_csr_file);
-			}
-		} break;
-		case DAEMON_TO_CONTROLLER__CODE__RESPONSE: {
-			if (!resp->has_response)
-				break;
-			switch (resp->response) {
-			case DAEMON_TO_CONTROLLER__RESPONSE__GUESTOS_MGR_INSTALL_STARTED: {
-				INFO("Waiting for images to be transfered ...");
-				protobuf_free_message((ProtobufCMessage *)resp);
-				goto handle_resp;
-			} break;
-			default:
-				protobuf_dump_message(STDOUT_FILENO, (ProtobufCMessage *)resp);
-			}
-		} break;
-		default:
-			// TODO for now just dump the response in text format
-			protobuf_dump_message(STDOUT_FILENO, (ProtobufCMessage *)resp);
-		}
-		protobuf_free_message((ProtobufCMessage *)resp);
+		req->run_uuid = uuid;
+		req->exec_pty = msg.exec_pty;
+		uuid = NULL;
+	} else if (msg.command == CONTROLLER_TO_DAEMON__COMMAND__PULL_DEVICE_CSR) {
+		req->csr_file = argv[optind];
 	}
 
-exit:
-	close(sock);
-	tcsetattr(STDIN_FILENO, TCSAFLUSH, &termios_before);
+	// names and uuids of the containers may have changed
+	if (msg.command == CONTROLLER_TO_DAEMON__COMMAND__CREATE_CONTAINER ||
+	    msg.command == CONTROLLER_TO_DAEMON__COMMAND__REMOVE_CONTAINER ||
+	    msg.command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_UPDATE_CONFIG ||
+	    msg.command == CONTROLLER_TO_DAEMON__COMMAND__RELOAD_CONTAINERS)
+		control_containers_flush();
 
 	if (msg.has_container_config_file)
 		mem_free(msg.container_config_file.data);
@@ -906,6 +928,307 @@ exit:
 	mem_free(msg.container_uuids);
 	if (uuid)
 		uuid_free(uuid);
+}
+
+/*
+ * Forwards the input of the user to the command run in the container and its
+ * output to stdout until the command terminates.
+ */
+static void
+control_run_io(int sock, uuid_t *uuid, bool exec_pty, const struct termios *termios_before)
+{
+	TRACE("[CLIENT] Processing response for run command");
+
+	if (exec_pty) {
+		TRACE("[CLIENT] Setting termios for PTY");
+		struct termios termios_run = *termios_before;
+		termios_run.c_cflag &= ~(ICRNL | IXON | IXOFF);
+		termios_run.c_oflag &= ~(OPOST);
+		termios_run.c_lflag &= ~(ISIG | ICANON | ECHO | ECHOCTL);
+		tcsetattr(STDIN_FILENO, TCSANOW, &termios_run);
+	}
+
+	int pid = fork();
+
+	if (pid == -1) {
+		ERROR("[CLIENT] Failed to fork(), exiting...\n");
+		return;
+	} else if (pid == 0) {
+		TRACE("[CLIENT] User input reading child forked, PID: %i", getpid());
+
+		char buf[128];
+		unsigned int count;
+
+		while (1) {
+			TRACE("[CLIENT] Trying to read input for exec'ed process");
+
+			if ((count = read(STDIN_FILENO, buf, 127)) > 0) {
+				buf[count] = 0;
+
+				TRACE("[CLIENT] Got input for exec'ed process: %s", buf);
+
+				ControllerToDaemon inputmsg = CONTROLLER_TO_DAEMON__INIT;
+				inputmsg.container_uuids = mem_new(char *, 1);
+				inputmsg.container_uuids[0] = (char *)uuid_string(uuid);
+				inputmsg.n_container_uuids = 1;
+				inputmsg.command =
+					CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_INPUT;
+				inputmsg.exec_input = buf;
+
+				TRACE("[CLIENT] Sending input for exec'ed process in container %s",
+				      uuid_string(uuid));
+
+				send_message(sock, &inputmsg);
+				mem_free(inputmsg.container_uuids);
+				TRACE("[CLIENT] Sent input to cmld");
+			}
+		}
+	} else {
+		TRACE("[CLIENT] Exec'ed process outputreceiving  child forked, PID: %i", getpid());
+
+		while (1) {
+			TRACE("[CLIENT] Waiting for command output message from cmld");
+			DaemonToController *resp = recv_message(sock);
+
+			TRACE("[CLIENT] Got message from exec'ed process\n");
+
+			size_t written = 0, current = 0;
+			if (resp->code == DAEMON_TO_CONTROLLER__CODE__EXEC_OUTPUT) {
+				TRACE("[CLIENT] Message length; %zu\n", resp->exec_output.len);
+				while (written < resp->exec_output.len) {
+					TRACE("[CLIENT] Writing exec output to stdout");
+					if ((current = write(STDOUT_FILENO,
+							     resp->exec_output.data + written,
+							     resp->exec_output.len - written))) {
+						written += current;
+					}
+					fflush(stdout);
+				}
+			} else if (resp->code == DAEMON_TO_CONTROLLER__CODE__EXEC_END) {
+				TRACE("[CLIENT] Got notification of command termination. "
+				      "Exiting...");
+				kill(pid, SIGTERM);
+				waitpid(pid, NULL, 0);
+				return;
+			} else {
+				ERROR("Detected unexpected message from cmld. Exiting");
+				return;
+			}
+		}
+	}
+	ERROR_ERRNO("[CLIENT] command \"run\" failed");
+}
+
+/*
+ * Receives and prints the response of cmld to a request.
+ */
+static void
+control_handle_response(int sock, const char *csr_file)
+{
+handle_resp:
+	TRACE("[CLIENT] Awaiting response");
+
+	DaemonToController *resp = recv_message(sock);
+
+	TRACE("[CLIENT] Got response. Processing");
+
+	// do command-specific response processing
+	switch (resp->code) {
+	case DAEMON_TO_CONTROLLER__CODE__DEVICE_CSR: {
+		if (!resp->has_device_csr) {
+			ERROR("DEVICE_CSR_ERROR: Device not in Provisioning mode!");
+		} else if (!csr_file || -1 == file_write(csr_file, (char *)resp->device_csr.data,
+							 resp->device_csr.len)) {
+			ERROR("writing device csr to %s", csr_file ? csr_file : "(null)");
+		} else {
+			INFO("device csr written to %s", csr_file);
+		}
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__CONTAINER_START_TRACE: {
+		if (!resp->container_start_trace)
+			ERROR("No start of the container has been traced");
+		else
+			printf("%s\n", resp->container_start_trace);
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__CONTAINER_NET_STATS: {
+		for (size_t i = 0; i < resp->n_container_net_stats; i++) {
+			ContainerNetStats *stats = resp->container_net_stats[i];
+			printf("%s%s: rx %" PRIu64 " packets %" PRIu64 " bytes, tx %" PRIu64
+			       " packets %" PRIu64 " bytes\n",
+			       stats->if_name, stats->fastpath ? " (fastpath)" : "",
+			       stats->rx_packets, stats->rx_bytes, stats->tx_packets,
+			       stats->tx_bytes);
+		}
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__CONTAINER_ACCOUNTING: {
+		for (size_t i = 0; i < resp->n_container_accounting; i++) {
+			ContainerAccounting *acc = resp->container_accounting[i];
+			printf("%s: time_ms cpu_us mem anon file io_read io_write "
+			       "net_rx net_tx\n",
+			       acc->container_uuid);
+			for (size_t j = 0; j < acc->n_samples; j++) {
+				ContainerAccountingSample *s = acc->samples[j];
+				printf("%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+				       " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+				       " %" PRIu64 "\n",
+				       s->time_ms, s->cpu_usage_us, s->memory_bytes,
+				       s->memory_anon_bytes, s->memory_file_bytes,
+				       s->io_read_bytes, s->io_write_bytes, s->net_rx_bytes,
+				       s->net_tx_bytes);
+			}
+		}
+	} break;
+	case DAEMON_TO_CONTROLLER__CODE__RESPONSE: {
+		if (!resp->has_response)
+			break;
+		switch (resp->response) {
+		case DAEMON_TO_CONTROLLER__RESPONSE__GUESTOS_MGR_INSTALL_STARTED: {
+			INFO("Waiting for images to be transfered ...");
+			protobuf_free_message((ProtobufCMessage *)resp);
+			goto handle_resp;
+		} break;
+		default:
+			protobuf_dump_message(STDOUT_FILENO, (ProtobufCMessage *)resp);
+		}
+	} break;
+	default:
+		// TODO for now just dump the response in text format
+		protobuf_dump_message(STDOUT_FILENO, (ProtobufCMessage *)resp);
+	}
+	protobuf_free_message((ProtobufCMessage *)resp);
+}
+
+static void
+control_pending_drain(int sock)
+{
+	for (size_t i = 0; i < control_pending_len; i++) {
+		control_handle_response(sock, control_pending[i]);
+		mem_free(control_pending[i]);
+	}
+	control_pending_len = 0;
+}
+
+/*
+ * Splits line into arguments at whitespace, argv[0] is set to the name of
+ * the program. Returns the number of arguments.
+ */
+static int
+control_batch_split(char *line, char *argv[], int max)
+{
+	int argc = 0;
+	char *saveptr = NULL;
+
+	argv[argc++] = (char *)control_prog;
+	for (char *tok = strtok_r(line, " \t\n", &saveptr); tok && argc < max;
+	     tok = strtok_r(NULL, " \t\n", &saveptr))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+/*
+ * Reads commands from stdin, one per line, and sends them over a single
+ * connection. Up to CONTROL_BATCH_WINDOW requests are in flight before their
+ * responses are read, in order. If stdin is a terminal, each response is
+ * printed before the next command is read.
+ */
+static void
+control_batch(int sock)
+{
+	bool interactive = isatty(STDIN_FILENO);
+	char *argv[CONTROL_BATCH_MAX_ARGS + 1];
+	char *line = NULL;
+	size_t size = 0;
+
+	control_batch_mode = true;
+
+	for (;;) {
+		if (interactive) {
+			printf("cml> ");
+			fflush(stdout);
+		}
+		if (getline(&line, &size, stdin) < 0)
+			break;
+
+		int argc = control_batch_split(line, argv, CONTROL_BATCH_MAX_ARGS);
+		if (argc < 2 || argv[1][0] == '#')
+			continue;
+
+		// these read from stdin themselves
+		if (!strcasecmp(argv[1], "run") || !strcasecmp(argv[1], "change_pin") ||
+		    !strcasecmp(argv[1], "batch")) {
+			ERROR("Command %s is not supported in batch mode", argv[1]);
+			continue;
+		}
+
+		if (control_pending_len == CONTROL_BATCH_WINDOW)
+			control_pending_drain(sock);
+
+		control_request_t req = { 0 };
+		optind = 1;
+		control_send_command(argc, argv, sock, &req);
+		if (req.has_response)
+			control_pending[control_pending_len++] =
+				req.csr_file ? mem_strdup(req.csr_file) : NULL;
+
+		if (interactive)
+			control_pending_drain(sock);
+	}
+	control_pending_drain(sock);
+
+	free(line);
+}
+
+int
+main(int argc, char *argv[])
+{
+	logf_register(&logf_test_write, stderr);
+
+	const char *socket_file = CONTROL_SOCKET;
+	control_prog = argv[0];
+
+	struct termios termios_before;
+	tcgetattr(STDIN_FILENO, &termios_before);
+
+	for (int c, option_index = 0;
+	     - 1 != (c = getopt_long(argc, argv, "+s:h", global_options, &option_index));) {
+		switch (c) {
+		case 's':
+			socket_file = optarg;
+			break;
+		default: // includes cases 'h' and '?'
+			print_usage(control_prog);
+		}
+	}
+
+	if (!file_exists(socket_file))
+		FATAL("Could not find socket file %s. Aborting.\n", socket_file);
+
+	// need at least one more argument (i.e. command string)
+	if (optind >= argc)
+		print_usage(control_prog);
+
+	int sock = sock_connect(socket_file);
+
+	if (!strcasecmp(argv[optind], "batch")) {
+		control_batch(sock);
+	} else {
+		control_request_t req = { 0 };
+		control_send_command(argc, argv, sock, &req);
+
+		if (req.run_uuid) {
+			control_run_io(sock, req.run_uuid, req.exec_pty, &termios_before);
+			uuid_free(req.run_uuid);
+		} else if (req.has_response) {
+			control_handle_response(sock, req.csr_file);
+		}
+	}
+
+	close(sock);
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &termios_before);
+
+	control_containers_flush();
 
 	return 0;
 }
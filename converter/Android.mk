@@ -42,6 +42,7 @@ LOCAL_SRC_FILES := \
 
 LOCAL_STATIC_LIBRARIES := \
 	libprotobuf-c-text \
+	libz \
 	libselinux \
 	libz \
 	libminitar \
@@ -93,6 +94,7 @@ LOCAL_SRC_FILES := \
 
 LOCAL_STATIC_LIBRARIES := \
 	libprotobuf-c-text-host \
+	libz-host \
 	libunz \
 	libtar \
 	liblog \
@@ -36,10 +36,12 @@
 #include "common/mem.h"
 
 #include "docker.h"
+#include "tar.h"
 #include "util.h"
 #include "control.h"
 
 #include <getopt.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
 #include <inttypes.h>
@@ -54,6 +56,9 @@
 
 #define WORK_PATH "/tmp/trustx-converter"
 #define IMAGE_NAME_ROOT "root.img"
+// content addressed store of layer images, kept across conversions
+#define LAYER_STORE_PATH WORK_PATH "/layers"
+#define LAYER_DIR "layers"
 #define MIN_INIT "/sbin/cservice"
 #define FILE_SERVER_ETH "eth0"
 
@@ -92,9 +97,52 @@ err:
 	return ip_str;
 }
 
+static GuestOSMount *
+layer_mount_new(const char *layer_image_file, util_image_fs_t fs)
+{
+	GuestOSMount *mount = mem_new0(GuestOSMount, 1);
+	guest_osmount__init(mount);
+
+	// the image file is named by its sha256 in the layer store
+	char *name = mem_strdup(strrchr(layer_image_file, '/') + 1);
+	*strrchr(name, '.') = '\0';
+	mount->image_file = name;
+	mount->mount_point = mem_strdup("/");
+	mount->fs_type = mem_strdup(util_image_fs_get_name(fs));
+	mount->mount_type = GUEST_OSMOUNT__TYPE__LAYER;
+	mount->has_image_size = true;
+	mount->image_size = file_size(layer_image_file);
+	mount->image_sha1 = util_hash_sha_image_file_new(layer_image_file);
+	mount->image_sha2_256 = mem_strdup(name);
+	return mount;
+}
+
+/*
+ * Makes the layer image available on the file server, which serves the
+ * layers of all GuestOSes from one directory.
+ */
+static void
+layer_image_publish(const char *layer_image_file)
+{
+	char *www_file =
+		mem_printf("%s/%s%s", WWW_OS_IMAGES_DIR, LAYER_DIR, strrchr(layer_image_file, '/'));
+
+	if (dir_mkdir_p(WWW_OS_IMAGES_DIR "/" LAYER_DIR, 0755) < 0)
+		ERROR_ERRNO("Can't create folder for hosting layer files");
+	else if (!file_exists(www_file) && link(layer_image_file, www_file) < 0 &&
+		 file_copy(layer_image_file, www_file, -1, 512, 0) < 0)
+		ERROR("Can't publish layer %s", layer_image_file);
+	mem_free(www_file);
+}
+
+/*
+ * Writes the GuestOS config, whose root file system is either the image
+ * root_image_file or, if it is NULL, the stack of layer images (lowest first).
+ */
 int
-write_guestos_config(docker_config_t *config, const char *root_image_file, const char *image_path,
-		     const char *image_name, const char *image_tag)
+write_guestos_config(docker_config_t *config, const char *root_image_file, char **layer_files,
+		     int n_layers, const char *image_path, const char *image_name,
+		     const char *image_tag, util_image_fs_t fs)
 {
 	int ret = -1;
 	char *out_file;
@@ -116,25 +164,44 @@ write_guestos_config(docker_config_t *config, const char *root_image_file, const
 	out_image_path_versioned = mem_printf("%s-%" PRId64, image_path_unversioned, cfg.version);
 	out_file = mem_printf("%s.conf", out_image_path_versioned);
 
-	cfg.n_mounts = list_length(config->volumes_list) + 1;
+	int n_root = root_image_file ? 1 : n_layers;
+	cfg.n_mounts = list_length(config->volumes_list) + n_root;
 	INFO("cfg.n_mounts: %zu", cfg.n_mounts);
 	cfg.mounts = mem_new(GuestOSMount *, cfg.n_mounts);
 
 	GuestOSMount mount_root = GUEST_OSMOUNT__INIT;
-	mount_root.image_file = strtok(mem_strdup(IMAGE_NAME_ROOT), ".");
-	mount_root.mount_point = mem_strdup("/");
-	mount_root.fs_type = mem_strdup("squashfs");
-	mount_root.mount_type = GUEST_OSMOUNT__TYPE__SHARED_RW;
-
-	// add image_sha1 and image_sha256 values
-	mount_root.has_image_size = true;
-	mount_root.image_size = file_size(root_image_file);
-	mount_root.image_sha1 = util_hash_sha_image_file_new(root_image_file);
-	mount_root.image_sha2_256 = util_hash_sha256_image_file_new(root_image_file);
+	if (root_image_file) {
+		mount_root.image_file = strtok(mem_strdup(IMAGE_NAME_ROOT), ".");
+		mount_root.mount_point = mem_strdup("/");
+		mount_root.fs_type = mem_strdup(util_image_fs_get_name(fs));
+		mount_root.mount_type = GUEST_OSMOUNT__TYPE__SHARED_RW;
+
+		// add image_sha1 and image_sha256 values
+		mount_root.has_image_size = true;
+		mount_root.image_size = file_size(root_image_file);
+
+		// the signed digest of the chunk index lets devices trust its chunk hashes
+		char *root_index_file = mem_printf("%s.chunks", root_image_file);
+		if (util_chunk_index_image_file(root_image_file, root_index_file,
+						&mount_root.image_sha1, &mount_root.image_sha2_256,
+						&mount_root.image_chunks_sha256) < 0) {
+			WARN("Could not create chunk index, devices cannot update %s by delta",
+			     root_image_file);
+			unlink(root_index_file);
+			mount_root.image_sha1 = util_hash_sha_image_file_new(root_image_file);
+			mount_root.image_sha2_256 =
+				util_hash_sha256_image_file_new(root_image_file);
+		}
+		mem_free(root_index_file);
 
-	cfg.mounts[0] = &mount_root;
+		cfg.mounts[0] = &mount_root;
+	} else {
+		// the daemon stacks consecutive layers of the same mount point
+		for (int l = 0; l < n_layers; l++)
+			cfg.mounts[l] = layer_mount_new(layer_files[l], fs);
+	}
 
-	int i = 1;
+	int i = n_root;
 	// default sceleton for every volume
 	GuestOSMount mount_vol = GUEST_OSMOUNT__INIT;
 
@@ -231,6 +298,9 @@ write_guestos_config(docker_config_t *config, const char *root_image_file, const
 	out_www_image_path_versioned = mem_printf("%s/%s_%s-%" PRId64, WWW_OS_IMAGES_DIR,
 						  image_name, image_tag, cfg.version);
 
+	for (int l = 0; !root_image_file && l < n_layers; l++)
+		layer_image_publish(layer_files[l]);
+
 	if (rename(image_path_unversioned, out_www_image_path_versioned) < 0)
 		ERROR_ERRNO("Can't rename dir %s", image_path_unversioned);
 	else
@@ -248,7 +318,8 @@ free_stuff:
 		mem_free(cfg.mounts[j]->fs_type);
 		mem_free(cfg.mounts[j]->image_sha1);
 		mem_free(cfg.mounts[j]->image_sha2_256);
-		if (j > 0) {
+		mem_free(cfg.mounts[j]->image_chunks_sha256);
+		if (cfg.mounts[j] != &mount_root) {
 			mem_free(cfg.mounts[j]);
 		}
 	}
@@ -265,55 +336,193 @@ free_stuff:
 	return ret;
 }
 
+typedef struct merge_layers {
+	char **files;
+	int count;
+} merge_layers_t;
+
+static int
+merge_layers_write_tar(int fd, void *data)
+{
+	merge_layers_t *layers = data;
+	return tar_merge_layers((const char *const *)layers->files, layers->count, fd);
+}
+
+/*
+ * Builds the root image directly from the merged tar stream of all layers,
+ * without extracting them to disk first. If image_file is NULL, the stream is
+ * extracted to extract_dir instead.
+ */
+static int
+merge_layers_stream(docker_manifest_t *manifest, char *in_path, const char *image_file,
+		    const char *extract_dir, util_image_fs_t fs)
+{
+	merge_layers_t layers = { mem_new0(char *, manifest->layers_size),
+				  manifest->layers_size };
+
+	for (int i = 0; i < manifest->layers_size; ++i)
+		layers.files[i] = mem_printf("%s/%s%s", in_path, manifest->layers[i]->digest,
+					     manifest->layers[i]->suffix);
+
+	int ret = image_file ?
+			  util_create_tar_image(fs, image_file, merge_layers_write_tar, &layers) :
+			  util_tar_extract(extract_dir, merge_layers_write_tar, &layers);
+
+	for (int i = 0; i < manifest->layers_size; ++i)
+		mem_free(layers.files[i]);
+	mem_free(layers.files);
+	return ret;
+}
+
 char *
 merge_layers_new(docker_manifest_t *manifest, char *in_path, char *out_path, char *image_name,
-		 char *image_tag)
+		 char *image_tag, util_image_fs_t fs)
 {
 	char *target_image_path = mem_printf("%s/%s_%s", out_path, image_name, image_tag);
 	char *extracted_image_path =
 		mem_printf("%s/%s_%s_extracted", out_path, image_name, image_tag);
 	char *image_file = NULL;
 
+	if (dir_mkdir_p(target_image_path, 0755) < 0) {
+		ERROR_ERRNO("Can't create dir %s", target_image_path);
+		goto out;
+	}
+
+	image_file = mem_printf("%s/%s", target_image_path, IMAGE_NAME_ROOT);
+	if (merge_layers_stream(manifest, in_path, image_file, NULL, fs) == 0)
+		goto out;
+
+	// e.g. mksquashfs before 4.6 and mkfs.erofs before 1.6 cannot read tar streams
+	WARN("Streaming layers into %s failed, extracting them instead", image_file);
+	mem_free(image_file);
+	image_file = NULL;
+
 	if (dir_mkdir_p(extracted_image_path, 0755) < 0) {
 		ERROR_ERRNO("Can't create dir %s", extracted_image_path);
 		goto out;
 	}
-	if (dir_mkdir_p(target_image_path, 0755) < 0) {
-		ERROR_ERRNO("Can't create dir %s", target_image_path);
+
+	// whiteouts are applied while merging, the extraction does not depend on overwriting
+	INFO("Extracting merged layers to %s", extracted_image_path);
+	if (merge_layers_stream(manifest, in_path, NULL, extracted_image_path, fs) < 0) {
+		ERROR("Failed to extract layers to %s", extracted_image_path);
 		goto out;
 	}
+	image_file = mem_printf("%s/%s", target_image_path, IMAGE_NAME_ROOT);
+	if (util_create_image(fs, extracted_image_path, image_file) < 0) {
+		mem_free(image_file);
+		image_file = NULL;
+		goto out;
+	}
+out:
+	mem_free(extracted_image_path);
+	mem_free(target_image_path);
+	return image_file;
+}
 
-	for (int i = 0; i < manifest->layers_size; ++i) {
-		char *layer_file_name = mem_printf("%s/%s%s", in_path, manifest->layers[i]->digest,
-						   manifest->layers[i]->suffix);
-		INFO("Extracting layer[%d]: %s", i, layer_file_name);
-		if (-1 == util_tar_extract(layer_file_name, extracted_image_path)) {
-			ERROR_ERRNO("Failed to extract %s", layer_file_name);
-			mem_free(layer_file_name);
+static int
+layer_write_tar(int fd, void *data)
+{
+	return tar_convert_layer(data, fd);
+}
+
+/*
+ * Returns the path of the image of a layer in the layer store, which is named
+ * by its sha256. An image is built only once per layer digest and file system,
+ * so images sharing base layers reference the very same layer images.
+ */
+static char *
+layer_image_new(const docker_remote_file_t *layer, const char *in_path, util_image_fs_t fs)
+{
+	char *layer_file = mem_printf("%s/%s%s", in_path, layer->digest, layer->suffix);
+	char *map_file = mem_printf("%s/%s.%s", LAYER_STORE_PATH, layer->digest,
+				    util_image_fs_get_name(fs));
+	char *tmp_file = mem_printf("%s.tmp", map_file);
+	char *image_file = NULL;
+	char *sha256 = NULL;
+
+	// the map file holds the sha256 of the image built from the layer
+	sha256 = file_exists(map_file) ? file_read_new(map_file, 128) : NULL;
+	if (sha256) {
+		image_file = mem_printf("%s/%s.img", LAYER_STORE_PATH, sha256);
+		if (file_exists(image_file)) {
+			INFO("Reusing image %s of layer %s", image_file, layer->digest);
 			goto out;
 		}
-		mem_free(layer_file_name);
+		mem_free(image_file);
+		image_file = NULL;
+		mem_free(sha256);
+		sha256 = NULL;
 	}
-	image_file = mem_printf("%s/%s", target_image_path, IMAGE_NAME_ROOT);
-	if (util_squash_image(extracted_image_path, image_file) < 0) {
+
+	INFO("Creating image of layer %s", layer->digest);
+	if (util_create_tar_image(fs, tmp_file, layer_write_tar, layer_file) < 0) {
+		ERROR("Could not create image of layer %s", layer_file);
+		unlink(tmp_file);
+		goto out;
+	}
+
+	sha256 = util_hash_sha256_image_file_new(tmp_file);
+	IF_NULL_GOTO(sha256, out);
+	image_file = mem_printf("%s/%s.img", LAYER_STORE_PATH, sha256);
+	if (rename(tmp_file, image_file) < 0) {
+		ERROR_ERRNO("Could not rename %s to %s", tmp_file, image_file);
 		mem_free(image_file);
 		image_file = NULL;
 		goto out;
 	}
+	if (file_write(map_file, sha256, -1) < 0)
+		WARN("Could not store image digest of layer %s", layer->digest);
 out:
-	mem_free(extracted_image_path);
-	mem_free(target_image_path);
+	mem_free(sha256);
+	mem_free(tmp_file);
+	mem_free(map_file);
+	mem_free(layer_file);
 	return image_file;
 }
 
+/*
+ * Creates the images of all layers of manifest (lowest first) in the layer
+ * store and the output dir for the GuestOS config.
+ */
+static char **
+layer_images_new(docker_manifest_t *manifest, char *in_path, char *out_path, char *image_name,
+		 char *image_tag, util_image_fs_t fs, bool verity)
+{
+	char *target_image_path = mem_printf("%s/%s_%s", out_path, image_name, image_tag);
+	char **images = mem_new0(char *, manifest->layers_size);
+
+	if (dir_mkdir_p(target_image_path, 0755) < 0 || dir_mkdir_p(LAYER_STORE_PATH, 0755) < 0) {
+		ERROR_ERRNO("Can't create dir %s or %s", target_image_path, LAYER_STORE_PATH);
+		goto error;
+	}
+
+	for (int i = 0; i < manifest->layers_size; ++i) {
+		images[i] = layer_image_new(manifest->layers[i], in_path, fs);
+		IF_NULL_GOTO(images[i], error);
+		if (verity && util_enable_verity(images[i]) < 0)
+			WARN("Continuing without fs-verity for %s", images[i]);
+	}
+
+	mem_free(target_image_path);
+	return images;
+error:
+	for (int i = 0; i < manifest->layers_size; ++i)
+		mem_free(images[i]);
+	mem_free(images);
+	mem_free(target_image_path);
+	return NULL;
+}
+
 void
 print_usage(char *progname)
 {
 	ERROR("Usage: %s login -u <username> -p <password>"
 	      " -r <hostname:port>",
 	      progname);
-	ERROR("Usage: %s pull [-r <hostname:port>] [-a <arch>]"
-	      " <imagename> [-t <imagetag>]",
+	ERROR("Usage: %s pull [-r <hostname:port>] [-a <arch>] [-j <jobs>]"
+	      " [-c <cachedir> [-C <cachesize MiB>]]"
+	      " [-f squashfs|erofs] [-V] [-l] <imagename> [-t <imagetag>]",
 	      progname);
 	exit(-1);
 }
@@ -321,6 +530,12 @@ print_usage(char *progname)
 static const struct option pull_options[] = { { "registry", optional_argument, 0, 'r' },
 					      { "arch", optional_argument, 0, 'a' },
 					      { "tag", optional_argument, 0, 't' },
+					      { "jobs", required_argument, 0, 'j' },
+					      { "cache", required_argument, 0, 'c' },
+					      { "cache-size", required_argument, 0, 'C' },
+					      { "fs", required_argument, 0, 'f' },
+					      { "verity", no_argument, 0, 'V' },
+					      { "layers", no_argument, 0, 'l' },
 					      { "help", no_argument, 0, 'h' },
 					      { 0, 0, 0, 0 } };
 
@@ -340,6 +555,10 @@ main(UNUSED int argc, char **argv)
 	char *image_name = NULL;
 	;
 	char *image_arch = NULL;
+	util_image_fs_t image_fs = UTIL_IMAGE_FS_SQUASHFS;
+	bool image_verity = false;
+	bool image_layers = false;
+	char **trustx_layer_files = NULL;
 
 	char *config_file_name = NULL;
 	docker_config_t *config = NULL;
@@ -372,8 +591,10 @@ main(UNUSED int argc, char **argv)
 		const char *url = "registry-1.docker.io";
 		image_arch = "amd64";
 		image_tag = "latest";
+		const char *blob_cache = NULL;
+		off_t blob_cache_size = 0;
 		for (int c, option_index = 0;
-		     - 1 != (c = getopt_long(pull_argc, pull_argv, "t:r:a:", pull_options,
+		     - 1 != (c = getopt_long(pull_argc, pull_argv, "t:r:a:j:c:C:f:Vl", pull_options,
 					     &option_index));) {
 			switch (c) {
 			case 'r':
@@ -385,6 +606,30 @@ main(UNUSED int argc, char **argv)
 			case 'a':
 				image_arch = optarg ? optarg : "amd64";
 				break;
+			case 'j':
+				docker_set_download_jobs(atoi(optarg));
+				break;
+			case 'c':
+				blob_cache = optarg;
+				break;
+			case 'C':
+				// size in MiB
+				blob_cache_size = strtoll(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			case 'f':
+				if (!strcmp(optarg, "erofs"))
+					image_fs = UTIL_IMAGE_FS_EROFS;
+				else if (!strcmp(optarg, "squashfs"))
+					image_fs = UTIL_IMAGE_FS_SQUASHFS;
+				else
+					print_usage(argv[0]);
+				break;
+			case 'V':
+				image_verity = true;
+				break;
+			case 'l':
+				image_layers = true;
+				break;
 			default:
 				print_usage(argv[0]);
 			}
@@ -395,6 +640,7 @@ main(UNUSED int argc, char **argv)
 			print_usage(argv[0]);
 
 		docker_set_host_url(url);
+		docker_set_blob_cache(blob_cache, blob_cache_size);
 		image_name = argv[optind++];
 		INFO("imagename %s", image_name);
 	}
@@ -528,14 +774,33 @@ main(UNUSED int argc, char **argv)
 		goto err;
 	}
 
-	trustx_image_file = merge_layers_new(manifest, docker_image_path, trustx_image_path,
-					     image_name, image_tag);
-	if (NULL == trustx_image_file) {
-		ERROR("Failed to merge layers resulting image file is NULL!");
-		goto err;
+	if (image_layers) {
+		trustx_layer_files = layer_images_new(manifest, docker_image_path,
+						      trustx_image_path, image_name, image_tag,
+						      image_fs, image_verity);
+		if (NULL == trustx_layer_files) {
+			ERROR("Failed to create layer images!");
+			goto err;
+		}
+	} else {
+		trustx_image_file = merge_layers_new(manifest, docker_image_path,
+						     trustx_image_path, image_name, image_tag,
+						     image_fs);
+		if (NULL == trustx_image_file) {
+			ERROR("Failed to merge layers resulting image file is NULL!");
+			goto err;
+		}
+		if (image_verity && util_enable_verity(trustx_image_file) < 0)
+			WARN("Continuing without fs-verity for %s", trustx_image_file);
 	}
 
-	write_guestos_config(config, trustx_image_file, trustx_image_path, image_name, image_tag);
+	write_guestos_config(config, trustx_image_file, trustx_layer_files,
+			     manifest->layers_size, trustx_image_path, image_name, image_tag,
+			     image_fs);
+
+	for (int i = 0; trustx_layer_files && i < manifest->layers_size; ++i)
+		mem_free(trustx_layer_files[i]);
+	mem_free(trustx_layer_files);
 
 	mem_free(manifest_list_file);
 	mem_free(manifest_file);
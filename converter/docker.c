@@ -21,6 +21,8 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define _GNU_SOURCE
+
 #include "docker.h"
 
 #include "common/macro.h"
@@ -30,21 +32,37 @@
 #include "common/list.h"
 #include "common/mem.h"
 #include "common/proc.h"
+#include "common/fd.h"
 
 #include "cJSON/cJSON.h"
 #include "util.h"
 
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <openssl/sha.h>
+
 #define BUF_SIZE 10 * 4096
 #define CURL_PATH "curl"
 
+#define DOCKER_DOWNLOAD_JOBS_DEFAULT 4
+#define DOCKER_DIGEST_INDEX "digests"
+#define DOCKER_BLOB_CACHE_SIZE_DEFAULT (10LL * 1024 * 1024 * 1024)
+
 #define MEDIA_TYPE_MANIFEST_LIST_V2 "application/vnd.docker.distribution.manifest.list.v2+json"
 #define MEDIA_TYPE_MANIFEST_V2 "application/vnd.docker.distribution.manifest.v2+json"
 #define MEDIA_TYPE_MANIFEST_V1 "application/vnd.docker.distribution.manifest.v1+json"
 
 static char *host_url = NULL;
+static int download_jobs = DOCKER_DOWNLOAD_JOBS_DEFAULT;
+static char *blob_cache_dir = NULL;
+static off_t blob_cache_max_size = DOCKER_BLOB_CACHE_SIZE_DEFAULT;
 
 static void
 docker_remote_file_free(docker_remote_file_t *rf)
@@ -65,6 +83,124 @@ docker_remote_file_free(docker_remote_file_t *rf)
 	mem_free(rf);
 }
 
+static const char *
+json_skip_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+	return p;
+}
+
+/*
+ * Skips the string starting at p, returns the position after the closing
+ * quote or NULL if the string is not terminated.
+ */
+static const char *
+json_skip_string(const char *p)
+{
+	for (p++; *p && *p != '"'; p++) {
+		if (*p == '\\' && !*++p)
+			return NULL;
+	}
+	return *p ? p + 1 : NULL;
+}
+
+/*
+ * Skips the value starting at p without parsing it, returns the position
+ * after the value or NULL if it is not terminated.
+ */
+static const char *
+json_skip_value(const char *p)
+{
+	int depth = 0;
+
+	do {
+		switch (*p) {
+		case '\0':
+			return NULL;
+		case '"':
+			IF_NULL_RETVAL(p = json_skip_string(p), NULL);
+			continue;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			depth--;
+			break;
+		default:
+			// scalars end at the next delimiter
+			if (!depth) {
+				while (*p && !strchr(",}] \t\n\r", *p))
+					p++;
+				return p;
+			}
+		}
+		p++;
+	} while (depth > 0);
+	return p;
+}
+
+/*
+ * Parses only the values of the members of the top-level object in buf with
+ * the given keys, all other members are skipped without building a cJSON
+ * tree, e.g. the history of image configs. values[i] is set to the parsed
+ * value of keys[i] or NULL. Returns -1 if buf is not a valid object.
+ */
+static int
+json_parse_members(const char *buf, const char *const keys[], cJSON *values[], size_t n)
+{
+	const char *p = json_skip_ws(buf);
+
+	memset(values, 0, n * sizeof(cJSON *));
+	IF_TRUE_GOTO(*p != '{', error);
+	p = json_skip_ws(p + 1);
+
+	while (*p == '"') {
+		const char *key = p + 1;
+		IF_NULL_GOTO(p = json_skip_string(p), error);
+		size_t key_len = p - 1 - key;
+		p = json_skip_ws(p);
+		IF_TRUE_GOTO(*p != ':', error);
+		p = json_skip_ws(p + 1);
+
+		size_t i;
+		for (i = 0; i < n; i++) {
+			if (!values[i] && strlen(keys[i]) == key_len &&
+			    !strncmp(keys[i], key, key_len))
+				break;
+		}
+		if (i < n) {
+			values[i] = cJSON_ParseWithOpts(p, &p, false);
+			IF_NULL_GOTO(values[i], error);
+		} else {
+			IF_NULL_GOTO(p = json_skip_value(p), error);
+		}
+
+		p = json_skip_ws(p);
+		if (*p != ',')
+			break;
+		p = json_skip_ws(p + 1);
+	}
+	IF_TRUE_GOTO(*p != '}', error);
+	return 0;
+error:
+	ERROR("Failed to parse JSON document");
+	for (size_t i = 0; i < n; i++) {
+		cJSON_Delete(values[i]);
+		values[i] = NULL;
+	}
+	return -1;
+}
+
+static void
+json_members_delete(cJSON *values[], size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		cJSON_Delete(values[i]);
+}
+
 static docker_remote_file_t *
 parse_remote_file_new(cJSON *rf_obj, char *suffix)
 {
@@ -103,20 +239,23 @@ parse_remote_file_new(cJSON *rf_obj, char *suffix)
 docker_manifest_list_t *
 docker_parse_manifest_list_new(const char *raw_file_buffer)
 {
-	cJSON *jroot = NULL;
+	// v1 manifests carry the layer history, which is not needed
+	static const char *const keys[] = { "schemaVersion", "architecture", "tag", "manifests",
+					    "mediaType" };
+	cJSON *jvalues[ELEMENTSOF(keys)];
 	docker_manifest_list_t *ml = mem_alloc0(sizeof(docker_manifest_list_t));
 
-	jroot = cJSON_Parse(raw_file_buffer);
+	json_parse_members(raw_file_buffer, keys, jvalues, ELEMENTSOF(keys));
 
-	cJSON *jschema = cJSON_GetObjectItem(jroot, "schemaVersion");
+	cJSON *jschema = jvalues[0];
 	if (cJSON_IsNumber(jschema))
 		ml->schema_version = jschema->valueint;
 	switch (ml->schema_version) {
 	case 1: {
 		// no manifetslist support (client answerd with v1 manifest)
 		// construct a default manifest list for the v2 manifest
-		cJSON *jarchitecture = cJSON_GetObjectItem(jroot, "architecture");
-		cJSON *jtag = cJSON_GetObjectItem(jroot, "tag");
+		cJSON *jarchitecture = jvalues[1];
+		cJSON *jtag = jvalues[2];
 		if (cJSON_IsString(jarchitecture) && cJSON_IsString(jtag)) {
 			ml->schema_version = 2;
 			ml->manifests_size = 1;
@@ -136,7 +275,7 @@ docker_parse_manifest_list_new(const char *raw_file_buffer)
 		break;
 	}
 	case 2: {
-		cJSON *jmanifests = cJSON_GetObjectItem(jroot, "manifests");
+		cJSON *jmanifests = jvalues[3];
 		ml->manifests_size = cJSON_GetArraySize(jmanifests);
 		if (ml->manifests_size < 0) {
 			ERROR("No manifests in list");
@@ -145,7 +284,7 @@ docker_parse_manifest_list_new(const char *raw_file_buffer)
 			goto out;
 		}
 
-		cJSON *jmedia_type = cJSON_GetObjectItem(jroot, "mediaType");
+		cJSON *jmedia_type = jvalues[4];
 		if (cJSON_IsString(jmedia_type)) {
 			ml->media_type = mem_strdup(jmedia_type->valuestring);
 		}
@@ -163,7 +302,7 @@ docker_parse_manifest_list_new(const char *raw_file_buffer)
 		ml = NULL;
 	}
 out:
-	cJSON_Delete(jroot);
+	json_members_delete(jvalues, ELEMENTSOF(keys));
 	return ml;
 }
 
@@ -182,24 +321,26 @@ docker_manifest_list_free(docker_manifest_list_t *ml)
 docker_manifest_t *
 docker_parse_manifest_new(const char *raw_file_buffer)
 {
-	cJSON *jroot = NULL;
+	static const char *const keys[] = { "schemaVersion", "mediaType", "config", "layers" };
+	cJSON *jvalues[ELEMENTSOF(keys)];
 	docker_manifest_t *manifest = mem_alloc0(sizeof(docker_manifest_t));
 
-	jroot = cJSON_Parse(raw_file_buffer);
-	// seems a manifest contains an array with just one item
-	cJSON *jschema = cJSON_GetArrayItem(jroot, 0);
+	// annotations and other members are skipped
+	json_parse_members(raw_file_buffer, keys, jvalues, ELEMENTSOF(keys));
+
+	cJSON *jschema = jvalues[0];
 	if (cJSON_IsNumber(jschema))
 		manifest->schema_version = jschema->valueint;
 
-	cJSON *jmedia_type = cJSON_GetObjectItem(jroot, "mediaType");
+	cJSON *jmedia_type = jvalues[1];
 	if (cJSON_IsString(jmedia_type)) {
 		manifest->media_type = mem_strdup(jmedia_type->valuestring);
 	}
 
-	cJSON *jconfig = cJSON_GetObjectItem(jroot, "config");
+	cJSON *jconfig = jvalues[2];
 	manifest->config = parse_remote_file_new(jconfig, ".json");
 
-	cJSON *jlayers = cJSON_GetObjectItem(jroot, "layers");
+	cJSON *jlayers = jvalues[3];
 	manifest->layers_size = cJSON_GetArraySize(jlayers);
 	manifest->layers = mem_alloc0(manifest->layers_size * sizeof(docker_remote_file_t *));
 	for (int i = 0; i < manifest->layers_size; ++i) {
@@ -207,7 +348,7 @@ docker_parse_manifest_new(const char *raw_file_buffer)
 		manifest->layers[i] = parse_remote_file_new(item, ".tar.gz");
 	}
 
-	cJSON_Delete(jroot);
+	json_members_delete(jvalues, ELEMENTSOF(keys));
 	return manifest;
 }
 
@@ -230,12 +371,12 @@ docker_manifest_free(docker_manifest_t *manifest)
 docker_config_t *
 docker_parse_config_new(const char *raw_file_buffer)
 {
-	cJSON *jroot = NULL;
+	static const char *const keys[] = { "config" };
+	cJSON *jconfig = NULL;
 	docker_config_t *config = mem_alloc0(sizeof(docker_config_t));
 
-	jroot = cJSON_Parse(raw_file_buffer);
-
-	cJSON *jconfig = cJSON_GetObjectItem(jroot, "config");
+	// the history and rootfs of the image, which grow with each layer, are skipped
+	json_parse_members(raw_file_buffer, keys, &jconfig, ELEMENTSOF(keys));
 
 	cJSON *jhostname = cJSON_GetObjectItem(jconfig, "Hostname");
 	if (jhostname->type == cJSON_String)
@@ -316,7 +457,7 @@ docker_parse_config_new(const char *raw_file_buffer)
 		}
 	}
 
-	cJSON_Delete(jroot);
+	cJSON_Delete(jconfig);
 	return config;
 }
 
@@ -490,80 +631,452 @@ docker_download_manifest(const char *curl_token, const char *out_file, const cha
 	return ret;
 }
 
+/*
+ * Blobs are fetched by up to download_jobs concurrent curl processes, which
+ * write to a pipe. The data is hashed while it is stored in a part file, so
+ * that a blob only becomes visible under its digest name once verified.
+ * Verified blobs are recorded in a digest index together with their size and
+ * mtime, so that cached blobs are recognized without hashing them again.
+ */
+typedef struct docker_blob {
+	const docker_remote_file_t *rf;
+	char *file;
+	char *part_file;
+	char *url;
+	bool basic_auth; // retrying with basic auth after bearer auth failed
+	pid_t pid;
+	int pipe_fd;
+	int fd;
+	SHA256_CTX ctx;
+} docker_blob_t;
+
+static void
+docker_blob_free(docker_blob_t *blob)
+{
+	if (blob->pid > 0) {
+		kill(blob->pid, SIGTERM);
+		waitpid(blob->pid, NULL, 0);
+	}
+	if (blob->pipe_fd >= 0)
+		close(blob->pipe_fd);
+	if (blob->fd >= 0)
+		close(blob->fd);
+	// a complete blob has been renamed already, remove leftovers of failed ones
+	if (unlink(blob->part_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", blob->part_file);
+	mem_free(blob->file);
+	mem_free(blob->part_file);
+	mem_free(blob->url);
+	mem_free(blob);
+}
+
+static bool
+docker_digest_index_lookup(const char *index_file, const docker_remote_file_t *rf,
+			   const char *file)
+{
+	struct stat st;
+	bool found = false;
+
+	if (stat(file, &st) < 0 || st.st_size != rf->size)
+		return false;
+
+	FILE *fp = fopen(index_file, "r");
+	if (!fp)
+		return false;
+
+	char digest[129];
+	long long size, mtime_sec, mtime_nsec;
+	while (fscanf(fp, "%128s %lld %lld.%lld", digest, &size, &mtime_sec, &mtime_nsec) == 4) {
+		if (!strcmp(digest, rf->digest) && size == st.st_size &&
+		    mtime_sec == st.st_mtim.tv_sec && mtime_nsec == st.st_mtim.tv_nsec)
+			found = true;
+	}
+	fclose(fp);
+
+	return found;
+}
+
+static void
+docker_digest_index_store(const char *index_file, const docker_remote_file_t *rf,
+			  const char *file)
+{
+	struct stat st;
+
+	if (stat(file, &st) < 0 ||
+	    file_printf_append(index_file, "%s %lld %lld.%09lld\n", rf->digest,
+			       (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+			       (long long)st.st_mtim.tv_nsec) < 0)
+		WARN("Could not add %s to digest index", rf->digest);
+}
+
+/*
+ * The blob cache only holds verified blobs, which are named by their digest.
+ * The mtime of a cached blob is the time it was used last.
+ */
+static char *
+docker_blob_cache_file_new(const docker_remote_file_t *rf)
+{
+	return mem_printf("%s/%s/%s", blob_cache_dir, rf->digest_algorithm, rf->digest);
+}
+
+/*
+ * Links the blob from the cache to file. Returns true if the blob was cached.
+ */
+static bool
+docker_blob_cache_get(const docker_remote_file_t *rf, const char *file)
+{
+	struct stat st;
+	bool ret = false;
+
+	IF_TRUE_RETVAL(!blob_cache_dir || !rf->digest_algorithm, false);
+
+	char *cache_file = docker_blob_cache_file_new(rf);
+	if (stat(cache_file, &st) < 0 || st.st_size != rf->size)
+		goto out;
+
+	if (utimensat(AT_FDCWD, cache_file, NULL, 0) < 0)
+		WARN_ERRNO("Could not mark %s as used", cache_file);
+	if (unlink(file) < 0 && errno != ENOENT) {
+		WARN_ERRNO("Could not remove %s", file);
+		goto out;
+	}
+	// hardlink, or reflink if the cache is on another file system
+	if (link(cache_file, file) < 0 && file_clone(cache_file, file) < 0) {
+		DEBUG_ERRNO("Could not link %s to %s", cache_file, file);
+		goto out;
+	}
+	ret = true;
+out:
+	mem_free(cache_file);
+	return ret;
+}
+
+/*
+ * Adds the verified blob at file to the cache.
+ */
+static void
+docker_blob_cache_put(const docker_remote_file_t *rf, const char *file)
+{
+	IF_TRUE_RETURN(!blob_cache_dir || !rf->digest_algorithm);
+
+	char *dir = mem_printf("%s/%s", blob_cache_dir, rf->digest_algorithm);
+	char *cache_file = docker_blob_cache_file_new(rf);
+	char *tmp_file = mem_printf("%s.%d.tmp", cache_file, getpid());
+
+	if (dir_mkdir_p(dir, 0755) < 0) {
+		WARN_ERRNO("Could not create blob cache %s", dir);
+		goto out;
+	}
+	if (link(file, tmp_file) < 0 && file_clone(file, tmp_file) < 0) {
+		DEBUG_ERRNO("Could not link %s to the blob cache", file);
+		goto out;
+	}
+	if (rename(tmp_file, cache_file) < 0) {
+		WARN_ERRNO("Could not add %s to the blob cache", rf->digest);
+		unlink(tmp_file);
+	}
+out:
+	mem_free(tmp_file);
+	mem_free(cache_file);
+	mem_free(dir);
+}
+
+typedef struct docker_blob_cache_entry {
+	char *file;
+	off_t size;
+	struct timespec mtime;
+} docker_blob_cache_entry_t;
+
+typedef struct docker_blob_cache_scan {
+	docker_blob_cache_entry_t *entries;
+	size_t count;
+	off_t size;
+} docker_blob_cache_scan_t;
+
 static int
-download_docker_remote_file(const char *curl_token, const docker_remote_file_t *rf,
-			    const char *out_path, const char *image_name)
+docker_blob_cache_scan_file_cb(const char *path, const char *file, void *data)
 {
-	int ret = 0;
-	char *image_hash = NULL;
+	docker_blob_cache_scan_t *scan = data;
+	struct stat st;
 
-	char *out_file = mem_printf("%s/%s%s", out_path, rf->digest, rf->suffix);
+	char *cache_file = mem_printf("%s/%s", path, file);
+	if (stat(cache_file, &st) < 0 || !S_ISREG(st.st_mode)) {
+		mem_free(cache_file);
+		return 0;
+	}
 
-	if (file_exists(out_file) && file_size(out_file) == rf->size) {
-		image_hash = util_hash_sha256_image_file_new(out_file);
-		if (!strncmp(image_hash, rf->digest, strlen(image_hash))) {
-			INFO("File %s already downloaded!", rf->digest);
-			mem_free(image_hash);
-			return ret;
+	// grow in steps of powers of two
+	if (!(scan->count & (scan->count - 1)))
+		scan->entries = mem_renew(docker_blob_cache_entry_t, scan->entries,
+					  scan->count ? scan->count * 2 : 1);
+	scan->entries[scan->count].file = cache_file;
+	scan->entries[scan->count].size = st.st_size;
+	scan->entries[scan->count].mtime = st.st_mtim;
+	scan->count++;
+	scan->size += st.st_size;
+	return 0;
+}
+
+static int
+docker_blob_cache_scan_dir_cb(const char *path, const char *file, void *data)
+{
+	char *dir = mem_printf("%s/%s", path, file);
+	if (file_is_dir(dir))
+		dir_foreach(dir, docker_blob_cache_scan_file_cb, data);
+	mem_free(dir);
+	return 0;
+}
+
+static int
+docker_blob_cache_entry_cmp(const void *a, const void *b)
+{
+	const docker_blob_cache_entry_t *ea = a, *eb = b;
+
+	if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+		return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+	if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+		return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Removes the least recently used blobs until the cache fits its maximum size.
+ * Blobs linked to output paths remain valid there.
+ */
+static void
+docker_blob_cache_evict(void)
+{
+	docker_blob_cache_scan_t scan = { NULL, 0, 0 };
+
+	IF_NULL_RETURN(blob_cache_dir);
+	IF_TRUE_RETURN(dir_foreach(blob_cache_dir, docker_blob_cache_scan_dir_cb, &scan) < 0);
+
+	if (scan.size > blob_cache_max_size) {
+		qsort(scan.entries, scan.count, sizeof(docker_blob_cache_entry_t),
+		      docker_blob_cache_entry_cmp);
+		for (size_t i = 0; i < scan.count && scan.size > blob_cache_max_size; i++) {
+			DEBUG("Evicting %s from blob cache", scan.entries[i].file);
+			if (unlink(scan.entries[i].file) < 0) {
+				WARN_ERRNO("Could not evict %s", scan.entries[i].file);
+				continue;
+			}
+			scan.size -= scan.entries[i].size;
 		}
-		mem_free(image_hash);
 	}
 
-	//char *url = mem_printf("https://registry-1.docker.io/v2/library/%s/blobs/%s:%s",
-	char *url = mem_printf("https://%s/v2/%s%s/blobs/%s:%s", host_url,
-			       !strchr(image_name, '/') ? "library/" : "", image_name,
-			       rf->digest_algorithm, rf->digest);
+	for (size_t i = 0; i < scan.count; i++)
+		mem_free(scan.entries[i].file);
+	mem_free(scan.entries);
+}
 
-	char *auth_basic = mem_printf("Authorization: Basic %s", curl_token);
-	char *auth_bearer = mem_printf("Authorization: Bearer %s", curl_token);
-	const char *const argv_bearer[] = { CURL_PATH, "-fSL", "--progress", "-H", auth_bearer,
-					    url,       "-o",   out_file,     NULL };
-	const char *const argv_basic[] = { CURL_PATH, "-fSL", "--progress", "-H", auth_basic,
-					   url,	      "-o",   out_file,	    NULL };
+static int
+docker_blob_start(docker_blob_t *blob, const char *curl_token)
+{
+	int fds[2];
 
-	ret = proc_fork_and_execvp(argv_bearer);
-	if (ret != 0)
-		ret = proc_fork_and_execvp(argv_basic);
+	blob->fd = open(blob->part_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (blob->fd < 0) {
+		ERROR_ERRNO("Could not create %s", blob->part_file);
+		return -1;
+	}
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		ERROR_ERRNO("Could not create pipe for %s", blob->rf->digest);
+		return -1;
+	}
 
-	mem_free(url);
-	mem_free(auth_basic);
-	mem_free(auth_bearer);
+	char *auth = mem_printf("Authorization: %s %s", blob->basic_auth ? "Basic" : "Bearer",
+				curl_token);
+	const char *const argv[] = { CURL_PATH, "-fsSL", "-H", auth, blob->url, NULL };
 
+	blob->pid = fork();
+	if (blob->pid == 0) {
+		if (dup2(fds[1], STDOUT_FILENO) < 0)
+			_exit(EXIT_FAILURE);
+		execvp(argv[0], (char *const *)argv);
+		_exit(EXIT_FAILURE);
+	}
+	mem_free(auth);
+	close(fds[1]);
+	if (blob->pid < 0) {
+		ERROR_ERRNO("Could not fork curl for %s", blob->rf->digest);
+		close(fds[0]);
+		return -1;
+	}
+
+	blob->pipe_fd = fds[0];
+	SHA256_Init(&blob->ctx);
+	return 0;
+}
+
+/*
+ * Handles the end of the curl output of blob. Returns 1 if the download has been
+ * restarted with basic auth, 0 if the blob is complete and -1 on error.
+ */
+static int
+docker_blob_finish(docker_blob_t *blob, const char *curl_token, const char *index_file)
+{
+	int status;
+
+	close(blob->pipe_fd);
+	blob->pipe_fd = -1;
+	close(blob->fd);
+	blob->fd = -1;
+	if (waitpid(blob->pid, &status, 0) < 0)
+		status = -1;
+	blob->pid = -1;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		if (!blob->basic_auth) {
+			blob->basic_auth = true;
+			return docker_blob_start(blob, curl_token) < 0 ? -1 : 1;
+		}
+		ERROR("Download of %s failed!", blob->rf->digest);
+		return -1;
+	}
+
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	SHA256_Final(md, &blob->ctx);
+	char *image_hash = util_bin_to_hex_new(md, SHA256_DIGEST_LENGTH);
+	int ret = strcmp(image_hash, blob->rf->digest) ? -1 : 0;
+	mem_free(image_hash);
 	if (ret < 0) {
-		ERROR("Download failed!");
-		return ret;
+		ERROR("SHA256 sum missmatch of %s!", blob->rf->digest);
+		return -1;
 	}
 
-	image_hash = util_hash_sha256_image_file_new(out_file);
-	if (strncmp(image_hash, rf->digest, strlen(image_hash))) {
-		ERROR("SHA256 sum missmatch!");
-		ret = -1;
+	if (rename(blob->part_file, blob->file) < 0) {
+		ERROR_ERRNO("Could not rename %s", blob->part_file);
+		return -1;
 	}
-	INFO("Download of file %s completed!", rf->digest);
+	docker_digest_index_store(index_file, blob->rf, blob->file);
+	docker_blob_cache_put(blob->rf, blob->file);
 
-	if (image_hash)
-		mem_free(image_hash);
+	INFO("Download of file %s completed!", blob->rf->digest);
+	return 0;
+}
 
-	return ret;
+static docker_blob_t *
+docker_blob_new(const docker_remote_file_t *rf, const char *out_path, const char *image_name)
+{
+	docker_blob_t *blob = mem_new0(docker_blob_t, 1);
+	blob->rf = rf;
+	blob->file = mem_printf("%s/%s%s", out_path, rf->digest, rf->suffix);
+	blob->part_file = mem_printf("%s.part", blob->file);
+	//char *url = mem_printf("https://registry-1.docker.io/v2/library/%s/blobs/%s:%s",
+	blob->url = mem_printf("https://%s/v2/%s%s/blobs/%s:%s", host_url,
+			       !strchr(image_name, '/') ? "library/" : "", image_name,
+			       rf->digest_algorithm, rf->digest);
+	blob->pid = -1;
+	blob->pipe_fd = -1;
+	blob->fd = -1;
+	return blob;
+}
+
+void
+docker_set_download_jobs(int jobs)
+{
+	download_jobs = jobs > 0 ? jobs : DOCKER_DOWNLOAD_JOBS_DEFAULT;
+}
+
+void
+docker_set_blob_cache(const char *dir, off_t max_size)
+{
+	mem_free(blob_cache_dir);
+	blob_cache_dir = dir ? mem_strdup(dir) : NULL;
+	blob_cache_max_size = max_size > 0 ? max_size : DOCKER_BLOB_CACHE_SIZE_DEFAULT;
 }
 
 int
 docker_download_image(char *curl_token, const docker_manifest_t *manifest, const char *out_path,
 		      const char *image_name, const char *image_tag)
 {
-	int ret = download_docker_remote_file(curl_token, manifest->config, out_path, image_name);
-	if (ret < 0) {
-		ERROR("Failed to download %s!", manifest->config->digest);
-		return -1;
+	int ret = 0;
+	list_t *pending = NULL, *active = NULL;
+	char *index_file = mem_printf("%s/%s", out_path, DOCKER_DIGEST_INDEX);
+	unsigned char *buf = mem_alloc(BUF_SIZE);
+	struct pollfd *pfds = mem_new0(struct pollfd, download_jobs);
+
+	for (int i = -1; i < manifest->layers_size; ++i) {
+		docker_remote_file_t *rf = i < 0 ? manifest->config : manifest->layers[i];
+		docker_blob_t *blob = docker_blob_new(rf, out_path, image_name);
+		if (docker_digest_index_lookup(index_file, rf, blob->file)) {
+			INFO("File %s already downloaded!", rf->digest);
+			docker_blob_free(blob);
+			continue;
+		}
+		// the digest of a cached blob has been verified when it was downloaded
+		if (docker_blob_cache_get(rf, blob->file)) {
+			INFO("File %s taken from blob cache", rf->digest);
+			docker_digest_index_store(index_file, rf, blob->file);
+			docker_blob_free(blob);
+			continue;
+		}
+		pending = list_append(pending, blob);
 	}
-	for (int i = 0; i < manifest->layers_size; ++i) {
-		ret = download_docker_remote_file(curl_token, manifest->layers[i], out_path,
-						  image_name);
-		if (ret < 0) {
-			ERROR("Failed to download %s!", manifest->config->digest);
-			return -1;
+
+	while (pending || active) {
+		while (pending && list_length(active) < (unsigned)download_jobs) {
+			docker_blob_t *blob = pending->data;
+			pending = list_unlink(pending, pending);
+			active = list_append(active, blob);
+			DEBUG("Downloading %s", blob->url);
+			IF_TRUE_GOTO_ERROR(docker_blob_start(blob, curl_token) < 0, error);
+		}
+
+		int n = 0;
+		for (list_t *l = active; l; l = l->next, n++) {
+			pfds[n].fd = ((docker_blob_t *)l->data)->pipe_fd;
+			pfds[n].events = POLLIN;
+		}
+		if (poll(pfds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR_ERRNO("Could not poll downloads");
+			goto error;
+		}
+
+		list_t *l = active;
+		for (int i = 0; i < n; i++) {
+			docker_blob_t *blob = l->data;
+			l = l->next;
+			if (!pfds[i].revents)
+				continue;
+
+			ssize_t len = read(blob->pipe_fd, buf, BUF_SIZE);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len > 0) {
+				SHA256_Update(&blob->ctx, buf, len);
+				if (fd_write(blob->fd, (char *)buf, len) != len) {
+					ERROR_ERRNO("Could not write %s", blob->part_file);
+					goto error;
+				}
+				continue;
+			}
+
+			int res = docker_blob_finish(blob, curl_token, index_file);
+			IF_TRUE_GOTO_ERROR(res < 0, error);
+			if (res == 0) {
+				active = list_remove(active, blob);
+				docker_blob_free(blob);
+			}
 		}
 	}
 	INFO("Download image %s:%s completed!", image_name, image_tag);
-	return 0;
+	goto out;
+error:
+	ERROR("Failed to download image %s:%s!", image_name, image_tag);
+	ret = -1;
+out:
+	for (list_t *l = pending; l; l = l->next)
+		docker_blob_free(l->data);
+	for (list_t *l = active; l; l = l->next)
+		docker_blob_free(l->data);
+	list_delete(pending);
+	list_delete(active);
+	mem_free(pfds);
+	mem_free(buf);
+	mem_free(index_file);
+	docker_blob_cache_evict();
+	return ret;
 }
@@ -26,6 +26,8 @@
 
 #include "common/list.h"
 
+#include <sys/types.h>
+
 typedef struct docker_remote_file {
 	char *media_type;
 	int size;
@@ -107,6 +109,23 @@ docker_download_image(char *curl_token, const docker_manifest_t *manifest, const
 void
 docker_set_host_url(const char *url);
 
+/**
+ * Sets the number of blobs docker_download_image() fetches concurrently,
+ * values below one select the default.
+ */
+void
+docker_set_download_jobs(int jobs);
+
+/**
+ * Enables a content addressed cache of verified blobs in dir, which is shared
+ * by all conversions. Blobs are stored as <dir>/<algorithm>/<digest> and
+ * hardlinked (or reflinked) to the output path of docker_download_image().
+ * The least recently used blobs are evicted once the cache exceeds max_size
+ * bytes, values below one select the default of 10 GiB.
+ */
+void
+docker_set_blob_cache(const char *dir, off_t max_size);
+
 int
 docker_generate_basic_auth(const char *user, const char *password, const char *token_file);
 
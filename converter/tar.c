@@ -0,0 +1,767 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "tar.h"
+#include "util.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/fd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_COPY_SIZE (64 * 1024)
+// upper bound for the data of extension headers (long names, pax records)
+#define TAR_EXT_MAX (1024 * 1024)
+// lets the decompressor of a layer run ahead of its consumer
+#define TAR_PIPE_SIZE (1024 * 1024)
+
+#define TAR_WHITEOUT_PREFIX ".wh."
+#define TAR_WHITEOUT_OPAQUE ".wh..wh..opq"
+#define TAR_XATTR_OPAQUE "SCHILY.xattr.trusted.overlay.opaque"
+
+#define TAR_PAD(size) (((size) + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE)
+
+enum tar_kind {
+	TAR_KIND_DIR = 1,
+	TAR_KIND_OTHER = 2,
+	TAR_KIND_WHITEOUT = 4,
+	TAR_KIND_OPAQUE = 8,
+};
+
+/*
+ * All paths of all layers, sorted by path and layer. Whiteouts are recorded
+ * with the path they remove, opaque markers with the path of their directory.
+ */
+typedef struct tar_path {
+	char *path;
+	int layer;
+	int kind;
+} tar_path_t;
+
+typedef struct tar_index {
+	tar_path_t *paths;
+	size_t count;
+} tar_index_t;
+
+typedef struct tar_layer {
+	const char *file;
+	int fd;
+	pid_t pid;
+	const char *filter;
+} tar_layer_t;
+
+typedef struct tar_entry {
+	uint8_t *raw; // extension headers and the header block as read
+	size_t raw_len;
+	char *path;
+	char type;
+	uint64_t size;
+} tar_entry_t;
+
+/*
+ * Checks if the program is found in PATH.
+ */
+static bool
+tar_program_available(const char *name)
+{
+	const char *env = getenv("PATH");
+	char *paths = mem_strdup(env ? env : "/usr/bin:/bin");
+	char *saveptr = NULL;
+	bool found = false;
+
+	for (char *dir = strtok_r(paths, ":", &saveptr); dir && !found;
+	     dir = strtok_r(NULL, ":", &saveptr)) {
+		char *path = mem_printf("%s/%s", dir, name);
+		found = !access(path, X_OK);
+		mem_free(path);
+	}
+	mem_free(paths);
+	return found;
+}
+
+static int
+tar_layer_open(tar_layer_t *layer, const char *file)
+{
+	// pigz decompresses with separate threads for reading, writing and checksums
+	static const char *const pigz_argv[] = { "pigz", "-dc", NULL };
+	static const char *const gzip_argv[] = { "gzip", "-dc", NULL };
+	static const char *const zstd_argv[] = { "zstd", "-dcq", NULL };
+	static int pigz = -1;
+	const char *const *argv = NULL;
+	uint8_t magic[4] = { 0 };
+
+	layer->file = file;
+	layer->pid = -1;
+	layer->fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (layer->fd < 0) {
+		ERROR_ERRNO("Could not open layer %s", file);
+		return -1;
+	}
+	if (read(layer->fd, magic, sizeof(magic)) < 0 || lseek(layer->fd, 0, SEEK_SET) < 0) {
+		ERROR_ERRNO("Could not read layer %s", file);
+		goto error;
+	}
+
+	if (magic[0] == 0x1f && magic[1] == 0x8b) {
+		if (pigz < 0)
+			pigz = tar_program_available(pigz_argv[0]);
+		argv = pigz ? pigz_argv : gzip_argv;
+	}
+	else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		argv = zstd_argv;
+	if (!argv)
+		return 0;
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		ERROR_ERRNO("Could not create pipe for layer %s", file);
+		goto error;
+	}
+	if (fcntl(fds[1], F_SETPIPE_SZ, TAR_PIPE_SIZE) < 0)
+		TRACE_ERRNO("Could not enlarge pipe for layer %s", file);
+	layer->filter = argv[0];
+	layer->pid = util_fork_filter(argv, layer->fd, fds[1]);
+	close(fds[1]);
+	close(layer->fd);
+	layer->fd = fds[0];
+	if (layer->pid < 0)
+		goto error;
+	return 0;
+error:
+	close(layer->fd);
+	layer->fd = -1;
+	return -1;
+}
+
+static int
+tar_layer_close(tar_layer_t *layer)
+{
+	int ret = 0;
+
+	if (layer->fd < 0)
+		return -1;
+
+	// let the decompressor write trailing data, e.g. zero blocks beyond the end marker
+	if (layer->pid > 0) {
+		char buf[TAR_BLOCK_SIZE];
+		while (fd_read(layer->fd, buf, sizeof(buf)) > 0)
+			;
+	}
+	close(layer->fd);
+	layer->fd = -1;
+	if (layer->pid > 0 && util_wait_filter(layer->pid, layer->filter) < 0) {
+		ERROR("Could not decompress layer %s", layer->file);
+		ret = -1;
+	}
+	layer->pid = -1;
+	return ret;
+}
+
+static uint64_t
+tar_parse_number(const uint8_t *field, size_t len)
+{
+	uint64_t v = 0;
+	size_t i = 0;
+
+	// GNU base-256 encoding for large values
+	if (field[0] & 0x80) {
+		v = field[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			v = (v << 8) | field[i];
+		return v;
+	}
+
+	while (i < len && field[i] == ' ')
+		i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		v = (v << 3) | (field[i] - '0');
+	return v;
+}
+
+static char *
+tar_pax_path_new(const char *data, size_t len)
+{
+	const char *p = data, *end = data + len;
+	char *path = NULL;
+
+	while (p < end) {
+		char *sp;
+		unsigned long rec_len = strtoul(p, &sp, 10);
+		if (rec_len == 0 || p + rec_len > end || *sp != ' ')
+			break;
+		const char *key = sp + 1;
+		const char *val = memchr(key, '=', p + rec_len - key);
+		if (val && val - key == 4 && !strncmp(key, "path", 4)) {
+			mem_free(path);
+			// the record is terminated by a newline
+			path = mem_strndup(val + 1, p + rec_len - 1 - (val + 1));
+		}
+		p += rec_len;
+	}
+	return path;
+}
+
+static char *
+tar_path_normalize_new(const char *path)
+{
+	for (;;) {
+		if (!strncmp(path, "./", 2))
+			path += 2;
+		else if (*path == '/')
+			path++;
+		else
+			break;
+	}
+
+	char *p = mem_strdup(path);
+	size_t len = strlen(p);
+	while (len && p[len - 1] == '/')
+		p[--len] = '\0';
+	if (!strcmp(p, "."))
+		p[0] = '\0';
+	return p;
+}
+
+static void
+tar_entry_clear(tar_entry_t *entry)
+{
+	mem_free(entry->raw);
+	mem_free(entry->path);
+	memset(entry, 0, sizeof(tar_entry_t));
+}
+
+static int
+tar_entry_raw_read(tar_layer_t *layer, tar_entry_t *entry, size_t len)
+{
+	entry->raw = mem_renew(uint8_t, entry->raw, entry->raw_len + len);
+	if (fd_read(layer->fd, (char *)entry->raw + entry->raw_len, len) != (int)len) {
+		ERROR("Layer %s is truncated", layer->file);
+		return -1;
+	}
+	entry->raw_len += len;
+	return 0;
+}
+
+/*
+ * Reads the header of the next entry of layer including preceding extension
+ * headers. Returns 1 if an entry was read, 0 at the end of the archive and -1
+ * on error.
+ */
+static int
+tar_entry_read(tar_layer_t *layer, tar_entry_t *entry)
+{
+	char *long_path = NULL;
+
+	tar_entry_clear(entry);
+	for (;;) {
+		size_t off = entry->raw_len;
+		char block[TAR_BLOCK_SIZE];
+
+		int n = fd_read(layer->fd, block, TAR_BLOCK_SIZE);
+		if (n == 0)
+			goto end;
+		if (n != TAR_BLOCK_SIZE) {
+			ERROR("Layer %s is truncated", layer->file);
+			goto error;
+		}
+		bool zero = true;
+		for (int i = 0; i < TAR_BLOCK_SIZE && zero; i++)
+			zero = !block[i];
+		if (zero)
+			goto end;
+
+		entry->raw = mem_renew(uint8_t, entry->raw, off + TAR_BLOCK_SIZE);
+		memcpy(entry->raw + off, block, TAR_BLOCK_SIZE);
+		entry->raw_len += TAR_BLOCK_SIZE;
+
+		char type = block[156];
+		uint64_t size = tar_parse_number((uint8_t *)block + 124, 12);
+
+		if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+			if (size > TAR_EXT_MAX) {
+				ERROR("Extension header of %zu bytes in layer %s", (size_t)size,
+				      layer->file);
+				goto error;
+			}
+			IF_TRUE_GOTO(tar_entry_raw_read(layer, entry, TAR_PAD(size)) < 0, error);
+			const char *data = (char *)entry->raw + off + TAR_BLOCK_SIZE;
+			if (type == 'L') {
+				mem_free(long_path);
+				long_path = mem_strndup(data, size);
+			} else if (type == 'x') {
+				char *pax_path = tar_pax_path_new(data, size);
+				if (pax_path) {
+					mem_free(long_path);
+					long_path = pax_path;
+				}
+			}
+			continue;
+		}
+
+		entry->type = type;
+		// only regular files carry data
+		entry->size = (type == '0' || type == '\0' || type == '7') ? size : 0;
+		if (long_path) {
+			entry->path = tar_path_normalize_new(long_path);
+		} else {
+			char *name = mem_strndup(block, 100);
+			char *prefix = !strncmp(block + 257, "ustar", 5) ?
+					       mem_strndup(block + 345, 155) :
+					       mem_strdup("");
+			char *path = *prefix ? mem_printf("%s/%s", prefix, name) :
+					       mem_strdup(name);
+			entry->path = tar_path_normalize_new(path);
+			mem_free(path);
+			mem_free(prefix);
+			mem_free(name);
+		}
+		mem_free(long_path);
+		return 1;
+	}
+end:
+	mem_free(long_path);
+	tar_entry_clear(entry);
+	return 0;
+error:
+	mem_free(long_path);
+	tar_entry_clear(entry);
+	return -1;
+}
+
+/*
+ * Copies the data of the current entry to fd, or skips it if fd is negative.
+ */
+static int
+tar_entry_data_copy(tar_layer_t *layer, const tar_entry_t *entry, int fd)
+{
+	static char buf[TAR_COPY_SIZE];
+	uint64_t remain = TAR_PAD(entry->size);
+
+	while (remain > 0) {
+		size_t len = MIN(remain, sizeof(buf));
+		if (fd_read(layer->fd, buf, len) != (int)len) {
+			ERROR("Layer %s is truncated", layer->file);
+			return -1;
+		}
+		if (fd >= 0 && fd_write(fd, buf, len) != (int)len) {
+			ERROR_ERRNO("Could not write merged layers");
+			return -1;
+		}
+		remain -= len;
+	}
+	return 0;
+}
+
+/*
+ * Returns the kind of the entry and the path it affects as newly allocated string.
+ */
+static int
+tar_entry_classify(const tar_entry_t *entry, char **target)
+{
+	const char *base = strrchr(entry->path, '/');
+	base = base ? base + 1 : entry->path;
+	size_t dir_len = base > entry->path ? (size_t)(base - entry->path - 1) : 0;
+
+	if (!strcmp(base, TAR_WHITEOUT_OPAQUE)) {
+		*target = mem_strndup(entry->path, dir_len);
+		return TAR_KIND_OPAQUE;
+	}
+	if (!strncmp(base, TAR_WHITEOUT_PREFIX, strlen(TAR_WHITEOUT_PREFIX))) {
+		const char *name = base + strlen(TAR_WHITEOUT_PREFIX);
+		*target = dir_len ? mem_printf("%.*s/%s", (int)dir_len, entry->path, name) :
+				    mem_strdup(name);
+		return TAR_KIND_WHITEOUT;
+	}
+	*target = mem_strdup(entry->path);
+	return entry->type == '5' ? TAR_KIND_DIR : TAR_KIND_OTHER;
+}
+
+static int
+tar_path_cmp(const void *a, const void *b)
+{
+	const tar_path_t *pa = a, *pb = b;
+	int c = strcmp(pa->path, pb->path);
+	return c ? c : pa->layer - pb->layer;
+}
+
+static int
+tar_path_cmp_key(const char *key, size_t len, const char *path)
+{
+	int c = strncmp(key, path, len);
+	return c ? c : (path[len] ? -1 : 0);
+}
+
+/*
+ * Checks if a layer above the given one has an entry of one of the given kinds
+ * at the first len characters of path.
+ */
+static bool
+tar_index_above(const tar_index_t *index, const char *path, size_t len, int layer, int kinds)
+{
+	size_t lo = 0, hi = index->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (tar_path_cmp_key(path, len, index->paths[mid].path) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (size_t i = lo;
+	     i < index->count && !tar_path_cmp_key(path, len, index->paths[i].path); i++) {
+		if (index->paths[i].layer > layer && (index->paths[i].kind & kinds))
+			return true;
+	}
+	return false;
+}
+
+static bool
+tar_index_visible(const tar_index_t *index, const char *path, int layer)
+{
+	if (tar_index_above(index, path, strlen(path), layer,
+			    TAR_KIND_DIR | TAR_KIND_OTHER | TAR_KIND_WHITEOUT))
+		return false;
+
+	// a removed, replaced or opaque parent directory hides the entry
+	for (const char *s = strchr(path, '/'); s; s = strchr(s + 1, '/')) {
+		if (tar_index_above(index, path, s - path, layer,
+				    TAR_KIND_OTHER | TAR_KIND_WHITEOUT | TAR_KIND_OPAQUE))
+			return false;
+	}
+	return true;
+}
+
+static void
+tar_index_free(tar_index_t *index)
+{
+	for (size_t i = 0; i < index->count; i++)
+		mem_free(index->paths[i].path);
+	mem_free(index->paths);
+}
+
+/*
+ * Passes all entries of the opened layer to fd (or just reads them if fd is
+ * negative), which are visible according to index (or just records them in
+ * index). The layer is closed afterwards.
+ */
+static int
+tar_layer_process(tar_layer_t *layer, int layer_no, tar_index_t *index, int fd, size_t *emitted)
+{
+	tar_entry_t entry = { 0 };
+	int ret;
+
+	while ((ret = tar_entry_read(layer, &entry)) > 0) {
+		char *target = NULL;
+		int kind = tar_entry_classify(&entry, &target);
+		bool emit = false;
+
+		if (fd < 0) {
+			// grow in steps of powers of two
+			if (!(index->count & (index->count - 1)))
+				index->paths = mem_renew(tar_path_t, index->paths,
+							 index->count ? index->count * 2 : 1);
+			index->paths[index->count].path = target;
+			index->paths[index->count].layer = layer_no;
+			index->paths[index->count].kind = kind;
+			index->count++;
+			target = NULL;
+		} else if (kind & (TAR_KIND_DIR | TAR_KIND_OTHER)) {
+			emit = tar_index_visible(index, target, layer_no);
+		}
+		mem_free(target);
+
+		if (emit) {
+			if (fd_write(fd, (char *)entry.raw, entry.raw_len) != (int)entry.raw_len) {
+				ERROR_ERRNO("Could not write merged layers");
+				ret = -1;
+				break;
+			}
+			(*emitted)++;
+		}
+		if (tar_entry_data_copy(layer, &entry, emit ? fd : -1) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	tar_entry_clear(&entry);
+	if (tar_layer_close(layer) < 0)
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Processes all layers in order like tar_layer_process(). The decompressor of
+ * the next layer is started while the current one is processed, so that
+ * decompression of the next layer overlaps with the consumer of the stream.
+ */
+static int
+tar_layers_process(const char *const *layer_files, int n, tar_index_t *index, int fd,
+		   size_t *emitted)
+{
+	tar_layer_t layers[2] = { { .fd = -1 }, { .fd = -1 } };
+
+	IF_TRUE_RETVAL(n > 0 && tar_layer_open(&layers[0], layer_files[0]) < 0, -1);
+
+	for (int i = 0; i < n; i++) {
+		tar_layer_t *layer = &layers[i % 2];
+		tar_layer_t *next = &layers[(i + 1) % 2];
+
+		if (i + 1 < n && tar_layer_open(next, layer_files[i + 1]) < 0) {
+			tar_layer_close(layer);
+			return -1;
+		}
+		INFO("%s layer[%d]: %s", fd < 0 ? "Indexing" : "Merging", i, layer_files[i]);
+		if (tar_layer_process(layer, i, index, fd, emitted) < 0) {
+			if (i + 1 < n)
+				tar_layer_close(next);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+tar_merge_layers(const char *const *layer_files, int n, int fd)
+{
+	tar_index_t index = { NULL, 0 };
+	size_t emitted = 0;
+	int ret = -1;
+
+	// first pass: find out which paths are replaced or removed by upper layers
+	IF_TRUE_GOTO(tar_layers_process(layer_files, n, &index, -1, NULL) < 0, out);
+	if (index.count)
+		qsort(index.paths, index.count, sizeof(tar_path_t), tar_path_cmp);
+
+	// second pass: stream the visible entries
+	IF_TRUE_GOTO(tar_layers_process(layer_files, n, &index, fd, &emitted) < 0, out);
+
+	// end of archive
+	char zero[2 * TAR_BLOCK_SIZE] = { 0 };
+	if (fd_write(fd, zero, sizeof(zero)) != sizeof(zero)) {
+		ERROR_ERRNO("Could not write merged layers");
+		goto out;
+	}
+	INFO("Merged %zu of %zu entries of %d layers", emitted, index.count, n);
+	ret = 0;
+out:
+	tar_index_free(&index);
+	return ret;
+}
+
+/*
+ * Appends the pax record "<len> key=value\n" to records, where len is the
+ * length of the whole record including its own digits.
+ */
+static char *
+tar_pax_record_append(char *records, const char *key, const char *value)
+{
+	size_t len = strlen(key) + strlen(value) + 3, total = len;
+
+	for (int digits = 1; snprintf(NULL, 0, "%zu", total = len + digits) != digits; digits++)
+		;
+
+	char *appended = mem_printf("%s%zu %s=%s\n", records ? records : "", total, key, value);
+	mem_free(records);
+	return appended;
+}
+
+static void
+tar_header_set_number(uint8_t *block, size_t off, size_t len, uint64_t v)
+{
+	snprintf((char *)block + off, len, "%0*" PRIo64, (int)len - 1, v);
+}
+
+static void
+tar_header_finish(uint8_t *block)
+{
+	unsigned sum = 0;
+
+	memcpy(block + 257, "ustar\0" "00", 8);
+	memset(block + 148, ' ', 8);
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += block[i];
+	snprintf((char *)block + 148, 8, "%06o", sum);
+	block[155] = ' ';
+}
+
+/*
+ * Writes an entry without data for path, based on the header block of the
+ * original entry if there is one. It is preceded by a pax header with the
+ * full path and, for opaque directories, the xattr marking them as such.
+ */
+static int
+tar_overlay_entry_write(int fd, const uint8_t *orig, const char *path, char type, bool opaque)
+{
+	uint8_t pax[TAR_BLOCK_SIZE] = { 0 };
+	uint8_t block[TAR_BLOCK_SIZE] = { 0 };
+	int ret = -1;
+
+	char *records = tar_pax_record_append(NULL, "path", path);
+	if (opaque)
+		records = tar_pax_record_append(records, TAR_XATTR_OPAQUE, "y");
+	size_t records_len = strlen(records);
+	size_t data_len = TAR_PAD(records_len);
+	char *data = mem_new0(char, data_len);
+	memcpy(data, records, records_len);
+
+	memcpy(pax, "././@PaxHeader", strlen("././@PaxHeader"));
+	tar_header_set_number(pax, 100, 8, 0644);
+	tar_header_set_number(pax, 108, 8, 0);
+	tar_header_set_number(pax, 116, 8, 0);
+	tar_header_set_number(pax, 124, 12, records_len);
+	tar_header_set_number(pax, 136, 12, 0);
+	pax[156] = 'x';
+	tar_header_finish(pax);
+
+	if (orig) {
+		// keep mode, owner and mtime, clear name, link name and prefix
+		memcpy(block, orig, TAR_BLOCK_SIZE);
+		memset(block, 0, 100);
+		memset(block + 157, 0, 100);
+		memset(block + 329, 0, TAR_BLOCK_SIZE - 329);
+	} else {
+		tar_header_set_number(block, 100, 8, 0755);
+		tar_header_set_number(block, 108, 8, 0);
+		tar_header_set_number(block, 116, 8, 0);
+		tar_header_set_number(block, 136, 12, 0);
+	}
+	memcpy(block, path, MIN(strlen(path), (size_t)100));
+	tar_header_set_number(block, 124, 12, 0);
+	block[156] = type;
+	// overlayfs whiteouts are character devices 0:0
+	if (type == '3') {
+		tar_header_set_number(block, 100, 8, 0);
+		tar_header_set_number(block, 329, 8, 0);
+		tar_header_set_number(block, 337, 8, 0);
+	}
+	tar_header_finish(block);
+
+	if (fd_write(fd, (char *)pax, TAR_BLOCK_SIZE) != TAR_BLOCK_SIZE ||
+	    fd_write(fd, data, data_len) != (int)data_len ||
+	    fd_write(fd, (char *)block, TAR_BLOCK_SIZE) != TAR_BLOCK_SIZE) {
+		ERROR_ERRNO("Could not write converted layer");
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(data);
+	mem_free(records);
+	return ret;
+}
+
+/*
+ * Passes all entries of layer to fd with its whiteouts converted according to
+ * index, which holds all paths of the layer.
+ */
+static int
+tar_layer_convert(const char *file, const tar_index_t *index, int fd)
+{
+	tar_layer_t layer;
+	tar_entry_t entry = { 0 };
+	int ret;
+
+	IF_TRUE_RETVAL(tar_layer_open(&layer, file) < 0, -1);
+
+	while ((ret = tar_entry_read(&layer, &entry)) > 0) {
+		const uint8_t *header = entry.raw + entry.raw_len - TAR_BLOCK_SIZE;
+		char *target = NULL;
+		int kind = tar_entry_classify(&entry, &target);
+		bool opaque = *target && tar_index_above(index, target, strlen(target), -1,
+							 TAR_KIND_OPAQUE);
+		bool copy = false;
+		int written = 0;
+
+		switch (kind) {
+		case TAR_KIND_WHITEOUT:
+			written = tar_overlay_entry_write(fd, header, target, '3', false);
+			break;
+		case TAR_KIND_OPAQUE:
+			// the directory carries the xattr, unless the layer lacks its entry
+			if (opaque &&
+			    !tar_index_above(index, target, strlen(target), -1, TAR_KIND_DIR))
+				written = tar_overlay_entry_write(fd, NULL, target, '5', true);
+			break;
+		case TAR_KIND_DIR:
+			if (opaque) {
+				written = tar_overlay_entry_write(fd, header, target, '5', true);
+				break;
+			}
+			// fallthrough
+		default:
+			copy = true;
+			if (fd_write(fd, (char *)entry.raw, entry.raw_len) != (int)entry.raw_len) {
+				ERROR_ERRNO("Could not write converted layer");
+				written = -1;
+			}
+		}
+		mem_free(target);
+
+		if (written < 0 || tar_entry_data_copy(&layer, &entry, copy ? fd : -1) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	tar_entry_clear(&entry);
+	if (tar_layer_close(&layer) < 0)
+		ret = -1;
+	return ret;
+}
+
+int
+tar_convert_layer(const char *layer_file, int fd)
+{
+	tar_index_t index = { NULL, 0 };
+	int ret = -1;
+
+	// first pass: find the directories of the layer and which of them are opaque
+	IF_TRUE_GOTO(tar_layers_process(&layer_file, 1, &index, -1, NULL) < 0, out);
+	if (index.count)
+		qsort(index.paths, index.count, sizeof(tar_path_t), tar_path_cmp);
+
+	// second pass: stream the entries with converted whiteouts
+	INFO("Converting layer %s", layer_file);
+	IF_TRUE_GOTO(tar_layer_convert(layer_file, &index, fd) < 0, out);
+
+	char zero[2 * TAR_BLOCK_SIZE] = { 0 };
+	if (fd_write(fd, zero, sizeof(zero)) != sizeof(zero)) {
+		ERROR_ERRNO("Could not write converted layer");
+		goto out;
+	}
+	ret = 0;
+out:
+	tar_index_free(&index);
+	return ret;
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file tar.h
+ *
+ * Merges the tar layers of a docker/OCI image into a single tar stream, which
+ * can be fed directly to an image builder instead of extracting all layers
+ * to a directory first, or converts single layers for stacking them with
+ * overlayfs.
+ */
+
+#ifndef TAR_H
+#define TAR_H
+
+/**
+ * Writes the union of the given layer tars (lowest layer first) to fd.
+ * Layers may be gzip or zstd compressed, they are decompressed on the fly.
+ * Entries of a layer replace the same paths of lower layers and OCI whiteouts
+ * (".wh.<name>" and ".wh..wh..opq") remove paths of lower layers. Every path of
+ * the resulting stream appears only once and whiteouts are not part of it.
+ * @return 0 on success, -1 on error
+ */
+int
+tar_merge_layers(const char *const *layer_files, int n, int fd);
+
+/**
+ * Writes a single layer tar to fd, converting its OCI whiteouts to the format
+ * of overlayfs, so that an image of the layer can serve as one of several
+ * overlayfs lower dirs: ".wh.<name>" becomes a character device 0:0 <name>
+ * and directories with ".wh..wh..opq" get the xattr trusted.overlay.opaque=y.
+ * @return 0 on success, -1 on error
+ */
+int
+tar_convert_layer(const char *layer_file, int fd);
+
+#endif /* TAR_H */
@@ -21,12 +21,15 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define _GNU_SOURCE
+
 #include "util.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/file.h"
 #include "common/proc.h"
+#include "common/chunk.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -34,6 +37,11 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <stdint.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fsverity.h>
 
 #include <openssl/sha.h>
 
@@ -42,6 +50,10 @@
 #define MKSQUASHFS_PATH "mksquashfs"
 #define MKSQUASHFS_COMP "gzip"
 #define MKSQUASHFS_BSIZE "131072"
+// erofs-utils 1.8 or later for multi-threaded compression
+#define MKEROFS_PATH "mkfs.erofs"
+#define MKEROFS_COMP "lz4hc"
+#define UTIL_IMAGE_ARGV_MAX 12
 
 #define SIGN_HASH_BUFFER_SIZE 4096
 
@@ -77,15 +89,8 @@
 //    }
 //}
 
-int
-util_tar_extract(const char *tar_filename, const char *out_dir)
-{
-	const char *const argv[] = { TAR_PATH, "-xvf", tar_filename, "-C", out_dir, NULL };
-	return proc_fork_and_execvp(argv);
-}
-
-static char *
-convert_bin_to_hex_new(const uint8_t *bin, int length)
+char *
+util_bin_to_hex_new(const uint8_t *bin, int length)
 {
 	char *hex = mem_alloc0(sizeof(char) * length * 2 + 1);
 
@@ -118,7 +123,7 @@ util_hash_sha_image_file_new(const char *image_file)
 	fclose(fp);
 
 	SHA1_Final(buf, &ctx);
-	return convert_bin_to_hex_new(buf, SHA_DIGEST_LENGTH);
+	return util_bin_to_hex_new(buf, SHA_DIGEST_LENGTH);
 }
 
 char *
@@ -142,17 +147,273 @@ util_hash_sha256_image_file_new(const char *image_file)
 	fclose(fp);
 
 	SHA256_Final(buf, &ctx);
-	return convert_bin_to_hex_new(buf, SHA256_DIGEST_LENGTH);
+	return util_bin_to_hex_new(buf, SHA256_DIGEST_LENGTH);
+}
+
+/*
+ * Writes a line to the chunk index and adds it to the digest of the index.
+ */
+static void
+util_chunk_index_printf(FILE *out, SHA256_CTX *index_ctx, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	char *line = mem_vprintf(fmt, ap);
+	va_end(ap);
+	fputs(line, out);
+	SHA256_Update(index_ctx, line, strlen(line));
+	mem_free(line);
+}
+
+static void
+util_chunk_index_add(FILE *out, SHA256_CTX *index_ctx, SHA256_CTX *ctx, size_t len)
+{
+	uint8_t md[SHA256_DIGEST_LENGTH];
+
+	SHA256_Final(md, ctx);
+	char *hex = util_bin_to_hex_new(md, SHA256_DIGEST_LENGTH);
+	util_chunk_index_printf(out, index_ctx, "%s %zu\n", hex, len);
+	mem_free(hex);
+}
+
+int
+util_chunk_index_image_file(const char *image_file, const char *index_file, char **sha1,
+			    char **sha256, char **index_sha256)
+{
+	FILE *fp = NULL, *out = NULL;
+	chunker_t *chunker = NULL;
+	SHA_CTX sha1_ctx;
+	SHA256_CTX ctx, sha256_ctx, index_ctx;
+	size_t n, len = 0;
+	unsigned char buf[SIGN_HASH_BUFFER_SIZE];
+	uint8_t md[SHA256_DIGEST_LENGTH];
+	int ret = -1;
+
+	if (!(fp = fopen(image_file, "rb"))) {
+		ERROR_ERRNO("Error in chunking, cannot open %s", image_file);
+		return -1;
+	}
+	if (!(out = fopen(index_file, "w"))) {
+		ERROR_ERRNO("Error in chunking, cannot create %s", index_file);
+		goto out;
+	}
+	SHA256_Init(&index_ctx);
+	util_chunk_index_printf(out, &index_ctx, "# cml chunk index v1\n");
+
+	chunker = chunker_new();
+	SHA1_Init(&sha1_ctx);
+	SHA256_Init(&sha256_ctx);
+	SHA256_Init(&ctx);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		// the digests of the whole image are computed in the same pass
+		SHA1_Update(&sha1_ctx, buf, n);
+		SHA256_Update(&sha256_ctx, buf, n);
+		for (size_t pos = 0; pos < n;) {
+			bool boundary;
+			size_t scanned = chunker_scan(chunker, buf + pos, n - pos, &boundary);
+			SHA256_Update(&ctx, buf + pos, scanned);
+			pos += scanned;
+			len += scanned;
+			if (!boundary)
+				continue;
+
+			util_chunk_index_add(out, &index_ctx, &ctx, len);
+			SHA256_Init(&ctx);
+			len = 0;
+		}
+	}
+	if (len)
+		util_chunk_index_add(out, &index_ctx, &ctx, len);
+	IF_TRUE_GOTO(ferror(fp), out);
+
+	uint8_t sha1_md[SHA_DIGEST_LENGTH];
+	SHA1_Final(sha1_md, &sha1_ctx);
+	*sha1 = util_bin_to_hex_new(sha1_md, SHA_DIGEST_LENGTH);
+	SHA256_Final(md, &sha256_ctx);
+	*sha256 = util_bin_to_hex_new(md, SHA256_DIGEST_LENGTH);
+	SHA256_Final(md, &index_ctx);
+	*index_sha256 = util_bin_to_hex_new(md, SHA256_DIGEST_LENGTH);
+	ret = 0;
+out:
+	if (out && fclose(out) != 0)
+		ret = -1;
+	if (chunker)
+		chunker_free(chunker);
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Fills argv with the image builder command line for fs. The source is a
+ * directory, or a tar stream on stdin if src is NULL.
+ */
+static void
+util_image_argv(util_image_fs_t fs, const char *src, const char *image_file, const char **argv,
+		char *workers, size_t workers_len)
+{
+	int i = 0;
+
+	if (fs == UTIL_IMAGE_FS_EROFS) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		snprintf(workers, workers_len, "--workers=%ld", cpus > 0 ? cpus : 1);
+		argv[i++] = MKEROFS_PATH;
+		argv[i++] = "-z" MKEROFS_COMP;
+		argv[i++] = workers;
+		if (!src)
+			argv[i++] = "--tar=f";
+		argv[i++] = image_file;
+		argv[i++] = src ? src : "/dev/stdin";
+	} else {
+		argv[i++] = MKSQUASHFS_PATH;
+		argv[i++] = src ? src : "-";
+		argv[i++] = image_file;
+		if (!src)
+			argv[i++] = "-tar";
+		argv[i++] = "-noappend";
+		argv[i++] = "-comp";
+		argv[i++] = MKSQUASHFS_COMP;
+		argv[i++] = "-b";
+		argv[i++] = MKSQUASHFS_BSIZE;
+	}
+	argv[i] = NULL;
+}
+
+const char *
+util_image_fs_get_name(util_image_fs_t fs)
+{
+	return fs == UTIL_IMAGE_FS_EROFS ? "erofs" : "squashfs";
 }
 
 int
-util_squash_image(const char *dir, const char *image_file)
+util_create_image(util_image_fs_t fs, const char *dir, const char *image_file)
 {
-	const char *const argv[] = { MKSQUASHFS_PATH, dir,  image_file,	      "-noappend", "-comp",
-				     MKSQUASHFS_COMP, "-b", MKSQUASHFS_BSIZE, NULL };
+	const char *argv[UTIL_IMAGE_ARGV_MAX];
+	char workers[32];
+
+	util_image_argv(fs, dir, image_file, argv, workers, sizeof(workers));
 	return proc_fork_and_execvp(argv);
 }
 
+int
+util_enable_verity(const char *image_file)
+{
+	struct fsverity_enable_arg arg = { .version = 1,
+					   .hash_algorithm = FS_VERITY_HASH_ALG_SHA256,
+					   .block_size = 4096 };
+	uint8_t buf[sizeof(struct fsverity_digest) + SHA256_DIGEST_LENGTH];
+	struct fsverity_digest *d = (struct fsverity_digest *)buf;
+	int ret = -1;
+
+	// fs-verity can only be enabled on files which are not open for writing
+	int fd = open(image_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open %s", image_file);
+		return -1;
+	}
+	if (ioctl(fd, FS_IOC_ENABLE_VERITY, &arg) < 0 && errno != EEXIST) {
+		ERROR_ERRNO("Could not enable fs-verity on %s", image_file);
+		goto out;
+	}
+
+	d->digest_size = SHA256_DIGEST_LENGTH;
+	if (ioctl(fd, FS_IOC_MEASURE_VERITY, d) < 0) {
+		ERROR_ERRNO("Could not measure fs-verity digest of %s", image_file);
+		goto out;
+	}
+	char *digest = util_bin_to_hex_new(d->digest, d->digest_size);
+	INFO("Enabled fs-verity on %s, digest sha256:%s", image_file, digest);
+	mem_free(digest);
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+pid_t
+util_fork_filter(const char *const *argv, int in_fd, int out_fd)
+{
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		ERROR_ERRNO("Could not fork for %s", argv[0]);
+		return -1;
+	}
+	if (pid == 0) {
+		if ((in_fd >= 0 && dup2(in_fd, STDIN_FILENO) < 0) ||
+		    (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0))
+			FATAL_ERRNO("Could not redirect stdio of %s", argv[0]);
+		execvp(argv[0], (char *const *)argv);
+		FATAL_ERRNO("Could not execvp %s", argv[0]);
+	}
+	return pid;
+}
+
+int
+util_wait_filter(pid_t pid, const char *name)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid) {
+		ERROR_ERRNO("Could not waitpid for '%s'", name);
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		ERROR("Child '%s' failed", name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Runs the program of argv with a tar stream written by write_tar as its stdin.
+ */
+static int
+util_pipe_tar(const char *const *argv, int (*write_tar)(int fd, void *data), void *data)
+{
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		ERROR_ERRNO("Could not create pipe for %s", argv[0]);
+		return -1;
+	}
+	pid_t pid = util_fork_filter(argv, fds[0], -1);
+	close(fds[0]);
+	if (pid < 0) {
+		close(fds[1]);
+		return -1;
+	}
+
+	// if the image builder fails, writing the stream should fail instead of killing us
+	struct sigaction sa = { .sa_handler = SIG_IGN }, old_sa;
+	sigaction(SIGPIPE, &sa, &old_sa);
+	int ret = write_tar(fds[1], data);
+	close(fds[1]);
+	if (util_wait_filter(pid, argv[0]) < 0)
+		ret = -1;
+	sigaction(SIGPIPE, &old_sa, NULL);
+	return ret;
+}
+
+int
+util_create_tar_image(util_image_fs_t fs, const char *image_file,
+		      int (*write_tar)(int fd, void *data), void *data)
+{
+	const char *argv[UTIL_IMAGE_ARGV_MAX];
+	char workers[32];
+
+	util_image_argv(fs, NULL, image_file, argv, workers, sizeof(workers));
+	return util_pipe_tar(argv, write_tar, data);
+}
+
+int
+util_tar_extract(const char *out_dir, int (*write_tar)(int fd, void *data), void *data)
+{
+	// the stream is merged already, thus entries are neither listed nor overwritten
+	const char *const argv[] = { TAR_PATH, "-x", "-f", "-", "-C", out_dir, NULL };
+	return util_pipe_tar(argv, write_tar, data);
+}
+
 int
 util_sign_guestos(const char *sig_file, const char *cfg_file, const char *key_file)
 {
@@ -24,6 +24,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 #define b64_ntop __b64_ntop
@@ -31,22 +32,96 @@
 
 #define UTIL_PKI_PATH "/pki_generator/"
 
+typedef enum util_image_fs {
+	UTIL_IMAGE_FS_SQUASHFS,
+	UTIL_IMAGE_FS_EROFS,
+} util_image_fs_t;
+
 int
 b64_ntop(unsigned char const *src, size_t srclength, char *target, size_t targsize);
 int
 b64_pton(char const *src, unsigned char *target, size_t targsize);
 
+/**
+ * Returns a newly allocated lower case hex string of the length bytes at bin.
+ */
+char *
+util_bin_to_hex_new(const uint8_t *bin, int length);
+
 char *
 util_hash_sha_image_file_new(const char *image_file);
 
 char *
 util_hash_sha256_image_file_new(const char *image_file);
 
+/**
+ * Extracts the tar stream written to fd by write_tar into out_dir, e.g. the
+ * merged layers of an image from tar_merge_layers().
+ * @return 0 on success, -1 on error
+ */
+int
+util_tar_extract(const char *out_dir, int (*write_tar)(int fd, void *data), void *data);
+
+/**
+ * Writes the index of the content defined chunks of image_file to index_file,
+ * which allows devices to update the image from a previous version by
+ * downloading only the changed chunks. The digests of the image are computed
+ * in the same pass over the file.
+ * @param sha1 Set to a newly allocated hex string of the SHA1 digest of the image.
+ * @param sha256 Set to a newly allocated hex string of the SHA256 digest of the image.
+ * @param index_sha256 Set to a newly allocated hex string of the SHA256 digest
+ *                     of the index, which is part of the signed GuestOS config.
+ * @return 0 on success, -1 on error
+ */
+int
+util_chunk_index_image_file(const char *image_file, const char *index_file, char **sha1,
+			    char **sha256, char **index_sha256);
+
+/**
+ * Creates image_file with the file system fs from the contents of dir.
+ * EROFS images are LZ4HC compressed by one worker per cpu.
+ * @return 0 on success, -1 on error
+ */
+int
+util_create_image(util_image_fs_t fs, const char *dir, const char *image_file);
+
+/**
+ * Returns the name of the file system fs as used for the fs_type of mounts.
+ */
+const char *
+util_image_fs_get_name(util_image_fs_t fs);
+
+/**
+ * Enables fs-verity on image_file, which makes the file immutable and lets
+ * the kernel verify all data read from it.
+ * @return 0 on success, -1 on error
+ */
 int
-util_tar_extract(const char *tar_filename, const char *out_dir);
+util_enable_verity(const char *image_file);
 
+/**
+ * Starts argv with its stdin and stdout redirected to in_fd and out_fd,
+ * a negative fd keeps the respective stream.
+ * @return the pid of the child or -1 on error
+ */
+pid_t
+util_fork_filter(const char *const *argv, int in_fd, int out_fd);
+
+/**
+ * Waits for the child pid started by util_fork_filter().
+ * @return 0 if it exited successfully, -1 otherwise
+ */
+int
+util_wait_filter(pid_t pid, const char *name);
+
+/**
+ * Creates image_file with the file system fs from a tar stream, which
+ * write_tar writes to the given fd, without extracting it to a directory first.
+ * @return 0 on success, -1 on error
+ */
 int
-util_squash_image(const char *dir, const char *image_file);
+util_create_tar_image(util_image_fs_t fs, const char *image_file,
+		      int (*write_tar)(int fd, void *data), void *data);
 
 int
 util_sign_guestos(const char *sig_file, const char *cfg_file, const char *key_file);
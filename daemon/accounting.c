@@ -0,0 +1,310 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "accounting.h"
+
+#include "cmld.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+#include "common/fd.h"
+#include "common/list.h"
+#include "common/sock.h"
+#include "common/str.h"
+#include "common/uuid.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ACCOUNTING_METRICS_SOCKET SOCK_PATH(metrics)
+
+/* maximum number of containers sampled per round, bounds the cost of a round */
+#define ACCOUNTING_SAMPLE_MAX 8
+
+typedef struct {
+	char *uuid;
+	char *name;
+	accounting_sample_t samples[ACCOUNTING_HISTORY_LEN]; // ring buffer
+	size_t next;
+	size_t len;
+	bool seen; // container still exists in the current round
+} accounting_entry_t;
+
+static list_t *accounting_entries = NULL;
+
+/* index of the container to be sampled next, across rounds */
+static int accounting_next_index = 0;
+
+static event_timer_t *accounting_timer = NULL;
+
+static accounting_entry_t *
+accounting_entry_get(const container_t *container)
+{
+	const char *uuid = uuid_string(container_get_uuid(container));
+	for (list_t *l = accounting_entries; l; l = l->next) {
+		accounting_entry_t *entry = l->data;
+		if (!strcmp(entry->uuid, uuid))
+			return entry;
+	}
+	return NULL;
+}
+
+static void
+accounting_entry_free(accounting_entry_t *entry)
+{
+	mem_free(entry->uuid);
+	mem_free(entry->name);
+	mem_free(entry);
+}
+
+static const accounting_sample_t *
+accounting_entry_latest(const accounting_entry_t *entry)
+{
+	IF_TRUE_RETVAL(entry->len == 0, NULL);
+	return &entry->samples[(entry->next + ACCOUNTING_HISTORY_LEN - 1) % ACCOUNTING_HISTORY_LEN];
+}
+
+static void
+accounting_sample(container_t *container)
+{
+	accounting_sample_t sample = { 0 };
+	struct timespec now;
+
+	IF_TRUE_RETURN(container_get_usage(container, &sample.usage) < 0);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	sample.time_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+	list_t *net_stats = container_get_net_stats_new(container);
+	for (list_t *l = net_stats; l; l = l->next) {
+		container_net_stats_t *stats = l->data;
+		sample.net_rx_bytes += stats->rx_bytes;
+		sample.net_tx_bytes += stats->tx_bytes;
+		container_net_stats_free(stats);
+	}
+	list_delete(net_stats);
+
+	accounting_entry_t *entry = accounting_entry_get(container);
+	if (!entry) {
+		entry = mem_new0(accounting_entry_t, 1);
+		entry->uuid = mem_strdup(uuid_string(container_get_uuid(container)));
+		entry->name = mem_strdup(container_get_name(container));
+		accounting_entries = list_append(accounting_entries, entry);
+	}
+
+	entry->samples[entry->next] = sample;
+	entry->next = (entry->next + 1) % ACCOUNTING_HISTORY_LEN;
+	entry->len = MIN(entry->len + 1, ACCOUNTING_HISTORY_LEN);
+}
+
+/*
+ * Samples the next ACCOUNTING_SAMPLE_MAX containers and drops the history of
+ * containers which have been removed.
+ */
+static void
+accounting_timer_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	int count = cmld_containers_get_count();
+	int n = MIN(count, ACCOUNTING_SAMPLE_MAX);
+
+	for (int i = 0; i < n; i++) {
+		if (accounting_next_index >= count)
+			accounting_next_index = 0;
+		accounting_sample(cmld_container_get_by_index(accounting_next_index++));
+	}
+
+	for (list_t *l = accounting_entries; l; l = l->next)
+		((accounting_entry_t *)l->data)->seen = false;
+	for (int i = 0; i < count; i++) {
+		accounting_entry_t *entry = accounting_entry_get(cmld_container_get_by_index(i));
+		if (entry)
+			entry->seen = true;
+	}
+	for (list_t *l = accounting_entries; l;) {
+		accounting_entry_t *entry = l->data;
+		list_t *next = l->next;
+		if (!entry->seen) {
+			accounting_entries = list_unlink(accounting_entries, l);
+			accounting_entry_free(entry);
+		}
+		l = next;
+	}
+}
+
+size_t
+accounting_get_samples(const container_t *container, accounting_sample_t *samples)
+{
+	ASSERT(container);
+	ASSERT(samples);
+
+	accounting_entry_t *entry = accounting_entry_get(container);
+	IF_NULL_RETVAL(entry, 0);
+
+	size_t first = (entry->next + ACCOUNTING_HISTORY_LEN - entry->len) % ACCOUNTING_HISTORY_LEN;
+	for (size_t i = 0; i < entry->len; i++)
+		samples[i] = entry->samples[(first + i) % ACCOUNTING_HISTORY_LEN];
+	return entry->len;
+}
+
+/******************************************************************************/
+/* Prometheus text export */
+
+typedef struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t offset; // of the uint64_t counter in accounting_sample_t
+	unsigned int scale; // divisor, e.g. to convert microseconds to seconds
+} accounting_metric_t;
+
+#define ACCOUNTING_METRIC(name, type, help, field, scale)                                           \
+	{                                                                                          \
+		name, type, help, offsetof(accounting_sample_t, field), scale                      \
+	}
+
+static const accounting_metric_t accounting_metrics[] = {
+	ACCOUNTING_METRIC("cml_container_cpu_usage_seconds_total", "counter",
+			  "Cpu time consumed by the container", usage.cpu_usage_us, 1000000),
+	ACCOUNTING_METRIC("cml_container_memory_bytes", "gauge",
+			  "Memory charged to the container", usage.memory_bytes, 1),
+	ACCOUNTING_METRIC("cml_container_memory_anon_bytes", "gauge",
+			  "Anonymous memory of the container", usage.memory_anon_bytes, 1),
+	ACCOUNTING_METRIC("cml_container_memory_file_bytes", "gauge",
+			  "Page cache charged to the container", usage.memory_file_bytes, 1),
+	ACCOUNTING_METRIC("cml_container_io_read_bytes_total", "counter",
+			  "Bytes read from block devices by the container", usage.io_read_bytes, 1),
+	ACCOUNTING_METRIC("cml_container_io_write_bytes_total", "counter",
+			  "Bytes written to block devices by the container", usage.io_write_bytes,
+			  1),
+	ACCOUNTING_METRIC("cml_container_network_receive_bytes_total", "counter",
+			  "Bytes received on the container's interfaces", net_rx_bytes, 1),
+	ACCOUNTING_METRIC("cml_container_network_transmit_bytes_total", "counter",
+			  "Bytes transmitted on the container's interfaces", net_tx_bytes, 1),
+};
+
+static char *
+accounting_metrics_new(void)
+{
+	str_t *text = str_new(NULL);
+
+	for (size_t m = 0; m < sizeof(accounting_metrics) / sizeof(accounting_metrics[0]); m++) {
+		const accounting_metric_t *metric = &accounting_metrics[m];
+		str_append_printf(text, "# HELP %s %s.\n# TYPE %s %s\n", metric->name, metric->help,
+				  metric->name, metric->type);
+
+		for (list_t *l = accounting_entries; l; l = l->next) {
+			accounting_entry_t *entry = l->data;
+			const accounting_sample_t *sample = accounting_entry_latest(entry);
+			if (!sample)
+				continue;
+			uint64_t value = *(const uint64_t *)((const char *)sample + metric->offset);
+
+			str_append_printf(text, "%s{container=\"%s\",uuid=\"%s\"} ", metric->name,
+					  entry->name, entry->uuid);
+			if (metric->scale > 1)
+				str_append_printf(text, "%" PRIu64 ".%06" PRIu64, value / metric->scale,
+						  value % metric->scale);
+			else
+				str_append_printf(text, "%" PRIu64, value);
+			str_append_printf(text, " %" PRIu64 "\n", sample->time_ms);
+		}
+	}
+
+	return str_free(text, false);
+}
+
+static void
+accounting_metrics_sent_cb(int fd, ssize_t len, void *data)
+{
+	char *text = data;
+
+	if (len < 0 || (size_t)len != strlen(text))
+		WARN("Could not send metrics, %zd bytes sent", len);
+	mem_free(text);
+	close(fd);
+}
+
+/*
+ * Answers each connection with the current metrics and closes it, which is
+ * all a scraper (e.g. node_exporter's textfile collector fed by socat) needs.
+ * A slow reader is served from the event loop without holding it up.
+ */
+static void
+accounting_metrics_accept_cb(int fd, UNUSED unsigned events, UNUSED event_io_t *io,
+			     UNUSED void *data)
+{
+	int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (cfd < 0) {
+		WARN_ERRNO("Could not accept metrics connection");
+		return;
+	}
+
+	char *text = accounting_metrics_new();
+	fd_write_async(cfd, text, strlen(text), &accounting_metrics_sent_cb, text);
+}
+
+static int
+accounting_metrics_init(void)
+{
+	int sock = sock_unix_create_and_bind(SOCK_STREAM | SOCK_CLOEXEC, ACCOUNTING_METRICS_SOCKET);
+	if (sock < 0) {
+		WARN("Could not create metrics socket %s", ACCOUNTING_METRICS_SOCKET);
+		return -1;
+	}
+	if (sock_unix_listen(sock) < 0) {
+		WARN("Could not listen on metrics socket %s", ACCOUNTING_METRICS_SOCKET);
+		sock_unix_close_and_unlink(sock, ACCOUNTING_METRICS_SOCKET);
+		return -1;
+	}
+
+	event_io_t *io = event_io_new(sock, EVENT_IO_READ, &accounting_metrics_accept_cb, NULL);
+	event_add_io(io);
+	return 0;
+}
+
+int
+accounting_init(unsigned int interval_s, bool metrics)
+{
+	if (interval_s == 0) {
+		INFO("Accounting disabled");
+		return 0;
+	}
+
+	if (metrics && accounting_metrics_init() < 0)
+		return -1;
+
+	accounting_timer = event_timer_new(interval_s * 1000, EVENT_TIMER_REPEAT_FOREVER,
+					   &accounting_timer_cb, NULL);
+	event_add_timer(accounting_timer);
+
+	INFO("Accounting every %u s for up to %d containers%s", interval_s, ACCOUNTING_SAMPLE_MAX,
+	     metrics ? ", exporting metrics on " ACCOUNTING_METRICS_SOCKET : "");
+	return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file accounting.h
+ *
+ * Periodically samples the cpu, memory, io and network usage of the containers
+ * and keeps a short history of samples per container, e.g., for billing. The
+ * number of containers sampled per interval is bounded, so that the cost of a
+ * sampling round does not grow with the number of containers; with more
+ * containers, each one is sampled less often instead. Optionally, the latest
+ * samples are exported in the Prometheus text format on a local socket.
+ */
+
+#ifndef ACCOUNTING_H
+#define ACCOUNTING_H
+
+#include "container.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* number of samples kept per container */
+#define ACCOUNTING_HISTORY_LEN 60
+
+typedef struct {
+	uint64_t time_ms; // CLOCK_REALTIME
+	container_usage_t usage;
+	uint64_t net_rx_bytes; // summed up over the container's interfaces
+	uint64_t net_tx_bytes;
+} accounting_sample_t;
+
+/**
+ * Copies the samples of a container, oldest first.
+ *
+ * @param container the container whose samples are returned
+ * @param samples buffer for at most ACCOUNTING_HISTORY_LEN samples
+ * @return the number of samples copied, 0 if the container has not been sampled yet
+ */
+size_t
+accounting_get_samples(const container_t *container, accounting_sample_t *samples);
+
+/**
+ * Starts sampling the containers every interval_s seconds.
+ *
+ * @param interval_s seconds between two samples of a container, 0 disables accounting
+ * @param metrics export the latest samples on the cml-metrics socket
+ * @return 0 on success or if disabled, -1 on error
+ */
+int
+accounting_init(unsigned int interval_s, bool metrics);
+
+#endif /* ACCOUNTING_H */
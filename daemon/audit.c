@@ -28,6 +28,7 @@
 #include "audit.h"
 
 #include "cmld.h"
+#include "hash.h"
 #include "smartcard.h"
 
 #include "common/audit.h"
@@ -35,22 +36,29 @@
 #include "common/uuid.h"
 #include "common/str.h"
 #include "common/macro.h"
+#include "common/probe.h"
 #include "common/dir.h"
 #include "common/file.h"
 #include "common/protobuf.h"
 #include "common/event.h"
 #include "common/fd.h"
 #include "common/nl.h"
+#include "common/list.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <linux/audit.h>
 #include <google/protobuf-c/protobuf-c-text.h>
 
 //TODO implement ACK mechanism fpr all service messages inside c-service.c?
 #include "c_service.pb-c.h"
 
-#define AUDIT_HASH_ALGO SHA512
 #define AUDIT_HASH_ALGO_LEN 64
 
 #define AUDIT_DEFAULT_CONTAINER "00000000-0000-0000-0000-000000000000"
@@ -62,6 +70,15 @@
 
 #define AUDIT_LOGDIR "/data/audit"
 
+// token bucket of audit_log_event() per container, component and category
+#define AUDIT_RATE_PER_SEC 50
+#define AUDIT_RATE_BURST 200
+#define AUDIT_COMPONENT_COUNT (TPM2D + 1)
+#define AUDIT_CATEGORY_COUNT (RLE + 1)
+
+// share of AUDIT_STORAGE only available to failed security actions
+#define AUDIT_STORAGE_RESERVED_DIV 8
+
 uint64_t AUDIT_STORAGE = 0;
 
 static AUDIT_MODE LOGMODE = CONTAINER;
@@ -112,8 +129,108 @@ audit_get_log_container(const uuid_t *uuid)
 	return c;
 }
 
+/*
+ * Audit records are stored per container in a binary, append-only log file.
+ * The file starts with a header holding the offset of the first record that
+ * has not yet been acknowledged by the container, followed by the packed
+ * records, each prefixed by its length (network byte order). Acknowledged
+ * records are dropped by advancing the head; the file is truncated once all
+ * records have been acknowledged and compacted if the acknowledged part grows
+ * too large. The log fd stays open and an in-memory index of the unacked
+ * records allows sending and acknowledging records without parsing the file.
+ *
+ * Appended records are buffered and written out in one go at the end of the
+ * current event loop iteration (or once the buffer gets large).
+ */
+#define AUDIT_LOG_MAGIC 0x314c4c41 // "ALL1"
+#define AUDIT_LOG_FLUSH_SIZE (64 * 1024)
+#define AUDIT_LOG_COMPACT_SIZE (1024 * 1024)
+#define AUDIT_LOG_MAX_RECORD_SIZE (1024 * 1024)
+#define AUDIT_LOG_SCAN_SIZE (64 * 1024) // read ahead for the record headers when scanning
+#define AUDIT_WINDOW_MAX 32
+
+/*
+ * A stored record which has been sent to c_service but not yet been
+ * acknowledged. Records are always sent in log order.
+ */
+typedef struct {
+	char *hash; ///< hash of the packed message, NULL if not the last record of a batch
+} audit_log_inflight_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t head; ///< offset of the first unacknowledged record
+} audit_log_header_t;
+
+typedef struct {
+	uint64_t off; ///< offset of the length prefix of the record
+	uint32_t len; ///< length of the packed record
+} audit_log_entry_t;
+
+typedef struct {
+	uint64_t last_ms; ///< time of the last refill, 0 if unused
+	double tokens;
+	unsigned suppressed; ///< events dropped since the last accepted one
+} audit_rate_t;
+
+typedef struct {
+	char *uuid;
+	char *file;
+	int fd;
+	uint64_t size;		  ///< size of the log including buffered records
+	uint64_t head;		  ///< offset of the first unacknowledged record
+	uint64_t used;		  ///< bytes taken by unacknowledged records
+	audit_log_entry_t *index; ///< unacknowledged records are index[first] ... index[count-1]
+	size_t first;
+	size_t count;
+	size_t index_size;
+	uint8_t *wbuf; ///< buffered records, to be written at size - wlen
+	size_t wlen;
+	size_t wbuf_size;
+	event_timer_t *flush_timer;
+	bool flush_pending;
+	const container_t *container; ///< container receiving the records
+	uint64_t seq;		      ///< sequence number of index[first]
+	audit_log_inflight_t inflight[AUDIT_WINDOW_MAX]; ///< records index[first] ... index[first+n_inflight-1]
+	size_t n_inflight;
+	size_t window; ///< max. number of records in flight
+	size_t batch;  ///< max. number of records per message, 0 if unsupported by c_service
+	audit_rate_t rate[AUDIT_COMPONENT_COUNT][AUDIT_CATEGORY_COUNT];
+} audit_log_t;
+
+static list_t *audit_logs = NULL;
+static pid_t audit_pid = 0; ///< pid of cmld owning the logs
+static audit_log_t *audit_log_last = NULL; ///< most recently used log
+
+// kernel audit messages received with a single recvmmsg
+#define AUDIT_KERNEL_BATCH_LEN 16
+static char *audit_kernel_bufs[AUDIT_KERNEL_BATCH_LEN]; ///< only used by the worker
+
+/*
+ * The kernel audit socket is drained by a worker loop, thus the kernel does not
+ * drop records while the main loop is busy. The records are handed over to the
+ * main loop in batches, as logging them accesses the containers.
+ */
+static event_base_t *audit_kernel_base = NULL;
+
+typedef struct {
+	int count;
+	int len[AUDIT_KERNEL_BATCH_LEN];
+	char *buf[AUDIT_KERNEL_BATCH_LEN];
+} audit_kernel_batch_t;
+
 static char *
 audit_log_file_new(const char *uuid)
+{
+	if (C0 == LOGMODE)
+		return mem_printf("%s/%s.alog", AUDIT_LOGDIR, AUDIT_DEFAULT_CONTAINER);
+	else
+		return mem_printf("%s/%s.alog", AUDIT_LOGDIR, uuid);
+}
+
+static char *
+audit_log_legacy_file_new(const char *uuid)
 {
 	if (C0 == LOGMODE)
 		return mem_printf("%s/%s.log", AUDIT_LOGDIR, AUDIT_DEFAULT_CONTAINER);
@@ -121,334 +238,714 @@ audit_log_file_new(const char *uuid)
 		return mem_printf("%s/%s.log", AUDIT_LOGDIR, uuid);
 }
 
-static uint64_t
-audit_remaining_storage(const char *uuid)
+static char *
+audit_log_spool_file_new(const char *uuid)
+{
+	return mem_printf("%s/%s.alog.spool", AUDIT_LOGDIR,
+			  (C0 == LOGMODE) ? AUDIT_DEFAULT_CONTAINER : uuid);
+}
+
+/*
+ * Child processes of cmld, e.g. the early start child of a container, must not
+ * touch the logs of cmld. They append their records to a spool file in the
+ * log format, which cmld imports into the log later on.
+ */
+static int
+audit_spool_append(const char *uuid, const AuditRecord *record)
+{
+	uint32_t len = protobuf_c_message_get_packed_size((const ProtobufCMessage *)record);
+	uint8_t *buf = mem_alloc(sizeof(len) + len);
+	uint32_t len_be = htonl(len);
+	int ret = -1;
+
+	memcpy(buf, &len_be, sizeof(len_be));
+	protobuf_c_message_pack((const ProtobufCMessage *)record, buf + sizeof(len_be));
+
+	char *spool = audit_log_spool_file_new(uuid);
+	int fd = open(spool, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ERROR_ERRNO("Failed to open audit spool %s", spool);
+		goto out;
+	}
+	// a single write, records of concurrent children must not interleave
+	if (write(fd, buf, sizeof(len) + len) != (ssize_t)(sizeof(len) + len))
+		ERROR_ERRNO("Failed to write audit record to spool %s", spool);
+	else
+		ret = 0;
+	close(fd);
+out:
+	mem_free(spool);
+	mem_free(buf);
+	return ret;
+}
+
+static int
+audit_log_write_header(audit_log_t *log)
 {
-	char *file = audit_log_file_new(uuid);
-	off_t size = file_size(file);
+	audit_log_header_t hdr = { .magic = AUDIT_LOG_MAGIC, .reserved = 0, .head = log->head };
 
-	if (!file_exists(file)) {
-		mem_free(file);
-		return AUDIT_STORAGE;
+	if (pwrite(log->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+		ERROR_ERRNO("Failed to write header of audit log %s", log->file);
+		return -1;
 	}
-	mem_free(file);
+	return 0;
+}
 
-	if (0 > size) {
-		ERROR_ERRNO("Failed to retrieve size of audit log file");
-		return 0;
+static void
+audit_log_index_append(audit_log_t *log, uint64_t off, uint32_t len)
+{
+	if (log->count == log->index_size) {
+		log->index_size = log->index_size ? log->index_size * 2 : 64;
+		log->index = mem_renew(audit_log_entry_t, log->index, log->index_size);
 	}
+	log->index[log->count].off = off;
+	log->index[log->count].len = len;
+	log->count++;
+}
 
-	if ((uint64_t)size > AUDIT_STORAGE) {
-		ERROR("Detected audit log overflow");
-		return 0;
+static int
+audit_log_flush(audit_log_t *log)
+{
+	IF_FALSE_RETVAL(log->wlen, 0);
+
+	uint64_t off = log->size - log->wlen;
+	size_t done = 0;
+	while (done < log->wlen) {
+		ssize_t n = pwrite(log->fd, log->wbuf + done, log->wlen - done, off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ERROR_ERRNO("Failed to write %zu buffered records to audit log %s",
+				    log->wlen - done, log->file);
+			return -1;
+		}
+		done += n;
 	}
 
-	return AUDIT_STORAGE - size;
+	TRACE("Flushed %zu bytes to audit log %s", log->wlen, log->file);
+	log->wlen = 0;
+	return 0;
 }
 
 static void
-audit_send_record_cb(const char *hash_string, const char *hash_file,
-		     UNUSED smartcard_crypto_hashalgo_t hash_algo, void *data)
+audit_log_flush_cb(UNUSED event_timer_t *timer, void *data)
 {
-	uint8_t *buf = NULL;
-	const container_t *c = (const container_t *)data;
-	ASSERT(c);
+	audit_log_t *log = data;
 
-	// callback is triggert twice for cleanup
-	IF_NULL_RETURN_TRACE(hash_string);
+	log->flush_pending = false;
+	audit_log_flush(log);
+}
 
-	if (!hash_file) {
-		ERROR("audit_send_record_cb: hash_file was empty");
-		return;
+void
+audit_flush(void)
+{
+	for (list_t *l = audit_logs; l; l = l->next)
+		audit_log_flush(l->data);
+}
+
+/*
+ * Builds the index of the unacknowledged records. A record which was only
+ * partially written, e.g. due to a power cut, is cut off. The log is read in
+ * large blocks, thus the many small records of a full log take a few reads
+ * instead of one per record.
+ */
+static int
+audit_log_scan(audit_log_t *log, uint64_t file_size)
+{
+	uint64_t off = log->head;
+	uint8_t *buf = mem_alloc(AUDIT_LOG_SCAN_SIZE);
+	uint64_t buf_off = off;
+	size_t buf_len = 0;
+
+	while (off + sizeof(uint32_t) <= file_size) {
+		uint32_t len;
+		if (off + sizeof(len) > buf_off + buf_len) {
+			ssize_t n = pread(log->fd, buf, AUDIT_LOG_SCAN_SIZE, off);
+			if (n < (ssize_t)sizeof(len)) {
+				mem_free(buf);
+				return -1;
+			}
+			buf_off = off;
+			buf_len = n;
+		}
+		memcpy(&len, buf + (off - buf_off), sizeof(len));
+		len = ntohl(len);
+		if (len > AUDIT_LOG_MAX_RECORD_SIZE || off + sizeof(len) + len > file_size)
+			break;
+		audit_log_index_append(log, off, len);
+		off += sizeof(len) + len;
 	}
+	mem_free(buf);
 
-	if (!data) {
-		ERROR("audit_send_record_cb: No container given");
-		return;
+	if (off != file_size) {
+		WARN("Dropping %" PRIu64 " bytes of incomplete record at the end of %s",
+		     file_size - off, log->file);
+		if (ftruncate(log->fd, off) < 0)
+			return -1;
 	}
 
-	uint32_t buf_len = file_size(hash_file);
-	buf = mem_alloc0(buf_len);
+	log->size = off;
+	log->used = log->size - log->head;
+	return 0;
+}
 
-	int read = file_read(hash_file, (char *)buf, buf_len);
+static int
+audit_log_append(audit_log_t *log, const AuditRecord *record);
 
-	if (read < 0 || buf_len != (unsigned int)read) {
-		ERROR("Processing SCD response: read %u bytes, expected %u", read, buf_len);
-		goto out;
-	}
+/*
+ * Converts an audit log written in the former text format, i.e. text protobuf
+ * messages separated by AUDIT_DELIMITER lines, into the binary log.
+ */
+static void
+audit_log_migrate_legacy(audit_log_t *log)
+{
+	char *legacy_file = audit_log_legacy_file_new(log->uuid);
+	IF_FALSE_GOTO_TRACE(file_exists(legacy_file), out);
+
+	INFO("Migrating audit log %s to %s", legacy_file, log->file);
+
+	char *text = file_read_new(legacy_file, AUDIT_STORAGE + 1);
+	IF_NULL_GOTO_ERROR(text, out);
 
-	TRACE("Got hash from SCD for file %s: %s", hash_file, hash_string);
+	size_t migrated = 0;
+	char *begin = text;
+	while (*begin) {
+		char *delim = strstr(begin, AUDIT_DELIMITER);
+		// the delimiter must be a line of its own
+		while (delim && delim != begin && delim[-1] != '\n')
+			delim = strstr(delim + 1, AUDIT_DELIMITER);
+		size_t len = delim ? (size_t)(delim - begin) : strlen(begin);
 
-	if (unlink(hash_file)) {
-		ERROR_ERRNO("Failed to unlink %s", hash_file);
+		AuditRecord *record = (AuditRecord *)protobuf_message_new_from_buf(
+			(uint8_t *)begin, len, &audit_record__descriptor);
+		if (record) {
+			audit_log_append(log, record);
+			protobuf_free_message((ProtobufCMessage *)record);
+			migrated++;
+		} else {
+			WARN("Skipping unparsable record in legacy audit log %s", legacy_file);
+		}
+
+		if (!delim)
+			break;
+		begin = delim + strlen(AUDIT_DELIMITER);
 	}
+	mem_free(text);
+
+	if (audit_log_flush(log) == 0 && unlink(legacy_file) < 0)
+		WARN_ERRNO("Failed to remove legacy audit log %s", legacy_file);
+	INFO("Migrated %zu audit records", migrated);
+out:
+	mem_free(legacy_file);
+}
+
+static uint8_t *
+audit_log_reserve(audit_log_t *log, uint32_t len);
 
-	char *old_acked = mem_strdup(container_audit_get_last_ack(c));
-	container_audit_set_last_ack(c, hash_string);
+static void
+audit_log_import_spool(audit_log_t *log)
+{
+	char *spool = audit_log_spool_file_new(log->uuid);
+	char *import = mem_printf("%s.import", spool);
+	uint8_t *buf = NULL;
+	int fd = -1;
 
-	if (0 > container_audit_record_send(c, buf, buf_len)) {
-		ERROR("Failed to send audit record to container");
-		// rollback
-		container_audit_set_last_ack(c, old_acked);
-		mem_free(old_acked);
+	// records spooled while importing go to a new spool file
+	if (rename(spool, import) < 0 && !file_exists(import))
+		goto out;
+
+	off_t size = file_size(import);
+	IF_TRUE_GOTO(size < 0, out);
+	buf = mem_alloc(size ? size : 1);
+
+	fd = open(import, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fd_read(fd, (char *)buf, size) != size) {
+		ERROR_ERRNO("Failed to read audit spool %s", import);
 		goto out;
 	}
-	mem_free(old_acked);
 
-	TRACE("Sent audit record with ID %s to container %s", container_audit_get_last_ack(c),
-	      uuid_string(container_get_uuid(c)));
+	size_t n = 0;
+	off_t off = 0;
+	while (off + (off_t)sizeof(uint32_t) <= size) {
+		uint32_t len;
+		memcpy(&len, buf + off, sizeof(len));
+		len = ntohl(len);
+		if (off + (off_t)sizeof(len) + len > size)
+			break;
+		memcpy(audit_log_reserve(log, len), buf + off + sizeof(len), len);
+		off += sizeof(len) + len;
+		n++;
+	}
 
+	if (audit_log_flush(log) == 0 && unlink(import) < 0)
+		WARN_ERRNO("Failed to remove audit spool %s", import);
+	DEBUG("Imported %zu spooled audit records into %s", n, log->file);
 out:
-	container_audit_set_processing_ack(c, false);
+	if (fd >= 0)
+		close(fd);
 	mem_free(buf);
+	mem_free(import);
+	mem_free(spool);
 }
 
-static AuditRecord *
-audit_record_from_textfile_new(const char *filename, bool purge)
+static audit_log_t *
+audit_log_get(const char *uuid);
+
+void
+audit_import_spooled(const uuid_t *uuid)
 {
-	ASSERT(filename);
+	IF_TRUE_RETURN(!AUDIT_STORAGE);
 
-	TRACE("audit record from textfile using log '%s'", filename);
+	audit_log_t *log = audit_log_get(uuid_string(uuid));
+	if (log)
+		audit_log_import_spool(log);
+}
 
-	FILE *file = fopen(filename, "r");
-	if (!file) {
-		WARN_ERRNO("Could not open file \"%s\" for reading.", filename);
-		return NULL;
-	}
+static void
+audit_log_inflight_clear(audit_log_inflight_t *r)
+{
+	mem_free(r->hash);
+	memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Forgets about the records in flight starting with the pos-th one, they
+ * are sent again when the window is refilled.
+ */
+static void
+audit_log_window_reset(audit_log_t *log, size_t pos)
+{
+	for (size_t i = pos; i < log->n_inflight; i++)
+		audit_log_inflight_clear(&log->inflight[i]);
+	log->n_inflight = MIN(log->n_inflight, pos);
+}
+
+static void
+audit_log_free(audit_log_t *log)
+{
+	IF_NULL_RETURN(log);
+
+	audit_log_window_reset(log, 0);
+
+	if (audit_log_last == log)
+		audit_log_last = NULL;
+	audit_log_flush(log);
+	if (log->flush_pending)
+		event_remove_timer(log->flush_timer);
+	event_timer_free(log->flush_timer);
+	if (log->fd >= 0)
+		close(log->fd);
+	mem_free(log->wbuf);
+	mem_free(log->index);
+	mem_free(log->file);
+	mem_free(log->uuid);
+	mem_free(log);
+}
 
-	ssize_t size = file_size(filename);
+static audit_log_t *
+audit_log_open(const char *uuid)
+{
+	struct stat st;
+	audit_log_header_t hdr;
 
-	if (0 > size) {
-		ERROR("Failed to retrieve size of audit record log '%s'", filename);
+	if (!file_is_dir(AUDIT_LOGDIR) && dir_mkdir_p(AUDIT_LOGDIR, 0700)) {
+		ERROR("Failed to create logdir");
 		return NULL;
 	}
 
-	// read file up to delimiter
-	char *buf = mem_alloc0(size + 1);
-	size_t read = 0;
-	bool delim_found = false;
+	audit_log_t *log = mem_new0(audit_log_t, 1);
+	log->seq = 1;
+	log->window = 1;
+	log->uuid = mem_strdup(uuid);
+	log->file = audit_log_file_new(uuid);
+	log->flush_timer = event_timer_new(0, 1, &audit_log_flush_cb, log);
 
-	while (!delim_found && read < (size_t)size) {
-		ssize_t current = 0;
-		size_t n = 0;
-		char *line = NULL;
+	log->fd = open(log->file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (log->fd < 0) {
+		ERROR_ERRNO("Failed to open audit log %s", log->file);
+		goto err;
+	}
+	IF_TRUE_GOTO_ERROR(fstat(log->fd, &st) < 0, err);
 
-		if (0 > (current = getline(&line, &n, file))) {
-			ERROR_ERRNO("Failed to read line from file");
-			fclose(file);
-			mem_free(line);
-			goto out;
+	if ((size_t)st.st_size < sizeof(hdr)) {
+		// new log
+		log->head = log->size = sizeof(hdr);
+		IF_TRUE_GOTO(ftruncate(log->fd, 0) < 0 || audit_log_write_header(log) < 0, err);
+	} else {
+		IF_TRUE_GOTO_ERROR(pread(log->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr), err);
+		if (hdr.magic != AUDIT_LOG_MAGIC || hdr.head < sizeof(hdr) ||
+		    hdr.head > (uint64_t)st.st_size) {
+			ERROR("Invalid header of audit log %s", log->file);
+			goto err;
 		}
+		log->head = hdr.head;
+		IF_TRUE_GOTO_ERROR(audit_log_scan(log, st.st_size) < 0, err);
+	}
 
-		if (read + current > (size_t)size) {
-			ERROR("File was changed while reading");
-			fclose(file);
-			mem_free(line);
-			goto out;
-		}
+	audit_log_migrate_legacy(log);
+	audit_log_import_spool(log);
 
-		// if delimiter line was read, stop further processing
-		if (!strcmp(AUDIT_DELIMITER, line)) {
-			delim_found = true;
-			mem_free(line);
-			continue;
-		}
+	TRACE("Opened audit log %s with %zu unacknowledged records", log->file, log->count);
+	return log;
+err:
+	audit_log_free(log);
+	return NULL;
+}
 
-		memcpy(buf + read, line, current);
-		read += current;
-		mem_free(line);
-	}
-	fclose(file);
+static audit_log_t *
+audit_log_get(const char *uuid)
+{
+	const char *key = (C0 == LOGMODE) ? AUDIT_DEFAULT_CONTAINER : uuid;
 
-	// parse record from file
-	AuditRecord *record;
-	if (0 == size) {
-		INFO("Read audit record with default values");
-		record = (AuditRecord *)mem_new0(AuditRecord, 1);
-		audit_record__init(record);
-		goto out;
-	} else {
-		record = (AuditRecord *)protobuf_message_new_from_buf((uint8_t *)buf, read,
-								      &audit_record__descriptor);
-	}
+	// records usually arrive in bursts for the same container
+	if (audit_log_last && !strcmp(audit_log_last->uuid, key))
+		return audit_log_last;
 
-	if (!record) {
-		ERROR("Failed to parse text protobuf message (%s) from file \"%s\".",
-		      audit_record__descriptor.name ? audit_record__descriptor.name : "UNKNOWN",
-		      filename);
-		goto out;
+	for (list_t *l = audit_logs; l; l = l->next) {
+		audit_log_t *log = l->data;
+		if (!strcmp(log->uuid, key))
+			return audit_log_last = log;
 	}
 
-	if (purge) {
-		// delete record from file
-		if (read + strlen(AUDIT_DELIMITER) == (size_t)size) {
-			DEBUG("Audit log empty, removing file");
-			if (-1 == unlink(filename)) {
-				ERROR_ERRNO("Failed to remove audit log file");
-			}
-			goto out;
-		}
-
-		char *filebuf = file_read_new(filename, AUDIT_STORAGE);
+	audit_log_t *log = audit_log_open(key);
+	if (log) {
+		audit_logs = list_append(audit_logs, log);
+		audit_log_last = log;
+	}
+	return log;
+}
 
-		if (!filebuf) {
-			ERROR("Failed to read audit log file");
-			goto out;
-		}
+/*
+ * Appends a record of len bytes to the write buffer of the log and returns
+ * where the packed record has to be put.
+ */
+static uint8_t *
+audit_log_reserve(audit_log_t *log, uint32_t len)
+{
+	size_t needed = log->wlen + sizeof(len) + len;
 
-		size_t offset = read + strlen(AUDIT_DELIMITER);
-		if (-1 == file_write(filename, filebuf + offset, strlen(filebuf + offset))) {
-			ERROR_ERRNO("Failed to remove message from file: %s", filename);
-		}
-		mem_free(filebuf);
+	if (needed > log->wbuf_size) {
+		log->wbuf_size = MAX(needed, 2 * log->wbuf_size);
+		log->wbuf = mem_renew(uint8_t, log->wbuf, log->wbuf_size);
 	}
 
-out:
-	if (buf)
-		mem_free(buf);
+	uint32_t len_be = htonl(len);
+	memcpy(log->wbuf + log->wlen, &len_be, sizeof(len_be));
+	uint8_t *record = log->wbuf + log->wlen + sizeof(len_be);
+	log->wlen = needed;
+
+	audit_log_index_append(log, log->size, len);
+	log->size += sizeof(len) + len;
+	log->used += sizeof(len) + len;
 
-	return (AuditRecord *)record;
+	return record;
 }
 
 static int
-audit_write_file(const uuid_t *uuid, const AuditRecord *msg)
+audit_log_append(audit_log_t *log, const AuditRecord *record)
 {
-	int ret = -1;
+	uint32_t len = protobuf_c_message_get_packed_size((const ProtobufCMessage *)record);
+	protobuf_c_message_pack((const ProtobufCMessage *)record, audit_log_reserve(log, len));
 
-	char *dir = mem_printf("%s/audit", AUDIT_LOGDIR);
+	if (log->wlen >= AUDIT_LOG_FLUSH_SIZE)
+		return audit_log_flush(log);
 
-	if (!file_is_dir(dir) && dir_mkdir_p(dir, 0600)) {
-		ERROR("Failed to create logdir");
-		mem_free(dir);
-		return -1;
+	if (!log->flush_pending) {
+		event_add_timer(log->flush_timer);
+		log->flush_pending = true;
 	}
-	mem_free(dir);
+	return 0;
+}
 
-	char *file = audit_log_file_new(uuid_string(uuid));
+/*
+ * Returns the pos-th unacknowledged record of the log or NULL if there is none.
+ */
+static AuditRecord *
+audit_log_read_new(audit_log_t *log, size_t pos)
+{
+	IF_TRUE_RETVAL_TRACE(log->first + pos >= log->count, NULL);
 
-	char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
+	// the record may still be buffered
+	IF_TRUE_RETVAL(audit_log_flush(log) < 0, NULL);
 
-	//TODO send error message
-	if (audit_remaining_storage(uuid_string(uuid)) <
-	    (strlen(msg_text) + strlen(AUDIT_DELIMITER))) {
-		container_t *c = cmld_container_get_by_uuid(uuid);
+	audit_log_entry_t *e = &log->index[log->first + pos];
+	uint8_t *buf = mem_alloc(e->len ? e->len : 1);
+	AuditRecord *record = NULL;
 
-		TRACE("Trying to notify container %s about stored audit events, remaining storage: %ld",
-		      (uuid_string(uuid)), audit_remaining_storage(uuid_string(uuid)));
-		if ((!c) || (-1 == container_audit_record_notify(
-					   c, audit_remaining_storage(uuid_string(uuid))))) {
-			ERROR("Failed to notify container about audit log overflow");
-		}
-		ERROR("Failed to store audit record: max. log size exceeded");
+	if (pread(log->fd, buf, e->len, e->off + sizeof(uint32_t)) != (ssize_t)e->len) {
+		ERROR_ERRNO("Failed to read audit record from %s", log->file);
 		goto out;
 	}
 
-	TRACE("Logging audit record to file: %s", file);
-	if (0 > file_write_append(file, msg_text, strlen(msg_text))) {
-		ERROR("Failed to log audit message to file: %s", file);
-		goto out;
-	}
+	record = (AuditRecord *)protobuf_unpack_message(&audit_record__descriptor, buf, e->len);
+	if (!record)
+		ERROR("Failed to unpack audit record from %s", log->file);
+out:
+	mem_free(buf);
+	return record;
+}
+
+/*
+ * Moves the unacknowledged records to the beginning of the log.
+ */
+static int
+audit_log_compact(audit_log_t *log)
+{
+	IF_TRUE_RETVAL(audit_log_flush(log) < 0, -1);
 
-	if (0 > file_write_append(file, "-----\n", strlen("-----\n"))) {
-		ERROR("Failed to log audit message to file: %s", msg_text);
+	uint64_t shift = log->head - sizeof(audit_log_header_t);
+	uint64_t live = log->size - log->head;
+	uint8_t *buf = mem_alloc(live ? live : 1);
+	int ret = -1;
+
+	if (pread(log->fd, buf, live, log->head) != (ssize_t)live ||
+	    pwrite(log->fd, buf, live, sizeof(audit_log_header_t)) != (ssize_t)live) {
+		ERROR_ERRNO("Failed to compact audit log %s", log->file);
 		goto out;
 	}
 
-	ret = 0;
+	log->head -= shift;
+	log->size -= shift;
+	IF_TRUE_GOTO(audit_log_write_header(log) < 0, out);
+	IF_TRUE_GOTO_ERROR(ftruncate(log->fd, log->size) < 0, out);
 
-out:
-	mem_free(file);
-	mem_free(msg_text);
+	// drop the acknowledged part of the index as well
+	memmove(log->index, log->index + log->first,
+		(log->count - log->first) * sizeof(audit_log_entry_t));
+	log->count -= log->first;
+	log->first = 0;
+	for (size_t i = 0; i < log->count; i++)
+		log->index[i].off -= shift;
 
+	TRACE("Compacted audit log %s by %" PRIu64 " bytes", log->file, shift);
+	ret = 0;
+out:
+	mem_free(buf);
 	return ret;
 }
 
-static AuditRecord *
-audit_next_record_new(const container_t *container, bool purge)
+/*
+ * Drops the oldest unacknowledged record from the log.
+ */
+static int
+audit_log_pop(audit_log_t *log)
 {
-	AuditRecord *r;
+	IF_TRUE_RETVAL(log->first == log->count, -1);
+
+	log->used -= sizeof(uint32_t) + log->index[log->first].len;
+	log->first++;
+
+	if (log->first == log->count) {
+		// everything acknowledged, start over
+		IF_TRUE_RETVAL(audit_log_flush(log) < 0, -1);
+		log->first = log->count = 0;
+		log->used = 0;
+		log->head = log->size = sizeof(audit_log_header_t);
+		if (ftruncate(log->fd, log->size) < 0) {
+			ERROR_ERRNO("Failed to truncate audit log %s", log->file);
+			return -1;
+		}
+		return audit_log_write_header(log);
+	}
 
-	char *file = audit_log_file_new(uuid_string(container_get_uuid(container)));
-	TRACE("next record in log file '%s'", file);
+	log->head = log->index[log->first].off;
+	if (log->head - sizeof(audit_log_header_t) >= AUDIT_LOG_COMPACT_SIZE &&
+	    log->head - sizeof(audit_log_header_t) >= log->size - log->head)
+		return audit_log_compact(log);
 
-	if (!file_exists(file)) {
-		ERROR("Failed to read audit record: no file");
-		mem_free(file);
-		return NULL;
+	return audit_log_write_header(log);
+}
+
+static uint64_t
+audit_log_remaining(const audit_log_t *log)
+{
+	if (log->used > AUDIT_STORAGE) {
+		ERROR("Detected audit log overflow");
+		return 0;
 	}
 
-	r = (AuditRecord *)audit_record_from_textfile_new(file, purge);
+	return AUDIT_STORAGE - log->used;
+}
+
+static uint64_t
+audit_remaining_storage(const char *uuid)
+{
+	audit_log_t *log = audit_log_get(uuid);
+	IF_NULL_RETVAL(log, 0);
 
-	mem_free(file);
+	return audit_log_remaining(log);
+}
 
-	return r;
+static uint64_t
+audit_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Takes a token for an event from the bucket. Returns false if the event has to
+ * be dropped, otherwise suppressed is set to the number of events dropped since
+ * the last accepted one.
+ */
+static bool
+audit_rate_take(audit_rate_t *rate, unsigned *suppressed)
+{
+	uint64_t now = audit_now_ms();
+
+	if (rate->last_ms)
+		rate->tokens += (now - rate->last_ms) * AUDIT_RATE_PER_SEC / 1000.0;
+	else
+		rate->tokens = AUDIT_RATE_BURST;
+	rate->tokens = MIN(rate->tokens, AUDIT_RATE_BURST);
+	rate->last_ms = now;
+
+	if (rate->tokens < 1) {
+		rate->suppressed++;
+		return false;
+	}
+
+	rate->tokens -= 1;
+	*suppressed = rate->suppressed;
+	rate->suppressed = 0;
+	return true;
+}
+
+/*
+ * Failed security actions and the summaries of suppressed events may use the
+ * reserved part of the storage, thus they are not pushed out by a chatty container.
+ */
+static bool
+audit_record_is_priority(const AuditRecord *msg)
+{
+	return msg->type && (!strncmp(msg->type, "FSA.", 4) || !strncmp(msg->type, "RLE.", 4));
 }
 
 static int
-audit_do_send_record(const container_t *c)
+audit_write_file(const uuid_t *uuid, const AuditRecord *msg)
 {
-	uint8_t *packed = NULL;
-	uint32_t packed_len = 0;
-	int ret = -1;
+	if (getpid() != audit_pid)
+		return audit_spool_append(uuid_string(uuid), msg);
+
+	audit_log_t *log = audit_log_get(uuid_string(uuid));
+	IF_NULL_RETVAL(log, -1);
 
-	char tmpfile[strlen(AUDIT_LOGDIR) + 14];
-	if (0 >= sprintf(tmpfile, "%s/%s", AUDIT_LOGDIR, "audit_XXXXXX")) {
-		ERROR_ERRNO("Failed to prepare temporary filename");
+	size_t len = sizeof(uint32_t) +
+		     protobuf_c_message_get_packed_size((const ProtobufCMessage *)msg);
+
+	//TODO send error message
+	uint64_t remaining = audit_log_remaining(log);
+	uint64_t reserved =
+		audit_record_is_priority(msg) ? 0 : AUDIT_STORAGE / AUDIT_STORAGE_RESERVED_DIV;
+	if (remaining < len + reserved) {
+		container_t *c = cmld_container_get_by_uuid(uuid);
+
+		TRACE("Trying to notify container %s about stored audit events, remaining storage: %" PRIu64,
+		      (uuid_string(uuid)), remaining);
+		if ((!c) || (-1 == container_audit_record_notify(c, remaining))) {
+			ERROR("Failed to notify container about audit log overflow");
+		}
+		ERROR("Failed to store audit record: max. log size exceeded");
 		return -1;
 	}
 
-	if (!strcmp("", mktemp(tmpfile))) {
-		ERROR_ERRNO("Failed to generate temporary filename");
+	TRACE("Logging audit record to file: %s", log->file);
+	if (0 > audit_log_append(log, msg)) {
+		ERROR("Failed to log audit message to file: %s", log->file);
 		return -1;
 	}
 
+	return 0;
+}
+
+/*
+ * Packs the n stored records starting with the pos-th one into a single message,
+ * hashes it in-process and sends it to c_service. c_service acknowledges the
+ * batch as a whole, thus only its last record keeps the hash.
+ */
+static int
+audit_log_send_records(audit_log_t *log, size_t pos, size_t n)
+{
+	audit_log_inflight_t *r = &log->inflight[pos + n - 1];
+	uint8_t *buf = NULL;
+	int ret = -1;
+
 	CmldToServiceMessage *message_proto = mem_new0(CmldToServiceMessage, 1);
 	cmld_to_service_message__init(message_proto);
 	message_proto->code = CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORD;
-
-	if (!(message_proto->audit_record = audit_next_record_new(c, false))) {
-		ERROR("Could not read next audit record");
-		goto out;
+	message_proto->has_audit_seq = true;
+	message_proto->audit_seq = log->seq + pos + n - 1;
+	// ask for an ACK if these are the last records for now
+	message_proto->has_audit_ack_request = true;
+	message_proto->audit_ack_request =
+		(pos + n == log->window) || (log->first + pos + n == log->count);
+
+	if (!log->batch) {
+		message_proto->audit_record = audit_log_read_new(log, pos);
+		IF_NULL_GOTO_ERROR(message_proto->audit_record, out);
+	} else {
+		message_proto->audit_records = mem_new0(AuditRecord *, n);
+		for (size_t i = 0; i < n; i++, message_proto->n_audit_records++) {
+			message_proto->audit_records[i] = audit_log_read_new(log, pos + i);
+			IF_NULL_GOTO_ERROR(message_proto->audit_records[i], out);
+		}
 	}
-	TRACE("read next audit record sucessfully");
-
-	packed_len = protobuf_pack_message_new((ProtobufCMessage *)message_proto, &packed);
 
-	if (!packed) {
+	size_t len = protobuf_pack_message_new((ProtobufCMessage *)message_proto, &buf);
+	if (!buf) {
 		ERROR("Failed to pack protobuf message");
 		goto out;
 	}
 
-	if (-1 == file_write(tmpfile, (char *)packed, packed_len)) {
-		ERROR("Failed to write packed message to file.");
+	// c_service acknowledges the records with the sha512 digest of the packed message
+	if (!(r->hash = hash_buf_sha512_new(buf, len))) {
+		ERROR("Failed to hash audit records");
 		goto out;
 	}
 
-	TRACE("Requesting scd to hash serialized protobuf message at %s", tmpfile);
-
-	// this state is needed s.t. additional ACKs from container arriving while scd is hashing the file
-	// do not lead to multiple transmissions of the same record
-	container_audit_set_processing_ack(c, true);
-
-	if (smartcard_crypto_hash_file(tmpfile, AUDIT_HASH_ALGO, audit_send_record_cb, (void *)c)) {
-		container_audit_set_processing_ack(c, false);
-		str_t *dump = str_hexdump_new((unsigned char *)packed, (int)packed_len);
-		ERROR("Failed to request hashing of record to be sent with length %u: %s.",
-		      packed_len, str_buffer(dump));
-		mem_free(dump);
+	if (container_audit_record_send(log->container, buf, len)) {
+		ERROR("Failed to send audit records with ID %s", r->hash);
+		goto out;
 	}
 
-	TRACE("sent next stored audit record sucessfully");
+	container_audit_set_last_ack(log->container, r->hash);
+	TRACE("Sent %zu audit record(s) up to %" PRIu64 " with ID %s to container %s", n,
+	      log->seq + pos + n - 1, r->hash, uuid_string(container_get_uuid(log->container)));
+
 	ret = 0;
 out:
 	if (ret < 0)
-		ERROR("Failed to send next stored audit record");
-
-	mem_free(packed);
+		audit_log_inflight_clear(r);
+	mem_free(buf);
 	protobuf_free_message((ProtobufCMessage *)message_proto);
 	return ret;
 }
 
+/*
+ * Puts stored records in flight until the window is full.
+ */
+static int
+audit_log_fill_window(audit_log_t *log)
+{
+	int ret = 0;
+
+	while (log->n_inflight < log->window && log->first + log->n_inflight < log->count) {
+		size_t n = MIN(log->window - log->n_inflight,
+			       log->count - log->first - log->n_inflight);
+		n = MIN(n, MAX(log->batch, (size_t)1));
+
+		if ((ret = audit_log_send_records(log, log->n_inflight, n)) < 0) {
+			ERROR("Failed to send next stored audit records");
+			break;
+		}
+		log->n_inflight += n;
+	}
+
+	container_audit_set_processing_ack(log->container, log->n_inflight > 0);
+	return ret;
+}
+
 static int
 audit_send_next_stored(const container_t *c)
 {
@@ -456,13 +953,14 @@ audit_send_next_stored(const container_t *c)
 		return -1;
 
 	TRACE("send_next_stored");
-	char *file = audit_log_file_new(uuid_string(container_get_uuid(c)));
+	audit_log_t *log = audit_log_get(uuid_string(container_get_uuid(c)));
+	IF_NULL_RETVAL(log, -1);
 
-	TRACE("send_next_stored log file: %s", file);
+	TRACE("send_next_stored log file: %s", log->file);
+	log->container = c;
 
-	if (!file_exists(file)) {
+	if (log->first == log->count) {
 		DEBUG("Sent all stored audit messages");
-		mem_free(file);
 
 		if (0 > container_audit_notify_complete(c)) {
 			ERROR("Failed to notify container that all records were sent");
@@ -474,13 +972,13 @@ audit_send_next_stored(const container_t *c)
 
 		return 0;
 	}
-	mem_free(file);
 
-	return audit_do_send_record(c);
+	return audit_log_fill_window(log);
 }
 
 int
-audit_process_ack(const container_t *c, const char *ack)
+audit_process_ack(const container_t *c, const char *ack, uint64_t ack_seq, uint32_t window,
+		  uint32_t batch)
 {
 	ASSERT(c);
 
@@ -498,39 +996,60 @@ audit_process_ack(const container_t *c, const char *ack)
 	if (!ack) {
 		ERROR("Got audit ACK missing hash from container %s",
 		      uuid_string(container_get_uuid(c)));
+		return -1;
 	}
 
-	if (container_audit_get_processing_ack(c)) {
-		TRACE("Already processing ACK for container %s, ignoring additional ACK",
-		      uuid_string(container_get_uuid(c)));
-		return 0;
-	}
-
-	TRACE("Got audit record ACK from container %s: %s", uuid_string(container_get_uuid(c)),
-	      ack);
-
-	TRACE("Last ack for container %s: %s", uuid_string(container_get_uuid(c)),
-	      container_audit_get_last_ack(c));
+	audit_log_t *log = audit_log_get(uuid_string(container_get_uuid(c)));
+	IF_NULL_RETVAL(log, -1);
 
-	if (match_hash(AUDIT_HASH_ALGO_LEN, container_audit_get_last_ack(c), ack)) {
-		TRACE("ACK hash matched last sent record %s", container_audit_get_last_ack(c));
+	TRACE("Got audit record ACK %" PRIu64 " from container %s: %s", ack_seq,
+	      uuid_string(container_get_uuid(c)), ack);
 
-		AuditRecord *record = audit_next_record_new(c, true);
+	log->container = c;
+	log->window = window ? MIN(window, AUDIT_WINDOW_MAX) : 1;
+	log->batch = window ? batch : 0;
 
-		if (!record) {
-			ERROR("Failed to delete audit record %s", ack);
-			return -1;
+	// the ACK is cumulative, find the (last) record it refers to
+	size_t acked = 0;
+	for (size_t i = 0; i < log->n_inflight; i++) {
+		if ((!window || ack_seq == log->seq + i) && log->inflight[i].hash &&
+		    match_hash(AUDIT_HASH_ALGO_LEN, log->inflight[i].hash, ack)) {
+			acked = i + 1;
+			break;
 		}
+	}
 
-		protobuf_free_message((ProtobufCMessage *)record);
-		TRACE("Cleaned up ack'ed record");
+	if (acked) {
+		TRACE("ACK hash matched sent record %s", ack);
 
-		container_audit_set_last_ack(c, "");
+		for (size_t i = 0; i < acked; i++) {
+			if (audit_log_pop(log) < 0) {
+				ERROR("Failed to delete audit record %s", ack);
+				audit_log_window_reset(log, 0);
+				return -1;
+			}
+			audit_log_inflight_clear(&log->inflight[i]);
+		}
+		memmove(log->inflight, log->inflight + acked,
+			(log->n_inflight - acked) * sizeof(audit_log_inflight_t));
+		memset(log->inflight + log->n_inflight - acked, 0,
+		       acked * sizeof(audit_log_inflight_t));
+		log->n_inflight -= acked;
+		log->seq += acked;
+
+		TRACE("Cleaned up %zu ack'ed records", acked);
+	} else if (window && log->n_inflight && ack_seq + 1 < log->seq) {
+		TRACE("Ignoring outdated ACK %" PRIu64, ack_seq);
+		return 0;
 	} else {
-		WARN("ACK from container %s did not match last sent audit record, try to send last stored record again",
+		WARN("ACK from container %s did not match sent audit records, try to send stored records again",
 		     uuid_string(container_get_uuid(c)));
+		audit_log_window_reset(log, 0);
 	}
 
+	if (log->n_inflight)
+		return audit_log_fill_window(log);
+
 	return audit_send_next_stored(c);
 }
 
@@ -541,6 +1060,7 @@ audit_record_log(container_t *c, AuditRecord *record)
 
 	IF_NULL_RETVAL(record, -1);
 
+	PROBE2(audit_record_log_begin, c ? container_get_name(c) : NULL, record->type);
 	if (c) {
 		if (0 != (ret = audit_write_file(container_get_uuid(c), record))) {
 			ERROR("Failed to store audit log for container %s to file",
@@ -559,8 +1079,15 @@ audit_record_log(container_t *c, AuditRecord *record)
 		uuid_free(default_uuid);
 	}
 
+	// spooled records are sent by cmld once it has imported them
+	IF_TRUE_GOTO_TRACE(getpid() != audit_pid, out);
+
 	if (c && (container_audit_get_processing_ack(c))) {
 		TRACE("Already processing ACK, do not notify container again");
+		// the new record may still fit into the window of records in flight
+		audit_log_t *log = audit_log_get(uuid_string(container_get_uuid(c)));
+		if (log && log->container == c && log->n_inflight < log->window)
+			audit_log_fill_window(log);
 		goto out;
 	}
 
@@ -573,6 +1100,7 @@ audit_record_log(container_t *c, AuditRecord *record)
 		}
 	}
 out:
+	PROBE1(audit_record_log_end, ret);
 	return ret;
 }
 
@@ -590,6 +1118,27 @@ audit_log_event(const uuid_t *uuid, AUDIT_CATEGORY category, AUDIT_COMPONENT com
 		return 0;
 	}
 
+	container_t *c = audit_get_log_container(uuid);
+	unsigned suppressed = 0;
+
+	// records of child processes are spooled, they are few and short-lived
+	if (category != RLE && getpid() == audit_pid) {
+		audit_log_t *log = audit_log_get(c ? uuid_string(container_get_uuid(c)) :
+						     AUDIT_DEFAULT_CONTAINER);
+		if (log && !audit_rate_take(&log->rate[component][category], &suppressed)) {
+			TRACE("Rate limit exceeded, dropping audit event %s.%s",
+			      audit_category_to_string(category), evtype);
+			return 0;
+		}
+	}
+
+	if (suppressed) {
+		char *count = mem_printf("%u", suppressed);
+		audit_log_event(uuid, RLE, component, evclass, "events-suppressed", subject_id, 4,
+				"category", audit_category_to_string(category), "count", count);
+		mem_free(count);
+	}
+
 	if (0 < meta_count) {
 		if (0 != (meta_count % 2)) {
 			ERROR("Odd number of variadic arguments, aborting...");
@@ -631,7 +1180,7 @@ audit_log_event(const uuid_t *uuid, AUDIT_CATEGORY category, AUDIT_COMPONENT com
 	DEBUG("Logging audit message %s", record_text ? record_text : "");
 	mem_free(record_text);
 
-	ret = audit_record_log(audit_get_log_container(uuid), record);
+	ret = audit_record_log(c, record);
 
 out:
 	//if (record)
@@ -641,34 +1190,55 @@ out:
 	return ret;
 }
 
-static void
-audit_kernel_handle_log(int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+/*
+ * Returns the value of the field key (e.g. "pid=") of a kernel audit record. Only
+ * matches at the start of a token count, thus "auid=" is not taken for "uid=".
+ */
+static const char *
+audit_kernel_field(const char *record, const char *key, size_t key_len)
 {
-	nl_sock_t *audit_sock = data;
-	ASSERT(audit_sock);
-	ASSERT(fd == nl_sock_get_fd(audit_sock));
+	for (const char *p = record; (p = strstr(p, key)); p += key_len) {
+		if (p == record || p[-1] == ' ' || p[-1] == '\'')
+			return p + key_len;
+	}
+	return NULL;
+}
 
-	char *buf = mem_new0(char, MAX_AUDIT_MESSAGE_LENGTH);
-	char *log_record = NULL;
+/*
+ * Parses a decimal field of a kernel audit record. Ids are unsigned 32 bit values
+ * in the kernel, thus an unset id (4294967295) is returned as -1 like a missing field.
+ */
+static int
+audit_kernel_field_int(const char *record, const char *key, size_t key_len)
+{
+	const char *v = audit_kernel_field(record, key, key_len);
+	if (!v || *v < '0' || *v > '9')
+		return -1;
 
-	int msg_len;
-	if ((msg_len = nl_msg_receive_kernel(audit_sock, buf, MAX_AUDIT_MESSAGE_LENGTH, false)) <=
-	    0) {
-		WARN("could not read audit meassge.");
-		goto err;
+	uint32_t n = 0;
+	for (; *v >= '0' && *v <= '9'; v++)
+		n = n * 10 + (*v - '0');
+	return (int)n;
+}
+
+static void
+audit_kernel_handle_msg(char *buf, int len)
+{
+	if (len < (int)NLMSG_HDRLEN) {
+		TRACE("discarding truncated audit message");
+		return;
 	}
 
 	struct nlmsghdr *nlmsg = (struct nlmsghdr *)buf;
 	uint16_t type = nlmsg->nlmsg_type;
+	char *log_record = NLMSG_DATA(nlmsg);
 
 	if (type == AUDIT_TRUSTED_APP) {
-		log_record = NLMSG_DATA(nlmsg);
-		int uid = -1;
-		int pid = -1;
-		sscanf(log_record, "%*s pid=%d uid=%d %*8970c", &pid, &uid);
+		int pid = audit_kernel_field_int(log_record, "pid=", 4);
+		int uid = audit_kernel_field_int(log_record, "uid=", 4);
 		TRACE("scanned pid=%d, uid=%d", pid, uid);
 		char *record_text = strstr(log_record, "msg='");
-		IF_NULL_GOTO(record_text, err);
+		IF_NULL_RETURN(record_text);
 		record_text += 5;
 		// remove closing ' char from msg string
 		int record_text_len = strlen(record_text) - 1;
@@ -680,34 +1250,92 @@ audit_kernel_handle_log(int fd, UNUSED unsigned events, UNUSED event_io_t *io, v
 	} else if (type == AUDIT_USER || type == AUDIT_LOGIN ||
 		   (type >= AUDIT_FIRST_USER_MSG && type <= AUDIT_LAST_USER_MSG) ||
 		   (type >= AUDIT_FIRST_USER_MSG2 && type <= AUDIT_LAST_USER_MSG2)) {
-		log_record = NLMSG_DATA(nlmsg);
-		int uid = -1;
-		int pid = -1;
-		sscanf(log_record, "%*s pid=%d uid=%d %*8970c", &pid, &uid);
-		char *res = strstr(log_record, "res=");
-		res = res ? res + 4 : "failed";
+		int uid = audit_kernel_field_int(log_record, "uid=", 4);
+		const char *res = audit_kernel_field(log_record, "res=", 4);
+		bool success = res && (!strncmp(res, "success", 7) || res[0] == '1');
 		container_t *c = cmld_container_get_by_uid(uid);
 		c = c ? c : cmld_containers_get_c0();
-		char *record_type = mem_printf("type=%hu", type);
-		audit_log_event(container_get_uuid(c),
-				(strstr(res, "success") || res[0] == '1') ? SSA : FSA, CMLD, KAUDIT,
+		char record_type[16];
+		snprintf(record_type, sizeof(record_type), "type=%hu", type);
+		audit_log_event(container_get_uuid(c), success ? SSA : FSA, CMLD, KAUDIT,
 				record_type, uuid_string(container_get_uuid(c)), 2, "msg",
 				log_record);
-		mem_free(record_type);
 		TRACE("audit: type=%d %s", type, log_record);
 	} else if (type == AUDIT_KERNEL ||
 		   (type >= AUDIT_FIRST_EVENT && type <= AUDIT_INTEGRITY_LAST_MSG)) {
-		log_record = NLMSG_DATA(nlmsg);
 		TRACE("audit: type=%d %s", type, log_record);
 	}
-err:
-	mem_free(buf);
+}
+
+static void
+audit_kernel_batch_free(audit_kernel_batch_t *batch)
+{
+	for (int i = 0; i < batch->count; i++)
+		mem_free(batch->buf[i]);
+	mem_free(batch);
+}
+
+// runs on the main loop
+static void
+audit_kernel_batch_cb(void *data)
+{
+	audit_kernel_batch_t *batch = data;
+
+	for (int i = 0; i < batch->count; i++)
+		audit_kernel_handle_msg(batch->buf[i], batch->len[i]);
+	audit_kernel_batch_free(batch);
+}
+
+// runs on the worker loop
+static void
+audit_kernel_handle_log(int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	nl_sock_t *audit_sock = data;
+	ASSERT(audit_sock);
+	ASSERT(fd == nl_sock_get_fd(audit_sock));
+
+	int received[AUDIT_KERNEL_BATCH_LEN];
+	int count;
+
+	// the socket is registered edge-triggered, thus drain it completely
+	while (1) {
+		count = nl_msg_receive_kernel_batch(audit_sock, audit_kernel_bufs,
+						    MAX_AUDIT_MESSAGE_LENGTH, received,
+						    AUDIT_KERNEL_BATCH_LEN);
+		if (count < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			WARN_ERRNO("could not read audit messages");
+			// the kernel dropped records (ENOBUFS), keep on draining
+			if (errno != ENOBUFS)
+				break;
+			continue;
+		}
+		audit_kernel_batch_t *batch = mem_new0(audit_kernel_batch_t, 1);
+		for (int i = 0; i < count; i++) {
+			if (received[i] <= 0)
+				continue;
+			// buffers are one byte larger than the maximum message
+			audit_kernel_bufs[i][received[i]] = '\0';
+			batch->len[batch->count] = received[i];
+			batch->buf[batch->count++] = (char *)mem_memcpy(
+				(unsigned char *)audit_kernel_bufs[i], received[i] + 1);
+		}
+		if (batch->count == 0) {
+			audit_kernel_batch_free(batch);
+			continue;
+		}
+		// on failure, the batch stays queued until the main loop is woken up otherwise
+		if (event_base_post(event_base_main_get(), &audit_kernel_batch_cb, batch) < 0)
+			WARN("Could not wake up main loop for kernel audit records");
+	}
 }
 
 int
 audit_init(uint32_t size)
 {
 	AUDIT_STORAGE = size * 1024 * 1024;
+	audit_pid = getpid();
 
 	TRACE("Initializing audit subsystem");
 
@@ -725,16 +1353,37 @@ audit_init(uint32_t size)
 		return -1;
 	}
 
-	event_io_t *audit_io_event = event_io_new(nl_sock_get_fd(audit_sock), EVENT_IO_READ,
-						  &audit_kernel_handle_log, audit_sock);
-	event_add_io(audit_io_event);
+	for (int i = 0; i < AUDIT_KERNEL_BATCH_LEN; i++)
+		if (!audit_kernel_bufs[i])
+			audit_kernel_bufs[i] = mem_alloc(MAX_AUDIT_MESSAGE_LENGTH + 1);
 
-	/* Register message handler for audit logs */
 	if (fd_make_non_blocking(nl_sock_get_fd(audit_sock))) {
 		ERROR("Could not set fd of audit netlink socket to non blocking!");
 		nl_sock_free(audit_sock);
 		return -1;
 	}
 
+	/* Register message handler for audit logs on the worker loop before it is started */
+	audit_kernel_base = event_base_new();
+	if (!audit_kernel_base) {
+		ERROR("Could not create kernel audit worker loop");
+		nl_sock_free(audit_sock);
+		return -1;
+	}
+	event_io_t *audit_io_event =
+		event_io_new(nl_sock_get_fd(audit_sock), EVENT_IO_READ | EVENT_IO_EDGE,
+			     &audit_kernel_handle_log, audit_sock);
+	event_base_add_io(audit_kernel_base, audit_io_event);
+
+	if (event_base_start_thread(audit_kernel_base) < 0) {
+		ERROR("Could not start kernel audit worker");
+		event_remove_io(audit_io_event);
+		event_io_free(audit_io_event);
+		event_base_free(audit_kernel_base);
+		audit_kernel_base = NULL;
+		nl_sock_free(audit_sock);
+		return -1;
+	}
+
 	return 0;
 }
@@ -48,8 +48,34 @@ audit_log_event(const uuid_t *uuid, AUDIT_CATEGORY category, AUDIT_COMPONENT com
 		AUDIT_EVENTCLASS evclass, const char *evtype, const char *subject_id,
 		int meta_count, ...);
 
+/**
+ * Processes an audit ACK received from a container's service and sends the
+ * next stored records.
+ *
+ * @param ack hash of the last record stored by the service
+ * @param ack_seq sequence number of that record (cumulative ACK)
+ * @param window number of records the service accepts in flight, 0 for
+ *	  services which ACK each record by hash only
+ * @param batch number of records the service accepts in a single message, 0 for
+ *	  services which only accept one record per message
+ */
 int
-audit_process_ack(const container_t *audit, const char *ack);
+audit_process_ack(const container_t *c, const char *ack, uint64_t ack_seq, uint32_t window,
+		  uint32_t batch);
+
+/**
+ * Writes all buffered audit records to their log files. Has to be called
+ * before the device is powered off or rebooted.
+ */
+void
+audit_flush(void);
+
+/**
+ * Imports the audit records, which have been logged by child processes of
+ * cmld for the given container, into the container's audit log.
+ */
+void
+audit_import_spooled(const uuid_t *uuid);
 
 int
 audit_init(uint32_t size);
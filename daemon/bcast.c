@@ -0,0 +1,195 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "bcast.h"
+
+#include "common/bcast.h"
+#include "common/event.h"
+#include "common/list.h"
+#include "common/macro.h"
+#include "common/mem.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static bcast_page_t *bcast_page = NULL;
+static int bcast_memfd = -1;
+static int bcast_fd = -1; // read-only, passed to the containers
+
+// state to be published with the next flush
+static bcast_state_t bcast_state;
+static event_timer_t *bcast_timer = NULL;
+
+// eventfds of the subscribers
+static list_t *bcast_subscribers = NULL;
+
+static void
+bcast_notify(void)
+{
+	for (list_t *l = bcast_subscribers; l; l = l->next) {
+		int efd = (int)(intptr_t)l->data;
+		if (eventfd_write(efd, 1) < 0)
+			WARN_ERRNO("Failed to notify broadcast subscriber %d", efd);
+	}
+}
+
+static void
+bcast_flush_cb(event_timer_t *timer, UNUSED void *data)
+{
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	bcast_timer = NULL;
+
+	IF_NULL_RETURN(bcast_page);
+
+	DEBUG("Publishing broadcast state (connectivity=%d, flags=0x%x, dns=%s)",
+	      bcast_state.connectivity, bcast_state.flags, bcast_state.dns);
+	bcast_page_write(bcast_page, &bcast_state);
+	bcast_notify();
+}
+
+/*
+ * Publishes the staged state once the current burst of changes is over,
+ * i.e. at most once per BCAST_DEBOUNCE_MS.
+ */
+static void
+bcast_schedule(void)
+{
+	IF_TRUE_RETURN(!bcast_page || bcast_timer);
+
+	bcast_timer = event_timer_new(BCAST_DEBOUNCE_MS, 1, &bcast_flush_cb, NULL);
+	event_add_timer(bcast_timer);
+}
+
+int
+bcast_init(void)
+{
+	IF_TRUE_RETVAL(bcast_page, 0);
+
+	bcast_memfd = bcast_page_new(&bcast_page);
+	IF_TRUE_RETVAL(bcast_memfd < 0, -1);
+
+	if ((bcast_fd = bcast_page_open_ro(bcast_memfd)) < 0) {
+		bcast_page_unmap(bcast_page);
+		bcast_page = NULL;
+		close(bcast_memfd);
+		bcast_memfd = -1;
+		return -1;
+	}
+
+	bcast_page_write(bcast_page, &bcast_state);
+	INFO("Initialized broadcast page");
+	return 0;
+}
+
+void
+bcast_cleanup(void)
+{
+	if (bcast_timer) {
+		event_remove_timer(bcast_timer);
+		event_timer_free(bcast_timer);
+		bcast_timer = NULL;
+	}
+
+	if (bcast_page) {
+		bcast_page_kill(bcast_page);
+		bcast_notify();
+		bcast_page_unmap(bcast_page);
+		bcast_page = NULL;
+	}
+	if (bcast_fd >= 0) {
+		close(bcast_fd);
+		bcast_fd = -1;
+	}
+	if (bcast_memfd >= 0) {
+		close(bcast_memfd);
+		bcast_memfd = -1;
+	}
+}
+
+void
+bcast_set_connectivity(container_connectivity_t connectivity)
+{
+	IF_TRUE_RETURN(bcast_state.connectivity == (int32_t)connectivity);
+
+	bcast_state.connectivity = connectivity;
+	bcast_schedule();
+}
+
+void
+bcast_set_dns(const char *dns)
+{
+	char buf[BCAST_DNS_LEN] = { 0 };
+	if (dns && strlen(dns) >= sizeof(buf)) {
+		WARN("DNS server '%s' too long for broadcast", dns);
+		dns = NULL;
+	}
+	if (dns)
+		strcpy(buf, dns);
+	IF_TRUE_RETURN(!strcmp(bcast_state.dns, buf));
+
+	memcpy(bcast_state.dns, buf, sizeof(buf));
+	bcast_schedule();
+}
+
+void
+bcast_set_time(time_t btime, bool unsynced)
+{
+	uint32_t flags = unsynced ? bcast_state.flags | BCAST_FLAG_TIME_UNSYNCED :
+				    bcast_state.flags & ~BCAST_FLAG_TIME_UNSYNCED;
+	IF_TRUE_RETURN(bcast_state.btime == btime && bcast_state.flags == flags);
+
+	bcast_state.btime = btime;
+	bcast_state.flags = flags;
+	bcast_schedule();
+}
+
+int
+bcast_get_fd(void)
+{
+	return bcast_fd;
+}
+
+int
+bcast_subscribe(void)
+{
+	int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd < 0) {
+		ERROR_ERRNO("Failed to create eventfd for broadcast subscriber");
+		return -1;
+	}
+
+	bcast_subscribers = list_append(bcast_subscribers, (void *)(intptr_t)efd);
+	return efd;
+}
+
+void
+bcast_unsubscribe(int efd)
+{
+	IF_TRUE_RETURN(efd < 0);
+
+	bcast_subscribers = list_remove(bcast_subscribers, (void *)(intptr_t)efd);
+	close(efd);
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file bcast.h
+ *
+ * Broadcast of host state which all containers share, i.e. the global
+ * connectivity, the host's dns server and the state of the clock. Instead of
+ * sending a message to each TrustmeService on every change, cmld publishes the
+ * state on a single broadcast page (see common/bcast.h), which each container
+ * maps read-only. Changes are coalesced for BCAST_DEBOUNCE_MS and announced by
+ * a single eventfd notification per subscriber.
+ */
+
+#ifndef BCAST_H
+#define BCAST_H
+
+#include "container.h"
+
+#include <stdbool.h>
+#include <time.h>
+
+// changes within this time are published at once
+#define BCAST_DEBOUNCE_MS 250
+
+/**
+ * Creates the broadcast page and publishes the state set so far.
+ * @return 0 on success, -1 otherwise
+ */
+int
+bcast_init(void);
+
+/**
+ * Abandons the broadcast page, e.g. before a live restart of cmld. Subscribers
+ * are notified and find the page stale, so they fetch the page of the new
+ * instance.
+ */
+void
+bcast_cleanup(void);
+
+void
+bcast_set_connectivity(container_connectivity_t connectivity);
+
+void
+bcast_set_dns(const char *dns);
+
+void
+bcast_set_time(time_t btime, bool unsynced);
+
+/**
+ * Returns the read-only fd of the broadcast page, which may be passed to
+ * subscribers, or -1 if there is no page.
+ */
+int
+bcast_get_fd(void);
+
+/**
+ * Creates an eventfd which is signaled whenever the broadcast page changes.
+ * @return the eventfd or -1 on error
+ */
+int
+bcast_subscribe(void);
+
+/**
+ * Removes and closes an eventfd returned by bcast_subscribe().
+ */
+void
+bcast_unsubscribe(int efd);
+
+#endif /* BCAST_H */
@@ -0,0 +1,196 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "boot.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+/* interval for polling pending stages if no other stage can make progress */
+#define BOOT_POLL_INTERVAL_MS 20
+
+typedef enum {
+	BOOT_STAGE_WAITING = 0,
+	BOOT_STAGE_PENDING,
+	BOOT_STAGE_DONE,
+	BOOT_STAGE_FAILED,
+} boot_stage_state_t;
+
+typedef struct {
+	const char *name;
+	boot_stage_cb_t start;
+	boot_stage_cb_t poll;
+	uint64_t deps;
+	void *data;
+	boot_stage_state_t state;
+	uint64_t begin_us; /* relative to the start of boot_run() */
+	uint64_t end_us;
+} boot_stage_t;
+
+struct boot {
+	struct timespec start;
+	unsigned int len;
+	boot_stage_t stages[BOOT_MAX_STAGES];
+};
+
+static uint64_t
+boot_now_us(const boot_t *boot)
+{
+	struct timespec now;
+	IF_TRUE_RETVAL(clock_gettime(CLOCK_MONOTONIC, &now) < 0, 0);
+
+	return (uint64_t)(now.tv_sec - boot->start.tv_sec) * 1000000 +
+	       (now.tv_nsec - boot->start.tv_nsec) / 1000;
+}
+
+boot_t *
+boot_new(void)
+{
+	return mem_new0(boot_t, 1);
+}
+
+void
+boot_free(boot_t *boot)
+{
+	mem_free(boot);
+}
+
+int
+boot_add_stage(boot_t *boot, const char *name, boot_stage_cb_t start, boot_stage_cb_t poll,
+	       uint64_t deps, void *data)
+{
+	ASSERT(boot);
+	ASSERT(name);
+	ASSERT(start);
+
+	IF_TRUE_RETVAL_ERROR(boot->len >= BOOT_MAX_STAGES, -1);
+
+	// only already added stages can be dependencies, thus the graph has no cycles
+	if (deps & ~(BOOT_DEP(boot->len) - 1)) {
+		ERROR("Boot stage %s depends on an unknown stage", name);
+		return -1;
+	}
+
+	boot_stage_t *stage = &boot->stages[boot->len];
+	stage->name = name;
+	stage->start = start;
+	stage->poll = poll;
+	stage->deps = deps;
+	stage->data = data;
+	stage->state = BOOT_STAGE_WAITING;
+
+	return boot->len++;
+}
+
+/*
+ * Updates the state of a stage from the return value of its start or poll
+ * function.
+ * @return true if the stage has finished
+ */
+static bool
+boot_stage_update(boot_t *boot, boot_stage_t *stage, int rc)
+{
+	if (rc == 1 && stage->poll) {
+		stage->state = BOOT_STAGE_PENDING;
+		return false;
+	}
+
+	stage->end_us = boot_now_us(boot);
+	if (rc == 0) {
+		stage->state = BOOT_STAGE_DONE;
+	} else {
+		WARN("Boot stage %s failed", stage->name);
+		stage->state = BOOT_STAGE_FAILED;
+	}
+	return true;
+}
+
+static void
+boot_log_profile(const boot_t *boot, uint64_t idle_us)
+{
+	uint64_t total_us = 0;
+
+	for (unsigned int i = 0; i < boot->len; ++i) {
+		const boot_stage_t *stage = &boot->stages[i];
+		INFO("boot: %-24s start %6" PRIu64 " ms, took %6" PRIu64 " ms%s", stage->name,
+		     stage->begin_us / 1000, (stage->end_us - stage->begin_us) / 1000,
+		     stage->state == BOOT_STAGE_FAILED ? " (failed)" : "");
+		total_us = MAX(total_us, stage->end_us);
+	}
+	INFO("boot: all %u stages finished after %" PRIu64 " ms, %" PRIu64 " ms waiting",
+	     boot->len, total_us / 1000, idle_us / 1000);
+}
+
+int
+boot_run(boot_t *boot)
+{
+	ASSERT(boot);
+
+	uint64_t all = boot->len ? (BOOT_DEP(boot->len - 1) << 1) - 1 : 0;
+	uint64_t finished = 0;
+	uint64_t idle_us = 0;
+	bool failed = false;
+
+	IF_TRUE_RETVAL_ERROR(clock_gettime(CLOCK_MONOTONIC, &boot->start) < 0, -1);
+
+	while (finished != all) {
+		bool progress = false;
+
+		for (unsigned int i = 0; i < boot->len; ++i) {
+			boot_stage_t *stage = &boot->stages[i];
+			int rc;
+
+			if (stage->state == BOOT_STAGE_WAITING && !(stage->deps & ~finished)) {
+				DEBUG("Starting boot stage %s", stage->name);
+				stage->begin_us = boot_now_us(boot);
+				rc = stage->start(stage->data);
+				progress = true;
+			} else if (stage->state == BOOT_STAGE_PENDING) {
+				rc = stage->poll(stage->data);
+			} else {
+				continue;
+			}
+
+			if (boot_stage_update(boot, stage, rc)) {
+				finished |= BOOT_DEP(i);
+				failed |= stage->state == BOOT_STAGE_FAILED;
+				progress = true;
+			}
+		}
+
+		// only pending stages are left, give them some time
+		if (!progress) {
+			usleep(BOOT_POLL_INTERVAL_MS * 1000);
+			idle_us += BOOT_POLL_INTERVAL_MS * 1000;
+		}
+	}
+
+	boot_log_profile(boot, idle_us);
+
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file boot.h
+ *
+ * Runs the startup stages of cmld along a dependency graph. A stage is started
+ * as soon as all stages it depends on are finished. Asynchronous stages, e.g.,
+ * the handshake with a freshly forked daemon, are started once and then polled,
+ * thus the stages which do not depend on them run while the daemon comes up.
+ * Everything happens in the calling thread before the event loop is entered.
+ * The start and duration of each stage are logged as startup profile.
+ */
+
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+
+#define BOOT_MAX_STAGES 64
+
+/**
+ * Dependency mask of the stage with the given id.
+ */
+#define BOOT_DEP(id) (UINT64_C(1) << (id))
+
+typedef struct boot boot_t;
+
+/**
+ * Starts a stage or polls an asynchronous stage.
+ * @return 0 if the stage is finished, 1 if it is still pending, -1 on error
+ */
+typedef int (*boot_stage_cb_t)(void *data);
+
+boot_t *
+boot_new(void);
+
+void
+boot_free(boot_t *boot);
+
+/**
+ * Adds a stage which is started once all stages in deps are finished.
+ * If start returns 1, poll is called until it returns 0 or -1.
+ * Failed stages count as finished, i.e., the stages depending on them still
+ * run and have to cope with the missing functionality themselves.
+ *
+ * @param name The name of the stage, not copied, e.g., a string literal.
+ * @param start The function running or starting the stage.
+ * @param poll The function polling the stage, may be NULL for synchronous stages.
+ * @param deps Or'd BOOT_DEP() of the ids of already added stages.
+ * @return the id of the stage or -1 on error
+ */
+int
+boot_add_stage(boot_t *boot, const char *name, boot_stage_cb_t start, boot_stage_cb_t poll,
+	       uint64_t deps, void *data);
+
+/**
+ * Runs all stages and logs the startup profile.
+ * @return 0 if all stages succeeded, -1 if at least one failed
+ */
+int
+boot_run(boot_t *boot);
+
+#endif /* BOOT_H */
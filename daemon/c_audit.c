@@ -25,6 +25,8 @@
 #define _GNU_SOURCE
 #endif
 
+#define MEM_TAG "container"
+
 #include "c_audit.h"
 
 #include "cmld.h"
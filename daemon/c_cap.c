@@ -21,6 +21,8 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define MEM_TAG "container"
+
 #include "c_cap.h"
 
 #include "common/macro.h"
@@ -33,7 +35,6 @@
 #include <sys/capability.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
@@ -183,20 +184,11 @@ c_cap_do_exec_cap_systime(const container_t *container, char *const *argv)
 }
 
 static void
-c_cap_exec_cap_systime_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+c_cap_exec_cap_systime_child_cb(pid_t pid, UNUSED int status, event_child_t *child,
+				UNUSED void *data)
 {
-	pid_t *pid = data;
-	int status = 0;
-
-	DEBUG("exec_cap_systime SIGCHLD handler called for PID %d", *pid);
-	if (waitpid(*pid, &status, WNOHANG) > 0) {
-		TRACE("Reaped exec_cap_systime process: %d", *pid);
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		mem_free(pid);
-	} else {
-		TRACE("Failed to reap exec_cap_systime process");
-	}
+	TRACE("Reaped exec_cap_systime process: %d", pid);
+	event_child_free(child);
 }
 
 int
@@ -227,7 +219,8 @@ c_cap_exec_cap_systime(const container_t *container, char *const *argv)
 			mem_free(uid_wrapper_lib);
 		}
 		// join container namespace but maintain root user ns
-		if (ns_join_all(container_get_pid(container), false) < 0) {
+		if (ns_join_all_pidfd(container_get_pidfd(container), container_get_pid(container),
+				      false) < 0) {
 			ERROR("Could not join namesapces");
 			exit(EXIT_FAILURE);
 		}
@@ -250,12 +243,12 @@ c_cap_exec_cap_systime(const container_t *container, char *const *argv)
 	}
 
 	// sucessfully double forked child in target pidns
-	pid_t *_pid = mem_new(pid_t, 1);
-	*_pid = pid;
 	// register reaper for intermediate process
-	event_signal_t *sigchld =
-		event_signal_new(SIGCHLD, c_cap_exec_cap_systime_sigchld_cb, _pid);
-	event_add_signal(sigchld);
+	event_child_t *child = event_child_new(pid, c_cap_exec_cap_systime_child_cb, NULL);
+	if (event_add_child(child) < 0) {
+		WARN("Failed to register reaper for exec_cap_systime process %d", pid);
+		event_child_free(child);
+	}
 	return 0;
 }
 
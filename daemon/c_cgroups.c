@@ -23,14 +23,20 @@
 
 // for gnu version of basename
 #define _GNU_SOURCE
+
+#define MEM_TAG "container"
+
 #include <string.h>
 
 #include "c_cgroups.h"
+#include "c_cgroups_v2.h"
 
 #include "hardware.h"
 #include "uevent.h"
 #include "cmld.h"
 #include "mount.h"
+#include "ksm.h"
+#include "hibernate.h"
 
 #include "common/mem.h"
 #include "common/macro.h"
@@ -40,6 +46,7 @@
 
 #include <limits.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/mount.h>
@@ -47,6 +54,7 @@
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/inotify.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 
@@ -64,18 +72,113 @@
 
 /* Define timeout for freeze in milliseconds */
 #define CGROUPS_FREEZER_TIMEOUT 5000
+/* How much later the freeze timeout may expire to share a wakeup */
+#define CGROUPS_FREEZER_TIMEOUT_SLACK 1000
 /* Define the time interval between status checks while freezing */
 #define CGROUPS_FREEZER_RETRY_INTERVAL 100
 
 #define CGROUPS_FREEZER_RETRIES CGROUPS_FREEZER_TIMEOUT / CGROUPS_FREEZER_RETRY_INTERVAL
 
-/* List of 2-element int arrays, representing maj:min of devices allowed to be used in the running containers.
-  * wildcard '*' is mapped to -1 */
-list_t *global_allowed_devs_list = NULL;
+/* PSI trigger window of the resource governor in milliseconds */
+#define CGROUPS_PRESSURE_WINDOW 1000
+/* default cpu.weight and io.weight of a cgroup */
+#define CGROUPS_PRESSURE_WEIGHT_DEFAULT 100
+
+/* default cpu.shares of a v1 cgroup */
+#define CGROUPS_CPU_SHARES_DEFAULT 1024
+/* period of the cpu bandwidth limit in us */
+#define CGROUPS_CPU_PERIOD_US 100000
+/* default blkio.weight of a v1 cgroup */
+#define CGROUPS_BLKIO_WEIGHT_DEFAULT 500
+
+typedef enum {
+	C_CGROUPS_PRESSURE_MEMORY = 0,
+	C_CGROUPS_PRESSURE_CPU,
+	C_CGROUPS_PRESSURE_IO,
+	C_CGROUPS_PRESSURE_COUNT
+} c_cgroups_pressure_t;
+
+static const char *c_cgroups_pressure_resources[C_CGROUPS_PRESSURE_COUNT] = { "memory", "cpu",
+									       "io" };
+
+/* size of the buffer for reading the accounting files, enough for memory.stat */
+#define CGROUPS_USAGE_BUF_LEN 8192
+
+typedef enum {
+	C_CGROUPS_USAGE_CPU = 0,
+	C_CGROUPS_USAGE_MEMORY,
+	C_CGROUPS_USAGE_MEMORY_STAT,
+	C_CGROUPS_USAGE_IO,
+	C_CGROUPS_USAGE_COUNT
+} c_cgroups_usage_file_t;
+
+/* accounting files of the container's cgroup(s), relative to the v2 cgroup */
+static const char *c_cgroups_usage_files_v2[C_CGROUPS_USAGE_COUNT] = { "cpu.stat",
+									"memory.current",
+									"memory.stat", "io.stat" };
+
+/* accounting files and their subsystems, i.e. "<subsys>/<uuid>/<file>" for v1 */
+static const char *c_cgroups_usage_files_v1[C_CGROUPS_USAGE_COUNT][2] = {
+	{ "cpu,cpuacct", "cpuacct.usage" },
+	{ "memory", "memory.usage_in_bytes" },
+	{ "memory", "memory.stat" },
+	{ "blkio", "blkio.throttle.io_service_bytes" },
+};
+
+/* what the memory tiers of containers are mapped to, see container_memory_priority_t */
+typedef struct {
+	int oom_score_adj;	 /* of the container's init, inherited by its children */
+	bool protect;		 /* memory.low (v2) or soft limit (v1) shields the memory */
+	unsigned int swappiness; /* only available with v1 */
+} c_cgroups_memory_tier_t;
+
+static const c_cgroups_memory_tier_t c_cgroups_memory_tiers[] = {
+	[CONTAINER_MEMORY_PRIORITY_NONE] = { 0, false, 60 },
+	[CONTAINER_MEMORY_PRIORITY_FOREGROUND] = { -300, true, 20 },
+	[CONTAINER_MEMORY_PRIORITY_BACKGROUND] = { 300, false, 60 },
+	[CONTAINER_MEMORY_PRIORITY_BEST_EFFORT] = { 700, false, 100 },
+};
+
+/* minor number of the per major counters of a devset, never parsed from a rule */
+#define C_CGROUPS_DEVSET_MAJOR_TOTAL INT_MIN
+
+typedef struct {
+	int major;
+	int minor;
+	unsigned int count; /* 0 for removed entries, which are dropped on the next rehash */
+	bool used;
+} c_cgroups_devset_entry_t;
+
+/*
+ * Multiset of maj:min pairs, wildcard '*' is mapped to -1. Besides the pairs
+ * themselves, the open addressing table holds one counter per major under the
+ * key (major, C_CGROUPS_DEVSET_MAJOR_TOTAL) and the number of pairs with a
+ * wildcard major is kept in any, so that every match is at most two lookups.
+ */
+typedef struct {
+	c_cgroups_devset_entry_t *entries;
+	size_t capacity; /* power of 2 */
+	size_t used;	 /* slots in use, including removed entries */
+	unsigned int size;
+	unsigned int any;
+} c_cgroups_devset_t;
+
+/* maj:min of devices allowed to be used in the running containers */
+static c_cgroups_devset_t global_allowed_devs = { NULL, 0, 0, 0, 0 };
+
+/* maj:min of devices exclusively assigned to the running containers */
+static c_cgroups_devset_t global_assigned_devs = { NULL, 0, 0, 0, 0 };
+
+/* Use the cgroup v2 unified hierarchy instead of the v1 controller hierarchies */
+static bool c_cgroups_unified = false;
 
-/* List of 2-element int arrays, representing maj:min of devices exclusively assigned to the running containers.
-  * wildcard '*' is mapped to -1 */
-list_t *global_assigned_devs_list = NULL;
+static c_cgroups_pressure_policy_t c_cgroups_pressure_policy = { 0, 0, 0, 100, 0 };
+
+/* lifts the throttling of the resource governor once no pressure was reported for a while */
+static event_timer_t *c_cgroups_pressure_relax_timer = NULL;
+
+/* all c_cgroups instances, for the resource governor to throttle the other containers */
+static list_t *c_cgroups_list = NULL;
 
 struct c_cgroups {
 	container_t *container; // weak reference
@@ -83,28 +186,106 @@ struct c_cgroups {
 	list_t *active_cgroups;
 
 	event_inotify_t *inotify_freezer_state;
+	int freezer_events_fd;		  /* cgroup.events, signals POLLPRI on changes (v2 only) */
+	event_io_t *freezer_events_io;
 	event_timer_t *freeze_timer; /* timer to handle a container freeze timeout */
 	int freezer_retries;
-	list_t *assigned_devs; /* list of 2 element int arrays, representing maj:min of exclusively assigned devices.
-				  wildcard '*' is mapped to -1 */
-	list_t *allowed_devs; /* list of 2 element int arrays, representing maj:min of devices allowed to be accessed.
-				  wildcard '*' is mapped to -1 */
+	c_cgroups_devset_t assigned_devs; /* maj:min of exclusively assigned devices */
+	c_cgroups_devset_t allowed_devs;  /* maj:min of devices allowed to be accessed */
 	bool ns_cgroup;
+
+	c_cgroups_v2_devices_t *devices_v2; /* device policy evaluated by BPF (v2 only) */
+
+	int pressure_fd[C_CGROUPS_PRESSURE_COUNT];	   /* PSI triggers (v2 only) */
+	event_io_t *pressure_io[C_CGROUPS_PRESSURE_COUNT]; /* NULL if not watched */
+	bool pressure_throttled[C_CGROUPS_PRESSURE_COUNT]; /* throttled by the governor */
+	unsigned int cpu_weight; /* cpu.weight if not throttled by the governor (v2 only) */
+	unsigned int io_weight;	 /* io.weight if not throttled by the governor (v2 only) */
+
+	int usage_fd[C_CGROUPS_USAGE_COUNT]; /* kept open while running, -1 if not available */
+
+	int clone_fd;	  /* child cgroup to create the container init in (v2 only) */
+	bool cloned_into; /* the container init was created in its child cgroup */
 };
 
+void
+c_cgroups_set_pressure_policy(const c_cgroups_pressure_policy_t *policy)
+{
+	ASSERT(policy);
+
+	c_cgroups_pressure_policy = *policy;
+
+	unsigned int *stall_ms[C_CGROUPS_PRESSURE_COUNT] = {
+		&c_cgroups_pressure_policy.memory_stall_ms, &c_cgroups_pressure_policy.cpu_stall_ms,
+		&c_cgroups_pressure_policy.io_stall_ms
+	};
+	for (int i = 0; i < C_CGROUPS_PRESSURE_COUNT; i++) {
+		if (*stall_ms[i] >= CGROUPS_PRESSURE_WINDOW) {
+			WARN("%s stall of %u ms exceeds the pressure window, disabling",
+			     c_cgroups_pressure_resources[i], *stall_ms[i]);
+			*stall_ms[i] = 0;
+		}
+		if (*stall_ms[i] && !c_cgroups_unified) {
+			WARN("%s pressure governor requires cgroups v2, disabling",
+			     c_cgroups_pressure_resources[i]);
+			*stall_ms[i] = 0;
+		}
+	}
+	if (c_cgroups_pressure_policy.throttle_percent == 0 ||
+	    c_cgroups_pressure_policy.throttle_percent > 100) {
+		WARN("Invalid throttle percentage %u, using 100",
+		     c_cgroups_pressure_policy.throttle_percent);
+		c_cgroups_pressure_policy.throttle_percent = 100;
+	}
+}
+
+bool
+c_cgroups_set_unified(bool unified)
+{
+	if (unified && !c_cgroups_v2_supported()) {
+		WARN("cgroup2 not supported by kernel, falling back to cgroups v1");
+		unified = false;
+	}
+	c_cgroups_unified = unified;
+	INFO("Using cgroups %s", c_cgroups_unified ? "v2 unified hierarchy" : "v1 hierarchies");
+	return c_cgroups_unified;
+}
+
+int
+c_cgroups_mount(void)
+{
+	if (c_cgroups_unified)
+		return c_cgroups_v2_mount();
+
+	list_t *subsystems = hardware_get_active_cgroups_subsystems();
+	int ret = mount_cgroups(subsystems);
+	list_delete(subsystems);
+	return ret;
+}
+
 c_cgroups_t *
 c_cgroups_new(container_t *container)
 {
 	c_cgroups_t *cgroups = mem_new0(c_cgroups_t, 1);
 	cgroups->container = container;
-	//cgroups->cgroup_path = mem_printf("%s/%s", CONTAINER_HIERARCHY, uuid_string(container_get_uuid(cgroups->container)));
+	/* only used with the unified hierarchy, v1 paths are per subsystem */
+	cgroups->cgroup_path = mem_printf("%s/%s", CGROUPS_FOLDER,
+					  uuid_string(container_get_uuid(cgroups->container)));
 	cgroups->active_cgroups = hardware_get_active_cgroups_subsystems();
 
 	cgroups->inotify_freezer_state = NULL;
+	cgroups->freezer_events_fd = -1;
+	cgroups->freezer_events_io = NULL;
 	cgroups->freeze_timer = NULL;
-	cgroups->assigned_devs = NULL;
-	cgroups->allowed_devs = NULL;
 	cgroups->ns_cgroup = file_exists("/proc/self/ns/cgroup");
+	cgroups->devices_v2 = NULL;
+	for (int i = 0; i < C_CGROUPS_USAGE_COUNT; i++)
+		cgroups->usage_fd[i] = -1;
+	cgroups->clone_fd = -1;
+	cgroups->cpu_weight = CGROUPS_PRESSURE_WEIGHT_DEFAULT;
+	cgroups->io_weight = CGROUPS_PRESSURE_WEIGHT_DEFAULT;
+
+	c_cgroups_list = list_append(c_cgroups_list, cgroups);
 	return cgroups;
 }
 
@@ -112,6 +293,7 @@ void
 c_cgroups_free(c_cgroups_t *cgroups)
 {
 	ASSERT(cgroups);
+	c_cgroups_list = list_remove(c_cgroups_list, cgroups);
 	mem_free(cgroups->cgroup_path);
 	mem_free(cgroups);
 }
@@ -239,59 +421,152 @@ out:
 	return ret;
 }
 
+static size_t
+c_cgroups_devset_hash(int major, int minor)
+{
+	return ((unsigned int)major * 2654435761u) ^ ((unsigned int)minor * 2246822519u);
+}
+
+static c_cgroups_devset_entry_t *
+c_cgroups_devset_lookup(const c_cgroups_devset_t *set, int major, int minor)
+{
+	IF_TRUE_RETVAL(set->capacity == 0, NULL);
+
+	size_t mask = set->capacity - 1;
+	for (size_t i = c_cgroups_devset_hash(major, minor) & mask;; i = (i + 1) & mask) {
+		c_cgroups_devset_entry_t *entry = &set->entries[i];
+		if (!entry->used)
+			return entry;
+		if (entry->major == major && entry->minor == minor)
+			return entry;
+	}
+}
+
 static void
-c_cgroups_list_add(list_t **list, const int *dev)
+c_cgroups_devset_rehash(c_cgroups_devset_t *set)
 {
-	int *dev_copy = mem_new0(int, 2);
-	memcpy(dev_copy, dev, sizeof(int) * 2);
-	*list = list_append(*list, dev_copy);
+	size_t live = 0;
+	for (size_t i = 0; i < set->capacity; i++)
+		if (set->entries[i].count > 0)
+			live++;
+
+	size_t capacity = 16;
+	while ((live + 1) * 2 > capacity)
+		capacity *= 2;
+
+	c_cgroups_devset_t rehashed = { mem_new0(c_cgroups_devset_entry_t, capacity), capacity, 0,
+				   set->size, set->any };
+	for (size_t i = 0; i < set->capacity; i++) {
+		c_cgroups_devset_entry_t *entry = &set->entries[i];
+		if (entry->count == 0)
+			continue;
+		*c_cgroups_devset_lookup(&rehashed, entry->major, entry->minor) = *entry;
+		rehashed.used++;
+	}
+	mem_free(set->entries);
+	*set = rehashed;
 }
 
 static void
-c_cgroups_list_remove(list_t **list, const int *dev)
-{
-	for (list_t *elem = *list; elem != NULL; elem = elem->next) {
-		int *dev_elem = (int *)elem->data;
-		if ((dev_elem[0] == dev[0]) && (dev_elem[1] == dev[1])) {
-			mem_free(elem->data);
-			*list = list_unlink(*list, elem);
-			break;
-		}
+c_cgroups_devset_adjust(c_cgroups_devset_t *set, int major, int minor, int delta)
+{
+	if ((set->used + 1) * 4 > set->capacity * 3)
+		c_cgroups_devset_rehash(set);
+
+	c_cgroups_devset_entry_t *entry = c_cgroups_devset_lookup(set, major, minor);
+	if (!entry->used) {
+		entry->major = major;
+		entry->minor = minor;
+		entry->used = true;
+		set->used++;
 	}
+	entry->count += delta;
+}
+
+static unsigned int
+c_cgroups_devset_count(const c_cgroups_devset_t *set, int major, int minor)
+{
+	const c_cgroups_devset_entry_t *entry = c_cgroups_devset_lookup(set, major, minor);
+	return entry ? entry->count : 0;
+}
+
+static void
+c_cgroups_devset_add(c_cgroups_devset_t *set, const int *dev)
+{
+	c_cgroups_devset_adjust(set, dev[0], dev[1], 1);
+	if (dev[0] == -1)
+		set->any++;
+	else
+		c_cgroups_devset_adjust(set, dev[0], C_CGROUPS_DEVSET_MAJOR_TOTAL, 1);
+	set->size++;
+}
+
+/* removes one occurrence of exactly the pair dev */
+static void
+c_cgroups_devset_remove(c_cgroups_devset_t *set, const int *dev)
+{
+	IF_TRUE_RETURN(c_cgroups_devset_count(set, dev[0], dev[1]) == 0);
+
+	c_cgroups_devset_adjust(set, dev[0], dev[1], -1);
+	if (dev[0] == -1)
+		set->any--;
+	else
+		c_cgroups_devset_adjust(set, dev[0], C_CGROUPS_DEVSET_MAJOR_TOTAL, -1);
+	set->size--;
 }
 
 static int
-c_cgroups_list_contains_match(const list_t *list, const int *dev)
+c_cgroups_devset_contains_match(const c_cgroups_devset_t *set, const int *dev)
+{
+	IF_TRUE_RETVAL(set->size == 0, 0);
+
+	if ((set->any > 0) || (dev[0] == -1))
+		return 1;
+	if (dev[1] == -1)
+		return c_cgroups_devset_count(set, dev[0], C_CGROUPS_DEVSET_MAJOR_TOTAL) > 0;
+	return (c_cgroups_devset_count(set, dev[0], dev[1]) > 0) ||
+	       (c_cgroups_devset_count(set, dev[0], -1) > 0);
+}
+
+/* removes all pairs of set from global and frees set */
+static void
+c_cgroups_devset_release(c_cgroups_devset_t *set, c_cgroups_devset_t *global)
 {
-	for (const list_t *elem = list; elem != NULL; elem = elem->next) {
-		const int *dev_elem = (const int *)elem->data;
-		if ((dev_elem[0] == -1) || (dev[0] == -1))
-			return 1;
-		if (dev_elem[0] != dev[0])
+	for (size_t i = 0; i < set->capacity; i++) {
+		c_cgroups_devset_entry_t *entry = &set->entries[i];
+		if (entry->major != -1 && entry->minor == C_CGROUPS_DEVSET_MAJOR_TOTAL)
 			continue;
-		if ((dev[1] == -1) || (dev_elem[1] == -1) || (dev[1] == dev_elem[1]))
-			return 1;
+		int dev[2] = { entry->major, entry->minor };
+		for (unsigned int n = 0; n < entry->count; n++)
+			c_cgroups_devset_remove(global, dev);
 	}
-	return 0;
+	mem_free(set->entries);
+	memset(set, 0, sizeof(*set));
 }
 
 static void
 c_cgroups_add_allowed(c_cgroups_t *cgroups, const int *dev)
 {
-	c_cgroups_list_add(&global_allowed_devs_list, dev);
-	c_cgroups_list_add(&cgroups->allowed_devs, dev);
+	c_cgroups_devset_add(&global_allowed_devs, dev);
+	c_cgroups_devset_add(&cgroups->allowed_devs, dev);
 }
 
 static void
 c_cgroups_add_assigned(c_cgroups_t *cgroups, const int *dev)
 {
-	c_cgroups_list_add(&global_assigned_devs_list, dev);
-	c_cgroups_list_add(&cgroups->assigned_devs, dev);
+	c_cgroups_devset_add(&global_assigned_devs, dev);
+	c_cgroups_devset_add(&cgroups->assigned_devs, dev);
 }
 
 static int
 c_cgroups_allow_rule(c_cgroups_t *cgroups, const char *rule)
 {
+	if (c_cgroups_unified) {
+		if (!cgroups->devices_v2)
+			cgroups->devices_v2 = c_cgroups_v2_devices_new();
+		return c_cgroups_v2_devices_rule_add(cgroups->devices_v2, rule, true);
+	}
+
 	// first allow in host-side list, which cannot manipulated by container (if namspaced)
 	char *path = mem_printf("%s/devices/%s/devices.allow", CGROUPS_FOLDER,
 				uuid_string(container_get_uuid(cgroups->container)));
@@ -325,7 +600,7 @@ c_cgroups_devices_allow(c_cgroups_t *cgroups, const char *rule)
 	ASSERT(rule);
 
 	int *dev = c_cgroups_dev_from_rule(rule);
-	if (c_cgroups_list_contains_match(global_assigned_devs_list, dev)) {
+	if (c_cgroups_devset_contains_match(&global_assigned_devs, dev)) {
 		WARN("Unable to allow rule %s: device busy (already assigned to another container)",
 		     rule);
 		mem_free(dev);
@@ -343,7 +618,7 @@ c_cgroups_devices_assign(c_cgroups_t *cgroups, const char *rule)
 	ASSERT(rule);
 
 	int *dev = c_cgroups_dev_from_rule(rule);
-	if (c_cgroups_list_contains_match(global_allowed_devs_list, dev)) {
+	if (c_cgroups_devset_contains_match(&global_allowed_devs, dev)) {
 		ERROR("Unable to exclusively assign device according to rule %s: device busy (already available to another container)",
 		      rule);
 		mem_free(dev);
@@ -367,6 +642,12 @@ c_cgroups_devices_deny(c_cgroups_t *cgroups, const char *rule)
 	ASSERT(cgroups);
 	ASSERT(rule);
 
+	if (c_cgroups_unified) {
+		if (!cgroups->devices_v2)
+			cgroups->devices_v2 = c_cgroups_v2_devices_new();
+		return c_cgroups_v2_devices_rule_add(cgroups->devices_v2, rule, false);
+	}
+
 	// will automatically deny access to all sub folders including child
 	char *path = mem_printf("%s/devices/%s/devices.deny", CGROUPS_FOLDER,
 				uuid_string(container_get_uuid(cgroups->container)));
@@ -549,6 +830,18 @@ c_cgroups_devices_init(c_cgroups_t *cgroups)
 	}
 	DEBUG("Applied containers assign list");
 
+	if (c_cgroups_unified) {
+		if (!cgroups->devices_v2)
+			cgroups->devices_v2 = c_cgroups_v2_devices_new();
+		IF_TRUE_RETVAL(c_cgroups_v2_devices_attach(cgroups->devices_v2,
+							   cgroups->cgroup_path) < 0,
+			       -1);
+		DEBUG("Attached device program with %d map entries for container %s",
+		      c_cgroups_v2_devices_get_count(cgroups->devices_v2),
+		      container_get_description(cgroups->container));
+		return 0;
+	}
+
 	/* Print out the initialized devices whitelist */
 	char *list_path = mem_printf("%s/devices/%s/devices.list", CGROUPS_FOLDER,
 				     uuid_string(container_get_uuid(cgroups->container)));
@@ -576,6 +869,9 @@ c_cgroups_cleanup_freeze_timer(c_cgroups_t *cgroups)
 	cgroups->freezer_retries = 0;
 }
 
+static void
+c_cgroups_freezer_state_cb(const char *path, uint32_t mask, event_inotify_t *inotify, void *data);
+
 int
 c_cgroups_freeze(c_cgroups_t *cgroups)
 {
@@ -583,6 +879,13 @@ c_cgroups_freeze(c_cgroups_t *cgroups)
 
 	// TODO think about where to check for unnecessary state changes, currently done in container.c
 
+	if (c_cgroups_unified) {
+		IF_TRUE_RETVAL(c_cgroups_v2_freeze(cgroups->cgroup_path, true) < 0, -1);
+		/* cgroup.events is only modified once frozen, thus pick up FREEZING here */
+		c_cgroups_freezer_state_cb(NULL, 0, NULL, cgroups);
+		return 0;
+	}
+
 	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
 					      uuid_string(container_get_uuid(cgroups->container)));
 	if (file_write(freezer_state_path, "FROZEN", -1) == -1) {
@@ -601,6 +904,13 @@ c_cgroups_unfreeze(c_cgroups_t *cgroups)
 
 	// TODO think about where to check for unnecessary state changes
 
+	if (c_cgroups_unified) {
+		IF_TRUE_RETVAL(c_cgroups_v2_freeze(cgroups->cgroup_path, false) < 0, -1);
+		/* thawing from FREEZING does not modify cgroup.events */
+		c_cgroups_freezer_state_cb(NULL, 0, NULL, cgroups);
+		return 0;
+	}
+
 	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
 					      uuid_string(container_get_uuid(cgroups->container)));
 	if (file_write(freezer_state_path, "THAWED", -1) == -1) {
@@ -612,8 +922,17 @@ c_cgroups_unfreeze(c_cgroups_t *cgroups)
 	return 0;
 }
 
-static void
-c_cgroups_freezer_state_cb(const char *path, uint32_t mask, event_inotify_t *inotify, void *data);
+int
+c_cgroups_kill(c_cgroups_t *cgroups)
+{
+	ASSERT(cgroups);
+
+	// with v1, the processes die together with the pid namespace of the init
+	IF_FALSE_RETVAL(c_cgroups_unified, -1);
+	IF_FALSE_RETVAL(file_is_dir(cgroups->cgroup_path), -1);
+
+	return c_cgroups_v2_kill(cgroups->cgroup_path);
+}
 
 static void
 c_cgroups_freeze_timeout_cb(UNUSED event_timer_t *timer, void *data)
@@ -647,6 +966,38 @@ c_cgroups_freeze_timeout_cb(UNUSED event_timer_t *timer, void *data)
 	c_cgroups_cleanup_freeze_timer(cgroups);
 }
 
+/*
+ * Returns the newly allocated path of the cgroup holding the memory of the
+ * container, which is hibernated while the container is frozen.
+ */
+static char *
+c_cgroups_memory_path_new(const c_cgroups_t *cgroups)
+{
+	if (c_cgroups_unified)
+		return mem_strdup(cgroups->cgroup_path);
+	return mem_printf("%s/memory/%s", CGROUPS_FOLDER,
+			  uuid_string(container_get_uuid(cgroups->container)));
+}
+
+static void
+c_cgroups_hibernate(c_cgroups_t *cgroups)
+{
+	IF_FALSE_RETURN(hibernate_enabled());
+
+	char *path = c_cgroups_memory_path_new(cgroups);
+	if (c_cgroups_unified) {
+		/* ask for everything, the kernel stops once nothing is left */
+		char *reclaim_file = mem_printf("%s/memory.reclaim", path);
+		hibernate_reclaim(path, reclaim_file, c_cgroups_v2_get_memory_current(path));
+		mem_free(reclaim_file);
+	} else {
+		char *force_empty_file = mem_printf("%s/memory.force_empty", path);
+		hibernate_reclaim(path, force_empty_file, 0);
+		mem_free(force_empty_file);
+	}
+	mem_free(path);
+}
+
 static void
 c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 			   UNUSED event_inotify_t *inotify, void *data)
@@ -655,10 +1006,17 @@ c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 
 	ASSERT(cgroups);
 
-	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
-					      uuid_string(container_get_uuid(cgroups->container)));
-	char *state = file_read_new(freezer_state_path, 10);
-	mem_free(freezer_state_path);
+	char *state;
+	if (c_cgroups_unified) {
+		state = c_cgroups_v2_freezer_state_new(cgroups->cgroup_path);
+	} else {
+		char *freezer_state_path =
+			mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
+				   uuid_string(container_get_uuid(cgroups->container)));
+		state = file_read_new(freezer_state_path, 10);
+		mem_free(freezer_state_path);
+	}
+	IF_NULL_RETURN_ERROR(state);
 
 	DEBUG("State of freezer for container %s is %s",
 	      container_get_description(cgroups->container), state);
@@ -671,6 +1029,11 @@ c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 		INFO("Container %s thawed from freezing or frozen state",
 		     container_get_description(cgroups->container));
 		c_cgroups_cleanup_freeze_timer(cgroups);
+		if (container_state == CONTAINER_STATE_FROZEN && hibernate_enabled()) {
+			char *memory_path = c_cgroups_memory_path_new(cgroups);
+			hibernate_prefetch(memory_path);
+			mem_free(memory_path);
+		}
 		container_set_state(cgroups->container, CONTAINER_STATE_RUNNING);
 	} else if (!strncmp(state, "FREEZING", strlen("FREEZING")) &&
 		   container_state != CONTAINER_STATE_FREEZING) {
@@ -678,8 +1041,19 @@ c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 
 		c_cgroups_cleanup_freeze_timer(cgroups);
 		/* register a timer to stop the freeze if it does not complete in time */
-		cgroups->freeze_timer = event_timer_new(CGROUPS_FREEZER_RETRY_INTERVAL, -1,
-							&c_cgroups_freeze_timeout_cb, cgroups);
+		if (c_cgroups_unified) {
+			/* completion is notified by cgroup.events, there is nothing to poll */
+			cgroups->freezer_retries = CGROUPS_FREEZER_RETRIES;
+			cgroups->freeze_timer = event_timer_new(CGROUPS_FREEZER_TIMEOUT, 1,
+								&c_cgroups_freeze_timeout_cb,
+								cgroups);
+			event_timer_set_slack(cgroups->freeze_timer,
+					      CGROUPS_FREEZER_TIMEOUT_SLACK);
+		} else {
+			cgroups->freeze_timer = event_timer_new(CGROUPS_FREEZER_RETRY_INTERVAL, -1,
+								&c_cgroups_freeze_timeout_cb,
+								cgroups);
+		}
 		event_add_timer(cgroups->freeze_timer);
 
 		container_set_state(cgroups->container, CONTAINER_STATE_FREEZING);
@@ -688,11 +1062,28 @@ c_cgroups_freezer_state_cb(UNUSED const char *path, UNUSED uint32_t mask,
 		INFO("Container %s frozen", container_get_description(cgroups->container));
 		c_cgroups_cleanup_freeze_timer(cgroups);
 		container_set_state(cgroups->container, CONTAINER_STATE_FROZEN);
+		c_cgroups_hibernate(cgroups);
 	}
 
 	mem_free(state);
 }
 
+static void
+c_cgroups_freezer_events_cb(int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	c_cgroups_t *cgroups = data;
+	char buf[256];
+
+	ASSERT(cgroups);
+
+	/* kernfs keeps signaling POLLPRI until the changed file has been read again */
+	if (pread(fd, buf, sizeof(buf), 0) < 0)
+		WARN_ERRNO("Could not read cgroup events of container %s",
+			   container_get_description(cgroups->container));
+
+	c_cgroups_freezer_state_cb(NULL, 0, NULL, cgroups);
+}
+
 int
 c_cgroups_set_ram_limit(c_cgroups_t *cgroups)
 {
@@ -704,6 +1095,19 @@ c_cgroups_set_ram_limit(c_cgroups_t *cgroups)
 		return 0;
 	}
 
+	if (c_cgroups_unified) {
+		INFO("Trying to set RAM limit of container %s to %d MBytes",
+		     container_get_description(cgroups->container),
+		     container_get_ram_limit(cgroups->container));
+		IF_TRUE_RETVAL(c_cgroups_v2_set_memory_limit(cgroups->cgroup_path,
+							     container_get_ram_limit(cgroups->container)) < 0,
+			       -1);
+		INFO("Successfully set RAM limit of container %s to %d MBytes",
+		     container_get_description(cgroups->container),
+		     container_get_ram_limit(cgroups->container));
+		return 0;
+	}
+
 	int ret = -1;
 	char *limit_in_bytes_path = mem_printf("%s/memory/%s/memory.limit_in_bytes", CGROUPS_FOLDER,
 					       uuid_string(container_get_uuid(cgroups->container)));
@@ -734,6 +1138,257 @@ out:
 	return ret;
 }
 
+/*
+ * Limits the huge pages of the container, the hugetlb controller is only
+ * available in the unified hierarchy.
+ */
+static int
+c_cgroups_set_hugetlb_limit(const c_cgroups_t *cgroups)
+{
+	uint64_t limit = container_get_memory_policy(cgroups->container)->hugetlb_limit;
+	IF_TRUE_RETVAL(limit == 0, 0);
+
+	if (!c_cgroups_unified) {
+		ERROR("Cannot limit huge pages of container %s without unified cgroups",
+		      container_get_description(cgroups->container));
+		return -1;
+	}
+
+	INFO("Setting hugetlb limit of container %s to %" PRIu64 " bytes",
+	     container_get_description(cgroups->container), limit);
+	return c_cgroups_v2_set_hugetlb_limit(cgroups->cgroup_path, limit);
+}
+
+/*
+ * Writes the swappiness of a memory tier to the v1 memory cgroup of the
+ * container and to the child cgroup its init runs in, as reclaim uses the
+ * swappiness of the cgroup the pages are charged to.
+ */
+static int
+c_cgroups_set_swappiness(const c_cgroups_t *cgroups, unsigned int swappiness)
+{
+	int ret = 0;
+	const char *uuid = uuid_string(container_get_uuid(cgroups->container));
+	char *paths[] = { mem_printf("%s/memory/%s/memory.swappiness", CGROUPS_FOLDER, uuid),
+			  mem_printf("%s/memory/%s/child/memory.swappiness", CGROUPS_FOLDER,
+				     uuid) };
+
+	for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		if (file_exists(paths[i]) && file_printf(paths[i], "%u", swappiness) == -1) {
+			ERROR_ERRNO("Could not write to %s", paths[i]);
+			ret = -1;
+		}
+		mem_free(paths[i]);
+	}
+	return ret;
+}
+
+int
+c_cgroups_set_memory_priority(c_cgroups_t *cgroups)
+{
+	ASSERT(cgroups);
+
+	container_memory_priority_t prio = container_get_memory_priority(cgroups->container);
+	IF_TRUE_RETVAL(prio == CONTAINER_MEMORY_PRIORITY_NONE, 0);
+
+	const c_cgroups_memory_tier_t *tier = &c_cgroups_memory_tiers[prio];
+	int ret = 0;
+
+	INFO("Setting memory tier of container %s to %d (oom_score_adj %d)",
+	     container_get_description(cgroups->container), prio, tier->oom_score_adj);
+
+	pid_t pid = container_get_pid(cgroups->container);
+	if (pid > 0) {
+		char *oom_path = mem_printf("/proc/%d/oom_score_adj", pid);
+		if (file_printf(oom_path, "%d", tier->oom_score_adj) == -1) {
+			ERROR_ERRNO("Could not write to %s", oom_path);
+			ret = -1;
+		}
+		mem_free(oom_path);
+	}
+
+	if (c_cgroups_unified) {
+		uint64_t min = 0, low = 0;
+		if (tier->protect) {
+			/* a hard guarantee for a quarter of the limit, best effort for the rest */
+			min = ((uint64_t)container_get_ram_limit(cgroups->container) << 20) / 4;
+			low = UINT64_MAX;
+		}
+		if (c_cgroups_v2_set_memory_protection(cgroups->cgroup_path, min, low) < 0)
+			ret = -1;
+		return ret;
+	}
+
+	/* under global pressure, v1 reclaims from cgroups above their soft limit first */
+	char *soft_limit_path =
+		mem_printf("%s/memory/%s/memory.soft_limit_in_bytes", CGROUPS_FOLDER,
+			   uuid_string(container_get_uuid(cgroups->container)));
+	if (file_printf(soft_limit_path, "%s", tier->protect ? "-1" : "0") == -1) {
+		ERROR_ERRNO("Could not write to %s", soft_limit_path);
+		ret = -1;
+	}
+	mem_free(soft_limit_path);
+
+	if (c_cgroups_set_swappiness(cgroups, tier->swappiness) < 0)
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Writes cpu.uclamp.min of the cgroup in dir, which is the same in v1 and v2.
+ * Kernels without CONFIG_UCLAMP_TASK_GROUP do not provide it, which is fine.
+ */
+static int
+c_cgroups_set_uclamp_min(const char *dir, unsigned int percent)
+{
+	char *uclamp_path = mem_printf("%s/cpu.uclamp.min", dir);
+	int ret = 0;
+
+	if (!file_exists(uclamp_path))
+		TRACE("No utilization clamping support, skipping %s", uclamp_path);
+	else if ((ret = file_printf(uclamp_path, "%u.00", MIN(percent, 100))) == -1)
+		ERROR_ERRNO("Could not write to %s", uclamp_path);
+	mem_free(uclamp_path);
+	return ret == -1 ? -1 : 0;
+}
+
+int
+c_cgroups_set_cpu_sched(c_cgroups_t *cgroups, unsigned int weight_percent,
+			unsigned int uclamp_min_percent, unsigned int max_percent)
+{
+	ASSERT(cgroups);
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t quota_us = (uint64_t)CGROUPS_CPU_PERIOD_US * MAX(ncpus, 1) * max_percent / 100;
+	int ret = 0;
+
+	DEBUG("Setting cpu weight %u%%, uclamp.min %u%% and limit %u%% for container %s",
+	      weight_percent, uclamp_min_percent, max_percent,
+	      container_get_description(cgroups->container));
+
+	if (c_cgroups_unified) {
+		cgroups->cpu_weight =
+			MIN(10000, MAX(1, CGROUPS_PRESSURE_WEIGHT_DEFAULT * weight_percent / 100));
+		/* the governor applies the new weight once it lifts its throttling */
+		if (!cgroups->pressure_throttled[C_CGROUPS_PRESSURE_CPU] &&
+		    c_cgroups_v2_set_weight(cgroups->cgroup_path, "cpu", cgroups->cpu_weight) < 0)
+			ret = -1;
+		if (c_cgroups_set_uclamp_min(cgroups->cgroup_path, uclamp_min_percent) < 0)
+			ret = -1;
+		if (c_cgroups_v2_set_cpu_max(cgroups->cgroup_path, quota_us,
+					     CGROUPS_CPU_PERIOD_US) < 0)
+			ret = -1;
+		return ret;
+	}
+
+	const char *uuid = uuid_string(container_get_uuid(cgroups->container));
+	char *dir = mem_printf("%s/cpu,cpuacct/%s", CGROUPS_FOLDER, uuid);
+	if (!file_is_dir(dir)) {
+		mem_free(dir);
+		dir = mem_printf("%s/cpu/%s", CGROUPS_FOLDER, uuid);
+	}
+	char *shares_path = mem_printf("%s/cpu.shares", dir);
+	char *period_path = mem_printf("%s/cpu.cfs_period_us", dir);
+	char *quota_path = mem_printf("%s/cpu.cfs_quota_us", dir);
+
+	if (file_printf(shares_path, "%u",
+			MAX(2, CGROUPS_CPU_SHARES_DEFAULT * weight_percent / 100)) == -1) {
+		ERROR_ERRNO("Could not write to %s", shares_path);
+		ret = -1;
+	}
+	if (c_cgroups_set_uclamp_min(dir, uclamp_min_percent) < 0)
+		ret = -1;
+	if (file_printf(period_path, "%d", CGROUPS_CPU_PERIOD_US) == -1 ||
+	    (quota_us ? file_printf(quota_path, "%" PRIu64, quota_us) :
+			file_printf(quota_path, "-1")) == -1) {
+		ERROR_ERRNO("Could not set cpu bandwidth limit in %s", dir);
+		ret = -1;
+	}
+
+	mem_free(shares_path);
+	mem_free(period_path);
+	mem_free(quota_path);
+	mem_free(dir);
+	return ret;
+}
+
+/* writes "<maj>:<min> <limit>" to a blkio throttle file, a limit of 0 removes the rule */
+static int
+c_cgroups_set_blkio_throttle(const char *dir, const char *file, dev_t dev, uint64_t limit)
+{
+	char *path = mem_printf("%s/%s", dir, file);
+	int ret = file_printf(path, "%u:%u %" PRIu64, major(dev), minor(dev), limit);
+	if (ret == -1)
+		ERROR_ERRNO("Could not write limit of %u:%u to %s", major(dev), minor(dev), path);
+	mem_free(path);
+	return ret == -1 ? -1 : 0;
+}
+
+int
+c_cgroups_set_io(c_cgroups_t *cgroups)
+{
+	ASSERT(cgroups);
+
+	const container_io_config_t *io = container_get_io_config(cgroups->container);
+	dev_t *devs = NULL;
+	size_t n = container_get_block_devs(cgroups->container, &devs);
+	int ret = 0;
+
+	DEBUG("Setting io weight %u and limits of %zu devices for container %s", io->weight, n,
+	      container_get_description(cgroups->container));
+
+	if (c_cgroups_unified) {
+		cgroups->io_weight = MIN(10000, MAX(1, io->weight));
+		/* the governor applies the new weight once it lifts its throttling */
+		if (!cgroups->pressure_throttled[C_CGROUPS_PRESSURE_IO] &&
+		    c_cgroups_v2_set_weight(cgroups->cgroup_path, "io", cgroups->io_weight) < 0)
+			ret = -1;
+		for (size_t i = 0; i < n; i++) {
+			if (c_cgroups_v2_set_io_max(cgroups->cgroup_path, devs[i], io->read_bps,
+						    io->write_bps, io->read_iops,
+						    io->write_iops) < 0)
+				ret = -1;
+		}
+		mem_free(devs);
+		return ret;
+	}
+
+	char *dir = mem_printf("%s/blkio/%s", CGROUPS_FOLDER,
+			       uuid_string(container_get_uuid(cgroups->container)));
+	if (!file_is_dir(dir)) {
+		DEBUG("No blkio cgroup for container %s",
+		      container_get_description(cgroups->container));
+		goto out;
+	}
+
+	/* proportional weights are only supported by the bfq scheduler */
+	char *weight_path = mem_printf("%s/blkio.weight", dir);
+	if (file_exists(weight_path) &&
+	    file_printf(weight_path, "%u",
+			MIN(1000, MAX(10, CGROUPS_BLKIO_WEIGHT_DEFAULT * io->weight /
+						  CGROUPS_PRESSURE_WEIGHT_DEFAULT))) == -1) {
+		ERROR_ERRNO("Could not write to %s", weight_path);
+		ret = -1;
+	}
+	mem_free(weight_path);
+
+	for (size_t i = 0; i < n; i++) {
+		if (c_cgroups_set_blkio_throttle(dir, "blkio.throttle.read_bps_device", devs[i],
+						 io->read_bps) < 0 ||
+		    c_cgroups_set_blkio_throttle(dir, "blkio.throttle.write_bps_device", devs[i],
+						 io->write_bps) < 0 ||
+		    c_cgroups_set_blkio_throttle(dir, "blkio.throttle.read_iops_device", devs[i],
+						 io->read_iops) < 0 ||
+		    c_cgroups_set_blkio_throttle(dir, "blkio.throttle.write_iops_device", devs[i],
+						 io->write_iops) < 0)
+			ret = -1;
+	}
+out:
+	mem_free(dir);
+	mem_free(devs);
+	return ret;
+}
+
 static int
 c_cgroups_set_cpu_exclusive(const c_cgroups_t *cgroups, char *path)
 {
@@ -771,6 +1426,21 @@ out:
 	return ret;
 }
 
+/* statically assigned cpus take precedence over the ones chosen by the cpu placement */
+static const char *
+c_cgroups_get_cpus(const c_cgroups_t *cgroups)
+{
+	const char *cpus = container_get_cpus_allowed(cgroups->container);
+	return cpus ? cpus : container_get_cpus_placed(cgroups->container);
+}
+
+static const char *
+c_cgroups_get_mems(const c_cgroups_t *cgroups)
+{
+	const char *mems = container_get_mems_placed(cgroups->container);
+	return (mems && !container_get_cpus_allowed(cgroups->container)) ? mems : "0";
+}
+
 /**
  * This functions gets the allowed cpus for the container from its associated container
  * object and configures the cgroups cpuset subsystem to restrict access to that cpus.
@@ -780,7 +1450,7 @@ c_cgroups_set_cpus_allowed(const c_cgroups_t *cgroups, char *path)
 {
 	ASSERT(cgroups);
 
-	if (NULL == container_get_cpus_allowed(cgroups->container)) {
+	if (NULL == c_cgroups_get_cpus(cgroups)) {
 		INFO("Setting no CPU restrictions for container %s",
 		     container_get_description(cgroups->container));
 		return 0;
@@ -797,8 +1467,7 @@ c_cgroups_set_cpus_allowed(const c_cgroups_t *cgroups, char *path)
 		      cpuset_cpus_path);
 		goto out;
 	}
-	if (file_printf(cpuset_cpus_path, "%s", container_get_cpus_allowed(cgroups->container)) ==
-	    -1) {
+	if (file_printf(cpuset_cpus_path, "%s", c_cgroups_get_cpus(cgroups)) == -1) {
 		ERROR("Could not write to cgroups cpuset file in %s", cpuset_cpus_path);
 		goto out;
 	}
@@ -808,16 +1477,17 @@ c_cgroups_set_cpus_allowed(const c_cgroups_t *cgroups, char *path)
 		      cpuset_mems_path);
 		goto out;
 	}
-	if (file_printf(cpuset_mems_path, "0") == -1) {
+	if (file_printf(cpuset_mems_path, "%s", c_cgroups_get_mems(cgroups)) == -1) {
 		ERROR("Could not write to cgroups cpuset file in %s", cpuset_mems_path);
 		goto out;
 	}
 
-	IF_TRUE_GOTO(c_cgroups_set_cpu_exclusive(cgroups, path) == -1, out);
+	/* placed cpusets are disjoint anyway and must stay movable on rebalancing */
+	if (container_get_cpus_allowed(cgroups->container))
+		IF_TRUE_GOTO(c_cgroups_set_cpu_exclusive(cgroups, path) == -1, out);
 
 	INFO("Successfully set CPU restriction of container %s to cores %s",
-	     container_get_description(cgroups->container),
-	     container_get_cpus_allowed(cgroups->container));
+	     container_get_description(cgroups->container), c_cgroups_get_cpus(cgroups));
 
 	ret = 0;
 out:
@@ -827,6 +1497,73 @@ out:
 	return ret;
 }
 
+static int
+c_cgroups_cpuset_write(const char *path, const char *cpus, const char *mems)
+{
+	char *cpus_path = mem_printf("%s/cpuset.cpus", path);
+	char *mems_path = mem_printf("%s/cpuset.mems", path);
+	int ret = 0;
+
+	if (file_printf(cpus_path, "%s", cpus) == -1 || file_printf(mems_path, "%s", mems) == -1) {
+		ERROR_ERRNO("Could not write cpuset of %s", path);
+		ret = -1;
+	}
+
+	mem_free(cpus_path);
+	mem_free(mems_path);
+	return ret;
+}
+
+int
+c_cgroups_set_cpuset(c_cgroups_t *cgroups)
+{
+	ASSERT(cgroups);
+
+	/* applied by c_cgroups_start_post_clone() if the container is not yet running */
+	char *path = c_cgroups_unified ?
+			     mem_strdup(cgroups->cgroup_path) :
+			     mem_printf("%s/cpuset/%s", CGROUPS_FOLDER,
+					uuid_string(container_get_uuid(cgroups->container)));
+	if (!file_is_dir(path)) {
+		mem_free(path);
+		return 0;
+	}
+
+	int ret = -1;
+	char *child_path = mem_printf("%s/child", path);
+	char *online_cpus = file_read_new("/sys/devices/system/cpu/online", 4096);
+	char *online_mems = file_exists("/sys/devices/system/node/online") ?
+				    file_read_new("/sys/devices/system/node/online", 4096) :
+				    mem_strdup("0");
+	IF_NULL_GOTO(online_cpus, err);
+	IF_NULL_GOTO(online_mems, err);
+
+	const char *cpus = c_cgroups_get_cpus(cgroups);
+	const char *mems = cpus ? c_cgroups_get_mems(cgroups) : online_mems;
+	cpus = cpus ? cpus : online_cpus;
+
+	if (c_cgroups_unified) {
+		/* the child inherits the effective cpuset of its parent */
+		IF_TRUE_GOTO(c_cgroups_cpuset_write(path, cpus, mems) < 0, err);
+	} else {
+		/* v1 requires the cpuset of the child to be a subset of its parent's */
+		IF_TRUE_GOTO(c_cgroups_cpuset_write(path, online_cpus, online_mems) < 0, err);
+		if (file_is_dir(child_path))
+			IF_TRUE_GOTO(c_cgroups_cpuset_write(child_path, cpus, mems) < 0, err);
+		IF_TRUE_GOTO(c_cgroups_cpuset_write(path, cpus, mems) < 0, err);
+	}
+
+	INFO("Moved container %s to cores %s and memory nodes %s",
+	     container_get_description(cgroups->container), cpus, mems);
+	ret = 0;
+err:
+	mem_free(online_cpus);
+	mem_free(online_mems);
+	mem_free(child_path);
+	mem_free(path);
+	return ret;
+}
+
 #ifndef _BSD_SOURCE
 #define _BSD_SOURCE /* See feature_test_macros(7) */
 #endif
@@ -1078,31 +1815,465 @@ c_cgroups_devices_is_dev_allowed(c_cgroups_t *cgroups, int major, int minor)
 	int dev[2] = { major, minor };
 
 	/* search in assigned devices */
-	if (c_cgroups_list_contains_match(cgroups->assigned_devs, dev))
+	if (c_cgroups_devset_contains_match(&cgroups->assigned_devs, dev))
 		return true;
 
 	/* search in allowed devices */
-	if (c_cgroups_list_contains_match(cgroups->allowed_devs, dev))
+	if (c_cgroups_devset_contains_match(&cgroups->allowed_devs, dev))
 		return true;
 
 	return false;
 }
 
+/*******************/
+/* Resource governor */
+
+static unsigned int
+c_cgroups_pressure_stall_ms(c_cgroups_pressure_t res)
+{
+	switch (res) {
+	case C_CGROUPS_PRESSURE_MEMORY:
+		return c_cgroups_pressure_policy.memory_stall_ms;
+	case C_CGROUPS_PRESSURE_CPU:
+		return c_cgroups_pressure_policy.cpu_stall_ms;
+	case C_CGROUPS_PRESSURE_IO:
+		return c_cgroups_pressure_policy.io_stall_ms;
+	default:
+		return 0;
+	}
+}
+
+static void
+c_cgroups_pressure_throttle(c_cgroups_t *cgroups, c_cgroups_pressure_t res, bool throttle)
+{
+	IF_TRUE_RETURN(cgroups->pressure_throttled[res] == throttle);
+
+	unsigned int percent = throttle ? c_cgroups_pressure_policy.throttle_percent : 100;
+	unsigned int ram_limit = container_get_ram_limit(cgroups->container);
+	int ret;
+
+	switch (res) {
+	case C_CGROUPS_PRESSURE_MEMORY:
+		if (!throttle) {
+			/* restore what c_cgroups_set_ram_limit() configured */
+			ret = ram_limit ? c_cgroups_v2_set_memory_limit(cgroups->cgroup_path,
+								       ram_limit) :
+					  c_cgroups_v2_set_memory_high(cgroups->cgroup_path, 0);
+		} else {
+			uint64_t base =
+				ram_limit ? (uint64_t)ram_limit << 20 :
+					    c_cgroups_v2_get_memory_current(cgroups->cgroup_path);
+			IF_TRUE_RETURN(base == 0);
+			ret = c_cgroups_v2_set_memory_high(cgroups->cgroup_path,
+							   base * percent / 100);
+		}
+		break;
+	case C_CGROUPS_PRESSURE_CPU:
+		/* relative to the weight set by c_cgroups_set_cpu_sched() */
+		ret = c_cgroups_v2_set_weight(cgroups->cgroup_path, "cpu",
+					      MAX(1, cgroups->cpu_weight * percent / 100));
+		break;
+	case C_CGROUPS_PRESSURE_IO:
+		/* relative to the weight set by c_cgroups_set_io() */
+		ret = c_cgroups_v2_set_weight(cgroups->cgroup_path, "io",
+					      MAX(1, cgroups->io_weight * percent / 100));
+		break;
+	default:
+		return;
+	}
+
+	if (ret < 0) {
+		WARN("Could not %s %s of container %s", throttle ? "throttle" : "restore",
+		     c_cgroups_pressure_resources[res], container_get_description(cgroups->container));
+		return;
+	}
+	DEBUG("%s %s of container %s", throttle ? "Throttled" : "Restored",
+	      c_cgroups_pressure_resources[res], container_get_description(cgroups->container));
+	cgroups->pressure_throttled[res] = throttle;
+}
+
+static void
+c_cgroups_pressure_relax_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	DEBUG("No pressure reported for %u ms, lifting throttling",
+	      c_cgroups_pressure_policy.relax_ms);
+
+	for (list_t *l = c_cgroups_list; l; l = l->next) {
+		c_cgroups_t *cgroups = l->data;
+		for (int res = 0; res < C_CGROUPS_PRESSURE_COUNT; res++)
+			c_cgroups_pressure_throttle(cgroups, res, false);
+	}
+
+	event_remove_timer(c_cgroups_pressure_relax_timer);
+	event_timer_free(c_cgroups_pressure_relax_timer);
+	c_cgroups_pressure_relax_timer = NULL;
+}
+
+static void
+c_cgroups_pressure_cb(int fd, unsigned events, event_io_t *io, void *data)
+{
+	c_cgroups_t *cgroups = data;
+	ASSERT(cgroups);
+
+	c_cgroups_pressure_t res = 0;
+	while (res < C_CGROUPS_PRESSURE_COUNT && cgroups->pressure_io[res] != io)
+		res++;
+	ASSERT(res < C_CGROUPS_PRESSURE_COUNT);
+
+	if (events & EVENT_IO_EXCEPT) {
+		WARN("%s pressure trigger of container %s failed, stop watching",
+		     c_cgroups_pressure_resources[res], container_get_description(cgroups->container));
+		event_remove_io(io);
+		event_io_free(io);
+		close(fd);
+		cgroups->pressure_io[res] = NULL;
+		return;
+	}
+
+	INFO("Container %s stalls on %s, throttling other containers",
+	     container_get_description(cgroups->container), c_cgroups_pressure_resources[res]);
+
+	/* the stalling container gets its full share back */
+	c_cgroups_pressure_throttle(cgroups, res, false);
+
+	for (list_t *l = c_cgroups_list; l; l = l->next) {
+		c_cgroups_t *other = l->data;
+		if (other == cgroups ||
+		    container_get_state(other->container) != CONTAINER_STATE_RUNNING)
+			continue;
+		c_cgroups_pressure_throttle(other, res, true);
+	}
+
+	if (res == C_CGROUPS_PRESSURE_MEMORY && c_cgroups_pressure_policy.relax_ms)
+		ksm_set_aggressive_for(c_cgroups_pressure_policy.relax_ms);
+
+	/* (re)arm the timer which lifts the throttling again */
+	if (c_cgroups_pressure_relax_timer) {
+		event_remove_timer(c_cgroups_pressure_relax_timer);
+		event_timer_free(c_cgroups_pressure_relax_timer);
+	}
+	c_cgroups_pressure_relax_timer = event_timer_new(c_cgroups_pressure_policy.relax_ms, 1,
+							 &c_cgroups_pressure_relax_cb, NULL);
+	event_add_timer(c_cgroups_pressure_relax_timer);
+}
+
+static void
+c_cgroups_pressure_watch(c_cgroups_t *cgroups)
+{
+	for (int res = 0; res < C_CGROUPS_PRESSURE_COUNT; res++) {
+		unsigned int stall_ms = c_cgroups_pressure_stall_ms(res);
+		if (!stall_ms)
+			continue;
+
+		int fd = c_cgroups_v2_pressure_trigger_open(cgroups->cgroup_path,
+							    c_cgroups_pressure_resources[res],
+							    stall_ms * 1000,
+							    CGROUPS_PRESSURE_WINDOW * 1000);
+		if (fd < 0) {
+			WARN("Could not watch %s pressure of container %s",
+			     c_cgroups_pressure_resources[res],
+			     container_get_description(cgroups->container));
+			continue;
+		}
+		cgroups->pressure_fd[res] = fd;
+		cgroups->pressure_io[res] =
+			event_io_new(fd, EVENT_IO_PRI, &c_cgroups_pressure_cb, cgroups);
+		event_add_io(cgroups->pressure_io[res]);
+		DEBUG("Watching %s pressure of container %s (%u ms/s)",
+		      c_cgroups_pressure_resources[res],
+		      container_get_description(cgroups->container), stall_ms);
+	}
+}
+
+static void
+c_cgroups_pressure_unwatch(c_cgroups_t *cgroups)
+{
+	for (int res = 0; res < C_CGROUPS_PRESSURE_COUNT; res++) {
+		cgroups->pressure_throttled[res] = false;
+		if (!cgroups->pressure_io[res])
+			continue;
+
+		event_remove_io(cgroups->pressure_io[res]);
+		event_io_free(cgroups->pressure_io[res]);
+		cgroups->pressure_io[res] = NULL;
+		close(cgroups->pressure_fd[res]);
+	}
+}
+
+/*******************/
+/* Accounting */
+
+/*
+ * Opens the accounting files once the cgroup exists, so that sampling the
+ * usage is a pread() per file instead of resolving the path each time.
+ */
+static void
+c_cgroups_usage_open(c_cgroups_t *cgroups)
+{
+	for (int i = 0; i < C_CGROUPS_USAGE_COUNT; i++) {
+		char *path = c_cgroups_unified ?
+				     mem_printf("%s/%s", cgroups->cgroup_path,
+						c_cgroups_usage_files_v2[i]) :
+				     mem_printf("%s/%s/%s/%s", CGROUPS_FOLDER,
+						c_cgroups_usage_files_v1[i][0],
+						uuid_string(container_get_uuid(cgroups->container)),
+						c_cgroups_usage_files_v1[i][1]);
+		cgroups->usage_fd[i] = open(path, O_RDONLY | O_CLOEXEC);
+		if (cgroups->usage_fd[i] < 0)
+			DEBUG_ERRNO("Could not open %s, not accounted", path);
+		mem_free(path);
+	}
+}
+
+static void
+c_cgroups_usage_close(c_cgroups_t *cgroups)
+{
+	for (int i = 0; i < C_CGROUPS_USAGE_COUNT; i++) {
+		if (cgroups->usage_fd[i] < 0)
+			continue;
+		close(cgroups->usage_fd[i]);
+		cgroups->usage_fd[i] = -1;
+	}
+}
+
+/* reads the whole file into buf as string, returns false if not available */
+static bool
+c_cgroups_usage_read(const c_cgroups_t *cgroups, c_cgroups_usage_file_t file, char *buf)
+{
+	IF_TRUE_RETVAL(cgroups->usage_fd[file] < 0, false);
+
+	ssize_t len = pread(cgroups->usage_fd[file], buf, CGROUPS_USAGE_BUF_LEN - 1, 0);
+	if (len < 0) {
+		WARN_ERRNO("Could not read accounting file %d of container %s", file,
+			   container_get_description(cgroups->container));
+		return false;
+	}
+	buf[len] = '\0';
+	return true;
+}
+
+/* returns the value of the line "<key> <value>" in buf or 0 if there is none */
+static uint64_t
+c_cgroups_usage_keyed(const char *buf, const char *key)
+{
+	size_t key_len = strlen(key);
+	for (const char *line = buf; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (!strncmp(line, key, key_len) && line[key_len] == ' ')
+			return strtoull(line + key_len + 1, NULL, 10);
+	}
+	return 0;
+}
+
+/* sums up the "<maj>:<min> rbytes=<n> wbytes=<n> ..." lines of io.stat */
+static void
+c_cgroups_usage_io_v2(const char *buf, container_usage_t *usage)
+{
+	for (const char *p = buf; (p = strchr(p, ' ')); p++) {
+		if (!strncmp(p, " rbytes=", 8))
+			usage->io_read_bytes += strtoull(p + 8, NULL, 10);
+		else if (!strncmp(p, " wbytes=", 8))
+			usage->io_write_bytes += strtoull(p + 8, NULL, 10);
+	}
+}
+
+/* sums up the "<maj>:<min> Read|Write <n>" lines of blkio.throttle.io_service_bytes */
+static void
+c_cgroups_usage_io_v1(const char *buf, container_usage_t *usage)
+{
+	for (const char *line = buf; line && *line; line = strchr(line, '\n')) {
+		unsigned int major, minor;
+		char op[8];
+		unsigned long long bytes;
+
+		if (*line == '\n')
+			line++;
+		if (sscanf(line, "%u:%u %7s %llu", &major, &minor, op, &bytes) != 4)
+			continue;
+		if (!strcmp(op, "Read"))
+			usage->io_read_bytes += bytes;
+		else if (!strcmp(op, "Write"))
+			usage->io_write_bytes += bytes;
+	}
+}
+
+int
+c_cgroups_get_usage(const c_cgroups_t *cgroups, container_usage_t *usage)
+{
+	ASSERT(cgroups);
+	ASSERT(usage);
+	IF_TRUE_RETVAL(cgroups->usage_fd[C_CGROUPS_USAGE_CPU] < 0, -1);
+
+	char buf[CGROUPS_USAGE_BUF_LEN];
+	memset(usage, 0, sizeof(container_usage_t));
+
+	if (c_cgroups_usage_read(cgroups, C_CGROUPS_USAGE_CPU, buf))
+		usage->cpu_usage_us = c_cgroups_unified ? c_cgroups_usage_keyed(buf, "usage_usec") :
+							  strtoull(buf, NULL, 10) / 1000;
+
+	if (c_cgroups_usage_read(cgroups, C_CGROUPS_USAGE_MEMORY, buf))
+		usage->memory_bytes = strtoull(buf, NULL, 10);
+
+	/* the v1 total_* counters include the descendant cgroups like v2 does */
+	if (c_cgroups_usage_read(cgroups, C_CGROUPS_USAGE_MEMORY_STAT, buf)) {
+		usage->memory_anon_bytes =
+			c_cgroups_usage_keyed(buf, c_cgroups_unified ? "anon" : "total_rss");
+		usage->memory_file_bytes =
+			c_cgroups_usage_keyed(buf, c_cgroups_unified ? "file" : "total_cache");
+	}
+
+	if (c_cgroups_usage_read(cgroups, C_CGROUPS_USAGE_IO, buf)) {
+		if (c_cgroups_unified)
+			c_cgroups_usage_io_v2(buf, usage);
+		else
+			c_cgroups_usage_io_v1(buf, usage);
+	}
+
+	return 0;
+}
+
 /*******************/
 /* Hooks */
 
+/* watches the frozen state, the pressure and the usage of the container's cgroup */
+static int
+c_cgroups_v2_watch(c_cgroups_t *cgroups)
+{
+	/* the kernel signals POLLPRI on cgroup.events when the frozen state changes */
+	char *events_path = c_cgroups_v2_events_path_new(cgroups->cgroup_path);
+	cgroups->freezer_events_fd = open(events_path, O_RDONLY | O_CLOEXEC);
+	if (cgroups->freezer_events_fd < 0) {
+		ERROR_ERRNO("Could not open %s", events_path);
+		mem_free(events_path);
+		return -1;
+	}
+	mem_free(events_path);
+	cgroups->freezer_events_io = event_io_new(cgroups->freezer_events_fd, EVENT_IO_PRI,
+						  &c_cgroups_freezer_events_cb, cgroups);
+	event_add_io(cgroups->freezer_events_io);
+
+	c_cgroups_pressure_watch(cgroups);
+	c_cgroups_usage_open(cgroups);
+	return 0;
+}
+
+static int
+c_cgroups_v2_start_pre_clone(c_cgroups_t *cgroups)
+{
+	IF_TRUE_RETVAL(c_cgroups_v2_mount() < 0, -1);
+
+	INFO("Creating cgroup %s", cgroups->cgroup_path);
+	/* the container's processes live in child, so the controllers are delegated */
+	if (c_cgroups_v2_create(cgroups->cgroup_path, true) < 0) {
+		ERROR("Could not create cgroup for container %s",
+		      container_get_description(cgroups->container));
+		return -1;
+	}
+
+	if (NULL == c_cgroups_get_cpus(cgroups)) {
+		INFO("Setting no CPU restrictions for container %s",
+		     container_get_description(cgroups->container));
+	} else if (c_cgroups_v2_set_cpus(cgroups->cgroup_path, c_cgroups_get_cpus(cgroups),
+					 c_cgroups_get_mems(cgroups),
+					 container_get_cpus_allowed(cgroups->container) != NULL) < 0) {
+		ERROR("Could not configure cgroup to restrict cpus of container %s",
+		      container_get_description(cgroups->container));
+		return -1;
+	}
+
+	if (c_cgroups_set_ram_limit(cgroups) < 0) {
+		ERROR("Could not configure cgroup maximum ram for container %s",
+		      container_get_description(cgroups->container));
+		return -1;
+	}
+
+	IF_TRUE_RETVAL(c_cgroups_set_hugetlb_limit(cgroups) < 0, -1);
+
+	IF_TRUE_RETVAL(c_cgroups_v2_watch(cgroups) < 0, -1);
+
+	/*
+	 * Nothing depends on the pid of the container, thus also the child cgroup is
+	 * prepared before the clone, so that the init is created in it right away.
+	 */
+	int ret = -1;
+	char *child_path = mem_printf("%s/child", cgroups->cgroup_path);
+
+	INFO("Creating cgroup %s", child_path);
+	if (c_cgroups_v2_create(child_path, false) < 0) {
+		ERROR("Could not create child cgroup for container %s",
+		      container_get_description(cgroups->container));
+		goto out;
+	}
+
+	if (container_shift_ids(cgroups->container, child_path, false)) {
+		ERROR("Could not shift ids of child cgroup for userns");
+		goto out;
+	}
+
+	cgroups->cloned_into = false;
+	cgroups->clone_fd = open(child_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cgroups->clone_fd < 0)
+		WARN_ERRNO("Could not open %s, the container is moved there later", child_path);
+	ret = 0;
+out:
+	mem_free(child_path);
+	return ret;
+}
+
 int
 c_cgroups_start_pre_clone(c_cgroups_t *cgroups)
 {
 	ASSERT(cgroups);
+
+	if (c_cgroups_unified)
+		return c_cgroups_v2_start_pre_clone(cgroups);
+
 	return mount_cgroups(cgroups->active_cgroups);
 }
 
+int
+c_cgroups_get_clone_fd(const c_cgroups_t *cgroups)
+{
+	ASSERT(cgroups);
+	return cgroups->clone_fd;
+}
+
+void
+c_cgroups_set_cloned_into(c_cgroups_t *cgroups, bool cloned_into)
+{
+	ASSERT(cgroups);
+
+	cgroups->cloned_into = cloned_into;
+	if (cgroups->clone_fd >= 0) {
+		close(cgroups->clone_fd);
+		cgroups->clone_fd = -1;
+	}
+}
+
+/* watches the freezer state and the usage of the container's cgroups */
+static void
+c_cgroups_v1_watch(c_cgroups_t *cgroups)
+{
+	/* initialize freezer subsystem */
+	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
+					      uuid_string(container_get_uuid(cgroups->container)));
+	cgroups->inotify_freezer_state = event_inotify_new(freezer_state_path, IN_MODIFY,
+							   &c_cgroups_freezer_state_cb, cgroups);
+	event_add_inotify(cgroups->inotify_freezer_state);
+	mem_free(freezer_state_path);
+
+	c_cgroups_usage_open(cgroups);
+}
+
 int
 c_cgroups_start_post_clone(c_cgroups_t *cgroups)
 {
 	ASSERT(cgroups);
 
+	// the cgroup has been set up before the clone already
+	IF_TRUE_RETVAL(c_cgroups_unified, 0);
+
 	// temporarily add systemd to list
 	cgroups->active_cgroups = list_prepend(cgroups->active_cgroups, "systemd");
 
@@ -1139,14 +2310,10 @@ c_cgroups_start_post_clone(c_cgroups_t *cgroups)
 		      container_get_description(cgroups->container));
 		goto error;
 	}
+	// the temporarily added head is already removed
+	IF_TRUE_RETVAL(c_cgroups_set_hugetlb_limit(cgroups) < 0, -1);
 
-	/* initialize freezer subsystem */
-	char *freezer_state_path = mem_printf("%s/freezer/%s/freezer.state", CGROUPS_FOLDER,
-					      uuid_string(container_get_uuid(cgroups->container)));
-	cgroups->inotify_freezer_state = event_inotify_new(freezer_state_path, IN_MODIFY,
-							   &c_cgroups_freezer_state_cb, cgroups);
-	event_add_inotify(cgroups->inotify_freezer_state);
-	mem_free(freezer_state_path);
+	c_cgroups_v1_watch(cgroups);
 
 	return 0;
 error:
@@ -1155,6 +2322,27 @@ error:
 	return -1;
 }
 
+static int
+c_cgroups_v2_start_pre_exec(c_cgroups_t *cgroups)
+{
+	// no migration (and moving of charges) if the init was created in the cgroup
+	IF_TRUE_RETVAL(cgroups->cloned_into, 0);
+
+	int ret = -1;
+	char *child_path = mem_printf("%s/child", cgroups->cgroup_path);
+
+	/* assign the container to the cgroup */
+	if (c_cgroups_v2_add_pid(child_path, container_get_pid(cgroups->container)) < 0) {
+		ERROR("Could not add container %s to its cgroup under %s",
+		      container_get_description(cgroups->container), child_path);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(child_path);
+	return ret;
+}
+
 int
 c_cgroups_start_pre_exec(c_cgroups_t *cgroups)
 {
@@ -1183,6 +2371,13 @@ c_cgroups_start_pre_exec(c_cgroups_t *cgroups)
 		c_cgroups_devices_usbdev_allow(cgroups, usbdev);
 	}
 
+	if (c_cgroups_unified) {
+		IF_TRUE_RETVAL(c_cgroups_v2_start_pre_exec(cgroups) < 0, -1);
+		c_cgroups_set_memory_priority(cgroups);
+		c_cgroups_set_io(cgroups);
+		return 0;
+	}
+
 	// temporarily add systemd to list
 	cgroups->active_cgroups = list_prepend(cgroups->active_cgroups, "systemd");
 
@@ -1232,6 +2427,9 @@ c_cgroups_start_pre_exec(c_cgroups_t *cgroups)
 
 	// remove temporarily added head
 	cgroups->active_cgroups = list_unlink(cgroups->active_cgroups, cgroups->active_cgroups);
+
+	c_cgroups_set_memory_priority(cgroups);
+	c_cgroups_set_io(cgroups);
 	return 0;
 error:
 	// remove temporarily added head
@@ -1244,6 +2442,13 @@ c_cgroups_add_pid(c_cgroups_t *cgroups, pid_t pid)
 {
 	ASSERT(cgroups);
 
+	if (c_cgroups_unified) {
+		char *child_path = mem_printf("%s/child", cgroups->cgroup_path);
+		int ret = c_cgroups_v2_add_pid(child_path, pid);
+		mem_free(child_path);
+		return ret;
+	}
+
 	// temporarily add systemd to list
 	cgroups->active_cgroups = list_prepend(cgroups->active_cgroups, "systemd");
 
@@ -1302,7 +2507,7 @@ c_cgroups_start_child(c_cgroups_t *cgroups)
 
 	/* We are doing our best to umount the cgroups related directories in child
 	 * but we do not stop if it does not work */
-	for (list_t *l = cgroups->active_cgroups; l; l = l->next) {
+	for (list_t *l = cgroups->active_cgroups; l && !c_cgroups_unified; l = l->next) {
 		char *subsys = l->data;
 		char *subsys_path = mem_printf("%s/%s", CGROUPS_FOLDER, subsys);
 		if (umount(subsys_path) < 0) {
@@ -1316,6 +2521,41 @@ c_cgroups_start_child(c_cgroups_t *cgroups)
 
 	return 0;
 }
+void
+c_cgroups_get_devices_fds(const c_cgroups_t *cgroups, int *map_fd, int *prog_fd)
+{
+	ASSERT(cgroups);
+
+	*map_fd = *prog_fd = -1;
+	if (cgroups->devices_v2)
+		c_cgroups_v2_devices_get_fds(cgroups->devices_v2, map_fd, prog_fd);
+}
+
+int
+c_cgroups_adopt(c_cgroups_t *cgroups, int map_fd, int prog_fd)
+{
+	ASSERT(cgroups);
+
+	if (c_cgroups_unified) {
+		/* the device program stays attached, only its policy has to be restored */
+		if (map_fd >= 0 && prog_fd >= 0)
+			cgroups->devices_v2 = c_cgroups_v2_devices_adopt(map_fd, prog_fd);
+		// the container has been moved to its child cgroup already
+		cgroups->cloned_into = true;
+		IF_TRUE_RETVAL(c_cgroups_v2_watch(cgroups) < 0, -1);
+	} else {
+		c_cgroups_v1_watch(cgroups);
+	}
+
+	/* occupy the exclusively assigned devices again, the rules are applied already */
+	if (c_cgroups_devices_assign_list(cgroups,
+					  container_get_dev_assign_list(cgroups->container)) < 0)
+		WARN("Could not restore the assigned devices of container %s",
+		     container_get_description(cgroups->container));
+
+	return 0;
+}
+
 static int
 c_cgroups_cleanup_subsys_remove_cb(const char *path, const char *name, UNUSED void *data)
 {
@@ -1338,6 +2578,40 @@ c_cgroups_cleanup_subsys_remove_cb(const char *path, const char *name, UNUSED vo
 	return ret;
 }
 
+static void
+c_cgroups_v2_cleanup(c_cgroups_t *cgroups)
+{
+	c_cgroups_set_cloned_into(cgroups, false);
+	c_cgroups_pressure_unwatch(cgroups);
+
+	if (cgroups->freezer_events_io) {
+		event_remove_io(cgroups->freezer_events_io);
+		event_io_free(cgroups->freezer_events_io);
+		cgroups->freezer_events_io = NULL;
+		close(cgroups->freezer_events_fd);
+		cgroups->freezer_events_fd = -1;
+	}
+
+	c_cgroups_v2_devices_free(cgroups->devices_v2, cgroups->cgroup_path);
+	cgroups->devices_v2 = NULL;
+
+	IF_FALSE_RETURN(file_is_dir(cgroups->cgroup_path));
+
+	/* make sure no process left over by the container keeps the cgroup busy */
+	c_cgroups_v2_kill(cgroups->cgroup_path);
+
+	/* recursively remove all subfolders which the container may have created */
+	if (dir_foreach(cgroups->cgroup_path, &c_cgroups_cleanup_subsys_remove_cb, NULL) < 0) {
+		WARN_ERRNO("Could not remove cgroup for container %s",
+			   container_get_description(cgroups->container));
+	} else if (rmdir(cgroups->cgroup_path) < 0) {
+		WARN_ERRNO("Could not delete cgroup %s", cgroups->cgroup_path);
+	} else {
+		INFO("Removed cgroup %s for container %s", cgroups->cgroup_path,
+		     container_get_description(cgroups->container));
+	}
+}
+
 void
 c_cgroups_cleanup(c_cgroups_t *cgroups)
 {
@@ -1349,6 +2623,18 @@ c_cgroups_cleanup(c_cgroups_t *cgroups)
 	cgroups->inotify_freezer_state = NULL;
 
 	c_cgroups_cleanup_freeze_timer(cgroups);
+	c_cgroups_usage_close(cgroups);
+
+	if (hibernate_enabled()) {
+		char *memory_path = c_cgroups_memory_path_new(cgroups);
+		hibernate_cancel(memory_path);
+		mem_free(memory_path);
+	}
+
+	if (c_cgroups_unified) {
+		c_cgroups_v2_cleanup(cgroups);
+		goto out;
+	}
 
 	// temporarily add systemd to list
 	cgroups->active_cgroups = list_prepend(cgroups->active_cgroups, "systemd");
@@ -1378,6 +2664,7 @@ c_cgroups_cleanup(c_cgroups_t *cgroups)
 	// remove temporarily added head
 	cgroups->active_cgroups = list_unlink(cgroups->active_cgroups, cgroups->active_cgroups);
 
+out:
 	/* unregister usbdevs from uevent subsystem for hotplugging */
 	for (list_t *l = container_get_usbdev_list(cgroups->container); l; l = l->next) {
 		uevent_usbdev_t *usbdev = l->data;
@@ -1385,18 +2672,8 @@ c_cgroups_cleanup(c_cgroups_t *cgroups)
 	}
 
 	/* free assigned devices */
-	for (list_t *elem = cgroups->assigned_devs; elem != NULL; elem = elem->next) {
-		int *dev_elem = (int *)elem->data;
-		c_cgroups_list_remove(&global_assigned_devs_list, dev_elem);
-	}
-	list_delete(cgroups->assigned_devs);
-	cgroups->assigned_devs = NULL;
+	c_cgroups_devset_release(&cgroups->assigned_devs, &global_assigned_devs);
 
 	/* free allowed devices */
-	for (list_t *elem = cgroups->allowed_devs; elem != NULL; elem = elem->next) {
-		int *dev_elem = (int *)elem->data;
-		c_cgroups_list_remove(&global_allowed_devs_list, dev_elem);
-	}
-	list_delete(cgroups->allowed_devs);
-	cgroups->allowed_devs = NULL;
+	c_cgroups_devset_release(&cgroups->allowed_devs, &global_allowed_devs);
 }
@@ -36,6 +36,44 @@
 
 typedef struct c_cgroups c_cgroups_t;
 
+/**
+ * Selects the cgroup hierarchy used for all containers. If unified is set and
+ * the kernel provides cgroup2, containers are managed in the cgroup v2 unified
+ * hierarchy instead of the v1 controller hierarchies. Device access is then
+ * enforced by a cgroup BPF device program. Must be called before any cgroup
+ * is mounted.
+ * @return true if the unified hierarchy is used, false otherwise
+ */
+bool
+c_cgroups_set_unified(bool unified);
+
+/**
+ * Policy of the pressure stall (PSI) driven resource governor. If a container
+ * stalls on a resource for longer than the configured time per second, the
+ * other running containers get throttled on that resource until no container
+ * reported pressure for relax_ms. Only available with the unified hierarchy.
+ */
+typedef struct {
+	unsigned int memory_stall_ms; /* 0 disables the memory governor */
+	unsigned int cpu_stall_ms;    /* 0 disables the cpu governor */
+	unsigned int io_stall_ms;     /* 0 disables the io governor */
+	unsigned int throttle_percent; /* memory.high and cpu/io weight of throttled containers */
+	unsigned int relax_ms;	       /* also the duration KSM is set aggressive on memory pressure */
+} c_cgroups_pressure_policy_t;
+
+/**
+ * Sets the policy of the resource governor for containers started afterwards.
+ */
+void
+c_cgroups_set_pressure_policy(const c_cgroups_pressure_policy_t *policy);
+
+/**
+ * Mounts the selected cgroup hierarchy if not already done.
+ * @return 0 on success, -1 on error
+ */
+int
+c_cgroups_mount(void);
+
 c_cgroups_t *
 c_cgroups_new(container_t *container);
 
@@ -50,6 +88,15 @@ c_cgroups_freeze(c_cgroups_t *cgroups);
 int
 c_cgroups_unfreeze(c_cgroups_t *cgroups);
 
+/**
+ * Kills all processes in the cgroup of the container at once through
+ * cgroup.kill, also frozen ones and those outside of the pid namespace of
+ * the container. Only supported with the unified hierarchy.
+ * @return 0 on success, -1 otherwise
+ */
+int
+c_cgroups_kill(c_cgroups_t *cgroups);
+
 int
 c_cgroups_devices_allow_audio(c_cgroups_t *cgroups);
 
@@ -71,6 +118,48 @@ c_cgroups_devices_is_dev_allowed(c_cgroups_t *cgroups, int major, int minor);
 int
 c_cgroups_set_ram_limit(c_cgroups_t *cgroups);
 
+/**
+ * Applies the current memory tier of the container (see
+ * container_get_memory_priority()) to the oom_score_adj of its init and to the
+ * memory protection and swappiness of its cgroup, so that the kernel reclaims
+ * from and OOM kills the containers of lower tiers first.
+ */
+int
+c_cgroups_set_memory_priority(c_cgroups_t *cgroups);
+
+/**
+ * Moves a running container to the cpus and memory nodes currently chosen by
+ * the cpu placement, or lifts the restriction if none are chosen.
+ */
+int
+c_cgroups_set_cpuset(c_cgroups_t *cgroups);
+
+/**
+ * Sets the cpu scheduling parameters of a running container.
+ * @param weight_percent cpu.weight (v2) or cpu.shares (v1) in percent of the default
+ * @param uclamp_min_percent minimum utilization clamp, i.e. the cpu frequency and
+ *        capacity the scheduler assumes for the container's tasks at least
+ * @param max_percent cpu bandwidth limit in percent of all online cpus, 0 for no limit
+ */
+int
+c_cgroups_set_cpu_sched(c_cgroups_t *cgroups, unsigned int weight_percent,
+			unsigned int uclamp_min_percent, unsigned int max_percent);
+
+/**
+ * Applies the block io weight and limits of the container (see
+ * container_get_io_config()) to the loop and dm devices backing its images.
+ */
+int
+c_cgroups_set_io(c_cgroups_t *cgroups);
+
+/**
+ * Samples the cpu, memory and io usage of the running container from the
+ * accounting files of its cgroup, which are kept open while it is running.
+ * @return 0 on success, -1 if the container's cgroup is not set up
+ */
+int
+c_cgroups_get_usage(const c_cgroups_t *cgroups, container_usage_t *usage);
+
 /*******************/
 /* Hooks */
 int
@@ -79,9 +168,39 @@ c_cgroups_start_pre_clone(c_cgroups_t *cgroups);
 int
 c_cgroups_start_post_clone(c_cgroups_t *cgroups);
 
+/**
+ * Returns an fd of the cgroup the container init can be created in by
+ * clone3(CLONE_INTO_CGROUP), or -1 if not available (v1 hierarchies).
+ * The fd is valid from c_cgroups_start_pre_clone() until c_cgroups_set_cloned_into().
+ */
+int
+c_cgroups_get_clone_fd(const c_cgroups_t *cgroups);
+
+/**
+ * Records whether the container init was created in its cgroup on clone, in
+ * which case it is not migrated by c_cgroups_start_pre_exec().
+ */
+void
+c_cgroups_set_cloned_into(c_cgroups_t *cgroups, bool cloned_into);
+
 int
 c_cgroups_start_pre_exec(c_cgroups_t *cgroups);
 
+/**
+ * Returns the fds of the BPF map and program of the device policy (cgroups v2
+ * only), e.g. to hand them over to a new cmld instance. -1 if not attached.
+ */
+void
+c_cgroups_get_devices_fds(const c_cgroups_t *cgroups, int *map_fd, int *prog_fd);
+
+/**
+ * Takes over the cgroups of a running container from a previous cmld instance
+ * instead of the start hooks: restores the device policy from the handed over
+ * BPF map and program (-1 for cgroups v1) and watches the cgroups again.
+ */
+int
+c_cgroups_adopt(c_cgroups_t *cgroups, int map_fd, int prog_fd);
+
 int
 c_cgroups_start_pre_exec_child(c_cgroups_t *cgroups);
 
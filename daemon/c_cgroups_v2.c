@@ -0,0 +1,1001 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#define MEM_TAG "container"
+
+#include "c_cgroups_v2.h"
+
+#include "mount.h"
+
+#include "common/mem.h"
+#include "common/macro.h"
+#include "common/file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+
+#define CGROUPS_V2_FOLDER MOUNT_CGROUPS_FOLDER
+
+#define CGROUPS_V2_DEV_ACC_ALL (BPF_DEVCG_ACC_MKNOD | BPF_DEVCG_ACC_READ | BPF_DEVCG_ACC_WRITE)
+
+/* wildcards in device map keys */
+#define CGROUPS_V2_DEV_TYPE_ANY 0
+#define CGROUPS_V2_DEV_NUM_ANY UINT32_MAX
+
+/* maximum number of device rules per container */
+#define CGROUPS_V2_DEV_MAP_SIZE 1024
+/* upper bound of the generated program, which has a fixed layout */
+#define CGROUPS_V2_DEV_PROG_MAX_INSNS 256
+
+/* key of the device map, layout shared with the BPF program */
+typedef struct {
+	uint32_t type; /* BPF_DEVCG_DEV_* or CGROUPS_V2_DEV_TYPE_ANY */
+	uint32_t major;
+	uint32_t minor;
+} c_cgroups_v2_dev_key_t;
+
+/* value of the device map, layout shared with the BPF program */
+typedef struct {
+	uint32_t allow; /* BPF_DEVCG_ACC_* bits granted */
+	uint32_t deny;	/* BPF_DEVCG_ACC_* bits revoked, take precedence */
+} c_cgroups_v2_dev_value_t;
+
+typedef struct {
+	c_cgroups_v2_dev_key_t key;
+	c_cgroups_v2_dev_value_t value;
+	bool dirty; /* not yet written to the map */
+} c_cgroups_v2_dev_entry_t;
+
+struct c_cgroups_v2_devices {
+	list_t *entries; /* userspace mirror of the map */
+	int map_fd;	 /* -1 until attached */
+	int prog_fd;
+};
+
+bool
+c_cgroups_v2_supported(void)
+{
+	char *filesystems = file_read_new("/proc/filesystems", 4096);
+	IF_NULL_RETVAL(filesystems, false);
+
+	bool ret = strstr(filesystems, "\tcgroup2\n") != NULL;
+	mem_free(filesystems);
+	return ret;
+}
+
+/* enables all controllers listed in cgroup.controllers of path for its children */
+static void
+c_cgroups_v2_enable_controllers(const char *path)
+{
+	char *controllers_path = mem_printf("%s/cgroup.controllers", path);
+	char *subtree_control_path = mem_printf("%s/cgroup.subtree_control", path);
+	char *controllers = file_read_new(controllers_path, 1024);
+
+	if (!controllers) {
+		WARN("Could not read available controllers from %s", controllers_path);
+		goto out;
+	}
+
+	char *pointer = NULL;
+	for (char *c = strtok_r(controllers, " \n", &pointer); c;
+	     c = strtok_r(NULL, " \n", &pointer)) {
+		/* controllers are enabled one by one, thus a single unusable one does not hurt */
+		if (file_printf(subtree_control_path, "+%s", c) == -1)
+			WARN_ERRNO("Could not enable controller %s in %s", c, subtree_control_path);
+		else
+			TRACE("Enabled controller %s in %s", c, subtree_control_path);
+	}
+
+out:
+	mem_free(controllers);
+	mem_free(controllers_path);
+	mem_free(subtree_control_path);
+}
+
+int
+c_cgroups_v2_mount(void)
+{
+	if (!file_is_mountpoint(CGROUPS_V2_FOLDER)) {
+		INFO("Mounting cgroup2 unified hierarchy");
+		if (mkdir(CGROUPS_V2_FOLDER, 0755) && errno != EEXIST) {
+			ERROR_ERRNO("Could not create cgroup mount directory");
+			return -1;
+		}
+		/* let the memory protection of a container cover its child cgroups */
+		unsigned long flags = MS_NOEXEC | MS_NODEV | MS_NOSUID | MS_RELATIME;
+		int ret = mount("cgroup2", CGROUPS_V2_FOLDER, "cgroup2", flags,
+				"memory_recursiveprot");
+		if (ret == -1 && errno == EINVAL) {
+			WARN("cgroup2 memory_recursiveprot not supported by kernel");
+			ret = mount("cgroup2", CGROUPS_V2_FOLDER, "cgroup2", flags, NULL);
+		}
+		if (ret == -1 && errno != EBUSY) {
+			ERROR_ERRNO("Could not mount cgroup2 unified hierarchy");
+			return -1;
+		}
+	}
+
+	c_cgroups_v2_enable_controllers(CGROUPS_V2_FOLDER);
+	return 0;
+}
+
+int
+c_cgroups_v2_create(const char *path, bool delegate)
+{
+	ASSERT(path);
+
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		ERROR_ERRNO("Could not create cgroup %s", path);
+		return -1;
+	}
+	if (delegate)
+		c_cgroups_v2_enable_controllers(path);
+	return 0;
+}
+
+int
+c_cgroups_v2_add_pid(const char *path, pid_t pid)
+{
+	ASSERT(path);
+
+	char *procs_path = mem_printf("%s/cgroup.procs", path);
+	int ret = file_printf(procs_path, "%d", pid);
+	if (ret == -1)
+		ERROR_ERRNO("Could not add pid %d to %s", pid, procs_path);
+	mem_free(procs_path);
+	return ret == -1 ? -1 : 0;
+}
+
+int
+c_cgroups_v2_set_memory_limit(const char *path, unsigned int limit_mb)
+{
+	ASSERT(path);
+
+	int ret = -1;
+	uint64_t max = (uint64_t)limit_mb << 20;
+	char *max_path = mem_printf("%s/memory.max", path);
+	char *high_path = mem_printf("%s/memory.high", path);
+
+	if (!file_exists(max_path)) {
+		ERROR("%s file not found (memory controller not enabled?)", max_path);
+		goto out;
+	}
+	/* lower memory.high first, writing a max below the current high is fine anyway */
+	if (file_printf(high_path, "%" PRIu64, max - max / 8) == -1) {
+		ERROR_ERRNO("Could not write to %s", high_path);
+		goto out;
+	}
+	if (file_printf(max_path, "%" PRIu64, max) == -1) {
+		ERROR_ERRNO("Could not write to %s", max_path);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(max_path);
+	mem_free(high_path);
+	return ret;
+}
+
+/*
+ * Returns the name of the default huge page size in the file names of the
+ * hugetlb controller, e.g. "2MB", or NULL without huge page support.
+ */
+static char *
+c_cgroups_v2_hugetlb_size_new(void)
+{
+	char *meminfo = file_read_new("/proc/meminfo", 8192);
+	IF_NULL_RETVAL(meminfo, NULL);
+
+	unsigned long kb = 0;
+	char *line = strstr(meminfo, "Hugepagesize:");
+	if (!line || sscanf(line, "Hugepagesize: %lu kB", &kb) != 1)
+		kb = 0;
+	mem_free(meminfo);
+
+	IF_TRUE_RETVAL(kb == 0, NULL);
+	if (kb >= (1UL << 20))
+		return mem_printf("%luGB", kb >> 20);
+	if (kb >= (1UL << 10))
+		return mem_printf("%luMB", kb >> 10);
+	return mem_printf("%luKB", kb);
+}
+
+int
+c_cgroups_v2_set_hugetlb_limit(const char *path, uint64_t limit)
+{
+	ASSERT(path);
+
+	char *size = c_cgroups_v2_hugetlb_size_new();
+	if (!size) {
+		ERROR("Could not determine the default huge page size (no hugetlb support?)");
+		return -1;
+	}
+
+	int ret = -1;
+	/* rsvd also charges reservations, e.g. of hugetlbfs mappings (Linux 5.7 and later) */
+	char *max_path = mem_printf("%s/hugetlb.%s.max", path, size);
+	char *rsvd_path = mem_printf("%s/hugetlb.%s.rsvd.max", path, size);
+
+	if (!file_exists(max_path)) {
+		ERROR("%s file not found (hugetlb controller not enabled?)", max_path);
+		goto out;
+	}
+	if ((limit ? file_printf(max_path, "%" PRIu64, limit) : file_printf(max_path, "max")) ==
+	    -1) {
+		ERROR_ERRNO("Could not write to %s", max_path);
+		goto out;
+	}
+	if (file_exists(rsvd_path) &&
+	    (limit ? file_printf(rsvd_path, "%" PRIu64, limit) : file_printf(rsvd_path, "max")) ==
+		    -1) {
+		ERROR_ERRNO("Could not write to %s", rsvd_path);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(max_path);
+	mem_free(rsvd_path);
+	mem_free(size);
+	return ret;
+}
+
+int
+c_cgroups_v2_set_memory_high(const char *path, uint64_t high)
+{
+	ASSERT(path);
+
+	char *high_path = mem_printf("%s/memory.high", path);
+	int ret = high ? file_printf(high_path, "%" PRIu64, high) : file_printf(high_path, "max");
+	if (ret == -1)
+		ERROR_ERRNO("Could not write to %s", high_path);
+	mem_free(high_path);
+	return ret == -1 ? -1 : 0;
+}
+
+int
+c_cgroups_v2_set_memory_protection(const char *path, uint64_t min, uint64_t low)
+{
+	ASSERT(path);
+
+	int ret = -1;
+	char *min_path = mem_printf("%s/memory.min", path);
+	char *low_path = mem_printf("%s/memory.low", path);
+
+	if ((min == UINT64_MAX ? file_printf(min_path, "max") :
+				 file_printf(min_path, "%" PRIu64, min)) == -1) {
+		ERROR_ERRNO("Could not write to %s", min_path);
+		goto out;
+	}
+	if ((low == UINT64_MAX ? file_printf(low_path, "max") :
+				 file_printf(low_path, "%" PRIu64, low)) == -1) {
+		ERROR_ERRNO("Could not write to %s", low_path);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(min_path);
+	mem_free(low_path);
+	return ret;
+}
+
+uint64_t
+c_cgroups_v2_get_memory_current(const char *path)
+{
+	ASSERT(path);
+
+	uint64_t current = 0;
+	char *current_path = mem_printf("%s/memory.current", path);
+	char *buf = file_read_new(current_path, 32);
+	if (!buf || sscanf(buf, "%" SCNu64, &current) != 1)
+		WARN("Could not read %s", current_path);
+	mem_free(buf);
+	mem_free(current_path);
+	return current;
+}
+
+int
+c_cgroups_v2_set_weight(const char *path, const char *controller, unsigned int weight)
+{
+	ASSERT(path);
+	ASSERT(controller);
+
+	char *weight_path = mem_printf("%s/%s.weight", path, controller);
+	/* io.weight takes per device weights as well, thus needs the default key */
+	int ret = strcmp(controller, "io") ? file_printf(weight_path, "%u", weight) :
+					     file_printf(weight_path, "default %u", weight);
+	if (ret == -1)
+		ERROR_ERRNO("Could not write to %s", weight_path);
+	mem_free(weight_path);
+	return ret == -1 ? -1 : 0;
+}
+
+int
+c_cgroups_v2_set_cpu_max(const char *path, uint64_t quota_us, uint64_t period_us)
+{
+	ASSERT(path);
+
+	char *max_path = mem_printf("%s/cpu.max", path);
+	int ret = quota_us ? file_printf(max_path, "%" PRIu64 " %" PRIu64, quota_us, period_us) :
+			     file_printf(max_path, "max %" PRIu64, period_us);
+	if (ret == -1)
+		ERROR_ERRNO("Could not write to %s", max_path);
+	mem_free(max_path);
+	return ret == -1 ? -1 : 0;
+}
+
+/* the io.max value of a limit, 0 is unlimited */
+static char *
+c_cgroups_v2_io_max_value_new(uint64_t limit)
+{
+	return limit ? mem_printf("%" PRIu64, limit) : mem_strdup("max");
+}
+
+int
+c_cgroups_v2_set_io_max(const char *path, dev_t dev, uint64_t rbps, uint64_t wbps, uint64_t riops,
+			uint64_t wiops)
+{
+	ASSERT(path);
+
+	char *max_path = mem_printf("%s/io.max", path);
+	char *rbps_str = c_cgroups_v2_io_max_value_new(rbps);
+	char *wbps_str = c_cgroups_v2_io_max_value_new(wbps);
+	char *riops_str = c_cgroups_v2_io_max_value_new(riops);
+	char *wiops_str = c_cgroups_v2_io_max_value_new(wiops);
+
+	int ret = file_printf(max_path, "%u:%u rbps=%s wbps=%s riops=%s wiops=%s", major(dev),
+			      minor(dev), rbps_str, wbps_str, riops_str, wiops_str);
+	if (ret == -1)
+		ERROR_ERRNO("Could not write limits of %u:%u to %s", major(dev), minor(dev),
+			    max_path);
+
+	mem_free(wiops_str);
+	mem_free(riops_str);
+	mem_free(wbps_str);
+	mem_free(rbps_str);
+	mem_free(max_path);
+	return ret == -1 ? -1 : 0;
+}
+
+int
+c_cgroups_v2_pressure_trigger_open(const char *path, const char *resource, unsigned int stall_us,
+				   unsigned int window_us)
+{
+	ASSERT(path);
+	ASSERT(resource);
+
+	char *pressure_path = mem_printf("%s/%s.pressure", path, resource);
+	char *trigger = mem_printf("some %u %u", stall_us, window_us);
+
+	int fd = open(pressure_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open %s (kernel without PSI support?)", pressure_path);
+		goto out;
+	}
+	/* the kernel expects the terminating NUL to be written as well */
+	if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+		ERROR_ERRNO("Could not register trigger '%s' on %s", trigger, pressure_path);
+		close(fd);
+		fd = -1;
+	}
+out:
+	mem_free(trigger);
+	mem_free(pressure_path);
+	return fd;
+}
+
+int
+c_cgroups_v2_set_cpus(const char *path, const char *cpus, const char *mems, bool exclusive)
+{
+	ASSERT(path);
+	ASSERT(cpus);
+	ASSERT(mems);
+
+	int ret = -1;
+	char *cpus_path = mem_printf("%s/cpuset.cpus", path);
+	char *mems_path = mem_printf("%s/cpuset.mems", path);
+	char *partition_path = mem_printf("%s/cpuset.cpus.partition", path);
+
+	if (!file_exists(cpus_path)) {
+		ERROR("%s file not found (cpuset controller not enabled?)", cpus_path);
+		goto out;
+	}
+	if (file_printf(cpus_path, "%s", cpus) == -1) {
+		ERROR_ERRNO("Could not write to %s", cpus_path);
+		goto out;
+	}
+	if (file_printf(mems_path, "%s", mems) == -1) {
+		ERROR_ERRNO("Could not write to %s", mems_path);
+		goto out;
+	}
+	if (!exclusive) {
+		ret = 0;
+		goto out;
+	}
+	if (!file_exists(partition_path)) {
+		WARN("%s not supported by kernel, cpus are not exclusive", partition_path);
+	} else if (file_printf(partition_path, "root") == -1) {
+		ERROR_ERRNO("Could not write to %s", partition_path);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(cpus_path);
+	mem_free(mems_path);
+	mem_free(partition_path);
+	return ret;
+}
+
+int
+c_cgroups_v2_freeze(const char *path, bool freeze)
+{
+	ASSERT(path);
+
+	char *freeze_path = mem_printf("%s/cgroup.freeze", path);
+	int ret = file_printf(freeze_path, "%d", freeze ? 1 : 0);
+	if (ret == -1)
+		ERROR_ERRNO("Failed to write to freezer file %s", freeze_path);
+	mem_free(freeze_path);
+	return ret == -1 ? -1 : 0;
+}
+
+char *
+c_cgroups_v2_events_path_new(const char *path)
+{
+	ASSERT(path);
+	return mem_printf("%s/cgroup.events", path);
+}
+
+char *
+c_cgroups_v2_freezer_state_new(const char *path)
+{
+	ASSERT(path);
+
+	char *ret = NULL;
+	char *freeze_path = mem_printf("%s/cgroup.freeze", path);
+	char *events_path = c_cgroups_v2_events_path_new(path);
+	char *freeze = file_read_new(freeze_path, 4);
+	char *events = file_read_new(events_path, 256);
+
+	IF_NULL_GOTO_ERROR(freeze, out);
+	IF_NULL_GOTO_ERROR(events, out);
+
+	bool frozen = strstr(events, "frozen 1") != NULL;
+	if (freeze[0] != '1')
+		ret = mem_strdup("THAWED");
+	else
+		ret = mem_strdup(frozen ? "FROZEN" : "FREEZING");
+out:
+	mem_free(freeze);
+	mem_free(events);
+	mem_free(freeze_path);
+	mem_free(events_path);
+	return ret;
+}
+
+int
+c_cgroups_v2_kill(const char *path)
+{
+	ASSERT(path);
+
+	int ret = 0;
+	char *kill_path = mem_printf("%s/cgroup.kill", path);
+	if (!file_exists(kill_path)) {
+		TRACE("%s not supported by kernel", kill_path);
+	} else if (file_printf(kill_path, "1") == -1) {
+		WARN_ERRNO("Could not kill processes in %s", path);
+		ret = -1;
+	}
+	mem_free(kill_path);
+	return ret;
+}
+
+/******************************/
+/* device cgroup BPF programs */
+
+static int
+c_cgroups_v2_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* parses a v1 style rule into key and access bits */
+static int
+c_cgroups_v2_dev_rule_parse(const char *rule, c_cgroups_v2_dev_key_t *key, uint32_t *access)
+{
+	key->type = CGROUPS_V2_DEV_TYPE_ANY;
+	key->major = CGROUPS_V2_DEV_NUM_ANY;
+	key->minor = CGROUPS_V2_DEV_NUM_ANY;
+	*access = CGROUPS_V2_DEV_ACC_ALL;
+
+	if (!strcmp(rule, "a"))
+		return 0;
+
+	char type, maj[16], min[16], acc[8];
+	if (sscanf(rule, "%c %15[^:]:%15s %7s", &type, maj, min, acc) != 4)
+		goto err;
+
+	switch (type) {
+	case 'a':
+		break;
+	case 'b':
+		key->type = BPF_DEVCG_DEV_BLOCK;
+		break;
+	case 'c':
+		key->type = BPF_DEVCG_DEV_CHAR;
+		break;
+	default:
+		goto err;
+	}
+
+	if (strcmp(maj, "*")) {
+		char *end;
+		long num = strtol(maj, &end, 10);
+		IF_TRUE_GOTO(*end || num < 0 || num >= CGROUPS_V2_DEV_NUM_ANY, err);
+		key->major = num;
+	}
+	if (strcmp(min, "*")) {
+		char *end;
+		long num = strtol(min, &end, 10);
+		IF_TRUE_GOTO(*end || num < 0 || num >= CGROUPS_V2_DEV_NUM_ANY, err);
+		key->minor = num;
+	}
+
+	*access = 0;
+	for (char *c = acc; *c; c++) {
+		switch (*c) {
+		case 'm':
+			*access |= BPF_DEVCG_ACC_MKNOD;
+			break;
+		case 'r':
+			*access |= BPF_DEVCG_ACC_READ;
+			break;
+		case 'w':
+			*access |= BPF_DEVCG_ACC_WRITE;
+			break;
+		default:
+			goto err;
+		}
+	}
+	return 0;
+err:
+	ERROR("Invalid device rule '%s'", rule);
+	return -1;
+}
+
+/* true if every device matched by b is also matched by a */
+static bool
+c_cgroups_v2_dev_key_covers(const c_cgroups_v2_dev_key_t *a, const c_cgroups_v2_dev_key_t *b)
+{
+	return (a->type == CGROUPS_V2_DEV_TYPE_ANY || a->type == b->type) &&
+	       (a->major == CGROUPS_V2_DEV_NUM_ANY || a->major == b->major) &&
+	       (a->minor == CGROUPS_V2_DEV_NUM_ANY || a->minor == b->minor);
+}
+
+static bool
+c_cgroups_v2_dev_key_overlaps(const c_cgroups_v2_dev_key_t *a, const c_cgroups_v2_dev_key_t *b)
+{
+	return c_cgroups_v2_dev_key_covers(a, b) || c_cgroups_v2_dev_key_covers(b, a) ||
+	       ((a->type == b->type || a->type == CGROUPS_V2_DEV_TYPE_ANY ||
+		 b->type == CGROUPS_V2_DEV_TYPE_ANY) &&
+		(a->major == b->major || a->major == CGROUPS_V2_DEV_NUM_ANY ||
+		 b->major == CGROUPS_V2_DEV_NUM_ANY) &&
+		(a->minor == b->minor || a->minor == CGROUPS_V2_DEV_NUM_ANY ||
+		 b->minor == CGROUPS_V2_DEV_NUM_ANY));
+}
+
+static c_cgroups_v2_dev_entry_t *
+c_cgroups_v2_devices_entry_get(c_cgroups_v2_devices_t *devices, const c_cgroups_v2_dev_key_t *key)
+{
+	for (list_t *l = devices->entries; l; l = l->next) {
+		c_cgroups_v2_dev_entry_t *entry = l->data;
+		if (!memcmp(&entry->key, key, sizeof(*key)))
+			return entry;
+	}
+
+	c_cgroups_v2_dev_entry_t *entry = mem_new0(c_cgroups_v2_dev_entry_t, 1);
+	entry->key = *key;
+	devices->entries = list_append(devices->entries, entry);
+	return entry;
+}
+
+/* writes dirty entries to the map, empty entries are deleted */
+static int
+c_cgroups_v2_devices_sync(c_cgroups_v2_devices_t *devices)
+{
+	int ret = 0;
+
+	for (list_t *l = devices->entries; l;) {
+		list_t *next = l->next;
+		c_cgroups_v2_dev_entry_t *entry = l->data;
+		bool empty = !entry->value.allow && !entry->value.deny;
+
+		if (entry->dirty && devices->map_fd >= 0) {
+			union bpf_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.map_fd = devices->map_fd;
+			attr.key = (uint64_t)(uintptr_t)&entry->key;
+			attr.value = (uint64_t)(uintptr_t)&entry->value;
+			attr.flags = BPF_ANY;
+
+			if (empty) {
+				if (c_cgroups_v2_bpf(BPF_MAP_DELETE_ELEM, &attr) < 0 &&
+				    errno != ENOENT) {
+					ERROR_ERRNO("Could not delete device map entry");
+					ret = -1;
+				}
+			} else if (c_cgroups_v2_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+				ERROR_ERRNO("Could not update device map entry");
+				ret = -1;
+				l = next;
+				continue;
+			}
+		}
+		entry->dirty = false;
+
+		if (empty) {
+			mem_free(entry);
+			devices->entries = list_unlink(devices->entries, l);
+		}
+		l = next;
+	}
+	return ret;
+}
+
+c_cgroups_v2_devices_t *
+c_cgroups_v2_devices_new(void)
+{
+	c_cgroups_v2_devices_t *devices = mem_new0(c_cgroups_v2_devices_t, 1);
+	devices->map_fd = -1;
+	devices->prog_fd = -1;
+	return devices;
+}
+
+int
+c_cgroups_v2_devices_rule_add(c_cgroups_v2_devices_t *devices, const char *rule, bool allow)
+{
+	ASSERT(devices);
+	ASSERT(rule);
+
+	c_cgroups_v2_dev_key_t key;
+	uint32_t access;
+	IF_TRUE_RETVAL(c_cgroups_v2_dev_rule_parse(rule, &key, &access) < 0, -1);
+
+	bool granted_wider = false;
+	for (list_t *l = devices->entries; l; l = l->next) {
+		c_cgroups_v2_dev_entry_t *entry = l->data;
+		if (c_cgroups_v2_dev_key_covers(&key, &entry->key)) {
+			/* the new rule supersedes narrower rules for its access bits */
+			if (allow)
+				entry->value.deny &= ~access;
+			else
+				entry->value.allow &= ~access;
+			entry->dirty = true;
+		} else if (!allow && (entry->value.allow & access) &&
+			   c_cgroups_v2_dev_key_overlaps(&key, &entry->key)) {
+			granted_wider = true;
+		}
+	}
+
+	if (allow || granted_wider) {
+		/* a deny is only needed where a wider allow still grants access */
+		c_cgroups_v2_dev_entry_t *entry = c_cgroups_v2_devices_entry_get(devices, &key);
+		if (allow)
+			entry->value.allow |= access;
+		else
+			entry->value.deny |= access;
+		entry->dirty = true;
+	}
+
+	return c_cgroups_v2_devices_sync(devices);
+}
+
+static void
+c_cgroups_v2_insn_add(struct bpf_insn *prog, int *len, uint8_t code, uint8_t dst, uint8_t src,
+		      int16_t off, int32_t imm)
+{
+	ASSERT(*len < CGROUPS_V2_DEV_PROG_MAX_INSNS);
+
+	struct bpf_insn *insn = &prog[(*len)++];
+	memset(insn, 0, sizeof(*insn));
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+}
+
+/* stack layout of the program (offsets relative to r10) */
+#define CGROUPS_V2_STACK_KEY -16
+#define CGROUPS_V2_STACK_TYPE -20
+#define CGROUPS_V2_STACK_MAJOR -24
+#define CGROUPS_V2_STACK_MINOR -28
+
+/* key field of the lookup: either the requested value saved on the stack or the wildcard */
+static void
+c_cgroups_v2_prog_add_key_field(struct bpf_insn *prog, int *len, int16_t field, int16_t saved,
+				bool any, int32_t any_value)
+{
+	if (any) {
+		c_cgroups_v2_insn_add(prog, len, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, field,
+				      any_value);
+	} else {
+		c_cgroups_v2_insn_add(prog, len, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_10,
+				      saved, 0);
+		c_cgroups_v2_insn_add(prog, len, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3,
+				      field, 0);
+	}
+}
+
+/*
+ * The program looks up all 8 combinations of (type, major, minor) and their
+ * wildcards in the map, ORs the allowed and denied access bits of all matches
+ * into r7 and r8, and grants the access requested in r6 if it is fully
+ * allowed and not denied. Thus, its layout does not depend on the rules.
+ */
+static int
+c_cgroups_v2_prog_load(int map_fd)
+{
+	struct bpf_insn *prog = mem_new0(struct bpf_insn, CGROUPS_V2_DEV_PROG_MAX_INSNS);
+	int len = 0;
+
+	/* r6 = access (upper 16 bit of access_type), save type, major and minor on the stack */
+	c_cgroups_v2_insn_add(prog, &len, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+			      offsetof(struct bpf_cgroup_dev_ctx, access_type), 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_2, 0, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_RSH | BPF_K, BPF_REG_6, 0, 0, 16);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_AND | BPF_K, BPF_REG_2, 0, 0, 0xffff);
+	c_cgroups_v2_insn_add(prog, &len, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2,
+			      CGROUPS_V2_STACK_TYPE, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+			      offsetof(struct bpf_cgroup_dev_ctx, major), 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2,
+			      CGROUPS_V2_STACK_MAJOR, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+			      offsetof(struct bpf_cgroup_dev_ctx, minor), 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2,
+			      CGROUPS_V2_STACK_MINOR, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_7, 0, 0, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, 0);
+
+	for (int i = 0; i < 8; i++) {
+		c_cgroups_v2_prog_add_key_field(prog, &len,
+						CGROUPS_V2_STACK_KEY +
+							(int)offsetof(c_cgroups_v2_dev_key_t, type),
+						CGROUPS_V2_STACK_TYPE, i & 4, CGROUPS_V2_DEV_TYPE_ANY);
+		c_cgroups_v2_prog_add_key_field(prog, &len,
+						CGROUPS_V2_STACK_KEY +
+							(int)offsetof(c_cgroups_v2_dev_key_t, major),
+						CGROUPS_V2_STACK_MAJOR, i & 2, -1);
+		c_cgroups_v2_prog_add_key_field(prog, &len,
+						CGROUPS_V2_STACK_KEY +
+							(int)offsetof(c_cgroups_v2_dev_key_t, minor),
+						CGROUPS_V2_STACK_MINOR, i & 1, -1);
+
+		/* r0 = bpf_map_lookup_elem(map, r10 + CGROUPS_V2_STACK_KEY) */
+		c_cgroups_v2_insn_add(prog, &len, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1,
+				      BPF_PSEUDO_MAP_FD, 0, map_fd);
+		c_cgroups_v2_insn_add(prog, &len, 0, 0, 0, 0, 0);
+		c_cgroups_v2_insn_add(prog, &len, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10,
+				      0, 0);
+		c_cgroups_v2_insn_add(prog, &len, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0,
+				      CGROUPS_V2_STACK_KEY);
+		c_cgroups_v2_insn_add(prog, &len, BPF_JMP | BPF_CALL, 0, 0, 0,
+				      BPF_FUNC_map_lookup_elem);
+
+		c_cgroups_v2_insn_add(prog, &len, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 4, 0);
+		c_cgroups_v2_insn_add(prog, &len, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_0,
+				      offsetof(c_cgroups_v2_dev_value_t, allow), 0);
+		c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_OR | BPF_X, BPF_REG_7, BPF_REG_3, 0,
+				      0);
+		c_cgroups_v2_insn_add(prog, &len, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_0,
+				      offsetof(c_cgroups_v2_dev_value_t, deny), 0);
+		c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_OR | BPF_X, BPF_REG_8, BPF_REG_3, 0,
+				      0);
+	}
+
+	/* deny if any requested bit is denied */
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_6, 0, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_AND | BPF_X, BPF_REG_3, BPF_REG_8, 0, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_3, 0, 5, 0);
+	/* deny if any requested bit is not allowed */
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_7, 0, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_XOR | BPF_K, BPF_REG_3, 0, 0, -1);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU | BPF_AND | BPF_X, BPF_REG_3, BPF_REG_6, 0, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_3, 0, 1, 0);
+	c_cgroups_v2_insn_add(prog, &len, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 1);
+	c_cgroups_v2_insn_add(prog, &len, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_CGROUP_DEVICE;
+	attr.insns = (uint64_t)(uintptr_t)prog;
+	attr.insn_cnt = len;
+	attr.license = (uint64_t)(uintptr_t) "GPL";
+
+	int prog_fd = c_cgroups_v2_bpf(BPF_PROG_LOAD, &attr);
+	if (prog_fd < 0)
+		ERROR_ERRNO("Could not load device cgroup program (%d instructions)", len);
+
+	mem_free(prog);
+	return prog_fd;
+}
+
+static int
+c_cgroups_v2_prog_attach(int cgroup_fd, int prog_fd, bool attach)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = cgroup_fd;
+	attr.attach_bpf_fd = prog_fd;
+	attr.attach_type = BPF_CGROUP_DEVICE;
+	/* programs attached by the container itself below us are evaluated as well */
+	attr.attach_flags = attach ? BPF_F_ALLOW_MULTI : 0;
+
+	return c_cgroups_v2_bpf(attach ? BPF_PROG_ATTACH : BPF_PROG_DETACH, &attr);
+}
+
+int
+c_cgroups_v2_devices_attach(c_cgroups_v2_devices_t *devices, const char *path)
+{
+	ASSERT(devices);
+	ASSERT(path);
+	IF_TRUE_RETVAL(devices->prog_fd >= 0, 0);
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = sizeof(c_cgroups_v2_dev_key_t);
+	attr.value_size = sizeof(c_cgroups_v2_dev_value_t);
+	attr.max_entries = CGROUPS_V2_DEV_MAP_SIZE;
+
+	devices->map_fd = c_cgroups_v2_bpf(BPF_MAP_CREATE, &attr);
+	if (devices->map_fd < 0) {
+		ERROR_ERRNO("Could not create device map");
+		return -1;
+	}
+
+	/* fill the map before the program becomes effective */
+	for (list_t *l = devices->entries; l; l = l->next)
+		((c_cgroups_v2_dev_entry_t *)l->data)->dirty = true;
+	IF_TRUE_GOTO(c_cgroups_v2_devices_sync(devices) < 0, err);
+
+	devices->prog_fd = c_cgroups_v2_prog_load(devices->map_fd);
+	IF_TRUE_GOTO(devices->prog_fd < 0, err);
+
+	int cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cgroup_fd < 0) {
+		ERROR_ERRNO("Could not open cgroup %s", path);
+		goto err;
+	}
+	if (c_cgroups_v2_prog_attach(cgroup_fd, devices->prog_fd, true) < 0) {
+		ERROR_ERRNO("Could not attach device cgroup program to %s", path);
+		close(cgroup_fd);
+		goto err;
+	}
+	close(cgroup_fd);
+
+	TRACE("Attached device cgroup program with %d entries to %s",
+	      list_length(devices->entries), path);
+	return 0;
+err:
+	if (devices->prog_fd >= 0)
+		close(devices->prog_fd);
+	close(devices->map_fd);
+	devices->prog_fd = -1;
+	devices->map_fd = -1;
+	return -1;
+}
+
+int
+c_cgroups_v2_devices_get_count(const c_cgroups_v2_devices_t *devices)
+{
+	ASSERT(devices);
+	return list_length(devices->entries);
+}
+
+void
+c_cgroups_v2_devices_get_fds(const c_cgroups_v2_devices_t *devices, int *map_fd, int *prog_fd)
+{
+	ASSERT(devices);
+	*map_fd = devices->map_fd;
+	*prog_fd = devices->prog_fd;
+}
+
+c_cgroups_v2_devices_t *
+c_cgroups_v2_devices_adopt(int map_fd, int prog_fd)
+{
+	c_cgroups_v2_devices_t *devices = c_cgroups_v2_devices_new();
+	devices->map_fd = map_fd;
+	devices->prog_fd = prog_fd;
+
+	/* the map is the only copy of the policy, a NULL key returns its first key */
+	c_cgroups_v2_dev_key_t key, next_key;
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.next_key = (uint64_t)(uintptr_t)&next_key;
+
+	while (c_cgroups_v2_bpf(BPF_MAP_GET_NEXT_KEY, &attr) == 0) {
+		c_cgroups_v2_dev_entry_t *entry = mem_new0(c_cgroups_v2_dev_entry_t, 1);
+		entry->key = next_key;
+
+		union bpf_attr lookup;
+		memset(&lookup, 0, sizeof(lookup));
+		lookup.map_fd = map_fd;
+		lookup.key = (uint64_t)(uintptr_t)&entry->key;
+		lookup.value = (uint64_t)(uintptr_t)&entry->value;
+		if (c_cgroups_v2_bpf(BPF_MAP_LOOKUP_ELEM, &lookup) < 0)
+			mem_free(entry);
+		else
+			devices->entries = list_append(devices->entries, entry);
+
+		key = next_key;
+		attr.key = (uint64_t)(uintptr_t)&key;
+	}
+	if (errno != ENOENT)
+		WARN_ERRNO("Could not read all entries of the device map");
+
+	TRACE("Adopted device cgroup program with %d entries", list_length(devices->entries));
+	return devices;
+}
+
+void
+c_cgroups_v2_devices_free(c_cgroups_v2_devices_t *devices, const char *path)
+{
+	IF_NULL_RETURN(devices);
+
+	if (devices->prog_fd >= 0 && path) {
+		int cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (cgroup_fd >= 0) {
+			if (c_cgroups_v2_prog_attach(cgroup_fd, devices->prog_fd, false) < 0)
+				TRACE_ERRNO("Could not detach device cgroup program from %s",
+					    path);
+			close(cgroup_fd);
+		}
+	}
+	if (devices->prog_fd >= 0)
+		close(devices->prog_fd);
+	if (devices->map_fd >= 0)
+		close(devices->map_fd);
+
+	for (list_t *l = devices->entries; l; l = l->next)
+		mem_free(l->data);
+	list_delete(devices->entries);
+	mem_free(devices);
+}
@@ -0,0 +1,229 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file c_cgroups_v2.h
+ *
+ * Helpers for the cgroup v2 (unified hierarchy) backend of c_cgroups.
+ * All functions operate on the path of a single cgroup directory, the
+ * container specific state is kept in c_cgroups.
+ *
+ * Since the unified hierarchy has no devices controller, device access is
+ * enforced by a BPF_PROG_TYPE_CGROUP_DEVICE program which looks up a BPF hash
+ * map filled from v1 style device rules ("c 1:3 rwm", "a", ...).
+ */
+
+#ifndef C_CGROUPS_V2_H
+#define C_CGROUPS_V2_H
+
+#include "common/list.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Checks if the running kernel provides the cgroup2 filesystem.
+ */
+bool
+c_cgroups_v2_supported(void);
+
+/**
+ * Mounts the unified hierarchy if not already done and enables all
+ * available controllers for its children.
+ * @return 0 on success, -1 on error
+ */
+int
+c_cgroups_v2_mount(void);
+
+/**
+ * Creates the cgroup at path. An already existing cgroup is accepted.
+ * If delegate is set, all controllers available in the cgroup are enabled
+ * for its children. Processes can then only be added to those children.
+ * @return 0 on success, -1 on error
+ */
+int
+c_cgroups_v2_create(const char *path, bool delegate);
+
+/**
+ * Moves the process pid into the cgroup at path.
+ */
+int
+c_cgroups_v2_add_pid(const char *path, pid_t pid);
+
+/**
+ * Sets memory.max of the cgroup at path to limit_mb MBytes and memory.high
+ * to 7/8 of it, so that the kernel throttles and reclaims before the
+ * container hits the hard limit and gets OOM killed.
+ */
+int
+c_cgroups_v2_set_memory_limit(const char *path, unsigned int limit_mb);
+
+/**
+ * Restricts the cgroup at path to the given cpus and memory nodes. If exclusive
+ * is set, the cgroup is made a cpuset partition root, which is the v2
+ * counterpart of cpuset.cpu_exclusive.
+ */
+int
+c_cgroups_v2_set_cpus(const char *path, const char *cpus, const char *mems, bool exclusive);
+
+/**
+ * Writes cgroup.freeze of the cgroup at path.
+ */
+int
+c_cgroups_v2_freeze(const char *path, bool freeze);
+
+/**
+ * Returns the freezer state of the cgroup at path as one of the v1 freezer
+ * state strings "THAWED", "FREEZING" or "FROZEN" (newly allocated), derived
+ * from cgroup.freeze and the frozen key in cgroup.events.
+ * @return the state string or NULL on error
+ */
+char *
+c_cgroups_v2_freezer_state_new(const char *path);
+
+/**
+ * Returns a newly allocated path of the file which is modified by the kernel
+ * on state changes of the cgroup at path and thus can be watched by inotify.
+ */
+char *
+c_cgroups_v2_events_path_new(const char *path);
+
+/**
+ * Kills all processes of the cgroup at path and its descendants using
+ * cgroup.kill if supported by the kernel.
+ */
+int
+c_cgroups_v2_kill(const char *path);
+
+/**
+ * Limits the huge pages of the default size the cgroup at path may use and
+ * reserve to limit bytes, 0 removes the limit.
+ */
+int
+c_cgroups_v2_set_hugetlb_limit(const char *path, uint64_t limit);
+
+/**
+ * Sets memory.high of the cgroup at path to high bytes, 0 removes the limit.
+ */
+int
+c_cgroups_v2_set_memory_high(const char *path, uint64_t high);
+
+/**
+ * Sets memory.min and memory.low of the cgroup at path to min and low bytes,
+ * UINT64_MAX protects all memory of the cgroup.
+ */
+int
+c_cgroups_v2_set_memory_protection(const char *path, uint64_t min, uint64_t low);
+
+/**
+ * Returns the current memory usage of the cgroup at path in bytes, 0 on error.
+ */
+uint64_t
+c_cgroups_v2_get_memory_current(const char *path);
+
+/**
+ * Sets the default weight (1-10000) of the "cpu" or "io" controller of the
+ * cgroup at path.
+ */
+int
+c_cgroups_v2_set_weight(const char *path, const char *controller, unsigned int weight);
+
+/**
+ * Limits the cpu bandwidth of the cgroup at path to quota_us per period_us,
+ * a quota of 0 removes the limit.
+ */
+int
+c_cgroups_v2_set_cpu_max(const char *path, uint64_t quota_us, uint64_t period_us);
+
+/**
+ * Limits the bandwidth and io operations per second of the cgroup at path on
+ * the block device dev, a limit of 0 removes it.
+ */
+int
+c_cgroups_v2_set_io_max(const char *path, dev_t dev, uint64_t rbps, uint64_t wbps, uint64_t riops,
+			uint64_t wiops);
+
+/**
+ * Opens a pressure stall (PSI) trigger on the "memory", "cpu" or "io" pressure
+ * file of the cgroup at path. The returned fd signals EPOLLPRI whenever some
+ * tasks of the cgroup stalled for more than stall_us within window_us.
+ * @return the trigger fd or -1 on error
+ */
+int
+c_cgroups_v2_pressure_trigger_open(const char *path, const char *resource, unsigned int stall_us,
+				   unsigned int window_us);
+
+typedef struct c_cgroups_v2_devices c_cgroups_v2_devices_t;
+
+/**
+ * Creates an empty device policy, which denies all devices.
+ */
+c_cgroups_v2_devices_t *
+c_cgroups_v2_devices_new(void);
+
+/**
+ * Applies a v1 style device rule to the policy. Narrower rules covered by the
+ * new one lose the affected access bits. A deny is only recorded if a wider
+ * allow still grants the access, everything not allowed is denied anyway.
+ * Once attached, only the changed entries of the BPF map are updated.
+ * @return 0 on success, -1 if the rule could not be parsed or applied
+ */
+int
+c_cgroups_v2_devices_rule_add(c_cgroups_v2_devices_t *devices, const char *rule, bool allow);
+
+/**
+ * Creates the BPF map holding the policy and attaches a device cgroup program,
+ * which evaluates the map, to the cgroup at path. Does nothing if already attached.
+ * @return 0 on success, -1 on error
+ */
+int
+c_cgroups_v2_devices_attach(c_cgroups_v2_devices_t *devices, const char *path);
+
+/**
+ * Returns the number of entries of the policy.
+ */
+int
+c_cgroups_v2_devices_get_count(const c_cgroups_v2_devices_t *devices);
+
+/**
+ * Returns the fds of the BPF map and the program of an attached policy, -1 if
+ * not attached.
+ */
+void
+c_cgroups_v2_devices_get_fds(const c_cgroups_v2_devices_t *devices, int *map_fd, int *prog_fd);
+
+/**
+ * Takes over the policy attached by a previous cmld instance, given by the fds
+ * of its BPF map and program. The entries of the policy are read from the map.
+ */
+c_cgroups_v2_devices_t *
+c_cgroups_v2_devices_adopt(int map_fd, int prog_fd);
+
+/**
+ * Detaches the program from the cgroup at path, if attached, and frees the policy.
+ */
+void
+c_cgroups_v2_devices_free(c_cgroups_v2_devices_t *devices, const char *path);
+
+#endif /* C_CGROUPS_V2_H */
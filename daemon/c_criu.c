@@ -0,0 +1,227 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#define MEM_TAG "container"
+
+#include "c_criu.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
+#include "common/dir.h"
+#include "common/proc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define C_CRIU_BIN "criu"
+#define C_CRIU_DIR_NAME "criu"
+#define C_CRIU_NETNS_KEY "cml-netns"
+
+/* an argv for a criu dump or restore, see the C_CRIU_*_ARGS below */
+#define C_CRIU_MAX_ARGS 32
+
+/* options which have to be the same for dump and restore */
+// clang-format off
+#define C_CRIU_COMMON_ARGS \
+	"--manage-cgroups=soft", \
+	"--tcp-established", \
+	"--ext-unix-sk", \
+	"--file-locks", \
+	"--ext-mount-map", "auto", \
+	"--enable-external-sharing", \
+	"--enable-external-masters"
+// clang-format on
+
+struct c_criu {
+	const container_t *container; // weak reference
+	char *dir;		      // directory of the images
+};
+
+c_criu_t *
+c_criu_new(const container_t *container)
+{
+	ASSERT(container);
+
+	c_criu_t *criu = mem_new0(c_criu_t, 1);
+	criu->container = container;
+	criu->dir = mem_printf("%s/%s", container_get_images_dir(container), C_CRIU_DIR_NAME);
+
+	return criu;
+}
+
+void
+c_criu_free(c_criu_t *criu)
+{
+	ASSERT(criu);
+
+	mem_free(criu->dir);
+	mem_free(criu);
+}
+
+bool
+c_criu_has_checkpoint(const c_criu_t *criu)
+{
+	ASSERT(criu);
+
+	char *inventory = mem_printf("%s/inventory.img", criu->dir);
+	bool ret = file_exists(inventory);
+	mem_free(inventory);
+
+	return ret;
+}
+
+void
+c_criu_cleanup(c_criu_t *criu)
+{
+	ASSERT(criu);
+
+	IF_FALSE_RETURN(file_is_dir(criu->dir));
+
+	if (dir_delete_folder(container_get_images_dir(criu->container), C_CRIU_DIR_NAME) < 0)
+		WARN("Could not remove checkpoint of %s", container_get_description(criu->container));
+}
+
+int
+c_criu_dump(c_criu_t *criu, pid_t pid, const char *netns_path)
+{
+	ASSERT(criu);
+
+	int ret = -1;
+	char *pid_str = mem_printf("%d", pid);
+	char *netns_ext = NULL;
+
+	// remove images of an older checkpoint which has not been restored
+	c_criu_cleanup(criu);
+
+	if (dir_mkdir_p(criu->dir, 0700) < 0) {
+		ERROR_ERRNO("Could not create checkpoint dir %s", criu->dir);
+		goto out;
+	}
+
+	const char *argv[C_CRIU_MAX_ARGS] = { C_CRIU_BIN,    "dump",	 "--tree",	 pid_str,
+					      "--images-dir", criu->dir, "--log-file", "dump.log",
+					      C_CRIU_COMMON_ARGS };
+	int argc = 0;
+	while (argv[argc])
+		argc++;
+
+	if (netns_path) {
+		struct stat s;
+		if (stat(netns_path, &s) < 0) {
+			ERROR_ERRNO("Could not stat netns %s", netns_path);
+			goto out;
+		}
+		netns_ext = mem_printf("net[%lu]:%s", (unsigned long)s.st_ino, C_CRIU_NETNS_KEY);
+		argv[argc++] = "--external";
+		argv[argc++] = netns_ext;
+	}
+
+	INFO("Checkpointing %s to %s", container_get_description(criu->container), criu->dir);
+	if (proc_fork_and_execvp(argv) < 0) {
+		ERROR("Checkpoint of %s failed, see %s/dump.log",
+		      container_get_description(criu->container), criu->dir);
+		c_criu_cleanup(criu);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(pid_str);
+	mem_free(netns_ext);
+	return ret;
+}
+
+pid_t
+c_criu_restore(c_criu_t *criu, const char *rootdir, const char *netns_path)
+{
+	ASSERT(criu);
+	ASSERT(rootdir);
+
+	pid_t pid = -1;
+	int netns_fd = -1;
+	char *netns_inherit = NULL;
+	char *pid_file = mem_printf("%s/restore.pid", criu->dir);
+	char *pid_str = NULL;
+
+	IF_FALSE_GOTO_ERROR(c_criu_has_checkpoint(criu), out);
+
+	const char *argv[C_CRIU_MAX_ARGS] = { C_CRIU_BIN,
+					      "restore",
+					      "--images-dir",
+					      criu->dir,
+					      "--log-file",
+					      "restore.log",
+					      "--root",
+					      rootdir,
+					      "--pidfile",
+					      pid_file,
+					      "--restore-detached",
+					      "--restore-sibling",
+					      C_CRIU_COMMON_ARGS };
+	int argc = 0;
+	while (argv[argc])
+		argc++;
+
+	if (netns_path) {
+		// not opened with O_CLOEXEC, criu has to inherit the fd
+		netns_fd = open(netns_path, O_RDONLY);
+		if (netns_fd < 0) {
+			ERROR_ERRNO("Could not open netns %s", netns_path);
+			goto out;
+		}
+		netns_inherit = mem_printf("fd[%d]:%s", netns_fd, C_CRIU_NETNS_KEY);
+		argv[argc++] = "--inherit-fd";
+		argv[argc++] = netns_inherit;
+	}
+
+	INFO("Restoring %s from %s", container_get_description(criu->container), criu->dir);
+	unlink(pid_file);
+	if (proc_fork_and_execvp(argv) < 0) {
+		ERROR("Restore of %s failed, see %s/restore.log",
+		      container_get_description(criu->container), criu->dir);
+		goto out;
+	}
+
+	pid_str = file_read_new(pid_file, 32);
+	if (!pid_str || (pid = strtol(pid_str, NULL, 10)) <= 0) {
+		ERROR("Could not read pid of restored %s", container_get_description(criu->container));
+		pid = -1;
+		goto out;
+	}
+	DEBUG("Restored init of %s has pid %d", container_get_description(criu->container), pid);
+
+	// the processes are running again, thus the checkpoint is outdated
+	c_criu_cleanup(criu);
+out:
+	if (netns_fd >= 0)
+		close(netns_fd);
+	mem_free(netns_inherit);
+	mem_free(pid_file);
+	mem_free(pid_str);
+	return pid;
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file c_criu.h
+ *
+ * Checkpoint/restore of the process tree of a container using CRIU.
+ * A checkpoint dumps all processes of the running container into the criu
+ * directory below its images dir and terminates them, a restore recreates
+ * them from these images. The resources managed by the other c_* modules
+ * (mounted volumes, network namespace, cgroups and user id offset) are kept
+ * while the container is checkpointed and are reattached by the restore, so
+ * the container does not need to boot again.
+ */
+
+#ifndef C_CRIU_H
+#define C_CRIU_H
+
+#include "container.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct c_criu c_criu_t;
+
+c_criu_t *
+c_criu_new(const container_t *container);
+
+void
+c_criu_free(c_criu_t *criu);
+
+/**
+ * Dumps the process tree of the container with the init process pid. If
+ * netns_path is set, the network namespace bound to it is treated as external
+ * and is not part of the checkpoint. The processes are killed by CRIU after a
+ * successful dump.
+ * @return 0 on success, -1 on error
+ */
+int
+c_criu_dump(c_criu_t *criu, pid_t pid, const char *netns_path);
+
+/**
+ * Restores the process tree of the last checkpoint with rootdir as root of its
+ * mount namespace. The network namespace bound to netns_path is passed to CRIU
+ * to be rejoined. The restored init process becomes a child of cmld.
+ * @return the pid of the restored init process or -1 on error
+ */
+pid_t
+c_criu_restore(c_criu_t *criu, const char *rootdir, const char *netns_path);
+
+/**
+ * Checks whether images of a checkpoint are available.
+ */
+bool
+c_criu_has_checkpoint(const c_criu_t *criu);
+
+/**
+ * Removes the images of the last checkpoint.
+ */
+void
+c_criu_cleanup(c_criu_t *criu);
+
+#endif /* C_CRIU_H */
@@ -22,6 +22,9 @@
  */
 
 #define _GNU_SOURCE
+
+#define MEM_TAG "container"
+
 #include "c_fifo.h"
 #include "cmld.h"
 #include "container.h"
@@ -34,18 +37,24 @@
 #include "common/uuid.h"
 #include "common/str.h"
 #include "common/fd.h"
+#include "common/event.h"
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <sys/ioctl.h>
 
 #define FIFO_PATH "/dev/fifos"
 
+#define C_FIFO_SPLICE_SIZE (64 * 1024)
+#define C_FIFO_OPEN_RETRY_INTERVAL 200
+
 struct c_fifo {
 	container_t *container;
 	list_t *fifo_list;
+	list_t *forwards; // c_fifo_forward_t per forwarded FIFO
 };
 
 c_fifo_t *
@@ -141,54 +150,226 @@ error:
 	return -1;
 }
 
+/*
+ * Forwarding of one FIFO from c0 to the container. Both ends are pipes, thus
+ * data is moved by splice() inside the kernel on events of the main loop.
+ */
+typedef struct c_fifo_forward {
+	char *name;
+	char *path_c0;
+	char *path_container;
+	int from_fd;
+	int to_fd;
+	event_io_t *from_io;
+	bool reading; // from_io is registered
+	event_io_t *to_io;
+	event_timer_t *open_timer;
+} c_fifo_forward_t;
+
+static void
+c_fifo_forward_cb_from(int fd, unsigned events, event_io_t *io, void *data);
+
+static void
+c_fifo_forward_set_reading(c_fifo_forward_t *fwd, bool reading)
+{
+	if (fwd->reading == reading)
+		return;
+
+	if (reading)
+		event_add_io(fwd->from_io);
+	else
+		event_remove_io(fwd->from_io);
+	fwd->reading = reading;
+}
+
+static void
+c_fifo_forward_close_to(c_fifo_forward_t *fwd)
+{
+	if (fwd->to_io) {
+		event_remove_io(fwd->to_io);
+		event_io_free(fwd->to_io);
+		fwd->to_io = NULL;
+	}
+	if (fwd->to_fd >= 0) {
+		close(fwd->to_fd);
+		fwd->to_fd = -1;
+	}
+}
+
+static void
+c_fifo_forward_stop(c_fifo_forward_t *fwd)
+{
+	if (fwd->open_timer) {
+		event_remove_timer(fwd->open_timer);
+		event_timer_free(fwd->open_timer);
+		fwd->open_timer = NULL;
+	}
+	if (fwd->from_io) {
+		c_fifo_forward_set_reading(fwd, false);
+		event_io_free(fwd->from_io);
+		fwd->from_io = NULL;
+	}
+	if (fwd->from_fd >= 0) {
+		close(fwd->from_fd);
+		fwd->from_fd = -1;
+	}
+	c_fifo_forward_close_to(fwd);
+}
+
+static void
+c_fifo_forward_free(c_fifo_forward_t *fwd)
+{
+	c_fifo_forward_stop(fwd);
+	mem_free(fwd->name);
+	mem_free(fwd->path_c0);
+	mem_free(fwd->path_container);
+	mem_free(fwd);
+}
+
+/*
+ * (Re-)opens the c0 end. A freshly opened read end does not report a hangup
+ * before a writer has connected, so there is no busy loop while c0's end is closed.
+ */
 static int
-c_fifo_loop(char *fifo_path_c0, char *fifo_path_container)
+c_fifo_forward_open_from(c_fifo_forward_t *fwd)
 {
-	int fromfd = -1, tofd = -1;
+	if (fwd->from_io) {
+		c_fifo_forward_set_reading(fwd, false);
+		event_io_free(fwd->from_io);
+		fwd->from_io = NULL;
+	}
+	if (fwd->from_fd >= 0)
+		close(fwd->from_fd);
 
-	//keep repopening c0 FIFO when closed
-	while (1) {
-		if (fromfd != -1 && close(fromfd)) {
-			TRACE_ERRNO("Failed to close old reading fd");
-		}
+	fwd->from_fd = open(fwd->path_c0, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fwd->from_fd < 0) {
+		ERROR_ERRNO("Failed to open reading end %s", fwd->path_c0);
+		return -1;
+	}
+	TRACE("Opened reading end for %s", fwd->path_c0);
 
-		if (tofd != -1 && close(tofd)) {
-			TRACE_ERRNO("Failed to close old reading fd");
-		}
+	fwd->from_io = event_io_new(fwd->from_fd, EVENT_IO_READ, c_fifo_forward_cb_from, fwd);
+	event_io_set_prio(fwd->from_io, EVENT_PRIO_LOW);
+	c_fifo_forward_set_reading(fwd, true);
+	return 0;
+}
 
-		if (-1 == (fromfd = open(fifo_path_c0, O_RDONLY))) {
-			ERROR_ERRNO("Failed to open fromfd at %s, exiting...", fifo_path_c0);
-			exit(-1);
+static void
+c_fifo_forward_cb_open_timer(event_timer_t *timer, void *data)
+{
+	c_fifo_forward_t *fwd = data;
+
+	fwd->to_fd = open(fwd->path_container, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fwd->to_fd < 0) {
+		if (errno != ENXIO) {
+			ERROR_ERRNO("Failed to open writing end %s, stop forwarding",
+				    fwd->path_container);
+			c_fifo_forward_stop(fwd);
 		}
-		TRACE("Opened reading end for %s", fifo_path_c0);
+		return;
+	}
+	TRACE("Opened writing end for %s", fwd->path_container);
 
-		if (-1 == (tofd = open(fifo_path_container, O_WRONLY))) {
-			ERROR_ERRNO("Failed to open tofd at %s, exiting ...", fifo_path_container);
-			exit(-1);
-		}
-		TRACE("Opened writing end for %s", fifo_path_container);
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	fwd->open_timer = NULL;
 
-		TRACE("Entering readloop with fromfd %d and tofd %d", fromfd, tofd);
+	// forward what has been queued up in the meantime
+	c_fifo_forward_set_reading(fwd, true);
+	c_fifo_forward_cb_from(fwd->from_fd, EVENT_IO_READ, fwd->from_io, fwd);
+}
 
-		int count = 0;
-		char buf[1024];
+/*
+ * Waits for a reader on the container end. The c0 end is not read meanwhile,
+ * thus c0's writers are throttled by the full FIFO.
+ */
+static void
+c_fifo_forward_wait_reader(c_fifo_forward_t *fwd)
+{
+	c_fifo_forward_set_reading(fwd, false);
+	if (!fwd->open_timer) {
+		fwd->open_timer = event_timer_new(C_FIFO_OPEN_RETRY_INTERVAL,
+						  EVENT_TIMER_REPEAT_FOREVER,
+						  c_fifo_forward_cb_open_timer, fwd);
+		event_add_timer(fwd->open_timer);
+	}
+}
 
-		while (1) {
-			if (0 < (count = read(fromfd, &buf, sizeof(buf) - 1))) {
-				TRACE("[READLOOP] Read returned %d, writing to target FIFO", count);
+static void
+c_fifo_forward_cb_to(UNUSED int fd, UNUSED unsigned events, event_io_t *io, void *data)
+{
+	c_fifo_forward_t *fwd = data;
 
-				buf[count] = 0;
-				TRACE("[READLOOP] Read %d bytes from fd: %d: %s", count, fromfd,
-				      buf);
+	// space in the container FIFO again, resume reading from c0
+	event_remove_io(io);
+	event_io_free(io);
+	fwd->to_io = NULL;
 
-				if (count != fd_write(tofd, buf, count)) {
-					ERROR("Could not write all bytes to container FIFO end.");
-					break;
-				}
-			} else {
-				TRACE("[READLOOP] Read returned %d, try to reopen fds", count);
+	c_fifo_forward_set_reading(fwd, true);
+	c_fifo_forward_cb_from(fwd->from_fd, EVENT_IO_READ, fwd->from_io, fwd);
+}
+
+static void
+c_fifo_forward_cb_from(int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	c_fifo_forward_t *fwd = data;
+
+	if (fwd->to_fd < 0) {
+		fwd->to_fd = open(fwd->path_container, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fwd->to_fd < 0) {
+			if (errno != ENXIO) {
+				ERROR_ERRNO("Failed to open writing end %s, stop forwarding",
+					    fwd->path_container);
+				c_fifo_forward_stop(fwd);
+				return;
 			}
+			TRACE("No reader on %s yet", fwd->path_container);
+			c_fifo_forward_wait_reader(fwd);
+			return;
 		}
+		TRACE("Opened writing end for %s", fwd->path_container);
+	}
+
+	while (1) {
+		ssize_t count = splice(fd, NULL, fwd->to_fd, NULL, C_FIFO_SPLICE_SIZE,
+				       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (count > 0) {
+			TRACE("Forwarded %zd bytes of FIFO %s", count, fwd->name);
+			continue;
+		}
+
+		if (count == 0) {
+			// all writers in c0 are gone, pass EOF on to the container's reader
+			DEBUG("EOF on FIFO %s in c0, reopening", fwd->name);
+			c_fifo_forward_close_to(fwd);
+			if (c_fifo_forward_open_from(fwd) < 0)
+				c_fifo_forward_stop(fwd);
+			return;
+		}
+
+		if (errno == EAGAIN) {
+			int pending = 0;
+			if (ioctl(fd, FIONREAD, &pending) == 0 && pending > 0) {
+				// container FIFO is full, wait until its reader caught up
+				c_fifo_forward_set_reading(fwd, false);
+				fwd->to_io = event_io_new(fwd->to_fd, EVENT_IO_WRITE,
+							  c_fifo_forward_cb_to, fwd);
+				event_add_io(fwd->to_io);
+			}
+			return;
+		}
+
+		if (errno == EPIPE) {
+			// reader in container is gone, keep data in c0 until the next one shows up
+			DEBUG("Reader of FIFO %s in container is gone", fwd->name);
+			c_fifo_forward_close_to(fwd);
+			c_fifo_forward_wait_reader(fwd);
+			return;
+		}
+
+		ERROR_ERRNO("Failed to forward FIFO %s, stop forwarding", fwd->name);
+		c_fifo_forward_stop(fwd);
+		return;
 	}
 }
 
@@ -214,35 +395,29 @@ c_fifo_start_post_clone(c_fifo_t *fifo)
 			return -1;
 		}
 
-		//fork FIFO forwarding child
 		for (list_t *elem = fifo->fifo_list; elem != NULL; elem = elem->next) {
 			char *current_fifo = elem->data;
 
-			int pid = fork();
-
-			if (-1 == pid) {
-				ERROR("Failed to clone forwarding child");
-				return -1;
-			} else if (pid == 0) {
-				DEBUG("Preparing forwarding for FIFO \'%s\'", current_fifo);
-
-				char *fifo_path_c0 = mem_printf("/tmp/%s/%s/%s",
-								uuid_string(container_get_uuid(c0)),
-								FIFO_PATH, current_fifo);
-				char *fifo_path_container =
-					mem_printf("/tmp/%s/%s/%s",
-						   uuid_string(container_get_uuid(fifo->container)),
-						   FIFO_PATH, current_fifo);
+			DEBUG("Preparing forwarding for FIFO \'%s\'", current_fifo);
 
-				DEBUG("Forwarding from %s to %s", fifo_path_c0,
-				      fifo_path_container);
+			c_fifo_forward_t *fwd = mem_new0(c_fifo_forward_t, 1);
+			fwd->name = mem_strdup(current_fifo);
+			fwd->path_c0 = mem_printf("/tmp/%s/%s/%s", uuid_string(container_get_uuid(c0)),
+						  FIFO_PATH, current_fifo);
+			fwd->path_container =
+				mem_printf("/tmp/%s/%s/%s",
+					   uuid_string(container_get_uuid(fifo->container)),
+					   FIFO_PATH, current_fifo);
+			fwd->from_fd = -1;
+			fwd->to_fd = -1;
+			fifo->forwards = list_append(fifo->forwards, fwd);
 
-				c_fifo_loop(fifo_path_c0, fifo_path_container);
+			DEBUG("Forwarding from %s to %s", fwd->path_c0, fwd->path_container);
 
-				exit(EXIT_FAILURE);
+			if (c_fifo_forward_open_from(fwd) < 0) {
+				ERROR("Failed to set up forwarding for FIFO %s", current_fifo);
+				return -1;
 			}
-
-			DEBUG("Forked FIFO forwarding child %d for %s", pid, current_fifo);
 		}
 
 	} else {
@@ -252,3 +427,28 @@ c_fifo_start_post_clone(c_fifo_t *fifo)
 
 	return 0;
 }
+
+void
+c_fifo_cleanup(c_fifo_t *fifo)
+{
+	ASSERT(fifo);
+
+	for (list_t *l = fifo->forwards; l; l = l->next)
+		c_fifo_forward_free(l->data);
+	list_delete(fifo->forwards);
+	fifo->forwards = NULL;
+}
+
+void
+c_fifo_free(c_fifo_t *fifo)
+{
+	ASSERT(fifo);
+
+	c_fifo_cleanup(fifo);
+
+	for (list_t *l = fifo->fifo_list; l; l = l->next)
+		mem_free(l->data);
+	list_delete(fifo->fifo_list);
+
+	mem_free(fifo);
+}
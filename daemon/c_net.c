@@ -23,6 +23,8 @@
 
 #define _GNU_SOURCE
 
+#define MEM_TAG "container"
+
 #include "c_net.h"
 
 #include <sched.h>
@@ -30,16 +32,21 @@
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 
 #include "common/macro.h"
 #include "common/mem.h"
+#include "common/bitmap.h"
 #include "common/sock.h"
 #include "common/list.h"
 #include "common/nl.h"
@@ -54,6 +61,8 @@
 #include "cmld.h"
 #include "hardware.h"
 #include "uevent.h"
+#include "dhcpd.h"
+#include "dnsd.h"
 
 /* Offset for ipv4/mac address allocation, e.g. 127.1.(IPV4_SUBNET_OFFS+x).2
  * Defines the start value for address allocation */
@@ -66,30 +75,50 @@
 /* Path to search for net devices */
 #define SYS_NET_PATH "/sys/class/net"
 
+/* Receive buffer for link dumps and notifications */
+#define C_NET_LINKS_BUF_SIZE 32768
+
 /* ipv4 addresses for cmld and cont endpoints, where the subnet depends on the container */
 #ifdef USE_LOCALNET_ROUTING
 #define IPV4_CMLD_ADDRESS "127.1.%d.1"
 #define IPV4_CONT_ADDRESS "127.1.%d.2"
-#define IPV4_DHCP_RANGE_START "127.1.%d.50"
-#define IPV4_DHCP_RANGE_END "127.1.%d.61"
 #else
 #define IPV4_CMLD_ADDRESS "172.23.%d.1"
 #define IPV4_CONT_ADDRESS "172.23.%d.2"
-#define IPV4_DHCP_RANGE_START "172.23.%d.2"
-#define IPV4_DHCP_RANGE_END "172.23.%d.12"
-#define IPV4_DHCP_MASK "255.255.255.0"
 #endif
 
+/* ipv4 addresses on shared bridges, where the subnet depends on the bridge */
+#ifdef USE_LOCALNET_ROUTING
+#define IPV4_BRIDGE_ADDRESS "127.2.%d.%d"
+#else
+#define IPV4_BRIDGE_ADDRESS "172.24.%d.%d"
+#endif
+
+/* Name of a shared bridge in c0, which depends on its index */
+#define C_NET_BRIDGE_NAME "cbr_%d"
+
+/* Number of dynamic dhcp leases following the container address of a veth */
+#define IPV4_DHCP_POOL_SIZE 10
+
 // uplink interface for cmld inside of routing container (c0)
 #define CML_UPLINK_INTERFACE_NAME "cml"
 
 /* Network prefix */
 #define IPV4_PREFIX 24
 
+/* Shared bridge of veths, see container_vnet_cfg_t */
+typedef struct c_net_bridge {
+	char *name;   //!< configured name of the bridge
+	char *ifname; //!< name of the bridge interface in c0
+	int index;    //!< index of the bridge, which determines its subnet
+	int refs;     //!< number of veths attached to the bridge
+} c_net_bridge_t;
+
 /* Network interface structure with interface specific settings */
 typedef struct {
 	char *nw_name;		       //!< Name of the network device
 	bool configure;		       // do ip/routing configuration
+	bool fastpath;		       // offload forwarded connections to a flowtable
 	char *veth_cmld_name;	       //!< associated veth name in root ns
 	char *veth_cont_name;	       //!< veth name in the container's ns
 	char *subnet;		       //!< string with subnet (x.x.x.x/y)
@@ -97,8 +126,15 @@ typedef struct {
 	struct in_addr ipv4_cont_addr; //!< ipv4 address of container
 	struct in_addr ipv4_bc_addr;   //!< ipv4 bcaddr of container/cmld subnet
 	int cont_offset;	       //!< gives information about the adresses to be set
+	int offset_reserved;	       //!< offset kept for the interface in the container store
 	uint8_t veth_mac[6];	       // generated or configured mac of nic in	container
-	pid_t dhcpd_pid;	       // pid of corresponding dhcpd if running for this ni
+	dhcpd_iface_t *dhcpd;	       // dhcp server of the rootns endpoint if running
+	dnsd_iface_t *dnsd;	       // dns forwarder of the rootns endpoint if running
+	container_vnet_type_t type;    // veth pair or direct attachment to parent
+	char *parent;		       // parent interface or physical function of a vf
+	int vf;			       // index of the virtual function
+	char *bridge_name;	       // configured shared bridge of the veth
+	c_net_bridge_t *bridge;	       // shared bridge the veth is attached to while running
 } c_net_interface_t;
 
 /* Network structure with specific network settings */
@@ -109,52 +145,371 @@ struct c_net {
 	list_t *interface_mv_name_list; //!< contains list of iff names to be moved into the container
 	char *ns_path;			//!< path for binding netns into filesystem
 	int fd_netns;			//!< fd to keep netns active during reboots
+	bool adopted;			//!< the netns of a zygote is used for the current start
 };
 
 /**
- * bool array, which globally holds assigend offsets in order to
+ * Bitmaps, which globally hold assigned offsets in order to
  * determine a new offset for a starting container.
- * address_offsets[i]==true means that a container holds this offset to get its specific ip address
+ * A set bit i in address_offsets means that a container holds this offset to get its
+ * specific ip address. A set bit i in address_offsets_reserved means that a container
+ * stored this offset in the container store, thus other containers avoid it and the
+ * container gets the same subnet on its next start.
+ */
+static bitmap_t *address_offsets = NULL;
+static bitmap_t *address_offsets_reserved = NULL;
+
+/* Shared bridges with attached veths of running containers */
+static list_t *c_net_bridges = NULL;
+
+/**
+ * In-memory table of the network interfaces of the root netns. It is filled
+ * by an RTM_GETLINK dump and kept up to date from RTNLGRP_LINK notifications,
+ * so that veth names can be checked without scanning sysfs.
+ */
+typedef struct c_net_link {
+	int index;
+	char name[IFNAMSIZ];
+} c_net_link_t;
+
+static list_t *c_net_links = NULL;
+static nl_sock_t *c_net_links_sock = NULL;
+static event_io_t *c_net_links_io = NULL;
+static pid_t c_net_links_pid = -1;
+
+/**
+ * Bitmaps of the offsets of existing veth interfaces, i.e. "r_<offset>" and
+ * "c_<offset>" links in the root netns.
+ */
+static bitmap_t *veth_offsets[2] = { NULL, NULL };
+
+static void
+c_net_offsets_init(void)
+{
+	if (address_offsets)
+		return;
+
+	address_offsets = bitmap_new(MAX_NUM_DEVICES);
+	address_offsets_reserved = bitmap_new(MAX_NUM_DEVICES);
+	veth_offsets[0] = bitmap_new(MAX_NUM_DEVICES);
+	veth_offsets[1] = bitmap_new(MAX_NUM_DEVICES);
+}
+
+/**
+ * Marks the offset of a veth interface named "r_<offset>" or "c_<offset>"
+ * as present or absent. Other names are ignored.
+ */
+static void
+c_net_links_mark_veth(const char *name, bool present)
+{
+	if ((name[0] != 'r' && name[0] != 'c') || name[1] != '_' || !isdigit(name[2]))
+		return;
+
+	char *end;
+	long offset = strtol(name + 2, &end, 10);
+	if (*end || offset >= MAX_NUM_DEVICES)
+		return;
+
+	c_net_offsets_init();
+	bitmap_t *map = veth_offsets[name[0] == 'r' ? 0 : 1];
+	if (present)
+		bitmap_set(map, offset);
+	else
+		bitmap_clear(map, offset);
+}
+
+static c_net_link_t *
+c_net_links_get_by_index(int index)
+{
+	for (list_t *l = c_net_links; l; l = l->next) {
+		c_net_link_t *link = l->data;
+		if (link->index == index)
+			return link;
+	}
+	return NULL;
+}
+
+static void
+c_net_links_clear(void)
+{
+	for (list_t *l = c_net_links; l; l = l->next)
+		mem_free(l->data);
+	list_delete(c_net_links);
+	c_net_links = NULL;
+	c_net_offsets_init();
+	bitmap_clear_all(veth_offsets[0]);
+	bitmap_clear_all(veth_offsets[1]);
+}
+
+/**
+ * Applies the RTM_NEWLINK/RTM_DELLINK messages in buf to the link table.
+ * @return 1 if the end of a dump was reached, 0 otherwise
+ */
+static int
+c_net_links_update(char *buf, int len)
+{
+	for (struct nlmsghdr *msg = (struct nlmsghdr *)buf; NLMSG_OK(msg, (unsigned int)len);
+	     msg = NLMSG_NEXT(msg, len)) {
+		if (msg->nlmsg_type == NLMSG_DONE)
+			return 1;
+		if (msg->nlmsg_type != RTM_NEWLINK && msg->nlmsg_type != RTM_DELLINK)
+			continue;
+
+		struct ifinfomsg *ifi = NLMSG_DATA(msg);
+		const char *name = NULL;
+		int attr_len = IFLA_PAYLOAD(msg);
+		for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attr_len);
+		     rta = RTA_NEXT(rta, attr_len)) {
+			if (rta->rta_type == IFLA_IFNAME)
+				name = RTA_DATA(rta);
+		}
+
+		c_net_link_t *link = c_net_links_get_by_index(ifi->ifi_index);
+		if (link) {
+			c_net_links_mark_veth(link->name, false);
+			if (msg->nlmsg_type == RTM_DELLINK) {
+				TRACE("Link %s (%d) removed", link->name, link->index);
+				c_net_links = list_remove(c_net_links, link);
+				mem_free(link);
+				continue;
+			}
+		} else if (msg->nlmsg_type == RTM_NEWLINK) {
+			link = mem_new0(c_net_link_t, 1);
+			link->index = ifi->ifi_index;
+			c_net_links = list_append(c_net_links, link);
+		} else {
+			continue;
+		}
+
+		if (name)
+			strncpy(link->name, name, IFNAMSIZ - 1);
+		c_net_links_mark_veth(link->name, true);
+		TRACE("Link %s (%d) present", link->name, link->index);
+	}
+	return 0;
+}
+
+/**
+ * Rebuilds the link table from an RTM_GETLINK dump.
  */
-static bool *address_offsets = NULL;
+static int
+c_net_links_dump(void)
+{
+	nl_sock_t *nl_sock = NULL;
+	nl_msg_t *req = NULL;
+	char *buf = NULL;
+	int ret = -1;
+
+	nl_sock = nl_sock_routing_new();
+	IF_NULL_RETVAL_ERROR(nl_sock, -1);
+
+	req = nl_msg_new();
+	IF_NULL_GOTO_ERROR(req, out);
+
+	struct ifinfomsg link_req = { .ifi_family = AF_UNSPEC };
+
+	IF_TRUE_GOTO_ERROR(nl_msg_set_type(req, RTM_GETLINK), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_flags(req, NLM_F_REQUEST | NLM_F_DUMP), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_set_link_req(req, &link_req), out);
+	IF_TRUE_GOTO_ERROR(nl_msg_send_kernel(nl_sock, req) < 0, out);
+
+	c_net_links_clear();
+
+	buf = mem_alloc(C_NET_LINKS_BUF_SIZE);
+	for (;;) {
+		int len = nl_msg_receive_kernel(nl_sock, buf, C_NET_LINKS_BUF_SIZE, false);
+		IF_TRUE_GOTO_ERROR(len < 0, out);
+		if (c_net_links_update(buf, len))
+			break;
+	}
+	DEBUG("Found %d network interfaces", list_length(c_net_links));
+	ret = 0;
+out:
+	mem_free(buf);
+	nl_msg_free(req);
+	nl_sock_free(nl_sock);
+	return ret;
+}
 
 /**
- * sets the offset at the specified position to false.
+ * Applies all queued link notifications. Since the kernel queues them
+ * while handling a request, the table is accurate afterwards.
+ */
+static void
+c_net_links_sync(void)
+{
+	char *buf = mem_alloc(C_NET_LINKS_BUF_SIZE);
+
+	for (;;) {
+		int len = nl_msg_receive_kernel(c_net_links_sock, buf, C_NET_LINKS_BUF_SIZE, false);
+		if (len >= 0) {
+			c_net_links_update(buf, len);
+		} else if (errno == ENOBUFS) {
+			WARN("Missed link notifications, dumping links again");
+			c_net_links_dump();
+		} else if (errno != EIO) {
+			// EAGAIN, all notifications are processed
+			break;
+		}
+	}
+	mem_free(buf);
+}
+
+static void
+c_net_links_io_cb(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io,
+		  UNUSED void *data)
+{
+	c_net_links_sync();
+}
+
+/**
+ * Subscribes to link notifications and does the initial dump of the link table.
+ * The table is only maintained by the process, which created it.
+ */
+static int
+c_net_links_init(void)
+{
+	if (c_net_links_sock)
+		return c_net_links_pid == getpid() ? 0 : -1;
+
+	c_net_links_sock = nl_sock_routing_new();
+	IF_NULL_RETVAL_ERROR(c_net_links_sock, -1);
+
+	int fd = nl_sock_get_fd(c_net_links_sock);
+	int group = RTNLGRP_LINK;
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0 ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		ERROR_ERRNO("Could not subscribe to link notifications");
+		goto err;
+	}
+
+	// subscribed before the dump, thus changes in between are applied afterwards
+	IF_TRUE_GOTO(c_net_links_dump(), err);
+
+	c_net_links_io = event_io_new(fd, EVENT_IO_READ, c_net_links_io_cb, NULL);
+	event_add_io(c_net_links_io);
+	c_net_links_pid = getpid();
+
+	return 0;
+err:
+	nl_sock_free(c_net_links_sock);
+	c_net_links_sock = NULL;
+	return -1;
+}
+
+/**
+ * sets the offset at the specified position to free.
  * indicates that a container releases its addresses.
  */
 static void
 c_net_unset_offset(int offset)
 {
-	ASSERT(offset >= 0 && offset < MAX_NUM_DEVICES);
+	IF_TRUE_RETURN(offset < 0);
+	ASSERT(offset < MAX_NUM_DEVICES);
 	TRACE("Offset %d released by a container", offset);
 
-	address_offsets[offset] = false;
+	bitmap_clear(address_offsets, offset);
 }
 
 /**
- * determines first free slot and occupies it. Also responsible for allocating the offsets array.
+ * determines first free slot and occupies it. The reserved offset of the
+ * interface is preferred, offsets reserved by other containers are only taken
+ * if all other offsets are in use. Offsets whose veth names are still taken by
+ * existing interfaces are skipped.
  * @return failure, return -1, else return first free offset
  */
 static int
-c_net_set_next_offset(void)
+c_net_set_next_offset(int reserved)
 {
-	if (!address_offsets) {
-		address_offsets = mem_new0(bool, MAX_NUM_DEVICES);
-		address_offsets[0] = true;
-		TRACE("Offset 0 ocupied by a container");
-		return 0;
+	c_net_offsets_init();
+	if (!c_net_links_init())
+		c_net_links_sync();
+
+	const bitmap_t *const taken[] = { address_offsets, veth_offsets[0], veth_offsets[1],
+					  address_offsets_reserved };
+	ssize_t i = -1;
+	if (reserved >= 0 && !bitmap_test(address_offsets, reserved) &&
+	    !bitmap_test(veth_offsets[0], reserved) && !bitmap_test(veth_offsets[1], reserved))
+		i = reserved;
+	if (i < 0)
+		i = bitmap_find_zero(ELEMENTSOF(taken), taken);
+	if (i < 0)
+		i = bitmap_find_zero(ELEMENTSOF(taken) - 1, taken);
+	if (i < 0) {
+		DEBUG("Unable to provide a valid ip address for c_net");
+		return -1;
 	}
 
-	for (int i = 0; i < MAX_NUM_DEVICES; i++) {
-		if (!address_offsets[i]) {
-			TRACE("Offset %d occupied by a container", i);
-			address_offsets[i] = true;
-			return i;
-		}
+	TRACE("Offset %zd occupied by a container", i);
+	bitmap_set(address_offsets, i);
+	return i;
+}
+
+/**
+ * Reserves offset for the interface, replacing its former reservation,
+ * unless the offset is reserved by another interface.
+ * @return true if the reservation of the interface changed
+ */
+static bool
+c_net_reserve_offset(c_net_interface_t *ni, int offset)
+{
+	IF_TRUE_RETVAL(offset == ni->offset_reserved, false);
+
+	c_net_offsets_init();
+	if (offset >= 0 && bitmap_test(address_offsets_reserved, offset)) {
+		DEBUG("Offset %d is reserved by another container", offset);
+		return false;
 	}
 
-	DEBUG("Unable to provide a valid ip address for c_net");
-	return -1;
+	if (ni->offset_reserved >= 0)
+		bitmap_clear(address_offsets_reserved, ni->offset_reserved);
+	if (offset >= 0)
+		bitmap_set(address_offsets_reserved, offset);
+	ni->offset_reserved = offset;
+	return true;
+}
+
+/**
+ * Restores the reservations of the interfaces from the container store, which
+ * holds the offsets in the order of the interface list.
+ */
+static void
+c_net_read_offsets(c_net_t *net)
+{
+	char *file_name = mem_printf("%s.net", container_get_images_dir(net->container));
+	int offsets[MAX_NUM_DEVICES];
+	int len = -1;
+
+	if (file_exists(file_name))
+		len = file_read(file_name, (char *)offsets, sizeof(offsets));
+	mem_free(file_name);
+	IF_TRUE_RETURN(len <= 0);
+
+	size_t i = 0;
+	for (list_t *l = net->interface_list; l && i < len / sizeof(int); l = l->next) {
+		int offset = offsets[i++];
+		if (offset >= 0 && offset < MAX_NUM_DEVICES)
+			c_net_reserve_offset(l->data, offset);
+	}
+}
+
+/**
+ * Stores the reserved offsets of the interfaces in the container store.
+ */
+static void
+c_net_write_offsets(const c_net_t *net)
+{
+	char *file_name = mem_printf("%s.net", container_get_images_dir(net->container));
+	int offsets[MAX_NUM_DEVICES];
+	size_t n = 0;
+
+	for (list_t *l = net->interface_list; l && n < ELEMENTSOF(offsets); l = l->next)
+		offsets[n++] = ((c_net_interface_t *)l->data)->offset_reserved;
+
+	if (file_write(file_name, (char *)offsets, n * sizeof(int)) < 0)
+		WARN("Failed to store network offsets for container %s",
+		     container_get_description(net->container));
+	mem_free(file_name);
 }
 
 /**
@@ -231,13 +586,8 @@ c_net_get_next_ipv4_cont_addr(int offset, struct in_addr *ipv4_addr)
 	return 0;
 }
 
-/**
- * This function checks if the specified veth name is free.
- * In case it is free, 0 is returned, if it's blocked 1
- * In case of failure, the function returns -1
- */
 static int
-c_net_is_veth_used(const char *if_name)
+c_net_is_veth_used_sysfs(const char *if_name)
 {
 	ASSERT(if_name);
 
@@ -272,6 +622,34 @@ c_net_is_veth_used(const char *if_name)
 	return 0;
 }
 
+/**
+ * This function checks if the specified veth name is free.
+ * In case it is free, 0 is returned, if it's blocked 1
+ * In case of failure, the function returns -1
+ */
+static int
+c_net_is_veth_used(const char *if_name)
+{
+	ASSERT(if_name);
+
+	// e.g. helper children in the netns of c0 must not consume the notifications
+	if (c_net_links_init())
+		return c_net_is_veth_used_sysfs(if_name);
+
+	c_net_links_sync();
+
+	for (list_t *l = c_net_links; l; l = l->next) {
+		c_net_link_t *link = l->data;
+		if (!strncmp(link->name, if_name, IFNAMSIZ)) {
+			DEBUG("veth %s is occupied", if_name);
+			return 1;
+		}
+	}
+
+	DEBUG("veth %s is free", if_name);
+	return 0;
+}
+
 /**
  * This function moves the network interface to the corresponding namespace,
  * specified by the pid (from root namespace to container namespace).
@@ -399,17 +777,16 @@ msg_err:
 }
 
 /**
- * This function sets an ipv4 address (and the broadcast addr) for a given veth
- * with a netlink message using the netlink socket.
+ * This function creates the netlink message which sets an ipv4 address (and the
+ * broadcast addr) for a given veth. The interface is referenced by its current index.
  * We use this in the root namespace and in the container's namespace.
  */
-static int
-c_net_set_ipv4(const char *ifi_name, const struct in_addr *ipv4_addr,
-	       const struct in_addr *ipv4_bcaddr)
+static nl_msg_t *
+c_net_ipv4_msg_new(const char *ifi_name, const struct in_addr *ipv4_addr,
+		   const struct in_addr *ipv4_bcaddr)
 {
 	ASSERT(ifi_name);
 
-	nl_sock_t *nl_sock = NULL;
 	unsigned int ifi_index;
 	nl_msg_t *req = NULL;
 
@@ -418,20 +795,13 @@ c_net_set_ipv4(const char *ifi_name, const struct in_addr *ipv4_addr,
 	/* Get the interface index of the interface name */
 	if (!(ifi_index = if_nametoindex(ifi_name))) {
 		ERROR("veth interface name could not be resolved");
-		return -1;
-	}
-
-	/* Open netlink socket */
-	if (!(nl_sock = nl_sock_routing_new())) {
-		ERROR("failed to allocate netlink socket");
-		return -1;
+		return NULL;
 	}
 
 	/* Create netlink message */
 	if (!(req = nl_msg_new())) {
 		ERROR("failed to allocate netlink message");
-		nl_sock_free(nl_sock);
-		return -1;
+		return NULL;
 	}
 
 	/* Prepare the request message */
@@ -465,20 +835,111 @@ c_net_set_ipv4(const char *ifi_name, const struct in_addr *ipv4_addr,
 	if (nl_msg_add_buffer(req, IFA_BROADCAST, (void *)ipv4_bcaddr, sizeof(struct in_addr)))
 		goto msg_err;
 
-	/* Send request message and wait for the response message */
-	if (nl_msg_send_kernel_verify(nl_sock, req))
-		goto msg_err;
+	return req;
 
+msg_err:
+	ERROR("failed to create netlink message");
 	nl_msg_free(req);
-	nl_sock_free(nl_sock);
+	return NULL;
+}
 
-	return 0;
+/**
+ * Appends req to the batch reqs. If req is NULL, i.e. its creation failed,
+ * the whole batch is freed and NULL is returned.
+ */
+static list_t *
+c_net_batch_append(list_t *reqs, nl_msg_t *req)
+{
+	if (!req) {
+		for (list_t *l = reqs; l; l = l->next)
+			nl_msg_free(l->data);
+		list_delete(reqs);
+		return NULL;
+	}
+	return list_append(reqs, req);
+}
 
-msg_err:
-	ERROR("failed to create/send netlink message");
-	nl_msg_free(req);
-	nl_sock_free(nl_sock);
-	return -1;
+/**
+ * Appends the requests which set the ipv4 address of the interface and bring it up
+ * to the batch reqs. Returns NULL, with the batch freed, on error.
+ */
+static list_t *
+c_net_batch_append_ipv4_up(list_t *reqs, const char *ifi_name, const struct in_addr *ipv4_addr,
+			   const struct in_addr *ipv4_bcaddr)
+{
+	reqs = c_net_batch_append(reqs, c_net_ipv4_msg_new(ifi_name, ipv4_addr, ipv4_bcaddr));
+	IF_NULL_RETVAL(reqs, NULL);
+
+	return c_net_batch_append(reqs, network_set_flag_msg_new(ifi_name, IFF_UP));
+}
+
+static c_net_bridge_t *
+c_net_bridge_get_by_index(int index)
+{
+	for (list_t *l = c_net_bridges; l; l = l->next) {
+		c_net_bridge_t *br = l->data;
+		if (br->index == index)
+			return br;
+	}
+	return NULL;
+}
+
+/**
+ * Takes a reference of the shared bridge name. A new bridge gets the given
+ * index, e.g. of a running bridge which is adopted, or the lowest free index
+ * if index is negative.
+ * @return the bridge or NULL if the index is invalid or taken
+ */
+static c_net_bridge_t *
+c_net_bridge_get(const char *name, int index)
+{
+	ASSERT(name);
+
+	for (list_t *l = c_net_bridges; l; l = l->next) {
+		c_net_bridge_t *br = l->data;
+		if (strcmp(br->name, name))
+			continue;
+		if (index >= 0 && index != br->index) {
+			ERROR("Bridge %s is %s, not " C_NET_BRIDGE_NAME, name, br->ifname, index);
+			return NULL;
+		}
+		br->refs++;
+		return br;
+	}
+
+	if (index < 0)
+		while (c_net_bridge_get_by_index(++index))
+			;
+	if (index >= MAX_NUM_DEVICES || c_net_bridge_get_by_index(index)) {
+		ERROR("No subnet left for bridge %s", name);
+		return NULL;
+	}
+
+	c_net_bridge_t *br = mem_new0(c_net_bridge_t, 1);
+	br->name = mem_strdup(name);
+	br->ifname = mem_printf(C_NET_BRIDGE_NAME, index);
+	br->index = index;
+	br->refs = 1;
+	c_net_bridges = list_append(c_net_bridges, br);
+
+	DEBUG("Bridge %s is %s", br->name, br->ifname);
+	return br;
+}
+
+/**
+ * Releases a reference of the shared bridge, the last one frees it. The
+ * bridge interface itself is removed by the helper in c0's netns.
+ */
+static void
+c_net_bridge_put(c_net_bridge_t *br)
+{
+	IF_NULL_RETURN(br);
+	IF_TRUE_RETURN(--br->refs > 0);
+
+	c_net_bridges = list_remove(c_net_bridges, br);
+	mem_free(br->name);
+	mem_free(br->ifname);
+	mem_free(br);
 }
 
 static c_net_interface_t *
@@ -490,7 +951,8 @@ c_net_interface_new(const char *if_name, uint8_t if_mac[6], bool configure)
 	ni->nw_name = mem_printf("%s", if_name);
 	memcpy(ni->veth_mac, if_mac, 6);
 	ni->configure = configure;
-	ni->dhcpd_pid = -1;
+	ni->cont_offset = -1;
+	ni->offset_reserved = -1;
 
 	return ni;
 }
@@ -535,6 +997,30 @@ c_net_new(container_t *container, bool net_ns, list_t *vnet_cfg_list, list_t *nw
 		c_net_interface_t *ni =
 			c_net_interface_new(cfg->vnet_name, cfg->vnet_mac, cfg->configure);
 		ASSERT(ni);
+		ni->fastpath = cfg->fastpath;
+		ni->type = cfg->type;
+		ni->parent = cfg->parent ? mem_strdup(cfg->parent) : NULL;
+		ni->vf = cfg->vf;
+		if (ni->type != CONTAINER_VNET_VETH && ni->configure) {
+			INFO("Leaving configuration of directly attached %s to the container",
+			     ni->nw_name);
+			ni->configure = false;
+		}
+		if (cfg->bridge && (ni->type != CONTAINER_VNET_VETH || !ni->configure)) {
+			WARN("Only configured veths are attached to bridges, ignoring bridge of %s",
+			     ni->nw_name);
+		} else if (cfg->bridge) {
+			ni->bridge_name = mem_strdup(cfg->bridge);
+			// forwarded connections leave through the bridge, not the veth
+			ni->fastpath = false;
+		}
+		// keep the vf away from the physical interfaces which are handed to c0
+		if (ni->type == CONTAINER_VNET_SRIOV_VF) {
+			char *vf_name = network_get_vf_ifname_new(ni->parent, ni->vf);
+			if (vf_name && cmld_netif_phys_remove_by_name(vf_name))
+				DEBUG("Reserved vf %s for %s", vf_name, ni->nw_name);
+			mem_free(vf_name);
+		}
 		net->interface_list = list_append(net->interface_list, ni);
 
 		TRACE("new c_net_interface_t struct %s was allocated", ni->nw_name);
@@ -573,98 +1059,205 @@ c_net_new(container_t *container, bool net_ns, list_t *vnet_cfg_list, list_t *nw
 	dir_mkdir_p("/var/run/netns", 00755);
 	net->ns_path = mem_printf("/var/run/netns/%s", uuid_string(container_get_uuid(container)));
 
+	// keep the stored subnets for the container, even if it is not running
+	c_net_read_offsets(net);
+
 	TRACE("new c_net struct was allocated");
 
 	return net;
 }
 
-void
-c_net_udhcpd_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
-{
-	c_net_interface_t *ni = data;
-	pid_t pid;
-	int status = 0;
-
-	DEBUG("dhcpd SIGCHLD handler called for PID %d", ni->dhcpd_pid);
-	if ((pid = waitpid(ni->dhcpd_pid, &status, WNOHANG)) > 0) {
-		TRACE("Reaped dhcpd process: %d", pid);
-		/* remove the sigchld callback for this container from the event loop */
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		ni->dhcpd_pid = -1;
-	} else {
-		TRACE("Failed to reap dhcpd process");
-	}
+static void
+c_net_dhcpd_stop(c_net_interface_t *ni)
+{
+	ASSERT(ni);
+	dhcpd_iface_free(ni->dhcpd);
+	ni->dhcpd = NULL;
+}
+
+/**
+ * Serves DHCP on the rootns endpoint of the veth, which has been moved to the
+ * network namespace of netns_fd (-1 for the namespace of cmld). The container
+ * endpoint keeps its address by a static lease, other clients get addresses
+ * from the pool following it.
+ */
+static int
+c_net_dhcpd_start(c_net_interface_t *ni, int netns_fd)
+{
+	ASSERT(ni);
+
+	// if running stop dhcpd for this ni
+	c_net_dhcpd_stop(ni);
+
+	struct in_addr pool_start = { .s_addr = htonl(ntohl(ni->ipv4_cont_addr.s_addr) + 1) };
+	ni->dhcpd = dhcpd_iface_new(ni->veth_cmld_name, netns_fd, &ni->ipv4_cmld_addr,
+				    IPV4_PREFIX, &pool_start, IPV4_DHCP_POOL_SIZE, ni->veth_mac,
+				    &ni->ipv4_cont_addr);
+
+	return ni->dhcpd ? 0 : -1;
 }
 
 static void
-c_net_udhcpd_stop(c_net_interface_t *ni)
+c_net_dnsd_stop(c_net_interface_t *ni)
 {
 	ASSERT(ni);
-	if (ni->dhcpd_pid > 0) {
-		DEBUG("Stopping dhcpd process with pid=%d!", ni->dhcpd_pid);
-		kill(ni->dhcpd_pid, SIGTERM);
+	dnsd_iface_free(ni->dnsd);
+	ni->dnsd = NULL;
+}
+
+/**
+ * Serves the container as caching forwarder to its configured dns server on the
+ * rootns endpoint of the veth, which has been moved to the network namespace of
+ * netns_fd (-1 for the namespace of cmld).
+ */
+static int
+c_net_dnsd_start(c_net_interface_t *ni, int netns_fd, const char *dns_server)
+{
+	ASSERT(ni);
+
+	c_net_dnsd_stop(ni);
+
+	struct in_addr upstream;
+	IF_TRUE_RETVAL(!dns_server || !inet_aton(dns_server, &upstream), -1);
+
+	ni->dnsd = dnsd_iface_new(ni->veth_cmld_name, netns_fd, &ni->ipv4_cmld_addr, &upstream);
+
+	return ni->dnsd ? 0 : -1;
+}
+
+/**
+ * Starts the dhcp server and the dns forwarder for all configured veths of net,
+ * whose rootns endpoints are in the network namespace of netns_pid, or in the
+ * namespace of cmld if 0.
+ */
+static void
+c_net_services_start_all(c_net_t *net, pid_t netns_pid)
+{
+	int netns_fd = -1;
+
+	if (netns_pid > 0) {
+		char *netns = mem_printf("/proc/%d/ns/net", netns_pid);
+		netns_fd = open(netns, O_RDONLY | O_CLOEXEC);
+		mem_free(netns);
+		if (netns_fd == -1) {
+			WARN_ERRNO("Could not open netns of pid %d for dhcp", netns_pid);
+			return;
+		}
+	}
+
+	for (list_t *l = net->interface_list; l; l = l->next) {
+		c_net_interface_t *ni = l->data;
+		// addresses on a shared bridge are static
+		if (!ni->configure || ni->bridge_name ||
+		    !strcmp(ni->nw_name, CML_UPLINK_INTERFACE_NAME))
+			continue;
+		if (c_net_dhcpd_start(ni, netns_fd))
+			WARN("Could not start dhcp server for %s", ni->veth_cmld_name);
+		if (c_net_dnsd_start(ni, netns_fd, container_get_dns_server(net->container)))
+			WARN("Could not start dns forwarder for %s", ni->veth_cmld_name);
 	}
+
+	if (netns_fd != -1)
+		close(netns_fd);
 }
 
+/**
+ * Reserves the name of a directly attached interface. Sub-interfaces are named
+ * after the offset like the container endpoint of a veth, but only created
+ * post clone in the namespace of the container. A virtual function keeps the
+ * name of its netdev until it is renamed in the container.
+ */
 static int
-c_net_udhcpd_start(c_net_interface_t *ni)
+c_net_start_pre_clone_interface_direct(c_net_interface_t *ni)
 {
 	ASSERT(ni);
 
-	int bytes_written = -1;
+	if (ni->type == CONTAINER_VNET_SRIOV_VF) {
+		ni->veth_cont_name = network_get_vf_ifname_new(ni->parent, ni->vf);
+		IF_NULL_GOTO(ni->veth_cont_name, err);
+		return 0;
+	}
+
+	ni->veth_cont_name = mem_printf("c_%d", ni->cont_offset);
+	if (c_net_is_veth_used(ni->veth_cont_name)) {
+		ERROR("container interface %s already in use", ni->veth_cont_name);
+		goto err;
+	}
+	return 0;
+
+err:
+	c_net_unset_offset(ni->cont_offset);
+	mem_free(ni->veth_cont_name);
+	ni->veth_cont_name = NULL;
+	return -1;
+}
 
-	char *run_dir = mem_printf("/run/udhcpd");
-	char *conf_file = mem_printf("%s/%s.conf", run_dir, ni->veth_cmld_name);
-	char *ipv4_start = mem_printf(IPV4_DHCP_RANGE_START, ni->cont_offset);
-	char *ipv4_end = mem_printf(IPV4_DHCP_RANGE_END, ni->cont_offset);
-	char *lease_file = mem_printf("%s/%s.leases", run_dir, ni->veth_cmld_name);
-	char *pid_file = mem_printf("%s/%s.pid", run_dir, ni->veth_cmld_name);
+/**
+ * Sets the ipv4 addresses of a veth on a shared bridge. The bridge holds the
+ * first address of the subnet of the bridge, the container endpoints follow
+ * by their offsets.
+ */
+static int
+c_net_interface_set_ipv4_bridge(c_net_interface_t *ni)
+{
+	ASSERT(ni->bridge);
 
-	// create config dir if not created yet
-	if (dir_mkdir_p(run_dir, 0755) < 0) {
-		DEBUG_ERRNO("Could not mkdir %s", run_dir);
-		goto out;
+	if (ni->cont_offset + 2 >= 255) {
+		ERROR("No address left for %s on bridge %s", ni->nw_name, ni->bridge->name);
+		return -1;
 	}
 
-	// if running stop dhcpd for this ni
-	if (ni->dhcpd_pid > 0)
-		c_net_udhcpd_stop(ni);
-
-	bytes_written = file_printf(conf_file,
-				    "interface %s\n"
-				    "start %s\n"
-				    "end %s\n"
-				    "option subnet %s\n"
-				    "lease_file %s\n"
-				    "pidfile %s",
-				    ni->veth_cmld_name, ipv4_start, ipv4_end, IPV4_DHCP_MASK,
-				    lease_file, pid_file);
-
-	IF_FALSE_GOTO(bytes_written > 0, out);
-
-	char *dhcpd_argv[] = { "udhcpd", "-f", conf_file, NULL };
-	ni->dhcpd_pid = fork();
-	if (ni->dhcpd_pid == -1) {
-		ERROR_ERRNO("Could not fork '%s' for %s", dhcpd_argv[0], ni->veth_cmld_name);
-		bytes_written = -1;
-	} else if (ni->dhcpd_pid == 0) {
-		INFO("Starting '%s' for %s", dhcpd_argv[0], ni->veth_cmld_name);
-		execvp(dhcpd_argv[0], dhcpd_argv);
-		FATAL_ERRNO("dhcpd: Could not exec '%s'!", dhcpd_argv[0]);
-	} else {
-		event_signal_t *sigchld = event_signal_new(SIGCHLD, c_net_udhcpd_sigchld_cb, ni);
-		event_add_signal(sigchld);
+	int ret = 0;
+	char *cmld_addr = mem_printf(IPV4_BRIDGE_ADDRESS, ni->bridge->index, 1);
+	char *cont_addr = mem_printf(IPV4_BRIDGE_ADDRESS, ni->bridge->index, ni->cont_offset + 2);
+	if (!inet_aton(cmld_addr, &ni->ipv4_cmld_addr) ||
+	    !inet_aton(cont_addr, &ni->ipv4_cont_addr) ||
+	    c_net_get_next_ipv4_bcaddr(&ni->ipv4_cont_addr, &ni->ipv4_bc_addr)) {
+		ERROR("failed to determine the addresses of %s on bridge %s", ni->nw_name,
+		      ni->bridge->name);
+		ret = -1;
 	}
-out:
-	mem_free(lease_file);
-	mem_free(pid_file);
-	mem_free(run_dir);
-	mem_free(conf_file);
-	mem_free(ipv4_start);
-	mem_free(ipv4_end);
+	mem_free(cmld_addr);
+	mem_free(cont_addr);
 
-	return (bytes_written > 0) ? 0 : -1;
+	mem_free(ni->subnet);
+	ni->subnet = mem_printf(IPV4_BRIDGE_ADDRESS "/%d", ni->bridge->index, 0, IPV4_PREFIX);
+	return ret;
+}
+
+/**
+ * Sets the ipv4 addresses of both veth endpoints and the subnet, which depend
+ * on the offset of the interface.
+ */
+static int
+c_net_interface_set_ipv4(c_net_interface_t *ni)
+{
+	if (ni->bridge)
+		return c_net_interface_set_ipv4_bridge(ni);
+
+	/* Get root ns ipv4 address */
+	if (c_net_get_next_ipv4_cmld_addr(ni->cont_offset, &ni->ipv4_cmld_addr)) {
+		ERROR("failed to retrieve a root/c0 ns ip address");
+		return -1;
+	}
+	/* set subnet string */
+	uint32_t ip = ntohl(ni->ipv4_cmld_addr.s_addr);
+	uint32_t mask = ~(((uint32_t)-1) >> IPV4_PREFIX);
+	struct in_addr net_prefix = { .s_addr = htonl(ip & mask) };
+	mem_free(ni->subnet);
+	ni->subnet = mem_printf("%s/%d", inet_ntoa(net_prefix), IPV4_PREFIX);
+
+	/* Get container ns ipv4 address */
+	if (c_net_get_next_ipv4_cont_addr(ni->cont_offset, &ni->ipv4_cont_addr)) {
+		ERROR("failed to retrieve an ip container address");
+		return -1;
+	}
+	/* Get corresponding bcaddress */
+	if (c_net_get_next_ipv4_bcaddr(&ni->ipv4_cont_addr, &ni->ipv4_bc_addr)) {
+		ERROR("failed to retrieve the ip container broadcast address");
+		return -1;
+	}
+	return 0;
 }
 
 static int
@@ -673,38 +1266,22 @@ c_net_start_pre_clone_interface(c_net_interface_t *ni)
 	ASSERT(ni);
 
 	/* Get container offset based on currently started containers */
-	if ((ni->cont_offset = c_net_set_next_offset()) == -1) {
+	if ((ni->cont_offset = c_net_set_next_offset(ni->offset_reserved)) == -1) {
 		WARN_ERRNO("Maximum offset for Network interfaces reached!");
 		goto err;
 	}
 
-	ni->dhcpd_pid = -1;
+	if (ni->type != CONTAINER_VNET_VETH)
+		return c_net_start_pre_clone_interface_direct(ni);
+
 	ni->veth_cmld_name = mem_printf("r_%d", ni->cont_offset);
 	ni->veth_cont_name = mem_printf("c_%d", ni->cont_offset);
 
-	if (ni->configure) {
-		/* Get root ns ipv4 address */
-		if (c_net_get_next_ipv4_cmld_addr(ni->cont_offset, &ni->ipv4_cmld_addr)) {
-			ERROR("failed to retrieve a root/c0 ns ip address");
-			goto err;
-		}
-		/* set subnet string */
-		uint32_t ip = ntohl(ni->ipv4_cmld_addr.s_addr);
-		uint32_t mask = ~(((uint32_t)-1) >> IPV4_PREFIX);
-		struct in_addr net_prefix = { .s_addr = htonl(ip & mask) };
-		ni->subnet = mem_printf("%s/%d", inet_ntoa(net_prefix), IPV4_PREFIX);
-
-		/* Get container ns ipv4 address */
-		if (c_net_get_next_ipv4_cont_addr(ni->cont_offset, &ni->ipv4_cont_addr)) {
-			ERROR("failed to retrieve an ip container address");
-			goto err;
-		}
-		/* Get corresponding bcaddress */
-		if (c_net_get_next_ipv4_bcaddr(&ni->ipv4_cont_addr, &ni->ipv4_bc_addr)) {
-			ERROR("failed to retrieve the ip container broadcast address");
-			goto err;
-		}
-	}
+	if (ni->bridge_name && !(ni->bridge = c_net_bridge_get(ni->bridge_name, -1)))
+		goto err;
+
+	if (ni->configure && c_net_interface_set_ipv4(ni) < 0)
+		goto err;
 
 	/* Create free veth pair from container name, check if the interfaces are free */
 	if (c_net_is_veth_used(ni->veth_cmld_name)) {
@@ -728,6 +1305,8 @@ c_net_start_pre_clone_interface(c_net_interface_t *ni)
 	/* In case of an error, release the current offset */
 err:
 	c_net_unset_offset(ni->cont_offset);
+	c_net_bridge_put(ni->bridge);
+	ni->bridge = NULL;
 	if (ni->veth_cmld_name) {
 		// delete veth pair if it was created!
 		if (c_net_is_veth_used(ni->veth_cmld_name)) {
@@ -767,36 +1346,60 @@ c_net_start_pre_clone(c_net_t *net)
 	    (container_get_prev_state(net->container) == CONTAINER_STATE_REBOOTING))
 		return 0;
 
+	bool reserved = false;
 	for (list_t *l = net->interface_list; l; l = l->next) {
 		c_net_interface_t *ni = l->data;
 
 		if (c_net_start_pre_clone_interface(ni) == -1)
 			return -1;
-		if (!ni->configure)
-			continue;
+		// keep the subnet for the next start
+		reserved |= c_net_reserve_offset(ni, ni->cont_offset);
 	}
+	if (reserved)
+		c_net_write_offsets(net);
 	return 0;
 }
 
+/**
+ * Moves the container endpoint of the veth pair to the ns of pid and, if pid_c0
+ * is set, the rootns endpoint to the ns of c0. Both moves and the optional
+ * rename of the rootns endpoint are sent as a single netlink batch.
+ */
 static int
-c_net_start_post_clone_interface(pid_t pid, c_net_interface_t *ni)
+c_net_start_post_clone_interface(pid_t pid, pid_t pid_c0, c_net_interface_t *ni)
 {
 	ASSERT(ni);
 
+	list_t *reqs = NULL;
+	bool rename_radio = ni->cont_offset == 0 && hardware_get_radio_ifname();
+
 	if (!(ni->veth_cont_name && pid > 0)) {
 		ERROR("PID or veth name missing to move ifi");
 		return -1;
 	}
 
 	DEBUG("move %s to the ns of this pid: %d", ni->veth_cont_name, pid);
-	if (c_net_move_ifi(ni->veth_cont_name, pid) < 0)
-		return -1;
+	reqs = c_net_batch_append(reqs, network_rtnet_move_ns_msg_new(ni->veth_cont_name, pid));
+	IF_NULL_RETVAL(reqs, -1);
 
-	if (ni->cont_offset == 0 && hardware_get_radio_ifname()) {
+	if (rename_radio) {
 		/* Rename the rootns first veth to the RADIO_IFACE_NAME name */
-		if (network_rename_ifi(ni->veth_cmld_name, hardware_get_radio_ifname()))
-			return -1;
+		reqs = c_net_batch_append(reqs, network_rename_ifi_msg_new(
+							ni->veth_cmld_name, hardware_get_radio_ifname()));
+		IF_NULL_RETVAL(reqs, -1);
+	}
+
+	if (pid_c0 > 0) {
+		DEBUG("move %s to the ns of c0's pid: %d", ni->veth_cmld_name, pid_c0);
+		reqs = c_net_batch_append(reqs,
+					  network_rtnet_move_ns_msg_new(ni->veth_cmld_name, pid_c0));
+		IF_NULL_RETVAL(reqs, -1);
+	}
 
+	if (network_rtnl_send_batch(reqs))
+		return -1;
+
+	if (rename_radio) {
 		mem_free(ni->veth_cmld_name);
 		ni->veth_cmld_name = mem_strdup(hardware_get_radio_ifname());
 	}
@@ -804,24 +1407,127 @@ c_net_start_post_clone_interface(pid_t pid, c_net_interface_t *ni)
 	return 0;
 }
 
-void
-c_net_helper_sigchild_cb(UNUSED int signum, event_signal_t *sig, void *data)
+/**
+ * Attaches a macvlan/ipvlan sub-interface or a virtual function directly to the
+ * ns of pid. The parent of a sub-interface is looked up in the ns of cmld and,
+ * if not found there, in the ns of c0, which owns the physical interfaces
+ * when privileged.
+ */
+static int
+c_net_start_post_clone_interface_direct(pid_t pid, pid_t pid_c0, c_net_interface_t *ni)
 {
-	pid_t *c0_netns_pid = data;
-	pid_t pid;
-	int status = 0;
+	ASSERT(ni);
+
+	if (ni->type == CONTAINER_VNET_SRIOV_VF) {
+		DEBUG("move vf %s of %s to the ns of this pid: %d", ni->veth_cont_name, ni->parent,
+		      pid);
+		return c_net_move_ifi(ni->veth_cont_name, pid);
+	}
 
-	ASSERT(c0_netns_pid);
+	const char *kind = ni->type == CONTAINER_VNET_MACVLAN ? "macvlan" : "ipvlan";
+	int netns_fd = -1;
 
-	TRACE("cmld's c0 netns helper SIGCHLD handler called for PID %d", *c0_netns_pid);
-	if ((pid = waitpid(*c0_netns_pid, &status, WNOHANG)) > 0) {
-		TRACE("Reaped c0 netns helper process: %d", pid);
-		/* remove the sigchld callback for this container from the event loop */
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		mem_free(c0_netns_pid);
-	} else {
-		TRACE("Failed to reap c0 netns helper process");
+	if (if_nametoindex(ni->parent) == 0 && pid_c0 > 0) {
+		char *c0_netns = mem_printf("/proc/%d/ns/net", pid_c0);
+		netns_fd = open(c0_netns, O_RDONLY | O_CLOEXEC);
+		mem_free(c0_netns);
+		IF_TRUE_RETVAL_ERROR(netns_fd < 0, -1);
+	}
+
+	int ret = network_create_sublink(netns_fd, ni->parent, kind, ni->veth_cont_name,
+					 ni->veth_mac, pid);
+	if (ret)
+		ERROR("Could not attach %s %s on %s", kind, ni->veth_cont_name, ni->parent);
+
+	if (netns_fd >= 0)
+		close(netns_fd);
+	return ret;
+}
+
+/**
+ * Creates the shared bridge of ni in the current network namespace, unless it
+ * exists already, with the gateway address of its subnet and masquerading for
+ * the traffic leaving the subnet. Called by the netns helper child.
+ */
+static int
+c_net_bridge_setup(const c_net_interface_t *ni)
+{
+	ASSERT(ni && ni->bridge);
+
+	IF_TRUE_RETVAL(if_nametoindex(ni->bridge->ifname) > 0, 0);
+
+	// the helper of another container may have been faster
+	if (network_create_bridge(ni->bridge->ifname))
+		return if_nametoindex(ni->bridge->ifname) > 0 ? 0 : -1;
+
+	list_t *reqs = c_net_batch_append_ipv4_up(NULL, ni->bridge->ifname, &ni->ipv4_cmld_addr,
+						  &ni->ipv4_bc_addr);
+	if (!reqs || network_rtnl_send_batch(reqs))
+		return -1;
+
+	return network_setup_masquerading(ni->subnet, true);
+}
+
+/**
+ * Sets up the shared bridge of ni and the filter of the rootns endpoint as its
+ * port, and appends the requests to attach the endpoint to the bridge and bring
+ * it up to reqs. The port is filtered before it is attached.
+ * @return the extended list or NULL on error
+ */
+static list_t *
+c_net_batch_append_bridge_port(list_t *reqs, const c_net_interface_t *ni)
+{
+	ASSERT(ni && ni->bridge);
+
+	if (c_net_bridge_setup(ni) ||
+	    network_setup_bridge_port_filter(ni->veth_cmld_name, inet_ntoa(ni->ipv4_cont_addr),
+					     true))
+		return c_net_batch_append(reqs, NULL);
+
+	DEBUG("attach veth %s to bridge %s", ni->veth_cmld_name, ni->bridge->ifname);
+	nl_msg_t *req = network_set_master_msg_new(ni->veth_cmld_name, ni->bridge->ifname);
+	reqs = c_net_batch_append(reqs, req);
+	IF_NULL_RETVAL(reqs, NULL);
+
+	return c_net_batch_append(reqs, network_set_flag_msg_new(ni->veth_cmld_name, IFF_UP));
+}
+
+/**
+ * Removes the filter of the rootns endpoint of ni as port of its shared bridge,
+ * and the bridge itself if ni holds its last reference, which is released by
+ * cmld after the fork of the netns helper child calling this.
+ */
+static void
+c_net_bridge_cleanup_port(const c_net_interface_t *ni)
+{
+	ASSERT(ni && ni->bridge);
+
+	if (network_setup_bridge_port_filter(ni->veth_cmld_name, inet_ntoa(ni->ipv4_cont_addr),
+					     false))
+		WARN("Failed to remove filter of bridge port %s", ni->veth_cmld_name);
+
+	IF_TRUE_RETURN(ni->bridge->refs > 1);
+
+	if (network_setup_masquerading(ni->subnet, false))
+		WARN("Failed to remove masquerading from %s", ni->subnet);
+	if (network_delete_link(ni->bridge->ifname))
+		WARN("Bridge %s could not be destroyed", ni->bridge->ifname);
+}
+
+static void
+c_net_helper_child_cb(pid_t pid, UNUSED int status, event_child_t *child, UNUSED void *data)
+{
+	TRACE("Reaped c0 netns helper process: %d", pid);
+	event_child_free(child);
+}
+
+static void
+c_net_helper_add_child(pid_t pid)
+{
+	event_child_t *child = event_child_new(pid, c_net_helper_child_cb, NULL);
+	if (event_add_child(child) < 0) {
+		WARN("Failed to register reaper for c0 netns helper process %d", pid);
+		event_child_free(child);
 	}
 }
 
@@ -874,25 +1580,23 @@ c_net_start_post_clone(c_net_t *net)
 	for (list_t *l = net->interface_list; l; l = l->next) {
 		c_net_interface_t *ni = l->data;
 
-		if (c_net_start_post_clone_interface(pid, ni) == -1)
-			return -1;
-		if (pid == pid_c0) //skip moving interfaces defined for c0 (e.g. uplink iiff)
-			continue;
-		if (cmld_containers_get_c0()) {
-			DEBUG("move %s to the ns of c0's pid: %d", ni->veth_cmld_name, pid_c0);
-			if (c_net_move_ifi(ni->veth_cmld_name, pid_c0) < 0)
+		if (ni->type != CONTAINER_VNET_VETH) {
+			if (c_net_start_post_clone_interface_direct(pid, pid_c0, ni) == -1)
 				return -1;
+			continue;
 		}
+
+		//skip moving interfaces defined for c0 (e.g. uplink iiff)
+		if (c_net_start_post_clone_interface(pid, pid == pid_c0 ? 0 : pid_c0, ni) == -1)
+			return -1;
 	}
 
 	// configure moved rootns veth endpoint in c0's network namespace
-	pid_t *c0_netns_pid = mem_new0(pid_t, 1);
-	*c0_netns_pid = fork();
-	if (*c0_netns_pid == -1) {
+	pid_t c0_netns_pid = fork();
+	if (c0_netns_pid == -1) {
 		ERROR_ERRNO("Could not fork for switching to c0's netns");
-		mem_free(c0_netns_pid);
 		return -1;
-	} else if (*c0_netns_pid == 0) {
+	} else if (c0_netns_pid == 0) {
 		const char *hostns = cmld_containers_get_c0() ? "c0" : "CML";
 
 		DEBUG("Configuring netifs in %s", hostns);
@@ -912,41 +1616,55 @@ c_net_start_post_clone(c_net_t *net)
 		// enable forwarding for container conectivity
 		network_enable_ip_forwarding();
 
+		/* Set IPv4 addresses and bring veths up by a single batch */
+		list_t *reqs = NULL;
 		for (list_t *l = net->interface_list; l; l = l->next) {
 			c_net_interface_t *ni = l->data;
-			if (!ni->configure)
+			// configuration of uplink interface is done in root netns below
+			if (!ni->configure || !strcmp(ni->nw_name, CML_UPLINK_INTERFACE_NAME))
+				continue;
+
+			if (ni->bridge) {
+				if (!(reqs = c_net_batch_append_bridge_port(reqs, ni)))
+					FATAL("Cannot attach '%s' to bridge %s in %s!",
+					      ni->veth_cmld_name, ni->bridge->ifname, hostns);
 				continue;
+			}
 
 			DEBUG("set IFF_UP for veth: %s", ni->veth_cmld_name);
+			if (!(reqs = c_net_batch_append_ipv4_up(reqs, ni->veth_cmld_name,
+								&ni->ipv4_cmld_addr,
+								&ni->ipv4_bc_addr)))
+				FATAL("Cannot create netlink requests for '%s' in %s!",
+				      ni->veth_cmld_name, hostns);
+		}
+		if (reqs && network_rtnl_send_batch(reqs))
+			FATAL_ERRNO("Could not configure veths in %s!", hostns);
+
+		for (list_t *l = net->interface_list; l; l = l->next) {
+			c_net_interface_t *ni = l->data;
+			// the shared bridge is masqueraded as a whole
+			if (!ni->configure || ni->bridge)
+				continue;
 
 			/* Configure uplink of CML in c0 */
 			if (!strcmp(ni->nw_name, CML_UPLINK_INTERFACE_NAME)) {
 				if (network_setup_masquerading(ni->subnet, true))
 					FATAL_ERRNO("Could not setup masquerading for %s!",
 						    ni->veth_cmld_name);
-				// configuration of interface is done in root netns below
 				continue;
 			}
 
-			/* Set IPv4 address */
-			if (c_net_set_ipv4(ni->veth_cmld_name, &ni->ipv4_cmld_addr,
-					   &ni->ipv4_bc_addr))
-				FATAL_ERRNO("Cannot set ip for '%s' in %s!", ni->veth_cmld_name,
-					    hostns);
-
-			/* Bring veth up */
-			if (network_set_flag(ni->veth_cmld_name, IFF_UP))
-				FATAL_ERRNO("Could not configure %s in %s!", ni->veth_cmld_name,
-					    hostns);
-
 			/* Setup firewall for container connectivity */
 			if (network_setup_masquerading(ni->subnet, true))
 				FATAL_ERRNO("Could not setup masquerading for %s!",
 					    ni->veth_cmld_name);
 
-			/* Start busybox' dhcpd server for veth */
-			if (c_net_udhcpd_start(ni))
-				FATAL_ERRNO("Could not start udhcpd!");
+			/* Bypass netfilter for established connections */
+			if (ni->fastpath &&
+			    network_setup_flow_offload(ni->subnet, ni->veth_cmld_name, true))
+				WARN("Connections of %s keep the regular forwarding path",
+				     ni->veth_cmld_name);
 
 			DEBUG("Successfully configured %s in %s, wait for child to exit.",
 			      ni->veth_cmld_name, hostns);
@@ -954,23 +1672,20 @@ c_net_start_post_clone(c_net_t *net)
 		DEBUG("Setup of net ifs in netns of %s done, exiting netns child!", hostns);
 		exit(0);
 	} else {
-		DEBUG("Setup of nis should be done by pid=%d", *c0_netns_pid);
-		// register new sigchild handler for helper clone in netns of c0
-		event_signal_t *sig =
-			event_signal_new(SIGCHLD, c_net_helper_sigchild_cb, c0_netns_pid);
-		event_add_signal(sig);
+		DEBUG("Setup of nis should be done by pid=%d", c0_netns_pid);
+		// register reaper for helper clone in netns of c0
+		c_net_helper_add_child(c0_netns_pid);
+
+		/* serve dhcp on the veths in c0's netns, veths of c0 itself stay in cmld's netns */
+		c_net_services_start_all(net, pid == pid_c0 ? 0 : pid_c0);
 
 		/* setup uplink of cml */
 		c_net_interface_t *ni = list_nth_data(net->interface_list, 0);
 		if (ni && !strcmp(ni->nw_name, CML_UPLINK_INTERFACE_NAME)) {
-			/* Set IPv4 address */
-			if (c_net_set_ipv4(ni->veth_cmld_name, &ni->ipv4_cmld_addr,
-					   &ni->ipv4_bc_addr))
-				ERROR_ERRNO("Cannot set ip for uplink iff '%s'!",
-					    ni->veth_cmld_name);
-
-			/* Bring veth up */
-			if (network_set_flag(ni->veth_cmld_name, IFF_UP))
+			/* Set IPv4 address and bring veth up */
+			list_t *reqs = c_net_batch_append_ipv4_up(
+				NULL, ni->veth_cmld_name, &ni->ipv4_cmld_addr, &ni->ipv4_bc_addr);
+			if (!reqs || network_rtnl_send_batch(reqs))
 				ERROR_ERRNO("Could not configure uplink %s!", ni->veth_cmld_name);
 
 			if (network_setup_default_route(inet_ntoa(ni->ipv4_cont_addr), true))
@@ -979,6 +1694,10 @@ c_net_start_post_clone(c_net_t *net)
 		}
 	}
 
+	/* the adopted netns is already bound */
+	if (net->adopted)
+		return 0;
+
 	// bind netns to file
 	if (ns_bind("net", pid, net->ns_path) == -1) {
 		WARN("Could not bind netns of %s into filesystem!",
@@ -991,37 +1710,186 @@ c_net_start_post_clone(c_net_t *net)
 	return 0;
 }
 
+int
+c_net_adopt_netns(c_net_t *net, pid_t pid)
+{
+	ASSERT(net);
+	IF_FALSE_RETVAL(net->ns_net, -1);
+
+	// bind netns to file to be joined by the start child
+	if (ns_bind("net", pid, net->ns_path) == -1) {
+		ERROR("Could not bind adopted netns of %s into filesystem!",
+		      container_get_name(net->container));
+		return -1;
+	}
+	net->fd_netns = open(net->ns_path, O_RDONLY);
+	if (net->fd_netns < 0)
+		WARN("Could not keep netns active for reboot!");
+
+	net->adopted = true;
+	return 0;
+}
+
+size_t
+c_net_get_offsets(const c_net_t *net, int **offsets)
+{
+	ASSERT(net);
+	ASSERT(offsets);
+
+	size_t n = net->ns_net ? list_length(net->interface_list) : 0;
+	*offsets = n ? mem_new0(int, n) : NULL;
+
+	size_t i = 0;
+	for (list_t *l = net->interface_list; l && i < n; l = l->next, i++)
+		(*offsets)[i] = ((c_net_interface_t *)l->data)->cont_offset;
+	return n;
+}
+
+/**
+ * Takes a reference of the shared bridge of a veth of a running container. The
+ * bridge keeps the index of its interface, to which the rootns endpoint of the
+ * veth is attached in the network namespace netns_fd (-1 for the one of cmld).
+ */
+static int
+c_net_adopt_bridge(c_net_interface_t *ni, int netns_fd)
+{
+	int index = -1;
+	char *master = network_get_link_master_new(netns_fd, ni->veth_cmld_name);
+	if (!master || sscanf(master, C_NET_BRIDGE_NAME, &index) != 1) {
+		ERROR("Veth %s is not attached to bridge %s", ni->veth_cmld_name, ni->bridge_name);
+		mem_free(master);
+		return -1;
+	}
+	mem_free(master);
+
+	ni->bridge = c_net_bridge_get(ni->bridge_name, index);
+	return ni->bridge ? 0 : -1;
+}
+
+/**
+ * Occupies the offset of an interface of a running container again and restores
+ * the names and addresses, which have been derived from it on the start.
+ */
+static int
+c_net_adopt_interface(c_net_interface_t *ni, int offset, int netns_fd)
+{
+	ASSERT(ni);
+
+	c_net_offsets_init();
+	if (offset < 0 || offset >= MAX_NUM_DEVICES || bitmap_test(address_offsets, offset)) {
+		ERROR("Offset %d of network interface %s is invalid or taken", offset,
+		      ni->nw_name);
+		return -1;
+	}
+	bitmap_set(address_offsets, offset);
+	ni->cont_offset = offset;
+
+	// the container endpoint is not in the ns of cmld anymore
+	if (ni->type != CONTAINER_VNET_VETH)
+		return c_net_start_pre_clone_interface_direct(ni);
+
+	ni->veth_cmld_name = (offset == 0 && hardware_get_radio_ifname()) ?
+				     mem_strdup(hardware_get_radio_ifname()) :
+				     mem_printf("r_%d", offset);
+	ni->veth_cont_name = mem_printf("c_%d", offset);
+
+	if (ni->bridge_name && c_net_adopt_bridge(ni, netns_fd) < 0) {
+		c_net_unset_offset(ni->cont_offset);
+		return -1;
+	}
+
+	if (ni->configure && c_net_interface_set_ipv4(ni) < 0) {
+		c_net_unset_offset(ni->cont_offset);
+		c_net_bridge_put(ni->bridge);
+		ni->bridge = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+c_net_adopt(c_net_t *net, const int *offsets, size_t len)
+{
+	ASSERT(net);
+
+	/* Skip, if the container doesn't have a network ns */
+	if (!net->ns_net)
+		return 0;
+
+	if (len != (size_t)list_length(net->interface_list)) {
+		ERROR("Network interfaces of %s do not match the running container",
+		      container_get_name(net->container));
+		return -1;
+	}
+
+	// the rootns endpoints of veths are in c0's netns, except for c0 itself
+	container_t *c0 = cmld_containers_get_c0();
+	pid_t pid_c0 = (c0 && net->container != c0) ? container_get_pid(c0) : 0;
+	int c0_netns_fd = -1;
+	if (pid_c0 > 0) {
+		char *c0_netns = mem_printf("/proc/%d/ns/net", pid_c0);
+		c0_netns_fd = open(c0_netns, O_RDONLY | O_CLOEXEC);
+		mem_free(c0_netns);
+		IF_TRUE_RETVAL_ERROR(c0_netns_fd < 0, -1);
+	}
+
+	size_t i = 0;
+	int ret = 0;
+	for (list_t *l = net->interface_list; l && !ret; l = l->next, i++)
+		ret = c_net_adopt_interface(l->data, offsets[i], c0_netns_fd);
+
+	if (c0_netns_fd >= 0)
+		close(c0_netns_fd);
+	IF_TRUE_RETVAL(ret < 0, -1);
+
+	// the netns is still bound into the filesystem of cmld
+	net->fd_netns = open(net->ns_path, O_RDONLY);
+	if (net->fd_netns < 0)
+		WARN("Could not keep netns active for reboot!");
+
+	/* the dhcp servers have been running in the previous cmld instance */
+	c_net_services_start_all(net, pid_c0);
+
+	return 0;
+}
+
 static int
 c_net_start_child_interface(c_net_interface_t *ni)
 {
 	ASSERT(ni);
 
+	list_t *reqs = NULL;
+
 	DEBUG("rename ifi from %s to %s", ni->veth_cont_name, ni->nw_name);
 
 	/* Rename container veth to the given if name */
-	if (network_rename_ifi(ni->veth_cont_name, ni->nw_name))
-		return -1;
+	reqs = c_net_batch_append(reqs, network_rename_ifi_msg_new(ni->veth_cont_name, ni->nw_name));
+	IF_NULL_RETVAL(reqs, -1);
+
+	/* Directly attached interfaces are brought up, addresses are up to the container */
+	if (ni->type != CONTAINER_VNET_VETH) {
+		reqs = c_net_batch_append(reqs, network_set_flag_msg_new(ni->veth_cont_name, IFF_UP));
+		IF_NULL_RETVAL(reqs, -1);
+		return network_rtnl_send_batch(reqs);
+	}
 
 	/* Skip IPv4 setup if interface has no config */
 	if (!ni->configure) {
 		DEBUG("Leave %s interface unconfigured. (Manual configuration detected)",
 		      ni->nw_name);
-		return 0;
+		return network_rtnl_send_batch(reqs);
 	}
 
-	DEBUG("set ipv4 (addr: %s) for %s", inet_ntoa(ni->ipv4_cont_addr), ni->nw_name);
+	/*
+	 * Set IPv4 address and bring interface up in the same batch. The requests
+	 * are created before the rename is sent, thus still use the old name.
+	 */
+	DEBUG("set ipv4 (addr: %s) and bring up %s", inet_ntoa(ni->ipv4_cont_addr), ni->nw_name);
+	reqs = c_net_batch_append_ipv4_up(reqs, ni->veth_cont_name, &ni->ipv4_cont_addr,
+					  &ni->ipv4_bc_addr);
+	IF_NULL_RETVAL(reqs, -1);
 
-	/* Set IPv4 address */
-	if (c_net_set_ipv4(ni->nw_name, &ni->ipv4_cont_addr, &ni->ipv4_bc_addr))
-		return -1;
-
-	/* bring net->nw_name interface up */
-	DEBUG("bring %s interface up", ni->nw_name);
-
-	if (network_set_flag(ni->nw_name, IFF_UP))
-		return -1;
-
-	return 0;
+	return network_rtnl_send_batch(reqs);
 }
 
 /**
@@ -1068,7 +1936,8 @@ c_net_cleanup_interface(c_net_interface_t *ni)
 	ASSERT(ni);
 
 	DEBUG("shut network interface %s down", ni->veth_cont_name);
-	c_net_udhcpd_stop(ni);
+	c_net_dhcpd_stop(ni);
+	c_net_dnsd_stop(ni);
 
 	/* shut the network interface down */
 	// check if iface was allready destroyed by kernel
@@ -1084,6 +1953,7 @@ c_net_cleanup_interface(c_net_interface_t *ni)
 
 	/* Release the offset, as the ip addresses are no more occupied */
 	c_net_unset_offset(ni->cont_offset);
+	ni->cont_offset = -1;
 
 	if (ni->subnet) {
 		mem_free(ni->subnet);
@@ -1112,20 +1982,20 @@ c_net_cleanup_c0(c_net_t *net)
 	ASSERT(net);
 
 	// cleanup moved rootns veth endpoint in c0's network namespace
-	pid_t *c0_netns_pid = mem_new0(pid_t, 1);
-	*c0_netns_pid = fork();
-	if (*c0_netns_pid == -1) {
+	pid_t c0_netns_pid = fork();
+	if (c0_netns_pid == -1) {
 		ERROR_ERRNO("Could not fork for switching to c0's netns");
-		mem_free(c0_netns_pid);
 		return -1;
-	} else if (*c0_netns_pid == 0) {
+	} else if (c0_netns_pid == 0) {
 		const char *hostns = cmld_containers_get_c0() ? "c0" : "CML";
 
 		DEBUG("Cleaning up netifs in %s", hostns);
 
 		event_reset(); // reset event_loop of cloned from parent
 		if (cmld_containers_get_c0()) {
-			if (ns_join_all(container_get_pid(cmld_containers_get_c0()), true)) {
+			const container_t *c0 = cmld_containers_get_c0();
+			if (ns_join_all_pidfd(container_get_pidfd(c0), container_get_pid(c0),
+					      true)) {
 				ERROR("Failed to join namespaces of container c0");
 			}
 
@@ -1141,19 +2011,34 @@ c_net_cleanup_c0(c_net_t *net)
 				c_net_cleanup_interface(ni);
 				continue;
 			}
+			if (ni->bridge) {
+				c_net_bridge_cleanup_port(ni);
+				c_net_cleanup_interface(ni);
+				continue;
+			}
 			if (network_setup_masquerading(ni->subnet, false))
 				WARN("Failed to remove masquerading from %s", ni->subnet);
+			if (ni->fastpath &&
+			    network_setup_flow_offload(ni->subnet, ni->veth_cmld_name, false))
+				WARN("Failed to remove flow offload from %s", ni->subnet);
 
 			c_net_cleanup_interface(ni);
 		}
 		DEBUG("Cleanup of net ifs in netns of %s done, exiting netns child!", hostns);
 		exit(0);
 	} else {
-		DEBUG("Cleanup of ni ifs should be done by pid=%d", *c0_netns_pid);
-		// register new sigchild handler for helper clone in netns of c0
-		event_signal_t *sig =
-			event_signal_new(SIGCHLD, c_net_helper_sigchild_cb, c0_netns_pid);
-		event_add_signal(sig);
+		DEBUG("Cleanup of ni ifs should be done by pid=%d", c0_netns_pid);
+		// dhcp and dns servers and the references of the bridges are held by cmld itself
+		for (list_t *l = net->interface_list; l; l = l->next) {
+			c_net_interface_t *ni = l->data;
+			c_net_dhcpd_stop(ni);
+			c_net_dnsd_stop(ni);
+			c_net_bridge_put(ni->bridge);
+			ni->bridge = NULL;
+		}
+
+		// register reaper for helper clone in netns of c0
+		c_net_helper_add_child(c0_netns_pid);
 	}
 	return 0;
 }
@@ -1166,6 +2051,8 @@ c_net_cleanup(c_net_t *net, bool is_rebooting)
 {
 	ASSERT(net);
 
+	net->adopted = false;
+
 	/* We can skip this in case the container has no network ns */
 	if (!net->ns_net || !(list_length(net->interface_list)))
 		return;
@@ -1193,10 +2080,14 @@ c_net_free_interface(c_net_interface_t *ni)
 {
 	ASSERT(ni);
 
+	c_net_reserve_offset(ni, -1);
+	c_net_bridge_put(ni->bridge);
+	mem_free(ni->bridge_name);
 	if (ni->subnet)
 		mem_free(ni->subnet);
 	mem_free(ni->veth_cmld_name);
 	mem_free(ni->veth_cont_name);
+	mem_free(ni->parent);
 	mem_free(ni->nw_name);
 	mem_free(ni);
 }
@@ -1232,6 +2123,16 @@ c_net_get_ip_new(c_net_t *net)
 	return mem_strdup(inet_ntoa(ni0->ipv4_cont_addr));
 }
 
+char *
+c_net_get_dns_forwarder_new(c_net_t *net)
+{
+	IF_FALSE_RETVAL_TRACE(net->ns_net, NULL);
+
+	c_net_interface_t *ni0 = list_nth_data(net->interface_list, 0);
+	IF_TRUE_RETVAL(!ni0 || !ni0->dnsd, NULL);
+	return mem_strdup(inet_ntoa(ni0->ipv4_cmld_addr));
+}
+
 char *
 c_net_get_subnet_new(c_net_t *net)
 {
@@ -1250,11 +2151,44 @@ c_net_get_interface_mapping_new(c_net_t *net)
 		c_net_interface_t *ni = l->data;
 		container_vnet_cfg_t *vnet_cfg = container_vnet_cfg_new(
 			ni->nw_name, ni->veth_cmld_name, ni->veth_mac, ni->configure);
+		vnet_cfg->fastpath = ni->fastpath;
+		vnet_cfg->type = ni->type;
+		vnet_cfg->parent = ni->parent ? mem_strdup(ni->parent) : NULL;
+		vnet_cfg->vf = ni->vf;
+		vnet_cfg->bridge = ni->bridge_name ? mem_strdup(ni->bridge_name) : NULL;
 		mapping = list_append(mapping, vnet_cfg);
 	}
 	return mapping;
 }
 
+list_t *
+c_net_get_stats_new(const c_net_t *net)
+{
+	ASSERT(net);
+	IF_FALSE_RETVAL(net->ns_net && net->fd_netns > 0, NULL);
+
+	list_t *stats_list = NULL;
+	for (list_t *l = net->interface_list; l; l = l->next) {
+		c_net_interface_t *ni = l->data;
+		network_link_stats_t counters;
+
+		if (network_get_link_stats(net->fd_netns, ni->nw_name, &counters)) {
+			WARN("Could not get counters of %s", ni->nw_name);
+			continue;
+		}
+
+		container_net_stats_t *stats = mem_new0(container_net_stats_t, 1);
+		stats->vnet_name = mem_strdup(ni->nw_name);
+		stats->fastpath = ni->fastpath;
+		stats->rx_packets = counters.rx_packets;
+		stats->tx_packets = counters.tx_packets;
+		stats->rx_bytes = counters.rx_bytes;
+		stats->tx_bytes = counters.tx_bytes;
+		stats_list = list_append(stats_list, stats);
+	}
+	return stats_list;
+}
+
 /* rejoin existing netns on reboots where netns is kept active */
 int
 c_net_join_netns(const c_net_t *net)
@@ -1264,3 +2198,12 @@ c_net_join_netns(const c_net_t *net)
 
 	return ns_join_by_path(net->ns_path);
 }
+
+const char *
+c_net_get_ns_path(const c_net_t *net)
+{
+	ASSERT(net);
+	IF_FALSE_RETVAL(net->ns_net && net->fd_netns > 0, NULL);
+
+	return net->ns_path;
+}
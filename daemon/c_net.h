@@ -83,6 +83,14 @@ c_net_cleanup(c_net_t *net, bool is_rebooting);
 char *
 c_net_get_ip_new(c_net_t *net);
 
+/*
+ * return a new string with the address of the caching dns forwarder
+ * of cmld on the first network interface.
+ * returns NULL if the forwarder is not running for the container
+ */
+char *
+c_net_get_dns_forwarder_new(c_net_t *net);
+
 /*
  * return a new string with the containers subnet which is
  * set on the first network interfcace.
@@ -114,10 +122,50 @@ c_net_remove_ifi(const char *ifi_name, const pid_t pid);
 list_t *
 c_net_get_interface_mapping_new(c_net_t *net);
 
+/**
+ * Returns a list of container_net_stats_t objects with the counters of the
+ * interfaces inside the container, or NULL if the container does not run.
+ */
+list_t *
+c_net_get_stats_new(const c_net_t *net);
+
 /**
  * Rejoin existing netns on reboots where netns is kept active
  */
 int
 c_net_join_netns(const c_net_t *net);
 
+/**
+ * Adopts the network namespace of the process pid, i.e. of a zygote, instead
+ * of creating a new one on clone. Binds the netns to be joined by the start
+ * child of the container.
+ */
+int
+c_net_adopt_netns(c_net_t *net, pid_t pid);
+
+/**
+ * Returns the offsets of the network interfaces of the running container, from
+ * which their names and addresses are derived.
+ *
+ * @param offsets Set to a newly allocated array of the offsets, one per interface.
+ * @return the number of offsets
+ */
+size_t
+c_net_get_offsets(const c_net_t *net, int **offsets);
+
+/**
+ * Takes over the network interfaces of a running container from a previous cmld
+ * instance, i.e. occupies their offsets again, keeps the netns, which is still
+ * bound into the filesystem, active and restarts the dhcp servers.
+ */
+int
+c_net_adopt(c_net_t *net, const int *offsets, size_t len);
+
+/**
+ * Returns the path the netns of the container is bound to, if it has its own
+ * netns which is kept active, or NULL otherwise.
+ */
+const char *
+c_net_get_ns_path(const c_net_t *net);
+
 #endif /* C_NET_H */
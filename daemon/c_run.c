@@ -22,6 +22,9 @@
  */
 
 #define _GNU_SOURCE
+
+#define MEM_TAG "container"
+
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,9 +32,12 @@
 #include <pty.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
 #include <linux/limits.h>
 #include <linux/sockios.h>
-#include <sched.h>
+#include <poll.h>
+#include <signal.h>
 
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 #include <macro.h>
@@ -44,13 +50,43 @@
 #include "common/event.h"
 #include "common/proc.h"
 #include "common/ns.h"
+#include "common/sock.h"
 #include "hardware.h"
 #include "container.h"
 #include "c_run.h"
 #include "cmld.h"
 
-//TODO define in container.h?
-#define CLONE_STACK_SIZE 8192
+// chunk size for forwarding between pty and console socket
+#define C_RUN_STREAM_BUF_SIZE (64 * 1024)
+#define C_RUN_STREAM_SOCK_BUF_SIZE (256 * 1024)
+
+// maximum size of an exec request, i.e. the header and the arguments
+#define C_RUN_EXEC_REQ_MAX_SIZE (64 * 1024)
+
+/*
+ * Exec requests are served by one helper process per container which joins
+ * the container once and forks the processes of all sessions. A request
+ * carries the stdio descriptor of the process (pty slave or console socket)
+ * as SCM_RIGHTS, followed by argc NUL-terminated arguments.
+ */
+typedef struct c_run_exec_req {
+	uint32_t id;
+	uint32_t pty;
+	uint32_t argc;
+} c_run_exec_req_t;
+
+typedef enum {
+	C_RUN_EXEC_STARTED = 1, // pid is set
+	C_RUN_EXEC_EXITED,	// pid and its wait status are set, id is unused
+	C_RUN_EXEC_FAILED,	// status is the errno of the failure
+} c_run_exec_msg_type_t;
+
+typedef struct c_run_exec_msg {
+	uint32_t id;
+	int32_t type;
+	int32_t pid;
+	int32_t status;
+} c_run_exec_msg_t;
 
 typedef struct c_run_session {
 	c_run_t *run;
@@ -60,16 +96,21 @@ typedef struct c_run_session {
 	int console_sock_container;
 	int pty_master;
 	char *pty_slave_name;
-	int pty_slave_fd;
 	int create_pty;
 	char *cmd;
 	ssize_t argc;
 	char **argv;
+	uint32_t id;  /* id of the exec request */
+	bool pending; /* request sent, but process not started yet */
 } c_run_session_t;
 
 struct c_run {
 	container_t *container;
 	list_t *sessions;
+	uint32_t next_id;
+	pid_t helper_pid;
+	int helper_sock;
+	event_io_t *helper_io;
 };
 
 c_run_t *
@@ -78,6 +119,8 @@ c_run_new(container_t *container)
 	c_run_t *run = mem_new0(c_run_t, 1);
 	run->container = container;
 	run->sessions = NULL;
+	run->helper_pid = -1;
+	run->helper_sock = -1;
 	return run;
 }
 
@@ -105,17 +148,25 @@ c_run_session_new(c_run_t *run, int create_pty, char *cmd, ssize_t argc, char **
 	session->pty_master = -1;
 	session->active_exec_pid = -1;
 	session->pty_slave_name = NULL;
-	session->pty_slave_fd = -1;
 
 	session->console_sock_cmld = cfd[0];
 	session->console_sock_container = cfd[1];
 
+	// let the console task queue whole frames of output
+	for (int i = 0; i < 2; i++) {
+		int bufsize = C_RUN_STREAM_SOCK_BUF_SIZE;
+		if (setsockopt(cfd[i], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) < 0)
+			TRACE_ERRNO("Could not enlarge console socket buffer");
+	}
+
 	TRACE("Making cmld console socket nonblocking");
 	fd_make_non_blocking(session->console_sock_cmld);
-	fd_make_non_blocking(session->console_sock_container);
+	// without pty, the container end is the stdio of the executed process
+	if (create_pty)
+		fd_make_non_blocking(session->console_sock_container);
 
 	ssize_t i = 0;
-	size_t total_len = ADD_WITH_OVERFLOW_CHECK(session->argc, (size_t)1);
+	size_t total_len = ADD_WITH_OVERFLOW_CHECK(argc, (size_t)1);
 	total_len = MUL_WITH_OVERFLOW_CHECK(sizeof(char *), total_len);
 	session->argv = mem_alloc0(total_len);
 
@@ -187,6 +238,34 @@ c_run_session_cleanup(c_run_session_t *session)
 	}
 }
 
+static void
+c_run_session_end(c_run_session_t *session)
+{
+	c_run_t *run = session->run;
+
+	run->sessions = list_remove(run->sessions, session);
+	c_run_session_cleanup(session);
+	c_run_session_free(session);
+}
+
+static void
+c_run_exec_helper_stop(c_run_t *run)
+{
+	IF_TRUE_RETURN(run->helper_pid == -1);
+
+	event_remove_io(run->helper_io);
+	event_io_free(run->helper_io);
+	run->helper_io = NULL;
+
+	close(run->helper_sock);
+	run->helper_sock = -1;
+	// do not wait for the helper to notice the eof, it may be frozen with the container
+	kill(run->helper_pid, SIGKILL);
+	if (waitpid(run->helper_pid, NULL, 0) < 0)
+		WARN_ERRNO("Could not reap exec helper %d", run->helper_pid);
+	run->helper_pid = -1;
+}
+
 void
 c_run_cleanup(c_run_t *run)
 {
@@ -199,32 +278,41 @@ c_run_cleanup(c_run_t *run)
 	}
 	list_delete(run->sessions);
 	run->sessions = NULL;
+
+	c_run_exec_helper_stop(run);
 }
 
-static int
-do_clone(int (*func)(void *), unsigned long flags, void *data)
+static c_run_session_t *
+c_run_get_session_by_fd(const c_run_t *run, int session_fd)
 {
-	void *exec_stack = NULL;
-	/* Allocate node stack */
-	if (!(exec_stack = alloca(CLONE_STACK_SIZE))) {
-		WARN_ERRNO("Not enough memory for allocating container stack");
-		return -1;
+	for (list_t *l = run->sessions; l; l = l->next) {
+		c_run_session_t *session = l->data;
+		if (session_fd == session->fd)
+			return session;
 	}
+	ERROR("Session for fd=%d does not exist!", session_fd);
+	return NULL;
+}
 
-	void *exec_stack_high = (void *)((const char *)exec_stack + CLONE_STACK_SIZE);
-
-	return clone(func, exec_stack_high, flags, data);
+static c_run_session_t *
+c_run_get_session_by_id(const c_run_t *run, uint32_t id)
+{
+	for (list_t *l = run->sessions; l; l = l->next) {
+		c_run_session_t *session = l->data;
+		if (session->pending && session->id == id)
+			return session;
+	}
+	return NULL;
 }
 
 static c_run_session_t *
-c_run_get_session_by_fd(const c_run_t *run, int session_fd)
+c_run_get_session_by_pid(const c_run_t *run, pid_t pid)
 {
 	for (list_t *l = run->sessions; l; l = l->next) {
 		c_run_session_t *session = l->data;
-		if (session_fd == session->fd)
+		if (session->active_exec_pid == pid)
 			return session;
 	}
-	ERROR("Session for fd=%d does not exist!", session_fd);
 	return NULL;
 }
 
@@ -245,7 +333,8 @@ c_run_write_exec_input(const c_run_t *run, char *exec_input, int session_fd)
 	c_run_session_t *session = c_run_get_session_by_fd(run, session_fd);
 	IF_NULL_RETVAL(session, -1);
 
-	if (session->active_exec_pid != -1) {
+	// input for a pending process is queued in the console socket
+	if (session->active_exec_pid != -1 || session->pending) {
 		TRACE("Write message \"%s\" to fd: %d", exec_input, session->console_sock_cmld);
 		return write(session->console_sock_cmld, exec_input, strlen(exec_input));
 	} else {
@@ -254,62 +343,28 @@ c_run_write_exec_input(const c_run_t *run, char *exec_input, int session_fd)
 	}
 }
 
-void
-c_run_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+static void
+c_run_session_exited(c_run_session_t *session, int status)
 {
-	c_run_session_t *session = data;
-
 	c_run_t *run = session->run;
-	if (NULL == run) {
-		// cleanup of c_run subsystem already done just remove signal handler
-		TRACE("SIGCHLD handler called for already dead c_run session");
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		return;
-	}
-
-	TRACE("SIGCHLD handler called for c_run injected process in container %s with PID %d",
-	      container_get_description(run->container), container_get_pid(run->container));
-	/* The exec loop is started in a new session having it's PID as PGID.
-	 * Therefore wait for this PGID. If a descendant process call setsid it doesn't
-	 * get reaped by this handler. This enables the user to inject processes who
-	 * continue running after the command injected by control exits */
-	pid_t exec_pid = session->active_exec_pid;
-	pid_t pid = 0;
-	int status = 0;
-	while ((pid = waitpid(session->active_exec_pid, &status, WNOHANG))) {
-		TRACE("Got exited child with PID: %d, exec pid: %d", pid, exec_pid);
-
-		//if (pid == exec_pid || pid == run->pty_master_read_pid || run->pty_master_write_pid) {
-		if (pid == exec_pid) {
-			TRACE("Injected process exited. Cleaning up.");
-			if (WIFEXITED(status)) {
-				INFO("Exec'ed process in container %s terminated (status=%d)",
-				     container_get_description(run->container),
-				     WEXITSTATUS(status));
-			} else if (WIFSIGNALED(status)) {
-				INFO("Injected process in container %s killed by signal %d",
-				     container_get_description(run->container), WTERMSIG(status));
-			} else {
-				continue;
-			}
-
-			/* remove the sigchld callback for this container from the event loop */
-			event_remove_signal(sig);
-			event_signal_free(sig);
 
-			/* Close sockets of the session */
-			run->sessions = list_remove(run->sessions, session);
-			c_run_session_cleanup(session);
-			c_run_session_free(session);
-			break;
-		} else {
-			DEBUG("Reaped a descendant process with PID %d of injected process in container %s",
-			      pid, container_get_description(run->container));
-		}
+	TRACE("Injected process %d in container %s exited. Cleaning up.",
+	      session->active_exec_pid, container_get_description(run->container));
+	if (WIFEXITED(status)) {
+		INFO("Exec'ed process in container %s terminated (status=%d)",
+		     container_get_description(run->container), WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		INFO("Injected process in container %s killed by signal %d",
+		     container_get_description(run->container), WTERMSIG(status));
 	}
 
-	TRACE("No more childs to reap. Exiting handler.");
+	/* The process is gone, do not kill a recycled pid during cleanup.
+	 * Descendants which called setsid are not reaped here. This enables the user
+	 * to inject processes who continue running after the injected command exits */
+	session->active_exec_pid = -1;
+
+	/* Close sockets of the session */
+	c_run_session_end(session);
 }
 
 static int
@@ -325,7 +380,8 @@ c_run_join_container(c_run_t *run)
 		ERROR("Could not join container cgroups!");
 		goto error;
 	}
-	if (ns_join_all(container_get_pid(run->container), true) < 0) {
+	if (ns_join_all_pidfd(container_get_pidfd(run->container),
+			      container_get_pid(run->container), true) < 0) {
 		ERROR("Could not set namespaces!");
 		goto error;
 	}
@@ -343,96 +399,293 @@ error:
 	return -1;
 }
 
-static int
-do_exec(c_run_session_t *session)
+/*
+ * Runs in the forked child of the exec helper. The helper has already joined
+ * the container, thus the child is created in its pid namespace. As all other
+ * descriptors are closed in the helper, errors are only visible by the exit
+ * status.
+ */
+static void
+c_run_exec_helper_child(int fd, bool pty, char *const argv[])
 {
-	IF_TRUE_GOTO(-1 == c_run_join_container(session->run), error);
+	sigset_t set;
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	// make process session leader, necessary for TIOCSCTTY
+	IF_TRUE_GOTO(setsid() == -1, error);
+	IF_TRUE_GOTO(pty && ioctl(fd, TIOCSCTTY, NULL) == -1, error);
+
+	IF_TRUE_GOTO(dup2(fd, STDIN_FILENO) == -1, error);
+	IF_TRUE_GOTO(dup2(fd, STDOUT_FILENO) == -1, error);
+	IF_TRUE_GOTO(dup2(fd, STDERR_FILENO) == -1, error);
+	if (fd > STDERR_FILENO)
+		close(fd);
 
-	TRACE("[EXEC]: Executing command %s in process with PID: %d, PGID: %d, PPID: %d",
-	      session->cmd, getpid(), getpgid(getpid()), getppid());
+	execvp(argv[0], argv);
+	_exit(127);
+error:
+	_exit(EXIT_FAILURE);
+}
 
-	if (-1 == dup2(session->pty_slave_fd, STDIN_FILENO)) {
-		ERROR("Failed to redirect stdin to cmld socket. Exiting...");
-		goto error;
-	}
+/*
+ * Serves one exec request received on sock. Returns -1 if cmld closed its end.
+ */
+static int
+c_run_exec_helper_request(int sock)
+{
+	char buf[C_RUN_EXEC_REQ_MAX_SIZE];
+	c_run_exec_req_t req;
+	c_run_exec_msg_t msg = { .type = C_RUN_EXEC_FAILED, .pid = -1, .status = EINVAL };
+	char **argv = NULL;
+	int fd;
 
-	if (-1 == dup2(session->pty_slave_fd, STDOUT_FILENO)) {
-		ERROR("Failed to redirect stdout to cmld socket. Exiting...");
-		goto error;
+	ssize_t len = sock_unix_recv_fd(sock, buf, sizeof(buf), &fd);
+	IF_TRUE_RETVAL(len <= 0, -1);
+
+	IF_TRUE_GOTO((size_t)len < sizeof(req), out);
+	memcpy(&req, buf, sizeof(req));
+	msg.id = req.id;
+	IF_TRUE_GOTO(fd < 0 || req.argc < 1 || req.argc > (size_t)len, out);
+
+	// each argument has to be NUL-terminated within the request
+	argv = mem_new0(char *, req.argc + 1);
+	char *arg = buf + sizeof(req);
+	for (uint32_t i = 0; i < req.argc; i++) {
+		char *end = memchr(arg, '\0', buf + len - arg);
+		IF_NULL_GOTO(end, out);
+		argv[i] = arg;
+		arg = end + 1;
 	}
 
-	if (-1 == dup2(session->pty_slave_fd, STDERR_FILENO)) {
-		ERROR("Failed to redirect stderr to cmld. Exiting...");
-		goto error;
+	pid_t pid = fork();
+	if (pid == -1) {
+		msg.status = errno;
+		goto out;
+	} else if (pid == 0) {
+		c_run_exec_helper_child(fd, req.pty, argv);
 	}
 
-	/*
-	 * fork again to also join the pidns, since setns does not switch
-	 * the current process into the pidns but sets the childs to be created
-	 * in the new ns.
-	 */
-	IF_TRUE_GOTO(proc_fork_and_execvp((const char *const *)session->argv) < 0, error);
-	exit(EXIT_SUCCESS);
+	msg.type = C_RUN_EXEC_STARTED;
+	msg.pid = pid;
+	msg.status = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	if (argv)
+		mem_free(argv);
+	send(sock, &msg, sizeof(msg), MSG_NOSIGNAL);
+	return 0;
+}
+
+/*
+ * Main loop of the exec helper. Afterwards joining the container, only sock is
+ * kept open. Thus the helper does not log, which could otherwise end up in a
+ * reused descriptor, but reports all results to cmld.
+ */
+static void
+c_run_exec_helper_main(c_run_t *run, pid_t cmld_pid, int sock)
+{
+	// the helper does not run the event loop of cmld
+	for (int sig = 1; sig < NSIG; sig++)
+		signal(sig, SIG_DFL);
+
+	IF_TRUE_GOTO(c_run_join_container(run) < 0, error);
+
+	// changing the credentials resets the parent death signal
+	IF_TRUE_GOTO(prctl(PR_SET_PDEATHSIG, SIGKILL) == -1, error);
+	IF_TRUE_GOTO(getppid() != cmld_pid, error);
+
+	fd_close_all_except(sock);
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	IF_TRUE_GOTO(sigprocmask(SIG_BLOCK, &set, NULL) == -1, error);
+	int sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	IF_TRUE_GOTO(sfd == -1, error);
+
+	for (;;) {
+		struct pollfd fds[] = { { .fd = sock, .events = POLLIN },
+					{ .fd = sfd, .events = POLLIN } };
+
+		if (poll(fds, ELEMENTSOF(fds), -1) == -1) {
+			IF_TRUE_GOTO(errno != EINTR, error);
+			continue;
+		}
 
+		if (fds[1].revents & POLLIN) {
+			struct signalfd_siginfo info;
+			while (read(sfd, &info, sizeof(info)) == sizeof(info))
+				;
+
+			// one SIGCHLD may stand for several exited children
+			c_run_exec_msg_t msg = { .type = C_RUN_EXEC_EXITED };
+			pid_t pid;
+			while ((pid = waitpid(-1, &msg.status, WNOHANG)) > 0) {
+				msg.pid = pid;
+				send(sock, &msg, sizeof(msg), MSG_NOSIGNAL);
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			IF_TRUE_GOTO(c_run_exec_helper_request(sock) < 0, out);
+		} else if (fds[0].revents & (POLLHUP | POLLERR)) {
+			goto out;
+		}
+	}
+out:
+	_exit(EXIT_SUCCESS);
 error:
-	ERROR_ERRNO("An error occured while trying to execute command. Giving up...");
-	exit(EXIT_FAILURE);
+	_exit(EXIT_FAILURE);
 }
 
-static int
-do_pty_exec(void *data)
+static void
+c_run_exec_helper_msg(c_run_t *run, const c_run_exec_msg_t *msg)
+{
+	c_run_session_t *session;
+
+	switch (msg->type) {
+	case C_RUN_EXEC_STARTED:
+		session = c_run_get_session_by_id(run, msg->id);
+		if (!session) {
+			// the session was closed in the meantime
+			TRACE("Killing process %d of closed session", msg->pid);
+			kill(msg->pid, SIGKILL);
+			return;
+		}
+		TRACE("Exec helper started process %d for session fd=%d", msg->pid, session->fd);
+		session->pending = false;
+		session->active_exec_pid = msg->pid;
+		break;
+	case C_RUN_EXEC_FAILED:
+		session = c_run_get_session_by_id(run, msg->id);
+		IF_NULL_RETURN(session);
+		errno = msg->status;
+		ERROR_ERRNO("Exec helper could not start '%s' in container %s", session->cmd,
+			    container_get_description(run->container));
+		c_run_session_end(session);
+		break;
+	case C_RUN_EXEC_EXITED:
+		session = c_run_get_session_by_pid(run, msg->pid);
+		IF_NULL_RETURN(session);
+		c_run_session_exited(session, msg->status);
+		break;
+	default:
+		WARN("Unknown message type %d from exec helper", msg->type);
+	}
+}
+
+static void
+c_run_exec_helper_cb(int fd, unsigned events, UNUSED event_io_t *io, void *data)
 {
 	ASSERT(data);
-	c_run_session_t *session = data;
+	c_run_t *run = data;
+	c_run_exec_msg_t msg;
+	ssize_t len;
 
-	session->active_exec_pid = getpid();
+	while ((len = recv(fd, &msg, sizeof(msg), MSG_DONTWAIT)) == sizeof(msg))
+		c_run_exec_helper_msg(run, &msg);
 
-	TRACE("[EXEC] Prepare command execution in process with PID: %d, PGID: %d", getpid(),
-	      getpgid(getpid()));
-	session->pty_slave_fd = -1;
+	if (len == -1 && (errno == EAGAIN || errno == EINTR) && !(events & EVENT_IO_EXCEPT))
+		return;
 
-	// open PTY slave
-	if (-1 == (session->pty_slave_fd = open(session->pty_slave_name, O_RDWR))) {
-		TRACE("Failed to open pty slave: %s\n", session->pty_slave_name);
-		//TODO avoid access to pty master from child ?
-		goto error;
-	}
+	// the helper is gone, e.g. killed together with the container cgroup
+	WARN("Exec helper of container %s exited", container_get_description(run->container));
+	c_run_cleanup(run);
+}
 
-	const char *current_pty = ctermid(NULL);
-	TRACE("[EXEC] Current controlling PTY is: %s\n", current_pty);
+static int
+c_run_exec_helper_start(c_run_t *run)
+{
+	IF_TRUE_RETVAL(run->helper_pid != -1, 0);
 
-	if (-1 == ioctl(STDIN_FILENO, TIOCNOTTY)) {
-		TRACE("[EXEC] Failed to release current controlling pty.\n");
+	int fd[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fd) < 0) {
+		ERROR_ERRNO("Could not create socketpair for exec helper");
+		return -1;
 	}
 
-	// make process session leader
-	// necessary for TIOCSCTTY
-	setsid();
+	pid_t cmld_pid = getpid();
+	pid_t pid = fork();
+	if (pid < 0) {
+		ERROR_ERRNO("Could not fork exec helper");
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	} else if (pid == 0) {
+		close(fd[1]);
+		c_run_exec_helper_main(run, cmld_pid, fd[0]);
+	}
+	close(fd[0]);
 
-	if (-1 == ioctl(session->pty_slave_fd, TIOCSCTTY, NULL)) {
-		ERROR("[EXEC] Failed to set controlling pty slave\n");
-		goto error;
+	run->helper_pid = pid;
+	run->helper_sock = fd[1];
+	run->helper_io = event_io_new(run->helper_sock, EVENT_IO_READ | EVENT_IO_EXCEPT,
+				      c_run_exec_helper_cb, run);
+	event_add_io(run->helper_io);
+
+	DEBUG("Started exec helper %d for container %s", pid,
+	      container_get_description(run->container));
+	return 0;
+}
+
+/*
+ * Passes the command of the session together with fd as its stdio to the
+ * exec helper. The process is started asynchronously.
+ */
+static int
+c_run_exec_helper_send(c_run_session_t *session, int fd)
+{
+	c_run_t *run = session->run;
+	c_run_exec_req_t req = { .id = run->next_id++,
+				 .pty = session->create_pty ? 1 : 0,
+				 .argc = session->argc };
+
+	size_t len = sizeof(req);
+	for (ssize_t i = 0; i < session->argc; i++)
+		len += strlen(session->argv[i]) + 1;
+	if (len > C_RUN_EXEC_REQ_MAX_SIZE) {
+		ERROR("Command line of '%s' exceeds %d bytes", session->cmd,
+		      C_RUN_EXEC_REQ_MAX_SIZE);
+		return -1;
 	}
 
-	do_exec(session);
-error:
-	TRACE("An error occurred. Exiting...");
-	exit(EXIT_FAILURE);
+	char *buf = mem_alloc(len);
+	char *arg = buf + sizeof(req);
+	memcpy(buf, &req, sizeof(req));
+	for (ssize_t i = 0; i < session->argc; i++) {
+		size_t arg_len = strlen(session->argv[i]) + 1;
+		memcpy(arg, session->argv[i], arg_len);
+		arg += arg_len;
+	}
+
+	ssize_t ret = sock_unix_send_fd(run->helper_sock, buf, len, fd);
+	mem_free(buf);
+	IF_TRUE_RETVAL(ret < 0, -1);
+
+	session->id = req.id;
+	session->pending = true;
+	return 0;
 }
 
+/*
+ * Forwards all data available on from_fd as raw bytes. pty and socket are no
+ * pipes, so splice() cannot be used here; large chunks keep the number of
+ * syscalls and of the control frames built from them low.
+ */
 static int
 readloop(int from_fd, int to_fd)
 {
 	TRACE("[EXEC] Starting read loop in process %d; from fd %d, to fd %d, PPID: %d", getpid(),
 	      from_fd, to_fd, getppid());
 
-	int count = 0;
-	char buf[1024];
+	ssize_t count = 0;
+	char buf[C_RUN_STREAM_BUF_SIZE];
 
-	while (0 < (count = read(from_fd, &buf, sizeof(buf) - 1))) {
-		buf[count] = 0;
-		TRACE("[READLOOP] Read %d bytes from fd: %d: %s", count, from_fd, buf);
-		if (write(to_fd, buf, count + 1) < 0) {
+	while (0 < (count = read(from_fd, buf, sizeof(buf)))) {
+		TRACE("[READLOOP] Read %zd bytes from fd: %d", count, from_fd);
+		if (fd_write(to_fd, buf, count) < count) {
 			TRACE_ERRNO("[READLOOP] write failed.");
 			return -1;
 		}
@@ -532,36 +785,35 @@ c_run_prepare_exec(c_run_session_t *session)
 		event_io_t *pty_master_write_io =
 			event_io_new(session->console_sock_container,
 				     EVENT_IO_READ | EVENT_IO_EXCEPT, c_run_cb_write_pty, session);
+		event_io_set_prio(pty_master_write_io, EVENT_PRIO_LOW);
 		event_add_io(pty_master_write_io);
 
 		DEBUG("Registering read callback for console socket");
 		event_io_t *pty_master_read_io =
 			event_io_new(session->pty_master, EVENT_IO_READ | EVENT_IO_EXCEPT,
 				     c_run_cb_read_pty, session);
+		// exec output may flood the loop, control commands go first
+		event_io_set_prio(pty_master_read_io, EVENT_PRIO_LOW);
 		event_add_io(pty_master_read_io);
 
-		//clone child to execute command
-		TRACE("clone child process to execute command with PTY");
-		session->active_exec_pid = do_clone(do_pty_exec, SIGCHLD, (void *)session);
-
-		if (session->active_exec_pid == -1) {
-			TRACE("Failed to fork() ...\n");
+		// the helper passes the slave on to the process as its controlling tty
+		int pty_slave_fd = open(session->pty_slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (pty_slave_fd == -1) {
+			ERROR_ERRNO("Failed to open pty slave %s", session->pty_slave_name);
 			goto error;
 		}
 
+		TRACE("Passing command with PTY to exec helper");
+		int ret = c_run_exec_helper_send(session, pty_slave_fd);
+		close(pty_slave_fd);
+		IF_TRUE_GOTO(ret < 0, error);
+
 		return 0;
 	} else {
 		// attach executed process directly to console socket
-		TRACE("Executing without PTY");
-
-		//clone child to execute command
-		TRACE("Clone child process to execute command without PTY");
-		session->active_exec_pid = do_clone(do_pty_exec, SIGCHLD, (void *)session);
-
-		if (session->active_exec_pid == -1) {
-			TRACE("Failed to fork() ...\n");
-			goto error;
-		}
+		TRACE("Passing command without PTY to exec helper");
+		IF_TRUE_GOTO(c_run_exec_helper_send(session, session->console_sock_container) < 0,
+			     error);
 
 		return 0;
 	}
@@ -583,18 +835,14 @@ c_run_exec_process(c_run_t *run, int create_pty, char *cmd, ssize_t argc, char *
 
 	run->sessions = list_append(run->sessions, session);
 
+	// the helper joins the container once and serves the following sessions as well
+	IF_TRUE_GOTO(c_run_exec_helper_start(run) < 0, error);
 	IF_TRUE_GOTO(c_run_prepare_exec(session) < 0, error);
 
-	TRACE("Registering SIGCHLD handler for injected processes");
-	event_signal_t *sig = event_signal_new(SIGCHLD, c_run_sigchld_cb, session);
-	event_add_signal(sig);
-
 	return session->fd;
 
 error:
 	TRACE("An error occurred.");
-	run->sessions = list_remove(run->sessions, session);
-	c_run_session_cleanup(session);
-	c_run_session_free(session);
+	c_run_session_end(session);
 	return -1;
 }
@@ -21,11 +21,14 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define MEM_TAG "container"
+
 #include "c_service.h"
 #include "c_service.pb-c.h"
 
 #include "container.h"
 #include "audit.h"
+#include "bcast.h"
 
 #include "common/event.h"
 #include "common/fd.h"
@@ -40,6 +43,7 @@
 
 // clang-format off
 #define C_SERVICE_SOCKET SOCK_PATH(service)
+#define C_SERVICE_BCAST_SOCKET SOCK_PATH(service-bcast)
 // clang-format on
 
 //#undef LOGF_LOG_MIN_PRIO
@@ -48,13 +52,23 @@
 struct c_service {
 	container_t *container; // weak reference
 	int sock;
-	int sock_connected;
+	protobuf_conn_t *conn; // connection of the TrustmeService
 	event_io_t *event_io_sock;
-	event_io_t *event_io_sock_connected;
 	container_connectivity_t connectivity;
 	container_callback_t *connectivity_observer;
+	int bcast_sock; // hands out the broadcast page, see bcast.h
+	event_io_t *event_io_bcast;
+	int bcast_efd; // signaled on changes of the broadcast page
 };
 
+static int
+c_service_send_proto(c_service_t *service, const ProtobufCMessage *message)
+{
+	IF_NULL_RETVAL_TRACE(service->conn, -1);
+
+	return protobuf_conn_send_message(service->conn, message);
+}
+
 static int
 c_service_send_container_cfg_name_proto(c_service_t *service)
 {
@@ -70,7 +84,7 @@ c_service_send_container_cfg_name_proto(c_service_t *service)
 
 	message_proto.container_cfg_name = mem_strdup(container_get_name(service->container));
 
-	ret = protobuf_send_message(service->sock_connected, (ProtobufCMessage *)&message_proto);
+	ret = c_service_send_proto(service, (ProtobufCMessage *)&message_proto);
 
 	mem_free(message_proto.container_cfg_name);
 	return ret;
@@ -82,17 +96,21 @@ c_service_send_container_cfg_dns_proto(c_service_t *service)
 	ASSERT(service);
 	int ret = -1;
 
-	INFO("Sending container config dns %s to container %s",
-	     container_get_dns_server(service->container),
+	// prefer the caching forwarder of cmld over the upstream server itself
+	char *dns = container_get_dns_forwarder_new(service->container);
+	if (!dns)
+		dns = mem_strdup(container_get_dns_server(service->container));
+
+	INFO("Sending container config dns %s to container %s", dns,
 	     container_get_description(service->container));
 
 	/* fill connectivity and send to TrustmeService */
 	CmldToServiceMessage message_proto = CMLD_TO_SERVICE_MESSAGE__INIT;
 	message_proto.code = CMLD_TO_SERVICE_MESSAGE__CODE__CONTAINER_CFG_DNS;
 
-	message_proto.container_cfg_dns = mem_strdup(container_get_dns_server(service->container));
+	message_proto.container_cfg_dns = dns;
 
-	ret = protobuf_send_message(service->sock_connected, (ProtobufCMessage *)&message_proto);
+	ret = c_service_send_proto(service, (ProtobufCMessage *)&message_proto);
 
 	mem_free(message_proto.container_cfg_dns);
 	return ret;
@@ -216,7 +234,11 @@ c_service_handle_received_message(c_service_t *service, const ServiceToCmldMessa
 		INFO("Got ACK from Container %s",
 		     uuid_string(container_get_uuid(service->container)));
 
-		if (0 > container_audit_process_ack(service->container, message->audit_ack)) {
+		if (0 > container_audit_process_ack(
+				service->container, message->audit_ack,
+				message->has_audit_ack_seq ? message->audit_ack_seq : 0,
+				message->has_audit_window ? message->audit_window : 0,
+				message->has_audit_batch ? message->audit_batch : 0)) {
 			ERROR("Failed to process audit ACK from container %s",
 			      uuid_string(container_get_uuid(service->container)));
 		}
@@ -234,38 +256,28 @@ c_service_handle_received_message(c_service_t *service, const ServiceToCmldMessa
  * to the _connected_ socket.
  */
 static void
-c_service_cb_receive_message(int fd, unsigned events, event_io_t *io, void *data)
+c_service_cb_receive_message(UNUSED protobuf_conn_t *conn, ProtobufCMessage *msg, void *data)
 {
 	TRACE("Callback c_service_cb_receive_message has been invoked");
 
 	c_service_t *service = data;
 
-	if (events & EVENT_IO_READ) {
-		ServiceToCmldMessage *message = (ServiceToCmldMessage *)protobuf_recv_message(
-			fd, &service_to_cmld_message__descriptor);
-		// close connection if client EOF, or protocol parse error
-		IF_NULL_GOTO_TRACE(message, connection_err);
+	c_service_handle_received_message(service, (ServiceToCmldMessage *)msg);
+}
 
-		c_service_handle_received_message(service, message);
-		protobuf_c_message_free_unpacked((ProtobufCMessage *)message, NULL);
-	}
+/**
+ * Invoked on client EOF, protocol parse error or exception on the connected socket.
+ */
+static void
+c_service_cb_conn_closed(protobuf_conn_t *conn, void *data)
+{
+	c_service_t *service = data;
 
-	// also check EXCEPT flag
-	if (events & EVENT_IO_EXCEPT) {
-		WARN("Exception on connected socket to TrustmeService; "
-		     "closing socket and deregistering c_service_cb_receive_message");
-		goto connection_err;
-	}
-	return;
+	WARN("Connection to TrustmeService of %s closed",
+	     container_get_description(service->container));
 
-connection_err:
-	event_remove_io(io);
-	event_io_free(io);
-	service->event_io_sock_connected = NULL;
-	if (close(fd) < 0)
-		WARN_ERRNO("Failed to close connected service socket");
-	service->sock_connected = -1;
-	return;
+	protobuf_conn_free(conn);
+	service->conn = NULL;
 }
 
 /**
@@ -283,18 +295,23 @@ c_service_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
 
 	IF_FALSE_RETURN(events & EVENT_IO_READ);
 
-	if ((service->sock_connected = sock_unix_accept(fd)) < 0)
+	int sock_connected = sock_unix_accept(fd);
+	if (sock_connected < 0)
 		goto error;
 
-	TRACE("Accepted connection %d from %s", service->sock_connected,
+	TRACE("Accepted connection %d from %s", sock_connected,
 	      container_get_description(service->container));
 
-	service->event_io_sock_connected = event_io_new(service->sock_connected, EVENT_IO_READ,
-							&c_service_cb_receive_message, service);
-	event_add_io(service->event_io_sock_connected);
+	// a reconnecting TrustmeService replaces its old connection
+	protobuf_conn_free(service->conn);
+	service->conn = protobuf_conn_new(sock_connected, &service_to_cmld_message__descriptor,
+					  &c_service_cb_receive_message, &c_service_cb_conn_closed,
+					  service);
+	if (!service->conn)
+		close(sock_connected);
 
 	// We leave service->sock open so the TrustmeService could connect
-	// again in the future in case service->sock_connected gets closed.
+	// again in the future in case service->conn gets closed.
 
 	return;
 
@@ -309,6 +326,45 @@ error:
 	return;
 }
 
+/**
+ * Invoked when the TrustmeService connects to fetch the broadcast page. The
+ * read-only page and the eventfd announcing its changes are passed and the
+ * connection is closed right away.
+ */
+static void
+c_service_cb_accept_bcast(int fd, unsigned events, event_io_t *io, void *data)
+{
+	c_service_t *service = data;
+
+	if (events & EVENT_IO_EXCEPT) {
+		WARN("Exception on broadcast socket of %s; closing socket",
+		     container_get_description(service->container));
+		event_remove_io(io);
+		event_io_free(io);
+		service->event_io_bcast = NULL;
+		if (close(fd) < 0)
+			WARN_ERRNO("Failed to close broadcast socket");
+		service->bcast_sock = -1;
+		return;
+	}
+
+	IF_FALSE_RETURN(events & EVENT_IO_READ);
+
+	int sock_connected = sock_unix_accept(fd);
+	IF_TRUE_RETURN(sock_connected < 0);
+
+	char tag = 0;
+	if (bcast_get_fd() < 0 || service->bcast_efd < 0 ||
+	    sock_unix_send_fd(sock_connected, &tag, 1, bcast_get_fd()) != 1 ||
+	    sock_unix_send_fd(sock_connected, &tag, 1, service->bcast_efd) != 1)
+		WARN("Could not pass broadcast page to %s",
+		     container_get_description(service->container));
+	else
+		DEBUG("Passed broadcast page to %s", container_get_description(service->container));
+
+	close(sock_connected);
+}
+
 static int
 c_service_send_connectivity_proto(c_service_t *service, container_connectivity_t connectivity)
 {
@@ -324,7 +380,7 @@ c_service_send_connectivity_proto(c_service_t *service, container_connectivity_t
 	message_proto.has_connectivity = true;
 	message_proto.connectivity = (const ContainerConnectivity)connectivity;
 
-	return protobuf_send_message(service->sock_connected, (ProtobufCMessage *)&message_proto);
+	return c_service_send_proto(service, (ProtobufCMessage *)&message_proto);
 }
 
 static void
@@ -353,38 +409,41 @@ c_service_new(container_t *container)
 	c_service_t *service = mem_new0(c_service_t, 1);
 	service->container = container;
 	service->sock = -1;
-	service->sock_connected = -1;
+	service->conn = NULL;
 	service->event_io_sock = NULL;
-	service->event_io_sock_connected = NULL;
 
 	service->connectivity = CONTAINER_CONNECTIVITY_OFFLINE;
 	service->connectivity_observer = NULL;
+	service->bcast_sock = -1;
+	service->event_io_bcast = NULL;
+	service->bcast_efd = -1;
 
 	return service;
 }
 
 void
-c_service_cleanup(c_service_t *service)
+c_service_disconnect(c_service_t *service)
 {
 	ASSERT(service);
 
-	if (service->sock_connected > 0) {
-		if (close(service->sock_connected) < 0) {
-			WARN_ERRNO("Failed to close connected service socket");
-		}
-		service->sock_connected = -1;
+	if (service->conn) {
+		protobuf_conn_free(service->conn);
+		service->conn = NULL;
 	}
+}
+
+void
+c_service_cleanup(c_service_t *service)
+{
+	ASSERT(service);
+
+	c_service_disconnect(service);
 	if (service->sock > 0) {
 		if (close(service->sock) < 0) {
 			WARN_ERRNO("Failed to close service socket");
 		}
 		service->sock = -1;
 	}
-	if (service->event_io_sock_connected) {
-		event_remove_io(service->event_io_sock_connected);
-		event_io_free(service->event_io_sock_connected);
-		service->event_io_sock_connected = NULL;
-	}
 	if (service->event_io_sock) {
 		event_remove_io(service->event_io_sock);
 		event_io_free(service->event_io_sock);
@@ -394,6 +453,18 @@ c_service_cleanup(c_service_t *service)
 		container_unregister_observer(service->container, service->connectivity_observer);
 		service->connectivity_observer = NULL;
 	}
+	if (service->event_io_bcast) {
+		event_remove_io(service->event_io_bcast);
+		event_io_free(service->event_io_bcast);
+		service->event_io_bcast = NULL;
+	}
+	if (service->bcast_sock >= 0) {
+		if (close(service->bcast_sock) < 0)
+			WARN_ERRNO("Failed to close broadcast socket");
+		service->bcast_sock = -1;
+	}
+	bcast_unsubscribe(service->bcast_efd);
+	service->bcast_efd = -1;
 }
 
 int
@@ -421,6 +492,12 @@ c_service_start_pre_clone(c_service_t *service)
 	ASSERT(service);
 
 	service->sock = sock_unix_create(SOCK_STREAM);
+	IF_TRUE_RETVAL(service->sock < 0, -1);
+
+	// without the broadcast page, the TrustmeService still works on messages
+	if ((service->bcast_sock = sock_unix_create(SOCK_STREAM)) < 0)
+		WARN("Could not create broadcast socket for %s",
+		     container_get_description(service->container));
 
 	return service->sock;
 }
@@ -430,22 +507,29 @@ c_service_start_child(c_service_t *service)
 {
 	ASSERT(service);
 
+	if (service->bcast_sock >= 0 &&
+	    sock_unix_bind(service->bcast_sock, C_SERVICE_BCAST_SOCKET) < 0)
+		WARN("Could not bind broadcast socket");
+
 	return sock_unix_bind(service->sock, C_SERVICE_SOCKET);
 }
 
-int
-c_service_start_pre_exec(c_service_t *service)
+static int
+c_service_watch(c_service_t *service)
 {
-	ASSERT(service);
-
-	if (sock_unix_listen(service->sock) < 0)
-		return -1;
-
 	// Now wait for initial connect from TrustmeService to socket.
 	service->event_io_sock =
 		event_io_new(service->sock, EVENT_IO_READ, &c_service_cb_accept, service);
 	event_add_io(service->event_io_sock);
 
+	if (service->bcast_sock >= 0) {
+		if (service->bcast_efd < 0)
+			service->bcast_efd = bcast_subscribe();
+		service->event_io_bcast = event_io_new(service->bcast_sock, EVENT_IO_READ,
+						       &c_service_cb_accept_bcast, service);
+		event_add_io(service->event_io_bcast);
+	}
+
 	/* register connectivity observer */
 	service->connectivity_observer = container_register_observer(
 		service->container, &c_service_connectivity_observer_cb, service);
@@ -457,6 +541,51 @@ c_service_start_pre_exec(c_service_t *service)
 	return 0;
 }
 
+int
+c_service_start_pre_exec(c_service_t *service)
+{
+	ASSERT(service);
+
+	if (sock_unix_listen(service->sock) < 0)
+		return -1;
+	if (service->bcast_sock >= 0 && sock_unix_listen(service->bcast_sock) < 0) {
+		close(service->bcast_sock);
+		service->bcast_sock = -1;
+	}
+
+	return c_service_watch(service);
+}
+
+void
+c_service_get_socks(const c_service_t *service, int *sock, int *conn, int *bcast_sock)
+{
+	ASSERT(service);
+
+	*sock = service->sock;
+	*conn = service->conn ? protobuf_conn_get_fd(service->conn) : -1;
+	*bcast_sock = service->bcast_sock;
+}
+
+int
+c_service_adopt(c_service_t *service, int sock, int conn, int bcast_sock)
+{
+	ASSERT(service);
+	IF_TRUE_RETVAL(sock < 0, -1);
+
+	service->sock = sock;
+	service->bcast_sock = bcast_sock;
+	if (conn >= 0) {
+		service->conn = protobuf_conn_new(conn, &service_to_cmld_message__descriptor,
+						  &c_service_cb_receive_message,
+						  &c_service_cb_conn_closed, service);
+		// the TrustmeService reconnects to the listening socket
+		if (!service->conn)
+			close(conn);
+	}
+
+	return c_service_watch(service);
+}
+
 /**
  * Helper function that generates and sends a protobuf message to the Trustme Service.
  */
@@ -468,8 +597,7 @@ c_service_send_message_proto(c_service_t *service, unsigned int code)
 	CmldToServiceMessage message_proto = CMLD_TO_SERVICE_MESSAGE__INIT;
 	message_proto.code = code;
 
-	int ret =
-		protobuf_send_message(service->sock_connected, (ProtobufCMessage *)&message_proto);
+	int ret = c_service_send_proto(service, (ProtobufCMessage *)&message_proto);
 
 	return ret;
 }
@@ -482,7 +610,7 @@ c_service_audit_send_record(c_service_t *service, const uint8_t *buf, uint32_t b
 	TRACE("Trying to send packed audit record of size %u to container %s", buf_len,
 	      uuid_string(container_get_uuid(service->container)));
 
-	if (-1 == protobuf_send_message_packed(service->sock_connected, buf, buf_len)) {
+	if (!service->conn || -1 == protobuf_conn_send_message_packed(service->conn, buf, buf_len)) {
 		ERROR("Failed to send packed audit record to container %s",
 		      uuid_string(container_get_uuid(service->container)));
 		return -1;
@@ -501,7 +629,7 @@ c_service_audit_notify(c_service_t *service, uint64_t remaining_storage)
 
 	message_proto.audit_remaining_storage = remaining_storage;
 
-	return protobuf_send_message(service->sock_connected, (ProtobufCMessage *)&message_proto);
+	return c_service_send_proto(service, (ProtobufCMessage *)&message_proto);
 }
 
 int
@@ -510,7 +638,7 @@ c_service_send_message(c_service_t *service, c_service_message_t message)
 	DEBUG("Sending message");
 	ASSERT(service);
 
-	if (service->sock_connected < 0) {
+	if (!service->conn) {
 		WARN("Trying to send message `%d' to Trustme Service but socket is not connected. "
 		     "We ignore this for now because the Trustme Service is probably still booting...",
 		     message);
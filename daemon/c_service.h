@@ -79,6 +79,13 @@ c_service_cleanup(c_service_t *service);
 int
 c_service_stop(c_service_t *service);
 
+/**
+ * Closes the connection to the TrustmeService but keeps the socket it connects
+ * to, so that the service could connect again, e.g. after a restore.
+ */
+void
+c_service_disconnect(c_service_t *service);
+
 /**
  * Frees the service object. Calls the cleanup function first.
  *
@@ -115,6 +122,31 @@ c_service_start_child(c_service_t *service);
 int
 c_service_start_pre_exec(c_service_t *service);
 
+/**
+ * Returns the listening socket and the connection of the TrustmeService, e.g.
+ * to hand them over to a new cmld instance.
+ *
+ * @param service The service object of the associated container.
+ * @param sock Set to the listening socket, -1 if there is none.
+ * @param conn Set to the connected socket, -1 if the TrustmeService is not connected.
+ * @param bcast_sock Set to the listening socket for the broadcast page, -1 if there is none.
+ */
+void
+c_service_get_socks(const c_service_t *service, int *sock, int *conn, int *bcast_sock);
+
+/**
+ * Takes over the sockets of the TrustmeService of a running container from a
+ * previous cmld instance instead of the start hooks.
+ *
+ * @param service The service object of the associated container.
+ * @param sock The listening socket bound inside the container.
+ * @param conn The connected socket or -1 if the TrustmeService is not connected.
+ * @param bcast_sock The listening socket for the broadcast page or -1.
+ * @return 0 on success, -1 on error.
+ */
+int
+c_service_adopt(c_service_t *service, int sock, int conn, int bcast_sock);
+
 /**
  * Send packed audit record to service.
  * @param service The service object of the associated container.
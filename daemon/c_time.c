@@ -22,6 +22,9 @@
  */
 
 #define _GNU_SOURCE
+
+#define MEM_TAG "container"
+
 #include "c_time.h"
 
 #include "common/macro.h"
@@ -42,7 +45,7 @@
 struct c_time {
 	const container_t *container;
 	bool ns_time;
-	time_t time_started;
+	long boottime_started; ///< CLOCK_BOOTTIME of the host at container start, -1 if stopped
 	time_t time_created;
 };
 
@@ -89,7 +92,7 @@ c_time_new(container_t *container)
 	c_time_t *time = mem_new0(c_time_t, 1);
 	time->container = container;
 	time->ns_time = file_exists("/proc/self/ns/time");
-	time->time_started = -1;
+	time->boottime_started = -1;
 	time->time_created = c_time_get_creation_time_from_file(time);
 	return time;
 }
@@ -134,12 +137,11 @@ c_time_start_pre_exec(const c_time_t *time)
 	long boottime = c_time_get_clock_secs(CLOCK_BOOTTIME);
 	long monotonic = c_time_get_clock_secs(CLOCK_MONOTONIC);
 
-	if (file_printf(path_timens_offsets, "boottime -%ld 0", boottime) == -1) {
-		ERROR_ERRNO("Could not reset boottime -%ld 0", boottime);
-		goto error;
-	}
-	if (file_printf(path_timens_offsets, "monotonic -%ld 0", monotonic) == -1) {
-		ERROR_ERRNO("Could not reset monotonic -%ld 0", monotonic);
+	// the kernel applies all offsets of a single write at once
+	if (file_printf(path_timens_offsets, "boottime -%ld 0\nmonotonic -%ld 0\n", boottime,
+			monotonic) == -1) {
+		ERROR_ERRNO("Could not reset boottime -%ld 0 and monotonic -%ld 0", boottime,
+			    monotonic);
 		goto error;
 	}
 	INFO("Successfully updated timens offsets in new time namespace");
@@ -155,7 +157,7 @@ int
 c_time_start_post_exec(c_time_t *_time)
 {
 	ASSERT(_time);
-	_time->time_started = time(NULL);
+	_time->boottime_started = c_time_get_clock_secs(CLOCK_BOOTTIME);
 	return 0;
 }
 
@@ -194,20 +196,32 @@ c_time_get_creation_time(const c_time_t *time)
 	return time->time_created;
 }
 
+/*
+ * The uptime is derived from CLOCK_BOOTTIME of the host, which advances like
+ * the CLOCK_BOOTTIME of the container in its time namespace. Unlike the wall
+ * clock, it does not jump if a container with CAP_SYS_TIME sets the time.
+ */
 time_t
 c_time_get_uptime(const c_time_t *_time)
 {
 	ASSERT(_time);
-	if (_time->time_started < 0)
+	if (_time->boottime_started < 0)
 		return 0;
 
-	time_t uptime = time(NULL) - _time->time_started;
+	long uptime = c_time_get_clock_secs(CLOCK_BOOTTIME) - _time->boottime_started;
 	return (uptime < 0) ? 0 : uptime;
 }
 
+void
+c_time_adopt(c_time_t *_time, time_t uptime)
+{
+	ASSERT(_time);
+	_time->boottime_started = c_time_get_clock_secs(CLOCK_BOOTTIME) - uptime;
+}
+
 void
 c_time_cleanup(c_time_t *time)
 {
 	ASSERT(time);
-	time->time_started = -1;
+	time->boottime_started = -1;
 }
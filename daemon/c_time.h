@@ -63,6 +63,13 @@ c_time_start_post_exec(c_time_t *time);
 int
 c_time_start_pre_exec_child(const c_time_t *time);
 
+/**
+ * Restores the start time of a running container adopted from a previous cmld
+ * instance from its uptime.
+ */
+void
+c_time_adopt(c_time_t *time, time_t uptime);
+
 void
 c_time_cleanup(c_time_t *time);
 
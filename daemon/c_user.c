@@ -22,20 +22,31 @@
  */
 
 #define _GNU_SOURCE
+
+#define MEM_TAG "container"
+
 #include "c_user.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/mount.h>
 #include <sched.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
 #include "common/macro.h"
 #include "common/mem.h"
+#include "common/bitmap.h"
 #include "common/file.h"
 #include "common/dir.h"
 #include "common/ns.h"
@@ -55,10 +66,47 @@
 
 #define SHIFTFS_DIR "/tmp/shiftfs"
 
+// marks a tree which was already chowned to the uid range starting at its value
+#define C_USER_SHIFT_XATTR "trusted.cml.shift_uid"
+
+/* Define the new mount api for idmapped mounts (Linux 5.12) if missing in libc */
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOUNT_ATTR_IDMAP
+#define MOUNT_ATTR_IDMAP 0x00100000
+#endif
+
+struct c_user_mount_attr {
+	uint64_t attr_set;
+	uint64_t attr_clr;
+	uint64_t propagation;
+	uint64_t userns_fd;
+};
+
 struct c_user_shift {
 	char *target;
 	char *mark;
 	bool is_root;
+	bool is_bind; // mark is a bind mount, e.g. idmapped, and not a shiftfs mark
 };
 
 /* User structure with specific usernamespace mappings */
@@ -66,81 +114,136 @@ struct c_user {
 	container_t *container; //!< container which the c_user struct is associated to
 	bool ns_usr;		//!< indicates if the c_user structure has an user namespace
 	int offset;		//!< gives information about the uid mapping to be set
+	int offset_reserved;	//!< offset stored in the container store and reserved for it
 	int uid_start;		//!< this is the start of uids and gids in the root namespace
 	list_t *marks;		//marks to be mounted in userns
 	int mark_index;
 	int fd_userns;
 	char *ns_path;
+	bool adopted; //!< the userns of a zygote is used for the current start
+	int fd_idmap; //!< userns with the uid mapping of the container for idmapped mounts
 };
 
 /**
- * bool array, which globally holds assigend ranges in order to
- * determine a new offset for a starting container.
- * uid_offsets[i]==true means that a container holds this offset to get its
- * specific uid range
+ * Bitmaps, which globally hold the offsets of the uid ranges. A set bit i in
+ * uid_offsets means that a running container holds this offset to get its
+ * specific uid range. A set bit i in uid_offsets_reserved means that a
+ * container stored this offset in the container store, thus other containers
+ * avoid it and the container gets the same uid range on its next start.
  */
-static bool *uid_offsets = NULL;
+static bitmap_t *uid_offsets = NULL;
+static bitmap_t *uid_offsets_reserved = NULL;
+
+static void
+c_user_offsets_init(void)
+{
+	if (uid_offsets)
+		return;
+
+	uid_offsets = bitmap_new(MAX_UID_RANGES);
+	uid_offsets_reserved = bitmap_new(MAX_UID_RANGES);
+}
 
 /**
- * sets the offset at the specified position to false.
+ * sets the offset at the specified position to free.
  * indicates that a container releases its addresses.
  */
 static void
 c_user_unset_offset(int offset)
 {
+	IF_TRUE_RETURN(offset < 0);
 	ASSERT(offset < MAX_UID_RANGES);
 	TRACE("UID offset %d released by a container", offset);
-	IF_TRUE_RETURN(offset == -1);
 
-	uid_offsets[offset] = false;
+	bitmap_clear(uid_offsets, offset);
 }
 
 /**
- * determines first free slot and occupies it. Also responsible for allocating the offsets array.
+ * determines first free slot and occupies it. Offsets reserved by other
+ * containers are only taken if all other offsets are in use.
  * @return failure, return -1, else return first free offset
  */
 static int
 c_user_set_next_offset(void)
 {
-	if (!uid_offsets) {
-		uid_offsets = mem_new0(bool, MAX_UID_RANGES);
-		uid_offsets[0] = true;
-		TRACE("UID offset 0 ocupied by a container");
-		return 0;
-	}
-
-	for (int i = 0; i < MAX_UID_RANGES; i++) {
-		if (!uid_offsets[i]) {
-			TRACE("UID offset %d occupied by a container", i);
-			uid_offsets[i] = true;
-			return i;
-		}
+	c_user_offsets_init();
+
+	ssize_t offset =
+		bitmap_find_zero(2, (const bitmap_t *const[]){ uid_offsets, uid_offsets_reserved });
+	if (offset < 0)
+		offset = bitmap_find_zero(1, (const bitmap_t *const[]){ uid_offsets });
+	if (offset < 0) {
+		DEBUG("Unable to provide a valid uid/gid range for c_user");
+		return -1;
 	}
 
-	DEBUG("Unable to provide a valid uid/gid range for c_user");
-	return -1;
+	TRACE("UID offset %zd occupied by a container", offset);
+	bitmap_set(uid_offsets, offset);
+	return offset;
 }
 
 /**
- * determines first free slot and occupies it. Also responsible for allocating the offsets array.
+ * occupies the requested offset if it is free.
  * @return failure, return -1, else return the requested offest if its free
  */
 static int
 c_user_set_offset(int offset)
 {
-	if (!uid_offsets)
-		uid_offsets = mem_new0(bool, MAX_UID_RANGES);
+	c_user_offsets_init();
 
-	if (uid_offsets[offset]) {
+	if (bitmap_test(uid_offsets, offset)) {
 		ERROR("UID offset %d allready taken by a container", offset);
 		return -1;
 	}
 
 	TRACE("UID offset %d now occupied by a container", offset);
-	uid_offsets[offset] = true;
+	bitmap_set(uid_offsets, offset);
 	return offset;
 }
 
+/**
+ * Reads the offset of the container from the container store.
+ * @return the stored offset or -1 if there is none
+ */
+static int
+c_user_read_offset(const c_user_t *user)
+{
+	char *file_name_uid = mem_printf("%s.uid", container_get_images_dir(user->container));
+	int offset = -1;
+
+	if (file_exists(file_name_uid) &&
+	    file_read(file_name_uid, (char *)&offset, sizeof(offset)) < 0) {
+		WARN("Failed to restore uid for container %s",
+		     uuid_string(container_get_uuid(user->container)));
+		offset = -1;
+	}
+	mem_free(file_name_uid);
+
+	return (offset >= 0 && offset < MAX_UID_RANGES) ? offset : -1;
+}
+
+/**
+ * Reserves offset for the container, replacing its former reservation,
+ * unless the offset is reserved by another container.
+ */
+static void
+c_user_reserve_offset(c_user_t *user, int offset)
+{
+	IF_TRUE_RETURN(offset == user->offset_reserved);
+
+	c_user_offsets_init();
+	if (offset >= 0 && bitmap_test(uid_offsets_reserved, offset)) {
+		DEBUG("UID offset %d is reserved by another container", offset);
+		return;
+	}
+
+	if (user->offset_reserved >= 0)
+		bitmap_clear(uid_offsets_reserved, user->offset_reserved);
+	if (offset >= 0)
+		bitmap_set(uid_offsets_reserved, offset);
+	user->offset_reserved = offset;
+}
+
 /**
  * This function determines and sets the next available uid range, depending on the container offset.
  */
@@ -149,32 +252,32 @@ c_user_set_next_uid_range_start(c_user_t *user)
 {
 	ASSERT(user);
 
-	char *file_name_uid = mem_printf("%s.uid", container_get_images_dir(user->container));
-	int offset = -1;
-	if (file_exists(file_name_uid)) {
-		if (file_read(file_name_uid, (char *)&offset, sizeof(offset)) < 0) {
-			WARN("Failed to restore uid for container %s",
-			     uuid_string(container_get_uuid(user->container)));
-		}
-	}
+	int offset = user->offset;
 
-	// try to use stored uid
-	if (offset > -1)
-		offset = c_user_set_offset(offset);
+	// try to use the reserved uid, i.e., the stored one if no other container has it
+	if (offset < 0 && user->offset_reserved >= 0)
+		offset = c_user_set_offset(user->offset_reserved);
 
-	if (offset == -1) {
-		INFO("Restored uid already taken, generating new one");
+	if (offset < 0) {
+		if (user->offset_reserved >= 0)
+			INFO("Restored uid already taken, generating new one");
 		offset = c_user_set_next_offset();
 		IF_TRUE_RETVAL(offset < 0, -1);
+
+		char *file_name_uid =
+			mem_printf("%s.uid", container_get_images_dir(user->container));
 		if (file_write(file_name_uid, (char *)&offset, sizeof(offset)) < 0) {
 			WARN("Failed to store uid %d for container %s", offset,
 			     uuid_string(container_get_uuid(user->container)));
 		}
+		mem_free(file_name_uid);
+		c_user_reserve_offset(user, offset);
 	}
 	user->offset = offset;
 
 	user->uid_start = UID_RANGES_START + (user->offset * UID_RANGE);
 	DEBUG("Next free uid/gid map start is: %u", user->uid_start);
+	cmld_containers_uid_changed();
 
 	return 0;
 }
@@ -201,6 +304,13 @@ c_user_new(container_t *container, bool user_ns)
 	user->container = container;
 	user->ns_usr = user_ns;
 	user->uid_start = 0;
+	user->fd_idmap = -1;
+	user->offset = -1;
+	user->offset_reserved = -1;
+
+	// keep the stored uid range for the container, even if it is not running
+	if (user_ns)
+		c_user_reserve_offset(user, c_user_read_offset(user));
 
 	// path to bind userns (used for reboots)
 	dir_mkdir_p("/var/run/userns", 00755);
@@ -216,15 +326,15 @@ c_user_new(container_t *container, bool user_ns)
  * Setup mappings for uids and gids
  */
 static int
-c_user_setup_mapping(const c_user_t *user)
+c_user_setup_mapping(const c_user_t *user, pid_t pid)
 {
 	ASSERT(user);
 
 	char *uid_mapping = mem_printf(C_USER_MAP_FORMAT, 0, user->uid_start, UID_MAX);
 	INFO("mapping: '%s'", uid_mapping);
 
-	char *uid_map_path = mem_printf(C_USER_UID_MAP_PATH, container_get_pid(user->container));
-	char *gid_map_path = mem_printf(C_USER_GID_MAP_PATH, container_get_pid(user->container));
+	char *uid_map_path = mem_printf(C_USER_UID_MAP_PATH, pid);
+	char *gid_map_path = mem_printf(C_USER_GID_MAP_PATH, pid);
 
 	// write mapping to proc
 	if (file_printf(uid_map_path, "%s", uid_mapping) == -1) {
@@ -280,6 +390,8 @@ c_user_cleanup(c_user_t *user, bool is_rebooting)
 	if (!user->ns_usr)
 		return;
 
+	user->adopted = false;
+
 	/* skip on reboots of c0 */
 	if (is_rebooting && (cmld_containers_get_c0() == user->container))
 		return;
@@ -290,8 +402,13 @@ c_user_cleanup(c_user_t *user, bool is_rebooting)
 		close(user->fd_userns);
 		user->fd_userns = -1;
 	}
+	if (user->fd_idmap >= 0) {
+		close(user->fd_idmap);
+		user->fd_idmap = -1;
+	}
 
 	c_user_unset_offset(user->offset);
+	user->offset = -1;
 
 	// cleanup left-over marks in main cmld process
 	const char *uuid = uuid_string(container_get_uuid(user->container));
@@ -310,6 +427,7 @@ void
 c_user_free(c_user_t *user)
 {
 	ASSERT(user);
+	c_user_reserve_offset(user, -1);
 	mem_free(user->ns_path);
 	mem_free(user);
 }
@@ -322,48 +440,70 @@ c_user_get_uid(const c_user_t *user)
 }
 
 static int
-c_user_chown_dev_cb(const char *path, const char *file, void *data)
+c_user_chown_cb(int dirfd, const char *name, const struct stat *s, void *data)
 {
-	struct stat s;
-	int ret = 0;
 	c_user_t *user = data;
 	ASSERT(user);
 
-	char *file_to_chown = mem_printf("%s/%s", path, file);
-	if (lstat(file_to_chown, &s) == -1) {
-		mem_free(file_to_chown);
+	// modulo operation avoids shifting twice
+	uid_t uid = s->st_uid % UID_RANGE + user->uid_start;
+	gid_t gid = s->st_gid % UID_RANGE + user->uid_start;
+
+	if (s->st_uid == uid && s->st_gid == gid)
+		return 0;
+
+	if (fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+		ERROR_ERRNO("Could not chown '%s' to (%d:%d)", name, uid, gid);
 		return -1;
 	}
+	TRACE("Chown file '%s' to (%d:%d) (uid_start %d)", name, uid, gid, user->uid_start);
 
-	// modulo operation avoids shifting twice
-	uid_t uid = s.st_uid % UID_RANGE + user->uid_start;
-	gid_t gid = s.st_gid % UID_RANGE + user->uid_start;
-
-	if (file_is_dir(file_to_chown)) {
-		TRACE("Path %s is dir", file_to_chown);
-		if (dir_foreach(file_to_chown, &c_user_chown_dev_cb, user) < 0) {
-			ERROR_ERRNO("Could not chown all dir contents in '%s'", file_to_chown);
-			ret--;
-		}
-		if (chown(file_to_chown, uid, gid) < 0) {
-			ERROR_ERRNO("Could not chown dir '%s' to (%d:%d)", file_to_chown, uid, gid);
-			ret--;
-		}
-	} else {
-		if (lchown(file_to_chown, uid, gid) < 0) {
-			ERROR_ERRNO("Could not chown file '%s' to (%d:%d)", file_to_chown, uid,
-				    gid);
-			ret--;
-		}
+	// chown drops the set-user/group-ID bits, restore them
+	if (S_ISREG(s->st_mode) && (s->st_mode & (S_ISUID | S_ISGID)) &&
+	    fchmodat(dirfd, name, s->st_mode & 07777, 0) < 0) {
+		ERROR_ERRNO("Could not restore mode of '%s'", name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Shifts the uids and gids of path and all files below it to the uid range
+ * of the container. If marked is set, the shift is recorded by an xattr on
+ * path and skipped in case the tree was already shifted to the same range.
+ */
+static int
+c_user_chown_tree(const c_user_t *user, const char *path, bool marked)
+{
+	char *uid_str = mem_printf("%d", user->uid_start);
+	char value[16] = { 0 };
+	struct stat s;
+	int ret = -1;
+
+	if (marked && getxattr(path, C_USER_SHIFT_XATTR, value, sizeof(value) - 1) > 0 &&
+	    !strcmp(value, uid_str)) {
+		INFO("'%s' already shifted to uid %s, skipping chown", path, uid_str);
+		ret = 0;
+		goto out;
+	}
+
+	if (lstat(path, &s) < 0) {
+		ERROR_ERRNO("Could not stat '%s'", path);
+		goto out;
 	}
-	INFO("Chown file '%s' to (%d:%d) (uid_start %d)", file_to_chown, uid, gid, user->uid_start);
+	IF_TRUE_GOTO(c_user_chown_cb(AT_FDCWD, path, &s, (void *)user) < 0, out);
 
-	// chown .
-	if (chown(path, uid, gid) < 0) {
-		ERROR_ERRNO("Could not chown dir '%s' to (%d:%d)", path, uid, gid);
-		ret--;
+	if (dir_walk_parallel(path, &c_user_chown_cb, (void *)user, 0) < 0) {
+		ERROR("Could not chown %s to target uid:gid (%d:%d)", path, user->uid_start,
+		      user->uid_start);
+		goto out;
 	}
-	mem_free(file_to_chown);
+
+	if (marked && setxattr(path, C_USER_SHIFT_XATTR, uid_str, strlen(uid_str), 0) < 0)
+		WARN_ERRNO("Could not mark '%s' as shifted", path);
+	ret = 0;
+out:
+	mem_free(uid_str);
 	return ret;
 }
 
@@ -390,7 +530,102 @@ c_user_start_child(const c_user_t *user)
 }
 
 /**
- * Shifts or sets uid/gids of path using the parent ids for this c_user_t
+ * Returns an fd of a user namespace with the uid/gid mapping of the container,
+ * to be used for idmapped mounts. If the userns of the container already
+ * exists, e.g. adopted from a zygote, it is used. Otherwise an extra userns is
+ * created by a short-lived child and kept open for this start.
+ */
+static int
+c_user_get_idmap_userns(c_user_t *user)
+{
+	if (user->fd_userns > 0)
+		return user->fd_userns;
+	if (user->fd_idmap >= 0)
+		return user->fd_idmap;
+
+	int fd[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd) < 0) {
+		ERROR_ERRNO("Could not create socketpair for idmap userns");
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		ERROR_ERRNO("Could not fork for idmap userns");
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	} else if (pid == 0) {
+		char c = 0;
+		ssize_t n;
+		close(fd[1]);
+		if (unshare(CLONE_NEWUSER) < 0)
+			_exit(-1);
+		// signal the new userns, then wait until the parent has mapped and opened it
+		if (write(fd[0], &c, 1) < 0)
+			_exit(-1);
+		do {
+			n = read(fd[0], &c, 1);
+		} while (n > 0 || (n < 0 && errno == EINTR));
+		_exit(0);
+	}
+	close(fd[0]);
+
+	char c;
+	if (read(fd[1], &c, 1) == 1 && !c_user_setup_mapping(user, pid)) {
+		char *userns = mem_printf("/proc/%d/ns/user", pid);
+		user->fd_idmap = open(userns, O_RDONLY | O_CLOEXEC);
+		if (user->fd_idmap < 0)
+			ERROR_ERRNO("Could not open idmap userns %s", userns);
+		mem_free(userns);
+	}
+	close(fd[1]);
+	if (waitpid(pid, NULL, 0) < 0)
+		WARN_ERRNO("Could not reap idmap userns child %d", pid);
+
+	return user->fd_idmap;
+}
+
+/**
+ * Creates the mark as an idmapped bind mount of path, so that the uids/gids on
+ * disk appear shifted by the mapping of the container without touching any
+ * file. Requires Linux 5.12 and support of the underlying filesystems.
+ */
+static int
+c_user_idmap_mark(c_user_t *user, const char *path, const char *mark)
+{
+	int userns_fd = c_user_get_idmap_userns(user);
+	IF_TRUE_RETVAL(userns_fd < 0, -1);
+
+	int tree_fd = syscall(__NR_open_tree, AT_FDCWD, path,
+			      OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+	if (tree_fd < 0) {
+		DEBUG_ERRNO("Could not clone mount tree of %s", path);
+		return -1;
+	}
+
+	struct c_user_mount_attr attr = { .attr_set = MOUNT_ATTR_IDMAP, .userns_fd = userns_fd };
+	if (syscall(__NR_mount_setattr, tree_fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr,
+		    sizeof(attr)) < 0) {
+		DEBUG_ERRNO("Could not idmap mount tree of %s", path);
+		close(tree_fd);
+		return -1;
+	}
+
+	if (syscall(__NR_move_mount, tree_fd, "", AT_FDCWD, mark, MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+		ERROR_ERRNO("Could not attach idmapped mount of %s on %s", path, mark);
+		close(tree_fd);
+		return -1;
+	}
+
+	close(tree_fd);
+	return 0;
+}
+
+/**
+ * Shifts or sets uid/gids of path using the parent ids for this c_user_t.
+ * Mounts are shifted by an idmapped mount if supported, by shiftfs otherwise
+ * and only as last resort by chowning all files.
  *
  * Call this inside the parent user_ns.
  */
@@ -418,31 +653,11 @@ c_user_shift_ids(c_user_t *user, const char *path, bool is_root)
 	// if dev or a cgroup subsys just chown the files
 	if ((strlen(path) >= 4 && !strcmp(strrchr(path, '\0') - 4, "/dev")) ||
 	    (strstr(path, "/cgroup") != NULL)) {
-		if (dir_foreach(path, &c_user_chown_dev_cb, user) < 0) {
-			ERROR("Could not chown %s to target uid:gid (%d:%d)", path, user->uid_start,
-			      user->uid_start);
+		if (c_user_chown_tree(user, path, false) < 0)
 			goto error;
-		}
 		goto success;
 	}
 
-	// if kernel does not support shiftfs just chown the files
-	// and do bind mounts (see jump mark shift)
-	if (!cmld_is_shiftfs_supported()) {
-		if (chown(path, user->uid_start, user->uid_start) < 0) {
-			ERROR_ERRNO("Could not chown mnt point '%s' to (%d:%d)", path,
-				    user->uid_start, user->uid_start);
-			goto error;
-		}
-		if (dir_foreach(path, &c_user_chown_dev_cb, user) < 0) {
-			ERROR("Could not chown %s to target uid:gid (%d:%d)", path, user->uid_start,
-			      user->uid_start);
-			goto error;
-		}
-		goto shift;
-	}
-
-shift:
 	// create mountpoints for lower and upper dev
 	if (dir_mkdir_p(SHIFTFS_DIR, 0777) < 0) {
 		ERROR_ERRNO("Could not mkdir %s", SHIFTFS_DIR);
@@ -464,17 +679,36 @@ shift:
 		c_user_shift_free(shift_mark);
 		goto error;
 	}
+
 	/*
-	 * In case shiftfs is not supported we use MS_BIND flag to just bind
-	 * mount the chowned directories to the new mount tree.
-	 * If MS_BIND flag is used, fs paramter and other options are ignored
-	 * by the mount system call.
+	 * Files chowned by an earlier start without idmapped mounts have to stay
+	 * on the chown path, an idmapped mount would shift them a second time.
 	 */
-	if (mount(path, shift_mark->mark, "shiftfs", cmld_is_shiftfs_supported() ? 0 : MS_BIND,
-		  "mark") < 0) {
-		ERROR_ERRNO("Could not mark shiftfs origin %s on mark %s", path, shift_mark->mark);
-		c_user_shift_free(shift_mark);
-		goto error;
+	struct stat s;
+	bool chowned = !lstat(path, &s) && s.st_uid >= UID_RANGES_START;
+
+	if (!chowned && !c_user_idmap_mark(user, path, shift_mark->mark)) {
+		INFO("Using idmapped mount for '%s'", path);
+		shift_mark->is_bind = true;
+	} else if (cmld_is_shiftfs_supported()) {
+		if (mount(path, shift_mark->mark, "shiftfs", 0, "mark") < 0) {
+			ERROR_ERRNO("Could not mark shiftfs origin %s on mark %s", path,
+				    shift_mark->mark);
+			c_user_shift_free(shift_mark);
+			goto error;
+		}
+	} else {
+		// neither idmapped mounts nor shiftfs, chown all files and bind mount them
+		if (c_user_chown_tree(user, path, true) < 0) {
+			c_user_shift_free(shift_mark);
+			goto error;
+		}
+		if (mount(path, shift_mark->mark, NULL, MS_BIND, NULL) < 0) {
+			ERROR_ERRNO("Could not bind chowned %s on mark %s", path, shift_mark->mark);
+			c_user_shift_free(shift_mark);
+			goto error;
+		}
+		shift_mark->is_bind = true;
 	}
 
 	user->marks = list_append(user->marks, shift_mark);
@@ -526,6 +760,10 @@ c_user_start_post_clone(c_user_t *user)
 	    (container_get_prev_state(user->container) == CONTAINER_STATE_REBOOTING))
 		return 0;
 
+	/* the adopted userns is already mapped and bound */
+	if (user->adopted)
+		return 0;
+
 	// bind userns to file
 	if (ns_bind("user", container_get_pid(user->container), user->ns_path) == -1) {
 		WARN("Could not bind userns of %s into filesystem!",
@@ -535,7 +773,60 @@ c_user_start_post_clone(c_user_t *user)
 	if (user->fd_userns < 0)
 		WARN("Could not keep userns active for reboot!");
 
-	return c_user_setup_mapping(user);
+	return c_user_setup_mapping(user, container_get_pid(user->container));
+}
+
+int
+c_user_adopt_userns(c_user_t *user, pid_t pid)
+{
+	ASSERT(user);
+	IF_FALSE_RETVAL(user->ns_usr, -1);
+
+	IF_TRUE_RETVAL(c_user_setup_mapping(user, pid) < 0, -1);
+
+	// bind userns to file to be joined by the start child
+	if (ns_bind("user", pid, user->ns_path) == -1) {
+		ERROR("Could not bind adopted userns of %s into filesystem!",
+		      container_get_name(user->container));
+		return -1;
+	}
+	user->fd_userns = open(user->ns_path, O_RDONLY);
+	if (user->fd_userns < 0)
+		WARN("Could not keep userns active for reboot!");
+
+	user->adopted = true;
+	return 0;
+}
+
+int
+c_user_get_offset(const c_user_t *user)
+{
+	ASSERT(user);
+	return user->ns_usr ? user->offset : -1;
+}
+
+int
+c_user_adopt(c_user_t *user, int offset)
+{
+	ASSERT(user);
+
+	/* Skip this, if the container doesn't have a user namespace */
+	if (!user->ns_usr)
+		return 0;
+
+	IF_TRUE_RETVAL(offset < 0 || offset >= MAX_UID_RANGES, -1);
+	IF_TRUE_RETVAL(c_user_set_offset(offset) < 0, -1);
+
+	user->offset = offset;
+	user->uid_start = UID_RANGES_START + (user->offset * UID_RANGE);
+	DEBUG("Adopted uid/gid map start: %u", user->uid_start);
+	cmld_containers_uid_changed();
+
+	user->fd_userns = open(user->ns_path, O_RDONLY);
+	if (user->fd_userns < 0)
+		WARN("Could not keep userns active for reboot!");
+
+	return 0;
 }
 
 int
@@ -569,9 +860,12 @@ c_user_shift_mounts(const c_user_t *user)
 			}
 		}
 
-		// mount the shifted user ids to new root
+		/*
+		 * mount the shifted user ids to new root, idmapped or chowned marks
+		 * are just bind mounted, the fs type is ignored for MS_BIND
+		 */
 		if (mount(shift_mark->mark, shift_mark->target, "shiftfs",
-			  cmld_is_shiftfs_supported() ? 0 : MS_BIND, NULL) < 0) {
+			  shift_mark->is_bind ? MS_BIND : 0, NULL) < 0) {
 			ERROR_ERRNO("Could not remount shiftfs mark %s to %s", shift_mark->mark,
 				    shift_mark->target);
 			goto error;
@@ -102,4 +102,28 @@ c_user_setuid0(const c_user_t *user);
 int
 c_user_join_userns(const c_user_t *user);
 
+/**
+ * Adopts the still unmapped user namespace of the process pid, i.e. of a zygote,
+ * instead of creating a new one on clone. Writes the mapping of the reserved uid
+ * range and binds the userns to be joined by the start child of the container.
+ * To be called after c_user_start_pre_clone().
+ */
+int
+c_user_adopt_userns(c_user_t *user, pid_t pid);
+
+/**
+ * Returns the offset of the uid range the running container holds, -1 if it
+ * has no user namespace.
+ */
+int
+c_user_get_offset(const c_user_t *user);
+
+/**
+ * Takes over the user namespace of a running container from a previous cmld
+ * instance, i.e. occupies the uid range of offset again and keeps the userns,
+ * which is still bound into the filesystem, active.
+ */
+int
+c_user_adopt(c_user_t *user, int offset);
+
 #endif /* C_USER_H */
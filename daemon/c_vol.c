@@ -29,36 +29,53 @@
 #define _GNU_SOURCE
 #endif
 
+#define MEM_TAG "container"
+
 #include "c_vol.h"
 
 #include "common/macro.h"
+#include "common/probe.h"
 #include "common/mem.h"
 #include "common/file.h"
+#include "common/fd.h"
+#include "common/list.h"
 #include "common/loopdev.h"
 #include "common/cryptfs.h"
+#include "common/dmthin.h"
 #include "common/dir.h"
 #include "common/proc.h"
 #include "common/sock.h"
 #include "common/str.h"
+#include "common/event.h"
 
 #include "cmld.h"
 #include "hardware.h"
 #include "guestos.h"
+#include "lazyimg.h"
 #include "smartcard.h"
 #include "lxcfs.h"
 #include "audit.h"
+#include "tss.h"
 
 #include <unistd.h>
 #include <string.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/quota.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdio.h>
 
 #include <selinux/selinux.h>
 
@@ -67,6 +84,10 @@
 #define MAKE_BTRFS "mkfs.btrfs"
 #define MDEV "mdev"
 
+#ifndef SYS_quotactl_fd
+#define SYS_quotactl_fd 443
+#endif
+
 #if 0
 #define ICC_SHARED_MOUNT "data/trustme-com"
 #define TPM2D_SHARED_MOUNT ICC_SHARED_MOUNT "/tpm2d"
@@ -80,17 +101,67 @@
 #define is_selinux_enabled() file_is_mountpoint("/sys/fs/selinux")
 
 #define BUSYBOX_PATH "/bin/busybox"
+// host dir with busybox and its applet symlinks, bind-mounted into setup mode containers
+#define BUSYBOX_TOOLS_DIR "/tmp/cml-busybox"
+#define BUSYBOX_LIST_MAXLEN (64 * 1024)
 
-#ifndef FALLOC_FL_ZERO_RANGE
-#define FALLOC_FL_ZERO_RANGE 0x10
-#endif
+// max. number of images for which devices are set up concurrently
+#define C_VOL_PREPARE_THREADS 4
+#define C_VOL_LOOPDEV_TIMEOUT 2000
+#define C_VOL_DM_TIMEOUT 5000
+#define C_VOL_LOOPDEV_RETRIES 8
+
+#define C_VOL_THIN_POOL "cml-thin-pool"
+#define C_VOL_THIN_ID_PROBES 64
+// warn about over-provisioning if the pool is filled above this percentage
+#define C_VOL_THIN_USAGE_WARN 90
+
+// set by c_vol_thin_pool_init(), new data volumes are allocated from the pool
+static bool c_vol_thin_pool_active = false;
+
+#define C_VOL_DIR_PROJID_PROBES 64
+#define C_VOL_DIR_PROJID_MAX 0x7fffffff
+
+// set by c_vol_dir_storage_init(), new unencrypted data volumes are directories
+static bool c_vol_dir_storage_active = false;
+
+// cmld-private dir below which read-only GuestOS images are mounted once for all containers
+#define C_VOL_LOWER_DIR "/tmp/cml-lower"
+
+// boot read profiles are stored beside the image file
+#define C_VOL_PREFETCH_SUFFIX ".prefetch"
+#define C_VOL_PREFETCH_MAXLEN (1024 * 1024)
+// resident pages at most this far apart are read ahead as one range
+#define C_VOL_PREFETCH_GAP_PAGES 8
+
+/*
+ * A read-only GuestOS image mounted in the mount namespace of cmld, which is
+ * shared by all containers of the same GuestOS version. The containers inherit
+ * the mount on clone and only put their private upper dirs on top of it, thus
+ * they use the same superblock and page cache.
+ */
+typedef struct c_vol_lower {
+	char *img; ///< image file, identifies GuestOS, version and image
+	char *dir; ///< mount point below C_VOL_LOWER_DIR
+	unsigned refs;
+	bool record; ///< record the boot read profile once the container booted
+} c_vol_lower_t;
+
+static list_t *c_vol_lower_list = NULL;
 
 struct c_vol {
 	const container_t *container;
 	char *root;
 	int overlay_count;
+	char *layer_dirs; ///< mounted layers of the stack being set up, topmost first
+	bool busybox_bound; ///< busybox tools have been bind-mounted into the setup root
+	list_t *lowers; ///< c_vol_lower_t references held by the container
 };
 
+// top level dirs of the busybox applet paths, all of them are below BUSYBOX_TOOLS_DIR
+static const char *const c_vol_busybox_tools_dirs[] = { "bin", "sbin", "usr" };
+static bool c_vol_busybox_tools_ready = false;
+
 /******************************************************************************/
 
 /**
@@ -124,6 +195,8 @@ c_vol_image_path_new(c_vol_t *vol, const mount_entry_t *mntent)
 	case MOUNT_TYPE_BIND_FILE:
 	case MOUNT_TYPE_BIND_FILE_RW:
 		return mem_printf("%s/%s", SHARED_FILES_PATH, mount_entry_get_img(mntent));
+	case MOUNT_TYPE_LAYER:
+		return guestos_get_image_path_new(container_get_os(vol->container), mntent);
 	default:
 		ERROR("Unsupported operating system mount type %d for %s",
 		      mount_entry_get_type(mntent), mount_entry_get_img(mntent));
@@ -182,31 +255,34 @@ c_vol_check_image(c_vol_t *vol, const char *img)
 }
 
 static char *
-c_vol_create_loopdev_new(int *fd, const char *img)
+c_vol_create_loopdev_new(int *fd, const char *img, unsigned flags)
 {
-	char *dev = loopdev_new();
-	if (!dev) {
-		ERROR("Could not get free loop device for %s", img);
-		return NULL;
-	}
+	for (int i = 0; i < C_VOL_LOOPDEV_RETRIES; i++) {
+		char *dev = loopdev_new();
+		if (!dev) {
+			ERROR("Could not get free loop device for %s", img);
+			return NULL;
+		}
 
-	// wait until the devie appears...
-	// TODO: how was this timeout chosen?
-	// TODO: maybe better wait for the uevent?
-	if (loopdev_wait(dev, 10) < 0) {
-		ERROR("Device %s for image %s was not created", dev, img);
-		goto error;
-	}
+		// wait until the device appears...
+		if (loopdev_wait(dev, C_VOL_LOOPDEV_TIMEOUT) < 0) {
+			ERROR("Device %s for image %s was not created", dev, img);
+			mem_free(dev);
+			return NULL;
+		}
 
-	// TODO: there might be another process trying to setup a device for dev
-	*fd = loopdev_setup_device(img, dev);
-	if (*fd < 0) {
-		ERROR("Could not setup loop device %s for %s", dev, img);
-		goto error;
+		*fd = loopdev_setup_device_flags(img, dev, flags);
+		if (*fd >= 0)
+			return dev;
+
+		mem_free(dev);
+		// images are set up concurrently, another one may have taken the device
+		if (errno != EBUSY)
+			break;
+		DEBUG("Loop device for %s is busy, trying another one", img);
 	}
-	return dev;
-error:
-	mem_free(dev);
+
+	ERROR("Could not setup loop device for %s", img);
 	return NULL;
 }
 
@@ -244,11 +320,19 @@ c_vol_create_sparse_file(const char *img, off64_t storage_size)
 		return -1;
 	}
 
-	// also allocate with  zeros for dm-integrity
-	if (fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, storage_size)) {
-		ERROR_ERRNO("Could not write to image file %s", img);
-		close(fd);
-		return -1;
+	/*
+	 * Reserve the space, so that the volume cannot run out of it later. The
+	 * blocks are allocated unwritten and read as zeros, without writing the
+	 * whole image. dm-integrity does not rely on the zeros, the integrity
+	 * volume is either wiped through dm-crypt or initialized on first write.
+	 */
+	if (fallocate(fd, 0, 0, storage_size)) {
+		if (errno != EOPNOTSUPP) {
+			ERROR_ERRNO("Could not allocate image file %s", img);
+			close(fd);
+			return -1;
+		}
+		WARN("Preallocation not supported for %s, keeping sparse image file", img);
 	}
 
 	close(fd);
@@ -371,6 +455,297 @@ c_vol_create_image(c_vol_t *vol, const char *img, const mount_entry_t *mntent)
 	return 0;
 }
 
+/*
+ * Container data volumes (empty and upper overlay images) may be thin devices
+ * of the thin pool instead of image files attached to loop devices. Such a
+ * volume is represented by a marker file in place of the image file, which
+ * holds the id of the thin device and, for encrypted volumes, the id of the
+ * thin device for the integrity metadata.
+ */
+static char *
+c_vol_thin_marker_path_new(c_vol_t *vol, const mount_entry_t *mntent)
+{
+	switch (mount_entry_get_type(mntent)) {
+	case MOUNT_TYPE_EMPTY:
+	case MOUNT_TYPE_OVERLAY_RW:
+		break;
+	default:
+		return NULL;
+	}
+	return mem_printf("%s/%s.thin", container_get_images_dir(vol->container),
+			  mount_entry_get_img(mntent));
+}
+
+/*
+ * Reads the ids of a marker file, meta_id is set to -1 if there is none.
+ */
+static int
+c_vol_thin_marker_read(const char *marker, uint32_t *data_id, int64_t *meta_id)
+{
+	char *buf = file_read_new(marker, 64);
+	IF_NULL_RETVAL(buf, -1);
+
+	unsigned long data, meta;
+	int n = sscanf(buf, "%lu %lu", &data, &meta);
+	mem_free(buf);
+	if (n < 1 || data > DMTHIN_ID_MAX || (n == 2 && meta > DMTHIN_ID_MAX)) {
+		ERROR("Invalid thin volume marker %s", marker);
+		return -1;
+	}
+	*data_id = data;
+	*meta_id = n == 2 ? (int64_t)meta : -1;
+	return 0;
+}
+
+static int
+c_vol_thin_marker_write(const char *marker, uint32_t data_id, int64_t meta_id)
+{
+	if (meta_id >= 0)
+		return file_printf(marker, "%" PRIu32 " %" PRId64 "\n", data_id, meta_id);
+	return file_printf(marker, "%" PRIu32 "\n", data_id);
+}
+
+/*
+ * Creates a thin device (or a snapshot of origin if origin >= 0) with a free
+ * id. Probing starts at an id derived from seed, so that the ids of the
+ * volumes of different containers rarely collide, concurrent allocations are
+ * serialized by the pool itself.
+ */
+static int64_t
+c_vol_thin_alloc(const char *seed, int64_t origin)
+{
+	uint32_t id = 2166136261u;
+	for (const char *c = seed; *c; c++)
+		id = (id ^ (unsigned char)*c) * 16777619u;
+
+	for (int i = 0; i < C_VOL_THIN_ID_PROBES; i++, id++) {
+		id &= DMTHIN_ID_MAX;
+		int ret = origin >= 0 ? dmthin_snapshot(C_VOL_THIN_POOL, origin, id) :
+					dmthin_create(C_VOL_THIN_POOL, id);
+		if (ret == 0)
+			return id;
+		if (errno != EEXIST)
+			break;
+	}
+	ERROR_ERRNO("Could not allocate thin device for %s", seed);
+	return -1;
+}
+
+static void
+c_vol_thin_log_usage(void)
+{
+	dmthin_usage_t usage;
+	IF_TRUE_RETURN(dmthin_pool_get_usage(C_VOL_THIN_POOL, &usage) < 0);
+	IF_TRUE_RETURN(usage.data_total == 0 || usage.meta_total == 0);
+
+	uint64_t data_percent = usage.data_used * 100 / usage.data_total;
+	uint64_t meta_percent = usage.meta_used * 100 / usage.meta_total;
+	if (data_percent >= C_VOL_THIN_USAGE_WARN || meta_percent >= C_VOL_THIN_USAGE_WARN)
+		WARN("Thin pool %s is running out of space: data %" PRIu64 "%%, metadata %" PRIu64
+		     "%% used",
+		     C_VOL_THIN_POOL, data_percent, meta_percent);
+	else
+		DEBUG("Thin pool %s: %" PRIu64 " of %" PRIu64 " MiB data, metadata %" PRIu64
+		      "%% used",
+		      C_VOL_THIN_POOL, usage.data_used * usage.block_size >> 20,
+		      usage.data_total * usage.block_size >> 20, meta_percent);
+}
+
+int
+c_vol_thin_pool_init(const char *meta_dev, const char *data_dev)
+{
+	IF_NULL_RETVAL(meta_dev, -1);
+	IF_NULL_RETVAL(data_dev, -1);
+
+	if (dmthin_pool_activate(C_VOL_THIN_POOL, meta_dev, data_dev) < 0) {
+		ERROR("Could not activate thin pool on %s", data_dev);
+		return -1;
+	}
+	c_vol_thin_pool_active = true;
+	c_vol_thin_log_usage();
+	return 0;
+}
+
+int
+c_vol_thin_delete(const char *marker)
+{
+	uint32_t data_id;
+	int64_t meta_id;
+	int ret = 0;
+
+	IF_TRUE_RETVAL(c_vol_thin_marker_read(marker, &data_id, &meta_id) < 0, -1);
+
+	if (dmthin_delete(C_VOL_THIN_POOL, data_id) < 0) {
+		ERROR_ERRNO("Could not delete thin device %" PRIu32 " of %s", data_id, marker);
+		ret = -1;
+	}
+	if (meta_id >= 0 && dmthin_delete(C_VOL_THIN_POOL, meta_id) < 0) {
+		ERROR_ERRNO("Could not delete thin device %" PRId64 " of %s", meta_id, marker);
+		ret = -1;
+	}
+	// keep the marker if the devices are still in use, so that they do not leak
+	if (ret == 0 && unlink(marker) < 0)
+		ret = -1;
+	return ret;
+}
+
+int
+c_vol_thin_snapshot(const char *marker, const char *snapshot_marker)
+{
+	uint32_t data_id;
+	int64_t meta_id, snap_meta_id = -1;
+
+	IF_TRUE_RETVAL(c_vol_thin_marker_read(marker, &data_id, &meta_id) < 0, -1);
+
+	int64_t snap_data_id = c_vol_thin_alloc(snapshot_marker, data_id);
+	IF_TRUE_RETVAL(snap_data_id < 0, -1);
+	if (meta_id >= 0 && (snap_meta_id = c_vol_thin_alloc(snapshot_marker, meta_id)) < 0)
+		goto err;
+	if (c_vol_thin_marker_write(snapshot_marker, snap_data_id, snap_meta_id) < 0) {
+		ERROR_ERRNO("Could not write thin volume marker %s", snapshot_marker);
+		goto err;
+	}
+	return 0;
+err:
+	dmthin_delete(C_VOL_THIN_POOL, snap_data_id);
+	if (snap_meta_id >= 0)
+		dmthin_delete(C_VOL_THIN_POOL, snap_meta_id);
+	return -1;
+}
+
+/*
+ * Unencrypted data volumes (empty images) may be directories in the images
+ * dir instead of image files with their own file system. The size of such a
+ * volume is enforced by a project quota of the host file system, which has
+ * to be ext4 or xfs mounted with project quotas enabled.
+ */
+static char *
+c_vol_dir_path_new(c_vol_t *vol, const mount_entry_t *mntent)
+{
+	if (mount_entry_get_type(mntent) != MOUNT_TYPE_EMPTY || mount_entry_is_encrypted(mntent))
+		return NULL;
+	return mem_printf("%s/%s.dir", container_get_images_dir(vol->container),
+			  mount_entry_get_img(mntent));
+}
+
+static int
+c_vol_dir_quotactl(int fd, int cmd, uint32_t id, void *addr)
+{
+	return syscall(SYS_quotactl_fd, fd, QCMD(cmd, PRJQUOTA), id, addr);
+}
+
+/*
+ * Returns true if a project id is not used by another volume, i.e., there is
+ * no quota entry for it or the entry has neither limits nor usage.
+ */
+static bool
+c_vol_dir_projid_is_free(int fd, uint32_t id)
+{
+	struct dqblk dq;
+
+	if (c_vol_dir_quotactl(fd, Q_GETQUOTA, id, &dq) < 0)
+		return errno == ESRCH || errno == ENOENT;
+	return !dq.dqb_bhardlimit && !dq.dqb_curspace && !dq.dqb_curinodes;
+}
+
+/*
+ * Sets the block limit of the project quota of a volume dir, allocating a
+ * project id for the dir first if it does not have one. Probing starts at an
+ * id derived from the path of the dir, like for thin devices.
+ */
+static int
+c_vol_dir_set_quota(const char *path, uint64_t size)
+{
+	struct fsxattr fsx;
+	struct dqblk dq = { 0 };
+	int ret = -1;
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open volume dir %s", path);
+		return -1;
+	}
+	if (ioctl(fd, FS_IOC_FSGETXATTR, &fsx) < 0) {
+		ERROR_ERRNO("Could not get project of volume dir %s", path);
+		goto out;
+	}
+
+	if (!fsx.fsx_projid) {
+		uint32_t id = 2166136261u;
+		for (const char *c = path; *c; c++)
+			id = (id ^ (unsigned char)*c) * 16777619u;
+		for (int i = 0; i < C_VOL_DIR_PROJID_PROBES && !fsx.fsx_projid; i++, id++) {
+			id &= C_VOL_DIR_PROJID_MAX;
+			if (id && c_vol_dir_projid_is_free(fd, id))
+				fsx.fsx_projid = id;
+		}
+		if (!fsx.fsx_projid) {
+			ERROR("Could not allocate project id for volume dir %s", path);
+			goto out;
+		}
+		// files created below the dir are charged to its project as well
+		fsx.fsx_xflags |= FS_XFLAG_PROJINHERIT;
+		if (ioctl(fd, FS_IOC_FSSETXATTR, &fsx) < 0) {
+			ERROR_ERRNO("Could not set project of volume dir %s", path);
+			goto out;
+		}
+		INFO("Allocated project id %" PRIu32 " for volume dir %s", fsx.fsx_projid, path);
+	}
+
+	// quota blocks are 1 KiB, size is given in MBytes
+	dq.dqb_bhardlimit = dq.dqb_bsoftlimit = size * 1024;
+	dq.dqb_valid = QIF_BLIMITS;
+	if (c_vol_dir_quotactl(fd, Q_SETQUOTA, fsx.fsx_projid, &dq) < 0) {
+		ERROR_ERRNO("Could not set project quota of volume dir %s", path);
+		goto out;
+	}
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+int
+c_vol_dir_storage_init(const char *path)
+{
+	struct if_dqinfo info;
+	IF_NULL_RETVAL(path, -1);
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open %s", path);
+		return -1;
+	}
+	int ret = c_vol_dir_quotactl(fd, Q_GETINFO, 0, &info);
+	close(fd);
+	if (ret < 0) {
+		ERROR_ERRNO("Project quotas are not enabled on the file system of %s", path);
+		return -1;
+	}
+	c_vol_dir_storage_active = true;
+	return 0;
+}
+
+int
+c_vol_dir_release(const char *path)
+{
+	struct fsxattr fsx;
+	struct dqblk dq = { .dqb_valid = QIF_BLIMITS };
+	int ret = 0;
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	IF_TRUE_RETVAL(fd < 0, -1);
+
+	// the project id is free again once the files are deleted as well
+	if (ioctl(fd, FS_IOC_FSGETXATTR, &fsx) == 0 && fsx.fsx_projid &&
+	    c_vol_dir_quotactl(fd, Q_SETQUOTA, fsx.fsx_projid, &dq) < 0) {
+		WARN_ERRNO("Could not reset project quota of volume dir %s", path);
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
 static int
 c_vol_format_image(const char *dev, const char *fs)
 {
@@ -439,10 +814,15 @@ out:
 	return ret;
 }
 
+/*
+ * Mounts an overlay with a writable upper dir to target_dir. The lower dir
+ * is either the image lower_dev, the colon separated list lower_dirs of
+ * already mounted read-only layers (topmost first) or target_dir itself.
+ */
 static int
 c_vol_mount_overlay(const char *target_dir, const char *upper_fstype, const char *lowerfs_type,
 		    int mount_flags, const char *mount_data, const char *upper_dev,
-		    const char *lower_dev, const char *overlayfs_mount_dir)
+		    const char *lower_dev, const char *lower_dirs, const char *overlayfs_mount_dir)
 {
 	char *lower_dir, *upper_dir, *work_dir;
 	lower_dir = upper_dir = work_dir = NULL;
@@ -489,6 +869,9 @@ c_vol_mount_overlay(const char *target_dir, const char *upper_fstype, const char
 			goto error;
 		}
 		DEBUG("Successfully mounted %s to %s", lower_dev, lower_dir);
+	} else if (lower_dirs) {
+		mem_free(lower_dir);
+		lower_dir = mem_strdup(lower_dirs);
 	} else {
 		// try to hide absolute paths (if just overmounting existing lower dir)
 		if (file_is_link(lower_dir))
@@ -509,7 +892,8 @@ c_vol_mount_overlay(const char *target_dir, const char *upper_fstype, const char
 					       lower_dir, upper_dir, work_dir);
 	} else {
 		overlayfs_options =
-			mem_strdup("lowerdir=lower,upperdir=upper,workdir=work,metacopy=on");
+			mem_printf("lowerdir=%s,upperdir=upper,workdir=work,metacopy=on",
+				   lower_dirs && !lower_dev ? lower_dirs : "lower");
 		TRACE("old_wdir: %s, mount_cwd: %s, overlay_options: %s ", cwd, overlayfs_mount_dir,
 		      overlayfs_options);
 	}
@@ -598,8 +982,12 @@ err:
 	return -1;
 }
 
+/*
+ * Returns the mount options of a tmpfs, which is limited to size MBytes unless
+ * size is 0.
+ */
 static char *
-c_vol_get_tmpfs_opts_new(const char *mount_data, int uid, int gid)
+c_vol_get_tmpfs_opts_new(const char *mount_data, int uid, int gid, uint64_t size)
 {
 	str_t *opts = str_new(NULL);
 
@@ -608,53 +996,1106 @@ c_vol_get_tmpfs_opts_new(const char *mount_data, int uid, int gid)
 	if (!cmld_is_shiftfs_supported())
 		str_append_printf(opts, "uid=%d,gid=%d", uid, gid);
 
+	if (size)
+		str_append_printf(opts, "%ssize=%" PRIu64 "m", str_length(opts) ? "," : "", size);
+
 	if (mount_data)
 		str_append_printf(opts, ",%s", mount_data);
 
-	return str_free(opts, false);
+	return str_free(opts, false);
+}
+
+/*
+ * Copy busybox binary to target_base directory.
+ * Remeber, this will only succeed if targetfs is writable.
+ */
+static int
+c_vol_setup_busybox_copy(const char *target_base)
+{
+	int ret = 0;
+	char *target_bin = mem_printf("%s%s", target_base, BUSYBOX_PATH);
+	char *target_dir = mem_strdup(target_bin);
+	char *target_dir_p = dirname(target_dir);
+	if ((ret = dir_mkdir_p(target_dir_p, 0755)) < 0) {
+		WARN_ERRNO("Could not mkdir '%s' dir", target_dir_p);
+	} else if (file_exists("/bin/busybox")) {
+		file_copy("/bin/busybox", target_bin, -1, 512, 0);
+		INFO("Copied %s to container", target_bin);
+		if (chmod(target_bin, 0755)) {
+			WARN_ERRNO("Could not set %s executable", target_bin);
+			ret = -1;
+		}
+	} else {
+		WARN_ERRNO("Could not copy %s to container", target_bin);
+		ret = -1;
+	}
+
+	mem_free(target_bin);
+	mem_free(target_dir);
+	return ret;
+}
+
+/*
+ * Returns the output of 'busybox --list-full', i.e., the paths of all applets
+ * relative to the root dir, one per line.
+ */
+static char *
+c_vol_busybox_list_new(void)
+{
+	int pipefd[2];
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		ERROR_ERRNO("Could not create pipe for busybox applet list");
+		return NULL;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		ERROR_ERRNO("Could not fork for busybox applet list");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return NULL;
+	} else if (pid == 0) {
+		if (dup2(pipefd[1], STDOUT_FILENO) < 0)
+			_exit(EXIT_FAILURE);
+		const char *const argv[] = { BUSYBOX_PATH, "--list-full", NULL };
+		execv(argv[0], (char *const *)argv);
+		_exit(EXIT_FAILURE);
+	}
+	close(pipefd[1]);
+
+	char *list = mem_alloc0(BUSYBOX_LIST_MAXLEN);
+	ssize_t len = fd_read(pipefd[0], list, BUSYBOX_LIST_MAXLEN - 1);
+	close(pipefd[0]);
+
+	int status;
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    len <= 0) {
+		ERROR("Could not get busybox applet list");
+		mem_free(list);
+		return NULL;
+	}
+	return list;
+}
+
+/*
+ * Prepares BUSYBOX_TOOLS_DIR once in the namespace of cmld: it holds the
+ * symlinks of all busybox applets and the busybox binary itself, which is
+ * bind-mounted read-only from the host. Containers in setup mode get the
+ * tools bind-mounted into their root, which saves copying busybox and running
+ * 'busybox --install' on each start.
+ */
+static void
+c_vol_busybox_tools_init(void)
+{
+	IF_TRUE_RETURN(c_vol_busybox_tools_ready);
+	IF_FALSE_RETURN_TRACE(file_exists(BUSYBOX_PATH));
+
+	char *list = c_vol_busybox_list_new();
+	IF_NULL_RETURN(list);
+
+	int ret = 0;
+	char *saveptr = NULL;
+	for (char *applet = strtok_r(list, "\n", &saveptr); applet && ret == 0;
+	     applet = strtok_r(NULL, "\n", &saveptr)) {
+		while (*applet == '/')
+			applet++;
+		if (!*applet || strstr(applet, "..") || !strcmp(applet, BUSYBOX_PATH + 1))
+			continue;
+
+		char *link = mem_printf("%s/%s", BUSYBOX_TOOLS_DIR, applet);
+		char *link_dir = mem_strdup(link);
+		if (dir_mkdir_p(dirname(link_dir), 0755) < 0 ||
+		    (symlink(BUSYBOX_PATH, link) < 0 && errno != EEXIST)) {
+			WARN_ERRNO("Could not create busybox applet link %s", link);
+			ret = -1;
+		}
+		mem_free(link_dir);
+		mem_free(link);
+	}
+	mem_free(list);
+
+	char *bin = mem_printf("%s%s", BUSYBOX_TOOLS_DIR, BUSYBOX_PATH);
+	for (size_t i = 0; ret == 0 && i < sizeof(c_vol_busybox_tools_dirs) / sizeof(char *); i++) {
+		char *dir = mem_printf("%s/%s", BUSYBOX_TOOLS_DIR, c_vol_busybox_tools_dirs[i]);
+		ret = dir_mkdir_p(dir, 0755);
+		mem_free(dir);
+	}
+	if (ret == 0 && !file_is_mountpoint(bin))
+		ret = c_vol_mount_file_bind(BUSYBOX_PATH, bin, MS_BIND | MS_RDONLY);
+	mem_free(bin);
+
+	if (ret < 0) {
+		WARN("Could not prepare busybox tools in %s, falling back to copying",
+		     BUSYBOX_TOOLS_DIR);
+		return;
+	}
+	c_vol_busybox_tools_ready = true;
+	DEBUG("Prepared busybox tools in %s", BUSYBOX_TOOLS_DIR);
+}
+
+/*
+ * Bind-mounts the prepared busybox tools read-only into target_base.
+ */
+static int
+c_vol_setup_busybox_bind(c_vol_t *vol, const char *target_base)
+{
+	for (size_t i = 0; i < sizeof(c_vol_busybox_tools_dirs) / sizeof(char *); i++) {
+		char *src = mem_printf("%s/%s", BUSYBOX_TOOLS_DIR, c_vol_busybox_tools_dirs[i]);
+		char *dst = mem_printf("%s/%s", target_base, c_vol_busybox_tools_dirs[i]);
+		int ret = -1;
+
+		if (dir_mkdir_p(dst, 0755) < 0)
+			WARN_ERRNO("Could not mkdir '%s' dir", dst);
+		else if (mount(src, dst, NULL, MS_BIND | MS_REC, NULL) < 0)
+			WARN_ERRNO("Could not bind mount %s to %s", src, dst);
+		else if (mount(NULL, dst, NULL, MS_BIND | MS_REMOUNT | MS_RDONLY, NULL) < 0)
+			WARN_ERRNO("Could not remount %s read-only", dst);
+		else
+			ret = 0;
+
+		mem_free(src);
+		mem_free(dst);
+		IF_TRUE_RETVAL(ret < 0, -1);
+	}
+	vol->busybox_bound = true;
+	DEBUG("Bind mounted busybox tools to %s", target_base);
+	return 0;
+}
+
+static int
+c_vol_setup_busybox(c_vol_t *vol, const char *target_base)
+{
+	if (c_vol_busybox_tools_ready && c_vol_setup_busybox_bind(vol, target_base) == 0)
+		return 0;
+	return c_vol_setup_busybox_copy(target_base);
+}
+
+static int
+c_vol_setup_busybox_install(c_vol_t *vol)
+{
+	// the applet links are part of the bind-mounted tools
+	IF_TRUE_RETVAL_TRACE(vol->busybox_bound, 0);
+
+	// skip if busybox was not coppied
+	IF_FALSE_RETVAL_TRACE(file_exists("/bin/busybox"), 0);
+
+	IF_TRUE_RETVAL(dir_mkdir_p("/bin", 0755) < 0, -1);
+	IF_TRUE_RETVAL(dir_mkdir_p("/sbin", 0755) < 0, -1);
+
+	const char *const argv[] = { "busybox", "--install", "-s", NULL };
+	return proc_fork_and_execvp(argv);
+}
+
+typedef enum {
+	C_VOL_CRYPT_NONE = 0,
+	C_VOL_CRYPT_EXISTING,
+	C_VOL_CRYPT_NO_KEY,
+	C_VOL_CRYPT_FAILED,
+	C_VOL_CRYPT_OK,
+} c_vol_crypt_result_t;
+
+/*
+ * The block device an image is mounted from, i.e. its loop device or the
+ * dm-crypt device on top of it. The devices of independent images are set up
+ * concurrently before the images are mounted one after another.
+ */
+typedef struct {
+	const mount_entry_t *mntent;
+	char *img;
+	char *dev;
+	int fd; ///< fd of the loop device, -1 if none
+	bool new_image;
+	bool queued;   ///< to be set up in advance
+	bool prepared; ///< c_vol_dev_setup() has been called
+	bool stack_top; ///< topmost layer of the layers stacked at its mount point
+	char *thin_meta; ///< thin device for the integrity metadata of a thin volume
+	int ret;
+	char *crypt_label;
+	c_vol_crypt_result_t crypt;
+} c_vol_dev_t;
+
+static void
+c_vol_dev_release(c_vol_dev_t *d)
+{
+	if (d->dev)
+		loopdev_free(d->dev);
+	d->dev = NULL;
+	if (d->fd >= 0)
+		close(d->fd);
+	d->fd = -1;
+	mem_free(d->thin_meta);
+	d->thin_meta = NULL;
+}
+
+/*
+ * Images are attached with direct I/O, so their pages are not cached twice,
+ * once for the image file and once for the loop device. Images which are
+ * always mounted read-only are attached read-only as well.
+ */
+static unsigned
+c_vol_mntent_loopdev_flags(const mount_entry_t *mntent)
+{
+	unsigned flags = LOOPDEV_DIRECT_IO;
+
+	switch (mount_entry_get_type(mntent)) {
+	case MOUNT_TYPE_SHARED:
+	case MOUNT_TYPE_DEVICE:
+	case MOUNT_TYPE_OVERLAY_RO:
+	case MOUNT_TYPE_LAYER:
+		// dm-crypt needs a writable device
+		if (!mount_entry_is_encrypted(mntent))
+			flags |= LOOPDEV_RDONLY;
+		break;
+	default:
+		break;
+	}
+	return flags;
+}
+
+/*
+ * Activates a thin device of the pool, reusing it if it is still active, e.g.,
+ * because its dm-crypt device on top has been kept.
+ */
+static char *
+c_vol_thin_activate_new(const char *name, uint32_t id, uint64_t size)
+{
+	char *dev = cryptfs_get_device_path_new(name);
+	if (file_is_blk(dev))
+		return dev;
+	mem_free(dev);
+	return dmthin_activate_new(C_VOL_THIN_POOL, name, id, size);
+}
+
+/*
+ * Sets up the thin devices of a data volume instead of an image file and its
+ * loop device, allocating them from the thin pool if the volume is new.
+ */
+static int
+c_vol_thin_dev_setup(c_vol_t *vol, c_vol_dev_t *d, const char *marker)
+{
+	const mount_entry_t *mntent = d->mntent;
+	bool encrypted = mount_entry_is_encrypted(mntent);
+	uint64_t size = MAX(mount_entry_get_size(mntent), 10) * 1024 * 1024;
+	uint32_t data_id;
+	int64_t meta_id = -1;
+
+	if (!c_vol_thin_pool_active) {
+		ERROR("Volume %s is located in the thin pool, which is not active", marker);
+		return -1;
+	}
+
+	if (!file_exists(marker)) {
+		c_vol_thin_log_usage();
+		int64_t id = c_vol_thin_alloc(marker, -1);
+		IF_TRUE_RETVAL(id < 0, -1);
+		if (encrypted && (meta_id = c_vol_thin_alloc(marker, -1)) < 0) {
+			dmthin_delete(C_VOL_THIN_POOL, id);
+			return -1;
+		}
+		if (c_vol_thin_marker_write(marker, id, meta_id) < 0) {
+			ERROR_ERRNO("Could not write thin volume marker %s", marker);
+			dmthin_delete(C_VOL_THIN_POOL, id);
+			if (meta_id >= 0)
+				dmthin_delete(C_VOL_THIN_POOL, meta_id);
+			return -1;
+		}
+		INFO("Allocated thin volume %s from pool %s", marker, C_VOL_THIN_POOL);
+		d->new_image = true;
+	}
+	IF_TRUE_RETVAL(c_vol_thin_marker_read(marker, &data_id, &meta_id) < 0, -1);
+
+	char *label = mem_printf("%s-%s-thin", uuid_string(container_get_uuid(vol->container)),
+				 mount_entry_get_img(mntent));
+	d->dev = c_vol_thin_activate_new(label, data_id, size);
+	mem_free(label);
+	IF_NULL_RETVAL(d->dev, -1);
+
+	if (encrypted && meta_id >= 0) {
+		label = mem_printf("%s-%s-thin-meta",
+				   uuid_string(container_get_uuid(vol->container)),
+				   mount_entry_get_img(mntent));
+		d->thin_meta = c_vol_thin_activate_new(label, meta_id, size / 10);
+		mem_free(label);
+		IF_NULL_RETVAL(d->thin_meta, -1);
+	}
+	return 0;
+}
+
+/*
+ * Sets up the loop device and, for encrypted images, the dm-crypt device of an
+ * image, creating the image first if necessary. This may be called from a
+ * worker thread, so audit events are only logged by c_vol_dev_audit_log().
+ */
+static void
+c_vol_dev_setup(c_vol_t *vol, c_vol_dev_t *d)
+{
+	const mount_entry_t *mntent = d->mntent;
+	char *img_meta = NULL, *dev_meta = NULL;
+	int fd_meta = -1;
+
+	d->prepared = true;
+	d->ret = -1;
+
+	/*
+	 * Layers are shared by containers of different GuestOSes, reuse the loop
+	 * device of a running container so that its page cache is shared, too.
+	 */
+	if (mount_entry_get_type(mntent) == MOUNT_TYPE_LAYER && !mount_entry_is_encrypted(mntent)) {
+		d->fd = loopdev_find_attached(d->img, &d->dev);
+		if (d->fd >= 0) {
+			DEBUG("Sharing loop device %s of layer %s", d->dev, d->img);
+			d->ret = 0;
+			return;
+		}
+	}
+
+	/*
+	 * Data volumes are allocated from the thin pool if it is active, unless
+	 * an image file has been created for them before.
+	 */
+	char *thin_marker = c_vol_thin_marker_path_new(vol, mntent);
+	if (thin_marker &&
+	    (file_exists(thin_marker) || (c_vol_thin_pool_active && !file_exists(d->img)))) {
+		int ret = c_vol_thin_dev_setup(vol, d, thin_marker);
+		mem_free(thin_marker);
+		IF_TRUE_RETURN(ret < 0);
+	} else {
+		mem_free(thin_marker);
+		unsigned flags = c_vol_mntent_loopdev_flags(mntent);
+
+		// read-only images still being streamed are served by an nbd device
+		if ((flags & LOOPDEV_RDONLY) && !file_exists(d->img))
+			d->dev = lazyimg_attach_new(d->img, &d->fd);
+
+		if (!d->dev) {
+			if (c_vol_check_image(vol, d->img) < 0) {
+				d->new_image = true;
+				if (c_vol_create_image(vol, d->img, mntent) < 0)
+					return;
+			}
+			d->dev = c_vol_create_loopdev_new(&d->fd, d->img, flags);
+			IF_NULL_RETURN(d->dev);
+		}
+	}
+
+	if (!mount_entry_is_encrypted(mntent)) {
+		d->ret = 0;
+		return;
+	}
+
+	d->crypt_label = mem_printf("%s-%s", uuid_string(container_get_uuid(vol->container)),
+				    mount_entry_get_img(mntent));
+
+	if (!container_get_key(vol->container)) {
+		ERROR("Trying to mount encrypted volume without key...");
+		d->crypt = C_VOL_CRYPT_NO_KEY;
+		return;
+	}
+
+	char *crypt = cryptfs_get_device_path_new(d->crypt_label);
+	if (file_is_blk(crypt)) {
+		INFO("Using existing mapper device: %s", crypt);
+		d->crypt = C_VOL_CRYPT_EXISTING;
+	} else {
+		DEBUG("Setting up cryptfs volume %s for %s", d->crypt_label, d->dev);
+
+		if (d->thin_meta) {
+			dev_meta = mem_strdup(d->thin_meta);
+		} else {
+			img_meta = c_vol_meta_image_path_new(vol, mntent);
+			dev_meta = c_vol_create_loopdev_new(&fd_meta, img_meta, LOOPDEV_DIRECT_IO);
+			mem_free(img_meta);
+		}
+		mem_free(crypt);
+
+		if (!dev_meta) {
+			d->crypt = C_VOL_CRYPT_FAILED;
+			return;
+		}
+
+		crypt = cryptfs_setup_volume_new(d->crypt_label, d->dev,
+						 container_get_key(vol->container), dev_meta,
+						 container_get_crypt_flags(vol->container),
+						 container_get_crypt_sector_size(vol->container));
+
+		// release loopdev fd (crypt device should keep it open now)
+		if (fd_meta >= 0)
+			close(fd_meta);
+		loopdev_free(dev_meta);
+
+		if (!crypt) {
+			ERROR("Setting up cryptfs volume %s for %s failed", d->crypt_label, d->dev);
+			d->crypt = C_VOL_CRYPT_FAILED;
+			return;
+		}
+		d->crypt = C_VOL_CRYPT_OK;
+	}
+
+	loopdev_free(d->dev);
+	d->dev = crypt;
+
+	if (file_wait_blk(d->dev, C_VOL_DM_TIMEOUT) < 0) {
+		ERROR("Device %s for volume %s was not created", d->dev, d->crypt_label);
+		return;
+	}
+
+	d->ret = 0;
+}
+
+static void
+c_vol_dev_audit_log(c_vol_t *vol, const c_vol_dev_t *d)
+{
+	const uuid_t *uuid = container_get_uuid(vol->container);
+
+	switch (d->crypt) {
+	case C_VOL_CRYPT_NO_KEY:
+		audit_log_event(uuid, FSA, CMLD, CONTAINER_MGMT, "setup-crypted-volume-no-key",
+				uuid_string(uuid), 2, "label", d->crypt_label);
+		break;
+	case C_VOL_CRYPT_FAILED:
+		audit_log_event(uuid, FSA, CMLD, CONTAINER_MGMT, "setup-crypted-volume",
+				uuid_string(uuid), 2, "label", d->crypt_label);
+		break;
+	case C_VOL_CRYPT_OK:
+		audit_log_event(uuid, SSA, CMLD, CONTAINER_MGMT, "setup-crypted-volume",
+				uuid_string(uuid), 2, "label", d->crypt_label);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Returns true if the image is an overlay for a feature which is not enabled
+ * for the container.
+ */
+static bool
+c_vol_mntent_is_disabled_feature(const c_vol_t *vol, const mount_entry_t *mntent)
+{
+	const char *img_name = mount_entry_get_img(mntent);
+	size_t feature_len = strlen("feature_");
+
+	if (mount_entry_get_type(mntent) != MOUNT_TYPE_OVERLAY_RO ||
+	    strncmp(img_name, "feature_", feature_len))
+		return false;
+
+	return !container_is_feature_enabled(vol->container, img_name + feature_len);
+}
+
+/*
+ * Returns true if the volume is kept in tmpfs instead of an image because the
+ * container is ephemeral.
+ */
+static bool
+c_vol_mntent_is_ephemeral(const c_vol_t *vol, const mount_entry_t *mntent)
+{
+	switch (mount_entry_get_type(mntent)) {
+	case MOUNT_TYPE_EMPTY:
+	case MOUNT_TYPE_OVERLAY_RW:
+		return container_is_ephemeral(vol->container) &&
+		       strcmp(mount_entry_get_fs(mntent), "tmpfs");
+	default:
+		return false;
+	}
+}
+
+/*
+ * Returns true if the volume is a directory with a project quota instead of
+ * an image, either because it has been created as such or because it is new
+ * and directory storage is enabled.
+ */
+static bool
+c_vol_mntent_is_dir(c_vol_t *vol, const mount_entry_t *mntent)
+{
+	if (c_vol_mntent_is_ephemeral(vol, mntent) || !strcmp(mount_entry_get_fs(mntent), "tmpfs"))
+		return false;
+
+	char *path = c_vol_dir_path_new(vol, mntent);
+	IF_NULL_RETVAL_TRACE(path, false);
+	bool is_dir = file_is_dir(path);
+	mem_free(path);
+	if (is_dir || !c_vol_dir_storage_active)
+		return is_dir;
+
+	// existing image files and thin volumes are kept
+	char *img = c_vol_image_path_new(vol, mntent);
+	char *thin_marker = c_vol_thin_marker_path_new(vol, mntent);
+	is_dir = !file_exists(img) && !file_exists(thin_marker);
+	mem_free(thin_marker);
+	mem_free(img);
+	return is_dir;
+}
+
+/*
+ * Returns true if the image is mounted from a block device.
+ */
+static bool
+c_vol_mntent_needs_dev(c_vol_t *vol, const mount_entry_t *mntent)
+{
+	if (c_vol_mntent_is_ephemeral(vol, mntent) || c_vol_mntent_is_dir(vol, mntent))
+		return false;
+
+	switch (mount_entry_get_type(mntent)) {
+	case MOUNT_TYPE_SHARED:
+	case MOUNT_TYPE_DEVICE:
+	case MOUNT_TYPE_OVERLAY_RO:
+	case MOUNT_TYPE_SHARED_RW:
+	case MOUNT_TYPE_OVERLAY_RW:
+	case MOUNT_TYPE_DEVICE_RW:
+	case MOUNT_TYPE_EMPTY:
+	case MOUNT_TYPE_COPY:
+	case MOUNT_TYPE_LAYER:
+		break;
+	default:
+		return false;
+	}
+
+	return strcmp(mount_entry_get_fs(mntent), "tmpfs") &&
+	       !c_vol_mntent_is_disabled_feature(vol, mntent);
+}
+
+/*
+ * Returns true if the image is the same for all containers of the GuestOS and
+ * only mounted read-only, thus it can be mounted once for all of them.
+ */
+static bool
+c_vol_mntent_is_sharable(c_vol_t *vol, const mount_entry_t *mntent)
+{
+	switch (mount_entry_get_type(mntent)) {
+	case MOUNT_TYPE_SHARED:
+	case MOUNT_TYPE_SHARED_RW:
+		break;
+	default:
+		return false;
+	}
+
+	return c_vol_mntent_needs_dev(vol, mntent) && !mount_entry_is_encrypted(mntent);
+}
+
+/*
+ * Returns the shared lower mount of the image held by the container or NULL.
+ */
+static const c_vol_lower_t *
+c_vol_lower_find(const c_vol_t *vol, const char *img)
+{
+	IF_NULL_RETVAL(img, NULL);
+
+	for (list_t *l = vol->lowers; l; l = l->next) {
+		const c_vol_lower_t *lower = l->data;
+		if (!strcmp(lower->img, img))
+			return lower;
+	}
+	return NULL;
+}
+
+static void
+c_vol_lower_release(c_vol_lower_t *lower)
+{
+	ASSERT(lower->refs > 0);
+	if (--lower->refs > 0)
+		return;
+
+	DEBUG("Releasing shared image %s mounted at %s", lower->img, lower->dir);
+	// the loop device is detached by autoclear after the last umount
+	if (umount2(lower->dir, MNT_DETACH) < 0)
+		WARN_ERRNO("Could not umount shared image %s", lower->dir);
+	if (rmdir(lower->dir) < 0)
+		TRACE_ERRNO("Unable to remove %s", lower->dir);
+
+	c_vol_lower_list = list_remove(c_vol_lower_list, lower);
+	mem_free(lower->img);
+	mem_free(lower->dir);
+	mem_free(lower);
+}
+
+/*
+ * Boot read profiles of shared images. The images are attached with direct I/O,
+ * thus the guest reads them through the page cache of the files in the mounted
+ * file system and not through the one of the image file. Therefore, the pages
+ * of these files which are resident once the first container booted from a
+ * freshly mounted image are recorded beside the image. On later mounts, the
+ * ranges are read ahead in the background while the container is set up.
+ */
+static char *
+c_vol_prefetch_profile_file_new(const char *img)
+{
+	return mem_printf("%s%s", img, C_VOL_PREFETCH_SUFFIX);
+}
+
+/*
+ * Returns the identity of the image a profile is only valid for.
+ */
+static char *
+c_vol_prefetch_image_id_new(const char *img)
+{
+	struct stat st;
+	IF_TRUE_RETVAL(stat(img, &st) < 0, NULL);
+
+	return mem_printf("%ju %jd %jd.%09ld", (uintmax_t)st.st_ino, (intmax_t)st.st_size,
+			  (intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+typedef struct c_vol_prefetch_record {
+	str_t *profile;
+	size_t root_len;
+	dev_t dev;
+} c_vol_prefetch_record_t;
+
+static void
+c_vol_prefetch_record_file(c_vol_prefetch_record_t *rec, const char *path)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned char *vec = NULL;
+	void *addr = MAP_FAILED;
+	struct stat st;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		goto out;
+
+	size_t pages = (st.st_size + page_size - 1) / page_size;
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	IF_TRUE_GOTO(addr == MAP_FAILED, out);
+	vec = mem_alloc(pages);
+	IF_TRUE_GOTO(mincore(addr, st.st_size, vec) < 0, out);
+
+	// merge resident pages into ranges, bridging small gaps
+	for (size_t i = 0; i < pages;) {
+		if (!(vec[i] & 1)) {
+			i++;
+			continue;
+		}
+		size_t end = i + 1, gap = 0;
+		for (size_t j = end; j < pages && gap <= C_VOL_PREFETCH_GAP_PAGES; j++) {
+			gap = (vec[j] & 1) ? 0 : gap + 1;
+			if (!gap)
+				end = j + 1;
+		}
+		str_append_printf(rec->profile, "%s %zu %zu\n", path + rec->root_len,
+				  i * page_size, (end - i) * page_size);
+		i = end;
+	}
+out:
+	if (addr != MAP_FAILED)
+		munmap(addr, st.st_size);
+	mem_free(vec);
+	if (fd >= 0)
+		close(fd);
+}
+
+static int
+c_vol_prefetch_record_cb(const char *path, const char *file, void *data)
+{
+	c_vol_prefetch_record_t *rec = data;
+	struct stat st;
+
+	// the profile is line and space separated
+	IF_TRUE_RETVAL(strpbrk(file, " \t\n"), 0);
+	IF_TRUE_RETVAL(str_length(rec->profile) >= C_VOL_PREFETCH_MAXLEN, -1);
+
+	char *full = mem_printf("%s/%s", path, file);
+	if (lstat(full, &st) == 0 && st.st_dev == rec->dev) {
+		if (S_ISDIR(st.st_mode))
+			dir_foreach(full, &c_vol_prefetch_record_cb, rec);
+		else if (S_ISREG(st.st_mode))
+			c_vol_prefetch_record_file(rec, full);
+	}
+	mem_free(full);
+	return 0;
+}
+
+static void
+c_vol_prefetch_child_cb(pid_t pid, int status, event_child_t *child, void *data)
+{
+	char *img = data;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+		DEBUG("Prefetch helper %d for %s finished", pid, img);
+	else
+		WARN("Prefetch helper %d for %s failed", pid, img);
+
+	mem_free(img);
+	event_child_free(child);
+}
+
+/*
+ * Forks a helper process which runs func on the lower mount and reaps it from
+ * the main loop. The helper must not log, as the fds of the log are closed.
+ */
+static void
+c_vol_prefetch_fork(const c_vol_lower_t *lower, int (*func)(const c_vol_lower_t *lower))
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		WARN_ERRNO("Could not fork prefetch helper for %s", lower->img);
+		return;
+	} else if (pid == 0) {
+		fd_close_all_except(-1);
+		_exit(func(lower) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	char *img = mem_strdup(lower->img);
+	event_child_t *child = event_child_new(pid, c_vol_prefetch_child_cb, img);
+	if (event_add_child(child) < 0) {
+		WARN("Failed to register reaper for prefetch helper process %d", pid);
+		event_child_free(child);
+		mem_free(img);
+	}
+}
+
+static int
+c_vol_prefetch_record(const c_vol_lower_t *lower)
+{
+	struct stat st;
+	IF_TRUE_RETVAL(stat(lower->dir, &st) < 0, -1);
+
+	char *id = c_vol_prefetch_image_id_new(lower->img);
+	IF_NULL_RETVAL(id, -1);
+
+	c_vol_prefetch_record_t rec = { .profile = str_new(id), .root_len = strlen(lower->dir) + 1,
+					.dev = st.st_dev };
+	str_append(rec.profile, "\n");
+	dir_foreach(lower->dir, &c_vol_prefetch_record_cb, &rec);
+
+	// replace the profile atomically, it may be read by a concurrent replay
+	char *profile_file = c_vol_prefetch_profile_file_new(lower->img);
+	char *tmp_file = mem_printf("%s.tmp", profile_file);
+	int ret = 0;
+	if (file_write(tmp_file, str_buffer(rec.profile), -1) < 0 ||
+	    rename(tmp_file, profile_file) < 0) {
+		unlink(tmp_file);
+		ret = -1;
+	}
+
+	mem_free(tmp_file);
+	mem_free(profile_file);
+	str_free(rec.profile, true);
+	mem_free(id);
+	return ret;
+}
+
+static int
+c_vol_prefetch_replay(const c_vol_lower_t *lower)
+{
+	char *profile_file = c_vol_prefetch_profile_file_new(lower->img);
+	char *profile = file_read_new(profile_file, C_VOL_PREFETCH_MAXLEN);
+	mem_free(profile_file);
+	IF_NULL_RETVAL(profile, -1);
+
+	int root = open(lower->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int fd = -1;
+	char *last = NULL;
+	char *save = NULL;
+
+	// the header with the image id is checked before forking
+	strtok_r(profile, "\n", &save);
+	for (char *line = strtok_r(NULL, "\n", &save); line && root >= 0;
+	     line = strtok_r(NULL, "\n", &save)) {
+		char path[PATH_MAX];
+		uint64_t offset, len;
+		if (sscanf(line, "%4095s %" SCNu64 " %" SCNu64, path, &offset, &len) != 3)
+			continue;
+
+		// ranges of the same file are consecutive
+		if (!last || strcmp(last, path)) {
+			if (fd >= 0)
+				close(fd);
+			fd = openat(root, path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+			mem_free(last);
+			last = mem_strdup(path);
+		}
+		if (fd >= 0)
+			readahead(fd, offset, len);
+	}
+
+	if (fd >= 0)
+		close(fd);
+	if (root >= 0)
+		close(root);
+	mem_free(last);
+	mem_free(profile);
+	return 0;
+}
+
+/*
+ * Starts reading ahead a freshly mounted shared image along its boot read
+ * profile. If there is no profile for the image in its current version, the
+ * profile is recorded once the container booted, see c_vol_start_post_boot().
+ */
+static void
+c_vol_prefetch_start(c_vol_lower_t *lower)
+{
+	char *profile_file = c_vol_prefetch_profile_file_new(lower->img);
+	char *header = file_read_new(profile_file, PATH_MAX);
+	char *id = c_vol_prefetch_image_id_new(lower->img);
+
+	char *eol = header ? strchr(header, '\n') : NULL;
+	if (eol)
+		*eol = '\0';
+
+	if (eol && id && !strcmp(header, id)) {
+		DEBUG("Reading ahead %s along boot read profile %s", lower->dir, profile_file);
+		c_vol_prefetch_fork(lower, &c_vol_prefetch_replay);
+	} else {
+		DEBUG("No valid boot read profile for %s, recording it", lower->img);
+		lower->record = true;
+	}
+
+	mem_free(id);
+	mem_free(header);
+	mem_free(profile_file);
+}
+
+static char *
+c_vol_lower_dir_new(const c_vol_t *vol, const mount_entry_t *mntent)
+{
+	const guestos_t *os = container_get_os(vol->container);
+	return mem_printf("%s/%s-%" PRIu64 "/%s", C_VOL_LOWER_DIR, guestos_get_name(os),
+			  guestos_get_version(os), mount_entry_get_img(mntent));
+}
+
+/*
+ * Mounts the image read-only below C_VOL_LOWER_DIR in the mount namespace of
+ * cmld if it is not mounted yet and takes a reference on the mount.
+ */
+static c_vol_lower_t *
+c_vol_lower_acquire(c_vol_t *vol, const mount_entry_t *mntent)
+{
+	char *img = c_vol_image_path_new(vol, mntent);
+	c_vol_lower_t *lower = NULL;
+	char *dev = NULL;
+	int fd = -1;
+
+	for (list_t *l = c_vol_lower_list; l; l = l->next) {
+		c_vol_lower_t *i = l->data;
+		if (!strcmp(i->img, img)) {
+			lower = i;
+			lower->refs++;
+			goto out;
+		}
+	}
+
+	char *dir = c_vol_lower_dir_new(vol, mntent);
+	if (dir_mkdir_p(dir, 0700) < 0) {
+		ERROR_ERRNO("Could not mkdir %s", dir);
+		goto error;
+	}
+
+	dev = c_vol_create_loopdev_new(&fd, img, LOOPDEV_DIRECT_IO | LOOPDEV_RDONLY);
+	IF_NULL_GOTO(dev, error);
+
+	unsigned long mountflags = MS_RDONLY | MS_NOATIME | MS_NODEV;
+	const char *mount_data = mount_entry_get_mount_data(mntent);
+	if (mount(dev, dir, mount_entry_get_fs(mntent), mountflags, mount_data) < 0 &&
+	    (!is_selinux_disabled() ||
+	     mount(dev, dir, mount_entry_get_fs(mntent), mountflags, NULL) < 0)) {
+		ERROR_ERRNO("Could not mount shared image %s using %s to %s", img, dev, dir);
+		goto error;
+	}
+	// umounts in cmld and in the containers must not propagate to each other
+	if (mount(NULL, dir, NULL, MS_PRIVATE, NULL) < 0)
+		WARN_ERRNO("Could not mount '%s' MS_PRIVATE", dir);
+	DEBUG("Mounted shared image %s using %s to %s", img, dev, dir);
+
+	lower = mem_new0(c_vol_lower_t, 1);
+	lower->img = img;
+	lower->dir = dir;
+	lower->refs = 1;
+	c_vol_lower_list = list_append(c_vol_lower_list, lower);
+	img = NULL;
+	c_vol_prefetch_start(lower);
+	goto out;
+
+error:
+	if (rmdir(dir) < 0)
+		TRACE_ERRNO("Unable to remove %s", dir);
+	mem_free(dir);
+out:
+	if (fd >= 0)
+		close(fd);
+	if (dev)
+		loopdev_free(dev);
+	mem_free(img);
+	return lower;
+}
+
+/*
+ * Takes a reference on the shared mount of the image, which has been mounted by
+ * a previous cmld instance for a running container.
+ */
+static c_vol_lower_t *
+c_vol_lower_adopt(c_vol_t *vol, const mount_entry_t *mntent)
+{
+	char *img = c_vol_image_path_new(vol, mntent);
+
+	for (list_t *l = c_vol_lower_list; l; l = l->next) {
+		c_vol_lower_t *lower = l->data;
+		if (!strcmp(lower->img, img)) {
+			lower->refs++;
+			mem_free(img);
+			return lower;
+		}
+	}
+
+	// the container uses a loop device of its own if the image was not shared
+	char *dir = c_vol_lower_dir_new(vol, mntent);
+	if (!file_is_mountpoint(dir)) {
+		mem_free(img);
+		mem_free(dir);
+		return NULL;
+	}
+
+	c_vol_lower_t *lower = mem_new0(c_vol_lower_t, 1);
+	lower->img = img;
+	lower->dir = dir;
+	lower->refs = 1;
+	c_vol_lower_list = list_append(c_vol_lower_list, lower);
+	return lower;
+}
+
+/*
+ * Mounts the image from its shared lower mount, either read-only as is or
+ * with a private writable tmpfs overlay on top.
+ */
+static int
+c_vol_mount_lower(c_vol_t *vol, const c_vol_lower_t *lower, const mount_entry_t *mntent,
+		  const char *dir, unsigned long mountflags)
+{
+	if (mount_entry_get_type(mntent) == MOUNT_TYPE_SHARED) {
+		if (mount(lower->dir, dir, NULL, MS_BIND, NULL) < 0 ||
+		    mount(NULL, dir, NULL, MS_REMOUNT | MS_BIND | mountflags, NULL) < 0) {
+			ERROR_ERRNO("Could not bind shared image %s to %s", lower->dir, dir);
+			return -1;
+		}
+		DEBUG("Successfully bound shared image %s to %s", lower->dir, dir);
+		return 0;
+	}
+
+	char *overlayfs_mount_dir = mem_printf("/tmp/overlayfs/%s/%d",
+					       uuid_string(container_get_uuid(vol->container)),
+					       ++vol->overlay_count);
+	int ret = c_vol_mount_overlay(dir, "tmpfs", NULL, mountflags,
+				      mount_entry_get_mount_data(mntent), NULL, NULL, lower->dir,
+				      overlayfs_mount_dir);
+	if (ret < 0)
+		ERROR("Could not mount shared image %s using overlay to %s", lower->dir, dir);
+	else
+		DEBUG("Successfully mounted shared image %s using overlay to %s", lower->dir,
+		      dir);
+	mem_free(overlayfs_mount_dir);
+	return ret;
+}
+
+/*
+ * Mounts a tmpfs of the volume's size in place of the volume of an ephemeral
+ * container, either directly or as upper dir of an overlay. Its pages are
+ * charged to the memory cgroup of the container processes writing them, thus
+ * they count against the container's ram limit.
+ */
+static int
+c_vol_mount_ephemeral(c_vol_t *vol, const mount_entry_t *mntent, const char *dir,
+		      unsigned long mountflags)
+{
+	int uid = container_get_uid(vol->container);
+	char *tmpfs_opts = c_vol_get_tmpfs_opts_new(NULL, uid, uid, mount_entry_get_size(mntent));
+	int ret;
+
+	if (mount_entry_get_type(mntent) == MOUNT_TYPE_EMPTY) {
+		ret = mount("tmpfs", dir, "tmpfs", mountflags, tmpfs_opts);
+		if (ret < 0)
+			ERROR_ERRNO("Could not mount tmpfs for ephemeral volume %s to %s",
+				    mount_entry_get_img(mntent), dir);
+	} else {
+		char *overlayfs_mount_dir =
+			mem_printf("/tmp/overlayfs/%s/%d",
+				   uuid_string(container_get_uuid(vol->container)),
+				   ++vol->overlay_count);
+		ret = c_vol_mount_overlay(dir, "tmpfs", NULL, mountflags, tmpfs_opts, NULL, NULL,
+					  NULL, overlayfs_mount_dir);
+		if (ret < 0)
+			ERROR("Could not mount tmpfs overlay for ephemeral volume %s to %s",
+			      mount_entry_get_img(mntent), dir);
+		mem_free(overlayfs_mount_dir);
+	}
+	if (!ret)
+		DEBUG("Successfully mounted ephemeral volume %s (%" PRIu64 " MBytes) to %s",
+		      mount_entry_get_img(mntent), mount_entry_get_size(mntent), dir);
+
+	mem_free(tmpfs_opts);
+	return ret;
 }
 
 /*
- * Copy busybox binary to target_base directory.
- * Remeber, this will only succeed if targetfs is writable.
+ * Bind mounts the dir of a directory-backed volume, creating it if necessary.
+ * The quota is set on each mount, thus a changed storage size takes effect on
+ * the next start of the container.
  */
 static int
-c_vol_setup_busybox_copy(const char *target_base)
+c_vol_mount_dir(c_vol_t *vol, const mount_entry_t *mntent, const char *dir,
+		unsigned long mountflags)
 {
-	int ret = 0;
-	char *target_bin = mem_printf("%s%s", target_base, BUSYBOX_PATH);
-	char *target_dir = mem_strdup(target_bin);
-	char *target_dir_p = dirname(target_dir);
-	if ((ret = dir_mkdir_p(target_dir_p, 0755)) < 0) {
-		WARN_ERRNO("Could not mkdir '%s' dir", target_dir_p);
-	} else if (file_exists("/bin/busybox")) {
-		file_copy("/bin/busybox", target_bin, -1, 512, 0);
-		INFO("Copied %s to container", target_bin);
-		if (chmod(target_bin, 0755)) {
-			WARN_ERRNO("Could not set %s executable", target_bin);
-			ret = -1;
-		}
-	} else {
-		WARN_ERRNO("Could not copy %s to container", target_bin);
-		ret = -1;
+	char *path = c_vol_dir_path_new(vol, mntent);
+	int ret = -1;
+
+	if (mkdir(path, 0755) == 0)
+		INFO("Created volume dir %s", path);
+	else if (errno != EEXIST) {
+		ERROR_ERRNO("Could not create volume dir %s", path);
+		goto out;
 	}
+	IF_TRUE_GOTO(c_vol_dir_set_quota(path, MAX(mount_entry_get_size(mntent), 10)) < 0, out);
 
-	mem_free(target_bin);
-	mem_free(target_dir);
+	if (mount(path, dir, NULL, MS_BIND, NULL) < 0) {
+		ERROR_ERRNO("Could not bind mount volume dir %s to %s", path, dir);
+		goto out;
+	}
+	// the flags of a bind mount can only be changed by a remount
+	if (mount(NULL, dir, NULL, MS_BIND | MS_REMOUNT | mountflags, NULL) < 0) {
+		ERROR_ERRNO("Could not remount volume dir %s at %s", path, dir);
+		umount2(dir, MNT_DETACH);
+		goto out;
+	}
+	DEBUG("Successfully mounted volume dir %s (%" PRIu64 " MBytes) to %s", path,
+	      mount_entry_get_size(mntent), dir);
+	ret = 0;
+out:
+	mem_free(path);
 	return ret;
 }
 
+/*
+ * Mounts the layer image dev read-only below the overlayfs dir of the
+ * container and puts it on top of the layer stack being set up.
+ */
 static int
-c_vol_setup_busybox_install(void)
+c_vol_mount_layer(c_vol_t *vol, const mount_entry_t *mntent, const char *dev,
+		  unsigned long mountflags)
 {
-	// skip if busybox was not coppied
-	IF_FALSE_RETVAL_TRACE(file_exists("/bin/busybox"), 0);
+	char *layer_dir = mem_printf("/tmp/overlayfs/%s/%d",
+				     uuid_string(container_get_uuid(vol->container)),
+				     ++vol->overlay_count);
+	if (dir_mkdir_p(layer_dir, 0755) < 0) {
+		ERROR_ERRNO("Could not mkdir layer dir %s", layer_dir);
+		mem_free(layer_dir);
+		return -1;
+	}
 
-	IF_TRUE_RETVAL(dir_mkdir_p("/bin", 0755) < 0, -1);
-	IF_TRUE_RETVAL(dir_mkdir_p("/sbin", 0755) < 0, -1);
+	if (mount(dev, layer_dir, mount_entry_get_fs(mntent), mountflags | MS_RDONLY,
+		  mount_entry_get_mount_data(mntent)) < 0) {
+		ERROR_ERRNO("Could not mount layer %s using %s to %s", mount_entry_get_img(mntent),
+			    dev, layer_dir);
+		mem_free(layer_dir);
+		return -1;
+	}
+	DEBUG("Successfully mounted layer %s using %s to %s", mount_entry_get_img(mntent), dev,
+	      layer_dir);
 
-	const char *const argv[] = { "busybox", "--install", "-s", NULL };
-	return proc_fork_and_execvp(argv);
+	char *layer_dirs = vol->layer_dirs ? mem_printf("%s:%s", layer_dir, vol->layer_dirs) :
+					     mem_strdup(layer_dir);
+	mem_free(vol->layer_dirs);
+	vol->layer_dirs = layer_dirs;
+	mem_free(layer_dir);
+	return 0;
 }
 
 /**
@@ -662,17 +2103,19 @@ c_vol_setup_busybox_install(void)
  * thread or child process.
  * @param vol The vol struct for the container.
  * @param root The directory where the root file system should be mounted.
- * @param mntent The information for this mount.
+ * @param d The image with its information for this mount and its block device
+ * if it has already been set up by c_vol_dev_setup().
  * @return -1 on error else 0.
  */
 static int
-c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
+c_vol_mount_image(c_vol_t *vol, const char *root, c_vol_dev_t *d)
 {
-	char *img, *dev, *img_meta, *dev_meta, *dir;
-	int fd = 0, fd_meta = 0;
+	const mount_entry_t *mntent = d->mntent;
+	char *img, *dev, *dir;
 	bool new_image = false;
 	bool encrypted = mount_entry_is_encrypted(mntent);
 	bool overlay = false;
+	bool layer = false;
 	bool shiftids = false;
 	bool is_root = strcmp(mount_entry_get_dir(mntent), "/") == 0;
 	bool setup_mode = container_has_setup_mode(vol->container);
@@ -681,17 +2124,19 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 	// default mountflags for most image types
 	unsigned long mountflags = setup_mode ? MS_NOATIME : MS_NOATIME | MS_NODEV;
 
-	img = dev = img_meta = dev_meta = dir = NULL;
+	dev = dir = NULL;
 
 	if (mount_entry_get_dir(mntent)[0] == '/')
 		dir = mem_printf("%s%s", root, mount_entry_get_dir(mntent));
 	else
 		dir = mem_printf("%s/%s", root, mount_entry_get_dir(mntent));
 
-	img = c_vol_image_path_new(vol, mntent);
+	img = d->img;
 	if (!img)
 		goto error;
 
+	PROBE2(c_vol_mount_begin, img, mount_entry_get_type(mntent));
+
 	switch (mount_entry_get_type(mntent)) {
 	case MOUNT_TYPE_SHARED:
 	case MOUNT_TYPE_DEVICE:
@@ -725,6 +2170,10 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 	case MOUNT_TYPE_FLASH:
 		DEBUG("Skipping mounting of FLASH type image %s", mount_entry_get_img(mntent));
 		goto final;
+	case MOUNT_TYPE_LAYER:
+		layer = true;
+		shiftids = true; // of the writable overlay on top of the stack
+		break;
 	default:
 		ERROR("Unsupported operating system mount type %d for %s",
 		      mount_entry_get_type(mntent), mount_entry_get_img(mntent));
@@ -735,15 +2184,32 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 	if (dir_mkdir_p(dir, 0777) < 0)
 		DEBUG_ERRNO("Could not mkdir %s", dir);
 
+	// check if its a feature mount and if the container has the feature enabled
+	if (c_vol_mntent_is_disabled_feature(vol, mntent)) {
+		DEBUG("Feature %s not enabled, skipping...",
+		      mount_entry_get_img(mntent) + strlen("feature_"));
+		goto final;
+	}
+
+	if (c_vol_mntent_is_ephemeral(vol, mntent)) {
+		IF_TRUE_GOTO(c_vol_mount_ephemeral(vol, mntent, dir, mountflags) < 0, error);
+		goto final;
+	}
+
+	if (c_vol_mntent_is_dir(vol, mntent)) {
+		IF_TRUE_GOTO(c_vol_mount_dir(vol, mntent, dir, mountflags) < 0, error);
+		goto final;
+	}
+
 	if (strcmp(mount_entry_get_fs(mntent), "tmpfs") == 0) {
 		const char *mount_data = mount_entry_get_mount_data(mntent);
-		char *tmpfs_opts = c_vol_get_tmpfs_opts_new(mount_data, uid, uid);
+		char *tmpfs_opts = c_vol_get_tmpfs_opts_new(mount_data, uid, uid, 0);
 		if (mount(mount_entry_get_fs(mntent), dir, mount_entry_get_fs(mntent), mountflags,
 			  tmpfs_opts) >= 0) {
 			DEBUG("Sucessfully mounted %s to %s", mount_entry_get_fs(mntent), dir);
 			mem_free(tmpfs_opts);
-			if (is_root && setup_mode && c_vol_setup_busybox_copy(dir) < 0)
-				WARN("Cannot copy busybox for setup mode!");
+			if (is_root && setup_mode && c_vol_setup_busybox(vol, dir) < 0)
+				WARN("Cannot set up busybox for setup mode!");
 			goto final;
 		} else {
 			ERROR_ERRNO("Cannot mount %s to %s", mount_entry_get_fs(mntent), dir);
@@ -752,76 +2218,20 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 		}
 	}
 
-	if (c_vol_check_image(vol, img) < 0) {
-		new_image = true;
-		if (c_vol_create_image(vol, img, mntent) < 0) {
-			goto error;
-		}
+	const c_vol_lower_t *lower = c_vol_lower_find(vol, img);
+	if (lower) {
+		IF_TRUE_GOTO(c_vol_mount_lower(vol, lower, mntent, dir, mountflags) < 0, error);
+		goto final;
 	}
 
-	dev = c_vol_create_loopdev_new(&fd, img);
-	IF_NULL_GOTO(dev, error);
-
-	if (encrypted) {
-		char *label, *crypt;
+	if (!d->prepared)
+		c_vol_dev_setup(vol, d);
+	c_vol_dev_audit_log(vol, d);
+	PROBE2(c_vol_mount_dev, img, d->ret);
+	IF_TRUE_GOTO(d->ret < 0, error);
 
-		label = mem_printf("%s-%s", uuid_string(container_get_uuid(vol->container)),
-				   mount_entry_get_img(mntent));
-
-		if (!container_get_key(vol->container)) {
-			audit_log_event(container_get_uuid(vol->container), FSA, CMLD,
-					CONTAINER_MGMT, "setup-crypted-volume-no-key",
-					uuid_string(container_get_uuid(vol->container)), 2, "label",
-					label);
-			ERROR("Trying to mount encrypted volume without key...");
-			mem_free(label);
-			goto error;
-		}
-
-		crypt = cryptfs_get_device_path_new(label);
-		if (file_is_blk(crypt)) {
-			INFO("Using existing mapper device: %s", crypt);
-		} else {
-			DEBUG("Setting up cryptfs volume %s for %s", label, dev);
-
-			img_meta = c_vol_meta_image_path_new(vol, mntent);
-			dev_meta = c_vol_create_loopdev_new(&fd_meta, img_meta);
-
-			IF_NULL_GOTO(dev_meta, error);
-
-			mem_free(crypt);
-			crypt = cryptfs_setup_volume_new(
-				label, dev, container_get_key(vol->container), dev_meta);
-
-			// release loopdev fd (crypt device should keep it open now)
-			close(fd_meta);
-			mem_free(img_meta);
-
-			if (!crypt) {
-				audit_log_event(container_get_uuid(vol->container), FSA, CMLD,
-						CONTAINER_MGMT, "setup-crypted-volume",
-						uuid_string(container_get_uuid(vol->container)), 2,
-						"label", label);
-				ERROR("Setting up cryptfs volume %s for %s failed", label, dev);
-				mem_free(label);
-				goto error;
-			}
-			audit_log_event(container_get_uuid(vol->container), SSA, CMLD,
-					CONTAINER_MGMT, "setup-crypted-volume",
-					uuid_string(container_get_uuid(vol->container)), 2, "label",
-					label);
-		}
-
-		mem_free(label);
-		mem_free(dev);
-		dev = crypt;
-
-		// TODO: timeout?
-		while (access(dev, F_OK) < 0) {
-			usleep(1000 * 10);
-			DEBUG("Waiting for %s", dev);
-		}
-	}
+	dev = d->dev;
+	new_image = d->new_image;
 
 	if (overlay) {
 		const char *upper_fstype = NULL;
@@ -848,18 +2258,6 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 		} break;
 
 		case MOUNT_TYPE_OVERLAY_RO: {
-			// check if its a feature mount and if the container has the feature enabled
-			const char *img_name = mount_entry_get_img(mntent);
-			size_t feature_len = strlen("feature_");
-			if (strncmp(img_name, "feature_", feature_len) == 0) {
-				if (!container_is_feature_enabled(vol->container,
-								  img_name + feature_len)) {
-					DEBUG("Feature %s not enabled, skipping...",
-					      img_name + feature_len);
-					goto final;
-				}
-				DEBUG("Going to mount feature %s", img_name + feature_len);
-			}
 			upper_dev = dev;
 			upper_fstype = mount_entry_get_fs(mntent);
 			mountflags |= MS_RDONLY;
@@ -881,7 +2279,7 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 				   uuid_string(container_get_uuid(vol->container)),
 				   ++vol->overlay_count);
 		if (c_vol_mount_overlay(dir, upper_fstype, lower_fstype, mountflags, mount_data,
-					upper_dev, lower_dev, overlayfs_mount_dir) < 0) {
+					upper_dev, lower_dev, NULL, overlayfs_mount_dir) < 0) {
 			ERROR_ERRNO("Could not mount %s to %s", img, dir);
 			mem_free(overlayfs_mount_dir);
 			goto error;
@@ -891,6 +2289,30 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 		goto final;
 	}
 
+	if (layer) {
+		IF_TRUE_GOTO(c_vol_mount_layer(vol, mntent, dev, mountflags) < 0, error);
+		// the stack is mounted to dir together with its topmost layer
+		if (!d->stack_top)
+			goto out;
+
+		char *overlayfs_mount_dir =
+			mem_printf("/tmp/overlayfs/%s/%d",
+				   uuid_string(container_get_uuid(vol->container)),
+				   ++vol->overlay_count);
+		int ret = c_vol_mount_overlay(dir, "tmpfs", NULL, mountflags,
+					      mount_entry_get_mount_data(mntent), NULL, NULL,
+					      vol->layer_dirs, overlayfs_mount_dir);
+		mem_free(overlayfs_mount_dir);
+		if (ret < 0) {
+			ERROR("Could not mount layers %s to %s", vol->layer_dirs, dir);
+			goto error;
+		}
+		DEBUG("Successfully mounted layers %s using overlay to %s", vol->layer_dirs, dir);
+		mem_free(vol->layer_dirs);
+		vol->layer_dirs = NULL;
+		goto final;
+	}
+
 	DEBUG("Mounting image %s %s using %s to %s", img, mountflags & MS_RDONLY ? "ro" : "rw", dev,
 	      dir);
 
@@ -944,6 +2366,7 @@ c_vol_mount_image(c_vol_t *vol, const char *root, const mount_entry_t *mntent)
 	DEBUG("Sucessfully mounted %s using %s to %s", img, dev, dir);
 
 final:
+	PROBE1(c_vol_mount_mounted, img);
 	if (mount(NULL, dir, NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
 		ERROR_ERRNO("Could not mount '%s' MS_PRIVATE", dir);
 		goto error;
@@ -956,37 +2379,18 @@ final:
 		}
 	}
 
-	if (dev)
-		loopdev_free(dev);
-	if (dev_meta)
-		loopdev_free(dev_meta);
-	if (img)
-		mem_free(img);
-	if (img_meta)
-		mem_free(img_meta);
+out:
+	PROBE2(c_vol_mount_end, img, 0);
+	c_vol_dev_release(d);
 	if (dir)
 		mem_free(dir);
-	if (fd)
-		close(fd);
-	if (fd_meta)
-		close(fd_meta);
 	return 0;
 
 error:
-	if (dev)
-		loopdev_free(dev);
-	if (dev_meta)
-		loopdev_free(dev_meta);
-	if (img)
-		mem_free(img);
-	if (img_meta)
-		mem_free(img_meta);
+	PROBE2(c_vol_mount_end, img, -1);
+	c_vol_dev_release(d);
 	if (dir)
 		mem_free(dir);
-	if (fd)
-		close(fd);
-	if (fd_meta)
-		close(fd_meta);
 	return -1;
 }
 
@@ -1008,6 +2412,20 @@ c_vol_cleanup_dm(c_vol_t *vol)
 		// we just try to delete all mounts and ignore their type...
 		if (cryptfs_delete_blk_dev(label) < 0)
 			DEBUG("Could not delete dm %s", label);
+
+		// thin devices are below the dm-crypt device, thus removed afterwards
+		char *thin_marker = c_vol_thin_marker_path_new(vol, mntent);
+		if (thin_marker && file_exists(thin_marker)) {
+			char *thin_label = mem_printf("%s-thin", label);
+			if (dmthin_deactivate(thin_label) < 0 && errno != ENXIO)
+				WARN("Could not deactivate thin device %s", thin_label);
+			mem_free(thin_label);
+			thin_label = mem_printf("%s-thin-meta", label);
+			if (dmthin_deactivate(thin_label) < 0 && errno != ENXIO)
+				WARN("Could not deactivate thin device %s", thin_label);
+			mem_free(thin_label);
+		}
+		mem_free(thin_marker);
 		mem_free(label);
 	}
 
@@ -1106,6 +2524,85 @@ error:
 	return -1;
 }
 
+typedef struct {
+	c_vol_t *vol;
+	c_vol_dev_t *devs;
+	size_t n;
+	size_t next;
+	pthread_mutex_t lock;
+} c_vol_prepare_t;
+
+static void *
+c_vol_prepare_worker(void *data)
+{
+	c_vol_prepare_t *p = data;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		size_t i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+
+		if (i >= p->n)
+			return NULL;
+
+		c_vol_dev_t *d = &p->devs[i];
+		if (d->queued)
+			c_vol_dev_setup(p->vol, d);
+	}
+}
+
+/*
+ * Sets up the block devices of all images which do not depend on each other,
+ * i.e. which do not share the same image file, concurrently. The images are
+ * mounted afterwards in order, remaining devices are set up on the fly.
+ */
+static void
+c_vol_prepare_devs(c_vol_t *vol, c_vol_dev_t *devs, size_t n)
+{
+	size_t todo = 0;
+
+	// mark the independent images, c_vol_prepare_worker() sets them up
+	for (size_t i = 0; i < n; i++) {
+		if (!devs[i].img || !c_vol_mntent_needs_dev(vol, devs[i].mntent) ||
+		    c_vol_lower_find(vol, devs[i].img))
+			continue;
+
+		bool shared = false;
+		for (size_t j = 0; j < n && !shared; j++) {
+			shared = j != i && devs[j].img && !strcmp(devs[i].img, devs[j].img) &&
+				 c_vol_mntent_needs_dev(vol, devs[j].mntent);
+		}
+		if (!shared) {
+			devs[i].queued = true;
+			todo++;
+		}
+	}
+	IF_TRUE_RETURN(todo < 2);
+
+	c_vol_prepare_t p = { .vol = vol, .devs = devs, .n = n, .next = 0 };
+	pthread_mutex_init(&p.lock, NULL);
+
+	size_t n_threads = MIN(todo, (size_t)C_VOL_PREPARE_THREADS);
+	pthread_t threads[C_VOL_PREPARE_THREADS];
+	size_t started = 0;
+
+	DEBUG("Setting up devices of %zu images using %zu threads", todo, n_threads);
+	for (; started < n_threads; started++) {
+		if (pthread_create(&threads[started], NULL, c_vol_prepare_worker, &p)) {
+			WARN("Could not start thread for setting up image devices");
+			break;
+		}
+	}
+	// do the work in this thread if no thread could be started
+	if (!started)
+		c_vol_prepare_worker(&p);
+
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&p.lock);
+}
+
 /**
  * Mount all image files.
  * This function is called in the rootns.
@@ -1113,7 +2610,8 @@ error:
 static int
 c_vol_mount_images(c_vol_t *vol)
 {
-	size_t i, n;
+	size_t i, n, n_setup = 0;
+	int ret = -1;
 
 	ASSERT(vol);
 
@@ -1122,16 +2620,36 @@ c_vol_mount_images(c_vol_t *vol)
 	// in setup mode mount container images under {root}/setup subfolder
 	char *c_root = mem_printf("%s%s", vol->root, (setup_mode) ? "/setup" : "");
 
-	if (setup_mode) {
-		n = mount_get_count(container_get_mount_setup(vol->container));
-		for (i = 0; i < n; i++) {
-			const mount_entry_t *mntent;
+	if (setup_mode)
+		n_setup = mount_get_count(container_get_mount_setup(vol->container));
+	n = n_setup + mount_get_count(container_get_mount(vol->container));
 
-			mntent = mount_get_entry(container_get_mount_setup(vol->container), i);
+	c_vol_dev_t *devs = mem_new0(c_vol_dev_t, MAX(n, (size_t)1));
+	for (i = 0; i < n; i++) {
+		devs[i].mntent =
+			(i < n_setup) ?
+				mount_get_entry(container_get_mount_setup(vol->container), i) :
+				mount_get_entry(container_get_mount(vol->container), i - n_setup);
+		devs[i].img = c_vol_image_path_new(vol, devs[i].mntent);
+		devs[i].fd = -1;
+	}
 
-			if (c_vol_mount_image(vol, vol->root, mntent) < 0) {
-				goto err;
-			}
+	// consecutive layers of the same mount point are stacked in one overlay
+	for (i = 0; i < n; i++) {
+		if (mount_entry_get_type(devs[i].mntent) != MOUNT_TYPE_LAYER)
+			continue;
+		devs[i].stack_top = i + 1 == n || i + 1 == n_setup ||
+				    mount_entry_get_type(devs[i + 1].mntent) != MOUNT_TYPE_LAYER ||
+				    strcmp(mount_entry_get_dir(devs[i].mntent),
+					   mount_entry_get_dir(devs[i + 1].mntent));
+	}
+
+	c_vol_prepare_devs(vol, devs, n);
+
+	if (setup_mode) {
+		for (i = 0; i < n_setup; i++) {
+			if (c_vol_mount_image(vol, vol->root, &devs[i]) < 0)
+				goto out;
 		}
 
 		// create mount point for setup
@@ -1139,23 +2657,27 @@ c_vol_mount_images(c_vol_t *vol)
 			DEBUG_ERRNO("Could not mkdir %s", c_root);
 	}
 
-	n = mount_get_count(container_get_mount(vol->container));
+	for (i = n_setup; i < n; i++) {
+		if (c_vol_mount_image(vol, c_root, &devs[i]) < 0)
+			goto out;
+	}
+	ret = 0;
+out:
 	for (i = 0; i < n; i++) {
-		const mount_entry_t *mntent;
-
-		mntent = mount_get_entry(container_get_mount(vol->container), i);
+		c_vol_dev_release(&devs[i]);
+		mem_free(devs[i].img);
+		mem_free(devs[i].crypt_label);
+	}
+	mem_free(devs);
+	mem_free(vol->layer_dirs);
+	vol->layer_dirs = NULL;
 
-		if (c_vol_mount_image(vol, c_root, mntent) < 0) {
-			goto err;
-		}
+	if (ret < 0) {
+		c_vol_umount_all(vol);
+		c_vol_cleanup_dm(vol);
 	}
 	mem_free(c_root);
-	return 0;
-err:
-	c_vol_umount_all(vol);
-	c_vol_cleanup_dm(vol);
-	mem_free(c_root);
-	return -1;
+	return ret;
 }
 
 static bool
@@ -1198,7 +2720,7 @@ c_vol_mount_dev(c_vol_t *vol)
 	const char *mount_data = is_selinux_enabled() ? "rootcontext=u:object_r:device:s0" : NULL;
 	char *dev_mnt = mem_printf("%s/%s", vol->root, "dev");
 	int uid = container_get_uid(vol->container);
-	char *tmpfs_opts = c_vol_get_tmpfs_opts_new(mount_data, uid, uid);
+	char *tmpfs_opts = c_vol_get_tmpfs_opts_new(mount_data, uid, uid, 0);
 	if ((ret = mkdir(dev_mnt, 0755)) < 0 && errno != EEXIST) {
 		ERROR_ERRNO("Could not mkdir /dev");
 		goto error;
@@ -1221,11 +2743,54 @@ error:
 	return ret;
 }
 
+/*
+ * Mounts the hugetlbfs instances of the memory policy of the container, the
+ * mount fails if the pool cannot provide the pages reserved by min_size.
+ */
+static int
+c_vol_mount_hugetlbfs(c_vol_t *vol)
+{
+	ASSERT(vol);
+
+	int ret = 0;
+	int uid = container_get_uid(vol->container);
+
+	for (list_t *l = container_get_memory_policy(vol->container)->hugetlbfs; l; l = l->next) {
+		const container_hugetlbfs_t *fs = l->data;
+		char *dir = mem_printf("%s%s%s", vol->root, fs->dir[0] == '/' ? "" : "/", fs->dir);
+		str_t *opts = str_new(NULL);
+		str_append_printf(opts, "uid=%d,gid=%d", uid, uid);
+		if (fs->size)
+			str_append_printf(opts, ",size=%" PRIu64, fs->size);
+		if (fs->min_size)
+			str_append_printf(opts, ",min_size=%" PRIu64, fs->min_size);
+
+		DEBUG("Mounting hugetlbfs to %s (%s)", dir, str_buffer(opts));
+		if (dir_mkdir_p(dir, 0755) < 0) {
+			ERROR_ERRNO("Could not mkdir %s", dir);
+			ret = -1;
+		} else if (mount("hugetlbfs", dir, "hugetlbfs", MS_RELATIME | MS_NOSUID | MS_NODEV,
+				 str_buffer(opts)) < 0) {
+			ERROR_ERRNO("Could not mount hugetlbfs to %s", dir);
+			ret = -1;
+		}
+		str_free(opts, true);
+		mem_free(dir);
+		IF_TRUE_RETVAL(ret < 0, -1);
+	}
+	return 0;
+}
+
 static bool
 c_vol_verify_mount_entries(const c_vol_t *vol)
 {
 	ASSERT(vol);
 
+	bool ret = true;
+
+	// the measurements of all images are sent to tpm2d at once
+	tss_ml_batch_begin();
+
 	int n = mount_get_count(container_get_mount(vol->container));
 	for (int i = 0; i < n; i++) {
 		const mount_entry_t *mntent;
@@ -1237,11 +2802,15 @@ c_vol_verify_mount_entries(const c_vol_t *vol)
 							    mntent, true) != CHECK_IMAGE_GOOD) {
 				ERROR("Cannot verify image %s: image file is corrupted",
 				      mount_entry_get_img(mntent));
-				return false;
+				ret = false;
+				break;
 			}
 		}
 	}
-	return true;
+
+	if (tss_ml_batch_commit())
+		WARN("Failed to append image measurements to the measurement list");
+	return ret;
 }
 
 /******************************************************************************/
@@ -1256,6 +2825,10 @@ c_vol_new(const container_t *container)
 	vol->root = mem_printf("/tmp/%s", uuid_string(container_get_uuid(container)));
 	vol->overlay_count = 0;
 
+	// the tools have to be prepared in the mount namespace of cmld
+	if (container_has_setup_mode(container))
+		c_vol_busybox_tools_init();
+
 	return vol;
 }
 
@@ -1264,6 +2837,10 @@ c_vol_free(c_vol_t *vol)
 {
 	ASSERT(vol);
 
+	for (list_t *l = vol->lowers; l; l = l->next)
+		c_vol_lower_release(l->data);
+	list_delete(vol->lowers);
+
 	mem_free(vol->root);
 	mem_free(vol);
 }
@@ -1309,7 +2886,7 @@ c_vol_do_shared_bind_mounts(const c_vol_t *vol)
 		}
 		INFO("Succesfully created image for %s", SHARED_FILES_PATH);
 	}
-	bind_dev = c_vol_create_loopdev_new(&loop_fd, bind_img_path);
+	bind_dev = c_vol_create_loopdev_new(&loop_fd, bind_img_path, LOOPDEV_DIRECT_IO);
 	IF_NULL_GOTO(bind_dev, err);
 	if (mount(bind_dev, SHARED_FILES_PATH, "ext4", MS_NOATIME | MS_NODEV | MS_NOEXEC, NULL) <
 	    0) {
@@ -1403,6 +2980,57 @@ err:
 	return ret;
 }
 
+/*
+ * Takes references on the shared lower mounts of the container's images, which
+ * are mounted if needed or, on adoption, have been mounted already.
+ */
+static void
+c_vol_lowers_acquire(c_vol_t *vol, bool adopt)
+{
+	const mount_t *mnts[] = { container_get_mount(vol->container),
+				  container_has_setup_mode(vol->container) ?
+					  container_get_mount_setup(vol->container) :
+					  NULL };
+
+	for (size_t m = 0; m < sizeof(mnts) / sizeof(mnts[0]) && mnts[m]; m++) {
+		size_t n = mount_get_count(mnts[m]);
+		for (size_t i = 0; i < n; i++) {
+			const mount_entry_t *mntent = mount_get_entry(mnts[m], i);
+			if (!c_vol_mntent_is_sharable(vol, mntent))
+				continue;
+
+			// falls back to a loop device of the container on failure
+			c_vol_lower_t *lower = adopt ? c_vol_lower_adopt(vol, mntent) :
+						       c_vol_lower_acquire(vol, mntent);
+			if (lower && c_vol_lower_find(vol, lower->img))
+				c_vol_lower_release(lower);
+			else if (lower)
+				vol->lowers = list_append(vol->lowers, lower);
+		}
+	}
+}
+
+int
+c_vol_start_pre_clone(c_vol_t *vol)
+{
+	ASSERT(vol);
+
+	// the child inherits the list of lxcfs proc files to overlay
+	lxcfs_proc_overlay_prepare();
+
+	c_vol_lowers_acquire(vol, false);
+	return 0;
+}
+
+int
+c_vol_adopt(c_vol_t *vol)
+{
+	ASSERT(vol);
+
+	c_vol_lowers_acquire(vol, true);
+	return 0;
+}
+
 int
 c_vol_start_child_early(c_vol_t *vol)
 {
@@ -1441,6 +3069,8 @@ c_vol_start_child_early(c_vol_t *vol)
 	DEBUG("Mounting /dev");
 	IF_TRUE_GOTO_ERROR(c_vol_mount_dev(vol) < 0, error);
 
+	IF_TRUE_GOTO_ERROR(c_vol_mount_hugetlbfs(vol) < 0, error);
+
 	/*
 	 * copy cml-service-container binary to target as defined in CSERVICE_TARGET
 	 * Remeber, This will only succeed if targetfs is writable
@@ -1528,6 +3158,120 @@ c_vol_start_pre_exec(c_vol_t *vol)
 	mem_free(dev_mnt);
 	return 0;
 }
+
+void
+c_vol_start_post_boot(c_vol_t *vol)
+{
+	ASSERT(vol);
+
+	for (list_t *l = vol->lowers; l; l = l->next) {
+		c_vol_lower_t *lower = l->data;
+		if (!lower->record)
+			continue;
+
+		lower->record = false;
+		DEBUG("Recording boot read profile of %s", lower->img);
+		c_vol_prefetch_fork(lower, &c_vol_prefetch_record);
+	}
+}
+
+typedef struct c_vol_block_devs {
+	dev_t *devs;
+	size_t n;
+} c_vol_block_devs_t;
+
+static void
+c_vol_block_devs_add(c_vol_block_devs_t *bdevs, dev_t dev);
+
+static int
+c_vol_block_devs_add_slave_cb(const char *path, const char *file, void *data)
+{
+	c_vol_block_devs_t *bdevs = data;
+	unsigned int maj, min;
+
+	char *dev_file = mem_printf("%s/%s/dev", path, file);
+	char *buf = file_read_new(dev_file, 32);
+	if (buf && sscanf(buf, "%u:%u", &maj, &min) == 2)
+		c_vol_block_devs_add(bdevs, makedev(maj, min));
+	mem_free(buf);
+	mem_free(dev_file);
+	return 0;
+}
+
+/*
+ * Adds a whole block device and, for dm devices, the devices stacked below it,
+ * e.g. the loop device of an image below its dm-crypt or dm-verity device.
+ * Partitions are skipped, the io controllers only accept whole disks.
+ */
+static void
+c_vol_block_devs_add(c_vol_block_devs_t *bdevs, dev_t dev)
+{
+	for (size_t i = 0; i < bdevs->n; i++)
+		IF_TRUE_RETURN(bdevs->devs[i] == dev);
+
+	char *sys_dir = mem_printf("/sys/dev/block/%u:%u", major(dev), minor(dev));
+	char *partition = mem_printf("%s/partition", sys_dir);
+	char *slaves = mem_printf("%s/slaves", sys_dir);
+
+	if (file_is_dir(sys_dir) && !file_exists(partition)) {
+		bdevs->devs = mem_renew(dev_t, bdevs->devs, bdevs->n + 1);
+		bdevs->devs[bdevs->n++] = dev;
+		if (file_is_dir(slaves))
+			dir_foreach(slaves, &c_vol_block_devs_add_slave_cb, bdevs);
+	}
+
+	mem_free(slaves);
+	mem_free(partition);
+	mem_free(sys_dir);
+}
+
+size_t
+c_vol_get_block_devs(const c_vol_t *vol, dev_t **devs)
+{
+	ASSERT(vol);
+	ASSERT(devs);
+
+	c_vol_block_devs_t bdevs = { NULL, 0 };
+	*devs = NULL;
+
+	/*
+	 * The images are mounted in the mount namespace of the container, thus we
+	 * look at the mounts below its root from the perspective of its init.
+	 */
+	pid_t pid = container_get_pid(vol->container);
+	IF_TRUE_RETVAL(pid <= 0, 0);
+
+	char *mountinfo = mem_printf("/proc/%d/mountinfo", pid);
+	FILE *fp = fopen(mountinfo, "r");
+	if (!fp) {
+		WARN_ERRNO("Could not open %s", mountinfo);
+		mem_free(mountinfo);
+		return 0;
+	}
+
+	size_t root_len = strlen(vol->root);
+	char *line = NULL;
+	size_t line_len = 0;
+	while (getline(&line, &line_len, fp) != -1) {
+		unsigned int maj, min;
+		char mnt_point[PATH_MAX];
+		// <id> <parent id> <major>:<minor> <root> <mount point> ...
+		if (sscanf(line, "%*d %*d %u:%u %*s %4095s", &maj, &min, mnt_point) != 3)
+			continue;
+		if (strncmp(mnt_point, vol->root, root_len) ||
+		    (mnt_point[root_len] != '\0' && mnt_point[root_len] != '/'))
+			continue;
+		c_vol_block_devs_add(&bdevs, makedev(maj, min));
+	}
+
+	free(line);
+	fclose(fp);
+	mem_free(mountinfo);
+
+	*devs = bdevs.devs;
+	return bdevs.n;
+}
+
 static int
 c_vol_mount_proc_and_sys(const c_vol_t *vol, const char *dir)
 {
@@ -1745,7 +3489,7 @@ c_vol_start_child(c_vol_t *vol)
 		goto error;
 	}
 
-	if (container_has_setup_mode(vol->container) && c_vol_setup_busybox_install() < 0)
+	if (container_has_setup_mode(vol->container) && c_vol_setup_busybox_install(vol) < 0)
 		WARN("Cannot install busybox symlinks for setup mode!");
 
 	char *mount_output = file_read_new("/proc/self/mounts", 2048);
@@ -1771,7 +3515,7 @@ c_vol_is_encrypted(c_vol_t *vol)
 	for (i = 0; i < n; i++) {
 		const mount_entry_t *mntent;
 		mntent = mount_get_entry(container_get_mount(vol->container), i);
-		if (mount_entry_is_encrypted(mntent))
+		if (mount_entry_is_encrypted(mntent) && !c_vol_mntent_is_ephemeral(vol, mntent))
 			return true;
 	}
 	return false;
@@ -1785,6 +3529,15 @@ c_vol_cleanup(c_vol_t *vol, bool is_rebooting)
 	if (c_vol_umount_all(vol))
 		WARN("Could not umount all images properly");
 
+	// the containers keep their own copies of the shared mounts
+	for (list_t *l = vol->lowers; l; l = l->next)
+		c_vol_lower_release(l->data);
+	list_delete(vol->lowers);
+	vol->lowers = NULL;
+
+	// unlike loop devices, nbd devices of lazy images are not cleared automatically
+	lazyimg_detach_unused();
+
 	// keep dm crypt/integrity device up for reboot
 	if (!is_rebooting && c_vol_cleanup_dm(vol))
 		WARN("Could not remove mounts properly");
@@ -54,6 +54,16 @@ bool
 c_vol_is_encrypted(c_vol_t *vol);
 
 /* Start hooks */
+
+/**
+ * Mounts the read-only images of the container's GuestOS in cmld's mount
+ * namespace, unless another container of the same GuestOS version has already
+ * done so, thus the container inherits them on clone and shares their page
+ * cache with the other containers. The mounts are released on cleanup.
+ */
+int
+c_vol_start_pre_clone(c_vol_t *vol);
+
 int
 c_vol_start_child_early(c_vol_t *vol);
 
@@ -63,7 +73,86 @@ c_vol_start_child(c_vol_t *vol);
 int
 c_vol_start_pre_exec(c_vol_t *vol);
 
+/**
+ * Called once the container booted. Records the boot read profiles of the
+ * shared images which were mounted for this start and had no valid profile,
+ * i.e., which pages of the files in them are in the page cache now. Later
+ * mounts of the images read these pages ahead in the background.
+ */
+void
+c_vol_start_post_boot(c_vol_t *vol);
+
+/**
+ * Returns the block devices backing the mounts of a running container, i.e.,
+ * the loop and dm devices of its images, to apply io limits to them.
+ *
+ * @param devs Set to a newly allocated array of the device numbers.
+ * @return The number of devices in devs.
+ */
+size_t
+c_vol_get_block_devs(const c_vol_t *vol, dev_t **devs);
+
+/**
+ * Takes over the volumes of a running container from a previous cmld instance,
+ * i.e. takes references on the shared images still mounted for it, so that
+ * they are released when the container stops.
+ */
+int
+c_vol_adopt(c_vol_t *vol);
+
 void
 c_vol_cleanup(c_vol_t *vol, bool is_rebooting);
 
+/**
+ * Activates the thin pool on the given raw partitions. Afterwards, new data
+ * volumes of containers (empty and upper overlay images) are allocated as thin
+ * devices from the pool instead of as image files on the data partition, which
+ * saves the loop device and host file system below them. Existing image files
+ * are kept.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int
+c_vol_thin_pool_init(const char *meta_dev, const char *data_dev);
+
+/**
+ * Deletes the (inactive) thin devices of a volume together with its marker
+ * file, which takes the place of the image file in the images dir.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int
+c_vol_thin_delete(const char *marker);
+
+/**
+ * Snapshots the (inactive) thin devices of a volume and writes the marker file
+ * of the snapshot. The snapshot shares all blocks with the volume until either
+ * of them is written.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int
+c_vol_thin_snapshot(const char *marker, const char *snapshot_marker);
+
+/**
+ * Enables directory storage. Afterwards, new unencrypted data volumes (empty
+ * images) of containers are directories in the images dir, which are bind
+ * mounted instead of image files with their own file system on a loop device.
+ * Their size is enforced by project quotas, thus the file system of path has
+ * to be mounted with project quotas enabled. Existing images are kept.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int
+c_vol_dir_storage_init(const char *path);
+
+/**
+ * Resets the project quota of the dir of a directory-backed volume before
+ * the dir is deleted.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int
+c_vol_dir_release(const char *path);
+
 #endif /* C_VOL_H */
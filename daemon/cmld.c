@@ -34,34 +34,59 @@
 #include "common/event.h"
 #include "common/logf.h"
 #include "common/list.h"
+#include "common/hashmap.h"
+#include "common/omap.h"
 #include "common/file.h"
 #include "common/sock.h"
 #include "common/mem.h"
 #include "common/dir.h"
 #include "common/network.h"
 #include "common/reboot.h"
+#include "common/loopdev.h"
+#include "common/cryptfs.h"
+#include "common/ssl_util.h"
 #include "hardware.h"
 #include "mount.h"
 #include "device_config.h"
 #include "control.h"
+#include "container_config.h"
 #include "guestos_mgr.h"
 #include "guestos.h"
+#include "hash.h"
+#include "trash.h"
 #include "smartcard.h"
 #include "tss.h"
 #include "ksm.h"
+#include "hibernate.h"
+#include "placement.h"
+#include "sched_policy.h"
+#include "accounting.h"
+#include "zygote.h"
+#include "handoff.h"
+#include "boot.h"
 #include "uevent.h"
 #include "time.h"
 #include "lxcfs.h"
+#include "c_cgroups.h"
+#include "c_vol.h"
 #include "audit.h"
 #include "time.h"
+#include "bcast.h"
+#include "peer.h"
+
+#include "scd_shared.h"
+#include "tpm2d_shared.h"
 
 #include <stdio.h>
 #include <dirent.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <sys/inotify.h>
 
 // clang-format off
 #define CMLD_CONTROL_SOCKET SOCK_PATH(control)
@@ -69,11 +94,15 @@
 
 #define CMLD_SUSPEND_TIMEOUT 5000
 
+// deadline of each stop phase of the shutdown, afterwards the remaining containers are killed
+#define CMLD_SHUTDOWN_DEADLINE 30000
+
 // files and directories in cmld's home path /data/cml
 #define CMLD_PATH_DEVICE_CONF "device.conf"
 #define CMLD_PATH_USERS_DIR "users"
 #define CMLD_PATH_GUESTOS_DIR "operatingsystems"
 #define CMLD_PATH_CONTAINERS_DIR "containers"
+#define CMLD_PATH_TRASH_DIR ".trash"
 #define CMLD_PATH_CONTAINER_KEYS_DIR "keys"
 #define CMLD_PATH_CONTAINER_TOKENS_DIR "tokens"
 #define CMLD_PATH_SHARED_DATA_DIR "shared"
@@ -91,7 +120,7 @@
 
 static const char *cmld_path = DEFAULT_BASE_PATH;
 
-static list_t *cmld_containers_list = NULL; // usually first element is c0
+static ilist_t cmld_containers_list = ILIST_INITIALIZER; // usually first element is c0
 
 static control_t *cmld_control_mdm = NULL;
 static control_t *cmld_control_gui = NULL;
@@ -115,6 +144,20 @@ static bool cmld_signed_configs = false;
 
 static bool cmld_device_provisioned = false;
 
+static unsigned cmld_device_pool_size = 0;
+
+static bool cmld_checkpoint_background = false;
+
+static bool cmld_lazy_images = false;
+
+static unsigned cmld_boot_concurrency = 0;
+static list_t *cmld_boot_queue = NULL;	  // autostart containers not yet started
+static list_t *cmld_boot_inflight = NULL; // autostart containers started but not yet running
+static bool cmld_boot_scheduling = false;
+static bool cmld_boot_reschedule = false;
+static struct timespec cmld_boot_ts;
+static event_timer_t *cmld_device_pool_timer = NULL;
+
 /******************************************************************************/
 
 static int
@@ -131,14 +174,190 @@ cmld_containers_get_c0()
 	return container;
 }
 
+/*
+ * Indexes of cmld_containers_list. The keys are owned by the containers, thus
+ * an entry has to be removed before its key changes. If several containers
+ * share a key, the index refers to the first of them in cmld_containers_list.
+ * The uid ranges of the containers are assigned on container start, thus the
+ * uid index is rebuilt on the next lookup after cmld_containers_uid_changed().
+ */
+static hashmap_t *cmld_containers_by_uuid = NULL;
+static hashmap_t *cmld_containers_by_name = NULL;
+static hashmap_t *cmld_containers_by_serial = NULL;
+static hashmap_t *cmld_containers_by_devpath = NULL;
+static omap_t *cmld_containers_by_uid = NULL;
+static bool cmld_containers_by_uid_valid = false;
+
+/*
+ * Change detection for cmld_reload_containers(). For each loaded config the
+ * stat data and a hash of the .conf, .sig and .cert files are recorded, keyed
+ * by the name of the .conf file. An inotify watch on the containers directory
+ * marks the stamps of modified files dirty, thus unchanged configs are neither
+ * parsed nor verified again on reload.
+ */
+#define CMLD_CONFIG_FILES_MAX 3
+
+static const char *cmld_config_suffixes[CMLD_CONFIG_FILES_MAX] = { ".conf", ".sig", ".cert" };
+
+typedef struct {
+	char *name; // key in cmld_config_stamps
+	struct {
+		bool exists;
+		struct timespec mtime;
+		off_t size;
+		char *sha256;
+	} files[CMLD_CONFIG_FILES_MAX];
+	bool dirty;
+} cmld_config_stamp_t;
+
+static hashmap_t *cmld_config_stamps = NULL;
+static event_inotify_t *cmld_config_inotify = NULL;
+
+static const char *
+cmld_container_get_token_serial(const container_t *container)
+{
+	if (CONTAINER_TOKEN_TYPE_USB != container_get_token_type(container))
+		return NULL;
+	return container_get_usbtoken_serial(container);
+}
+
+static const char *
+cmld_container_get_token_devpath(const container_t *container)
+{
+	if (CONTAINER_TOKEN_TYPE_USB != container_get_token_type(container))
+		return NULL;
+	return container_get_usbtoken_devpath(container);
+}
+
+static void
+cmld_containers_index_add(hashmap_t **index, const char *key, container_t *container)
+{
+	IF_NULL_RETURN_TRACE(key);
+
+	if (!*index)
+		*index = hashmap_new_str();
+	if (!hashmap_contains(*index, key))
+		hashmap_put(*index, key, container);
+}
+
+static void
+cmld_containers_index_remove(hashmap_t *index, const char *key, container_t *container,
+			     const char *(*get_key)(const container_t *container))
+{
+	IF_NULL_RETURN_TRACE(key);
+	IF_NULL_RETURN_TRACE(index);
+	IF_FALSE_RETURN_TRACE(hashmap_get(index, key) == container);
+
+	hashmap_remove(index, key);
+
+	// hand the key over to the next container sharing it
+	ilist_foreach(&cmld_containers_list, n) {
+		container_t *c = container_from_list_node(n);
+		const char *k = get_key(c);
+		if (c != container && k && !strcmp(k, key)) {
+			hashmap_put(index, k, c);
+			break;
+		}
+	}
+}
+
+static const char *
+cmld_container_get_uuid_string(const container_t *container)
+{
+	return uuid_string(container_get_uuid(container));
+}
+
+static void
+cmld_containers_index_insert(container_t *container)
+{
+	cmld_containers_index_add(&cmld_containers_by_uuid,
+				  cmld_container_get_uuid_string(container), container);
+	cmld_containers_index_add(&cmld_containers_by_name, container_get_name(container),
+				  container);
+	cmld_containers_index_add(&cmld_containers_by_serial,
+				  cmld_container_get_token_serial(container), container);
+	cmld_containers_index_add(&cmld_containers_by_devpath,
+				  cmld_container_get_token_devpath(container), container);
+	cmld_containers_by_uid_valid = false;
+}
+
+static void
+cmld_containers_index_delete(container_t *container)
+{
+	cmld_containers_index_remove(cmld_containers_by_uuid,
+				     cmld_container_get_uuid_string(container), container,
+				     &cmld_container_get_uuid_string);
+	cmld_containers_index_remove(cmld_containers_by_name, container_get_name(container),
+				     container, &container_get_name);
+	cmld_containers_index_remove(cmld_containers_by_serial,
+				     cmld_container_get_token_serial(container), container,
+				     &cmld_container_get_token_serial);
+	cmld_containers_index_remove(cmld_containers_by_devpath,
+				     cmld_container_get_token_devpath(container), container,
+				     &cmld_container_get_token_devpath);
+	cmld_containers_by_uid_valid = false;
+}
+
+static void
+cmld_containers_list_append(container_t *container)
+{
+	ilist_append(&cmld_containers_list, container_get_list_node(container));
+	cmld_containers_index_insert(container);
+}
+
+static void
+cmld_containers_list_prepend(container_t *container)
+{
+	ilist_prepend(&cmld_containers_list, container_get_list_node(container));
+	// the new head takes precedence for shared keys
+	cmld_containers_index_delete(container);
+	cmld_containers_index_insert(container);
+}
+
+static void
+cmld_containers_list_remove(container_t *container)
+{
+	ilist_node_t *node = container_get_list_node(container);
+	IF_FALSE_RETURN(ilist_contains(&cmld_containers_list, node));
+	ilist_unlink(&cmld_containers_list, node);
+	cmld_containers_index_delete(container);
+}
+
+static void
+cmld_container_set_token_devpath(container_t *container, char *devpath)
+{
+	cmld_containers_index_remove(cmld_containers_by_devpath,
+				     cmld_container_get_token_devpath(container), container,
+				     &cmld_container_get_token_devpath);
+	container_set_usbtoken_devpath(container, devpath);
+	cmld_containers_index_add(&cmld_containers_by_devpath,
+				  cmld_container_get_token_devpath(container), container);
+}
+
+static void
+cmld_containers_index_free(void)
+{
+	hashmap_free(cmld_containers_by_uuid);
+	hashmap_free(cmld_containers_by_name);
+	hashmap_free(cmld_containers_by_serial);
+	hashmap_free(cmld_containers_by_devpath);
+	omap_free(cmld_containers_by_uid);
+	cmld_containers_by_uuid = NULL;
+	cmld_containers_by_name = NULL;
+	cmld_containers_by_serial = NULL;
+	cmld_containers_by_devpath = NULL;
+	cmld_containers_by_uid = NULL;
+	cmld_containers_by_uid_valid = false;
+}
+
 container_t *
 cmld_container_get_c_root_netns()
 {
 	container_t *found = NULL;
 	container_t *found_c0 = NULL;
 
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		container_t *container = l->data;
+	ilist_foreach(&cmld_containers_list, n) {
+		container_t *container = container_from_list_node(n);
 		if (!container_has_netns(container)) {
 			if (container == cmld_containers_get_c0()) {
 				found_c0 = container;
@@ -156,12 +375,18 @@ container_t *
 cmld_container_get_by_uuid(const uuid_t *uuid)
 {
 	ASSERT(uuid);
+	IF_NULL_RETVAL_TRACE(cmld_containers_by_uuid, NULL);
 
-	for (list_t *l = cmld_containers_list; l; l = l->next)
-		if (uuid_equals(container_get_uuid(l->data), uuid))
-			return l->data;
+	return hashmap_get(cmld_containers_by_uuid, uuid_string(uuid));
+}
 
-	return NULL;
+container_t *
+cmld_container_get_by_name(const char *name)
+{
+	IF_NULL_RETVAL_TRACE(name, NULL);
+	IF_NULL_RETVAL_TRACE(cmld_containers_by_name, NULL);
+
+	return hashmap_get(cmld_containers_by_name, name);
 }
 
 container_t *
@@ -170,18 +395,9 @@ cmld_container_get_by_token_serial(const char *serial)
 	IF_NULL_RETVAL_TRACE(serial, NULL);
 
 	TRACE("Looking for container with token serial %s", serial);
+	IF_NULL_RETVAL_TRACE(cmld_containers_by_serial, NULL);
 
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		if (CONTAINER_TOKEN_TYPE_USB != container_get_token_type(l->data))
-			continue;
-
-		char *s = container_get_usbtoken_serial(l->data);
-
-		if (s && !strcmp(s, serial))
-			return l->data;
-	}
-
-	return NULL;
+	return hashmap_get(cmld_containers_by_serial, serial);
 }
 
 container_t *
@@ -190,60 +406,183 @@ cmld_container_get_by_devpath(const char *devpath)
 	ASSERT(devpath);
 
 	TRACE("Looking for container with token devpath %s", devpath);
+	IF_NULL_RETVAL_TRACE(cmld_containers_by_devpath, NULL);
 
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		if (CONTAINER_TOKEN_TYPE_USB != container_get_token_type(l->data))
-			continue;
+	return hashmap_get(cmld_containers_by_devpath, devpath);
+}
+
+#define UID_MAX 65535
 
-		char *p = container_get_usbtoken_devpath(l->data);
+static void
+cmld_containers_uid_index_rebuild(void)
+{
+	if (!cmld_containers_by_uid)
+		cmld_containers_by_uid = omap_new_uint();
+	omap_clear(cmld_containers_by_uid);
 
-		if (p && !strcmp(p, devpath))
-			return l->data;
+	ilist_foreach(&cmld_containers_list, n) {
+		container_t *c = container_from_list_node(n);
+		const void *key = (void *)(uintptr_t)container_get_uid(c);
+		if (!omap_get(cmld_containers_by_uid, key))
+			omap_put(cmld_containers_by_uid, key, c);
 	}
+	cmld_containers_by_uid_valid = true;
+}
 
-	return NULL;
+void
+cmld_containers_uid_changed(void)
+{
+	cmld_containers_by_uid_valid = false;
 }
 
-#define UID_MAX 65535
 container_t *
 cmld_container_get_by_uid(int uid)
 {
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		container_t *c = l->data;
-		if ((uid >= container_get_uid(c)) && (uid < container_get_uid(c) + UID_MAX))
-			return c;
-	}
-	return NULL;
+	const void *key = NULL;
+
+	if (uid < 0)
+		return NULL;
+
+	if (!cmld_containers_by_uid_valid)
+		cmld_containers_uid_index_rebuild();
+
+	// the range starting at or below uid, if uid is part of it
+	container_t *c = omap_floor(cmld_containers_by_uid, (void *)(uintptr_t)uid, &key);
+	if (!c || uid >= (int)(uintptr_t)key + UID_MAX)
+		return NULL;
+
+	return c;
+}
+
+static bool
+cmld_container_is_down(const container_t *container)
+{
+	container_state_t state = container_get_state(container);
+	return state == CONTAINER_STATE_STOPPED || state == CONTAINER_STATE_ZOMBIE;
+}
+
+/*
+ * Shutdown planner: all containers but c0 are stopped at once, c0 is stopped
+ * after them, as the others may still depend on its services. Each of both
+ * phases is bounded by a deadline, after which the remaining containers of the
+ * phase are killed. The exits are noticed through the pidfd based reapers of
+ * the containers, thus the shutdown takes as long as the slowest container.
+ */
+typedef struct cmld_shutdown_plan {
+	void (*on_all_stopped)(void);
+	event_timer_t *deadline;
+	const container_t *c0; /* NULL in hosted mode */
+	bool c0_phase;	       /* the other containers are down, c0 is stopped now */
+} cmld_shutdown_plan_t;
+
+static cmld_shutdown_plan_t *cmld_shutdown_plan = NULL;
+
+/* returns true if container is stopped in the current phase of the plan */
+static bool
+cmld_shutdown_plan_covers(const cmld_shutdown_plan_t *plan, const container_t *container)
+{
+	return plan->c0_phase || container != plan->c0;
 }
 
 static bool
-cmld_containers_are_all_stopped(void)
+cmld_shutdown_plan_phase_done(const cmld_shutdown_plan_t *plan)
 {
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		container_t *c = l->data;
-		if (container_get_state(c) != CONTAINER_STATE_STOPPED)
+	ilist_foreach(&cmld_containers_list, n) {
+		container_t *c = container_from_list_node(n);
+		if (cmld_shutdown_plan_covers(plan, c) && !cmld_container_is_down(c))
 			return false;
-		else
-			continue;
 	}
 	return true;
 }
 
-typedef struct cmld_container_stop_data {
-	void (*on_all_stopped)(void);
-} cmld_container_stop_data_t;
+static void
+cmld_shutdown_plan_deadline_cb(event_timer_t *timer, void *data)
+{
+	cmld_shutdown_plan_t *plan = data;
+
+	ilist_foreach(&cmld_containers_list, n) {
+		container_t *c = container_from_list_node(n);
+		if (!cmld_shutdown_plan_covers(plan, c) || cmld_container_is_down(c))
+			continue;
+		WARN("Container %s did not stop in time, killing it", container_get_description(c));
+		container_kill(c);
+	}
+
+	event_timer_free(timer);
+	plan->deadline = NULL;
+}
+
+static void
+cmld_shutdown_plan_arm(cmld_shutdown_plan_t *plan)
+{
+	if (plan->deadline) {
+		event_remove_timer(plan->deadline);
+		event_timer_free(plan->deadline);
+	}
+	plan->deadline = event_timer_new(CMLD_SHUTDOWN_DEADLINE, 1,
+					 &cmld_shutdown_plan_deadline_cb, plan);
+	event_add_timer(plan->deadline);
+}
+
+static void
+cmld_shutdown_plan_cb(container_t *container, container_callback_t *cb, void *data);
+
+/* stops all containers of the current phase which are not stopping already */
+static void
+cmld_shutdown_plan_stop_phase(cmld_shutdown_plan_t *plan)
+{
+	ilist_foreach(&cmld_containers_list, n) {
+		container_t *c = container_from_list_node(n);
+		if (!cmld_shutdown_plan_covers(plan, c) || cmld_container_is_down(c))
+			continue;
+
+		/* Register observer to wait for completed container_stop */
+		if (!container_register_observer(c, &cmld_shutdown_plan_cb, plan))
+			WARN("Could not register stop callback for %s",
+			     container_get_description(c));
+		if (container_get_state(c) != CONTAINER_STATE_SHUTTING_DOWN)
+			container_stop(c);
+	}
+	cmld_shutdown_plan_arm(plan);
+}
+
+static void
+cmld_shutdown_plan_advance(cmld_shutdown_plan_t *plan)
+{
+	IF_FALSE_RETURN(cmld_shutdown_plan_phase_done(plan));
+
+	if (!plan->c0_phase) {
+		plan->c0_phase = true;
+		if (!cmld_shutdown_plan_phase_done(plan)) {
+			INFO("All containers but c0 are stopped, stopping c0");
+			cmld_shutdown_plan_stop_phase(plan);
+			return;
+		}
+	}
+
+	if (plan->deadline) {
+		event_remove_timer(plan->deadline);
+		event_timer_free(plan->deadline);
+	}
+	cmld_shutdown_plan = NULL;
+
+	INFO("all containers are stopped now, execution of on_all_stopped()");
+	void (*on_all_stopped)(void) = plan->on_all_stopped;
+	mem_free(plan);
+	on_all_stopped();
+}
 
 static void
-cmld_container_stop_cb(container_t *container, container_callback_t *cb, void *data)
+cmld_shutdown_plan_cb(container_t *container, container_callback_t *cb, void *data)
 {
-	cmld_container_stop_data_t *stop_data = data;
+	cmld_shutdown_plan_t *plan = data;
 
 	ASSERT(container);
 	ASSERT(cb);
-	ASSERT(stop_data);
+	ASSERT(plan);
 
 	/* skip if the container is not stopped */
-	IF_FALSE_RETURN_TRACE(container_get_state(container) == CONTAINER_STATE_STOPPED);
+	IF_FALSE_RETURN_TRACE(cmld_container_is_down(container));
 
 	/* unregister observer */
 	container_unregister_observer(container, cb);
@@ -251,51 +590,127 @@ cmld_container_stop_cb(container_t *container, container_callback_t *cb, void *d
 	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
 			"container-stopped", uuid_string(container_get_uuid(container)), 0);
 
-	/* execute on_all_stopped, if all containers are stopped now */
-	if (cmld_containers_are_all_stopped()) {
-		INFO("all containers are stopped now, execution of on_all_stopped()");
-		stop_data->on_all_stopped();
-	}
+	cmld_shutdown_plan_advance(plan);
 }
 
 int
 cmld_containers_stop(void (*on_all_stopped)(void))
 {
-	/* execute on_all_stopped, if all containers are stopped now */
-	if (cmld_containers_are_all_stopped()) {
-		INFO("all containers are stopped now, execution of on_all_stopped()");
-		on_all_stopped();
+	/* a shutdown is in progress already, which finishes the first request */
+	if (cmld_shutdown_plan) {
+		INFO("Containers are being stopped already");
+		return 0;
+	}
+
+	/* checkpointed containers have no processes, their resources are released right away */
+	ilist_foreach(&cmld_containers_list, n) {
+		container_t *container = container_from_list_node(n);
+		if (container_get_state(container) == CONTAINER_STATE_CHECKPOINTED)
+			container_stop(container);
+	}
+
+	cmld_shutdown_plan = mem_new0(cmld_shutdown_plan_t, 1);
+	cmld_shutdown_plan->on_all_stopped = on_all_stopped;
+	cmld_shutdown_plan->c0 = cmld_containers_get_c0();
+
+	/* without any other running container, c0 is stopped right away */
+	if (cmld_shutdown_plan_phase_done(cmld_shutdown_plan)) {
+		cmld_shutdown_plan_advance(cmld_shutdown_plan);
 		return 0;
 	}
 
-	cmld_container_stop_data_t *stop_data = mem_new0(cmld_container_stop_data_t, 1);
-	stop_data->on_all_stopped = on_all_stopped;
+	cmld_shutdown_plan_stop_phase(cmld_shutdown_plan);
+	return 0;
+}
+
+typedef struct cmld_containers_freeze_data {
+	void (*on_all_frozen)(bool success, void *data);
+	void *data;
+	int pending;  /* containers which did not reach a final state yet */
+	bool success; /* false if any container failed to freeze */
+} cmld_containers_freeze_data_t;
+
+static void
+cmld_containers_freeze_done(cmld_containers_freeze_data_t *freeze_data, bool frozen)
+{
+	freeze_data->success &= frozen;
+	if (--freeze_data->pending > 0)
+		return;
+
+	INFO("Batch freeze finished (%s)", freeze_data->success ? "all frozen" : "failed");
+	if (freeze_data->on_all_frozen)
+		freeze_data->on_all_frozen(freeze_data->success, freeze_data->data);
+	mem_free(freeze_data);
+}
+
+static void
+cmld_containers_freeze_cb(container_t *container, container_callback_t *cb, void *data)
+{
+	cmld_containers_freeze_data_t *freeze_data = data;
+
+	ASSERT(container);
+	ASSERT(cb);
+	ASSERT(freeze_data);
+
+	container_state_t state = container_get_state(container);
+	/* wait for the kernel to report the final state */
+	IF_TRUE_RETURN_TRACE(state == CONTAINER_STATE_FREEZING);
+
+	container_unregister_observer(container, cb);
+	cmld_containers_freeze_done(freeze_data, state == CONTAINER_STATE_FROZEN);
+}
 
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
+int
+cmld_containers_freeze(list_t *containers, void (*on_all_frozen)(bool success, void *data),
+		       void *data)
+{
+	cmld_containers_freeze_data_t *freeze_data = mem_new0(cmld_containers_freeze_data_t, 1);
+	freeze_data->on_all_frozen = on_all_frozen;
+	freeze_data->data = data;
+	freeze_data->success = true;
+	/* hold an extra reference until all freezes are triggered */
+	freeze_data->pending = 1;
+
+	/* trigger all freezes first, so that the kernel freezes the cgroups in parallel */
+	for (list_t *l = containers; l; l = l->next) {
 		container_t *container = l->data;
-		if (container_get_state(container) != CONTAINER_STATE_STOPPED) {
-			container_stop(container);
-			/* Register observer to wait for completed container_stop */
-			if (!container_register_observer(container, &cmld_container_stop_cb,
-							 stop_data)) {
-				DEBUG("Could not register stop callback");
-				return -1;
-			}
+
+		if (container_get_state(container) == CONTAINER_STATE_FROZEN)
+			continue;
+
+		/* register before freezing, the state may change before container_freeze() returns */
+		container_callback_t *cb = container_register_observer(
+			container, &cmld_containers_freeze_cb, freeze_data);
+		if (!cb) {
+			WARN("Could not register freeze callback for container %s",
+			     container_get_description(container));
+			freeze_data->success = false;
+			continue;
+		}
+		freeze_data->pending++;
+
+		if (container_freeze(container) < 0) {
+			container_unregister_observer(container, cb);
+			cmld_containers_freeze_done(freeze_data, false);
 		}
 	}
-	return 0;
+
+	bool success = freeze_data->success;
+	cmld_containers_freeze_done(freeze_data, true);
+	return success ? 0 : -1;
 }
 
 int
 cmld_containers_get_count(void)
 {
-	return list_length(cmld_containers_list);
+	return ilist_length(&cmld_containers_list);
 }
 
 container_t *
 cmld_container_get_by_index(int index)
 {
-	return list_nth_data(cmld_containers_list, index);
+	ilist_node_t *n = index < 0 ? NULL : ilist_nth(&cmld_containers_list, index);
+	return n ? container_from_list_node(n) : NULL;
 }
 
 const char *
@@ -346,6 +761,12 @@ cmld_is_hostedmode_active(void)
 	return cmld_hostedmode;
 }
 
+bool
+cmld_is_lazy_images_enabled(void)
+{
+	return cmld_lazy_images;
+}
+
 bool
 cmld_uses_signed_configs(void)
 {
@@ -376,6 +797,32 @@ cmld_set_device_provisioned(void)
 	}
 }
 
+static void
+cmld_device_pool_refill_cb(event_timer_t *timer, void *data)
+{
+	ASSERT(data == NULL);
+
+	if (loopdev_pool_fill(cmld_device_pool_size) < 0)
+		WARN("Could not refill loop device pool");
+	if (cryptfs_pool_fill(cmld_device_pool_size) < 0)
+		WARN("Could not refill dm device pool");
+
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	cmld_device_pool_timer = NULL;
+}
+
+void
+cmld_device_pool_refill(void)
+{
+	if (!cmld_device_pool_size || cmld_device_pool_timer)
+		return;
+
+	// refill from the main loop, off the path of the current container start
+	cmld_device_pool_timer = event_timer_new(0, 1, cmld_device_pool_refill_cb, NULL);
+	event_add_timer(cmld_device_pool_timer);
+}
+
 /**
  * Requests the SCD to initialize a token associated to a container and queries whether that
  * token has been provisioned with a platform-bound authentication code.
@@ -405,58 +852,264 @@ cmld_container_token_init(container_t *container)
 	return 0;
 }
 
-static int
-cmld_load_containers_cb(const char *path, const char *name, UNUSED void *data)
+/**
+ * Fills the stat data of the config files of prefix in path into stamp.
+ * @return true if it differs from the previous content of stamp
+ */
+static bool
+cmld_config_stamp_stat(cmld_config_stamp_t *stamp, const char *path, const char *prefix)
 {
-	uuid_t *uuid = NULL;
+	bool changed = false;
 
-	/* we should check for config files here, because the images
-	 * might not be synced to the device from the mdm, but the config files
-	 * should be always there
-	 */
-	size_t len = strlen(name);
-	if (len < 5 || strcmp(name + len - 5, ".conf"))
-		return 0;
+	for (int i = 0; i < CMLD_CONFIG_FILES_MAX; ++i) {
+		struct stat st;
+		char *file = mem_printf("%s/%s%s", path, prefix, cmld_config_suffixes[i]);
+		bool exists = stat(file, &st) == 0;
+		mem_free(file);
 
-	char *prefix = mem_strdup(name);
-	prefix[len - 5] = '\0';
+		if (!exists) {
+			changed |= stamp->files[i].exists;
+			stamp->files[i].exists = false;
+			continue;
+		}
+		changed |= !stamp->files[i].exists || stamp->files[i].size != st.st_size ||
+			   stamp->files[i].mtime.tv_sec != st.st_mtim.tv_sec ||
+			   stamp->files[i].mtime.tv_nsec != st.st_mtim.tv_nsec;
+		stamp->files[i].exists = true;
+		stamp->files[i].size = st.st_size;
+		stamp->files[i].mtime = st.st_mtim;
+	}
+	return changed;
+}
 
-	int res = 0;
-	char *dir = mem_printf("%s/%s", path, prefix);
+/**
+ * Hashes the existing config files of prefix in path into stamp.
+ * @return true if any hash differs from the previous content of stamp
+ */
+static bool
+cmld_config_stamp_hash(cmld_config_stamp_t *stamp, const char *path, const char *prefix)
+{
+	bool changed = false;
+	char *files[CMLD_CONFIG_FILES_MAX];
+	char *sha256[CMLD_CONFIG_FILES_MAX] = { NULL };
+	size_t n = 0;
 
-	if (file_exists(dir) && !file_is_dir(dir)) {
-		WARN("%s exists but is not a directory!", dir);
-		goto cleanup;
+	for (int i = 0; i < CMLD_CONFIG_FILES_MAX; ++i) {
+		if (stamp->files[i].exists)
+			files[n++] = mem_printf("%s/%s%s", path, prefix, cmld_config_suffixes[i]);
 	}
-
-	uuid = uuid_new(prefix);
-	if (uuid) {
-		container_t *c = cmld_container_get_by_uuid(uuid);
-		if (c) {
-			container_state_t state = container_get_state(c);
-			if (state != CONTAINER_STATE_STOPPED) {
-				DEBUG("Not loading %s for already created and not stopped container %s.",
-				      name, container_get_name(c));
-				goto cleanup;
-			}
-			DEBUG("Removing outdated created container %s for config update",
-			      container_get_name(c));
-			cmld_containers_list = list_remove(cmld_containers_list, c);
-			container_free(c);
-		}
-		c = container_new(path, uuid, NULL, 0, NULL, 0, NULL, 0);
-		if (c) {
-			DEBUG("Loaded config for container %s from %s", container_get_name(c),
-			      name);
-			cmld_container_token_init(c);
-			cmld_containers_list = list_append(cmld_containers_list, c);
-			res = 1;
-			goto cleanup;
-		}
+	hash_files_block(n, (const char *const *)files, HASH_SHA256, NULL, sha256);
+
+	for (int i = 0, j = 0; i < CMLD_CONFIG_FILES_MAX; ++i) {
+		char *old = stamp->files[i].sha256;
+		char *hash = stamp->files[i].exists ? sha256[j++] : NULL;
+		// unreadable files always count as changed, they are reparsed anyway
+		if (stamp->files[i].exists ? !hash || !old || strcmp(hash, old) : old != NULL)
+			changed = true;
+		if (old)
+			mem_free(old);
+		stamp->files[i].sha256 = hash;
 	}
-	WARN("Could not create new container object from %s", name);
+	for (size_t j = 0; j < n; ++j)
+		mem_free(files[j]);
+	return changed;
+}
 
-cleanup:
+static void
+cmld_config_stamp_free(cmld_config_stamp_t *stamp)
+{
+	for (int i = 0; i < CMLD_CONFIG_FILES_MAX; ++i) {
+		if (stamp->files[i].sha256)
+			mem_free(stamp->files[i].sha256);
+	}
+	mem_free(stamp->name);
+	mem_free(stamp);
+}
+
+static void
+cmld_config_stamps_free(void)
+{
+	IF_NULL_RETURN(cmld_config_stamps);
+
+	const void *key = NULL;
+	void *stamp = NULL;
+	size_t iter = 0;
+	while (hashmap_next(cmld_config_stamps, &iter, &key, &stamp))
+		cmld_config_stamp_free(stamp);
+	hashmap_free(cmld_config_stamps);
+	cmld_config_stamps = NULL;
+}
+
+/**
+ * Marks the stamp of the config which the file at path belongs to as dirty,
+ * or drops it if the config itself was removed.
+ */
+static void
+cmld_config_inotify_cb(const char *path, uint32_t mask, UNUSED event_inotify_t *inotify,
+		       UNUSED void *data)
+{
+	IF_NULL_RETURN(cmld_config_stamps);
+
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	size_t len = strlen(name);
+
+	for (int i = 0; i < CMLD_CONFIG_FILES_MAX; ++i) {
+		size_t suffix_len = strlen(cmld_config_suffixes[i]);
+		if (len <= suffix_len || strcmp(name + len - suffix_len, cmld_config_suffixes[i]))
+			continue;
+
+		char *conf = mem_printf("%.*s.conf", (int)(len - suffix_len), name);
+		cmld_config_stamp_t *stamp = hashmap_get(cmld_config_stamps, conf);
+		if (stamp && i == 0 && (mask & (IN_DELETE | IN_MOVED_FROM))) {
+			TRACE("Config file %s removed", name);
+			hashmap_remove(cmld_config_stamps, conf);
+			cmld_config_stamp_free(stamp);
+		} else if (stamp) {
+			TRACE("Config file %s changed (mask 0x%x)", name, mask);
+			stamp->dirty = true;
+		}
+		mem_free(conf);
+		return;
+	}
+}
+
+static void
+cmld_config_inotify_init(const char *path)
+{
+	if (!cmld_config_stamps)
+		cmld_config_stamps = hashmap_new_str();
+
+	if (cmld_config_inotify)
+		return;
+
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB;
+	cmld_config_inotify = event_inotify_new(path, mask, &cmld_config_inotify_cb, NULL);
+	if (event_add_inotify(cmld_config_inotify) < 0) {
+		WARN("Could not watch %s for config changes, falling back to stat checks", path);
+		event_inotify_free(cmld_config_inotify);
+		cmld_config_inotify = NULL;
+	}
+}
+
+/**
+ * Checks if the config name in path of the already loaded container c is
+ * unchanged since it was loaded. The stamp has to describe the loaded config,
+ * thus it is compared on a copy and a changed config is only committed by
+ * cmld_config_stamp_update() once it is actually loaded.
+ */
+static bool
+cmld_config_is_unchanged(const char *path, const char *name, const char *prefix, container_t *c)
+{
+	IF_NULL_RETVAL(cmld_config_stamps, false);
+	IF_NULL_RETVAL(c, false);
+
+	cmld_config_stamp_t *stamp = hashmap_get(cmld_config_stamps, name);
+	IF_NULL_RETVAL(stamp, false);
+
+	cmld_config_stamp_t current = *stamp;
+	for (int i = 0; i < CMLD_CONFIG_FILES_MAX; ++i) {
+		if (stamp->files[i].sha256)
+			current.files[i].sha256 = mem_strdup(stamp->files[i].sha256);
+	}
+
+	// without a working watch, a rewrite preserving mtime and size is missed
+	bool unchanged = !cmld_config_stamp_stat(&current, path, prefix) && !stamp->dirty;
+	if (!unchanged && !cmld_config_stamp_hash(&current, path, prefix)) {
+		DEBUG("Config %s was touched but its content is unchanged", name);
+		unchanged = true;
+	}
+
+	// the content is still the loaded one, only its stat data is refreshed
+	if (unchanged) {
+		for (int i = 0; i < CMLD_CONFIG_FILES_MAX; ++i) {
+			stamp->files[i].exists = current.files[i].exists;
+			stamp->files[i].mtime = current.files[i].mtime;
+			stamp->files[i].size = current.files[i].size;
+		}
+		stamp->dirty = false;
+	}
+
+	for (int i = 0; i < CMLD_CONFIG_FILES_MAX; ++i) {
+		if (current.files[i].sha256)
+			mem_free(current.files[i].sha256);
+	}
+	return unchanged;
+}
+
+static void
+cmld_config_stamp_update(const char *path, const char *name, const char *prefix)
+{
+	IF_NULL_RETURN(cmld_config_stamps);
+
+	cmld_config_stamp_t *stamp = hashmap_get(cmld_config_stamps, name);
+	if (!stamp) {
+		stamp = mem_new0(cmld_config_stamp_t, 1);
+		stamp->name = mem_strdup(name);
+		hashmap_put(cmld_config_stamps, stamp->name, stamp);
+	}
+	cmld_config_stamp_stat(stamp, path, prefix);
+	cmld_config_stamp_hash(stamp, path, prefix);
+	stamp->dirty = false;
+}
+
+static int
+cmld_load_containers_cb(const char *path, const char *name, UNUSED void *data)
+{
+	uuid_t *uuid = NULL;
+
+	/* we should check for config files here, because the images
+	 * might not be synced to the device from the mdm, but the config files
+	 * should be always there
+	 */
+	size_t len = strlen(name);
+	if (len < 5 || strcmp(name + len - 5, ".conf"))
+		return 0;
+
+	char *prefix = mem_strdup(name);
+	prefix[len - 5] = '\0';
+
+	int res = 0;
+	char *dir = mem_printf("%s/%s", path, prefix);
+
+	if (file_exists(dir) && !file_is_dir(dir)) {
+		WARN("%s exists but is not a directory!", dir);
+		goto cleanup;
+	}
+
+	uuid = uuid_new(prefix);
+	if (uuid) {
+		container_t *c = cmld_container_get_by_uuid(uuid);
+		if (cmld_config_is_unchanged(path, name, prefix, c)) {
+			TRACE("Config %s of container %s unchanged", name, container_get_name(c));
+			goto cleanup;
+		}
+		if (c) {
+			container_state_t state = container_get_state(c);
+			if (state != CONTAINER_STATE_STOPPED) {
+				DEBUG("Not loading %s for already created and not stopped container %s.",
+				      name, container_get_name(c));
+				goto cleanup;
+			}
+			DEBUG("Removing outdated created container %s for config update",
+			      container_get_name(c));
+			cmld_containers_list_remove(c);
+			container_free(c);
+		}
+		c = container_new(path, uuid, NULL, 0, NULL, 0, NULL, 0);
+		if (c) {
+			DEBUG("Loaded config for container %s from %s", container_get_name(c),
+			      name);
+			cmld_container_token_init(c);
+			cmld_containers_list_append(c);
+			cmld_config_stamp_update(path, name, prefix);
+			res = 1;
+			goto cleanup;
+		}
+	}
+	WARN("Could not create new container object from %s", name);
+
+cleanup:
 	if (uuid)
 		uuid_free(uuid);
 	mem_free(dir);
@@ -464,9 +1117,50 @@ cleanup:
 	return res;
 }
 
+static int
+cmld_load_containers_collect_cb(const char *path, const char *name, void *data)
+{
+	list_t **files = data;
+
+	size_t len = strlen(name);
+	if (len < 5 || strcmp(name + len - 5, ".conf"))
+		return 0;
+
+	*files = list_append(*files, mem_printf("%s/%s", path, name));
+	return 1;
+}
+
+/*
+ * Verifies the signatures of all container configs in one batch, rather than
+ * one after the other while the containers are loaded.
+ */
+static void
+cmld_load_containers_verify_prefetch(const char *path)
+{
+	list_t *files = NULL;
+
+	if (dir_foreach(path, &cmld_load_containers_collect_cb, &files) > 1) {
+		size_t n = list_length(files);
+		const char **file_array = mem_new0(const char *, n);
+		size_t i = 0;
+		for (list_t *l = files; l; l = l->next)
+			file_array[i++] = l->data;
+
+		container_config_verify_prefetch(n, file_array);
+		mem_free(file_array);
+	}
+
+	for (list_t *l = files; l; l = l->next)
+		mem_free(l->data);
+	list_delete(files);
+}
+
 static int
 cmld_load_containers(const char *path)
 {
+	cmld_config_inotify_init(path);
+	cmld_load_containers_verify_prefetch(path);
+
 	if (dir_foreach(path, &cmld_load_containers_cb, NULL) < 0) {
 		WARN("Could not open %s to load containers", path);
 		return -1;
@@ -513,10 +1207,13 @@ cmld_rename_logfiles()
 				}
 				char *filename_with_correct_timestamp =
 					logf_file_new_name(filename);
+				// keep the suffix of compressed log segments
+				const char *suffix = strstr(entry->d_name, ".gz");
 				char *old_filename_with_path =
 					mem_printf("%s/%s", LOGFILE_DIR, entry->d_name);
 				char *new_filename_with_path = mem_printf(
-					"%s/%s", LOGFILE_DIR, filename_with_correct_timestamp);
+					"%s/%s%s", LOGFILE_DIR, filename_with_correct_timestamp,
+					suffix ? suffix : "");
 				if (rename(old_filename_with_path, new_filename_with_path))
 					ERROR_ERRNO("Rename not successful %s -> %s",
 						    old_filename_with_path, new_filename_with_path);
@@ -534,6 +1231,156 @@ cmld_rename_logfiles()
 		ERROR("Couldn't open the directory %s", LOGFILE_DIR);
 }
 
+/*
+ * A route cmld maintains depending on the global connectivity. The routes which
+ * have been applied are kept, thus a connectivity change only sends the
+ * difference to the desired routes to the kernel, in a single rtnetlink batch.
+ */
+typedef struct cmld_route {
+	char *table;
+	char *dst; // NULL for the default route
+	char *gateway;
+	char *dev;
+} cmld_route_t;
+
+static list_t *cmld_routes = NULL;
+
+static cmld_route_t *
+cmld_route_new(const char *table, const char *dst, const char *gateway, const char *dev)
+{
+	cmld_route_t *route = mem_new0(cmld_route_t, 1);
+	route->table = mem_strdup(table);
+	route->dst = dst ? mem_strdup(dst) : NULL;
+	route->gateway = gateway ? mem_strdup(gateway) : NULL;
+	route->dev = dev ? mem_strdup(dev) : NULL;
+	return route;
+}
+
+static void
+cmld_routes_free(list_t *routes)
+{
+	for (list_t *l = routes; l; l = l->next) {
+		cmld_route_t *route = l->data;
+		mem_free(route->table);
+		mem_free(route->dst);
+		mem_free(route->gateway);
+		mem_free(route->dev);
+		mem_free(route);
+	}
+	list_delete(routes);
+}
+
+static bool
+cmld_route_str_equals(const char *a, const char *b)
+{
+	return (!a && !b) || (a && b && !strcmp(a, b));
+}
+
+static bool
+cmld_routes_contain(const list_t *routes, const cmld_route_t *route)
+{
+	for (const list_t *l = routes; l; l = l->next) {
+		const cmld_route_t *r = l->data;
+		if (!strcmp(r->table, route->table) && cmld_route_str_equals(r->dst, route->dst) &&
+		    cmld_route_str_equals(r->gateway, route->gateway) &&
+		    cmld_route_str_equals(r->dev, route->dev))
+			return true;
+	}
+	return false;
+}
+
+static list_t *
+cmld_routes_desired_new(container_connectivity_t conn)
+{
+	list_t *routes = NULL;
+
+	if (container_connectivity_mobile(conn)) {
+		/* route over c0 with rild */
+		container_t *c0 = cmld_containers_get_c0();
+		char *c0_ipaddr = c0 ? container_get_first_ip_new(c0) : NULL;
+		char *c0_subnet = c0 ? container_get_first_subnet_new(c0) : NULL;
+		if (c0_ipaddr && c0_subnet) {
+			const char *table = hardware_get_routing_table_radio();
+			routes = list_append(routes, cmld_route_new(table, c0_subnet, NULL,
+								    hardware_get_radio_ifname()));
+			routes = list_append(routes, cmld_route_new(table, NULL, c0_ipaddr, NULL));
+		}
+		mem_free(c0_ipaddr);
+		mem_free(c0_subnet);
+	}
+	return routes;
+}
+
+/*
+ * Appends the requests to add or delete the routes which are not in except.
+ * A route whose device has vanished need not be deleted, as the kernel drops
+ * the routes of a device, but cannot be added.
+ *
+ * @return 0 on success, -1 if a route cannot be added
+ */
+static int
+cmld_routes_append_msgs(list_t **reqs, const list_t *routes, const list_t *except, bool add)
+{
+	int ret = 0;
+
+	for (const list_t *l = routes; l; l = l->next) {
+		const cmld_route_t *route = l->data;
+		if (cmld_routes_contain(except, route))
+			continue;
+		nl_msg_t *req = network_route_msg_new(route->table, route->dst, route->gateway,
+						      route->dev, add);
+		if (req)
+			*reqs = list_append(*reqs, req);
+		else if (add)
+			ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Brings the routes in line with the connectivity. Deletions are sent ahead of
+ * additions, thus e.g. a default route via a new gateway replaces the old one.
+ */
+static void
+cmld_routes_update(container_connectivity_t conn)
+{
+	list_t *desired = cmld_routes_desired_new(conn);
+	list_t *reqs = NULL;
+
+	cmld_routes_append_msgs(&reqs, cmld_routes, desired, false);
+	size_t n_del = list_length(reqs);
+	int ret = cmld_routes_append_msgs(&reqs, desired, cmld_routes, true);
+
+	if (!reqs) {
+		TRACE("Routes are up to date with connectivity %d", conn);
+		cmld_routes_free(desired);
+		return;
+	}
+
+	DEBUG("Updating routes for connectivity %d: deleting %zu, adding %zu", conn, n_del,
+	      list_length(reqs) - n_del);
+	if (network_rtnl_send_batch(reqs) < 0) {
+		ret = -1;
+		// a route may be gone with its gateway, adding is idempotent
+		if (n_del) {
+			WARN("Could not update routes, retrying without deleting stale ones");
+			reqs = NULL;
+			ret = cmld_routes_append_msgs(&reqs, desired, cmld_routes, true);
+			if (reqs && network_rtnl_send_batch(reqs) < 0)
+				ret = -1;
+		}
+	}
+
+	cmld_routes_free(cmld_routes);
+	cmld_routes = desired;
+	if (ret < 0) {
+		// not known which routes exist, the next update adds all desired ones
+		WARN("Could not apply routes for connectivity %d", conn);
+		cmld_routes_free(cmld_routes);
+		cmld_routes = NULL;
+	}
+}
+
 /**
  * This function is called every time the state of the wifi connection changes from
  * offline to online and vice versa.
@@ -559,19 +1406,9 @@ cmld_wifi_change_cb(bool active)
 static void
 cmld_mobile_change_cb(bool active)
 {
-	/* TODO insert stuff that depends on mobile */
+	/* TODO insert stuff that depends on mobile, routes are set by cmld_routes_update() */
 	if (active) {
 		INFO("Global mobile data activated");
-		/* setup route over c0 with rild */
-		container_t *c0 = cmld_containers_get_c0();
-		char *c0_ipaddr = container_get_first_ip_new(c0);
-		char *c0_subnet = container_get_first_subnet_new(c0);
-		network_setup_route_table(hardware_get_routing_table_radio(), c0_subnet,
-					  hardware_get_radio_ifname(), true);
-		network_setup_default_route_table(hardware_get_routing_table_radio(), c0_ipaddr,
-						  true);
-		mem_free(c0_ipaddr);
-		mem_free(c0_subnet);
 	} else {
 		INFO("Global mobile data deactivated");
 	}
@@ -584,6 +1421,8 @@ cmld_mobile_change_cb(bool active)
 static void
 cmld_online_change_cb(bool active)
 {
+	IF_NULL_RETURN(cmld_control_mdm);
+
 	/* connect the MDM dynamically */
 	if (active) {
 		INFO("Global internet (wifi or mobile) activated");
@@ -648,6 +1487,9 @@ cmld_connectivity_rootns_cb(container_t *c_root_netns, UNUSED container_callback
 
 	DEBUG("Global connectivity changed from %d to %d", old_conn, cmld_connectivity);
 
+	cmld_routes_update(cmld_connectivity);
+	bcast_set_connectivity(cmld_connectivity);
+
 	/* detect changes in connection state and call the respective callbacks */
 	if (container_connectivity_wifi(cmld_connectivity) !=
 	    container_connectivity_wifi(old_conn)) {
@@ -765,6 +1607,11 @@ cmld_container_register_observers(container_t *container)
 		WARN("Could not register container reboot observer callback for %s",
 		     container_get_description(container));
 	}
+
+	/* move the container and the others on its start, stop or switch to the foreground */
+	placement_register_container(container);
+	/* boost the container while it is in the foreground */
+	sched_policy_register_container(container);
 }
 
 int
@@ -777,6 +1624,10 @@ cmld_container_start(container_t *container)
 		return -1;
 	}
 
+	/* resume a checkpointed container instead of booting it again */
+	if (container_get_state(container) == CONTAINER_STATE_CHECKPOINTED)
+		return container_restore(container);
+
 	if ((container_get_state(container) == CONTAINER_STATE_STOPPED) ||
 	    (container_get_state(container) == CONTAINER_STATE_REBOOTING)) {
 		/* container is not running => start it */
@@ -866,6 +1717,142 @@ cmld_get_control_gui_sock(void)
 
 /******************************************************************************/
 
+/*
+ * Boot orchestration of the autostart containers: up to cmld_boot_concurrency
+ * containers are started at once. Containers with their own netns wait for the
+ * container providing the root netns, if it is started as well.
+ */
+
+static long
+cmld_boot_elapsed_ms(void)
+{
+	struct timespec now;
+	IF_TRUE_RETVAL(clock_gettime(CLOCK_MONOTONIC, &now) < 0, 0);
+	return (now.tv_sec - cmld_boot_ts.tv_sec) * 1000 +
+	       (now.tv_nsec - cmld_boot_ts.tv_nsec) / 1000000;
+}
+
+static bool
+cmld_boot_is_pending(container_t *container)
+{
+	return list_find(cmld_boot_queue, container) || list_find(cmld_boot_inflight, container);
+}
+
+static bool
+cmld_boot_dependencies_done(container_t *container)
+{
+	container_t *c_root_netns = cmld_container_get_c_root_netns();
+
+	if (container_has_netns(container) && c_root_netns && c_root_netns != container &&
+	    cmld_boot_is_pending(c_root_netns)) {
+		TRACE("Container %s waits for %s", container_get_description(container),
+		      container_get_description(c_root_netns));
+		return false;
+	}
+	return true;
+}
+
+static void
+cmld_boot_schedule(void);
+
+static void
+cmld_boot_done(container_t *container, container_callback_t *cb, bool success)
+{
+	IF_NULL_RETURN(list_find(cmld_boot_inflight, container));
+
+	if (cb)
+		container_unregister_observer(container, cb);
+	cmld_boot_inflight = list_remove(cmld_boot_inflight, container);
+
+	if (success)
+		INFO("Autostart container %s is running (%ld ms after boot start)",
+		     container_get_description(container), cmld_boot_elapsed_ms());
+	else
+		WARN("Autostart of container %s failed", container_get_description(container));
+
+	cmld_boot_schedule();
+}
+
+static void
+cmld_boot_container_cb(container_t *container, container_callback_t *cb, UNUSED void *data)
+{
+	switch (container_get_state(container)) {
+	case CONTAINER_STATE_RUNNING:
+	case CONTAINER_STATE_SETUP:
+		cmld_boot_done(container, cb, true);
+		break;
+	case CONTAINER_STATE_STOPPED:
+	case CONTAINER_STATE_ZOMBIE:
+		cmld_boot_done(container, cb, false);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+cmld_boot_schedule(void)
+{
+	/* a container may fail synchronously while we are starting it */
+	if (cmld_boot_scheduling) {
+		cmld_boot_reschedule = true;
+		return;
+	}
+	cmld_boot_scheduling = true;
+
+	do {
+		cmld_boot_reschedule = false;
+		for (list_t *l = cmld_boot_queue; l; l = l->next) {
+			container_t *container = l->data;
+
+			if (cmld_boot_concurrency > 0 &&
+			    (unsigned)list_length(cmld_boot_inflight) >= cmld_boot_concurrency)
+				break;
+			if (!cmld_boot_dependencies_done(container))
+				continue;
+
+			cmld_boot_queue = list_remove(cmld_boot_queue, container);
+			cmld_boot_inflight = list_append(cmld_boot_inflight, container);
+
+			INFO("Autostarting container %s in background (%ld ms after boot start)",
+			     container_get_name(container), cmld_boot_elapsed_ms());
+			container_callback_t *cb =
+				container_register_observer(container, &cmld_boot_container_cb, NULL);
+			if (!cb || cmld_container_start(container) < 0)
+				cmld_boot_done(container, cb, false);
+
+			/* the queue has changed, start over */
+			cmld_boot_reschedule = true;
+			break;
+		}
+	} while (cmld_boot_reschedule);
+
+	cmld_boot_scheduling = false;
+
+	if (!cmld_boot_queue && !cmld_boot_inflight)
+		INFO("Boot orchestration finished after %ld ms", cmld_boot_elapsed_ms());
+}
+
+static void
+cmld_boot_start_autostart(void)
+{
+	if (clock_gettime(CLOCK_MONOTONIC, &cmld_boot_ts) < 0)
+		memset(&cmld_boot_ts, 0, sizeof(cmld_boot_ts));
+
+	ilist_foreach(&cmld_containers_list, n) {
+		container_t *container = container_from_list_node(n);
+		if (container_get_allow_autostart(container) && !cmld_boot_is_pending(container))
+			cmld_boot_queue = list_append(cmld_boot_queue, container);
+	}
+	IF_NULL_RETURN(cmld_boot_queue);
+
+	INFO("Starting %d autostart containers, at most %u at once", list_length(cmld_boot_queue),
+	     cmld_boot_concurrency);
+	cmld_boot_schedule();
+}
+
+/******************************************************************************/
+
 static void
 cmld_init_c0_cb(container_t *container, container_callback_t *cb, void *data)
 {
@@ -895,52 +1882,27 @@ cmld_c0_boot_complete_cb(container_t *container, container_callback_t *cb, UNUSE
 			uevent_udev_trigger_coldboot(container);
 		container_unregister_observer(container, cb);
 
-		for (list_t *l = cmld_containers_list; l; l = l->next) {
-			container_t *container = l->data;
-			if (container_get_allow_autostart(container)) {
-				INFO("Autostarting container %s in background",
-				     container_get_name(container));
-				cmld_container_start(container);
-			}
-		}
+		cmld_boot_start_autostart();
 	}
 }
 
 /**
- * This observer callback is attached to each container in order to check for other running containers.
- * It ensures that as soon as the last container went down, the device is shut down.
+ * Powers off the device once the shutdown planner stopped all containers.
  */
 static void
-cmld_shutdown_container_cb(container_t *container, container_callback_t *cb, UNUSED void *data)
+cmld_shutdown_poweroff(void)
 {
-	container_state_t state = container_get_state(container);
-
-	if (!(state == CONTAINER_STATE_STOPPED || state == CONTAINER_STATE_ZOMBIE)) {
-		return;
-	}
-
-	container_unregister_observer(container, cb);
-
-	DEBUG("Device shutdown: container %s went down, checking others before shutdown",
-	      container_get_description(container));
-
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		if (!(container_get_state(l->data) == CONTAINER_STATE_STOPPED ||
-		      container_get_state(l->data) == CONTAINER_STATE_ZOMBIE)) {
-			DEBUG("Device shutdown: There are still running containers, can't shut down");
-			return;
-		}
-	}
-
-	IF_TRUE_RETURN_TRACE(cmld_hostedmode);
+	IF_TRUE_RETURN_TRACE(cmld_hostedmode);
 
 	/* all containers are down, so shut down */
 	DEBUG("Device shutdown: last container down; shutdown now");
 
-	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT, "shutdown",
-			uuid_string(container_get_uuid(container)), 0);
+	container_t *c0 = cmld_containers_get_c0();
+	audit_log_event(c0 ? container_get_uuid(c0) : NULL, SSA, CMLD, CONTAINER_MGMT, "shutdown",
+			c0 ? uuid_string(container_get_uuid(c0)) : NULL, 0);
 
 #ifndef TRUSTME_DEBUG
+	audit_flush();
 	reboot_reboot(POWER_OFF);
 	// should never arrive here, but in case the shutdown fails somehow, we exit
 	exit(0);
@@ -955,7 +1917,6 @@ static void
 cmld_shutdown_c0_cb(container_t *c0, container_callback_t *cb, UNUSED void *data)
 {
 	container_state_t c0_state = container_get_state(c0);
-	bool shutdown_now = true;
 
 	/* only execute the callback if c0 goes down */
 	if (!(c0_state == CONTAINER_STATE_SHUTTING_DOWN || c0_state == CONTAINER_STATE_STOPPED ||
@@ -965,45 +1926,13 @@ cmld_shutdown_c0_cb(container_t *c0, container_callback_t *cb, UNUSED void *data
 	audit_log_event(container_get_uuid(c0), SSA, CMLD, CONTAINER_MGMT, "shutdown-c0-start",
 			uuid_string(container_get_uuid(c0)), 0);
 
-	DEBUG("Device shutdown: c0 went down or shutting down, checking others before shutdown");
-
-	/* iterate over containers and check their status:
-	 * - every container, which is not yet down gets an observer to inspect global containers' statuses
-	 * - every container, which is furthermore not yet shutting down, is sent the shutdown command, which
-	 *   needs not to be done for c0, as this observer callback call tells that it is either already
-	 *   dead or in shutting down state
-	 */
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		if (!(container_get_state(l->data) == CONTAINER_STATE_STOPPED ||
-		      container_get_state(l->data) == CONTAINER_STATE_ZOMBIE)) {
-			shutdown_now = false;
-			if (!container_register_observer(l->data, &cmld_shutdown_container_cb,
-							 NULL)) {
-				ERROR("Could not register observer shutdown callback for %s",
-				      container_get_description(l->data));
-			}
-			if (l->data != c0 &&
-			    !(container_get_state(l->data) == CONTAINER_STATE_SHUTTING_DOWN)) {
-				DEBUG("Device shutdown: There is another running container:%s. Shut it down first",
-				      container_get_description(l->data));
-				cmld_container_stop(l->data);
-			}
-		}
-	}
+	DEBUG("Device shutdown: c0 went down or shutting down, stopping the others");
 
 	container_unregister_observer(c0, cb);
 
-	if (shutdown_now && !cmld_hostedmode) {
-		/* all containers are down, so shut down */
-		DEBUG("Device shutdown: all containers already down; shutdown now");
-		audit_log_event(container_get_uuid(c0), SSA, CMLD, CONTAINER_MGMT, "shutdown",
-				uuid_string(container_get_uuid(c0)), 0);
-#ifndef TRUSTME_DEBUG
-		reboot_reboot(POWER_OFF);
-		// should never arrive here, but in case the shutdown fails somehow, we exit
-		exit(0);
-#endif /* TRUSTME_DEBUG */
-	}
+	/* the others are stopped at once, c0 which is going down already is waited for last */
+	if (cmld_containers_stop(&cmld_shutdown_poweroff) < 0)
+		ERROR("Could not stop all containers for device shutdown");
 }
 
 /*
@@ -1021,124 +1950,576 @@ cmld_reboot_c0_cb(container_t *c0, container_callback_t *cb, UNUSED void *data)
 }
 
 static int
-cmld_init_c0(const char *path, const char *c0os)
+cmld_init_c0(const char *path, const char *c0os)
+{
+	IF_TRUE_RETVAL_TRACE(cmld_hostedmode, 0);
+
+	/* Get the c0 guestos */
+	guestos_t *c0_os = guestos_mgr_get_latest_by_name(c0os, true);
+
+	uuid_t *c0_uuid = uuid_new("00000000-0000-0000-0000-000000000000");
+	char *c0_config_file =
+		mem_printf("%s/%s", path, "00000000-0000-0000-0000-000000000000.conf");
+	if (file_exists(c0_config_file)) {
+		// let do load_containers() do the rest
+		INFO("Load c0 config from file %s", c0_config_file);
+		goto out;
+	}
+
+	char *c0_images_folder = mem_printf("%s/%s", path, "00000000-0000-0000-0000-000000000000");
+	mount_t *c0_mnt = mount_new();
+	guestos_fill_mount(c0_os, c0_mnt);
+	unsigned int c0_ram_limit = 1024;
+	bool c0_ns_net = true;
+	bool privileged = true;
+
+	container_t *new_c0 =
+		container_new_internal(c0_uuid, "c0", CONTAINER_TYPE_CONTAINER, false, c0_ns_net,
+				       privileged, c0_os, NULL, c0_images_folder, c0_mnt,
+				       c0_ram_limit, NULL, 0xffffff00, false, NULL,
+				       cmld_get_device_host_dns(), NULL, NULL, NULL, NULL, NULL,
+				       NULL, 0, NULL, CONTAINER_TOKEN_TYPE_NONE, false, 0, 512, 0,
+				       false, CONTAINER_MEMORY_PRIORITY_NONE, NULL, NULL);
+
+	/* store c0 as first element of the cmld_containers_list */
+	cmld_containers_list_prepend(new_c0);
+
+	mem_free(c0_images_folder);
+
+out:
+	uuid_free(c0_uuid);
+	mem_free(c0_config_file);
+
+	return 0;
+}
+
+static int
+cmld_start_c0(container_t *new_c0)
+{
+	IF_TRUE_RETVAL_TRACE(cmld_hostedmode, 0);
+
+	INFO("Starting management container %s...", container_get_description(new_c0));
+
+	int *control_sock_p = mem_new0(int, 1);
+	*control_sock_p = container_bind_socket_before_start(new_c0, CMLD_CONTROL_SOCKET);
+
+	if (!container_register_observer(new_c0, &cmld_init_c0_cb, control_sock_p)) {
+		WARN("Could not register observer init callback on c0");
+		return -1;
+	}
+	if (!container_register_observer(new_c0, &cmld_c0_boot_complete_cb, NULL)) {
+		WARN("Could not register observer boot complete callback on c0");
+		return -1;
+	}
+
+	container_set_key(new_c0, DUMMY_KEY);
+	if (container_start(new_c0)) {
+		audit_log_event(container_get_uuid(new_c0), FSA, CMLD, CONTAINER_MGMT, "c0-start",
+				uuid_string(container_get_uuid(new_c0)), 0);
+		FATAL("Could not start management container");
+	}
+
+	/* register an observer to capture the shutdown command for the special container c0 */
+	if (!container_register_observer(new_c0, &cmld_shutdown_c0_cb, NULL)) {
+		WARN("Could not register observer shutdown callback for c0");
+
+		audit_log_event(container_get_uuid(new_c0), FSA, CMLD, CONTAINER_MGMT, "c0-start",
+				uuid_string(container_get_uuid(new_c0)), 0);
+		return -1;
+	}
+	/* register an observer to capture the reboot command for the special container c0 */
+	if (!container_register_observer(new_c0, &cmld_reboot_c0_cb, NULL)) {
+		WARN("Could not register observer reboot callback for c0");
+		audit_log_event(container_get_uuid(new_c0), FSA, CMLD, CONTAINER_MGMT, "c0-start",
+				uuid_string(container_get_uuid(new_c0)), 0);
+		return -1;
+	}
+
+	audit_log_event(container_get_uuid(new_c0), SSA, CMLD, CONTAINER_MGMT, "c0-start",
+			uuid_string(container_get_uuid(new_c0)), 0);
+	return 0;
+}
+
+/*
+ * Registers the observers of cmld_container_register_observers() and
+ * cmld_start_c0() for a container adopted on a live restart. The observers
+ * which wait for the container to come up are only needed if it still boots.
+ */
+static void
+cmld_container_adopt_observers(container_t *container)
+{
+	bool booting = container_get_state(container) == CONTAINER_STATE_BOOTING;
+	int control_sock = container_get_bound_socket(container, CMLD_CONTROL_SOCKET);
+
+	if (container == cmld_containers_get_c0()) {
+		if (control_sock >= 0)
+			cmld_control_gui = control_new(control_sock, true);
+		if (booting && !container_register_observer(container, &cmld_c0_boot_complete_cb,
+							    NULL))
+			WARN("Could not register observer boot complete callback on c0");
+		if (!container_register_observer(container, &cmld_shutdown_c0_cb, NULL))
+			WARN("Could not register observer shutdown callback for c0");
+		if (!container_register_observer(container, &cmld_reboot_c0_cb, NULL))
+			WARN("Could not register observer reboot callback for c0");
+		return;
+	}
+
+	if (booting &&
+	    !container_register_observer(container, &cmld_container_boot_complete_cb, NULL))
+		ERROR("Could not register container boot complete observer callback for %s",
+		      container_get_description(container));
+	if (container == cmld_container_get_c_root_netns() &&
+	    !container_register_observer(container, &cmld_connectivity_rootns_cb, NULL))
+		ERROR("Could not register connectivity observer callback for %s",
+		      container_get_description(container));
+	if (control_sock >= 0 && !control_new(control_sock, false))
+		WARN("Could not create unpriv control socket for %s",
+		     container_get_description(container));
+	if (!container_register_observer(container, &cmld_reboot_container_cb, NULL))
+		WARN("Could not register container reboot observer callback for %s",
+		     container_get_description(container));
+
+	placement_register_container(container);
+	sched_policy_register_container(container);
+}
+
+/*
+ * Adopts the containers handed over by the previous cmld instance instead of
+ * starting c0 and the autostart containers.
+ */
+static void
+cmld_adopt_containers(void)
+{
+	container_t *c0 = cmld_containers_get_c0();
+	bool c0_adopted = false;
+
+	list_t *adopted = handoff_adopt_containers();
+	for (list_t *l = adopted; l; l = l->next) {
+		container_t *container = l->data;
+		cmld_container_adopt_observers(container);
+		c0_adopted |= (container == c0);
+	}
+	list_delete(adopted);
+
+	if (c0 && !c0_adopted && container_get_state(c0) == CONTAINER_STATE_STOPPED &&
+	    cmld_start_c0(c0) < 0)
+		FATAL("Could not start c0");
+}
+
+static void
+cmld_tune_network(const char *host_addr, uint32_t host_subnet, const char *host_if,
+		  const char *host_gateway, const char *host_dns)
+{
+	IF_TRUE_RETURN_TRACE(cmld_hostedmode);
+
+	/*
+	 * Increase the max socket send buffer size which is used for all types of
+	 * connections. In particular, this is required by the TrustmeService in
+	 * order to send moderately large messages (e.g. wallpaper data) over the
+	 * unix domain socket to the cmld without blocking for several seconds.
+	 */
+	if (file_printf("/proc/sys/net/core/wmem_max", "%d", 1024 * 1024) < 0)
+		WARN("Could not increase max OS send buffer size");
+
+	/* configure loopback interface of root network namespace */
+	network_setup_loopback();
+
+	cmld_netif_phys_list = network_get_physical_interfaces_new();
+
+	/* configure resolver of root network namespace */
+	if (-1 == file_printf("/etc/resolv.conf", "nameserver %s", host_dns))
+		WARN("Could not setup dns server for CML");
+
+	DEBUG("Trying to configure eth0");
+	//network_set_ip_addr_of_interface("10.0.2.15", 24, "eth0");
+	network_set_ip_addr_of_interface(host_addr, host_subnet, host_if);
+	network_setup_default_route(host_gateway, true);
+	network_enable_ip_forwarding();
+}
+
+/*
+ * State shared by the startup stages of cmld_init().
+ */
+typedef struct {
+	const char *path;
+	device_config_t *device_config;
+	smartcard_t *smartcard; /* started, but not yet connected scd */
+	char *containers_path;
+} cmld_boot_ctx_t;
+
+static int
+cmld_boot_scd_start(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	char *tokens_path = mem_printf("%s/%s", ctx->path, CMLD_PATH_CONTAINER_KEYS_DIR);
+	ctx->smartcard = smartcard_new(tokens_path);
+	mem_free(tokens_path);
+
+	return ctx->smartcard ? 1 : -1;
+}
+
+static int
+cmld_boot_scd_poll(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	int ret = smartcard_connect(ctx->smartcard);
+	if (ret == 0) {
+		INFO("Connected to smartcard daemon");
+		cmld_smartcard = ctx->smartcard;
+	} else if (ret < 0) {
+		smartcard_free(ctx->smartcard);
+	}
+	return ret;
+}
+
+static int
+cmld_boot_tss_start(UNUSED void *data)
+{
+	if (tss_init() < 0)
+		FATAL("Failed to initialize TSS / TPM 2.0 and tpm2d");
+	return 1;
+}
+
+static int
+cmld_boot_tss_poll(UNUSED void *data)
+{
+	int ret = tss_connect();
+	if (ret < 0)
+		FATAL("Failed to connect to tpm2d");
+	IF_TRUE_RETVAL(ret != 0, ret);
+
+	INFO("tss initialized.");
+
+	// without the key, the hash caches are only kept in memory
+	size_t key_len = 0;
+	uint8_t *key = tss_cache_key_new(&key_len);
+	if (key)
+		hash_cache_set_key(key, key_len);
+	return 0;
+}
+
+static int
+cmld_boot_uevent(UNUSED void *data)
+{
+	if (uevent_init() < 0)
+		FATAL("Could not init uevent module");
+	INFO("uevent initialized.");
+	return 0;
+}
+
+static int
+cmld_boot_network(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	cmld_tune_network(device_config_get_host_addr(ctx->device_config),
+			  device_config_get_host_subnet(ctx->device_config),
+			  device_config_get_host_if(ctx->device_config),
+			  device_config_get_host_gateway(ctx->device_config),
+			  device_config_get_host_dns(ctx->device_config));
+	return 0;
+}
+
+static int
+cmld_boot_peer(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	uint32_t port = device_config_get_peer_cache_port(ctx->device_config);
+	IF_TRUE_RETVAL(!port, 0);
+
+	if (port > UINT16_MAX || peer_init(port) < 0) {
+		WARN("Could not init peer cache, images are only fetched from the update server");
+		return -1;
+	}
+	INFO("peer cache initialized.");
+	return 0;
+}
+
+static int
+cmld_boot_devices(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	cmld_device_pool_size = device_config_get_device_pool_size(ctx->device_config);
+	cmld_device_pool_refill();
+
+	const char *thin_meta_dev = device_config_get_thin_pool_meta_dev(ctx->device_config);
+	const char *thin_data_dev = device_config_get_thin_pool_data_dev(ctx->device_config);
+	if (thin_meta_dev && thin_data_dev) {
+		if (c_vol_thin_pool_init(thin_meta_dev, thin_data_dev) < 0) {
+			WARN("Could not init thin pool, using image files for container volumes");
+			return -1;
+		}
+		INFO("thin pool initialized.");
+	}
+	return 0;
+}
+
+static int
+cmld_boot_cgroups(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	c_cgroups_set_unified(device_config_get_cgroups_v2(ctx->device_config));
+
+	c_cgroups_pressure_policy_t pressure_policy = {
+		.memory_stall_ms = device_config_get_pressure_memory_stall_ms(ctx->device_config),
+		.cpu_stall_ms = device_config_get_pressure_cpu_stall_ms(ctx->device_config),
+		.io_stall_ms = device_config_get_pressure_io_stall_ms(ctx->device_config),
+		.throttle_percent = device_config_get_pressure_throttle_percent(ctx->device_config),
+		.relax_ms = device_config_get_pressure_relax_ms(ctx->device_config),
+	};
+	c_cgroups_set_pressure_policy(&pressure_policy);
+	return 0;
+}
+
+static int
+cmld_boot_ksm(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	if (ksm_init(device_config_get_ksm_merge_containers(ctx->device_config)) < 0) {
+		WARN("Could not init ksm module");
+		return -1;
+	}
+	INFO("ksm initialized.");
+	return 0;
+}
+
+static int
+cmld_boot_hibernate(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	if (hibernate_init(device_config_get_hibernate_zram_mb(ctx->device_config),
+			   device_config_get_hibernate_zram_algorithm(ctx->device_config)) < 0) {
+		WARN("Could not init hibernation, keeping frozen containers in memory");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+cmld_boot_placement(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	sched_policy_init(device_config_get_sched_foreground_boost(ctx->device_config),
+			  device_config_get_sched_foreground_uclamp_min(ctx->device_config),
+			  device_config_get_sched_background_cpu_percent(ctx->device_config));
+
+	if (placement_init(device_config_get_cpu_placement(ctx->device_config)) < 0) {
+		WARN("Could not init cpu placement module");
+		return -1;
+	}
+	INFO("cpu placement initialized.");
+	return 0;
+}
+
+static int
+cmld_boot_accounting(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	if (accounting_init(device_config_get_accounting_interval(ctx->device_config),
+			    device_config_get_accounting_metrics(ctx->device_config)) < 0) {
+		WARN("Could not init accounting module");
+		return -1;
+	}
+	INFO("accounting initialized.");
+	return 0;
+}
+
+static int
+cmld_boot_zygote(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
+
+	if (zygote_init(device_config_get_zygote_pool_size(ctx->device_config)) < 0) {
+		WARN("Could not init zygote pool");
+		return -1;
+	}
+	INFO("zygote pool initialized.");
+	return 0;
+}
+
+static int
+cmld_boot_lxcfs(UNUSED void *data)
+{
+	pid_t lxcfs_pid = handoff_get_lxcfs_pid();
+	if (lxcfs_pid > 0 && lxcfs_adopt(lxcfs_pid) == 0) {
+		INFO("lxcfs adopted.");
+		return 0;
+	}
+
+	if (lxcfs_init() < 0) {
+		WARN("Plattform does not support LXCFS");
+		return -1;
+	}
+	INFO("lxcfs initialized.");
+	return 0;
+}
+
+static int
+cmld_boot_control(UNUSED void *data)
+{
+	// Read the provision-status-file to set provisioned flag of control structs accordingly
+	char *provisioned_file = mem_printf("%s/%s", DEFAULT_BASE_PATH, PROVISIONED_FILE_NAME);
+	if (file_exists(provisioned_file)) {
+		DEBUG("Device is already provisioned");
+		cmld_device_provisioned = true;
+	} else {
+		DEBUG("Device is not yet provisioned and provision-status-file does not yet exist");
+	}
+	mem_free(provisioned_file);
+
+	/* the control module sets up a local or remote socket, registers a
+	 * callback (via event_) and parses incoming commands
+	 * and calls the corresponding function in the cmld module,
+	 * e.g. cmld_switch_container */
+	int control_sock = handoff_get_control_sock();
+	if (control_sock >= 0)
+		cmld_control_cml = control_new(control_sock, true);
+	else
+		cmld_control_cml = control_local_new(CMLD_CONTROL_SOCKET);
+	if (!cmld_control_cml) {
+		FATAL("Could not init cmld_cli control socket");
+	}
+	INFO("created control socket.");
+	return 0;
+}
+
+static int
+cmld_boot_mdm(void *data)
 {
-	IF_TRUE_RETVAL_TRACE(cmld_hostedmode, 0);
-
-	/* Get the c0 guestos */
-	guestos_t *c0_os = guestos_mgr_get_latest_by_name(c0os, true);
+	cmld_boot_ctx_t *ctx = data;
 
-	uuid_t *c0_uuid = uuid_new("00000000-0000-0000-0000-000000000000");
-	char *c0_config_file =
-		mem_printf("%s/%s", path, "00000000-0000-0000-0000-000000000000.conf");
-	if (file_exists(c0_config_file)) {
-		// let do load_containers() do the rest
-		INFO("Load c0 config from file %s", c0_config_file);
-		goto out;
+	// TODO: we should implement a callback for inet connectivity and
+	// reconnect the MDM socket automatically
+	const char *mdm_node = device_config_get_mdm_node(ctx->device_config);
+	const char *mdm_service = device_config_get_mdm_service(ctx->device_config);
+	INFO("got MDM node and service %s and %s.", mdm_node, mdm_service);
+	if (!mdm_node || !mdm_service) {
+		WARN("Could not get a valid MDM configuration from config file");
+		return 0;
 	}
 
-	char *c0_images_folder = mem_printf("%s/%s", path, "00000000-0000-0000-0000-000000000000");
-	mount_t *c0_mnt = mount_new();
-	guestos_fill_mount(c0_os, c0_mnt);
-	unsigned int c0_ram_limit = 1024;
-	bool c0_ns_net = true;
-	bool privileged = true;
-
-	container_t *new_c0 =
-		container_new_internal(c0_uuid, "c0", CONTAINER_TYPE_CONTAINER, false, c0_ns_net,
-				       privileged, c0_os, NULL, c0_images_folder, c0_mnt,
-				       c0_ram_limit, NULL, 0xffffff00, false, NULL,
-				       cmld_get_device_host_dns(), NULL, NULL, NULL, NULL, NULL,
-				       NULL, 0, NULL, CONTAINER_TOKEN_TYPE_NONE, false);
+	cmld_control_mdm = control_remote_new(mdm_node, mdm_service);
+	if (!cmld_control_mdm) {
+		WARN_ERRNO("Could not init MDM control socket");
+		return -1;
+	}
+	if (device_config_get_mdm_tls(ctx->device_config)) {
+		bool use_tpm = device_config_get_tpm_enabled(ctx->device_config);
+		const char *key_file = use_tpm ? TPM2D_ATT_TSS_FILE : DEVICE_KEY_FILE;
+		// never fall back to an unencrypted MDM connection
+		if (ssl_init(use_tpm, TPM2D_PRIMARY_STORAGE_KEY_PW) < 0 ||
+		    control_remote_set_tls(cmld_control_mdm, MDM_ROOT_CERT, DEVICE_CERT_FILE,
+					   key_file, use_tpm) < 0) {
+			WARN("Could not set up TLS for MDM connection, MDM disabled");
+			control_free(cmld_control_mdm);
+			cmld_control_mdm = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	/* store c0 as first element of the cmld_containers_list */
-	cmld_containers_list = list_prepend(cmld_containers_list, new_c0);
+static int
+cmld_boot_c0_prefetch_start(UNUSED void *data)
+{
+	IF_TRUE_RETVAL(cmld_hostedmode || !cmld_c0os_name, 0);
 
-	mem_free(c0_images_folder);
+	// cmld_init_c0() picks the latest c0 GuestOS whose config is valid
+	char *guestos_path = mem_printf("%s/%s", cmld_path, CMLD_PATH_GUESTOS_DIR);
+	int n = guestos_mgr_prefetch_images(guestos_path, cmld_c0os_name);
+	mem_free(guestos_path);
 
-out:
-	uuid_free(c0_uuid);
-	mem_free(c0_config_file);
+	return n > 0 ? 1 : 0;
+}
 
-	return 0;
+static int
+cmld_boot_c0_prefetch_poll(UNUSED void *data)
+{
+	return hash_file_speculative_pending() ? 1 : 0;
 }
 
 static int
-cmld_start_c0(container_t *new_c0)
+cmld_boot_guestos(void *data)
 {
-	IF_TRUE_RETVAL_TRACE(cmld_hostedmode, 0);
+	cmld_boot_ctx_t *ctx = data;
 
-	INFO("Starting management container %s...", container_get_description(new_c0));
+	char *guestos_path = mem_printf("%s/%s", ctx->path, CMLD_PATH_GUESTOS_DIR);
+	bool allow_locally_signed = device_config_get_locally_signed_images(ctx->device_config);
+	if (guestos_mgr_init(guestos_path, allow_locally_signed) < 0 && !cmld_hostedmode)
+		FATAL("Could not load guest operating systems");
+	mem_free(guestos_path);
+	INFO("guestos initialized.");
+	guestos_mgr_update_images();
 
-	int *control_sock_p = mem_new0(int, 1);
-	*control_sock_p = container_bind_socket_before_start(new_c0, CMLD_CONTROL_SOCKET);
+	// the interval is configured in hours, the bandwidth in KiB/s
+	uint32_t scrub_hours = device_config_get_scrub_interval(ctx->device_config);
+	uint64_t scrub_rate = device_config_get_scrub_bandwidth(ctx->device_config);
+	scrub_rate *= 1024;
+	if (scrub_hours && guestos_mgr_scrub_init((time_t)scrub_hours * 3600, scrub_rate) < 0)
+		WARN("Could not start scrubbing GuestOS images");
+	return 0;
+}
 
-	if (!container_register_observer(new_c0, &cmld_init_c0_cb, control_sock_p)) {
-		WARN("Could not register observer init callback on c0");
-		return -1;
-	}
-	if (!container_register_observer(new_c0, &cmld_c0_boot_complete_cb, NULL)) {
-		WARN("Could not register observer boot complete callback on c0");
-		return -1;
-	}
+static int
+cmld_boot_storage(void *data)
+{
+	cmld_boot_ctx_t *ctx = data;
 
-	container_set_key(new_c0, DUMMY_KEY);
-	if (container_start(new_c0)) {
-		audit_log_event(container_get_uuid(new_c0), FSA, CMLD, CONTAINER_MGMT, "c0-start",
-				uuid_string(container_get_uuid(new_c0)), 0);
-		FATAL("Could not start management container");
-	}
+	ctx->containers_path = mem_printf("%s/%s", ctx->path, CMLD_PATH_CONTAINERS_DIR);
+	if (mkdir(ctx->containers_path, 0700) < 0 && errno != EEXIST)
+		FATAL_ERRNO("Could not mkdir containers directory %s", ctx->containers_path);
 
-	/* register an observer to capture the shutdown command for the special container c0 */
-	if (!container_register_observer(new_c0, &cmld_shutdown_c0_cb, NULL)) {
-		WARN("Could not register observer shutdown callback for c0");
+	// deleted images are moved to the trash on the same file system
+	char *trash_path = mem_printf("%s/%s", ctx->containers_path, CMLD_PATH_TRASH_DIR);
+	if (trash_init(trash_path) < 0)
+		WARN("Could not init trash, deleting images synchronously");
+	mem_free(trash_path);
 
-		audit_log_event(container_get_uuid(new_c0), FSA, CMLD, CONTAINER_MGMT, "c0-start",
-				uuid_string(container_get_uuid(new_c0)), 0);
-		return -1;
-	}
-	/* register an observer to capture the reboot command for the special container c0 */
-	if (!container_register_observer(new_c0, &cmld_reboot_c0_cb, NULL)) {
-		WARN("Could not register observer reboot callback for c0");
-		audit_log_event(container_get_uuid(new_c0), FSA, CMLD, CONTAINER_MGMT, "c0-start",
-				uuid_string(container_get_uuid(new_c0)), 0);
-		return -1;
+	if (device_config_get_dir_storage(ctx->device_config)) {
+		if (c_vol_dir_storage_init(ctx->containers_path) < 0)
+			WARN("Could not init directory storage, using image files for volumes");
+		else
+			INFO("directory storage initialized.");
 	}
 
-	audit_log_event(container_get_uuid(new_c0), SSA, CMLD, CONTAINER_MGMT, "c0-start",
-			uuid_string(container_get_uuid(new_c0)), 0);
+	char *keys_path = mem_printf("%s/%s", ctx->path, CMLD_PATH_CONTAINER_KEYS_DIR);
+	if (mkdir(keys_path, 0700) < 0 && errno != EEXIST)
+		FATAL_ERRNO("Could not mkdir container keys directory %s", keys_path);
+	mem_free(keys_path);
 	return 0;
 }
 
-static void
-cmld_tune_network(const char *host_addr, uint32_t host_subnet, const char *host_if,
-		  const char *host_gateway, const char *host_dns)
+static int
+cmld_boot_c0(void *data)
 {
-	IF_TRUE_RETURN_TRACE(cmld_hostedmode);
+	cmld_boot_ctx_t *ctx = data;
 
-	/*
-	 * Increase the max socket send buffer size which is used for all types of
-	 * connections. In particular, this is required by the TrustmeService in
-	 * order to send moderately large messages (e.g. wallpaper data) over the
-	 * unix domain socket to the cmld without blocking for several seconds.
-	 */
-	if (file_printf("/proc/sys/net/core/wmem_max", "%d", 1024 * 1024) < 0)
-		WARN("Could not increase max OS send buffer size");
+	if (cmld_smartcard == NULL)
+		FATAL("Could not connect to smartcard daemon");
 
-	/* configure loopback interface of root network namespace */
-	network_setup_loopback();
+	if (cmld_init_c0(ctx->containers_path, device_config_get_c0os(ctx->device_config)) < 0)
+		FATAL("Could not init c0");
 
-	cmld_netif_phys_list = network_get_physical_interfaces_new();
+	if (cmld_load_containers(ctx->containers_path) < 0)
+		FATAL("Could not load containers");
 
-	/* configure resolver of root network namespace */
-	if (-1 == file_printf("/etc/resolv.conf", "nameserver %s", host_dns))
-		WARN("Could not setup dns server for CML");
+	if (handoff_is_active()) {
+		cmld_adopt_containers();
+		return 0;
+	}
 
-	DEBUG("Trying to configure eth0");
-	//network_set_ip_addr_of_interface("10.0.2.15", 24, "eth0");
-	network_set_ip_addr_of_interface(host_addr, host_subnet, host_if);
-	network_setup_default_route(host_gateway, true);
-	network_enable_ip_forwarding();
+	if (cmld_start_c0(cmld_containers_get_c0()) < 0)
+		FATAL("Could not start c0");
+	return 0;
 }
 
 int
@@ -1147,7 +2528,8 @@ cmld_init(const char *path)
 	INFO("Storage path is %s", path);
 	cmld_path = path;
 
-	if (mount_private_tmp())
+	// on a live restart, the private tmp of the previous instance is kept
+	if (!handoff_init() && mount_private_tmp())
 		FATAL("Could not setup private tmp!");
 
 	/* Currently the given path is used by the config module to generate the
@@ -1170,12 +2552,6 @@ cmld_init(const char *path)
 	// activate signature checking of container configs if enabled
 	cmld_signed_configs = device_config_get_signed_configs(device_config);
 
-	cmld_tune_network(device_config_get_host_addr(device_config),
-			  device_config_get_host_subnet(device_config),
-			  device_config_get_host_if(device_config),
-			  device_config_get_host_gateway(device_config),
-			  device_config_get_host_dns(device_config));
-
 	cmld_shared_data_dir = mem_printf("%s/%s", path, CMLD_PATH_SHARED_DATA_DIR);
 	if (mkdir(cmld_shared_data_dir, 0700) < 0 && errno != EEXIST)
 		FATAL_ERRNO("Could not mkdir shared data directory %s", cmld_shared_data_dir);
@@ -1192,6 +2568,10 @@ cmld_init(const char *path)
 	const char *c0os_name = device_config_get_c0os(device_config);
 	cmld_c0os_name = c0os_name ? mem_strdup(c0os_name) : NULL;
 
+	cmld_boot_concurrency = device_config_get_boot_concurrency(device_config);
+	cmld_checkpoint_background = device_config_get_checkpoint_background(device_config);
+	cmld_lazy_images = device_config_get_lazy_images(device_config);
+
 	if (mount_remount_root_ro() < 0 && !cmld_hostedmode)
 		FATAL("Could not remount rootfs read-only");
 
@@ -1206,6 +2586,11 @@ cmld_init(const char *path)
 	else
 		INFO("audit initialized.");
 
+	// state shared by all containers, published as soon as the page exists
+	if (bcast_init() < 0)
+		WARN("Could not init broadcast page, containers fall back to messages");
+	bcast_set_dns(cmld_device_host_dns);
+
 	if (time_init() < 0)
 		FATAL("Could not init time module");
 	INFO("time initialized.");
@@ -1214,100 +2599,52 @@ cmld_init(const char *path)
 	audit_log_event(NULL, SSA, CMLD, GENERIC, "boot-time", NULL, 2, "time", btime);
 	mem_free(btime);
 
-	if (uevent_init() < 0)
-		FATAL("Could not init uevent module");
-	INFO("uevent initialized.");
-
-	if (ksm_init() < 0)
-		WARN("Could not init ksm module");
-	else
-		INFO("ksm initialized.");
-
-	if (device_config_get_tpm_enabled(device_config)) {
-		if (tss_init() < 0)
-			FATAL("Failed to initialize TSS / TPM 2.0 and tpm2d");
-		else
-			INFO("tss initialized.");
-	}
-
-	if (lxcfs_init() < 0)
-		WARN("Plattform does not support LXCFS");
-	else
-		INFO("lxcfs initialized.");
-
-	// Read the provision-status-file to set provisioned flag of control structs accordingly
-	char *provisioned_file = mem_printf("%s/%s", DEFAULT_BASE_PATH, PROVISIONED_FILE_NAME);
-	if (file_exists(provisioned_file)) {
-		DEBUG("Device is already provisioned");
-		cmld_device_provisioned = true;
-	} else {
-		DEBUG("Device is not yet provisioned and provision-status-file does not yet exist");
-	}
-
-	/* the control module sets up a local or remote socket, registers a
-	 * callback (via event_) and parses incoming commands
-	 * and calls the corresponding function in the cmld module,
-	 * e.g. cmld_switch_container */
+	// scd and cmld place their sockets there
 	if (dir_mkdir_p(CMLD_SOCKET_DIR, 0755) < 0) {
 		FATAL("Could not create directory for cmld_cli control socket");
 	}
-	cmld_control_cml = control_local_new(CMLD_CONTROL_SOCKET);
-	if (!cmld_control_cml) {
-		FATAL("Could not init cmld_cli control socket");
-	}
-	INFO("created control socket.");
-
-	// TODO: we should implement a callback for inet connectivity and
-	// reconnect the MDM socket automatically
-	const char *mdm_node = device_config_get_mdm_node(device_config);
-	const char *mdm_service = device_config_get_mdm_service(device_config);
-	INFO("got MDM node and service %s and %s.", mdm_node, mdm_service);
-	if (mdm_node && mdm_service) {
-		cmld_control_mdm = control_remote_new(mdm_node, mdm_service);
-		if (!cmld_control_mdm) {
-			WARN_ERRNO("Could not init MDM control socket");
-		}
-	} else {
-		WARN("Could not get a valid MDM configuration from config file");
-	}
-
-	char *tokens_path = mem_printf("%s/%s", path, CMLD_PATH_CONTAINER_KEYS_DIR);
-	cmld_smartcard = smartcard_new(tokens_path);
-	mem_free(tokens_path);
-
-	char *guestos_path = mem_printf("%s/%s", path, CMLD_PATH_GUESTOS_DIR);
-	bool allow_locally_signed = device_config_get_locally_signed_images(device_config);
-	if (guestos_mgr_init(guestos_path, allow_locally_signed) < 0 && !cmld_hostedmode)
-		FATAL("Could not load guest operating systems");
-	mem_free(guestos_path);
-	INFO("guestos initialized.");
-	guestos_mgr_update_images();
-
-	char *containers_path = mem_printf("%s/%s", path, CMLD_PATH_CONTAINERS_DIR);
-	if (mkdir(containers_path, 0700) < 0 && errno != EEXIST)
-		FATAL_ERRNO("Could not mkdir containers directory %s", containers_path);
-
-	char *keys_path = mem_printf("%s/%s", path, CMLD_PATH_CONTAINER_KEYS_DIR);
-	if (mkdir(containers_path, 0700) < 0 && errno != EEXIST)
-		FATAL_ERRNO("Could not mkdir container keys directory %s", containers_path);
-	mem_free(keys_path);
-
-	if (cmld_smartcard == NULL)
-		FATAL("Could not connect to smartcard daemon");
-	else
-		INFO("Connected to smartcard daemon");
-
-	if (cmld_init_c0(containers_path, device_config_get_c0os(device_config)) < 0)
-		FATAL("Could not init c0");
-
-	if (cmld_load_containers(containers_path) < 0)
-		FATAL("Could not load containers");
-
-	if (cmld_start_c0(cmld_containers_get_c0()) < 0)
-		FATAL("Could not start c0");
-
-	mem_free(containers_path);
 
+	/* The remaining subsystems are initialized along their dependencies. scd
+	 * and tpm2d are started first, everything not depending on them is set up
+	 * while they come up, and c0 is started as soon as all stages are done. */
+	cmld_boot_ctx_t ctx = { .path = path, .device_config = device_config };
+	boot_t *boot = boot_new();
+
+	int scd = boot_add_stage(boot, "scd", cmld_boot_scd_start, cmld_boot_scd_poll, 0, &ctx);
+	uint64_t tpm2d = 0;
+	if (device_config_get_tpm_enabled(device_config))
+		tpm2d = BOOT_DEP(boot_add_stage(boot, "tpm2d", cmld_boot_tss_start,
+						cmld_boot_tss_poll, 0, &ctx));
+	/* c0's images are checked in its init, which cannot wait for the hash workers,
+	 * thus the speculative hashes have to be finished before c0 is started. The
+	 * hash caches, which let the prefetch skip unchanged images, need tpm2d's key */
+	boot_add_stage(boot, "c0 prefetch", cmld_boot_c0_prefetch_start,
+		       cmld_boot_c0_prefetch_poll, tpm2d, &ctx);
+	boot_add_stage(boot, "uevent", cmld_boot_uevent, NULL, 0, &ctx);
+	int network = boot_add_stage(boot, "network", cmld_boot_network, NULL, 0, &ctx);
+	boot_add_stage(boot, "peer", cmld_boot_peer, NULL, BOOT_DEP(network), &ctx);
+	boot_add_stage(boot, "devices", cmld_boot_devices, NULL, 0, &ctx);
+	// the cgroup version needs to be selected before lxcfs mounts the cgroups
+	int cgroups = boot_add_stage(boot, "cgroups", cmld_boot_cgroups, NULL, 0, &ctx);
+	boot_add_stage(boot, "ksm", cmld_boot_ksm, NULL, 0, &ctx);
+	boot_add_stage(boot, "hibernate", cmld_boot_hibernate, NULL, 0, &ctx);
+	boot_add_stage(boot, "placement", cmld_boot_placement, NULL, 0, &ctx);
+	boot_add_stage(boot, "accounting", cmld_boot_accounting, NULL, BOOT_DEP(cgroups), &ctx);
+	boot_add_stage(boot, "zygote", cmld_boot_zygote, NULL, 0, &ctx);
+	boot_add_stage(boot, "lxcfs", cmld_boot_lxcfs, NULL, BOOT_DEP(cgroups), &ctx);
+	boot_add_stage(boot, "control", cmld_boot_control, NULL, 0, &ctx);
+	// the MDM connection may use a TPM key for TLS
+	boot_add_stage(boot, "mdm", cmld_boot_mdm, NULL, tpm2d, &ctx);
+	// guest OS configs are verified by scd, their hash caches are keyed by tpm2d
+	boot_add_stage(boot, "guestos", cmld_boot_guestos, NULL, BOOT_DEP(scd) | tpm2d, &ctx);
+	int storage = boot_add_stage(boot, "storage", cmld_boot_storage, NULL, 0, &ctx);
+	// c0 is started when everything else is done
+	boot_add_stage(boot, "c0", cmld_boot_c0, NULL, BOOT_DEP(storage + 1) - 1, &ctx);
+
+	boot_run(boot);
+	boot_free(boot);
+
+	mem_free(ctx.containers_path);
 	device_config_free(device_config);
 	return 0;
 }
@@ -1341,7 +2678,7 @@ cmld_container_create_from_config(const uint8_t *config, size_t config_len, uint
 			cmld_container_destroy(c);
 			c = NULL;
 		} else {
-			cmld_containers_list = list_append(cmld_containers_list, c);
+			cmld_containers_list_append(c);
 			audit_log_event(container_get_uuid(c), SSA, CMLD, CONTAINER_MGMT,
 					"container-create", uuid_string(container_get_uuid(c)), 0);
 			INFO("Created container %s (uuid=%s).", container_get_name(c),
@@ -1393,7 +2730,7 @@ cmld_container_destroy_cb(container_t *container, container_callback_t *cb, UNUS
 	}
 
 	/* cleanup container */
-	cmld_containers_list = list_remove(cmld_containers_list, container);
+	cmld_containers_list_remove(container);
 	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
 			"container-remove", uuid_string(container_get_uuid(container)), 0);
 	container_free(container);
@@ -1408,6 +2745,10 @@ cmld_container_destroy(container_t *container)
 	container_t *c0 = cmld_containers_get_c0();
 	IF_TRUE_RETVAL(c0 == container, -1);
 
+	/* a checkpointed container has no processes, its resources are released right away */
+	if (container_get_state(container) == CONTAINER_STATE_CHECKPOINTED)
+		container_stop(container);
+
 	if (container_get_state(container) != CONTAINER_STATE_STOPPED) {
 		container_kill(container);
 
@@ -1453,6 +2794,15 @@ cmld_container_freeze(container_t *container)
 {
 	ASSERT(container);
 
+	/* evict background containers to flash instead of keeping their memory */
+	if (cmld_checkpoint_background && !container_is_screen_on(container) &&
+	    !container_is_encrypted(container)) {
+		if (!container_checkpoint(container))
+			return 0;
+		WARN("Checkpoint of %s failed, freezing it instead",
+		     container_get_description(container));
+	}
+
 	return container_freeze(container);
 }
 
@@ -1461,6 +2811,9 @@ cmld_container_unfreeze(container_t *container)
 {
 	ASSERT(container);
 
+	if (container_get_state(container) == CONTAINER_STATE_CHECKPOINTED)
+		return container_restore(container);
+
 	return container_unfreeze(container);
 }
 
@@ -1484,8 +2837,8 @@ int
 cmld_container_snapshot(container_t *container)
 {
 	ASSERT(container);
-	ASSERT(0);
-	return 0;
+
+	return container_snapshot(container);
 }
 
 int
@@ -1493,6 +2846,20 @@ cmld_container_wipe(container_t *container)
 {
 	ASSERT(container);
 
+	/*
+	 * Crypto-erase: without the key file, the data of encrypted volumes cannot
+	 * be decrypted anymore, even before the images have been deleted. A new
+	 * key is generated on the next start.
+	 */
+	if (container_is_encrypted(container)) {
+		bool removed = smartcard_remove_keyfile(cmld_smartcard, container) == 0;
+		audit_log_event(container_get_uuid(container), removed ? SSA : FSA, CMLD,
+				CONTAINER_MGMT, "container-remove-keyfile",
+				uuid_string(container_get_uuid(container)), 0);
+		if (!removed)
+			WARN("Failed to remove keyfile. Continuing to wipe container anyway.");
+	}
+
 	return container_wipe(container);
 }
 
@@ -1504,8 +2871,10 @@ cmld_wipe_device()
 	dir_delete_folder(cmld_path, CMLD_PATH_CONTAINER_KEYS_DIR);
 	dir_delete_folder(cmld_path, CMLD_PATH_CONTAINER_TOKENS_DIR);
 	dir_delete_folder(LOGFILE_DIR, "");
-	if (!cmld_hostedmode)
+	if (!cmld_hostedmode) {
+		audit_flush();
 		reboot_reboot(POWER_OFF);
+	}
 }
 
 const char *
@@ -1586,7 +2955,7 @@ cmld_token_attach(const char *serial, char *devpath)
 
 	TRACE("Handling attachment of token with serial %s at %s", serial, devpath);
 
-	container_set_usbtoken_devpath(container, mem_strdup(devpath));
+	cmld_container_set_token_devpath(container, mem_strdup(devpath));
 
 	// initialize the USB token
 	int block_return = cmld_container_token_init(container);
@@ -1609,7 +2978,7 @@ cmld_token_detach(char *devpath)
 
 	DEBUG("Handling detachment of token at %s", devpath);
 
-	container_set_usbtoken_devpath(container, NULL);
+	cmld_container_set_token_devpath(container, NULL);
 
 	DEBUG("Stopping Container");
 	if (cmld_container_stop(container)) {
@@ -1623,14 +2992,111 @@ cmld_token_detach(char *devpath)
 	return 0;
 }
 
+static bool cmld_live_restart_stopped = false;
+
+/*
+ * Stops the helpers right before the exec of the live restart, they are
+ * started again by the new instance.
+ */
+static void
+cmld_live_restart_stop_helpers(void)
+{
+	zygote_cleanup();
+	if (cmld_smartcard) {
+		smartcard_free(cmld_smartcard);
+		cmld_smartcard = NULL;
+	}
+	tss_cleanup();
+	// the services fetch the broadcast page of the new instance
+	bcast_cleanup();
+	// the new instance listens on the peer cache port again
+	peer_cleanup();
+
+	cmld_live_restart_stopped = true;
+}
+
+/*
+ * Starts the helpers again after a failed live restart, along the same
+ * stages as cmld_init().
+ */
+static void
+cmld_live_restart_resume_helpers(void)
+{
+	IF_FALSE_RETURN(cmld_live_restart_stopped);
+	cmld_live_restart_stopped = false;
+
+	// the services refetch the page as the old one was abandoned
+	if (bcast_init() < 0)
+		WARN("Could not init broadcast page, containers fall back to messages");
+
+	const char *device_path = DEFAULT_CONF_BASE_PATH "/" CMLD_PATH_DEVICE_CONF;
+	device_config_t *device_config = device_config_new(device_path);
+
+	cmld_boot_ctx_t ctx = { .path = cmld_path, .device_config = device_config };
+	boot_t *boot = boot_new();
+
+	boot_add_stage(boot, "scd", cmld_boot_scd_start, cmld_boot_scd_poll, 0, &ctx);
+	if (device_config_get_tpm_enabled(device_config))
+		boot_add_stage(boot, "tpm2d", cmld_boot_tss_start, cmld_boot_tss_poll, 0, &ctx);
+	boot_add_stage(boot, "peer", cmld_boot_peer, NULL, 0, &ctx);
+	boot_add_stage(boot, "zygote", cmld_boot_zygote, NULL, 0, &ctx);
+
+	if (boot_run(boot) < 0)
+		WARN("Not all helpers could be started again");
+	boot_free(boot);
+
+	device_config_free(device_config);
+}
+
+static void
+cmld_live_restart_cb(event_timer_t *timer, UNUSED void *data)
+{
+	event_remove_timer(timer);
+	event_timer_free(timer);
+
+	// a container may have changed its state since the restart was requested
+	if (handoff_check() < 0) {
+		WARN("Live restart aborted");
+		return;
+	}
+
+	audit_log_event(NULL, SSA, CMLD, GENERIC, "live-restart", NULL, 0);
+	audit_flush();
+
+	handoff_exec(cmld_control_cml ? control_get_sock(cmld_control_cml) : -1, lxcfs_get_pid(),
+		     cmld_live_restart_stop_helpers);
+
+	// the containers are still running, thus continue with this instance
+	cmld_live_restart_resume_helpers();
+	WARN("Live restart of cmld failed, continuing with the running instance");
+	audit_log_event(NULL, FSA, CMLD, GENERIC, "live-restart", NULL, 0);
+}
+
+int
+cmld_live_restart(void)
+{
+	IF_TRUE_RETVAL(handoff_check() < 0, -1);
+
+	INFO("Scheduling live restart of cmld");
+	event_timer_t *timer = event_timer_new(0, 1, cmld_live_restart_cb, NULL);
+	event_add_timer(timer);
+	return 0;
+}
+
 void
 cmld_cleanup(void)
 {
-	for (list_t *l = cmld_containers_list; l; l = l->next) {
-		container_t *container = l->data;
-		container_free(container);
+	bcast_cleanup();
+	peer_cleanup();
+
+	if (cmld_config_inotify) {
+		event_remove_inotify(cmld_config_inotify);
+		event_inotify_free(cmld_config_inotify);
 	}
-	list_delete(cmld_containers_list);
+	cmld_config_stamps_free();
+	cmld_containers_index_free();
+	for (ilist_node_t *n; (n = ilist_pop(&cmld_containers_list));)
+		container_free(container_from_list_node(n));
 
 	if (cmld_control_mdm)
 		control_free(cmld_control_mdm);
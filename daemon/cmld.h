@@ -70,6 +70,17 @@ cmld_init(const char *path);
 void
 cmld_cleanup(void);
 
+/**
+ * Restarts cmld in place, e.g. after its binary has been updated, and hands
+ * over the running containers to the new instance, see handoff.h. The restart
+ * is deferred to the main loop.
+ *
+ * @return 0 if the restart is scheduled, -1 if a container is in a state
+ *         which cannot be handed over.
+ */
+int
+cmld_live_restart(void);
+
 /**
  * Reloads all containers from storage path.
  *
@@ -167,15 +178,42 @@ cmld_wipe_device();
 container_t *
 cmld_container_get_by_uuid(const uuid_t *uuid);
 
+/**
+ * Returns the first container with the given name.
+ */
+container_t *
+cmld_container_get_by_name(const char *name);
+
 container_t *
 cmld_container_get_by_token_serial(const char *serial);
 
 container_t *
 cmld_container_get_by_uid(int uid);
 
+/**
+ * Has to be called whenever the uid range of a container changes,
+ * so that cmld_container_get_by_uid() picks up the new range.
+ */
+void
+cmld_containers_uid_changed(void);
+
 int
 cmld_containers_stop(void (*on_all_stopped)(void));
 
+/**
+ * Freezes all containers in the list at once. The freezes are triggered
+ * together and on_all_frozen is called as soon as the kernel reported every
+ * container either frozen or the freeze as failed (e.g. timed out).
+ *
+ * @param containers the list of containers to be frozen
+ * @param on_all_frozen called with success set if all containers are frozen, may be NULL
+ * @param data passed to on_all_frozen
+ * @return 0 if all freezes could be triggered, -1 otherwise
+ */
+int
+cmld_containers_freeze(list_t *containers, void (*on_all_frozen)(bool success, void *data),
+		       void *data);
+
 /* state as parameter? */
 //void
 //cmld_containers_foreach(/*function, params*/);
@@ -229,6 +267,12 @@ cmld_is_internet_active(void);
 bool
 cmld_is_hostedmode_active(void);
 
+/**
+ * Checks if images of new GuestOSes are streamed lazily, see lazyimg.h.
+ */
+bool
+cmld_is_lazy_images_enabled(void);
+
 /**
  * Checks if signed container configs are enabled.
  */
@@ -253,6 +297,13 @@ cmld_get_device_host_dns(void);
 const char *
 cmld_get_c0os(void);
 
+/**
+ * Schedule topping up the pools of spare loop and dm devices
+ * to the size configured in the device config.
+ */
+void
+cmld_device_pool_refill(void);
+
 /**
  * Change the pin of the token associated to a container.
  *
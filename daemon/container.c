@@ -22,12 +22,16 @@
  */
 
 #define _GNU_SOURCE
+
+#define MEM_TAG "container"
+
 #include <sched.h>
 
 #include "container.h"
 
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 #include "common/macro.h"
+#include "common/probe.h"
 #include "common/mem.h"
 #include "common/uuid.h"
 #include "common/list.h"
@@ -38,6 +42,7 @@
 #include "common/dir.h"
 #include "common/proc.h"
 #include "common/ns.h"
+#include "common/protobuf.h"
 
 #include "cmld.h"
 #include "c_user.h"
@@ -51,12 +56,17 @@
 #include "c_run.h"
 #include "c_run.h"
 #include "c_audit.h"
+#include "c_criu.h"
 #include "container_config.h"
 #include "guestos_mgr.h"
 #include "guestos.h"
 #include "hardware.h"
 #include "uevent.h"
 #include "audit.h"
+#include "ksm.h"
+#include "trace.h"
+#include "zygote.h"
+#include "trash.h"
 
 #include <inttypes.h>
 #include <stdint.h>
@@ -68,6 +78,7 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
 #include <pty.h>
 
 #include <selinux/selinux.h>
@@ -103,7 +114,11 @@
 
 #define TOKEN_IS_PAIRED_FILE_NAME "token_is_paired"
 
+/* Directory below the images dir holding reflinked copies of the images */
+#define CONTAINER_SNAPSHOT_DIR "snapshot"
+
 struct container {
+	mem_profile_owner_t *mem_owner; // accounts the allocations on behalf of the container
 	container_state_t state;
 	container_state_t prev_state;
 	uuid_t *uuid;
@@ -122,6 +137,13 @@ struct container {
 	bool allow_autostart;
 	unsigned int ram_limit; /* maximum RAM space the container may use */
 	char *cpus_allowed;
+	unsigned int cpu_priority;
+	container_memory_priority_t memory_priority;
+	container_io_config_t io_config;
+	container_memory_policy_t memory_policy;
+	bool ephemeral; // data volumes are kept in tmpfs
+	char *cpus_placed; /* set by the cpu placement if cpus_allowed is not configured */
+	char *mems_placed;
 
 	container_connectivity_t connectivity;
 
@@ -132,7 +154,10 @@ struct container {
 	list_t *csock_list;  /* List of sockets bound inside the container */
 	const guestos_t *os; /* weak reference */
 	pid_t pid;	     /* PID of the corresponding /init */
+	int pidfd;	     /* pidfd of pid to join its namespaces, -1 if not supported */
 	pid_t pid_early;     /* PID of the corresponding early start child */
+	event_child_t *child;	    /* reaper of pid */
+	event_child_t *child_early; /* reaper of pid_early */
 	int exit_status;     /* if the container's init exited, here we store its exit status */
 
 	char **init_argv; /* command line parameters for init */
@@ -141,6 +166,10 @@ struct container {
 	list_t *observer_list; /* list of function callbacks to be called when the state changes */
 	event_timer_t *stop_timer;  /* timer to handle container stop timeout */
 	event_timer_t *start_timer; /* timer to handle a container start timeout */
+	trace_t *start_trace;	    /* timing of the module hooks of the last start */
+	bool start_tracing;	    /* start_trace is being recorded */
+	bool checkpointing;	    /* the processes are terminated by a checkpoint */
+	bool ns_adopted;	    /* userns and netns of a zygote are joined on start */
 
 	/* TODO maybe we should try to get rid of this state since it is only
 	 * useful for the starting phase and only there to make it easier to pass
@@ -159,6 +188,7 @@ struct container {
 	c_run_t *run;
 	c_audit_t *audit;
 	c_time_t *time;
+	c_criu_t *criu;
 	// Wifi module?
 
 	char *imei;
@@ -183,6 +213,11 @@ struct container {
 	container_token_config_t token;
 
 	bool usb_pin_entry;
+
+	unsigned crypt_flags;
+	unsigned crypt_sector_size;
+
+	ilist_node_t node; // links the container into the container list of cmld
 };
 
 struct container_callback {
@@ -229,9 +264,21 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 		       list_t *net_ifaces, char **allowed_devices, char **assigned_devices,
 		       list_t *vnet_cfg_list, list_t *usbdev_list, char **init_env,
 		       size_t init_env_len, list_t *fifo_list, container_token_type_t ttype,
-		       bool usb_pin_entry)
+		       bool usb_pin_entry, unsigned crypt_flags, unsigned crypt_sector_size,
+		       unsigned int cpu_priority, bool ephemeral,
+		       container_memory_priority_t memory_priority,
+		       const container_io_config_t *io_config,
+		       container_memory_policy_t *memory_policy)
 {
+	mem_profile_owner_t *mem_owner = mem_profile_owner_new(uuid_string(uuid));
+	MEM_PROFILE_OWNER_SCOPE(mem_owner);
+
 	container_t *container = mem_new0(container_t, 1);
+	container->mem_owner = mem_owner;
+
+	// takes over the list of hugetlbfs mounts, released by container_free() on error
+	if (memory_policy)
+		container->memory_policy = *memory_policy;
 
 	container->state = CONTAINER_STATE_STOPPED;
 	container->prev_state = CONTAINER_STATE_STOPPED;
@@ -254,6 +301,7 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 
 	/* initialize pid to a value indicating it is invalid */
 	container->pid = -1;
+	container->pidfd = -1;
 	container->pid_early = -1;
 
 	/* initialize exit_status to 0 */
@@ -382,6 +430,8 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 		goto error;
 	}
 
+	container->criu = c_criu_new(container);
+
 	// construct an argv buffer for execve
 	container->init_argv = guestos_get_init_argv_new(os);
 
@@ -433,6 +483,17 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 
 	container->usb_pin_entry = usb_pin_entry;
 
+	container->crypt_flags = crypt_flags;
+	container->crypt_sector_size = crypt_sector_size;
+
+	container->cpu_priority = cpu_priority;
+	container->memory_priority = memory_priority;
+	if (io_config)
+		container->io_config = *io_config;
+	else
+		container->io_config.weight = CONTAINER_IO_WEIGHT_DEFAULT;
+	container->ephemeral = ephemeral;
+
 	return container;
 
 error:
@@ -594,11 +655,23 @@ container_new(const char *store_path, const uuid_t *existing_uuid, const uint8_t
 
 	bool usb_pin_entry = container_config_get_usb_pin_entry(conf);
 
+	unsigned crypt_flags = container_config_get_crypt_flags(conf);
+	unsigned crypt_sector_size = container_config_get_crypt_sector_size(conf);
+
+	unsigned int cpu_priority = container_config_get_cpu_priority(conf);
+	bool ephemeral = container_config_get_ephemeral(conf);
+	container_memory_priority_t memory_priority = container_config_get_memory_priority(conf);
+	container_io_config_t io_config;
+	container_config_get_io_config(conf, &io_config);
+	container_memory_policy_t memory_policy;
+	container_config_get_memory_policy(conf, &memory_policy);
+
 	container_t *c = container_new_internal(
 		uuid, name, type, ns_usr, ns_net, priv, os, config_filename, images_dir, mnt,
 		ram_limit, cpus_allowed, color, allow_autostart, feature_enabled, dns_server,
 		net_ifaces, allowed_devices, assigned_devices, vnet_cfg_list, usbdev_list, init_env,
-		init_env_len, fifo_list, ttype, usb_pin_entry);
+		init_env_len, fifo_list, ttype, usb_pin_entry, crypt_flags, crypt_sector_size,
+		cpu_priority, ephemeral, memory_priority, &io_config, &memory_policy);
 	if (c)
 		container_config_write(conf);
 
@@ -638,6 +711,9 @@ container_free(container_t *container)
 		mem_free(container->config_filename);
 
 	mem_free(container->cpus_allowed);
+	mem_free(container->cpus_placed);
+	mem_free(container->mems_placed);
+	trace_free(container->start_trace);
 
 	if (container->init_argv) {
 		for (char **arg = container->init_argv; *arg; arg++) {
@@ -658,6 +734,16 @@ container_free(container_t *container)
 	}
 	list_delete(container->feature_enabled_list);
 
+	for (list_t *l = container->memory_policy.hugetlbfs; l; l = l->next) {
+		container_hugetlbfs_t *fs = l->data;
+		mem_free(fs->dir);
+		mem_free(fs);
+	}
+	list_delete(container->memory_policy.hugetlbfs);
+
+	event_child_free(container->child);
+	event_child_free(container->child_early);
+
 	if (container->mnt)
 		mount_free(container->mnt);
 	if (container->mnt_setup)
@@ -675,8 +761,12 @@ container_free(container_t *container)
 		c_run_free(container->run);
 	if (container->time)
 		c_time_free(container->time);
+	if (container->fifo)
+		c_fifo_free(container->fifo);
 	if (container->service)
 		c_service_free(container->service);
+	if (container->criu)
+		c_criu_free(container->criu);
 	if (container->imei)
 		mem_free(container->imei);
 	if (container->mac_address)
@@ -701,6 +791,11 @@ container_free(container_t *container)
 
 	if (container->token.devpath)
 		mem_free(container->token.devpath);
+
+	if (container->pidfd >= 0)
+		close(container->pidfd);
+	// allocations still accounted to the container are reported as leaked
+	mem_profile_owner_free(container->mem_owner);
 	mem_free(container);
 }
 
@@ -711,6 +806,20 @@ container_get_uuid(const container_t *container)
 	return container->uuid;
 }
 
+ilist_node_t *
+container_get_list_node(container_t *container)
+{
+	ASSERT(container);
+	return &container->node;
+}
+
+container_t *
+container_from_list_node(ilist_node_t *node)
+{
+	ASSERT(node);
+	return ilist_entry(node, container_t, node);
+}
+
 const mount_t *
 container_get_mount(const container_t *container)
 {
@@ -764,6 +873,33 @@ container_get_pid(const container_t *container)
 	return container->pid;
 }
 
+int
+container_get_pidfd(const container_t *container)
+{
+	ASSERT(container);
+	return container->pidfd;
+}
+
+/*
+ * The pidfd is opened once per container start, so that the namespaces of the
+ * container are joined without looking up the ns files of the pid each time.
+ */
+static void
+container_set_pid_pidfd(container_t *container, pid_t pid, int pidfd)
+{
+	if (container->pidfd >= 0)
+		close(container->pidfd);
+
+	container->pid = pid;
+	container->pidfd = pidfd;
+}
+
+static void
+container_set_pid(container_t *container, pid_t pid)
+{
+	container_set_pid_pidfd(container, pid, (pid > 0) ? proc_pidfd_open(pid) : -1);
+}
+
 pid_t
 container_get_service_pid(const container_t *container)
 {
@@ -912,12 +1048,18 @@ container_is_encrypted(const container_t *container)
 int
 container_suspend(container_t *container)
 {
+	// a checkpointed container has no processes which could be suspended
+	IF_TRUE_RETVAL(container_get_state(container) == CONTAINER_STATE_CHECKPOINTED, 0);
+
 	return c_service_send_message(container->service, C_SERVICE_MESSAGE_SUSPEND);
 }
 
 int
 container_resume(container_t *container)
 {
+	if (container_get_state(container) == CONTAINER_STATE_CHECKPOINTED)
+		return container_restore(container);
+
 	return c_service_send_message(container->service, C_SERVICE_MESSAGE_RESUME);
 }
 
@@ -971,9 +1113,10 @@ container_audit_notify_complete(const container_t *container)
 }
 
 int
-container_audit_process_ack(const container_t *container, const char *ack)
+container_audit_process_ack(const container_t *container, const char *ack, uint64_t ack_seq,
+			    uint32_t window, uint32_t batch)
 {
-	return audit_process_ack(container, ack);
+	return audit_process_ack(container, ack, ack_seq, window, batch);
 }
 
 void
@@ -998,13 +1141,33 @@ container_audit_get_loginuid(const container_t *container)
  * It also sets container state to rebooting if 'is_rebooting' is set and
  * stopped otherwise.
  */
+static void
+container_remove_timers(container_t *container)
+{
+	/* timer can be removed here, because container is on the transition to the stopped state */
+	if (container->stop_timer) {
+		DEBUG("Remove container stop timer for %s", container_get_description(container));
+		event_remove_timer(container->stop_timer);
+		event_timer_free(container->stop_timer);
+		container->stop_timer = NULL;
+	}
+	if (container->start_timer) {
+		DEBUG("Remove container start timer for %s", container_get_description(container));
+		event_remove_timer(container->start_timer);
+		event_timer_free(container->start_timer);
+		container->start_timer = NULL;
+	}
+}
+
 static void
 container_cleanup(container_t *container, bool is_rebooting)
 {
+	/* the exec helper of c_run is a member of the container cgroups */
+	c_run_cleanup(container->run);
 	c_cgroups_cleanup(container->cgroups);
 	c_service_cleanup(container->service);
-	c_run_cleanup(container->run);
 	c_time_cleanup(container->time);
+	c_fifo_cleanup(container->fifo);
 
 	/*
 	 * maintain some state concerning mounts and corresponding shifted uid
@@ -1016,113 +1179,128 @@ container_cleanup(container_t *container, bool is_rebooting)
 	/* cleanup c_vol last, as it removes partitions */
 	c_vol_cleanup(container->vol, is_rebooting);
 
-	container->pid = -1;
+	/* the kept resources are gone, thus a checkpoint can not be restored anymore */
+	c_criu_cleanup(container->criu);
+	container->checkpointing = false;
+
+	uevent_helper_stop(container);
+	container_set_pid(container, -1);
 	container->pid_early = -1;
 
-	/* timer can be removed here, because container is on the transition to the stopped state */
-	if (container->stop_timer) {
-		DEBUG("Remove container stop timer for %s", container_get_description(container));
-		event_remove_timer(container->stop_timer);
-		event_timer_free(container->stop_timer);
-		container->stop_timer = NULL;
-	}
-	if (container->start_timer) {
-		DEBUG("Remove container start timer for %s", container_get_description(container));
-		event_remove_timer(container->start_timer);
-		event_timer_free(container->start_timer);
-		container->start_timer = NULL;
-	}
+	container_remove_timers(container);
 
 	container_state_t state =
 		is_rebooting ? CONTAINER_STATE_REBOOTING : CONTAINER_STATE_STOPPED;
 	container_set_state(container, state);
 }
 
-void
-container_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+/**
+ * Cleans up after the processes of the container have been terminated by a
+ * checkpoint. In contrast to container_cleanup(), the mounted volumes, the
+ * network namespace, the cgroups, the user id offset and the service socket
+ * are kept, as they are reattached by container_restore().
+ */
+static void
+container_cleanup_checkpointed(container_t *container)
 {
-	ASSERT(data);
+	c_run_cleanup(container->run);
+
+	uevent_helper_stop(container);
+	container_set_pid(container, -1);
+	container->pid_early = -1;
+
+	container_remove_timers(container);
 
+	container_set_state(container, CONTAINER_STATE_CHECKPOINTED);
+}
+
+static void
+container_child_cb(pid_t pid, int status, event_child_t *child, void *data)
+{
 	container_t *container = data;
+	ASSERT(container);
+
+	TRACE("Reaped init with PID %d of container %s", pid, container_get_description(container));
+
+	event_child_free(child);
+	container->child = NULL;
 
-	TRACE("SIGCHLD handler called for container %s with PID %d",
-	      container_get_description(container), container->pid);
+	bool rebooting = false;
+	if (WIFEXITED(status)) {
+		INFO("Container %s terminated (init process exited with status=%d)",
+		     container_get_description(container), WEXITSTATUS(status));
+		container->exit_status = WEXITSTATUS(status);
+	} else if (WIFSIGNALED(status)) {
+		INFO("Container %s killed by signal %d", container_get_description(container),
+		     WTERMSIG(status));
+		/* Since Kernel 3.4 reboot inside pid namspaces
+		 * are signaled by SIGHUP (see manpage REBOOT(2)) */
+		if (WTERMSIG(status) == SIGHUP)
+			rebooting = true;
+	} else {
+		audit_log_event(container_get_uuid(container), FSA, CMLD, CONTAINER_MGMT,
+				"container-observer-error",
+				uuid_string(container_get_uuid(container)), 0);
+		WARN("Could not reap init of container %s", container_get_description(container));
+	}
 
 	/* In the start function the childs init process gets set a process group which has
-	 * the same pgid as its pid. We wait for all processes belonging to our container's
-	 * process group, but only change the containers state to stopped if the init exited */
-	pid_t container_pid = container->pid;
-	pid_t pid = 0;
-	int status = 0;
-	while ((pid = waitpid(-(container_pid), &status, WNOHANG))) {
-		if (pid == container_pid) {
-			bool rebooting = false;
-			if (WIFEXITED(status)) {
-				INFO("Container %s terminated (init process exited with status=%d)",
-				     container_get_description(container), WEXITSTATUS(status));
-				container->exit_status = WEXITSTATUS(status);
-			} else if (WIFSIGNALED(status)) {
-				INFO("Container %s killed by signal %d",
-				     container_get_description(container), WTERMSIG(status));
-				/* Since Kernel 3.4 reboot inside pid namspaces
-				 * are signaled by SIGHUP (see manpage REBOOT(2)) */
-				if (WTERMSIG(status) == SIGHUP)
-					rebooting = true;
-			} else {
-				continue;
-			}
-			/* remove the sigchld callback for this container from the event loop */
-			event_remove_signal(sig);
-			event_signal_free(sig);
-			/* cleanup and set states accordingly to notify observers */
-			container_cleanup(container, rebooting);
-
-			audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
-					rebooting ? "reboot" : "stop",
-					uuid_string(container_get_uuid(container)), 0);
-		} else if (pid == -1) {
-			if (errno == ECHILD) {
-				DEBUG("Process group of container %s terminated completely",
-				      container_get_description(container));
-			} else {
-				audit_log_event(container_get_uuid(container), FSA, CMLD,
-						CONTAINER_MGMT, "container-observer-error",
-						uuid_string(container_get_uuid(container)), 0);
-				WARN_ERRNO("waitpid failed for container %s",
-					   container_get_description(container));
-			}
-			break;
-		} else {
-			DEBUG("Reaped a child with PID %d for container %s", pid,
-			      container_get_description(container));
-		}
+	 * the same pgid as its pid. Reap what is left of our children in this group, but only
+	 * once the init exited, i.e., without checking the group on each SIGCHLD */
+	while ((pid = waitpid(-(container->pid), &status, WNOHANG)) > 0)
+		DEBUG("Reaped a child with PID %d for container %s", pid,
+		      container_get_description(container));
+
+	if (container->checkpointing) {
+		INFO("Container %s checkpointed", container_get_description(container));
+		container_cleanup_checkpointed(container);
+		audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
+				"checkpoint", uuid_string(container_get_uuid(container)), 0);
+		return;
 	}
 
-	TRACE("No more childs to reap. Callback exiting...");
+	/* cleanup and set states accordingly to notify observers */
+	container_cleanup(container, rebooting);
+
+	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT,
+			rebooting ? "reboot" : "stop", uuid_string(container_get_uuid(container)),
+			0);
 }
 
-void
-container_sigchld_early_cb(UNUSED int signum, event_signal_t *sig, void *data)
+/*
+ * Registers the reaper of the container's init, which sets the state and
+ * calls the appropriate cleanup functions if the init dies.
+ */
+static int
+container_add_child(container_t *container)
+{
+	event_child_free(container->child);
+	container->child = event_child_new(container->pid, container_child_cb, container);
+	if (event_add_child(container->child) < 0) {
+		ERROR("Could not register reaper for init of container %s",
+		      container_get_description(container));
+		event_child_free(container->child);
+		container->child = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+container_child_early_cb(pid_t pid, int status, event_child_t *child, void *data)
 {
 	container_t *container = data;
 	ASSERT(container);
 
-	pid_t pid;
-	int status = 0;
+	TRACE("Reaped early container child process: %d", pid);
 
-	TRACE("SIGCHLD handler called for container %s early start child with PID %d",
-	      container_get_description(container), container->pid);
+	event_child_free(child);
+	container->child_early = NULL;
 
-	if ((pid = waitpid(container->pid_early, &status, WNOHANG)) > 0) {
-		TRACE("Reaped early container child process: %d", pid);
-		/* remove the sigchld callback for this early child from the event loop */
-		event_remove_signal(sig);
-		event_signal_free(sig);
-		// cleanup if early child returned with an error
-		if ((WIFEXITED(status) && WEXITSTATUS(status)) || WIFSIGNALED(status)) {
-			container_set_state(container, CONTAINER_STATE_STOPPED);
-			container->pid_early = -1;
-		}
+	// cleanup if early child returned with an error
+	if ((WIFEXITED(status) && WEXITSTATUS(status)) || WIFSIGNALED(status)) {
+		container_set_state(container, CONTAINER_STATE_STOPPED);
+		container->pid_early = -1;
 	}
 }
 
@@ -1150,6 +1328,41 @@ container_close_all_fds()
 	return 0;
 }
 
+/* records a step of the current start, to see where the start time of a container goes */
+static void
+container_start_trace_step(container_t *container, const char *step)
+{
+	IF_FALSE_RETURN(container->start_tracing);
+	trace_step(container->start_trace, step);
+}
+
+#ifndef PR_THP_DISABLE_EXCEPT_ADVISED
+#define PR_THP_DISABLE_EXCEPT_ADVISED (1 << 1)
+#endif
+
+/*
+ * Applies the THP mode of the container to the current process, it is inherited
+ * by its children and kept across execve, i.e., it holds for the whole container.
+ */
+static void
+container_set_thp_mode_current(const container_t *container)
+{
+	switch (container->memory_policy.thp) {
+	case CONTAINER_THP_NEVER:
+		if (prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0) < 0)
+			WARN_ERRNO("Could not disable THP for container %s", container->name);
+		break;
+	case CONTAINER_THP_MADVISE:
+		if (prctl(PR_SET_THP_DISABLE, 1, PR_THP_DISABLE_EXCEPT_ADVISED, 0, 0) < 0)
+			WARN_ERRNO("Could not restrict THP of container %s to advised regions;"
+				   " no kernel support?",
+				   container->name);
+		break;
+	default:
+		break;
+	}
+}
+
 static int
 container_start_child(void *data)
 {
@@ -1187,40 +1400,53 @@ container_start_child(void *data)
 		goto error;
 	}
 
+	container_start_trace_step(container, "child start sync");
+
+	/* needs CAP_SYS_RESOURCE in the initial user namespace */
+	ksm_set_mergeable_current();
+	container_set_thp_mode_current(container);
+
 	if (c_user_start_child(container->user) < 0) {
 		ret = CONTAINER_ERROR_USER;
 		goto error;
 	}
+	container_start_trace_step(container, "c_user_start_child");
 
 	if (c_net_start_child(container->net) < 0) {
 		ret = CONTAINER_ERROR_NET;
 		goto error;
 	}
+	container_start_trace_step(container, "c_net_start_child");
 
 	if (c_cgroups_start_child(container->cgroups) < 0) {
 		ret = CONTAINER_ERROR_CGROUPS;
 		goto error;
 	}
+	container_start_trace_step(container, "c_cgroups_start_child");
 
 	if (c_vol_start_child(container->vol) < 0) {
 		ret = CONTAINER_ERROR_VOL;
 		goto error;
 	}
+	container_start_trace_step(container, "c_vol_start_child");
 
 	if (c_time_start_child(container->time) < 0) {
 		ret = CONTAINER_ERROR_TIME;
 		goto error;
 	}
+	container_start_trace_step(container, "c_time_start_child");
 
 	if (c_service_start_child(container->service) < 0) {
 		ret = CONTAINER_ERROR_SERVICE;
 		goto error;
 	}
+	container_start_trace_step(container, "c_service_start_child");
 
 	if (c_cap_start_child(container) < 0) {
 		//ret = 1; // FIXME
 		goto error;
 	}
+	container_start_trace_step(container, "c_cap_start_child");
 
 	char *root = (container->type == CONTAINER_TYPE_KVM) ? kvm_root : "/";
 	if (chdir(root) < 0) {
@@ -1372,33 +1598,31 @@ container_start_child_early(void *data)
 
 	close(container->sync_sock_parent);
 
+	// cloned children do not run the fork handlers which restore the signal mask
+	event_signal_unblock();
+
 	if (c_audit_start_child_early(container->audit) < 0) {
 		ret = CONTAINER_ERROR_AUDIT;
 		goto error;
 	}
+	container_start_trace_step(container, "c_audit_start_child_early");
 
 	if (c_vol_start_child_early(container->vol) < 0) {
 		ret = CONTAINER_ERROR_VOL;
 		goto error;
 	}
-	void *container_stack = NULL;
-	/* Allocate node stack */
-	if (!(container_stack = alloca(CLONE_STACK_SIZE))) {
-		WARN_ERRNO("Not enough memory for allocating container stack");
-		goto error;
-	}
-	void *container_stack_high = (void *)((const char *)container_stack + CLONE_STACK_SIZE);
+	container_start_trace_step(container, "c_vol_start_child_early");
 	/* Set namespaces for node */
 	/* set some basic and non-configurable namespaces */
 	unsigned long clone_flags = 0;
-	clone_flags |= SIGCHLD | CLONE_PARENT; // sig child to main process
+	clone_flags |= CLONE_PARENT; // sig child to main process
 	clone_flags |= CLONE_NEWUTS | CLONE_NEWNS | CLONE_NEWPID;
 	if (container->ns_ipc)
 		clone_flags |= CLONE_NEWIPC;
 
-	// on reboots of c0 rejoin existing userns and netns
-	if (cmld_containers_get_c0() == container &&
-	    container->prev_state == CONTAINER_STATE_REBOOTING) {
+	// on reboots of c0 and with the namespaces of a zygote rejoin existing userns and netns
+	if (container->ns_adopted || (cmld_containers_get_c0() == container &&
+				      container->prev_state == CONTAINER_STATE_REBOOTING)) {
 		if (c_user_join_userns(container->user) < 0) {
 			ret = CONTAINER_ERROR_USER;
 			goto error;
@@ -1414,14 +1638,46 @@ container_start_child_early(void *data)
 			clone_flags |= CLONE_NEWNET;
 	}
 
-	container->pid = clone(container_start_child, container_stack_high, clone_flags, container);
+	/*
+	 * Create the init directly in its cgroup and with a pidfd, which is passed
+	 * to cmld together with the pid. Without clone3(), the init is moved to
+	 * its cgroup by c_cgroups_start_pre_exec() later.
+	 */
+	int cgroup_fd = c_cgroups_get_clone_fd(container->cgroups);
+	bool cloned_into = cgroup_fd >= 0;
+	int pidfd = -1;
+
+	container->pid = proc_clone3(clone_flags, cgroup_fd, &pidfd);
+	if (container->pid < 0 && cloned_into && errno != ENOSYS) {
+		WARN_ERRNO("Could not create container init in its cgroup, moving it later");
+		cloned_into = false;
+		container->pid = proc_clone3(clone_flags, -1, &pidfd);
+	}
+	if (container->pid < 0 && errno == ENOSYS) {
+		void *container_stack = NULL;
+		/* Allocate node stack */
+		if (!(container_stack = alloca(CLONE_STACK_SIZE))) {
+			WARN_ERRNO("Not enough memory for allocating container stack");
+			goto error;
+		}
+		void *container_stack_high =
+			(void *)((const char *)container_stack + CLONE_STACK_SIZE);
+		cloned_into = false;
+		container->pid = clone(container_start_child, container_stack_high,
+				       clone_flags | SIGCHLD, container);
+	} else if (container->pid == 0) {
+		_exit(container_start_child(container));
+	}
 	if (container->pid < 0) {
 		ERROR_ERRNO("Double clone container failed");
 		goto error;
 	}
 
-	char *msg_pid = mem_printf("%d", container->pid);
-	if (write(container->sync_sock_child, msg_pid, strlen(msg_pid)) < 0) {
+	char *msg_pid = mem_printf("%d%s", container->pid, cloned_into ? " cgroup" : "");
+	ssize_t sent = (pidfd < 0) ? write(container->sync_sock_child, msg_pid, strlen(msg_pid)) :
+				     sock_unix_send_fd(container->sync_sock_child, msg_pid,
+						       strlen(msg_pid), pidfd);
+	if (sent < 0) {
 		ERROR_ERRNO("write pid '%s' to sync socket failed", msg_pid);
 		goto error;
 	}
@@ -1496,8 +1752,9 @@ container_start_post_clone_cb(int fd, unsigned events, event_io_t *io, void *dat
 
 	if (msg == CONTAINER_START_SYNC_MSG_ERROR) {
 		WARN("Received error message from child process");
-		return; // the child exits on its own and we cleanup in the sigchld handler
+		return; // the child exits on its own and we cleanup in the child reaper
 	}
+	container_start_trace_step(container, "child sync");
 
 	/********************************************************/
 	/* on success call all c_<module>_start_pre_exec hooks */
@@ -1505,21 +1762,25 @@ container_start_post_clone_cb(int fd, unsigned events, event_io_t *io, void *dat
 		WARN("c_time_start_pre_exec failed");
 		goto error_pre_exec;
 	}
+	container_start_trace_step(container, "c_time_start_pre_exec");
 
 	if (c_cgroups_start_pre_exec(container->cgroups) < 0) {
 		WARN("c_cgroups_start_pre_exec failed");
 		goto error_pre_exec;
 	}
+	container_start_trace_step(container, "c_cgroups_start_pre_exec");
 	// during reboot c_vol state is not cleared, thus skip pre_exec here
 	if (c_vol_start_pre_exec(container->vol) < 0) {
 		WARN("c_vol_start_pre_exec failed");
 		goto error_pre_exec;
 	}
+	container_start_trace_step(container, "c_vol_start_pre_exec");
 
 	if (c_service_start_pre_exec(container->service) < 0) {
 		WARN("c_service_start_pre_exec failed");
 		goto error_pre_exec;
 	}
+	container_start_trace_step(container, "c_service_start_pre_exec");
 
 	// skip setup of start timer and maintain SETUP state if in SETUP mode
 	if (container_get_state(container) != CONTAINER_STATE_SETUP) {
@@ -1544,6 +1805,11 @@ container_start_post_clone_cb(int fd, unsigned events, event_io_t *io, void *dat
 		goto error;
 	}
 
+	/* uevents are still injected by a short-lived child without the helper */
+	if (uevent_helper_start(container) < 0)
+		WARN("Could not start uevent helper for container %s",
+		     container_get_name(container));
+
 	event_remove_io(io);
 	event_io_free(io);
 	close(fd);
@@ -1607,14 +1873,19 @@ container_start_post_clone_early_cb(int fd, unsigned events, event_io_t *io, voi
 
 	DEBUG("Received event from child process %u", events);
 
+	// pick up the audit records logged while mounting the images
+	audit_import_spooled(container_get_uuid(container));
+	cmld_device_pool_refill();
+
 	if (events == EVENT_IO_EXCEPT) {
 		ERROR("Received exception from child process");
 		goto error_pre_clone;
 	}
 
-	// receive success or error message from started child
+	// receive success or error message from started child, the pid comes with a pidfd
+	int pidfd;
 	char *pid_msg = mem_alloc0(34);
-	if (read(container->sync_sock_parent, pid_msg, 33) <= 0) {
+	if (sock_unix_recv_fd(container->sync_sock_parent, pid_msg, 33, &pidfd) <= 0) {
 		WARN_ERRNO("Could not read from sync socket");
 		mem_free(pid_msg);
 		goto error_pre_clone;
@@ -1622,6 +1893,8 @@ container_start_post_clone_early_cb(int fd, unsigned events, event_io_t *io, voi
 
 	if (pid_msg[0] == CONTAINER_START_SYNC_MSG_ERROR) {
 		WARN("Early child died with error!");
+		if (pidfd >= 0)
+			close(pidfd);
 		mem_free(pid_msg);
 		goto error_pre_clone;
 	}
@@ -1631,8 +1904,13 @@ container_start_post_clone_early_cb(int fd, unsigned events, event_io_t *io, voi
 	event_io_free(io);
 
 	DEBUG("Received pid message from child %s", pid_msg);
-	container->pid = atoi(pid_msg);
+	if (pidfd >= 0)
+		container_set_pid_pidfd(container, atoi(pid_msg), pidfd);
+	else
+		container_set_pid(container, atoi(pid_msg));
+	c_cgroups_set_cloned_into(container->cgroups, strstr(pid_msg, " cgroup") != NULL);
 	mem_free(pid_msg);
+	container_start_trace_step(container, "child early sync");
 
 	/*********************************************************/
 	/* REGISTER SOCKET TO RECEIVE STATUS MESSAGES FROM CHILD */
@@ -1640,11 +1918,11 @@ container_start_post_clone_early_cb(int fd, unsigned events, event_io_t *io, voi
 		event_io_new(fd, EVENT_IO_READ, &container_start_post_clone_cb, container);
 	event_add_io(sync_sock_parent_event);
 
-	/* register SIGCHILD handler which sets the state and
+	/* register reaper which sets the state and
 	 * calls the appropriate cleanup functions if the child
 	 * dies */
-	event_signal_t *sig = event_signal_new(SIGCHLD, container_sigchld_cb, container);
-	event_add_signal(sig);
+	if (container_add_child(container))
+		goto error_post_clone;
 
 	/*********************************************************/
 	/* POST CLONE HOOKS */
@@ -1654,21 +1932,25 @@ container_start_post_clone_early_cb(int fd, unsigned events, event_io_t *io, voi
 		ret = CONTAINER_ERROR_CGROUPS;
 		goto error_post_clone;
 	}
+	container_start_trace_step(container, "c_cgroups_start_post_clone");
 
 	if (c_net_start_post_clone(container->net)) {
 		ret = CONTAINER_ERROR_NET;
 		goto error_post_clone;
 	}
+	container_start_trace_step(container, "c_net_start_post_clone");
 
 	if (c_user_start_post_clone(container->user)) {
 		ret = CONTAINER_ERROR_USER;
 		goto error_post_clone;
 	}
+	container_start_trace_step(container, "c_user_start_post_clone");
 
 	if (c_fifo_start_post_clone(container->fifo)) {
 		ret = CONTAINER_ERROR_FIFO;
 		goto error_post_clone;
 	}
+	container_start_trace_step(container, "c_fifo_start_post_clone");
 
 	/*********************************************************/
 	/* NOTIFY CHILD TO START */
@@ -1701,6 +1983,7 @@ int
 container_start(container_t *container) //, const char *key)
 {
 	ASSERT(container);
+	MEM_PROFILE_OWNER_SCOPE(container->mem_owner);
 
 	if ((container_get_state(container) != CONTAINER_STATE_STOPPED) &&
 	    (container_get_state(container) != CONTAINER_STATE_REBOOTING)) {
@@ -1711,7 +1994,13 @@ container_start(container_t *container) //, const char *key)
 
 	int ret = 0;
 
+	/* the trace is shared with the children, which record their hooks as well */
+	trace_free(container->start_trace);
+	container->start_trace = trace_new(container_get_description(container));
+	container->start_tracing = true;
+
 	container_set_state(container, CONTAINER_STATE_STARTING);
+	container_start_trace_step(container, "starting observers");
 
 	/*********************************************************/
 	/* PRE CLONE HOOKS */
@@ -1720,21 +2009,47 @@ container_start(container_t *container) //, const char *key)
 		ret = CONTAINER_ERROR_USER;
 		goto error_pre_clone;
 	}
+	container_start_trace_step(container, "c_user_start_pre_clone");
 
 	if (c_cgroups_start_pre_clone(container->cgroups) < 0) {
 		ret = CONTAINER_ERROR_CGROUPS;
 		goto error_pre_clone;
 	}
+	container_start_trace_step(container, "c_cgroups_start_pre_clone");
 
 	if (c_net_start_pre_clone(container->net) < 0) {
 		ret = CONTAINER_ERROR_NET;
 		goto error_pre_clone;
 	}
+	container_start_trace_step(container, "c_net_start_pre_clone");
 
 	if (c_service_start_pre_clone(container->service) < 0) {
 		ret = CONTAINER_ERROR_SERVICE;
 		goto error_pre_clone;
 	}
+	container_start_trace_step(container, "c_service_start_pre_clone");
+
+	if (c_vol_start_pre_clone(container->vol) < 0) {
+		ret = CONTAINER_ERROR_VOL;
+		goto error_pre_clone;
+	}
+	container_start_trace_step(container, "c_vol_start_pre_clone");
+
+	/* adopt the namespaces of a zygote instead of creating them on clone */
+	container->ns_adopted = false;
+	if (container->ns_usr && container->ns_net && cmld_containers_get_c0() != container) {
+		pid_t zygote = zygote_take();
+		if (zygote > 0) {
+			container->ns_adopted = !c_user_adopt_userns(container->user, zygote) &&
+						!c_net_adopt_netns(container->net, zygote);
+			zygote_release(zygote);
+			if (!container->ns_adopted) {
+				ret = CONTAINER_ERROR;
+				goto error_pre_clone;
+			}
+			container_start_trace_step(container, "zygote adoption");
+		}
+	}
 
 	// Wifi module?
 
@@ -1778,7 +2093,7 @@ container_start(container_t *container) //, const char *key)
 		WARN_ERRNO("Clone container failed");
 		goto error_pre_clone;
 	}
-	container->pid = container_pid;
+	container_set_pid(container, container_pid);
 
 	/* close the childs end of the sync sockets */
 	close(container->sync_sock_child);
@@ -1790,9 +2105,17 @@ container_start(container_t *container) //, const char *key)
 			     &container_start_post_clone_early_cb, container);
 	event_add_io(sync_sock_parent_event);
 
-	// handler for early start child process which dies after double fork
-	event_signal_t *sig = event_signal_new(SIGCHLD, container_sigchld_early_cb, container);
-	event_add_signal(sig);
+	// reaper for early start child process which dies after double fork
+	container->pid_early = container_pid;
+	event_child_free(container->child_early);
+	container->child_early =
+		event_child_new(container->pid_early, container_child_early_cb, container);
+	if (event_add_child(container->child_early) < 0) {
+		WARN("Could not register reaper for early start child of container %s",
+		     container_get_description(container));
+		event_child_free(container->child_early);
+		container->child_early = NULL;
+	}
 
 	if (c_audit_start_post_clone_early(container->audit)) {
 		ERROR("c_audit_start_post_clone");
@@ -1817,10 +2140,22 @@ container_kill(container_t *container)
 		return;
 	}
 
+	/* there are no processes to be killed, just release the kept resources */
+	if (container_get_state(container) == CONTAINER_STATE_CHECKPOINTED) {
+		container_stop(container);
+		return;
+	}
+
 	// TODO kill container (possibly register callback and wait non-blocking)
 	DEBUG("Killing container %s with pid: %d", container_get_description(container),
 	      container_get_pid(container));
 
+	/* also catches processes which are frozen or outside of the pid namespace */
+	c_cgroups_kill(container->cgroups);
+
+	/* the pid is not known yet in the early start phase, never signal all processes */
+	IF_TRUE_RETURN(container_get_pid(container) <= 0);
+
 	if (kill(container_get_pid(container), SIGKILL)) {
 		ERROR_ERRNO("Failed to kill container %s", container_get_description(container));
 	}
@@ -1850,9 +2185,18 @@ int
 container_stop(container_t *container)
 {
 	ASSERT(container);
+	MEM_PROFILE_OWNER_SCOPE(container->mem_owner);
 
 	int ret = 0;
 
+	/* there are no processes to be stopped, just release the kept resources */
+	if (container_get_state(container) == CONTAINER_STATE_CHECKPOINTED) {
+		container_cleanup(container, false);
+		audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT, "stop",
+				uuid_string(container_get_uuid(container)), 0);
+		return 0;
+	}
+
 	/* register timer with callback doing the kill, if stop fails */
 	event_timer_t *container_stop_timer =
 		event_timer_new(CONTAINER_STOP_TIMEOUT, 1, &container_stop_timeout_cb, container);
@@ -1967,6 +2311,213 @@ container_freeze(container_t *container)
 	return 0;
 }
 
+int
+container_checkpoint(container_t *container)
+{
+	ASSERT(container);
+
+	if (container_get_state(container) != CONTAINER_STATE_RUNNING) {
+		WARN("Container %s not running, not checkpointing it",
+		     container_get_description(container));
+		return -1;
+	}
+	if (container_is_encrypted(container)) {
+		WARN("Not checkpointing encrypted container %s, its memory would be stored in plain",
+		     container_get_description(container));
+		return -1;
+	}
+
+	/* processes joined by c_run are not part of the process tree of init */
+	c_run_cleanup(container->run);
+	/* the TrustmeService connects again to the kept socket after the restore */
+	c_service_disconnect(container->service);
+
+	container->checkpointing = true;
+	if (c_criu_dump(container->criu, container->pid, c_net_get_ns_path(container->net)) < 0) {
+		container->checkpointing = false;
+		audit_log_event(container_get_uuid(container), FSA, CMLD, CONTAINER_MGMT,
+				"checkpoint", uuid_string(container_get_uuid(container)), 0);
+		return -1;
+	}
+
+	// SIGCHLD of the init killed by criu moves the container to CHECKPOINTED
+	return 0;
+}
+
+int
+container_restore(container_t *container)
+{
+	ASSERT(container);
+
+	if (container_get_state(container) != CONTAINER_STATE_CHECKPOINTED) {
+		WARN("Container %s not checkpointed, nothing to restore",
+		     container_get_description(container));
+		return -1;
+	}
+
+	pid_t pid = c_criu_restore(container->criu, container_get_rootdir(container),
+				   c_net_get_ns_path(container->net));
+	if (pid < 0) {
+		audit_log_event(container_get_uuid(container), FSA, CMLD, CONTAINER_MGMT,
+				"restore", uuid_string(container_get_uuid(container)), 0);
+		/* release the kept resources, the container has to be started again */
+		container_cleanup(container, false);
+		return -1;
+	}
+	container_set_pid(container, pid);
+
+	if (container_add_child(container)) {
+		/* the restored container can not be observed, thus stop it */
+		kill(pid, SIGKILL);
+		container_cleanup(container, false);
+		return -1;
+	}
+
+	audit_log_event(container_get_uuid(container), SSA, CMLD, CONTAINER_MGMT, "restore",
+			uuid_string(container_get_uuid(container)), 0);
+	container_set_state(container, CONTAINER_STATE_RUNNING);
+
+	return 0;
+}
+
+int
+container_handoff_prepare(container_t *container, container_handoff_t *handoff)
+{
+	ASSERT(container);
+	ASSERT(handoff);
+	IF_TRUE_RETVAL(container->pid <= 0, -1);
+
+	memset(handoff, 0, sizeof(*handoff));
+	handoff->state = container->state;
+	handoff->pid = container->pid;
+	handoff->pidfd = container->pidfd;
+	handoff->uptime = container_get_uptime(container);
+
+	c_service_get_socks(container->service, &handoff->service_sock, &handoff->service_conn,
+			    &handoff->service_bcast_sock);
+	handoff->uid_offset = c_user_get_offset(container->user);
+	handoff->net_offsets_len = c_net_get_offsets(container->net, &handoff->net_offsets);
+	c_cgroups_get_devices_fds(container->cgroups, &handoff->devices_map_fd,
+				  &handoff->devices_prog_fd);
+
+	handoff->socks_len = list_length(container->csock_list);
+	handoff->sock_paths = mem_new0(char *, handoff->socks_len + 1);
+	handoff->sock_fds = mem_new0(int, handoff->socks_len + 1);
+	size_t i = 0;
+	for (list_t *l = container->csock_list; l; l = l->next, i++) {
+		container_sock_t *cs = l->data;
+		handoff->sock_paths[i] = cs->path;
+		handoff->sock_fds[i] = cs->sockfd;
+	}
+
+	// its pipe is not handed over, the new instance starts a helper of its own
+	uevent_helper_stop(container);
+	return 0;
+}
+
+void
+container_handoff_free(container_handoff_t *handoff)
+{
+	IF_NULL_RETURN(handoff);
+
+	mem_free(handoff->net_offsets);
+	mem_free(handoff->sock_paths);
+	mem_free(handoff->sock_fds);
+}
+
+int
+container_adopt(container_t *container, const container_handoff_t *handoff)
+{
+	ASSERT(container);
+	ASSERT(handoff);
+
+	if (container->state != CONTAINER_STATE_STOPPED) {
+		WARN("Container %s is not stopped, cannot adopt it",
+		     container_get_description(container));
+		return -1;
+	}
+
+	if (handoff->pidfd >= 0)
+		container_set_pid_pidfd(container, handoff->pid, handoff->pidfd);
+	else
+		container_set_pid(container, handoff->pid);
+
+	if (container_add_child(container)) {
+		// leave the handed over pidfd to the caller
+		if (handoff->pidfd < 0 && container->pidfd >= 0)
+			close(container->pidfd);
+		container->pid = -1;
+		container->pidfd = -1;
+		return -1;
+	}
+
+	for (size_t i = 0; i < handoff->socks_len; i++) {
+		container_sock_t *cs = mem_new0(container_sock_t, 1);
+		cs->sockfd = handoff->sock_fds[i];
+		cs->path = mem_strdup(handoff->sock_paths[i]);
+		container->csock_list = list_append(container->csock_list, cs);
+	}
+
+	// set first, thus the container is killed and stopped by its reaper if the modules fail
+	container->prev_state = CONTAINER_STATE_STOPPED;
+	container->state = handoff->state;
+
+	if (c_user_adopt(container->user, handoff->uid_offset) < 0) {
+		ERROR("Could not adopt user namespace of container %s",
+		      container_get_description(container));
+		goto error;
+	}
+	if (c_vol_adopt(container->vol) < 0) {
+		ERROR("Could not adopt volumes of container %s",
+		      container_get_description(container));
+		goto error;
+	}
+	if (c_cgroups_adopt(container->cgroups, handoff->devices_map_fd,
+			    handoff->devices_prog_fd) < 0) {
+		ERROR("Could not adopt cgroups of container %s",
+		      container_get_description(container));
+		goto error;
+	}
+	if (c_net_adopt(container->net, handoff->net_offsets, handoff->net_offsets_len) < 0) {
+		ERROR("Could not adopt network of container %s",
+		      container_get_description(container));
+		goto error;
+	}
+	if (c_service_adopt(container->service, handoff->service_sock, handoff->service_conn,
+			    handoff->service_bcast_sock) < 0) {
+		ERROR("Could not adopt TrustmeService connection of container %s",
+		      container_get_description(container));
+		goto error;
+	}
+	c_time_adopt(container->time, handoff->uptime);
+
+	if (uevent_helper_start(container) < 0)
+		WARN("Could not start uevent helper for container %s",
+		     container_get_description(container));
+
+	INFO("Adopted container %s with pid %d", container_get_description(container),
+	     container->pid);
+	return 0;
+
+error:
+	container_kill(container);
+	return -1;
+}
+
+int
+container_get_bound_socket(const container_t *container, const char *path)
+{
+	ASSERT(container);
+	ASSERT(path);
+
+	for (list_t *l = container->csock_list; l; l = l->next) {
+		container_sock_t *cs = l->data;
+		if (!strcmp(cs->path, path))
+			return cs->sockfd;
+	}
+	return -1;
+}
+
 int
 container_unfreeze(container_t *container)
 {
@@ -1991,44 +2542,169 @@ container_deny_audio(container_t *container)
 	return c_cgroups_devices_deny_audio(container->cgroups);
 }
 
-int
-container_snapshot(container_t *container)
-{
-	ASSERT(container);
-	// TODO implement
-	return 0;
-}
-
 static int
 container_wipe_image_cb(const char *path, const char *name, UNUSED void *data)
 {
 	ASSERT(data);
 	container_t *container = data;
-	/* Only do the rest of the callback if the file name ends with .img */
 	int len = strlen(name);
+	/* volumes in the thin pool are represented by a marker file */
+	if (len >= 5 && !strcmp(name + len - 5, ".thin")) {
+		char *marker = mem_printf("%s/%s", path, name);
+		DEBUG("Deleting thin volume of container %s: %s",
+		      container_get_description(container), marker);
+		if (c_vol_thin_delete(marker) < 0)
+			ERROR("Could not delete thin volume %s", marker);
+		mem_free(marker);
+	}
+	/* directory-backed volumes are deleted in the background like images */
+	if (len >= 4 && !strcmp(name + len - 4, ".dir")) {
+		char *vol_dir = mem_printf("%s/%s", path, name);
+		DEBUG("Deleting volume dir of container %s: %s",
+		      container_get_description(container), vol_dir);
+		c_vol_dir_release(vol_dir);
+		if (trash_add(vol_dir, NULL, NULL) < 0)
+			ERROR("Could not delete volume dir %s", vol_dir);
+		mem_free(vol_dir);
+	}
+	/* Only do the rest of the callback if the file name ends with .img */
 	if (len >= 4 && !strcmp(name + len - 4, ".img")) {
 		char *image_path = mem_printf("%s/%s", path, name);
 		DEBUG("Deleting image of container %s: %s", container_get_description(container),
 		      image_path);
-		if (unlink(image_path) == -1) {
-			ERROR_ERRNO("Could not delete image %s", image_path);
-		}
+		// large images are deleted in the background
+		if (trash_add(image_path, NULL, NULL) < 0)
+			ERROR("Could not delete image %s", image_path);
 		mem_free(image_path);
 	}
 	return 0;
 }
 
+/*
+ * Deletes a snapshot dir below the images dir, including the thin volumes
+ * its marker files refer to.
+ */
+static int
+container_snapshot_delete(container_t *container, const char *dir_name)
+{
+	int ret = 0;
+	char *dir = mem_printf("%s/%s", container->images_dir, dir_name);
+	if (file_is_dir(dir)) {
+		dir_foreach(dir, &container_wipe_image_cb, container);
+		ret = dir_delete_folder(container->images_dir, dir_name);
+	}
+	mem_free(dir);
+	return ret;
+}
+
+static int
+container_snapshot_image_cb(const char *path, const char *name, void *data)
+{
+	ASSERT(data);
+	const char *snapshot_dir = data;
+
+	int len = strlen(name);
+	if (len >= 4 && !strcmp(name + len - 4, ".dir")) {
+		// a copy of the files would block the event loop, there is nothing to reflink
+		ERROR("Cannot snapshot directory-backed volume %s/%s", path, name);
+		return -1;
+	}
+	bool thin = len >= 5 && !strcmp(name + len - 5, ".thin");
+	if (!thin && (len < 4 || strcmp(name + len - 4, ".img")))
+		return 0;
+
+	int ret = 0;
+	char *image_path = mem_printf("%s/%s", path, name);
+	char *snapshot_path = mem_printf("%s/%s", snapshot_dir, name);
+	if (thin) {
+		if (c_vol_thin_snapshot(image_path, snapshot_path) < 0) {
+			ERROR("Could not snapshot thin volume %s", image_path);
+			ret = -1;
+		}
+	} else if (file_clone(image_path, snapshot_path) < 0) {
+		ERROR_ERRNO("Could not clone image %s to %s", image_path, snapshot_path);
+		ret = -1;
+	}
+	mem_free(snapshot_path);
+	mem_free(image_path);
+	return ret;
+}
+
+int
+container_snapshot(container_t *container)
+{
+	ASSERT(container);
+
+	if (container_get_state(container) != CONTAINER_STATE_STOPPED) {
+		ERROR("Container %s must be stopped for a consistent snapshot",
+		      container_get_description(container));
+		return -1;
+	}
+
+	int ret = -1;
+	char *tmp_dir = mem_printf("%s/%s", container->images_dir, CONTAINER_SNAPSHOT_DIR ".new");
+	char *snapshot_dir = mem_printf("%s/%s", container->images_dir, CONTAINER_SNAPSHOT_DIR);
+
+	container_snapshot_delete(container, CONTAINER_SNAPSHOT_DIR ".new");
+	if (mkdir(tmp_dir, 0700) < 0) {
+		ERROR_ERRNO("Could not create snapshot dir %s", tmp_dir);
+		goto out;
+	}
+
+	// images are only reflinked, a full copy would block the event loop for ages
+	if (dir_foreach(container->images_dir, &container_snapshot_image_cb, tmp_dir) < 0) {
+		ERROR("Could not snapshot images of container %s",
+		      container_get_description(container));
+		container_snapshot_delete(container, CONTAINER_SNAPSHOT_DIR ".new");
+		goto out;
+	}
+
+	// replace the previous snapshot only once the new one is complete
+	if (container_snapshot_delete(container, CONTAINER_SNAPSHOT_DIR) < 0) {
+		ERROR("Could not remove previous snapshot of container %s",
+		      container_get_description(container));
+		container_snapshot_delete(container, CONTAINER_SNAPSHOT_DIR ".new");
+		goto out;
+	}
+	if (rename(tmp_dir, snapshot_dir) < 0) {
+		ERROR_ERRNO("Could not move snapshot %s to %s", tmp_dir, snapshot_dir);
+		goto out;
+	}
+
+	INFO("Created snapshot of container %s in %s", container_get_description(container),
+	     snapshot_dir);
+	ret = 0;
+out:
+	mem_free(snapshot_dir);
+	mem_free(tmp_dir);
+	return ret;
+}
+
+static void
+container_wipe_done_cb(UNUSED int ret, void *data)
+{
+	char *description = data;
+	INFO("Finished deleting the images of container %s", description);
+	mem_free(description);
+}
+
 int
 container_wipe_finish(container_t *container)
 {
 	ASSERT(container);
 
+	/* remove the snapshot, it shares the data of the images */
+	if (container_snapshot_delete(container, CONTAINER_SNAPSHOT_DIR) < 0)
+		WARN("Could not remove snapshot of container %s",
+		     container_get_description(container));
+
 	/* remove all images of the container */
 	if (dir_foreach(container->images_dir, &container_wipe_image_cb, container) < 0) {
 		WARN("Could not open %s images path for wiping container",
 		     container_get_description(container));
 		return -1;
 	}
+	trash_sync(&container_wipe_done_cb, mem_strdup(container_get_description(container)));
 	return 0;
 }
 
@@ -2105,12 +2781,24 @@ container_destroy(container_t *container)
 		if (0 != unlink(file_name_uid)) {
 			ERROR_ERRNO("Can't delete .uid file!");
 		}
-	mem_free(file_name_created);
+	mem_free(file_name_uid);
+
+	char *file_name_net = mem_printf("%s.net", container_get_images_dir(container));
+	if (file_exists(file_name_net))
+		if (0 != unlink(file_name_net)) {
+			ERROR_ERRNO("Can't delete .net file!");
+		}
+	mem_free(file_name_net);
 
 	char *path = container_token_paired_file_new(container);
 	unlink(path);
 	mem_free(path);
 
+	const char *config_file = container_get_config_filename(container);
+	char *cache_file = mem_printf("%s" PROTOBUF_CACHEFILE_SUFFIX, config_file);
+	unlink(cache_file);
+	mem_free(cache_file);
+
 	if ((ret = unlink(container_get_config_filename(container))))
 		ERROR_ERRNO("Can't delete config file!");
 	return ret;
@@ -2119,6 +2807,8 @@ container_destroy(container_t *container)
 static void
 container_notify_observers(container_t *container)
 {
+	MEM_PROFILE_OWNER_SCOPE(container->mem_owner);
+
 	for (list_t *l = container->observer_list; l; l = l->next) {
 		container_callback_t *ccb = l->data;
 		ccb->todo = true;
@@ -2164,6 +2854,23 @@ container_set_state(container_t *container, container_state_t state)
 
 	DEBUG("Setting container state: %d", state);
 	container->state = state;
+	PROBE3(container_set_state, container_get_name(container), container->prev_state, state);
+
+	if (state == CONTAINER_STATE_BOOTING) {
+		container_start_trace_step(container, "booting observers");
+	} else if (state == CONTAINER_STATE_RUNNING && container->start_tracing) {
+		container_start_trace_step(container, "guest boot");
+		container->start_tracing = false;
+		if (container->start_trace)
+			INFO("Container %s started in %ld ms", container_get_description(container),
+			     trace_get_elapsed_ms(container->start_trace));
+	} else if (state == CONTAINER_STATE_STOPPED) {
+		container->start_tracing = false;
+	}
+
+	// the pages of the images read during the boot are still resident
+	if (state == CONTAINER_STATE_RUNNING && container->prev_state == CONTAINER_STATE_BOOTING)
+		c_vol_start_post_boot(container->vol);
 
 	container_notify_observers(container);
 }
@@ -2261,6 +2968,125 @@ container_get_cpus_allowed(const container_t *container)
 	return container->cpus_allowed;
 }
 
+unsigned int
+container_get_cpu_priority(const container_t *container)
+{
+	ASSERT(container);
+
+	return container->cpu_priority;
+}
+
+container_memory_priority_t
+container_get_memory_priority(const container_t *container)
+{
+	ASSERT(container);
+
+	if (container->memory_priority != CONTAINER_MEMORY_PRIORITY_NONE && container->screen_on)
+		return CONTAINER_MEMORY_PRIORITY_FOREGROUND;
+	return container->memory_priority;
+}
+
+bool
+container_is_ephemeral(const container_t *container)
+{
+	ASSERT(container);
+
+	return container->ephemeral;
+}
+
+static bool
+container_cpuset_equals(const char *a, const char *b)
+{
+	return (a && b) ? !strcmp(a, b) : a == b;
+}
+
+int
+container_set_cpuset(container_t *container, const char *cpus, const char *mems)
+{
+	ASSERT(container);
+
+	if (container_cpuset_equals(cpus, container->cpus_placed) &&
+	    container_cpuset_equals(mems, container->mems_placed))
+		return 0;
+
+	mem_free(container->cpus_placed);
+	mem_free(container->mems_placed);
+	container->cpus_placed = cpus ? mem_strdup(cpus) : NULL;
+	container->mems_placed = mems ? mem_strdup(mems) : NULL;
+
+	/* Note that the c_cgroups submodule gets the cpuset from its container reference */
+	return c_cgroups_set_cpuset(container->cgroups);
+}
+
+int
+container_set_cpu_sched(container_t *container, unsigned int weight_percent,
+			unsigned int uclamp_min_percent, unsigned int max_percent)
+{
+	ASSERT(container);
+
+	return c_cgroups_set_cpu_sched(container->cgroups, weight_percent, uclamp_min_percent,
+				       max_percent);
+}
+
+const container_io_config_t *
+container_get_io_config(const container_t *container)
+{
+	ASSERT(container);
+	return &container->io_config;
+}
+
+const container_memory_policy_t *
+container_get_memory_policy(const container_t *container)
+{
+	ASSERT(container);
+	return &container->memory_policy;
+}
+
+int
+container_set_io_config(container_t *container, const container_io_config_t *io_config)
+{
+	ASSERT(container);
+	ASSERT(io_config);
+
+	container->io_config = *io_config;
+
+	IF_TRUE_RETVAL(container->pid <= 0, 0);
+	/* Note that the c_cgroups submodule gets the io config from its container reference */
+	return c_cgroups_set_io(container->cgroups);
+}
+
+size_t
+container_get_block_devs(const container_t *container, dev_t **devs)
+{
+	ASSERT(container);
+	return c_vol_get_block_devs(container->vol, devs);
+}
+
+const char *
+container_get_cpus_placed(const container_t *container)
+{
+	ASSERT(container);
+
+	return container->cpus_placed;
+}
+
+const char *
+container_get_mems_placed(const container_t *container)
+{
+	ASSERT(container);
+
+	return container->mems_placed;
+}
+
+char *
+container_get_start_trace_new(const container_t *container)
+{
+	ASSERT(container);
+
+	IF_NULL_RETVAL(container->start_trace, NULL);
+	return trace_to_json_new(container->start_trace);
+}
+
 int
 container_set_ram_limit(container_t *container, unsigned int ram_limit)
 {
@@ -2313,6 +3139,10 @@ container_set_screen_on(container_t *container, bool screen_on)
 
 	container->screen_on = screen_on;
 
+	/* let the kernel reclaim from the containers in the background first */
+	if (container->pid > 0)
+		c_cgroups_set_memory_priority(container->cgroups);
+
 	container_notify_observers(container);
 }
 
@@ -2489,6 +3319,13 @@ container_get_first_ip_new(container_t *container)
 	return c_net_get_ip_new(container->net);
 }
 
+char *
+container_get_dns_forwarder_new(container_t *container)
+{
+	ASSERT(container);
+	return c_net_get_dns_forwarder_new(container->net);
+}
+
 char *
 container_get_first_subnet_new(container_t *container)
 {
@@ -2620,6 +3457,11 @@ container_vnet_cfg_new(const char *if_name, const char *rootns_name, const uint8
 	memcpy(vnet_cfg->vnet_mac, mac, 6);
 	vnet_cfg->rootns_name = rootns_name ? mem_strdup(rootns_name) : NULL;
 	vnet_cfg->configure = configure;
+	vnet_cfg->fastpath = false;
+	vnet_cfg->type = CONTAINER_VNET_VETH;
+	vnet_cfg->parent = NULL;
+	vnet_cfg->vf = 0;
+	vnet_cfg->bridge = NULL;
 	return vnet_cfg;
 }
 
@@ -2631,6 +3473,10 @@ container_vnet_cfg_free(container_vnet_cfg_t *vnet_cfg)
 		mem_free(vnet_cfg->vnet_name);
 	if (vnet_cfg->rootns_name)
 		mem_free(vnet_cfg->rootns_name);
+	if (vnet_cfg->parent)
+		mem_free(vnet_cfg->parent);
+	if (vnet_cfg->bridge)
+		mem_free(vnet_cfg->bridge);
 	mem_free(vnet_cfg);
 }
 
@@ -2640,6 +3486,28 @@ container_get_vnet_runtime_cfg_new(container_t *container)
 	return c_net_get_interface_mapping_new(container->net);
 }
 
+list_t *
+container_get_net_stats_new(container_t *container)
+{
+	ASSERT(container);
+	return c_net_get_stats_new(container->net);
+}
+
+int
+container_get_usage(const container_t *container, container_usage_t *usage)
+{
+	ASSERT(container);
+	return c_cgroups_get_usage(container->cgroups, usage);
+}
+
+void
+container_net_stats_free(container_net_stats_t *stats)
+{
+	IF_NULL_RETURN(stats);
+	mem_free(stats->vnet_name);
+	mem_free(stats);
+}
+
 int
 container_update_config(container_t *container, uint8_t *buf, size_t buf_len, uint8_t *sig_buf,
 			size_t sig_len, uint8_t *cert_buf, size_t cert_len)
@@ -2809,3 +3677,17 @@ container_get_usb_pin_entry(const container_t *container)
 	ASSERT(container);
 	return container->usb_pin_entry;
 }
+
+unsigned
+container_get_crypt_flags(const container_t *container)
+{
+	ASSERT(container);
+	return container->crypt_flags;
+}
+
+unsigned
+container_get_crypt_sector_size(const container_t *container)
+{
+	ASSERT(container);
+	return container->crypt_sector_size;
+}
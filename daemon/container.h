@@ -39,6 +39,7 @@
 
 #include "common/uuid.h"
 #include "common/list.h"
+#include "common/ilist.h"
 
 #include "guestos.h"
 
@@ -51,6 +52,8 @@
  */
 #define CSERVICE_TARGET "/sbin/cservice"
 
+#define CONTAINER_IO_WEIGHT_DEFAULT 100
+
 /**
  * Opaque container type.
  * (only used as pointer outside of the container module)
@@ -84,6 +87,66 @@ typedef enum {
 	CONTAINER_TOKEN_TYPE_USB,
 } container_token_type_t;
 
+/**
+ * Memory priority tiers, from the most to the least protected.
+ * Must be kept in sync with container.proto!
+ */
+typedef enum {
+	CONTAINER_MEMORY_PRIORITY_NONE = 0,
+	CONTAINER_MEMORY_PRIORITY_FOREGROUND,
+	CONTAINER_MEMORY_PRIORITY_BACKGROUND,
+	CONTAINER_MEMORY_PRIORITY_BEST_EFFORT,
+} container_memory_priority_t;
+
+/**
+ * Block io weight and limits of a container, limits of 0 mean unlimited.
+ */
+typedef struct container_io_config {
+	unsigned int weight; ///< 1-10000, default 100
+	uint64_t read_bps;
+	uint64_t write_bps;
+	unsigned int read_iops;
+	unsigned int write_iops;
+} container_io_config_t;
+
+/**
+ * Transparent huge page modes of the processes of a container.
+ * Must be kept in sync with container.proto!
+ */
+typedef enum {
+	CONTAINER_THP_DEFAULT = 0,
+	CONTAINER_THP_NEVER,
+	CONTAINER_THP_MADVISE,
+} container_thp_mode_t;
+
+/**
+ * A hugetlbfs mounted to the container on start.
+ */
+typedef struct container_hugetlbfs {
+	char *dir;	   ///< mount point in the container
+	uint64_t min_size; ///< bytes reserved in the huge page pool on mount
+	uint64_t size;	   ///< maximum bytes, 0 for unlimited
+} container_hugetlbfs_t;
+
+/**
+ * Huge page usage of a container.
+ */
+typedef struct container_memory_policy {
+	container_thp_mode_t thp;
+	uint64_t hugetlb_limit; ///< bytes of huge pages of the default size, 0 for unlimited
+	list_t *hugetlbfs;	///< list of container_hugetlbfs_t
+} container_memory_policy_t;
+
+/**
+ * Attachment type of a container network interface.
+ */
+typedef enum container_vnet_type {
+	CONTAINER_VNET_VETH = 1,
+	CONTAINER_VNET_MACVLAN,
+	CONTAINER_VNET_IPVLAN,
+	CONTAINER_VNET_SRIOV_VF
+} container_vnet_type_t;
+
 /**
  * Structure to define the configuration for a virtual network
  * interface in a container. It defines the name and if cmld
@@ -94,8 +157,39 @@ typedef struct container_vnet_cfg {
 	char *rootns_name;
 	uint8_t vnet_mac[6];
 	bool configure;
+	bool fastpath; // offload forwarded connections to a flowtable
+	container_vnet_type_t type;
+	char *parent; // parent interface, or physical function of a virtual function
+	int vf;	      // index of the virtual function
+	char *bridge; // shared bridge of a veth, NULL for a routed veth
 } container_vnet_cfg_t;
 
+/**
+ * Packet and byte counters of a virtual network interface of a container,
+ * as seen from inside the container.
+ */
+typedef struct container_net_stats {
+	char *vnet_name;
+	bool fastpath; // connections are offloaded to a flowtable
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+} container_net_stats_t;
+
+/**
+ * Resource usage of the cgroup of a running container. Cpu time and io bytes
+ * are counted since the start of the container.
+ */
+typedef struct container_usage {
+	uint64_t cpu_usage_us;
+	uint64_t memory_bytes;
+	uint64_t memory_anon_bytes;
+	uint64_t memory_file_bytes; // page cache
+	uint64_t io_read_bytes;
+	uint64_t io_write_bytes;
+} container_usage_t;
+
 /**
  * Structure to define the configuration of the token associated with the container.
  */
@@ -128,9 +222,33 @@ typedef enum {
 	CONTAINER_STATE_ZOMBIE,
 	CONTAINER_STATE_SHUTTING_DOWN,
 	CONTAINER_STATE_SETUP,
-	CONTAINER_STATE_REBOOTING
+	CONTAINER_STATE_REBOOTING,
+	CONTAINER_STATE_CHECKPOINTED
 } container_state_t;
 
+/**
+ * Runtime state of a running container, which is handed over to a new cmld
+ * instance on a live restart, see handoff.h. The file descriptors stay open
+ * across the exec of cmld.
+ */
+typedef struct container_handoff {
+	container_state_t state;
+	pid_t pid;
+	int pidfd;
+	time_t uptime;
+	int service_sock; /* listening socket of the TrustmeService, -1 if none */
+	int service_conn; /* connection of the TrustmeService, -1 if not connected */
+	int service_bcast_sock; /* listening socket for the broadcast page, -1 if none */
+	int uid_offset;	  /* offset of the uid range, -1 without user namespace */
+	int *net_offsets; /* offsets of the network interfaces */
+	size_t net_offsets_len;
+	int devices_map_fd; /* device policy with cgroups v2, -1 otherwise */
+	int devices_prog_fd;
+	char **sock_paths; /* sockets bound into the container */
+	int *sock_fds;
+	size_t socks_len;
+} container_handoff_t;
+
 /**
  * Represents an error that happened during the start of a container.
  */
@@ -192,7 +310,11 @@ container_new_internal(const uuid_t *uuid, const char *name, container_type_t ty
 		       list_t *net_ifaces, char **allowed_devices, char **assigned_devices,
 		       list_t *vnet_cfg_list, list_t *usbdev_list, char **init_env,
 		       size_t init_env_len, list_t *fifo_list, container_token_type_t ttype,
-		       bool usb_pin_entry);
+		       bool usb_pin_entry, unsigned crypt_flags, unsigned crypt_sector_size,
+		       unsigned int cpu_priority, bool ephemeral,
+		       container_memory_priority_t memory_priority,
+		       const container_io_config_t *io_config,
+		       container_memory_policy_t *memory_policy);
 
 /**
  * Creates a new container container object. There are three different cases
@@ -251,6 +373,19 @@ container_get_name(const container_t *container);
 const uuid_t *
 container_get_uuid(const container_t *container);
 
+/**
+ * Returns the node which links the container into the container list of cmld.
+ * A container can be part of one such list at a time.
+ */
+ilist_node_t *
+container_get_list_node(container_t *container);
+
+/**
+ * Returns the container which embeds the given list node.
+ */
+container_t *
+container_from_list_node(ilist_node_t *node);
+
 /**
  * Return the partition table of the container.
  */
@@ -288,6 +423,13 @@ container_get_description(const container_t *container);
 pid_t
 container_get_pid(const container_t *container);
 
+/**
+ * Returns the pidfd of the container's init process, which is opened once at
+ * container start, or -1 if pidfds are not supported by the kernel.
+ */
+int
+container_get_pidfd(const container_t *container);
+
 /**
  * Returns the PID of the container's trustme service process
  * or -1 if the PID could not be determined.
@@ -395,7 +537,7 @@ int
 container_suspend(container_t *container);
 
 /**
- * Resumes the container.
+ * Resumes the container. A checkpointed container is restored.
  */
 int
 container_resume(container_t *container);
@@ -441,7 +583,8 @@ int
 container_stop(container_t *container);
 
 /**
- * Forcefully terminate the execution of a container.
+ * Forcefully terminate the execution of a container. With the unified
+ * cgroup hierarchy, all processes of its cgroup are killed at once.
  */
 void
 container_kill(container_t *container);
@@ -515,6 +658,67 @@ container_freeze(container_t *container);
 int
 container_unfreeze(container_t *container);
 
+/**
+ * Checkpoints a running container using CRIU. Its processes are dumped to
+ * flash and terminated, while volumes, network namespace and cgroups are kept.
+ * The container passes over to CONTAINER_STATE_CHECKPOINTED as soon as its
+ * init process terminated. Encrypted containers are not checkpointed, since
+ * their memory would be stored unencrypted.
+ *
+ * @return 0 if ok, negative values indicate errors.
+ */
+int
+container_checkpoint(container_t *container);
+
+/**
+ * Restores the processes of a checkpointed container and sets it running
+ * again. If the restore fails, the kept resources are released and the
+ * container is stopped.
+ *
+ * @return 0 if ok, negative values indicate errors.
+ */
+int
+container_restore(container_t *container);
+
+/**
+ * Collects the runtime state of a running container to hand it over to a new
+ * cmld instance and stops its uevent helper, which is restarted by the new
+ * instance. The arrays of handoff are newly allocated and have to be freed by
+ * container_handoff_free(), the file descriptors stay owned by the container.
+ *
+ * @return 0 if ok, negative values indicate errors.
+ */
+int
+container_handoff_prepare(container_t *container, container_handoff_t *handoff);
+
+/**
+ * Frees the arrays of a handoff filled by container_handoff_prepare().
+ */
+void
+container_handoff_free(container_handoff_t *handoff);
+
+/**
+ * Takes over a container which has been started by a previous cmld instance
+ * and is still running, given its handed over runtime state. The container
+ * must be stopped from the view of this instance, i.e. just loaded from its
+ * config. Its init is reaped again, the modules take over their resources
+ * and the container passes over to the handed over state. If the modules
+ * fail, the container is killed and cleaned up by its reaper.
+ *
+ * @return 0 if ok, negative values indicate errors. If the container did not
+ *         take over its init, i.e. container_get_pid() returns no pid, the
+ *         handed over process and file descriptors are left to the caller.
+ */
+int
+container_adopt(container_t *container, const container_handoff_t *handoff);
+
+/**
+ * Returns the socket bound into the container at path by
+ * container_bind_socket_before_start(), -1 if there is none.
+ */
+int
+container_get_bound_socket(const container_t *container, const char *path);
+
 int
 container_allow_audio(container_t *container);
 
@@ -522,7 +726,14 @@ int
 container_deny_audio(container_t *container);
 
 /**
- * TODO Document 'snapshot' function.
+ * Creates a snapshot of the images of a stopped container in the "snapshot"
+ * directory below its images dir, replacing a previous snapshot. The images are
+ * reflinked, volumes in the thin pool are snapshotted by the pool, thus the
+ * snapshot is created instantly and shares its storage with the images until
+ * they are modified. File systems without reflink support (e.g., ext4) are not
+ * supported, the snapshot fails on them.
+ *
+ * @return 0 on success, -1 otherwise
  */
 int
 container_snapshot(container_t *container);
@@ -590,6 +801,79 @@ container_set_ram_limit(container_t *container, unsigned int ram_limit);
 const char *
 container_get_cpus_allowed(const container_t *container);
 
+unsigned int
+container_get_cpu_priority(const container_t *container);
+
+/**
+ * Returns the memory tier the container is currently in, i.e. its configured
+ * tier or CONTAINER_MEMORY_PRIORITY_FOREGROUND while it is in the foreground.
+ */
+container_memory_priority_t
+container_get_memory_priority(const container_t *container);
+
+/**
+ * Returns true if the empty and upper overlay volumes of the container are
+ * kept in tmpfs instead of images, i.e., they do not survive a restart.
+ */
+bool
+container_is_ephemeral(const container_t *container);
+
+/**
+ * Sets the cpus and memory nodes chosen by the cpu placement for a container
+ * without statically assigned cpus and applies them to its cgroup if running.
+ * NULL removes the restriction.
+ */
+int
+container_set_cpuset(container_t *container, const char *cpus, const char *mems);
+
+/**
+ * Sets the cpu weight, minimum utilization clamp and cpu bandwidth limit of a
+ * running container, see c_cgroups_set_cpu_sched().
+ */
+int
+container_set_cpu_sched(container_t *container, unsigned int weight_percent,
+			unsigned int uclamp_min_percent, unsigned int max_percent);
+
+/**
+ * Returns the block io weight and limits of the container.
+ */
+const container_io_config_t *
+container_get_io_config(const container_t *container);
+
+/**
+ * Returns the transparent and hugetlb huge page policy of the container.
+ */
+const container_memory_policy_t *
+container_get_memory_policy(const container_t *container);
+
+/**
+ * Changes the block io weight and limits of the container and applies them
+ * if it is running. They are not persisted in the container config.
+ */
+int
+container_set_io_config(container_t *container, const container_io_config_t *io_config);
+
+/**
+ * Returns the block devices backing the images of a running container,
+ * see c_vol_get_block_devs().
+ */
+size_t
+container_get_block_devs(const container_t *container, dev_t **devs);
+
+const char *
+container_get_cpus_placed(const container_t *container);
+
+const char *
+container_get_mems_placed(const container_t *container);
+
+/**
+ * Returns the timing of the module hooks of the last start of the container
+ * as newly allocated JSON in the Chrome trace event format.
+ * @return the trace or NULL if the container has not been started yet
+ */
+char *
+container_get_start_trace_new(const container_t *container);
+
 /***************************
  * Submodule Interfaces    *
  **************************/
@@ -715,6 +999,13 @@ container_has_userns(const container_t *container);
 char *
 container_get_first_ip_new(container_t *container);
 
+/**
+ * Returns the address of the caching dns forwarder of cmld, which resolves
+ * for the container, or NULL if it is not running.
+ */
+char *
+container_get_dns_forwarder_new(container_t *container);
+
 /**
  * Returns the subnet of the first interface set inside the container
  */
@@ -776,6 +1067,26 @@ container_vnet_cfg_free(container_vnet_cfg_t *vnet_cfg);
 list_t *
 container_get_vnet_runtime_cfg_new(container_t *container);
 
+/**
+ * Returns the counters of the virtual network interfaces of the running
+ * container as list of container_net_stats_t elements.
+ */
+list_t *
+container_get_net_stats_new(container_t *container);
+
+/**
+ * Samples the cpu, memory and io usage of the running container.
+ * @return 0 on success, -1 if the container is not running
+ */
+int
+container_get_usage(const container_t *container, container_usage_t *usage);
+
+/**
+ * Free all memory used by a container_net_stats_t data structure
+ */
+void
+container_net_stats_free(container_net_stats_t *stats);
+
 /**
  * This function updates the containers config on storage with the provided
  * protobuf config in buf. A reload is triggerd if the container is stopped
@@ -937,6 +1248,18 @@ container_exec_cap_systime(const container_t *container, char *const *argv);
 bool
 container_get_usb_pin_entry(const container_t *container);
 
+/**
+ * Returns the CRYPTFS_* flags used to set up the container's encrypted volumes
+ */
+unsigned
+container_get_crypt_flags(const container_t *container);
+
+/**
+ * Returns the dm-crypt sector size for newly created encrypted volumes of the container
+ */
+unsigned
+container_get_crypt_sector_size(const container_t *container);
+
 /**
  * Send audit record to container
  */
@@ -981,10 +1304,11 @@ int
 container_audit_record_send(const container_t *container, const uint8_t *buf, uint32_t buflen);
 
 /**
- * Process audit record ACK received from a container
+ * Process audit record ACK received from a container, see audit_process_ack()
  */
 int
-container_audit_process_ack(const container_t *container, const char *ack);
+container_audit_process_ack(const container_t *container, const char *ack, uint64_t ack_seq,
+			    uint32_t window, uint32_t batch);
 
 int
 container_audit_notify_complete(const container_t *container);
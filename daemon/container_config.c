@@ -23,6 +23,8 @@
 
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
+#define MEM_TAG "container"
+
 #include "container_config.h"
 
 #include "container.pb-c.h"
@@ -32,6 +34,7 @@
 #include "common/file.h"
 #include "common/list.h"
 #include "common/protobuf.h"
+#include "common/cryptfs.h"
 
 #include <stdint.h>
 #include <inttypes.h>
@@ -43,6 +46,7 @@
 #include "network.h"
 #include "uevent.h"
 #include "smartcard.h"
+#include "hash.h"
 
 struct container_config {
 	char *file;
@@ -95,6 +99,64 @@ container_config_proto_to_token_type(ContainerTokenType type)
 	}
 }
 
+/**
+ * The usual identity map between two corresponding C and protobuf enums.
+ */
+static container_memory_priority_t
+container_config_proto_to_memory_priority(ContainerMemoryPriority prio)
+{
+	switch (prio) {
+	case CONTAINER_MEMORY_PRIORITY__MEMORY_PRIORITY_NONE:
+		return CONTAINER_MEMORY_PRIORITY_NONE;
+	case CONTAINER_MEMORY_PRIORITY__MEMORY_PRIORITY_FOREGROUND:
+		return CONTAINER_MEMORY_PRIORITY_FOREGROUND;
+	case CONTAINER_MEMORY_PRIORITY__MEMORY_PRIORITY_BACKGROUND:
+		return CONTAINER_MEMORY_PRIORITY_BACKGROUND;
+	case CONTAINER_MEMORY_PRIORITY__MEMORY_PRIORITY_BEST_EFFORT:
+		return CONTAINER_MEMORY_PRIORITY_BEST_EFFORT;
+	default:
+		FATAL("Unhandled value for ContainerMemoryPriority: %d", prio);
+	}
+}
+
+/**
+ * The usual identity map between two corresponding C and protobuf enums.
+ */
+static container_thp_mode_t
+container_config_proto_to_thp_mode(ContainerThpMode thp)
+{
+	switch (thp) {
+	case CONTAINER_THP_MODE__THP_DEFAULT:
+		return CONTAINER_THP_DEFAULT;
+	case CONTAINER_THP_MODE__THP_NEVER:
+		return CONTAINER_THP_NEVER;
+	case CONTAINER_THP_MODE__THP_MADVISE:
+		return CONTAINER_THP_MADVISE;
+	default:
+		FATAL("Unhandled value for ContainerThpMode: %d", thp);
+	}
+}
+
+/**
+ * The usual identity map between two corresponding C and protobuf enums.
+ */
+static container_vnet_type_t
+container_config_proto_to_vnet_type(ContainerVnetConfig__Type type)
+{
+	switch (type) {
+	case CONTAINER_VNET_CONFIG__TYPE__VETH:
+		return CONTAINER_VNET_VETH;
+	case CONTAINER_VNET_CONFIG__TYPE__MACVLAN:
+		return CONTAINER_VNET_MACVLAN;
+	case CONTAINER_VNET_CONFIG__TYPE__IPVLAN:
+		return CONTAINER_VNET_IPVLAN;
+	case CONTAINER_VNET_CONFIG__TYPE__SRIOV_VF:
+		return CONTAINER_VNET_SRIOV_VF;
+	default:
+		FATAL("Unhandled value for ContainerVnetConfig__Type: %d", type);
+	}
+}
+
 static uevent_usbdev_type_t
 container_config_proto_to_usb_type(ContainerUsbType type)
 {
@@ -152,67 +214,71 @@ container_config_storage_size(container_config_t *config)
 /******************************************************************************/
 
 static bool
-container_config_verify(const char *prefix, uint8_t *conf_buf, size_t conf_len, uint8_t *sig_buf,
-			size_t sig_len, uint8_t *cert_buf, size_t cert_len)
+container_config_verify(const char *prefix, const char *digest, const uint8_t *conf_buf,
+			size_t conf_len, const uint8_t *sig_buf, size_t sig_len,
+			const uint8_t *cert_buf, size_t cert_len)
 {
 	ASSERT(conf_buf);
 	bool ret = false;
+	smartcard_crypto_verify_result_t verify_result;
 
-	uint8_t *sig = NULL;
-	uint8_t *cert = NULL;
+	file_map_t *sig_map = NULL;
+	file_map_t *cert_map = NULL;
+	const uint8_t *sig = sig_buf;
+	const uint8_t *cert = cert_buf;
 
-	off_t sig_size = sig_len;
-	off_t cert_size = cert_len;
+	size_t sig_size = sig_len;
+	size_t cert_size = cert_len;
 
 	if (!cmld_uses_signed_configs()) {
 		TRACE("Signed configuration is disabled, skipping!");
 		return true;
 	}
 
-	if (sig_buf && cert_buf) {
-		TRACE("Copy buffers for sig and cert!");
-		sig = mem_new0(uint8_t, sig_len);
-		memcpy(sig, sig_buf, sig_len);
-		cert = mem_new0(uint8_t, cert_len);
-		memcpy(cert, cert_buf, cert_len);
-	} else {
-		TRACE("Read sig and cert from files!");
+	// config files have possibly been verified in a batch already
+	if (digest && smartcard_crypto_verify_take_prefetched(digest, C_CONFIG_VERIFY_HASH_ALGO,
+							      &verify_result)) {
+		ret = (verify_result == VERIFY_GOOD) ? true : false;
+		goto out;
+	}
+
+	if (!sig_buf || !cert_buf) {
+		TRACE("Map sig and cert from files!");
 		char *sig_file = mem_printf("%s.sig", prefix);
 		char *cert_file = mem_printf("%s.cert", prefix);
-		sig_size = file_size(sig_file);
-		if (sig_size > 0) {
-			sig = mem_alloc(sig_size);
-			if (-1 == file_read(sig_file, (char *)sig, sig_size)) {
-				ERROR("Failed to read sig file '%s'!", sig_file);
-				mem_free(sig);
-				sig = NULL;
-			}
+		if ((sig_map = file_map_ro(sig_file))) {
+			sig = file_map_data(sig_map);
+			sig_size = file_map_size(sig_map);
+		} else {
+			ERROR("Failed to read sig file '%s'!", sig_file);
 		}
-		cert_size = file_size(cert_file);
-		if (cert_size > 0) {
-			cert = mem_alloc(cert_size);
-			if (-1 == file_read(cert_file, (char *)cert, cert_size)) {
-				ERROR("Failed to read cert file '%s'!", cert_file);
-				mem_free(cert);
-				cert = NULL;
-			}
+		if ((cert_map = file_map_ro(cert_file))) {
+			cert = file_map_data(cert_map);
+			cert_size = file_map_size(cert_map);
+		} else {
+			ERROR("Failed to read cert file '%s'!", cert_file);
 		}
 		mem_free(sig_file);
 		mem_free(cert_file);
 	}
 
 	// check cert and signature buffers
-	IF_TRUE_GOTO(cert_size <= 0 || sig_size <= 0 || cert == NULL || sig == NULL, out);
+	IF_TRUE_GOTO(cert_size == 0 || sig_size == 0 || cert == NULL || sig == NULL, out);
 
-	smartcard_crypto_verify_result_t verify_result = smartcard_crypto_verify_buf_block(
-		conf_buf, conf_len, sig, sig_size, cert, cert_size, C_CONFIG_VERIFY_HASH_ALGO);
+	// the buffers are only read during verification
+	verify_result = smartcard_crypto_verify_buf_block((unsigned char *)conf_buf, conf_len,
+							  (unsigned char *)sig, sig_size,
+							  (unsigned char *)cert, cert_size,
+							  C_CONFIG_VERIFY_HASH_ALGO);
 
 	ret = (verify_result == VERIFY_GOOD) ? true : false;
 out:
 	INFO("Verify Result of target with prefix '%s': %s", prefix, ret ? "GOOD" : "UNSIGNED");
 
-	mem_free(sig);
-	mem_free(cert);
+	if (sig_map)
+		file_map_unref(sig_map);
+	if (cert_map)
+		file_map_unref(cert_map);
 	return ret;
 }
 
@@ -221,8 +287,12 @@ container_config_new(const char *file, const uint8_t *buf, size_t len, uint8_t *
 		     size_t sig_len, uint8_t *cert_buf, size_t cert_len)
 {
 	ContainerConfig *ccfg = NULL;
-	uint8_t *buf_internal = NULL;
+	file_map_t *conf_map = NULL;
+	const uint8_t *buf_internal = buf;
 	container_config_t *config = NULL;
+	char *digest = NULL;
+	char *cache_file = NULL;
+	bool cacheable = false;
 
 	ASSERT(file);
 	off_t conf_len = len;
@@ -236,27 +306,45 @@ container_config_new(const char *file, const uint8_t *buf, size_t len, uint8_t *
 
 	// check if config comes from buffer or needs to be read from file
 	if (buf == NULL) {
+		/*
+		 * Configs loaded from file are verified on every load, but only parsed
+		 * once: they are cached in binary form, bound to the digest of config,
+		 * signature and cert and authenticated by the key of the hash caches.
+		 */
+		char *sig_file = mem_printf("%s.sig", prefix);
+		char *cert_file = mem_printf("%s.cert", prefix);
+		const char *const files[] = { file, sig_file, cert_file };
+
+		cache_file = mem_printf("%s" PROTOBUF_CACHEFILE_SUFFIX, file);
+		digest = hash_files_digest_new(3, files);
+		cacheable = digest && hash_cache_has_key();
+		mem_free(sig_file);
+		mem_free(cert_file);
+
 		DEBUG("Loading container config from file \"%s\".", file);
-		conf_len = file_size(file);
-		if (conf_len > 0) {
-			buf_internal = mem_alloc(conf_len);
-			if (-1 == file_read(file, (char *)buf_internal, conf_len)) {
-				mem_free(buf_internal);
-				buf_internal = NULL;
-			}
+		if ((conf_map = file_map_ro(file))) {
+			buf_internal = file_map_data(conf_map);
+			conf_len = file_map_size(conf_map);
 		}
+		IF_NULL_GOTO(buf_internal, out);
 	} else {
 		DEBUG("Loading container config from buf storing to file \"%s\".", file);
-		buf_internal = mem_new0(uint8_t, conf_len);
-		memcpy(buf_internal, buf, conf_len);
 	}
 
-	if (!container_config_verify(prefix, buf_internal, conf_len, sig_buf, sig_len, cert_buf,
-				     cert_len)) {
+	if (!container_config_verify(prefix, digest, buf_internal, conf_len, sig_buf, sig_len,
+				     cert_buf, cert_len)) {
 		ERROR("Failed verify signature of container config for file \"%s\".", file);
 		goto out;
 	}
 
+	if (cacheable)
+		ccfg = (ContainerConfig *)protobuf_message_new_from_cachefile(
+			cache_file, &container_config__descriptor, digest, hash_cache_mac);
+	if (ccfg) {
+		DEBUG("Loaded container config from cache \"%s\".", cache_file);
+		goto done;
+	}
+
 	ccfg = (ContainerConfig *)protobuf_message_new_from_buf(buf_internal, conf_len,
 								&container_config__descriptor);
 	if (!ccfg) {
@@ -279,15 +367,78 @@ container_config_new(const char *file, const uint8_t *buf, size_t len, uint8_t *
 		}
 	}
 
+	if (cacheable && protobuf_message_write_to_cachefile(cache_file, (ProtobufCMessage *)ccfg,
+							      digest, hash_cache_mac) < 0)
+		WARN("Could not cache container config \"%s\".", file);
+
+done:
 	config = mem_new0(container_config_t, 1);
 	config->file = mem_strdup(file);
 	config->cfg = ccfg;
 out:
-	mem_free(buf_internal);
+	mem_free(digest);
+	mem_free(cache_file);
+	if (conf_map)
+		file_map_unref(conf_map);
 	mem_free(prefix);
 	return config;
 }
 
+void
+container_config_verify_prefetch(size_t n, const char *const files[])
+{
+	IF_FALSE_RETURN(cmld_uses_signed_configs());
+
+	const char **conf_files = mem_new0(const char *, n);
+	char **sig_files = mem_new0(char *, n);
+	char **cert_files = mem_new0(char *, n);
+	char **digests = mem_new0(char *, n);
+	size_t m = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t file_len = strlen(files[i]);
+		if (file_len < 5 || strcmp(files[i] + file_len - 5, ".conf"))
+			continue;
+
+		char *prefix = mem_strndup(files[i], file_len - 5);
+		char *sig_file = mem_printf("%s.sig", prefix);
+		char *cert_file = mem_printf("%s.cert", prefix);
+		const char *const triple[] = { files[i], sig_file, cert_file };
+		char *digest = NULL;
+		mem_free(prefix);
+
+		if (file_exists(sig_file) && file_exists(cert_file))
+			digest = hash_files_digest_new(3, triple);
+
+		if (!digest) {
+			mem_free(sig_file);
+			mem_free(cert_file);
+			continue;
+		}
+
+		conf_files[m] = files[i];
+		sig_files[m] = sig_file;
+		cert_files[m] = cert_file;
+		digests[m] = digest;
+		m++;
+	}
+
+	smartcard_crypto_verify_files_prefetch(m, conf_files, (const char *const *)sig_files,
+					       (const char *const *)cert_files,
+					       (const char *const *)digests,
+					       C_CONFIG_VERIFY_HASH_ALGO);
+
+	for (size_t i = 0; i < m; i++) {
+		mem_free(sig_files[i]);
+		mem_free(cert_files[i]);
+		mem_free(digests[i]);
+	}
+	mem_free(conf_files);
+	mem_free(sig_files);
+	mem_free(cert_files);
+	mem_free(digests);
+}
+
 void
 container_config_free(container_config_t *config)
 {
@@ -705,6 +856,18 @@ container_config_get_vnet_cfg_list_new(const container_config_t *config)
 		container_vnet_cfg_t *if_cfg =
 			container_vnet_cfg_new(config->cfg->vnet_configs[i]->if_name, NULL, mac,
 					       config->cfg->vnet_configs[i]->configure);
+		if_cfg->fastpath = config->cfg->vnet_configs[i]->fastpath;
+		if_cfg->type = container_config_proto_to_vnet_type(config->cfg->vnet_configs[i]->type);
+		if (config->cfg->vnet_configs[i]->parent)
+			if_cfg->parent = mem_strdup(config->cfg->vnet_configs[i]->parent);
+		if_cfg->vf = config->cfg->vnet_configs[i]->vf;
+		if (config->cfg->vnet_configs[i]->bridge)
+			if_cfg->bridge = mem_strdup(config->cfg->vnet_configs[i]->bridge);
+		if (if_cfg->type != CONTAINER_VNET_VETH && !if_cfg->parent) {
+			WARN("Missing parent of vnet %s, skipping", if_cfg->vnet_name);
+			container_vnet_cfg_free(if_cfg);
+			continue;
+		}
 		if_cfg_list = list_append(if_cfg_list, if_cfg);
 	}
 
@@ -793,6 +956,33 @@ container_config_get_usb_pin_entry(const container_config_t *config)
 	return config->cfg->usb_pin_entry;
 }
 
+unsigned
+container_config_get_crypt_flags(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	const ContainerCryptConfig *crypt = config->cfg->crypt_config;
+	IF_NULL_RETVAL(crypt, 0);
+
+	return (crypt->no_read_workqueue ? CRYPTFS_NO_READ_WORKQUEUE : 0) |
+	       (crypt->no_write_workqueue ? CRYPTFS_NO_WRITE_WORKQUEUE : 0) |
+	       (crypt->same_cpu_crypt ? CRYPTFS_SAME_CPU_CRYPT : 0) |
+	       (crypt->submit_from_crypt_cpus ? CRYPTFS_SUBMIT_FROM_CRYPT_CPUS : 0) |
+	       (crypt->lazy_init ? CRYPTFS_LAZY_INIT : 0) |
+	       (crypt->inline_crypt ? CRYPTFS_INLINE_CRYPT : 0);
+}
+
+unsigned
+container_config_get_crypt_sector_size(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	IF_NULL_RETVAL(config->cfg->crypt_config, 512);
+	return config->cfg->crypt_config->sector_size;
+}
+
 const char *
 container_config_get_cpus_allowed(const container_config_t *config)
 {
@@ -800,3 +990,73 @@ container_config_get_cpus_allowed(const container_config_t *config)
 	ASSERT(config->cfg);
 	return config->cfg->assign_cpus;
 }
+
+unsigned int
+container_config_get_cpu_priority(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->cpu_priority;
+}
+
+bool
+container_config_get_ephemeral(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return config->cfg->ephemeral;
+}
+
+container_memory_priority_t
+container_config_get_memory_priority(const container_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	return container_config_proto_to_memory_priority(config->cfg->memory_priority);
+}
+
+void
+container_config_get_io_config(const container_config_t *config, container_io_config_t *io_config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	ASSERT(io_config);
+
+	const ContainerIoConfig *io = config->cfg->io_config;
+	if (!io) {
+		*io_config = (container_io_config_t){ .weight = CONTAINER_IO_WEIGHT_DEFAULT };
+		return;
+	}
+
+	io_config->weight = io->weight;
+	io_config->read_bps = io->read_bps;
+	io_config->write_bps = io->write_bps;
+	io_config->read_iops = io->read_iops;
+	io_config->write_iops = io->write_iops;
+}
+
+void
+container_config_get_memory_policy(const container_config_t *config,
+				   container_memory_policy_t *memory_policy)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+	ASSERT(memory_policy);
+
+	*memory_policy = (container_memory_policy_t){ .thp = CONTAINER_THP_DEFAULT };
+
+	const ContainerMemoryPolicy *mp = config->cfg->memory_policy;
+	if (!mp)
+		return;
+
+	memory_policy->thp = container_config_proto_to_thp_mode(mp->thp);
+	memory_policy->hugetlb_limit = mp->hugetlb_limit;
+
+	for (size_t i = 0; i < mp->n_hugetlbfs; i++) {
+		container_hugetlbfs_t *fs = mem_new0(container_hugetlbfs_t, 1);
+		fs->dir = mem_strdup(mp->hugetlbfs[i]->dir);
+		fs->min_size = mp->hugetlbfs[i]->min_size;
+		fs->size = mp->hugetlbfs[i]->size;
+		memory_policy->hugetlbfs = list_append(memory_policy->hugetlbfs, fs);
+	}
+}
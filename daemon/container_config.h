@@ -65,6 +65,17 @@ container_config_t *
 container_config_new(const char *file, const uint8_t *buf, size_t len, uint8_t *sig_buf,
 		     size_t sig_len, uint8_t *cert_buf, size_t cert_len);
 
+/**
+ * Verifies the signatures of several container config files in one batch, so
+ * that the subsequent container_config_new() of each file does not need to
+ * wait for its own verification. Files with a valid binary cache are skipped.
+ *
+ * @param n Number of config files.
+ * @param files The config files (<uuid>.conf).
+ */
+void
+container_config_verify_prefetch(size_t n, const char *const files[]);
+
 /**
  * Release the container_config_t object.
  */
@@ -120,6 +131,38 @@ container_config_set_ram_limit(container_config_t *config, unsigned int ram_limi
 const char *
 container_config_get_cpus_allowed(const container_config_t *config);
 
+/**
+ * Get the priority of the container for the cpu placement.
+ */
+unsigned int
+container_config_get_cpu_priority(const container_config_t *config);
+
+/**
+ * Get whether the data volumes of the container are kept in tmpfs.
+ */
+bool
+container_config_get_ephemeral(const container_config_t *config);
+
+/**
+ * Get the memory tier of the container while it is not in the foreground.
+ */
+container_memory_priority_t
+container_config_get_memory_priority(const container_config_t *config);
+
+/**
+ * Get the block io weight and limits of the container.
+ */
+void
+container_config_get_io_config(const container_config_t *config, container_io_config_t *io_config);
+
+/**
+ * Get the huge page policy of the container. The list of hugetlbfs mounts is
+ * newly allocated and owned by the caller.
+ */
+void
+container_config_get_memory_policy(const container_config_t *config,
+				   container_memory_policy_t *memory_policy);
+
 void
 container_config_fill_mount(const container_config_t *config, mount_t *mnt);
 #if 0
@@ -281,4 +324,16 @@ container_config_get_token_type(const container_config_t *config);
 bool
 container_config_get_usb_pin_entry(const container_config_t *config);
 
+/**
+ * Returns the CRYPTFS_* flags tuning dm-crypt for the container's encrypted volumes.
+ */
+unsigned
+container_config_get_crypt_flags(const container_config_t *config);
+
+/**
+ * Returns the dm-crypt sector size in bytes for newly created encrypted volumes.
+ */
+unsigned
+container_config_get_crypt_sector_size(const container_config_t *config);
+
 #endif /* C_CONFIG_H */
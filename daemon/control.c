@@ -35,6 +35,7 @@
 #include "input.h"
 #include "uevent.h"
 #include "audit.h"
+#include "accounting.h"
 
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 #include "common/macro.h"
@@ -45,13 +46,23 @@
 #include "common/event.h"
 #include "common/fd.h"
 #include "common/logf.h"
+#include "common/logstore.h"
 #include "common/list.h"
 #include "common/network.h"
 #include "common/reboot.h"
 #include "common/file.h"
+#include "common/hashmap.h"
+#include "common/ssl_util.h"
 
 #include <unistd.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
 
 #include <google/protobuf-c/protobuf-c-text.h>
 
@@ -60,9 +71,69 @@
 
 // time between reconnection attempts of a remote client socket
 #define CONTROL_REMOTE_RECONNECT_INTERVAL 10000
+// attempts may be deferred to coalesce with other wakeups
+#define CONTROL_REMOTE_RECONNECT_SLACK 5000
+
+// TCP keepalive of the remote connection, detects a dead link while it is idle
+#define CONTROL_REMOTE_KEEPIDLE 60 // s
+#define CONTROL_REMOTE_KEEPINTVL 10 // s
+#define CONTROL_REMOTE_KEEPCNT 3
+
+// minimum free space in the buffer of decrypted data before reading from a TLS peer
+#define CONTROL_TLS_READ_SIZE (16 * 1024)
 
 #define LOGGER_ENTRY_MAX_LEN (5 * 1024)
 
+// maximum payload of one EXEC_OUTPUT message
+#define CONTROL_EXEC_FRAME_SIZE (64 * 1024)
+
+// maximum amount of data queued for a client which does not read its messages
+#define CONTROL_OUT_QUEUE_MAX (16 * 1024 * 1024)
+
+// maximum no. of asynchronously completing requests tracked per connection
+#define CONTROL_DEFERRED_MAX 32
+
+// a packed, length prefixed DaemonToController message waiting to be sent
+typedef struct control_out {
+	size_t len;
+	size_t off;
+	uint8_t buf[];
+} control_out_t;
+
+// defaults and limits for bulk transfers of log files
+#define CONTROL_LOG_CHUNK_SIZE (64 * 1024)
+#define CONTROL_LOG_CHUNK_SIZE_MAX (512 * 1024)
+// a bulk transfer only reads further chunks while less than this is queued
+#define CONTROL_LOG_QUEUE_HIGH (1024 * 1024)
+
+// state of a bulk transfer of a log file, continued whenever the output queue drains
+typedef struct control_log_transfer {
+	int fd;
+	uint64_t offset;
+	size_t chunk_size;
+	uint8_t *chunk;
+	bool has_request_id;
+	uint64_t request_id;
+} control_log_transfer_t;
+
+// collects state changes of observed containers for this long before pushing them
+#define CONTROL_STATUS_COALESCE_MS 100
+
+// a container observed by a control connection (OBSERVE_STATUS_START)
+typedef struct control_status_observer {
+	control_t *control;
+	char *uuid;
+	container_callback_t *cb;
+	ContainerState pushed_state; // state the client was told last
+	bool changed;		     // state changed since the last push
+} control_status_observer_t;
+
+// a request which is answered later, e.g. after the scd unlocked the container key
+typedef struct control_deferred {
+	ControllerToDaemon__Command command;
+	uint64_t request_id;
+} control_deferred_t;
+
 struct control {
 	int sock; // listen socket fd
 	int sock_client;
@@ -74,15 +145,578 @@ struct control {
 	bool connected; // FIXME: we should reconsider this...
 	event_timer_t *reconnect_timer;
 	bool privileged;
+	list_t *out_queue;   // control_out_t messages not yet written to sock_client
+	size_t out_len;	     // total length of the queued messages
+	int out_fd;	     // dup of sock_client, watched while messages are queued
+	event_io_t *out_io;  // write watch on out_fd
+	list_t *deferred;    // control_deferred_t of requests answered later, in request order
+	control_log_transfer_t *log_transfer; // bulk transfer of a log file in progress, if any
+	list_t *status_observers;	      // control_status_observer_t of observed containers
+	event_timer_t *status_timer;	      // pushes coalesced state changes once expired
+	event_io_t *client_io;		      // watch on sock_client of a remote connection
+	SSL_CTX *tls_ctx;		      // set if the remote connection is secured by TLS
+	SSL *ssl;			      // TLS state of sock_client
+	SSL_SESSION *tls_session;	      // latest session with the peer, resumed on reconnect
+	uint8_t *tls_rbuf;		      // decrypted data not yet parsed into messages
+	size_t tls_rbuf_len;
+	size_t tls_rbuf_size;
+	protobuf_zstream_t *zs_out; // compresses messages to the client once it asked for it
+	protobuf_zstream_t *zs_in;  // decompresses messages from the client
 };
 
 // TODO really?!
 static list_t *control_list = NULL;
+
+// the connection and the message which is currently handled, if any
+static control_t *control_current = NULL;
+static const ControllerToDaemon *control_current_msg = NULL;
+static bool control_current_replied = false;
+
+// temporaries of the message handlers, released after each message
+static mem_arena_t *control_arena = NULL;
+#define CONTROL_ARENA_BLOCK_SIZE 4096
 UNUSED static logf_handler_t *control_logf_handler = NULL;
 
 static int
 control_remote_reconnect(control_t *control);
 
+static control_t *
+control_get_by_client_sock(int fd)
+{
+	IF_TRUE_RETVAL(fd < 0, NULL);
+
+	for (list_t *l = control_list; l; l = l->next) {
+		control_t *control = l->data;
+		if (control->sock_client == fd)
+			return control;
+	}
+	return NULL;
+}
+
+static void
+control_out_watch(control_t *control, bool enable);
+
+static void
+control_log_transfer_continue(control_t *control);
+
+/*
+ * OpenSSL writes to the socket without MSG_NOSIGNAL, so a vanished peer raises
+ * SIGPIPE. It is blocked around TLS calls only, since the signal mask would be
+ * inherited by the processes spawned from the message handlers.
+ */
+static void
+control_tls_sigpipe_block(sigset_t *old)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+static void
+control_tls_sigpipe_restore(const sigset_t *old)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+
+	// drop a SIGPIPE raised meanwhile, the failed call already reported EPIPE
+	sigset_t pending;
+	if (!sigismember(old, SIGPIPE) && sigpending(&pending) == 0 &&
+	    sigismember(&pending, SIGPIPE))
+		sigtimedwait(&set, NULL, &(struct timespec){ 0, 0 });
+
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/*
+ * Writes to control's client, through TLS if the connection is secured.
+ * Behaves like send() on a non-blocking socket, i.e., fails with EAGAIN.
+ */
+static ssize_t
+control_client_write(control_t *control, const void *buf, size_t len)
+{
+	if (!control->ssl)
+		return send(control->sock_client, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	sigset_t old;
+	control_tls_sigpipe_block(&old);
+	ERR_clear_error();
+	int n = SSL_write(control->ssl, buf, len);
+	int err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(control->ssl, n);
+	control_tls_sigpipe_restore(&old);
+
+	switch (err) {
+	case SSL_ERROR_NONE:
+		return n;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	default:
+		DEBUG("TLS send to %s failed: %s", control->hostip,
+		      ERR_error_string(ERR_get_error(), NULL));
+		errno = EPIPE;
+		return -1;
+	}
+}
+
+static void
+control_out_cb(UNUSED int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	control_t *control = data;
+
+	IF_FALSE_RETURN(events & EVENT_IO_WRITE);
+
+	/*
+	 * Write as much as the socket takes. Errors are only logged, the
+	 * connection is closed by the read handler which sees the same error.
+	 */
+	while (control->out_queue) {
+		control_out_t *out = control->out_queue->data;
+		ssize_t n = control_client_write(control, out->buf + out->off,
+						 out->len - out->off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			WARN_ERRNO("Could not write queued messages to control client %d",
+				   control->sock_client);
+			break;
+		}
+		out->off += n;
+		if (out->off < out->len)
+			continue;
+
+		control->out_len -= out->len;
+		control->out_queue = list_remove(control->out_queue, out);
+		mem_free(out);
+	}
+	control_out_watch(control, false);
+
+	if (control->log_transfer)
+		control_log_transfer_continue(control);
+}
+
+static void
+control_out_watch(control_t *control, bool enable)
+{
+	if (enable && !control->out_io) {
+		// the read watch of sock_client already occupies its epoll slot
+		control->out_fd = dup(control->sock_client);
+		if (control->out_fd < 0) {
+			WARN_ERRNO("Could not dup control client %d", control->sock_client);
+			return;
+		}
+		control->out_io =
+			event_io_new(control->out_fd, EVENT_IO_WRITE, control_out_cb, control);
+		event_add_io(control->out_io);
+	} else if (!enable && control->out_io) {
+		event_remove_io(control->out_io);
+		event_io_free(control->out_io);
+		control->out_io = NULL;
+		close(control->out_fd);
+		control->out_fd = -1;
+	}
+
+	if (!enable) {
+		for (list_t *l = control->out_queue; l; l = l->next)
+			mem_free(l->data);
+		list_delete(control->out_queue);
+		control->out_queue = NULL;
+		control->out_len = 0;
+	}
+}
+
+/*
+ * Drops everything which belongs to the client connection of control, called
+ * whenever sock_client is closed.
+ */
+static void
+control_log_transfer_free(control_t *control)
+{
+	IF_NULL_RETURN_TRACE(control->log_transfer);
+
+	close(control->log_transfer->fd);
+	mem_free(control->log_transfer->chunk);
+	mem_trim_hint(control->log_transfer->chunk_size);
+	mem_free(control->log_transfer);
+}
+
+static void
+control_status_observe_stop(control_t *control, const char *uuid);
+
+static void
+control_client_reset(control_t *control)
+{
+	control_out_watch(control, false);
+	control_log_transfer_free(control);
+	control_status_observe_stop(control, NULL);
+
+	for (list_t *l = control->deferred; l; l = l->next)
+		mem_free(l->data);
+	list_delete(control->deferred);
+	control->deferred = NULL;
+
+	protobuf_zstream_free(control->zs_out);
+	control->zs_out = NULL;
+	protobuf_zstream_free(control->zs_in);
+	control->zs_in = NULL;
+}
+
+/*
+ * Returns the state for decompressing messages from control's client,
+ * which may send compressed frames at any time.
+ */
+static protobuf_zstream_t *
+control_zs_in(control_t *control)
+{
+	if (!control->zs_in)
+		control->zs_in = protobuf_zstream_new();
+	return control->zs_in;
+}
+
+/*
+ * Sends out to control's client without blocking cmld. Whatever the socket does
+ * not take immediately is queued and written once it becomes writable again, so
+ * that messages keep their order. If the client negotiated compression, the
+ * message is compressed against the previous message with the same code.
+ */
+static int
+control_out_send_packed(control_t *control, DaemonToController__Code code, const uint8_t *buf,
+			uint32_t buflen)
+{
+	if (!(buflen < PROTOBUF_MAX_MESSAGE_SIZE)) {
+		ERROR("Packed message exceeds PROTOBUF_MAX_MESSAGE_SIZE");
+		return -1;
+	}
+
+	// checked before compressing, a dropped frame would desync the dictionaries
+	if (control->out_len + sizeof(uint32_t) + buflen > CONTROL_OUT_QUEUE_MAX) {
+		WARN("Output queue of control client %d is full, dropping message",
+		     control->sock_client);
+		return -1;
+	}
+
+	control_out_t *frame = mem_alloc(sizeof(control_out_t) + sizeof(uint32_t) + buflen);
+	frame->off = 0;
+
+	ssize_t zlen = 0;
+	if (control->zs_out) {
+		zlen = protobuf_zstream_deflate(control->zs_out, code & 0xff, buf, buflen,
+						frame->buf + sizeof(uint32_t), buflen);
+		if (zlen < 0)
+			WARN("Could not compress message for control client %d",
+			     control->sock_client);
+	}
+
+	if (zlen > 0) {
+		frame->len = sizeof(uint32_t) + zlen;
+		memcpy(frame->buf, &(uint32_t){ htonl(zlen | PROTOBUF_FRAME_COMPRESSED) },
+		       sizeof(uint32_t));
+	} else {
+		frame->len = sizeof(uint32_t) + buflen;
+		memcpy(frame->buf, &(uint32_t){ htonl(buflen) }, sizeof(uint32_t));
+		if (buflen)
+			memcpy(frame->buf + sizeof(uint32_t), buf, buflen);
+	}
+
+	while (!control->out_queue && frame->off < frame->len) {
+		ssize_t n = control_client_write(control, frame->buf + frame->off,
+						 frame->len - frame->off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			DEBUG_ERRNO("Failed to write message to control client %d",
+				    control->sock_client);
+			mem_free(frame);
+			return -1;
+		}
+		frame->off += n;
+	}
+
+	if (frame->off == frame->len) {
+		mem_free(frame);
+		return buflen;
+	}
+
+	TRACE("Queueing %zu bytes for control client %d", frame->len - frame->off,
+	      control->sock_client);
+	control->out_queue = list_append(control->out_queue, frame);
+	control->out_len += frame->len;
+	control_out_watch(control, true);
+	return buflen;
+}
+
+static int
+control_out_send(control_t *control, const DaemonToController *out)
+{
+	uint8_t *buf = NULL;
+	uint32_t buflen = protobuf_pack_message_new((const ProtobufCMessage *)out, &buf);
+
+	int ret = control_out_send_packed(control, out->code, buf, buflen);
+	mem_free(buf);
+	return ret;
+}
+
+/*
+ * Sends out to the client connected on fd, through the output queue of
+ * its connection if fd belongs to one.
+ */
+static int
+control_send(int fd, const DaemonToController *out)
+{
+	control_t *control = control_get_by_client_sock(fd);
+	if (!control)
+		return protobuf_send_message(fd, (const ProtobufCMessage *)out);
+
+	return control_out_send(control, out);
+}
+
+/*
+ * Sends out as answer to the message which is currently handled on fd,
+ * tagged with its request id. The already packed fields in tail, if any,
+ * are appended to the packed out.
+ */
+static int
+control_send_reply_packed(int fd, DaemonToController *out, const uint8_t *tail, size_t tail_len)
+{
+	control_t *control = control_get_by_client_sock(fd);
+	if (control && control == control_current) {
+		control_current_replied = true;
+		if (control_current_msg->has_request_id) {
+			out->has_request_id = true;
+			out->request_id = control_current_msg->request_id;
+		}
+	}
+
+	if (!tail_len) {
+		if (!control)
+			return protobuf_send_message(fd, (const ProtobufCMessage *)out);
+		return control_out_send(control, out);
+	}
+
+	uint8_t *buf = NULL;
+	uint32_t buflen = protobuf_pack_message_new((const ProtobufCMessage *)out, &buf);
+	if (buflen + tail_len >= PROTOBUF_MAX_MESSAGE_SIZE) {
+		ERROR("Packed message exceeds PROTOBUF_MAX_MESSAGE_SIZE");
+		mem_free(buf);
+		return -1;
+	}
+	buf = mem_realloc(buf, buflen + tail_len);
+	memcpy(buf + buflen, tail, tail_len);
+	buflen += tail_len;
+
+	int ret = control ? control_out_send_packed(control, out->code, buf, buflen) :
+			    protobuf_send_message_packed(fd, buf, buflen);
+	mem_free(buf);
+	return ret;
+}
+
+static int
+control_send_reply(int fd, DaemonToController *out)
+{
+	return control_send_reply_packed(fd, out, NULL, 0);
+}
+
+/*
+ * Returns true if command possibly answers after its handler returned, i.e.
+ * once the scd or a download finished.
+ */
+static bool
+control_command_is_deferrable(ControllerToDaemon__Command command)
+{
+	switch (command) {
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START:
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP:
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CHANGE_TOKEN_PIN:
+	case CONTROLLER_TO_DAEMON__COMMAND__CHANGE_DEVICE_PIN:
+	case CONTROLLER_TO_DAEMON__COMMAND__PUSH_DEVICE_CERT:
+	case CONTROLLER_TO_DAEMON__COMMAND__PUSH_GUESTOS_CONFIG:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Returns true if message may answer a deferred command. Sets final to
+ * false for progress messages which are followed by another answer.
+ */
+static bool
+control_response_answers(control_message_t message, ControllerToDaemon__Command command,
+			 bool *final)
+{
+	*final = true;
+
+	switch (message) {
+	case CONTROL_RESPONSE_CONTAINER_START_OK:
+	case CONTROL_RESPONSE_CONTAINER_START_LOCK_FAILED:
+	case CONTROL_RESPONSE_CONTAINER_START_UNLOCK_FAILED:
+	case CONTROL_RESPONSE_CONTAINER_START_PASSWD_WRONG:
+	case CONTROL_RESPONSE_CONTAINER_START_EEXIST:
+	case CONTROL_RESPONSE_CONTAINER_START_EINTERNAL:
+	case CONTROL_RESPONSE_CONTAINER_TOKEN_UNINITIALIZED:
+	case CONTROL_RESPONSE_CONTAINER_TOKEN_UNPAIRED:
+		return command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START;
+	case CONTROL_RESPONSE_CONTAINER_STOP_OK:
+	case CONTROL_RESPONSE_CONTAINER_STOP_LOCK_FAILED:
+	case CONTROL_RESPONSE_CONTAINER_STOP_UNLOCK_FAILED:
+	case CONTROL_RESPONSE_CONTAINER_STOP_PASSWD_WRONG:
+	case CONTROL_RESPONSE_CONTAINER_STOP_FAILED_NOT_RUNNING:
+		return command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP;
+	case CONTROL_RESPONSE_CONTAINER_CTRL_EINTERNAL:
+	case CONTROL_RESPONSE_CONTAINER_USB_PIN_ENTRY_FAIL:
+		return command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START ||
+		       command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP;
+	case CONTROL_RESPONSE_CONTAINER_LOCKED_TILL_REBOOT:
+		return command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START ||
+		       command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP ||
+		       command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CHANGE_TOKEN_PIN;
+	case CONTROL_RESPONSE_CONTAINER_CHANGE_PIN_FAILED:
+	case CONTROL_RESPONSE_CONTAINER_CHANGE_PIN_SUCCESSFUL:
+		return command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CHANGE_TOKEN_PIN ||
+		       command == CONTROLLER_TO_DAEMON__COMMAND__CHANGE_DEVICE_PIN;
+	case CONTROL_RESPONSE_DEVICE_PROVISIONING_ERROR:
+	case CONTROL_RESPONSE_DEVICE_CERT_ERROR:
+	case CONTROL_RESPONSE_DEVICE_CERT_OK:
+		return command == CONTROLLER_TO_DAEMON__COMMAND__PUSH_DEVICE_CERT;
+	case CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_STARTED:
+	case CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_WAITING:
+		*final = false;
+		return command == CONTROLLER_TO_DAEMON__COMMAND__PUSH_GUESTOS_CONFIG;
+	case CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_COMPLETED:
+	case CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_FAILED:
+		return command == CONTROLLER_TO_DAEMON__COMMAND__PUSH_GUESTOS_CONFIG;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Tags out with the request id of the oldest deferred request of control which
+ * is answered by message. Requests are completed by the scd and the download
+ * in the order they were received, so the oldest matching one is answered.
+ */
+static void
+control_deferred_tag(control_t *control, control_message_t message, DaemonToController *out)
+{
+	for (list_t *l = control->deferred; l; l = l->next) {
+		control_deferred_t *deferred = l->data;
+		bool final;
+
+		if (!control_response_answers(message, deferred->command, &final))
+			continue;
+
+		out->has_request_id = true;
+		out->request_id = deferred->request_id;
+		if (final) {
+			control->deferred = list_unlink(control->deferred, l);
+			mem_free(deferred);
+		}
+		return;
+	}
+}
+
+static void
+control_deferred_add(control_t *control, const ControllerToDaemon *msg)
+{
+	if (list_length(control->deferred) >= CONTROL_DEFERRED_MAX) {
+		// the oldest request may never be answered, e.g. if no download was needed
+		mem_free(control->deferred->data);
+		control->deferred = list_unlink(control->deferred, control->deferred);
+	}
+
+	control_deferred_t *deferred = mem_new0(control_deferred_t, 1);
+	deferred->command = msg->command;
+	deferred->request_id = msg->request_id;
+	control->deferred = list_append(control->deferred, deferred);
+}
+
+/*
+ * Sends the next chunks of the log transfer of control until the output queue
+ * is filled up. The end of the file is signalled by an empty chunk.
+ */
+static void
+control_log_transfer_continue(control_t *control)
+{
+	control_log_transfer_t *transfer = control->log_transfer;
+
+	while (transfer && control->out_len < CONTROL_LOG_QUEUE_HIGH) {
+		ssize_t len = pread(transfer->fd, transfer->chunk, transfer->chunk_size,
+				    transfer->offset);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR_ERRNO("Could not read log file at offset %" PRIu64, transfer->offset);
+			len = 0;
+		}
+
+		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+		out.code = DAEMON_TO_CONTROLLER__CODE__LOG_CHUNK;
+		out.has_request_id = transfer->has_request_id;
+		out.request_id = transfer->request_id;
+		out.has_log_chunk = true;
+		out.log_chunk.data = transfer->chunk;
+		out.log_chunk.len = len;
+		out.has_log_chunk_offset = true;
+		out.log_chunk_offset = transfer->offset;
+
+		if (control_out_send(control, &out) < 0 || len == 0) {
+			DEBUG("Finished log transfer at offset %" PRIu64, transfer->offset);
+			control_log_transfer_free(control);
+			return;
+		}
+		transfer->offset += len;
+	}
+}
+
+/*
+ * Streams the file at path in raw chunks of chunk_size, starting at offset, to
+ * the client of control. In contrast to control_send_log_file(), the file is not
+ * split into lines and only read as fast as the client takes the chunks, which
+ * allows resuming an interrupted transfer at the last received offset.
+ */
+static int UNUSED
+control_log_transfer_start(control_t *control, const char *path, uint64_t offset,
+			   size_t chunk_size)
+{
+	if (control->log_transfer) {
+		WARN("A log transfer is already in progress");
+		return -1;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open %s", path);
+		return -1;
+	}
+
+	if (chunk_size == 0)
+		chunk_size = CONTROL_LOG_CHUNK_SIZE;
+	chunk_size = MIN(chunk_size, CONTROL_LOG_CHUNK_SIZE_MAX);
+
+	control_log_transfer_t *transfer = mem_new0(control_log_transfer_t, 1);
+	transfer->fd = fd;
+	transfer->offset = offset;
+	transfer->chunk_size = chunk_size;
+	transfer->chunk = mem_alloc(chunk_size);
+	if (control_current == control && control_current_msg->has_request_id) {
+		control_current_replied = true;
+		transfer->has_request_id = true;
+		transfer->request_id = control_current_msg->request_id;
+	}
+	control->log_transfer = transfer;
+
+	DEBUG("Starting log transfer of %s at offset %" PRIu64 " in chunks of %zu bytes", path,
+	      offset, chunk_size);
+	control_log_transfer_continue(control);
+	return 0;
+}
+
 UNUSED static void
 control_logf(logf_prio_t prio, const char *msg, UNUSED void *data)
 {
@@ -117,7 +751,7 @@ control_logf(logf_prio_t prio, const char *msg, UNUSED void *data)
 		if (cmld_get_device_uuid()) {
 			out.device_uuid = mem_strdup(cmld_get_device_uuid());
 		}
-		if (protobuf_send_message(control->sock_client, (ProtobufCMessage *)&out) < 0) {
+		if (control_out_send(control, &out) < 0) {
 			WARN("Could not send log message");
 			//Do not try to reconnect here
 			//Reconnection handling is done by control_cb_recv_message()
@@ -133,8 +767,7 @@ control_send_log_file(int fd, char *log_file_name, bool read_low_level, bool sen
 {
 	int fp_low = -1;
 	bool skipped_lines = false;
-	FILE *fp = NULL;
-	char *line;
+	logstore_reader_t *reader = NULL;
 	char line_low[LOGGER_ENTRY_MAX_LEN + 1];
 	size_t HEADER_LENGTH = 21;
 	ssize_t bytes_read;
@@ -158,9 +791,9 @@ control_send_log_file(int fd, char *log_file_name, bool read_low_level, bool sen
 			file_is_open = true;
 		}
 	} else {
-		fp = fopen(log_file_name, "r");
-		line = NULL;
-		if (fp == NULL) {
+		// rotated log segments are read straight from their compressed form
+		reader = logstore_reader_new(log_file_name);
+		if (reader == NULL) {
 			ERROR("Could not open %s", log_file_name);
 		} else {
 			file_is_open = true;
@@ -178,14 +811,13 @@ control_send_log_file(int fd, char *log_file_name, bool read_low_level, bool sen
 			char *second_string = line_low + HEADER_LENGTH + string_len + 1;
 			message.msg = mem_printf("%s/%s", first_string, second_string);
 		} else {
-			size_t len = 0;
-			bytes_read = getline(&line, &len, fp);
-			if (bytes_read == -1)
+			const char *line = logstore_reader_getline(reader);
+			if (line == NULL)
 				break;
 			message.msg = mem_strdup(line);
 		}
 		out.log_message = &message;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			ERROR_ERRNO("Could not finish sending %s", log_file_name);
 			skipped_lines = true;
 			break;
@@ -195,7 +827,7 @@ control_send_log_file(int fd, char *log_file_name, bool read_low_level, bool sen
 	if (send_last_line_info) {
 		message.msg = mem_printf("Last line of log");
 		out.log_message = &message;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			ERROR("Could not sent last line info for %s", log_file_name);
 		}
 		mem_free(message.msg);
@@ -207,9 +839,7 @@ control_send_log_file(int fd, char *log_file_name, bool read_low_level, bool sen
 		if (read_low_level) {
 			close(fp_low);
 		} else {
-			fclose(fp);
-			if (line)
-				free(line);
+			logstore_reader_free(reader);
 		}
 	}
 
@@ -247,6 +877,8 @@ control_container_state_to_proto(container_state_t state)
 		return CONTAINER_STATE__SETUP;
 	case CONTAINER_STATE_REBOOTING:
 		return CONTAINER_STATE__REBOOTING;
+	case CONTAINER_STATE_CHECKPOINTED:
+		return CONTAINER_STATE__CHECKPOINTED;
 	default:
 		FATAL("Unhandled value for container_state_t: %d", state);
 	}
@@ -268,6 +900,19 @@ control_container_type_to_proto(container_type_t type)
 	}
 }
 
+static ContainerTrust
+control_container_trust_level(const container_t *container)
+{
+	switch (guestos_get_verify_result(container_get_guestos(container))) {
+	case GUESTOS_SIGNED:
+		return CONTAINER_TRUST__SIGNED;
+	case GUESTOS_LOCALLY_SIGNED:
+		return CONTAINER_TRUST__LOCALLY_SIGNED;
+	default:
+		return CONTAINER_TRUST__UNSIGNED;
+	}
+}
+
 /**
  * Get the ContainerStatus for the given container.
  *
@@ -287,17 +932,7 @@ control_container_status_new(const container_t *container)
 	c_status->uptime = container_get_uptime(container);
 	c_status->created = container_get_creation_time(container);
 	c_status->guestos = mem_strdup(guestos_get_name(container_get_guestos(container)));
-
-	switch (guestos_get_verify_result(container_get_guestos(container))) {
-	case GUESTOS_SIGNED:
-		c_status->trust_level = CONTAINER_TRUST__SIGNED;
-		break;
-	case GUESTOS_LOCALLY_SIGNED:
-		c_status->trust_level = CONTAINER_TRUST__LOCALLY_SIGNED;
-		break;
-	default:
-		c_status->trust_level = CONTAINER_TRUST__UNSIGNED;
-	}
+	c_status->trust_level = control_container_trust_level(container);
 
 	return c_status;
 }
@@ -318,33 +953,158 @@ control_container_status_free(ContainerStatus *c_status)
 	mem_free(c_status);
 }
 
+/*
+ * Packed ContainerStatus records, indexed by container uuid string. A
+ * record is repacked only if one of the inputs it was built from changed;
+ * the uptime is appended to the cached bytes when sending.
+ */
+typedef struct control_status_record {
+	char *uuid;
+	const container_t *container;
+	const char *name;
+	const guestos_t *guestos;
+	ContainerState state;
+	ContainerTrust trust_level;
+	uint8_t *packed;
+	size_t len;
+} control_status_record_t;
+
+static hashmap_t *control_status_records = NULL;
+
+static const control_status_record_t *
+control_status_record_get(const container_t *container)
+{
+	const char *uuid = uuid_string(container_get_uuid(container));
+	ContainerState state = control_container_state_to_proto(container_get_state(container));
+	ContainerTrust trust_level = control_container_trust_level(container);
+
+	if (!control_status_records)
+		control_status_records = hashmap_new_str();
+
+	control_status_record_t *record = hashmap_get(control_status_records, uuid);
+	if (record && record->container == container &&
+	    record->name == container_get_name(container) &&
+	    record->guestos == container_get_guestos(container) && record->state == state &&
+	    record->trust_level == trust_level)
+		return record;
+
+	if (!record) {
+		record = mem_new0(control_status_record_t, 1);
+		record->uuid = mem_strdup(uuid);
+		hashmap_put(control_status_records, record->uuid, record);
+	}
+
+	TRACE("Packing status record of container %s", uuid);
+	record->container = container;
+	record->name = container_get_name(container);
+	record->guestos = container_get_guestos(container);
+	record->state = state;
+	record->trust_level = trust_level;
+
+	ContainerStatus *c_status = control_container_status_new(container);
+	c_status->uptime = 0;
+	mem_free(record->packed);
+	record->len =
+		protobuf_pack_message_new((const ProtobufCMessage *)c_status, &record->packed);
+	control_container_status_free(c_status);
+
+	return record;
+}
+
+static size_t
+control_varint_encode(uint8_t *buf, uint64_t value)
+{
+	size_t n = 0;
+	for (; value >= 0x80; value >>= 7)
+		buf[n++] = (value & 0x7f) | 0x80;
+	buf[n++] = value;
+	return n;
+}
+
+/*
+ * Returns the packed repeated container_status field of a DaemonToController
+ * message for the given containers, to be appended to the packed message.
+ */
+static uint8_t *
+control_status_records_pack_new(const list_t *containers, size_t *len)
+{
+	// tag, length and uptime field need at most 1 + 10 + 1 + 10 bytes
+	size_t size = 0;
+	for (const list_t *l = containers; l; l = l->next)
+		size += control_status_record_get(l->data)->len + 22;
+
+	uint8_t *buf = mem_alloc(MAX(size, 1));
+	size_t off = 0;
+	for (const list_t *l = containers; l; l = l->next) {
+		const control_status_record_t *record = control_status_record_get(l->data);
+		uint8_t uptime[11] = { (5 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT };
+		size_t uptime_len =
+			1 + control_varint_encode(uptime + 1, container_get_uptime(l->data));
+
+		buf[off++] = (7 << 3) | PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		off += control_varint_encode(buf + off, record->len + uptime_len);
+		memcpy(buf + off, record->packed, record->len);
+		off += record->len;
+		memcpy(buf + off, uptime, uptime_len);
+		off += uptime_len;
+	}
+
+	*len = off;
+	return buf;
+}
+
+/*
+ * Sends the status of the given containers as answer to the currently
+ * handled message on fd using the cached status records.
+ */
+static int
+control_send_container_status(int fd, const list_t *containers)
+{
+	size_t len = 0;
+	uint8_t *tail = control_status_records_pack_new(containers, &len);
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_STATUS;
+	int ret = control_send_reply_packed(fd, &out, tail, len);
+
+	mem_free(tail);
+	return ret;
+}
+
+
+/*
+ * Coalesces the output available on the console socket into one EXEC_OUTPUT
+ * frame of at most CONTROL_EXEC_FRAME_SIZE bytes.
+ */
 static ssize_t
 control_read_send(int cfd, int fd)
 {
-	uint8_t buf[1024];
-	ssize_t count = -1;
+	static uint8_t buf[CONTROL_EXEC_FRAME_SIZE];
+	ssize_t count = 0, ret = -1;
 
 	TRACE("Trying to read data from console socket.");
 
-	if ((count = read(fd, buf, 1023)) > 0) {
-		buf[count] = 0;
+	while (count < (ssize_t)sizeof(buf) &&
+	       (ret = read(fd, buf + count, sizeof(buf) - count)) > 0)
+		count += ret;
 
+	if (count > 0) {
 		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
 		out.code = DAEMON_TO_CONTROLLER__CODE__EXEC_OUTPUT;
 		out.has_exec_output = true;
 		out.exec_output.len = count;
 		out.exec_output.data = buf;
 
-		TRACE("[CONTROL] Read %zd bytes: %s. Sending to control client...", count, buf);
+		TRACE("[CONTROL] Read %zd bytes. Sending to control client...", count);
 
-		if (protobuf_send_message(cfd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send(cfd, &out) < 0) {
 			WARN("Could not send exec output to MDM");
 		}
-	} else {
-		TRACE_ERRNO("[CONTROL] Read from console socket returned %zd", count);
+		return count;
 	}
 
-	return count;
+	TRACE_ERRNO("[CONTROL] Read from console socket returned %zd", ret);
+	return ret;
 }
 
 static void
@@ -379,7 +1139,7 @@ control_cb_read_console(int fd, unsigned events, event_io_t *io, void *data)
 		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
 		out.code = DAEMON_TO_CONTROLLER__CODE__EXEC_END;
 
-		if (protobuf_send_message(*cfd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send(*cfd, &out) < 0) {
 			WARN("Could not send exec output to MDM");
 		}
 
@@ -430,6 +1190,134 @@ control_build_container_list_from_uuids(size_t n_uuids, char **uuids)
 	return containers;
 }
 
+/*
+ * Pushes the status of all observed containers whose state differs from the
+ * one pushed last in a single STATUS_CHANGED message. A state which changed
+ * and changed back within the coalescing interval is not pushed at all.
+ */
+static void
+control_status_timer_cb(event_timer_t *timer, void *data)
+{
+	control_t *control = data;
+
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	control->status_timer = NULL;
+
+	size_t n = 0;
+	ContainerStatus **results =
+		mem_new0(ContainerStatus *, list_length(control->status_observers));
+
+	for (list_t *l = control->status_observers; l; l = l->next) {
+		control_status_observer_t *observer = l->data;
+		if (!observer->changed)
+			continue;
+		observer->changed = false;
+
+		container_t *container = control_get_container_by_uuid_string(observer->uuid);
+		if (!container)
+			continue;
+
+		ContainerState state =
+			control_container_state_to_proto(container_get_state(container));
+		if (state == observer->pushed_state)
+			continue;
+
+		observer->pushed_state = state;
+		results[n++] = control_container_status_new(container);
+	}
+
+	if (n > 0) {
+		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+		out.code = DAEMON_TO_CONTROLLER__CODE__STATUS_CHANGED;
+		out.n_container_status = n;
+		out.container_status = results;
+		if (control_out_send(control, &out) < 0)
+			WARN("Could not push container status changes");
+	}
+
+	for (size_t i = 0; i < n; i++)
+		control_container_status_free(results[i]);
+	mem_free(results);
+}
+
+static void
+control_status_observer_cb(UNUSED container_t *container, UNUSED container_callback_t *cb,
+			   void *data)
+{
+	control_status_observer_t *observer = data;
+	control_t *control = observer->control;
+
+	observer->changed = true;
+	if (!control->status_timer) {
+		control->status_timer = event_timer_new(CONTROL_STATUS_COALESCE_MS, 1,
+							control_status_timer_cb, control);
+		event_add_timer(control->status_timer);
+	}
+}
+
+static void
+control_status_observe_start(control_t *control, container_t *container)
+{
+	const char *uuid = uuid_string(container_get_uuid(container));
+
+	for (list_t *l = control->status_observers; l; l = l->next) {
+		control_status_observer_t *observer = l->data;
+		IF_TRUE_RETURN_TRACE(!strcmp(observer->uuid, uuid));
+	}
+
+	control_status_observer_t *observer = mem_new0(control_status_observer_t, 1);
+	observer->control = control;
+	observer->uuid = mem_strdup(uuid);
+	observer->pushed_state = control_container_state_to_proto(container_get_state(container));
+	observer->cb = container_register_observer(container, control_status_observer_cb, observer);
+	if (!observer->cb) {
+		WARN("Could not observe container %s", container_get_description(container));
+		mem_free(observer->uuid);
+		mem_free(observer);
+		return;
+	}
+	control->status_observers = list_append(control->status_observers, observer);
+}
+
+/*
+ * Stops observing the container with the given uuid, or all containers if
+ * uuid is NULL. The container is looked up again, since it may have been
+ * destroyed while being observed.
+ */
+static void
+control_status_observe_stop(control_t *control, const char *uuid)
+{
+	for (list_t *l = control->status_observers; l;) {
+		control_status_observer_t *observer = l->data;
+		list_t *next = l->next;
+
+		if (!uuid || !strcmp(observer->uuid, uuid)) {
+			container_t *container =
+				control_get_container_by_uuid_string(observer->uuid);
+			if (container)
+				container_unregister_observer(container, observer->cb);
+			control->status_observers = list_unlink(control->status_observers, l);
+			mem_free(observer->uuid);
+			mem_free(observer);
+		}
+		l = next;
+	}
+
+	if (!control->status_observers && control->status_timer) {
+		event_remove_timer(control->status_timer);
+		event_timer_free(control->status_timer);
+		control->status_timer = NULL;
+	}
+}
+
+int
+control_get_sock(const control_t *control)
+{
+	ASSERT(control);
+	return control->sock;
+}
+
 int
 control_get_client_sock(control_t *control)
 {
@@ -560,7 +1448,12 @@ control_send_message(control_message_t message, int fd)
 		return -1;
 	}
 
-	return protobuf_send_message(fd, (ProtobufCMessage *)&out);
+	// answers to requests of other connections or from later events complete a deferred one
+	control_t *control = control_get_by_client_sock(fd);
+	if (control && control != control_current)
+		control_deferred_tag(control, message, &out);
+
+	return control_send_reply(fd, &out);
 }
 
 /**
@@ -585,7 +1478,7 @@ control_handle_cmd_list_guestos_configs(UNUSED const ControllerToDaemon *msg, in
 	out.code = DAEMON_TO_CONTROLLER__CODE__GUESTOS_CONFIGS_LIST;
 	out.n_guestos_configs = n;
 	out.guestos_configs = results;
-	if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+	if (control_send_reply(fd, &out) < 0) {
 		WARN("Could not send list of guestos configs to MDM");
 	}
 
@@ -620,13 +1513,256 @@ control_handle_cmd_push_guestos_configs(const ControllerToDaemon *msg, int fd)
  * Used in both priv and unpriv control handlers.
  */
 static void
-control_handle_cmd_register_localca(const ControllerToDaemon *msg, UNUSED int fd)
+control_handle_cmd_register_localca(const ControllerToDaemon *msg, UNUSED int fd)
+{
+	if (!msg->has_guestos_rootcert)
+		WARN("REGISTER_LOCALCA without root certificate");
+	else {
+		guestos_mgr_register_localca(msg->guestos_rootcert.data, msg->guestos_rootcert.len);
+	}
+}
+
+static void
+control_event_stats_append_cb(const event_stats_t *stats, void *data)
+{
+	EventLoopStats *out = data;
+
+	EventCallbackStats *cb = mem_new(EventCallbackStats, 1);
+	event_callback_stats__init(cb);
+	cb->type = mem_strdup(event_stats_type_to_string(stats->type));
+	cb->name = event_stats_func_name(stats->func);
+	cb->calls = stats->calls;
+	cb->total_ns = stats->total_ns;
+	cb->max_ns = stats->max_ns;
+	cb->n_histogram = EVENT_STATS_HIST_BUCKETS;
+	cb->histogram = mem_new(uint64_t, EVENT_STATS_HIST_BUCKETS);
+	memcpy(cb->histogram, stats->hist, sizeof(stats->hist));
+
+	out->callbacks = mem_renew(EventCallbackStats *, out->callbacks, out->n_callbacks + 1);
+	out->callbacks[out->n_callbacks++] = cb;
+}
+
+static void
+control_mem_stats_append_cb(const mem_profile_site_t *site, void *data)
+{
+	MemStats *out = data;
+
+	MemSiteStats *s = mem_new(MemSiteStats, 1);
+	mem_site_stats__init(s);
+	s->site = mem_printf("%s:%d", site->file, site->line);
+	s->count = site->count;
+	s->bytes = site->bytes;
+	s->live_count = site->live_count;
+	s->live_bytes = site->live_bytes;
+	s->peak_bytes = site->peak_bytes;
+
+	out->sites = mem_renew(MemSiteStats *, out->sites, out->n_sites + 1);
+	out->sites[out->n_sites++] = s;
+}
+
+static void
+control_mem_stats_append_tag_cb(const mem_profile_tag_t *tag, void *data)
+{
+	MemStats *out = data;
+
+	MemTagStats *t = mem_new(MemTagStats, 1);
+	mem_tag_stats__init(t);
+	t->tag = mem_strdup(tag->name);
+	t->count = tag->count;
+	t->bytes = tag->bytes;
+	t->live_count = tag->live_count;
+	t->live_bytes = tag->live_bytes;
+
+	out->tags = mem_renew(MemTagStats *, out->tags, out->n_tags + 1);
+	out->tags[out->n_tags++] = t;
+}
+
+static void
+control_mem_stats_append_owner_cb(const mem_profile_owner_t *owner, void *data)
+{
+	MemStats *out = data;
+
+	MemContainerStats *c = mem_new(MemContainerStats, 1);
+	mem_container_stats__init(c);
+	c->container_uuid = mem_strdup(owner->name);
+	c->live_count = owner->live_count;
+	c->live_bytes = owner->live_bytes;
+	c->peak_bytes = owner->peak_bytes;
+	c->has_freed = owner->freed;
+	c->freed = owner->freed;
+
+	out->containers = mem_renew(MemContainerStats *, out->containers, out->n_containers + 1);
+	out->containers[out->n_containers++] = c;
+}
+
+/**
+ * Handles get_mem_stats cmd.
+ * Sends the allocation profile of cmld to the controller, per call site,
+ * per subsystem and per container.
+ */
+static void
+control_handle_cmd_get_mem_stats(int fd)
+{
+	MemStats stats = MEM_STATS__INIT;
+	stats.enabled = (mem_profile_foreach(&control_mem_stats_append_cb, &stats) == 0);
+	if (stats.enabled) {
+		mem_profile_foreach_tag(&control_mem_stats_append_tag_cb, &stats);
+		mem_profile_foreach_owner(&control_mem_stats_append_owner_cb, &stats);
+	}
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__MEM_STATS;
+	out.mem_stats = &stats;
+	if (control_send_reply(fd, &out) < 0) {
+		WARN("Could not send mem stats to MDM");
+	}
+
+	for (size_t i = 0; i < stats.n_sites; i++) {
+		mem_free(stats.sites[i]->site);
+		mem_free(stats.sites[i]);
+	}
+	mem_free(stats.sites);
+	for (size_t i = 0; i < stats.n_tags; i++) {
+		mem_free(stats.tags[i]->tag);
+		mem_free(stats.tags[i]);
+	}
+	mem_free(stats.tags);
+	for (size_t i = 0; i < stats.n_containers; i++) {
+		mem_free(stats.containers[i]->container_uuid);
+		mem_free(stats.containers[i]);
+	}
+	mem_free(stats.containers);
+}
+
+/**
+ * Handles get_event_stats cmd.
+ * Sends the instrumentation data of the main event loop to the controller.
+ */
+static void
+control_handle_cmd_get_event_stats(int fd)
+{
+	event_loop_stats_t loop;
+	EventLoopStats stats = EVENT_LOOP_STATS__INIT;
+
+	stats.enabled = (event_stats_get_loop(&loop) == 0);
+	if (stats.enabled) {
+		stats.has_wakeups = stats.has_events = true;
+		stats.wakeups = loop.wakeups;
+		stats.events = loop.events;
+		stats.n_wakeup_histogram = EVENT_STATS_WAKEUP_BUCKETS;
+		stats.wakeup_histogram = loop.wakeup_hist;
+		stats.has_lag_count = stats.has_lag_total_ns = stats.has_lag_max_ns = true;
+		stats.lag_count = loop.lag_count;
+		stats.lag_total_ns = loop.lag_total_ns;
+		stats.lag_max_ns = loop.lag_max_ns;
+		event_stats_foreach(&control_event_stats_append_cb, &stats);
+	}
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__EVENT_STATS;
+	out.event_stats = &stats;
+	if (control_send_reply(fd, &out) < 0) {
+		WARN("Could not send event stats to MDM");
+	}
+
+	for (size_t i = 0; i < stats.n_callbacks; i++) {
+		mem_free(stats.callbacks[i]->type);
+		mem_free(stats.callbacks[i]->name);
+		mem_free(stats.callbacks[i]->histogram);
+		mem_free(stats.callbacks[i]);
+	}
+	mem_free(stats.callbacks);
+}
+
+static void
+control_handle_cmd_get_container_net_stats(container_t *container, int fd)
+{
+	list_t *stats_list = container_get_net_stats_new(container);
+	size_t n = list_length(stats_list);
+	ContainerNetStats **results = mem_new0(ContainerNetStats *, n);
+
+	for (size_t i = 0; i < n; i++) {
+		container_net_stats_t *stats = list_nth_data(stats_list, i);
+		results[i] = mem_new0(ContainerNetStats, 1);
+		container_net_stats__init(results[i]);
+		results[i]->if_name = stats->vnet_name;
+		results[i]->has_fastpath = true;
+		results[i]->fastpath = stats->fastpath;
+		results[i]->has_rx_packets = results[i]->has_tx_packets = true;
+		results[i]->rx_packets = stats->rx_packets;
+		results[i]->tx_packets = stats->tx_packets;
+		results[i]->has_rx_bytes = results[i]->has_tx_bytes = true;
+		results[i]->rx_bytes = stats->rx_bytes;
+		results[i]->tx_bytes = stats->tx_bytes;
+	}
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_NET_STATS;
+	out.n_container_net_stats = n;
+	out.container_net_stats = results;
+	if (control_send_reply(fd, &out) < 0) {
+		WARN("Could not send container network counters to MDM");
+	}
+
+	for (size_t i = 0; i < n; i++)
+		mem_free(results[i]);
+	mem_free(results);
+	for (list_t *l = stats_list; l; l = l->next)
+		container_net_stats_free(l->data);
+	list_delete(stats_list);
+}
+
+static void
+control_handle_cmd_get_container_accounting(const ControllerToDaemon *msg, int fd)
 {
-	if (!msg->has_guestos_rootcert)
-		WARN("REGISTER_LOCALCA without root certificate");
-	else {
-		guestos_mgr_register_localca(msg->guestos_rootcert.data, msg->guestos_rootcert.len);
+	list_t *containers = control_build_container_list_from_uuids(msg->n_container_uuids,
+								     msg->container_uuids);
+	size_t n = list_length(containers);
+	ContainerAccounting **results =
+		mem_arena_alloc0(control_arena, n * sizeof(ContainerAccounting *));
+	accounting_sample_t samples[ACCOUNTING_HISTORY_LEN];
+
+	for (size_t i = 0; i < n; i++) {
+		container_t *container = list_nth_data(containers, i);
+		size_t n_samples = accounting_get_samples(container, samples);
+
+		results[i] = mem_arena_alloc0(control_arena, sizeof(ContainerAccounting));
+		container_accounting__init(results[i]);
+		results[i]->container_uuid = (char *)uuid_string(container_get_uuid(container));
+		results[i]->n_samples = n_samples;
+		results[i]->samples = mem_arena_alloc0(
+			control_arena, n_samples * sizeof(ContainerAccountingSample *));
+
+		for (size_t j = 0; j < n_samples; j++) {
+			ContainerAccountingSample *out =
+				mem_arena_alloc0(control_arena, sizeof(ContainerAccountingSample));
+			container_accounting_sample__init(out);
+			out->time_ms = samples[j].time_ms;
+			out->has_cpu_usage_us = out->has_memory_bytes = true;
+			out->cpu_usage_us = samples[j].usage.cpu_usage_us;
+			out->memory_bytes = samples[j].usage.memory_bytes;
+			out->has_memory_anon_bytes = out->has_memory_file_bytes = true;
+			out->memory_anon_bytes = samples[j].usage.memory_anon_bytes;
+			out->memory_file_bytes = samples[j].usage.memory_file_bytes;
+			out->has_io_read_bytes = out->has_io_write_bytes = true;
+			out->io_read_bytes = samples[j].usage.io_read_bytes;
+			out->io_write_bytes = samples[j].usage.io_write_bytes;
+			out->has_net_rx_bytes = out->has_net_tx_bytes = true;
+			out->net_rx_bytes = samples[j].net_rx_bytes;
+			out->net_tx_bytes = samples[j].net_tx_bytes;
+			results[i]->samples[j] = out;
+		}
+	}
+
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_ACCOUNTING;
+	out.n_container_accounting = n;
+	out.container_accounting = results;
+	if (control_send_reply(fd, &out) < 0) {
+		WARN("Could not send container accounting to MDM");
 	}
+
+	list_delete(containers);
 }
 
 /**
@@ -745,8 +1881,17 @@ control_check_command(control_t *control, const ControllerToDaemon *msg)
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START) ||
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_UPDATE_CONFIG) ||
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_STATUS_START) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_STATUS_STOP) ||
 	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_CMLD_HANDLES_PIN) ||
-	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP)) {
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_STOP) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_EVENT_STATS) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_MEM_STATS) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_START_TRACE) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_NET_STATS) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_ACCOUNTING) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__EVENT_STATS_START) ||
+	    (msg->command == CONTROLLER_TO_DAEMON__COMMAND__EVENT_STATS_STOP)) {
 		TRACE("Received command %d is valid in provisioned mode", msg->command);
 		return true;
 	}
@@ -757,14 +1902,15 @@ control_check_command(control_t *control, const ControllerToDaemon *msg)
 }
 
 /**
- * Handles a single decoded ControllerToDaemon message.
+ * Handles the command of a single decoded ControllerToDaemon message.
+ * Temporaries may be allocated from control_arena.
  *
  * @param msg	the ControllerToDaemon message to be handled
  * @param fd	file descriptor of the client connection
  *		(for sending a response, if necessary)
  */
 static void
-control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd)
+control_handle_message_cmd(control_t *control, const ControllerToDaemon *msg, int fd)
 {
 	// TODO cases when and how to report the result back to the caller?
 	// => for now, only reply if there is actual data to be sent back to the caller
@@ -774,7 +1920,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		return;
 	}
 
-	if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
+	if (logf_enabled(LOGF_PRIO_TRACE)) {
 		char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
 		TRACE("Handling ControllerToDaemon message:\n%s", msg_text ? msg_text : "NULL");
 		if (msg_text)
@@ -815,13 +1961,13 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 	case CONTROLLER_TO_DAEMON__COMMAND__LIST_CONTAINERS: {
 		// assemble list of relevant containers and allocate memory for result
 		size_t n = cmld_containers_get_count();
-		char **results = mem_new(char *, n);
+		char **results = mem_arena_alloc(control_arena, n * sizeof(char *));
 
 		// fill result with data from guestos
 		for (size_t i = 0; i < n; i++) {
 			container_t *container = cmld_container_get_by_index(i);
 			const char *uuid = uuid_string(container_get_uuid(container));
-			results[i] = mem_strdup(uuid);
+			results[i] = mem_arena_strdup(control_arena, uuid);
 		}
 
 		// build and send response message to controller
@@ -829,43 +1975,22 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINERS_LIST;
 		out.n_container_uuids = n;
 		out.container_uuids = results;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			WARN("Could not send list of containers to MDM");
 		}
-
-		// collect garbage
-		for (size_t i = 0; i < n; i++)
-			mem_free(results[i]);
-		mem_free(results);
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_STATUS: {
 		// assemble list of relevant containers and allocate memory for result
 		list_t *containers = control_build_container_list_from_uuids(msg->n_container_uuids,
 									     msg->container_uuids);
-		size_t n = list_length(containers);
-		ContainerStatus **results = mem_new(ContainerStatus *, n);
-
-		// fill result with data from container
-		for (size_t i = 0; i < n; i++) {
-			container_t *container = list_nth_data(containers, i);
-			results[i] = control_container_status_new(container);
-		}
 
-		// build and send response message to controller
-		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
-		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_STATUS;
-		out.n_container_status = n;
-		out.container_status = results;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		// build and send response message from the cached status records
+		if (control_send_container_status(fd, containers) < 0) {
 			WARN("Could not send container status to MDM");
 		}
 
-		// collect garbage
 		list_delete(containers);
-		for (size_t i = 0; i < n; i++)
-			control_container_status_free(results[i]);
-		mem_free(results);
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_CONFIG: {
@@ -873,8 +1998,9 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		list_t *containers = control_build_container_list_from_uuids(msg->n_container_uuids,
 									     msg->container_uuids);
 		size_t n = list_length(containers);
-		ContainerConfig **results = mem_new0(ContainerConfig *, n);
-		char **result_uuids = mem_new(char *, n);
+		ContainerConfig **results =
+			mem_arena_alloc0(control_arena, n * sizeof(ContainerConfig *));
+		char **result_uuids = mem_arena_alloc(control_arena, n * sizeof(char *));
 
 		size_t number_of_configs = 0;
 		// fill result with data from container
@@ -931,18 +2057,30 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 						vnet_cfg->vnet_mac[2], vnet_cfg->vnet_mac[3],
 						vnet_cfg->vnet_mac[4], vnet_cfg->vnet_mac[5]);
 					vnet_configs[i]->configure = vnet_cfg->configure;
+					vnet_configs[i]->has_fastpath = true;
+					vnet_configs[i]->fastpath = vnet_cfg->fastpath;
+					vnet_configs[i]->has_type = true;
+					vnet_configs[i]->type = (ContainerVnetConfig__Type)vnet_cfg->type;
+					if (vnet_cfg->parent)
+						vnet_configs[i]->parent = mem_strdup(vnet_cfg->parent);
+					vnet_configs[i]->has_vf = vnet_cfg->type == CONTAINER_VNET_SRIOV_VF;
+					vnet_configs[i]->vf = vnet_cfg->vf;
+					if (vnet_cfg->bridge)
+						vnet_configs[i]->bridge =
+							mem_strdup(vnet_cfg->bridge);
 					TRACE("setup runtime vnet_configs[%d] vnetc: %s, vnetr: %s (%s)",
 					      i, vnet_configs[i]->if_name,
 					      vnet_configs[i]->if_rootns_name,
 					      vnet_configs[i]->configure ? "configured" : "manual");
-					mem_free(vnet_cfg);
+					container_vnet_cfg_free(vnet_cfg);
 				}
 				list_delete(vnet_runtime_cfg_list);
 				results[number_of_configs]->n_vnet_configs = vnet_config_len;
 				results[number_of_configs]->vnet_configs = vnet_configs;
 
 				const char *uuid = uuid_string(container_get_uuid(container));
-				result_uuids[number_of_configs] = mem_strdup(uuid);
+				result_uuids[number_of_configs] =
+					mem_arena_strdup(control_arena, uuid);
 				number_of_configs++;
 			}
 		}
@@ -960,25 +2098,28 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 			out.n_container_uuids = number_of_configs;
 			out.container_uuids = result_uuids;
 		}
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			WARN("Could not send container configs to MDM");
 		}
 
 		// collect garbage
 		list_delete(containers);
 		for (size_t i = 0; i < number_of_configs; i++) {
-			mem_free(result_uuids[i]);
 			if (results[i] != NULL)
 				protobuf_free_message((ProtobufCMessage *)results[i]);
 		}
-		mem_free(result_uuids);
-		mem_free(results);
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__GET_LAST_LOG: {
 		WARN("Due to privacy concerns this command is currently not supported.");
-		//control_send_log_file(fd, "/proc/last_kmsg", false, false);
-		//control_send_log_file(fd, "/dev/log/main", true, true);
+		//if (msg->has_log_chunk_size)
+		//	control_log_transfer_start(control, "/proc/last_kmsg",
+		//				   msg->has_log_offset ? msg->log_offset : 0,
+		//				   msg->log_chunk_size);
+		//else {
+		//	control_send_log_file(fd, "/proc/last_kmsg", false, false);
+		//	control_send_log_file(fd, "/dev/log/main", true, true);
+		//}
 	} break;
 	case CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_LOG_START: {
 		WARN("Due to privacy concerns this command is currently not supported.");
@@ -992,10 +2133,60 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		//	control_logf_handler = NULL;
 	} break;
 	// TODO
-	case CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_STATUS_START:
-	case CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_STATUS_STOP:
-		WARN("ControllerToDaemon command %d not implemented yet", msg->command);
-		break;
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_EVENT_STATS: {
+		control_handle_cmd_get_event_stats(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_MEM_STATS: {
+		control_handle_cmd_get_mem_stats(fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_ACCOUNTING: {
+		control_handle_cmd_get_container_accounting(msg, fd);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__EVENT_STATS_START: {
+		event_stats_enable(true);
+		event_stats_reset();
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__EVENT_STATS_STOP: {
+		event_stats_enable(false);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__SET_LOG_LEVEL: {
+		if (!msg->has_log_prio) {
+			WARN("SET_LOG_LEVEL without log level");
+			break;
+		}
+		if (logf_module_set_prio(msg->log_module, (logf_prio_t)msg->log_prio) < 0) {
+			WARN("Invalid log level %d", msg->log_prio);
+			break;
+		}
+		INFO("Set log level of %s to %d", msg->log_module ? msg->log_module : "all modules",
+		     msg->log_prio);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_STATUS_START: {
+		list_t *containers = control_build_container_list_from_uuids(msg->n_container_uuids,
+									     msg->container_uuids);
+
+		// answer with the current status to which the pushed changes apply
+		for (list_t *l = containers; l; l = l->next)
+			control_status_observe_start(control, l->data);
+
+		if (control_send_container_status(fd, containers) < 0)
+			WARN("Could not send container status to MDM");
+
+		list_delete(containers);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__OBSERVE_STATUS_STOP: {
+		if (msg->n_container_uuids == 0)
+			control_status_observe_stop(control, NULL);
+		for (size_t i = 0; i < msg->n_container_uuids; i++)
+			control_status_observe_stop(control, msg->container_uuids[i]);
+	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__PUSH_GUESTOS_CONFIG: {
 		control_handle_cmd_push_guestos_configs(msg, fd);
@@ -1037,6 +2228,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__REBOOT_DEVICE: {
+		audit_flush();
 		reboot_reboot(REBOOT);
 	} break;
 
@@ -1048,7 +2240,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.has_device_csr = csr ? true : false;
 		out.device_csr.data = csr;
 
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			WARN("Could not send device csr!");
 		}
 		if (csr)
@@ -1065,6 +2257,11 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		cmld_push_device_cert(control, cert, cert_len);
 	} break;
 
+	case CONTROLLER_TO_DAEMON__COMMAND__LIVE_RESTART: {
+		if (cmld_live_restart() < 0)
+			WARN("Could not schedule live restart of cmld");
+	} break;
+
 	case CONTROLLER_TO_DAEMON__COMMAND__SET_PROVISIONED: {
 		cmld_set_device_provisioned();
 	} break;
@@ -1081,7 +2278,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 
 		if (!msg->has_container_config_file || msg->container_config_file.data == NULL) {
 			WARN("CREATE_CONTAINER without config file does not work, doing nothing...");
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			if (control_send_reply(fd, &out) < 0)
 				WARN("Could not send empty Response to CREATE");
 			break;
 		}
@@ -1099,23 +2296,20 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 							      0, NULL, 0);
 		}
 		if (NULL == c) {
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			if (control_send_reply(fd, &out) < 0)
 				WARN("Could not send empty Response to CREATE");
 			break;
 		}
 
-		ccfg = mem_new(ContainerConfig *, 1);
+		ccfg = mem_arena_alloc(control_arena, sizeof(ContainerConfig *));
 		ccfg[0] = (ContainerConfig *)protobuf_message_new_from_textfile(
 			container_get_config_filename(c), &container_config__descriptor);
-		cuuid_str = mem_new(char *, 1);
-		cuuid_str[0] = mem_strdup(uuid_string(container_get_uuid(c)));
+		cuuid_str = mem_arena_alloc(control_arena, sizeof(char *));
+		cuuid_str[0] = mem_arena_strdup(control_arena, uuid_string(container_get_uuid(c)));
 
 		if (!ccfg[0]) {
 			ERROR("Failed to get new config for %s", cuuid_str[0]);
-			mem_free(ccfg);
-			mem_free(cuuid_str[0]);
-			mem_free(cuuid_str);
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			if (control_send_reply(fd, &out) < 0)
 				WARN("Could not send empty Response to CREATE");
 			break;
 		}
@@ -1124,13 +2318,10 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.container_configs = ccfg;
 		out.n_container_uuids = 1;
 		out.container_uuids = cuuid_str;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			WARN("Could not send container config as Response to CREATE");
 		}
-		mem_free(cuuid_str[0]);
-		mem_free(cuuid_str);
 		protobuf_free_message((ProtobufCMessage *)ccfg[0]);
-		mem_free(ccfg);
 	} break;
 
 	// Container-specific commands:
@@ -1154,13 +2345,13 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 
 		if (NULL == container) {
 			WARN("Container does not exist!");
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			if (control_send_reply(fd, &out) < 0)
 				WARN("Could not send empty Response to UPDATE_CONFIG");
 			break;
 		}
 		if (!msg->has_container_config_file) {
 			WARN("UPDATE_CONFIG without config file does not work, doing nothing...");
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			if (control_send_reply(fd, &out) < 0)
 				WARN("Could not send empty Response to UPDATE_CONFIG");
 			break;
 		}
@@ -1177,23 +2368,21 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 						      0);
 		}
 		if (res) {
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			if (control_send_reply(fd, &out) < 0)
 				WARN("Could not send empty Response to UPDATE_CONFIG");
 			break;
 		}
 
-		ccfg = mem_new(ContainerConfig *, 1);
+		ccfg = mem_arena_alloc(control_arena, sizeof(ContainerConfig *));
 		ccfg[0] = (ContainerConfig *)protobuf_message_new_from_textfile(
 			container_get_config_filename(container), &container_config__descriptor);
-		cuuid_str = mem_new(char *, 1);
-		cuuid_str[0] = mem_strdup(uuid_string(container_get_uuid(container)));
+		cuuid_str = mem_arena_alloc(control_arena, sizeof(char *));
+		cuuid_str[0] =
+			mem_arena_strdup(control_arena, uuid_string(container_get_uuid(container)));
 
 		if (!ccfg[0]) {
 			ERROR("Failed to get new config for %s", cuuid_str[0]);
-			mem_free(ccfg);
-			mem_free(cuuid_str[0]);
-			mem_free(cuuid_str);
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0)
+			if (control_send_reply(fd, &out) < 0)
 				WARN("Could not send empty Response to UPDATE_CONFIG");
 			break;
 		}
@@ -1207,13 +2396,10 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.container_configs = ccfg;
 		out.n_container_uuids = 1;
 		out.container_uuids = cuuid_str;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			WARN("Could not send container config as Response to UPDATE_CONFIG");
 		}
-		mem_free(cuuid_str[0]);
-		mem_free(cuuid_str);
 		protobuf_free_message((ProtobufCMessage *)ccfg[0]);
-		mem_free(ccfg);
 	} break;
 	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_START: {
 		if (NULL == container) {
@@ -1308,24 +2494,21 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_IFACES;
 
 		size_t n = list_length(link_list);
-		char **results = mem_new(char *, n);
+		char **results = mem_arena_alloc(control_arena, n * sizeof(char *));
 
 		for (size_t i = 0; i < n; i++) {
 			char *link_line = list_nth_data(link_list, i);
-			results[i] = mem_strdup(link_line);
+			results[i] = mem_arena_strdup(control_arena, link_line);
 		}
 
 		out.n_container_ifaces = n;
 		out.container_ifaces = results;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			WARN("Could not send container network interfaces to MDM");
 		}
 
 		// collect garbage
 		list_delete(link_list);
-		for (size_t i = 0; i < n; i++)
-			mem_free(results[i]);
-		mem_free(results);
 	} break;
 
 	case CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_PID: {
@@ -1335,11 +2518,27 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_PID;
 		out.has_container_pid = true;
 		out.container_pid = pid;
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			WARN("Could not send container PID to MDM");
 		}
 	} break;
 
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_START_TRACE: {
+		IF_NULL_RETURN(container);
+		DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_START_TRACE;
+		out.container_start_trace = container_get_start_trace_new(container);
+		if (control_send_reply(fd, &out) < 0) {
+			WARN("Could not send container start trace");
+		}
+		mem_free(out.container_start_trace);
+	} break;
+
+	case CONTROLLER_TO_DAEMON__COMMAND__GET_CONTAINER_NET_STATS: {
+		IF_NULL_RETURN(container);
+		control_handle_cmd_get_container_net_stats(container, fd);
+	} break;
+
 	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_EXEC_CMD: {
 		IF_NULL_RETURN(container);
 		TRACE("Got exec command: %s, attach PTY: %d", msg->exec_command, msg->exec_pty);
@@ -1354,7 +2553,7 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 			DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
 			out.code = DAEMON_TO_CONTROLLER__CODE__EXEC_END;
 
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+			if (control_send_reply(fd, &out) < 0) {
 				WARN("Could not send exec output to MDM");
 			}
 
@@ -1369,6 +2568,8 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 				event_io_new(container_get_console_sock_cmld(container, fd),
 					     EVENT_IO_READ | EVENT_IO_EXCEPT,
 					     control_cb_read_console, cfd);
+			// console output is bulk data, commands must not wait for it
+			event_io_set_prio(event, EVENT_PRIO_LOW);
 			event_add_io(event);
 		}
 	} break;
@@ -1399,11 +2600,28 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 		out.code = DAEMON_TO_CONTROLLER__CODE__CONTAINER_CMLD_HANDLES_PIN;
 		out.has_container_cmld_handles_pin = true;
 		out.container_cmld_handles_pin = container_get_usb_pin_entry(container);
-		if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
+		if (control_send_reply(fd, &out) < 0) {
 			WARN("Could not send container cmld handles pin info");
 		}
 	} break;
 
+	case CONTROLLER_TO_DAEMON__COMMAND__CONTAINER_SET_IO: {
+		IF_NULL_RETURN(container);
+		const ContainerIoConfig *io = msg->container_io_config;
+		if (!io) {
+			ERROR("Missing io config");
+			break;
+		}
+		container_io_config_t io_config = {
+			.weight = io->weight,
+			.read_bps = io->read_bps,
+			.write_bps = io->write_bps,
+			.read_iops = io->read_iops,
+			.write_iops = io->write_iops,
+		};
+		res = container_set_io_config(container, &io_config);
+	} break;
+
 	default:
 		WARN("Unsupported ControllerToDaemon command: %d received", msg->command);
 		if (control_send_message(CONTROL_RESPONSE_CMD_UNSUPPORTED, fd))
@@ -1411,6 +2629,259 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
 	}
 }
 
+/**
+ * Handles a single decoded ControllerToDaemon message and releases all
+ * temporaries its handler allocated from control_arena afterwards.
+ */
+static void
+control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd)
+{
+	if (!control_arena)
+		control_arena = mem_arena_new(CONTROL_ARENA_BLOCK_SIZE);
+
+	size_t mark = mem_arena_mark(control_arena);
+
+	control_current = control;
+	control_current_msg = msg;
+	control_current_replied = false;
+
+	// the client is able to decompress all further messages, including the answer
+	if (msg->has_transport_compression && msg->transport_compression && !control->zs_out) {
+		DEBUG("Compressing messages to control client %d", fd);
+		control->zs_out = protobuf_zstream_new();
+	}
+
+	control_handle_message_cmd(control, msg, fd);
+
+	// remember the request id for the answer sent once the command completed
+	if (!control_current_replied && msg->has_request_id &&
+	    control_command_is_deferrable(msg->command))
+		control_deferred_add(control, msg);
+
+	control_current = NULL;
+	control_current_msg = NULL;
+	mem_arena_reset(control_arena, mark);
+}
+
+/*
+ * Sends the LOGON_DEVICE message which introduces the device to a freshly connected MDM.
+ */
+static void
+control_remote_logon(control_t *control)
+{
+	container_t *container_c0 = cmld_containers_get_c0();
+	char *imei = container_get_imei(container_c0);
+	char *mac_address = container_get_mac_address(container_c0);
+	char *phone_number = container_get_phone_number(container_c0);
+
+	/* send LOGON_DEVICE message */
+	DEBUG("Sending LOGON_DEVICE message to remote host %s:%d", control->hostip, control->port);
+	DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
+	out.code = DAEMON_TO_CONTROLLER__CODE__LOGON_DEVICE;
+	out.has_logon_transport_compression = true;
+	out.logon_transport_compression = true;
+	if (cmld_get_device_uuid()) {
+		DEBUG("Setting uuid: %s", cmld_get_device_uuid());
+		out.device_uuid = mem_strdup(cmld_get_device_uuid());
+	}
+	if (hardware_get_name()) {
+		DEBUG("Setting hardware name: %s", hardware_get_name());
+		out.logon_hardware_name = mem_strdup(hardware_get_name());
+	}
+	if (hardware_get_serial_number()) {
+		DEBUG("Setting hardware serial number: %s", hardware_get_serial_number());
+		out.logon_hardware_serial = mem_strdup(hardware_get_serial_number());
+	}
+	if (imei) {
+		DEBUG("Setting imei: %s", imei);
+		out.logon_imei = mem_strdup(imei);
+	}
+	if (mac_address) {
+		DEBUG("Setting MAC address: %s", mac_address);
+		out.logon_mac_address = mem_strdup(mac_address);
+	}
+	if (phone_number) {
+		DEBUG("Setting phone_number: %s", phone_number);
+		out.logon_phone_number = mem_strdup(phone_number);
+	}
+	if (control_out_send(control, &out) < 0) {
+		WARN("Could not send LOGON message");
+	}
+	DEBUG("Sent LOGON message");
+	mem_free(out.device_uuid);
+	mem_free(out.logon_hardware_name);
+	mem_free(out.logon_hardware_serial);
+	mem_free(out.logon_imei);
+	mem_free(out.logon_mac_address);
+	mem_free(out.logon_phone_number);
+}
+
+/*
+ * Registers func for events on the connection of a remote control object,
+ * replacing the previous registration.
+ */
+static void
+control_remote_watch(control_t *control, unsigned events,
+		     void (*func)(int fd, unsigned events, event_io_t *io, void *data))
+{
+	if (control->client_io) {
+		event_remove_io(control->client_io);
+		event_io_free(control->client_io);
+	}
+	control->client_io = event_io_new(control->sock_client, events, func, control);
+	event_io_set_prio(control->client_io, EVENT_PRIO_HIGH);
+	event_add_io(control->client_io);
+}
+
+/*
+ * Releases the TLS state of the connection. A dropped link is the normal case
+ * on mobile networks, so the session is kept resumable even if the peer could
+ * not be notified of the closure.
+ */
+static void
+control_tls_free(control_t *control, bool notify)
+{
+	if (control->ssl) {
+		if (notify && control->connected) {
+			sigset_t old;
+			control_tls_sigpipe_block(&old);
+			SSL_shutdown(control->ssl);
+			control_tls_sigpipe_restore(&old);
+		}
+		SSL_set_shutdown(control->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		SSL_free(control->ssl);
+		control->ssl = NULL;
+	}
+	mem_free(control->tls_rbuf);
+	control->tls_rbuf = NULL;
+	control->tls_rbuf_len = 0;
+	control->tls_rbuf_size = 0;
+}
+
+/*
+ * Closes the connection of a remote control object, if any. If graceful is set,
+ * the peer is notified, otherwise the connection is considered broken.
+ */
+static void
+control_remote_close(control_t *control, bool graceful)
+{
+	if (control->client_io) {
+		event_remove_io(control->client_io);
+		event_io_free(control->client_io);
+		control->client_io = NULL;
+	}
+	if (control->sock_client >= 0) {
+		control_client_reset(control);
+		control_tls_free(control, graceful);
+		if (graceful && shutdown(control->sock_client, SHUT_RDWR) == -1)
+			WARN_ERRNO("Shutting down the control socket failed");
+		if (close(control->sock_client) == -1)
+			WARN_ERRNO("Closing the control socket failed");
+		control->sock_client = -1;
+	}
+	control->connected = false;
+}
+
+/*
+ * Handles all complete messages in the buffer of decrypted data.
+ */
+static int
+control_tls_parse(control_t *control)
+{
+	SSL *ssl = control->ssl;
+	size_t off = 0;
+
+	// stop if a handler closed the connection
+	while (control->ssl == ssl && control->tls_rbuf_len - off >= sizeof(uint32_t)) {
+		uint32_t len;
+		memcpy(&len, control->tls_rbuf + off, sizeof(len));
+		len = ntohl(len);
+
+		bool compressed = len & PROTOBUF_FRAME_COMPRESSED;
+		len &= ~PROTOBUF_FRAME_COMPRESSED;
+		if (!(len < PROTOBUF_MAX_MESSAGE_SIZE)) {
+			ERROR("Protocol violation by remote host %s, message of %u bytes",
+			      control->hostip, len);
+			return -1;
+		}
+		if (control->tls_rbuf_len - off - sizeof(uint32_t) < len)
+			break;
+
+		uint8_t *packed = control->tls_rbuf + off + sizeof(uint32_t);
+		uint8_t *inflated = NULL;
+		off += sizeof(uint32_t) + len;
+		if (compressed) {
+			inflated = protobuf_zstream_inflate_new(control_zs_in(control), packed, len,
+								&len);
+			IF_NULL_RETVAL(inflated, -1);
+			packed = inflated;
+		}
+
+		ControllerToDaemon *msg = (ControllerToDaemon *)protobuf_unpack_message(
+			&controller_to_daemon__descriptor, packed, len);
+		mem_free(inflated);
+		if (!msg) {
+			WARN("Failed to decode ControllerToDaemon protobuf message!");
+			return -1;
+		}
+		control_handle_message(control, msg, control->sock_client);
+		TRACE("Handled control connection %d", control->sock_client);
+		protobuf_free_message((ProtobufCMessage *)msg);
+	}
+
+	if (control->ssl == ssl && off > 0) {
+		control->tls_rbuf_len -= off;
+		memmove(control->tls_rbuf, control->tls_rbuf + off, control->tls_rbuf_len);
+	}
+	return 0;
+}
+
+/*
+ * Reads everything the TLS peer has sent so far and handles the complete messages.
+ *
+ * @return 0 if the connection is still usable or was closed by a handler, -1 otherwise
+ */
+static int
+control_tls_recv(control_t *control)
+{
+	SSL *ssl = control->ssl;
+
+	while (control->ssl == ssl) {
+		if (control->tls_rbuf_size - control->tls_rbuf_len < CONTROL_TLS_READ_SIZE) {
+			control->tls_rbuf_size = control->tls_rbuf_len + CONTROL_TLS_READ_SIZE;
+			control->tls_rbuf =
+				mem_renew(uint8_t, control->tls_rbuf, control->tls_rbuf_size);
+		}
+
+		sigset_t old;
+		control_tls_sigpipe_block(&old);
+		ERR_clear_error();
+		int n = SSL_read(ssl, control->tls_rbuf + control->tls_rbuf_len,
+				 control->tls_rbuf_size - control->tls_rbuf_len);
+		int err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl, n);
+		control_tls_sigpipe_restore(&old);
+
+		switch (err) {
+		case SSL_ERROR_NONE:
+			control->tls_rbuf_len += n;
+			if (control_tls_parse(control) < 0)
+				return -1;
+			break;
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+		case SSL_ERROR_ZERO_RETURN:
+			DEBUG("Remote host %s closed TLS connection", control->hostip);
+			return -1;
+		default:
+			DEBUG("TLS receive from %s failed: %s", control->hostip,
+			      ERR_error_string(ERR_get_error(), NULL));
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /**
  * Event callback for incoming data that receives a ControllerToDaemon message (remote)
  *
@@ -1423,103 +2894,181 @@ control_handle_message(control_t *control, const ControllerToDaemon *msg, int fd
  * @param data	    pointer to this control_t struct
  */
 static void
-control_cb_recv_message(int fd, unsigned events, event_io_t *io, void *data)
+control_cb_recv_message(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	control_t *control = data;
+
+	if (events & EVENT_IO_READ) {
+		if (control->ssl) {
+			if (control_tls_recv(control) == 0 &&
+			    (!control->ssl || !(events & EVENT_IO_EXCEPT)))
+				return;
+		} else {
+			ControllerToDaemon *msg =
+				(ControllerToDaemon *)protobuf_recv_message_zstream(
+					fd, &controller_to_daemon__descriptor,
+					control_zs_in(control));
+			if (msg != NULL) {
+				control_handle_message(control, msg, fd);
+				TRACE("Handled control connection %d", fd);
+				protobuf_free_message((ProtobufCMessage *)msg);
+				return;
+			}
+			if (!(events & EVENT_IO_EXCEPT))
+				WARN("Failed to receive and decode ControllerToDaemon protobuf message!");
+		}
+	}
+	TRACE("MDM Connection Error");
+	control_remote_close(control, false);
+	control_remote_reconnect(control);
+}
+
+/*
+ * Keeps the session ticket which the peer issued last, so that the next
+ * connection resumes the session instead of doing a full handshake.
+ */
+static int
+control_tls_new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+	control_t *control = SSL_get_app_data(ssl);
+
+	if (control->tls_session)
+		SSL_SESSION_free(control->tls_session);
+	control->tls_session = session;
+
+	// keep the reference
+	return 1;
+}
+
+static int
+control_tls_new(control_t *control)
+{
+	control->ssl = SSL_new(control->tls_ctx);
+	IF_NULL_RETVAL_ERROR(control->ssl, -1);
+	SSL_set_app_data(control->ssl, control);
+	// queued frames are written in pieces and may be resent from a different address
+	SSL_set_mode(control->ssl,
+		     SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	struct in6_addr ip;
+	bool ip_literal = inet_pton(AF_INET, control->hostip, &ip) == 1 ||
+			  inet_pton(AF_INET6, control->hostip, &ip) == 1;
+	X509_VERIFY_PARAM *param = SSL_get0_param(control->ssl);
+	if (ip_literal ? !X509_VERIFY_PARAM_set1_ip_asc(param, control->hostip) :
+			 !X509_VERIFY_PARAM_set1_host(param, control->hostip, 0)) {
+		ERROR("Could not set expected TLS peer %s", control->hostip);
+		return -1;
+	}
+	if (!ip_literal)
+		SSL_set_tlsext_host_name(control->ssl, control->hostip);
+
+	if (control->tls_session && !SSL_set_session(control->ssl, control->tls_session))
+		WARN("Could not resume TLS session with %s", control->hostip);
+
+	if (!SSL_set_fd(control->ssl, control->sock_client)) {
+		ERROR("Could not attach TLS to control socket %d", control->sock_client);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+control_remote_cb_connect(int fd, unsigned events, event_io_t *io, void *data);
+
+/**
+ * Continues the TLS handshake with the remote host.
+ *
+ * @return 1 if the handshake is complete, 0 if it waits for the socket, -1 on error
+ */
+static int
+control_tls_handshake(control_t *control)
+{
+	sigset_t old;
+	control_tls_sigpipe_block(&old);
+	ERR_clear_error();
+	int ret = SSL_connect(control->ssl);
+	int err = ret == 1 ? SSL_ERROR_NONE : SSL_get_error(control->ssl, ret);
+	control_tls_sigpipe_restore(&old);
+
+	switch (err) {
+	case SSL_ERROR_NONE:
+		DEBUG("TLS connection to %s established (%s)", control->hostip,
+		      SSL_session_reused(control->ssl) ? "resumed" : "full handshake");
+		return 1;
+	case SSL_ERROR_WANT_READ:
+		control_remote_watch(control, EVENT_IO_READ, control_remote_cb_connect);
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		control_remote_watch(control, EVENT_IO_WRITE, control_remote_cb_connect);
+		return 0;
+	default:
+		ERROR("TLS handshake with %s failed: %s (%s)", control->hostip,
+		      ERR_error_string(ERR_get_error(), NULL),
+		      X509_verify_cert_error_string(SSL_get_verify_result(control->ssl)));
+		// the next attempt starts over with a full handshake
+		if (control->tls_session) {
+			SSL_SESSION_free(control->tls_session);
+			control->tls_session = NULL;
+		}
+		return -1;
+	}
+}
+
+static void
+control_remote_keepalive(int fd)
+{
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &(int){ 1 }, sizeof(int)) < 0 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &(int){ CONTROL_REMOTE_KEEPIDLE },
+		       sizeof(int)) < 0 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &(int){ CONTROL_REMOTE_KEEPINTVL },
+		       sizeof(int)) < 0 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &(int){ CONTROL_REMOTE_KEEPCNT },
+		       sizeof(int)) < 0)
+		WARN_ERRNO("Could not enable TCP keepalive on control socket %d", fd);
+}
+
+/**
+ * Event callback which completes the connection to the remote host,
+ * including the TLS handshake if the connection is secured.
+ */
+static void
+control_remote_cb_connect(int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
 {
-	bool connection_error = false;
 	control_t *control = data;
 
-	if ((events & EVENT_IO_WRITE) && control->type == AF_INET) {
-		int res;
+	if (!control->ssl) {
+		int res = 0;
 		socklen_t res_len = sizeof(int);
 		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &res, &res_len) < 0) {
 			TRACE_ERRNO("getsockopt failed for socket %d", fd);
-			connection_error = true;
+			goto error;
 		}
 		if (res != 0) {
 			TRACE("res of getsockopt for %d says error %s", fd, strerror(res));
-			connection_error = true;
-		} else {
-			DEBUG("Connected to remote host %s:%d", control->hostip, control->port);
-			control->connected = true;
-			container_t *container_c0 = cmld_containers_get_c0();
-			char *imei = container_get_imei(container_c0);
-			char *mac_address = container_get_mac_address(container_c0);
-			char *phone_number = container_get_phone_number(container_c0);
-
-			/* send LOGON_DEVICE message */
-			DEBUG("Sending LOGON_DEVICE message to remote host %s:%d", control->hostip,
-			      control->port);
-			DaemonToController out = DAEMON_TO_CONTROLLER__INIT;
-			out.code = DAEMON_TO_CONTROLLER__CODE__LOGON_DEVICE;
-			if (cmld_get_device_uuid()) {
-				DEBUG("Setting uuid: %s", cmld_get_device_uuid());
-				out.device_uuid = mem_strdup(cmld_get_device_uuid());
-			}
-			if (hardware_get_name()) {
-				DEBUG("Setting hardware name: %s", hardware_get_name());
-				out.logon_hardware_name = mem_strdup(hardware_get_name());
-			}
-			if (hardware_get_serial_number()) {
-				DEBUG("Setting hardware serial number: %s",
-				      hardware_get_serial_number());
-				out.logon_hardware_serial =
-					mem_strdup(hardware_get_serial_number());
-			}
-			if (imei) {
-				DEBUG("Setting imei: %s", imei);
-				out.logon_imei = mem_strdup(imei);
-			}
-			if (mac_address) {
-				DEBUG("Setting MAC address: %s", mac_address);
-				out.logon_mac_address = mem_strdup(mac_address);
-			}
-			if (phone_number) {
-				DEBUG("Setting phone_number: %s", phone_number);
-				out.logon_phone_number = mem_strdup(phone_number);
-			}
-			if (protobuf_send_message(fd, (ProtobufCMessage *)&out) < 0) {
-				WARN("Could not send LOGON message");
-			}
-			DEBUG("Sent LOGON message");
-			mem_free(out.device_uuid);
-			mem_free(out.logon_hardware_name);
-			mem_free(out.logon_hardware_serial);
-			mem_free(out.logon_imei);
-			mem_free(out.logon_mac_address);
-			mem_free(out.logon_phone_number);
-
-			/* remove write watch */
-			event_remove_io(io);
-			event_io_free(io);
-			io = event_io_new(control->sock_client, EVENT_IO_READ,
-					  control_cb_recv_message, control);
-			event_add_io(io);
-		}
-	} else if (events & EVENT_IO_READ) {
-		ControllerToDaemon *msg = (ControllerToDaemon *)protobuf_recv_message(
-			fd, &controller_to_daemon__descriptor);
-		if (msg != NULL) {
-			control_handle_message(control, msg, fd);
-			TRACE("Handled control connection %d", fd);
-			protobuf_free_message((ProtobufCMessage *)msg);
-			return;
-		}
-		if (!(events & EVENT_IO_EXCEPT)) {
-			WARN("Failed to receive and decode ControllerToDaemon protobuf message!");
-			if (control->type == AF_INET)
-				connection_error = true;
+			goto error;
 		}
+		DEBUG("Connected to remote host %s:%d", control->hostip, control->port);
+		control_remote_keepalive(fd);
+
+		if (control->tls_ctx && control_tls_new(control) < 0)
+			goto error;
 	}
-	if ((events & EVENT_IO_EXCEPT) || connection_error) {
-		TRACE("MDM Connection Error: %d", (int)connection_error);
-		event_remove_io(io);
-		event_io_free(io);
-		close(fd);
-		control->sock_client = -1;
-		if (control->type == AF_INET)
-			control_remote_reconnect(control);
-		return;
+
+	if (control->ssl) {
+		int ret = control_tls_handshake(control);
+		IF_TRUE_GOTO(ret < 0, error);
+		IF_TRUE_RETURN(ret == 0);
 	}
+
+	control->connected = true;
+	control_remote_watch(control, EVENT_IO_READ, control_cb_recv_message);
+	control_remote_logon(control);
+	return;
+
+error:
+	TRACE("MDM Connection Error");
+	control_remote_close(control, false);
+	control_remote_reconnect(control);
 }
 
 /**
@@ -1543,8 +3092,8 @@ control_cb_recv_message_local(int fd, unsigned events, event_io_t *io, void *dat
 	 * Thus, we have to read pending date before handling the EXCEPT event.
 	 */
 	if (events & EVENT_IO_READ) {
-		ControllerToDaemon *msg = (ControllerToDaemon *)protobuf_recv_message(
-			fd, &controller_to_daemon__descriptor);
+		ControllerToDaemon *msg = (ControllerToDaemon *)protobuf_recv_message_zstream(
+			fd, &controller_to_daemon__descriptor, control_zs_in(control));
 		// close connection if client EOF, or protocol parse error
 		IF_NULL_GOTO_TRACE(msg, connection_err);
 		control_handle_message(control, msg, fd);
@@ -1562,6 +3111,7 @@ connection_err:
 	input_clean_pin_entry();
 	event_remove_io(io);
 	event_io_free(io);
+	control_client_reset(control);
 	if (close(fd) < 0)
 		WARN_ERRNO("Failed to close connected control socket");
 	control->sock_client = -1;
@@ -1600,6 +3150,8 @@ control_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
 		WARN("Could not accept control connection");
 		return;
 	}
+	// a queue left for a previous client must not be written to the new one
+	control_client_reset(control);
 	control->sock_client = cfd;
 	DEBUG("Accepted control connection %d", cfd);
 
@@ -1607,6 +3159,7 @@ control_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
 
 	event_io_t *event =
 		event_io_new(cfd, EVENT_IO_READ, control_cb_recv_message_local, control);
+	event_io_set_prio(event, EVENT_PRIO_HIGH);
 	DEBUG("local control client connected on fd=%d", cfd);
 
 	event_add_io(event);
@@ -1633,6 +3186,8 @@ control_remote_reconnect_cb(UNUSED event_timer_t *timer, void *data)
 	if (-1 == res) {
 		DEBUG_ERRNO("Connecting failed to remote host %s:%d", control->hostip,
 			    control->port);
+		close(control->sock_client);
+		control->sock_client = -1;
 		return;
 	}
 
@@ -1640,12 +3195,8 @@ control_remote_reconnect_cb(UNUSED event_timer_t *timer, void *data)
 	event_timer_free(control->reconnect_timer);
 	control->reconnect_timer = NULL;
 
-	/* connection succeeded so register socket for receiving data */
-	fd_make_non_blocking(control->sock_client);
-
-	event_io_t *event = event_io_new(control->sock_client, EVENT_IO_READ | EVENT_IO_WRITE,
-					 control_cb_recv_message, control);
-	event_add_io(event);
+	/* wait for the connection to complete, including the TLS handshake if enabled */
+	control_remote_watch(control, EVENT_IO_WRITE, control_remote_cb_connect);
 }
 /**
  * helper function to register timer for reconnect handler
@@ -1665,6 +3216,7 @@ control_remote_reconnect(control_t *control)
 	}
 	control->reconnect_timer = event_timer_new(CONTROL_REMOTE_RECONNECT_INTERVAL, -1,
 						   control_remote_reconnect_cb, control);
+	event_timer_set_slack(control->reconnect_timer, CONTROL_REMOTE_RECONNECT_SLACK);
 	event_add_timer(control->reconnect_timer);
 
 	return 0;
@@ -1681,10 +3233,14 @@ control_new(int sock, bool privileged)
 	control_t *control = mem_new0(control_t, 1);
 	control->sock = sock;
 	control->sock_client = -1;
+	control->out_fd = -1;
 	control->type = AF_UNIX;
 	control->privileged = privileged;
 
+	control_list = list_append(control_list, control);
+
 	event_io_t *event = event_io_new(sock, EVENT_IO_READ, control_cb_accept, control);
+	event_io_set_prio(event, EVENT_PRIO_HIGH);
 	event_add_io(event);
 
 	return control;
@@ -1716,6 +3272,7 @@ control_remote_new(const char *hostip, const char *service)
 	control->connected = false;
 	control->sock = -1;
 	control->sock_client = -1;
+	control->out_fd = -1;
 	control->privileged = true;
 
 	control->reconnect_timer = NULL;
@@ -1725,11 +3282,30 @@ control_remote_new(const char *hostip, const char *service)
 	return control;
 }
 
+int
+control_remote_set_tls(control_t *control, const char *ca_file, const char *cert_file,
+		       const char *key_file, bool tpmkey)
+{
+	ASSERT(control);
+	ASSERT(control->type == AF_INET);
+	ASSERT(!control->tls_ctx);
+
+	control->tls_ctx = ssl_tls_client_ctx_new(ca_file, cert_file, key_file, tpmkey);
+	IF_NULL_RETVAL(control->tls_ctx, -1);
+
+	// sessions are kept by the control object, see control_tls_new_session_cb()
+	SSL_CTX_set_session_cache_mode(control->tls_ctx,
+				       SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(control->tls_ctx, control_tls_new_session_cb);
+
+	return 0;
+}
+
 int
 control_remote_connect(control_t *control)
 {
 	/* handle connection to remote host asynchronously */
-	if (!control->connected && !control->reconnect_timer)
+	if (!control_remote_connecting(control))
 		return control_remote_reconnect(control);
 	else {
 		DEBUG("Tried to connect remote control socket which already attempts a connection");
@@ -1740,7 +3316,7 @@ control_remote_connect(control_t *control)
 bool
 control_remote_connecting(control_t *control)
 {
-	return (control->connected || control->reconnect_timer);
+	return (control->connected || control->reconnect_timer || control->client_io);
 }
 
 void
@@ -1751,28 +3327,28 @@ control_remote_disconnect(control_t *control)
 		event_timer_free(control->reconnect_timer);
 		control->reconnect_timer = NULL;
 	}
-	if (control->sock_client >= 0) {
+	if (control->sock_client >= 0)
 		DEBUG("Shutting down control socket");
-		if (shutdown(control->sock_client, SHUT_RDWR) == -1) {
-			WARN_ERRNO("Shutting down the control socket failed");
-		}
-		if (close(control->sock_client) == -1) {
-			WARN_ERRNO("Closing the control socket failed");
-		}
-	}
-	control->connected = false;
+	control_remote_close(control, true);
 }
 
 void
 control_free(control_t *control)
 {
 	ASSERT(control);
-	if (control->sock_client >= 0) {
+	if (control->type == AF_INET) {
+		control_remote_close(control, true);
+	} else if (control->sock_client >= 0) {
+		control_client_reset(control);
 		shutdown(control->sock_client, SHUT_RDWR);
 		close(control->sock_client);
 	}
 	if (control->hostip)
 		mem_free(control->hostip);
+	if (control->tls_session)
+		SSL_SESSION_free(control->tls_session);
+	if (control->tls_ctx)
+		SSL_CTX_free(control->tls_ctx);
 
 	if (control->reconnect_timer) {
 		event_remove_timer(control->reconnect_timer);
@@ -106,6 +106,19 @@ control_local_new(const char *path);
 control_t *
 control_remote_new(const char *hostip, const char *service);
 
+/**
+ * Secures the connection of a remote control object by TLS, authenticated with the
+ * given client certificate and key. The peer has to be certified by the CA in ca_file.
+ * Sessions are resumed on reconnects, so that a flaky link does not cost a full
+ * handshake each time. Must be called before control_remote_connect().
+ *
+ * @param tpmkey indicates that key_file designates a TPM-key, see ssl_init()
+ * @return 0 on success, -1 on error
+ */
+int
+control_remote_set_tls(control_t *control, const char *ca_file, const char *cert_file,
+		       const char *key_file, bool tpmkey);
+
 /**
  * Connects a remote control object to the host:ip provided during object creation.
  * Automatically retries the connection if it does not succeed until the corresponding
@@ -137,6 +150,12 @@ control_free(control_t *control);
 int
 control_get_client_sock(control_t *control);
 
+/**
+ * Returns the listening socket of a local control object, -1 for a remote one.
+ */
+int
+control_get_sock(const control_t *control);
+
 /**
  * Sends a protobuf message to the specified fd.
  */
@@ -0,0 +1,479 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "delta.h"
+#include "download.h"
+#include "hash.h"
+
+#include "common/chunk.h"
+#include "common/event.h"
+#include "common/fd.h"
+#include "common/file.h"
+#include "common/macro.h"
+#include "common/mem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DELTA_FILE_SUFFIX ".delta"
+#define DELTA_INDEX_HEADER "# cml chunk index v1"
+#define DELTA_INDEX_MAXLEN (16 * 1024 * 1024)
+#define DELTA_READ_SIZE (1024 * 1024)
+// missing chunks closer to each other than this are fetched by one range request
+#define DELTA_RANGE_GAP (256 * 1024)
+
+typedef struct delta_range {
+	uint64_t start;
+	uint64_t len;
+} delta_range_t;
+
+typedef struct delta {
+	char *url;
+	char *file;
+	char *base;
+	char *index_file;
+	char *index_sha256;
+	char *delta_file;
+	delta_range_t *ranges;
+	size_t ranges_count;
+	size_t pending;
+	uint64_t size;
+	uint64_t reused;
+	bool failed;
+	delta_callback_t cb;
+	void *data;
+} delta_t;
+
+static void
+delta_free(delta_t *delta)
+{
+	mem_free(delta->url);
+	mem_free(delta->file);
+	mem_free(delta->base);
+	mem_free(delta->index_file);
+	mem_free(delta->index_sha256);
+	mem_free(delta->delta_file);
+	mem_free(delta->ranges);
+	mem_free(delta);
+}
+
+static void
+delta_finish(delta_t *delta, bool success)
+{
+	if (success && rename(delta->delta_file, delta->file) < 0) {
+		WARN_ERRNO("Could not rename %s to %s", delta->delta_file, delta->file);
+		success = false;
+	}
+	if (!success && unlink(delta->delta_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", delta->delta_file);
+	if (unlink(delta->index_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", delta->index_file);
+
+	delta->cb(success, delta->data);
+	delta_free(delta);
+}
+
+static int
+delta_chunk_cmp(const void *a, const void *b)
+{
+	return strcmp(((const delta_chunk_t *)a)->sha256, ((const delta_chunk_t *)b)->sha256);
+}
+
+static void
+delta_chunk_append(delta_chunk_t **chunks, size_t *count, const char *sha256, uint64_t offset,
+		   uint64_t len)
+{
+	// grow in steps of powers of two
+	if (!(*count & (*count - 1)))
+		*chunks = mem_renew(delta_chunk_t, *chunks, *count ? *count * 2 : 1);
+
+	delta_chunk_t *c = &(*chunks)[(*count)++];
+	strncpy(c->sha256, sha256, sizeof(c->sha256) - 1);
+	c->sha256[sizeof(c->sha256) - 1] = '\0';
+	c->offset = offset;
+	c->len = len;
+}
+
+/*
+ * Checks the chunk index against its digest from the signed GuestOS config.
+ */
+static bool
+delta_index_verify(const char *index_file, const char *buf, const char *index_sha256)
+{
+	char *sha256 = NULL;
+	bool ret = false;
+
+	hash_stream_t *hs = hash_stream_new(HASH_SHA256);
+	IF_NULL_RETVAL(hs, false);
+	if (hash_stream_update(hs, buf, strlen(buf)) < 0 ||
+	    hash_stream_final(hs, NULL, &sha256) < 0)
+		goto out;
+
+	ret = !strcasecmp(sha256, index_sha256);
+	if (!ret)
+		WARN("Chunk index %s does not match its digest %s", index_file, index_sha256);
+out:
+	mem_free(sha256);
+	hash_stream_free(hs);
+	return ret;
+}
+
+/*
+ * If index_sha256 is given, the index is only used if it matches the digest.
+ */
+delta_chunk_t *
+delta_index_parse(const char *index_file, const char *index_sha256, size_t *count)
+{
+	char *buf = file_read_new(index_file, DELTA_INDEX_MAXLEN);
+	IF_NULL_RETVAL(buf, NULL);
+
+	delta_chunk_t *chunks = NULL;
+	uint64_t offset = 0;
+	char *saveptr = NULL;
+	*count = 0;
+
+	if (index_sha256 && !delta_index_verify(index_file, buf, index_sha256))
+		goto error;
+
+	char *line = strtok_r(buf, "\n", &saveptr);
+	if (!line || strcmp(line, DELTA_INDEX_HEADER)) {
+		WARN("%s is not a chunk index", index_file);
+		goto error;
+	}
+	while ((line = strtok_r(NULL, "\n", &saveptr))) {
+		char sha256[65];
+		uint64_t len;
+		if (sscanf(line, "%64[0-9a-f] %" SCNu64, sha256, &len) != 2 ||
+		    strlen(sha256) != 64 || len == 0 || len > CHUNK_SIZE_MAX) {
+			WARN("Invalid line '%s' in chunk index %s", line, index_file);
+			goto error;
+		}
+		delta_chunk_append(&chunks, count, sha256, offset, len);
+		offset += len;
+	}
+	if (!*count) {
+		WARN("Chunk index %s is empty", index_file);
+		goto error;
+	}
+
+	mem_free(buf);
+	return chunks;
+error:
+	mem_free(chunks);
+	mem_free(buf);
+	return NULL;
+}
+
+/*
+ * Chunks the base image, the returned chunks are sorted by their digests.
+ */
+static delta_chunk_t *
+delta_base_chunks(const char *base, size_t *count)
+{
+	delta_chunk_t *chunks = NULL;
+	chunker_t *chunker = chunker_new();
+	hash_stream_t *hs = NULL;
+	uint8_t *buf = mem_alloc(DELTA_READ_SIZE);
+	uint64_t offset = 0, len = 0;
+	ssize_t n;
+	*count = 0;
+
+	int fd = open(base, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		WARN_ERRNO("Could not open base image %s", base);
+		goto error;
+	}
+
+	while ((n = read(fd, buf, DELTA_READ_SIZE)) > 0) {
+		for (size_t pos = 0; pos < (size_t)n;) {
+			bool boundary;
+			size_t scanned = chunker_scan(chunker, buf + pos, n - pos, &boundary);
+
+			if (!hs)
+				hs = hash_stream_new(HASH_SHA256);
+			IF_NULL_GOTO_ERROR(hs, error);
+			IF_TRUE_GOTO_ERROR(hash_stream_update(hs, buf + pos, scanned) < 0, error);
+			pos += scanned;
+			len += scanned;
+			if (!boundary)
+				continue;
+
+			char *sha256 = NULL;
+			IF_TRUE_GOTO_ERROR(hash_stream_final(hs, NULL, &sha256) < 0, error);
+			delta_chunk_append(&chunks, count, sha256, offset, len);
+			mem_free(sha256);
+			hash_stream_free(hs);
+			hs = NULL;
+			offset += len;
+			len = 0;
+		}
+	}
+	if (n < 0) {
+		WARN_ERRNO("Could not read base image %s", base);
+		goto error;
+	}
+	// the end of the image always ends the last chunk
+	if (len) {
+		char *sha256 = NULL;
+		IF_TRUE_GOTO_ERROR(hash_stream_final(hs, NULL, &sha256) < 0, error);
+		delta_chunk_append(&chunks, count, sha256, offset, len);
+		mem_free(sha256);
+	}
+
+	if (chunks)
+		qsort(chunks, *count, sizeof(delta_chunk_t), delta_chunk_cmp);
+	goto out;
+error:
+	mem_free(chunks);
+	*count = 0;
+out:
+	if (hs)
+		hash_stream_free(hs);
+	if (fd >= 0)
+		close(fd);
+	mem_free(buf);
+	chunker_free(chunker);
+	return chunks;
+}
+
+static void
+delta_range_add(delta_t *delta, const delta_chunk_t *c)
+{
+	delta_range_t *last = delta->ranges_count ? &delta->ranges[delta->ranges_count - 1] : NULL;
+
+	if (last && c->offset - (last->start + last->len) <= DELTA_RANGE_GAP) {
+		last->len = c->offset + c->len - last->start;
+		return;
+	}
+
+	if (!(delta->ranges_count & (delta->ranges_count - 1)))
+		delta->ranges = mem_renew(delta_range_t, delta->ranges,
+					  delta->ranges_count ? delta->ranges_count * 2 : 1);
+	delta->ranges[delta->ranges_count].start = c->offset;
+	delta->ranges[delta->ranges_count].len = c->len;
+	delta->ranges_count++;
+}
+
+/*
+ * Creates the delta file with the size of the new image, copies all chunks
+ * found in the base image into it and collects the ranges still missing.
+ * Runs in its own thread, since it reads the complete base image.
+ */
+static int
+delta_prepare(delta_t *delta)
+{
+	int ret = -1;
+	size_t index_count, base_count;
+	int fd = -1, fd_base = -1;
+	char *buf = NULL;
+
+	delta_chunk_t *index =
+		delta_index_parse(delta->index_file, delta->index_sha256, &index_count);
+	IF_NULL_RETVAL(index, -1);
+	delta_chunk_t *base = delta_base_chunks(delta->base, &base_count);
+	IF_NULL_GOTO_ERROR(base, out);
+
+	delta->size = index[index_count - 1].offset + index[index_count - 1].len;
+
+	fd_base = open(delta->base, O_RDONLY | O_CLOEXEC);
+	if (fd_base < 0) {
+		WARN_ERRNO("Could not open base image %s", delta->base);
+		goto out;
+	}
+	fd = open(delta->delta_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		WARN_ERRNO("Could not create %s", delta->delta_file);
+		goto out;
+	}
+	if (ftruncate(fd, delta->size) < 0) {
+		WARN_ERRNO("Could not resize %s to %" PRIu64 " bytes", delta->delta_file,
+			   delta->size);
+		goto out;
+	}
+
+	buf = mem_alloc(CHUNK_SIZE_MAX);
+	for (size_t i = 0; i < index_count; i++) {
+		delta_chunk_t *c = &index[i];
+		delta_chunk_t *b =
+			bsearch(c, base, base_count, sizeof(delta_chunk_t), delta_chunk_cmp);
+
+		if (!b || b->len != c->len) {
+			delta_range_add(delta, c);
+			continue;
+		}
+		if (lseek(fd_base, b->offset, SEEK_SET) < 0 || lseek(fd, c->offset, SEEK_SET) < 0 ||
+		    fd_read(fd_base, buf, b->len) != (int)b->len ||
+		    fd_write(fd, buf, c->len) != (int)c->len) {
+			WARN_ERRNO("Could not copy chunk at %" PRIu64 " to %s", c->offset,
+				   delta->delta_file);
+			goto out;
+		}
+		delta->reused += c->len;
+	}
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	if (fd_base >= 0)
+		close(fd_base);
+	mem_free(buf);
+	mem_free(base);
+	mem_free(index);
+	return ret;
+}
+
+static void
+delta_download_done(delta_t *delta)
+{
+	if (--delta->pending > 0)
+		return;
+
+	if (!delta->failed)
+		INFO("Assembled %s from %" PRIu64 " bytes of %s and %zu ranges of %s", delta->file,
+		     delta->reused, delta->base, delta->ranges_count, delta->url);
+	delta_finish(delta, !delta->failed);
+}
+
+static void
+delta_cb_range(download_t *dl, bool success, void *data)
+{
+	delta_t *delta = data;
+	ASSERT(delta);
+
+	if (!success) {
+		WARN("Download of a range of %s failed", download_get_url(dl));
+		delta->failed = true;
+	}
+	download_free(dl);
+	delta_download_done(delta);
+}
+
+static void
+delta_prepared_cb(void *data)
+{
+	delta_t *delta = data;
+
+	if (delta->failed) {
+		delta_finish(delta, false);
+		return;
+	}
+
+	DEBUG("Reusing %" PRIu64 " of %" PRIu64 " bytes of %s, downloading %zu ranges",
+	      delta->reused, delta->size, delta->file, delta->ranges_count);
+
+	// hold a reference while starting the downloads
+	delta->pending = 1;
+	for (size_t i = 0; i < delta->ranges_count; i++) {
+		download_t *dl = download_new(delta->url, delta->delta_file, delta_cb_range, delta);
+		download_set_range(dl, delta->ranges[i].start, delta->ranges[i].len);
+		if (download_start(dl) < 0) {
+			ERROR("Failed to start download for %s", download_get_url(dl));
+			download_free(dl);
+			delta->failed = true;
+			break;
+		}
+		delta->pending++;
+	}
+	delta_download_done(delta);
+}
+
+static void *
+delta_prepare_main(void *arg)
+{
+	delta_t *delta = arg;
+
+	delta->failed = delta_prepare(delta) < 0;
+	if (event_base_post(event_base_main_get(), &delta_prepared_cb, delta) < 0) {
+		ERROR("Could not deliver delta of %s to main loop", delta->file);
+		delta_free(delta);
+	}
+
+	return NULL;
+}
+
+static void
+delta_cb_index(download_t *dl, bool success, void *data)
+{
+	delta_t *delta = data;
+	ASSERT(delta);
+
+	download_free(dl);
+	if (!success) {
+		DEBUG("No chunk index available for %s", delta->url);
+		delta_finish(delta, false);
+		return;
+	}
+
+	// the thread must not receive process signals, those are handled by the main loop
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t thread;
+	int ret = pthread_create(&thread, NULL, &delta_prepare_main, delta);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		errno = ret;
+		WARN_ERRNO("Could not start delta thread for %s", delta->file);
+		delta_finish(delta, false);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+int
+delta_fetch(const char *url, const char *file, const char *base, const char *index_sha256,
+	    delta_callback_t cb, void *data)
+{
+	ASSERT(url);
+	ASSERT(file);
+	ASSERT(base);
+	ASSERT(cb);
+
+	delta_t *delta = mem_new0(delta_t, 1);
+	delta->url = mem_strdup(url);
+	delta->file = mem_strdup(file);
+	delta->base = mem_strdup(base);
+	delta->index_file = mem_printf("%s" DELTA_INDEX_SUFFIX, file);
+	delta->index_sha256 = index_sha256 ? mem_strdup(index_sha256) : NULL;
+	delta->delta_file = mem_printf("%s" DELTA_FILE_SUFFIX, file);
+	delta->cb = cb;
+	delta->data = data;
+
+	char *index_url = mem_printf("%s" DELTA_INDEX_SUFFIX, url);
+	download_t *dl = download_new(index_url, delta->index_file, delta_cb_index, delta);
+	mem_free(index_url);
+	if (download_start(dl) < 0) {
+		download_free(dl);
+		delta_free(delta);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file delta.h
+ *
+ * Delta updates of images. Along with an image, the update server provides
+ * an index of its content defined chunks (see common/chunk.h) at
+ * <url>.chunks, a text file starting with the line "# cml chunk index v1"
+ * followed by one line "<sha256> <length>" per chunk in the order of the image.
+ * The chunks which are also found in a local base image, usually the same
+ * image of the previous version of a GuestOS, are copied from it and only the
+ * remaining ranges of the image are downloaded by range requests.
+ *
+ * The assembled file is not verified here, this is up to the caller who knows
+ * the expected digest of the image anyway. If the signed GuestOS config holds
+ * the digest of the chunk index, an index not matching it is rejected before
+ * any chunk is taken from the base image.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_INDEX_SUFFIX ".chunks"
+
+/**
+ * A chunk of an image as listed in its chunk index.
+ */
+typedef struct delta_chunk {
+	char sha256[65];
+	uint64_t offset;
+	uint64_t len;
+} delta_chunk_t;
+
+/**
+ * Parses a chunk index, the offsets of the chunks follow from their order.
+ * @param index_file the downloaded chunk index
+ * @param index_sha256 the expected sha256 of the index, NULL if unknown
+ * @param count returns the number of chunks
+ * @return the chunks in the order of the image, NULL on error
+ */
+delta_chunk_t *
+delta_index_parse(const char *index_file, const char *index_sha256, size_t *count);
+
+/**
+ * Callback type for functions called after a delta update has been completed/aborted.
+ */
+typedef void (*delta_callback_t)(bool success, void *data);
+
+/**
+ * Starts to assemble file from the image at url and the local image base.
+ * The file is assembled in <file>.delta and only renamed to file on success.
+ * If the server provides no chunk index or something else fails, the callback
+ * reports an error and the caller should fall back to a complete download.
+ * @param url the URL of the image
+ * @param file the file to assemble the image in
+ * @param base the local image to take the common chunks from
+ * @param index_sha256 the expected sha256 of the chunk index, NULL if unknown
+ * @param cb the callback to call after the update is finished/aborted
+ * @param data custom parameter passed to the callback
+ * @return 0 if the update has been started, -1 otherwise
+ */
+int
+delta_fetch(const char *url, const char *file, const char *base, const char *index_sha256,
+	    delta_callback_t cb, void *data);
+
+#endif /* DELTA_H */
@@ -30,6 +30,8 @@
 #include "common/protobuf.h"
 #include "common/uuid.h"
 
+#include "hash.h"
+
 struct device_config {
 	char *file;
 
@@ -50,8 +52,29 @@ device_config_new(const char *path)
 		file = mem_strdup(path);
 		DEBUG("Loading device config from \"%s\".", file);
 
-		cfg = (DeviceConfig *)protobuf_message_new_from_textfile(
-			file, &device_config__descriptor);
+		/*
+		 * The unsigned device config is cached in binary form, bound to its
+		 * digest. The cache is not authenticated, as forging it gains nothing
+		 * over editing the device config itself.
+		 */
+		const char *const files[] = { file };
+		char *digest = hash_files_digest_new(1, files);
+		char *cache_file = mem_printf("%s" PROTOBUF_CACHEFILE_SUFFIX, file);
+
+		if (digest)
+			cfg = (DeviceConfig *)protobuf_message_new_from_cachefile(
+				cache_file, &device_config__descriptor, digest, NULL);
+		if (!cfg) {
+			cfg = (DeviceConfig *)protobuf_message_new_from_textfile(
+				file, &device_config__descriptor);
+			if (cfg && digest &&
+			    protobuf_message_write_to_cachefile(cache_file, (ProtobufCMessage *)cfg,
+								digest, NULL) < 0)
+				WARN("Could not cache device config \"%s\".", file);
+		}
+		mem_free(digest);
+		mem_free(cache_file);
+
 		if (!cfg) {
 			WARN("Failed loading device config from file \"%s\". Reverting to default values.",
 			     file);
@@ -249,3 +272,246 @@ device_config_get_tpm_enabled(const device_config_t *config)
 
 	return config->cfg->tpm_enabled;
 }
+
+uint32_t
+device_config_get_device_pool_size(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->device_pool_size;
+}
+
+bool
+device_config_get_cgroups_v2(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->cgroups_v2;
+}
+
+uint32_t
+device_config_get_pressure_memory_stall_ms(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->pressure_memory_stall_ms;
+}
+
+uint32_t
+device_config_get_pressure_cpu_stall_ms(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->pressure_cpu_stall_ms;
+}
+
+uint32_t
+device_config_get_pressure_io_stall_ms(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->pressure_io_stall_ms;
+}
+
+uint32_t
+device_config_get_pressure_throttle_percent(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->pressure_throttle_percent;
+}
+
+uint32_t
+device_config_get_pressure_relax_ms(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->pressure_relax_ms;
+}
+
+bool
+device_config_get_ksm_merge_containers(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->ksm_merge_containers;
+}
+
+bool
+device_config_get_cpu_placement(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->cpu_placement;
+}
+
+unsigned int
+device_config_get_boot_concurrency(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->boot_concurrency;
+}
+
+bool
+device_config_get_checkpoint_background(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->checkpoint_background;
+}
+
+unsigned int
+device_config_get_zygote_pool_size(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->zygote_pool_size;
+}
+
+unsigned int
+device_config_get_accounting_interval(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->accounting_interval;
+}
+
+bool
+device_config_get_accounting_metrics(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->accounting_metrics;
+}
+
+bool
+device_config_get_mdm_tls(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->mdm_tls;
+}
+
+const char *
+device_config_get_thin_pool_meta_dev(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->thin_pool_meta_dev;
+}
+
+const char *
+device_config_get_thin_pool_data_dev(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->thin_pool_data_dev;
+}
+
+uint32_t
+device_config_get_hibernate_zram_mb(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->hibernate_zram_mb;
+}
+
+const char *
+device_config_get_hibernate_zram_algorithm(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->hibernate_zram_algorithm;
+}
+
+bool
+device_config_get_sched_foreground_boost(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->sched_foreground_boost;
+}
+
+uint32_t
+device_config_get_sched_foreground_uclamp_min(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->sched_foreground_uclamp_min;
+}
+
+uint32_t
+device_config_get_sched_background_cpu_percent(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->sched_background_cpu_percent;
+}
+
+bool
+device_config_get_dir_storage(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->dir_storage;
+}
+
+uint32_t
+device_config_get_scrub_interval(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->scrub_interval;
+}
+
+uint32_t
+device_config_get_scrub_bandwidth(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->scrub_bandwidth;
+}
+
+bool
+device_config_get_lazy_images(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->lazy_images;
+}
+
+uint32_t
+device_config_get_peer_cache_port(const device_config_t *config)
+{
+	ASSERT(config);
+	ASSERT(config->cfg);
+
+	return config->cfg->peer_cache_port;
+}
@@ -112,4 +112,85 @@ device_config_get_audit_size(const device_config_t *config);
 
 bool
 device_config_get_tpm_enabled(const device_config_t *config);
+
+uint32_t
+device_config_get_device_pool_size(const device_config_t *config);
+
+bool
+device_config_get_cgroups_v2(const device_config_t *config);
+
+uint32_t
+device_config_get_pressure_memory_stall_ms(const device_config_t *config);
+
+uint32_t
+device_config_get_pressure_cpu_stall_ms(const device_config_t *config);
+
+uint32_t
+device_config_get_pressure_io_stall_ms(const device_config_t *config);
+
+uint32_t
+device_config_get_pressure_throttle_percent(const device_config_t *config);
+
+uint32_t
+device_config_get_pressure_relax_ms(const device_config_t *config);
+
+bool
+device_config_get_ksm_merge_containers(const device_config_t *config);
+
+bool
+device_config_get_cpu_placement(const device_config_t *config);
+
+unsigned int
+device_config_get_boot_concurrency(const device_config_t *config);
+
+bool
+device_config_get_checkpoint_background(const device_config_t *config);
+
+unsigned int
+device_config_get_zygote_pool_size(const device_config_t *config);
+
+unsigned int
+device_config_get_accounting_interval(const device_config_t *config);
+
+bool
+device_config_get_accounting_metrics(const device_config_t *config);
+
+bool
+device_config_get_mdm_tls(const device_config_t *config);
+
+const char *
+device_config_get_thin_pool_meta_dev(const device_config_t *config);
+
+const char *
+device_config_get_thin_pool_data_dev(const device_config_t *config);
+
+uint32_t
+device_config_get_hibernate_zram_mb(const device_config_t *config);
+
+const char *
+device_config_get_hibernate_zram_algorithm(const device_config_t *config);
+
+bool
+device_config_get_sched_foreground_boost(const device_config_t *config);
+
+uint32_t
+device_config_get_sched_foreground_uclamp_min(const device_config_t *config);
+
+uint32_t
+device_config_get_sched_background_cpu_percent(const device_config_t *config);
+
+bool
+device_config_get_dir_storage(const device_config_t *config);
+
+uint32_t
+device_config_get_scrub_interval(const device_config_t *config);
+
+uint32_t
+device_config_get_scrub_bandwidth(const device_config_t *config);
+
+bool
+device_config_get_lazy_images(const device_config_t *config);
+
+uint32_t
+device_config_get_peer_cache_port(const device_config_t *config);
 #endif /* DEVICE_H */
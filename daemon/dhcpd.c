@@ -0,0 +1,577 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "dhcpd.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DHCPD_SERVER_PORT 67
+#define DHCPD_CLIENT_PORT 68
+
+/* default lease time of busybox' udhcpd (10 days) */
+#define DHCPD_LEASE_TIME 864000
+
+#define DHCPD_MAGIC_COOKIE 0x63825363
+#define DHCPD_BOOTREQUEST 1
+#define DHCPD_BOOTREPLY 2
+#define DHCPD_FLAG_BROADCAST 0x8000
+
+/* DHCP message types (option 53) */
+#define DHCPDISCOVER 1
+#define DHCPOFFER 2
+#define DHCPREQUEST 3
+#define DHCPDECLINE 4
+#define DHCPACK 5
+#define DHCPNAK 6
+#define DHCPRELEASE 7
+
+/* DHCP options */
+#define DHCPD_OPT_PAD 0
+#define DHCPD_OPT_SUBNET_MASK 1
+#define DHCPD_OPT_ROUTER 3
+#define DHCPD_OPT_REQUESTED_IP 50
+#define DHCPD_OPT_LEASE_TIME 51
+#define DHCPD_OPT_MESSAGE_TYPE 53
+#define DHCPD_OPT_SERVER_ID 54
+#define DHCPD_OPT_END 255
+
+#define DHCPD_OPTIONS_LEN 312
+
+/* BOOTP message as defined in RFC 2131 */
+struct dhcpd_msg {
+	uint8_t op;
+	uint8_t htype;
+	uint8_t hlen;
+	uint8_t hops;
+	uint32_t xid;
+	uint16_t secs;
+	uint16_t flags;
+	uint32_t ciaddr;
+	uint32_t yiaddr;
+	uint32_t siaddr;
+	uint32_t giaddr;
+	uint8_t chaddr[16];
+	uint8_t sname[64];
+	uint8_t file[128];
+	uint32_t cookie;
+	uint8_t options[DHCPD_OPTIONS_LEN];
+} __attribute__((packed));
+
+/* minimal size of a BOOTP message, which clients pad their requests to */
+#define DHCPD_MSG_MIN_LEN 300
+
+struct dhcpd_packet {
+	struct iphdr ip;
+	struct udphdr udp;
+	struct dhcpd_msg msg;
+} __attribute__((packed));
+
+typedef struct {
+	uint8_t mac[ETH_ALEN];
+	time_t expires; //!< 0 if the address is free
+} dhcpd_lease_t;
+
+struct dhcpd_iface {
+	char *ifname;
+	int ifindex;
+	int sock;
+	event_io_t *event;
+	struct in_addr server_addr;
+	struct in_addr netmask;
+	struct in_addr pool_start;
+	unsigned int pool_size;
+	dhcpd_lease_t *leases; //!< lease i holds the address pool_start + i
+	bool has_static;
+	uint8_t static_mac[ETH_ALEN];
+	struct in_addr static_addr;
+};
+
+/* parsed request options */
+typedef struct {
+	int type;
+	struct in_addr requested;
+	struct in_addr server_id;
+} dhcpd_req_t;
+
+/*
+ * cBPF filter on the IP packets of the socket, which only passes unfragmented
+ * UDP packets to the server port:
+ *   if (ip.protocol != UDP || ip.frag_off & 0x1fff) drop
+ *   if (udp.dest != 67) drop
+ */
+static struct sock_filter dhcpd_filter[] = {
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct iphdr, protocol)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offsetof(struct iphdr, frag_off)),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct udphdr, dest)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, DHCPD_SERVER_PORT, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0xffff),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static time_t
+dhcpd_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static uint16_t
+dhcpd_checksum(const void *data, size_t len, uint32_t sum)
+{
+	const uint8_t *p = data;
+
+	for (; len > 1; p += 2, len -= 2)
+		sum += (p[0] << 8) | p[1];
+	if (len)
+		sum += p[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return htons(~sum & 0xffff);
+}
+
+static void
+dhcpd_parse_options(const struct dhcpd_msg *msg, size_t len, dhcpd_req_t *req)
+{
+	const uint8_t *opt = msg->options;
+	const uint8_t *end = (const uint8_t *)msg + len;
+
+	while (opt < end && *opt != DHCPD_OPT_END) {
+		if (*opt == DHCPD_OPT_PAD) {
+			opt++;
+			continue;
+		}
+		if (opt + 2 > end || opt + 2 + opt[1] > end)
+			break;
+
+		const uint8_t *val = opt + 2;
+		switch (opt[0]) {
+		case DHCPD_OPT_MESSAGE_TYPE:
+			if (opt[1] == 1)
+				req->type = val[0];
+			break;
+		case DHCPD_OPT_REQUESTED_IP:
+			if (opt[1] == 4)
+				memcpy(&req->requested, val, 4);
+			break;
+		case DHCPD_OPT_SERVER_ID:
+			if (opt[1] == 4)
+				memcpy(&req->server_id, val, 4);
+			break;
+		default:
+			break;
+		}
+		opt += 2 + opt[1];
+	}
+}
+
+static struct in_addr
+dhcpd_lease_addr(const dhcpd_iface_t *iface, unsigned int i)
+{
+	struct in_addr addr = { .s_addr = htonl(ntohl(iface->pool_start.s_addr) + i) };
+	return addr;
+}
+
+/**
+ * Returns the index of the pool address addr or -1 if addr is not part of the pool.
+ */
+static int
+dhcpd_lease_index(const dhcpd_iface_t *iface, struct in_addr addr)
+{
+	uint32_t i = ntohl(addr.s_addr) - ntohl(iface->pool_start.s_addr);
+	return i < iface->pool_size ? (int)i : -1;
+}
+
+static bool
+dhcpd_is_static(const dhcpd_iface_t *iface, const uint8_t *mac)
+{
+	return iface->has_static && !memcmp(iface->static_mac, mac, ETH_ALEN);
+}
+
+/**
+ * Checks if the pool address with index i may be leased to the client mac.
+ */
+static bool
+dhcpd_lease_is_available(const dhcpd_iface_t *iface, unsigned int i, const uint8_t *mac)
+{
+	const dhcpd_lease_t *lease = &iface->leases[i];
+
+	if (iface->has_static && dhcpd_lease_addr(iface, i).s_addr == iface->static_addr.s_addr)
+		return false;
+	if (lease->expires && lease->expires > dhcpd_now())
+		return !memcmp(lease->mac, mac, ETH_ALEN);
+	return true;
+}
+
+/**
+ * Looks up the address for the client mac, preferring its static lease, its
+ * current lease and the requested address, in this order.
+ * @return the address or INADDR_ANY if the pool is exhausted
+ */
+static struct in_addr
+dhcpd_lease_find(const dhcpd_iface_t *iface, const uint8_t *mac, struct in_addr requested)
+{
+	struct in_addr none = { .s_addr = INADDR_ANY };
+	int free_index = -1;
+
+	if (dhcpd_is_static(iface, mac))
+		return iface->static_addr;
+
+	for (unsigned int i = 0; i < iface->pool_size; i++) {
+		const dhcpd_lease_t *lease = &iface->leases[i];
+		if (lease->expires && !memcmp(lease->mac, mac, ETH_ALEN) &&
+		    dhcpd_lease_is_available(iface, i, mac))
+			return dhcpd_lease_addr(iface, i);
+		if (free_index < 0 && dhcpd_lease_is_available(iface, i, mac))
+			free_index = i;
+	}
+
+	int i = dhcpd_lease_index(iface, requested);
+	if (i >= 0 && dhcpd_lease_is_available(iface, i, mac))
+		return requested;
+
+	return free_index < 0 ? none : dhcpd_lease_addr(iface, free_index);
+}
+
+/**
+ * Binds the address to the client mac for lease_time seconds, 0 releases it.
+ * Returns false if the address can not be leased to the client.
+ */
+static bool
+dhcpd_lease_bind(dhcpd_iface_t *iface, const uint8_t *mac, struct in_addr addr, time_t lease_time)
+{
+	if (dhcpd_is_static(iface, mac))
+		return addr.s_addr == iface->static_addr.s_addr;
+
+	int i = dhcpd_lease_index(iface, addr);
+	if (i < 0 || !dhcpd_lease_is_available(iface, i, mac))
+		return false;
+
+	memcpy(iface->leases[i].mac, mac, ETH_ALEN);
+	iface->leases[i].expires = lease_time ? dhcpd_now() + lease_time : 0;
+	return true;
+}
+
+static uint8_t *
+dhcpd_add_option(uint8_t *opt, uint8_t code, const void *val, uint8_t len)
+{
+	opt[0] = code;
+	opt[1] = len;
+	memcpy(opt + 2, val, len);
+	return opt + 2 + len;
+}
+
+static void
+dhcpd_send_reply(dhcpd_iface_t *iface, const struct dhcpd_msg *request, uint8_t type,
+		 struct in_addr yiaddr)
+{
+	struct dhcpd_packet pkt;
+	struct dhcpd_msg *msg = &pkt.msg;
+	uint8_t *opt = msg->options;
+
+	memset(&pkt, 0, sizeof(pkt));
+	msg->op = DHCPD_BOOTREPLY;
+	msg->htype = request->htype;
+	msg->hlen = request->hlen;
+	msg->xid = request->xid;
+	msg->flags = request->flags;
+	msg->yiaddr = yiaddr.s_addr;
+	msg->siaddr = iface->server_addr.s_addr;
+	memcpy(msg->chaddr, request->chaddr, sizeof(msg->chaddr));
+	msg->cookie = htonl(DHCPD_MAGIC_COOKIE);
+
+	opt = dhcpd_add_option(opt, DHCPD_OPT_MESSAGE_TYPE, &type, 1);
+	opt = dhcpd_add_option(opt, DHCPD_OPT_SERVER_ID, &iface->server_addr, 4);
+	if (type != DHCPNAK) {
+		uint32_t lease_time = htonl(DHCPD_LEASE_TIME);
+		opt = dhcpd_add_option(opt, DHCPD_OPT_LEASE_TIME, &lease_time, 4);
+		opt = dhcpd_add_option(opt, DHCPD_OPT_SUBNET_MASK, &iface->netmask, 4);
+		opt = dhcpd_add_option(opt, DHCPD_OPT_ROUTER, &iface->server_addr, 4);
+	}
+	*opt++ = DHCPD_OPT_END;
+
+	size_t msg_len = MAX((size_t)(opt - (uint8_t *)msg), DHCPD_MSG_MIN_LEN);
+	size_t udp_len = sizeof(struct udphdr) + msg_len;
+
+	/*
+	 * Unicast to the client, which does not have its address yet, if it
+	 * accepts this, otherwise broadcast (RFC 2131, 4.1). NAKs are always broadcast.
+	 */
+	bool broadcast = type == DHCPNAK || (ntohs(request->flags) & DHCPD_FLAG_BROADCAST);
+	uint32_t dst = broadcast ? INADDR_BROADCAST : yiaddr.s_addr;
+	if (!broadcast && request->ciaddr)
+		dst = request->ciaddr;
+
+	/* UDP checksum over the pseudo header */
+	pkt.ip.saddr = iface->server_addr.s_addr;
+	pkt.ip.daddr = dst;
+	pkt.ip.protocol = IPPROTO_UDP;
+	pkt.ip.tot_len = htons(udp_len);
+	pkt.udp.source = htons(DHCPD_SERVER_PORT);
+	pkt.udp.dest = htons(DHCPD_CLIENT_PORT);
+	pkt.udp.len = htons(udp_len);
+	pkt.udp.check = dhcpd_checksum(&pkt, sizeof(struct iphdr) + udp_len, 0);
+	if (!pkt.udp.check)
+		pkt.udp.check = 0xffff;
+
+	pkt.ip.version = 4;
+	pkt.ip.ihl = sizeof(struct iphdr) / 4;
+	pkt.ip.ttl = IPDEFTTL;
+	pkt.ip.tot_len = htons(sizeof(struct iphdr) + udp_len);
+	pkt.ip.check = dhcpd_checksum(&pkt.ip, sizeof(struct iphdr), 0);
+
+	struct sockaddr_ll dst_ll = { .sll_family = AF_PACKET,
+				      .sll_protocol = htons(ETH_P_IP),
+				      .sll_ifindex = iface->ifindex,
+				      .sll_halen = ETH_ALEN };
+	if (broadcast)
+		memset(dst_ll.sll_addr, 0xff, ETH_ALEN);
+	else
+		memcpy(dst_ll.sll_addr, request->chaddr, ETH_ALEN);
+
+	if (sendto(iface->sock, &pkt, sizeof(struct iphdr) + udp_len, 0,
+		   (struct sockaddr *)&dst_ll, sizeof(dst_ll)) < 0)
+		WARN_ERRNO("dhcpd: Could not send reply on %s", iface->ifname);
+}
+
+static void
+dhcpd_handle_request(dhcpd_iface_t *iface, const struct dhcpd_msg *msg, size_t len)
+{
+	dhcpd_req_t req = { 0 };
+	struct in_addr addr;
+
+	if (msg->op != DHCPD_BOOTREQUEST || msg->hlen != ETH_ALEN ||
+	    ntohl(msg->cookie) != DHCPD_MAGIC_COOKIE)
+		return;
+
+	dhcpd_parse_options(msg, len, &req);
+
+	/* a request for another server, e.g. of a relay in the container */
+	if (req.server_id.s_addr && req.server_id.s_addr != iface->server_addr.s_addr) {
+		TRACE("dhcpd: Ignoring message for server %s", inet_ntoa(req.server_id));
+		return;
+	}
+
+	if (!req.requested.s_addr)
+		req.requested.s_addr = msg->ciaddr;
+
+	switch (req.type) {
+	case DHCPDISCOVER:
+		addr = dhcpd_lease_find(iface, msg->chaddr, req.requested);
+		if (addr.s_addr == INADDR_ANY) {
+			WARN("dhcpd: No free address left on %s", iface->ifname);
+			return;
+		}
+		DEBUG("dhcpd: Offering %s on %s", inet_ntoa(addr), iface->ifname);
+		dhcpd_send_reply(iface, msg, DHCPOFFER, addr);
+		break;
+	case DHCPREQUEST:
+		if (!dhcpd_lease_bind(iface, msg->chaddr, req.requested, DHCPD_LEASE_TIME)) {
+			DEBUG("dhcpd: Rejecting request for %s on %s", inet_ntoa(req.requested),
+			      iface->ifname);
+			dhcpd_send_reply(iface, msg, DHCPNAK, (struct in_addr){ INADDR_ANY });
+			return;
+		}
+		INFO("dhcpd: Leased %s on %s", inet_ntoa(req.requested), iface->ifname);
+		dhcpd_send_reply(iface, msg, DHCPACK, req.requested);
+		break;
+	case DHCPDECLINE:
+	case DHCPRELEASE:
+		/* the address is taken by someone else, or not needed anymore */
+		DEBUG("dhcpd: Releasing %s on %s", inet_ntoa(req.requested), iface->ifname);
+		dhcpd_lease_bind(iface, msg->chaddr, req.requested, 0);
+		break;
+	default:
+		TRACE("dhcpd: Ignoring message type %d on %s", req.type, iface->ifname);
+		break;
+	}
+}
+
+static void
+dhcpd_cb_recv(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	dhcpd_iface_t *iface = data;
+	struct dhcpd_packet pkt;
+	struct sockaddr_ll src;
+	socklen_t src_len = sizeof(src);
+
+	if (events & EVENT_IO_EXCEPT) {
+		WARN("dhcpd: Exception on socket of %s", iface->ifname);
+		return;
+	}
+
+	ssize_t len = recvfrom(fd, &pkt, sizeof(pkt), MSG_TRUNC | MSG_DONTWAIT,
+			       (struct sockaddr *)&src, &src_len);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			WARN_ERRNO("dhcpd: Could not receive on %s", iface->ifname);
+		return;
+	}
+	if (src.sll_pkttype == PACKET_OUTGOING || (size_t)len > sizeof(pkt))
+		return;
+
+	/* the filter guarantees an unfragmented udp packet to the server port */
+	size_t ihl = pkt.ip.ihl * 4;
+	if ((size_t)len < ihl + sizeof(struct udphdr) + offsetof(struct dhcpd_msg, options) ||
+	    ihl != sizeof(struct iphdr) || ntohs(pkt.ip.tot_len) > len)
+		return;
+
+	size_t msg_len = ntohs(pkt.ip.tot_len) - ihl - sizeof(struct udphdr);
+	if (msg_len < offsetof(struct dhcpd_msg, options))
+		return;
+
+	dhcpd_handle_request(iface, &pkt.msg, msg_len);
+}
+
+/**
+ * Creates the packet socket bound to ifname in the network namespace netns_fd.
+ * The socket stays in that namespace after switching back.
+ */
+static int
+dhcpd_socket_new(const char *ifname, int netns_fd, int *ifindex)
+{
+	int sock = -1;
+	int cmld_netns = -1;
+
+	if (netns_fd >= 0) {
+		cmld_netns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+		IF_TRUE_RETVAL_ERROR(cmld_netns < 0, -1);
+		if (setns(netns_fd, CLONE_NEWNET) < 0) {
+			ERROR_ERRNO("dhcpd: Could not join netns of %s", ifname);
+			close(cmld_netns);
+			return -1;
+		}
+	}
+
+	if (!(*ifindex = if_nametoindex(ifname))) {
+		ERROR_ERRNO("dhcpd: Could not resolve interface %s", ifname);
+		goto out;
+	}
+
+	sock = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, htons(ETH_P_IP));
+	if (sock < 0) {
+		ERROR_ERRNO("dhcpd: Could not create packet socket for %s", ifname);
+		goto out;
+	}
+
+	struct sock_fprog prog = { .len = sizeof(dhcpd_filter) / sizeof(dhcpd_filter[0]),
+				   .filter = dhcpd_filter };
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		ERROR_ERRNO("dhcpd: Could not attach filter for %s", ifname);
+		goto err;
+	}
+
+	struct sockaddr_ll addr = { .sll_family = AF_PACKET,
+				    .sll_protocol = htons(ETH_P_IP),
+				    .sll_ifindex = *ifindex };
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ERROR_ERRNO("dhcpd: Could not bind packet socket to %s", ifname);
+		goto err;
+	}
+	goto out;
+err:
+	close(sock);
+	sock = -1;
+out:
+	if (cmld_netns >= 0) {
+		if (setns(cmld_netns, CLONE_NEWNET) < 0)
+			FATAL_ERRNO("dhcpd: Could not switch back to netns of cmld");
+		close(cmld_netns);
+	}
+	return sock;
+}
+
+dhcpd_iface_t *
+dhcpd_iface_new(const char *ifname, int netns_fd, const struct in_addr *server_addr,
+		unsigned int prefix, const struct in_addr *pool_start, unsigned int pool_size,
+		const uint8_t *static_mac, const struct in_addr *static_addr)
+{
+	ASSERT(ifname && server_addr && pool_start && prefix <= 32);
+	ASSERT(!static_mac || static_addr);
+
+	int ifindex;
+	int sock = dhcpd_socket_new(ifname, netns_fd, &ifindex);
+	IF_TRUE_RETVAL(sock < 0, NULL);
+
+	dhcpd_iface_t *iface = mem_new0(dhcpd_iface_t, 1);
+	iface->ifname = mem_strdup(ifname);
+	iface->ifindex = ifindex;
+	iface->sock = sock;
+	iface->server_addr = *server_addr;
+	iface->netmask.s_addr = prefix ? htonl(~((1u << (32 - prefix)) - 1)) : 0;
+	iface->pool_start = *pool_start;
+	iface->pool_size = pool_size;
+	iface->leases = mem_new0(dhcpd_lease_t, pool_size ? pool_size : 1);
+	if (static_mac) {
+		iface->has_static = true;
+		memcpy(iface->static_mac, static_mac, ETH_ALEN);
+		iface->static_addr = *static_addr;
+	}
+
+	iface->event = event_io_new(sock, EVENT_IO_READ, dhcpd_cb_recv, iface);
+	event_add_io(iface->event);
+
+	INFO("dhcpd: Serving %s (pool %s, %u addresses)", ifname, inet_ntoa(*pool_start),
+	     pool_size);
+	return iface;
+}
+
+void
+dhcpd_iface_free(dhcpd_iface_t *iface)
+{
+	IF_NULL_RETURN(iface);
+
+	DEBUG("dhcpd: Stop serving %s", iface->ifname);
+	event_remove_io(iface->event);
+	event_io_free(iface->event);
+	close(iface->sock);
+	mem_free(iface->leases);
+	mem_free(iface->ifname);
+	mem_free(iface);
+}
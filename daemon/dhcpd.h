@@ -0,0 +1,71 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file dhcpd.h
+ *
+ * Minimal DHCPv4 server of cmld, which serves the rootns endpoints of all
+ * container veths from the main event loop. It replaces the busybox udhcpd
+ * process formerly forked per interface.
+ *
+ * Each interface is served by an AF_PACKET socket with a BPF filter, which only
+ * passes UDP packets to the server port. Thus, the server does not need an address
+ * configured on the interface and can also serve interfaces of another network
+ * namespace, e.g. the veths moved to c0. Leases are only kept in memory.
+ */
+
+#ifndef DHCPD_H
+#define DHCPD_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+typedef struct dhcpd_iface dhcpd_iface_t;
+
+/**
+ * Starts serving DHCP requests on the interface ifname.
+ *
+ * @param ifname name of the interface in the network namespace of netns_fd
+ * @param netns_fd fd of the network namespace of the interface, -1 for the
+ *        namespace of cmld
+ * @param server_addr address of the interface, also announced as router
+ * @param prefix length of the subnet prefix of the interface
+ * @param pool_start first address of the dynamic pool
+ * @param pool_size number of addresses of the dynamic pool
+ * @param static_mac if not NULL, a client with this hardware address always
+ *        gets static_addr, which is not handed out to other clients
+ * @param static_addr address of the static lease
+ * @return the interface handle or NULL on error
+ */
+dhcpd_iface_t *
+dhcpd_iface_new(const char *ifname, int netns_fd, const struct in_addr *server_addr,
+		unsigned int prefix, const struct in_addr *pool_start, unsigned int pool_size,
+		const uint8_t *static_mac, const struct in_addr *static_addr);
+
+/**
+ * Stops serving the interface and drops all its leases.
+ */
+void
+dhcpd_iface_free(dhcpd_iface_t *iface);
+
+#endif /* DHCPD_H */
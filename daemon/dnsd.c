@@ -0,0 +1,893 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "dnsd.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+#include "common/list.h"
+#include "common/hashmap.h"
+#include "common/drbg.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DNSD_PORT 53
+
+/* maximal size of a message over UDP, also with EDNS */
+#define DNSD_MSG_MAX 4096
+/* maximal size of an answer to a client without EDNS */
+#define DNSD_MSG_MAX_PLAIN 512
+
+/* maximal length of a name in wire format */
+#define DNSD_NAME_MAX 255
+
+/* length of a forwarded query: header, question and OPT record */
+#define DNSD_QUERY_MAX (12 + DNSD_NAME_MAX + 4 + 11)
+
+/* number of cached answers and of queries in flight */
+#define DNSD_CACHE_MAX 1024
+#define DNSD_QUERIES_MAX 256
+
+/* timeout of a forwarded query in ms, clients retry on their own */
+#define DNSD_QUERY_TIMEOUT 5000
+
+/* maximal time in seconds an answer, or a negative answer, is cached */
+#define DNSD_TTL_MAX 86400
+#define DNSD_NEG_TTL_MAX 900
+
+/* an answer served this often is refreshed in the last tenth of its ttl */
+#define DNSD_PREFETCH_HITS 3
+#define DNSD_PREFETCH_DIV 10
+
+#define DNSD_FLAG_QR 0x8000
+#define DNSD_FLAG_TC 0x0200
+#define DNSD_FLAG_RD 0x0100
+#define DNSD_OPCODE(flags) (((flags) >> 11) & 0xf)
+#define DNSD_RCODE(flags) ((flags)&0xf)
+
+#define DNSD_OPCODE_QUERY 0
+#define DNSD_RCODE_NOERROR 0
+#define DNSD_RCODE_NXDOMAIN 3
+
+#define DNSD_TYPE_SOA 6
+#define DNSD_TYPE_OPT 41
+
+enum { DNSD_SECTION_ANSWER, DNSD_SECTION_AUTHORITY, DNSD_SECTION_ADDITIONAL };
+
+struct dnsd_hdr {
+	uint16_t id;
+	uint16_t flags;
+	uint16_t qdcount;
+	uint16_t ancount;
+	uint16_t nscount;
+	uint16_t arcount;
+} __attribute__((packed));
+
+/* question of a message with the name in lower case and the server it is asked */
+typedef struct {
+	ino_t netns; //!< network namespace the upstream server is reached from
+	struct in_addr upstream;
+	uint16_t qtype;
+	uint16_t qclass;
+	size_t qname_len;
+	uint8_t qname[DNSD_NAME_MAX];
+} dnsd_key_t;
+
+typedef struct {
+	dnsd_key_t key;
+	uint8_t *msg; //!< answer with the ttls as received
+	size_t len;
+	size_t qend; //!< offset of the first record following the question
+	time_t stored;
+	time_t expires;
+	time_t used;
+	unsigned int hits; //!< since the answer was stored
+	bool prefetching;
+} dnsd_entry_t;
+
+struct dnsd_iface {
+	char *ifname;
+	int sock;
+	event_io_t *event;
+	int netns_fd; //!< -1 for the network namespace of cmld
+	ino_t netns;
+	struct in_addr addr;
+	struct in_addr upstream;
+};
+
+/* client waiting for an answer */
+typedef struct {
+	dnsd_iface_t *iface;
+	struct sockaddr_in addr;
+	uint16_t id;	//!< id of the query of the client
+	size_t max_len; //!< larger answers are truncated
+	bool edns;	//!< the query of the client has an OPT record
+} dnsd_client_t;
+
+/* query forwarded to the upstream server */
+typedef struct {
+	dnsd_key_t key;
+	uint16_t id; //!< id towards the upstream server
+	int sock;
+	event_io_t *event;
+	event_timer_t *timer;
+	list_t *clients; //!< empty for a refresh of the cache
+} dnsd_query_t;
+
+/* answers and queries in flight by their dnsd_key_t, shared by all interfaces */
+static hashmap_t *dnsd_cache = NULL;
+static hashmap_t *dnsd_queries = NULL;
+
+static time_t
+dnsd_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static uint16_t
+dnsd_get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t
+dnsd_get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+dnsd_put16(uint8_t *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static void
+dnsd_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static size_t
+dnsd_fnv1a(uint64_t hash, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static size_t
+dnsd_key_hash(const void *key)
+{
+	const dnsd_key_t *k = key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	hash = dnsd_fnv1a(hash, &k->netns, sizeof(k->netns));
+	hash = dnsd_fnv1a(hash, &k->upstream, sizeof(k->upstream));
+	hash = dnsd_fnv1a(hash, &k->qtype, sizeof(k->qtype));
+	hash = dnsd_fnv1a(hash, &k->qclass, sizeof(k->qclass));
+	return dnsd_fnv1a(hash, k->qname, k->qname_len);
+}
+
+static bool
+dnsd_key_equal(const void *key1, const void *key2)
+{
+	const dnsd_key_t *k1 = key1, *k2 = key2;
+
+	return k1->netns == k2->netns && k1->upstream.s_addr == k2->upstream.s_addr &&
+	       k1->qtype == k2->qtype &&
+	       k1->qclass == k2->qclass && k1->qname_len == k2->qname_len &&
+	       !memcmp(k1->qname, k2->qname, k1->qname_len);
+}
+
+/**
+ * Returns the offset following the (possibly compressed) name at off or -1 if
+ * the name exceeds the message.
+ */
+static ssize_t
+dnsd_skip_name(const uint8_t *msg, size_t len, size_t off)
+{
+	while (off < len) {
+		uint8_t label = msg[off];
+		if ((label & 0xc0) == 0xc0)
+			return off + 2 <= len ? (ssize_t)off + 2 : -1;
+		if (label & 0xc0)
+			return -1;
+		if (!label)
+			return off + 1;
+		off += 1 + label;
+	}
+	return -1;
+}
+
+/**
+ * Parses the single question of msg into key, with the name in lower case.
+ * The namespace and upstream server of key are left untouched.
+ * @return the offset following the question or -1 if it is malformed
+ */
+static ssize_t
+dnsd_parse_question(const uint8_t *msg, size_t len, dnsd_key_t *key)
+{
+	const struct dnsd_hdr *hdr = (const struct dnsd_hdr *)msg;
+	IF_TRUE_RETVAL(len < sizeof(*hdr) || ntohs(hdr->qdcount) != 1, -1);
+
+	size_t off = sizeof(*hdr);
+	uint8_t label;
+
+	key->qname_len = 0;
+	do {
+		IF_TRUE_RETVAL(off >= len, -1);
+		label = msg[off++];
+		// the name of the question is never compressed
+		IF_TRUE_RETVAL(label & 0xc0, -1);
+		IF_TRUE_RETVAL(off + label > len || key->qname_len + 1 + label > DNSD_NAME_MAX, -1);
+
+		key->qname[key->qname_len++] = label;
+		for (uint8_t i = 0; i < label; i++, off++) {
+			uint8_t c = msg[off];
+			key->qname[key->qname_len++] = (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
+		}
+	} while (label);
+
+	IF_TRUE_RETVAL(off + 4 > len, -1);
+	key->qtype = dnsd_get16(msg + off);
+	key->qclass = dnsd_get16(msg + off + 2);
+	return off + 4;
+}
+
+/**
+ * Calls func for all resource records following the question of msg at off,
+ * with rr pointing to the fixed fields (type, class, ttl, rdlength) following
+ * the owner name, which are followed by the rdata.
+ * @return 0 if all records are within the message, -1 otherwise
+ */
+static int
+dnsd_foreach_rr(uint8_t *msg, size_t len, size_t off,
+		void (*func)(uint8_t *rr, int section, void *data), void *data)
+{
+	const struct dnsd_hdr *hdr = (const struct dnsd_hdr *)msg;
+	const unsigned int counts[] = { ntohs(hdr->ancount), ntohs(hdr->nscount),
+					ntohs(hdr->arcount) };
+
+	for (int section = 0; section < (int)ELEMENTSOF(counts); section++) {
+		for (unsigned int i = 0; i < counts[section]; i++) {
+			ssize_t rr = dnsd_skip_name(msg, len, off);
+			IF_TRUE_RETVAL(rr < 0 || (size_t)rr + 10 > len, -1);
+
+			size_t end = rr + 10 + dnsd_get16(msg + rr + 8);
+			IF_TRUE_RETVAL(end > len, -1);
+
+			func(msg + rr, section, data);
+			off = end;
+		}
+	}
+	return 0;
+}
+
+typedef struct {
+	uint32_t answer; //!< minimal ttl of the answer section
+	uint32_t soa;	 //!< negative ttl of the SOA in the authority section
+} dnsd_ttl_t;
+
+static void
+dnsd_rr_min_ttl(uint8_t *rr, int section, void *data)
+{
+	dnsd_ttl_t *ttl = data;
+	uint16_t type = dnsd_get16(rr);
+	uint16_t rdlen = dnsd_get16(rr + 8);
+
+	if (section == DNSD_SECTION_ANSWER && type != DNSD_TYPE_OPT) {
+		ttl->answer = MIN(ttl->answer, dnsd_get32(rr + 4));
+	} else if (section == DNSD_SECTION_AUTHORITY && type == DNSD_TYPE_SOA && rdlen >= 22) {
+		// the MINIMUM field concludes the rdata (RFC 2308, 5)
+		uint32_t minimum = dnsd_get32(rr + 10 + rdlen - 4);
+		ttl->soa = MIN(ttl->soa, MIN(dnsd_get32(rr + 4), minimum));
+	}
+}
+
+/**
+ * Returns how long the answer msg may be cached in seconds, 0 if not at all.
+ */
+static uint32_t
+dnsd_answer_ttl(uint8_t *msg, size_t len, size_t qend)
+{
+	const struct dnsd_hdr *hdr = (const struct dnsd_hdr *)msg;
+	uint16_t flags = ntohs(hdr->flags);
+	dnsd_ttl_t ttl = { .answer = UINT32_MAX, .soa = UINT32_MAX };
+
+	// truncated answers are incomplete
+	IF_TRUE_RETVAL(flags & DNSD_FLAG_TC, 0);
+	IF_TRUE_RETVAL(dnsd_foreach_rr(msg, len, qend, dnsd_rr_min_ttl, &ttl), 0);
+
+	if (DNSD_RCODE(flags) == DNSD_RCODE_NOERROR && ttl.answer != UINT32_MAX)
+		return MIN(ttl.answer, DNSD_TTL_MAX);
+
+	// NXDOMAIN and NODATA without SOA are not cached (RFC 2308, 5)
+	if ((DNSD_RCODE(flags) == DNSD_RCODE_NXDOMAIN || DNSD_RCODE(flags) == DNSD_RCODE_NOERROR) &&
+	    ttl.soa != UINT32_MAX)
+		return MIN(ttl.soa, DNSD_NEG_TTL_MAX);
+
+	return 0;
+}
+
+static void
+dnsd_rr_client_edns(uint8_t *rr, int section, void *data)
+{
+	dnsd_client_t *client = data;
+
+	// the class of the OPT pseudo record is the udp payload size of the sender
+	if (section == DNSD_SECTION_ADDITIONAL && dnsd_get16(rr) == DNSD_TYPE_OPT) {
+		client->edns = true;
+		client->max_len = MAX(dnsd_get16(rr + 2), DNSD_MSG_MAX_PLAIN);
+	}
+}
+
+static void
+dnsd_rr_find_opt(uint8_t *rr, int section, void *data)
+{
+	if (section == DNSD_SECTION_ADDITIONAL && dnsd_get16(rr) == DNSD_TYPE_OPT)
+		*(uint8_t **)data = rr;
+}
+
+static void
+dnsd_rr_age(uint8_t *rr, UNUSED int section, void *data)
+{
+	uint32_t elapsed = *(uint32_t *)data;
+	uint32_t ttl = dnsd_get32(rr + 4);
+
+	// the ttl of the OPT pseudo record holds flags
+	if (dnsd_get16(rr) != DNSD_TYPE_OPT)
+		dnsd_put32(rr + 4, ttl > elapsed ? ttl - elapsed : 0);
+}
+
+/**
+ * Sends the answer msg, whose id is replaced, to the client. An answer which is
+ * too large for the client is truncated to the question, thus the client asks
+ * again with a larger buffer or over TCP.
+ */
+static void
+dnsd_send_answer(const dnsd_client_t *client, uint8_t *msg, size_t len, size_t qend)
+{
+	struct dnsd_hdr *hdr = (struct dnsd_hdr *)msg;
+	uint8_t truncated[sizeof(struct dnsd_hdr) + DNSD_NAME_MAX + 4];
+	uint8_t plain[DNSD_MSG_MAX_PLAIN];
+	uint8_t *opt = NULL;
+
+	hdr->id = client->id;
+
+	/* answers to the forwarded query carry an OPT record, which must not be sent
+	 * to clients without EDNS (RFC 6891, 7). It concludes the answer, as it is
+	 * not followed by a TSIG record in an answer to a query without one. */
+	if (!client->edns && !dnsd_foreach_rr(msg, len, qend, dnsd_rr_find_opt, &opt) && opt &&
+	    opt + 10 + dnsd_get16(opt + 8) == msg + len) {
+		// the owner of the OPT record is the root, a single byte
+		len = opt - 1 - msg;
+		if (len <= client->max_len) {
+			memcpy(plain, msg, len);
+			hdr = (struct dnsd_hdr *)plain;
+			hdr->arcount = htons(ntohs(hdr->arcount) - 1);
+			msg = plain;
+		}
+	}
+
+	if (len > client->max_len) {
+		ASSERT(qend <= sizeof(truncated));
+		memcpy(truncated, msg, qend);
+		hdr = (struct dnsd_hdr *)truncated;
+		hdr->flags |= htons(DNSD_FLAG_TC);
+		hdr->ancount = hdr->nscount = hdr->arcount = 0;
+		msg = truncated;
+		len = qend;
+	}
+
+	if (sendto(client->iface->sock, msg, len, MSG_DONTWAIT,
+		   (const struct sockaddr *)&client->addr, sizeof(client->addr)) < 0)
+		DEBUG_ERRNO("dnsd: Could not send answer on %s", client->iface->ifname);
+}
+
+static void
+dnsd_entry_free(dnsd_entry_t *entry)
+{
+	mem_free(entry->msg);
+	mem_free(entry);
+}
+
+/**
+ * Returns the cached answer for key or NULL if there is none or it expired.
+ */
+static dnsd_entry_t *
+dnsd_cache_lookup(const dnsd_key_t *key)
+{
+	dnsd_entry_t *entry = hashmap_get(dnsd_cache, key);
+	IF_NULL_RETVAL(entry, NULL);
+
+	if (entry->expires > dnsd_now())
+		return entry;
+
+	hashmap_remove(dnsd_cache, &entry->key);
+	dnsd_entry_free(entry);
+	return NULL;
+}
+
+/**
+ * Drops an expired answer, or the least recently used one if none expired.
+ */
+static void
+dnsd_cache_evict(void)
+{
+	dnsd_entry_t *victim = NULL;
+	time_t now = dnsd_now();
+	size_t iter = 0;
+	const void *key;
+	void *value;
+
+	while (hashmap_next(dnsd_cache, &iter, &key, &value)) {
+		dnsd_entry_t *entry = value;
+		if (entry->expires <= now) {
+			victim = entry;
+			break;
+		}
+		if (!victim || entry->used < victim->used)
+			victim = entry;
+	}
+	IF_NULL_RETURN(victim);
+
+	hashmap_remove(dnsd_cache, &victim->key);
+	dnsd_entry_free(victim);
+}
+
+static void
+dnsd_cache_store(const dnsd_query_t *query, const uint8_t *msg, size_t len, size_t qend,
+		 uint32_t ttl)
+{
+	dnsd_entry_t *entry = hashmap_get(dnsd_cache, &query->key);
+
+	if (!entry) {
+		if (hashmap_count(dnsd_cache) >= DNSD_CACHE_MAX)
+			dnsd_cache_evict();
+		entry = mem_new0(dnsd_entry_t, 1);
+		entry->key = query->key;
+		hashmap_put(dnsd_cache, &entry->key, entry);
+	}
+
+	mem_free(entry->msg);
+	entry->msg = mem_alloc(len);
+	memcpy(entry->msg, msg, len);
+	entry->len = len;
+	entry->qend = qend;
+	entry->stored = entry->used = dnsd_now();
+	entry->expires = entry->stored + ttl;
+	// the name has to stay hot to be refreshed again
+	entry->hits = 0;
+	entry->prefetching = false;
+}
+
+static void
+dnsd_query_free(dnsd_query_t *query)
+{
+	if (hashmap_get(dnsd_queries, &query->key) == query)
+		hashmap_remove(dnsd_queries, &query->key);
+
+	// allow another refresh, e.g. after a timeout
+	dnsd_entry_t *entry = hashmap_get(dnsd_cache, &query->key);
+	if (entry)
+		entry->prefetching = false;
+
+	event_remove_io(query->event);
+	event_io_free(query->event);
+	event_remove_timer(query->timer);
+	event_timer_free(query->timer);
+	close(query->sock);
+
+	for (list_t *l = query->clients; l; l = l->next)
+		mem_free(l->data);
+	list_delete(query->clients);
+	mem_free(query);
+}
+
+static void
+dnsd_query_cb_timeout(UNUSED event_timer_t *timer, void *data)
+{
+	dnsd_query_t *query = data;
+
+	DEBUG("dnsd: Query to %s timed out", inet_ntoa(query->key.upstream));
+	dnsd_query_free(query);
+}
+
+static void
+dnsd_query_cb_recv(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	dnsd_query_t *query = data;
+	uint8_t msg[DNSD_MSG_MAX];
+	dnsd_key_t key = { .netns = query->key.netns, .upstream = query->key.upstream };
+
+	if (events & EVENT_IO_EXCEPT) {
+		DEBUG("dnsd: Exception on socket to %s", inet_ntoa(query->key.upstream));
+		dnsd_query_free(query);
+		return;
+	}
+
+	// the connected socket only receives from the upstream server
+	ssize_t len = recv(fd, msg, sizeof(msg), MSG_TRUNC | MSG_DONTWAIT);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		DEBUG_ERRNO("dnsd: Could not receive from %s", inet_ntoa(query->key.upstream));
+		dnsd_query_free(query);
+		return;
+	}
+
+	const struct dnsd_hdr *hdr = (const struct dnsd_hdr *)msg;
+	if ((size_t)len > sizeof(msg) || (size_t)len < sizeof(*hdr) || hdr->id != query->id ||
+	    !(ntohs(hdr->flags) & DNSD_FLAG_QR))
+		return;
+
+	ssize_t qend = dnsd_parse_question(msg, len, &key);
+	if (qend < 0 || !dnsd_key_equal(&key, &query->key)) {
+		TRACE("dnsd: Ignoring answer of %s for another question",
+		      inet_ntoa(query->key.upstream));
+		return;
+	}
+
+	uint32_t ttl = dnsd_answer_ttl(msg, len, qend);
+	if (ttl)
+		dnsd_cache_store(query, msg, len, qend, ttl);
+
+	for (list_t *l = query->clients; l; l = l->next)
+		dnsd_send_answer(l->data, msg, len, qend);
+
+	dnsd_query_free(query);
+}
+
+/**
+ * Switches to the network namespace netns_fd, if not -1.
+ * @return fd of the namespace of cmld to switch back to, -1 if not switched,
+ *         -2 on error
+ */
+static int
+dnsd_netns_enter(int netns_fd)
+{
+	IF_TRUE_RETVAL(netns_fd < 0, -1);
+
+	int cmld_netns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	IF_TRUE_RETVAL_ERROR(cmld_netns < 0, -2);
+	if (setns(netns_fd, CLONE_NEWNET) < 0) {
+		ERROR_ERRNO("dnsd: Could not join netns");
+		close(cmld_netns);
+		return -2;
+	}
+	return cmld_netns;
+}
+
+static void
+dnsd_netns_leave(int cmld_netns)
+{
+	IF_TRUE_RETURN(cmld_netns < 0);
+
+	if (setns(cmld_netns, CLONE_NEWNET) < 0)
+		FATAL_ERRNO("dnsd: Could not switch back to netns of cmld");
+	close(cmld_netns);
+}
+
+/**
+ * Builds the query which is forwarded for key into msg. As the answer is shared
+ * by all clients asking the question, nothing of the query of a client is
+ * passed on: recursion is desired, checking is not disabled and the OPT record
+ * only announces DNSD_MSG_MAX, without the DO bit and without options of the
+ * client such as its subnet or cookies.
+ * @return the length of the query
+ */
+static size_t
+dnsd_query_build(const dnsd_key_t *key, uint8_t msg[DNSD_QUERY_MAX])
+{
+	struct dnsd_hdr *hdr = (struct dnsd_hdr *)msg;
+	size_t off = sizeof(*hdr);
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->flags = htons(DNSD_FLAG_RD);
+	hdr->qdcount = htons(1);
+	hdr->arcount = htons(1);
+
+	memcpy(msg + off, key->qname, key->qname_len);
+	off += key->qname_len;
+	dnsd_put16(msg + off, key->qtype);
+	dnsd_put16(msg + off + 2, key->qclass);
+	off += 4;
+
+	// root owner, udp payload size as class, no extended rcode, flags or rdata
+	msg[off++] = 0;
+	dnsd_put16(msg + off, DNSD_TYPE_OPT);
+	dnsd_put16(msg + off + 2, DNSD_MSG_MAX);
+	dnsd_put32(msg + off + 4, 0);
+	dnsd_put16(msg + off + 8, 0);
+	return off + 10;
+}
+
+/**
+ * Forwards the query for key, under a new random id, to its upstream server.
+ * Each query has a socket of its own, thus a random source port, which is
+ * created in the network namespace of iface.
+ */
+static dnsd_query_t *
+dnsd_query_new(const dnsd_iface_t *iface, const dnsd_key_t *key)
+{
+	if (hashmap_count(dnsd_queries) >= DNSD_QUERIES_MAX) {
+		DEBUG("dnsd: Too many queries in flight, dropping query");
+		return NULL;
+	}
+
+	int cmld_netns = dnsd_netns_enter(iface->netns_fd);
+	IF_TRUE_RETVAL(cmld_netns == -2, NULL);
+	int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	dnsd_netns_leave(cmld_netns);
+	IF_TRUE_RETVAL_ERROR(sock < 0, NULL);
+
+	struct sockaddr_in dst = { .sin_family = AF_INET,
+				   .sin_port = htons(DNSD_PORT),
+				   .sin_addr = key->upstream };
+	if (connect(sock, (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+		DEBUG_ERRNO("dnsd: Could not connect to %s", inet_ntoa(key->upstream));
+		close(sock);
+		return NULL;
+	}
+
+	dnsd_query_t *query = mem_new0(dnsd_query_t, 1);
+	query->key = *key;
+	query->sock = sock;
+
+	uint8_t msg[DNSD_QUERY_MAX];
+	size_t len = dnsd_query_build(key, msg);
+	if (drbg_bytes(&query->id, sizeof(query->id)) < 0)
+		WARN("dnsd: Could not randomize query id");
+	((struct dnsd_hdr *)msg)->id = query->id;
+
+	query->event = event_io_new(sock, EVENT_IO_READ, dnsd_query_cb_recv, query);
+	event_add_io(query->event);
+	query->timer = event_timer_new(DNSD_QUERY_TIMEOUT, 1, dnsd_query_cb_timeout, query);
+	event_add_timer(query->timer);
+	hashmap_put(dnsd_queries, &query->key, query);
+
+	if (send(sock, msg, len, MSG_DONTWAIT) < 0) {
+		DEBUG_ERRNO("dnsd: Could not forward query to %s", inet_ntoa(key->upstream));
+		dnsd_query_free(query);
+		return NULL;
+	}
+	return query;
+}
+
+/**
+ * Serves the client from the cached answer and refreshes the answer if it is
+ * asked for often and about to expire.
+ */
+static void
+dnsd_cache_answer(dnsd_entry_t *entry, const dnsd_client_t *client)
+{
+	uint8_t msg[DNSD_MSG_MAX];
+	time_t now = dnsd_now();
+	uint32_t elapsed = now - entry->stored;
+
+	entry->hits++;
+	entry->used = now;
+
+	memcpy(msg, entry->msg, entry->len);
+	dnsd_foreach_rr(msg, entry->len, entry->qend, dnsd_rr_age, &elapsed);
+	dnsd_send_answer(client, msg, entry->len, entry->qend);
+
+	if (entry->prefetching || entry->hits < DNSD_PREFETCH_HITS ||
+	    (entry->expires - now) * DNSD_PREFETCH_DIV > entry->expires - entry->stored ||
+	    hashmap_contains(dnsd_queries, &entry->key))
+		return;
+
+	TRACE("dnsd: Refreshing answer for %s", inet_ntoa(entry->key.upstream));
+	if (dnsd_query_new(client->iface, &entry->key))
+		entry->prefetching = true;
+}
+
+static void
+dnsd_iface_cb_recv(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	dnsd_iface_t *iface = data;
+	uint8_t msg[DNSD_MSG_MAX];
+	dnsd_client_t client = { .iface = iface, .max_len = DNSD_MSG_MAX_PLAIN };
+	socklen_t addr_len = sizeof(client.addr);
+	dnsd_key_t key = { .netns = iface->netns, .upstream = iface->upstream };
+
+	if (events & EVENT_IO_EXCEPT) {
+		WARN("dnsd: Exception on socket of %s", iface->ifname);
+		return;
+	}
+
+	ssize_t len = recvfrom(fd, msg, sizeof(msg), MSG_TRUNC | MSG_DONTWAIT,
+			       (struct sockaddr *)&client.addr, &addr_len);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			WARN_ERRNO("dnsd: Could not receive on %s", iface->ifname);
+		return;
+	}
+
+	const struct dnsd_hdr *hdr = (const struct dnsd_hdr *)msg;
+	if ((size_t)len > sizeof(msg) || (size_t)len < sizeof(*hdr) ||
+	    (ntohs(hdr->flags) & DNSD_FLAG_QR) ||
+	    DNSD_OPCODE(ntohs(hdr->flags)) != DNSD_OPCODE_QUERY)
+		return;
+
+	ssize_t qend = dnsd_parse_question(msg, len, &key);
+	if (qend < 0) {
+		TRACE("dnsd: Ignoring malformed query on %s", iface->ifname);
+		return;
+	}
+	client.id = hdr->id;
+	if (dnsd_foreach_rr(msg, len, qend, dnsd_rr_client_edns, &client))
+		return;
+
+	dnsd_entry_t *entry = dnsd_cache_lookup(&key);
+	if (entry) {
+		dnsd_cache_answer(entry, &client);
+		return;
+	}
+
+	// join an identical query in flight
+	dnsd_query_t *query = hashmap_get(dnsd_queries, &key);
+	if (!query && !(query = dnsd_query_new(iface, &key)))
+		return;
+
+	dnsd_client_t *waiting = mem_new(dnsd_client_t, 1);
+	*waiting = client;
+	query->clients = list_append(query->clients, waiting);
+}
+
+/**
+ * Creates the udp socket bound to addr in the network namespace netns_fd.
+ * The socket stays in that namespace after switching back.
+ */
+static int
+dnsd_socket_new(const char *ifname, int netns_fd, const struct in_addr *addr)
+{
+	int sock = -1;
+	int cmld_netns = dnsd_netns_enter(netns_fd);
+	IF_TRUE_RETVAL(cmld_netns == -2, -1);
+
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		ERROR_ERRNO("dnsd: Could not create socket for %s", ifname);
+		goto out;
+	}
+
+	// the address may be configured by the netns helper after this
+	int one = 1;
+	if (setsockopt(sock, IPPROTO_IP, IP_FREEBIND, &one, sizeof(one)) < 0) {
+		ERROR_ERRNO("dnsd: Could not set IP_FREEBIND for %s", ifname);
+		goto err;
+	}
+
+	struct sockaddr_in sa = { .sin_family = AF_INET,
+				  .sin_port = htons(DNSD_PORT),
+				  .sin_addr = *addr };
+	if (bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		// e.g. a resolver of c0 itself listening on all addresses
+		WARN_ERRNO("dnsd: Could not bind to %s on %s", inet_ntoa(*addr), ifname);
+		goto err;
+	}
+	goto out;
+err:
+	close(sock);
+	sock = -1;
+out:
+	dnsd_netns_leave(cmld_netns);
+	return sock;
+}
+
+dnsd_iface_t *
+dnsd_iface_new(const char *ifname, int netns_fd, const struct in_addr *addr,
+	       const struct in_addr *upstream)
+{
+	ASSERT(ifname && addr && upstream);
+
+	// the forwarder must not ask itself
+	IF_TRUE_RETVAL(addr->s_addr == upstream->s_addr, NULL);
+
+	struct stat netns_stat = { .st_ino = 0 };
+	if (netns_fd >= 0 && fstat(netns_fd, &netns_stat) < 0) {
+		ERROR_ERRNO("dnsd: Could not stat netns of %s", ifname);
+		return NULL;
+	}
+
+	int sock = dnsd_socket_new(ifname, netns_fd, addr);
+	IF_TRUE_RETVAL(sock < 0, NULL);
+
+	if (!dnsd_cache)
+		dnsd_cache = hashmap_new(dnsd_key_hash, dnsd_key_equal);
+	if (!dnsd_queries)
+		dnsd_queries = hashmap_new(dnsd_key_hash, dnsd_key_equal);
+
+	dnsd_iface_t *iface = mem_new0(dnsd_iface_t, 1);
+	iface->ifname = mem_strdup(ifname);
+	iface->sock = sock;
+	// the caller may close netns_fd, it is needed for each forwarded query
+	iface->netns_fd = netns_fd >= 0 ? fcntl(netns_fd, F_DUPFD_CLOEXEC, 0) : -1;
+	iface->netns = netns_stat.st_ino;
+	iface->addr = *addr;
+	iface->upstream = *upstream;
+
+	iface->event = event_io_new(sock, EVENT_IO_READ, dnsd_iface_cb_recv, iface);
+	event_add_io(iface->event);
+
+	INFO("dnsd: Serving %s on %s", inet_ntoa(*addr), ifname);
+	return iface;
+}
+
+void
+dnsd_iface_free(dnsd_iface_t *iface)
+{
+	IF_NULL_RETURN(iface);
+
+	DEBUG("dnsd: Stop serving %s", iface->ifname);
+
+	// queries in flight are kept to fill the cache
+	size_t iter = 0;
+	const void *key;
+	void *value;
+	while (hashmap_next(dnsd_queries, &iter, &key, &value)) {
+		dnsd_query_t *query = value;
+		for (list_t *l = query->clients; l;) {
+			list_t *next = l->next;
+			dnsd_client_t *client = l->data;
+			if (client->iface == iface) {
+				mem_free(client);
+				query->clients = list_unlink(query->clients, l);
+			}
+			l = next;
+		}
+	}
+
+	event_remove_io(iface->event);
+	event_io_free(iface->event);
+	close(iface->sock);
+	if (iface->netns_fd >= 0)
+		close(iface->netns_fd);
+	mem_free(iface->ifname);
+	mem_free(iface);
+}
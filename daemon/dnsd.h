@@ -0,0 +1,69 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file dnsd.h
+ *
+ * Caching DNS forwarder of cmld, which serves the containers on the rootns
+ * endpoints of their veths from the main event loop. Queries are forwarded
+ * over UDP to the upstream server configured for the container. The answers
+ * are kept in a cache shared by all containers with the same upstream server
+ * (and network namespace).
+ *
+ * Identical queries, e.g. of several containers, which are in flight at the
+ * same time are forwarded only once. Negative answers (NXDOMAIN, NODATA) are
+ * cached as long as the SOA of the answer allows (RFC 2308). Names which are
+ * asked for repeatedly are refreshed shortly before they expire, thus hot names
+ * are served from the cache without a round trip to the upstream server.
+ */
+
+#ifndef DNSD_H
+#define DNSD_H
+
+#include <netinet/in.h>
+
+typedef struct dnsd_iface dnsd_iface_t;
+
+/**
+ * Starts serving DNS queries on addr, port 53.
+ *
+ * @param ifname name of the interface of addr, only used for logging
+ * @param netns_fd fd of the network namespace of the interface, -1 for the
+ *        namespace of cmld. The address does not need to be configured yet.
+ * @param addr address of the interface, which the containers use as resolver
+ * @param upstream server the queries are forwarded to from the network
+ *        namespace of the interface
+ * @return the interface handle or NULL on error
+ */
+dnsd_iface_t *
+dnsd_iface_new(const char *ifname, int netns_fd, const struct in_addr *addr,
+	       const struct in_addr *upstream);
+
+/**
+ * Stops serving the interface. Queries of its clients, which are still in
+ * flight, are not answered anymore. The cache is kept.
+ */
+void
+dnsd_iface_free(dnsd_iface_t *iface);
+
+#endif /* DNSD_H */
@@ -21,37 +21,1258 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define _GNU_SOURCE
+
 #include "download.h"
+#include "hash.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/event.h"
-#include "common/file.h"
+#include "common/list.h"
+#include "common/str.h"
 
-#include <sys/wait.h>
-#include <fcntl.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include <arpa/inet.h>
 #include <errno.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000
+#define TLS_client_method SSLv23_client_method
+#endif
+
+// further downloads wait until one of the running downloads is finished
+#define DOWNLOAD_MAX_ACTIVE 4
+// idle keep-alive connections which are kept to be reused by later downloads
+#define DOWNLOAD_MAX_IDLE 4
+#define DOWNLOAD_MAX_REDIRECTS 5
+// a download is aborted if no data has been received within this time (ms)
+#define DOWNLOAD_TIMEOUT 60000
+#define DOWNLOAD_BUF_SIZE (64 * 1024)
+// bounds the reads per event, so that other events are not starved by a fast transfer
+#define DOWNLOAD_MAX_READS 16
+#define DOWNLOAD_HEADER_MAX (16 * 1024)
+#define DOWNLOAD_PART_SUFFIX ".part"
+#define DOWNLOAD_USER_AGENT "cmld"
+
+// returned by download_conn_recv()/download_conn_send() if the operation would block
+#define DOWNLOAD_AGAIN (-2)
 
-#define WGET_PATH "wget"
+typedef struct download_conn {
+	bool tls;
+	char *host;
+	char *port;
+	int fd;
+	SSL *ssl;
+	event_io_t *io;
+	unsigned events;
+	void *io_data;
+} download_conn_t;
+
+typedef enum download_state {
+	DOWNLOAD_STATE_IDLE = 1,
+	DOWNLOAD_STATE_QUEUED,
+	DOWNLOAD_STATE_CONNECT,
+	DOWNLOAD_STATE_HANDSHAKE,
+	DOWNLOAD_STATE_REQUEST,
+	DOWNLOAD_STATE_HEADER,
+	DOWNLOAD_STATE_BODY,
+	DOWNLOAD_STATE_LOCAL,
+} download_state_t;
+
+typedef enum download_chunk_state {
+	DOWNLOAD_CHUNK_SIZE = 1, // line with the size of the next chunk
+	DOWNLOAD_CHUNK_DATA,
+	DOWNLOAD_CHUNK_DATA_END, // line break following the data of a chunk
+	DOWNLOAD_CHUNK_TRAILER,	 // trailer lines after the last chunk
+} download_chunk_state_t;
 
 struct download {
 	char *url;
 	char *file;
 	download_callback_t on_complete;
 	void *data;
-	pid_t wget_pid;
+
+	char *part_file; // receives the data, renamed to file once complete
+	download_state_t state;
+
+	// location of the current request, changes on redirects
+	bool tls;
+	char *host;
+	char *port;
+	char *path;
+	unsigned redirects;
+
+	download_conn_t *conn;
+	bool conn_reused;
+	struct addrinfo *addrs;
+	struct addrinfo *addr; // address of the current connection attempt
+
+	char *request;
+	size_t request_len;
+	size_t request_sent;
+	str_t *header;
+
+	// framing of the response body
+	bool chunked;
+	bool until_close;
+	bool keep_alive;
+	uint64_t remaining; // bytes left of the body or the current chunk
+	download_chunk_state_t chunk_state;
+	char line[32];
+	size_t line_len;
+
+	int fd;		 // part file
+	int local_fd;	 // source file of a file:// url
+	uint64_t offset; // bytes already received, i.e. size of the part file
+	bool drop_part;	 // the part file cannot be resumed
+
+	// only the given range is requested and written to file (see download_set_range())
+	bool ranged;
+	uint64_t range_start;
+	uint64_t range_len;
+	// started at once regardless of DOWNLOAD_MAX_ACTIVE (see download_set_urgent())
+	bool urgent;
+
+	hash_stream_t *hash;
+	char *sha1;
+	char *sha256;
+
+	event_timer_t *timer;
+	bool progress;
 };
 
+static list_t *download_active_list = NULL;
+static list_t *download_queue = NULL;
+static list_t *download_idle_list = NULL;
+static SSL_CTX *download_ssl_ctx = NULL;
+
+static char download_buf[DOWNLOAD_BUF_SIZE];
+
+static void
+download_io_cb(int fd, unsigned events, event_io_t *io, void *data);
+
+static int
+download_connect(download_t *dl);
+
+static void
+download_queue_run(void);
+
+/******************************************************************************/
+/* connections                                                                */
+/******************************************************************************/
+
+static void
+download_conn_free(download_conn_t *conn)
+{
+	IF_NULL_RETURN_TRACE(conn);
+
+	if (conn->io) {
+		event_remove_io(conn->io);
+		event_io_free(conn->io);
+	}
+	if (conn->ssl)
+		SSL_free(conn->ssl);
+	if (conn->fd >= 0)
+		close(conn->fd);
+	mem_free(conn->host);
+	mem_free(conn->port);
+	mem_free(conn);
+}
+
+/**
+ * Registers func for the given events on the connection, replacing the
+ * previous registration if the events or the receiver changed.
+ */
+static void
+download_conn_watch(download_conn_t *conn, unsigned events,
+		    void (*func)(int fd, unsigned events, event_io_t *io, void *data), void *data)
+{
+	if (conn->io && conn->events == events && conn->io_data == data)
+		return;
+
+	if (conn->io) {
+		event_remove_io(conn->io);
+		event_io_free(conn->io);
+	}
+	conn->io = event_io_new(conn->fd, events, func, data);
+	conn->events = events;
+	conn->io_data = data;
+	event_add_io(conn->io);
+}
+
+/**
+ * @return the number of bytes received, 0 on EOF, -1 on error or DOWNLOAD_AGAIN,
+ *         in which case want is set to the event to wait for.
+ */
+static ssize_t
+download_conn_recv(download_conn_t *conn, void *buf, size_t len, unsigned *want)
+{
+	if (!conn->ssl) {
+		ssize_t n;
+		do {
+			n = recv(conn->fd, buf, len, 0);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			*want = EVENT_IO_READ;
+			return DOWNLOAD_AGAIN;
+		}
+		if (n < 0)
+			DEBUG_ERRNO("Could not receive from %s", conn->host);
+		return n;
+	}
+
+	ERR_clear_error();
+	int n = SSL_read(conn->ssl, buf, len);
+	if (n > 0)
+		return n;
+
+	switch (SSL_get_error(conn->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+		*want = EVENT_IO_READ;
+		return DOWNLOAD_AGAIN;
+	case SSL_ERROR_WANT_WRITE:
+		*want = EVENT_IO_WRITE;
+		return DOWNLOAD_AGAIN;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_SYSCALL:
+		// peer closed the connection without close_notify
+		if (ERR_peek_error() == 0 && n == 0)
+			return 0;
+		// fallthrough
+	default:
+		DEBUG("TLS receive from %s failed: %s", conn->host,
+		      ERR_error_string(ERR_get_error(), NULL));
+		return -1;
+	}
+}
+
+/**
+ * @return the number of bytes sent, -1 on error or DOWNLOAD_AGAIN,
+ *         in which case want is set to the event to wait for.
+ */
+static ssize_t
+download_conn_send(download_conn_t *conn, const void *buf, size_t len, unsigned *want)
+{
+	if (!conn->ssl) {
+		ssize_t n;
+		do {
+			n = send(conn->fd, buf, len, MSG_NOSIGNAL);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			*want = EVENT_IO_WRITE;
+			return DOWNLOAD_AGAIN;
+		}
+		if (n < 0)
+			DEBUG_ERRNO("Could not send to %s", conn->host);
+		return n;
+	}
+
+	ERR_clear_error();
+	int n = SSL_write(conn->ssl, buf, len);
+	if (n > 0)
+		return n;
+
+	switch (SSL_get_error(conn->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+		*want = EVENT_IO_READ;
+		return DOWNLOAD_AGAIN;
+	case SSL_ERROR_WANT_WRITE:
+		*want = EVENT_IO_WRITE;
+		return DOWNLOAD_AGAIN;
+	default:
+		DEBUG("TLS send to %s failed: %s", conn->host,
+		      ERR_error_string(ERR_get_error(), NULL));
+		return -1;
+	}
+}
+
+/*
+ * An idle connection must not receive anything, any event means that the
+ * server closed it (or misbehaves), so it is not reused.
+ */
+static void
+download_idle_io_cb(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	download_conn_t *conn = data;
+
+	TRACE("Idle connection to %s:%s closed", conn->host, conn->port);
+	download_idle_list = list_remove(download_idle_list, conn);
+	download_conn_free(conn);
+}
+
+static void
+download_idle_put(download_conn_t *conn)
+{
+	if (list_length(download_idle_list) >= DOWNLOAD_MAX_IDLE) {
+		download_conn_t *oldest = download_idle_list->data;
+		download_idle_list = list_remove(download_idle_list, oldest);
+		download_conn_free(oldest);
+	}
+	TRACE("Keeping connection to %s:%s alive", conn->host, conn->port);
+	download_conn_watch(conn, EVENT_IO_READ, download_idle_io_cb, conn);
+	download_idle_list = list_append(download_idle_list, conn);
+}
+
+static download_conn_t *
+download_idle_take(bool tls, const char *host, const char *port)
+{
+	for (list_t *l = download_idle_list; l; l = l->next) {
+		download_conn_t *conn = l->data;
+		if (conn->tls == tls && !strcmp(conn->host, host) && !strcmp(conn->port, port)) {
+			download_idle_list = list_unlink(download_idle_list, l);
+			return conn;
+		}
+	}
+	return NULL;
+}
+
+static SSL_CTX *
+download_ssl_ctx_get(void)
+{
+	if (download_ssl_ctx)
+		return download_ssl_ctx;
+
+	download_ssl_ctx = SSL_CTX_new(TLS_client_method());
+	IF_NULL_RETVAL_ERROR(download_ssl_ctx, NULL);
+
+	SSL_CTX_set_verify(download_ssl_ctx, SSL_VERIFY_PEER, NULL);
+	if (!SSL_CTX_set_default_verify_paths(download_ssl_ctx))
+		WARN("Could not load default CA certificates for downloads");
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	// the end of a response is determined by its framing, images are verified anyway
+	SSL_CTX_set_options(download_ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+	return download_ssl_ctx;
+}
+
+/******************************************************************************/
+/* part file                                                                  */
+/******************************************************************************/
+
+static int
+download_part_restart(download_t *dl)
+{
+	hash_stream_free(dl->hash);
+	dl->hash = hash_stream_new(HASH_SHA1 | HASH_SHA256);
+	IF_NULL_RETVAL(dl->hash, -1);
+
+	dl->offset = 0;
+	if (ftruncate(dl->fd, 0) < 0 || lseek(dl->fd, 0, SEEK_SET) < 0) {
+		ERROR_ERRNO("Could not truncate %s", dl->part_file);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Opens the part file and hashes the data it already contains, so that an
+ * interrupted download continues where it stopped with a consistent digest.
+ */
+static int
+download_part_open(download_t *dl)
+{
+	struct stat st;
+
+	dl->fd = open(dl->part_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (dl->fd < 0) {
+		ERROR_ERRNO("Could not open %s", dl->part_file);
+		return -1;
+	}
+	dl->hash = hash_stream_new(HASH_SHA1 | HASH_SHA256);
+	IF_NULL_RETVAL(dl->hash, -1);
+	dl->offset = 0;
+
+	if (fstat(dl->fd, &st) < 0 || st.st_size == 0)
+		return 0;
+
+	posix_fadvise(dl->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (;;) {
+		ssize_t n = read(dl->fd, download_buf, sizeof(download_buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 || (n > 0 && hash_stream_update(dl->hash, download_buf, n))) {
+			WARN_ERRNO("Could not hash %s, starting over", dl->part_file);
+			return download_part_restart(dl);
+		}
+		if (n == 0)
+			break;
+		dl->offset += n;
+	}
+	INFO("Resuming download of %s at %" PRIu64 " bytes", dl->url, dl->offset);
+	return 0;
+}
+
+static int
+download_part_write(download_t *dl, const char *buf, size_t len)
+{
+	for (size_t written = 0; written < len;) {
+		ssize_t n = write(dl->fd, buf + written, len - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			ERROR_ERRNO("Could not write to %s", dl->part_file);
+			return -1;
+		}
+		written += n;
+	}
+	if (dl->hash && hash_stream_update(dl->hash, buf, len)) {
+		ERROR("Could not hash data of %s", dl->url);
+		return -1;
+	}
+	dl->offset += len;
+	dl->progress = true;
+	return 0;
+}
+
+/******************************************************************************/
+/* download state                                                             */
+/******************************************************************************/
+
+/**
+ * Releases all resources of a running download except of the part file.
+ */
+static void
+download_stop(download_t *dl)
+{
+	if (dl->timer) {
+		event_remove_timer(dl->timer);
+		event_timer_free(dl->timer);
+		dl->timer = NULL;
+	}
+	download_conn_free(dl->conn);
+	dl->conn = NULL;
+	if (dl->addrs) {
+		freeaddrinfo(dl->addrs);
+		dl->addrs = dl->addr = NULL;
+	}
+	if (dl->local_fd >= 0) {
+		close(dl->local_fd);
+		dl->local_fd = -1;
+	}
+	mem_free(dl->request);
+	if (dl->header) {
+		str_free(dl->header, true);
+		dl->header = NULL;
+	}
+}
+
+static void
+download_close_part(download_t *dl)
+{
+	if (dl->fd >= 0) {
+		close(dl->fd);
+		dl->fd = -1;
+	}
+	if (dl->hash) {
+		hash_stream_free(dl->hash);
+		dl->hash = NULL;
+	}
+}
+
+static void
+download_finish(download_t *dl, bool success)
+{
+	download_stop(dl);
+
+	if (dl->ranged) {
+		if (success && dl->offset != dl->range_len) {
+			ERROR("Received %" PRIu64 " of %" PRIu64 " bytes of %s", dl->offset,
+			      dl->range_len, dl->url);
+			success = false;
+		}
+	} else if (success) {
+		if (hash_stream_final(dl->hash, &dl->sha1, &dl->sha256))
+			WARN("Could not compute digests of %s", dl->url);
+		if (rename(dl->part_file, dl->file) < 0) {
+			ERROR_ERRNO("Could not store download of %s as %s", dl->url, dl->file);
+			success = false;
+		}
+	} else if ((dl->drop_part || dl->offset == 0) && unlink(dl->part_file) < 0 &&
+		   errno != ENOENT) {
+		WARN_ERRNO("Could not remove %s", dl->part_file);
+	}
+	download_close_part(dl);
+
+	download_active_list = list_remove(download_active_list, dl);
+	dl->state = DOWNLOAD_STATE_IDLE;
+
+	DEBUG("Download of %s %s (%" PRIu64 " bytes)", dl->url, success ? "finished" : "failed",
+	      dl->offset);
+	// the callback may free dl
+	dl->on_complete(dl, success, dl->data);
+
+	download_queue_run();
+}
+
+/**
+ * Handles a failure of the current connection. A reused keep-alive connection
+ * may have been closed by the server in the meantime and a failed connect is
+ * retried with the next address of the host, otherwise the download fails.
+ */
+static void
+download_fail(download_t *dl)
+{
+	bool nothing_received = dl->state <= DOWNLOAD_STATE_HEADER &&
+				(!dl->header || str_length(dl->header) == 0);
+
+	if (dl->conn_reused && nothing_received) {
+		DEBUG("Reused connection to %s failed, reconnecting", dl->host);
+		download_conn_free(dl->conn);
+		dl->conn = NULL;
+		dl->conn_reused = false;
+		if (!download_connect(dl))
+			return;
+	} else if (dl->state == DOWNLOAD_STATE_CONNECT && dl->addr && dl->addr->ai_next) {
+		download_conn_free(dl->conn);
+		dl->conn = NULL;
+		dl->addr = dl->addr->ai_next;
+		if (!download_connect(dl))
+			return;
+	}
+	download_finish(dl, false);
+}
+
+static void
+download_complete(download_t *dl)
+{
+	if (dl->conn && dl->keep_alive && !dl->until_close) {
+		download_idle_put(dl->conn);
+		dl->conn = NULL;
+	}
+	download_finish(dl, true);
+}
+
+static void
+download_timeout_cb(UNUSED event_timer_t *timer, void *data)
+{
+	download_t *dl = data;
+
+	if (dl->progress) {
+		dl->progress = false;
+		return;
+	}
+	WARN("Download of %s timed out", dl->url);
+	dl->conn_reused = false;
+	download_finish(dl, false);
+}
+
+static int
+download_parse_url(download_t *dl, const char *url)
+{
+	const char *p;
+	bool tls;
+
+	if (!strncmp(url, "http://", 7)) {
+		tls = false;
+		p = url + 7;
+	} else if (!strncmp(url, "https://", 8)) {
+		tls = true;
+		p = url + 8;
+	} else {
+		ERROR("Unsupported download url %s", url);
+		return -1;
+	}
+
+	const char *path = strchr(p, '/');
+	const char *end = path ? path : p + strlen(p);
+	const char *host_end = end;
+	const char *port = NULL;
+
+	if (*p == '[') {
+		// IPv6 literal
+		const char *bracket = memchr(p, ']', end - p);
+		IF_NULL_RETVAL_ERROR(bracket, -1);
+		if (bracket + 1 < end && bracket[1] == ':')
+			port = bracket + 2;
+		host_end = bracket;
+		p++;
+	} else if ((port = memchr(p, ':', end - p))) {
+		host_end = port++;
+	}
+	if (host_end == p || (port && port == end)) {
+		ERROR("Invalid download url %s", url);
+		return -1;
+	}
+
+	mem_free(dl->host);
+	mem_free(dl->port);
+	mem_free(dl->path);
+	dl->tls = tls;
+	dl->host = mem_strndup(p, host_end - p);
+	dl->port = port ? mem_strndup(port, end - port) : mem_strdup(tls ? "443" : "80");
+	dl->path = mem_strdup(path ? path : "/");
+	return 0;
+}
+
+/******************************************************************************/
+/* http                                                                       */
+/******************************************************************************/
+
+static int
+download_send_request(download_t *dl)
+{
+	unsigned want = EVENT_IO_WRITE;
+
+	while (dl->request_sent < dl->request_len) {
+		ssize_t n = download_conn_send(dl->conn, dl->request + dl->request_sent,
+					       dl->request_len - dl->request_sent, &want);
+		if (n == DOWNLOAD_AGAIN) {
+			download_conn_watch(dl->conn, want, download_io_cb, dl);
+			return 0;
+		}
+		if (n < 0)
+			return -1;
+		dl->request_sent += n;
+	}
+
+	dl->state = DOWNLOAD_STATE_HEADER;
+	dl->header = str_new(NULL);
+	download_conn_watch(dl->conn, EVENT_IO_READ, download_io_cb, dl);
+	return 0;
+}
+
+static int
+download_start_request(download_t *dl)
+{
+	bool default_port = !strcmp(dl->port, dl->tls ? "443" : "80");
+	bool ipv6 = strchr(dl->host, ':') != NULL;
+	char *range = dl->ranged ? mem_printf("Range: bytes=%" PRIu64 "-%" PRIu64 "\r\n",
+					      dl->range_start + dl->offset,
+					      dl->range_start + dl->range_len - 1) :
+		      dl->offset ? mem_printf("Range: bytes=%" PRIu64 "-\r\n", dl->offset) :
+				   mem_strdup("");
+
+	mem_free(dl->request);
+	dl->request = mem_printf("GET %s HTTP/1.1\r\n"
+				 "Host: %s%s%s%s%s\r\n"
+				 "User-Agent: " DOWNLOAD_USER_AGENT "\r\n"
+				 "Accept: */*\r\n"
+				 "Accept-Encoding: identity\r\n"
+				 "Connection: keep-alive\r\n"
+				 "%s\r\n",
+				 dl->path, ipv6 ? "[" : "", dl->host, ipv6 ? "]" : "",
+				 default_port ? "" : ":", default_port ? "" : dl->port, range);
+	mem_free(range);
+	dl->request_len = strlen(dl->request);
+	dl->request_sent = 0;
+
+	TRACE("Requesting %s from %s:%s", dl->path, dl->host, dl->port);
+	dl->state = DOWNLOAD_STATE_REQUEST;
+	return download_send_request(dl);
+}
+
+static int
+download_handshake(download_t *dl)
+{
+	ERR_clear_error();
+	int ret = SSL_connect(dl->conn->ssl);
+	if (ret == 1) {
+		DEBUG("TLS connection to %s established", dl->host);
+		return download_start_request(dl);
+	}
+
+	switch (SSL_get_error(dl->conn->ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		download_conn_watch(dl->conn, EVENT_IO_READ, download_io_cb, dl);
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		download_conn_watch(dl->conn, EVENT_IO_WRITE, download_io_cb, dl);
+		return 0;
+	default:
+		ERROR("TLS handshake with %s failed: %s (%s)", dl->host,
+		      ERR_error_string(ERR_get_error(), NULL),
+		      X509_verify_cert_error_string(SSL_get_verify_result(dl->conn->ssl)));
+		return -1;
+	}
+}
+
+static int
+download_connected(download_t *dl)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(dl->conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+		errno = err;
+		DEBUG_ERRNO("Could not connect to %s:%s", dl->host, dl->port);
+		return -1;
+	}
+
+	if (!dl->tls)
+		return download_start_request(dl);
+
+	SSL_CTX *ctx = download_ssl_ctx_get();
+	IF_NULL_RETVAL(ctx, -1);
+	dl->conn->ssl = SSL_new(ctx);
+	IF_NULL_RETVAL_ERROR(dl->conn->ssl, -1);
+
+	struct in6_addr ip;
+	bool ip_literal = inet_pton(AF_INET, dl->host, &ip) == 1 ||
+			  inet_pton(AF_INET6, dl->host, &ip) == 1;
+	X509_VERIFY_PARAM *param = SSL_get0_param(dl->conn->ssl);
+	if (ip_literal ? !X509_VERIFY_PARAM_set1_ip_asc(param, dl->host) :
+			 !X509_VERIFY_PARAM_set1_host(param, dl->host, 0)) {
+		ERROR("Could not set expected TLS peer %s", dl->host);
+		return -1;
+	}
+	if (!ip_literal)
+		SSL_set_tlsext_host_name(dl->conn->ssl, dl->host);
+	if (!SSL_set_fd(dl->conn->ssl, dl->conn->fd))
+		return -1;
+
+	dl->state = DOWNLOAD_STATE_HANDSHAKE;
+	return download_handshake(dl);
+}
+
+/**
+ * Connects to the host of the current request, reusing an idle keep-alive
+ * connection if available. Otherwise the next address of the host is tried,
+ * starting with the first one after name resolution.
+ */
+static int
+download_connect(download_t *dl)
+{
+	if (!dl->addrs && (dl->conn = download_idle_take(dl->tls, dl->host, dl->port))) {
+		DEBUG("Reusing connection to %s:%s", dl->host, dl->port);
+		dl->conn_reused = true;
+		return download_start_request(dl);
+	}
+	dl->conn_reused = false;
+
+	if (!dl->addrs) {
+		struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+		int ret = getaddrinfo(dl->host, dl->port, &hints, &dl->addrs);
+		if (ret) {
+			ERROR("Could not resolve %s: %s", dl->host, gai_strerror(ret));
+			dl->addrs = NULL;
+			return -1;
+		}
+		dl->addr = dl->addrs;
+	}
+
+	for (; dl->addr; dl->addr = dl->addr->ai_next) {
+		int fd = socket(dl->addr->ai_family,
+				dl->addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				dl->addr->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, dl->addr->ai_addr, dl->addr->ai_addrlen) < 0 &&
+		    errno != EINPROGRESS) {
+			DEBUG_ERRNO("Could not connect to %s:%s", dl->host, dl->port);
+			close(fd);
+			continue;
+		}
+
+		dl->conn = mem_new0(download_conn_t, 1);
+		dl->conn->tls = dl->tls;
+		dl->conn->host = mem_strdup(dl->host);
+		dl->conn->port = mem_strdup(dl->port);
+		dl->conn->fd = fd;
+		dl->state = DOWNLOAD_STATE_CONNECT;
+		download_conn_watch(dl->conn, EVENT_IO_WRITE, download_io_cb, dl);
+		return 0;
+	}
+
+	ERROR("Could not connect to %s:%s", dl->host, dl->port);
+	return -1;
+}
+
+/**
+ * Follows a redirect to location, which is either an absolute url or an
+ * absolute path on the current host.
+ */
+static int
+download_redirect(download_t *dl, const char *location)
+{
+	if (++dl->redirects > DOWNLOAD_MAX_REDIRECTS) {
+		ERROR("Too many redirects for %s", dl->url);
+		return -1;
+	}
+
+	if (location[0] == '/') {
+		mem_free(dl->path);
+		dl->path = mem_strdup(location);
+	} else if (download_parse_url(dl, location) < 0) {
+		return -1;
+	}
+	DEBUG("Download of %s redirected to %s", dl->url, location);
+
+	// the rest of the redirect response is not read, thus the connection is not reused
+	download_conn_free(dl->conn);
+	dl->conn = NULL;
+	if (dl->addrs) {
+		freeaddrinfo(dl->addrs);
+		dl->addrs = dl->addr = NULL;
+	}
+	str_free(dl->header, true);
+	dl->header = NULL;
+	return download_connect(dl);
+}
+
+/**
+ * Processes a chunk of body data.
+ * @return 1 if the body is complete, 0 if more data is expected, -1 on error
+ */
+static int
+download_body(download_t *dl, const char *buf, size_t len)
+{
+	if (!dl->chunked) {
+		size_t n = (dl->until_close || len < dl->remaining) ? len : dl->remaining;
+		if (n && download_part_write(dl, buf, n))
+			return -1;
+		if (n < len)
+			dl->keep_alive = false; // unexpected data after the body
+		if (dl->until_close)
+			return 0;
+		dl->remaining -= n;
+		return dl->remaining == 0 ? 1 : 0;
+	}
+
+	for (size_t i = 0; i < len;) {
+		if (dl->chunk_state == DOWNLOAD_CHUNK_DATA) {
+			size_t n = len - i < dl->remaining ? len - i : dl->remaining;
+			if (download_part_write(dl, buf + i, n))
+				return -1;
+			dl->remaining -= n;
+			i += n;
+			if (dl->remaining == 0)
+				dl->chunk_state = DOWNLOAD_CHUNK_DATA_END;
+			continue;
+		}
+
+		char c = buf[i++];
+		if (c == '\r')
+			continue;
+		if (c != '\n') {
+			if (dl->line_len < sizeof(dl->line) - 1)
+				dl->line[dl->line_len] = c;
+			dl->line_len++;
+			continue;
+		}
+
+		// complete line
+		size_t line_len = dl->line_len;
+		dl->line[line_len < sizeof(dl->line) ? line_len : sizeof(dl->line) - 1] = '\0';
+		dl->line_len = 0;
+
+		switch (dl->chunk_state) {
+		case DOWNLOAD_CHUNK_SIZE: {
+			char *end = NULL;
+			errno = 0;
+			unsigned long long size = strtoull(dl->line, &end, 16);
+			if (errno || end == dl->line || line_len >= sizeof(dl->line)) {
+				ERROR("Invalid chunk of %s", dl->url);
+				return -1;
+			}
+			dl->remaining = size;
+			dl->chunk_state = size ? DOWNLOAD_CHUNK_DATA : DOWNLOAD_CHUNK_TRAILER;
+		} break;
+		case DOWNLOAD_CHUNK_DATA_END:
+			dl->chunk_state = DOWNLOAD_CHUNK_SIZE;
+			break;
+		case DOWNLOAD_CHUNK_TRAILER:
+			if (line_len == 0) {
+				if (i < len)
+					dl->keep_alive = false;
+				return 1;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Parses the response header and prepares the reception of the body.
+ * @return the http status code or -1 on error
+ */
+static int
+download_parse_header(download_t *dl, char **location, uint64_t *range_start,
+		      uint64_t *range_total)
+{
+	int major, minor, status;
+	bool has_length = false;
+	char *saveptr = NULL;
+	char *header = mem_strdup(str_buffer(dl->header));
+
+	char *line = strtok_r(header, "\r\n", &saveptr);
+	if (!line || sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+		ERROR("Invalid response for %s", dl->url);
+		mem_free(header);
+		return -1;
+	}
+
+	dl->keep_alive = major > 1 || (major == 1 && minor >= 1);
+	dl->chunked = false;
+	dl->until_close = false;
+	dl->remaining = 0;
+	*range_start = *range_total = UINT64_MAX;
+
+	while ((line = strtok_r(NULL, "\r\n", &saveptr))) {
+		char *value = strchr(line, ':');
+		if (!value)
+			continue;
+		*value++ = '\0';
+		value += strspn(value, " \t");
+
+		if (!strcasecmp(line, "Content-Length")) {
+			dl->remaining = strtoull(value, NULL, 10);
+			has_length = true;
+		} else if (!strcasecmp(line, "Transfer-Encoding")) {
+			dl->chunked = strcasestr(value, "chunked") != NULL;
+		} else if (!strcasecmp(line, "Connection")) {
+			if (strcasestr(value, "close"))
+				dl->keep_alive = false;
+			else if (strcasestr(value, "keep-alive"))
+				dl->keep_alive = true;
+		} else if (!strcasecmp(line, "Location")) {
+			mem_free(*location);
+			*location = mem_strdup(value);
+		} else if (!strcasecmp(line, "Content-Range")) {
+			uint64_t end;
+			if (sscanf(value, "bytes %" SCNu64 "-%" SCNu64 "/%" SCNu64, range_start,
+				   &end, range_total) < 1)
+				sscanf(value, "bytes */%" SCNu64, range_total);
+		}
+	}
+
+	if (dl->chunked) {
+		dl->chunk_state = DOWNLOAD_CHUNK_SIZE;
+		dl->line_len = 0;
+		dl->remaining = 0;
+	} else if (!has_length) {
+		dl->until_close = true;
+		dl->keep_alive = false;
+	}
+	mem_free(header);
+	return status;
+}
+
+/**
+ * Accumulates the response header and handles it once complete. Data
+ * following the header is passed on as body.
+ * @return 1 if the download has been finished or restarted, i.e. dl must not
+ *         be accessed anymore, 0 if more data is expected, -1 on error
+ */
+static int
+download_header(download_t *dl, const char *buf, size_t len)
+{
+	size_t old_len = str_length(dl->header);
+	str_append_len(dl->header, buf, len);
+
+	const char *hdr = str_buffer(dl->header);
+	const char *end = strstr(hdr + (old_len > 3 ? old_len - 3 : 0), "\r\n\r\n");
+	if (!end) {
+		if (str_length(dl->header) > DOWNLOAD_HEADER_MAX) {
+			ERROR("Response header of %s too large", dl->url);
+			return -1;
+		}
+		return 0;
+	}
+
+	size_t hdr_len = end + 4 - hdr;
+	size_t body_len = old_len + len - hdr_len;
+	const char *body = buf + len - body_len;
+	str_truncate(dl->header, hdr_len);
+
+	char *location = NULL;
+	uint64_t range_start, range_total;
+	int status = download_parse_header(dl, &location, &range_start, &range_total);
+	int ret = -1;
+
+	switch (status) {
+	case 200:
+		if (dl->ranged) {
+			ERROR("Server does not support range requests for %s", dl->url);
+			goto out;
+		}
+		if (dl->offset > 0) {
+			INFO("Server does not support resuming %s, starting over", dl->url);
+			IF_TRUE_GOTO(download_part_restart(dl), out);
+		}
+		break;
+	case 206:
+		if (range_start != dl->range_start + dl->offset) {
+			ERROR("Server resumed %s at the wrong position", dl->url);
+			dl->drop_part = true;
+			goto out;
+		}
+		break;
+	case 416:
+		// the part file is already complete
+		if (!dl->ranged && dl->offset > 0 && range_total == dl->offset) {
+			dl->keep_alive = false;
+			download_complete(dl);
+			ret = 1;
+			goto out;
+		}
+		ERROR("Server cannot resume %s at %" PRIu64 " bytes", dl->url, dl->offset);
+		dl->drop_part = true;
+		goto out;
+	case 301:
+	case 302:
+	case 303:
+	case 307:
+	case 308:
+		if (location) {
+			if (download_redirect(dl, location) < 0)
+				download_finish(dl, false);
+			ret = 1;
+			goto out;
+		}
+		// fallthrough
+	default:
+		ERROR("Download of %s failed with http status %d", dl->url, status);
+		goto out;
+	}
+
+	dl->state = DOWNLOAD_STATE_BODY;
+	if (!dl->chunked && !dl->until_close && dl->remaining == 0) {
+		download_complete(dl);
+		ret = 1;
+		goto out;
+	}
+
+	ret = download_body(dl, body, body_len);
+	if (ret == 1)
+		download_complete(dl);
+out:
+	mem_free(location);
+	return ret;
+}
+
+/**
+ * Reads the response until the connection would block.
+ * @return 1 if the download has been finished or restarted, 0 if more data is
+ *         expected, -1 on error
+ */
+static int
+download_recv(download_t *dl)
+{
+	for (int i = 0; i < DOWNLOAD_MAX_READS || (dl->conn->ssl && SSL_pending(dl->conn->ssl));
+	     i++) {
+		unsigned want = EVENT_IO_READ;
+		ssize_t n = download_conn_recv(dl->conn, download_buf, sizeof(download_buf), &want);
+
+		if (n == DOWNLOAD_AGAIN) {
+			download_conn_watch(dl->conn, want, download_io_cb, dl);
+			return 0;
+		}
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			// end of the connection ends a body without framing
+			if (dl->state == DOWNLOAD_STATE_BODY && dl->until_close) {
+				download_complete(dl);
+				return 1;
+			}
+			DEBUG("Connection to %s closed unexpectedly", dl->host);
+			return -1;
+		}
+
+		int ret;
+		if (dl->state == DOWNLOAD_STATE_HEADER) {
+			ret = download_header(dl, download_buf, n);
+		} else {
+			ret = download_body(dl, download_buf, n);
+			if (ret == 1)
+				download_complete(dl);
+		}
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void
+download_io_cb(UNUSED int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	download_t *dl = data;
+	int ret = 0;
+
+	if (events & EVENT_IO_EXCEPT)
+		TRACE("Exception on connection to %s", dl->host);
+
+	switch (dl->state) {
+	case DOWNLOAD_STATE_CONNECT:
+		ret = download_connected(dl);
+		break;
+	case DOWNLOAD_STATE_HANDSHAKE:
+		ret = download_handshake(dl);
+		break;
+	case DOWNLOAD_STATE_REQUEST:
+		ret = download_send_request(dl);
+		break;
+	case DOWNLOAD_STATE_HEADER:
+	case DOWNLOAD_STATE_BODY:
+		ret = download_recv(dl);
+		break;
+	default:
+		WARN("Unexpected event for download of %s", dl->url);
+		return;
+	}
+
+	if (ret < 0)
+		download_fail(dl);
+}
+
+/******************************************************************************/
+/* local files                                                                */
+/******************************************************************************/
+
+/*
+ * file:// urls are copied in slices on the event loop, which gives them the
+ * same resume and hashing behavior as remote downloads.
+ */
+static void
+download_local_cb(UNUSED event_timer_t *timer, void *data)
+{
+	download_t *dl = data;
+
+	for (int i = 0; i < DOWNLOAD_MAX_READS; i++) {
+		size_t len = sizeof(download_buf);
+		if (dl->ranged && dl->range_len - dl->offset < len)
+			len = dl->range_len - dl->offset;
+
+		ssize_t n = len ? read(dl->local_fd, download_buf, len) : 0;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			ERROR_ERRNO("Failed retrieving '%s'!", dl->url);
+			download_finish(dl, false);
+			return;
+		}
+		if (n == 0) {
+			download_complete(dl);
+			return;
+		}
+		if (download_part_write(dl, download_buf, n)) {
+			download_finish(dl, false);
+			return;
+		}
+	}
+}
+
+static int
+download_local_begin(download_t *dl)
+{
+	const char *src = dl->url + strlen("file://");
+	struct stat st;
+
+	INFO("Copying file from %s -> %s", src, dl->file);
+	dl->local_fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (dl->local_fd < 0 || fstat(dl->local_fd, &st) < 0) {
+		ERROR_ERRNO("Failed retrieving '%s'!", dl->url);
+		return -1;
+	}
+	if (!dl->ranged && dl->offset > (uint64_t)st.st_size && download_part_restart(dl))
+		return -1;
+	if (lseek(dl->local_fd, dl->range_start + dl->offset, SEEK_SET) < 0)
+		return -1;
+	posix_fadvise(dl->local_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	dl->state = DOWNLOAD_STATE_LOCAL;
+	dl->timer = event_timer_new(0, EVENT_TIMER_REPEAT_FOREVER, download_local_cb, dl);
+	event_add_timer(dl->timer);
+	return 0;
+}
+
+/******************************************************************************/
+/* API                                                                        */
+/******************************************************************************/
+
+static bool
+download_is_local(const download_t *dl)
+{
+	return strlen(dl->url) > 7 && !strncmp(dl->url, "file://", 7);
+}
+
+static int
+download_begin(download_t *dl)
+{
+	dl->drop_part = false;
+	dl->redirects = 0;
+	dl->progress = false;
+	mem_free(dl->sha1);
+	mem_free(dl->sha256);
+
+	if (dl->ranged) {
+		dl->offset = 0;
+		dl->fd = open(dl->file, O_WRONLY | O_CLOEXEC);
+		if (dl->fd < 0 || lseek(dl->fd, dl->range_start, SEEK_SET) < 0) {
+			ERROR_ERRNO("Could not open %s", dl->file);
+			goto err;
+		}
+	} else if (download_part_open(dl) < 0) {
+		goto err;
+	}
+
+	if (download_is_local(dl)) {
+		if (download_local_begin(dl) < 0)
+			goto err;
+		return 0;
+	}
+
+	if (download_parse_url(dl, dl->url) < 0 || download_connect(dl) < 0)
+		goto err;
+
+	dl->timer = event_timer_new(DOWNLOAD_TIMEOUT, EVENT_TIMER_REPEAT_FOREVER,
+				    download_timeout_cb, dl);
+	event_add_timer(dl->timer);
+	return 0;
+
+err:
+	download_stop(dl);
+	download_close_part(dl);
+	// do not leave an empty part file behind
+	if (!dl->ranged && dl->offset == 0 && unlink(dl->part_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", dl->part_file);
+	return -1;
+}
+
+static void
+download_queue_run(void)
+{
+	while (download_queue && list_length(download_active_list) < DOWNLOAD_MAX_ACTIVE) {
+		download_t *dl = download_queue->data;
+		download_queue = list_remove(download_queue, dl);
+		download_active_list = list_append(download_active_list, dl);
+
+		DEBUG("Starting queued download of %s", dl->url);
+		dl->state = DOWNLOAD_STATE_CONNECT;
+		if (download_begin(dl) < 0)
+			download_finish(dl, false);
+	}
+}
+
 download_t *
 download_new(const char *url, const char *file, download_callback_t on_complete, void *data)
 {
-	download_t *dl = mem_new(download_t, 1);
+	download_t *dl = mem_new0(download_t, 1);
 	dl->url = mem_strdup(url);
 	dl->file = mem_strdup(file);
+	dl->part_file = mem_printf("%s" DOWNLOAD_PART_SUFFIX, file);
 	dl->on_complete = on_complete;
 	dl->data = data;
+	dl->state = DOWNLOAD_STATE_IDLE;
+	dl->fd = -1;
+	dl->local_fd = -1;
 	return dl;
 }
 
@@ -59,92 +1280,72 @@ void
 download_free(download_t *dl)
 {
 	IF_NULL_RETURN(dl);
+
+	// abort a running download silently, the part file is kept for a later resume
+	if (dl->state == DOWNLOAD_STATE_QUEUED) {
+		download_queue = list_remove(download_queue, dl);
+	} else if (dl->state != DOWNLOAD_STATE_IDLE) {
+		download_stop(dl);
+		download_close_part(dl);
+		download_active_list = list_remove(download_active_list, dl);
+		download_queue_run();
+	}
+
 	mem_free(dl->url);
 	mem_free(dl->file);
+	mem_free(dl->part_file);
+	mem_free(dl->host);
+	mem_free(dl->port);
+	mem_free(dl->path);
+	mem_free(dl->sha1);
+	mem_free(dl->sha256);
 	mem_free(dl);
 }
 
-static void
-download_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+int
+download_start(download_t *dl)
 {
-	download_t *dl = data;
 	ASSERT(dl);
-	pid_t wget_pid = dl->wget_pid;
-	pid_t pid = 0;
-	int status = 0;
-	DEBUG("SIGCHLD handler called for wget (PID=%d)", wget_pid);
-	if (wget_pid <= 0) {
-		DEBUG("wget PID not yet set; returning");
-		return;
-	}
-	bool remove = false;
-	while ((pid = waitpid(wget_pid, &status, WNOHANG))) {
-		if (pid == wget_pid) {
-			bool success = false;
-			if (WIFEXITED(status)) {
-				DEBUG("wget terminated with status=%d", WEXITSTATUS(status));
-				success = !WEXITSTATUS(status);
-			} else if (WIFSIGNALED(status)) {
-				DEBUG("wget killed by signal %d", WTERMSIG(status));
-			} else {
-				continue;
-			}
-			remove = true;
-			dl->on_complete(dl, success, dl->data);
-		} else if (pid == 0) {
-			DEBUG("waitpid child(ren) (PID %d) exist without state change", wget_pid);
-			break;
-		} else if (pid == -1) {
-			if (errno == ECHILD)
-				DEBUG("Process group of wget terminated completely");
-			else
-				WARN_ERRNO("waitpid failed for wget");
-			remove = true;
-			break;
-		} else {
-			DEBUG("Reaped a child with PID %d for wget", pid);
-		}
+	IF_FALSE_RETVAL_ERROR(dl->state == DOWNLOAD_STATE_IDLE, -1);
+
+	if (!download_is_local(dl) && download_parse_url(dl, dl->url) < 0)
+		return -1;
+
+	if (!dl->urgent && list_length(download_active_list) >= DOWNLOAD_MAX_ACTIVE) {
+		DEBUG("Queueing download of %s", dl->url);
+		dl->state = DOWNLOAD_STATE_QUEUED;
+		download_queue = list_append(download_queue, dl);
+		return 0;
 	}
-	if (remove) {
-		event_remove_signal(sig);
-		event_signal_free(sig);
+
+	download_active_list = list_append(download_active_list, dl);
+	// a connection may have been established already, thus mark dl as running
+	dl->state = DOWNLOAD_STATE_CONNECT;
+	if (download_begin(dl) < 0) {
+		download_active_list = list_remove(download_active_list, dl);
+		dl->state = DOWNLOAD_STATE_IDLE;
+		return -1;
 	}
+	DEBUG("Started download of %s", dl->url);
+	return 0;
 }
 
-int
-download_start(download_t *dl)
+void
+download_set_range(download_t *dl, uint64_t start, uint64_t len)
 {
 	ASSERT(dl);
-	pid_t pid = fork();
-
-	char *const argv[] = { WGET_PATH, "-O", dl->file, dl->url, NULL };
-
-	switch (pid) {
-	case -1:
-		ERROR_ERRNO("Could not fork wget to download image %s", dl->file);
-		return -1;
-	case 0: {
-		if (strlen(dl->url) > 7 && !strncmp(dl->url, "file://", 7)) {
-			char *local_dl_src = dl->url + 7;
-			INFO("Copying file from %s -> %s", local_dl_src, dl->file);
-			int ret =
-				file_copy(local_dl_src, dl->file, file_size(local_dl_src), 512, 0);
-			if (ret < 0)
-				ERROR("Failed retrieving '%s'!", dl->url);
-			_exit(ret);
-		} else {
-			execvp(argv[0], argv);
-			ERROR_ERRNO("Could not exec %s", argv[0]);
-			_exit(-1);
-		}
-	}
-	default:
-		DEBUG("Started wget with PID %d", pid);
-		dl->wget_pid = pid;
-		event_signal_t *sig = event_signal_new(SIGCHLD, download_sigchld_cb, dl);
-		event_add_signal(sig);
-		return 0;
-	}
+	ASSERT(len > 0);
+
+	dl->ranged = true;
+	dl->range_start = start;
+	dl->range_len = len;
+}
+
+void
+download_set_urgent(download_t *dl)
+{
+	ASSERT(dl);
+	dl->urgent = true;
 }
 
 const char *
@@ -160,3 +1361,17 @@ download_get_file(const download_t *dl)
 	ASSERT(dl);
 	return dl->file;
 }
+
+const char *
+download_get_sha1(const download_t *dl)
+{
+	ASSERT(dl);
+	return dl->sha1;
+}
+
+const char *
+download_get_sha256(const download_t *dl)
+{
+	ASSERT(dl);
+	return dl->sha256;
+}
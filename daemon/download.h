@@ -26,10 +26,16 @@
 
 /**
  * @file downloader.h Defines an API to download files.
- * Uses 'wget' for now to do the actual work.
+ * Files are downloaded over http(s) by a non-blocking client on the event
+ * loop, or copied for file:// urls. A few downloads run concurrently, further
+ * ones are queued. The data is received in <file>.part, so that a failed
+ * download is resumed by a range request when it is started again, and only
+ * renamed to file when complete. Connections are kept alive to be reused by
+ * later downloads from the same server.
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  * A structure representing a download.
@@ -54,7 +60,8 @@ download_t *
 download_new(const char *url, const char *file, download_callback_t on_complete, void *data);
 
 /**
- * Frees the given download instance.
+ * Frees the given download instance. A running download is aborted without
+ * calling the callback, its part file is kept for resuming later.
  * @param dl the download instance to free
  */
 void
@@ -68,6 +75,24 @@ download_free(download_t *dl);
 int
 download_start(download_t *dl);
 
+/**
+ * Restricts the download to len bytes at start of the source, which are written
+ * to the same position of file. In contrast to complete downloads, file must
+ * already exist and is written in place, there are no part file and digests.
+ * Must be called before download_start().
+ */
+void
+download_set_range(download_t *dl, uint64_t start, uint64_t len);
+
+/**
+ * Marks a download as urgent, i.e. it is started at once instead of being
+ * queued behind other downloads if the maximum of concurrent ones is reached.
+ * Meant for small downloads someone is blocked on. Must be called before
+ * download_start().
+ */
+void
+download_set_urgent(download_t *dl);
+
 /**
  * Returns the URL of the given download instance.
  */
@@ -80,4 +105,18 @@ download_get_url(const download_t *dl);
 const char *
 download_get_file(const download_t *dl);
 
+/**
+ * Returns the SHA1 digest (hex string) of the file computed while it was
+ * downloaded, NULL if the download did not succeed.
+ */
+const char *
+download_get_sha1(const download_t *dl);
+
+/**
+ * Returns the SHA256 digest (hex string) of the file computed while it was
+ * downloaded, NULL if the download did not succeed.
+ */
+const char *
+download_get_sha256(const download_t *dl);
+
 #endif // DOWNLOAD_H
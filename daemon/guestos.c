@@ -21,41 +21,80 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#define MEM_TAG "guestos"
+
 #include "guestos.h"
 #include "guestos_config.h"
+#include "guestos_mgr.h"
 
 #include "hardware.h"
 #include "download.h"
+#include "delta.h"
+#include "lazyimg.h"
+#include "peer.h"
 #include "cmld.h"
-#include "smartcard.h"
+#include "hash.h"
 #include "tss.h"
 #include "audit.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
 #include "common/file.h"
+#include "common/str.h"
+#include "common/list.h"
+#include "common/dir.h"
+#include "common/event.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct guestos_flash guestos_flash_t;
+typedef struct guestos_scrub guestos_scrub_t;
+
+static void
+guestos_flash_finish(guestos_flash_t *flash, int result);
+
+static void
+guestos_scrub_cancel(guestos_scrub_t *scrub);
 
 struct guestos {
 	char *dir;			       ///< directory where the guest OS'es files are stored
+	char *layer_dir;		       ///< layer store shared by all guest OSes
 	char *cfg_file;			       ///< config file name
 	char *sig_file;			       ///< config signature file name
 	char *cert_file;		       ///< config certificate file name
 	guestos_config_t *cfg;		       ///< pointer to GuestOS config struct
 	guestos_verify_result_t verify_result; ///< result of guestos signature verification
 
-	bool downloading; ///< indicates download in progress
+	bool downloading;	///< indicates download in progress
+	unsigned streaming;	///< number of images being streamed lazily
+	guestos_flash_t *flash; ///< images being flashed, NULL otherwise
+	guestos_scrub_t *scrub; ///< image or partition being scrubbed, NULL otherwise
+	list_t *scrub_failed;	///< images and partitions which failed scrubbing, not retried
 };
 
 #define GUESTOS_MAX_DOWNLOAD_ATTEMPTS 3
 #define GUESTOS_FLASHED_FILE "flash_complete" // TODO check contents of partitions instead!
-#define GUESTOS_FLASH_BLOCKSIZE 512	      // blocksize in bytes for flashing partitions
-#define GUESTOS_VERIFY_BLOCKSIZE 4096	      // blocksize in bytes for verifying partitions
+#define GUESTOS_VERIFY_BLOCKSIZE 4096	      // blocksize in bytes for diffing partitions
+#define GUESTOS_FLASH_ALIGN 4096	      // alignment for direct I/O on partitions
+#define GUESTOS_FLASH_CHUNKSIZE (1024 * 1024) // chunksize in bytes for hashing/flashing partitions
+#define GUESTOS_LAYER_DIR "layers"	      // below basepath, cannot clash with name-version
+
+#define GUESTOS_FLASH_ALIGN_UP(n)                                                                  \
+	(((n) + GUESTOS_FLASH_ALIGN - 1) & ~((size_t)GUESTOS_FLASH_ALIGN - 1))
 
 /******************************************************************************/
 
@@ -104,6 +143,7 @@ guestos_new_internal(guestos_config_t *cfg, const char *basepath)
 	guestos_t *os = mem_new(guestos_t, 1);
 	os->dir = mem_printf("%s/%s-%" PRIu64 "", basepath, guestos_name,
 			     guestos_config_get_version(cfg));
+	os->layer_dir = mem_printf("%s/%s", basepath, GUESTOS_LAYER_DIR);
 	os->cfg_file = guestos_get_cfg_file_new(os->dir);
 	os->sig_file = guestos_get_sig_file_new(os->dir);
 	os->cert_file = guestos_get_cert_file_new(os->dir);
@@ -127,6 +167,14 @@ guestos_new_from_file(const char *file, const char *basepath)
 	return guestos_new_internal(cfg, basepath);
 }
 
+guestos_t *
+guestos_new_from_config(guestos_config_t *cfg, const char *basepath)
+{
+	ASSERT(cfg);
+	ASSERT(basepath);
+	return guestos_new_internal(cfg, basepath);
+}
+
 guestos_t *
 guestos_new_from_buffer(unsigned char *buf, size_t buflen, const char *basepath)
 {
@@ -151,9 +199,17 @@ void
 guestos_free(guestos_t *os)
 {
 	IF_NULL_RETURN(os);
+	if (os->flash)
+		guestos_flash_finish(os->flash, -1);
+	if (os->scrub)
+		guestos_scrub_cancel(os->scrub);
+	for (list_t *l = os->scrub_failed; l; l = l->next)
+		mem_free(l->data);
+	list_delete(os->scrub_failed);
 	mem_free(os->cert_file);
 	mem_free(os->sig_file);
 	mem_free(os->cfg_file);
+	mem_free(os->layer_dir);
 	mem_free(os->dir);
 	guestos_config_free(os->cfg);
 	mem_free(os);
@@ -206,63 +262,150 @@ check_mount_image_free(check_mount_image_t *task)
 	mem_free(task);
 }
 
+/**
+ * Looks up the digests of an image in the hash cache of the GuestOS, which is
+ * named by its directory. A hit is only reported if all digests requested by
+ * algos are cached.
+ */
+static bool
+guestos_hash_cache_lookup(const guestos_t *os, const char *img_path, unsigned algos, char **sha1,
+			  char **sha256)
+{
+	bool hit = hash_cache_lookup(guestos_get_dir(os), img_path, sha1, sha256);
+
+	if (hit && (((algos & HASH_SHA1) && !*sha1) || ((algos & HASH_SHA256) && !*sha256))) {
+		mem_free(*sha1);
+		mem_free(*sha256);
+		*sha1 = *sha256 = NULL;
+		hit = false;
+	}
+	if (hit)
+		DEBUG("Using cached hash values for image %s", img_path);
+	return hit;
+}
+
+static void
+guestos_hash_cache_store(const guestos_t *os, const char *img_path, const char *sha1,
+			 const char *sha256)
+{
+	if (hash_cache_store(guestos_get_dir(os), img_path, sha1, sha256) < 0)
+		WARN("Could not cache hash values of image %s", img_path);
+}
+
 static void
-check_mount_image_cb_sha256(const char *hash_string, UNUSED const char *hash_file,
-			    UNUSED smartcard_crypto_hashalgo_t hash_algo, void *data)
+check_mount_image_cb_hash(UNUSED const char *file, const char *sha1, const char *sha256,
+			  void *data)
 {
 	check_mount_image_t *task = data;
 	ASSERT(task);
 
-	bool match = mount_entry_match_sha256(task->e, hash_string);
+	bool match = mount_entry_match_sha1(task->e, sha1) &&
+		     mount_entry_match_sha256(task->e, sha256);
+	if (match)
+		guestos_hash_cache_store(task->os, task->img_path, sha1, sha256);
 	task->cb(match ? CHECK_IMAGE_GOOD : CHECK_IMAGE_HASH_MISMATCH, task->os, task->e,
 		 task->data);
 
 	check_mount_image_free(task);
 }
 
-static void
-check_mount_image_cb_sha1(const char *hash_string, UNUSED const char *hash_file,
-			  UNUSED smartcard_crypto_hashalgo_t hash_algo, void *data)
+/**
+ * Compares the hashes of an image with the signed GuestOS config. On a match,
+ * the image is appended to the measurement list, which also happens for hash
+ * values taken from the hash cache. Freshly computed hash values are cached.
+ *
+ * @return true if the hash values match
+ */
+static bool
+guestos_check_mount_image_hashes(const guestos_t *os, const mount_entry_t *e,
+				 const char *img_path, const char *sha1, const char *sha256,
+				 bool cached)
 {
-	check_mount_image_t *task = data;
-	ASSERT(task);
+	bool use_sha1 = mount_entry_get_sha256(e) == NULL; // fallback to sha1
 
-	bool match = mount_entry_match_sha1(task->e, hash_string);
-	if (match) {
-		// compute next hash
-		smartcard_crypto_hash_file(task->img_path, SHA256, check_mount_image_cb_sha256,
-					   task);
-		return;
-	}
-	task->cb(CHECK_IMAGE_HASH_MISMATCH, task->os, task->e, task->data);
+	if (!(use_sha1 ? mount_entry_match_sha1(e, sha1) : mount_entry_match_sha256(e, sha256)))
+		return false;
 
-	check_mount_image_free(task);
+	if (!cached)
+		guestos_hash_cache_store(os, img_path, sha1, sha256);
+	if (use_sha1)
+		return true;
+
+	// will only be executed if hash matches to signed config
+	size_t sha256_bin_len;
+	uint8_t *sha256_bin = str_hex_decode_new(sha256, &sha256_bin_len);
+	if (sha256_bin)
+		tss_ml_append((char *)img_path, sha256_bin, sha256_bin_len, TSS_SHA256);
+	else
+		ERROR("Converstion of hex string to bin failed!");
+	mem_free(sha256_bin);
+	return true;
 }
 
-static uint8_t *
-convert_hex_to_bin_new(const char *hex_str, int *out_length)
+/**
+ * Checks an image against the fs-verity digest of the signed GuestOS config,
+ * enabling fs-verity on the image file if necessary. A match covers the whole
+ * file as the kernel verifies each page against the digest when it is read,
+ * thus the image does not need to be hashed up front.
+ *
+ * @return 1 if the digest matches, 0 on a mismatch and -1 if the config has no
+ *         fs-verity digest or fs-verity is not available for the image file
+ */
+static int
+guestos_check_mount_image_verity(const mount_entry_t *e, const char *img_path, bool measure)
 {
-	int len = strlen(hex_str);
-	int i = 0, j = 0;
-	*out_length = (len + 1) / 2;
+	IF_NULL_RETVAL(mount_entry_get_verity_sha256(e), -1);
 
-	uint8_t *bin = mem_alloc0(*out_length);
-
-	if (len % 2 == 1) {
-		// odd length -> we need to pad
-		IF_FALSE_GOTO(sscanf(&(hex_str[0]), "%1hhx", &(bin[0])) == 1, err);
-		i = j = 1;
+	char *digest = hash_file_verity_new(img_path, true);
+	if (!digest) {
+		WARN("No fs-verity for image %s, falling back to hashing the whole file", img_path);
+		return -1;
 	}
 
-	for (; i < len; i += 2, j++) {
-		IF_FALSE_GOTO(sscanf(&(hex_str[i]), "%2hhx", &(bin[j])) == 1, err);
+	int ret = mount_entry_match_verity_sha256(e, digest) ? 1 : 0;
+	if (ret && measure) {
+		size_t digest_bin_len;
+		uint8_t *digest_bin = str_hex_decode_new(digest, &digest_bin_len);
+		if (digest_bin)
+			tss_ml_append((char *)img_path, digest_bin, digest_bin_len,
+				      TSS_FSVERITY_SHA256);
+		else
+			ERROR("Converstion of hex string to bin failed!");
+		mem_free(digest_bin);
 	}
+	mem_free(digest);
+	return ret;
+}
 
-	return bin;
-err:
-	ERROR("Converstion of hex string to bin failed!");
-	mem_free(bin);
-	return NULL;
+/*
+ * Computes all digests the config has reference values for, so that cache
+ * entries serve the blocking and the non-blocking check.
+ */
+static unsigned
+guestos_mount_image_hash_algos(const mount_entry_t *e)
+{
+	unsigned algos = 0;
+	algos |= mount_entry_get_sha1(e) ? HASH_SHA1 : 0;
+	algos |= mount_entry_get_sha256(e) ? HASH_SHA256 : 0;
+	return algos ? algos : HASH_SHA1;
+}
+
+/*
+ * Returns true for the mount types whose image files come with the GuestOS.
+ */
+static bool
+guestos_mount_type_has_image(enum mount_type t)
+{
+	switch (t) {
+	case MOUNT_TYPE_SHARED:
+	case MOUNT_TYPE_FLASH:
+	case MOUNT_TYPE_OVERLAY_RO:
+	case MOUNT_TYPE_SHARED_RW:
+	case MOUNT_TYPE_LAYER:
+		return true;
+	default:
+		return false;
+	}
 }
 
 guestos_check_mount_image_result_t
@@ -271,10 +414,9 @@ guestos_check_mount_image_block(const guestos_t *os, const mount_entry_t *e, boo
 	ASSERT(os);
 	ASSERT(e);
 
-	const char *img_name = mount_entry_get_img(e);
 	uint64_t img_size = mount_entry_get_size(e);
 
-	char *img_path = mem_printf("%s/%s.img", guestos_get_dir(os), img_name);
+	char *img_path = guestos_get_image_path_new(os, e);
 	DEBUG("Checking image %s (%s, blocking)", img_path, thorough ? "thorough" : "quick");
 
 	guestos_check_mount_image_result_t res = CHECK_IMAGE_GOOD;
@@ -292,25 +434,23 @@ guestos_check_mount_image_block(const guestos_t *os, const mount_entry_t *e, boo
 		goto cleanup;
 	}
 	if (thorough) {
-		bool match = false;
-		if (mount_entry_get_sha256(e) == NULL) { // fallback to sha1
-			char *sha1 = smartcard_crypto_hash_file_block_new(img_path, SHA1);
-			match = mount_entry_match_sha1(e, sha1);
-			mem_free(sha1);
-		} else {
-			char *sha256 = smartcard_crypto_hash_file_block_new(img_path, SHA256);
-			match = mount_entry_match_sha256(e, sha256);
-			if (match) { // will only be executed if hash matches to signed config
-				int sha256_bin_len;
-				uint8_t *sha256_bin =
-					convert_hex_to_bin_new(sha256, &sha256_bin_len);
-				tss_ml_append(img_path, sha256_bin, sha256_bin_len, TSS_SHA256);
-				mem_free(sha256_bin);
-			}
-			mem_free(sha256);
+		int verity = guestos_check_mount_image_verity(e, img_path, true);
+		if (verity >= 0) {
+			res = verity ? CHECK_IMAGE_GOOD : CHECK_IMAGE_HASH_MISMATCH;
+			goto cleanup;
 		}
-		if (!match)
+
+		const char *files[] = { img_path };
+		char *sha1 = NULL, *sha256 = NULL;
+		unsigned algos = guestos_mount_image_hash_algos(e);
+
+		bool cached = guestos_hash_cache_lookup(os, img_path, algos, &sha1, &sha256);
+		if (!cached)
+			hash_files_block(1, files, algos, &sha1, &sha256);
+		if (!guestos_check_mount_image_hashes(os, e, img_path, sha1, sha256, cached))
 			res = CHECK_IMAGE_HASH_MISMATCH;
+		mem_free(sha1);
+		mem_free(sha256);
 	}
 
 cleanup:
@@ -318,33 +458,198 @@ cleanup:
 	return res;
 }
 
-bool
-guestos_images_are_complete(const guestos_t *os, bool thorough)
+/*
+ * Returns true for the mount types whose images may be streamed lazily, i.e.
+ * which are attached read-only by c_vol.
+ */
+static bool
+guestos_mount_type_is_lazy(enum mount_type t)
+{
+	switch (t) {
+	case MOUNT_TYPE_SHARED:
+	case MOUNT_TYPE_OVERLAY_RO:
+	case MOUNT_TYPE_LAYER:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * If lazy is set, images being streamed lazily are accepted by quick checks.
+ */
+static bool
+guestos_images_check_complete(const guestos_t *os, bool thorough, bool lazy)
 {
 	ASSERT(os);
 	INFO("Checking images of GuestOS %s v%" PRIu64 " (%s)", guestos_get_name(os),
-	     guestos_get_version(os), thorough ? "thorough" : "quick");
+	     guestos_get_version(os),
+	     thorough ? "thorough" : (lazy ? "quick, lazy images allowed" : "quick"));
 
 	bool res = true;
 	mount_t *mnt = mount_new();	   // need to get "mounts" to get image URLs... feels wrong
 	guestos_fill_mount(os, mnt);	   // append mounts to be checked
 	guestos_fill_mount_setup(os, mnt); // append setup mode mounts to be check
 	size_t n = mount_get_count(mnt);
+
+	// quick checks first, then hash all remaining images concurrently
+	mount_entry_t **entries = mem_new0(mount_entry_t *, n);
+	char **img_paths = mem_new0(char *, n);
+	size_t count = 0;
 	for (size_t i = 0; i < n; i++) {
 		mount_entry_t *e = mount_get_entry(mnt, i);
-		enum mount_type t = mount_entry_get_type(e);
-		if (t != MOUNT_TYPE_SHARED && t != MOUNT_TYPE_FLASH && t != MOUNT_TYPE_OVERLAY_RO &&
-		    t != MOUNT_TYPE_SHARED_RW)
+		if (!guestos_mount_type_has_image(mount_entry_get_type(e)))
 			continue;
-		if (guestos_check_mount_image_block(os, e, thorough) != CHECK_IMAGE_GOOD) {
+		if (lazy && !thorough && guestos_mount_type_is_lazy(mount_entry_get_type(e))) {
+			char *img_path = guestos_get_image_path_new(os, e);
+			bool streaming = lazyimg_is_streaming(img_path);
+			mem_free(img_path);
+			if (streaming)
+				continue;
+		}
+		if (guestos_check_mount_image_block(os, e, false) != CHECK_IMAGE_GOOD) {
 			res = false;
-			break;
+			goto out;
+		}
+		entries[count] = e;
+		img_paths[count] = guestos_get_image_path_new(os, e);
+
+		// images protected by fs-verity do not need to be hashed
+		int verity = -1;
+		if (thorough)
+			verity = guestos_check_mount_image_verity(e, img_paths[count], true);
+		if (verity == 0) {
+			mem_free(img_paths[count]);
+			res = false;
+			goto out;
+		}
+		if (verity > 0) {
+			mem_free(img_paths[count]);
+			continue;
+		}
+		count++;
+	}
+
+	if (thorough && count > 0) {
+		char **sha1 = mem_new0(char *, count);
+		char **sha256 = mem_new0(char *, count);
+		bool *cached = mem_new0(bool, count);
+		const char **misses = mem_new0(const char *, count);
+		size_t *miss_index = mem_new0(size_t, count);
+		size_t nmisses = 0;
+		unsigned algos = 0;
+
+		for (size_t i = 0; i < count; i++) {
+			unsigned a = guestos_mount_image_hash_algos(entries[i]);
+			cached[i] = guestos_hash_cache_lookup(os, img_paths[i], a, &sha1[i],
+							      &sha256[i]);
+			if (cached[i])
+				continue;
+			misses[nmisses] = img_paths[i];
+			miss_index[nmisses++] = i;
+			algos |= a;
+		}
+
+		if (nmisses > 0) {
+			char **miss_sha1 = mem_new0(char *, nmisses);
+			char **miss_sha256 = mem_new0(char *, nmisses);
+
+			hash_files_block(nmisses, misses, algos, miss_sha1, miss_sha256);
+			for (size_t j = 0; j < nmisses; j++) {
+				sha1[miss_index[j]] = miss_sha1[j];
+				sha256[miss_index[j]] = miss_sha256[j];
+			}
+			mem_free(miss_sha1);
+			mem_free(miss_sha256);
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			if (res && !guestos_check_mount_image_hashes(os, entries[i], img_paths[i],
+								     sha1[i], sha256[i], cached[i]))
+				res = false;
+			mem_free(sha1[i]);
+			mem_free(sha256[i]);
 		}
+		mem_free(miss_index);
+		mem_free(misses);
+		mem_free(cached);
+		mem_free(sha1);
+		mem_free(sha256);
 	}
+
+out:
+	for (size_t i = 0; i < count; i++)
+		mem_free(img_paths[i]);
+	mem_free(img_paths);
+	mem_free(entries);
 	mount_free(mnt);
 	return res;
 }
 
+bool
+guestos_images_are_complete(const guestos_t *os, bool thorough)
+{
+	return guestos_images_check_complete(os, thorough, false);
+}
+
+bool
+guestos_images_are_available(const guestos_t *os)
+{
+	return guestos_images_check_complete(os, false, true);
+}
+
+bool
+guestos_images_are_streaming(const guestos_t *os)
+{
+	ASSERT(os);
+	return os->streaming > 0;
+}
+
+static int
+guestos_prefetch_images_cb(const char *path, const char *file, UNUSED void *data)
+{
+	size_t len = strlen(file);
+
+	IF_TRUE_RETVAL(len < 4 || strcmp(file + len - 4, ".img"), 0);
+
+	char *img_path = mem_printf("%s/%s", path, file);
+	int ret = 0;
+
+	int fd = open(img_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || !file_is_regular(img_path))
+		goto out;
+
+	// the image is read anyway, either by the hashing below or through the loop device
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+	char *sha1 = NULL, *sha256 = NULL;
+	if (hash_cache_lookup(path, img_path, &sha1, &sha256)) {
+		mem_free(sha1);
+		mem_free(sha256);
+		goto out;
+	}
+
+	if (hash_file_speculative(img_path, HASH_SHA1 | HASH_SHA256) == 0)
+		ret = 1;
+out:
+	if (fd >= 0)
+		close(fd);
+	mem_free(img_path);
+	return ret;
+}
+
+int
+guestos_prefetch_images(const char *dir)
+{
+	ASSERT(dir);
+
+	int n = dir_foreach(dir, &guestos_prefetch_images_cb, NULL);
+
+	if (n > 0)
+		INFO("Speculatively hashing %d images in %s", n, dir);
+	return n;
+}
+
 /**
  * Performs a thorough check on the integrity of a mount image and deliver the
  * result via the given callback.
@@ -369,182 +674,85 @@ guestos_check_mount_image(guestos_t *os, mount_entry_t *e, check_mount_image_com
 		return;
 	}
 
-	const char *img_name = mount_entry_get_img(e);
-	char *img_path = mem_printf("%s/%s.img", guestos_get_dir(os), img_name);
+	char *img_path = guestos_get_image_path_new(os, e);
 	DEBUG("Checking image %s (thorough, non-blocking)", img_path);
 
+	int verity = guestos_check_mount_image_verity(e, img_path, false);
+	if (verity >= 0) {
+		cb(verity ? CHECK_IMAGE_GOOD : CHECK_IMAGE_HASH_MISMATCH, os, e, data);
+		mem_free(img_path);
+		return;
+	}
+
+	char *sha1 = NULL, *sha256 = NULL;
+	if (guestos_hash_cache_lookup(os, img_path, HASH_SHA1 | HASH_SHA256, &sha1, &sha256)) {
+		bool match = mount_entry_match_sha1(e, sha1) && mount_entry_match_sha256(e, sha256);
+		cb(match ? CHECK_IMAGE_GOOD : CHECK_IMAGE_HASH_MISMATCH, os, e, data);
+		mem_free(sha1);
+		mem_free(sha256);
+		mem_free(img_path);
+		return;
+	}
+
 	check_mount_image_t *task = check_mount_image_new(os, e, img_path, cb, data);
-	smartcard_crypto_hash_file(img_path, SHA1, check_mount_image_cb_sha1, task);
+	if (hash_file(img_path, HASH_SHA1 | HASH_SHA256, check_mount_image_cb_hash, task) < 0) {
+		check_mount_image_free(task);
+		cb(CHECK_IMAGE_ERROR, os, e, data);
+	}
 
 	mem_free(img_path);
 }
 
-// ITERATE IMAGES
-
-// internal task callback types
-typedef struct iterate_images iterate_images_t;
-
-typedef void (*iterate_images_callback_t)(iterate_images_t *task,
-					  guestos_check_mount_image_result_t res, mount_entry_t *e);
-
-typedef union {
-	guestos_images_check_complete_cb_t check_complete;
-	guestos_images_download_complete_cb_t download_complete;
-} iterate_images_on_complete_cb_t;
+// CHECK IMAGES
 
-struct iterate_images {
-	// locals
+/*
+ * The thorough image checks of guestos_images_check() are started all at once,
+ * so that the hash workers process the images concurrently. This task collects
+ * the per-image results.
+ */
+typedef struct check_images {
 	guestos_t *os;
 	mount_t *mnt;
-	size_t n, i;
-	// iterator callback
-	iterate_images_callback_t iter_cb;
-	// callbacks to report back final result to caller
-	iterate_images_on_complete_cb_t on_complete;
-	void *complete_data;
-	// download
-	unsigned int dl_attempts;
-	unsigned int dl_count;
-	bool dl_started;
-};
-
-static iterate_images_t *
-iterate_images_new(guestos_t *os, mount_t *mnt, size_t n, iterate_images_callback_t iter_cb,
-		   iterate_images_on_complete_cb_t complete_cb, void *complete_data)
-{
-	iterate_images_t *task = mem_new(iterate_images_t, 1);
-	task->os = os;
-	task->mnt = mnt;
-	task->n = n;
-	task->i = 0;
-	task->iter_cb = iter_cb;
-	task->on_complete = complete_cb;
-	task->complete_data = complete_data;
-	task->dl_attempts = 0;
-	task->dl_count = 0;
-	task->dl_started = false;
-	return task;
-}
-
-static void
-iterate_images_free(iterate_images_t *task)
-{
-	IF_NULL_RETURN(task);
-	mount_free(task->mnt);
-	mem_free(task);
-}
+	size_t pending;
+	bool good;
+	guestos_images_check_complete_cb_t cb;
+	void *data;
+} check_images_t;
 
 static void
-iterate_images_cb_check_image(guestos_check_mount_image_result_t res,
-			      UNUSED guestos_t *os /*already in task*/, mount_entry_t *e,
-			      void *data)
-{
-	iterate_images_t *task = data;
-	ASSERT(task);
-	ASSERT(task->os == os);
-
-	task->iter_cb(task, res, e);
-}
-
-/**
- * Trigger image check for the next relevant (i.e. for SHARED or FLASH type) GuestOS image.
- *
- * @return true if next image was found and check for it was triggered, false otherwise.
- */
-static bool
-iterate_images_trigger_check(iterate_images_t *task)
-{
-	// look for next SHARED or FLASH type image
-	while (task->i < task->n) {
-		mount_entry_t *e = mount_get_entry(task->mnt, task->i);
-		enum mount_type t = mount_entry_get_type(e);
-		if (t == MOUNT_TYPE_SHARED || t == MOUNT_TYPE_FLASH || t == MOUNT_TYPE_OVERLAY_RO ||
-		    t == MOUNT_TYPE_SHARED_RW) {
-			DEBUG("Found next image %s.img for GuestOS %s v%" PRIu64
-			      ", triggering check.",
-			      mount_entry_get_img(e), guestos_get_name(task->os),
-			      guestos_get_version(task->os));
-			guestos_check_mount_image(task->os, e, iterate_images_cb_check_image, task);
-			return true;
-		}
-		++task->i;
-	}
-	DEBUG("No more images to check for GuestOS %s v%" PRIu64 ", stopping iteration.",
-	      guestos_get_name(task->os), guestos_get_version(task->os));
-	return false;
-}
-
-/**
- * Iterate over all (SHARED and FLASH type) images that are provided by the GuestOS
- * and call the given iter_cb callback for each of them.
- * The final result of the operation is returned via the complete_cb, if given.
- *
- * @param   os the GuestOS
- * @param   iter_cb the callback called for each GuestOS image
- * @param   complete_cb the callback to report the final result
- * @param   complete_data data parameter passed to the final result callback
- * @return  true if iteration was started (iter_cb should be called at least once),
- *	    false otherwise (e.g. when there are no images to iterate over)
- */
-static bool
-iterate_images_start(guestos_t *os, iterate_images_callback_t iter_cb,
-		     iterate_images_on_complete_cb_t on_complete, void *complete_data)
+check_images_done(check_images_t *task)
 {
-	ASSERT(os);
-
-	DEBUG("Iterating through images of GuestOS %s v%" PRIu64 "...", guestos_get_name(os),
-	      guestos_get_version(os));
+	if (--task->pending > 0)
+		return;
 
-	mount_t *mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong
-	guestos_fill_mount(os, mnt);
-	size_t n = mount_get_count(mnt);
-	if (n == 0) {
-		WARN("GuestOS %s v%" PRIu64 " has no mounts/images to iterate through.",
-		     guestos_get_name(os), guestos_get_version(os));
-		mount_free(mnt);
-		return false;
-	}
+	if (task->good)
+		INFO("GuestOS %s v%" PRIu64 " is complete, all images are good.",
+		     guestos_get_name(task->os), guestos_get_version(task->os));
 
-	iterate_images_t *task =
-		iterate_images_new(os, mnt, n, iter_cb, on_complete, complete_data);
-	if (iterate_images_trigger_check(task))
-		return true;
+	task->cb(task->good, task->os, task->data);
 
-	mount_free(mnt);
-	iterate_images_free(task);
-	return false;
+	mount_free(task->mnt);
+	mem_free(task);
 }
 
-// CHECK IMAGES
-
 static void
-iterate_images_cb_check(iterate_images_t *task, guestos_check_mount_image_result_t res,
-			mount_entry_t *e)
+check_images_cb_check_image(guestos_check_mount_image_result_t res,
+			    UNUSED guestos_t *os /*already in task*/, mount_entry_t *e, void *data)
 {
+	check_images_t *task = data;
 	ASSERT(task);
+	ASSERT(task->os == os);
 
-	bool good = (res == CHECK_IMAGE_GOOD);
-	if (good) {
-		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is GOOD, proceeding ...",
-		      guestos_get_name(task->os), guestos_get_version(task->os),
-		      mount_entry_get_img(e));
-		task->i++;
-		if (iterate_images_trigger_check(task))
-			return;
-		INFO("GuestOS %s v%" PRIu64 " is complete, all images are good.",
-		     guestos_get_name(task->os), guestos_get_version(task->os));
+	if (res == CHECK_IMAGE_GOOD) {
+		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is GOOD", guestos_get_name(task->os),
+		      guestos_get_version(task->os), mount_entry_get_img(e));
 	} else {
-		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is BAD, stopping ...",
-		      guestos_get_name(task->os), guestos_get_version(task->os),
-		      mount_entry_get_img(e));
+		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is BAD", guestos_get_name(task->os),
+		      guestos_get_version(task->os), mount_entry_get_img(e));
+		task->good = false;
 	}
 
-	// bad or last image: notify caller
-	if (task->on_complete.check_complete)
-		task->on_complete.check_complete(good, task->os, task->complete_data);
-
-	// cleanup
-	iterate_images_free(task);
+	check_images_done(task);
 }
 
 void
@@ -554,16 +762,30 @@ guestos_images_check(guestos_t *os, guestos_images_check_complete_cb_t cb, void
 	ASSERT(cb);
 	INFO("Checking images of GuestOS %s v%" PRIu64 " (thorough)", guestos_get_name(os),
 	     guestos_get_version(os));
-	// prepare image iteration
-	if (!iterate_images_start(os, iterate_images_cb_check,
-				  (iterate_images_on_complete_cb_t){ .check_complete = cb },
-				  data)) {
+
+	check_images_t *task = mem_new0(check_images_t, 1);
+	task->os = os;
+	task->mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong
+	task->good = true;
+	task->cb = cb;
+	task->data = data;
+	guestos_fill_mount(os, task->mnt);
+
+	// hold a reference while triggering, results may be delivered synchronously
+	task->pending = 1;
+	size_t n = mount_get_count(task->mnt);
+	for (size_t i = 0; i < n; i++) {
+		mount_entry_t *e = mount_get_entry(task->mnt, i);
+		if (!guestos_mount_type_has_image(mount_entry_get_type(e)))
+			continue;
+		task->pending++;
+		guestos_check_mount_image(os, e, check_images_cb_check_image, task);
+	}
+	if (task->pending == 1)
 		DEBUG("No images to check for GuestOS %s v%" PRIu64, guestos_get_name(os),
 		      guestos_get_version(os));
-		// notify caller and free
-		if (cb)
-			cb(true, os, data);
-	}
+
+	check_images_done(task);
 }
 
 // DOWNLOAD IMAGES
@@ -574,109 +796,392 @@ typedef enum download_images_result {
 	DOWNLOAD_IMAGES_INPROGRESS
 } download_images_result_t;
 */
-static void
-iterate_images_cb_download_complete(download_t *dl, bool success, void *data);
+/*
+ * guestos_images_download() checks all images at once and downloads the bad
+ * ones concurrently. A downloaded image is verified against the config with the
+ * digests computed during the download, i.e. without reading it once more.
+ * If an older version of the GuestOS is installed, a delta update from its
+ * image is tried first, which requires to verify the assembled image afterwards.
+ * In lazy mode, read-only images are streamed instead, so that they can be
+ * attached before they are complete, and are verified likewise at the end.
+ * If the peer cache is enabled, an image is fetched from other devices in the
+ * local network which hold it already before any of that, see peer.h.
+ */
+typedef struct download_images {
+	guestos_t *os;
+	mount_t *mnt;
+	size_t pending;
+	unsigned int count;
+	bool complete;
+	guestos_images_download_complete_cb_t cb;
+	void *data;
+} download_images_t;
 
-static bool
-iterate_images_trigger_download(iterate_images_t *task)
+typedef struct download_image {
+	download_images_t *task;
+	mount_entry_t *e;
+	unsigned int attempts;
+	bool delta_tried;
+	bool lazy_tried;
+	bool peer_tried;
+} download_image_t;
+
+static void
+download_images_done(download_images_t *task)
 {
-	ASSERT(task);
+	if (--task->pending > 0)
+		return;
 
-	mount_entry_t *e = mount_get_entry(task->mnt, task->i);
-	const char *img_name = mount_entry_get_img(e);
+	if (task->complete)
+		INFO("GuestOS %s v%" PRIu64 " is now complete, all images have been downloaded.",
+		     guestos_get_name(task->os), guestos_get_version(task->os));
 
-	TRACE("dl_attempt = %u for %s.img", task->dl_attempts, img_name);
-	if (task->dl_attempts >= GUESTOS_MAX_DOWNLOAD_ATTEMPTS) {
-		WARN("Maximum download attempts (%d) exceeded for %s.img. Aborting image downloads.",
-		     GUESTOS_MAX_DOWNLOAD_ATTEMPTS, img_name);
-		return false;
-	}
-	task->dl_attempts++; // increase dl_attempt counter
+	// notify caller
+	if (task->cb)
+		task->cb(task->complete, task->count, task->os, task->data);
+	task->os->downloading = false;
 
-	// check if guestos has update file server, use device.conf as fallback
-	const char *update_base_url = guestos_config_get_update_base_url(task->os->cfg) ?
-					      guestos_config_get_update_base_url(task->os->cfg) :
-					      cmld_get_device_update_base_url();
-	char *img_path = mem_printf("%s/%s.img", guestos_get_dir(task->os), img_name);
-	char *img_url = mem_printf("%s/operatingsystems/%s/%s-%" PRIu64 "/%s.img", update_base_url,
-				   hardware_get_name(), guestos_get_name(task->os),
-				   guestos_get_version(task->os), img_name);
-	// invoke downloader
-	DEBUG("Downloading %s to %s (attempt=%u).", img_url, img_path, task->dl_attempts);
-	download_t *dl = download_new(img_url, img_path, iterate_images_cb_download_complete, task);
-	mem_free(img_url);
-	mem_free(img_path);
-	if (download_start(dl) < 0) {
-		ERROR("Failed to start download for %s", download_get_url(dl));
-		download_free(dl);
-		return false;
-	}
-	return true;
+	mount_free(task->mnt);
+	mem_free(task);
 }
 
 static void
-iterate_images_cb_download_complete(download_t *dl, bool success, void *data)
-{
-	iterate_images_t *task = data;
-	ASSERT(task);
+download_image_cb_complete(download_t *dl, bool success, void *data);
 
-	if (success) {
-		INFO("Download of %s succeeded!", download_get_url(dl));
-		bool res = iterate_images_trigger_check(task);
-		ASSERT(res);
-	} else {
-		WARN("Download of %s failed!", download_get_url(dl));
-		if (!iterate_images_trigger_download(task)) {
-			// notify caller
-			if (task->on_complete.download_complete)
-				task->on_complete.download_complete(false, task->dl_count, task->os,
-								    task->complete_data);
-			task->os->downloading = false;
-			// cleanup
-			iterate_images_free(task);
-		}
-	}
-	download_free(dl);
-}
+static void
+download_image_cb_delta(bool success, void *data);
 
 static void
-iterate_images_cb_download_check(iterate_images_t *task, guestos_check_mount_image_result_t res,
-				 mount_entry_t *e)
-{
-	ASSERT(task);
+download_image_cb_lazy(bool success, void *data);
 
-	bool good = (res == CHECK_IMAGE_GOOD);
-	if (good) {
-		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is GOOD, proceeding ...",
-		      guestos_get_name(task->os), guestos_get_version(task->os),
-		      mount_entry_get_img(e));
-		task->dl_attempts = 0; // reset dl_attempt counter
-		if (task->dl_started) {
-			task->dl_count++;
-			task->dl_started = false;
+static void
+download_image_cb_peer(bool success, void *data);
+
+/*
+ * Fetches an image from peers in the local network if the peer cache is
+ * enabled and the signed config has the digest of its chunk index, which the
+ * chunks from the peers are verified with.
+ */
+static bool
+download_image_try_peer(download_image_t *img, const char *img_url, const char *img_path)
+{
+	IF_TRUE_RETVAL(img->peer_tried, false);
+	img->peer_tried = true;
+
+	IF_FALSE_RETVAL(peer_is_enabled(), false);
+	IF_TRUE_RETVAL(!strncmp(img_url, "file://", 7), false);
+	const char *sha256 = mount_entry_get_sha256(img->e);
+	const char *index_sha256 = mount_entry_get_chunks_sha256(img->e);
+	IF_TRUE_RETVAL(!sha256 || !index_sha256, false);
+
+	DEBUG("Looking for %s on peers.", img_path);
+	return !peer_fetch(img_url, img_path, sha256, index_sha256, download_image_cb_peer, img);
+}
+
+/*
+ * Starts to stream a read-only image lazily if enabled and the signed config
+ * has the digest of its chunk index, which the chunks are verified with.
+ */
+static bool
+download_image_try_lazy(download_image_t *img, const char *img_url, const char *img_path)
+{
+	IF_TRUE_RETVAL(img->lazy_tried, false);
+	img->lazy_tried = true;
+
+	IF_FALSE_RETVAL(cmld_is_lazy_images_enabled(), false);
+	IF_FALSE_RETVAL(guestos_mount_type_is_lazy(mount_entry_get_type(img->e)), false);
+	const char *index_sha256 = mount_entry_get_chunks_sha256(img->e);
+	IF_NULL_RETVAL(index_sha256, false);
+
+	DEBUG("Streaming %s lazily.", img_path);
+	if (lazyimg_fetch(img_url, img_path, index_sha256, download_image_cb_lazy, img) < 0)
+		return false;
+	img->task->os->streaming++;
+	return true;
+}
+
+/*
+ * Returns the path of the image img_name of the latest older version of os
+ * which is available locally, NULL if there is none.
+ */
+static char *
+download_image_get_delta_base_new(const guestos_t *os, const char *img_name)
+{
+	const guestos_t *base_os = NULL;
+	char *base = NULL;
+
+	for (size_t i = 0; i < guestos_mgr_get_guestos_count(); i++) {
+		const guestos_t *o = guestos_mgr_get_guestos_by_index(i);
+		if (strcmp(guestos_get_name(o), guestos_get_name(os)) ||
+		    guestos_get_version(o) >= guestos_get_version(os) ||
+		    (base_os && guestos_get_version(o) <= guestos_get_version(base_os)))
+			continue;
+
+		char *path = mem_printf("%s/%s.img", guestos_get_dir(o), img_name);
+		if (!file_exists(path)) {
+			mem_free(path);
+			continue;
+		}
+		mem_free(base);
+		base = path;
+		base_os = o;
+	}
+
+	return base;
+}
+
+static bool
+download_image_trigger(download_image_t *img)
+{
+	ASSERT(img);
+
+	guestos_t *os = img->task->os;
+	const char *img_name = mount_entry_get_img(img->e);
+
+	TRACE("dl_attempt = %u for %s.img", img->attempts, img_name);
+	if (img->attempts >= GUESTOS_MAX_DOWNLOAD_ATTEMPTS) {
+		WARN("Maximum download attempts (%d) exceeded for %s.img. Aborting image download.",
+		     GUESTOS_MAX_DOWNLOAD_ATTEMPTS, img_name);
+		return false;
+	}
+	img->attempts++; // increase dl_attempt counter
+
+	// check if guestos has update file server, use device.conf as fallback
+	const char *update_base_url = guestos_config_get_update_base_url(os->cfg) ?
+					      guestos_config_get_update_base_url(os->cfg) :
+					      cmld_get_device_update_base_url();
+	char *img_path = guestos_get_image_path_new(os, img->e);
+	char *img_url = NULL;
+	char *base = NULL;
+	if (mount_entry_get_type(img->e) == MOUNT_TYPE_LAYER) {
+		// layers are content addressed, so no older version can serve as delta base
+		img_url = mem_printf("%s/operatingsystems/%s/%s/%s.img", update_base_url,
+				     hardware_get_name(), GUESTOS_LAYER_DIR, img_name);
+		img->delta_tried = true;
+		if (mkdir(os->layer_dir, 0755) < 0 && errno != EEXIST)
+			WARN_ERRNO("Could not mkdir layer store %s", os->layer_dir);
+	} else {
+		img_url = mem_printf("%s/operatingsystems/%s/%s-%" PRIu64 "/%s.img",
+				     update_base_url, hardware_get_name(), guestos_get_name(os),
+				     guestos_get_version(os), img_name);
+	}
+
+	if (download_image_try_peer(img, img_url, img_path) ||
+	    download_image_try_lazy(img, img_url, img_path)) {
+		// like a delta attempt, these fall back to a download on failure
+		img->attempts--;
+		mem_free(img_url);
+		mem_free(img_path);
+		return true;
+	}
+
+	if (!img->delta_tried)
+		base = download_image_get_delta_base_new(os, img_name);
+	img->delta_tried = true;
+	if (base) {
+		DEBUG("Trying delta update of %s from %s.", img_path, base);
+		int ret = delta_fetch(img_url, img_path, base,
+				      mount_entry_get_chunks_sha256(img->e),
+				      download_image_cb_delta, img);
+		mem_free(base);
+		if (!ret) {
+			// the delta attempt does not count, it falls back to a download anyway
+			img->attempts--;
+			mem_free(img_url);
+			mem_free(img_path);
+			return true;
 		}
-		task->i++;
-		if (iterate_images_trigger_check(task))
+	}
+
+	// invoke downloader
+	DEBUG("Downloading %s to %s (attempt=%u).", img_url, img_path, img->attempts);
+	download_t *dl = download_new(img_url, img_path, download_image_cb_complete, img);
+	mem_free(img_url);
+	mem_free(img_path);
+	if (download_start(dl) < 0) {
+		ERROR("Failed to start download for %s", download_get_url(dl));
+		download_free(dl);
+		return false;
+	}
+	return true;
+}
+
+static void
+download_image_cb_complete(download_t *dl, bool success, void *data)
+{
+	download_image_t *img = data;
+	ASSERT(img);
+	download_images_t *task = img->task;
+
+	if (success) {
+		const char *img_path = download_get_file(dl);
+		guestos_check_mount_image_result_t res =
+			guestos_check_mount_image_block(task->os, img->e, false);
+		if (res == CHECK_IMAGE_GOOD &&
+		    !guestos_check_mount_image_hashes(task->os, img->e, img_path,
+						      download_get_sha1(dl),
+						      download_get_sha256(dl), false))
+			res = CHECK_IMAGE_HASH_MISMATCH;
+
+		if (res == CHECK_IMAGE_GOOD) {
+			INFO("Download of %s succeeded!", download_get_url(dl));
+			task->count++;
+			mem_free(img);
+			download_free(dl);
+			download_images_done(task);
 			return;
-		INFO("GuestOS %s v%" PRIu64 " is now complete, all images have been downloaded.",
+		}
+		WARN("Downloaded %s does not match GuestOS %s v%" PRIu64, img_path,
 		     guestos_get_name(task->os), guestos_get_version(task->os));
+		// start over instead of resuming the bad image
+		if (unlink(img_path) < 0)
+			WARN_ERRNO("Could not remove %s", img_path);
 	} else {
-		// bad image: trigger actual download
-		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is BAD, triggering download ...",
-		      guestos_get_name(task->os), guestos_get_version(task->os),
-		      mount_entry_get_img(e));
-		task->dl_started = true;
-		if (iterate_images_trigger_download(task))
-			return;
+		WARN("Download of %s failed!", download_get_url(dl));
 	}
+	download_free(dl);
 
-	// notify caller
-	if (task->on_complete.download_complete)
-		task->on_complete.download_complete(good, task->dl_count, task->os,
-						    task->complete_data);
-	task->os->downloading = false;
-	// cleanup
-	iterate_images_free(task);
+	if (download_image_trigger(img))
+		return;
+
+	task->complete = false;
+	mem_free(img);
+	download_images_done(task);
+}
+
+/*
+ * Verifies an image assembled by a delta update or streamed lazily.
+ */
+static void
+download_image_cb_check_assembled(guestos_check_mount_image_result_t res,
+				  UNUSED guestos_t *os /*already in task*/, mount_entry_t *e,
+				  void *data)
+{
+	download_image_t *img = data;
+	ASSERT(img);
+	download_images_t *task = img->task;
+
+	if (res == CHECK_IMAGE_GOOD) {
+		INFO("Assembling %s.img for GuestOS %s v%" PRIu64 " succeeded!",
+		     mount_entry_get_img(e), guestos_get_name(task->os),
+		     guestos_get_version(task->os));
+		task->count++;
+		mem_free(img);
+		download_images_done(task);
+		return;
+	}
+
+	char *img_path = guestos_get_image_path_new(task->os, e);
+	WARN("Assembled %s does not match GuestOS %s v%" PRIu64 ", downloading it completely",
+	     img_path, guestos_get_name(task->os), guestos_get_version(task->os));
+	if (unlink(img_path) < 0)
+		WARN_ERRNO("Could not remove %s", img_path);
+	mem_free(img_path);
+
+	if (download_image_trigger(img))
+		return;
+
+	task->complete = false;
+	mem_free(img);
+	download_images_done(task);
+}
+
+static void
+download_image_cb_delta(bool success, void *data)
+{
+	download_image_t *img = data;
+	ASSERT(img);
+	download_images_t *task = img->task;
+
+	if (success) {
+		// the delta has no digests of the download, verify the assembled image
+		guestos_check_mount_image(task->os, img->e, download_image_cb_check_assembled, img);
+		return;
+	}
+
+	DEBUG("Delta update of %s.img failed, downloading it completely",
+	      mount_entry_get_img(img->e));
+	if (download_image_trigger(img))
+		return;
+
+	task->complete = false;
+	mem_free(img);
+	download_images_done(task);
+}
+
+static void
+download_image_cb_lazy(bool success, void *data)
+{
+	download_image_t *img = data;
+	ASSERT(img);
+	download_images_t *task = img->task;
+
+	task->os->streaming--;
+	if (success) {
+		// only the chunks read through a device have been verified so far
+		guestos_check_mount_image(task->os, img->e, download_image_cb_check_assembled, img);
+		return;
+	}
+
+	DEBUG("Streaming %s.img failed, downloading it", mount_entry_get_img(img->e));
+	if (download_image_trigger(img))
+		return;
+
+	task->complete = false;
+	mem_free(img);
+	download_images_done(task);
+}
+
+static void
+download_image_cb_peer(bool success, void *data)
+{
+	download_image_t *img = data;
+	ASSERT(img);
+	download_images_t *task = img->task;
+
+	if (success) {
+		// each chunk has been verified, but not the image as a whole
+		guestos_check_mount_image(task->os, img->e, download_image_cb_check_assembled, img);
+		return;
+	}
+
+	DEBUG("Fetching %s.img from peers failed, downloading it", mount_entry_get_img(img->e));
+	if (download_image_trigger(img))
+		return;
+
+	task->complete = false;
+	mem_free(img);
+	download_images_done(task);
+}
+
+static void
+download_images_cb_check_image(guestos_check_mount_image_result_t res,
+			       UNUSED guestos_t *os /*already in task*/, mount_entry_t *e,
+			       void *data)
+{
+	download_images_t *task = data;
+	ASSERT(task);
+	ASSERT(task->os == os);
+
+	if (res == CHECK_IMAGE_GOOD) {
+		DEBUG("GuestOS %s v%" PRIu64 " image %s.img is GOOD", guestos_get_name(task->os),
+		      guestos_get_version(task->os), mount_entry_get_img(e));
+		download_images_done(task);
+		return;
+	}
+
+	// bad image: trigger actual download
+	DEBUG("GuestOS %s v%" PRIu64 " image %s.img is BAD, triggering download ...",
+	      guestos_get_name(task->os), guestos_get_version(task->os), mount_entry_get_img(e));
+	download_image_t *img = mem_new0(download_image_t, 1);
+	img->task = task;
+	img->e = e;
+	if (download_image_trigger(img))
+		return;
+
+	task->complete = false;
+	mem_free(img);
+	download_images_done(task);
 }
 
 bool
@@ -712,212 +1217,741 @@ guestos_images_download(guestos_t *os, guestos_images_download_complete_cb_t cb,
 		      guestos_get_name(os), guestos_get_version(os));
 		return os->downloading;
 	}
-	// prepare image iteration
 	os->downloading = true;
-	if (!iterate_images_start(os, iterate_images_cb_download_check,
-				  (iterate_images_on_complete_cb_t){ .download_complete = cb },
-				  data)) {
+
+	download_images_t *task = mem_new0(download_images_t, 1);
+	task->os = os;
+	task->mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong
+	task->complete = true;
+	task->cb = cb;
+	task->data = data;
+	guestos_fill_mount(os, task->mnt);
+
+	// hold a reference while triggering, results may be delivered synchronously
+	task->pending = 1;
+	size_t n = mount_get_count(task->mnt);
+	for (size_t i = 0; i < n; i++) {
+		mount_entry_t *e = mount_get_entry(task->mnt, i);
+		if (!guestos_mount_type_has_image(mount_entry_get_type(e)))
+			continue;
+		task->pending++;
+		guestos_check_mount_image(os, e, download_images_cb_check_image, task);
+	}
+	if (task->pending == 1) {
 		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "download-os-nothing-to-download",
 				guestos_get_name(os), 0);
 		DEBUG("No images to download for GuestOS %s v%" PRIu64, guestos_get_name(os),
 		      guestos_get_version(os));
-		// notify caller
-		if (cb)
-			cb(true, 0, os, data);
-		os->downloading = false;
-		return os->downloading;
 	}
+
+	download_images_done(task);
 	return os->downloading;
 }
 
 // FLASH IMAGES
 
-typedef enum {
-	VERIFY_PARTITION_MATCH,
-	VERIFY_PARTITION_ERROR,
-	VERIFY_PARTITION_MISMATCH,
-} verify_partition_result_t;
+/*
+ * Digests of the first len bytes of a flash partition. An entry is only valid
+ * for the generation of the partition it was computed for, see partition_get_gen().
+ */
+typedef struct partition_hash {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	uint64_t gen;
+	off_t len;
+	char *sha1;
+	char *sha256;
+	time_t verified; // when the digests matched a signed GuestOS config, 0 if never
+} partition_hash_t;
+
+static list_t *partition_hash_list = NULL;
+
+/*
+ * Determines the generation of a partition, i.e. a value which changes whenever
+ * data is written to it. For block devices this is the number of sectors written
+ * since boot as accounted by the kernel, for regular files (e.g. in test setups
+ * without real partitions) the ctime.
+ */
+static int
+partition_get_gen(const struct stat *st, uint64_t *gen)
+{
+	if (!S_ISBLK(st->st_mode)) {
+		*gen = (uint64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+		return 0;
+	}
+
+	int ret = -1;
+	char *stat_file = mem_printf("/sys/dev/block/%u:%u/stat", major(st->st_rdev),
+				     minor(st->st_rdev));
+	char *stat = file_read_new(stat_file, 1024);
+	// read I/Os, read merges, read sectors, read ticks, write I/Os, write merges, write sectors
+	uint64_t v[7];
+	if (stat && sscanf(stat, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+				 " %" SCNu64 " %" SCNu64,
+			   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) == 7) {
+		*gen = v[6];
+		ret = 0;
+	} else {
+		WARN("Could not read write statistics of partition from %s", stat_file);
+	}
+	mem_free(stat);
+	mem_free(stat_file);
+	return ret;
+}
+
+static partition_hash_t *
+partition_hash_find(const char *path)
+{
+	for (list_t *l = partition_hash_list; l; l = l->next) {
+		partition_hash_t *ph = l->data;
+		if (!strcmp(ph->path, path))
+			return ph;
+	}
+	return NULL;
+}
+
+static void
+partition_hash_free(partition_hash_t *ph)
+{
+	IF_NULL_RETURN(ph);
+	mem_free(ph->path);
+	mem_free(ph->sha1);
+	mem_free(ph->sha256);
+	mem_free(ph);
+}
+
+/*
+ * Caches the digests of a partition, which are not verified yet.
+ */
+static partition_hash_t *
+partition_hash_store(const char *path, dev_t dev, ino_t ino, uint64_t gen, off_t len,
+		     const char *sha1, const char *sha256)
+{
+	partition_hash_t *ph = partition_hash_find(path);
+	if (!ph) {
+		ph = mem_new0(partition_hash_t, 1);
+		ph->path = mem_strdup(path);
+		partition_hash_list = list_append(partition_hash_list, ph);
+	}
+	ph->dev = dev;
+	ph->ino = ino;
+	ph->gen = gen;
+	ph->len = len;
+	mem_free(ph->sha1);
+	mem_free(ph->sha256);
+	ph->sha1 = sha1 ? mem_strdup(sha1) : NULL;
+	ph->sha256 = sha256 ? mem_strdup(sha256) : NULL;
+	ph->verified = 0;
+	return ph;
+}
+
+/*
+ * Determines the device, inode and generation of a partition as they are
+ * recorded in the cache.
+ */
+static int
+partition_get_id(const char *path, dev_t *dev, ino_t *ino, uint64_t *gen)
+{
+	struct stat st;
+
+	IF_TRUE_RETVAL(stat(path, &st) < 0, -1);
+	*dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	*ino = st.st_ino;
+	return partition_get_gen(&st, gen);
+}
+
+/*
+ * Returns when the first len bytes of a partition were last verified against a
+ * signed GuestOS config, 0 if never or if the partition has been written since.
+ */
+static time_t
+partition_hash_get_verified(const char *path, off_t len)
+{
+	dev_t dev;
+	ino_t ino;
+	uint64_t gen;
+
+	partition_hash_t *ph = partition_hash_find(path);
+	IF_NULL_RETVAL(ph, 0);
+	IF_TRUE_RETVAL(partition_get_id(path, &dev, &ino, &gen) < 0, 0);
+
+	bool valid = ph->dev == dev && ph->ino == ino && ph->gen == gen && ph->len == len;
+	return valid ? ph->verified : 0;
+}
+
+/*
+ * Opens a partition for direct I/O which bypasses the page cache, thus the
+ * partition contents are read from the medium and flashed data does not evict
+ * the page cache. Falls back to buffered I/O if direct I/O is not supported,
+ * e.g. for partitions backed by files on tmpfs.
+ */
+static int
+partition_open(const char *path, int flags)
+{
+	int fd = open(path, flags | O_DIRECT | O_CLOEXEC);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(path, flags | O_CLOEXEC);
+	return fd;
+}
+
+static ssize_t
+partition_pread(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = pread(fd, (char *)buf + done, len - done, off + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/*
+ * Checks that the partition behind fd is able to hold len bytes.
+ */
+static bool
+partition_check_size(int fd, const char *path, off_t len)
+{
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		ERROR_ERRNO("Could not determine size of partition %s", path);
+		return false;
+	}
+	if (size < len) {
+		ERROR("Partition %s is too small (%jd bytes) for an image of %jd bytes", path,
+		      (intmax_t)size, (intmax_t)len);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * State of hashing the first len bytes of a partition chunk by chunk, so that
+ * a large partition does not block the event loop, see partition_hash_begin().
+ */
+typedef struct partition_hasher {
+	char *path;
+	off_t len;
+	off_t off;
+	int fd;
+	void *buf;
+	hash_stream_t *hs;
+	bool gen_valid; // the generation was taken before hashing, concurrent writes invalidate it
+	uint64_t gen;
+	dev_t dev;
+	ino_t ino;
+} partition_hasher_t;
+
+static void
+partition_hasher_release(partition_hasher_t *hasher)
+{
+	hash_stream_free(hasher->hs);
+	hasher->hs = NULL;
+	free(hasher->buf);
+	hasher->buf = NULL;
+	if (hasher->fd >= 0)
+		close(hasher->fd);
+	hasher->fd = -1;
+	mem_free(hasher->path);
+}
 
 /**
- * Verifies if the contents of the partition and image match.
+ * Starts to compute the digests of the first len bytes of a partition. The
+ * digests are cached per partition and only recomputed if the partition has
+ * been written to since, so that unchanged partitions are read at most once
+ * per cmld run.
  *
- * @param img_path path to the image file
- * @param part_path full path to the partition
- * @return whether the contents MATCH or MISMATCH, or ERROR if something goes wrong
+ * @return 1 if the digests were taken from the cache, 0 if hashing was started
+ *         and has to be continued by partition_hash_step(), -1 on error
  */
-static verify_partition_result_t
-verify_partition(const char *img_path, const char *part_path)
-{
-	ASSERT(img_path);
-	ASSERT(part_path);
-
-	verify_partition_result_t res = VERIFY_PARTITION_ERROR;
-	int img = open(img_path, O_RDONLY);
-	int part = open(part_path, O_RDONLY);
-	if (img == -1) {
-		WARN_ERRNO("Verifying partition %s: Cannot open image %s for reading.", part_path,
-			   img_path);
-		goto cleanup_files;
-	}
-	if (part == -1) {
-		WARN_ERRNO("Verifying partition %s: Cannot open partition for reading.", part_path);
-		goto cleanup_files;
-	}
-
-	char *img_buf = mem_alloc(GUESTOS_VERIFY_BLOCKSIZE);
-	char *part_buf = mem_alloc(GUESTOS_VERIFY_BLOCKSIZE);
-	ssize_t img_bytes, part_bytes;
-	do {
-		img_bytes = read(img, img_buf, GUESTOS_VERIFY_BLOCKSIZE);
-		if (img_bytes < 0) {
-			ERROR_ERRNO("Verifying partition %s: Cannot read from image %s.", part_path,
-				    img_path);
-			goto cleanup;
-		}
-		if (img_bytes == 0) {
-			DEBUG("Verifying partition %s: Success. Content matches with image %s.",
-			      part_path, img_path);
-			res = VERIFY_PARTITION_MATCH;
-			goto cleanup;
-		}
-		ASSERT(img_bytes <= GUESTOS_VERIFY_BLOCKSIZE);
-		part_bytes = read(part, part_buf, img_bytes);
-		if (part_bytes < 0) {
-			ERROR_ERRNO("Verifying partition %s: Cannot read from partition.",
-				    part_path);
-			goto cleanup;
+static int
+partition_hash_begin(partition_hasher_t *hasher, const char *path, off_t len, unsigned algos,
+		     char **sha1, char **sha256)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		WARN_ERRNO("Could not stat partition %s", path);
+		return -1;
+	}
+	hasher->gen_valid = partition_get_gen(&st, &hasher->gen) == 0;
+	hasher->dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	hasher->ino = st.st_ino;
+
+	partition_hash_t *ph = partition_hash_find(path);
+	if (ph && hasher->gen_valid && ph->dev == hasher->dev && ph->ino == st.st_ino &&
+	    ph->gen == hasher->gen && ph->len == len && (!(algos & HASH_SHA1) || ph->sha1) &&
+	    (!(algos & HASH_SHA256) || ph->sha256)) {
+		DEBUG("Using cached hash values for partition %s", path);
+		*sha1 = ph->sha1 ? mem_strdup(ph->sha1) : NULL;
+		*sha256 = ph->sha256 ? mem_strdup(ph->sha256) : NULL;
+		return 1;
+	}
+
+	hasher->fd = partition_open(path, O_RDONLY);
+	if (hasher->fd < 0) {
+		WARN_ERRNO("Could not open partition %s for reading", path);
+		return -1;
+	}
+	hasher->path = mem_strdup(path);
+	hasher->len = len;
+	hasher->off = 0;
+	if (!partition_check_size(hasher->fd, path, len))
+		goto err;
+	if (posix_memalign(&hasher->buf, GUESTOS_FLASH_ALIGN, GUESTOS_FLASH_CHUNKSIZE)) {
+		ERROR("Could not allocate buffer for hashing partition %s", path);
+		hasher->buf = NULL;
+		goto err;
+	}
+	if (!(hasher->hs = hash_stream_new(algos)))
+		goto err;
+	return 0;
+err:
+	partition_hasher_release(hasher);
+	return -1;
+}
+
+/**
+ * Hashes the next chunk of the partition. Once the whole length is hashed, the
+ * digests are returned and stored in the cache.
+ *
+ * @return 1 if chunks are left, 0 if the digests are set, -1 on error
+ */
+static int
+partition_hash_step(partition_hasher_t *hasher, char **sha1, char **sha256)
+{
+	if (hasher->off < hasher->len) {
+		size_t n = MIN(GUESTOS_FLASH_CHUNKSIZE, (size_t)(hasher->len - hasher->off));
+		// direct I/O requires aligned lengths, only the first n bytes are hashed
+		size_t n_aligned = GUESTOS_FLASH_ALIGN_UP(n);
+		if (partition_pread(hasher->fd, hasher->buf, n_aligned, hasher->off) <
+		    (ssize_t)n) {
+			ERROR_ERRNO("Could not read partition %s at offset %jd", hasher->path,
+				    (intmax_t)hasher->off);
+			goto err;
 		}
-	} while (img_bytes == part_bytes && !memcmp(img_buf, part_buf, img_bytes));
+		if (hash_stream_update(hasher->hs, hasher->buf, n) < 0)
+			goto err;
+		hasher->off += n;
+		return 1;
+	}
 
-	DEBUG("Verifying partition %s: Failed. Content differs from image %s.", part_path,
-	      img_path);
-	res = VERIFY_PARTITION_MISMATCH;
+	if (hash_stream_final(hasher->hs, sha1, sha256) < 0)
+		goto err;
 
-cleanup:
-	mem_free(part_buf);
-	mem_free(img_buf);
-cleanup_files:
-	if (img != -1)
-		close(img);
-	if (part != -1)
-		close(part);
-	return res;
+	if (hasher->gen_valid)
+		partition_hash_store(hasher->path, hasher->dev, hasher->ino, hasher->gen,
+				     hasher->len, *sha1, *sha256);
+	partition_hasher_release(hasher);
+	return 0;
+err:
+	partition_hasher_release(hasher);
+	return -1;
+}
+
+static void
+partition_hash_invalidate(const char *path)
+{
+	partition_hash_t *ph = partition_hash_find(path);
+	IF_NULL_RETURN(ph);
+	partition_hash_list = list_remove(partition_hash_list, ph);
+	partition_hash_free(ph);
+}
+
+/*
+ * State of flashing an image to a partition chunk by chunk, see
+ * partition_flash_begin().
+ */
+typedef struct partition_flasher {
+	const char *img_path;
+	const char *part_path;
+	off_t len;
+	off_t off;
+	off_t written;
+	int img;
+	int part;
+	void *img_buf;
+	void *part_buf;
+} partition_flasher_t;
+
+static void
+partition_flasher_release(partition_flasher_t *flasher)
+{
+	free(flasher->part_buf);
+	flasher->part_buf = NULL;
+	free(flasher->img_buf);
+	flasher->img_buf = NULL;
+	if (flasher->img >= 0)
+		close(flasher->img);
+	flasher->img = -1;
+	if (flasher->part >= 0)
+		close(flasher->part);
+	flasher->part = -1;
 }
 
 /**
- * Flashes a (FLASH type) mount entry if necessary and verifies the flashed data.
+ * Starts to flash an image to a partition, writing only those blocks which
+ * differ from the current partition contents. Writes of adjacent differing
+ * blocks are merged and issued with direct I/O.
  *
- * @param os the GuestOS to which the mount entry belongs to
- * @param e the mount entry to flash (type must be FLASH)
- * @return -1 on error, 0 if there was nothing to flash, 1 if the image was successfully flashed
+ * @param img_path path to the image file, must be valid until the flasher is released
+ * @param part_path full path to the partition, must be valid until the flasher is released
+ * @param len size of the image in bytes
+ * @return 0 if flashing has to be continued by partition_flash_step(), -1 on error
  */
 static int
-verify_flash_mount_entry(guestos_t *os, mount_entry_t *e)
+partition_flash_begin(partition_flasher_t *flasher, const char *img_path, const char *part_path,
+		      off_t len)
 {
-	ASSERT(os);
-	ASSERT(e);
+	flasher->img_path = img_path;
+	flasher->part_path = part_path;
+	flasher->len = len;
+	flasher->off = 0;
+	flasher->written = 0;
+	flasher->img = open(img_path, O_RDONLY | O_CLOEXEC);
+	flasher->part = partition_open(part_path, O_RDWR);
+	if (flasher->img < 0) {
+		ERROR_ERRNO("Flashing partition %s: Cannot open image %s for reading.", part_path,
+			    img_path);
+		goto err;
+	}
+	if (flasher->part < 0) {
+		ERROR_ERRNO("Flashing partition %s: Cannot open partition for writing.", part_path);
+		goto err;
+	}
+	if (!partition_check_size(flasher->part, part_path, len))
+		goto err;
+	posix_fadvise(flasher->img, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (posix_memalign(&flasher->img_buf, GUESTOS_FLASH_ALIGN, GUESTOS_FLASH_CHUNKSIZE) ||
+	    posix_memalign(&flasher->part_buf, GUESTOS_FLASH_ALIGN, GUESTOS_FLASH_CHUNKSIZE)) {
+		ERROR("Flashing partition %s: Cannot allocate buffers.", part_path);
+		goto err;
+	}
+	return 0;
+err:
+	partition_flasher_release(flasher);
+	return -1;
+}
+
+/**
+ * Flashes the next chunk of the image. The partition is synced once the whole
+ * image is written.
+ *
+ * @return 1 if chunks are left, 0 if the image is flashed, -1 on error
+ */
+static int
+partition_flash_step(partition_flasher_t *flasher)
+{
+	const char *part_path = flasher->part_path;
+	char *img_buf = flasher->img_buf;
+	char *part_buf = flasher->part_buf;
+	off_t off = flasher->off;
+
+	if (off >= flasher->len) {
+		if (fdatasync(flasher->part) < 0) {
+			ERROR_ERRNO("Flashing partition %s: Cannot sync partition.", part_path);
+			goto err;
+		}
+		partition_flasher_release(flasher);
+		return 0;
+	}
+
+	size_t n = MIN(GUESTOS_FLASH_CHUNKSIZE, (size_t)(flasher->len - off));
+	size_t n_aligned = GUESTOS_FLASH_ALIGN_UP(n);
+
+	if (partition_pread(flasher->img, img_buf, n, off) != (ssize_t)n) {
+		ERROR_ERRNO("Flashing partition %s: Cannot read from image %s.", part_path,
+			    flasher->img_path);
+		goto err;
+	}
+	// the partition is read with the aligned length, thus the tail of a last
+	// partial block keeps its contents when it is written back
+	if (partition_pread(flasher->part, part_buf, n_aligned, off) != (ssize_t)n_aligned) {
+		ERROR_ERRNO("Flashing partition %s: Cannot read from partition.", part_path);
+		goto err;
+	}
+
+	for (size_t blk = 0; blk < n;) {
+		size_t blk_len = MIN(GUESTOS_VERIFY_BLOCKSIZE, n - blk);
+		if (!memcmp(img_buf + blk, part_buf + blk, blk_len)) {
+			blk += GUESTOS_VERIFY_BLOCKSIZE;
+			continue;
+		}
+		// merge all adjacent differing blocks into a single write
+		size_t start = blk;
+		do {
+			memcpy(part_buf + blk, img_buf + blk, blk_len);
+			blk += GUESTOS_VERIFY_BLOCKSIZE;
+			blk_len = blk < n ? MIN(GUESTOS_VERIFY_BLOCKSIZE, n - blk) : 0;
+		} while (blk_len && memcmp(img_buf + blk, part_buf + blk, blk_len));
+
+		size_t wlen = MIN(blk, n_aligned) - start;
+		ssize_t ret;
+		do {
+			ret = pwrite(flasher->part, part_buf + start, wlen, off + start);
+		} while (ret < 0 && errno == EINTR);
+		if (ret != (ssize_t)wlen) {
+			ERROR_ERRNO("Flashing partition %s: Cannot write at offset %jd.", part_path,
+				    (intmax_t)(off + start));
+			goto err;
+		}
+		flasher->written += wlen;
+	}
+	flasher->off += n;
+	return 1;
+err:
+	partition_flasher_release(flasher);
+	return -1;
+}
+
+typedef enum {
+	GUESTOS_FLASH_NEXT,   // look for the next FLASH mount entry
+	GUESTOS_FLASH_CHECK,  // hash the partition to check if it has to be flashed
+	GUESTOS_FLASH_WRITE,  // write the differing blocks of the image
+	GUESTOS_FLASH_VERIFY, // hash the partition again to verify the flashed data
+} guestos_flash_phase_t;
+
+/*
+ * Flashing the images of a GuestOS as a cooperative task on the event loop.
+ * Each step reads (and writes) at most one chunk of a partition.
+ */
+struct guestos_flash {
+	guestos_t *os;
+	mount_t *mnt;
+	size_t index; // of the current mount entry in mnt
+	guestos_flash_phase_t phase;
+	char *img_path;
+	char *flash_path;
+	off_t len;
+	partition_hasher_t hasher;
+	partition_flasher_t flasher;
+	int flashed;
+	event_task_t *task;
+	guestos_images_flash_complete_cb_t cb;
+	void *data;
+};
+
+static void
+guestos_flash_entry_release(guestos_flash_t *flash)
+{
+	partition_hasher_release(&flash->hasher);
+	partition_flasher_release(&flash->flasher);
+	mem_free(flash->img_path);
+	mem_free(flash->flash_path);
+}
+
+/*
+ * Removes the flash task and delivers the result, i.e. the number of flashed
+ * images or -1 on error.
+ */
+static void
+guestos_flash_finish(guestos_flash_t *flash, int result)
+{
+	guestos_t *os = flash->os;
+
+	event_remove_task(flash->task);
+	event_task_free(flash->task);
+	guestos_flash_entry_release(flash);
+	mount_free(flash->mnt);
+	os->flash = NULL;
+
+	if (result > 0)
+		DEBUG("Images for GuestOS %s have been flashed.", guestos_get_name(os));
+	else if (result == 0)
+		DEBUG("Nothing to flash for GuestOS %s.", guestos_get_name(os));
+
+	flash->cb(result, os, flash->data);
+	mem_free(flash);
+}
+
+/*
+ * Returns the path of the partition a FLASH mount entry is flashed to.
+ */
+static char *
+guestos_get_flash_path_new(const mount_entry_t *e)
+{
+	const char *flash_partition = mount_entry_get_dir(e);
+	return hardware_get_block_by_name_path() ?
+		       mem_printf("%s%s", hardware_get_block_by_name_path(), flash_partition) :
+		       mem_strdup(flash_partition);
+}
 
+/*
+ * Prepares flashing the current mount entry if it is of type FLASH.
+ *
+ * @return 1 if the entry is to be checked, 0 if it is skipped, -1 on error
+ */
+static int
+guestos_flash_entry_begin(guestos_flash_t *flash, mount_entry_t *e)
+{
+	guestos_t *os = flash->os;
 	const char *img_name = mount_entry_get_img(e);
 	const char *flash_partition = mount_entry_get_dir(e);
 	ASSERT(img_name);
 	ASSERT(flash_partition);
 
-	if (mount_entry_get_type(e) != MOUNT_TYPE_FLASH) {
-		WARN("Image %s of GuestOS %s is not a FLASH image. Skipping.", img_name,
-		     guestos_get_name(os));
+	if (mount_entry_get_type(e) != MOUNT_TYPE_FLASH)
 		return 0;
-	}
 	if (flash_partition[0] != '/') {
 		ERROR("Invalid target partition %s for flashing %s for GuestOS %s", flash_partition,
 		      img_name, guestos_get_name(os));
 		return -1;
 	}
 
-	int res = -1;
-	char *img_path = mem_printf("%s/%s.img", guestos_get_dir(os), img_name);
-	char *flash_path =
-		hardware_get_block_by_name_path() ?
-			mem_printf("%s%s", hardware_get_block_by_name_path(), flash_partition) :
-			mem_strdup(flash_partition);
-	DEBUG("Flashing image %s to partition %s", img_path, flash_path);
+	flash->img_path = mem_printf("%s/%s.img", guestos_get_dir(os), img_name);
+	flash->flash_path = guestos_get_flash_path_new(e);
+	DEBUG("Flashing image %s to partition %s", flash->img_path, flash->flash_path);
 
-	switch (verify_partition(img_path, flash_path)) {
-	case VERIFY_PARTITION_MATCH:
-		DEBUG("Skipping flashing of partition %s: Already up to date with image %s.",
-		      flash_path, img_path);
-		res = 0;
-		break;
-	case VERIFY_PARTITION_MISMATCH:
-		DEBUG("Flashing partition %s with image %s.", flash_path, img_path);
-		file_copy(img_path, flash_path, mount_entry_get_size(e), GUESTOS_FLASH_BLOCKSIZE,
-			  0);
-
-		switch (verify_partition(img_path, flash_path)) {
-		case VERIFY_PARTITION_MATCH:
-			DEBUG("Successfully flashed image %s to %s", img_path, flash_path);
-			res = 1;
-			break;
-		default:
-			ERROR("Failed to flash image %s to partition %s", img_path, flash_path);
-			break;
-		}
-		break;
-	default:
-		ERROR("Failed to verify partition %s against image %s", flash_path, img_path);
-		break;
+	flash->len = file_size(flash->img_path);
+	if (flash->len < 0) {
+		ERROR("Failed to determine size of image %s", flash->img_path);
+		return -1;
 	}
-
-	mem_free(flash_path);
-	mem_free(img_path);
-	return res;
+	return 1;
 }
 
-/**
- * Flash images without checking them first.
+/*
+ * Starts or continues hashing the partition of the current mount entry. Once the
+ * digests are available, they are compared with the signed hash value of the
+ * image in the GuestOS config.
  *
- * @param os the GuestOS whose images to flash
- * @return -1 on error, number of flashed images otherwise
+ * @return 1 if hashing continues, 0 if the content matches, 2 if it differs, -1 on error
  */
 static int
-images_flash_no_check(guestos_t *os)
+guestos_flash_hash(guestos_flash_t *flash, const mount_entry_t *e, bool begin)
 {
-	INFO("Flashing images for GuestOS %s ...", guestos_get_name(os));
-	mount_t *mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong
-	guestos_fill_mount(os, mnt);
+	char *sha1 = NULL, *sha256 = NULL;
+	int ret;
+
+	if (begin) {
+		ret = partition_hash_begin(&flash->hasher, flash->flash_path, flash->len,
+					   guestos_mount_image_hash_algos(e), &sha1, &sha256);
+		if (ret == 0)
+			return 1;
+	} else {
+		ret = partition_hash_step(&flash->hasher, &sha1, &sha256);
+		if (ret == 1)
+			return 1;
+	}
+	if (ret < 0) {
+		WARN("Verifying partition %s: Could not hash partition.", flash->flash_path);
+		return -1;
+	}
 
-	int flashed = 0;
-	size_t n = mount_get_count(mnt);
-	for (size_t i = 0; i < n; i++) {
-		mount_entry_t *e = mount_get_entry(mnt, i);
-		if (mount_entry_get_type(e) != MOUNT_TYPE_FLASH)
-			continue;
+	bool use_sha1 = mount_entry_get_sha256(e) == NULL; // fallback to sha1
+	bool match = use_sha1 ? mount_entry_match_sha1(e, sha1) :
+				 mount_entry_match_sha256(e, sha256);
+	mem_free(sha1);
+	mem_free(sha256);
+
+	// freshly read from the partition, thus it need not be scrubbed soon
+	partition_hash_t *ph = partition_hash_find(flash->flash_path);
+	if (match && !begin && ph)
+		ph->verified = time(NULL);
+
+	DEBUG("Verifying partition %s: %s with image %s.", flash->flash_path,
+	      match ? "Success. Content matches" : "Failed. Content differs",
+	      mount_entry_get_img(e));
+	return match ? 0 : 2;
+}
 
-		int res = verify_flash_mount_entry(os, e);
-		if (res < 0) {
-			ERROR("Could not verify/flash partition %s with image %s, "
-			      "aborting flash for GuestOS %s.",
-			      mount_entry_get_dir(e), mount_entry_get_img(e), guestos_get_name(os));
-			flashed = -1;
-			goto cleanup;
+static int
+guestos_flash_step(UNUSED event_task_t *task, void *data)
+{
+	guestos_flash_t *flash = data;
+	mount_entry_t *e = mount_get_entry(flash->mnt, flash->index);
+	int ret;
+
+	switch (flash->phase) {
+	case GUESTOS_FLASH_NEXT:
+		if (flash->index >= mount_get_count(flash->mnt)) {
+			guestos_flash_finish(flash, flash->flashed);
+			return EVENT_TASK_DONE;
+		}
+		ret = guestos_flash_entry_begin(flash, e);
+		if (ret < 0)
+			goto err;
+		if (ret == 0) {
+			flash->index++;
+			return EVENT_TASK_AGAIN;
+		}
+		flash->phase = GUESTOS_FLASH_CHECK;
+		ret = guestos_flash_hash(flash, e, true);
+		break;
+	case GUESTOS_FLASH_CHECK:
+	case GUESTOS_FLASH_VERIFY:
+		ret = guestos_flash_hash(flash, e, false);
+		break;
+	case GUESTOS_FLASH_WRITE:
+		ret = partition_flash_step(&flash->flasher);
+		if (ret < 0) {
+			partition_hash_invalidate(flash->flash_path);
+			ERROR("Failed to flash image %s to partition %s", flash->img_path,
+			      flash->flash_path);
+			goto err;
+		}
+		if (ret == 0) {
+			DEBUG("Wrote %jd of %jd bytes to partition %s",
+			      (intmax_t)flash->flasher.written, (intmax_t)flash->len,
+			      flash->flash_path);
+			flash->phase = GUESTOS_FLASH_VERIFY;
+			ret = guestos_flash_hash(flash, e, true);
+			break;
 		}
-		flashed += res;
+		return EVENT_TASK_AGAIN;
+	default:
+		goto err;
 	}
-	if (flashed > 0) {
-		DEBUG("Images for GuestOS %s have been flashed.", guestos_get_name(os));
-		// TODO notify caller about flash result?
+
+	// the partition is hashed, ret is the result of guestos_flash_hash()
+	if (ret == 1)
+		return EVENT_TASK_AGAIN;
+
+	if (flash->phase == GUESTOS_FLASH_CHECK && ret == 0) {
+		DEBUG("Skipping flashing of partition %s: Already up to date with image %s.",
+		      flash->flash_path, flash->img_path);
+	} else if (flash->phase == GUESTOS_FLASH_CHECK && ret == 2) {
+		DEBUG("Flashing partition %s with image %s.", flash->flash_path, flash->img_path);
+		if (partition_flash_begin(&flash->flasher, flash->img_path, flash->flash_path,
+					  flash->len) < 0) {
+			ERROR("Failed to flash image %s to partition %s", flash->img_path,
+			      flash->flash_path);
+			goto err;
+		}
+		flash->phase = GUESTOS_FLASH_WRITE;
+		return EVENT_TASK_AGAIN;
+	} else if (flash->phase == GUESTOS_FLASH_VERIFY && ret == 0) {
+		DEBUG("Successfully flashed image %s to %s", flash->img_path, flash->flash_path);
+		flash->flashed++;
 	} else {
-		DEBUG("Nothing to flash for GuestOS %s.", guestos_get_name(os));
+		ERROR("Failed to verify partition %s against image %s", flash->flash_path,
+		      flash->img_path);
+		goto err;
 	}
 
-cleanup:
-	mount_free(mnt);
-	return flashed;
+	guestos_flash_entry_release(flash);
+	flash->phase = GUESTOS_FLASH_NEXT;
+	flash->index++;
+	return EVENT_TASK_AGAIN;
+err:
+	ERROR("Could not verify/flash partition %s with image %s, aborting flash for GuestOS %s.",
+	      mount_entry_get_dir(e), mount_entry_get_img(e), guestos_get_name(flash->os));
+	guestos_flash_finish(flash, -1);
+	return EVENT_TASK_DONE;
 }
 
 int
-guestos_images_flash(guestos_t *os)
+guestos_images_flash(guestos_t *os, guestos_images_flash_complete_cb_t cb, void *data)
 {
 	ASSERT(os);
+	ASSERT(cb);
 	INFO("Flashing images of GuestOS %s %" PRIu64, guestos_get_name(os),
 	     guestos_get_version(os));
 
@@ -926,6 +1960,10 @@ guestos_images_flash(guestos_t *os)
 		ERROR("Cannot flash images for non-privileged GuestOS %s.", guestos_get_name(os));
 		return -1;
 	}
+	if (os->flash) {
+		ERROR("Images of GuestOS %s are already being flashed.", guestos_get_name(os));
+		return -1;
+	}
 
 	if (!guestos_images_are_complete(os, true)) {
 		ERROR("Cannot flash images for GuestOS %s: some images are corrupted!",
@@ -933,7 +1971,278 @@ guestos_images_flash(guestos_t *os)
 		return -1;
 	}
 
-	return images_flash_no_check(os);
+	guestos_flash_t *flash = mem_new0(guestos_flash_t, 1);
+	flash->os = os;
+	flash->mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong
+	guestos_fill_mount(os, flash->mnt);
+	flash->phase = GUESTOS_FLASH_NEXT;
+	flash->hasher.fd = -1;
+	flash->flasher.img = -1;
+	flash->flasher.part = -1;
+	flash->cb = cb;
+	flash->data = data;
+	// each step reads a chunk of a partition, thus the loop stays responsive
+	flash->task = event_task_new(EVENT_TASK_SLICE, &guestos_flash_step, flash);
+	os->flash = flash;
+	event_add_task(flash->task);
+
+	INFO("Flashing images for GuestOS %s ...", guestos_get_name(os));
+	return 0;
+}
+
+/*
+ * Re-verifying an image file or a flashed partition in the background, see
+ * guestos_scrub_next(). The mount entries are a copy of the GuestOS config,
+ * thus they remain valid if the GuestOS is freed while the hash job runs.
+ */
+struct guestos_scrub {
+	guestos_t *os; // NULL once the GuestOS has been freed
+	mount_t *mnt;
+	mount_entry_t *e;
+	char *path;
+	bool partition;
+	bool id_valid; // partition id taken before hashing, concurrent writes invalidate it
+	dev_t dev;
+	ino_t ino;
+	uint64_t gen;
+	guestos_scrub_complete_cb_t cb;
+	void *data;
+};
+
+static void
+guestos_scrub_free(guestos_scrub_t *scrub)
+{
+	mount_free(scrub->mnt);
+	mem_free(scrub->path);
+	mem_free(scrub);
+}
+
+/*
+ * Detaches the scrub from its GuestOS, the hash job cannot be stopped, thus its
+ * callback reports the scrub as canceled.
+ */
+static void
+guestos_scrub_cancel(guestos_scrub_t *scrub)
+{
+	scrub->os->scrub = NULL;
+	scrub->os = NULL;
+}
+
+static void
+guestos_scrub_cb_hash(UNUSED const char *file, const char *sha1, const char *sha256, void *data)
+{
+	guestos_scrub_t *scrub = data;
+	guestos_t *os = scrub->os;
+	guestos_scrub_result_t res;
+
+	if (!os) {
+		scrub->cb(GUESTOS_SCRUB_CANCELED, NULL, scrub->path, scrub->data);
+		guestos_scrub_free(scrub);
+		return;
+	}
+	os->scrub = NULL;
+
+	bool use_sha1 = mount_entry_get_sha256(scrub->e) == NULL; // fallback to sha1
+	if (!(use_sha1 ? sha1 : sha256))
+		res = GUESTOS_SCRUB_FAILED;
+	else if (use_sha1 ? mount_entry_match_sha1(scrub->e, sha1) :
+			    mount_entry_match_sha256(scrub->e, sha256))
+		res = GUESTOS_SCRUB_GOOD;
+	else
+		res = GUESTOS_SCRUB_MISMATCH;
+
+	if (scrub->partition) {
+		partition_hash_invalidate(scrub->path);
+		if (res == GUESTOS_SCRUB_GOOD && scrub->id_valid) {
+			partition_hash_t *ph =
+				partition_hash_store(scrub->path, scrub->dev, scrub->ino,
+						     scrub->gen, mount_entry_get_size(scrub->e),
+						     sha1, sha256);
+			ph->verified = time(NULL);
+		}
+	} else if (res == GUESTOS_SCRUB_GOOD) {
+		guestos_hash_cache_store(os, scrub->path, sha1, sha256);
+	} else if (res == GUESTOS_SCRUB_MISMATCH) {
+		// the next thorough check hashes the image again and fails
+		if (hash_cache_remove(guestos_get_dir(os), scrub->path) < 0)
+			WARN("Could not remove hash values of image %s from cache", scrub->path);
+	}
+	// reported once, the next instance of the GuestOS, e.g. an update, starts afresh
+	if (res != GUESTOS_SCRUB_GOOD)
+		os->scrub_failed = list_append(os->scrub_failed, mem_strdup(scrub->path));
+
+	scrub->cb(res, os, scrub->path, scrub->data);
+	guestos_scrub_free(scrub);
+}
+
+/*
+ * Returns when the image of a mount entry or, if partition is set, the partition
+ * it has been flashed to was last verified. Sets path to the one to scrub.
+ *
+ * @return the time of the last verification, 0 if never and -1 if the entry
+ *         cannot be scrubbed
+ */
+static time_t
+guestos_scrub_get_verified(const guestos_t *os, const mount_entry_t *e, bool partition,
+			   char **path)
+{
+	time_t verified = -1;
+
+	*path = NULL;
+	IF_FALSE_RETVAL(guestos_mount_type_has_image(mount_entry_get_type(e)), -1);
+	IF_FALSE_RETVAL(mount_entry_get_sha1(e) || mount_entry_get_sha256(e), -1);
+
+	if (partition) {
+		const char *dir = mount_entry_get_dir(e);
+		IF_FALSE_RETVAL(mount_entry_get_type(e) == MOUNT_TYPE_FLASH, -1);
+		IF_FALSE_RETVAL(dir && dir[0] == '/', -1);
+		// images are flashed once they are complete
+		char *img_path = guestos_get_image_path_new(os, e);
+		bool complete = file_size(img_path) == (off_t)mount_entry_get_size(e);
+		mem_free(img_path);
+		IF_FALSE_RETVAL(complete, -1);
+		*path = guestos_get_flash_path_new(e);
+		if (file_exists(*path))
+			verified = partition_hash_get_verified(*path, mount_entry_get_size(e));
+	} else {
+		// missing or incomplete images are left to the download
+		*path = guestos_get_image_path_new(os, e);
+		if (file_size(*path) == (off_t)mount_entry_get_size(e))
+			verified = hash_cache_get_verified(guestos_get_dir(os), *path);
+	}
+
+	for (list_t *l = os->scrub_failed; l && verified >= 0; l = l->next)
+		if (!strcmp(l->data, *path))
+			verified = -1;
+	if (verified < 0)
+		mem_free(*path);
+	return verified;
+}
+
+int
+guestos_scrub_next(guestos_t *os, bool partitions, time_t max_age, uint64_t rate,
+		   guestos_scrub_complete_cb_t cb, void *data)
+{
+	ASSERT(os);
+	ASSERT(cb);
+
+	IF_TRUE_RETVAL(os->scrub || os->flash || os->downloading, 0);
+
+	guestos_scrub_t *scrub = mem_new0(guestos_scrub_t, 1);
+	scrub->mnt = mount_new();
+	guestos_fill_mount(os, scrub->mnt);
+	guestos_fill_mount_setup(os, scrub->mnt);
+
+	// the image or partition verified longest ago is due next
+	time_t now = time(NULL);
+	time_t oldest = now - max_age;
+	size_t n = mount_get_count(scrub->mnt);
+	for (size_t i = 0; i < 2 * n; i++) {
+		bool partition = i >= n;
+		if (partition && !partitions)
+			break;
+		mount_entry_t *e = mount_get_entry(scrub->mnt, i % n);
+		char *path = NULL;
+		time_t verified = guestos_scrub_get_verified(os, e, partition, &path);
+		if (verified < 0 || verified > oldest) {
+			mem_free(path);
+			continue;
+		}
+		mem_free(scrub->path);
+		scrub->path = path;
+		scrub->e = e;
+		scrub->partition = partition;
+		oldest = verified;
+	}
+
+	if (!scrub->path) {
+		guestos_scrub_free(scrub);
+		return 0;
+	}
+
+	if (scrub->partition)
+		scrub->id_valid =
+			partition_get_id(scrub->path, &scrub->dev, &scrub->ino, &scrub->gen) == 0;
+	scrub->os = os;
+	scrub->cb = cb;
+	scrub->data = data;
+
+	DEBUG("Scrubbing %s %s of GuestOS %s (last verified %jd seconds ago)",
+	      scrub->partition ? "partition" : "image", scrub->path, guestos_get_name(os),
+	      oldest ? (intmax_t)(now - oldest) : (intmax_t)-1);
+
+	off_t len = scrub->partition ? (off_t)mount_entry_get_size(scrub->e) : -1;
+	if (hash_file_background(scrub->path, len, guestos_mount_image_hash_algos(scrub->e), rate,
+				 &guestos_scrub_cb_hash, scrub) < 0) {
+		ERROR("Could not start scrubbing %s", scrub->path);
+		guestos_scrub_free(scrub);
+		return -1;
+	}
+	os->scrub = scrub;
+	return 1;
+}
+
+/*
+ * Removing the images of a GuestOS as a cooperative task, since unlinking
+ * large image files may take a while on some file systems. The inode of each
+ * file is recorded beforehand, thus a file of a reinstalled GuestOS with the
+ * same name and version is not removed.
+ */
+typedef struct guestos_purge_file {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+} guestos_purge_file_t;
+
+typedef struct guestos_purge {
+	list_t *files; // of guestos_purge_file_t, the directory comes last
+	event_task_t *task;
+} guestos_purge_t;
+
+static void
+guestos_purge_add(guestos_purge_t *purge, const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0) {
+		if (errno != ENOENT)
+			WARN_ERRNO("Failed to stat %s", path);
+		return;
+	}
+	guestos_purge_file_t *file = mem_new0(guestos_purge_file_t, 1);
+	file->path = mem_strdup(path);
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	purge->files = list_append(purge->files, file);
+}
+
+static int
+guestos_purge_step(event_task_t *task, void *data)
+{
+	guestos_purge_t *purge = data;
+	struct stat st;
+
+	if (!purge->files) {
+		event_remove_task(task);
+		event_task_free(task);
+		mem_free(purge);
+		return EVENT_TASK_DONE;
+	}
+
+	guestos_purge_file_t *file = purge->files->data;
+	purge->files = list_unlink(purge->files, purge->files);
+
+	if (lstat(file->path, &st) < 0 || st.st_dev != file->dev || st.st_ino != file->ino) {
+		DEBUG("Not removing %s, it has been replaced or removed meanwhile", file->path);
+	} else if (S_ISDIR(st.st_mode)) {
+		if (rmdir(file->path) < 0)
+			WARN_ERRNO("Failed to remove directory %s", file->path);
+	} else if (unlink(file->path) < 0) {
+		WARN_ERRNO("Failed to erase file %s", file->path);
+	}
+	mem_free(file->path);
+	mem_free(file);
+	return EVENT_TASK_AGAIN;
 }
 
 void
@@ -942,25 +2251,8 @@ guestos_purge(guestos_t *os)
 	ASSERT(os);
 	DEBUG("Purging GuestOS %s v%" PRIu64, guestos_get_name(os), guestos_get_version(os));
 	const char *dir = guestos_get_dir(os);
-	// remove images
-	mount_t *mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong (again)
-	guestos_fill_mount(os, mnt);
-	size_t n = mount_get_count(mnt);
-	for (size_t i = 0; i < n; i++) {
-		mount_entry_t *e = mount_get_entry(mnt, i);
-		if (!e) {
-			ERROR("Could not get mount entry %zu for %s", i, guestos_get_name(os));
-			break;
-		}
-		const char *img_name = mount_entry_get_img(e);
-		char *img_path = mem_printf("%s/%s.img", dir, img_name);
 
-		if (file_exists(img_path) && unlink(img_path) < 0) {
-			WARN_ERRNO("Failed to erase file %s", img_path);
-		}
-		mem_free(img_path);
-	}
-	// remove config and signature file
+	// remove config and signature file at once, the GuestOS is not loaded again
 	const char *file = guestos_get_cfg_file(os);
 	if (unlink(file) < 0) {
 		WARN_ERRNO("Failed to erase file %s", file);
@@ -973,12 +2265,32 @@ guestos_purge(guestos_t *os)
 	if (unlink(file) < 0) {
 		WARN_ERRNO("Failed to erase file %s", file);
 	}
-	// remove dir
-	if (rmdir(dir) < 0) {
-		WARN_ERRNO("Failed to remove directory %s", dir);
-	}
+	hash_cache_clear(guestos_get_dir(os));
+
+	// remove images
+	guestos_purge_t *purge = mem_new0(guestos_purge_t, 1);
+	mount_t *mnt = mount_new(); // need to get "mounts" to get image URLs... feels wrong (again)
+	guestos_fill_mount(os, mnt);
+	size_t n = mount_get_count(mnt);
+	for (size_t i = 0; i < n; i++) {
+		mount_entry_t *e = mount_get_entry(mnt, i);
+		if (!e) {
+			ERROR("Could not get mount entry %zu for %s", i, guestos_get_name(os));
+			break;
+		}
+		// layers may be used by other GuestOSes
+		if (mount_entry_get_type(e) == MOUNT_TYPE_LAYER)
+			continue;
 
+		char *img_path = mem_printf("%s/%s.img", dir, mount_entry_get_img(e));
+		guestos_purge_add(purge, img_path);
+		mem_free(img_path);
+	}
 	mount_free(mnt);
+	guestos_purge_add(purge, dir);
+
+	purge->task = event_task_new(EVENT_TASK_SLICE, &guestos_purge_step, purge);
+	event_add_task(purge->task);
 }
 
 const char *
@@ -1009,6 +2321,48 @@ guestos_get_dir(const guestos_t *os)
 	return os->dir;
 }
 
+char *
+guestos_get_image_path_new(const guestos_t *os, const mount_entry_t *e)
+{
+	ASSERT(os);
+	ASSERT(e);
+
+	const char *dir = (mount_entry_get_type(e) == MOUNT_TYPE_LAYER) ? os->layer_dir : os->dir;
+	return mem_printf("%s/%s.img", dir, mount_entry_get_img(e));
+}
+
+char *
+guestos_get_verified_image_path_new(const guestos_t *os, const char *sha256)
+{
+	ASSERT(os);
+	ASSERT(sha256);
+
+	char *ret = NULL;
+	mount_t *mnt = mount_new();
+	guestos_fill_mount(os, mnt);
+
+	for (size_t i = 0; i < mount_get_count(mnt) && !ret; i++) {
+		mount_entry_t *e = mount_get_entry(mnt, i);
+		if (!guestos_mount_type_has_image(mount_entry_get_type(e)) ||
+		    !mount_entry_get_sha256(e) || strcasecmp(mount_entry_get_sha256(e), sha256))
+			continue;
+
+		// only an image whose digest has been computed from its content is vouched for
+		char *img_path = guestos_get_image_path_new(os, e);
+		char *sha1 = NULL, *cached = NULL;
+		if (guestos_hash_cache_lookup(os, img_path, HASH_SHA256, &sha1, &cached) &&
+		    !strcasecmp(cached, sha256))
+			ret = img_path;
+		else
+			mem_free(img_path);
+		mem_free(sha1);
+		mem_free(cached);
+	}
+
+	mount_free(mnt);
+	return ret;
+}
+
 void *
 guestos_get_raw_ptr(const guestos_t *os)
 {
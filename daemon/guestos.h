@@ -40,8 +40,11 @@
  */
 
 #include "mount.h"
+#include "guestos_config.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 /**
  * A structure to present an guest operating system
@@ -86,6 +89,16 @@ guestos_get_cert_file_new(const char *dir);
 guestos_t *
 guestos_new_from_file(const char *file, const char *basepath);
 
+/**
+ * Creates a GuestOS from an already loaded config with the specified basepath
+ * under which it expects its associated files (e.g. images).
+ * @param cfg the GuestOS config, ownership is transferred to the GuestOS
+ * @param basepath the base path for GuestOSes
+ * @return the GuestOS instance or NULL on failure, in which case cfg is freed
+ */
+guestos_t *
+guestos_new_from_config(guestos_config_t *cfg, const char *basepath);
+
 /**
  * Loads the GuestOS config from the given buffer with the specified basepath
  * under which it expects its associated files (e.g. images).
@@ -141,6 +154,35 @@ guestos_check_mount_image_block(const guestos_t *os, const mount_entry_t *e, boo
 bool
 guestos_images_are_complete(const guestos_t *os, bool thorough);
 
+/**
+ * Checks like a quick guestos_images_are_complete() whether the GuestOS can be
+ * used, but accepts images which are still being streamed lazily, since those
+ * can be attached already (see lazyimg.h).
+ *
+ * @param os the GuestOS instance whose images to check
+ * @return true if all images are good or being streamed, false otherwise
+ */
+bool
+guestos_images_are_available(const guestos_t *os);
+
+/**
+ * Checks whether images of the GuestOS are still being streamed lazily.
+ */
+bool
+guestos_images_are_streaming(const guestos_t *os);
+
+/**
+ * Reads the images in the directory of a GuestOS ahead into the page cache and
+ * hashes those without a hash cache entry speculatively, see
+ * hash_file_speculative(). The GuestOS does not need to be loaded and verified
+ * yet, thus this can be done before scd is available.
+ *
+ * @param dir the directory of the GuestOS
+ * @return the number of images which are hashed or -1 on error
+ */
+int
+guestos_prefetch_images(const char *dir);
+
 /**
  * Callback type for guestos_images_check() to report whether all images of a GuestOS are complete.
  */
@@ -176,14 +218,67 @@ typedef void (*guestos_images_download_complete_cb_t)(bool complete, unsigned in
 bool
 guestos_images_download(guestos_t *os, guestos_images_download_complete_cb_t cb, void *data);
 
+/**
+ * Callback which is invoked once the images of a GuestOS have been flashed.
+ *
+ * @param flashed number of images that have been flashed, or -1 on error
+ * @param os the GuestOS whose images were flashed
+ * @param data the data pointer given to guestos_images_flash()
+ */
+typedef void (*guestos_images_flash_complete_cb_t)(int flashed, guestos_t *os, void *data);
+
 /**
  * Flash the images for the given privileged GuestOS (i.e. a0os).
+ * The partitions are hashed and written in slices on the event loop, thus
+ * the result is delivered later via the callback.
  *
  * @param os the privileged GuestOS with images to be flashed
- * @return number of images that have been flashed, or -1 on error
+ * @param cb callback which is invoked with the result
+ * @param data payload data to be passed to the callback
+ * @return 0 if flashing was started, -1 on error (the callback is not invoked)
+ */
+int
+guestos_images_flash(guestos_t *os, guestos_images_flash_complete_cb_t cb, void *data);
+
+typedef enum guestos_scrub_result {
+	GUESTOS_SCRUB_GOOD,	///< the digests match the signed GuestOS config
+	GUESTOS_SCRUB_MISMATCH, ///< the digests differ from the signed GuestOS config
+	GUESTOS_SCRUB_FAILED,	///< the image or partition could not be read
+	GUESTOS_SCRUB_CANCELED, ///< the GuestOS was freed while scrubbing
+} guestos_scrub_result_t;
+
+/**
+ * Callback which is invoked once an image or partition has been scrubbed.
+ *
+ * @param res the result of the verification
+ * @param os the scrubbed GuestOS, NULL if the scrub was canceled
+ * @param path the scrubbed image file or partition
+ * @param data the data pointer given to guestos_scrub_next()
+ */
+typedef void (*guestos_scrub_complete_cb_t)(guestos_scrub_result_t res, guestos_t *os,
+					    const char *path, void *data);
+
+/**
+ * Re-verifies the image of the GuestOS, or the partition an image has been
+ * flashed to, which was verified longest ago against the signed config, given
+ * that this was more than max_age seconds ago. The data is read in the
+ * background at idle I/O priority, see hash_file_background(). On success, the
+ * time of the verification is recorded in the hash cache, on a mismatch the
+ * cached digests are dropped so that the next thorough check fails.
+ *
+ * @param os the GuestOS to scrub
+ * @param partitions also scrub the partitions of FLASH mounts, i.e. if os is
+ *        the privileged GuestOS whose images have been flashed
+ * @param max_age seconds after which a verification is due again
+ * @param rate maximum read bandwidth in bytes per second, 0 for no limit
+ * @param cb callback which is invoked with the result
+ * @param data payload data to be passed to the callback
+ * @return 1 if scrubbing was started, 0 if nothing is due or the GuestOS is busy
+ *         and -1 on error (the callback is only invoked if 1 is returned)
  */
 int
-guestos_images_flash(guestos_t *os);
+guestos_scrub_next(guestos_t *os, bool partitions, time_t max_age, uint64_t rate,
+		   guestos_scrub_complete_cb_t cb, void *data);
 
 /******************************************************************************/
 
@@ -222,6 +317,27 @@ guestos_get_cert_file(const guestos_t *os);
 const char *
 guestos_get_dir(const guestos_t *os);
 
+/**
+ * Returns the path of the image file of a mount entry of the GuestOS, which
+ * is located in the layer store shared by all GuestOSes for MOUNT_TYPE_LAYER.
+ * @param os the GuestOS instance
+ * @param e the mount entry of the image
+ * @return the newly allocated path
+ */
+char *
+guestos_get_image_path_new(const guestos_t *os, const mount_entry_t *e);
+
+/**
+ * Returns the path of the image of the GuestOS with the given sha256 if it is
+ * available locally and its digest in the hash cache matches, i.e. the image
+ * has been verified since it was last modified.
+ * @param os the GuestOS instance
+ * @param sha256 the digest of the image as listed in the signed config
+ * @return the newly allocated path, NULL if there is no such verified image
+ */
+char *
+guestos_get_verified_image_path_new(const guestos_t *os, const char *sha256);
+
 /**
  * Returns a pointer to the underlying GuestOS config.
  * @param os the GuestOS instance
@@ -21,10 +21,13 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define MEM_TAG "guestos"
+
 #include "guestos_config.h"
 #include "guestos.pb-c.h"
 
 #include "mount.h"
+#include "hash.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
@@ -59,6 +62,25 @@ guestos_config_new_from_buffer(unsigned char *buf, size_t buflen)
 	return cfg;
 }
 
+guestos_config_t *
+guestos_config_new_from_cachefile(const char *cache_file, const char *digest)
+{
+	ASSERT(cache_file);
+	ASSERT(digest);
+
+	return (GuestOSConfig *)protobuf_message_new_from_cachefile(
+		cache_file, &guest_osconfig__descriptor, digest, hash_cache_mac);
+}
+
+int
+guestos_config_write_to_cachefile(const guestos_config_t *cfg, const char *cache_file,
+				  const char *digest)
+{
+	ASSERT(cfg);
+	return protobuf_message_write_to_cachefile(cache_file, (const ProtobufCMessage *)cfg,
+						   digest, hash_cache_mac);
+}
+
 /**
  * Free an operating system data structure. Does not remove the persistent
  * parts of the operating system, i.e. the configuration and the images.
@@ -107,6 +129,8 @@ guestos_config_mount_type_from_protobuf(GuestOSMount__Type mt)
 		return MOUNT_TYPE_BIND_FILE;
 	case GUEST_OSMOUNT__TYPE__BIND_FILE_RW:
 		return MOUNT_TYPE_BIND_FILE_RW;
+	case GUEST_OSMOUNT__TYPE__LAYER:
+		return MOUNT_TYPE_LAYER;
 	default:
 		FATAL("Invalid protobuf mount type %d.", mt);
 	}
@@ -152,6 +176,10 @@ guestos_config_fill_mount_internal(GuestOSMount **mounts, size_t n_mounts, mount
 			mount_entry_set_sha1(e, m->image_sha1);
 		if (m->image_sha2_256)
 			mount_entry_set_sha256(e, m->image_sha2_256);
+		if (m->image_verity_sha256)
+			mount_entry_set_verity_sha256(e, m->image_verity_sha256);
+		if (m->image_chunks_sha256)
+			mount_entry_set_chunks_sha256(e, m->image_chunks_sha256);
 		if (m->mount_data)
 			mount_entry_set_mount_data(e, m->mount_data);
 	}
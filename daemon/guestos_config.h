@@ -59,6 +59,26 @@ guestos_config_new_from_file(const char *file);
 guestos_config_t *
 guestos_config_new_from_buffer(unsigned char *buf, size_t buflen);
 
+/**
+ * Loads a GuestOS config from the given binary cache file, if the digest of
+ * the source files stored in the cache matches the given one and the cache is
+ * authenticated by the key of the hash caches, see hash_cache_mac().
+ * @param cache_file the binary cache file
+ * @param digest the digest of the current source files of the config
+ * @return the guestos_config_t instance or NULL if there is no valid cache
+ */
+guestos_config_t *
+guestos_config_new_from_cachefile(const char *cache_file, const char *digest);
+
+/**
+ * Stores the given GuestOS config in binary form in the given cache file. The
+ * cache only saves parsing, the config still has to be verified when loaded.
+ * @return 0 on success, -1 otherwise
+ */
+int
+guestos_config_write_to_cachefile(const guestos_config_t *cfg, const char *cache_file,
+				  const char *digest);
+
 /**
  * Frees the given guestos_config_t instance.
  */
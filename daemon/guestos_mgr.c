@@ -21,6 +21,8 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+#define MEM_TAG "guestos"
+
 #include "guestos_mgr.h"
 #include "guestos.h"
 #include "guestos_config.h"
@@ -29,6 +31,7 @@
 #include "download.h"
 #include "smartcard.h"
 #include "audit.h"
+#include "hash.h"
 
 #include "common/macro.h"
 #include "common/list.h"
@@ -37,6 +40,7 @@
 #include "common/fd.h"
 #include "common/dir.h"
 #include "common/event.h"
+#include "common/protobuf.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -61,22 +65,172 @@
 #define LOCALCA_ROOT_CERT SCD_TOKEN_DIR "/localca_rootca.cert"
 #define TRUSTED_CA_STORE SCD_TOKEN_DIR "/ca"
 
+#define GUESTOS_MGR_SCRUB_POLL_INTERVAL 60000 // ms between checks whether scrubbing is due
+#define GUESTOS_MGR_SCRUB_POLL_SLACK 30000
+// scrubbing pauses while tasks are stalled on I/O for more than this percentage of time
+#define GUESTOS_MGR_SCRUB_IO_PRESSURE_MAX 10.0
+
 static list_t *guestos_list = NULL;
 
+/*
+ * GuestOSes found on storage which have not been loaded yet. Their config is
+ * only read and verified once they are selected by guestos_mgr_get_latest_by_name()
+ * or all GuestOSes are enumerated.
+ */
+typedef struct {
+	char *name;
+	uint64_t version;
+	char *entry; // name of the GuestOS directory in guestos_basepath
+} guestos_mgr_pending_t;
+
+static list_t *guestos_pending_list = NULL;
+
 static const char *guestos_basepath = NULL;
 static bool guestos_mgr_allow_locally_signed = false;
 
+static event_timer_t *guestos_mgr_scrub_timer = NULL;
+static time_t guestos_mgr_scrub_max_age = 0;
+static uint64_t guestos_mgr_scrub_rate = 0;
+static bool guestos_mgr_scrubbing = false;
+
 /******************************************************************************/
 
+static int
+guestos_mgr_load_os(const char *path, const char *name);
+
+static void
+guestos_mgr_pending_free(guestos_mgr_pending_t *pending)
+{
+	mem_free(pending->name);
+	mem_free(pending->entry);
+	mem_free(pending);
+}
+
+/**
+ * Loads and verifies a pending GuestOS and removes it from the pending list.
+ */
+static void
+guestos_mgr_load_pending(list_t *l)
+{
+	guestos_mgr_pending_t *pending = l->data;
+	guestos_pending_list = list_unlink(guestos_pending_list, l);
+
+	DEBUG("Loading GuestOS %s v%" PRIu64 " on demand", pending->name, pending->version);
+	guestos_mgr_load_os(guestos_basepath, pending->entry);
+	guestos_mgr_pending_free(pending);
+}
+
+/**
+ * Verifies the signatures of the configs of the given GuestOS directories in
+ * one batch, so that they are not verified one after the other when loaded.
+ */
+static void
+guestos_mgr_verify_prefetch(size_t n, const char *const entries[])
+{
+	char **cfg_files = mem_new0(char *, n);
+	char **sig_files = mem_new0(char *, n);
+	char **cert_files = mem_new0(char *, n);
+	char **digests = mem_new0(char *, n);
+	size_t m = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		char *dir = mem_printf("%s/%s", guestos_basepath, entries[i]);
+		cfg_files[m] = guestos_get_cfg_file_new(dir);
+		sig_files[m] = guestos_get_sig_file_new(dir);
+		cert_files[m] = guestos_get_cert_file_new(dir);
+		mem_free(dir);
+
+		const char *const files[] = { cfg_files[m], sig_files[m], cert_files[m] };
+		digests[m] = hash_files_digest_new(3, files);
+		if (!digests[m]) {
+			mem_free(cfg_files[m]);
+			mem_free(sig_files[m]);
+			mem_free(cert_files[m]);
+			continue;
+		}
+		m++;
+	}
+
+	smartcard_crypto_verify_files_prefetch(
+		m, (const char *const *)cfg_files, (const char *const *)sig_files,
+		(const char *const *)cert_files, (const char *const *)digests,
+		GUESTOS_MGR_VERIFY_HASH_ALGO);
+
+	for (size_t i = 0; i < m; i++) {
+		mem_free(cfg_files[i]);
+		mem_free(sig_files[i]);
+		mem_free(cert_files[i]);
+		mem_free(digests[i]);
+	}
+	mem_free(cfg_files);
+	mem_free(sig_files);
+	mem_free(cert_files);
+	mem_free(digests);
+}
+
+static void
+guestos_mgr_load_pending_all(void)
+{
+	size_t n = list_length(guestos_pending_list);
+	if (n > 1) {
+		const char **entries = mem_new0(const char *, n);
+		size_t i = 0;
+		for (list_t *l = guestos_pending_list; l; l = l->next)
+			entries[i++] = ((guestos_mgr_pending_t *)l->data)->entry;
+		guestos_mgr_verify_prefetch(n, entries);
+		mem_free(entries);
+	}
+
+	while (guestos_pending_list)
+		guestos_mgr_load_pending(guestos_pending_list);
+}
+
+static bool
+guestos_mgr_is_loaded(const char *name)
+{
+	for (list_t *l = guestos_list; l; l = l->next) {
+		if (!strcmp(name, guestos_get_name(l->data)))
+			return true;
+	}
+	return false;
+}
+
 static void
 guestos_mgr_purge_obsolete(void)
 {
 	INFO("Looking for obsolete GuestOSes to purge...");
+
+	/*
+	 * Pending GuestOSes have to be loaded to know their images. This is only
+	 * done for old versions of GuestOSes which are in use anyway, the other
+	 * ones are left alone until they are needed.
+	 */
+	for (list_t *l = guestos_pending_list; l;) {
+		guestos_mgr_pending_t *pending = l->data;
+		size_t n = list_length(guestos_pending_list);
+		guestos_t *latest = guestos_mgr_is_loaded(pending->name) ?
+					    guestos_mgr_get_latest_by_name(pending->name, true) :
+					    NULL;
+		if (n != list_length(guestos_pending_list)) {
+			// pending list was changed by the lookup, start over
+			l = guestos_pending_list;
+			continue;
+		}
+		if (latest && pending->version < guestos_get_version(latest)) {
+			guestos_mgr_load_pending(l);
+			l = guestos_pending_list;
+			continue;
+		}
+		l = l->next;
+	}
+
 	for (list_t *l = guestos_list; l;) {
 		list_t *next = l->next;
 		guestos_t *os = l->data;
 		guestos_t *latest = guestos_mgr_get_latest_by_name(guestos_get_name(os), true);
-		if ((latest && guestos_get_version(os) < guestos_get_version(latest))) {
+		// keep older versions until the images of a lazy update are complete
+		if (latest && guestos_get_version(os) < guestos_get_version(latest) &&
+		    !guestos_images_are_streaming(latest)) {
 			guestos_list = list_unlink(guestos_list, l);
 			guestos_purge(os);
 			guestos_free(os);
@@ -86,7 +240,7 @@ guestos_mgr_purge_obsolete(void)
 }
 
 static int
-guestos_mgr_load_operatingsystems_cb(const char *path, const char *name, UNUSED void *data)
+guestos_mgr_load_os(const char *path, const char *name)
 {
 	int res = 0; // counter
 	guestos_verify_result_t guestos_verified = GUESTOS_UNSIGNED;
@@ -99,9 +253,25 @@ guestos_mgr_load_operatingsystems_cb(const char *path, const char *name, UNUSED
 	char *cfg_file = guestos_get_cfg_file_new(dir);
 	char *sig_file = guestos_get_sig_file_new(dir);
 	char *cert_file = guestos_get_cert_file_new(dir);
+	char *cache_file = mem_printf("%s" PROTOBUF_CACHEFILE_SUFFIX, cfg_file);
 
-	smartcard_crypto_verify_result_t verify_result = smartcard_crypto_verify_file_block(
-		cfg_file, sig_file, cert_file, GUESTOS_MGR_VERIFY_HASH_ALGO);
+	/*
+	 * The signature is verified on every load, possibly in a batch already.
+	 * Only the parsed config is cached in binary form, bound to the digest of
+	 * config, signature and certificate and authenticated by the device bound
+	 * key of the hash caches, so that unchanged configs are not parsed again.
+	 */
+	const char *const files[] = { cfg_file, sig_file, cert_file };
+	char *digest = hash_files_digest_new(3, files);
+	bool cacheable = digest && hash_cache_has_key();
+	guestos_config_t *cfg = NULL;
+
+	smartcard_crypto_verify_result_t verify_result;
+	if (!digest || !smartcard_crypto_verify_take_prefetched(
+			       digest, GUESTOS_MGR_VERIFY_HASH_ALGO, &verify_result)) {
+		verify_result = smartcard_crypto_verify_file_block(cfg_file, sig_file, cert_file,
+								   GUESTOS_MGR_VERIFY_HASH_ALGO);
+	}
 
 	switch (verify_result) {
 	case VERIFY_GOOD:
@@ -130,7 +300,13 @@ guestos_mgr_load_operatingsystems_cb(const char *path, const char *name, UNUSED
 		goto cleanup_files;
 	}
 
-	if (guestos_mgr_add_from_file(cfg_file, guestos_verified) < 0) {
+	if (cacheable && (cfg = guestos_config_new_from_cachefile(cache_file, digest)))
+		DEBUG("Loaded GuestOS config %s from cache", cfg_file);
+	else if ((cfg = guestos_config_new_from_file(cfg_file)) && cacheable &&
+		 guestos_config_write_to_cachefile(cfg, cache_file, digest) < 0)
+		WARN("Could not cache GuestOS config %s", cfg_file);
+
+	if (!cfg || guestos_mgr_add_from_config(cfg, guestos_verified) < 0) {
 		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "load-os-failed-to-add", cfg_file,
 				0);
 		WARN("Could not add guest operating system from file %s.", cfg_file);
@@ -138,8 +314,13 @@ guestos_mgr_load_operatingsystems_cb(const char *path, const char *name, UNUSED
 		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "load-os", cfg_file, 0);
 		res = 1;
 	}
+	cfg = NULL;
 
 cleanup_files:
+	if (cfg)
+		guestos_config_free(cfg);
+	mem_free(digest);
+	mem_free(cache_file);
 	mem_free(cfg_file);
 	mem_free(sig_file);
 	mem_free(cert_file);
@@ -148,21 +329,89 @@ cleanup:
 	return res;
 }
 
+/**
+ * Only records GuestOS directories named <name>-<version> as pending, to be
+ * loaded on demand. Other directories are collected in data to be loaded
+ * right away.
+ */
+static int
+guestos_mgr_load_operatingsystems_cb(const char *path, const char *name, void *data)
+{
+	list_t **immediate = data;
+
+	char *dir = mem_printf("%s/%s", path, name);
+	char *cfg_file = guestos_get_cfg_file_new(dir);
+	bool is_os = file_is_dir(dir) && file_exists(cfg_file);
+	mem_free(cfg_file);
+	mem_free(dir);
+
+	IF_FALSE_RETVAL(is_os, 0);
+
+	const char *sep = strrchr(name, '-');
+	char *end = NULL;
+	errno = 0;
+	uint64_t version = sep ? strtoull(sep + 1, &end, 10) : 0;
+	if (!sep || sep == name || end == sep + 1 || *end || errno) {
+		*immediate = list_append(*immediate, mem_strdup(name));
+		return 1;
+	}
+
+	guestos_mgr_pending_t *pending = mem_new0(guestos_mgr_pending_t, 1);
+	pending->name = mem_strndup(name, sep - name);
+	pending->version = version;
+	pending->entry = mem_strdup(name);
+	guestos_pending_list = list_append(guestos_pending_list, pending);
+
+	TRACE("Found GuestOS %s v%" PRIu64 ", deferring loading", pending->name, version);
+	return 1;
+}
+
+static void
+guestos_mgr_purge_obsolete_cb(event_timer_t *timer, UNUSED void *data)
+{
+	guestos_mgr_purge_obsolete();
+	event_remove_timer(timer);
+	event_timer_free(timer);
+}
+
 static int
 guestos_mgr_load_operatingsystems(void)
 {
-	if (dir_foreach(guestos_basepath, &guestos_mgr_load_operatingsystems_cb, NULL) < 0) {
+	list_t *immediate = NULL;
+
+	if (dir_foreach(guestos_basepath, &guestos_mgr_load_operatingsystems_cb, &immediate) < 0) {
 		WARN("Could not open %s to load operating system", guestos_basepath);
 		return -1;
 	}
 
-	if (!guestos_list) {
+	size_t n = list_length(immediate);
+	if (n > 1) {
+		const char **entries = mem_new0(const char *, n);
+		size_t i = 0;
+		for (list_t *l = immediate; l; l = l->next)
+			entries[i++] = l->data;
+		guestos_mgr_verify_prefetch(n, entries);
+		mem_free(entries);
+	}
+	for (list_t *l = immediate; l; l = l->next) {
+		guestos_mgr_load_os(guestos_basepath, l->data);
+		mem_free(l->data);
+	}
+	list_delete(immediate);
+
+	if (!guestos_list && !guestos_pending_list) {
 		// Seems we dont have any operating system on storage
 		WARN("No guest OS found on storage.");
 		return -1;
 	}
 
-	guestos_mgr_purge_obsolete();
+	/*
+	 * Purge once the containers have been loaded, which selects the GuestOSes
+	 * in use. Until then, nothing but the names and versions of the pending
+	 * GuestOSes is known.
+	 */
+	event_timer_t *purge_timer = event_timer_new(0, 1, &guestos_mgr_purge_obsolete_cb, NULL);
+	event_add_timer(purge_timer);
 
 	return 0;
 }
@@ -184,6 +433,50 @@ guestos_mgr_is_guestos_used_by_containers(const char *os_name)
 
 /******************************************************************************/
 
+typedef struct guestos_mgr_prefetch {
+	const char *name;
+	char *entry; /* directory of the latest version found so far */
+	uint64_t version;
+} guestos_mgr_prefetch_t;
+
+static int
+guestos_mgr_prefetch_images_cb(UNUSED const char *path, const char *name, void *data)
+{
+	guestos_mgr_prefetch_t *prefetch = data;
+	size_t len = strlen(prefetch->name);
+
+	IF_TRUE_RETVAL(strncmp(name, prefetch->name, len) || name[len] != '-', 0);
+
+	char *end = NULL;
+	errno = 0;
+	uint64_t version = strtoull(name + len + 1, &end, 10);
+	IF_TRUE_RETVAL(end == name + len + 1 || *end || errno, 0);
+
+	if (!prefetch->entry || version > prefetch->version) {
+		mem_free(prefetch->entry);
+		prefetch->entry = mem_strdup(name);
+		prefetch->version = version;
+	}
+	return 1;
+}
+
+int
+guestos_mgr_prefetch_images(const char *path, const char *name)
+{
+	ASSERT(path);
+	ASSERT(name);
+
+	guestos_mgr_prefetch_t prefetch = { .name = name, .entry = NULL, .version = 0 };
+	IF_TRUE_RETVAL(dir_foreach(path, &guestos_mgr_prefetch_images_cb, &prefetch) < 0, -1);
+	IF_NULL_RETVAL(prefetch.entry, 0);
+
+	char *dir = mem_printf("%s/%s", path, prefetch.entry);
+	int n = guestos_prefetch_images(dir);
+	mem_free(dir);
+	mem_free(prefetch.entry);
+	return n;
+}
+
 int
 guestos_mgr_init(const char *path, bool allow_locally_signed)
 {
@@ -199,15 +492,10 @@ guestos_mgr_init(const char *path, bool allow_locally_signed)
 	return guestos_mgr_load_operatingsystems();
 }
 
-int
-guestos_mgr_add_from_file(const char *file, guestos_verify_result_t verify_result)
+static int
+guestos_mgr_add(guestos_t *os, guestos_verify_result_t verify_result)
 {
-	ASSERT(file);
-
-	guestos_t *os = guestos_new_from_file(file, guestos_basepath);
-	if (!os) {
-		return -1;
-	}
+	IF_NULL_RETVAL(os, -1);
 
 	guestos_set_verify_result(os, verify_result);
 	guestos_list = list_append(guestos_list, os);
@@ -215,6 +503,20 @@ guestos_mgr_add_from_file(const char *file, guestos_verify_result_t verify_resul
 	return 0;
 }
 
+int
+guestos_mgr_add_from_file(const char *file, guestos_verify_result_t verify_result)
+{
+	ASSERT(file);
+	return guestos_mgr_add(guestos_new_from_file(file, guestos_basepath), verify_result);
+}
+
+int
+guestos_mgr_add_from_config(guestos_config_t *cfg, guestos_verify_result_t verify_result)
+{
+	ASSERT(cfg);
+	return guestos_mgr_add(guestos_new_from_config(cfg, guestos_basepath), verify_result);
+}
+
 void
 guestos_mgr_delete(guestos_t *os)
 {
@@ -235,6 +537,140 @@ guestos_mgr_delete(guestos_t *os)
 
 /******************************************************************************/
 
+/*
+ * Checks the "some" line of the I/O pressure stall information of the last ten
+ * seconds. Without PSI, the idle I/O priority of the scrubber has to suffice.
+ */
+static bool
+guestos_mgr_scrub_is_idle(void)
+{
+	double avg10;
+
+	char *pressure = file_read_new("/proc/pressure/io", 1024);
+	IF_NULL_RETVAL(pressure, true);
+	bool idle = sscanf(pressure, "some avg10=%lf", &avg10) != 1 ||
+		    avg10 < GUESTOS_MGR_SCRUB_IO_PRESSURE_MAX;
+	mem_free(pressure);
+	return idle;
+}
+
+static void
+guestos_mgr_scrub_next(void);
+
+static void
+guestos_mgr_scrub_cb(guestos_scrub_result_t res, guestos_t *os, const char *path,
+		     UNUSED void *data)
+{
+	guestos_mgr_scrubbing = false;
+
+	switch (res) {
+	case GUESTOS_SCRUB_GOOD:
+		INFO("Scrubbing %s: verified", path);
+		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "scrub-good", guestos_get_name(os),
+				2, "path", path);
+		break;
+	case GUESTOS_SCRUB_MISMATCH:
+		ERROR("Scrubbing %s: content does not match the signed GuestOS config", path);
+		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "scrub-mismatch",
+				guestos_get_name(os), 2, "path", path);
+		break;
+	case GUESTOS_SCRUB_FAILED:
+		ERROR("Scrubbing %s: could not be read", path);
+		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "scrub-failed", guestos_get_name(os),
+				2, "path", path);
+		break;
+	case GUESTOS_SCRUB_CANCELED:
+		DEBUG("Scrubbing %s: canceled", path);
+		break;
+	}
+
+	guestos_mgr_scrub_next();
+}
+
+/*
+ * Starts scrubbing the next due image or partition of any loaded GuestOS, one
+ * at a time and only while the system is idle.
+ */
+static void
+guestos_mgr_scrub_next(void)
+{
+	IF_TRUE_RETURN(guestos_mgr_scrubbing);
+	IF_FALSE_RETURN_TRACE(guestos_mgr_scrub_is_idle());
+
+	// only the latest privileged GuestOS has been flashed to the partitions
+	guestos_t *flashed = NULL;
+	for (list_t *l = guestos_list; l; l = l->next) {
+		guestos_t *os = l->data;
+		if (guestos_is_privileged(os) &&
+		    (!flashed || guestos_get_version(os) > guestos_get_version(flashed)))
+			flashed = os;
+	}
+
+	for (list_t *l = guestos_list; l; l = l->next) {
+		guestos_t *os = l->data;
+		if (guestos_scrub_next(os, os == flashed, guestos_mgr_scrub_max_age,
+				       guestos_mgr_scrub_rate, &guestos_mgr_scrub_cb, NULL) == 1) {
+			guestos_mgr_scrubbing = true;
+			return;
+		}
+	}
+}
+
+static void
+guestos_mgr_scrub_cb_timer(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	guestos_mgr_scrub_next();
+}
+
+int
+guestos_mgr_scrub_init(time_t max_age, uint64_t rate)
+{
+	IF_TRUE_RETVAL(guestos_mgr_scrub_timer || max_age <= 0, -1);
+
+	guestos_mgr_scrub_max_age = max_age;
+	guestos_mgr_scrub_rate = rate;
+	guestos_mgr_scrub_timer = event_timer_new(GUESTOS_MGR_SCRUB_POLL_INTERVAL,
+						  EVENT_TIMER_REPEAT_FOREVER,
+						  &guestos_mgr_scrub_cb_timer, NULL);
+	event_timer_set_slack(guestos_mgr_scrub_timer, GUESTOS_MGR_SCRUB_POLL_SLACK);
+	event_add_timer(guestos_mgr_scrub_timer);
+
+	INFO("Scrubbing GuestOS images every %jd s at up to %" PRIu64 " bytes/s",
+	     (intmax_t)max_age, rate);
+	return 0;
+}
+
+/******************************************************************************/
+
+static void
+guestos_mgr_send_response(control_message_t resp, int *resp_fd)
+{
+	if (*resp_fd > 0 && control_send_message(resp, *resp_fd) < 0)
+		WARN("Could not send response to fd=%d", *resp_fd);
+	mem_free(resp_fd);
+}
+
+static void
+download_flash_complete_cb(int flashed, guestos_t *os, void *data)
+{
+	int *resp_fd = data;
+	ASSERT(resp_fd);
+
+	control_message_t resp = CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_FAILED;
+
+	if (flashed < 0) {
+		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "download-os-flash-failed",
+				guestos_get_name(os), 0);
+		WARN("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_FLASH_FAILED);
+	} else {
+		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "download-os-flash-success",
+				guestos_get_name(os), 0);
+		INFO("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_SUCCESS);
+		resp = CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_COMPLETED;
+	}
+	guestos_mgr_send_response(resp, resp_fd);
+}
+
 static void
 download_complete_cb(bool complete, unsigned int count, guestos_t *os, void *data)
 {
@@ -249,25 +685,39 @@ download_complete_cb(bool complete, unsigned int count, guestos_t *os, void *dat
 	}
 
 	if (complete && count > 0) {
-		if (guestos_images_flash(os) < 0) {
-			audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "download-os-flash-failed",
-					guestos_get_name(os), 0);
-			WARN("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_FLASH_FAILED);
-		} else {
-			audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "download-os-flash-success",
-					guestos_get_name(os), 0);
-			INFO("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_SUCCESS);
-			resp = CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_COMPLETED;
-		}
+		// the response is sent once flashing is done
+		if (guestos_images_flash(os, download_flash_complete_cb, resp_fd) == 0)
+			return;
+		download_flash_complete_cb(-1, os, resp_fd);
+		return;
 	} else {
 		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "download-os-failed",
 				guestos_get_name(os), 0);
 		WARN("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_FAILED);
 	}
 out:
-	if (control_send_message(resp, *resp_fd) < 0)
-		WARN("Could not send response to fd=%d", *resp_fd);
-	mem_free(resp_fd);
+	guestos_mgr_send_response(resp, resp_fd);
+}
+
+static void
+flash_complete_cb(int flashed, guestos_t *os, void *data)
+{
+	int *resp_fd = data;
+	ASSERT(resp_fd);
+
+	control_message_t resp = CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_FAILED;
+
+	if (flashed < 0) {
+		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "flash-os", guestos_get_name(os),
+				0);
+		WARN("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_FLASH_FAILED);
+	} else {
+		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "flash-os", guestos_get_name(os),
+				0);
+		INFO("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_SUCCESS);
+		resp = CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_COMPLETED;
+	}
+	guestos_mgr_send_response(resp, resp_fd);
 }
 
 /**
@@ -286,23 +736,24 @@ guestos_mgr_download_latest(const char *name, int resp_fd)
 		int *cb_resp_fd = mem_new(int, 1);
 		*cb_resp_fd = resp_fd;
 		if (!guestos_images_download(os, download_complete_cb, cb_resp_fd)) {
+			// the images are flashed by download_complete_cb()
 			resp = CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_WAITING;
 			audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "download-os-start", name,
 					0);
+			goto out;
 		} else {
 			audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "download-os-start", name,
 					0);
 			return;
 		}
 	}
-	if (guestos_images_flash(os) < 0) {
-		audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "flash-os", name, 0);
-		WARN("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_FLASH_FAILED);
-	} else {
-		audit_log_event(NULL, SSA, CMLD, GUESTOS_MGMT, "flash-os", name, 0);
-		INFO("%s %s", GUESTOS_MGR_UPDATE_TITLE, GUESTOS_MGR_UPDATE_SUCCESS);
-		resp = CONTROL_RESPONSE_GUESTOS_MGR_INSTALL_COMPLETED;
-	}
+	int *cb_resp_fd = mem_new(int, 1);
+	*cb_resp_fd = resp_fd;
+	// the response is sent once flashing is done
+	if (guestos_images_flash(os, flash_complete_cb, cb_resp_fd) == 0)
+		return;
+	flash_complete_cb(-1, os, cb_resp_fd);
+	return;
 out:
 	if (resp_fd > 0 && control_send_message(resp, resp_fd) < 0)
 		WARN("Could not send response to fd=%d", resp_fd);
@@ -574,19 +1025,42 @@ out:
 
 /******************************************************************************/
 
+/**
+ * Returns the pending entry of the GuestOS name with the highest version
+ * above min_version, NULL if there is none.
+ */
+static list_t *
+guestos_mgr_get_pending_newer(const char *name, uint64_t min_version)
+{
+	list_t *newest = NULL;
+	for (list_t *l = guestos_pending_list; l; l = l->next) {
+		guestos_mgr_pending_t *pending = l->data;
+		if (strcmp(name, pending->name) || pending->version <= min_version)
+			continue;
+		if (!newest || pending->version > ((guestos_mgr_pending_t *)newest->data)->version)
+			newest = l;
+	}
+	return newest;
+}
+
 guestos_t *
 guestos_mgr_get_latest_by_name(const char *name, bool complete)
 {
 	IF_NULL_RETVAL(name, NULL);
 
-	uint64_t latest_version = 0;
-	guestos_t *latest_os = NULL;
+	uint64_t latest_version;
+	guestos_t *latest_os;
+	list_t *pending;
+retry:
+	latest_version = 0;
+	latest_os = NULL;
 	for (list_t *l = guestos_list; l; l = l->next) {
 		if (!strcmp(name, guestos_get_name(l->data))) {
 			guestos_t *os = l->data;
 			uint64_t version = guestos_get_version(os);
 			// TODO cache image complete result in guestos instance and get rid of check here?
-			if (complete && !guestos_images_are_complete(os, false)) {
+			// images being streamed lazily can be used already
+			if (complete && !guestos_images_are_available(os)) {
 				audit_log_event(NULL, FSA, CMLD, GUESTOS_MGMT, "broken-update",
 						guestos_get_name(os), 0);
 				DEBUG("GuestOS %s v%" PRIu64
@@ -600,18 +1074,26 @@ guestos_mgr_get_latest_by_name(const char *name, bool complete)
 			}
 		}
 	}
+
+	// a newer version which was not loaded yet may be selected instead
+	if ((pending = guestos_mgr_get_pending_newer(name, latest_version))) {
+		guestos_mgr_load_pending(pending);
+		goto retry;
+	}
 	return latest_os;
 }
 
 size_t
 guestos_mgr_get_guestos_count(void)
 {
+	guestos_mgr_load_pending_all();
 	return list_length(guestos_list);
 }
 
 guestos_t *
 guestos_mgr_get_guestos_by_index(size_t index)
 {
+	guestos_mgr_load_pending_all();
 	return list_nth_data(guestos_list, index);
 }
 
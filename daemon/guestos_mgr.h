@@ -47,6 +47,30 @@ typedef struct guestos guestos_mgr_t;
 int
 guestos_mgr_init(const char *path, bool allow_locally_signed);
 
+/**
+ * Starts scrubbing the images of the loaded GuestOSes and the partitions the
+ * privileged GuestOS has been flashed to: while the system is idle, each one
+ * verified more than max_age seconds ago is hashed again in the background
+ * and checked against its signed config, see guestos_scrub_next(). The results
+ * are reported to audit.
+ * @param max_age seconds after which an image or partition is verified again
+ * @param rate maximum read bandwidth in bytes per second, 0 for no limit
+ * @return 0 on success, -1 otherwise
+ */
+int
+guestos_mgr_scrub_init(time_t max_age, uint64_t rate);
+
+/**
+ * Prefetches the images of the latest version of a GuestOS before the operating
+ * systems are loaded, see guestos_prefetch_images(). Which version is the latest
+ * is only guessed from the directory names, as the configs are not verified yet.
+ * @param path The directory where operating systems are stored.
+ * @param name The name of the GuestOS.
+ * @return the number of images which are hashed or -1 on error
+ */
+int
+guestos_mgr_prefetch_images(const char *path, const char *name);
+
 /**
  * Add an operating system WITHOUT checking its signature. The verification
  * should already made elsewhere and the result must be provided by parameter
@@ -58,6 +82,15 @@ guestos_mgr_init(const char *path, bool allow_locally_signed);
 int
 guestos_mgr_add_from_file(const char *file, guestos_verify_result_t verify_result);
 
+/**
+ * Same as guestos_mgr_add_from_file() for an already loaded config.
+ * @param cfg The guest OS config, ownership is transferred to the guest OS.
+ * @param verify_result The result of the pre-required verification process.
+ * @return 0 if the guest OS was successfully added, -1 on error.
+ */
+int
+guestos_mgr_add_from_config(guestos_config_t *cfg, guestos_verify_result_t verify_result);
+
 /**
  * Delete an operating system persistently from disk, i.e. remove its configuration and
  * its images. this does not free the operating system object, this must be done
@@ -111,7 +144,8 @@ guestos_mgr_register_newca(unsigned char *cacert, size_t cacertlen);
 /**
  * Returns the latest (by version) GuestOS with the given name.
  * If 'complete' is set, only complete GuestOS instances are considered,
- * i.e. all shared images belonging to the GuestOS must be available on the device.
+ * i.e. all shared images belonging to the GuestOS must be available on the device,
+ * or be streamed lazily (see guestos_images_are_available()).
  * Otherwise, all registered GuestOSes with the given name are considered.
  * @param name	    the name of the GuestOS
  * @param complete  whether to only consider complete GuestOSes with all images available on the device
@@ -0,0 +1,562 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "handoff.h"
+#include "handoff.pb-c.h"
+
+#include "cmld.h"
+#include "container.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/dir.h"
+#include "common/event.h"
+#include "common/fd.h"
+#include "common/file.h"
+#include "common/proc.h"
+#include "common/protobuf.h"
+#include "common/uuid.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// environment variable passing the memfd with the packed Handoff message
+#define HANDOFF_ENV "CMLD_HANDOFF_FD"
+#define HANDOFF_CMDLINE_LEN 4096
+#define HANDOFF_DELETED_SUFFIX " (deleted)"
+
+static Handoff *handoff = NULL;
+
+bool
+handoff_init(void)
+{
+	const char *env = getenv(HANDOFF_ENV);
+	IF_NULL_RETVAL(env, false);
+
+	int fd = atoi(env);
+	unsetenv(HANDOFF_ENV);
+
+	uint8_t *buf = NULL;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > UINT32_MAX) {
+		ERROR_ERRNO("Invalid handoff fd %d of previous cmld instance", fd);
+		goto out;
+	}
+
+	buf = mem_alloc(st.st_size);
+	if (pread(fd, buf, st.st_size, 0) != st.st_size) {
+		ERROR_ERRNO("Could not read handoff of previous cmld instance");
+		goto out;
+	}
+
+	handoff = (Handoff *)protobuf_unpack_message(&handoff__descriptor, buf, st.st_size);
+	if (!handoff) {
+		ERROR("Could not unpack handoff of previous cmld instance");
+		goto out;
+	}
+	INFO("Live restart, taking over %zu running containers", handoff->n_containers);
+out:
+	mem_free(buf);
+	close(fd);
+	return handoff != NULL;
+}
+
+bool
+handoff_is_active(void)
+{
+	return handoff != NULL;
+}
+
+int
+handoff_get_control_sock(void)
+{
+	return handoff ? handoff->control_sock : -1;
+}
+
+pid_t
+handoff_get_lxcfs_pid(void)
+{
+	return handoff ? handoff->lxcfs_pid : 0;
+}
+
+static void
+handoff_child_cb(pid_t pid, UNUSED int status, event_child_t *child, UNUSED void *data)
+{
+	TRACE("Reaped process %d of previous cmld instance", pid);
+	event_child_free(child);
+}
+
+static void
+handoff_watch_child(pid_t pid)
+{
+	event_child_t *child = event_child_new(pid, handoff_child_cb, NULL);
+	if (event_add_child(child) < 0) {
+		WARN("Could not register reaper for process %d", pid);
+		event_child_free(child);
+	}
+}
+
+static void
+handoff_close(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Kills a handed over container which is not adopted and closes its fds.
+ */
+static void
+handoff_container_drop(const HandoffContainer *hc)
+{
+	WARN("Killing container %s which could not be adopted", hc->uuid);
+
+	kill(hc->pid, SIGKILL);
+	handoff_watch_child(hc->pid);
+
+	handoff_close(hc->pidfd);
+	handoff_close(hc->service_sock);
+	handoff_close(hc->service_conn);
+	handoff_close(hc->service_bcast_sock);
+	handoff_close(hc->devices_map_fd);
+	handoff_close(hc->devices_prog_fd);
+	for (size_t i = 0; i < hc->n_sockets; i++)
+		handoff_close(hc->sockets[i]->fd);
+}
+
+/*
+ * Returns the adopted container or NULL. If the container took over its init
+ * but failed afterwards, it is killed and cleaned up by its reaper, otherwise
+ * dropped is set.
+ */
+static container_t *
+handoff_container_adopt(const HandoffContainer *hc, bool *dropped)
+{
+	*dropped = true;
+
+	uuid_t *uuid = uuid_new(hc->uuid);
+	IF_NULL_RETVAL(uuid, NULL);
+
+	container_t *container = cmld_container_get_by_uuid(uuid);
+	uuid_free(uuid);
+	IF_NULL_RETVAL(container, NULL);
+
+	container_handoff_t ch = {
+		.state = hc->state,
+		.pid = hc->pid,
+		.pidfd = hc->pidfd,
+		.uptime = hc->uptime,
+		.service_sock = hc->service_sock,
+		.service_conn = hc->service_conn,
+		.service_bcast_sock = hc->service_bcast_sock,
+		.uid_offset = hc->uid_offset,
+		.net_offsets = hc->net_offsets,
+		.net_offsets_len = hc->n_net_offsets,
+		.devices_map_fd = hc->devices_map_fd,
+		.devices_prog_fd = hc->devices_prog_fd,
+		.sock_paths = mem_new0(char *, hc->n_sockets + 1),
+		.sock_fds = mem_new0(int, hc->n_sockets + 1),
+		.socks_len = hc->n_sockets,
+	};
+	for (size_t i = 0; i < hc->n_sockets; i++) {
+		ch.sock_paths[i] = hc->sockets[i]->path;
+		ch.sock_fds[i] = hc->sockets[i]->fd;
+	}
+
+	int ret = container_adopt(container, &ch);
+	mem_free(ch.sock_paths);
+	mem_free(ch.sock_fds);
+
+	if (ret < 0) {
+		*dropped = (container_get_pid(container) <= 0);
+		return NULL;
+	}
+	*dropped = false;
+	return container;
+}
+
+list_t *
+handoff_adopt_containers(void)
+{
+	IF_NULL_RETVAL(handoff, NULL);
+
+	list_t *adopted = NULL;
+	for (size_t i = 0; i < handoff->n_containers; i++) {
+		const HandoffContainer *hc = handoff->containers[i];
+		bool dropped;
+		container_t *container = handoff_container_adopt(hc, &dropped);
+		if (container)
+			adopted = list_append(adopted, container);
+		else if (dropped)
+			handoff_container_drop(hc);
+	}
+
+	for (size_t i = 0; i < handoff->n_orphans; i++)
+		handoff_watch_child(handoff->orphans[i]);
+
+	INFO("Adopted %u of %zu handed over containers", list_length(adopted),
+	     handoff->n_containers);
+
+	protobuf_free_message((ProtobufCMessage *)handoff);
+	handoff = NULL;
+	return adopted;
+}
+
+static bool
+handoff_container_is_possible(const container_t *container)
+{
+	switch (container_get_state(container)) {
+	case CONTAINER_STATE_STOPPED:
+	case CONTAINER_STATE_BOOTING:
+	case CONTAINER_STATE_RUNNING:
+	case CONTAINER_STATE_FROZEN:
+		return true;
+	default:
+		return false;
+	}
+}
+
+int
+handoff_check(void)
+{
+	for (int i = 0; i < cmld_containers_get_count(); i++) {
+		container_t *container = cmld_container_get_by_index(i);
+		if (!handoff_container_is_possible(container)) {
+			WARN("Container %s is in state %d, cannot hand it over",
+			     container_get_description(container), container_get_state(container));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * File descriptors which are kept open across the exec, all others are
+ * closed on exec.
+ */
+typedef struct handoff_fds {
+	int *fds;
+	size_t len;
+} handoff_fds_t;
+
+static void
+handoff_fds_add(handoff_fds_t *keep, int fd)
+{
+	IF_TRUE_RETURN(fd < 0);
+
+	keep->fds = mem_renew(int, keep->fds, keep->len + 1);
+	keep->fds[keep->len++] = fd;
+}
+
+static int
+handoff_fds_cloexec_cb(UNUSED const char *path, const char *file, void *data)
+{
+	handoff_fds_t *keep = data;
+
+	int fd = atoi(file);
+	IF_TRUE_RETVAL(fd <= STDERR_FILENO, 0);
+
+	int flags = fcntl(fd, F_GETFD);
+	IF_TRUE_RETVAL(flags < 0, 0); // fd of the listed dir itself, already closed
+
+	bool inherit = false;
+	for (size_t i = 0; i < keep->len && !inherit; i++)
+		inherit = (keep->fds[i] == fd);
+
+	flags = inherit ? (flags & ~FD_CLOEXEC) : (flags | FD_CLOEXEC);
+	if (fcntl(fd, F_SETFD, flags) < 0) {
+		WARN_ERRNO("Could not set close on exec of fd %d", fd);
+		return inherit ? -1 : 0;
+	}
+	return 0;
+}
+
+static HandoffContainer *
+handoff_container_new(container_t *container, handoff_fds_t *keep)
+{
+	container_handoff_t ch;
+	IF_TRUE_RETVAL(container_handoff_prepare(container, &ch) < 0, NULL);
+
+	HandoffContainer *hc = mem_new0(HandoffContainer, 1);
+	handoff_container__init(hc);
+	hc->uuid = mem_strdup(uuid_string(container_get_uuid(container)));
+	hc->state = ch.state;
+	hc->pid = ch.pid;
+	hc->has_pidfd = true;
+	hc->pidfd = ch.pidfd;
+	hc->uptime = ch.uptime;
+	hc->has_service_sock = true;
+	hc->service_sock = ch.service_sock;
+	hc->has_service_conn = true;
+	hc->service_conn = ch.service_conn;
+	hc->has_service_bcast_sock = true;
+	hc->service_bcast_sock = ch.service_bcast_sock;
+	hc->has_uid_offset = true;
+	hc->uid_offset = ch.uid_offset;
+	hc->n_net_offsets = ch.net_offsets_len;
+	hc->net_offsets = mem_new0(int32_t, ch.net_offsets_len + 1);
+	for (size_t i = 0; i < ch.net_offsets_len; i++)
+		hc->net_offsets[i] = ch.net_offsets[i];
+	hc->has_devices_map_fd = true;
+	hc->devices_map_fd = ch.devices_map_fd;
+	hc->has_devices_prog_fd = true;
+	hc->devices_prog_fd = ch.devices_prog_fd;
+
+	hc->n_sockets = ch.socks_len;
+	hc->sockets = mem_new0(HandoffSocket *, ch.socks_len + 1);
+	for (size_t i = 0; i < ch.socks_len; i++) {
+		hc->sockets[i] = mem_new0(HandoffSocket, 1);
+		handoff_socket__init(hc->sockets[i]);
+		hc->sockets[i]->path = mem_strdup(ch.sock_paths[i]);
+		hc->sockets[i]->fd = ch.sock_fds[i];
+		handoff_fds_add(keep, ch.sock_fds[i]);
+	}
+
+	handoff_fds_add(keep, ch.pidfd);
+	handoff_fds_add(keep, ch.service_sock);
+	handoff_fds_add(keep, ch.service_conn);
+	handoff_fds_add(keep, ch.service_bcast_sock);
+	handoff_fds_add(keep, ch.devices_map_fd);
+	handoff_fds_add(keep, ch.devices_prog_fd);
+
+	container_handoff_free(&ch);
+	return hc;
+}
+
+static void
+handoff_container_free(HandoffContainer *hc)
+{
+	for (size_t i = 0; i < hc->n_sockets; i++) {
+		mem_free(hc->sockets[i]->path);
+		mem_free(hc->sockets[i]);
+	}
+	mem_free(hc->sockets);
+	mem_free(hc->net_offsets);
+	mem_free(hc->uuid);
+	mem_free(hc);
+}
+
+typedef struct handoff_orphans {
+	const Handoff *containers; // children which are handed over as containers
+	pid_t lxcfs_pid;
+	Handoff *msg;
+} handoff_orphans_t;
+
+static void
+handoff_orphans_cb(pid_t pid, void *data)
+{
+	handoff_orphans_t *orphans = data;
+	Handoff *msg = orphans->msg;
+
+	IF_TRUE_RETURN(pid == orphans->lxcfs_pid);
+	for (size_t i = 0; i < orphans->containers->n_containers; i++)
+		IF_TRUE_RETURN(pid == orphans->containers->containers[i]->pid);
+
+	msg->orphans = mem_renew(int32_t, msg->orphans, msg->n_orphans + 1);
+	msg->orphans[msg->n_orphans++] = pid;
+}
+
+/*
+ * Appends the children of cmld which are neither containers nor lxcfs to the
+ * handoff in memfd, e.g. the just stopped helpers, which are only reaped by the
+ * new instance. Concatenated messages are merged on unpacking, i.e. the new
+ * instance finds them in the orphans of the single Handoff message.
+ */
+static int
+handoff_orphans_append(int memfd, const Handoff *containers, pid_t lxcfs_pid)
+{
+	int ret = 0;
+	uint8_t *buf = NULL;
+	Handoff msg = HANDOFF__INIT;
+	handoff_orphans_t orphans = { containers, lxcfs_pid, &msg };
+
+	if (proc_children_foreach(getpid(), handoff_orphans_cb, &orphans) < 0)
+		WARN("Could not list remaining children of cmld");
+	IF_TRUE_GOTO_TRACE(!msg.n_orphans, out);
+
+	uint32_t len = protobuf_pack_message_new((ProtobufCMessage *)&msg, &buf);
+	if (!len || fd_write(memfd, (char *)buf, len) != (ssize_t)len) {
+		ERROR_ERRNO("Could not append orphans to handoff");
+		ret = -1;
+	}
+out:
+	mem_free(msg.orphans);
+	mem_free(buf);
+	return ret;
+}
+
+/*
+ * Restores close on exec of the inherited fds after a failed exec.
+ */
+static void
+handoff_fds_restore(const handoff_fds_t *keep)
+{
+	for (size_t i = 0; i < keep->len; i++) {
+		int flags = fcntl(keep->fds[i], F_GETFD);
+		if (flags < 0 || fcntl(keep->fds[i], F_SETFD, flags | FD_CLOEXEC) < 0)
+			WARN_ERRNO("Could not restore close on exec of fd %d", keep->fds[i]);
+	}
+}
+
+/*
+ * Returns the argv of cmld as newly allocated array, the strings point into
+ * the also returned buffer of the cmdline.
+ */
+static char **
+handoff_argv_new(char **cmdline)
+{
+	*cmdline = mem_alloc0(HANDOFF_CMDLINE_LEN + 1);
+	int len = file_read("/proc/self/cmdline", *cmdline, HANDOFF_CMDLINE_LEN);
+	IF_TRUE_RETVAL(len <= 0, NULL);
+
+	size_t argc = 0;
+	for (int i = 0; i < len; i++)
+		argc += ((*cmdline)[i] == '\0');
+
+	char **argv = mem_new0(char *, argc + 2);
+	size_t n = 0;
+	for (char *arg = *cmdline; arg < *cmdline + len; arg += strlen(arg) + 1)
+		argv[n++] = arg;
+	return argv;
+}
+
+/*
+ * Returns the path of the running binary, i.e., of the updated binary if the
+ * running one has been replaced.
+ */
+static char *
+handoff_exe_new(void)
+{
+	char exe[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	IF_TRUE_RETVAL(len <= 0, NULL);
+	exe[len] = '\0';
+
+	size_t suffix_len = strlen(HANDOFF_DELETED_SUFFIX);
+	if ((size_t)len > suffix_len && !strcmp(exe + len - suffix_len, HANDOFF_DELETED_SUFFIX))
+		exe[len - suffix_len] = '\0';
+
+	return mem_strdup(exe);
+}
+
+int
+handoff_exec(int control_sock, pid_t lxcfs_pid, void (*stop_helpers)(void))
+{
+	int ret = -1;
+	int memfd = -1;
+	uint8_t *buf = NULL;
+	char *cmdline = NULL;
+	char **argv = NULL;
+	char *fd_str = NULL;
+	handoff_fds_t keep = { NULL, 0 };
+
+	char *exe = handoff_exe_new();
+	if (!exe || !(argv = handoff_argv_new(&cmdline))) {
+		ERROR("Could not determine binary and arguments of cmld");
+		goto out;
+	}
+
+	IF_TRUE_GOTO(handoff_check() < 0, out);
+
+	Handoff msg = HANDOFF__INIT;
+	msg.has_control_sock = true;
+	msg.control_sock = control_sock;
+	msg.has_lxcfs_pid = lxcfs_pid > 0;
+	msg.lxcfs_pid = lxcfs_pid;
+	handoff_fds_add(&keep, control_sock);
+
+	msg.containers = mem_new0(HandoffContainer *, cmld_containers_get_count() + 1);
+	for (int i = 0; i < cmld_containers_get_count(); i++) {
+		container_t *container = cmld_container_get_by_index(i);
+		if (container_get_pid(container) <= 0)
+			continue;
+
+		HandoffContainer *hc = handoff_container_new(container, &keep);
+		if (!hc) {
+			ERROR("Could not hand over container %s",
+			      container_get_description(container));
+			goto out_msg;
+		}
+		msg.containers[msg.n_containers++] = hc;
+	}
+
+	uint32_t len = protobuf_pack_message_new((ProtobufCMessage *)&msg, &buf);
+	if (!len) {
+		ERROR("Could not pack handoff");
+		goto out_msg;
+	}
+
+	// not closed on exec, the new instance closes it after reading
+	memfd = memfd_create("cmld-handoff", 0);
+	if (memfd < 0 || fd_write(memfd, (char *)buf, len) != (ssize_t)len) {
+		ERROR_ERRNO("Could not write handoff to memfd");
+		goto out_msg;
+	}
+	handoff_fds_add(&keep, memfd);
+
+	if (dir_foreach("/proc/self/fd", handoff_fds_cloexec_cb, &keep) < 0) {
+		ERROR("Could not pass file descriptors to the new cmld instance");
+		goto out_fds;
+	}
+
+	fd_str = mem_printf("%d", memfd);
+	setenv(HANDOFF_ENV, fd_str, 1);
+
+	// the helpers keep running until everything else is prepared
+	if (stop_helpers)
+		stop_helpers();
+	IF_TRUE_GOTO(handoff_orphans_append(memfd, &msg, lxcfs_pid) < 0, out_env);
+
+	INFO("Live restart, handing over %zu running containers to %s", msg.n_containers, exe);
+	execv(exe, argv);
+
+	ERROR_ERRNO("Could not exec %s", exe);
+out_env:
+	unsetenv(HANDOFF_ENV);
+out_fds:
+	handoff_fds_restore(&keep);
+out_msg:
+	for (size_t i = 0; i < msg.n_containers; i++)
+		handoff_container_free(msg.containers[i]);
+	mem_free(msg.containers);
+out:
+	handoff_close(memfd);
+	mem_free(buf);
+	mem_free(fd_str);
+	mem_free(argv);
+	mem_free(cmdline);
+	mem_free(exe);
+	mem_free(keep.fds);
+	return ret;
+}
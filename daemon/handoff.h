@@ -0,0 +1,108 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file handoff.h
+ *
+ * Live restart of cmld, e.g. after its binary has been updated, without
+ * stopping the running containers. cmld re-executes itself in place, thus it
+ * keeps its pid and the containers stay its children. The runtime state of the
+ * running containers is serialized into a memfd which is passed to the new
+ * instance together with the file descriptors of the containers, e.g. their
+ * pidfds, service connections and bound sockets. The new instance loads the
+ * containers from their configs as usual and adopts the running ones instead
+ * of starting them.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "common/list.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Reads the state handed over by the previous cmld instance, if cmld has been
+ * started by a live restart. Has to be called first on initialization of cmld.
+ *
+ * @return true if a handoff is active, false on a regular start.
+ */
+bool
+handoff_init(void);
+
+/**
+ * Returns true if cmld has been started by a live restart and has not adopted
+ * the handed over containers yet.
+ */
+bool
+handoff_is_active(void);
+
+/**
+ * Returns the listening socket of the local control interface handed over by
+ * the previous instance, -1 if there is none.
+ */
+int
+handoff_get_control_sock(void);
+
+/**
+ * Returns the pid of the lxcfs daemon started by the previous instance,
+ * 0 if there is none.
+ */
+pid_t
+handoff_get_lxcfs_pid(void);
+
+/**
+ * Adopts the running containers of the previous instance, which have to be
+ * loaded from their configs before. Containers which cannot be adopted are
+ * killed. Afterwards the handoff is not active anymore.
+ *
+ * @return the list of adopted containers, which has to be freed by the caller.
+ */
+list_t *
+handoff_adopt_containers(void);
+
+/**
+ * Checks if the running containers can be handed over, i.e., none of them
+ * is in a transitional state.
+ *
+ * @return 0 if a live restart is possible, -1 otherwise.
+ */
+int
+handoff_check(void);
+
+/**
+ * Re-executes cmld and hands over the running containers. The helper
+ * daemons of cmld, e.g. scd and tpm2d, are stopped by stop_helpers, which is
+ * called right before the exec once the handoff is prepared. If the exec
+ * fails afterwards, the caller has to start the helpers again.
+ *
+ * @param control_sock listening socket of the local control interface or -1.
+ * @param lxcfs_pid pid of the running lxcfs daemon or 0.
+ * @param stop_helpers stops the helper daemons, may be NULL.
+ * @return Does not return on success, -1 on error.
+ */
+int
+handoff_exec(int control_sock, pid_t lxcfs_pid, void (*stop_helpers)(void));
+
+#endif /* HANDOFF_H */
@@ -153,8 +153,8 @@ bool
 hardware_is_audio_device(const char *file);
 
 /**
- * Get random bytes using the hardware random number generator (if supported).
- * If no support is available, get random bytes from /dev/random.
+ * Get random bytes from the DRBG, which is seeded from the kernel and the
+ * hardware random number generator (if supported).
  * @param buf	buffer where the random bytes will be returned (must be large enough to hold 'len' bytes)
  * @param len	number of random bytes to store in 'buf'
  */
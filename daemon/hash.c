@@ -0,0 +1,1135 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "hash.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/event.h"
+#include "common/fd.h"
+#include "common/file.h"
+#include "common/hashmap.h"
+#include "common/str.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/fsverity.h>
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+// hashing is mostly bound by storage throughput, a few threads are sufficient
+#define HASH_THREADS_MAX 4
+#define HASH_BUFFER_SIZE (1024 * 1024)
+
+#define HASH_IMA_XATTR "security.ima"
+
+// the persisted hash caches are small, one line per image
+#define HASH_CACHE_MAXLEN (64 * 1024)
+
+// see linux/ioprio.h, which is not available with older kernel headers
+#define HASH_IOPRIO_WHO_PROCESS 1
+#define HASH_IOPRIO_CLASS_IDLE 3
+#define HASH_IOPRIO_CLASS_SHIFT 13
+
+typedef struct hash_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t pending;
+} hash_batch_t;
+
+typedef struct hash_job {
+	char *file;
+	unsigned algos;
+	off_t len;     // of the hashed prefix of the file, -1 for the whole file
+	uint64_t rate; // maximum read bandwidth in bytes per second, 0 for no limit
+	bool background;
+	char *sha1;
+	char *sha256;
+	// either delivered via the main event loop or to a waiting hash_files_block()
+	hash_file_cb_t cb;
+	void *data;
+	hash_batch_t *batch;
+	// or kept for hash_files_block() if the job is speculative
+	bool speculative;
+	bool done;
+} hash_job_t;
+
+/*
+ * A speculatively hashed file. The result is only valid as long as the file has
+ * the cache key it had before it was hashed.
+ */
+typedef struct hash_speculative {
+	hash_job_t *job;
+	char *key;
+} hash_speculative_t;
+
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_cond = PTHREAD_COND_INITIALIZER;
+static list_t *hash_queue = NULL;
+static unsigned hash_threads = 0;
+static pid_t hash_pool_pid = 0;
+
+// background jobs have a thread of their own, thus they never delay other jobs
+static pthread_cond_t hash_background_cond = PTHREAD_COND_INITIALIZER;
+static list_t *hash_background_queue = NULL;
+static bool hash_background_thread = false;
+
+// only accessed by the main thread
+static list_t *hash_speculative_list = NULL;
+
+static bool
+hash_speculative_take(const char *file, unsigned algos, char **sha1, char **sha256);
+
+static char *
+hash_bin_to_hex_new(const unsigned char *bin, unsigned int len)
+{
+	char *hex = mem_alloc0(len * 2 + 1);
+
+	for (unsigned int i = 0; i < len; ++i)
+		snprintf(hex + i * 2, 3, "%.2x", bin[i]);
+
+	return hex;
+}
+
+struct hash_stream {
+	EVP_MD_CTX *ctx[2];
+};
+
+hash_stream_t *
+hash_stream_new(unsigned algos)
+{
+	const EVP_MD *md[2] = { EVP_sha1(), EVP_sha256() };
+	hash_stream_t *hs = mem_new0(hash_stream_t, 1);
+
+	for (int i = 0; i < 2; i++) {
+		if (!(algos & (1 << i)))
+			continue;
+		if (!(hs->ctx[i] = EVP_MD_CTX_new()) ||
+		    !EVP_DigestInit_ex(hs->ctx[i], md[i], NULL)) {
+			ERROR("Could not initialize hash function");
+			hash_stream_free(hs);
+			return NULL;
+		}
+	}
+	return hs;
+}
+
+int
+hash_stream_update(hash_stream_t *hs, const void *buf, size_t len)
+{
+	ASSERT(hs);
+
+	for (int i = 0; i < 2; i++) {
+		if (hs->ctx[i] && !EVP_DigestUpdate(hs->ctx[i], buf, len))
+			return -1;
+	}
+	return 0;
+}
+
+int
+hash_stream_final(hash_stream_t *hs, char **sha1, char **sha256)
+{
+	ASSERT(hs);
+
+	char **out[2] = { sha1, sha256 };
+	int ret = 0;
+
+	for (int i = 0; i < 2; i++) {
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digest_len;
+
+		if (!hs->ctx[i] || !out[i])
+			continue;
+		if (EVP_DigestFinal_ex(hs->ctx[i], digest, &digest_len) != 1) {
+			ret = -1;
+			continue;
+		}
+		*out[i] = hash_bin_to_hex_new(digest, digest_len);
+	}
+	return ret;
+}
+
+void
+hash_stream_free(hash_stream_t *hs)
+{
+	IF_NULL_RETURN(hs);
+
+	for (int i = 0; i < 2; i++)
+		if (hs->ctx[i])
+			EVP_MD_CTX_free(hs->ctx[i]);
+	mem_free(hs);
+}
+
+char *
+hash_buf_sha512_new(const void *buf, size_t len)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+
+	if (!EVP_Digest(buf, len, digest, &digest_len, EVP_sha512(), NULL)) {
+		ERROR("Could not compute sha512 digest");
+		return NULL;
+	}
+	return hash_bin_to_hex_new(digest, digest_len);
+}
+
+/*
+ * Sleeps until reading done bytes since start complies with the rate limit of
+ * the job.
+ */
+static void
+hash_job_throttle(const hash_job_t *job, const struct timespec *start, uint64_t done)
+{
+	struct timespec now;
+
+	IF_FALSE_RETURN(job->rate);
+	IF_TRUE_RETURN(clock_gettime(CLOCK_MONOTONIC, &now) < 0);
+
+	double ahead = (double)done / job->rate - (now.tv_sec - start->tv_sec) -
+		       (now.tv_nsec - start->tv_nsec) / 1e9;
+	IF_TRUE_RETURN(ahead <= 0);
+
+	struct timespec ts = { .tv_sec = (time_t)ahead,
+			       .tv_nsec = (long)((ahead - (time_t)ahead) * 1e9) };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Reads the file in large chunks and updates all requested digests with each
+ * chunk. The file is not mmap'ed on purpose: an image which is truncated while
+ * being hashed would raise SIGBUS in cmld.
+ */
+static void
+hash_job_run(hash_job_t *job)
+{
+	hash_stream_t *hs = NULL;
+	unsigned char *buf = NULL;
+	struct timespec start = { 0 };
+	uint64_t done = 0;
+	int ioprio = -1;
+
+	int fd = open(job->file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open %s for hashing", job->file);
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (job->background) {
+		// the I/O priority of the calling thread, it is restored once the job is done
+		ioprio = syscall(SYS_ioprio_get, HASH_IOPRIO_WHO_PROCESS, 0);
+		if (syscall(SYS_ioprio_set, HASH_IOPRIO_WHO_PROCESS, 0,
+			    HASH_IOPRIO_CLASS_IDLE << HASH_IOPRIO_CLASS_SHIFT) < 0)
+			WARN_ERRNO("Could not set idle I/O priority for hashing %s", job->file);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+
+	if (!(hs = hash_stream_new(job->algos))) {
+		ERROR("Could not initialize hash function for %s", job->file);
+		goto out;
+	}
+
+	buf = mem_alloc(HASH_BUFFER_SIZE);
+	for (;;) {
+		size_t n = HASH_BUFFER_SIZE;
+		if (job->len >= 0)
+			n = MIN(n, (uint64_t)job->len - done);
+		if (n == 0)
+			break;
+		ssize_t len = read(fd, buf, n);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			ERROR_ERRNO("Could not read %s for hashing", job->file);
+			goto out;
+		}
+		if (len == 0 && job->len >= 0) {
+			ERROR("Could not hash %s: only %" PRIu64 " of %jd bytes available",
+			      job->file, done, (intmax_t)job->len);
+			goto out;
+		}
+		if (len == 0)
+			break;
+		if (hash_stream_update(hs, buf, len)) {
+			ERROR("Could not hash %s", job->file);
+			goto out;
+		}
+		done += len;
+		hash_job_throttle(job, &start, done);
+	}
+
+	if (hash_stream_final(hs, &job->sha1, &job->sha256))
+		ERROR("Could not compute hash of %s", job->file);
+
+out:
+	// kernels which report the default priority with a level reject it as class none
+	if (ioprio >= 0 && syscall(SYS_ioprio_set, HASH_IOPRIO_WHO_PROCESS, 0, ioprio) < 0)
+		syscall(SYS_ioprio_set, HASH_IOPRIO_WHO_PROCESS, 0, 0);
+	hash_stream_free(hs);
+	if (buf) {
+		mem_free(buf);
+		mem_trim_hint(HASH_BUFFER_SIZE);
+	}
+	close(fd);
+}
+
+static void
+hash_job_free(hash_job_t *job)
+{
+	IF_NULL_RETURN(job);
+	mem_free(job->file);
+	mem_free(job->sha1);
+	mem_free(job->sha256);
+	mem_free(job);
+}
+
+// runs in the main event loop
+static void
+hash_job_done_cb(void *data)
+{
+	hash_job_t *job = data;
+
+	job->cb(job->file, job->sha1, job->sha256, job->data);
+	hash_job_free(job);
+}
+
+/*
+ * Runs the jobs of the queue arg points to, i.e. the pool or the background queue.
+ */
+static void *
+hash_worker_main(void *arg)
+{
+	list_t **queue = arg;
+	pthread_cond_t *cond = queue == &hash_background_queue ? &hash_background_cond : &hash_cond;
+
+	for (;;) {
+		pthread_mutex_lock(&hash_lock);
+		while (!*queue)
+			pthread_cond_wait(cond, &hash_lock);
+		hash_job_t *job = (*queue)->data;
+		*queue = list_unlink(*queue, *queue);
+		pthread_mutex_unlock(&hash_lock);
+
+		hash_job_run(job);
+
+		if (job->speculative) {
+			__atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+		} else if (job->batch) {
+			pthread_mutex_lock(&job->batch->lock);
+			if (--job->batch->pending == 0)
+				pthread_cond_signal(&job->batch->cond);
+			pthread_mutex_unlock(&job->batch->lock);
+		} else if (event_base_post(event_base_main_get(), &hash_job_done_cb, job) < 0) {
+			ERROR("Could not deliver hash of %s to main loop", job->file);
+			hash_job_free(job);
+		}
+	}
+
+	return NULL;
+}
+
+static int
+hash_worker_start(bool background)
+{
+	pthread_t thread;
+
+	// worker threads must not receive process signals, those are handled by the main loop
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(&thread, NULL, &hash_worker_main,
+				 background ? &hash_background_queue : &hash_queue);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		errno = ret;
+		WARN_ERRNO("Could not start hash worker thread");
+		return -1;
+	}
+	pthread_detach(thread);
+	hash_pool_pid = getpid();
+	return 0;
+}
+
+/*
+ * Starts the worker threads on first use. Must be called with hash_lock held.
+ */
+static int
+hash_pool_start(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned n = cpus < 1 ? 1 : MIN((unsigned)cpus, HASH_THREADS_MAX);
+
+	while (hash_threads < n && hash_worker_start(false) == 0)
+		hash_threads++;
+
+	DEBUG("Started %u hash worker threads", hash_threads);
+	return hash_threads ? 0 : -1;
+}
+
+static int
+hash_job_queue(hash_job_t *job)
+{
+	int ret = 0;
+
+	// the workers do not exist in forked or cloned children, e.g., a container's init
+	IF_TRUE_RETVAL(hash_pool_pid && hash_pool_pid != getpid(), -1);
+
+	pthread_mutex_lock(&hash_lock);
+	if (job->background) {
+		if (!hash_background_thread && !(ret = hash_worker_start(true)))
+			hash_background_thread = true;
+		if (!ret) {
+			hash_background_queue = list_append(hash_background_queue, job);
+			pthread_cond_signal(&hash_background_cond);
+		}
+	} else {
+		if (!hash_threads)
+			ret = hash_pool_start();
+		if (!ret) {
+			hash_queue = list_append(hash_queue, job);
+			pthread_cond_signal(&hash_cond);
+		}
+	}
+	pthread_mutex_unlock(&hash_lock);
+
+	return ret;
+}
+
+static hash_job_t *
+hash_job_new(const char *file, unsigned algos)
+{
+	hash_job_t *job = mem_new0(hash_job_t, 1);
+	job->file = mem_strdup(file);
+	job->algos = algos;
+	job->len = -1;
+	return job;
+}
+
+/******************************************************************************/
+
+int
+hash_file(const char *file, unsigned algos, hash_file_cb_t cb, void *data)
+{
+	IF_NULL_RETVAL(file, -1);
+	IF_NULL_RETVAL(cb, -1);
+
+	hash_job_t *job = hash_job_new(file, algos);
+	job->cb = cb;
+	job->data = data;
+
+	TRACE("Queueing %s for hashing", file);
+	if (hash_job_queue(job) < 0) {
+		hash_job_free(job);
+		return -1;
+	}
+	return 0;
+}
+
+int
+hash_file_background(const char *file, off_t len, unsigned algos, uint64_t rate,
+		     hash_file_cb_t cb, void *data)
+{
+	IF_NULL_RETVAL(file, -1);
+	IF_NULL_RETVAL(cb, -1);
+
+	hash_job_t *job = hash_job_new(file, algos);
+	job->len = len;
+	job->rate = rate;
+	job->background = true;
+	job->cb = cb;
+	job->data = data;
+
+	TRACE("Queueing %s for hashing in the background", file);
+	if (hash_job_queue(job) < 0) {
+		hash_job_free(job);
+		return -1;
+	}
+	return 0;
+}
+
+void
+hash_files_block(size_t n, const char *const files[], unsigned algos, char *sha1[],
+		 char *sha256[])
+{
+	hash_batch_t batch = { .lock = PTHREAD_MUTEX_INITIALIZER,
+			       .cond = PTHREAD_COND_INITIALIZER,
+			       .pending = 0 };
+	hash_job_t **jobs = mem_new0(hash_job_t *, n);
+
+	ASSERT(!(algos & HASH_SHA1) || sha1);
+	ASSERT(!(algos & HASH_SHA256) || sha256);
+
+	for (size_t i = 0; i < n; i++) {
+		jobs[i] = hash_job_new(files[i], algos);
+		if (hash_speculative_take(files[i], algos, &jobs[i]->sha1, &jobs[i]->sha256))
+			continue;
+		jobs[i]->batch = &batch;
+
+		pthread_mutex_lock(&batch.lock);
+		batch.pending++;
+		pthread_mutex_unlock(&batch.lock);
+
+		if (hash_job_queue(jobs[i]) < 0) {
+			// no worker available, hash in the calling thread
+			hash_job_run(jobs[i]);
+			pthread_mutex_lock(&batch.lock);
+			batch.pending--;
+			pthread_mutex_unlock(&batch.lock);
+		}
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending)
+		pthread_cond_wait(&batch.cond, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+
+	for (size_t i = 0; i < n; i++) {
+		if (sha1) {
+			sha1[i] = jobs[i]->sha1;
+			jobs[i]->sha1 = NULL;
+		}
+		if (sha256) {
+			sha256[i] = jobs[i]->sha256;
+			jobs[i]->sha256 = NULL;
+		}
+		hash_job_free(jobs[i]);
+	}
+
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.cond);
+	mem_free(jobs);
+}
+
+char *
+hash_files_digest_new(size_t n, const char *const files[])
+{
+	const char **existing = mem_new0(const char *, n);
+	char **sha256 = mem_new0(char *, n);
+	size_t m = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		if (file_exists(files[i]))
+			existing[m++] = files[i];
+	}
+	hash_files_block(m, existing, HASH_SHA256, NULL, sha256);
+
+	str_t *digest = str_new(NULL);
+	bool failed = false;
+	for (size_t i = 0, j = 0; i < n; i++) {
+		if (j < m && existing[j] == files[i]) {
+			failed |= !sha256[j];
+			str_append(digest, sha256[j] ? sha256[j] : "");
+			j++;
+		} else {
+			str_append(digest, "-");
+		}
+		str_append(digest, ":");
+	}
+
+	for (size_t j = 0; j < m; j++) {
+		if (sha256[j])
+			mem_free(sha256[j]);
+	}
+	mem_free(sha256);
+	mem_free(existing);
+
+	if (failed) {
+		str_free(digest, true);
+		return NULL;
+	}
+	return str_free(digest, false);
+}
+
+char *
+hash_file_verity_new(const char *file, bool enable)
+{
+	ASSERT(file);
+
+#ifdef FS_IOC_MEASURE_VERITY
+	uint8_t buf[sizeof(struct fsverity_digest) + 64];
+	struct fsverity_digest *d = (struct fsverity_digest *)buf;
+	char *hex = NULL;
+
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		WARN_ERRNO("Could not open %s", file);
+		return NULL;
+	}
+
+	d->digest_size = sizeof(buf) - sizeof(*d);
+	int ret = ioctl(fd, FS_IOC_MEASURE_VERITY, d);
+	if (ret < 0 && errno == ENODATA && enable) {
+		struct fsverity_enable_arg arg = { .version = 1,
+						   .hash_algorithm = FS_VERITY_HASH_ALG_SHA256,
+						   .block_size = 4096 };
+
+		INFO("Enabling fs-verity on %s", file);
+		if (ioctl(fd, FS_IOC_ENABLE_VERITY, &arg) < 0 && errno != EEXIST) {
+			WARN_ERRNO("Could not enable fs-verity on %s", file);
+			goto out;
+		}
+		d->digest_size = sizeof(buf) - sizeof(*d);
+		ret = ioctl(fd, FS_IOC_MEASURE_VERITY, d);
+	}
+	if (ret < 0) {
+		DEBUG_ERRNO("Could not measure fs-verity digest of %s", file);
+		goto out;
+	}
+
+	if (d->digest_algorithm != FS_VERITY_HASH_ALG_SHA256) {
+		WARN("Unsupported fs-verity digest algorithm %u of %s", d->digest_algorithm, file);
+		goto out;
+	}
+	hex = hash_bin_to_hex_new(d->digest, d->digest_size);
+out:
+	close(fd);
+	return hex;
+#else
+	DEBUG("fs-verity not supported, cannot measure %s (enable=%d)", file, enable);
+	return NULL;
+#endif
+}
+
+/******************************************************************************/
+
+/*
+ * Returns the integrity metadata of a file as hex string, "-" if there is none.
+ */
+static char *
+hash_cache_integrity_new(const char *file)
+{
+	str_t *integrity = str_new(NULL);
+	unsigned char buf[512];
+
+	ssize_t len = getxattr(file, HASH_IMA_XATTR, buf, sizeof(buf));
+	if (len > 0) {
+		char *hex = hash_bin_to_hex_new(buf, len);
+		str_append_printf(integrity, "ima:%s", hex);
+		mem_free(hex);
+	}
+
+#ifdef FS_IOC_MEASURE_VERITY
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		struct fsverity_digest *d = (struct fsverity_digest *)buf;
+		d->digest_size = sizeof(buf) - sizeof(*d);
+		if (ioctl(fd, FS_IOC_MEASURE_VERITY, d) == 0) {
+			char *hex = hash_bin_to_hex_new(d->digest, d->digest_size);
+			str_append_printf(integrity, "%sverity:%s", str_length(integrity) ? "," : "",
+					  hex);
+			mem_free(hex);
+		}
+		close(fd);
+	}
+#endif
+
+	if (!str_length(integrity))
+		str_append(integrity, "-");
+
+	return str_free(integrity, false);
+}
+
+/*
+ * Returns the cache key of a file, i.e. "<name> <dev> <ino> <size> <mtime> <ctime> <integrity> ",
+ * or NULL if the file cannot be cached.
+ */
+static char *
+hash_cache_key_new(const char *file)
+{
+	struct stat st;
+
+	if (stat(file, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	char *path = mem_strdup(file);
+	char *name = basename(path);
+	if (strpbrk(name, " \t\n")) {
+		mem_free(path);
+		return NULL;
+	}
+
+	char *integrity = hash_cache_integrity_new(file);
+	char *key = mem_printf("%s %ju %ju %jd %jd.%09ld %jd.%09ld %s ", name, (uintmax_t)st.st_dev,
+			       (uintmax_t)st.st_ino, (intmax_t)st.st_size,
+			       (intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+			       (intmax_t)st.st_ctim.tv_sec, st.st_ctim.tv_nsec, integrity);
+	mem_free(integrity);
+	mem_free(path);
+	return key;
+}
+
+/*
+ * Entry of the hash cache. Its entries let checks skip the comparison with the
+ * signed GuestOS config, thus they are only persisted, in "<cache>.hashcache",
+ * if a key bound to the device is available to authenticate them. Otherwise,
+ * an image could be replaced offline together with its entry.
+ */
+typedef struct {
+	char *id;  //!< "<cache>/<name>", the key of hash_cache_entries
+	char *key; //!< see hash_cache_key_new()
+	char *sha1;
+	char *sha256;
+	time_t verified;
+} hash_cache_entry_t;
+
+static hashmap_t *hash_cache_entries = NULL;
+static list_t *hash_cache_loaded = NULL; //!< names of the caches read from file
+
+static uint8_t *hash_cache_mac_key = NULL;
+static size_t hash_cache_mac_key_len = 0;
+
+void
+hash_cache_set_key(uint8_t *key, size_t key_len)
+{
+	if (hash_cache_mac_key) {
+		OPENSSL_cleanse(hash_cache_mac_key, hash_cache_mac_key_len);
+		mem_free(hash_cache_mac_key);
+	}
+	hash_cache_mac_key = key;
+	hash_cache_mac_key_len = key ? key_len : 0;
+}
+
+bool
+hash_cache_has_key(void)
+{
+	return hash_cache_mac_key_len > 0;
+}
+
+int
+hash_cache_mac(const void *buf, size_t len, uint8_t mac[HASH_CACHE_MAC_LEN])
+{
+	unsigned int mac_len = HASH_CACHE_MAC_LEN;
+
+	IF_TRUE_RETVAL_TRACE(hash_cache_mac_key_len == 0, -1);
+
+	if (!HMAC(EVP_sha256(), hash_cache_mac_key, hash_cache_mac_key_len, buf, len, mac,
+		  &mac_len) ||
+	    mac_len != HASH_CACHE_MAC_LEN) {
+		ERROR("Could not compute HMAC");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Returns the hex string of the mac of a line of a cache file, which is bound
+ * to the cache, so that lines cannot be moved between caches.
+ */
+static char *
+hash_cache_line_mac_new(const char *cache, const char *line, size_t line_len)
+{
+	uint8_t mac[HASH_CACHE_MAC_LEN];
+
+	char *buf = mem_printf("%s\n%.*s", cache, (int)line_len, line);
+	int ret = hash_cache_mac(buf, strlen(buf), mac);
+	mem_free(buf);
+	IF_TRUE_RETVAL(ret < 0, NULL);
+
+	return hash_bin_to_hex_new(mac, sizeof(mac));
+}
+
+static char *
+hash_cache_file_new(const char *cache)
+{
+	return mem_printf("%s.hashcache", cache);
+}
+
+static char *
+hash_cache_id_new(const char *cache, const char *file)
+{
+	char *path = mem_strdup(file);
+	char *id = mem_printf("%s/%s", cache, basename(path));
+	mem_free(path);
+	return id;
+}
+
+static void
+hash_cache_entry_free(hash_cache_entry_t *entry)
+{
+	mem_free(entry->id);
+	mem_free(entry->key);
+	mem_free(entry->sha1);
+	mem_free(entry->sha256);
+	mem_free(entry);
+}
+
+static char *
+hash_cache_value_new(const char *token)
+{
+	return strcmp(token, "-") ? mem_strdup(token) : NULL;
+}
+
+/*
+ * Parses a line "<key> <sha1> <sha256> <verified> <mac>" of a cache file.
+ * Returns NULL if the line is malformed or its mac does not match.
+ */
+static hash_cache_entry_t *
+hash_cache_entry_new_from_line(const char *cache, char *line)
+{
+	char *sp = strrchr(line, ' ');
+	IF_NULL_RETVAL(sp, NULL);
+
+	char *mac = hash_cache_line_mac_new(cache, line, sp - line);
+	bool valid = mac && strlen(mac) == strlen(sp + 1) &&
+		     !CRYPTO_memcmp(mac, sp + 1, strlen(mac));
+	mem_free(mac);
+	IF_FALSE_RETVAL(valid, NULL);
+	*sp = '\0';
+
+	// the key contains spaces itself, thus the line is split from its end
+	char *fields[3];
+	for (int i = 2; i >= 0; i--) {
+		sp = strrchr(line, ' ');
+		IF_NULL_RETVAL(sp, NULL);
+		*sp = '\0';
+		fields[i] = sp + 1;
+	}
+	char *name_end = strchr(line, ' ');
+	IF_NULL_RETVAL(name_end, NULL);
+
+	hash_cache_entry_t *entry = mem_new0(hash_cache_entry_t, 1);
+	entry->id = mem_printf("%s/%.*s", cache, (int)(name_end - line), line);
+	// the separator of the first field also terminates the key
+	entry->key = mem_printf("%s ", line);
+	entry->sha1 = hash_cache_value_new(fields[0]);
+	entry->sha256 = hash_cache_value_new(fields[1]);
+	entry->verified = (time_t)strtoll(fields[2], NULL, 10);
+	return entry;
+}
+
+/*
+ * Reads the persisted entries of a cache once a key is available to
+ * authenticate them. Entries stored since take precedence.
+ */
+static void
+hash_cache_load(const char *cache)
+{
+	IF_TRUE_RETURN(hash_cache_mac_key_len == 0);
+	for (list_t *l = hash_cache_loaded; l; l = l->next)
+		if (!strcmp(l->data, cache))
+			return;
+	hash_cache_loaded = list_append(hash_cache_loaded, mem_strdup(cache));
+
+	char *cache_file = hash_cache_file_new(cache);
+	char *content = file_exists(cache_file) ? file_read_new(cache_file, HASH_CACHE_MAXLEN) :
+						  NULL;
+	IF_NULL_GOTO_TRACE(content, out);
+
+	if (!hash_cache_entries)
+		hash_cache_entries = hashmap_new_str();
+
+	int dropped = 0;
+	char *saveptr = NULL;
+	for (char *line = strtok_r(content, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		hash_cache_entry_t *entry = hash_cache_entry_new_from_line(cache, line);
+		if (!entry) {
+			dropped++;
+			continue;
+		}
+		if (hashmap_contains(hash_cache_entries, entry->id)) {
+			hash_cache_entry_free(entry);
+			continue;
+		}
+		hashmap_put(hash_cache_entries, entry->id, entry);
+	}
+	if (dropped)
+		WARN("Dropped %d entries of hash cache %s which are not authentic", dropped,
+		     cache_file);
+
+	mem_free(content);
+out:
+	mem_free(cache_file);
+}
+
+/*
+ * Writes the entries of a cache to its file, if they can be authenticated.
+ */
+static int
+hash_cache_save(const char *cache)
+{
+	int ret = -1;
+
+	IF_TRUE_RETVAL_TRACE(hash_cache_mac_key_len == 0, 0);
+
+	size_t cache_len = strlen(cache);
+	str_t *content = str_new(NULL);
+	size_t iter = 0;
+	const void *id;
+	void *value;
+	while (hash_cache_entries && hashmap_next(hash_cache_entries, &iter, &id, &value)) {
+		const hash_cache_entry_t *entry = value;
+		if (strncmp(id, cache, cache_len) || ((const char *)id)[cache_len] != '/')
+			continue;
+
+		char *line = mem_printf("%s%s %s %jd", entry->key, entry->sha1 ? entry->sha1 : "-",
+					entry->sha256 ? entry->sha256 : "-",
+					(intmax_t)entry->verified);
+		char *mac = hash_cache_line_mac_new(cache, line, strlen(line));
+		if (mac)
+			str_append_printf(content, "%s %s\n", line, mac);
+		mem_free(mac);
+		mem_free(line);
+	}
+
+	// replace the cache atomically, it is only read and written by cmld
+	char *cache_file = hash_cache_file_new(cache);
+	char *tmp_file = mem_printf("%s.tmp", cache_file);
+	if (!str_length(content)) {
+		if (unlink(cache_file) < 0 && errno != ENOENT) {
+			WARN_ERRNO("Could not remove hash cache %s", cache_file);
+			goto out;
+		}
+	} else if (file_write(tmp_file, str_buffer(content), -1) < 0 ||
+		   chmod(tmp_file, 0600) < 0 || rename(tmp_file, cache_file) < 0) {
+		WARN_ERRNO("Could not write hash cache %s", cache_file);
+		unlink(tmp_file);
+		goto out;
+	}
+	ret = 0;
+out:
+	mem_free(tmp_file);
+	mem_free(cache_file);
+	str_free(content, true);
+	return ret;
+}
+
+/*
+ * Looks up the entry of a file, entries of older versions of the file are not
+ * returned.
+ */
+static const hash_cache_entry_t *
+hash_cache_lookup_entry(const char *cache, const char *file)
+{
+	IF_NULL_RETVAL(cache, NULL);
+	IF_NULL_RETVAL(file, NULL);
+
+	hash_cache_load(cache);
+	IF_NULL_RETVAL_TRACE(hash_cache_entries, NULL);
+
+	char *id = hash_cache_id_new(cache, file);
+	const hash_cache_entry_t *entry = hashmap_get(hash_cache_entries, id);
+	mem_free(id);
+
+	if (entry) {
+		char *key = hash_cache_key_new(file);
+		if (!key || strcmp(key, entry->key))
+			entry = NULL;
+		mem_free(key);
+	}
+
+	TRACE("Hash cache %s for %s", entry ? "hit" : "miss", file);
+	return entry;
+}
+
+bool
+hash_cache_lookup(const char *cache, const char *file, char **sha1, char **sha256)
+{
+	*sha1 = NULL;
+	*sha256 = NULL;
+
+	const hash_cache_entry_t *entry = hash_cache_lookup_entry(cache, file);
+	IF_NULL_RETVAL(entry, false);
+
+	*sha1 = entry->sha1 ? mem_strdup(entry->sha1) : NULL;
+	*sha256 = entry->sha256 ? mem_strdup(entry->sha256) : NULL;
+	return true;
+}
+
+time_t
+hash_cache_get_verified(const char *cache, const char *file)
+{
+	const hash_cache_entry_t *entry = hash_cache_lookup_entry(cache, file);
+	return entry ? entry->verified : 0;
+}
+
+int
+hash_cache_store(const char *cache, const char *file, const char *sha1, const char *sha256)
+{
+	IF_NULL_RETVAL(cache, -1);
+	IF_NULL_RETVAL(file, -1);
+
+	char *key = hash_cache_key_new(file);
+	IF_NULL_RETVAL(key, -1);
+
+	hash_cache_load(cache);
+	if (!hash_cache_entries)
+		hash_cache_entries = hashmap_new_str();
+
+	hash_cache_entry_t *entry = mem_new0(hash_cache_entry_t, 1);
+	entry->id = hash_cache_id_new(cache, file);
+	entry->key = key;
+	entry->sha1 = sha1 ? mem_strdup(sha1) : NULL;
+	entry->sha256 = sha256 ? mem_strdup(sha256) : NULL;
+	// the digests have just been verified, which is recorded for scrubbing
+	entry->verified = time(NULL);
+
+	// replaces the entry of an older version of the file
+	hash_cache_entry_t *old = hashmap_put(hash_cache_entries, entry->id, entry);
+	if (old)
+		hash_cache_entry_free(old);
+	return hash_cache_save(cache);
+}
+
+int
+hash_cache_remove(const char *cache, const char *file)
+{
+	IF_NULL_RETVAL(cache, -1);
+	IF_NULL_RETVAL(file, -1);
+
+	hash_cache_load(cache);
+	IF_NULL_RETVAL(hash_cache_entries, 0);
+
+	char *id = hash_cache_id_new(cache, file);
+	hash_cache_entry_t *entry = hashmap_remove(hash_cache_entries, id);
+	mem_free(id);
+	IF_NULL_RETVAL(entry, 0);
+
+	hash_cache_entry_free(entry);
+	return hash_cache_save(cache);
+}
+
+void
+hash_cache_clear(const char *cache)
+{
+	IF_NULL_RETURN(cache);
+
+	size_t cache_len = strlen(cache);
+	list_t *stale = NULL;
+	size_t iter = 0;
+	const void *id;
+	void *entry;
+	while (hash_cache_entries && hashmap_next(hash_cache_entries, &iter, &id, &entry)) {
+		if (!strncmp(id, cache, cache_len) && ((const char *)id)[cache_len] == '/')
+			stale = list_append(stale, entry);
+	}
+	for (list_t *l = stale; l; l = l->next) {
+		hash_cache_entry_t *e = l->data;
+		hashmap_remove(hash_cache_entries, e->id);
+		hash_cache_entry_free(e);
+	}
+	list_delete(stale);
+
+	// also drops a file which has not been read or cannot be authenticated
+	char *cache_file = hash_cache_file_new(cache);
+	if (unlink(cache_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove hash cache %s", cache_file);
+	mem_free(cache_file);
+}
+
+/******************************************************************************/
+
+int
+hash_file_speculative(const char *file, unsigned algos)
+{
+	IF_NULL_RETVAL(file, -1);
+
+	char *key = hash_cache_key_new(file);
+	IF_NULL_RETVAL(key, -1);
+
+	hash_job_t *job = hash_job_new(file, algos);
+	job->speculative = true;
+
+	TRACE("Queueing %s for speculative hashing", file);
+	if (hash_job_queue(job) < 0) {
+		hash_job_free(job);
+		mem_free(key);
+		return -1;
+	}
+
+	hash_speculative_t *spec = mem_new0(hash_speculative_t, 1);
+	spec->job = job;
+	spec->key = key;
+	hash_speculative_list = list_append(hash_speculative_list, spec);
+	return 0;
+}
+
+size_t
+hash_file_speculative_pending(void)
+{
+	size_t pending = 0;
+
+	for (list_t *l = hash_speculative_list; l; l = l->next) {
+		hash_speculative_t *spec = l->data;
+		if (!__atomic_load_n(&spec->job->done, __ATOMIC_ACQUIRE))
+			pending++;
+	}
+	return pending;
+}
+
+/*
+ * Returns the digests of a finished speculative job for file if they cover algos
+ * and the file was not changed since the job was queued. Pending jobs are not
+ * waited for, their workers may not even exist in this process.
+ */
+static bool
+hash_speculative_take(const char *file, unsigned algos, char **sha1, char **sha256)
+{
+	for (list_t *l = hash_speculative_list; l; l = l->next) {
+		hash_speculative_t *spec = l->data;
+		hash_job_t *job = spec->job;
+
+		if (strcmp(job->file, file) || !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+			continue;
+		if (((algos & HASH_SHA1) && !job->sha1) || ((algos & HASH_SHA256) && !job->sha256))
+			continue;
+
+		char *key = hash_cache_key_new(file);
+		bool valid = key && !strcmp(key, spec->key);
+		mem_free(key);
+		if (!valid) {
+			DEBUG("%s changed since it was hashed speculatively", file);
+			continue;
+		}
+
+		DEBUG("Using speculatively computed hash values for %s", file);
+		*sha1 = (algos & HASH_SHA1) ? mem_strdup(job->sha1) : NULL;
+		*sha256 = (algos & HASH_SHA256) ? mem_strdup(job->sha256) : NULL;
+		return true;
+	}
+	return false;
+}
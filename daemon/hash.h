@@ -0,0 +1,293 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file hash.h
+ *
+ * In-process hashing of (large) files such as guest OS images. Files are hashed
+ * on a small pool of worker threads so that several images are processed
+ * concurrently and the main event loop is not blocked.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define HASH_SHA1 (1 << 0)
+#define HASH_SHA256 (1 << 1)
+
+#define HASH_CACHE_MAC_LEN 32
+
+/**
+ * Incremental hashing of data which is not (yet) available as a whole file,
+ * e.g. an image while it is downloaded.
+ */
+typedef struct hash_stream hash_stream_t;
+
+/**
+ * Creates a new hash stream for the given algorithms.
+ *
+ * @param algos Bitwise-or'd HASH_SHA1 and HASH_SHA256.
+ * @return The hash stream or NULL on error.
+ */
+hash_stream_t *
+hash_stream_new(unsigned algos);
+
+/**
+ * Updates all digests of the stream with the next len bytes of data.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int
+hash_stream_update(hash_stream_t *hs, const void *buf, size_t len);
+
+/**
+ * Finishes the digests of the stream. Afterwards, the stream can only be freed.
+ *
+ * @param sha1 Set to a newly allocated hex string of the SHA1 digest, if requested.
+ *             May be NULL.
+ * @param sha256 Set to a newly allocated hex string of the SHA256 digest, if requested.
+ *               May be NULL.
+ * @return 0 on success, -1 otherwise.
+ */
+int
+hash_stream_final(hash_stream_t *hs, char **sha1, char **sha256);
+
+/**
+ * Frees the hash stream.
+ */
+void
+hash_stream_free(hash_stream_t *hs);
+
+/**
+ * Computes the SHA512 digest of a (small) buffer in-process.
+ *
+ * @return A newly allocated hex string of the digest or NULL on error.
+ */
+char *
+hash_buf_sha512_new(const void *buf, size_t len);
+
+/**
+ * Callback which is invoked in the main event loop once a file has been hashed.
+ *
+ * @param file The hashed file.
+ * @param sha1 Hex string of the SHA1 digest, NULL if not requested or on error.
+ * @param sha256 Hex string of the SHA256 digest, NULL if not requested or on error.
+ * @param data The data pointer given to hash_file().
+ */
+typedef void (*hash_file_cb_t)(const char *file, const char *sha1, const char *sha256,
+			       void *data);
+
+/**
+ * Hashes a file asynchronously on the worker pool. All requested digests are
+ * computed in a single pass over the file.
+ *
+ * @param file The file to be hashed.
+ * @param algos Bitwise-or'd HASH_SHA1 and HASH_SHA256.
+ * @param cb Callback to deliver the result in the main event loop.
+ * @param data Payload data to be passed to the callback.
+ * @return 0 if hashing was started, -1 otherwise (the callback is not invoked).
+ */
+int
+hash_file(const char *file, unsigned algos, hash_file_cb_t cb, void *data);
+
+/**
+ * Hashes a file asynchronously like hash_file(), but on a background thread of
+ * its own which reads at idle I/O priority, i.e. only if the device has no other
+ * I/O pending, and at most at the given rate. Meant for re-verifying files which
+ * are in use, e.g. images and partitions when scrubbing.
+ *
+ * @param file The file (or block device) to be hashed.
+ * @param len Number of bytes from the start of the file to hash, -1 for the whole
+ *            file. If the file is shorter, the callback gets no digests.
+ * @param algos Bitwise-or'd HASH_SHA1 and HASH_SHA256.
+ * @param rate Maximum read bandwidth in bytes per second, 0 for no limit.
+ * @param cb Callback to deliver the result in the main event loop.
+ * @param data Payload data to be passed to the callback.
+ * @return 0 if hashing was started, -1 otherwise (the callback is not invoked).
+ */
+int
+hash_file_background(const char *file, off_t len, unsigned algos, uint64_t rate,
+		     hash_file_cb_t cb, void *data);
+
+/**
+ * Hashes several files concurrently on the worker pool and waits until all of
+ * them are done.
+ *
+ * @param n Number of files.
+ * @param files The files to be hashed.
+ * @param algos Bitwise-or'd HASH_SHA1 and HASH_SHA256.
+ * @param sha1 Array of n results, entries are newly allocated hex strings or NULL.
+ *             May be NULL if HASH_SHA1 is not requested.
+ * @param sha256 Array of n results, entries are newly allocated hex strings or NULL.
+ *               May be NULL if HASH_SHA256 is not requested.
+ */
+void
+hash_files_block(size_t n, const char *const files[], unsigned algos, char *sha1[],
+		 char *sha256[]);
+
+/**
+ * Hashes a file on the worker pool before its digests are requested, e.g., the
+ * images of c0 while scd and tpm2d come up. The digests are kept in memory and
+ * returned by hash_files_block() for the file, also in children forked after
+ * the hashing finished, as long as the file is not modified or replaced. Thus,
+ * they are only as trustworthy as freshly computed ones and still need to be
+ * compared to a signed reference.
+ *
+ * @param file The file to be hashed.
+ * @param algos Bitwise-or'd HASH_SHA1 and HASH_SHA256.
+ * @return 0 if hashing was started, -1 otherwise.
+ */
+int
+hash_file_speculative(const char *file, unsigned algos);
+
+/**
+ * Returns the number of files queued by hash_file_speculative() which are not
+ * hashed yet.
+ */
+size_t
+hash_file_speculative_pending(void);
+
+/**
+ * Computes a combined digest of several small files, e.g. a config and its
+ * signature and certificate, by concatenating their SHA256 hex digests.
+ * Missing files are represented by "-", thus adding or removing a file
+ * changes the digest as well.
+ *
+ * @param n Number of files.
+ * @param files The files to be hashed.
+ * @return A newly allocated string or NULL if an existing file could not be hashed.
+ */
+char *
+hash_files_digest_new(size_t n, const char *const files[]);
+
+/**
+ * Returns the fs-verity file digest of a file. Once fs-verity is enabled, the
+ * file is immutable and the kernel verifies each data page against the digest
+ * when it is read, thus the file does not need to be hashed as a whole.
+ *
+ * @param file The file to be measured.
+ * @param enable Enable fs-verity (sha256, 4K blocks) if the file does not have it yet.
+ *               This builds the Merkle tree once and fails if the file is open for writing.
+ * @return A newly allocated hex string of the sha256 digest or NULL if fs-verity
+ *         is not (or could not be) enabled.
+ */
+char *
+hash_file_verity_new(const char *file, bool enable);
+
+/**
+ * Sets the key which authenticates the persisted hash caches, see
+ * hash_cache_mac(). Caches are read from file when they are first used with a
+ * key. Without a key, e.g. if there is no TPM, they are not persisted.
+ *
+ * @param key The allocated key bound to the device, NULL to clear the key.
+ *            Ownership is taken, the key is cleansed when it is replaced.
+ * @param key_len The length of the key.
+ */
+void
+hash_cache_set_key(uint8_t *key, size_t key_len);
+
+/**
+ * Returns whether a key has been set with hash_cache_set_key().
+ */
+bool
+hash_cache_has_key(void);
+
+/**
+ * Computes the HMAC-SHA256 of a buffer with the key set by hash_cache_set_key(),
+ * e.g. to authenticate caches which are kept beside the files they describe.
+ *
+ * @param buf The buffer to authenticate.
+ * @param len The length of the buffer.
+ * @param mac Set to the HASH_CACHE_MAC_LEN bytes of the mac.
+ * @return 0 on success, -1 if there is no key or on error.
+ */
+int
+hash_cache_mac(const void *buf, size_t len, uint8_t mac[HASH_CACHE_MAC_LEN]);
+
+/**
+ * Looks up the digests of a file in a hash cache. An entry is only valid as long
+ * as the file was not replaced or modified, i.e. its device, inode, size, mtime,
+ * ctime and integrity metadata (IMA xattr, fs-verity digest) are unchanged.
+ * The caches are persisted in "<cache>.hashcache" while a key set with
+ * hash_cache_set_key() authenticates them, otherwise they are kept in memory.
+ *
+ * @param cache The name of the cache, e.g. the directory of the files.
+ * @param file The file to look up.
+ * @param sha1 Set to a newly allocated hex string of the cached SHA1 digest or NULL.
+ * @param sha256 Set to a newly allocated hex string of the cached SHA256 digest or NULL.
+ * @return true if a valid entry was found.
+ */
+bool
+hash_cache_lookup(const char *cache, const char *file, char **sha1, char **sha256);
+
+/**
+ * Stores the digests of a file in a hash cache, replacing an older entry of the
+ * file. Only digests which have been verified against a signed reference
+ * should be stored, the current time is recorded as time of the verification.
+ *
+ * @param cache The name of the cache, e.g. the directory of the files.
+ * @param file The hashed file.
+ * @param sha1 Hex string of the SHA1 digest, may be NULL.
+ * @param sha256 Hex string of the SHA256 digest, may be NULL.
+ * @return 0 on success, -1 otherwise.
+ */
+int
+hash_cache_store(const char *cache, const char *file, const char *sha1, const char *sha256);
+
+/**
+ * Returns when the digests cached for a file were last verified, see
+ * hash_cache_store().
+ *
+ * @param cache The name of the cache, e.g. the directory of the files.
+ * @param file The file to look up.
+ * @return the time of the last verification or 0 if there is no valid entry.
+ */
+time_t
+hash_cache_get_verified(const char *cache, const char *file);
+
+/**
+ * Removes the entry of a file from a hash cache, e.g. after its digests were
+ * found not to match anymore.
+ *
+ * @param cache The name of the cache, e.g. the directory of the files.
+ * @param file The file whose entry is removed.
+ * @return 0 on success, -1 otherwise.
+ */
+int
+hash_cache_remove(const char *cache, const char *file);
+
+/**
+ * Removes all entries of a hash cache, e.g. when its files are erased.
+ *
+ * @param cache The name of the cache, e.g. the directory of the files.
+ */
+void
+hash_cache_clear(const char *cache);
+
+#endif /* HASH_H */
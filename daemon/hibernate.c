@@ -0,0 +1,389 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "hibernate.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
+#include "common/dir.h"
+#include "common/fd.h"
+#include "common/event.h"
+#include "common/list.h"
+#include "common/proc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/swap.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef SYS_process_madvise
+#define SYS_process_madvise 440
+#endif
+
+#define HIBERNATE_ZRAM_CONTROL "/sys/class/zram-control/hot_add"
+
+/* prefer the zram device over any other swap */
+#define HIBERNATE_SWAP_PRIO 32767
+
+#define HIBERNATE_SWAP_MAGIC "SWAPSPACE2"
+#define HIBERNATE_SWAP_LABEL "cml-hibernate"
+
+/* number of mappings passed to a single process_madvise() call */
+#define HIBERNATE_PREFETCH_IOV 128
+
+/* header of a swap area (version 1) at the beginning of its first page */
+typedef struct {
+	char bootbits[1024];
+	uint32_t version;
+	uint32_t last_page;
+	uint32_t nr_badpages;
+	unsigned char uuid[16];
+	char volume_name[16];
+} hibernate_swap_header_t;
+
+/* a helper process reclaiming or prefetching the memory of a cgroup */
+typedef struct {
+	char *cgroup_path;
+	pid_t pid;
+	event_child_t *child;
+} hibernate_helper_t;
+
+static bool hibernate_active = false;
+
+static list_t *hibernate_helpers = NULL;
+
+/*
+ * Returns the id of an unused zram device, which is added if the kernel
+ * supports hot adding devices, otherwise zram0 is used if not yet set up.
+ */
+static int
+hibernate_zram_get(void)
+{
+	int id = -1;
+
+	if (file_exists(HIBERNATE_ZRAM_CONTROL)) {
+		char *buf = file_read_new(HIBERNATE_ZRAM_CONTROL, 16);
+		if (buf) {
+			id = atoi(buf);
+			mem_free(buf);
+			return id;
+		}
+	}
+
+	char *disksize = file_read_new("/sys/block/zram0/disksize", 32);
+	if (disksize && strtoull(disksize, NULL, 10) == 0)
+		id = 0;
+	mem_free(disksize);
+	return id;
+}
+
+/*
+ * Writes the header of an empty swap area of size bytes to dev, like mkswap.
+ */
+static int
+hibernate_mkswap(const char *dev, uint64_t size)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint8_t *page = mem_new0(uint8_t, page_size);
+	hibernate_swap_header_t *hdr = (hibernate_swap_header_t *)page;
+	int ret = -1;
+
+	hdr->version = 1;
+	hdr->last_page = size / page_size - 1;
+	hdr->nr_badpages = 0;
+	strncpy(hdr->volume_name, HIBERNATE_SWAP_LABEL, sizeof(hdr->volume_name) - 1);
+	memcpy(page + page_size - strlen(HIBERNATE_SWAP_MAGIC), HIBERNATE_SWAP_MAGIC,
+	       strlen(HIBERNATE_SWAP_MAGIC));
+
+	int fd = open(dev, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_ERRNO("Could not open %s", dev);
+		goto out;
+	}
+	if (fd_write(fd, (char *)page, page_size) != page_size || fsync(fd) < 0) {
+		ERROR_ERRNO("Could not write swap header to %s", dev);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	mem_free(page);
+	return ret;
+}
+
+int
+hibernate_init(unsigned int zram_mb, const char *algorithm)
+{
+	IF_TRUE_RETVAL(zram_mb == 0, 0);
+
+	int ret = -1;
+	char *comp_algorithm = NULL;
+	char *disksize = NULL;
+	char *dev = NULL;
+
+	int id = hibernate_zram_get();
+	if (id < 0) {
+		ERROR("No zram device available for hibernation; no kernel support?");
+		return -1;
+	}
+	comp_algorithm = mem_printf("/sys/block/zram%d/comp_algorithm", id);
+	disksize = mem_printf("/sys/block/zram%d/disksize", id);
+	dev = mem_printf("/dev/zram%d", id);
+
+	// the algorithm has to be set before the disksize
+	if (algorithm && file_printf(comp_algorithm, "%s", algorithm) < 0)
+		WARN("Compression %s not supported by zram, using default", algorithm);
+	if (file_printf(disksize, "%uM", zram_mb) < 0) {
+		ERROR("Could not set size of %s to %u MB", dev, zram_mb);
+		goto out;
+	}
+
+	IF_TRUE_GOTO(hibernate_mkswap(dev, (uint64_t)zram_mb << 20) < 0, out);
+
+	int flags = SWAP_FLAG_PREFER |
+		    ((HIBERNATE_SWAP_PRIO << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK);
+	if (swapon(dev, flags) < 0) {
+		ERROR_ERRNO("Could not enable swap on %s", dev);
+		goto out;
+	}
+
+	INFO("Hibernating frozen containers to %s (%u MB)", dev, zram_mb);
+	hibernate_active = true;
+	ret = 0;
+out:
+	mem_free(comp_algorithm);
+	mem_free(disksize);
+	mem_free(dev);
+	return ret;
+}
+
+bool
+hibernate_enabled(void)
+{
+	return hibernate_active;
+}
+
+static void
+hibernate_helper_child_cb(pid_t pid, int status, event_child_t *child, void *data)
+{
+	hibernate_helper_t *helper = data;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+		DEBUG("Hibernation helper %d for %s finished", pid, helper->cgroup_path);
+	else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)
+		DEBUG("Hibernation helper %d for %s aborted", pid, helper->cgroup_path);
+	else
+		WARN("Hibernation helper %d for %s failed", pid, helper->cgroup_path);
+
+	hibernate_helpers = list_remove(hibernate_helpers, helper);
+	event_child_free(child);
+	mem_free(helper->cgroup_path);
+	mem_free(helper);
+}
+
+/*
+ * Forks a helper process which runs func on the cgroup and reaps it from the
+ * main loop. The helper must not log, as the fds of the log are closed.
+ */
+static void
+hibernate_helper_fork(const char *cgroup_path, int (*func)(const char *path, void *data),
+		      void *data)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		WARN_ERRNO("Could not fork hibernation helper for %s", cgroup_path);
+		return;
+	} else if (pid == 0) {
+		fd_close_all_except(-1);
+		_exit(func(cgroup_path, data) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	hibernate_helper_t *helper = mem_new0(hibernate_helper_t, 1);
+	helper->cgroup_path = mem_strdup(cgroup_path);
+	helper->pid = pid;
+	helper->child = event_child_new(pid, hibernate_helper_child_cb, helper);
+	if (event_add_child(helper->child) < 0) {
+		WARN("Failed to register reaper for hibernation helper process %d", pid);
+		kill(pid, SIGKILL);
+		event_child_free(helper->child);
+		mem_free(helper->cgroup_path);
+		mem_free(helper);
+		return;
+	}
+	hibernate_helpers = list_append(hibernate_helpers, helper);
+}
+
+void
+hibernate_cancel(const char *cgroup_path)
+{
+	ASSERT(cgroup_path);
+
+	// the helpers are removed once they have been reaped
+	for (list_t *l = hibernate_helpers; l; l = l->next) {
+		hibernate_helper_t *helper = l->data;
+		if (!strcmp(helper->cgroup_path, cgroup_path))
+			kill(helper->pid, SIGKILL);
+	}
+}
+
+typedef struct {
+	const char *file;
+	uint64_t value;
+} hibernate_reclaim_t;
+
+static int
+hibernate_reclaim_helper(UNUSED const char *cgroup_path, void *data)
+{
+	hibernate_reclaim_t *reclaim = data;
+
+	int fd = open(reclaim->file, O_WRONLY | O_CLOEXEC);
+	IF_TRUE_RETVAL(fd < 0, -1);
+
+	/* the kernel reclaims until the value is reached or nothing is left, in the
+	 * latter case EAGAIN (v2) or EBUSY (v1) is returned, which is fine */
+	int ret = dprintf(fd, "%" PRIu64, reclaim->value);
+	if (ret < 0 && (errno == EAGAIN || errno == EBUSY))
+		ret = 0;
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+void
+hibernate_reclaim(const char *cgroup_path, const char *reclaim_file, uint64_t value)
+{
+	ASSERT(cgroup_path);
+	ASSERT(reclaim_file);
+
+	IF_FALSE_RETURN(hibernate_active);
+
+	hibernate_cancel(cgroup_path);
+
+	DEBUG("Hibernating cgroup %s", cgroup_path);
+	hibernate_reclaim_t reclaim = { .file = reclaim_file, .value = value };
+	hibernate_helper_fork(cgroup_path, hibernate_reclaim_helper, &reclaim);
+}
+
+/*
+ * Lets the kernel read the swapped out pages of all private writable mappings
+ * of the process back in asynchronously.
+ */
+static void
+hibernate_prefetch_pid(pid_t pid)
+{
+	struct iovec iov[HIBERNATE_PREFETCH_IOV];
+	size_t n = 0;
+	char *line = NULL;
+	size_t len = 0;
+
+	int pidfd = proc_pidfd_open(pid);
+	IF_TRUE_RETURN(pidfd < 0);
+
+	char *maps = mem_printf("/proc/%d/maps", pid);
+	FILE *fp = fopen(maps, "re");
+	mem_free(maps);
+	if (!fp) {
+		close(pidfd);
+		return;
+	}
+
+	while (getline(&line, &len, fp) > 0) {
+		unsigned long start, end;
+		char perms[5];
+		if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3)
+			continue;
+		// only anonymous and copied pages are swapped
+		if (perms[1] != 'w' || perms[3] != 'p')
+			continue;
+
+		iov[n].iov_base = (void *)start;
+		iov[n].iov_len = end - start;
+		if (++n == HIBERNATE_PREFETCH_IOV) {
+			syscall(SYS_process_madvise, pidfd, iov, n, MADV_WILLNEED, 0);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		syscall(SYS_process_madvise, pidfd, iov, n, MADV_WILLNEED, 0);
+
+	free(line);
+	fclose(fp);
+	close(pidfd);
+}
+
+static int
+hibernate_prefetch_cgroup_cb(const char *path, const char *file, UNUSED void *data);
+
+static int
+hibernate_prefetch_helper(const char *cgroup_path, UNUSED void *data)
+{
+	char *procs = mem_printf("%s/cgroup.procs", cgroup_path);
+	FILE *fp = fopen(procs, "re");
+	mem_free(procs);
+	IF_NULL_RETVAL(fp, -1);
+
+	pid_t pid;
+	while (fscanf(fp, "%d", &pid) == 1)
+		hibernate_prefetch_pid(pid);
+	fclose(fp);
+
+	// processes may also live in child cgroups, e.g. created by the container
+	dir_foreach(cgroup_path, hibernate_prefetch_cgroup_cb, NULL);
+	return 0;
+}
+
+static int
+hibernate_prefetch_cgroup_cb(const char *path, const char *file, UNUSED void *data)
+{
+	char *child = mem_printf("%s/%s", path, file);
+	if (file_is_dir(child))
+		hibernate_prefetch_helper(child, NULL);
+	mem_free(child);
+	return 0;
+}
+
+void
+hibernate_prefetch(const char *cgroup_path)
+{
+	ASSERT(cgroup_path);
+
+	IF_FALSE_RETURN(hibernate_active);
+
+	hibernate_cancel(cgroup_path);
+
+	DEBUG("Prefetching swapped out memory of cgroup %s", cgroup_path);
+	hibernate_helper_fork(cgroup_path, hibernate_prefetch_helper, NULL);
+}
@@ -0,0 +1,77 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file hibernate.h
+ *
+ * Hibernation of frozen containers. Once a container is frozen, the memory of
+ * its cgroup is reclaimed into a compressed zram swap device, so that more
+ * background containers can be kept warm on devices with little RAM. On
+ * unfreeze, the swapped out memory of the container's processes is read back
+ * ahead of its use. Reclaim and prefetch are done by helper processes, thus the
+ * main event loop is not blocked.
+ */
+
+#ifndef HIBERNATE_H
+#define HIBERNATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Sets up a zram swap device of zram_mb MBytes which compresses with the given
+ * algorithm (kernel default if NULL) and enables hibernation.
+ * @return 0 on success or if disabled (zram_mb is 0), -1 otherwise
+ */
+int
+hibernate_init(unsigned int zram_mb, const char *algorithm);
+
+/**
+ * Returns true if frozen containers are hibernated.
+ */
+bool
+hibernate_enabled(void);
+
+/**
+ * Starts reclaiming the memory of a frozen cgroup by writing value to its
+ * reclaim_file, e.g. the number of bytes to memory.reclaim (v2) or anything
+ * to memory.force_empty (v1).
+ * @param cgroup_path directory of the cgroup, identifies the hibernation
+ */
+void
+hibernate_reclaim(const char *cgroup_path, const char *reclaim_file, uint64_t value);
+
+/**
+ * Aborts a running reclaim of the cgroup and starts reading the swapped out
+ * memory of all processes in the cgroup and its descendants back in.
+ */
+void
+hibernate_prefetch(const char *cgroup_path);
+
+/**
+ * Aborts a running reclaim or prefetch of the cgroup, e.g. if it is removed.
+ */
+void
+hibernate_cancel(const char *cgroup_path);
+
+#endif /* HIBERNATE_H */
@@ -31,6 +31,7 @@
 #include "hardware.h"
 
 #include "common/macro.h"
+#include "common/drbg.h"
 #include "common/file.h"
 #include "common/mem.h"
 #include "common/event.h"
@@ -186,20 +187,18 @@ hardware_get_routing_table_radio(void)
 int
 hardware_get_random(unsigned char *buf, size_t len)
 {
+	static bool hw_source = false;
 	const char *rnd = "/dev/hwrng";
-	const char *sw = "/dev/random";
-
-	int bytes_read = file_read(rnd, (char *)buf, len);
-	if (bytes_read > 0 && (size_t)bytes_read == len) {
-		return bytes_read;
-	} else {
-		if (!file_exists(sw)) {
-			ERROR("Failed to retrieve random numbers. Neither random number generator %s or %s could be accessed!",
-			      rnd, sw);
-			return -1;
-		}
-		WARN("Could not access %s, falling back to %s. Check if device provides a hardware random number generator.",
-		     rnd, sw);
-		return file_read(sw, (char *)buf, len);
+
+	// the hardware RNG only seeds the DRBG, random bytes are served from memory
+	if (!hw_source) {
+		if (file_exists(rnd))
+			drbg_add_source(rnd, drbg_source_file, (void *)rnd);
+		else
+			INFO("No hardware random number generator %s, seeding from the kernel only",
+			     rnd);
+		hw_source = true;
 	}
+
+	return drbg_bytes(buf, len) < 0 ? -1 : (int)len;
 }
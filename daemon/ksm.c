@@ -26,6 +26,15 @@
 #include "common/macro.h"
 #include "common/event.h"
 #include "common/file.h"
+#include "common/mem.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#endif
 
 #define KSM_PATH "/sys/kernel/mm/ksm/"
 
@@ -35,7 +44,35 @@
 #define KSM_AGGRESSIVE_SLEEP_MILLISECS 100
 #define KSM_AGGRESSIVE_PAGES_TO_SCAN 500
 
+/* Interval in which the controller evaluates the merge statistics */
+#define KSM_CONTROLLER_INTERVAL 5000
+/* Slack of the KSM timers, neither the controller nor the end of aggressive scanning is urgent */
+#define KSM_TIMER_SLACK 1000
+/* Newly shared pages per interval for which scanning faster pays off (1 MiB with 4K pages) */
+#define KSM_CONTROLLER_MIN_GAIN 256
+/* pages_unshared per pages_sharing above which scanning is considered wasted effort */
+#define KSM_CONTROLLER_WASTE_RATIO 10
+
+typedef struct {
+	unsigned long pages_shared;
+	unsigned long pages_sharing;
+	unsigned long pages_unshared;
+	unsigned long full_scans;
+} ksm_stats_t;
+
 static event_timer_t *ksm_timer;
+static event_timer_t *ksm_controller_timer;
+
+/* while boosted by ksm_set_aggressive_for() the controller does not slow down */
+static bool ksm_boosted = false;
+static bool ksm_merge_containers = false;
+
+static int ksm_sleep_millisecs = KSM_RELAXED_SLEEP_MILLISECS;
+static int ksm_pages_to_scan = KSM_RELAXED_PAGES_TO_SCAN;
+
+static ksm_stats_t ksm_stats;
+/* full_scans at the last time the controller made scanning faster or slowed down */
+static unsigned long ksm_stats_full_scans_decided;
 
 static void
 ksm_set(int sleep_millisecs, int pages_to_scan)
@@ -46,7 +83,10 @@ ksm_set(int sleep_millisecs, int pages_to_scan)
 	}
 	if (file_printf(KSM_PATH "pages_to_scan", "%d", pages_to_scan) < 0) {
 		WARN("Could not configure KSM; no kernel support?");
+		return;
 	}
+	ksm_sleep_millisecs = sleep_millisecs;
+	ksm_pages_to_scan = pages_to_scan;
 }
 
 static void
@@ -57,18 +97,92 @@ ksm_set_aggressive()
 	ksm_set(KSM_AGGRESSIVE_SLEEP_MILLISECS, KSM_AGGRESSIVE_PAGES_TO_SCAN);
 }
 
+static int
+ksm_read_stat(const char *name, unsigned long *value)
+{
+	char *path = mem_printf(KSM_PATH "%s", name);
+	char *buf = file_read_new(path, 32);
+	mem_free(path);
+	IF_NULL_RETVAL(buf, -1);
+
+	errno = 0;
+	*value = strtoul(buf, NULL, 10);
+	mem_free(buf);
+	return errno ? -1 : 0;
+}
+
+static int
+ksm_stats_read(ksm_stats_t *stats)
+{
+	IF_TRUE_RETVAL(ksm_read_stat("pages_shared", &stats->pages_shared) < 0, -1);
+	IF_TRUE_RETVAL(ksm_read_stat("pages_sharing", &stats->pages_sharing) < 0, -1);
+	IF_TRUE_RETVAL(ksm_read_stat("pages_unshared", &stats->pages_unshared) < 0, -1);
+	IF_TRUE_RETVAL(ksm_read_stat("full_scans", &stats->full_scans) < 0, -1);
+	return 0;
+}
+
+/*
+ * Doubles (faster) or halves (slower) the scan rate within the bounds given
+ * by the relaxed and aggressive presets.
+ */
+static void
+ksm_step(bool faster)
+{
+	int sleep_millisecs, pages_to_scan;
+
+	if (faster) {
+		sleep_millisecs = MAX(ksm_sleep_millisecs / 2, KSM_AGGRESSIVE_SLEEP_MILLISECS);
+		pages_to_scan = MIN(ksm_pages_to_scan * 2, KSM_AGGRESSIVE_PAGES_TO_SCAN);
+	} else {
+		sleep_millisecs = MIN(ksm_sleep_millisecs * 2, KSM_RELAXED_SLEEP_MILLISECS);
+		pages_to_scan = MAX(ksm_pages_to_scan / 2, KSM_RELAXED_PAGES_TO_SCAN);
+	}
+
+	if (sleep_millisecs == ksm_sleep_millisecs && pages_to_scan == ksm_pages_to_scan)
+		return;
+
+	DEBUG("KSM %s (sleep_millisecs=%d, pages_to_scan=%d)",
+	      faster ? "yields savings, scanning faster" : "yields nothing, scanning slower",
+	      sleep_millisecs, pages_to_scan);
+	ksm_set(sleep_millisecs, pages_to_scan);
+}
+
 static void
-ksm_set_relaxed()
+ksm_controller_cb(UNUSED event_timer_t *timer, UNUSED void *data)
 {
-	DEBUG("Setting KSM relaxed settings (sleep_millisecs=%d, pages_to_scan=%d",
-	      KSM_RELAXED_SLEEP_MILLISECS, KSM_RELAXED_PAGES_TO_SCAN);
-	ksm_set(KSM_RELAXED_SLEEP_MILLISECS, KSM_RELAXED_PAGES_TO_SCAN);
+	ksm_stats_t stats;
+
+	if (ksm_stats_read(&stats) < 0) {
+		TRACE("Could not read KSM statistics");
+		return;
+	}
+
+	long gain = (long)stats.pages_sharing - (long)ksm_stats.pages_sharing;
+	bool scanned = stats.full_scans != ksm_stats_full_scans_decided;
+	bool wasted =
+		stats.pages_unshared > KSM_CONTROLLER_WASTE_RATIO * MAX(stats.pages_sharing, 1UL);
+
+	TRACE("KSM shared=%lu sharing=%lu unshared=%lu full_scans=%lu gain=%ld",
+	      stats.pages_shared, stats.pages_sharing, stats.pages_unshared, stats.full_scans,
+	      gain);
+
+	if (gain >= KSM_CONTROLLER_MIN_GAIN) {
+		ksm_step(true);
+		ksm_stats_full_scans_decided = stats.full_scans;
+	} else if (!ksm_boosted && gain <= 0 && (scanned || wasted)) {
+		/* a whole pass (or a mostly unmergeable pass) did not yield new savings */
+		ksm_step(false);
+		ksm_stats_full_scans_decided = stats.full_scans;
+	}
+
+	ksm_stats = stats;
 }
 
 static void
 ksm_set_aggressive_timeout_cb(UNUSED event_timer_t *timer, UNUSED void *data)
 {
-	ksm_set_relaxed();
+	/* scanning slows down by the controller as soon as it stops yielding savings */
+	ksm_boosted = false;
 
 	event_remove_timer(ksm_timer);
 	event_timer_free(ksm_timer);
@@ -79,6 +193,7 @@ void
 ksm_set_aggressive_for(int millisecs)
 {
 	ksm_set_aggressive();
+	ksm_boosted = true;
 
 	if (ksm_timer) {
 		/* if there is already a timer, renew it */
@@ -87,13 +202,23 @@ ksm_set_aggressive_for(int millisecs)
 		ksm_timer = NULL;
 	}
 
-	/* register timer to relax KSM after millisecs time */
+	/* register timer to hand KSM back to the controller after millisecs time */
 	ksm_timer = event_timer_new(millisecs, 1, &ksm_set_aggressive_timeout_cb, NULL);
+	event_timer_set_slack(ksm_timer, KSM_TIMER_SLACK);
 	event_add_timer(ksm_timer);
 }
 
+void
+ksm_set_mergeable_current(void)
+{
+	IF_FALSE_RETURN_TRACE(ksm_merge_containers);
+
+	if (prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) < 0)
+		DEBUG_ERRNO("Could not mark memory of the container mergeable; no kernel support?");
+}
+
 int
-ksm_init()
+ksm_init(bool merge_containers)
 {
 	if (file_printf(KSM_PATH "sleep_millisecs", "%d", KSM_RELAXED_SLEEP_MILLISECS) < 0) {
 		WARN("Could not configure KSM; no kernel support?");
@@ -103,9 +228,26 @@ ksm_init()
 		WARN("Could not configure KSM; no kernel support?");
 		return -1;
 	}
+	/* only writable while no pages are shared and only present on NUMA kernels */
+	if (file_exists(KSM_PATH "merge_across_nodes") &&
+	    file_printf(KSM_PATH "merge_across_nodes", "%d", 1) < 0) {
+		DEBUG("Could not enable KSM merging across NUMA nodes");
+	}
 	if (file_printf(KSM_PATH "run", "%d", 1) < 0) {
 		WARN("Could not configure KSM; no kernel support?");
 		return -1;
 	}
+
+	ksm_merge_containers = merge_containers;
+
+	if (ksm_stats_read(&ksm_stats) < 0)
+		WARN("Could not read KSM statistics, adaptive scanning disabled");
+	ksm_stats_full_scans_decided = ksm_stats.full_scans;
+
+	ksm_controller_timer =
+		event_timer_new(KSM_CONTROLLER_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+				&ksm_controller_cb, NULL);
+	event_timer_set_slack(ksm_controller_timer, KSM_TIMER_SLACK);
+	event_add_timer(ksm_controller_timer);
 	return 0;
 }
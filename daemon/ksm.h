@@ -24,14 +24,30 @@
 #ifndef KSM_H
 #define KSM_H
 
+#include <stdbool.h>
+
 /**
- * Configure KSM to be aggressive for some time before returning to normal
- * settings
+ * Configure KSM to be aggressive for some time before handing it back to the
+ * adaptive controller, which slows scanning down once it stops yielding savings
  */
 void
 ksm_set_aggressive_for(int millisecs);
 
+/**
+ * Marks all memory of the calling process and its future children mergeable
+ * (PR_SET_MEMORY_MERGE) if enabled by ksm_init(). To be called in a container's
+ * child before entering its user namespace.
+ */
+void
+ksm_set_mergeable_current(void);
+
+/**
+ * Enables KSM and starts the controller which tunes pages_to_scan and
+ * sleep_millisecs according to the merge statistics of the kernel.
+ * @param merge_containers make all memory of containers mergeable, not only
+ * regions which are advised by MADV_MERGEABLE
+ */
 int
-ksm_init();
+ksm_init(bool merge_containers);
 
 #endif /* KSM_H */
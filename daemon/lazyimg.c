@@ -0,0 +1,831 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "lazyimg.h"
+
+#include "delta.h"
+#include "download.h"
+#include "hash.h"
+
+#include "common/chunk.h"
+#include "common/event.h"
+#include "common/fd.h"
+#include "common/file.h"
+#include "common/list.h"
+#include "common/macro.h"
+#include "common/mem.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/nbd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#define LAZYIMG_FILE_SUFFIX ".lazy"
+// missing chunks fetched along with a read, reads during boot are mostly sequential
+#define LAZYIMG_READAHEAD (1024 * 1024)
+// size of the ranges streamed in the background, one after another
+#define LAZYIMG_STREAM_RANGE (4 * 1024 * 1024)
+// failed range downloads and mismatching chunks tolerated before giving up
+#define LAZYIMG_MAX_FAILURES 8
+#define LAZYIMG_NBD_MAX 16
+#define LAZYIMG_ATTACH_TIMEOUT 5000
+#define LAZYIMG_BUF_SIZE CHUNK_SIZE_MAX
+#define LAZYIMG_DETACH_INTERVAL 60000
+#define LAZYIMG_DETACH_SLACK 30000
+// seconds a device is given to be mounted after it has been attached
+#define LAZYIMG_DETACH_GRACE 60
+
+typedef enum {
+	LAZYIMG_CHUNK_MISSING = 0,
+	LAZYIMG_CHUNK_FETCHING,
+	LAZYIMG_CHUNK_FETCHED, ///< downloaded, but not verified yet
+	LAZYIMG_CHUNK_VERIFIED,
+} lazyimg_chunk_state_t;
+
+typedef struct lazyimg {
+	char *url;
+	char *file;
+	char *lazy_file;
+	char *index_file;
+	char *index_sha256;
+	delta_chunk_t *chunks;
+	size_t count;
+	uint64_t size;
+	int fd;		///< lazy file, read by the servers of the attached devices
+	size_t next;	///< chunk to continue streaming at
+	bool streaming; ///< a background range is being downloaded
+	lazyimg_callback_t cb;
+	void *data;
+
+	// shared with the server threads
+	pthread_mutex_t lock;
+	pthread_cond_t cond; ///< signaled on any change of state
+	uint8_t *state;	     ///< lazyimg_chunk_state_t of each chunk
+	size_t pending;	     ///< ranges posted or being downloaded
+	unsigned failures;
+	bool failed;
+	bool done; ///< nothing is fetched anymore
+	unsigned refs;
+} lazyimg_t;
+
+typedef struct lazyimg_range {
+	lazyimg_t *li;
+	size_t first;
+	size_t last;
+	bool urgent; ///< requested by a read of a device
+} lazyimg_range_t;
+
+typedef struct lazyimg_dev {
+	lazyimg_t *li;
+	char *dev;
+	int nbd_fd;
+	int sock[2]; ///< the first one is handed to the kernel, the second one is served
+	pthread_t server;
+	time_t attached;
+	bool detaching;
+} lazyimg_dev_t;
+
+// images being streamed and attached devices, shared with the threads attaching devices
+static pthread_mutex_t lazyimg_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static list_t *lazyimg_list = NULL;
+static list_t *lazyimg_dev_list = NULL;
+
+static event_timer_t *lazyimg_detach_timer = NULL;
+
+static void
+lazyimg_ref(lazyimg_t *li)
+{
+	pthread_mutex_lock(&li->lock);
+	li->refs++;
+	pthread_mutex_unlock(&li->lock);
+}
+
+static void
+lazyimg_unref(lazyimg_t *li)
+{
+	pthread_mutex_lock(&li->lock);
+	unsigned refs = --li->refs;
+	pthread_mutex_unlock(&li->lock);
+	IF_TRUE_RETURN(refs > 0);
+
+	if (li->fd >= 0)
+		close(li->fd);
+	pthread_cond_destroy(&li->cond);
+	pthread_mutex_destroy(&li->lock);
+	mem_free(li->url);
+	mem_free(li->file);
+	mem_free(li->lazy_file);
+	mem_free(li->index_file);
+	mem_free(li->index_sha256);
+	mem_free(li->chunks);
+	mem_free(li->state);
+	mem_free(li);
+}
+
+static void
+lazyimg_finish(lazyimg_t *li, bool success)
+{
+	// renamed under the lock, so that a file not streamed anymore exists
+	pthread_mutex_lock(&lazyimg_list_lock);
+	lazyimg_list = list_remove(lazyimg_list, li);
+	if (success && rename(li->lazy_file, li->file) < 0) {
+		WARN_ERRNO("Could not rename %s to %s", li->lazy_file, li->file);
+		success = false;
+	}
+	pthread_mutex_unlock(&lazyimg_list_lock);
+
+	if (!success && unlink(li->lazy_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", li->lazy_file);
+	if (unlink(li->index_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", li->index_file);
+
+	pthread_mutex_lock(&li->lock);
+	li->done = true;
+	li->failed |= !success;
+	pthread_cond_broadcast(&li->cond);
+	pthread_mutex_unlock(&li->lock);
+
+	if (success)
+		INFO("Streamed all %zu chunks of %s", li->count, li->file);
+	li->cb(success, li->data);
+	lazyimg_unref(li);
+}
+
+/*
+ * Marks the missing chunks starting at first as being fetched, up to max bytes.
+ * Returns the last chunk marked. Called with li->lock held.
+ */
+static size_t
+lazyimg_mark_fetching(lazyimg_t *li, size_t first, uint64_t max)
+{
+	size_t last = first;
+
+	li->state[first] = LAZYIMG_CHUNK_FETCHING;
+	while (last + 1 < li->count && li->state[last + 1] == LAZYIMG_CHUNK_MISSING &&
+	       li->chunks[last + 1].offset + li->chunks[last + 1].len - li->chunks[first].offset <=
+		       max)
+		li->state[++last] = LAZYIMG_CHUNK_FETCHING;
+	return last;
+}
+
+static void
+lazyimg_progress(lazyimg_t *li);
+
+static void
+lazyimg_range_done(lazyimg_range_t *range, bool success)
+{
+	lazyimg_t *li = range->li;
+
+	pthread_mutex_lock(&li->lock);
+	for (size_t i = range->first; i <= range->last; i++)
+		li->state[i] = success ? LAZYIMG_CHUNK_FETCHED : LAZYIMG_CHUNK_MISSING;
+	if (!success && ++li->failures >= LAZYIMG_MAX_FAILURES)
+		li->failed = true;
+	if (!range->urgent)
+		li->streaming = false;
+	li->pending--;
+	pthread_cond_broadcast(&li->cond);
+	pthread_mutex_unlock(&li->lock);
+
+	lazyimg_progress(li);
+	lazyimg_unref(li);
+	mem_free(range);
+}
+
+static void
+lazyimg_range_cb(download_t *dl, bool success, void *data)
+{
+	lazyimg_range_t *range = data;
+	ASSERT(range);
+
+	if (!success)
+		WARN("Download of a range of %s failed", download_get_url(dl));
+	download_free(dl);
+	lazyimg_range_done(range, success);
+}
+
+static void
+lazyimg_range_start(lazyimg_range_t *range)
+{
+	lazyimg_t *li = range->li;
+	uint64_t start = li->chunks[range->first].offset;
+	uint64_t len = li->chunks[range->last].offset + li->chunks[range->last].len - start;
+
+	TRACE("Fetching %" PRIu64 " bytes at %" PRIu64 " of %s%s", len, start, li->file,
+	      range->urgent ? " on demand" : "");
+	download_t *dl = download_new(li->url, li->lazy_file, lazyimg_range_cb, range);
+	download_set_range(dl, start, len);
+	if (range->urgent)
+		download_set_urgent(dl);
+	if (download_start(dl) < 0) {
+		ERROR("Failed to start download for %s", download_get_url(dl));
+		download_free(dl);
+		lazyimg_range_done(range, false);
+	}
+}
+
+/*
+ * Streams the next range in the background, wrapping around to fetch the
+ * chunks again whose download failed, and finishes once nothing is missing.
+ */
+static void
+lazyimg_progress(lazyimg_t *li)
+{
+	lazyimg_range_t *range = NULL;
+
+	pthread_mutex_lock(&li->lock);
+	for (size_t n = 0; !li->failed && !li->streaming && n < li->count; n++) {
+		size_t i = (li->next + n) % li->count;
+		if (li->state[i] != LAZYIMG_CHUNK_MISSING)
+			continue;
+		range = mem_new0(lazyimg_range_t, 1);
+		range->li = li;
+		range->first = i;
+		range->last = lazyimg_mark_fetching(li, i, LAZYIMG_STREAM_RANGE);
+		li->next = (range->last + 1) % li->count;
+		li->streaming = true;
+		li->pending++;
+		li->refs++;
+	}
+	bool finished = !range && li->pending == 0;
+	bool failed = li->failed;
+	pthread_mutex_unlock(&li->lock);
+
+	if (range)
+		lazyimg_range_start(range);
+	else if (finished)
+		lazyimg_finish(li, !failed);
+}
+
+static void
+lazyimg_fetch_cb(void *data)
+{
+	lazyimg_range_start(data);
+}
+
+/*
+ * Posts an urgent range starting at the missing chunk i to the main loop.
+ * Called by a server thread with li->lock held.
+ */
+static void
+lazyimg_request(lazyimg_t *li, size_t i)
+{
+	lazyimg_range_t *range = mem_new0(lazyimg_range_t, 1);
+	range->li = li;
+	range->first = i;
+	range->last = lazyimg_mark_fetching(li, i, LAZYIMG_READAHEAD);
+	range->urgent = true;
+	li->pending++;
+	li->refs++;
+
+	if (event_base_post(event_base_main_get(), &lazyimg_fetch_cb, range) < 0) {
+		ERROR("Could not request chunks of %s from main loop", li->file);
+		for (size_t j = range->first; j <= range->last; j++)
+			li->state[j] = LAZYIMG_CHUNK_MISSING;
+		if (++li->failures >= LAZYIMG_MAX_FAILURES)
+			li->failed = true;
+		li->pending--;
+		li->refs--;
+		mem_free(range);
+	}
+}
+
+static bool
+lazyimg_chunk_verify(lazyimg_t *li, size_t i, uint8_t *buf)
+{
+	const delta_chunk_t *c = &li->chunks[i];
+	char *sha256 = NULL;
+	bool ret = false;
+
+	if (pread(li->fd, buf, c->len, c->offset) != (ssize_t)c->len) {
+		WARN_ERRNO("Could not read chunk at %" PRIu64 " of %s", c->offset, li->file);
+		return false;
+	}
+
+	hash_stream_t *hs = hash_stream_new(HASH_SHA256);
+	IF_NULL_RETVAL(hs, false);
+	if (hash_stream_update(hs, buf, c->len) == 0 && hash_stream_final(hs, NULL, &sha256) == 0)
+		ret = !strcasecmp(sha256, c->sha256);
+	mem_free(sha256);
+	hash_stream_free(hs);
+	return ret;
+}
+
+/*
+ * Waits until the chunks first to last have been fetched and verified,
+ * requesting the missing ones. Called by a server thread.
+ */
+static int
+lazyimg_chunks_ensure(lazyimg_t *li, size_t first, size_t last, uint8_t *buf)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&li->lock);
+	for (size_t i = first; i <= last && ret == 0;) {
+		switch (li->state[i]) {
+		case LAZYIMG_CHUNK_VERIFIED:
+			i++;
+			break;
+		case LAZYIMG_CHUNK_FETCHING:
+			pthread_cond_wait(&li->cond, &li->lock);
+			break;
+		case LAZYIMG_CHUNK_MISSING:
+			if (li->failed || li->done)
+				ret = -1;
+			else
+				lazyimg_request(li, i);
+			break;
+		case LAZYIMG_CHUNK_FETCHED: {
+			// other servers verifying the same chunk concurrently do no harm
+			pthread_mutex_unlock(&li->lock);
+			bool good = lazyimg_chunk_verify(li, i, buf);
+			pthread_mutex_lock(&li->lock);
+			if (li->state[i] != LAZYIMG_CHUNK_FETCHED)
+				break;
+			if (good) {
+				li->state[i] = LAZYIMG_CHUNK_VERIFIED;
+				break;
+			}
+			WARN("Chunk at %" PRIu64 " of %s does not match the chunk index",
+			     li->chunks[i].offset, li->file);
+			li->state[i] = LAZYIMG_CHUNK_MISSING;
+			if (++li->failures >= LAZYIMG_MAX_FAILURES)
+				li->failed = true;
+			break;
+		}
+		}
+	}
+	pthread_mutex_unlock(&li->lock);
+	return ret;
+}
+
+static size_t
+lazyimg_chunk_find(const lazyimg_t *li, uint64_t offset)
+{
+	size_t lo = 0, hi = li->count - 1;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo + 1) / 2;
+		if (li->chunks[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/*
+ * Serves a read request of the device, the data of the reply is only sent if
+ * all chunks it covers have been verified.
+ */
+static int
+lazyimg_dev_read(lazyimg_dev_t *d, struct nbd_reply *reply, uint64_t from, uint32_t len,
+		 uint8_t *buf)
+{
+	lazyimg_t *li = d->li;
+
+	if (len == 0 || from >= li->size || len > li->size - from)
+		reply->error = htobe32(EINVAL);
+	else if (lazyimg_chunks_ensure(li, lazyimg_chunk_find(li, from),
+				       lazyimg_chunk_find(li, from + len - 1), buf) < 0)
+		reply->error = htobe32(EIO);
+
+	if (fd_write(d->sock[1], (char *)reply, sizeof(*reply)) != sizeof(*reply))
+		return -1;
+	IF_TRUE_RETVAL(reply->error, 0);
+
+	while (len > 0) {
+		size_t n = MIN(len, LAZYIMG_BUF_SIZE);
+		if (pread(li->fd, buf, n, from) != (ssize_t)n) {
+			// the reply is already announced, only the connection can be failed
+			WARN_ERRNO("Could not read %zu bytes at %" PRIu64 " of %s", n, from,
+				   li->file);
+			return -1;
+		}
+		if (fd_write(d->sock[1], (char *)buf, n) != (int)n)
+			return -1;
+		from += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *
+lazyimg_dev_serve(void *arg)
+{
+	lazyimg_dev_t *d = arg;
+	uint8_t *buf = mem_alloc(LAZYIMG_BUF_SIZE);
+	struct nbd_request req;
+
+	while (fd_read(d->sock[1], (char *)&req, sizeof(req)) == sizeof(req)) {
+		struct nbd_reply reply = { .magic = htobe32(NBD_REPLY_MAGIC) };
+		memcpy(reply.handle, req.handle, sizeof(reply.handle));
+		// the upper bits of the type are flags of the command
+		uint32_t type = be32toh(req.type) & 0xffff;
+		uint32_t len = be32toh(req.len);
+
+		if (be32toh(req.magic) != NBD_REQUEST_MAGIC) {
+			WARN("Invalid request on %s", d->dev);
+			break;
+		}
+		if (type == NBD_CMD_DISC)
+			break;
+
+		if (type == NBD_CMD_READ) {
+			if (lazyimg_dev_read(d, &reply, be64toh(req.from), len, buf) < 0)
+				break;
+			continue;
+		}
+		if (type == NBD_CMD_WRITE) {
+			// the device is read-only, drop the data
+			while (len > 0) {
+				size_t n = MIN(len, LAZYIMG_BUF_SIZE);
+				if (fd_read(d->sock[1], (char *)buf, n) != (int)n)
+					goto out;
+				len -= n;
+			}
+			reply.error = htobe32(EPERM);
+		} else if (type != NBD_CMD_FLUSH && type != NBD_CMD_TRIM) {
+			reply.error = htobe32(EINVAL);
+		}
+		if (fd_write(d->sock[1], (char *)&reply, sizeof(reply)) != sizeof(reply))
+			break;
+	}
+out:
+	mem_free(buf);
+	return NULL;
+}
+
+static void
+lazyimg_dev_free(lazyimg_dev_t *d)
+{
+	pthread_mutex_lock(&lazyimg_list_lock);
+	lazyimg_dev_list = list_remove(lazyimg_dev_list, d);
+	pthread_mutex_unlock(&lazyimg_list_lock);
+
+	close(d->sock[0]);
+	close(d->sock[1]);
+	close(d->nbd_fd);
+	lazyimg_unref(d->li);
+	mem_free(d->dev);
+	mem_free(d);
+}
+
+/*
+ * Runs the device until it is disconnected, the requests are served by the
+ * server thread.
+ */
+static void *
+lazyimg_dev_main(void *arg)
+{
+	lazyimg_dev_t *d = arg;
+
+	if (ioctl(d->nbd_fd, NBD_DO_IT) < 0)
+		DEBUG_ERRNO("Device %s has been disconnected", d->dev);
+	ioctl(d->nbd_fd, NBD_CLEAR_QUE);
+	ioctl(d->nbd_fd, NBD_CLEAR_SOCK);
+
+	shutdown(d->sock[1], SHUT_RDWR);
+	pthread_join(d->server, NULL);
+	INFO("Detached %s of %s", d->dev, d->li->file);
+	lazyimg_dev_free(d);
+	return NULL;
+}
+
+/*
+ * Hands a socket to a free nbd device and configures it for the image.
+ */
+static lazyimg_dev_t *
+lazyimg_dev_new(lazyimg_t *li)
+{
+	for (int i = 0; i < LAZYIMG_NBD_MAX; i++) {
+		char *dev = mem_printf("/dev/nbd%d", i);
+		int fd = open(dev, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			mem_free(dev);
+			continue;
+		}
+
+		int sock[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sock) < 0) {
+			WARN_ERRNO("Could not create socket pair for %s", dev);
+			close(fd);
+			mem_free(dev);
+			return NULL;
+		}
+		// fails with EBUSY if the device is in use
+		if (ioctl(fd, NBD_SET_SOCK, sock[0]) < 0) {
+			close(sock[0]);
+			close(sock[1]);
+			close(fd);
+			mem_free(dev);
+			continue;
+		}
+
+		unsigned long blksize = (li->size % 4096) ? 512 : 4096;
+		if (ioctl(fd, NBD_SET_BLKSIZE, blksize) < 0 ||
+		    ioctl(fd, NBD_SET_SIZE, (unsigned long)li->size) < 0 ||
+		    ioctl(fd, NBD_SET_FLAGS, NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY) < 0) {
+			WARN_ERRNO("Could not configure %s for %s", dev, li->file);
+			ioctl(fd, NBD_CLEAR_SOCK);
+			close(sock[0]);
+			close(sock[1]);
+			close(fd);
+			mem_free(dev);
+			return NULL;
+		}
+
+		lazyimg_dev_t *d = mem_new0(lazyimg_dev_t, 1);
+		d->li = li;
+		d->dev = dev;
+		d->nbd_fd = fd;
+		d->sock[0] = sock[0];
+		d->sock[1] = sock[1];
+		d->attached = time(NULL);
+		return d;
+	}
+
+	WARN("No free nbd device to attach %s", li->file);
+	return NULL;
+}
+
+/*
+ * Disconnects the device, its thread frees it afterwards. Called with
+ * lazyimg_list_lock held, which keeps the device from being freed meanwhile.
+ */
+static void
+lazyimg_dev_disconnect_locked(lazyimg_dev_t *d)
+{
+	if (ioctl(d->nbd_fd, NBD_DISCONNECT) < 0) {
+		WARN_ERRNO("Could not disconnect %s", d->dev);
+		return;
+	}
+	d->detaching = true;
+}
+
+static void
+lazyimg_dev_disconnect(const char *dev)
+{
+	pthread_mutex_lock(&lazyimg_list_lock);
+	for (list_t *l = lazyimg_dev_list; l; l = l->next) {
+		lazyimg_dev_t *d = l->data;
+		if (!strcmp(d->dev, dev) && !d->detaching)
+			lazyimg_dev_disconnect_locked(d);
+	}
+	pthread_mutex_unlock(&lazyimg_list_lock);
+}
+
+/*
+ * The device is usable once NBD_DO_IT has started it, which creates its pid
+ * attribute in sysfs.
+ */
+static int
+lazyimg_dev_wait(const char *dev)
+{
+	char *pid = mem_printf("/sys/block/%s/pid", strrchr(dev, '/') + 1);
+	int ret = -1;
+
+	for (int waited = 0; waited < LAZYIMG_ATTACH_TIMEOUT; waited += 10) {
+		if (file_exists(pid)) {
+			ret = 0;
+			break;
+		}
+		usleep(10 * 1000);
+	}
+	mem_free(pid);
+	return ret;
+}
+
+char *
+lazyimg_attach_new(const char *file, int *fd)
+{
+	ASSERT(file);
+	ASSERT(fd);
+
+	lazyimg_t *li = NULL;
+
+	pthread_mutex_lock(&lazyimg_list_lock);
+	for (list_t *l = lazyimg_list; l && !li; l = l->next) {
+		if (!strcmp(((lazyimg_t *)l->data)->file, file)) {
+			li = l->data;
+			lazyimg_ref(li);
+		}
+	}
+	pthread_mutex_unlock(&lazyimg_list_lock);
+	IF_NULL_RETVAL(li, NULL);
+
+	lazyimg_dev_t *d = lazyimg_dev_new(li);
+	if (!d) {
+		lazyimg_unref(li);
+		return NULL;
+	}
+	// d is freed by its thread once it is disconnected
+	char *dev = mem_strdup(d->dev);
+	pthread_mutex_lock(&lazyimg_list_lock);
+	lazyimg_dev_list = list_append(lazyimg_dev_list, d);
+	pthread_mutex_unlock(&lazyimg_list_lock);
+
+	// the threads must not receive process signals, those are handled by the main loop
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t thread;
+	int ret = pthread_create(&d->server, NULL, &lazyimg_dev_serve, d);
+	if (ret == 0 && (ret = pthread_create(&thread, NULL, &lazyimg_dev_main, d)) != 0) {
+		shutdown(d->sock[1], SHUT_RDWR);
+		pthread_join(d->server, NULL);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		errno = ret;
+		WARN_ERRNO("Could not start threads for %s", d->dev);
+		ioctl(d->nbd_fd, NBD_CLEAR_SOCK);
+		lazyimg_dev_free(d);
+		mem_free(dev);
+		return NULL;
+	}
+	pthread_detach(thread);
+
+	if (lazyimg_dev_wait(dev) < 0 || (*fd = open(dev, O_RDONLY | O_CLOEXEC)) < 0) {
+		WARN_ERRNO("Device %s for %s did not come up", dev, file);
+		lazyimg_dev_disconnect(dev);
+		mem_free(dev);
+		return NULL;
+	}
+
+	INFO("Attached %s of %s while it is streamed", dev, file);
+	return dev;
+}
+
+void
+lazyimg_detach_unused(void)
+{
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&lazyimg_list_lock);
+	for (list_t *l = lazyimg_dev_list; l; l = l->next) {
+		lazyimg_dev_t *d = l->data;
+		if (d->detaching || now - d->attached < LAZYIMG_DETACH_GRACE)
+			continue;
+
+		// a mounted block device cannot be opened exclusively
+		int fd = open(d->dev, O_RDONLY | O_EXCL | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		close(fd);
+		DEBUG("Detaching unused %s of %s", d->dev, d->li->file);
+		lazyimg_dev_disconnect_locked(d);
+	}
+	pthread_mutex_unlock(&lazyimg_list_lock);
+}
+
+static void
+lazyimg_detach_cb(event_timer_t *timer, UNUSED void *data)
+{
+	lazyimg_detach_unused();
+
+	pthread_mutex_lock(&lazyimg_list_lock);
+	bool idle = !lazyimg_list && !lazyimg_dev_list;
+	pthread_mutex_unlock(&lazyimg_list_lock);
+	IF_FALSE_RETURN(idle);
+
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	lazyimg_detach_timer = NULL;
+}
+
+/*
+ * Devices can only be attached while their image is streamed, so the timer
+ * is running whenever there are attached devices.
+ */
+static void
+lazyimg_detach_timer_start(void)
+{
+	IF_TRUE_RETURN(lazyimg_detach_timer);
+
+	lazyimg_detach_timer = event_timer_new(LAZYIMG_DETACH_INTERVAL, EVENT_TIMER_REPEAT_FOREVER,
+					       lazyimg_detach_cb, NULL);
+	event_timer_set_slack(lazyimg_detach_timer, LAZYIMG_DETACH_SLACK);
+	event_add_timer(lazyimg_detach_timer);
+}
+
+static void
+lazyimg_cb_index(download_t *dl, bool success, void *data)
+{
+	lazyimg_t *li = data;
+	ASSERT(li);
+
+	download_free(dl);
+	if (!success) {
+		DEBUG("No chunk index available for %s", li->url);
+		lazyimg_finish(li, false);
+		return;
+	}
+
+	li->chunks = delta_index_parse(li->index_file, li->index_sha256, &li->count);
+	if (!li->chunks) {
+		lazyimg_finish(li, false);
+		return;
+	}
+	li->size = li->chunks[li->count - 1].offset + li->chunks[li->count - 1].len;
+	li->state = mem_new0(uint8_t, li->count);
+
+	li->fd = open(li->lazy_file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (li->fd < 0 || ftruncate(li->fd, li->size) < 0) {
+		WARN_ERRNO("Could not create %s with %" PRIu64 " bytes", li->lazy_file, li->size);
+		lazyimg_finish(li, false);
+		return;
+	}
+
+	pthread_mutex_lock(&lazyimg_list_lock);
+	lazyimg_list = list_append(lazyimg_list, li);
+	pthread_mutex_unlock(&lazyimg_list_lock);
+	lazyimg_detach_timer_start();
+
+	INFO("Streaming %zu chunks of %s, it can be attached already", li->count, li->file);
+	lazyimg_progress(li);
+}
+
+int
+lazyimg_fetch(const char *url, const char *file, const char *index_sha256,
+	      lazyimg_callback_t cb, void *data)
+{
+	ASSERT(url);
+	ASSERT(file);
+	ASSERT(index_sha256);
+	ASSERT(cb);
+
+	if (!file_exists("/dev/nbd0")) {
+		DEBUG("No nbd devices available to attach %s lazily", file);
+		return -1;
+	}
+
+	lazyimg_t *li = mem_new0(lazyimg_t, 1);
+	li->url = mem_strdup(url);
+	li->file = mem_strdup(file);
+	li->lazy_file = mem_printf("%s" LAZYIMG_FILE_SUFFIX, file);
+	li->index_file = mem_printf("%s" DELTA_INDEX_SUFFIX, file);
+	li->index_sha256 = mem_strdup(index_sha256);
+	li->fd = -1;
+	li->cb = cb;
+	li->data = data;
+	li->refs = 1;
+	pthread_mutex_init(&li->lock, NULL);
+	pthread_cond_init(&li->cond, NULL);
+
+	char *index_url = mem_printf("%s" DELTA_INDEX_SUFFIX, url);
+	download_t *dl = download_new(index_url, li->index_file, lazyimg_cb_index, li);
+	mem_free(index_url);
+	if (download_start(dl) < 0) {
+		ERROR("Failed to start download for %s", download_get_url(dl));
+		download_free(dl);
+		lazyimg_unref(li);
+		return -1;
+	}
+	return 0;
+}
+
+bool
+lazyimg_is_streaming(const char *file)
+{
+	ASSERT(file);
+	bool ret = false;
+
+	pthread_mutex_lock(&lazyimg_list_lock);
+	for (list_t *l = lazyimg_list; l && !ret; l = l->next)
+		ret = !strcmp(((lazyimg_t *)l->data)->file, file);
+	pthread_mutex_unlock(&lazyimg_list_lock);
+	return ret;
+}
@@ -0,0 +1,93 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file lazyimg.h
+ *
+ * Lazy images are attached before they have been downloaded completely. The
+ * chunk index of an image (see delta.h) is fetched first and an empty sparse
+ * <file>.lazy of the size of the image is created. The image can then be
+ * attached as read-only network block device (NBD) served by cmld itself:
+ * chunks read through the device which are still missing are fetched at once
+ * by urgent range requests, including some readahead, while the remaining
+ * chunks are streamed in the background one range after another. Each chunk
+ * is verified against its digest from the chunk index before it is served,
+ * and the index itself against the digest from the signed GuestOS config.
+ *
+ * Once all chunks have been fetched, <file>.lazy is renamed to file and the
+ * callback is called; the attached devices are still served from the then
+ * complete image until they are no longer used and detached. Like for delta
+ * updates, the complete image is not verified here but by the caller.
+ */
+
+#ifndef LAZYIMG_H
+#define LAZYIMG_H
+
+#include <stdbool.h>
+
+/**
+ * Callback type for functions called after a lazy image has been completed/aborted.
+ */
+typedef void (*lazyimg_callback_t)(bool success, void *data);
+
+/**
+ * Starts to stream the image at url to file, which can be attached by
+ * lazyimg_attach_new() as soon as its chunk index has been fetched.
+ * If the server provides no valid chunk index, nbd is not available or the
+ * chunks cannot be fetched, the callback reports an error and the caller
+ * should fall back to a complete download.
+ * @param url the URL of the image
+ * @param file the file to stream the image to
+ * @param index_sha256 the expected sha256 of the chunk index
+ * @param cb the callback to call after the image is complete or streaming failed
+ * @param data custom parameter passed to the callback
+ * @return 0 if streaming has been started, -1 otherwise
+ */
+int
+lazyimg_fetch(const char *url, const char *file, const char *index_sha256,
+	      lazyimg_callback_t cb, void *data);
+
+/**
+ * Checks whether file is being streamed and can be attached.
+ */
+bool
+lazyimg_is_streaming(const char *file);
+
+/**
+ * Attaches the image file which is being streamed to a free nbd device.
+ * May be called from other threads than the main loop.
+ * @param file the file passed to lazyimg_fetch()
+ * @param fd returns an fd of the device, to be closed once it has been mounted
+ * @return the path of the device, NULL if file is not streamed or on error
+ */
+char *
+lazyimg_attach_new(const char *file, int *fd);
+
+/**
+ * Detaches the devices attached by lazyimg_attach_new() which are no longer
+ * mounted. This is also done periodically as long as devices are attached.
+ */
+void
+lazyimg_detach_unused(void);
+
+#endif /* LAZYIMG_H */
@@ -22,6 +22,7 @@
  */
 
 #include "lxcfs.h"
+#include "c_cgroups.h"
 #include "hardware.h"
 #include "mount.h"
 
@@ -30,9 +31,9 @@
 #include "common/dir.h"
 #include "common/event.h"
 #include "common/file.h"
+#include "common/list.h"
 
 #include <sys/mount.h>
-#include <sys/wait.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <unistd.h>
@@ -44,6 +45,28 @@ static const char *lxcfs_bin_path = NULL;
 static const char *lxcfs_rt_path = NULL;
 static pid_t lxcfs_daemon_pid = 0;
 
+/*
+ * Names of the files in the proc dir of lxcfs, which are bind-mounted over the
+ * proc of each container. The list is read once in cmld, so that container
+ * starts do not have to list the FUSE dir, which is served by the lxcfs daemon.
+ */
+static list_t *lxcfs_proc_files = NULL;
+static bool lxcfs_proc_files_read = false;
+
+/*
+ * Drops the list of proc files, e.g. if the lxcfs daemon is (re)started, as
+ * a new daemon may provide other files.
+ */
+static void
+lxcfs_proc_files_free(void)
+{
+	for (list_t *l = lxcfs_proc_files; l; l = l->next)
+		mem_free(l->data);
+	list_delete(lxcfs_proc_files);
+	lxcfs_proc_files = NULL;
+	lxcfs_proc_files_read = false;
+}
+
 #define PROC_FSES "/proc/filesystems"
 static const char *
 lxcfs_get_bin_path_if_supported(void)
@@ -66,20 +89,14 @@ lxcfs_get_bin_path_if_supported(void)
 }
 
 static void
-lxcfs_daemon_sigchld_cb(UNUSED int signum, event_signal_t *sig, void *data)
+lxcfs_daemon_child_cb(pid_t pid, UNUSED int status, event_child_t *child, UNUSED void *data)
 {
-	pid_t *lxcfs_pid = data;
-	pid_t pid;
-	int status = 0;
-
-	DEBUG("lxcfs SIGCHLD handler called for PID %d", *lxcfs_pid);
-	if ((pid = waitpid(*lxcfs_pid, &status, WNOHANG)) > 0) {
-		TRACE("Reaped lxcfs process: %d", pid);
-		/* remove the sigchld callback for the lxcfs daemon from the event loop */
-		event_remove_signal(sig);
-		event_signal_free(sig);
-	} else {
-		TRACE("Failed to reap lxcfs process");
+	TRACE("Reaped lxcfs process: %d", pid);
+	event_child_free(child);
+
+	if (pid == lxcfs_daemon_pid) {
+		lxcfs_daemon_pid = 0;
+		lxcfs_proc_files_free();
 	}
 }
 
@@ -92,6 +109,16 @@ lxcfs_daemon_stop(void)
 	}
 }
 
+static void
+lxcfs_daemon_watch(void)
+{
+	event_child_t *child = event_child_new(lxcfs_daemon_pid, lxcfs_daemon_child_cb, NULL);
+	if (event_add_child(child) < 0) {
+		WARN("Failed to register reaper for lxcfs process");
+		event_child_free(child);
+	}
+}
+
 static int
 lxcfs_daemon_start(const char *rt_path)
 {
@@ -99,6 +126,7 @@ lxcfs_daemon_start(const char *rt_path)
 					   LXCFS_PID_FILE, rt_path, NULL };
 	INFO("lxcfs is supported, starting lxcfs daemon '%s' ...", lxcfs_argv[0]);
 
+	lxcfs_proc_files_free();
 	IF_TRUE_RETVAL((lxcfs_daemon_pid = fork()) == -1, -1);
 
 	if (lxcfs_daemon_pid == 0) {
@@ -123,9 +151,7 @@ lxcfs_daemon_start(const char *rt_path)
 		exit(-1);
 	} else {
 		INFO("lxcfs daemon start done");
-		event_signal_t *sigchld =
-			event_signal_new(SIGCHLD, lxcfs_daemon_sigchld_cb, &lxcfs_daemon_pid);
-		event_add_signal(sigchld);
+		lxcfs_daemon_watch();
 	}
 
 	return 0;
@@ -138,16 +164,8 @@ lxcfs_is_supported(void)
 }
 
 static int
-lxcfs_proc_dir_foreach_cb(const char *path, const char *file, void *data)
+lxcfs_proc_overlay_file(const char *path, const char *file, const char *target_path)
 {
-	char *target_path = data;
-	ASSERT(target_path);
-
-	if (0 == strcmp(file, "mounts")) {
-		TRACE("Skipping 'mounts'");
-		return 0;
-	}
-
 	char *dst = mem_printf("%s/%s", target_path, file);
 	char *src = mem_printf("%s/%s", path, file);
 
@@ -162,6 +180,39 @@ lxcfs_proc_dir_foreach_cb(const char *path, const char *file, void *data)
 	return ret;
 }
 
+static int
+lxcfs_proc_dir_foreach_cb(UNUSED const char *path, const char *file, UNUSED void *data)
+{
+	if (0 == strcmp(file, "mounts")) {
+		TRACE("Skipping 'mounts'");
+		return 0;
+	}
+
+	lxcfs_proc_files = list_append(lxcfs_proc_files, mem_strdup(file));
+	return 0;
+}
+
+int
+lxcfs_proc_overlay_prepare(void)
+{
+	IF_TRUE_RETVAL(!lxcfs_is_supported() || lxcfs_proc_files_read, 0);
+
+	// the dir cannot be listed until the lxcfs daemon has mounted its file system
+	int ret = 0;
+	char *lxcfs_proc = mem_printf("%s/proc", lxcfs_rt_path);
+	if (dir_foreach(lxcfs_proc, &lxcfs_proc_dir_foreach_cb, NULL) < 0) {
+		DEBUG("Could not list lxcfs proc dir %s (yet)", lxcfs_proc);
+		lxcfs_proc_files_free();
+		ret = -1;
+	} else {
+		DEBUG("Found %u files in lxcfs proc dir %s", list_length(lxcfs_proc_files),
+		      lxcfs_proc);
+		lxcfs_proc_files_read = true;
+	}
+	mem_free(lxcfs_proc);
+	return ret;
+}
+
 int
 lxcfs_mount_proc_overlay(char *target)
 {
@@ -170,9 +221,20 @@ lxcfs_mount_proc_overlay(char *target)
 		return ret;
 
 	char *lxcfs_proc = mem_printf("%s/proc", lxcfs_rt_path);
-	if (dir_foreach(lxcfs_proc, &lxcfs_proc_dir_foreach_cb, target) < 0) {
+
+	// read the files now if the list could not be prepared before the clone
+	if (lxcfs_proc_overlay_prepare() < 0) {
 		ERROR("Could not mount proc overlay %s -> %s", lxcfs_proc, target);
-		ret = -1;
+		mem_free(lxcfs_proc);
+		return -1;
+	}
+
+	for (list_t *l = lxcfs_proc_files; l; l = l->next) {
+		if (lxcfs_proc_overlay_file(lxcfs_proc, l->data, target) < 0) {
+			ERROR("Could not mount proc overlay %s -> %s", lxcfs_proc, target);
+			ret = -1;
+			break;
+		}
 	}
 	mem_free(lxcfs_proc);
 	return ret;
@@ -185,7 +247,7 @@ lxcfs_init(void)
 	lxcfs_bin_path = lxcfs_get_bin_path_if_supported();
 
 	if (lxcfs_bin_path) {
-		int ret = mount_cgroups(hardware_get_active_cgroups_subsystems());
+		int ret = c_cgroups_mount();
 		if (ret) {
 			WARN("Cannont mount CGroups, thus no need to start lxcfs!");
 			return -1;
@@ -195,8 +257,30 @@ lxcfs_init(void)
 	return -1;
 }
 
+int
+lxcfs_adopt(pid_t pid)
+{
+	lxcfs_rt_path = LXCFS_RT_PATH;
+	lxcfs_bin_path = lxcfs_get_bin_path_if_supported();
+
+	IF_TRUE_RETVAL(!lxcfs_bin_path || pid <= 0, -1);
+
+	INFO("Adopting running lxcfs daemon with pid=%d", pid);
+	lxcfs_proc_files_free();
+	lxcfs_daemon_pid = pid;
+	lxcfs_daemon_watch();
+	return 0;
+}
+
+pid_t
+lxcfs_get_pid(void)
+{
+	return lxcfs_daemon_pid;
+}
+
 void
 lxcfs_cleanup(void)
 {
 	lxcfs_daemon_stop();
+	lxcfs_proc_files_free();
 }
@@ -22,6 +22,7 @@
  */
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 /**
  * Initialize the lxcfs submodule, gather pathes and start daemon.
@@ -31,6 +32,22 @@
 int
 lxcfs_init(void);
 
+/**
+ * Initialize the lxcfs submodule with the lxcfs daemon of a previous cmld
+ * instance, which is still running after a live restart, see handoff.h.
+ *
+ * @param pid The pid of the running lxcfs daemon
+ * @return 0 if sucessfully initialized, -1 otherwise
+ */
+int
+lxcfs_adopt(pid_t pid);
+
+/**
+ * Returns the pid of the lxcfs daemon, 0 if it is not running.
+ */
+pid_t
+lxcfs_get_pid(void);
+
 /**
  * Cleanup the lxcfs submodule, mainly stop daemon.
  */
@@ -45,6 +62,17 @@ lxcfs_cleanup(void);
 bool
 lxcfs_is_supported(void);
 
+/**
+ * Reads the list of proc files provided by lxcfs once, so that the children
+ * of cmld inherit it and lxcfs_mount_proc_overlay() does not have to list the
+ * lxcfs dir on each container start. Call before cloning a container. The
+ * list is read again once the lxcfs daemon has been restarted.
+ *
+ * @return 0 if the list is available, -1 if the lxcfs dir cannot be listed
+ */
+int
+lxcfs_proc_overlay_prepare(void);
+
 /**
  * Apply lxcfs provided virualization of proc files
  *
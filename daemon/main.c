@@ -32,6 +32,8 @@
 #include "common/event.h"
 #include "common/file.h"
 #include "common/logf.h"
+#include "common/logstore.h"
+#include "common/mem.h"
 
 #include "cmld.h"
 #include "hardware.h"
@@ -46,6 +48,10 @@
 #include <signal.h>
 #include <string.h>
 
+// segment size of the log file of cmld and storage budget of its compressed segments
+#define MAIN_LOGFILE_SEGMENT_SIZE (4 * 1024 * 1024)
+#define MAIN_LOGFILE_MAX_SIZE (64 * 1024 * 1024)
+
 static logf_handler_t *cml_daemon_logfile_handler = NULL;
 static bool is_handling_sigint = false;
 
@@ -93,13 +99,31 @@ main_sigterm_cb(UNUSED int signum, UNUSED event_signal_t *sig, UNUSED void *data
 		ERROR("Could not stop all containers");
 }
 
+// number of call sites logged on SIGUSR2, the complete profile is available by GET_MEM_STATS
+#define MAIN_MEM_PROFILE_LOG_SITES 32
+
+static void
+main_sigusr2_cb(UNUSED int signum, UNUSED event_signal_t *sig, UNUSED void *data)
+{
+	INFO("Received SIGUSR2..");
+	mem_profile_log(MAIN_MEM_PROFILE_LOG_SITES);
+}
+
+// large transient buffers freed in the meantime are returned to the kernel
+#define MAIN_MEM_TRIM_INTERVAL 60000
+
+static void
+main_mem_trim_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	if (mem_trim())
+		DEBUG("Trimmed the heap after large buffers have been freed");
+}
+
 static void
-main_logfile_rename_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+main_logfile_prio_cb(UNUSED event_timer_t *timer, UNUSED void *data)
 {
-	DEBUG("Logfile will be closed and a new file opened");
-	logf_unregister(cml_daemon_logfile_handler);
-	cml_daemon_logfile_handler =
-		logf_register(&logf_file_write, logf_file_new(LOGFILE_DIR "/cml-daemon"));
+	// the log file is rotated by size, after the first day only warnings are logged
+	DEBUG("Reducing the log file to warnings");
 	logf_handler_set_prio(cml_daemon_logfile_handler, LOGF_PRIO_WARN);
 }
 
@@ -115,10 +139,15 @@ main(int argc, char **argv)
 
 	// TODO: where should we store the log files?
 	// TODO: disable for non developer builds?
-	cml_daemon_logfile_handler =
-		logf_register(&logf_file_write, logf_file_new(LOGFILE_DIR "/cml-daemon"));
+	void *logfile = logstore_file_new(LOGFILE_DIR "/cml-daemon", MAIN_LOGFILE_SEGMENT_SIZE,
+					  MAIN_LOGFILE_MAX_SIZE);
+	cml_daemon_logfile_handler = logf_register(&logf_file_write, logfile);
 	logf_handler_set_prio(cml_daemon_logfile_handler, LOGF_PRIO_TRACE);
 
+	// keep log I/O out of the event loop
+	if (logf_async_start(0) < 0)
+		WARN("Could not start log writer thread, logging synchronously");
+
 	main_core_dump_enable();
 
 	INFO("Starting...");
@@ -130,6 +159,7 @@ main(int argc, char **argv)
 		path = DEFAULT_BASE_PATH;
 
 	event_init();
+	event_timer_use_timerfd(true);
 	// TODO: remove for production builds?
 	event_signal_t *sig_int = event_signal_new(SIGINT, &main_sigint_cb, NULL);
 	event_add_signal(sig_int);
@@ -137,12 +167,22 @@ main(int argc, char **argv)
 	event_signal_t *sig_term = event_signal_new(SIGTERM, &main_sigterm_cb, NULL);
 	event_add_signal(sig_term);
 
+	event_signal_t *sig_usr2 = event_signal_new(SIGUSR2, &main_sigusr2_cb, NULL);
+	event_add_signal(sig_usr2);
+
 	DEBUG("Initializing cmld...");
 	event_timer_t *logfile_timer =
 		event_timer_new(HOURS_TO_MILLISECONDS(24), EVENT_TIMER_REPEAT_FOREVER,
-				main_logfile_rename_cb, NULL);
+				main_logfile_prio_cb, NULL);
+	event_timer_set_slack(logfile_timer, HOURS_TO_MILLISECONDS(1));
 	event_add_timer(logfile_timer);
 
+	event_timer_t *mem_trim_timer = event_timer_new(MAIN_MEM_TRIM_INTERVAL,
+							EVENT_TIMER_REPEAT_FOREVER,
+							main_mem_trim_cb, NULL);
+	event_timer_set_slack(mem_trim_timer, MAIN_MEM_TRIM_INTERVAL / 2);
+	event_add_timer(mem_trim_timer);
+
 	if (cmld_init(path) < 0)
 		FATAL("Could not init cmld");
 
@@ -52,6 +52,8 @@ struct mount_entry {
 	// TODO: add list of hash, min/max size for EMPTY images, etc.
 	char *sha1;
 	char *sha256;
+	char *verity_sha256; /**< fs-verity file digest of the image */
+	char *chunks_sha256; /**< digest of the chunk index of the image */
 	char *mount_data; /**< mount_data to use for mount syscall e.g. "uid=1000,gid=1000,dmask=227,fmask=337,context=u:object_r:firmware_file:s0" */
 };
 
@@ -77,6 +79,8 @@ mount_add_entry(mount_t *mnt, enum mount_type type, const char *image_file, cons
 	mntent->image_size = 0;
 	mntent->sha1 = NULL;
 	mntent->sha256 = NULL;
+	mntent->verity_sha256 = NULL;
+	mntent->chunks_sha256 = NULL;
 	mntent->mount_data = NULL;
 
 	mnt->list = list_append(mnt->list, mntent);
@@ -100,6 +104,10 @@ mount_free(mount_t *mnt)
 			mem_free(mntent->sha1);
 		if (mntent->sha256)
 			mem_free(mntent->sha256);
+		if (mntent->verity_sha256)
+			mem_free(mntent->verity_sha256);
+		if (mntent->chunks_sha256)
+			mem_free(mntent->chunks_sha256);
 		if (mntent->mount_data)
 			mem_free(mntent->mount_data);
 		mem_free(mntent);
@@ -224,6 +232,36 @@ mount_entry_set_sha256(mount_entry_t *mntent, char *sha256)
 	mntent->sha256 = mem_strdup(sha256);
 }
 
+char *
+mount_entry_get_verity_sha256(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->verity_sha256;
+}
+
+void
+mount_entry_set_verity_sha256(mount_entry_t *mntent, char *verity_sha256)
+{
+	ASSERT(mntent);
+	IF_NULL_RETURN(verity_sha256);
+	mntent->verity_sha256 = mem_strdup(verity_sha256);
+}
+
+char *
+mount_entry_get_chunks_sha256(const mount_entry_t *mntent)
+{
+	ASSERT(mntent);
+	return mntent->chunks_sha256;
+}
+
+void
+mount_entry_set_chunks_sha256(mount_entry_t *mntent, char *chunks_sha256)
+{
+	ASSERT(mntent);
+	IF_NULL_RETURN(chunks_sha256);
+	mntent->chunks_sha256 = mem_strdup(chunks_sha256);
+}
+
 void
 mount_entry_set_mount_data(mount_entry_t *mntent, char *mount_data)
 {
@@ -264,6 +302,18 @@ mount_entry_match_sha256(const mount_entry_t *e, const char *hash)
 	return match_hash(32, expected, hash);
 }
 
+bool
+mount_entry_match_verity_sha256(const mount_entry_t *e, const char *hash)
+{
+	ASSERT(e);
+
+	const char *img_name = mount_entry_get_img(e);
+	const char *expected = mount_entry_get_verity_sha256(e);
+	DEBUG("Checking image %s.img with expected fs-verity digest %s, actual digest: %s",
+	      img_name, expected, hash);
+	return match_hash(32, expected, hash);
+}
+
 bool
 mount_entry_is_encrypted(const mount_entry_t *e)
 {
@@ -63,6 +63,10 @@ enum mount_type {
 				      as overlay to each container */
 	MOUNT_TYPE_BIND_FILE = 10,    /**< file is bind mounted to container (RO) */
 	MOUNT_TYPE_BIND_FILE_RW = 11, /**< file is bind mounted to container (RW) */
+	MOUNT_TYPE_LAYER = 12,	      /**< image file from the layer store shared by all
+				      operating systems, consecutive layers of the same mount
+				      point are stacked in one overlay with an individual
+				      writable tmpfs */
 };
 
 mount_t *
@@ -136,6 +140,32 @@ mount_entry_set_sha1(mount_entry_t *mntent, char *sha1);
 void
 mount_entry_set_sha256(mount_entry_t *mntent, char *sha256);
 
+/**
+ * Returns a string with the fs-verity (sha256) file digest of the mount entry's
+ * image or NULL if the image is not protected by fs-verity.
+ */
+char *
+mount_entry_get_verity_sha256(const mount_entry_t *mntent);
+
+/**
+ * Sets the fs-verity (sha256) file digest for the mount entry.
+ */
+void
+mount_entry_set_verity_sha256(mount_entry_t *mntent, char *verity_sha256);
+
+/**
+ * Returns a string with the sha256 digest of the chunk index of the mount
+ * entry's image or NULL if no chunk index is signed for the image.
+ */
+char *
+mount_entry_get_chunks_sha256(const mount_entry_t *mntent);
+
+/**
+ * Sets the sha256 digest of the chunk index for the mount entry.
+ */
+void
+mount_entry_set_chunks_sha256(mount_entry_t *mntent, char *chunks_sha256);
+
 /**
  * Checks if the given SHA1 hash matches with the one stored in the mount entry.
  */
@@ -148,6 +178,12 @@ mount_entry_match_sha1(const mount_entry_t *e, const char *hash);
 bool
 mount_entry_match_sha256(const mount_entry_t *e, const char *hash);
 
+/**
+ * Checks if the given fs-verity digest matches with the one stored in the mount entry.
+ */
+bool
+mount_entry_match_verity_sha256(const mount_entry_t *e, const char *hash);
+
 /**
  * Returns the type of the mount entry.
  */
@@ -0,0 +1,796 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "peer.h"
+#include "delta.h"
+#include "download.h"
+#include "guestos.h"
+#include "guestos_mgr.h"
+#include "hash.h"
+
+#include "common/chunk.h"
+#include "common/event.h"
+#include "common/list.h"
+#include "common/macro.h"
+#include "common/mem.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define PEER_MAGIC "CMLPEER1"
+#define PEER_MSG_MAX 128
+#define PEER_FILE_SUFFIX ".peer"
+// at most that many peers are used for one image
+#define PEER_MAX 8
+// consecutive chunks requested from a peer at once
+#define PEER_SEGMENT_SIZE (4 * 1024 * 1024)
+
+#define PEER_CONNS_MAX 16
+#define PEER_REQUEST_MAX 4096
+// a connection is closed if no data moved for that long
+#define PEER_CONN_TIMEOUT_MS 30000
+#define PEER_SEND_SIZE (256 * 1024)
+
+typedef struct peer_fetch {
+	char *url;
+	char *file;
+	char *sha256;
+	char *index_sha256;
+	char *index_file;
+	char *peer_file;
+	struct in_addr peers[PEER_MAX];
+	size_t peers_count;
+	size_t next_peer; // peers are asked for segments in turn
+	event_timer_t *timer;
+	delta_chunk_t *chunks;
+	size_t chunks_count;
+	size_t pending;
+	uint64_t fallback; // bytes fetched from the update server
+	bool failed;
+	peer_callback_t cb;
+	void *data;
+} peer_fetch_t;
+
+typedef struct peer_segment {
+	peer_fetch_t *fetch;
+	size_t first;
+	size_t count;
+	bool origin; // fetched from the update server
+} peer_segment_t;
+
+typedef struct peer_conn {
+	int fd;
+	event_io_t *event;
+	event_timer_t *timer;
+	char req[PEER_REQUEST_MAX];
+	size_t req_len;
+	char *resp;
+	size_t resp_len;
+	size_t resp_sent;
+	int file_fd;
+	off_t pos;
+	uint64_t remaining;
+} peer_conn_t;
+
+static uint16_t peer_port = 0;
+static int peer_udp_sock = -1;
+static int peer_tcp_sock = -1;
+static event_io_t *peer_udp_event = NULL;
+static event_io_t *peer_tcp_event = NULL;
+
+// fetches waiting for answers to their query
+static list_t *peer_queries = NULL;
+static list_t *peer_conns = NULL;
+
+/******************************************************************************/
+/* fetching from peers */
+
+static void
+peer_fetch_free(peer_fetch_t *fetch)
+{
+	if (fetch->timer) {
+		event_remove_timer(fetch->timer);
+		event_timer_free(fetch->timer);
+	}
+	mem_free(fetch->url);
+	mem_free(fetch->file);
+	mem_free(fetch->sha256);
+	mem_free(fetch->index_sha256);
+	mem_free(fetch->index_file);
+	mem_free(fetch->peer_file);
+	mem_free(fetch->chunks);
+	mem_free(fetch);
+}
+
+static void
+peer_fetch_finish(peer_fetch_t *fetch, bool success)
+{
+	if (success && rename(fetch->peer_file, fetch->file) < 0) {
+		WARN_ERRNO("Could not rename %s to %s", fetch->peer_file, fetch->file);
+		success = false;
+	}
+	if (!success && unlink(fetch->peer_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", fetch->peer_file);
+	if (unlink(fetch->index_file) < 0 && errno != ENOENT)
+		WARN_ERRNO("Could not remove %s", fetch->index_file);
+
+	fetch->cb(success, fetch->data);
+	peer_fetch_free(fetch);
+}
+
+static void
+peer_fetch_done(peer_fetch_t *fetch)
+{
+	if (--fetch->pending > 0)
+		return;
+
+	if (!fetch->failed) {
+		const delta_chunk_t *last = &fetch->chunks[fetch->chunks_count - 1];
+		INFO("Fetched %s from %zu peers, %" PRIu64 " of %" PRIu64
+		     " bytes from the update server",
+		     fetch->file, fetch->peers_count, fetch->fallback, last->offset + last->len);
+	}
+	peer_fetch_finish(fetch, !fetch->failed);
+}
+
+static void
+peer_cb_segment(download_t *dl, bool success, void *data);
+
+/*
+ * Starts a range request for count chunks from first on, either from the peer
+ * next in turn or from the update server.
+ */
+static int
+peer_segment_start(peer_fetch_t *fetch, size_t first, size_t count, bool origin)
+{
+	const delta_chunk_t *begin = &fetch->chunks[first];
+	const delta_chunk_t *end = &fetch->chunks[first + count - 1];
+	char *url = NULL;
+	if (origin) {
+		url = mem_strdup(fetch->url);
+		fetch->fallback += end->offset + end->len - begin->offset;
+	} else {
+		struct in_addr addr = fetch->peers[fetch->next_peer++ % fetch->peers_count];
+		url = mem_printf("http://%s:%u/sha256/%s", inet_ntoa(addr), peer_port,
+				 fetch->sha256);
+	}
+
+	peer_segment_t *seg = mem_new0(peer_segment_t, 1);
+	seg->fetch = fetch;
+	seg->first = first;
+	seg->count = count;
+	seg->origin = origin;
+
+	download_t *dl = download_new(url, fetch->peer_file, peer_cb_segment, seg);
+	mem_free(url);
+	download_set_range(dl, begin->offset, end->offset + end->len - begin->offset);
+	if (download_start(dl) < 0) {
+		ERROR("Failed to start download for %s", download_get_url(dl));
+		download_free(dl);
+		mem_free(seg);
+		return -1;
+	}
+	fetch->pending++;
+	return 0;
+}
+
+static bool
+peer_chunk_is_good(int fd, const delta_chunk_t *c, uint8_t *buf)
+{
+	char *sha256 = NULL;
+	bool good = false;
+
+	hash_stream_t *hs = hash_stream_new(HASH_SHA256);
+	IF_NULL_RETVAL(hs, false);
+	if (pread(fd, buf, c->len, c->offset) == (ssize_t)c->len &&
+	    !hash_stream_update(hs, buf, c->len) && !hash_stream_final(hs, NULL, &sha256))
+		good = !strcmp(sha256, c->sha256);
+
+	mem_free(sha256);
+	hash_stream_free(hs);
+	return good;
+}
+
+/*
+ * Checks the chunks of a segment received from a peer against the chunk
+ * index. Runs of bad chunks are fetched from the update server.
+ */
+static void
+peer_segment_verify(peer_segment_t *seg)
+{
+	peer_fetch_t *fetch = seg->fetch;
+	size_t end = seg->first + seg->count;
+
+	int fd = open(fetch->peer_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		WARN_ERRNO("Could not open %s", fetch->peer_file);
+	uint8_t *buf = mem_alloc(CHUNK_SIZE_MAX);
+
+	for (size_t i = seg->first; i < end; i++) {
+		if (fd >= 0 && peer_chunk_is_good(fd, &fetch->chunks[i], buf))
+			continue;
+
+		size_t j = i + 1;
+		while (j < end && !(fd >= 0 && peer_chunk_is_good(fd, &fetch->chunks[j], buf)))
+			j++;
+		WARN("%zu chunks of %s from a peer are corrupt, fetching them from the update"
+		     " server",
+		     j - i, fetch->file);
+		if (peer_segment_start(fetch, i, j - i, true) < 0)
+			fetch->failed = true;
+		// chunk j, if any, is good
+		i = j;
+	}
+
+	mem_free(buf);
+	if (fd >= 0)
+		close(fd);
+}
+
+static void
+peer_cb_segment(download_t *dl, bool success, void *data)
+{
+	peer_segment_t *seg = data;
+	ASSERT(seg);
+	peer_fetch_t *fetch = seg->fetch;
+
+	if (seg->origin) {
+		if (!success) {
+			WARN("Download of a range of %s failed", download_get_url(dl));
+			fetch->failed = true;
+		}
+	} else if (!success) {
+		DEBUG("Peer %s failed, fetching its range from the update server",
+		      download_get_url(dl));
+		if (peer_segment_start(fetch, seg->first, seg->count, true) < 0)
+			fetch->failed = true;
+	} else if (!fetch->failed) {
+		peer_segment_verify(seg);
+	}
+
+	download_free(dl);
+	mem_free(seg);
+	peer_fetch_done(fetch);
+}
+
+static void
+peer_cb_index(download_t *dl, bool success, void *data)
+{
+	peer_fetch_t *fetch = data;
+	ASSERT(fetch);
+
+	download_free(dl);
+	if (!success) {
+		DEBUG("No chunk index available for %s", fetch->url);
+		peer_fetch_finish(fetch, false);
+		return;
+	}
+
+	fetch->chunks = delta_index_parse(fetch->index_file, fetch->index_sha256,
+					  &fetch->chunks_count);
+	if (!fetch->chunks) {
+		peer_fetch_finish(fetch, false);
+		return;
+	}
+
+	const delta_chunk_t *last = &fetch->chunks[fetch->chunks_count - 1];
+	int fd = open(fetch->peer_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || ftruncate(fd, last->offset + last->len) < 0) {
+		WARN_ERRNO("Could not create %s", fetch->peer_file);
+		if (fd >= 0)
+			close(fd);
+		peer_fetch_finish(fetch, false);
+		return;
+	}
+	close(fd);
+
+	// hold a reference while starting the downloads
+	fetch->pending = 1;
+	for (size_t first = 0, i = 0; i < fetch->chunks_count; i++) {
+		const delta_chunk_t *c = &fetch->chunks[i];
+		if (c->offset + c->len - fetch->chunks[first].offset < PEER_SEGMENT_SIZE &&
+		    i + 1 < fetch->chunks_count)
+			continue;
+		if (peer_segment_start(fetch, first, i + 1 - first, false) < 0) {
+			fetch->failed = true;
+			break;
+		}
+		first = i + 1;
+	}
+	peer_fetch_done(fetch);
+}
+
+static void
+peer_cb_query_timeout(event_timer_t *timer, void *data)
+{
+	peer_fetch_t *fetch = data;
+	ASSERT(fetch);
+
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	fetch->timer = NULL;
+	peer_queries = list_remove(peer_queries, fetch);
+
+	if (!fetch->peers_count) {
+		DEBUG("No peer has %s", fetch->file);
+		peer_fetch_finish(fetch, false);
+		return;
+	}
+
+	DEBUG("Fetching %s from %zu peers", fetch->file, fetch->peers_count);
+	char *index_url = mem_printf("%s" DELTA_INDEX_SUFFIX, fetch->url);
+	download_t *dl = download_new(index_url, fetch->index_file, peer_cb_index, fetch);
+	mem_free(index_url);
+	if (download_start(dl) < 0) {
+		download_free(dl);
+		peer_fetch_finish(fetch, false);
+	}
+}
+
+static void
+peer_add(const char *sha256, struct in_addr addr)
+{
+	for (list_t *l = peer_queries; l; l = l->next) {
+		peer_fetch_t *fetch = l->data;
+		if (strcasecmp(fetch->sha256, sha256) || fetch->peers_count >= PEER_MAX)
+			continue;
+
+		bool known = false;
+		for (size_t i = 0; i < fetch->peers_count; i++)
+			known |= fetch->peers[i].s_addr == addr.s_addr;
+		if (known)
+			continue;
+
+		TRACE("Peer %s has %s", inet_ntoa(addr), fetch->file);
+		fetch->peers[fetch->peers_count++] = addr;
+	}
+}
+
+int
+peer_fetch(const char *url, const char *file, const char *sha256, const char *index_sha256,
+	   peer_callback_t cb, void *data)
+{
+	ASSERT(url);
+	ASSERT(file);
+	ASSERT(sha256);
+	ASSERT(cb);
+
+	IF_TRUE_RETVAL(peer_udp_sock < 0 || !index_sha256 || strlen(sha256) != 64, -1);
+
+	char msg[PEER_MSG_MAX];
+	int len = snprintf(msg, sizeof(msg), PEER_MAGIC " Q %s", sha256);
+	struct sockaddr_in sa = { .sin_family = AF_INET,
+				  .sin_port = htons(peer_port),
+				  .sin_addr.s_addr = htonl(INADDR_BROADCAST) };
+	if (sendto(peer_udp_sock, msg, len, MSG_DONTWAIT, (struct sockaddr *)&sa, sizeof(sa)) <
+	    0) {
+		DEBUG_ERRNO("Could not query peers for %s", file);
+		return -1;
+	}
+
+	peer_fetch_t *fetch = mem_new0(peer_fetch_t, 1);
+	fetch->url = mem_strdup(url);
+	fetch->file = mem_strdup(file);
+	fetch->sha256 = mem_strdup(sha256);
+	fetch->index_sha256 = mem_strdup(index_sha256);
+	fetch->index_file = mem_printf("%s" PEER_FILE_SUFFIX DELTA_INDEX_SUFFIX, file);
+	fetch->peer_file = mem_printf("%s" PEER_FILE_SUFFIX, file);
+	fetch->cb = cb;
+	fetch->data = data;
+
+	fetch->timer = event_timer_new(PEER_QUERY_TIMEOUT_MS, 1, &peer_cb_query_timeout, fetch);
+	event_add_timer(fetch->timer);
+	peer_queries = list_append(peer_queries, fetch);
+	return 0;
+}
+
+/******************************************************************************/
+/* serving peers */
+
+static char *
+peer_image_path_new(const char *sha256)
+{
+	for (size_t i = 0; i < guestos_mgr_get_guestos_count(); i++) {
+		const guestos_t *os = guestos_mgr_get_guestos_by_index(i);
+		char *path = guestos_get_verified_image_path_new(os, sha256);
+		if (path)
+			return path;
+	}
+	return NULL;
+}
+
+static void
+peer_cb_recv(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	char msg[PEER_MSG_MAX];
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+
+	if (events & EVENT_IO_EXCEPT) {
+		WARN("Exception on peer discovery socket");
+		return;
+	}
+
+	ssize_t len = recvfrom(fd, msg, sizeof(msg) - 1, MSG_TRUNC | MSG_DONTWAIT,
+			       (struct sockaddr *)&sa, &sa_len);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			WARN_ERRNO("Could not receive on peer discovery socket");
+		return;
+	}
+	IF_TRUE_RETURN((size_t)len >= sizeof(msg) || sa.sin_family != AF_INET);
+	msg[len] = '\0';
+
+	char type;
+	char sha256[65];
+	if (sscanf(msg, PEER_MAGIC " %c %64[0-9a-fA-F]", &type, sha256) != 2 ||
+	    strlen(sha256) != 64)
+		return;
+
+	if (type == 'H') {
+		peer_add(sha256, sa.sin_addr);
+		return;
+	}
+	IF_TRUE_RETURN(type != 'Q');
+
+	char *path = peer_image_path_new(sha256);
+	IF_NULL_RETURN(path);
+	mem_free(path);
+
+	len = snprintf(msg, sizeof(msg), PEER_MAGIC " H %s", sha256);
+	if (sendto(fd, msg, len, MSG_DONTWAIT, (struct sockaddr *)&sa, sa_len) < 0)
+		DEBUG_ERRNO("Could not answer peer %s", inet_ntoa(sa.sin_addr));
+}
+
+static void
+peer_conn_free(peer_conn_t *conn)
+{
+	peer_conns = list_remove(peer_conns, conn);
+
+	if (conn->event) {
+		event_remove_io(conn->event);
+		event_io_free(conn->event);
+	}
+	if (conn->timer) {
+		event_remove_timer(conn->timer);
+		event_timer_free(conn->timer);
+	}
+	if (conn->file_fd >= 0)
+		close(conn->file_fd);
+	close(conn->fd);
+	mem_free(conn->resp);
+	mem_free(conn);
+}
+
+static void
+peer_conn_cb_timeout(UNUSED event_timer_t *timer, void *data)
+{
+	peer_conn_t *conn = data;
+
+	DEBUG("Closing stalled peer connection");
+	peer_conn_free(conn);
+}
+
+/*
+ * Restarts the idle timeout of the connection, called whenever data moved.
+ */
+static void
+peer_conn_touch(peer_conn_t *conn)
+{
+	if (conn->timer) {
+		event_remove_timer(conn->timer);
+		event_timer_free(conn->timer);
+	}
+	conn->timer = event_timer_new(PEER_CONN_TIMEOUT_MS, 1, peer_conn_cb_timeout, conn);
+	event_add_timer(conn->timer);
+}
+
+static void
+peer_conn_cb_write(int fd, UNUSED unsigned events, UNUSED event_io_t *io, void *data)
+{
+	peer_conn_t *conn = data;
+	bool progress = false;
+
+	while (conn->resp_sent < conn->resp_len) {
+		ssize_t n = send(fd, conn->resp + conn->resp_sent, conn->resp_len - conn->resp_sent,
+				 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			IF_TRUE_GOTO(errno == EAGAIN || errno == EINTR, blocked);
+			goto close;
+		}
+		conn->resp_sent += n;
+		progress = true;
+	}
+
+	while (conn->remaining > 0) {
+		size_t len = MIN(conn->remaining, (uint64_t)PEER_SEND_SIZE);
+		ssize_t n = sendfile(fd, conn->file_fd, &conn->pos, len);
+		if (n < 0) {
+			IF_TRUE_GOTO(errno == EAGAIN || errno == EINTR, blocked);
+			DEBUG_ERRNO("Could not send image to peer");
+			goto close;
+		}
+		if (n == 0) {
+			WARN("Image served to peer was truncated");
+			goto close;
+		}
+		conn->remaining -= n;
+		progress = true;
+	}
+	goto close;
+
+blocked:
+	if (progress)
+		peer_conn_touch(conn);
+	return;
+
+close:
+	// one request per connection
+	peer_conn_free(conn);
+}
+
+/*
+ * Prepares the response to the complete request in conn->req.
+ */
+static void
+peer_conn_respond(peer_conn_t *conn)
+{
+	char sha256[65];
+	char *path = NULL;
+	struct stat st;
+	uint64_t size = 0, start = 0, end = 0;
+	bool ranged = false;
+	int status = 400;
+
+	conn->req[conn->req_len] = '\0';
+	if (sscanf(conn->req, "GET /sha256/%64[0-9a-fA-F] HTTP/1.", sha256) != 1 ||
+	    strlen(sha256) != 64)
+		goto out;
+
+	const char *range = strcasestr(conn->req, "\r\nRange:");
+	if (range) {
+		range += strlen("\r\nRange:");
+		int n = sscanf(range, " bytes=%" SCNu64 "-%" SCNu64, &start, &end);
+		IF_TRUE_GOTO(n < 1, out);
+		ranged = true;
+		if (n == 1)
+			end = UINT64_MAX;
+	}
+
+	status = 404;
+	IF_NULL_GOTO(path = peer_image_path_new(sha256), out);
+	conn->file_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (conn->file_fd < 0 || fstat(conn->file_fd, &st) < 0) {
+		WARN_ERRNO("Could not open %s for peer", path);
+		goto out;
+	}
+	size = st.st_size;
+
+	if (!ranged) {
+		status = 200;
+		conn->remaining = size;
+	} else if (start >= size || end < start) {
+		status = 416;
+	} else {
+		status = 206;
+		end = MIN(end, size - 1);
+		conn->pos = start;
+		conn->remaining = end - start + 1;
+	}
+	DEBUG("Serving %s to peer (status %d, %" PRIu64 " bytes)", path, status, conn->remaining);
+
+out:
+	mem_free(path);
+	if (status == 206)
+		conn->resp = mem_printf("HTTP/1.1 206 Partial Content\r\n"
+					"Content-Range: bytes %" PRIu64 "-%" PRIu64
+					"/%" PRIu64 "\r\n"
+					"Content-Length: %" PRIu64 "\r\n"
+					"Connection: close\r\n\r\n",
+					start, end, size, conn->remaining);
+	else if (status == 200)
+		conn->resp = mem_printf("HTTP/1.1 200 OK\r\n"
+					"Content-Length: %" PRIu64 "\r\n"
+					"Connection: close\r\n\r\n",
+					conn->remaining);
+	else if (status == 416)
+		conn->resp = mem_printf("HTTP/1.1 416 Range Not Satisfiable\r\n"
+					"Content-Range: bytes */%" PRIu64 "\r\n"
+					"Content-Length: 0\r\n"
+					"Connection: close\r\n\r\n",
+					size);
+	else
+		conn->resp = mem_printf("HTTP/1.1 %s\r\n"
+					"Content-Length: 0\r\n"
+					"Connection: close\r\n\r\n",
+					status == 404 ? "404 Not Found" : "400 Bad Request");
+	conn->resp_len = strlen(conn->resp);
+}
+
+static void
+peer_conn_cb_read(int fd, unsigned events, UNUSED event_io_t *io, void *data)
+{
+	peer_conn_t *conn = data;
+
+	if (events & EVENT_IO_EXCEPT) {
+		peer_conn_free(conn);
+		return;
+	}
+
+	ssize_t n = recv(fd, conn->req + conn->req_len, sizeof(conn->req) - 1 - conn->req_len,
+			 MSG_DONTWAIT);
+	if (n < 0) {
+		IF_TRUE_RETURN(errno == EAGAIN || errno == EINTR);
+		peer_conn_free(conn);
+		return;
+	}
+	conn->req_len += n;
+	conn->req[conn->req_len] = '\0';
+	if (n > 0)
+		peer_conn_touch(conn);
+
+	if (!strstr(conn->req, "\r\n\r\n")) {
+		if (n == 0 || conn->req_len == sizeof(conn->req) - 1)
+			peer_conn_free(conn);
+		return;
+	}
+
+	peer_conn_respond(conn);
+	event_remove_io(conn->event);
+	event_io_free(conn->event);
+	conn->event = event_io_new(fd, EVENT_IO_WRITE, peer_conn_cb_write, conn);
+	event_add_io(conn->event);
+}
+
+static void
+peer_cb_accept(int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+
+	int sock = accept4(fd, (struct sockaddr *)&sa, &sa_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sock < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			WARN_ERRNO("Could not accept peer connection");
+		return;
+	}
+	if (list_length(peer_conns) >= PEER_CONNS_MAX) {
+		DEBUG("Too many peer connections, rejecting %s", inet_ntoa(sa.sin_addr));
+		close(sock);
+		return;
+	}
+
+	peer_conn_t *conn = mem_new0(peer_conn_t, 1);
+	conn->fd = sock;
+	conn->file_fd = -1;
+	conn->event = event_io_new(sock, EVENT_IO_READ, peer_conn_cb_read, conn);
+	event_add_io(conn->event);
+	peer_conn_touch(conn);
+	peer_conns = list_append(peer_conns, conn);
+}
+
+static int
+peer_socket_new(int type, uint16_t port)
+{
+	int sock = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		ERROR_ERRNO("Could not create peer socket");
+		return -1;
+	}
+
+	int one = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+	    (type == SOCK_DGRAM &&
+	     setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)) < 0)) {
+		ERROR_ERRNO("Could not set options of peer socket");
+		goto err;
+	}
+
+	struct sockaddr_in sa = { .sin_family = AF_INET,
+				  .sin_port = htons(port),
+				  .sin_addr.s_addr = htonl(INADDR_ANY) };
+	if (bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		ERROR_ERRNO("Could not bind peer socket to port %u", port);
+		goto err;
+	}
+	if (type == SOCK_STREAM && listen(sock, PEER_CONNS_MAX) < 0) {
+		ERROR_ERRNO("Could not listen on peer socket");
+		goto err;
+	}
+	return sock;
+err:
+	close(sock);
+	return -1;
+}
+
+int
+peer_init(uint16_t port)
+{
+	IF_TRUE_RETVAL(peer_udp_sock >= 0, 0);
+
+	peer_udp_sock = peer_socket_new(SOCK_DGRAM, port);
+	IF_TRUE_RETVAL(peer_udp_sock < 0, -1);
+	peer_tcp_sock = peer_socket_new(SOCK_STREAM, port);
+	if (peer_tcp_sock < 0) {
+		close(peer_udp_sock);
+		peer_udp_sock = -1;
+		return -1;
+	}
+	peer_port = port;
+
+	peer_udp_event = event_io_new(peer_udp_sock, EVENT_IO_READ, peer_cb_recv, NULL);
+	event_add_io(peer_udp_event);
+	peer_tcp_event = event_io_new(peer_tcp_sock, EVENT_IO_READ, peer_cb_accept, NULL);
+	event_add_io(peer_tcp_event);
+
+	INFO("Peer cache listening on port %u", port);
+	return 0;
+}
+
+void
+peer_cleanup(void)
+{
+	while (peer_queries) {
+		peer_fetch_t *fetch = peer_queries->data;
+		peer_queries = list_unlink(peer_queries, peer_queries);
+		peer_fetch_finish(fetch, false);
+	}
+	while (peer_conns)
+		peer_conn_free(peer_conns->data);
+
+	if (peer_udp_event) {
+		event_remove_io(peer_udp_event);
+		event_io_free(peer_udp_event);
+		peer_udp_event = NULL;
+	}
+	if (peer_tcp_event) {
+		event_remove_io(peer_tcp_event);
+		event_io_free(peer_tcp_event);
+		peer_tcp_event = NULL;
+	}
+	if (peer_udp_sock >= 0) {
+		close(peer_udp_sock);
+		peer_udp_sock = -1;
+	}
+	if (peer_tcp_sock >= 0) {
+		close(peer_tcp_sock);
+		peer_tcp_sock = -1;
+	}
+}
+
+bool
+peer_is_enabled(void)
+{
+	return peer_udp_sock >= 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+/**
+ * @file peer.h
+ *
+ * Peer cache of GuestOS images in the local network. Devices with the peer
+ * cache enabled answer discovery queries for the images they hold verified,
+ * see guestos_get_verified_image_path_new(), and serve them by a minimal http
+ * server supporting range requests. A device fetching a new image broadcasts a
+ * query for its sha256, fetches the chunk index (see delta.h) of the image
+ * from the update server and downloads the chunks from all peers which
+ * answered in parallel, each peer serving other ranges of the image.
+ *
+ * Peers are not trusted: each chunk is verified against its digest from the
+ * chunk index, which is in turn verified against the digest from the signed
+ * GuestOS config. Ranges a peer fails to provide and chunks not matching their
+ * digests are fetched from the update server instead. The image is assembled
+ * in <file>.peer and only renamed to file when all chunks are complete; like
+ * for delta updates, the complete image is verified by the caller.
+ *
+ * Discovery uses udp datagrams on the configured port, the http server
+ * listens on the same tcp port:
+ *   query:  "CMLPEER1 Q <sha256>", broadcast to the local network
+ *   answer: "CMLPEER1 H <sha256>", sent back to the querying device
+ */
+
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// answers arriving later are ignored
+#define PEER_QUERY_TIMEOUT_MS 300
+
+/**
+ * Starts to answer queries and to serve verified images on port, which has to
+ * be the same on all devices sharing images.
+ * @return 0 on success, -1 otherwise
+ */
+int
+peer_init(uint16_t port);
+
+/**
+ * Stops serving images. Fetches waiting for answers fail.
+ */
+void
+peer_cleanup(void);
+
+/**
+ * Checks whether images may be fetched from peers.
+ */
+bool
+peer_is_enabled(void);
+
+/**
+ * Callback type for functions called after fetching from peers has been completed/aborted.
+ */
+typedef void (*peer_callback_t)(bool success, void *data);
+
+/**
+ * Starts to fetch the image with the given sha256 from peers. If no peer
+ * answers the query or the chunk index is not available, the callback reports
+ * an error and the caller should fall back to a download from the update server.
+ * @param url the URL of the image on the update server
+ * @param file the file to assemble the image in
+ * @param sha256 the digest of the image as listed in the signed GuestOS config
+ * @param index_sha256 the expected sha256 of the chunk index
+ * @param cb the callback to call after the image is complete or fetching failed
+ * @param data custom parameter passed to the callback
+ * @return 0 if fetching has been started, -1 otherwise
+ */
+int
+peer_fetch(const char *url, const char *file, const char *sha256, const char *index_sha256,
+	   peer_callback_t cb, void *data);
+
+#endif /* PEER_H */
@@ -0,0 +1,409 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "placement.h"
+
+#include "cmld.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
+#include "common/dir.h"
+#include "common/str.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLACEMENT_SYSFS_CPU "/sys/devices/system/cpu"
+#define PLACEMENT_SYSFS_NODE "/sys/devices/system/node"
+
+/* capacity of all cpus on systems without cpu_capacity, i.e. without big.LITTLE */
+#define PLACEMENT_CAPACITY_DEFAULT 1024
+
+#define PLACEMENT_CPULIST_MAXLEN 4096
+
+typedef struct {
+	int cpu;
+	unsigned int capacity;
+	int node;
+	int llc; /* lowest cpu sharing the last level cache */
+} placement_cpu_t;
+
+typedef struct {
+	container_t *container;
+	unsigned int weight;
+	int index; /* in the cmld container list, keeps the order stable */
+	bool foreground;
+} placement_candidate_t;
+
+/* last state of a container seen by its observer */
+typedef struct {
+	bool active;
+	bool foreground;
+} placement_watch_t;
+
+static bool placement_enabled = false;
+
+/* all online cpus, ordered by capacity, node and last level cache */
+static placement_cpu_t *placement_cpus = NULL;
+static int placement_cpus_len = 0;
+
+static int
+placement_cpulist_parse(const char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	IF_NULL_RETVAL(list, -1);
+
+	char *list_cp = mem_strdup(list);
+	char *saveptr = NULL;
+	int ret = 0;
+
+	for (char *tok = strtok_r(list_cp, ",\n", &saveptr); tok;
+	     tok = strtok_r(NULL, ",\n", &saveptr)) {
+		char *end;
+		long first = strtol(tok, &end, 10);
+		long last = (*end == '-') ? strtol(end + 1, &end, 10) : first;
+		if ((*end && *end != ' ') || first < 0 || last < first || last >= CPU_SETSIZE) {
+			ERROR("Invalid cpu list '%s'", list);
+			ret = -1;
+			break;
+		}
+		for (long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+	}
+
+	mem_free(list_cp);
+	return ret;
+}
+
+static char *
+placement_cpulist_new(const cpu_set_t *set)
+{
+	str_t *list = str_new(NULL);
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, set))
+			continue;
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+			last++;
+		str_append_printf(list, "%s%d", str_length(list) ? "," : "", cpu);
+		if (last > cpu)
+			str_append_printf(list, "-%d", last);
+		cpu = last;
+	}
+
+	return str_free(list, false);
+}
+
+static int
+placement_read_cpulist(const char *path, cpu_set_t *set)
+{
+	char *list = file_read_new(path, PLACEMENT_CPULIST_MAXLEN);
+	int ret = placement_cpulist_parse(list, set);
+	mem_free(list);
+	return ret;
+}
+
+static int
+placement_node_foreach_cb(const char *path, const char *name, UNUSED void *data)
+{
+	int node;
+	IF_TRUE_RETVAL(sscanf(name, "node%d", &node) != 1, 0);
+
+	char *cpulist_path = mem_printf("%s/%s/cpulist", path, name);
+	cpu_set_t cpus;
+	if (placement_read_cpulist(cpulist_path, &cpus) == 0) {
+		for (int i = 0; i < placement_cpus_len; i++)
+			if (CPU_ISSET(placement_cpus[i].cpu, &cpus))
+				placement_cpus[i].node = node;
+	}
+	mem_free(cpulist_path);
+	return 0;
+}
+
+static void
+placement_read_cpu(placement_cpu_t *cpu)
+{
+	char *capacity_path = mem_printf("%s/cpu%d/cpu_capacity", PLACEMENT_SYSFS_CPU, cpu->cpu);
+	char *capacity = file_read_new(capacity_path, 16);
+	cpu->capacity = capacity ? strtoul(capacity, NULL, 10) : PLACEMENT_CAPACITY_DEFAULT;
+	mem_free(capacity);
+	mem_free(capacity_path);
+
+	/* the cache with the highest index is the last level cache */
+	cpu->llc = cpu->cpu;
+	for (int index = 0;; index++) {
+		char *shared_path = mem_printf("%s/cpu%d/cache/index%d/shared_cpu_list",
+					       PLACEMENT_SYSFS_CPU, cpu->cpu, index);
+		bool exists = file_exists(shared_path);
+		cpu_set_t shared;
+		if (exists && placement_read_cpulist(shared_path, &shared) == 0) {
+			for (int i = 0; i < CPU_SETSIZE; i++) {
+				if (CPU_ISSET(i, &shared)) {
+					cpu->llc = i;
+					break;
+				}
+			}
+		}
+		mem_free(shared_path);
+		if (!exists)
+			break;
+	}
+}
+
+static int
+placement_cpu_compare(const void *a, const void *b)
+{
+	const placement_cpu_t *cpu_a = a;
+	const placement_cpu_t *cpu_b = b;
+
+	if (cpu_a->capacity != cpu_b->capacity)
+		return cpu_a->capacity > cpu_b->capacity ? -1 : 1;
+	if (cpu_a->node != cpu_b->node)
+		return cpu_a->node - cpu_b->node;
+	if (cpu_a->llc != cpu_b->llc)
+		return cpu_a->llc - cpu_b->llc;
+	return cpu_a->cpu - cpu_b->cpu;
+}
+
+static int
+placement_candidate_compare(const void *a, const void *b)
+{
+	const placement_candidate_t *cand_a = a;
+	const placement_candidate_t *cand_b = b;
+
+	if (cand_a->foreground != cand_b->foreground)
+		return cand_a->foreground ? -1 : 1;
+	if (cand_a->weight != cand_b->weight)
+		return cand_a->weight > cand_b->weight ? -1 : 1;
+	return cand_a->index - cand_b->index;
+}
+
+static bool
+placement_is_active(container_state_t state)
+{
+	return state != CONTAINER_STATE_STOPPED && state != CONTAINER_STATE_ZOMBIE &&
+	       state != CONTAINER_STATE_REBOOTING && state != CONTAINER_STATE_CHECKPOINTED;
+}
+
+static void
+placement_apply(container_t *container, const placement_cpu_t **cpus, int len)
+{
+	cpu_set_t cpu_set, node_set;
+	CPU_ZERO(&cpu_set);
+	CPU_ZERO(&node_set);
+
+	for (int i = 0; i < len; i++) {
+		CPU_SET(cpus[i]->cpu, &cpu_set);
+		CPU_SET(cpus[i]->node, &node_set);
+	}
+
+	char *cpu_list = placement_cpulist_new(&cpu_set);
+	char *node_list = placement_cpulist_new(&node_set);
+
+	DEBUG("Placing container %s on cpus %s, memory nodes %s",
+	      container_get_description(container), cpu_list, node_list);
+	if (container_set_cpuset(container, cpu_list, node_list) < 0)
+		WARN("Could not move container %s to cpus %s",
+		     container_get_description(container), cpu_list);
+
+	mem_free(cpu_list);
+	mem_free(node_list);
+}
+
+/*
+ * Splits cpus among the candidates in proportion to their weights, each gets at
+ * least one cpu. Shares are contiguous in the topology order and thus stay within
+ * a cache domain or node if possible. If there are more candidates than cpus,
+ * the remaining ones share all of them.
+ */
+static void
+placement_split(placement_candidate_t *cands, int cands_len, const placement_cpu_t **cpus, int len)
+{
+	IF_TRUE_RETURN(cands_len <= 0);
+
+	if (cands_len > len) {
+		WARN("%d containers for %d cpus, containers will share cpus", cands_len, len);
+		for (int i = 0; i < len; i++)
+			placement_apply(cands[i].container, &cpus[i], 1);
+		for (int i = len; i < cands_len; i++)
+			placement_apply(cands[i].container, cpus, len);
+		return;
+	}
+
+	unsigned int weights = 0;
+	for (int i = 0; i < cands_len; i++)
+		weights += cands[i].weight;
+
+	int spare = len - cands_len;
+	int pos = 0;
+	for (int i = 0; i < cands_len; i++) {
+		/* the last candidate gets the rounding remainder */
+		int share = (i == cands_len - 1) ?
+				    len - pos :
+				    1 + (int)((unsigned long)spare * cands[i].weight / weights);
+		placement_apply(cands[i].container, &cpus[pos], share);
+		pos += share;
+	}
+}
+
+void
+placement_rebalance(void)
+{
+	IF_FALSE_RETURN(placement_enabled);
+
+	int count = cmld_containers_get_count();
+	placement_candidate_t *cands = mem_new0(placement_candidate_t, count);
+	int cands_len = 0;
+
+	/* statically assigned cpus are not available for placement */
+	cpu_set_t reserved;
+	CPU_ZERO(&reserved);
+
+	for (int i = 0; i < count; i++) {
+		container_t *container = cmld_container_get_by_index(i);
+		bool active = placement_is_active(container_get_state(container));
+		const char *cpus_allowed = container_get_cpus_allowed(container);
+
+		if (cpus_allowed) {
+			cpu_set_t cpus;
+			if (active && placement_cpulist_parse(cpus_allowed, &cpus) == 0)
+				CPU_OR(&reserved, &reserved, &cpus);
+		} else if (active) {
+			cands[cands_len].container = container;
+			cands[cands_len].weight = container_get_cpu_priority(container) + 1;
+			cands[cands_len].index = i;
+			cands[cands_len].foreground = container_is_screen_on(container);
+			cands_len++;
+		} else {
+			container_set_cpuset(container, NULL, NULL);
+		}
+	}
+	qsort(cands, cands_len, sizeof(placement_candidate_t), placement_candidate_compare);
+
+	const placement_cpu_t **cpus = mem_new0(const placement_cpu_t *, placement_cpus_len);
+	int len = 0;
+	for (int i = 0; i < placement_cpus_len; i++)
+		if (!CPU_ISSET(placement_cpus[i].cpu, &reserved))
+			cpus[len++] = &placement_cpus[i];
+
+	if (len == 0) {
+		WARN("All cpus are statically assigned, not placing containers");
+		for (int i = 0; i < cands_len; i++)
+			container_set_cpuset(cands[i].container, NULL, NULL);
+		goto out;
+	}
+
+	/* on big.LITTLE systems, the foreground container gets the big cores */
+	int big = 1;
+	while (big < len && cpus[big]->capacity == cpus[0]->capacity)
+		big++;
+	if (cands_len > 1 && cands[0].foreground && big < len) {
+		placement_apply(cands[0].container, cpus, big);
+		placement_split(&cands[1], cands_len - 1, &cpus[big], len - big);
+	} else {
+		if (cands_len > 0 && cands[0].foreground)
+			cands[0].weight *= 2;
+		placement_split(cands, cands_len, cpus, len);
+	}
+
+out:
+	mem_free(cpus);
+	mem_free(cands);
+}
+
+static void
+placement_container_cb(container_t *container, container_callback_t *cb, void *data)
+{
+	placement_watch_t *watch = data;
+	ASSERT(watch);
+
+	container_state_t state = container_get_state(container);
+	bool active = placement_is_active(state);
+	bool foreground = container_is_screen_on(container);
+
+	if (active != watch->active || foreground != watch->foreground) {
+		watch->active = active;
+		watch->foreground = foreground;
+		placement_rebalance();
+	}
+
+	if (state == CONTAINER_STATE_STOPPED || state == CONTAINER_STATE_REBOOTING) {
+		container_unregister_observer(container, cb);
+		mem_free(watch);
+	}
+}
+
+void
+placement_register_container(container_t *container)
+{
+	ASSERT(container);
+	IF_FALSE_RETURN(placement_enabled);
+
+	placement_watch_t *watch = mem_new0(placement_watch_t, 1);
+	if (!container_register_observer(container, &placement_container_cb, watch)) {
+		WARN("Could not register placement observer for %s",
+		     container_get_description(container));
+		mem_free(watch);
+	}
+}
+
+int
+placement_init(bool enable)
+{
+	if (!enable) {
+		INFO("Cpu placement disabled");
+		return 0;
+	}
+
+	cpu_set_t online;
+	IF_TRUE_RETVAL(placement_read_cpulist(PLACEMENT_SYSFS_CPU "/online", &online) < 0, -1);
+
+	placement_cpus_len = CPU_COUNT(&online);
+	placement_cpus = mem_new0(placement_cpu_t, placement_cpus_len);
+	for (int cpu = 0, i = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &online))
+			continue;
+		placement_cpus[i].cpu = cpu;
+		placement_read_cpu(&placement_cpus[i]);
+		i++;
+	}
+
+	/* systems without NUMA have all cpus on node 0 */
+	if (file_is_dir(PLACEMENT_SYSFS_NODE))
+		dir_foreach(PLACEMENT_SYSFS_NODE, &placement_node_foreach_cb, NULL);
+
+	qsort(placement_cpus, placement_cpus_len, sizeof(placement_cpu_t), placement_cpu_compare);
+
+	for (int i = 0; i < placement_cpus_len; i++)
+		DEBUG("cpu%d: capacity %u, node %d, llc %d", placement_cpus[i].cpu,
+		      placement_cpus[i].capacity, placement_cpus[i].node, placement_cpus[i].llc);
+
+	placement_enabled = true;
+	INFO("Cpu placement enabled for %d cpus", placement_cpus_len);
+	return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file placement.h
+ *
+ * Places the running containers on disjoint sets of cpus and memory nodes
+ * according to the cpu topology. Cpus are ordered by their capacity (big
+ * before LITTLE cores), NUMA node and last level cache, so that the share of
+ * each container is as local as possible. The foreground container gets the
+ * cores with the highest capacity, the other containers share the remaining
+ * cpus weighted by their cpu_priority. Containers with statically assigned
+ * cpus are not placed, their cpus are excluded instead.
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "container.h"
+
+#include <stdbool.h>
+
+/**
+ * Reads the cpu topology and enables the placement if enable is set.
+ * @return 0 on success or if disabled, -1 if the topology could not be read
+ */
+int
+placement_init(bool enable);
+
+/**
+ * Lets the placement follow the state and the foreground of the container
+ * until it is stopped. To be called before the container is started.
+ */
+void
+placement_register_container(container_t *container);
+
+/**
+ * Recomputes the placement for all running containers and moves them
+ * accordingly.
+ */
+void
+placement_rebalance(void);
+
+#endif /* PLACEMENT_H */
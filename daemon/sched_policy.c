@@ -0,0 +1,131 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "sched_policy.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+
+/* cpu weight of the foreground container in percent of the default weight */
+#define SCHED_POLICY_FOREGROUND_WEIGHT 400
+
+/* last state of a container seen by its observer */
+typedef struct {
+	bool active;
+	bool foreground;
+} sched_policy_watch_t;
+
+static bool sched_policy_enabled = false;
+static unsigned int sched_policy_uclamp_min = 0;
+static unsigned int sched_policy_background_percent = 0;
+
+/*
+ * Returns true if the container is running and its cgroups are set up.
+ */
+static bool
+sched_policy_is_active(container_state_t state)
+{
+	return state == CONTAINER_STATE_BOOTING || state == CONTAINER_STATE_RUNNING ||
+	       state == CONTAINER_STATE_SETUP;
+}
+
+static void
+sched_policy_apply(container_t *container, bool foreground)
+{
+	int ret;
+
+	if (foreground)
+		ret = container_set_cpu_sched(container, SCHED_POLICY_FOREGROUND_WEIGHT,
+					      sched_policy_uclamp_min, 0);
+	else
+		ret = container_set_cpu_sched(container, 100, 0, sched_policy_background_percent);
+
+	if (ret < 0)
+		WARN("Could not apply %s scheduling policy to %s",
+		     foreground ? "foreground" : "background",
+		     container_get_description(container));
+	else
+		DEBUG("Applied %s scheduling policy to %s",
+		      foreground ? "foreground" : "background",
+		      container_get_description(container));
+}
+
+static void
+sched_policy_container_cb(container_t *container, container_callback_t *cb, void *data)
+{
+	sched_policy_watch_t *watch = data;
+	ASSERT(watch);
+
+	container_state_t state = container_get_state(container);
+	bool active = sched_policy_is_active(state);
+	bool foreground = container_is_screen_on(container);
+
+	/* the observers are notified synchronously on a switch of the foreground */
+	if (active && (!watch->active || foreground != watch->foreground))
+		sched_policy_apply(container, foreground);
+	watch->active = active;
+	watch->foreground = foreground;
+
+	if (state == CONTAINER_STATE_STOPPED || state == CONTAINER_STATE_REBOOTING) {
+		container_unregister_observer(container, cb);
+		mem_free(watch);
+	}
+}
+
+void
+sched_policy_register_container(container_t *container)
+{
+	ASSERT(container);
+	IF_FALSE_RETURN(sched_policy_enabled);
+
+	sched_policy_watch_t *watch = mem_new0(sched_policy_watch_t, 1);
+	if (!container_register_observer(container, &sched_policy_container_cb, watch)) {
+		WARN("Could not register scheduling policy observer for %s",
+		     container_get_description(container));
+		mem_free(watch);
+	}
+}
+
+void
+sched_policy_init(bool enable, unsigned int uclamp_min_percent, unsigned int background_percent)
+{
+	if (!enable) {
+		INFO("Foreground scheduling policy disabled");
+		return;
+	}
+
+	if (uclamp_min_percent > 100) {
+		WARN("Invalid uclamp.min %u%%, using 100%%", uclamp_min_percent);
+		uclamp_min_percent = 100;
+	}
+	if (background_percent > 100) {
+		WARN("Invalid background cpu limit %u%%, using no limit", background_percent);
+		background_percent = 0;
+	}
+
+	sched_policy_uclamp_min = uclamp_min_percent;
+	sched_policy_background_percent = background_percent;
+	sched_policy_enabled = true;
+	INFO("Foreground scheduling policy enabled (uclamp.min %u%%, background limit %u%%)",
+	     sched_policy_uclamp_min, sched_policy_background_percent);
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file sched_policy.h
+ *
+ * Foreground aware cpu scheduling. The container in the foreground gets a
+ * higher cpu weight and a minimum utilization clamp, so that its tasks are
+ * preferred and run on fast cores at a high frequency, while the containers in
+ * the background are limited to a share of the cpu bandwidth. The parameters
+ * follow a switch of the foreground right away. The policy complements the
+ * cpu placement, which moves the containers to disjoint cpus.
+ */
+
+#ifndef SCHED_POLICY_H
+#define SCHED_POLICY_H
+
+#include "container.h"
+
+#include <stdbool.h>
+
+/**
+ * Enables the policy for containers registered afterwards.
+ * @param uclamp_min_percent minimum utilization clamp of the foreground container
+ * @param background_percent cpu bandwidth of each background container in percent
+ *        of all online cpus, 0 for no limit
+ */
+void
+sched_policy_init(bool enable, unsigned int uclamp_min_percent, unsigned int background_percent);
+
+/**
+ * Lets the scheduling parameters of the container follow its state and
+ * foreground until it is stopped. To be called before the container is started.
+ */
+void
+sched_policy_register_container(container_t *container);
+
+#endif /* SCHED_POLICY_H */
@@ -30,19 +30,24 @@
 #include "scd_shared.h"
 
 #include "common/macro.h"
+#include "common/probe.h"
 #include "common/event.h"
 #include "common/logf.h"
 #include "common/fd.h"
 #include "common/file.h"
+#include "common/hashmap.h"
+#include "common/list.h"
 #include "common/sock.h"
 #include "common/mem.h"
 #include "common/protobuf.h"
 #include "common/proc.h"
+#include "common/str.h"
 
 #include <google/protobuf-c/protobuf-c-text.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 // clang-format off
@@ -58,6 +63,12 @@
 #define TOKEN_MAX_WRAPPED_KEY_LEN 4096
 
 #define MAX_PAIR_SEC_LEN 8
+
+// outstanding crypto requests on the shared connection to scd
+#define SMARTCARD_CRYPTO_INFLIGHT_MAX 32
+// time scd has to set up its control socket after it was started
+#define SMARTCARD_CONNECT_TIMEOUT_MS 5000
+
 #define PAIR_SEC_FILE_NAME "device_pairing_secret"
 
 //#undef LOGF_LOG_MIN_PRIO
@@ -67,6 +78,7 @@ struct smartcard {
 	int sock;
 	char *path;
 	pid_t scd_pid;
+	struct timespec started; /* start of scd for the connect timeout */
 };
 
 typedef struct smartcard_startdata {
@@ -86,13 +98,8 @@ bytes_to_string_new(unsigned char *data, size_t len)
 {
 	IF_NULL_RETVAL(data, NULL);
 	IF_TRUE_RETVAL(len == 0, NULL);
-	size_t len_chunk = MUL_WITH_OVERFLOW_CHECK(len, (size_t)2);
-	len_chunk = ADD_WITH_OVERFLOW_CHECK(len_chunk, 1);
 
-	char *str = mem_alloc(len_chunk);
-	for (size_t i = 0; i < len; i++)
-		snprintf(str + 2 * i, 3, "%02x", data[i]);
-	return str;
+	return str_hex_encode_new(data, len);
 }
 
 static TokenType
@@ -162,6 +169,7 @@ smartcard_send_recv_block(const DaemonToToken *out)
 {
 	ASSERT(out);
 
+	PROBE1(smartcard_send_recv_begin, out->code);
 	int sock = sock_unix_create_and_connect(SOCK_SEQPACKET, SCD_CONTROL_SOCKET);
 	if (sock < 0) {
 		ERROR_ERRNO("Failed to connect to scd control socket %s", SCD_CONTROL_SOCKET);
@@ -179,6 +187,7 @@ smartcard_send_recv_block(const DaemonToToken *out)
 	TokenToDaemon *msg = NULL;
 	msg = (TokenToDaemon *)protobuf_recv_message(sock, &token_to_daemon__descriptor);
 	close(sock);
+	PROBE2(smartcard_send_recv_end, out->code, msg ? msg->code : -1);
 	return msg;
 }
 
@@ -337,8 +346,11 @@ smartcard_cb_start_container(int fd, unsigned events, event_io_t *io, void *data
 			done = true;
 		} break;
 		case TOKEN_TO_DAEMON__CODE__UNLOCK_SUCCESSFUL: {
+			// scd may authenticate the PIN against its key cache instead of the token
 			audit_log_event(container_get_uuid(startdata->container), SSA, CMLD,
-					TOKEN_MGMT, "unlock-successful",
+					TOKEN_MGMT,
+					msg->key_cached ? "unlock-successful-cached" :
+							  "unlock-successful",
 					uuid_string(container_get_uuid(startdata->container)), 0);
 			char *keyfile =
 				mem_printf("%s/%s.key", startdata->smartcard->path,
@@ -471,7 +483,9 @@ smartcard_cb_start_container(int fd, unsigned events, event_io_t *io, void *data
 			}
 			// set the key
 			audit_log_event(container_get_uuid(startdata->container), SSA, CMLD,
-					TOKEN_MGMT, "unwrap-container-key",
+					TOKEN_MGMT,
+					msg->key_cached ? "unwrap-container-key-cached" :
+							  "unwrap-container-key",
 					uuid_string(container_get_uuid(startdata->container)), 0);
 			TRACE("Successfully retrieved unwrapped key from SCD");
 			char *ascii_key = bytes_to_string_new(msg->unwrapped_key.data,
@@ -699,7 +713,7 @@ smartcard_container_ctrl_handler(smartcard_t *smartcard, control_t *control, con
 
 	out.token_uuid = mem_strdup(uuid_string(container_get_uuid(startdata->container)));
 
-	if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
+	if (logf_enabled(LOGF_PRIO_TRACE)) {
 		char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)&out, NULL);
 		TRACE("Sending DaemonToToken message:\n%s", msg_text ? msg_text : "NULL");
 		if (msg_text)
@@ -1120,30 +1134,52 @@ smartcard_new(const char *path)
 
 	smartcard_t *smartcard = mem_alloc(sizeof(smartcard_t));
 	smartcard->path = mem_strdup(path);
+	smartcard->sock = -1;
 
-	// Start SCD and wait for control interface
+	// Start SCD, the control interface is connected by smartcard_connect()
 	smartcard->scd_pid = fork_and_exec_scd();
-	IF_TRUE_RETVAL_TRACE(smartcard->scd_pid == -1, NULL);
+	if (smartcard->scd_pid == -1 || clock_gettime(CLOCK_MONOTONIC, &smartcard->started) < 0) {
+		mem_free(smartcard->path);
+		mem_free(smartcard);
+		return NULL;
+	}
+
+	return smartcard;
+}
+
+int
+smartcard_connect(smartcard_t *smartcard)
+{
+	ASSERT(smartcard);
 
-	size_t retries = 0;
-	do {
-		usleep(500000);
-		smartcard->sock = sock_unix_create_and_connect(SOCK_SEQPACKET, SCD_CONTROL_SOCKET);
-		retries++;
-		TRACE("Retry %ld connecting to scd", retries);
-	} while (smartcard->sock < 0 && retries < 10);
+	IF_TRUE_RETVAL(smartcard->sock >= 0, 0);
 
+	smartcard->sock = sock_unix_create_and_connect(SOCK_SEQPACKET, SCD_CONTROL_SOCKET);
 	if (smartcard->sock < 0) {
-		mem_free(smartcard);
-		ERROR("Failed to connect to scd");
-		return NULL;
+		struct timespec now;
+		IF_TRUE_RETVAL_ERROR(clock_gettime(CLOCK_MONOTONIC, &now) < 0, -1);
+		long elapsed_ms = (now.tv_sec - smartcard->started.tv_sec) * 1000 +
+				  (now.tv_nsec - smartcard->started.tv_nsec) / 1000000;
+		if (elapsed_ms >= SMARTCARD_CONNECT_TIMEOUT_MS) {
+			ERROR("Failed to connect to scd");
+			return -1;
+		}
+		TRACE("scd control socket not yet available");
+		return 1;
 	}
 
 	// allow access from namespaced child before chroot and execv of init
 	if (chmod(SCD_CONTROL_SOCKET, 00777))
 		WARN("could not change access rights for scd control socket");
 
-	return smartcard;
+	return 0;
+}
+
+static void
+smartcard_scd_child_cb(pid_t pid, UNUSED int status, event_child_t *child, UNUSED void *data)
+{
+	TRACE("Reaped stopped %s process %d", SCD_BINARY_NAME, pid);
+	event_child_free(child);
 }
 
 static void
@@ -1151,6 +1187,14 @@ smartcard_scd_stop(smartcard_t *smartcard)
 {
 	DEBUG("Stopping %s process with pid=%d!", SCD_BINARY_NAME, smartcard->scd_pid);
 	kill(smartcard->scd_pid, SIGTERM);
+
+	// cmld may keep running, e.g., after a failed live restart
+	event_child_t *child = event_child_new(smartcard->scd_pid, smartcard_scd_child_cb, NULL);
+	if (event_add_child(child) < 0) {
+		WARN("Could not register reaper for %s process %d", SCD_BINARY_NAME,
+		     smartcard->scd_pid);
+		event_child_free(child);
+	}
 }
 
 void
@@ -1159,6 +1203,8 @@ smartcard_free(smartcard_t *smartcard)
 	IF_NULL_RETURN(smartcard);
 
 	smartcard_scd_stop(smartcard);
+	if (smartcard->sock >= 0)
+		close(smartcard->sock);
 
 	mem_free(smartcard->path);
 	mem_free(smartcard);
@@ -1216,8 +1262,17 @@ typedef struct crypto_callback_task {
 	size_t verify_data_buf_len;
 	size_t verify_sig_buf_len;
 	size_t verify_cert_buf_len;
+	uint32_t request_id;
+	uint8_t *req; // packed request while in the backlog
+	uint32_t req_len;
 } crypto_callback_task_t;
 
+static int smartcard_crypto_sock = -1;
+static event_io_t *smartcard_crypto_io = NULL;
+static list_t *smartcard_crypto_inflight = NULL;
+static list_t *smartcard_crypto_backlog = NULL;
+static uint32_t smartcard_crypto_request_id = 0;
+
 static crypto_callback_task_t *
 crypto_callback_hash_task_new(smartcard_crypto_hash_callback_t cb, void *data,
 			      const char *hash_file, smartcard_crypto_hashalgo_t hash_algo)
@@ -1286,85 +1341,71 @@ crypto_callback_task_free(crypto_callback_task_t *task)
 		mem_free(task->verify_sig_buf);
 	if (task->verify_cert_buf)
 		mem_free(task->verify_cert_buf);
+	if (task->req)
+		mem_free(task->req);
 	mem_free(task);
 }
 
+/*
+ * Calls the callback of the task with the result in msg.
+ */
 static void
-smartcard_cb_crypto(int fd, unsigned events, event_io_t *io, void *data)
+smartcard_crypto_dispatch(crypto_callback_task_t *task, const TokenToDaemon *msg)
 {
-	crypto_callback_task_t *task = data;
-	ASSERT(task);
-
-	TRACE("Received message from SCD");
+	switch (msg->code) {
+	// deal with CRYPTO_HASH_* cases
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK:
+		TRACE("Received HASH_OK message, ");
+		if (msg->has_hash_value) {
+			char *hash = bytes_to_string_new(msg->hash_value.data, msg->hash_value.len);
 
-	// TODO outsource socket/fd/events handling
-	if (events & EVENT_IO_READ) {
-		// use protobuf for communication with scd
-		TokenToDaemon *msg =
-			(TokenToDaemon *)protobuf_recv_message(fd, &token_to_daemon__descriptor);
-		if (!msg) {
-			ERROR("Failed to receive message although EVENT_IO_READ was set. Aborting smartcard crypto.");
-			goto cleanup;
-		}
-		switch (msg->code) {
-		// deal with CRYPTO_HASH_* cases
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK:
-			TRACE("Received HASH_OK message, ");
-			if (msg->has_hash_value) {
-				char *hash = bytes_to_string_new(msg->hash_value.data,
-								 msg->hash_value.len);
-
-				TRACE("Received hash for file %s: %s",
-				      task->hash_file ? task->hash_file : "<empty>", hash);
-				task->hash_complete(hash, task->hash_file, task->hash_algo,
-						    task->data);
-				if (hash != NULL) {
-					mem_free(hash);
-				}
-				break;
+			TRACE("Received hash for file %s: %s",
+			      task->hash_file ? task->hash_file : "<empty>", hash);
+			task->hash_complete(hash, task->hash_file, task->hash_algo, task->data);
+			if (hash != NULL) {
+				mem_free(hash);
 			}
-			task->hash_complete(NULL, task->hash_file, task->hash_algo, task->data);
-
-			ERROR("Missing hash_value in CRYPTO_HASH_OK response!"); // fallthrough
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR:
-			task->hash_complete(NULL, task->hash_file, task->hash_algo, task->data);
 			break;
+		}
+		task->hash_complete(NULL, task->hash_file, task->hash_algo, task->data);
 
-		// deal with CRYPTO_VERIFY_* cases
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_GOOD:
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR:
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_SIGNATURE:
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_CERTIFICATE:
-		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_LOCALLY_SIGNED:
-			if (task->verify_complete) {
-				task->verify_complete(
-					smartcard_crypto_verify_result_from_proto(msg->code),
-					task->verify_data_file, task->verify_sig_file,
-					task->verify_cert_file, task->hash_algo, task->data);
-			} else if (task->verify_buf_complete) {
-				task->verify_buf_complete(
-					smartcard_crypto_verify_result_from_proto(msg->code),
-					task->verify_data_buf, task->verify_data_buf_len,
-					task->verify_sig_buf, task->verify_sig_buf_len,
-					task->verify_cert_buf, task->verify_cert_buf_len,
-					task->hash_algo, task->data);
-			}
-			break;
-		default:
-			ERROR("TokenToDaemon command %d unknown or not implemented yet", msg->code);
-			break;
+		ERROR("Missing hash_value in CRYPTO_HASH_OK response!"); // fallthrough
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR:
+		task->hash_complete(NULL, task->hash_file, task->hash_algo, task->data);
+		break;
+
+	// deal with CRYPTO_VERIFY_* cases
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_GOOD:
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR:
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_SIGNATURE:
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_CERTIFICATE:
+	case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_LOCALLY_SIGNED:
+		if (task->verify_complete) {
+			task->verify_complete(smartcard_crypto_verify_result_from_proto(msg->code),
+					      task->verify_data_file, task->verify_sig_file,
+					      task->verify_cert_file, task->hash_algo, task->data);
+		} else if (task->verify_buf_complete) {
+			task->verify_buf_complete(
+				smartcard_crypto_verify_result_from_proto(msg->code),
+				task->verify_data_buf, task->verify_data_buf_len,
+				task->verify_sig_buf, task->verify_sig_buf_len,
+				task->verify_cert_buf, task->verify_cert_buf_len, task->hash_algo,
+				task->data);
 		}
-		protobuf_free_message((ProtobufCMessage *)msg);
-	} else if (events & EVENT_IO_EXCEPT) {
-		WARN("Got EVENT_IO_EXCEPT in smartcard_cb_crypto().");
-		// TODO
-	} else {
-		WARN("Got other event %x in smartcard_cb_crypto(), ignoring.", events);
-		return; // do nothing (i.e. do not free resources) for other kinds of events
+		break;
+	default:
+		ERROR("TokenToDaemon command %d unknown or not implemented yet", msg->code);
+		break;
 	}
+}
 
-cleanup:
-	// trigger callbacks nonetheless so that they can clean up their allocated buffers as well
+/*
+ * Triggers the callbacks of the task nonetheless, so that they can clean up
+ * their allocated buffers as well, and frees the task.
+ */
+static void
+smartcard_crypto_task_finish(crypto_callback_task_t *task)
+{
 	if (task->hash_complete) {
 		task->hash_complete(NULL, task->hash_file, task->hash_algo, task->data);
 	}
@@ -1378,42 +1419,155 @@ cleanup:
 		task->verify_complete(VERIFY_ERROR, task->verify_data_file, task->verify_sig_file,
 				      task->verify_cert_file, task->hash_algo, task->data);
 	}
-	event_remove_io(io);
-	event_io_free(io);
 	crypto_callback_task_free(task);
-	close(fd);
 }
 
+/*
+ * Closes the crypto connection to scd and fails all of its outstanding requests.
+ */
+static void
+smartcard_crypto_disconnect(void)
+{
+	if (smartcard_crypto_io) {
+		event_remove_io(smartcard_crypto_io);
+		event_io_free(smartcard_crypto_io);
+		smartcard_crypto_io = NULL;
+	}
+	if (smartcard_crypto_sock >= 0) {
+		close(smartcard_crypto_sock);
+		smartcard_crypto_sock = -1;
+	}
+
+	// callbacks may already issue new requests on a new connection
+	list_t *inflight = smartcard_crypto_inflight;
+	list_t *backlog = smartcard_crypto_backlog;
+	smartcard_crypto_inflight = NULL;
+	smartcard_crypto_backlog = NULL;
+
+	for (list_t *l = inflight; l; l = l->next)
+		smartcard_crypto_task_finish(l->data);
+	for (list_t *l = backlog; l; l = l->next)
+		smartcard_crypto_task_finish(l->data);
+	list_delete(inflight);
+	list_delete(backlog);
+}
+
+/*
+ * Sends requests of the backlog as far as the in-flight limit allows.
+ */
+static void
+smartcard_crypto_send_backlog(void)
+{
+	while (smartcard_crypto_sock >= 0 && smartcard_crypto_backlog &&
+	       list_length(smartcard_crypto_inflight) < SMARTCARD_CRYPTO_INFLIGHT_MAX) {
+		crypto_callback_task_t *task = smartcard_crypto_backlog->data;
+		smartcard_crypto_backlog = list_unlink(smartcard_crypto_backlog,
+						       smartcard_crypto_backlog);
+		smartcard_crypto_inflight = list_append(smartcard_crypto_inflight, task);
+
+		if (protobuf_send_message_packed(smartcard_crypto_sock, task->req, task->req_len) <
+		    0) {
+			ERROR("Failed to send crypto request %u to scd", task->request_id);
+			smartcard_crypto_disconnect();
+			return;
+		}
+		mem_free(task->req);
+		task->req = NULL;
+	}
+}
+
+static void
+smartcard_cb_crypto(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	TRACE("Received message from SCD");
+
+	if (events & EVENT_IO_READ) {
+		// use protobuf for communication with scd
+		TokenToDaemon *msg =
+			(TokenToDaemon *)protobuf_recv_message(fd, &token_to_daemon__descriptor);
+		if (!msg) {
+			ERROR("Failed to receive message although EVENT_IO_READ was set. Aborting smartcard crypto.");
+			smartcard_crypto_disconnect();
+			return;
+		}
+
+		list_t *l = smartcard_crypto_inflight;
+		for (; l; l = l->next) {
+			crypto_callback_task_t *task = l->data;
+			if (msg->has_request_id && task->request_id == msg->request_id)
+				break;
+		}
+		if (!l) {
+			WARN("Dropping scd response %d for unknown request", msg->code);
+			protobuf_free_message((ProtobufCMessage *)msg);
+			return;
+		}
+
+		crypto_callback_task_t *task = l->data;
+		smartcard_crypto_inflight = list_unlink(smartcard_crypto_inflight, l);
+
+		smartcard_crypto_dispatch(task, msg);
+		protobuf_free_message((ProtobufCMessage *)msg);
+		smartcard_crypto_task_finish(task);
+
+		smartcard_crypto_send_backlog();
+	} else if (events & EVENT_IO_EXCEPT) {
+		WARN("Got EVENT_IO_EXCEPT in smartcard_cb_crypto(), closing crypto connection.");
+		smartcard_crypto_disconnect();
+	} else {
+		WARN("Got other event %x in smartcard_cb_crypto(), ignoring.", events);
+	}
+}
+
+/*
+ * Sends a hash or verify request on the shared crypto connection to scd, which
+ * is established on first use. Requests are tagged with a request id, so that
+ * multiple of them can be outstanding and their responses may arrive in any
+ * order. Beyond SMARTCARD_CRYPTO_INFLIGHT_MAX outstanding requests, further
+ * ones are kept in a backlog, which keeps both socket buffers from filling up.
+ */
 static int
-smartcard_send_crypto(const DaemonToToken *out, crypto_callback_task_t *task)
+smartcard_send_crypto(DaemonToToken *out, crypto_callback_task_t *task)
 {
 	ASSERT(out);
 	ASSERT(task);
 
-	int sock = sock_unix_create_and_connect(SOCK_SEQPACKET | SOCK_NONBLOCK, SCD_CONTROL_SOCKET);
-	if (sock < 0) {
-		ERROR_ERRNO("Failed to connect to scd control socket %s for crypto",
-			    SCD_CONTROL_SOCKET);
-		return -1;
+	if (smartcard_crypto_sock < 0) {
+		int sock = sock_unix_create_and_connect(SOCK_SEQPACKET | SOCK_NONBLOCK,
+							SCD_CONTROL_SOCKET);
+		if (sock < 0) {
+			ERROR_ERRNO("Failed to connect to scd control socket %s for crypto",
+				    SCD_CONTROL_SOCKET);
+			return -1;
+		}
+		DEBUG("smartcard_send_crypto: connected to sock %d", sock);
+
+		smartcard_crypto_sock = sock;
+		smartcard_crypto_io = event_io_new(sock, EVENT_IO_READ, smartcard_cb_crypto, NULL);
+		event_add_io(smartcard_crypto_io);
 	}
 
-	DEBUG("smartcard_send_crypto: connected to sock %d", sock);
-	event_io_t *event = event_io_new(sock, EVENT_IO_READ, smartcard_cb_crypto, task);
-	event_add_io(event);
+	task->request_id = ++smartcard_crypto_request_id;
+	out->has_request_id = true;
+	out->request_id = task->request_id;
 
-	/*
-	char *string = protobuf_c_text_to_string((ProtobufCMessage *) out, NULL);
-	if (!string)
-		string = mem_printf("%d", out->code);
-	DEBUG("smartcard_send_crypto: sending crypto command {%s}", string);
-	mem_free(string);
-	*/
+	if (list_length(smartcard_crypto_inflight) >= SMARTCARD_CRYPTO_INFLIGHT_MAX) {
+		uint8_t *req = NULL;
+		uint32_t req_len = protobuf_pack_message_new((ProtobufCMessage *)out, &req);
+		IF_NULL_RETVAL(req, -1);
 
-	if (protobuf_send_message(sock, (ProtobufCMessage *)out) < 0) {
-		event_remove_io(event);
-		event_io_free(event);
+		task->req = req;
+		task->req_len = req_len;
+		smartcard_crypto_backlog = list_append(smartcard_crypto_backlog, task);
+		TRACE("Queued crypto request %u in backlog", task->request_id);
+		return 0;
+	}
+
+	if (protobuf_send_message(smartcard_crypto_sock, (ProtobufCMessage *)out) < 0) {
+		smartcard_crypto_disconnect();
 		return -1;
 	}
+	smartcard_crypto_inflight = list_append(smartcard_crypto_inflight, task);
 	return 0;
 }
 
@@ -1500,8 +1654,8 @@ smartcard_crypto_verify_buf(unsigned char *data_buf, size_t data_buf_len, unsign
 	if (smartcard_send_crypto(&out, task) < 0) {
 		crypto_callback_task_free(task);
 		// call the cb fct with error code so it can free its remaining buffers
-		task->verify_buf_complete(VERIFY_ERROR, data_buf, data_buf_len, sig_buf,
-					  sig_buf_len, cert_buf, cert_buf_len, hashalgo, data);
+		cb(VERIFY_ERROR, data_buf, data_buf_len, sig_buf, sig_buf_len, cert_buf,
+		   cert_buf_len, hashalgo, data);
 		return -1;
 	}
 	return 0;
@@ -1630,6 +1784,164 @@ smartcard_crypto_verify_buf_block(unsigned char *data_buf, size_t data_buf_len,
 	return ret;
 }
 
+/*
+ * Results of batch verifications which have not been taken yet, keyed by the
+ * digest of data, signature and certificate.
+ */
+typedef struct {
+	char *digest;
+	smartcard_crypto_hashalgo_t hashalgo;
+	smartcard_crypto_verify_result_t result;
+} smartcard_crypto_prefetched_t;
+
+static hashmap_t *smartcard_crypto_prefetched = NULL;
+
+static void
+smartcard_crypto_prefetched_free(smartcard_crypto_prefetched_t *prefetched)
+{
+	mem_free(prefetched->digest);
+	mem_free(prefetched);
+}
+
+int
+smartcard_crypto_verify_files_block(size_t n, const char *const datafiles[],
+				    const char *const sigfiles[], const char *const certfiles[],
+				    smartcard_crypto_hashalgo_t hashalgo,
+				    smartcard_crypto_verify_result_t results[])
+{
+	int ret = 0;
+	size_t sent = 0, received = 0;
+
+	for (size_t i = 0; i < n; i++)
+		results[i] = VERIFY_ERROR;
+	IF_TRUE_RETVAL(n == 0, 0);
+
+	int sock = sock_unix_create_and_connect(SOCK_SEQPACKET, SCD_CONTROL_SOCKET);
+	if (sock < 0) {
+		ERROR_ERRNO("Failed to connect to scd control socket %s", SCD_CONTROL_SOCKET);
+		return -1;
+	}
+
+	/*
+	 * The requests are tagged with their index and pipelined, so that the
+	 * crypto workers of scd verify them concurrently. Responses may arrive
+	 * in any order.
+	 */
+	while (received < n) {
+		while (sent < n && sent - received < SMARTCARD_CRYPTO_INFLIGHT_MAX) {
+			DaemonToToken out = DAEMON_TO_TOKEN__INIT;
+			out.code = DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_FILE;
+			out.verify_data_file = (char *)datafiles[sent];
+			out.verify_sig_file = (char *)sigfiles[sent];
+			out.verify_cert_file = (char *)certfiles[sent];
+			out.has_hash_algo = true;
+			out.hash_algo = smartcard_hashalgo_to_proto(hashalgo);
+			out.has_request_id = true;
+			out.request_id = sent;
+
+			if (protobuf_send_message(sock, (ProtobufCMessage *)&out) < 0) {
+				ERROR("Failed to send batch verify request to scd");
+				ret = -1;
+				goto out;
+			}
+			sent++;
+		}
+
+		TokenToDaemon *msg =
+			(TokenToDaemon *)protobuf_recv_message(sock, &token_to_daemon__descriptor);
+		if (!msg) {
+			ERROR("Failed to receive batch verify response from scd on sock %d", sock);
+			ret = -1;
+			goto out;
+		}
+		received++;
+
+		if (!msg->has_request_id || msg->request_id >= sent) {
+			WARN("Dropping scd response %d for unknown request", msg->code);
+			protobuf_free_message((ProtobufCMessage *)msg);
+			continue;
+		}
+
+		switch (msg->code) {
+		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_GOOD:
+		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR:
+		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_SIGNATURE:
+		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_BAD_CERTIFICATE:
+		case TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_LOCALLY_SIGNED:
+			results[msg->request_id] =
+				smartcard_crypto_verify_result_from_proto(msg->code);
+			break;
+		default:
+			ERROR("Invalid TokenToDaemon command %d when verifying file %s", msg->code,
+			      datafiles[msg->request_id]);
+		}
+		protobuf_free_message((ProtobufCMessage *)msg);
+	}
+
+	DEBUG("Verified %zu files in one batch", n);
+out:
+	close(sock);
+	return ret;
+}
+
+void
+smartcard_crypto_verify_files_prefetch(size_t n, const char *const datafiles[],
+				       const char *const sigfiles[], const char *const certfiles[],
+				       const char *const digests[],
+				       smartcard_crypto_hashalgo_t hashalgo)
+{
+	IF_TRUE_RETURN(n == 0);
+
+	smartcard_crypto_verify_result_t *results = mem_new0(smartcard_crypto_verify_result_t, n);
+	smartcard_crypto_verify_files_block(n, datafiles, sigfiles, certfiles, hashalgo, results);
+
+	if (!smartcard_crypto_prefetched)
+		smartcard_crypto_prefetched = hashmap_new_str();
+
+	for (size_t i = 0; i < n; i++) {
+		// errors may be transient, leave those to the regular verification
+		if (results[i] == VERIFY_ERROR)
+			continue;
+
+		smartcard_crypto_prefetched_t *prefetched =
+			mem_new0(smartcard_crypto_prefetched_t, 1);
+		prefetched->digest = mem_strdup(digests[i]);
+		prefetched->hashalgo = hashalgo;
+		prefetched->result = results[i];
+
+		smartcard_crypto_prefetched_t *old = hashmap_put(
+			smartcard_crypto_prefetched, prefetched->digest, prefetched);
+		if (old)
+			smartcard_crypto_prefetched_free(old);
+	}
+	mem_free(results);
+}
+
+bool
+smartcard_crypto_verify_take_prefetched(const char *digest, smartcard_crypto_hashalgo_t hashalgo,
+					smartcard_crypto_verify_result_t *result)
+{
+	ASSERT(digest);
+	ASSERT(result);
+
+	IF_NULL_RETVAL(smartcard_crypto_prefetched, false);
+
+	smartcard_crypto_prefetched_t *prefetched =
+		hashmap_remove(smartcard_crypto_prefetched, digest);
+	IF_NULL_RETVAL(prefetched, false);
+
+	bool found = prefetched->hashalgo == hashalgo;
+	if (found)
+		*result = prefetched->result;
+	smartcard_crypto_prefetched_free(prefetched);
+
+	if (!hashmap_count(smartcard_crypto_prefetched)) {
+		hashmap_free(smartcard_crypto_prefetched);
+		smartcard_crypto_prefetched = NULL;
+	}
+	return found;
+}
+
 uint8_t *
 smartcard_pull_csr_new(size_t *csr_len)
 {
@@ -37,11 +37,20 @@ typedef struct smartcard smartcard_t;
 // clang-format on
 
 /**
+ * Starts scd, but does not wait for it, see smartcard_connect().
  * @param path The directory where smartcard-related data is stored.
  */
 smartcard_t *
 smartcard_new(const char *path);
 
+/**
+ * Tries once to connect to the control socket of the scd started by
+ * smartcard_new(). Gives up if scd is not available within a few seconds.
+ * @return 0 if connected, 1 if scd is not ready yet, -1 on error
+ */
+int
+smartcard_connect(smartcard_t *smartcard);
+
 /**
  * @param smartcard The smartcard instance to be deleted.
  */
@@ -267,6 +276,51 @@ smartcard_crypto_verify_buf_block(unsigned char *data_buf, size_t data_buf_len,
 				  unsigned char *cert_buf, size_t cert_buf_len,
 				  smartcard_crypto_hashalgo_t hashalgo);
 
+/**
+ * Requests the scd to verify the signatures of several datafiles at once. The
+ * requests are pipelined on a single connection, thus scd verifies them
+ * concurrently on its crypto worker threads. Waits for all results.
+ *
+ * @param n number of datafiles
+ * @param datafiles the files whose signatures shall be verified
+ * @param sigfiles files with the signatures on the datafiles
+ * @param certfiles certificate files to verify the signatures with
+ * @param hash_algo the hash algorithm to use
+ * @param results array of n results, VERIFY_ERROR for requests which failed
+ * @return 0 if all results were received, -1 otherwise
+ */
+int
+smartcard_crypto_verify_files_block(size_t n, const char *const datafiles[],
+				    const char *const sigfiles[], const char *const certfiles[],
+				    smartcard_crypto_hashalgo_t hashalgo,
+				    smartcard_crypto_verify_result_t results[]);
+
+/**
+ * Verifies several datafiles in one batch with smartcard_crypto_verify_files_block()
+ * and keeps the results, to be taken once the files are actually loaded.
+ *
+ * @param digests digests of the contents of datafile, sigfile and certfile, used
+ *		  to look up the results, e.g. from hash_files_digest_new()
+ */
+void
+smartcard_crypto_verify_files_prefetch(size_t n, const char *const datafiles[],
+				       const char *const sigfiles[], const char *const certfiles[],
+				       const char *const digests[],
+				       smartcard_crypto_hashalgo_t hashalgo);
+
+/**
+ * Takes the result of a verification by smartcard_crypto_verify_files_prefetch().
+ * Each result is only handed out once.
+ *
+ * @param digest digest of the contents of datafile, sigfile and certfile
+ * @param hash_algo the hash algorithm the result is requested for
+ * @param result set to the result, if any
+ * @return true if a result was prefetched for the given digest
+ */
+bool
+smartcard_crypto_verify_take_prefetched(const char *digest, smartcard_crypto_hashalgo_t hashalgo,
+					smartcard_crypto_verify_result_t *result);
+
 /**
  * Pulls the device CSR from the tokens directory,
  * If a TPM is connected, the corresponding Private Key is stored inside the TPM,
@@ -22,6 +22,7 @@
  */
 
 #include "time.h"
+#include "bcast.h"
 
 #include "common/macro.h"
 #include "common/mem.h"
@@ -142,6 +143,7 @@ time_check_and_reset_clock_cb(event_timer_t *timer, UNUSED void *data)
 		event_timer_free(timer);
 		time_clock_check_timer = NULL;
 		time_out_of_sync = true;
+		bcast_set_time(btime_cml, time_out_of_sync);
 	} else {
 		INFO("System clock still in trusted range.");
 	}
@@ -156,6 +158,7 @@ time_init(void)
 		return -1;
 	}
 	btime_cml = btime;
+	bcast_set_time(btime_cml, time_out_of_sync);
 	return 0;
 }
 
@@ -187,6 +190,7 @@ time_register_clock_check(void)
 		time_clock_check_timer =
 			event_timer_new(TIME_MINUTES(11) * 1000, EVENT_TIMER_REPEAT_FOREVER,
 					time_check_and_reset_clock_cb, NULL);
+		event_timer_set_slack(time_clock_check_timer, TIME_MINUTES(1) * 1000);
 		event_add_timer(time_clock_check_timer);
 	}
 
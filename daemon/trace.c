@@ -0,0 +1,174 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "trace.h"
+
+#include "common/macro.h"
+#include "common/str.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAX_EVENTS 128
+#define TRACE_NAME_LEN 64
+
+typedef struct {
+	const char *name;
+	uint64_t begin_us; /* relative to the start of the trace */
+	uint64_t dur_us;
+	pid_t pid;
+} trace_event_t;
+
+struct trace {
+	char name[TRACE_NAME_LEN];
+	struct timespec start;
+	pid_t owner;
+	uint64_t last_us;
+	unsigned int len;
+	trace_event_t events[TRACE_MAX_EVENTS];
+};
+
+static uint64_t
+trace_now_us(const trace_t *trace)
+{
+	struct timespec now;
+	IF_TRUE_RETVAL(clock_gettime(CLOCK_MONOTONIC, &now) < 0, trace->last_us);
+
+	return (uint64_t)(now.tv_sec - trace->start.tv_sec) * 1000000 +
+	       (now.tv_nsec - trace->start.tv_nsec) / 1000;
+}
+
+trace_t *
+trace_new(const char *name)
+{
+	ASSERT(name);
+
+	trace_t *trace = mmap(NULL, sizeof(trace_t), PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (trace == MAP_FAILED) {
+		WARN_ERRNO("Could not map trace %s", name);
+		return NULL;
+	}
+
+	memset(trace, 0, sizeof(trace_t));
+	strncpy(trace->name, name, TRACE_NAME_LEN - 1);
+	trace->owner = getpid();
+	if (clock_gettime(CLOCK_MONOTONIC, &trace->start) < 0)
+		WARN_ERRNO("Could not read monotonic clock");
+	return trace;
+}
+
+void
+trace_free(trace_t *trace)
+{
+	IF_NULL_RETURN(trace);
+
+	if (munmap(trace, sizeof(trace_t)) < 0)
+		WARN_ERRNO("Could not unmap trace");
+}
+
+void
+trace_step(trace_t *trace, const char *name)
+{
+	IF_NULL_RETURN(trace);
+	ASSERT(name);
+
+	/* steps of the parent and its children may interleave */
+	unsigned int index = __atomic_fetch_add(&trace->len, 1, __ATOMIC_RELAXED);
+	if (index >= TRACE_MAX_EVENTS) {
+		__atomic_store_n(&trace->len, TRACE_MAX_EVENTS, __ATOMIC_RELAXED);
+		TRACE("Trace %s is full, dropping step %s", trace->name, name);
+		return;
+	}
+
+	uint64_t now = trace_now_us(trace);
+	uint64_t last = __atomic_exchange_n(&trace->last_us, now, __ATOMIC_RELAXED);
+	trace_event_t *event = &trace->events[index];
+
+	event->name = name;
+	event->begin_us = last;
+	event->dur_us = now > last ? now - last : 0;
+	event->pid = getpid();
+
+	DEBUG("%s: %s took %" PRIu64 " ms (%" PRIu64 " ms since start)", trace->name, name,
+	      event->dur_us / 1000, now / 1000);
+}
+
+long
+trace_get_elapsed_ms(const trace_t *trace)
+{
+	ASSERT(trace);
+	return trace_now_us(trace) / 1000;
+}
+
+static void
+trace_append_json_string(str_t *json, const char *s)
+{
+	str_append(json, "\"");
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			str_append_printf(json, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			str_append_printf(json, "\\u%04x", *s);
+		else
+			str_append_len(json, s, 1);
+	}
+	str_append(json, "\"");
+}
+
+char *
+trace_to_json_new(const trace_t *trace)
+{
+	ASSERT(trace);
+
+	str_t *json = str_new("{\"traceEvents\":[");
+	unsigned int len = MIN(trace->len, TRACE_MAX_EVENTS);
+	bool first = true;
+
+	for (unsigned int i = 0; i < len; i++) {
+		const trace_event_t *event = &trace->events[i];
+		/* reserved by a step which is still being recorded */
+		if (!event->name)
+			continue;
+
+		str_append_printf(json, "%s{\"name\":", first ? "" : ",");
+		first = false;
+		trace_append_json_string(json, event->name);
+		str_append(json, ",\"cat\":");
+		trace_append_json_string(json, trace->name);
+		str_append_printf(json,
+				  ",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64
+				  ",\"pid\":1,\"tid\":%d}",
+				  event->begin_us, event->dur_us, event->pid == trace->owner ? 1 : 2);
+	}
+	str_append(json, "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"name\":");
+	trace_append_json_string(json, trace->name);
+	str_append(json, "}}");
+
+	return str_free(json, false);
+}
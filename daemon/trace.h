@@ -0,0 +1,72 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file trace.h
+ *
+ * Records the timing of consecutive steps, e.g., the module hooks of a
+ * container start, and exports them in the Chrome trace event format, which
+ * can be loaded into chrome://tracing or Perfetto.
+ *
+ * A trace lives in shared memory, so that children cloned or forked after its
+ * creation record their steps into the same trace until they exec.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+typedef struct trace trace_t;
+
+/**
+ * Creates a new trace which starts now.
+ * @return the trace or NULL if no shared memory could be mapped
+ */
+trace_t *
+trace_new(const char *name);
+
+void
+trace_free(trace_t *trace);
+
+/**
+ * Records a step named name, which lasted from the end of the previous step
+ * (or the start of the trace) until now. The name is not copied and must stay
+ * valid in all processes sharing the trace, e.g., a string literal.
+ * Does nothing if trace is NULL.
+ */
+void
+trace_step(trace_t *trace, const char *name);
+
+/**
+ * Returns the milliseconds since the start of the trace.
+ */
+long
+trace_get_elapsed_ms(const trace_t *trace);
+
+/**
+ * Returns the trace as newly allocated JSON object in the Chrome trace event
+ * format. Steps of other processes are reported with their own tid.
+ */
+char *
+trace_to_json_new(const trace_t *trace);
+
+#endif /* TRACE_H */
@@ -0,0 +1,232 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#define _GNU_SOURCE
+
+#include "trash.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/dir.h"
+#include "common/event.h"
+#include "common/file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Blocks of large files are released in chunks from the end, so that the file
+ * system does not have to free (and discard) several GBytes in one transaction.
+ */
+#define TRASH_PUNCH_CHUNK (256 * 1024 * 1024)
+
+typedef struct trash_job {
+	char *path; // NULL for a sync job
+	trash_cb_t cb;
+	void *data;
+	int ret;
+} trash_job_t;
+
+static char *trash_dir = NULL;
+static event_base_t *trash_base = NULL;
+static unsigned trash_count = 0;
+
+static trash_job_t *
+trash_job_new(const char *path, trash_cb_t cb, void *data)
+{
+	trash_job_t *job = mem_new0(trash_job_t, 1);
+	job->path = path ? mem_strdup(path) : NULL;
+	job->cb = cb;
+	job->data = data;
+	return job;
+}
+
+static void
+trash_job_free(trash_job_t *job)
+{
+	mem_free(job->path);
+	mem_free(job);
+}
+
+static int
+trash_delete_file(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd >= 0) {
+		struct stat st;
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+			off_t off = st.st_size;
+			while (off > 0) {
+				off_t len = MIN(off, (off_t)TRASH_PUNCH_CHUNK);
+				off -= len;
+				if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+					      len) < 0)
+					break; // not supported, unlink frees the blocks anyway
+			}
+		}
+		close(fd);
+	}
+
+	if (unlink(path) < 0) {
+		ERROR_ERRNO("Could not delete %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+trash_delete(const char *path)
+{
+	if (!file_is_dir(path) || file_is_link(path))
+		return trash_delete_file(path);
+
+	char *parent = mem_strdup(path);
+	char *name = mem_strdup(path);
+	int ret = dir_delete_folder(dirname(parent), basename(name));
+	if (ret < 0)
+		ERROR("Could not delete %s", path);
+	mem_free(parent);
+	mem_free(name);
+	return ret;
+}
+
+static void
+trash_job_done_cb(void *data)
+{
+	trash_job_t *job = data;
+
+	if (job->cb)
+		job->cb(job->ret, job->data);
+	trash_job_free(job);
+}
+
+// runs on the worker thread, jobs are processed in order
+static void
+trash_job_run_cb(void *data)
+{
+	trash_job_t *job = data;
+
+	if (job->path) {
+		TRACE("Deleting %s from trash", job->path);
+		job->ret = trash_delete(job->path);
+	}
+
+	if (!job->cb) {
+		trash_job_free(job);
+		return;
+	}
+	// on failure, the job stays queued until the main loop is woken up otherwise
+	if (event_base_post(event_base_main_get(), &trash_job_done_cb, job) < 0)
+		WARN("Could not wake up main loop for completion of trash job");
+}
+
+static void
+trash_queue(trash_job_t *job)
+{
+	// on failure, the job stays queued until the worker is woken up otherwise
+	if (event_base_post(trash_base, &trash_job_run_cb, job) < 0)
+		WARN("Could not wake up trash worker");
+}
+
+static int
+trash_purge_cb(const char *path, const char *file, UNUSED void *data)
+{
+	char *leftover = mem_printf("%s/%s", path, file);
+	INFO("Deleting leftover %s from trash", leftover);
+	trash_queue(trash_job_new(leftover, NULL, NULL));
+	mem_free(leftover);
+	return 0;
+}
+
+int
+trash_init(const char *dir)
+{
+	ASSERT(dir);
+	IF_TRUE_RETVAL(trash_base, 0);
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		ERROR_ERRNO("Could not mkdir trash dir %s", dir);
+		return -1;
+	}
+
+	trash_base = event_base_new();
+	if (!trash_base || event_base_start_thread(trash_base) < 0) {
+		ERROR("Could not start trash worker");
+		if (trash_base)
+			event_base_free(trash_base);
+		trash_base = NULL;
+		return -1;
+	}
+	trash_dir = mem_strdup(dir);
+
+	if (dir_foreach(trash_dir, &trash_purge_cb, NULL) < 0)
+		WARN("Could not check trash dir %s for leftovers", trash_dir);
+	return 0;
+}
+
+int
+trash_add(const char *path, trash_cb_t cb, void *data)
+{
+	ASSERT(path);
+
+	if (trash_base) {
+		char *name = mem_strdup(path);
+		char *trash_path = mem_printf("%s/%lld-%u-%s", trash_dir, (long long)time(NULL),
+					      trash_count++, basename(name));
+		mem_free(name);
+
+		if (rename(path, trash_path) == 0) {
+			DEBUG("Moved %s to trash", path);
+			trash_queue(trash_job_new(trash_path, cb, data));
+			mem_free(trash_path);
+			return 0;
+		}
+		if (errno != EXDEV)
+			WARN_ERRNO("Could not move %s to trash", path);
+		mem_free(trash_path);
+	}
+
+	int ret = trash_delete(path);
+	IF_TRUE_RETVAL(ret < 0, -1);
+	if (cb)
+		cb(ret, data);
+	return 0;
+}
+
+void
+trash_sync(trash_cb_t cb, void *data)
+{
+	ASSERT(cb);
+
+	if (!trash_base)
+		cb(0, data);
+	else
+		trash_queue(trash_job_new(NULL, cb, data));
+}
@@ -0,0 +1,76 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+/**
+ * @file trash.h
+ *
+ * Background deletion of (large) files such as container images. A file is
+ * renamed into the trash directory, which removes it from its original
+ * location atomically, and is deleted on a worker thread afterwards, thus
+ * slow storage does not block the main event loop. Files which are left in
+ * the trash, e.g., after a power cut, are deleted on the next start.
+ */
+
+#ifndef TRASH_H
+#define TRASH_H
+
+/**
+ * Callback which is invoked in the main event loop once a deletion is done.
+ *
+ * @param ret 0 on success, -1 otherwise.
+ * @param data The data pointer given to trash_add() or trash_sync().
+ */
+typedef void (*trash_cb_t)(int ret, void *data);
+
+/**
+ * Creates the trash directory, which has to be on the same file system as the
+ * files moved into it, and starts the worker thread. Leftovers in the trash are
+ * deleted in the background.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int
+trash_init(const char *dir);
+
+/**
+ * Moves a file or directory into the trash and deletes it in the background.
+ * If there is no trash or the file is located on another file system, it is
+ * deleted synchronously.
+ *
+ * @param cb Callback to deliver the result in the main event loop, may be NULL.
+ * @param data Payload data to be passed to the callback.
+ * @return 0 if the file is gone from its original location, -1 otherwise (the
+ *         callback is not invoked).
+ */
+int
+trash_add(const char *path, trash_cb_t cb, void *data);
+
+/**
+ * Invokes cb in the main event loop once all files added to the trash before
+ * have been deleted, immediately if there is no trash.
+ */
+void
+trash_sync(trash_cb_t cb, void *data);
+
+#endif /* TRASH_H */
@@ -27,12 +27,15 @@
 #include "tpm2d_shared.h"
 
 #include "common/macro.h"
+#include "common/event.h"
 #include "common/mem.h"
 #include "common/protobuf.h"
 #include "common/proc.h"
 #include "common/file.h"
+#include "common/list.h"
 
 #include <google/protobuf-c/protobuf-c-text.h>
+#include <openssl/crypto.h>
 #include <stdbool.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -44,6 +47,10 @@
 static int tss_sock = -1;
 static pid_t tss_tpm2d_pid = -1;
 
+// measurements collected between tss_ml_batch_begin() and tss_ml_batch_commit()
+static list_t *tss_ml_batch = NULL;
+static unsigned int tss_ml_batch_depth = 0;
+
 /**
  * Returns the HashAlgLen (proto) for the given tss_hash_algo_t algo.
  */
@@ -54,6 +61,7 @@ tss_hash_algo_get_len_proto(tss_hash_algo_t algo)
 	case TSS_SHA1:
 		return HASH_ALG_LEN__SHA1;
 	case TSS_SHA256:
+	case TSS_FSVERITY_SHA256:
 		return HASH_ALG_LEN__SHA256;
 	case TSS_SHA384:
 		return HASH_ALG_LEN__SHA384;
@@ -117,30 +125,61 @@ tss_init(void)
 		return 0;
 	}
 
-	// Start the tpm2d
+	// Start the tpm2d, it is connected by tss_connect()
 	tss_tpm2d_pid = fork_and_exec_tpm2d();
 	IF_TRUE_RETVAL_TRACE(tss_tpm2d_pid == -1, -1);
 
-	// Connect to tpm2d
-	size_t retries = 0;
-	do {
-		usleep(500000);
-		tss_sock = sock_unix_create_and_connect(SOCK_STREAM, TPM2D_SOCKET);
-		retries++;
-		TRACE("Retry %ld connecting to tpm2d", retries);
-		printf(".");
-		fflush(stdout);
-	} while (tss_sock < 0);
-
-	return (tss_sock < 0) ? -1 : 0;
+	return 0;
+}
+
+int
+tss_connect(void)
+{
+	IF_TRUE_RETVAL(tss_tpm2d_pid == -1 || tss_sock >= 0, 0);
+
+	tss_sock = sock_unix_create_and_connect(SOCK_STREAM, TPM2D_SOCKET);
+	if (tss_sock < 0) {
+		int status;
+		if (waitpid(tss_tpm2d_pid, &status, WNOHANG) == tss_tpm2d_pid) {
+			ERROR("%s exited before accepting connections", TPM2D_BINARY_NAME);
+			tss_tpm2d_pid = -1;
+			return -1;
+		}
+		TRACE("tpm2d socket not yet available");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+tss_tpm2d_child_cb(pid_t pid, UNUSED int status, event_child_t *child, UNUSED void *data)
+{
+	TRACE("Reaped stopped %s process %d", TPM2D_BINARY_NAME, pid);
+	event_child_free(child);
 }
 
 static void
 tss_tpm2d_stop(void)
 {
+	if (tss_sock >= 0) {
+		close(tss_sock);
+		tss_sock = -1;
+	}
+
 	IF_TRUE_RETURN_TRACE(tss_tpm2d_pid == -1);
 	DEBUG("Stopping %s process with pid=%d!", TPM2D_BINARY_NAME, tss_tpm2d_pid);
 	kill(tss_tpm2d_pid, SIGTERM);
+
+	// cmld may keep running, e.g., after a failed live restart
+	event_child_t *child = event_child_new(tss_tpm2d_pid, tss_tpm2d_child_cb, NULL);
+	if (event_add_child(child) < 0) {
+		WARN("Could not register reaper for %s process %d", TPM2D_BINARY_NAME,
+		     tss_tpm2d_pid);
+		event_child_free(child);
+	}
+	// allows tss_init() to start it again
+	tss_tpm2d_pid = -1;
 }
 
 void
@@ -149,6 +188,67 @@ tss_cleanup(void)
 	tss_tpm2d_stop();
 }
 
+/*
+ * Sends msg to tpm2d and waits for its generic response.
+ * @return 0 if tpm2d reported success, -1 otherwise
+ */
+static int
+tss_send_ml_message(ControllerToTpm *msg)
+{
+	int ret = -1;
+
+	if (protobuf_send_message(tss_sock, (ProtobufCMessage *)msg) < 0) {
+		WARN("Failed to send measurement to tpm2d");
+	}
+
+	TpmToController *resp =
+		(TpmToController *)protobuf_recv_message(tss_sock, &tpm_to_controller__descriptor);
+	if (!resp) {
+		WARN("Failed to receive and decode TpmToController protobuf message!");
+		return -1;
+	}
+
+	if (resp->code != TPM_TO_CONTROLLER__CODE__GENERIC_RESPONSE ||
+	    resp->response != TPM_TO_CONTROLLER__GENERIC_RESPONSE__CMD_OK) {
+		ERROR("tpmd failed to append measurement to ML");
+	} else {
+		ret = 0;
+	}
+
+	protobuf_free_message((ProtobufCMessage *)resp);
+	return ret;
+}
+
+uint8_t *
+tss_cache_key_new(size_t *key_len)
+{
+	IF_TRUE_RETVAL_TRACE(tss_sock < 0, NULL);
+
+	ControllerToTpm msg = CONTROLLER_TO_TPM__INIT;
+	msg.code = CONTROLLER_TO_TPM__CODE__CACHE_KEY_REQ;
+	if (protobuf_send_message(tss_sock, (ProtobufCMessage *)&msg) < 0) {
+		WARN("Failed to request cache key from tpm2d");
+		return NULL;
+	}
+
+	TpmToController *resp =
+		(TpmToController *)protobuf_recv_message(tss_sock, &tpm_to_controller__descriptor);
+	IF_NULL_RETVAL_WARN(resp, NULL);
+
+	uint8_t *key = NULL;
+	if (resp->code == TPM_TO_CONTROLLER__CODE__CACHE_KEY_RESPONSE && resp->has_cache_key &&
+	    resp->cache_key.len > 0) {
+		key = mem_memcpy(resp->cache_key.data, resp->cache_key.len);
+		*key_len = resp->cache_key.len;
+		OPENSSL_cleanse(resp->cache_key.data, resp->cache_key.len);
+	} else {
+		WARN("tpm2d did not provide a cache key");
+	}
+
+	protobuf_free_message((ProtobufCMessage *)resp);
+	return key;
+}
+
 void
 tss_ml_append(char *filename, uint8_t *filehash, int filehash_len, tss_hash_algo_t hashalgo)
 {
@@ -158,6 +258,26 @@ tss_ml_append(char *filename, uint8_t *filehash, int filehash_len, tss_hash_algo
 	 */
 	IF_TRUE_RETURN(tss_sock < 0);
 
+	HashAlgLen hash_len = tss_hash_algo_get_len_proto(hashalgo);
+	IF_TRUE_RETURN(hash_len == 0);
+	MlDigestType digest_type = hashalgo == TSS_FSVERITY_SHA256 ?
+					   ML_DIGEST_TYPE__ML_DIGEST_FSVERITY :
+					   ML_DIGEST_TYPE__ML_DIGEST_FILE;
+
+	if (tss_ml_batch_depth > 0) {
+		MlEntry *e = mem_new(MlEntry, 1);
+		ml_entry__init(e);
+		e->filename = mem_strdup(filename);
+		e->datahash.len = filehash_len;
+		e->datahash.data = mem_memcpy(filehash, filehash_len);
+		e->has_hashalg = true;
+		e->hashalg = hash_len;
+		e->has_digest_type = true;
+		e->digest_type = digest_type;
+		tss_ml_batch = list_append(tss_ml_batch, e);
+		return;
+	}
+
 	ControllerToTpm msg = CONTROLLER_TO_TPM__INIT;
 
 	msg.code = CONTROLLER_TO_TPM__CODE__ML_APPEND;
@@ -166,28 +286,52 @@ tss_ml_append(char *filename, uint8_t *filehash, int filehash_len, tss_hash_algo
 	msg.ml_datahash.len = filehash_len;
 	msg.ml_datahash.data = filehash;
 	msg.has_ml_hashalg = true;
-
-	HashAlgLen hash_len = tss_hash_algo_get_len_proto(hashalgo);
-	IF_TRUE_RETURN(hash_len == 0);
 	msg.ml_hashalg = hash_len;
+	msg.has_ml_digest_type = true;
+	msg.ml_digest_type = digest_type;
 
-	if (protobuf_send_message(tss_sock, (ProtobufCMessage *)&msg) < 0) {
-		WARN("Failed to send measurement to tpm2d");
-	}
+	if (!tss_send_ml_message(&msg))
+		INFO("Sucessfully appended measurement to ML: file %s", filename);
+}
 
-	TpmToController *resp =
-		(TpmToController *)protobuf_recv_message(tss_sock, &tpm_to_controller__descriptor);
-	if (!resp) {
-		WARN("Failed to receive and decode TpmToController protobuf message!");
-		return;
-	}
+void
+tss_ml_batch_begin(void)
+{
+	tss_ml_batch_depth++;
+}
 
-	if (resp->code != TPM_TO_CONTROLLER__CODE__GENERIC_RESPONSE ||
-	    resp->response != TPM_TO_CONTROLLER__GENERIC_RESPONSE__CMD_OK) {
-		ERROR("tpmd failed to append measurement to ML");
-	} else {
-		INFO("Sucessfully appended measurement to ML: file %s", filename);
+int
+tss_ml_batch_commit(void)
+{
+	int ret = 0;
+
+	ASSERT(tss_ml_batch_depth > 0);
+	IF_TRUE_RETVAL(--tss_ml_batch_depth > 0, 0);
+	IF_NULL_RETVAL(tss_ml_batch, 0);
+
+	size_t n = list_length(tss_ml_batch);
+	MlEntry **entries = mem_new(MlEntry *, n);
+	size_t i = 0;
+	for (list_t *l = tss_ml_batch; l; l = l->next)
+		entries[i++] = l->data;
+
+	ControllerToTpm msg = CONTROLLER_TO_TPM__INIT;
+	msg.code = CONTROLLER_TO_TPM__CODE__ML_APPEND_BATCH;
+	msg.n_ml_entries = n;
+	msg.ml_entries = entries;
+
+	ret = tss_send_ml_message(&msg);
+	if (!ret)
+		INFO("Sucessfully appended %zu measurements to ML", n);
+
+	for (i = 0; i < n; i++) {
+		mem_free(entries[i]->filename);
+		mem_free(entries[i]->datahash.data);
+		mem_free(entries[i]);
 	}
+	mem_free(entries);
+	list_delete(tss_ml_batch);
+	tss_ml_batch = NULL;
 
-	protobuf_free_message((ProtobufCMessage *)resp);
+	return ret;
 }
@@ -25,22 +25,68 @@
 #define TSS_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*
- * type of supported hashes
+ * type of supported hashes, TSS_FSVERITY_SHA256 is the sha256 fs-verity file
+ * digest, which is listed as a distinct digest type in the measurement list
  */
-typedef enum { TSS_SHA1 = 0, TSS_SHA256, TSS_SHA384 } tss_hash_algo_t;
+typedef enum { TSS_SHA1 = 0, TSS_SHA256, TSS_SHA384, TSS_FSVERITY_SHA256 } tss_hash_algo_t;
 
+/**
+ * Starts tpm2d if the platform has a TPM, but does not wait for it,
+ * see tss_connect().
+ * @return 0 on success or if there is no TPM, -1 if tpm2d could not be started
+ */
 int
 tss_init(void);
 
+/**
+ * Tries once to connect to the tpm2d started by tss_init().
+ * @return 0 if connected or no tpm2d was started, 1 if tpm2d is not ready yet,
+ *         -1 if tpm2d exited
+ */
+int
+tss_connect(void);
+
 /**
  * Cleanup the tss submodule, mainly stop tpm2d daemon.
  */
 void
 tss_cleanup(void);
 
+/**
+ * Requests the key which authenticates the caches cmld stores on its data
+ * partition from tpm2d. The key is bound to the TPM of the device, see
+ * nvmcrypt_load_cache_key_new() of tpm2d.
+ * @param key_len set to the length of the key
+ * @return the key, to be wiped and freed by the caller, or NULL if there is no
+ *         tpm2d or it failed to provide the key
+ */
+uint8_t *
+tss_cache_key_new(size_t *key_len);
+
+/**
+ * Appends the measurement of filename to the container measurement list and
+ * extends it to the TPM. Inside a batch, the measurement is only collected.
+ */
 void
 tss_ml_append(char *filename, uint8_t *filehash, int filehash_len, tss_hash_algo_t hashalgo);
 
+/**
+ * Starts collecting the measurements passed to tss_ml_append() instead of
+ * sending each one to tpm2d and waiting for its extend, e.g., for all images
+ * of a container start. Batches may be nested, the outermost commit sends them.
+ */
+void
+tss_ml_batch_begin(void);
+
+/**
+ * Sends the measurements collected since tss_ml_batch_begin() to tpm2d in one
+ * message, which extends them in order.
+ * @return 0 on success or if nested, -1 on error
+ */
+int
+tss_ml_batch_commit(void);
+
 #endif /* TSS_H */
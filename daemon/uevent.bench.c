@@ -0,0 +1,795 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+/**
+ * @file uevent.bench.c
+ *
+ * Storm and fuzz benchmark for the uevent handling of cmld. Synthetic or
+ * recorded (udevadm monitor --property) kernel and udev uevents are written
+ * into a socketpair which replaces the netlink socket of uevent.c, and
+ * drained by uevent_handle() just as on a hotplug storm. Throughput, the
+ * handling latency per subsystem and the number of heap allocations per
+ * uevent are reported as JSON. Afterwards mutated uevents are fed into the
+ * parser to catch out of bounds accesses, preferably with SANITIZERS=y.
+ *
+ * Containers are stubbed and never allow the devices, thus no device nodes
+ * are created and nothing is injected into a netns.
+ */
+
+// the socket checks of nl.c do not hold for a socketpair, receive without them
+#define nl_msg_receive_uevents uevent_bench_receive_uevents
+
+#include "uevent.c"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define UEVENT_BENCH_SNDBUF (4 * 1024 * 1024)
+
+struct container {
+	char *name;
+	uuid_t *uuid;
+	container_state_t state;
+};
+
+typedef struct {
+	char *subsystem;
+	char *buf;
+	size_t len;
+} uevent_bench_event_t;
+
+typedef struct {
+	char *name;
+	uint64_t *values_ns;
+	size_t n;
+	size_t size;
+	uint64_t allocs;
+} uevent_bench_series_t;
+
+static int uevent_bench_fd = -1;
+static container_t *uevent_bench_containers = NULL;
+static int uevent_bench_containers_count = 0;
+
+/******************************************************************************/
+
+/*
+ * Count heap allocations of the uevent handling by interposing the allocator
+ * of glibc. Only counted while uevent_bench_count_allocs is set. The address
+ * sanitizer brings its own allocator, thus nothing is counted with SANITIZERS=y.
+ */
+static bool uevent_bench_count_allocs = false;
+static uint64_t uevent_bench_allocs = 0;
+
+#ifndef __SANITIZE_ADDRESS__
+extern void *
+__libc_malloc(size_t size);
+extern void *
+__libc_calloc(size_t nmemb, size_t size);
+extern void *
+__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+	if (uevent_bench_count_allocs)
+		uevent_bench_allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (uevent_bench_count_allocs)
+		uevent_bench_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (uevent_bench_count_allocs)
+		uevent_bench_allocs++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+/******************************************************************************/
+
+int
+uevent_bench_receive_uevents(UNUSED const nl_sock_t *nl, char *bufs[], size_t len, int received[],
+			     size_t n)
+{
+	struct iovec iov[NL_UEVENT_BATCH_MAX];
+	struct mmsghdr mm[NL_UEVENT_BATCH_MAX];
+	int count;
+
+	ASSERT(n <= NL_UEVENT_BATCH_MAX);
+
+	memset(mm, 0, sizeof(mm));
+	for (size_t i = 0; i < n; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = len;
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	do {
+		count = recvmmsg(uevent_bench_fd, mm, n, MSG_DONTWAIT, NULL);
+	} while (count < 0 && errno == EINTR);
+
+	if (count < 0)
+		return -1;
+
+	for (int i = 0; i < count; i++)
+		received[i] = (mm[i].msg_hdr.msg_flags & MSG_TRUNC) ? -1 : (int)mm[i].msg_len;
+	return count;
+}
+
+/******************************************************************************/
+
+container_t *
+cmld_container_get_by_index(int index)
+{
+	IF_TRUE_RETVAL(index < 0 || index >= uevent_bench_containers_count, NULL);
+	return &uevent_bench_containers[index];
+}
+
+container_t *
+cmld_container_get_by_uuid(const uuid_t *uuid)
+{
+	for (int i = 0; i < uevent_bench_containers_count; i++) {
+		if (uuid_equals(uevent_bench_containers[i].uuid, uuid))
+			return &uevent_bench_containers[i];
+	}
+	return NULL;
+}
+
+container_t *
+cmld_containers_get_c0()
+{
+	return cmld_container_get_by_index(0);
+}
+
+int
+cmld_containers_get_count()
+{
+	return uevent_bench_containers_count;
+}
+
+list_t *
+cmld_get_netif_phys_list(void)
+{
+	return NULL;
+}
+
+bool
+cmld_is_hostedmode_active(void)
+{
+	// do not move interfaces
+	return true;
+}
+
+void
+cmld_netif_phys_add_by_name(UNUSED const char *if_name)
+{
+}
+
+bool
+cmld_netif_phys_remove_by_name(UNUSED const char *if_name)
+{
+	return false;
+}
+
+int
+cmld_token_attach(UNUSED const char *serial, UNUSED char *devpath)
+{
+	return -1;
+}
+
+int
+cmld_token_detach(UNUSED char *usb_serial_short)
+{
+	return -1;
+}
+
+int
+container_add_net_iface(UNUSED container_t *container, UNUSED const char *iface,
+			UNUSED bool persistent)
+{
+	return -1;
+}
+
+int
+container_device_allow(UNUSED container_t *container, UNUSED int major, UNUSED int minor,
+		       UNUSED bool assign)
+{
+	return 0;
+}
+
+int
+container_device_deny(UNUSED container_t *container, UNUSED int major, UNUSED int minor)
+{
+	return 0;
+}
+
+const char *
+container_get_name(const container_t *container)
+{
+	return container->name;
+}
+
+pid_t
+container_get_pid(UNUSED const container_t *container)
+{
+	return -1;
+}
+
+int
+container_get_pidfd(UNUSED const container_t *container)
+{
+	return -1;
+}
+
+char *
+container_get_rootdir(UNUSED const container_t *container)
+{
+	return "/nonexistent";
+}
+
+container_state_t
+container_get_state(const container_t *container)
+{
+	return container->state;
+}
+
+const uuid_t *
+container_get_uuid(const container_t *container)
+{
+	return container->uuid;
+}
+
+bool
+container_has_userns(UNUSED const container_t *container)
+{
+	return false;
+}
+
+bool
+container_is_device_allowed(UNUSED const container_t *container, UNUSED int major,
+			    UNUSED int minor)
+{
+	return false;
+}
+
+int
+container_shift_ids(UNUSED const container_t *container, UNUSED const char *path,
+		    UNUSED bool is_root)
+{
+	return 0;
+}
+
+/******************************************************************************/
+
+static uint64_t
+uevent_bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Creates an uevent of the given subsystem from text with '\n' separated
+ * fields. udev messages are prefixed with the libudev monitor header.
+ */
+static uevent_bench_event_t *
+uevent_bench_event_new(const char *subsystem, bool udev, const char *text)
+{
+	uevent_bench_event_t *ev = mem_new0(uevent_bench_event_t, 1);
+	size_t text_len = strlen(text);
+	size_t off = udev ? sizeof(struct udev_monitor_netlink_header) : 0;
+
+	ev->subsystem = mem_strdup(subsystem);
+	ev->len = off + text_len + 1;
+	ev->buf = mem_alloc0(ev->len);
+
+	if (udev) {
+		struct udev_monitor_netlink_header *nlh = (void *)ev->buf;
+		memcpy(nlh->prefix, UDEV_MONITOR_TAG, sizeof(UDEV_MONITOR_TAG));
+		nlh->magic = htonl(UDEV_MONITOR_MAGIC);
+		nlh->header_size = off;
+		nlh->properties_off = off;
+		nlh->properties_len = text_len + 1;
+	}
+
+	memcpy(ev->buf + off, text, text_len);
+	for (char *p = ev->buf + off; p < ev->buf + ev->len; p++) {
+		if (*p == '\n')
+			*p = '\0';
+	}
+	return ev;
+}
+
+static void
+uevent_bench_event_free(uevent_bench_event_t *ev)
+{
+	mem_free(ev->subsystem);
+	mem_free(ev->buf);
+	mem_free(ev);
+}
+
+/*
+ * Synthetic hotplug storm, roughly what plugging in usb hubs with storage
+ * and network devices and starting containers with veths generates.
+ */
+static uevent_bench_event_t *
+uevent_bench_event_synth_new(int i)
+{
+	const char *action = (i / 8) % 2 ? "remove" : "add";
+	int k = i / 16;
+	char *text = NULL;
+	const char *subsystem = NULL;
+	bool udev = false;
+
+	switch (i % 8) {
+	case 0:
+		subsystem = "usb";
+		text = mem_printf("%s@/devices/pci0000:00/0000:00:14.0/usb1/1-%d\nACTION=%s\n"
+				  "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-%d\n"
+				  "SUBSYSTEM=usb\nMAJOR=189\nMINOR=%d\nDEVNAME=bus/usb/001/%03d\n"
+				  "DEVTYPE=usb_device\nPRODUCT=1050/407/543\nTYPE=0/0/0\n"
+				  "BUSNUM=001\nDEVNUM=%03d\nSEQNUM=%d\n",
+				  action, k % 16, action, k % 16, k % 128, k % 128, k % 128, i);
+		break;
+	case 1:
+		subsystem = "block";
+		text = mem_printf("%s@/devices/virtual/block/loop%d\nACTION=%s\n"
+				  "DEVPATH=/devices/virtual/block/loop%d\nSUBSYSTEM=block\n"
+				  "MAJOR=7\nMINOR=%d\nDEVNAME=loop%d\nDEVTYPE=disk\nDISKSEQ=%d\n"
+				  "SEQNUM=%d\n",
+				  action, k % 256, action, k % 256, k % 256, k % 256, k, i);
+		break;
+	case 2:
+		subsystem = "net";
+		text = mem_printf("%s@/devices/virtual/net/veth%d\nACTION=%s\n"
+				  "DEVPATH=/devices/virtual/net/veth%d\nSUBSYSTEM=net\n"
+				  "INTERFACE=veth%d\nIFINDEX=%d\nSEQNUM=%d\n",
+				  action, k, action, k, k, k + 10, i);
+		break;
+	case 3:
+		subsystem = "input";
+		text = mem_printf("%s@/devices/virtual/input/input%d/event%d\nACTION=%s\n"
+				  "DEVPATH=/devices/virtual/input/input%d/event%d\n"
+				  "SUBSYSTEM=input\nMAJOR=13\nMINOR=%d\nDEVNAME=input/event%d\n"
+				  "SEQNUM=%d\n",
+				  action, k, k % 32, action, k, k % 32, 64 + k % 32, k % 32, i);
+		break;
+	case 4:
+		subsystem = "tty";
+		text = mem_printf("%s@/devices/virtual/tty/ttyS%d\nACTION=%s\n"
+				  "DEVPATH=/devices/virtual/tty/ttyS%d\nSUBSYSTEM=tty\nMAJOR=4\n"
+				  "MINOR=%d\nDEVNAME=ttyS%d\nSEQNUM=%d\n",
+				  action, k % 32, action, k % 32, 64 + k % 32, k % 32, i);
+		break;
+	case 5:
+		// dropped by the socket filter in cmld, parsed and ignored here
+		subsystem = "bind";
+		text = mem_printf("bind@/devices/pci0000:00/0000:00:14.0/usb1/1-%d/1-%d:1.0\n"
+				  "ACTION=bind\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-%d/"
+				  "1-%d:1.0\nSUBSYSTEM=usb\nDEVTYPE=usb_interface\nDRIVER=usbhid\n"
+				  "PRODUCT=1050/407/543\nINTERFACE=3/0/0\nSEQNUM=%d\n",
+				  k % 16, k % 16, k % 16, k % 16, i);
+		break;
+	case 6:
+		// coldboot uevent triggered for the first container
+		subsystem = "synth";
+		text = mem_printf("%s@/devices/virtual/misc/tun\nACTION=%s\n"
+				  "DEVPATH=/devices/virtual/misc/tun\nSUBSYSTEM=misc\nMAJOR=10\n"
+				  "MINOR=200\nDEVNAME=net/tun\nSYNTH_UUID=%s\nSEQNUM=%d\n",
+				  action, action,
+				  uevent_bench_containers_count ?
+					  uuid_string(uevent_bench_containers[0].uuid) :
+					  "0",
+				  i);
+		break;
+	default:
+		subsystem = "udev";
+		udev = true;
+		text = mem_printf("ACTION=%s\nDEVPATH=/devices/virtual/block/loop%d\n"
+				  "SUBSYSTEM=block\nDEVNAME=/dev/loop%d\nDEVTYPE=disk\nMAJOR=7\n"
+				  "MINOR=%d\nSEQNUM=%d\nUSEC_INITIALIZED=%d\nID_FS_TYPE=ext4\n",
+				  action, k % 256, k % 256, k % 256, i, i);
+		break;
+	}
+
+	uevent_bench_event_t *ev = uevent_bench_event_new(subsystem, udev, text);
+	mem_free(text);
+	return ev;
+}
+
+/*
+ * Reads uevents recorded with 'udevadm monitor --kernel --udev --property'.
+ * Each uevent starts with a "KERNEL[...]" or "UDEV [...]" line followed by
+ * its properties up to an empty line.
+ */
+static list_t *
+uevent_bench_events_read(const char *file)
+{
+	FILE *f = fopen(file, "r");
+	IF_NULL_RETVAL_ERROR(f, NULL);
+
+	list_t *events = NULL;
+	char line[4096];
+	str_t *props = NULL;
+	char *action = NULL, *devpath = NULL, *subsystem = NULL;
+	bool udev = false;
+
+	for (bool eof = false; !eof;) {
+		eof = !fgets(line, sizeof(line), f);
+		line[strcspn(line, "\n")] = '\0';
+
+		if (!eof && !props) {
+			if (!strncmp(line, "KERNEL[", 7) || !strncmp(line, "UDEV", 4)) {
+				udev = !strncmp(line, "UDEV", 4);
+				props = str_new(NULL);
+			}
+			continue;
+		}
+		if (!eof && *line) {
+			char *value = strchr(line, '=');
+			if (!value)
+				continue;
+			str_append_printf(props, "%s\n", line);
+			if (!strncmp(line, "ACTION=", 7))
+				action = mem_strdup(value + 1);
+			else if (!strncmp(line, "DEVPATH=", 8))
+				devpath = mem_strdup(value + 1);
+			else if (!strncmp(line, "SUBSYSTEM=", 10))
+				subsystem = mem_strdup(value + 1);
+			continue;
+		}
+		if (!props)
+			continue;
+
+		if (action && devpath) {
+			char *text = udev ? mem_strdup(str_buffer(props)) :
+					    mem_printf("%s@%s\n%s", action, devpath,
+						       str_buffer(props));
+			char *name = mem_printf("%s%s", udev ? "udev:" : "",
+						subsystem ? subsystem : "none");
+			events = list_append(events, uevent_bench_event_new(name, udev, text));
+			mem_free(name);
+			mem_free(text);
+		}
+		str_free(props, true);
+		props = NULL;
+		mem_free(action);
+		mem_free(devpath);
+		mem_free(subsystem);
+		action = devpath = subsystem = NULL;
+	}
+
+	fclose(f);
+	return events;
+}
+
+static uevent_bench_series_t *
+uevent_bench_series_get(list_t **series, const char *name)
+{
+	for (list_t *l = *series; l; l = l->next) {
+		uevent_bench_series_t *s = l->data;
+		if (!strcmp(s->name, name))
+			return s;
+	}
+
+	uevent_bench_series_t *s = mem_new0(uevent_bench_series_t, 1);
+	s->name = mem_strdup(name);
+	*series = list_append(*series, s);
+	return s;
+}
+
+static void
+uevent_bench_series_add(uevent_bench_series_t *s, uint64_t ns, uint64_t allocs)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? 2 * s->size : 1024;
+		s->values_ns = mem_renew(uint64_t, s->values_ns, s->size);
+	}
+	s->values_ns[s->n++] = ns;
+	s->allocs += allocs;
+}
+
+static int
+uevent_bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double
+uevent_bench_percentile_us(const uevent_bench_series_t *s, int p)
+{
+	// nearest rank of the sorted values
+	size_t rank = (s->n * p + 99) / 100;
+	return s->values_ns[rank ? rank - 1 : 0] / 1e3;
+}
+
+/*
+ * Writes all events into the socketpair and lets uevent_handle() drain it
+ * whenever the socket is full, i.e. with as large batches as a storm yields.
+ */
+static void
+uevent_bench_storm(uevent_bench_event_t **events, int n, int fd, uint64_t *handle_ns,
+		   int *wakeups)
+{
+	*handle_ns = 0;
+	*wakeups = 0;
+
+	for (int i = 0; i <= n; i++) {
+		if (i < n && send(fd, events[i]->buf, events[i]->len, MSG_DONTWAIT) >= 0)
+			continue;
+		if (i < n && errno != EAGAIN && errno != EWOULDBLOCK)
+			FATAL_ERRNO("Could not send uevent %d", i);
+
+		uint64_t start = uevent_bench_now_ns();
+		uevent_handle(uevent_bench_fd, EVENT_IO_READ, NULL, NULL);
+		*handle_ns += uevent_bench_now_ns() - start;
+		(*wakeups)++;
+
+		// retry the uevent which did not fit into the socket
+		if (i < n)
+			i--;
+	}
+}
+
+/*
+ * Feeds randomly mutated copies of the events into the parser. Crashes or
+ * sanitizer reports are the result, the handling itself is not checked.
+ */
+static void
+uevent_bench_fuzz(uevent_bench_event_t **events, int n, int iterations, unsigned seed)
+{
+	char *buf = mem_alloc(UEVENT_BATCH_BUF_LEN);
+	srand(seed);
+
+	for (int it = 0; it < iterations; it++) {
+		const uevent_bench_event_t *ev = events[rand() % n];
+		size_t len = MIN(ev->len, (size_t)UEVENT_BATCH_BUF_LEN);
+		memcpy(buf, ev->buf, len);
+
+		for (int m = rand() % 4 + 1; m > 0; m--) {
+			size_t pos = rand() % len;
+			switch (rand() % 6) {
+			case 0:
+				buf[pos] ^= 1 << (rand() % 8);
+				break;
+			case 1:
+				buf[pos] = '\0';
+				break;
+			case 2:
+				buf[pos] = '=';
+				break;
+			case 3:
+				buf[pos] = (char)rand();
+				break;
+			case 4:
+				len = pos + 1;
+				break;
+			default:
+				// random header of a udev message
+				if (len >= sizeof(struct udev_monitor_netlink_header)) {
+					struct udev_monitor_netlink_header *nlh = (void *)buf;
+					memcpy(nlh->prefix, UDEV_MONITOR_TAG,
+					       sizeof(UDEV_MONITOR_TAG));
+					nlh->magic = htonl(UDEV_MONITOR_MAGIC);
+					nlh->properties_off = (rand() % 2) ? (unsigned)rand() :
+									     UINT_MAX - rand() % 64;
+				}
+				break;
+			}
+		}
+		uevent_handle_msg(buf, len);
+		uevent_inject_flush();
+	}
+
+	mem_free(buf);
+}
+
+static void
+print_usage(const char *cmd)
+{
+	printf("\n");
+	printf("Usage: %s [-n <events>] [-c <containers>] [-f <iterations>] [-s <seed>] [-v] "
+	       "[<recorded uevents>]\n",
+	       cmd);
+	printf("\n"
+	       "Replays a storm of <events> synthetic uevents (default 100000), or the uevents\n"
+	       "recorded with 'udevadm monitor --kernel --udev --property' repeatedly, into the\n"
+	       "uevent handling of cmld with <containers> stubbed containers (default 4) and\n"
+	       "reports throughput, latency and heap allocations per subsystem as JSON.\n"
+	       "Afterwards <iterations> mutated uevents (default 100000) are fed into the parser.\n"
+	       "-v logs the uevent handling to stderr.\n\n");
+	exit(-1);
+}
+
+static const struct option global_options[] = { { "events", required_argument, 0, 'n' },
+						{ "containers", required_argument, 0, 'c' },
+						{ "fuzz", required_argument, 0, 'f' },
+						{ "seed", required_argument, 0, 's' },
+						{ "verbose", no_argument, 0, 'v' },
+						{ "help", no_argument, 0, 'h' },
+						{ 0, 0, 0, 0 } };
+
+int
+main(int argc, char *argv[])
+{
+	int n = 100000, fuzz = 100000;
+	unsigned seed = time(NULL);
+	uevent_bench_containers_count = 4;
+
+	for (int c, option_index = 0;
+	     - 1 != (c = getopt_long(argc, argv, "+n:c:f:s:vh", global_options, &option_index));) {
+		switch (c) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'c':
+			uevent_bench_containers_count = atoi(optarg);
+			break;
+		case 'f':
+			fuzz = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			logf_register(&logf_test_write, stderr);
+			break;
+		default: // includes cases 'h' and '?'
+			print_usage(argv[0]);
+		}
+	}
+	if (n <= 0 || fuzz < 0 || uevent_bench_containers_count < 0)
+		print_usage(argv[0]);
+
+	uevent_bench_containers = mem_new0(container_t, uevent_bench_containers_count);
+	for (int i = 0; i < uevent_bench_containers_count; i++) {
+		container_t *c = &uevent_bench_containers[i];
+		char *uuid = mem_printf("00000000-0000-0000-0000-%012d", i);
+		c->name = mem_printf("bench%d", i);
+		c->uuid = uuid_new(uuid);
+		c->state = CONTAINER_STATE_RUNNING;
+		mem_free(uuid);
+	}
+
+	list_t *recorded = NULL;
+	if (optind < argc) {
+		recorded = uevent_bench_events_read(argv[optind]);
+		if (!recorded)
+			FATAL("No uevents found in %s", argv[optind]);
+	}
+
+	// the replayed storm, recorded uevents are repeated up to n
+	uevent_bench_event_t **events = mem_new0(uevent_bench_event_t *, n);
+	list_t *r = recorded;
+	for (int i = 0; i < n; i++) {
+		if (recorded) {
+			uevent_bench_event_t *ev = r->data;
+			events[i] = mem_new0(uevent_bench_event_t, 1);
+			events[i]->subsystem = mem_strdup(ev->subsystem);
+			events[i]->buf = (char *)mem_memcpy((unsigned char *)ev->buf, ev->len);
+			events[i]->len = ev->len;
+			r = r->next ? r->next : recorded;
+		} else {
+			events[i] = uevent_bench_event_synth_new(i);
+		}
+	}
+
+	// replaces the netlink socket set up by uevent_init()
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+		FATAL_ERRNO("Could not create socketpair");
+	int sndbuf = UEVENT_BENCH_SNDBUF;
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	uevent_bench_fd = sv[0];
+
+	uevent_buf = mem_new0(struct uevent, 1);
+	for (int i = 0; i < UEVENT_BATCH_LEN; i++)
+		uevent_batch_bufs[i] = mem_alloc(UEVENT_BATCH_BUF_LEN);
+	uevent_arena = mem_arena_new(4096);
+
+	// storm through the socketpair
+	uint64_t handle_ns;
+	int wakeups;
+	uevent_bench_allocs = 0;
+	uevent_bench_count_allocs = true;
+	uint64_t start = uevent_bench_now_ns();
+	uevent_bench_storm(events, n, sv[1], &handle_ns, &wakeups);
+	uint64_t wall_ns = uevent_bench_now_ns() - start;
+	uevent_bench_count_allocs = false;
+	uint64_t storm_allocs = uevent_bench_allocs;
+
+	// latency of each single uevent by subsystem
+	list_t *series = NULL;
+	for (int i = 0; i < n; i++) {
+		uevent_bench_series_t *s = uevent_bench_series_get(&series, events[i]->subsystem);
+		uevent_bench_allocs = 0;
+		uevent_bench_count_allocs = true;
+		uint64_t t = uevent_bench_now_ns();
+		uevent_handle_msg(events[i]->buf, events[i]->len);
+		uevent_inject_flush();
+		t = uevent_bench_now_ns() - t;
+		uevent_bench_count_allocs = false;
+		uevent_bench_series_add(s, t, uevent_bench_allocs);
+	}
+
+	start = uevent_bench_now_ns();
+	uevent_bench_fuzz(events, n, fuzz, seed);
+	uint64_t fuzz_ns = uevent_bench_now_ns() - start;
+
+	printf("{\n  \"events\": %d,\n  \"containers\": %d,\n", n,
+	       uevent_bench_containers_count);
+	printf("  \"storm\": { \"wall_s\": %.3f, \"handle_s\": %.3f, \"events_per_s\": %.0f, "
+	       "\"wakeups\": %d, \"allocs_per_event\": %.2f },\n",
+	       wall_ns / 1e9, handle_ns / 1e9, n / (handle_ns / 1e9), wakeups,
+	       (double)storm_allocs / n);
+	printf("  \"subsystems\": {");
+	for (list_t *l = series; l; l = l->next) {
+		uevent_bench_series_t *s = l->data;
+		qsort(s->values_ns, s->n, sizeof(uint64_t), uevent_bench_cmp_u64);
+		printf("%s\n    \"%s\": { \"count\": %zu, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+		       "\"p99_us\": %.2f, \"max_us\": %.2f, \"allocs_per_event\": %.2f }",
+		       l == series ? "" : ",", s->name, s->n, uevent_bench_percentile_us(s, 50),
+		       uevent_bench_percentile_us(s, 90), uevent_bench_percentile_us(s, 99),
+		       s->values_ns[s->n - 1] / 1e3, (double)s->allocs / s->n);
+	}
+	printf("\n  },\n  \"fuzz\": { \"iterations\": %d, \"seed\": %u, \"wall_s\": %.3f }\n}\n",
+	       fuzz, seed, fuzz_ns / 1e9);
+
+	for (list_t *l = series; l; l = l->next) {
+		uevent_bench_series_t *s = l->data;
+		mem_free(s->name);
+		mem_free(s->values_ns);
+		mem_free(s);
+	}
+	list_delete(series);
+	for (int i = 0; i < n; i++)
+		uevent_bench_event_free(events[i]);
+	mem_free(events);
+	for (list_t *l = recorded; l; l = l->next)
+		uevent_bench_event_free(l->data);
+	list_delete(recorded);
+	for (int i = 0; i < uevent_bench_containers_count; i++) {
+		mem_free(uevent_bench_containers[i].name);
+		uuid_free(uevent_bench_containers[i].uuid);
+	}
+	mem_free(uevent_bench_containers);
+	close(sv[0]);
+	close(sv[1]);
+
+	return 0;
+}
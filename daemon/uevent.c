@@ -27,26 +27,35 @@
 
 #include "uevent.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <sched.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <libgen.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
 
 #include "cmld.h"
 #include "container.h"
 #include "common/event.h"
 #include "common/fd.h"
+#include "common/hashmap.h"
 #include "common/file.h"
 #include "common/dir.h"
 #include "common/macro.h"
+#include "common/probe.h"
 #include "common/mem.h"
 #include "common/network.h"
 #include "common/nl.h"
+#include "common/ns.h"
 #include "common/proc.h"
 #include "common/str.h"
 
@@ -57,11 +66,83 @@
 static nl_sock_t *uevent_netlink_sock = NULL;
 static event_io_t *uevent_io_event = NULL;
 
-// track usb devices mapped to containers
-static list_t *uevent_container_dev_mapping_list = NULL;
-//
-// track net devices mapped to containers
-static list_t *uevent_container_netdev_mapping_list = NULL;
+// temporaries of a single uevent, released after it has been handled
+static mem_arena_t *uevent_arena = NULL;
+// receive buffer reused for all uevents
+static struct uevent *uevent_buf = NULL;
+
+// uevents received with a single recvmmsg, larger (udev) messages are discarded as truncated
+#define UEVENT_BATCH_LEN 16
+#define UEVENT_BATCH_BUF_LEN (8 * 1024)
+static char *uevent_batch_bufs[UEVENT_BATCH_LEN];
+
+/*
+ * uevents to be injected into the netns of a container, collected while the
+ * netlink socket is drained and injected by uevent_inject_flush()
+ */
+typedef struct {
+	size_t len;
+	char buf[];
+} uevent_inject_msg_t;
+
+typedef struct {
+	container_t *container;
+	pid_t pid;
+	bool userns;
+	list_t *msgs;
+} uevent_inject_batch_t;
+
+static list_t *uevent_inject_batches = NULL;
+
+/*
+ * Helper process per running container, which stays in the netns (and userns)
+ * of the container and injects the uevents it receives, one per packet.
+ */
+typedef struct {
+	const container_t *container;
+	pid_t pid;
+	int fd; // SOCK_SEQPACKET, the helper exits on eof
+} uevent_helper_t;
+
+static list_t *uevent_helpers = NULL;
+
+// only these kernel uevents pass the socket filter, everything else is ignored anyway
+static const char *const uevent_filter_actions[] = { "add", "remove", "change", NULL };
+
+/*
+ * Track usb devices mapped to containers. The mappings are indexed by
+ * "vendor:product:serial" for add events and by "major:minor" of the bound
+ * device node for remove events, so that hotplug events do not scan all
+ * mappings of all containers.
+ */
+static hashmap_t *uevent_usbdev_id_index = NULL;
+static hashmap_t *uevent_usbdev_devnum_index = NULL;
+
+// track net devices mapped to containers, indexed by mac address
+static hashmap_t *uevent_netdev_mac_index = NULL;
+
+/*
+ * Device database of all devices with a device node, indexed by DEVPATH. It is
+ * populated from sysfs once by uevent_init() and kept current by the add and
+ * remove uevents, thus the coldboot of a container replays synthesized uevents
+ * from memory instead of walking /sys/devices.
+ */
+typedef struct {
+	char *devpath;
+	char *subsystem;
+	char *devname;
+	char *devtype; // NULL if the device has none
+	int major;
+	int minor;
+} uevent_db_dev_t;
+
+static hashmap_t *uevent_db = NULL;
+
+// bucket of an index, holds all mappings with the same key
+typedef struct {
+	char *key;
+	list_t *mappings;
+} uevent_index_bucket_t;
 
 #define UDEV_MONITOR_TAG "libudev"
 #define UDEV_MONITOR_MAGIC 0xfeedcafe
@@ -240,6 +321,94 @@ uevent_container_netdev_mapping_free(uevent_container_netdev_mapping_t *mapping)
 	mem_free(mapping);
 }
 
+static char *
+uevent_usbdev_id_key_new(uint16_t id_vendor, uint16_t id_product, const char *i_serial)
+{
+	return mem_printf("%04x:%04x:%s", id_vendor, id_product, i_serial ? i_serial : "");
+}
+
+static char *
+uevent_usbdev_devnum_key_new(int major, int minor)
+{
+	return mem_printf("%d:%d", major, minor);
+}
+
+static list_t *
+uevent_index_get(const hashmap_t *index, const char *key)
+{
+	IF_NULL_RETVAL(index, NULL);
+
+	uevent_index_bucket_t *bucket = hashmap_get(index, key);
+	return bucket ? bucket->mappings : NULL;
+}
+
+static void
+uevent_index_add(hashmap_t **index, const char *key, void *mapping)
+{
+	if (!*index)
+		*index = hashmap_new_str();
+
+	uevent_index_bucket_t *bucket = hashmap_get(*index, key);
+	if (!bucket) {
+		bucket = mem_new0(uevent_index_bucket_t, 1);
+		bucket->key = mem_strdup(key);
+		hashmap_put(*index, bucket->key, bucket);
+	}
+	bucket->mappings = list_append(bucket->mappings, mapping);
+}
+
+static void
+uevent_index_remove(hashmap_t *index, const char *key, void *mapping)
+{
+	IF_NULL_RETURN(index);
+
+	uevent_index_bucket_t *bucket = hashmap_get(index, key);
+	IF_NULL_RETURN(bucket);
+
+	bucket->mappings = list_remove(bucket->mappings, mapping);
+	if (bucket->mappings)
+		return;
+
+	hashmap_remove(index, key);
+	mem_free(bucket->key);
+	mem_free(bucket);
+}
+
+// frees the buckets of index, the mappings have to be freed by the caller
+static void
+uevent_index_free(hashmap_t **index)
+{
+	IF_NULL_RETURN(*index);
+
+	size_t iter = 0;
+	const void *key;
+	void *value;
+	while (hashmap_next(*index, &iter, &key, &value)) {
+		uevent_index_bucket_t *bucket = value;
+		list_delete(bucket->mappings);
+		mem_free(bucket->key);
+		mem_free(bucket);
+	}
+	hashmap_free(*index);
+	*index = NULL;
+}
+
+static void
+uevent_usbdev_devnum_index_add(uevent_container_dev_mapping_t *mapping)
+{
+	char *key = uevent_usbdev_devnum_key_new(mapping->usbdev->major, mapping->usbdev->minor);
+	uevent_index_add(&uevent_usbdev_devnum_index, key, mapping);
+	mem_free(key);
+}
+
+static void
+uevent_usbdev_devnum_index_remove(uevent_container_dev_mapping_t *mapping)
+{
+	char *key = uevent_usbdev_devnum_key_new(mapping->usbdev->major, mapping->usbdev->minor);
+	uevent_index_remove(uevent_usbdev_devnum_index, key, mapping);
+	mem_free(key);
+}
+
 static void
 uevent_trace(struct uevent *uevent, char *raw_p)
 {
@@ -253,6 +422,58 @@ uevent_trace(struct uevent *uevent, char *raw_p)
 	}
 }
 
+typedef enum {
+	UEVENT_FIELD_NONE = 0,
+	UEVENT_FIELD_ACTION,
+	UEVENT_FIELD_DEVPATH,
+	UEVENT_FIELD_SUBSYSTEM,
+	UEVENT_FIELD_MAJOR,
+	UEVENT_FIELD_MINOR,
+	UEVENT_FIELD_DEVNAME,
+	UEVENT_FIELD_DEVTYPE,
+	UEVENT_FIELD_DRIVER,
+	UEVENT_FIELD_PRODUCT,
+	UEVENT_FIELD_ID_VENDOR_ID,
+	UEVENT_FIELD_ID_MODEL_ID,
+	UEVENT_FIELD_ID_SERIAL_SHORT,
+	UEVENT_FIELD_INTERFACE,
+	UEVENT_FIELD_SYNTH_UUID,
+} uevent_field_t;
+
+typedef struct {
+	const char *name;
+	size_t len;
+	uevent_field_t field;
+} uevent_key_t;
+
+/*
+ * Perfect hash over the uevent keys cmld is interested in, which maps each of
+ * them to its own slot of uevent_keys. Any other key must still be compared
+ * against the single candidate of its slot. The hash has to be checked for
+ * collisions whenever a key is added.
+ */
+#define UEVENT_KEY_HASH(key, len)                                                                  \
+	((((len)*10) + (unsigned char)(key)[2] + (unsigned char)(key)[(len)-2]) & 31)
+
+#define UEVENT_KEY(hash, str, f) [hash] = { .name = str, .len = sizeof(str) - 1, .field = f }
+
+static const uevent_key_t uevent_keys[32] = {
+	UEVENT_KEY(0, "ID_VENDOR_ID", UEVENT_FIELD_ID_VENDOR_ID),
+	UEVENT_KEY(1, "SUBSYSTEM", UEVENT_FIELD_SUBSYSTEM),
+	UEVENT_KEY(7, "ID_SERIAL_SHORT", UEVENT_FIELD_ID_SERIAL_SHORT),
+	UEVENT_KEY(9, "DEVNAME", UEVENT_FIELD_DEVNAME),
+	UEVENT_KEY(10, "DRIVER", UEVENT_FIELD_DRIVER),
+	UEVENT_KEY(11, "MAJOR", UEVENT_FIELD_MAJOR),
+	UEVENT_KEY(12, "DEVTYPE", UEVENT_FIELD_DEVTYPE),
+	UEVENT_KEY(15, "MINOR", UEVENT_FIELD_MINOR),
+	UEVENT_KEY(16, "DEVPATH", UEVENT_FIELD_DEVPATH),
+	UEVENT_KEY(17, "INTERFACE", UEVENT_FIELD_INTERFACE),
+	UEVENT_KEY(22, "ID_MODEL_ID", UEVENT_FIELD_ID_MODEL_ID),
+	UEVENT_KEY(24, "PRODUCT", UEVENT_FIELD_PRODUCT),
+	UEVENT_KEY(27, "SYNTH_UUID", UEVENT_FIELD_SYNTH_UUID),
+	UEVENT_KEY(31, "ACTION", UEVENT_FIELD_ACTION),
+};
+
 static void
 uevent_parse(struct uevent *uevent, char *raw_p)
 {
@@ -279,48 +500,59 @@ uevent_parse(struct uevent *uevent, char *raw_p)
 	 * struct to point into the buffer at the correct locations */
 	// TODO check if running out of the buffer
 	while (*raw_p) {
-		if (!strncmp(raw_p, "ACTION=", 7)) {
-			raw_p += 7;
-			uevent->action = raw_p;
-		} else if (!strncmp(raw_p, "DEVPATH=", 8)) {
-			raw_p += 8;
-			uevent->devpath = raw_p;
-		} else if (!strncmp(raw_p, "SUBSYSTEM=", 10)) {
-			raw_p += 10;
-			uevent->subsystem = raw_p;
-		} else if (!strncmp(raw_p, "MAJOR=", 6)) {
-			raw_p += 6;
-			uevent->major = atoi(raw_p);
-		} else if (!strncmp(raw_p, "MINOR=", 6)) {
-			raw_p += 6;
-			uevent->minor = atoi(raw_p);
-		} else if (!strncmp(raw_p, "DEVNAME=", 8)) {
-			raw_p += 8;
-			uevent->devname = raw_p;
-		} else if (!strncmp(raw_p, "DEVTYPE=", 8)) {
-			raw_p += 8;
-			uevent->devtype = raw_p;
-		} else if (!strncmp(raw_p, "DRIVER=", 7)) {
-			raw_p += 7;
-			uevent->driver = raw_p;
-		} else if (!strncmp(raw_p, "PRODUCT=", 8)) {
-			raw_p += 8;
-			uevent->product = raw_p;
-		} else if (!strncmp(raw_p, "ID_VENDOR_ID=", 13)) {
-			raw_p += 13;
-			sscanf(raw_p, "%hx", &uevent->id_vendor_id);
-		} else if (!strncmp(raw_p, "ID_MODEL_ID=", 12)) {
-			raw_p += 12;
-			sscanf(raw_p, "%hx", &uevent->id_model_id);
-		} else if (!strncmp(raw_p, "ID_SERIAL_SHORT=", 16)) {
-			raw_p += 16;
-			uevent->id_serial_short = raw_p;
-		} else if (!strncmp(raw_p, "INTERFACE=", 10)) {
-			raw_p += 10;
-			uevent->interface = raw_p;
-		} else if (!strncmp(raw_p, "SYNTH_UUID=", 11)) {
-			raw_p += 11;
-			uevent->synth_uuid = raw_p;
+		char *value = strchr(raw_p, '=');
+		size_t len = value ? (size_t)(value - raw_p) : 0;
+		const uevent_key_t *key =
+			(len >= 3) ? &uevent_keys[UEVENT_KEY_HASH(raw_p, len)] : NULL;
+
+		if (key && key->len == len && !memcmp(raw_p, key->name, len)) {
+			raw_p = value + 1;
+			switch (key->field) {
+			case UEVENT_FIELD_ACTION:
+				uevent->action = raw_p;
+				break;
+			case UEVENT_FIELD_DEVPATH:
+				uevent->devpath = raw_p;
+				break;
+			case UEVENT_FIELD_SUBSYSTEM:
+				uevent->subsystem = raw_p;
+				break;
+			case UEVENT_FIELD_MAJOR:
+				uevent->major = atoi(raw_p);
+				break;
+			case UEVENT_FIELD_MINOR:
+				uevent->minor = atoi(raw_p);
+				break;
+			case UEVENT_FIELD_DEVNAME:
+				uevent->devname = raw_p;
+				break;
+			case UEVENT_FIELD_DEVTYPE:
+				uevent->devtype = raw_p;
+				break;
+			case UEVENT_FIELD_DRIVER:
+				uevent->driver = raw_p;
+				break;
+			case UEVENT_FIELD_PRODUCT:
+				uevent->product = raw_p;
+				break;
+			case UEVENT_FIELD_ID_VENDOR_ID:
+				sscanf(raw_p, "%hx", &uevent->id_vendor_id);
+				break;
+			case UEVENT_FIELD_ID_MODEL_ID:
+				sscanf(raw_p, "%hx", &uevent->id_model_id);
+				break;
+			case UEVENT_FIELD_ID_SERIAL_SHORT:
+				uevent->id_serial_short = raw_p;
+				break;
+			case UEVENT_FIELD_INTERFACE:
+				uevent->interface = raw_p;
+				break;
+			case UEVENT_FIELD_SYNTH_UUID:
+				uevent->synth_uuid = raw_p;
+				break;
+			default:
+				break;
+			}
 		}
 
 		/* advance to after the next \0 */
@@ -373,8 +605,9 @@ uevent_replace_member(const struct uevent *uevent, char *oldmember, char *newmem
 	size_t off_after_old = off_member + strlen(oldmember) + 1;
 	size_t off_after_new = off_member + strlen(newmember) + 1;
 
+	// the old member may be the last one and not be terminated inside of msg_len
 	if (!memcpy(newevent->msg.raw + off_after_new, uevent->msg.raw + off_after_old,
-		    uevent->msg_len - off_after_old)) {
+		    uevent->msg_len > off_after_old ? uevent->msg_len - off_after_old : 0)) {
 		ERROR("Failed to copy remainder of uevent");
 		goto error;
 	}
@@ -517,14 +750,62 @@ uevent_get_usb_product(struct uevent *uevent)
 	return id_product;
 }
 
+/*
+ * Sends a raw uevent to the uevent netlink socket of the current netns
+ * and waits for its acknowledgment.
+ */
+static int
+uevent_inject_msg(nl_sock_t *target, const char *buf, size_t len)
+{
+	int ret = -1;
+	nl_msg_t *nl_msg = nl_msg_new();
+	if (NULL == nl_msg)
+		FATAL_ERRNO("Could not allocate nl_msg!");
+	if (nl_msg_set_type(nl_msg, UEVENT_SEND) < 0)
+		FATAL("Could not set type UEVENT_SEND of nl_msg!");
+	if (nl_msg_set_flags(nl_msg, NLM_F_ACK | NLM_F_REQUEST))
+		FATAL("Could not set flages for acked request of nl_msg!");
+	if (nl_msg_set_buf_unaligned(nl_msg, (char *)buf, len) < 0)
+		FATAL_ERRNO("Could not add uevent to nl_msg!");
+
+	if (nl_msg_send_kernel(target, nl_msg) < 0)
+		WARN_ERRNO("Could not inject uevent!");
+	else if (nl_msg_receive_and_check_kernel(target))
+		WARN_ERRNO("Could not verify resp to injected uevent!");
+	else
+		ret = 0;
+
+	nl_msg_free(nl_msg);
+	return ret;
+}
+
+/*
+ * Joins the netns (and userns) of the process referred to by pidfd/netns_pid and
+ * connects to its uevent netlink socket. Only to be called in a forked child.
+ */
+static nl_sock_t *
+uevent_join_netns(int pidfd, pid_t netns_pid, bool join_userns)
+{
+	int namespaces = join_userns ? CLONE_NEWNET | CLONE_NEWUSER : CLONE_NEWNET;
+	if (ns_join_pidfd(pidfd, netns_pid, namespaces) < 0)
+		FATAL("Could not join network namespace of pid %d!", netns_pid);
+	if (join_userns && namespace_setuid0() < 0)
+		FATAL("Could not become root in user namespace of pid %d!", netns_pid);
+
+	nl_sock_t *target = nl_sock_uevent_new(0);
+	if (NULL == target)
+		FATAL("Could not connect to nl socket!");
+	return target;
+}
+
 /**
  * This function forks a new child in the target netns (and userns) of netns_pid
  * in which the uevents should be injected. In the child the UEVENT netlink socket
- * is connected and a new message containing the raw uevent will be created and
- * sent to that socket.
+ * is connected and for each raw uevent in msgs (uevent_inject_msg_t) a new message
+ * will be created and sent to that socket.
  */
 static int
-uevent_inject_into_netns(char *uevent, size_t size, pid_t netns_pid, bool join_userns)
+uevent_inject_into_netns(const list_t *msgs, int pidfd, pid_t netns_pid, bool join_userns)
 {
 	int status;
 	pid_t pid = fork();
@@ -533,50 +814,16 @@ uevent_inject_into_netns(char *uevent, size_t size, pid_t netns_pid, bool join_u
 		ERROR_ERRNO("Could not fork for switching to netns of %d", netns_pid);
 		return -1;
 	} else if (pid == 0) {
-		if (join_userns) {
-			char *usrns = mem_printf("/proc/%d/ns/user", netns_pid);
-			int usrns_fd = open(usrns, O_RDONLY);
-			if (usrns_fd == -1)
-				FATAL_ERRNO("Could not open userns file %s!", usrns);
-			mem_free(usrns);
-			if (setns(usrns_fd, CLONE_NEWUSER) == -1)
-				FATAL_ERRNO("Could not join uesr namespace of pid %d!", netns_pid);
-			if (setuid(0) < 0)
-				FATAL_ERRNO("Could setuid to root in user namespace of pid %d!",
-					    netns_pid);
-			if (setgid(0) < 0)
-				FATAL_ERRNO("Could setgid to root in user namespace of pid %d!",
-					    netns_pid);
-			if (setgroups(0, NULL) < 0)
-				FATAL_ERRNO("Could setgroups to root in user namespace of pid %d!",
-					    netns_pid);
+		nl_sock_t *target = uevent_join_netns(pidfd, netns_pid, join_userns);
+		int failed = 0;
+		for (const list_t *l = msgs; l; l = l->next) {
+			const uevent_inject_msg_t *msg = l->data;
+			// a failed uevent does not prevent the injection of the following ones
+			if (uevent_inject_msg(target, msg->buf, msg->len) < 0)
+				failed++;
 		}
-		char *netns = mem_printf("/proc/%d/ns/net", netns_pid);
-		int netns_fd = open(netns, O_RDONLY);
-		if (netns_fd == -1)
-			FATAL_ERRNO("Could not open netns file %s!", netns);
-		mem_free(netns);
-		if (setns(netns_fd, CLONE_NEWNET) == -1)
-			FATAL_ERRNO("Could not join network namespace of pid %d!", netns_pid);
-		nl_sock_t *target = nl_sock_uevent_new(0);
-		if (NULL == target)
-			FATAL("Could not connect to nl socket!");
-		nl_msg_t *nl_msg = nl_msg_new();
-		if (NULL == nl_msg)
-			FATAL_ERRNO("Could not allocate nl_msg!");
-		if (nl_msg_set_type(nl_msg, UEVENT_SEND) < 0)
-			FATAL("Could not set type UEVENT_SEND of nl_msg!");
-		if (nl_msg_set_flags(nl_msg, NLM_F_ACK | NLM_F_REQUEST))
-			FATAL("Could not set flages for acked request of nl_msg!");
-		if (nl_msg_set_buf_unaligned(nl_msg, uevent, size) < 0)
-			FATAL_ERRNO("Could not add uevent to nl_msg!");
-		if (nl_msg_send_kernel(target, nl_msg) < 0)
-			FATAL_ERRNO("Could not inject uevent!");
-		if (nl_msg_receive_and_check_kernel(target))
-			FATAL_ERRNO("Could not verify resp to injected uevent!");
 		nl_sock_free(target);
-		nl_msg_free(nl_msg);
-		exit(0);
+		exit(failed ? 1 : 0);
 	} else {
 		if (waitpid(pid, &status, 0) != pid) {
 			ERROR_ERRNO("Could not waitpid for '%d'", pid);
@@ -589,6 +836,163 @@ uevent_inject_into_netns(char *uevent, size_t size, pid_t netns_pid, bool join_u
 	return -1;
 }
 
+static uevent_helper_t *
+uevent_helper_get(const container_t *container)
+{
+	for (list_t *l = uevent_helpers; l; l = l->next) {
+		uevent_helper_t *helper = l->data;
+		if (helper->container == container)
+			return helper;
+	}
+	return NULL;
+}
+
+int
+uevent_helper_start(const container_t *container)
+{
+	ASSERT(container);
+	IF_TRUE_RETVAL(uevent_helper_get(container), 0);
+
+	int fd[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fd) < 0) {
+		ERROR_ERRNO("Could not create socketpair for uevent helper");
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		ERROR_ERRNO("Could not fork uevent helper");
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	} else if (pid == 0) {
+		char buf[UEVENT_BATCH_BUF_LEN];
+		ssize_t len;
+
+		fd_close_all_except(fd[0]);
+		nl_sock_t *target = uevent_join_netns(container_get_pidfd(container),
+						      container_get_pid(container),
+						      container_has_userns(container));
+		while ((len = recv(fd[0], buf, sizeof(buf), 0)) != 0) {
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				_exit(EXIT_FAILURE);
+			}
+			uevent_inject_msg(target, buf, len);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+	close(fd[0]);
+
+	uevent_helper_t *helper = mem_new0(uevent_helper_t, 1);
+	helper->container = container;
+	helper->pid = pid;
+	helper->fd = fd[1];
+	uevent_helpers = list_append(uevent_helpers, helper);
+
+	DEBUG("Started uevent helper %d for container %s", pid, container_get_name(container));
+	return 0;
+}
+
+void
+uevent_helper_stop(const container_t *container)
+{
+	uevent_helper_t *helper = uevent_helper_get(container);
+	IF_NULL_RETURN(helper);
+
+	uevent_helpers = list_remove(uevent_helpers, helper);
+	close(helper->fd);
+	// the helper exits right away on eof, thus waiting does not block the event loop
+	if (waitpid(helper->pid, NULL, 0) < 0)
+		WARN_ERRNO("Could not reap uevent helper %d", helper->pid);
+	mem_free(helper);
+}
+
+/*
+ * Hands the uevents over to the helper of the container without waiting for
+ * their injection. Returns -1 if there is no (working) helper, in which case
+ * the remaining uevents are injected by a forked child.
+ */
+static int
+uevent_helper_inject(uevent_inject_batch_t *batch)
+{
+	uevent_helper_t *helper = uevent_helper_get(batch->container);
+	IF_NULL_RETVAL(helper, -1);
+
+	while (batch->msgs) {
+		uevent_inject_msg_t *msg = batch->msgs->data;
+		if (send(helper->fd, msg->buf, msg->len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			WARN_ERRNO("Could not pass uevent to helper of container %s",
+				   container_get_name(batch->container));
+			return -1;
+		}
+		batch->msgs = list_unlink(batch->msgs, batch->msgs);
+		mem_free(msg);
+	}
+	return 0;
+}
+
+/**
+ * Queues the raw uevent for injection into the netns of container by the
+ * next uevent_inject_flush(). The order of the uevents of a container is kept.
+ */
+static void
+uevent_inject_queue(struct uevent *uevent, container_t *container)
+{
+	uevent_inject_batch_t *batch = NULL;
+	for (list_t *l = uevent_inject_batches; l; l = l->next) {
+		if (((uevent_inject_batch_t *)l->data)->container == container) {
+			batch = l->data;
+			break;
+		}
+	}
+	if (!batch) {
+		batch = mem_new0(uevent_inject_batch_t, 1);
+		batch->container = container;
+		batch->pid = container_get_pid(container);
+		batch->userns = container_has_userns(container);
+		uevent_inject_batches = list_append(uevent_inject_batches, batch);
+	}
+
+	uevent_inject_msg_t *msg = mem_alloc(sizeof(uevent_inject_msg_t) + uevent->msg_len);
+	msg->len = uevent->msg_len;
+	memcpy(msg->buf, uevent->msg.raw, uevent->msg_len);
+	batch->msgs = list_append(batch->msgs, msg);
+}
+
+/**
+ * Injects all queued uevents, entering the namespaces of each container only once.
+ */
+static void
+uevent_inject_flush(void)
+{
+	for (list_t *l = uevent_inject_batches; l; l = l->next) {
+		uevent_inject_batch_t *batch = l->data;
+		size_t n = list_length(batch->msgs);
+
+		if (uevent_helper_inject(batch) == 0) {
+			TRACE("Passed %zu uevent(s) to helper of container %s", n,
+			      container_get_name(batch->container));
+		} else if (uevent_inject_into_netns(batch->msgs,
+						    container_get_pidfd(batch->container),
+						    batch->pid, batch->userns) < 0) {
+			WARN("Could not inject (all of) %zu uevent(s) into netns of container %s!",
+			     n, container_get_name(batch->container));
+		} else {
+			TRACE("Sucessfully injected %zu uevent(s) into netns of container %s!", n,
+			      container_get_name(batch->container));
+		}
+
+		for (list_t *m = batch->msgs; m; m = m->next)
+			mem_free(m->data);
+		list_delete(batch->msgs);
+		mem_free(batch);
+	}
+	list_delete(uevent_inject_batches);
+	uevent_inject_batches = NULL;
+}
+
 static int
 uevent_create_device_node(struct uevent *uevent, char *path, container_t *container)
 {
@@ -637,13 +1041,14 @@ uevent_netdev_move(struct uevent *uevent)
 		goto error;
 	}
 
+	macstr = network_mac_addr_to_str_new(iface_mac);
+
+	// the first registered mapping for this mac wins
 	container_t *container = NULL;
-	for (list_t *l = uevent_container_netdev_mapping_list; l; l = l->next) {
-		uevent_container_netdev_mapping_t *mapping = l->data;
-		if (0 == memcmp(iface_mac, mapping->mac, 6)) {
-			container = mapping->container;
-			break;
-		}
+	list_t *mappings = uevent_index_get(uevent_netdev_mac_index, macstr);
+	if (mappings) {
+		uevent_container_netdev_mapping_t *mapping = mappings->data;
+		container = mapping->container;
 	}
 
 	if (!container)
@@ -669,7 +1074,6 @@ uevent_netdev_move(struct uevent *uevent)
 		      uevent->interface);
 	}
 
-	macstr = network_mac_addr_to_str_new(iface_mac);
 	if (container_add_net_iface(container, uevent->interface, false)) {
 		ERROR("Cannot move '%s' to %s!", macstr, container_get_name(container));
 		goto error;
@@ -679,14 +1083,8 @@ uevent_netdev_move(struct uevent *uevent)
 	}
 
 	// if moving was successful also inject uevent
-	if (uevent_inject_into_netns(uevent->msg.raw, uevent->msg_len, container_get_pid(container),
-				     container_has_userns(container)) < 0) {
-		WARN("Could not inject uevent into netns of container %s!",
-		     container_get_name(container));
-	} else {
-		TRACE("Successfully injected uevent into netns of container %s!",
-		      container_get_name(container));
-	}
+	uevent_inject_queue(uevent, container);
+	uevent_inject_flush();
 
 	mem_free(macstr);
 	return 0;
@@ -733,14 +1131,13 @@ uevent_device_node_and_forward(struct uevent *uevent, container_t *container)
 	}
 
 	// newer versions of udev prepends '/dev/' in DEVNAME
-	char *devname =
-		mem_printf("%s%s%s", container_get_rootdir(container),
-			   strncmp("/dev/", uevent->devname, 4) ? "/dev/" : "", uevent->devname);
+	char *devname = mem_arena_printf(uevent_arena, "%s%s%s", container_get_rootdir(container),
+					 strncmp("/dev/", uevent->devname, 4) ? "/dev/" : "",
+					 uevent->devname);
 
 	if (!strncmp(uevent->action, "add", 3)) {
 		if (uevent_create_device_node(uevent, devname, container) < 0) {
 			ERROR("Could not create device node");
-			mem_free(devname);
 			return;
 		}
 	} else if (!strncmp(uevent->action, "remove", 6)) {
@@ -749,15 +1146,7 @@ uevent_device_node_and_forward(struct uevent *uevent, container_t *container)
 		}
 	}
 
-	if (uevent_inject_into_netns(uevent->msg.raw, uevent->msg_len, container_get_pid(container),
-				     container_has_userns(container)) < 0) {
-		WARN("Could not inject uevent into netns of container %s!",
-		     container_get_name(container));
-	} else {
-		TRACE("Sucessfully injected uevent into netns of container %s!",
-		      container_get_name(container));
-	}
-	mem_free(devname);
+	uevent_inject_queue(uevent, container);
 }
 
 /*
@@ -783,30 +1172,29 @@ uevent_handle_usb_device(struct uevent *uevent)
 			}
 		}
 
-		for (list_t *l = uevent_container_dev_mapping_list; l; l = l->next) {
+		char *key = uevent_usbdev_devnum_key_new(uevent->major, uevent->minor);
+		list_t *mappings = uevent_index_get(uevent_usbdev_devnum_index, key);
+		for (list_t *l = mappings; l; l = l->next) {
 			uevent_container_dev_mapping_t *mapping = l->data;
-			if ((uevent->major == mapping->usbdev->major) &&
-			    (uevent->minor == mapping->usbdev->minor)) {
-				container_device_deny(mapping->container, mapping->usbdev->major,
-						      mapping->usbdev->minor);
-				INFO("Denied access to unbound device node %d:%d mapped in container %s",
-				     mapping->usbdev->major, mapping->usbdev->minor,
-				     container_get_name(mapping->container));
-			}
+			container_device_deny(mapping->container, mapping->usbdev->major,
+					      mapping->usbdev->minor);
+			INFO("Denied access to unbound device node %d:%d mapped in container %s",
+			     mapping->usbdev->major, mapping->usbdev->minor,
+			     container_get_name(mapping->container));
 		}
+		mem_free(key);
 	}
 
 	if (0 == strncmp(uevent->action, "add", 3)) {
 		TRACE("add");
 
-		char *serial_path = mem_printf("/sys/%s/serial", uevent->devpath);
+		char *serial_path =
+			mem_arena_printf(uevent_arena, "/sys/%s/serial", uevent->devpath);
 		char *serial = NULL;
 
 		if (file_exists(serial_path))
 			serial = file_read_new(serial_path, 255);
 
-		mem_free(serial_path);
-
 		if (!serial || strlen(serial) < 1) {
 			TRACE("Failed to read serial of usb device");
 			return false;
@@ -827,34 +1215,76 @@ uevent_handle_usb_device(struct uevent *uevent)
 			}
 		}
 
-		for (list_t *l = uevent_container_dev_mapping_list; l; l = l->next) {
+		uint16_t vendor_id = uevent_get_usb_vendor(uevent);
+		uint16_t product_id = uevent_get_usb_product(uevent);
+		char *key = uevent_usbdev_id_key_new(vendor_id, product_id, serial);
+
+		for (list_t *l = uevent_index_get(uevent_usbdev_id_index, key); l; l = l->next) {
 			uevent_container_dev_mapping_t *mapping = l->data;
-			uint16_t vendor_id = uevent_get_usb_vendor(uevent);
-			uint16_t product_id = uevent_get_usb_product(uevent);
-
-			INFO("check mapping: %04x:%04x '%s' for %s bound device node %d:%d -> container %s",
-			     vendor_id, product_id, serial, (mapping->assign) ? "assign" : "allow",
-			     uevent->major, uevent->minor, container_get_name(mapping->container));
-
-			if ((mapping->usbdev->id_vendor == vendor_id) &&
-			    (mapping->usbdev->id_product == product_id) &&
-			    (0 == strcmp(mapping->usbdev->i_serial, serial))) {
-				mapping->usbdev->major = uevent->major;
-				mapping->usbdev->minor = uevent->minor;
-				INFO("%s bound device node %d:%d -> container %s",
-				     (mapping->assign) ? "assign" : "allow", mapping->usbdev->major,
-				     mapping->usbdev->minor,
-				     container_get_name(mapping->container));
-
-				container_device_allow(mapping->container, mapping->usbdev->major,
-						       mapping->usbdev->minor, mapping->assign);
-			}
+
+			// re-index the mapping by the device node it is bound to now
+			uevent_usbdev_devnum_index_remove(mapping);
+			mapping->usbdev->major = uevent->major;
+			mapping->usbdev->minor = uevent->minor;
+			uevent_usbdev_devnum_index_add(mapping);
+
+			INFO("%s bound device node %d:%d -> container %s",
+			     (mapping->assign) ? "assign" : "allow", mapping->usbdev->major,
+			     mapping->usbdev->minor, container_get_name(mapping->container));
+
+			container_device_allow(mapping->container, mapping->usbdev->major,
+					       mapping->usbdev->minor, mapping->assign);
 		}
+		mem_free(key);
 		mem_free(serial);
 	}
 	return false;
 }
 
+static void
+uevent_db_dev_free(uevent_db_dev_t *dev)
+{
+	IF_NULL_RETURN(dev);
+	mem_free(dev->devpath);
+	mem_free(dev->subsystem);
+	mem_free(dev->devname);
+	mem_free(dev->devtype);
+	mem_free(dev);
+}
+
+static void
+uevent_db_put(const char *devpath, const char *subsystem, const char *devname,
+	      const char *devtype, int major, int minor)
+{
+	uevent_db_dev_t *dev = mem_new0(uevent_db_dev_t, 1);
+	dev->devpath = mem_strdup(devpath);
+	dev->subsystem = mem_strdup(subsystem);
+	dev->devname = mem_strdup(devname);
+	dev->devtype = (devtype && *devtype) ? mem_strdup(devtype) : NULL;
+	dev->major = major;
+	dev->minor = minor;
+
+	uevent_db_dev_free(hashmap_put(uevent_db, dev->devpath, dev));
+}
+
+/*
+ * Keeps the device database in sync with the kernel uevents of devices
+ * which have a device node.
+ */
+static void
+uevent_db_update(const struct uevent *uevent)
+{
+	IF_NULL_RETURN(uevent_db);
+	IF_TRUE_RETURN(!*uevent->devpath);
+
+	if (!strcmp(uevent->action, "remove")) {
+		uevent_db_dev_free(hashmap_remove(uevent_db, uevent->devpath));
+	} else if (uevent->major > -1 && uevent->minor > -1 && *uevent->devname) {
+		uevent_db_put(uevent->devpath, uevent->subsystem, uevent->devname,
+			      uevent->devtype, uevent->major, uevent->minor);
+	}
+}
+
 static void
 handle_kernel_event(struct uevent *uevent, char *raw_p)
 {
@@ -866,6 +1296,8 @@ handle_kernel_event(struct uevent *uevent, char *raw_p)
 			     strncmp(uevent->action, "remove", 6) &&
 			     strncmp(uevent->action, "change", 6));
 
+	uevent_db_update(uevent);
+
 	/*
 	 * if handler returns true the event is completely handled
 	 * otherwise event should be checked for possible forwarding
@@ -898,9 +1330,10 @@ handle_kernel_event(struct uevent *uevent, char *raw_p)
 		struct uevent *uevent_cb = mem_new0(struct uevent, 1);
 		memcpy(uevent_cb, uevent, sizeof(struct uevent));
 
-		// give sysfs some time to settle if iface is wifi
+		// give sysfs some time to settle if iface is wifi, polling need not be exact
 		event_timer_t *e = event_timer_new(100, EVENT_TIMER_REPEAT_FOREVER,
 						   uevent_sysfs_netif_timer_cb, uevent_cb);
+		event_timer_set_slack(e, 100);
 		event_add_timer(e);
 		goto out;
 	}
@@ -925,17 +1358,26 @@ handle_udev_event(struct uevent *uevent, char *raw_p)
 	return;
 }
 
+/**
+ * Handles a single uevent of len bytes received into buf.
+ */
 static void
-uevent_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+uevent_handle_msg(const char *buf, size_t len)
 {
-	struct uevent *uev = mem_new0(struct uevent, 1);
+	size_t mark = mem_arena_mark(uevent_arena);
+	struct uevent *uev = uevent_buf;
 
-	// read uevent into raw buffer and assure that last char is '\0'
-	if ((uev->msg_len = nl_msg_receive_kernel(uevent_netlink_sock, uev->msg.raw,
-						  sizeof(uev->msg.raw) - 1, true)) <= 0) {
-		WARN("could not read uevent");
-		goto err;
-	}
+	// the raw buffer is overwritten by the next message, only reset the parsed fields
+	memset((char *)uev + offsetof(struct uevent, msg_len), 0,
+	       sizeof(struct uevent) - offsetof(struct uevent, msg_len));
+
+	// uevent_parse() stops at an empty key, thus terminate with two '\0'
+	len = MIN(len, sizeof(uev->msg.raw) - 2);
+	memcpy(uev->msg.raw, buf, len);
+	uev->msg.raw[len] = '\0';
+	uev->msg.raw[len + 1] = '\0';
+	uev->msg_len = len;
+	PROBE2(uevent_msg_begin, uev->msg.raw, len);
 
 	char *raw_p = uev->msg.raw;
 
@@ -944,12 +1386,13 @@ uevent_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUS
 		if (uev->msg.nlh.magic != htonl(UDEV_MONITOR_MAGIC)) {
 			WARN("unrecognized message signature (%x != %x)", uev->msg.nlh.magic,
 			     htonl(UDEV_MONITOR_MAGIC));
-			goto err;
+			goto out;
 		}
-		if (uev->msg.nlh.properties_off + 32 > uev->msg_len) {
+		// properties_off is taken from the message, do not let the check overflow
+		if ((size_t)uev->msg.nlh.properties_off + 32 > uev->msg_len) {
 			WARN("message smaller than expected (%u > %zd)",
 			     uev->msg.nlh.properties_off + 32, uev->msg_len);
-			goto err;
+			goto out;
 		}
 		raw_p += uev->msg.nlh.properties_off;
 		handle_udev_event(uev, raw_p);
@@ -962,8 +1405,136 @@ uevent_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUS
 		/* kernel message */
 		TRACE("no uevent: %s", raw_p);
 	}
-err:
-	mem_free(uev);
+out:
+	PROBE0(uevent_msg_end);
+	mem_arena_reset(uevent_arena, mark);
+}
+
+static void
+uevent_handle(UNUSED int fd, UNUSED unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	int received[UEVENT_BATCH_LEN];
+	int count;
+
+	// the socket is registered edge-triggered, thus drain it completely
+	while (1) {
+		count = nl_msg_receive_uevents(uevent_netlink_sock, uevent_batch_bufs,
+					       UEVENT_BATCH_BUF_LEN, received, UEVENT_BATCH_LEN);
+		if (count < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			WARN_ERRNO("could not read uevents");
+			// an overrun (ENOBUFS) does not stop draining
+			if (errno != ENOBUFS)
+				break;
+			continue;
+		}
+		PROBE1(uevent_batch_begin, count);
+		for (int i = 0; i < count; i++) {
+			if (received[i] > 0)
+				uevent_handle_msg(uevent_batch_bufs[i], received[i]);
+			else
+				TRACE("empty or discarded uevent");
+		}
+		PROBE1(uevent_batch_end, count);
+	}
+
+	// forward the uevents collected during this wakeup with one netns entry per container
+	uevent_inject_flush();
+	PROBE0(uevent_flushed);
+}
+
+/*
+ * Adds the device of the sysfs dir path to the device database if it has a
+ * device node, i.e., MAJOR, MINOR and DEVNAME in its uevent file.
+ */
+static void
+uevent_db_add_sysfs(const char *path)
+{
+	char buf[4096];
+	char subsystem[PATH_MAX];
+	const char *devname = NULL, *devtype = NULL;
+	int major = -1, minor = -1;
+
+	char *uevent_file = mem_printf("%s/uevent", path);
+	char *subsystem_link = mem_printf("%s/subsystem", path);
+
+	int len = file_read(uevent_file, buf, sizeof(buf) - 1);
+	IF_TRUE_GOTO(len < 0, out);
+	buf[len] = '\0';
+
+	char *saveptr = NULL;
+	for (char *line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		if (!strncmp(line, "MAJOR=", 6))
+			major = atoi(line + 6);
+		else if (!strncmp(line, "MINOR=", 6))
+			minor = atoi(line + 6);
+		else if (!strncmp(line, "DEVNAME=", 8))
+			devname = line + 8;
+		else if (!strncmp(line, "DEVTYPE=", 8))
+			devtype = line + 8;
+	}
+	IF_FALSE_GOTO_TRACE(major > -1 && minor > -1 && devname, out);
+
+	ssize_t link_len = readlink(subsystem_link, subsystem, sizeof(subsystem) - 1);
+	IF_TRUE_GOTO_TRACE(link_len < 0, out);
+	subsystem[link_len] = '\0';
+	char *subsystem_name = strrchr(subsystem, '/');
+
+	// DEVPATH is relative to /sys
+	uevent_db_put(path + strlen("/sys"), subsystem_name ? subsystem_name + 1 : subsystem,
+		      devname, devtype, major, minor);
+out:
+	mem_free(uevent_file);
+	mem_free(subsystem_link);
+}
+
+static int
+uevent_db_populate_foreach_cb(const char *path, const char *name, UNUSED void *data)
+{
+	char *full_path = mem_printf("%s/%s", path, name);
+
+	if (file_is_dir(full_path)) {
+		if (0 > dir_foreach(full_path, &uevent_db_populate_foreach_cb, NULL))
+			WARN("Could not read devices in '%s'!", full_path);
+	} else if (!strcmp(name, "uevent")) {
+		uevent_db_add_sysfs(path);
+	}
+
+	mem_free(full_path);
+	return 0;
+}
+
+/*
+ * Populates the device database by walking sysfs once. Uevents of devices
+ * which are added or removed meanwhile are queued on the netlink socket and
+ * update the database afterwards.
+ */
+static void
+uevent_db_init(void)
+{
+	const char *sysfs_devices = "/sys/devices";
+
+	uevent_db = hashmap_new_str();
+	if (0 > dir_foreach(sysfs_devices, &uevent_db_populate_foreach_cb, NULL))
+		WARN("Could not populate device database! No '%s'!", sysfs_devices);
+
+	DEBUG("Device database populated with %zu devices", hashmap_count(uevent_db));
+}
+
+static void
+uevent_db_free(void)
+{
+	IF_NULL_RETURN(uevent_db);
+
+	size_t iter = 0;
+	const void *key;
+	void *value;
+	while (hashmap_next(uevent_db, &iter, &key, &value))
+		uevent_db_dev_free(value);
+	hashmap_free(uevent_db);
+	uevent_db = NULL;
 }
 
 int
@@ -1007,8 +1578,26 @@ uevent_init()
 		return -1;
 	}
 
-	uevent_io_event = event_io_new(nl_sock_get_fd(uevent_netlink_sock), EVENT_IO_READ,
-				       &uevent_handle, NULL);
+	/*
+	 * Drop uevents with other actions (bind, unbind, move, ...) and the udev
+	 * monitor messages in the kernel, so that hotplug storms do not wake cmld
+	 * for events it discards. Not fatal, the actions are still checked below.
+	 */
+	if (nl_sock_uevent_set_filter(uevent_netlink_sock, uevent_filter_actions))
+		WARN("Could not attach uevent filter, receiving all uevents");
+
+	uevent_buf = mem_new0(struct uevent, 1);
+	for (int i = 0; i < UEVENT_BATCH_LEN; i++)
+		uevent_batch_bufs[i] = mem_alloc(UEVENT_BATCH_BUF_LEN);
+	uevent_arena = mem_arena_new(4096);
+
+	// after the socket is open, thus no add or remove uevent is missed
+	uevent_db_init();
+
+	uevent_io_event = event_io_new(nl_sock_get_fd(uevent_netlink_sock),
+				       EVENT_IO_READ | EVENT_IO_EDGE, &uevent_handle, NULL);
+	// a uevent storm must not delay control commands or child handling
+	event_io_set_prio(uevent_io_event, EVENT_PRIO_LOW);
 	event_add_io(uevent_io_event);
 
 	return 0;
@@ -1024,6 +1613,31 @@ uevent_deinit()
 	if (uevent_netlink_sock) {
 		nl_sock_free(uevent_netlink_sock);
 	}
+	mem_arena_free(uevent_arena);
+	uevent_arena = NULL;
+	mem_free(uevent_buf);
+	for (int i = 0; i < UEVENT_BATCH_LEN; i++)
+		mem_free(uevent_batch_bufs[i]);
+
+	// each mapping is part of exactly one bucket of the id and mac index
+	size_t iter = 0;
+	const void *key;
+	void *value;
+	while (uevent_usbdev_id_index &&
+	       hashmap_next(uevent_usbdev_id_index, &iter, &key, &value)) {
+		for (list_t *l = ((uevent_index_bucket_t *)value)->mappings; l; l = l->next)
+			uevent_container_dev_mapping_free(l->data);
+	}
+	iter = 0;
+	while (uevent_netdev_mac_index &&
+	       hashmap_next(uevent_netdev_mac_index, &iter, &key, &value)) {
+		for (list_t *l = ((uevent_index_bucket_t *)value)->mappings; l; l = l->next)
+			uevent_container_netdev_mapping_free(l->data);
+	}
+	uevent_index_free(&uevent_usbdev_devnum_index);
+	uevent_index_free(&uevent_usbdev_id_index);
+	uevent_index_free(&uevent_netdev_mac_index);
+	uevent_db_free();
 }
 
 int
@@ -1031,7 +1645,11 @@ uevent_register_usbdevice(container_t *container, uevent_usbdev_t *usbdev)
 {
 	uevent_container_dev_mapping_t *mapping =
 		uevent_container_dev_mapping_new(container, usbdev);
-	uevent_container_dev_mapping_list = list_append(uevent_container_dev_mapping_list, mapping);
+	char *key = uevent_usbdev_id_key_new(mapping->usbdev->id_vendor,
+					     mapping->usbdev->id_product, mapping->usbdev->i_serial);
+	uevent_index_add(&uevent_usbdev_id_index, key, mapping);
+	uevent_usbdev_devnum_index_add(mapping);
+	mem_free(key);
 
 	INFO("Registered usbdevice %04x:%04x '%s' [c %d:%d] for container %s",
 	     mapping->usbdev->id_vendor, mapping->usbdev->id_product, mapping->usbdev->i_serial,
@@ -1045,21 +1663,23 @@ int
 uevent_unregister_usbdevice(container_t *container, uevent_usbdev_t *usbdev)
 {
 	uevent_container_dev_mapping_t *mapping_to_remove = NULL;
+	char *key = uevent_usbdev_id_key_new(usbdev->id_vendor, usbdev->id_product,
+					     usbdev->i_serial);
 
-	for (list_t *l = uevent_container_dev_mapping_list; l; l = l->next) {
+	for (list_t *l = uevent_index_get(uevent_usbdev_id_index, key); l; l = l->next) {
 		uevent_container_dev_mapping_t *mapping = l->data;
-		if ((mapping->container == container) &&
-		    (mapping->usbdev->id_vendor == usbdev->id_vendor) &&
-		    (mapping->usbdev->id_product == usbdev->id_product) &&
-		    (0 == strcmp(mapping->usbdev->i_serial, usbdev->i_serial))) {
+		if (mapping->container == container)
 			mapping_to_remove = mapping;
-		}
 	}
 
-	IF_NULL_RETVAL(mapping_to_remove, -1);
+	if (!mapping_to_remove) {
+		mem_free(key);
+		return -1;
+	}
 
-	uevent_container_dev_mapping_list =
-		list_remove(uevent_container_dev_mapping_list, mapping_to_remove);
+	uevent_index_remove(uevent_usbdev_id_index, key, mapping_to_remove);
+	uevent_usbdev_devnum_index_remove(mapping_to_remove);
+	mem_free(key);
 
 	INFO("Unregistered usbdevice %04x:%04x '%s' for container %s",
 	     mapping_to_remove->usbdev->id_vendor, mapping_to_remove->usbdev->id_product,
@@ -1075,9 +1695,8 @@ uevent_register_netdev(container_t *container, uint8_t mac[6])
 {
 	uevent_container_netdev_mapping_t *mapping =
 		uevent_container_netdev_mapping_new(container, mac);
-	uevent_container_netdev_mapping_list =
-		list_append(uevent_container_netdev_mapping_list, mapping);
 	char *macstr = network_mac_addr_to_str_new(mapping->mac);
+	uevent_index_add(&uevent_netdev_mac_index, macstr, mapping);
 
 	INFO("Registered netdev '%s' for container %s", macstr,
 	     container_get_name(mapping->container));
@@ -1090,20 +1709,20 @@ int
 uevent_unregister_netdev(container_t *container, uint8_t mac[6])
 {
 	uevent_container_netdev_mapping_t *mapping_to_remove = NULL;
+	char *macstr = network_mac_addr_to_str_new(mac);
 
-	for (list_t *l = uevent_container_netdev_mapping_list; l; l = l->next) {
+	for (list_t *l = uevent_index_get(uevent_netdev_mac_index, macstr); l; l = l->next) {
 		uevent_container_netdev_mapping_t *mapping = l->data;
-		if ((mapping->container == container) && (0 == memcmp(mapping->mac, mac, 6))) {
+		if (mapping->container == container)
 			mapping_to_remove = mapping;
-		}
 	}
 
-	IF_NULL_RETVAL(mapping_to_remove, -1);
-
-	uevent_container_netdev_mapping_list =
-		list_remove(uevent_container_netdev_mapping_list, mapping_to_remove);
+	if (!mapping_to_remove) {
+		mem_free(macstr);
+		return -1;
+	}
 
-	char *macstr = network_mac_addr_to_str_new(mapping_to_remove->mac);
+	uevent_index_remove(uevent_netdev_mac_index, macstr, mapping_to_remove);
 
 	INFO("Unregistered netdev '%s' for container %s", macstr,
 	     container_get_name(mapping_to_remove->container));
@@ -1114,58 +1733,86 @@ uevent_unregister_netdev(container_t *container, uint8_t mac[6])
 	return 0;
 }
 
-static int
-uevent_trigger_coldboot_foreach_cb(const char *path, const char *name, void *data)
+/* appends a "KEY=value" string including its terminating '\0' to the raw uevent */
+__attribute__((format(printf, 2, 3))) static void
+uevent_synth_append(struct uevent *uevent, const char *fmt, ...)
 {
-	int ret = 0;
-	char buf[256];
-	int major, minor;
+	// keep two '\0' at the end, see uevent_handle_msg()
+	size_t size = sizeof(uevent->msg.raw) - 1;
+	IF_TRUE_RETURN(uevent->msg_len >= size);
 
-	container_t *container = data;
-	IF_NULL_RETVAL(container, -1);
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(uevent->msg.raw + uevent->msg_len, size - uevent->msg_len, fmt, ap);
+	va_end(ap);
 
-	char *full_path = mem_printf("%s/%s", path, name);
-	char *dev_file = NULL;
-
-	if (file_is_dir(full_path)) {
-		if (0 > dir_foreach(full_path, &uevent_trigger_coldboot_foreach_cb, container)) {
-			WARN("Could not trigger coldboot uevents! No '%s'!", full_path);
-			ret--;
-		}
-	} else if (!strcmp(name, "uevent")) {
-		dev_file = mem_printf("%s/dev", path);
-
-		IF_FALSE_GOTO_TRACE(file_exists(dev_file), out);
-
-		major = minor = -1;
-		IF_TRUE_GOTO(-1 == file_read(dev_file, buf, sizeof(buf)), out);
-		IF_TRUE_GOTO((sscanf(buf, "%d:%d", &major, &minor) < 0), out);
-		IF_FALSE_GOTO((major > -1 && minor > -1), out);
-
-		// only trigger for allowed devices
-		IF_FALSE_GOTO_TRACE(container_is_device_allowed(container, major, minor), out);
+	if (len > 0)
+		uevent->msg_len = MIN(size, uevent->msg_len + len + 1);
+}
 
-		char *trigger = mem_printf("add %s", uuid_string(container_get_uuid(container)));
-		if (-1 == file_printf(full_path, trigger)) {
-			WARN("Could not trigger event %s <- %s", full_path, trigger);
-			ret--;
-		} else {
-			DEBUG("Trigger event %s <- %s", full_path, trigger);
-		}
-		mem_free(trigger);
-	}
-out:
-	mem_free(full_path);
-	mem_free(dev_file);
-	return ret;
+/*
+ * Synthesizes the raw add uevent of a device of the database, as the kernel
+ * sends it when "add" is written to the uevent file of the device.
+ */
+static void
+uevent_synth_add(struct uevent *uevent, const uevent_db_dev_t *dev, unsigned long long seqnum)
+{
+	// the raw buffer is overwritten, only reset the parsed fields
+	memset((char *)uevent + offsetof(struct uevent, msg_len), 0,
+	       sizeof(struct uevent) - offsetof(struct uevent, msg_len));
+
+	uevent_synth_append(uevent, "add@%s", dev->devpath);
+	uevent_synth_append(uevent, "ACTION=add");
+	uevent_synth_append(uevent, "DEVPATH=%s", dev->devpath);
+	uevent_synth_append(uevent, "SUBSYSTEM=%s", dev->subsystem);
+	uevent_synth_append(uevent, "MAJOR=%d", dev->major);
+	uevent_synth_append(uevent, "MINOR=%d", dev->minor);
+	uevent_synth_append(uevent, "DEVNAME=%s", dev->devname);
+	if (dev->devtype)
+		uevent_synth_append(uevent, "DEVTYPE=%s", dev->devtype);
+	uevent_synth_append(uevent, "SYNTH_UUID=0");
+	uevent_synth_append(uevent, "SEQNUM=%llu", seqnum);
+	uevent->msg.raw[uevent->msg_len] = '\0';
+
+	uevent_parse(uevent, uevent->msg.raw + strlen(uevent->msg.raw) + 1);
 }
 
 void
 uevent_udev_trigger_coldboot(container_t *container)
 {
-	const char *sysfs_devices = "/sys/devices";
-	// for the first time iterate through sysfs to find device
-	if (0 > dir_foreach(sysfs_devices, &uevent_trigger_coldboot_foreach_cb, container)) {
-		WARN("Could not trigger coldboot uevents! No '%s'!", sysfs_devices);
+	ASSERT(container);
+
+	if (!uevent_db) {
+		WARN("No device database, cannot replay coldboot uevents");
+		return;
 	}
+
+	// udevd requires increasing sequence numbers, continue with the ones of the kernel
+	unsigned long long seqnum = 0;
+	char buf[32];
+	int len = file_read("/sys/kernel/uevent_seqnum", buf, sizeof(buf) - 1);
+	if (len > 0) {
+		buf[len] = '\0';
+		seqnum = strtoull(buf, NULL, 10);
+	}
+
+	struct uevent *uevent = mem_new0(struct uevent, 1);
+	size_t iter = 0;
+	const void *key;
+	void *value;
+	while (hashmap_next(uevent_db, &iter, &key, &value)) {
+		const uevent_db_dev_t *dev = value;
+
+		// only replay for allowed devices
+		if (!container_is_device_allowed(container, dev->major, dev->minor))
+			continue;
+
+		size_t mark = mem_arena_mark(uevent_arena);
+		uevent_synth_add(uevent, dev, ++seqnum);
+		uevent_device_node_and_forward(uevent, container);
+		mem_arena_reset(uevent_arena, mark);
+	}
+	mem_free(uevent);
+
+	uevent_inject_flush();
 }
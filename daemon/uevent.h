@@ -118,12 +118,33 @@ uevent_unregister_netdev(container_t *container, uint8_t mac[6]);
 /**
  * Trigger cold boot events to allow user namespaced containers to fixup
  * their device nodes by udevd in container.
- * Internally the uuid of the container is used for synthetic events
- * to allow directing events to corresponding container only.
+ * The add uevents of all devices allowed for the container are synthesized
+ * from the device database of cmld and injected into the container only,
+ * without walking sysfs.
  *
  * @param container container for which the cold boot is triggered.
  */
 void
 uevent_udev_trigger_coldboot(container_t *container);
 
+/**
+ * Starts a helper process which stays in the network (and user) namespace of the
+ * container and injects the uevents forwarded to the container. Thus, injecting
+ * uevents does not need to fork and join the namespaces each time.
+ * Without a helper, uevents are injected by a short-lived child as before.
+ *
+ * @param container running container for which the helper is started.
+ * @return 0 if successful (or already started). -1 indicates an error.
+ */
+int
+uevent_helper_start(const container_t *container);
+
+/**
+ * Stops the uevent injection helper of the container, if any.
+ *
+ * @param container container for which the helper was started.
+ */
+void
+uevent_helper_stop(const container_t *container);
+
 #endif /* UEVENT_H */
@@ -0,0 +1,187 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include "zygote.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/event.h"
+#include "common/fd.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+typedef struct {
+	pid_t pid;
+	int sync_fd; /* the zygote exits as soon as this fd is closed */
+} zygote_t;
+
+static unsigned int zygote_pool_size = 0;
+static list_t *zygote_pool = NULL;  /* zygotes ready to be taken */
+static list_t *zygote_taken = NULL; /* zygotes taken but not yet released */
+static event_timer_t *zygote_refill_timer = NULL;
+
+static zygote_t *
+zygote_new(void)
+{
+	int fd[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd) < 0) {
+		ERROR_ERRNO("Could not create sync socketpair for zygote");
+		return NULL;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		ERROR_ERRNO("Could not fork zygote");
+		close(fd[0]);
+		close(fd[1]);
+		return NULL;
+	} else if (pid == 0) {
+		char ready = 0;
+		ssize_t n;
+		fd_close_all_except(fd[0]);
+		if (unshare(CLONE_NEWUSER | CLONE_NEWNET) < 0)
+			_exit(-1);
+		// signal readiness by the first byte, then wait for the parent to close its end
+		if (write(fd[0], &ready, 1) < 0)
+			_exit(-1);
+		do {
+			n = read(fd[0], &ready, 1);
+		} while (n > 0 || (n < 0 && errno == EINTR));
+		_exit(0);
+	}
+	close(fd[0]);
+
+	char ready;
+	if (read(fd[1], &ready, 1) != 1) {
+		WARN("Zygote %d failed to create its namespaces", pid);
+		close(fd[1]);
+		waitpid(pid, NULL, 0);
+		return NULL;
+	}
+
+	zygote_t *zygote = mem_new0(zygote_t, 1);
+	zygote->pid = pid;
+	zygote->sync_fd = fd[1];
+	TRACE("Zygote %d ready", pid);
+
+	return zygote;
+}
+
+void
+zygote_release(pid_t pid)
+{
+	for (list_t *l = zygote_taken; l; l = l->next) {
+		zygote_t *zygote = l->data;
+		if (zygote->pid != pid)
+			continue;
+
+		zygote_taken = list_unlink(zygote_taken, l);
+		close(zygote->sync_fd);
+		// the zygote exits right away on eof, thus waiting does not block the event loop
+		if (waitpid(zygote->pid, NULL, 0) < 0)
+			WARN_ERRNO("Could not reap zygote %d", zygote->pid);
+		mem_free(zygote);
+		return;
+	}
+	WARN("Zygote %d was not taken from the pool", pid);
+}
+
+static void
+zygote_refill_cb(event_timer_t *timer, UNUSED void *data)
+{
+	for (unsigned int n = list_length(zygote_pool); n < zygote_pool_size; n++) {
+		zygote_t *zygote = zygote_new();
+		if (!zygote) {
+			WARN("Could not refill zygote pool");
+			break;
+		}
+		zygote_pool = list_append(zygote_pool, zygote);
+	}
+
+	event_remove_timer(timer);
+	event_timer_free(timer);
+	zygote_refill_timer = NULL;
+}
+
+static void
+zygote_refill(void)
+{
+	if (!zygote_pool_size || zygote_refill_timer)
+		return;
+
+	// refill from the main loop, off the path of the current container start
+	zygote_refill_timer = event_timer_new(0, 1, zygote_refill_cb, NULL);
+	event_add_timer(zygote_refill_timer);
+}
+
+pid_t
+zygote_take(void)
+{
+	IF_NULL_RETVAL(zygote_pool, -1);
+
+	zygote_t *zygote = zygote_pool->data;
+	zygote_pool = list_unlink(zygote_pool, zygote_pool);
+	zygote_taken = list_append(zygote_taken, zygote);
+	zygote_refill();
+
+	DEBUG("Took zygote %d from the pool", zygote->pid);
+	return zygote->pid;
+}
+
+int
+zygote_init(unsigned int pool_size)
+{
+	zygote_pool_size = pool_size;
+	IF_TRUE_RETVAL(pool_size == 0, 0);
+
+	zygote_refill();
+	return 0;
+}
+
+void
+zygote_cleanup(void)
+{
+	if (zygote_refill_timer) {
+		event_remove_timer(zygote_refill_timer);
+		event_timer_free(zygote_refill_timer);
+		zygote_refill_timer = NULL;
+	}
+	zygote_pool_size = 0;
+
+	while (zygote_pool) {
+		zygote_t *zygote = zygote_pool->data;
+		zygote_pool = list_unlink(zygote_pool, zygote_pool);
+		close(zygote->sync_fd);
+		if (waitpid(zygote->pid, NULL, 0) < 0)
+			WARN_ERRNO("Could not reap zygote %d", zygote->pid);
+		mem_free(zygote);
+	}
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file zygote.h
+ *
+ * Pool of pre-created, still empty user and network namespaces ("zygotes")
+ * which are adopted by starting containers instead of creating these
+ * namespaces during clone(). Each zygote is a helper process which unshared
+ * both namespaces and waits until it is taken from the pool. The taking module
+ * writes the id mapping and binds the namespaces, afterwards the zygote is
+ * released. The pool is refilled from the event loop, off the start path.
+ */
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <sys/types.h>
+
+/**
+ * Sets the number of zygotes to keep ready and fills the pool.
+ * A pool_size of 0 disables the pool.
+ */
+int
+zygote_init(unsigned int pool_size);
+
+/**
+ * Takes a zygote out of the pool and schedules the refill of the pool.
+ * Its namespaces are available at /proc/<pid>/ns/{user,net} until the
+ * zygote is released. The user namespace has no id mapping yet.
+ * @return the pid of the zygote or -1 if the pool is empty
+ */
+pid_t
+zygote_take(void);
+
+/**
+ * Lets a zygote taken by zygote_take() exit and reaps it. The namespaces
+ * stay alive as long as they are bound or joined by other processes.
+ */
+void
+zygote_release(pid_t pid);
+
+/**
+ * Lets all zygotes in the pool exit, reaps them and stops refilling the pool.
+ */
+void
+zygote_cleanup(void);
+
+#endif /* ZYGOTE_H */
@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/random.h>
+#include <openssl/sha.h>
 #include "ibmtss/Unmarshal_fp.h"
 
 #include "common/macro.h"
@@ -35,6 +36,8 @@
 #include "common/sock.h"
 #include "common/fd.h"
 #include "common/ssl_util.h"
+#include "common/str.h"
+#include "common/merkle.h"
 
 #include "attestation.pb-c.h"
 #include "config.pb-c.h"
@@ -44,7 +47,13 @@
 #include "hash.h"
 #include "ima_verify.h"
 
-#define TPM2D_SERVICE_PORT "9505"
+struct attestation_cert {
+	uint8_t *buf;
+	size_t len;
+	EVP_PKEY *key;
+	const char *hash_algo;
+	char *id; //!< identifies the device in IMA verification sessions
+};
 
 struct attestation_resp_cb_data {
 	void (*resp_verified_cb)(bool);
@@ -56,24 +65,87 @@ struct attestation_resp_cb_data {
 static char *
 convert_bin_to_hex_new(const uint8_t *bin, int length)
 {
-	size_t len = MUL_WITH_OVERFLOW_CHECK(length, (size_t)2);
-	len = MUL_WITH_OVERFLOW_CHECK(len, sizeof(char));
-	len = ADD_WITH_OVERFLOW_CHECK(len, 1);
-	char *hex = mem_alloc0(len);
-
-	for (int i = 0; i < length; ++i) {
-		// remember snprintf additionally writes a '0' byte
-		snprintf(hex + i * 2, 3, "%.2x", bin[i]);
-	}
+	IF_TRUE_RETVAL(0 > length, NULL);
 
-	return hex;
+	return str_hex_encode_new(bin, length);
 }
 
+attestation_cert_t *
+attestation_cert_new(const uint8_t *buf, size_t len)
+{
+	ASSERT(buf);
+
+	const char *hash_algo = NULL;
+	EVP_PKEY *key = ssl_get_pubkey_from_cert_pem_new(buf, len, &hash_algo);
+	IF_NULL_RETVAL(key, NULL);
+
+	attestation_cert_t *cert = mem_new0(attestation_cert_t, 1);
+	cert->buf = mem_memcpy(buf, len);
+	cert->len = len;
+	cert->key = key;
+	cert->hash_algo = hash_algo;
+
+	uint8_t cert_hash[SHA256_DIGEST_LENGTH];
+	sha256(cert_hash, cert->buf, len);
+	cert->id = convert_bin_to_hex_new(cert_hash, sizeof(cert_hash));
+
+	return cert;
+}
+
+attestation_cert_t *
+attestation_cert_update(attestation_cert_t *cert, const uint8_t *buf, size_t len)
+{
+	if (cert && cert->len == len && !memcmp(cert->buf, buf, len))
+		return cert;
+
+	attestation_cert_free(cert);
+	return attestation_cert_new(buf, len);
+}
+
+void
+attestation_cert_free(attestation_cert_t *cert)
+{
+	IF_NULL_RETURN(cert);
+
+	EVP_PKEY_free(cert->key);
+	mem_free(cert->buf);
+	mem_free(cert->id);
+	mem_free(cert);
+}
+
+/*
+ * Checks that the qualifying data of the quote binds nonce, either directly or,
+ * for a quote shared by aggregated requests, as a leaf of the Merkle tree whose
+ * root is the qualifying data.
+ */
 static bool
-attestation_verify_resp(Tpm2dToRemote *resp, const char *config_file, uint8_t *nonce,
-			size_t nonce_len)
+attestation_verify_nonce(const Tpm2dToRemote *resp, const uint8_t *qdata, size_t qdata_len,
+			 const uint8_t *nonce, size_t nonce_len)
 {
-	ASSERT(config_file);
+	if (!resp->has_nonce_count)
+		return qdata_len == nonce_len && !memcmp(qdata, nonce, nonce_len);
+
+	IF_FALSE_RETVAL(resp->has_nonce_index && qdata_len == MERKLE_HASH_LEN, false);
+	IF_TRUE_RETVAL(resp->n_nonce_proof > merkle_proof_max_len(resp->nonce_count), false);
+
+	const uint8_t *proof[resp->n_nonce_proof + 1];
+	for (size_t i = 0; i < resp->n_nonce_proof; i++) {
+		IF_FALSE_RETVAL(resp->nonce_proof[i].len == MERKLE_HASH_LEN, false);
+		proof[i] = resp->nonce_proof[i].data;
+	}
+
+	DEBUG("Quote shared by %u requests, verifying inclusion of nonce at %u",
+	      resp->nonce_count, resp->nonce_index);
+	return merkle_proof_verify(nonce, nonce_len, resp->nonce_index, resp->nonce_count, proof,
+				   resp->n_nonce_proof, qdata);
+}
+
+bool
+attestation_verify_resp(const Tpm2dToRemote *resp, const RAttestationConfig *config,
+			const attestation_cert_t *cert, const uint8_t *nonce, size_t nonce_len)
+{
+	ASSERT(config);
+	ASSERT(cert);
 	ASSERT(nonce);
 	ASSERT(resp);
 
@@ -84,15 +156,13 @@ attestation_verify_resp(Tpm2dToRemote *resp, const char *config_file, uint8_t *n
 	uint8_t *s = sig;   // Required as TSS functions manipulate pointer
 	uint32_t quote_len = resp->quoted.len;
 	uint32_t sig_len = resp->signature.len;
-	char *pcr_strings[resp->n_pcr_values];
+	char *pcr_strings[resp->n_pcr_values + 1];
 
-	// TODO Right now, the "good" values are read from the configuration file.
-	// Later, different methods could be implemented
-	RAttestationConfig *config = rattestation_read_config_new(config_file);
-	if (!config) {
-		ERROR("Failed to read config file %s. The file has to be provided as a command line argument",
-		      config_file);
-		return false;
+	// Convert to hex string representation to directly compare with specified values
+	// in the configuration file
+	for (size_t i = 0; i < resp->n_pcr_values; i++) {
+		pcr_strings[i] = convert_bin_to_hex_new(resp->pcr_values[i]->value.data,
+							resp->pcr_values[i]->value.len);
 	}
 
 	// Verficication Process
@@ -116,18 +186,17 @@ attestation_verify_resp(Tpm2dToRemote *resp, const char *config_file, uint8_t *n
 		goto err;
 	}
 
+	// PCR10 is needed for the measurement list below
+	if (resp->n_pcr_values < MAX(config->n_pcr_values, (size_t)11)) {
+		ERROR("Response contains %zu PCR values only", resp->n_pcr_values);
+		goto err;
+	}
+
 	// The TSS library manipulates the quote and signature buffers. Copy the buffers
 	// in order to enable a clean freeing of the protobuf response
 	memcpy(quote, resp->quoted.data, resp->quoted.len);
 	memcpy(sig, resp->signature.data, resp->signature.len);
 
-	// Convert to hex string representation to directly compare with specified values
-	// in the configuration file
-	for (size_t i = 0; i < resp->n_pcr_values; i++) {
-		pcr_strings[i] = convert_bin_to_hex_new(resp->pcr_values[i]->value.data,
-							resp->pcr_values[i]->value.len);
-	}
-
 	DEBUG("Verifying Response...");
 
 	DEBUG("Hash Algorithm: SHA%d", config->halg * 8);
@@ -166,15 +235,20 @@ attestation_verify_resp(Tpm2dToRemote *resp, const char *config_file, uint8_t *n
 	}
 
 	// Nonce verification
-	int ret_nonce = memcmp(tpms_attest.extraData.t.buffer, nonce, nonce_len);
+	bool ret_nonce = attestation_verify_nonce(resp, tpms_attest.extraData.t.buffer,
+						  tpms_attest.extraData.t.size, nonce, nonce_len);
 
 	char *nonce_str = convert_bin_to_hex_new(nonce, nonce_len);
 	char *rcv_nonce_str = convert_bin_to_hex_new(tpms_attest.extraData.t.buffer,
 						     tpms_attest.extraData.t.size);
 	DEBUG("Nonce (sent %s, received %s) - %s", nonce_str, rcv_nonce_str,
-	      ret_nonce ? "VERIFICATION FAILED" : "VERIFICATION SUCCESSFUL");
+	      ret_nonce ? "VERIFICATION SUCCESSFUL" : "VERIFICATION FAILED");
 	mem_free(nonce_str);
 	mem_free(rcv_nonce_str);
+	if (!ret_nonce) {
+		ERROR("Quote is not bound to the nonce of the request");
+		goto err;
+	}
 
 	// The signature is sent as a TPMT_SIGNATURE and has to be unmarshalled
 	TPMT_SIGNATURE tpmt_signature;
@@ -185,13 +259,10 @@ attestation_verify_resp(Tpm2dToRemote *resp, const char *config_file, uint8_t *n
 		goto err;
 	}
 
-	// Verify signature
-	ssl_init(false, NULL);
-
-	int retssl = ssl_verify_signature_from_buf(resp->certificate.data, resp->certificate.len,
-						   tpmt_signature.signature.rsapss.sig.t.buffer,
-						   tpmt_signature.signature.rsapss.sig.t.size,
-						   resp->quoted.data, resp->quoted.len);
+	// Verify signature with the already parsed certificate
+	int retssl = ssl_verify_signature_from_buf_pkey(
+		cert->key, cert->hash_algo, tpmt_signature.signature.rsapss.sig.t.buffer,
+		tpmt_signature.signature.rsapss.sig.t.size, resp->quoted.data, resp->quoted.len);
 	if (retssl != 0) {
 		ERROR("VERIFY QUOTE SIGNATURE FAILED");
 		ret = false;
@@ -201,11 +272,17 @@ attestation_verify_resp(Tpm2dToRemote *resp, const char *config_file, uint8_t *n
 	}
 
 	// PCR10 kernel module verification (from /sys/kernel/security/ima/binary_runtime_measuremts)
+	// incrementally per device, which is identified by its attestation certificate
 	hash_algo_t hash_algo = size_to_hash_algo((int)resp->halg);
-	int ret_ima =
-		ima_verify_binary_runtime_measurements(resp->ml_entry.data, resp->ml_entry.len,
-						       config->kmod_sign_cert, hash_algo,
-						       resp->pcr_values[10]->value.data);
+	if (resp->pcr_values[10]->value.len != (size_t)hash_algo_to_size(hash_algo)) {
+		ERROR("Length of received PCR value 10 does not match SHA%d", resp->halg * 8);
+		goto err;
+	}
+	ima_verify_session_t *session =
+		ima_verify_session_get(cert->id, config->kmod_sign_cert, hash_algo);
+
+	int ret_ima = ima_verify_session_update(session, resp->ml_entry.data, resp->ml_entry.len,
+						resp->pcr_values[10]->value.data);
 	if (ret_ima != 0) {
 		ERROR("Failed to verify measurement list");
 		goto err;
@@ -225,8 +302,6 @@ err:
 	for (size_t i = 0; i < resp->n_pcr_values; i++) {
 		mem_free(pcr_strings[i]);
 	}
-	protobuf_free_message((ProtobufCMessage *)config);
-	ssl_free();
 
 	return ret;
 }
@@ -248,9 +323,35 @@ attestation_response_recv_cb(int fd, unsigned events, event_io_t *io, void *data
 		(Tpm2dToRemote *)protobuf_recv_message(fd, &tpm2d_to_remote__descriptor);
 	IF_NULL_GOTO_ERROR(resp, cleanup);
 
-	verified = attestation_verify_resp(resp, resp_cb_data->config_file, resp_cb_data->nonce,
-					   resp_cb_data->nonce_len);
+	// TODO Right now, the "good" values are read from the configuration file.
+	// Later, different methods could be implemented
+	RAttestationConfig *config = rattestation_read_config_new(resp_cb_data->config_file);
+	if (!config) {
+		ERROR("Failed to read config file %s. The file has to be provided as a command line argument",
+		      resp_cb_data->config_file);
+		protobuf_free_message((ProtobufCMessage *)resp);
+		goto cleanup;
+	}
+
+	ssl_init(false, NULL);
 
+	// a certificate in the configuration pins the device, otherwise the one sent is used
+	attestation_cert_t *cert = NULL;
+	if (config->tpm_cert)
+		cert = attestation_cert_new((const uint8_t *)config->tpm_cert,
+					    strlen(config->tpm_cert));
+	else if (resp->has_certificate)
+		cert = attestation_cert_new(resp->certificate.data, resp->certificate.len);
+	if (cert) {
+		verified = attestation_verify_resp(resp, config, cert, resp_cb_data->nonce,
+						   resp_cb_data->nonce_len);
+		attestation_cert_free(cert);
+	} else {
+		ERROR("No valid certificate to verify the quote");
+	}
+
+	ssl_free();
+	protobuf_free_message((ProtobufCMessage *)config);
 	protobuf_free_message((ProtobufCMessage *)resp);
 	INFO("Handled response on connection %d", fd);
 
@@ -268,23 +369,39 @@ cleanup:
 }
 
 int
-attestation_do_request(const char *host, char *config_file, void (*resp_verified_cb)(bool))
+attestation_request_init(RemoteToTpm2d *msg, uint8_t *nonce, size_t nonce_len)
 {
+	ASSERT(msg);
+	ASSERT(nonce);
+
 	// Set nonce
-	size_t nonce_len = 8;
-	uint8_t nonce[nonce_len];
 	if (getrandom(nonce, nonce_len, (unsigned int)0) != (ssize_t)nonce_len) {
 		ERROR("Failed to create attestation request: Failed to retrieve random nonce from /dev/urandom");
 		return -1;
 	}
 
 	// build RemoteToTpm2d message
-	RemoteToTpm2d msg = REMOTE_TO_TPM2D__INIT;
+	remote_to_tpm2d__init(msg);
+
+	msg->code = REMOTE_TO_TPM2D__CODE__ATTESTATION_REQ;
+	msg->has_qualifyingdata = true;
+	msg->qualifyingdata.data = nonce;
+	msg->qualifyingdata.len = nonce_len;
+	// allow tpm2d to answer concurrent verifiers with one quote
+	msg->has_aggregate = true;
+	msg->aggregate = true;
+
+	return 0;
+}
+
+int
+attestation_do_request(const char *host, char *config_file, void (*resp_verified_cb)(bool))
+{
+	size_t nonce_len = 8;
+	uint8_t nonce[nonce_len];
+	RemoteToTpm2d msg;
 
-	msg.code = REMOTE_TO_TPM2D__CODE__ATTESTATION_REQ;
-	msg.has_qualifyingdata = true;
-	msg.qualifyingdata.data = nonce;
-	msg.qualifyingdata.len = nonce_len;
+	IF_TRUE_RETVAL(attestation_request_init(&msg, nonce, nonce_len) < 0, -1);
 
 	int sock = sock_inet_create_and_connect(SOCK_STREAM, host, TPM2D_SERVICE_PORT);
 	IF_TRUE_RETVAL(sock < 0, -1);
@@ -1,5 +1,60 @@
 #ifndef IP_AGENT_ATTESTATION_H
 #define IP_AGENT_ATTESTATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "attestation.pb-c.h"
+#include "config.pb-c.h"
+
+#define TPM2D_SERVICE_PORT "9505"
+
+/*
+ * Parsed attestation certificate of a device, i.e. the public key its
+ * quotes are verified with. It is only read by the verification, thus
+ * it may be cached and shared by concurrent verifications.
+ */
+typedef struct attestation_cert attestation_cert_t;
+
+/*
+ * Parses the PEM encoded certificate of len bytes in buf.
+ * Returns the certificate or NULL on error.
+ */
+attestation_cert_t *
+attestation_cert_new(const uint8_t *buf, size_t len);
+
+/*
+ * Returns cert if it was parsed from the same certificate as in buf,
+ * otherwise frees cert and returns the newly parsed certificate of buf
+ * (NULL on error). Allows to cache the certificate a device sends with
+ * each response.
+ */
+attestation_cert_t *
+attestation_cert_update(attestation_cert_t *cert, const uint8_t *buf, size_t len);
+
+void
+attestation_cert_free(attestation_cert_t *cert);
+
+/*
+ * Initializes msg as an attestation request with a fresh random nonce,
+ * which is stored in the caller's buffer nonce of nonce_len bytes.
+ * Returns 0 on success, -1 otherwise.
+ */
+int
+attestation_request_init(RemoteToTpm2d *msg, uint8_t *nonce, size_t nonce_len);
+
+/*
+ * Verifies the response to the request with the given nonce against the
+ * reference values in config: the PCRs, the signature of the quote with
+ * cert and the IMA measurement list of the device identified by cert.
+ * OpenSSL has to be initialized by the caller. May be called from several
+ * threads at once, e.g., for a fleet of devices.
+ */
+bool
+attestation_verify_resp(const Tpm2dToRemote *resp, const RAttestationConfig *config,
+			const attestation_cert_t *cert, const uint8_t *nonce, size_t nonce_len);
+
 /*
  * Do the attestation request
  *
@@ -35,6 +35,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <openssl/pkcs7.h>
 #include <openssl/ssl.h>
@@ -46,6 +47,7 @@
 #include "common/logf.h"
 #include "common/mem.h"
 #include "common/macro.h"
+#include "common/hashmap.h"
 
 #include "hash.h"
 #include "modsig.h"
@@ -54,6 +56,10 @@
 #define TCG_EVENT_NAME_LEN_MAX 255
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+// upper bound of signature verification threads and minimum of signatures per thread
+#define IMA_SIG_THREADS_MAX 8
+#define IMA_SIG_JOBS_PER_THREAD 32
+
 /*
  * IMA template descriptor definition
  */
@@ -93,6 +99,60 @@ struct event {
 	uint8_t *template_data;
 };
 
+/*
+ * File signature of an entry, collected while the list is parsed and verified
+ * afterwards. digest and sig point into the measurement list or into sig_info,
+ * name points to the n-ng field of the entry (not NUL terminated).
+ */
+typedef struct {
+	const uint8_t *digest;
+	size_t digest_len;
+	const uint8_t *sig;
+	size_t sig_len;
+	sig_info_t *sig_info; //!< parsed module signature holding sig, if any
+	const char *name;
+	size_t name_len;
+	size_t first; //!< first job with the same digest and signature
+	int result;
+} ima_sig_job_t;
+
+/*
+ * Signatures of one verification run. Identical (digest, signature) pairs,
+ * e.g. of files measured several times, are only verified once and the
+ * distinct ones are distributed over a number of threads.
+ */
+typedef struct {
+	ima_sig_job_t *jobs;
+	size_t jobs_len;
+	size_t jobs_size;
+	size_t *unique; //!< indices of the distinct jobs
+	size_t unique_len;
+	size_t next; //!< next distinct job to be taken by a worker
+	EVP_PKEY *pubkey;
+} ima_sig_batch_t;
+
+/*
+ * Verification state of the measurement list of one device. The list only
+ * grows, so the entries verified before are skipped by later attestations
+ * and the PCR replay continues from the checkpoint.
+ */
+struct ima_verify_session {
+	char *id;
+	char *cert;
+	hash_algo_t template_hash_algo;
+	size_t verified_len;	 //!< length of the verified prefix of the list
+	size_t verified_entries; //!< number of entries in the verified prefix
+	uint8_t pcr[EVP_MAX_MD_SIZE]; //!< PCR replayed over the verified prefix
+	uint8_t *template_data;	      //!< buffer reused for entries of the 'ima' template
+	size_t template_data_size;
+	EVP_PKEY *pubkey; //!< public key of cert, loaded on first use
+	pthread_mutex_t lock; //!< serializes verifications of the device
+};
+
+// sessions by device id, which may be looked up by several verifier threads
+static hashmap_t *ima_verify_sessions = NULL;
+static pthread_mutex_t ima_verify_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Known IMA template descriptors
 static ima_template_desc_t ima_template_desc[] = { { .name = "ima", .fmt = "d|n" },
 						   { .name = "ima-ng", .fmt = "d-ng|n-ng" },
@@ -100,21 +160,11 @@ static ima_template_desc_t ima_template_desc[] = { { .name = "ima", .fmt = "d|n"
 						   { .name = "ima-modsig",
 						     .fmt = "d-ng|n-ng|sig|d-modsig|modsig" } };
 
-static int
-print_module_name(uint8_t *buffer, size_t len)
-{
-	// Ensure terminating null
-	char *str = mem_alloc0(len + 1);
-	IF_NULL_RETVAL_ERROR(str, -1);
-	memcpy(str, buffer, len);
-	INFO("Parsing Module %s", str);
-	free(str);
-	return 0;
-}
-
 static void
-print_data(uint8_t *buf, size_t len, const char *info)
+print_data(const uint8_t *buf, size_t len, const char *info)
 {
+	IF_FALSE_RETURN(logf_enabled(LOGF_PRIO_TRACE));
+
 	uint32_t l = 2 * len + strlen(info) + 3;
 	char s[l];
 	uint32_t count = 0;
@@ -128,7 +178,7 @@ print_data(uint8_t *buf, size_t len, const char *info)
 }
 
 static int
-buf_read(void *dest, uint8_t **ptr, size_t size, size_t *remain)
+buf_read(void *dest, const uint8_t **ptr, size_t size, size_t *remain)
 {
 	if (size > *remain) {
 		return -1;
@@ -140,8 +190,179 @@ buf_read(void *dest, uint8_t **ptr, size_t size, size_t *remain)
 	return 0;
 }
 
+static void
+ima_sig_batch_add(ima_sig_batch_t *batch, const uint8_t *digest, size_t digest_len,
+		  const uint8_t *sig, size_t sig_len, sig_info_t *sig_info, const char *name,
+		  size_t name_len)
+{
+	if (batch->jobs_len == batch->jobs_size) {
+		batch->jobs_size = MAX(64, 2 * batch->jobs_size);
+		batch->jobs = mem_renew(ima_sig_job_t, batch->jobs, batch->jobs_size);
+	}
+
+	ima_sig_job_t *job = &batch->jobs[batch->jobs_len++];
+	job->digest = digest;
+	job->digest_len = digest_len;
+	job->sig = sig;
+	job->sig_len = sig_len;
+	job->sig_info = sig_info;
+	job->name = name;
+	job->name_len = name_len;
+	job->first = 0;
+	job->result = -2;
+}
+
+static void
+ima_sig_batch_clear(ima_sig_batch_t *batch)
+{
+	for (size_t i = 0; i < batch->jobs_len; i++) {
+		if (batch->jobs[i].sig_info)
+			modsig_free(batch->jobs[i].sig_info);
+	}
+	if (batch->jobs)
+		mem_free(batch->jobs);
+	if (batch->unique)
+		mem_free(batch->unique);
+	memset(batch, 0, sizeof(*batch));
+}
+
+static size_t
+ima_sig_job_hash(const void *key)
+{
+	const ima_sig_job_t *job = key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < job->digest_len; i++) {
+		hash ^= job->digest[i];
+		hash *= 0x100000001b3ULL;
+	}
+	for (size_t i = 0; i < job->sig_len; i++) {
+		hash ^= job->sig[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return (size_t)hash;
+}
+
+static bool
+ima_sig_job_equal(const void *key1, const void *key2)
+{
+	const ima_sig_job_t *job1 = key1;
+	const ima_sig_job_t *job2 = key2;
+
+	return job1->digest_len == job2->digest_len && job1->sig_len == job2->sig_len &&
+	       !memcmp(job1->digest, job2->digest, job1->digest_len) &&
+	       !memcmp(job1->sig, job2->sig, job1->sig_len);
+}
+
+/*
+ * Verifies distinct jobs of the batch until none is left. The public key is
+ * shared read-only, each verification uses its own EVP_PKEY_CTX.
+ */
+static void *
+ima_sig_batch_worker(void *data)
+{
+	ima_sig_batch_t *batch = data;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->unique_len) {
+		ima_sig_job_t *job = &batch->jobs[batch->unique[i]];
+
+		print_data(job->digest, job->digest_len, "Digest");
+		print_data(job->sig, job->sig_len, "Signature");
+
+		job->result = ssl_verify_signature_from_digest_pkey(
+			batch->pubkey, job->sig, job->sig_len, job->digest, job->digest_len);
+	}
+	return NULL;
+}
+
+static size_t
+ima_sig_batch_threads(size_t jobs)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000
+	// older OpenSSL versions are not thread-safe without locking callbacks
+	(void)jobs;
+	return 1;
+#else
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = jobs / IMA_SIG_JOBS_PER_THREAD;
+
+	if (cpus > 0 && threads > (size_t)cpus)
+		threads = cpus;
+	if (threads > IMA_SIG_THREADS_MAX)
+		threads = IMA_SIG_THREADS_MAX;
+	return MAX(threads, 1);
+#endif
+}
+
+/*
+ * Verifies all signatures collected in batch with the public key of the session.
+ * @return 0 if all signatures are valid, -1 otherwise
+ */
 static int
-verify_template_data(struct event *template, const char *cert)
+ima_sig_batch_verify(ima_verify_session_t *session, ima_sig_batch_t *batch)
+{
+	pthread_t threads[IMA_SIG_THREADS_MAX];
+	size_t nthreads, started = 0;
+	int ret = 0;
+
+	IF_TRUE_RETVAL(batch->jobs_len == 0, 0);
+
+	if (!session->pubkey) {
+		session->pubkey = ssl_get_pubkey_from_cert_buf_new(session->cert);
+		IF_NULL_RETVAL_ERROR(session->pubkey, -1);
+	}
+	batch->pubkey = session->pubkey;
+
+	hashmap_t *seen = hashmap_new(ima_sig_job_hash, ima_sig_job_equal);
+	batch->unique = mem_new(size_t, batch->jobs_len);
+	for (size_t i = 0; i < batch->jobs_len; i++) {
+		ima_sig_job_t *first = hashmap_get(seen, &batch->jobs[i]);
+		if (first) {
+			batch->jobs[i].first = first - batch->jobs;
+			continue;
+		}
+		batch->jobs[i].first = i;
+		hashmap_put(seen, &batch->jobs[i], &batch->jobs[i]);
+		batch->unique[batch->unique_len++] = i;
+	}
+	hashmap_free(seen);
+
+	nthreads = ima_sig_batch_threads(batch->unique_len);
+	for (; started + 1 < nthreads; started++) {
+		int err = pthread_create(&threads[started], NULL, ima_sig_batch_worker, batch);
+		if (err) {
+			errno = err;
+			WARN_ERRNO("Failed to start signature verification thread");
+			break;
+		}
+	}
+	// the calling thread takes its share and the remainder of failed threads
+	ima_sig_batch_worker(batch);
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (size_t i = 0; i < batch->jobs_len; i++) {
+		ima_sig_job_t *job = &batch->jobs[i];
+		if (batch->jobs[job->first].result != 0) {
+			ERROR("Signature verification FAILED for %.*s", (int)job->name_len,
+			      job->name ? job->name : "");
+			ret = -1;
+		}
+	}
+
+	IF_TRUE_RETVAL(ret, ret);
+
+	INFO("Signature verification SUCCESSFUL for %zu signatures (%zu distinct, %zu threads)",
+	     batch->jobs_len, batch->unique_len, started + 1);
+	return 0;
+}
+
+/*
+ * Parses the fields of an entry and adds its signature, if present, to batch.
+ */
+static int
+verify_template_data(struct event *template, ima_sig_batch_t *batch)
 {
 	int offset = 0;
 	size_t i;
@@ -149,6 +370,8 @@ verify_template_data(struct event *template, const char *cert)
 	char *template_fmt, *template_fmt_ptr, *f;
 	uint32_t digest_len = 0;
 	uint8_t *digest = NULL;
+	const char *name = NULL;
+	size_t name_len = 0;
 	int ret = 0;
 
 	is_ima_template = strcmp(template->name, "ima") == 0 ? 1 : 0;
@@ -209,24 +432,20 @@ verify_template_data(struct event *template, const char *cert)
 					(struct signature_v2_hdr *)(template->template_data +
 								    offset);
 
-				print_data(digest, digest_len, "Digest");
-				print_data(sig->sig, field_len - sizeof(struct signature_v2_hdr),
-					   "Signature");
-
-				int retssl = ssl_verify_signature_from_digest(
-					(const char *)cert, sig->sig,
-					field_len - sizeof(struct signature_v2_hdr), digest,
-					digest_len);
-				if (retssl != 0) {
-					ERROR("Signature verification FAILED for %s", f);
+				if (!digest || field_len < sizeof(struct signature_v2_hdr)) {
+					ERROR("%s: Malformed signature", f);
 					ret = -1;
 					goto out;
-				} else {
-					INFO("Signature verification SUCCESSFUL for %s", f);
 				}
 
+				ima_sig_batch_add(batch, digest, digest_len, sig->sig,
+						  field_len - sizeof(struct signature_v2_hdr),
+						  NULL, name, name_len);
+
 			} else if (strncmp(f, "n-ng", 4) == 0) {
-				print_module_name(template->template_data + offset, field_len);
+				name = (const char *)template->template_data + offset;
+				name_len = field_len;
+				TRACE("Parsing Module %.*s", (int)name_len, name);
 			}
 
 		} else if (strncmp(template->name, "ima-modsig", 10) == 0) {
@@ -243,30 +462,22 @@ verify_template_data(struct event *template, const char *cert)
 				sig_info = modsig_parse_new(
 					(const char *)(template->template_data + offset),
 					field_len);
-				if (!sig_info) {
+				if (!sig_info || !digest) {
 					ERROR("Failed to parse module signature");
+					if (sig_info)
+						modsig_free(sig_info);
 					ret = -1;
 					goto out;
 				}
 
-				print_data(digest, digest_len, "Digest");
-				print_data(sig_info->sig, sig_info->sig_len, "Signature");
-
-				int retssl = ssl_verify_signature_from_digest(
-					(const char *)cert, (const uint8_t *)sig_info->sig,
-					sig_info->sig_len, digest, digest_len);
-				if (retssl != 0) {
-					ERROR("Signature verification FAILED for %s", f);
-					ret = -1;
-					goto out;
-				} else {
-					INFO("Signature verification SUCCESSFUL for %s", f);
-				}
-
-				modsig_free(sig_info);
+				// the job takes over sig_info
+				ima_sig_batch_add(batch, digest, digest_len, sig_info->sig,
+						  sig_info->sig_len, sig_info, name, name_len);
 
 			} else if (strncmp(f, "n-ng", 4) == 0) {
-				print_module_name(template->template_data + offset, field_len);
+				name = (const char *)template->template_data + offset;
+				name_len = field_len;
+				TRACE("Parsing Module %.*s", (int)name_len, name);
 			}
 		}
 
@@ -280,34 +491,53 @@ out:
 	return ret;
 }
 
+/*
+ * Reads the template data of an entry. Except for the 'ima' template, whose data
+ * is assembled in the buffer of the session, it is only referenced in buf, which
+ * thus has to stay valid until the collected signatures are verified.
+ */
 static int
-read_template_data(struct event *template, uint8_t **buf, size_t *remain)
+read_template_data(ima_verify_session_t *session, struct event *template, const uint8_t **buf,
+		   size_t *remain)
 {
-	int len, is_ima_template;
+	int is_ima_template;
 
 	is_ima_template = strcmp(template->name, "ima") == 0 ? 1 : 0;
 	if (!is_ima_template) {
-		buf_read(&template->template_data_len, buf, sizeof(uint32_t), remain);
-		len = template->template_data_len;
-	} else {
-		template->template_data_len = SHA_DIGEST_LENGTH + TCG_EVENT_NAME_LEN_MAX + 1;
-		/*
-		 * Read the digest only as the event name length
-		 * is not known in advance.
-		 */
-		len = SHA_DIGEST_LENGTH;
+		IF_TRUE_RETVAL(buf_read(&template->template_data_len, buf, sizeof(uint32_t),
+					remain) < 0,
+			       -1);
+		IF_TRUE_RETVAL(template->template_data_len > *remain, -1);
+		// the template data is only read
+		template->template_data = (uint8_t *)*buf;
+		*buf += template->template_data_len;
+		*remain -= template->template_data_len;
+		return 0;
 	}
 
-	template->template_data = calloc(template->template_data_len, sizeof(uint8_t));
-	IF_NULL_RETVAL_ERROR(template->template_data, -1);
+	template->template_data_len = SHA_DIGEST_LENGTH + TCG_EVENT_NAME_LEN_MAX + 1;
 
-	buf_read(template->template_data, buf, len, remain);
-	if (is_ima_template) { /* finish 'ima' template data read */
-		uint32_t field_len = 0;
-
-		buf_read(&field_len, buf, sizeof(uint32_t), remain);
-		buf_read(template->template_data + SHA_DIGEST_LENGTH, buf, field_len, remain);
+	if (session->template_data_size < template->template_data_len) {
+		session->template_data_size =
+			MAX(template->template_data_len, 2 * session->template_data_size);
+		session->template_data =
+			mem_realloc(session->template_data, session->template_data_size);
 	}
+	template->template_data = session->template_data;
+	memset(template->template_data, 0, template->template_data_len);
+
+	/*
+	 * Read the digest only as the event name length
+	 * is not known in advance.
+	 */
+	IF_TRUE_RETVAL(buf_read(template->template_data, buf, SHA_DIGEST_LENGTH, remain) < 0, -1);
+
+	uint32_t field_len = 0;
+	IF_TRUE_RETVAL(buf_read(&field_len, buf, sizeof(uint32_t), remain) < 0, -1);
+	IF_TRUE_RETVAL(field_len > TCG_EVENT_NAME_LEN_MAX, -1);
+	IF_TRUE_RETVAL(buf_read(template->template_data + SHA_DIGEST_LENGTH, buf, field_len,
+				remain) < 0,
+		       -1);
 	return 0;
 }
 
@@ -323,27 +553,20 @@ verify_template_hash(struct event *template)
 	return -1;
 }
 
-int
-ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *cert,
-				       hash_algo_t template_hash_algo, uint8_t *pcr_tpm)
+/*
+ * Verifies the template hashes of the entries of buf starting at offset and
+ * extends pcr with them. The signatures of the entries are added to batch.
+ * @return the number of entries parsed or -1 on error
+ */
+static ssize_t
+ima_verify_entries(ima_verify_session_t *session, const uint8_t *buf, size_t size, size_t offset,
+		   uint8_t *pcr, ima_sig_batch_t *batch)
 {
-	ASSERT(buf);
-	ASSERT(cert);
-	ASSERT(pcr_tpm);
-
 	struct event template;
-	uint8_t *ptr = buf;
-	size_t remain = size;
-
-	int hash_size = hash_algo_to_size(template_hash_algo);
-	IF_FALSE_RETVAL_ERROR(hash_size > 0, -1);
-
-	uint8_t pcr[hash_size];
-
-	// PCRs are initialized with zero's
-	memset(pcr, 0, hash_size);
-
-	OpenSSL_add_all_digests();
+	const uint8_t *ptr = buf + offset;
+	size_t remain = size - offset;
+	hash_algo_t template_hash_algo = session->template_hash_algo;
+	ssize_t entries = 0;
 
 	while (!buf_read(&template.header, &ptr, sizeof(template.header), &remain)) {
 		TRACE("PCR %02d Measurement:", template.header.pcr);
@@ -351,10 +574,11 @@ ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *ce
 		IF_TRUE_RETVAL(template.header.name_len > TCG_EVENT_NAME_LEN_MAX, -1);
 
 		memset(template.name, 0, sizeof template.name);
-		buf_read(template.name, &ptr, template.header.name_len, &remain);
+		IF_TRUE_RETVAL(buf_read(template.name, &ptr, template.header.name_len, &remain) < 0,
+			       -1);
 		TRACE("Template: %s", template.name);
 
-		if (read_template_data(&template, &ptr, &remain) < 0) {
+		if (read_template_data(session, &template, &ptr, &remain) < 0) {
 			ERROR("Failed to read measurement entry %s", template.name);
 			return -1;
 		}
@@ -364,7 +588,7 @@ ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *ce
 			return -1;
 		}
 
-		if (verify_template_data(&template, cert) != 0) {
+		if (verify_template_data(&template, batch) != 0) {
 			ERROR("Failed to parse measurement entry %s", template.name);
 			return -1;
 		}
@@ -391,15 +615,183 @@ ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *ce
 			SHA1_Final(pcr, &c);
 		}
 
-		free(template.template_data);
+		entries++;
+	}
+
+	return entries;
+}
+
+static ima_verify_session_t *
+ima_verify_session_new(const char *id, const char *cert, hash_algo_t template_hash_algo)
+{
+	ima_verify_session_t *session = mem_new0(ima_verify_session_t, 1);
+
+	session->id = id ? mem_strdup(id) : NULL;
+	session->cert = mem_strdup(cert);
+	session->template_hash_algo = template_hash_algo;
+	pthread_mutex_init(&session->lock, NULL);
+
+	return session;
+}
+
+static void
+ima_verify_session_free(ima_verify_session_t *session)
+{
+	IF_NULL_RETURN(session);
+
+	if (session->id)
+		mem_free(session->id);
+	mem_free(session->cert);
+	if (session->template_data)
+		mem_free(session->template_data);
+	if (session->pubkey)
+		EVP_PKEY_free(session->pubkey);
+	pthread_mutex_destroy(&session->lock);
+	mem_free(session);
+}
+
+/*
+ * Starts the session over with new verification parameters. The session is
+ * reset in place as it may still be referenced by another verifier thread.
+ */
+static void
+ima_verify_session_reset(ima_verify_session_t *session, const char *cert,
+			 hash_algo_t template_hash_algo)
+{
+	pthread_mutex_lock(&session->lock);
+
+	mem_free(session->cert);
+	session->cert = mem_strdup(cert);
+	session->template_hash_algo = template_hash_algo;
+	session->verified_len = 0;
+	session->verified_entries = 0;
+	memset(session->pcr, 0, sizeof(session->pcr));
+	if (session->pubkey)
+		EVP_PKEY_free(session->pubkey);
+	session->pubkey = NULL;
+
+	pthread_mutex_unlock(&session->lock);
+}
+
+ima_verify_session_t *
+ima_verify_session_get(const char *id, const char *cert, hash_algo_t template_hash_algo)
+{
+	ASSERT(id);
+	ASSERT(cert);
+
+	pthread_mutex_lock(&ima_verify_sessions_lock);
+
+	if (!ima_verify_sessions)
+		ima_verify_sessions = hashmap_new_str();
+
+	ima_verify_session_t *session = hashmap_get(ima_verify_sessions, id);
+	if (session && (session->template_hash_algo != template_hash_algo ||
+			strcmp(session->cert, cert))) {
+		DEBUG("Verification parameters of device %s changed, starting over", id);
+		ima_verify_session_reset(session, cert, template_hash_algo);
+	}
+
+	if (!session) {
+		session = ima_verify_session_new(id, cert, template_hash_algo);
+		hashmap_put(ima_verify_sessions, session->id, session);
 	}
 
+	pthread_mutex_unlock(&ima_verify_sessions_lock);
+
+	return session;
+}
+
+// must be called with the session locked
+static int
+ima_verify_session_replay(ima_verify_session_t *session, const uint8_t *buf, size_t size,
+			  const uint8_t *pcr_tpm)
+{
+	int hash_size = hash_algo_to_size(session->template_hash_algo);
+	IF_FALSE_RETVAL_ERROR(hash_size > 0 && hash_size <= EVP_MAX_MD_SIZE, -1);
+
+	uint8_t pcr[EVP_MAX_MD_SIZE];
+	size_t offset = session->verified_len;
+	ssize_t entries = -1;
+	ima_sig_batch_t batch = { 0 };
+	int ret = -1;
+
+	OpenSSL_add_all_digests();
+
+	/*
+	 * The checkpoint PCR is the aggregate of the verified entries. If the
+	 * delta replayed from it matches the quoted PCR, the list still starts
+	 * with the verified prefix. Otherwise, e.g. after a reboot of the device,
+	 * the whole list is verified again. The signatures are only checked once
+	 * the cheap PCR replay matched.
+	 */
+	if (offset > 0 && offset <= size) {
+		memcpy(pcr, session->pcr, hash_size);
+		entries = ima_verify_entries(session, buf, size, offset, pcr, &batch);
+		if (entries >= 0 && memcmp(pcr, pcr_tpm, hash_size) == 0) {
+			IF_TRUE_GOTO(ima_sig_batch_verify(session, &batch), out);
+			INFO("Verified %zd new measurements after %zu verified before", entries,
+			     session->verified_entries);
+			goto commit;
+		}
+		DEBUG("Measurement list does not continue the verified prefix, verifying all");
+		ima_sig_batch_clear(&batch);
+	}
+
+	// PCRs are initialized with zero's
+	memset(pcr, 0, hash_size);
+	session->verified_len = 0;
+	session->verified_entries = 0;
+	memset(session->pcr, 0, sizeof(session->pcr));
+
+	entries = ima_verify_entries(session, buf, size, 0, pcr, &batch);
+	IF_TRUE_GOTO(entries < 0, out);
+
 	if (memcmp(pcr, pcr_tpm, hash_size) != 0) {
 		ERROR("Failed to verify the TPM PCR");
-		return -1;
+		goto out;
 	}
 
+	IF_TRUE_GOTO(ima_sig_batch_verify(session, &batch), out);
+
+commit:
 	INFO("Verify TPM PCR SUCCESSFUL");
 
-	return 0;
+	memcpy(session->pcr, pcr, hash_size);
+	session->verified_len = size;
+	session->verified_entries += entries;
+	ret = 0;
+
+out:
+	ima_sig_batch_clear(&batch);
+	return ret;
+}
+
+int
+ima_verify_session_update(ima_verify_session_t *session, const uint8_t *buf, size_t size,
+			  const uint8_t *pcr_tpm)
+{
+	ASSERT(session);
+	ASSERT(buf || size == 0);
+	ASSERT(pcr_tpm);
+
+	pthread_mutex_lock(&session->lock);
+	int ret = ima_verify_session_replay(session, buf, size, pcr_tpm);
+	pthread_mutex_unlock(&session->lock);
+
+	return ret;
+}
+
+int
+ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *cert,
+				       hash_algo_t template_hash_algo, uint8_t *pcr_tpm)
+{
+	ASSERT(buf);
+	ASSERT(cert);
+	ASSERT(pcr_tpm);
+
+	ima_verify_session_t *session = ima_verify_session_new(NULL, cert, template_hash_algo);
+	int ret = ima_verify_session_update(session, buf, size, pcr_tpm);
+	ima_verify_session_free(session);
+
+	return ret;
 }
\ No newline at end of file
@@ -24,8 +24,37 @@
 #ifndef IMA_VERIFY_H_
 #define IMA_VERIFY_H_
 
+typedef struct ima_verify_session ima_verify_session_t;
+
+/**
+ * Verifies the complete IMA binary measurement list buf: the template hashes,
+ * the signatures present in the entries using cert and the aggregate against
+ * the quoted pcr_tpm (PCR 10).
+ * @return 0 on success, -1 on error
+ */
 int
 ima_verify_binary_runtime_measurements(uint8_t *buf, size_t size, const char *cert,
 				       hash_algo_t template_hash_algo, uint8_t *pcr_tpm);
 
+/**
+ * Returns the verification session of the device identified by id, e.g. the hash
+ * of its attestation certificate. Sessions are kept for the runtime of the process.
+ * If cert or the hash algorithm differ from those of an existing session, the
+ * session starts over. May be called from several threads.
+ */
+ima_verify_session_t *
+ima_verify_session_get(const char *id, const char *cert, hash_algo_t template_hash_algo);
+
+/**
+ * Like ima_verify_binary_runtime_measurements, but only verifies the entries
+ * appended since the last successful verification of the session and continues
+ * the PCR replay from there. Falls back to verifying the whole list if it does
+ * not extend the verified one. Concurrent updates of the same session are
+ * serialized.
+ * @return 0 on success, -1 on error
+ */
+int
+ima_verify_session_update(ima_verify_session_t *session, const uint8_t *buf, size_t size,
+			  const uint8_t *pcr_tpm);
+
 #endif // IMA_VERIFY_H_
\ No newline at end of file
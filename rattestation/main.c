@@ -30,8 +30,11 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <getopt.h>
+#include <stdlib.h>
 
 #include "attestation.h"
+#include "verifier.h"
 
 #include <openssl/err.h>
 #include <openssl/sha.h>
@@ -48,25 +51,36 @@
 #define LOGFILE_DIR "/data/logs"
 #define LOGFILE_PATH LOGFILE_DIR "/rattestation"
 
+#define VERIFIER_CONCURRENCY 256
+#define VERIFIER_TIMEOUT 30000
+
 static logf_handler_t *ipagent_logfile_handler = NULL;
 static logf_handler_t *ipagent_logfile_handler_stdout = NULL;
 
-char *
-convert_bin_to_hex_new(const uint8_t *bin, int length)
-{
-	IF_TRUE_RETVAL(0 > length, NULL);
-
-	size_t len = MUL_WITH_OVERFLOW_CHECK(length, (size_t)2);
-	len = MUL_WITH_OVERFLOW_CHECK(len, sizeof(char));
-	len = ADD_WITH_OVERFLOW_CHECK(len, 1);
-	char *hex = mem_alloc0(len);
+static const struct option main_options[] = { { "fleet", required_argument, 0, 'f' },
+					      { "interval", required_argument, 0, 'i' },
+					      { "concurrency", required_argument, 0, 'j' },
+					      { "workers", required_argument, 0, 'w' },
+					      { "timeout", required_argument, 0, 't' },
+					      { "help", no_argument, 0, 'h' },
+					      { 0, 0, 0, 0 } };
 
-	for (int i = 0; i < length; ++i) {
-		// remember snprintf additionally writs a '0' byte
-		snprintf(hex + i * 2, 3, "%.2x", bin[i]);
-	}
-
-	return hex;
+static void
+main_print_usage(const char *cmd)
+{
+	printf("\n");
+	printf("Usage: %s [remote_host [config_file]]\n", cmd);
+	printf("       %s --fleet devices_file [options] [config_file]\n", cmd);
+	printf("\n");
+	printf("Verifier mode (devices_file lists one '<host> [<config_file>]' per line):\n");
+	printf("  -i, --interval SEC      attest all devices every SEC seconds (default: once)\n");
+	printf("  -j, --concurrency N     keep up to N sessions in flight (default: %d)\n",
+	       VERIFIER_CONCURRENCY);
+	printf("  -w, --workers N         verify on N threads (default: number of CPUs)\n");
+	printf("  -t, --timeout MS        wait MS milliseconds for a response (default: %d)\n",
+	       VERIFIER_TIMEOUT);
+	printf("\n");
+	exit(-1);
 }
 
 static void
@@ -92,8 +106,34 @@ main(int argc, char **argv)
 	logf_handler_set_prio(ipagent_logfile_handler, LOGF_PRIO_TRACE);
 	logf_handler_set_prio(ipagent_logfile_handler_stdout, LOGF_PRIO_TRACE);
 
-	char *rhost = (argc < 2) ? "127.0.0.1" : argv[1];
-	char *config_file = (argc < 3) ? "rattestation.conf" : argv[2];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	verifier_params_t params = { .interval = 0,
+				     .concurrency = VERIFIER_CONCURRENCY,
+				     .workers = cpus > 0 ? cpus : 1,
+				     .timeout = VERIFIER_TIMEOUT };
+
+	for (int c, option_index = 0;
+	     - 1 != (c = getopt_long(argc, argv, "+f:i:j:w:t:h", main_options, &option_index));) {
+		switch (c) {
+		case 'f':
+			params.devices_file = optarg;
+			break;
+		case 'i':
+			params.interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			params.concurrency = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			params.workers = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			params.timeout = strtoul(optarg, NULL, 10);
+			break;
+		default: // includes cases 'h' and '?'
+			main_print_usage(argv[0]);
+		}
+	}
 
 	event_init();
 
@@ -101,6 +141,25 @@ main(int argc, char **argv)
 	event_signal_t *sig = event_signal_new(SIGINT, &main_sigint_cb, NULL);
 	event_add_signal(sig);
 
+	if (params.devices_file) {
+		params.config_file = (optind < argc) ? argv[optind] : "rattestation.conf";
+
+		// results are logged per device, skip the details of each verification
+		logf_handler_set_prio(ipagent_logfile_handler, LOGF_PRIO_INFO);
+		logf_handler_set_prio(ipagent_logfile_handler_stdout, LOGF_PRIO_INFO);
+
+		if (verifier_start(&params, main_return_result_and_exit) < 0) {
+			ERROR("Failed to start verifier for devices in %s", params.devices_file);
+			main_return_result_and_exit(false);
+		}
+
+		event_loop();
+		return 0;
+	}
+
+	char *rhost = (optind < argc) ? argv[optind] : "127.0.0.1";
+	char *config_file = (optind + 1 < argc) ? argv[optind + 1] : "rattestation.conf";
+
 	/*
 	 * do attestation and register the main_retrun_result_and_exit handler
 	 * as callback when the response has been validated
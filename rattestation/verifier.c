@@ -0,0 +1,579 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/event.h"
+#include "common/hashmap.h"
+#include "common/protobuf.h"
+#include "common/ssl_util.h"
+
+#include "attestation.pb-c.h"
+#include "config.pb-c.h"
+#include "attestation.h"
+#include "config.h"
+#include "verifier.h"
+
+#define VERIFIER_NONCE_LEN 8
+
+typedef enum {
+	VERIFIER_RESULT_VERIFIED = 0,
+	VERIFIER_RESULT_FAILED,	 //!< the response did not pass the verification
+	VERIFIER_RESULT_TIMEOUT, //!< no response within the timeout
+	VERIFIER_RESULT_ERROR,	 //!< the device could not be reached or hung up
+	VERIFIER_RESULT_COUNT
+} verifier_result_t;
+
+static const char *verifier_result_str[VERIFIER_RESULT_COUNT] = { "verified", "failed", "timeout",
+								  "error" };
+
+/*
+ * Reference values shared by all devices with the same configuration file,
+ * parsed once and afterwards only read by the worker threads.
+ */
+typedef struct {
+	char *file;
+	RAttestationConfig *config;
+	attestation_cert_t *tpm_cert; //!< certificate pinned by the config, NULL if not set
+} verifier_ref_t;
+
+typedef struct {
+	char *host;
+	verifier_ref_t *ref;
+	struct sockaddr_storage addr; //!< resolved once, again after a failed session
+	socklen_t addrlen;
+	attestation_cert_t *cert; //!< certificate sent by the device, used by the workers only
+	protobuf_conn_t *conn;
+	event_timer_t *timer;
+	uint8_t nonce[VERIFIER_NONCE_LEN];
+	uint64_t start_ns;
+} verifier_device_t;
+
+// a response handed over to a worker
+typedef struct {
+	verifier_device_t *dev;
+	uint8_t *buf;
+	uint32_t len;
+	bool verified;
+	uint64_t queued_ns; //!< when the response arrived
+	uint64_t queue_ns;  //!< time waiting for a worker
+	uint64_t verify_ns; //!< time spent verifying
+} verifier_job_t;
+
+static struct {
+	verifier_params_t params;
+	void (*done_cb)(bool verified);
+	hashmap_t *refs; //!< verifier_ref_t by config file
+	verifier_device_t **devices;
+	size_t devices_len;
+	event_base_t **workers;
+	size_t next_worker;
+
+	// state of the current round
+	unsigned round;
+	uint64_t round_start_ns;
+	size_t next; //!< next device to be attested
+	size_t inflight;
+	size_t results[VERIFIER_RESULT_COUNT];
+	uint64_t *latency_ns; //!< per finished session
+	size_t latency_len;
+	uint64_t *queue_ns; //!< per verified response
+	uint64_t *verify_ns;
+	size_t verify_len;
+	event_timer_t *round_timer;
+} verifier;
+
+static void
+verifier_fill(void);
+
+static uint64_t
+verifier_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+verifier_ns_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Sorts the n samples in v and returns their percentiles
+ * in milliseconds as a JSON object.
+ */
+static char *
+verifier_percentiles_new(uint64_t *v, size_t n)
+{
+	IF_TRUE_RETVAL(n == 0, mem_strdup("null"));
+
+	qsort(v, n, sizeof(uint64_t), verifier_ns_cmp);
+#define P(p) (v[(n - 1) * (p) / 100] / 1e6)
+	return mem_printf("{\"p50\":%.1f,\"p95\":%.1f,\"p99\":%.1f,\"max\":%.1f}", P(50), P(95),
+			  P(99), P(100));
+#undef P
+}
+
+/******************************************************************************/
+
+static verifier_ref_t *
+verifier_ref_get(const char *file)
+{
+	verifier_ref_t *ref = hashmap_get(verifier.refs, file);
+	if (ref)
+		return ref;
+
+	RAttestationConfig *config = rattestation_read_config_new(file);
+	if (!config) {
+		ERROR("Failed to read config file %s", file);
+		return NULL;
+	}
+
+	ref = mem_new0(verifier_ref_t, 1);
+	ref->file = mem_strdup(file);
+	ref->config = config;
+	if (config->tpm_cert) {
+		ref->tpm_cert = attestation_cert_new((const uint8_t *)config->tpm_cert,
+						     strlen(config->tpm_cert));
+		if (!ref->tpm_cert)
+			WARN("Ignoring invalid tpm_cert in %s", file);
+	}
+
+	hashmap_put(verifier.refs, ref->file, ref);
+	return ref;
+}
+
+static int
+verifier_devices_load(const char *devices_file, const char *config_file)
+{
+	FILE *fp = fopen(devices_file, "r");
+	if (!fp) {
+		ERROR_ERRNO("Failed to open devices file %s", devices_file);
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t line_size = 0;
+	size_t lineno = 0;
+	int ret = 0;
+
+	while (getline(&line, &line_size, fp) >= 0) {
+		lineno++;
+
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		char *saveptr = NULL;
+		char *host = strtok_r(line, " \t\r\n", &saveptr);
+		if (!host)
+			continue;
+		char *file = strtok_r(NULL, " \t\r\n", &saveptr);
+
+		// hosts are logged as JSON strings
+		if (strpbrk(host, "\"\\")) {
+			ERROR("Invalid host in %s:%zu", devices_file, lineno);
+			ret = -1;
+			break;
+		}
+
+		verifier_ref_t *ref = verifier_ref_get(file ? file : config_file);
+		if (!ref) {
+			ret = -1;
+			break;
+		}
+
+		verifier_device_t *dev = mem_new0(verifier_device_t, 1);
+		dev->host = mem_strdup(host);
+		dev->ref = ref;
+
+		verifier.devices =
+			mem_renew(verifier_device_t *, verifier.devices, verifier.devices_len + 1);
+		verifier.devices[verifier.devices_len++] = dev;
+	}
+
+	free(line);
+	fclose(fp);
+
+	INFO("Loaded %zu devices with %zu reference configs from %s", verifier.devices_len,
+	     hashmap_count(verifier.refs), devices_file);
+	return ret;
+}
+
+/******************************************************************************/
+
+/*
+ * Starts a non-blocking connect to the attestation port of the device.
+ * The address is resolved on first use and cached.
+ */
+static int
+verifier_connect(verifier_device_t *dev)
+{
+	if (!dev->addrlen) {
+		struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+		struct addrinfo *res = NULL;
+
+		int status = getaddrinfo(dev->host, TPM2D_SERVICE_PORT, &hints, &res);
+		if (status) {
+			WARN("Failed to resolve %s: %s", dev->host, gai_strerror(status));
+			return -1;
+		}
+		memcpy(&dev->addr, res->ai_addr, res->ai_addrlen);
+		dev->addrlen = res->ai_addrlen;
+		freeaddrinfo(res);
+	}
+
+	int sock = socket(dev->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		WARN_ERRNO("Failed to create socket for %s", dev->host);
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr *)&dev->addr, dev->addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+		WARN_ERRNO("Failed to connect to %s", dev->host);
+		close(sock);
+		dev->addrlen = 0;
+		return -1;
+	}
+
+	return sock;
+}
+
+static void
+verifier_session_close(verifier_device_t *dev)
+{
+	if (dev->conn) {
+		protobuf_conn_free(dev->conn);
+		dev->conn = NULL;
+	}
+	if (dev->timer) {
+		event_remove_timer(dev->timer);
+		event_timer_free(dev->timer);
+		dev->timer = NULL;
+	}
+}
+
+static void
+verifier_session_finish(verifier_device_t *dev, verifier_result_t result, const verifier_job_t *job)
+{
+	verifier_session_close(dev);
+
+	uint64_t latency_ns = verifier_now_ns() - dev->start_ns;
+	verifier.latency_ns[verifier.latency_len++] = latency_ns;
+	verifier.results[result]++;
+
+	if (job) {
+		verifier.queue_ns[verifier.verify_len] = job->queue_ns;
+		verifier.verify_ns[verifier.verify_len++] = job->verify_ns;
+		INFO("{\"event\":\"attestation\",\"round\":%u,\"host\":\"%s\",\"result\":\"%s\","
+		     "\"latency_ms\":%.1f,\"queue_ms\":%.1f,\"verify_ms\":%.1f}",
+		     verifier.round, dev->host, verifier_result_str[result], latency_ns / 1e6,
+		     job->queue_ns / 1e6, job->verify_ns / 1e6);
+	} else {
+		// pick up address changes of unreachable devices
+		dev->addrlen = 0;
+		INFO("{\"event\":\"attestation\",\"round\":%u,\"host\":\"%s\",\"result\":\"%s\","
+		     "\"latency_ms\":%.1f}",
+		     verifier.round, dev->host, verifier_result_str[result], latency_ns / 1e6);
+	}
+
+	verifier.inflight--;
+	verifier_fill();
+}
+
+static void
+verifier_job_done_cb(void *data)
+{
+	verifier_job_t *job = data;
+
+	verifier_result_t result = job->verified ? VERIFIER_RESULT_VERIFIED : VERIFIER_RESULT_FAILED;
+
+	verifier_session_finish(job->dev, result, job);
+	mem_free(job);
+}
+
+// runs on a worker thread, which is the only one to access the device meanwhile
+static void
+verifier_job_run_cb(void *data)
+{
+	verifier_job_t *job = data;
+	verifier_device_t *dev = job->dev;
+	uint64_t begin = verifier_now_ns();
+
+	Tpm2dToRemote *resp = (Tpm2dToRemote *)protobuf_unpack_message(
+		&tpm2d_to_remote__descriptor, job->buf, job->len);
+	if (!resp) {
+		WARN("Failed to unpack response of %s", dev->host);
+		goto out;
+	}
+
+	const attestation_cert_t *cert = dev->ref->tpm_cert;
+	if (!cert && resp->has_certificate) {
+		// only parsed again if the device presents another certificate
+		dev->cert = attestation_cert_update(dev->cert, resp->certificate.data,
+						    resp->certificate.len);
+		cert = dev->cert;
+	}
+
+	if (cert)
+		job->verified = attestation_verify_resp(resp, dev->ref->config, cert, dev->nonce,
+							sizeof(dev->nonce));
+	else
+		WARN("No valid certificate to verify the quote of %s", dev->host);
+
+	protobuf_free_message((ProtobufCMessage *)resp);
+out:
+	job->queue_ns = begin - job->queued_ns;
+	job->verify_ns = verifier_now_ns() - begin;
+	mem_free(job->buf);
+	job->buf = NULL;
+
+	// on failure, the job stays queued until the main loop is woken up otherwise
+	if (event_base_post(event_base_main_get(), &verifier_job_done_cb, job) < 0)
+		WARN("Could not wake up main loop for completion of verification");
+}
+
+static void
+verifier_session_recv_cb(UNUSED protobuf_conn_t *conn, const uint8_t *buf, uint32_t len,
+			 void *data)
+{
+	verifier_device_t *dev = data;
+
+	verifier_job_t *job = mem_new0(verifier_job_t, 1);
+	job->dev = dev;
+	job->buf = mem_memcpy(buf, len);
+	job->len = len;
+	job->queued_ns = verifier_now_ns();
+
+	// the session is done on the network side, the device stays in flight until verified
+	verifier_session_close(dev);
+
+	event_base_t *worker = verifier.workers[verifier.next_worker];
+	verifier.next_worker = (verifier.next_worker + 1) % verifier.params.workers;
+
+	// on failure, the job stays queued until the worker is woken up otherwise
+	if (event_base_post(worker, &verifier_job_run_cb, job) < 0)
+		WARN("Could not wake up verification worker");
+}
+
+static void
+verifier_session_close_cb(UNUSED protobuf_conn_t *conn, void *data)
+{
+	verifier_device_t *dev = data;
+
+	DEBUG("Connection to %s closed without response", dev->host);
+	verifier_session_finish(dev, VERIFIER_RESULT_ERROR, NULL);
+}
+
+static void
+verifier_session_timeout_cb(event_timer_t *timer, void *data)
+{
+	verifier_device_t *dev = data;
+
+	event_timer_free(timer);
+	dev->timer = NULL;
+
+	DEBUG("No response from %s within %u ms", dev->host, verifier.params.timeout);
+	verifier_session_finish(dev, VERIFIER_RESULT_TIMEOUT, NULL);
+}
+
+static int
+verifier_session_start(verifier_device_t *dev)
+{
+	RemoteToTpm2d msg;
+
+	dev->start_ns = verifier_now_ns();
+	IF_TRUE_RETVAL(attestation_request_init(&msg, dev->nonce, sizeof(dev->nonce)) < 0, -1);
+
+	int sock = verifier_connect(dev);
+	IF_TRUE_RETVAL(sock < 0, -1);
+
+	dev->conn = protobuf_conn_new_packed(sock, &verifier_session_recv_cb,
+					     &verifier_session_close_cb, dev);
+	if (!dev->conn) {
+		close(sock);
+		return -1;
+	}
+
+	// queued until the connection is established
+	if (protobuf_conn_send_message(dev->conn, (ProtobufCMessage *)&msg) < 0) {
+		WARN("Failed to send attestation request to %s", dev->host);
+		verifier_session_close(dev);
+		return -1;
+	}
+
+	dev->timer = event_timer_new(verifier.params.timeout, 1, &verifier_session_timeout_cb, dev);
+	event_add_timer(dev->timer);
+
+	return 0;
+}
+
+/******************************************************************************/
+
+static void
+verifier_round_start_cb(event_timer_t *timer, UNUSED void *data);
+
+static void
+verifier_round_start(void)
+{
+	verifier.round++;
+	verifier.round_start_ns = verifier_now_ns();
+	verifier.next = 0;
+	verifier.latency_len = 0;
+	verifier.verify_len = 0;
+	memset(verifier.results, 0, sizeof(verifier.results));
+
+	verifier_fill();
+}
+
+static void
+verifier_round_end(void)
+{
+	uint64_t duration_ns = MAX(verifier_now_ns() - verifier.round_start_ns, 1ULL);
+	char *latency = verifier_percentiles_new(verifier.latency_ns, verifier.latency_len);
+	char *queue = verifier_percentiles_new(verifier.queue_ns, verifier.verify_len);
+	char *verify = verifier_percentiles_new(verifier.verify_ns, verifier.verify_len);
+
+	INFO("{\"event\":\"round\",\"round\":%u,\"devices\":%zu,\"verified\":%zu,\"failed\":%zu,"
+	     "\"timeout\":%zu,\"error\":%zu,\"duration_ms\":%.1f,\"throughput\":%.1f,"
+	     "\"concurrency\":%u,\"workers\":%u,\"latency_ms\":%s,\"queue_ms\":%s,"
+	     "\"verify_ms\":%s}",
+	     verifier.round, verifier.devices_len, verifier.results[VERIFIER_RESULT_VERIFIED],
+	     verifier.results[VERIFIER_RESULT_FAILED], verifier.results[VERIFIER_RESULT_TIMEOUT],
+	     verifier.results[VERIFIER_RESULT_ERROR], duration_ns / 1e6,
+	     verifier.devices_len / (duration_ns / 1e9), verifier.params.concurrency,
+	     verifier.params.workers, latency, queue, verify);
+
+	mem_free(latency);
+	mem_free(queue);
+	mem_free(verify);
+
+	if (!verifier.params.interval) {
+		if (verifier.done_cb)
+			verifier.done_cb(verifier.results[VERIFIER_RESULT_VERIFIED] ==
+					 verifier.devices_len);
+		return;
+	}
+
+	// the interval is measured between the starts of the rounds
+	uint64_t interval_ns = verifier.params.interval * 1000000000ULL;
+	int delay_ms = duration_ns < interval_ns ? (interval_ns - duration_ns) / 1000000 : 0;
+	verifier.round_timer = event_timer_new(delay_ms, 1, &verifier_round_start_cb, NULL);
+	event_add_timer(verifier.round_timer);
+}
+
+static void
+verifier_round_start_cb(event_timer_t *timer, UNUSED void *data)
+{
+	event_timer_free(timer);
+	verifier.round_timer = NULL;
+
+	verifier_round_start();
+}
+
+/*
+ * Starts sessions up to the concurrency limit and ends the
+ * round once all devices are done.
+ */
+static void
+verifier_fill(void)
+{
+	while (verifier.inflight < verifier.params.concurrency &&
+	       verifier.next < verifier.devices_len) {
+		verifier_device_t *dev = verifier.devices[verifier.next++];
+
+		verifier.inflight++;
+		if (verifier_session_start(dev) < 0) {
+			verifier.inflight--;
+			dev->addrlen = 0;
+			verifier.latency_ns[verifier.latency_len++] =
+				verifier_now_ns() - dev->start_ns;
+			verifier.results[VERIFIER_RESULT_ERROR]++;
+			INFO("{\"event\":\"attestation\",\"round\":%u,\"host\":\"%s\","
+			     "\"result\":\"%s\"}",
+			     verifier.round, dev->host, verifier_result_str[VERIFIER_RESULT_ERROR]);
+		}
+	}
+
+	if (!verifier.inflight && verifier.next == verifier.devices_len)
+		verifier_round_end();
+}
+
+/******************************************************************************/
+
+int
+verifier_start(const verifier_params_t *params, void (*done_cb)(bool verified))
+{
+	ASSERT(params);
+	ASSERT(params->devices_file);
+	ASSERT(params->config_file);
+
+	verifier.params = *params;
+	verifier.params.concurrency = MAX(params->concurrency, 1u);
+	verifier.params.workers = MAX(params->workers, 1u);
+	verifier.done_cb = done_cb;
+	verifier.refs = hashmap_new_str();
+
+	IF_TRUE_RETVAL(verifier_devices_load(params->devices_file, params->config_file) < 0, -1);
+	if (!verifier.devices_len) {
+		ERROR("No devices in %s", params->devices_file);
+		return -1;
+	}
+
+	verifier.latency_ns = mem_new(uint64_t, verifier.devices_len);
+	verifier.queue_ns = mem_new(uint64_t, verifier.devices_len);
+	verifier.verify_ns = mem_new(uint64_t, verifier.devices_len);
+
+	// once for all verifications, instead of around each of them
+	ssl_init(false, NULL);
+
+	verifier.workers = mem_new0(event_base_t *, verifier.params.workers);
+	for (size_t i = 0; i < verifier.params.workers; i++) {
+		verifier.workers[i] = event_base_new();
+		if (!verifier.workers[i] || event_base_start_thread(verifier.workers[i]) < 0) {
+			ERROR("Could not start verification worker");
+			return -1;
+		}
+	}
+
+	INFO("Verifying %zu devices with %u sessions in flight and %u workers",
+	     verifier.devices_len, verifier.params.concurrency, verifier.params.workers);
+
+	verifier_round_start();
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file verifier.h
+ *
+ * Verifier mode, which attests a fleet of devices. Many attestation sessions
+ * are kept concurrently on the event loop, the responses are verified on a
+ * pool of worker threads. The reference configurations and certificates are
+ * parsed once and cached per device. Results and per round throughput and
+ * latency metrics are logged as single line JSON objects.
+ */
+
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <stdbool.h>
+
+typedef struct {
+	const char *devices_file; //!< one device per line: <host> [<config_file>]
+	const char *config_file;  //!< reference config of devices without their own
+	unsigned interval;	  //!< seconds between the starts of rounds, 0 for one round
+	unsigned concurrency;	  //!< maximum number of sessions in flight
+	unsigned workers;	  //!< number of verification threads
+	unsigned timeout;	  //!< milliseconds until a response must have arrived
+} verifier_params_t;
+
+/**
+ * Loads the devices and their reference configurations and starts the first
+ * round of attestations on the event loop.
+ *
+ * @param params the verifier parameters
+ * @param done_cb called after the round if params->interval is 0 with true
+ *                if all devices were verified successfully
+ * @return 0 on success, -1 otherwise
+ */
+int
+verifier_start(const verifier_params_t *params, void (*done_cb)(bool verified));
+
+#endif /* VERIFIER_H */
@@ -33,6 +33,13 @@ LOCAL_SRC_FILES := \
 	common/logf.c \
 	common/dir.c \
 	common/mem.c \
+	common/fd.c \
+	common/file.c \
+	common/event.c \
+	common/hashmap.c \
+	common/ilist.c \
+	common/ns.c \
+	common/proc.c \
 	run.c
 
 LOCAL_STATIC_LIBRARIES := \
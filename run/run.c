@@ -24,26 +24,28 @@
 #include "common/macro.h"
 #include "common/dir.h"
 #include "common/mem.h"
+#include "common/file.h"
+#include "common/ns.h"
+#include "common/proc.h"
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <signal.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/wait.h>
 #include <sys/syscall.h>
-
-int
-setns(int fd, int nstype)
-{
-	return syscall(__NR_setns, fd, nstype);
-}
+#include <sys/vfs.h>
+#include <linux/magic.h>
 
 static void
 usage(char *pname)
 {
-	ERROR("Usage: %s container-pid cmd [arg...]\n", pname);
+	ERROR("Usage: %s [--pidfd] container-pid cmd [arg...]\n", pname);
 	exit(-1);
 }
 
@@ -79,20 +81,92 @@ error:
 	abort();
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * Opens the cgroup v2 directory of pid, which has to be done before the mount
+ * namespace of the container is joined. Returns -1 without unified hierarchy.
+ */
+static int
+run_open_cgroup(pid_t pid)
 {
-	logf_register(&logf_test_write, stderr);
-
-	if (argc < 3)
-		usage(argv[0]);
+	char *cgroup_file = mem_printf("/proc/%d/cgroup", pid);
+	char *cgroups = file_read_new(cgroup_file, 4096);
+	mem_free(cgroup_file);
+	IF_NULL_RETVAL(cgroups, -1);
+
+	int fd = -1;
+	struct statfs sfs;
+	// the unified hierarchy is listed as "0::<path>"
+	char *line = strstr(cgroups, "0::");
+	if (line && (line == cgroups || line[-1] == '\n')) {
+		line += strlen("0::");
+		line[strcspn(line, "\n")] = '\0';
+		char *path = mem_printf("/sys/fs/cgroup%s", line);
+		fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1) {
+			WARN_ERRNO("Could not open cgroup %s", path);
+		} else if (fstatfs(fd, &sfs) == -1 || sfs.f_type != CGROUP2_SUPER_MAGIC) {
+			// hybrid setup, the unified hierarchy is not mounted there
+			TRACE("%s is not a cgroup v2 directory", path);
+			close(fd);
+			fd = -1;
+		}
+		mem_free(path);
+	}
+	mem_free(cgroups);
+	return fd;
+}
 
-	pid_t pid = strtol(argv[1], NULL, 10);
-	if (!pid) {
-		ERROR("No valid PID given");
-		usage(argv[0]);
+/*
+ * Forks the child directly into the cgroup given by cgroup_fd, if any, instead
+ * of migrating it afterwards. Falls back to fork() if clone3() is not supported.
+ */
+static pid_t
+run_fork_into_cgroup(int cgroup_fd)
+{
+	if (cgroup_fd >= 0) {
+		pid_t pid = proc_clone3(0, cgroup_fd, NULL);
+		if (pid != -1)
+			return pid;
+		WARN_ERRNO("clone3() into container cgroup failed, falling back to fork()");
 	}
+	return fork();
+}
 
+/*
+ * Joins the namespaces of pid through a single setns() on a pidfd of the
+ * process. The cgroup and user namespaces are joined by the child, as the
+ * cgroup of the container has to be reachable for CLONE_INTO_CGROUP and
+ * writable with the credentials of the caller.
+ */
+static pid_t
+run_join_pidfd(pid_t pid)
+{
+	int pidfd = proc_pidfd_open(pid);
+	if (pidfd == -1)
+		FATAL_ERRNO("Could not open pidfd of %d, wrong PID?", pid);
+
+	int cgroup_fd = run_open_cgroup(pid);
+
+	if (ns_join_pidfd(pidfd, pid,
+			  CLONE_NEWIPC | CLONE_NEWNET | CLONE_NEWUTS | CLONE_NEWPID | CLONE_NEWTIME |
+				  CLONE_NEWNS) < 0)
+		FATAL("Could not join namespaces of %d", pid);
+
+	TRACE("Successfully joined namespaces, now forking...");
+
+	pid_t child = run_fork_into_cgroup(cgroup_fd);
+	if (child == 0 && ns_join_pidfd(pidfd, pid, CLONE_NEWCGROUP | CLONE_NEWUSER) < 0)
+		FATAL("Could not join cgroup and user namespaces of %d", pid);
+
+	if (cgroup_fd >= 0)
+		close(cgroup_fd);
+	close(pidfd);
+	return child;
+}
+
+static pid_t
+run_join_ns_files(pid_t pid)
+{
 	char *folder = mem_printf("/proc/%d/ns/", pid);
 
 	int i = 0;
@@ -108,7 +182,31 @@ main(int argc, char *argv[])
 
 	TRACE("Successfully joined all namespaces, now forking...");
 
-	pid = fork();
+	return fork();
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *pname = argv[0];
+	logf_register(&logf_test_write, stderr);
+
+	bool use_pidfd = argc > 1 && !strcmp(argv[1], "--pidfd");
+	if (use_pidfd) {
+		argc--;
+		argv++;
+	}
+
+	if (argc < 3)
+		usage(pname);
+
+	pid_t pid = strtol(argv[1], NULL, 10);
+	if (!pid) {
+		ERROR("No valid PID given");
+		usage(pname);
+	}
+
+	pid = use_pidfd ? run_join_pidfd(pid) : run_join_ns_files(pid);
 	if (pid == -1) {
 		FATAL_ERRNO("fork failed");
 	}
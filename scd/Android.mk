@@ -31,6 +31,7 @@ LOCAL_MODULE := cml-scd
 LOCAL_MODULE_TAGS := optional
 LOCAL_SRC_FILES := \
 	common/list.c \
+	common/ilist.c \
 	common/logf.c \
 	common/mem.c \
 	common/sock.c \
@@ -46,6 +47,7 @@ LOCAL_SRC_FILES := \
 	scd.proto \
 	device.proto \
 	control.c \
+	keycache.c \
 	softtoken.c \
 	scd.c
 
@@ -53,6 +55,7 @@ ifeq ($(shell test $(PLATFORM_VERSION_MAJOR) -gt 5; echo $$?),0)
 
 LOCAL_STATIC_LIBRARIES := \
 	libprotobuf-c-text \
+	libz \
 	libcutils \
 	openssl_libcrypto_static \
 	liblog \
@@ -65,6 +68,7 @@ else
 
 LOCAL_STATIC_LIBRARIES := \
 	libprotobuf-c-text \
+	libz \
 	libcutils \
 	libcrypto_static \
 	liblog \
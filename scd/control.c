@@ -30,6 +30,7 @@
 
 #include "usbtoken.h"
 #include "softtoken.h"
+#include "keycache.h"
 #include "scd.h"
 
 #include "common/macro.h"
@@ -43,6 +44,9 @@
 #include "common/protobuf.h"
 #include "common/ssl_util.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <google/protobuf-c/protobuf-c-text.h>
@@ -51,6 +55,9 @@
 #define SCD_CONTROL_SOCK_LISTEN_BACKLOG 8
 #define KEY_LENGTH_BYTES 64
 
+// hash and verify requests are mostly bound by storage throughput
+#define SCD_CONTROL_THREADS_MAX 4
+
 //#undef LOGF_LOG_MIN_PRIO
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
@@ -58,6 +65,28 @@ struct scd_control {
 	int sock; // listen socket fd
 };
 
+/*
+ * A client connection, which stays allocated until the crypto jobs of its
+ * requests are done, so that they do not answer on a reused fd.
+ */
+typedef struct scd_control_conn {
+	int fd; // -1 after the client closed the connection
+	unsigned refs;
+} scd_control_conn_t;
+
+typedef struct scd_control_job {
+	DaemonToToken *msg;
+	scd_control_conn_t *conn;
+	TokenToDaemon__Code code;
+	unsigned char *hash;
+	unsigned int hash_len;
+} scd_control_job_t;
+
+static pthread_mutex_t scd_control_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scd_control_cond = PTHREAD_COND_INITIALIZER;
+static list_t *scd_control_queue = NULL;
+static unsigned scd_control_threads = 0;
+
 UNUSED static list_t *control_list = NULL;
 
 /* keep in sync with offered algorithms by protobuf */
@@ -184,6 +213,20 @@ do_signature:
 	return out_code;
 }
 
+/*
+ * Sends out as response to msg. The request_id is echoed, so that clients with
+ * multiple outstanding requests on one connection can match the responses.
+ */
+static void
+scd_control_send_response(const DaemonToToken *msg, int fd, TokenToDaemon *out)
+{
+	if (msg->has_request_id) {
+		out->has_request_id = true;
+		out->request_id = msg->request_id;
+	}
+	protobuf_send_message(fd, (ProtobufCMessage *)out);
+}
+
 static void
 scd_control_handle_message(const DaemonToToken *msg, int fd)
 {
@@ -192,7 +235,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 		return;
 	}
 
-	if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
+	if (logf_enabled(LOGF_PRIO_TRACE)) {
 		char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
 		TRACE("Handling DaemonToToken message:\n%s", msg_text ? msg_text : "NULL");
 		if (msg_text)
@@ -215,7 +258,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 			ERROR("Could not create new token");
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 	} break;
 	case DAEMON_TO_TOKEN__CODE__TOKEN_REMOVE: {
 		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
@@ -223,6 +266,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 
 		scd_token_t *token = scd_get_token_from_msg(msg);
 
+		keycache_invalidate(msg->token_uuid);
 		if (token == NULL) {
 			ERROR("Token not found");
 		} else {
@@ -230,7 +274,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 			out.code = TOKEN_TO_DAEMON__CODE__TOKEN_REMOVE_SUCCESSFUL;
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 	} break;
 	case DAEMON_TO_TOKEN__CODE__UNLOCK: {
 		TRACE("SCD: Handle messsage UNLOCK");
@@ -245,12 +289,23 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 			ERROR("Token passphrase not specified");
 		} else if (token->is_locked_till_reboot(token)) {
 			out.code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
+		} else if (token->is_locked(token) &&
+			   keycache_unlock(msg->token_uuid, msg->token_pin,
+					   msg->pairing_secret.data, msg->pairing_secret.len)) {
+			out.code = TOKEN_TO_DAEMON__CODE__UNLOCK_SUCCESSFUL;
+			out.has_key_cached = true;
+			out.key_cached = true;
 		} else {
 			int ret = token->unlock(token, msg->token_pin, msg->pairing_secret.data,
 						msg->pairing_secret.len);
-			if (ret == 0)
+			if (ret == 0) {
 				out.code = TOKEN_TO_DAEMON__CODE__UNLOCK_SUCCESSFUL;
-			else if (ret == -2) {
+				keycache_token_unlocked(msg->token_uuid, msg->token_pin,
+							msg->pairing_secret.data,
+							msg->pairing_secret.len);
+			} else if (ret == -2) {
+				// a wrong PIN must not be retried against the cache
+				keycache_invalidate(msg->token_uuid);
 				if (token->is_locked_till_reboot(token))
 					out.code = TOKEN_TO_DAEMON__CODE__LOCKED_TILL_REBOOT;
 				else
@@ -259,7 +314,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 				out.code = TOKEN_TO_DAEMON__CODE__UNLOCK_FAILED;
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 	} break;
 	case DAEMON_TO_TOKEN__CODE__LOCK: {
 		TRACE("SCD: Handle messsage LOCK");
@@ -269,11 +324,16 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 		scd_token_t *token = scd_get_token_from_msg(msg);
 		if (!token) {
 			ERROR("No token loaded, lock failed");
+		} else if (keycache_is_unlocked(msg->token_uuid) && token->is_locked(token)) {
+			// the token itself has not been unlocked
+			keycache_lock(msg->token_uuid);
+			out.code = TOKEN_TO_DAEMON__CODE__LOCK_SUCCESSFUL;
 		} else if (token->lock(token) == 0) {
+			keycache_lock(msg->token_uuid);
 			out.code = TOKEN_TO_DAEMON__CODE__LOCK_SUCCESSFUL;
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 	} break;
 	case DAEMON_TO_TOKEN__CODE__WRAP_KEY: {
 		TRACE("SCD: Handle messsage WRAP_KEY");
@@ -295,11 +355,14 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 			out.has_wrapped_key = true;
 			out.wrapped_key.len = wrapped_key_len;
 			out.wrapped_key.data = wrapped_key;
+			keycache_put(msg->token_uuid, msg->container_uuid, wrapped_key,
+				     wrapped_key_len, msg->unwrapped_key.data,
+				     msg->unwrapped_key.len);
 		} else {
 			ERROR("Key wrapping failed");
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 		if (out.has_wrapped_key) {
 			memset(wrapped_key, 0, wrapped_key_len);
 			mem_free(wrapped_key);
@@ -313,23 +376,39 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 		out.code = TOKEN_TO_DAEMON__CODE__UNWRAPPED_KEY;
 
 		scd_token_t *token = scd_get_token_from_msg(msg);
+		bool cache_unlocked = keycache_is_unlocked(msg->token_uuid);
 		if (!token) {
 			ERROR("No token loaded, unwrap failed");
-		} else if (token->is_locked(token)) {
+		} else if (token->is_locked(token) && !cache_unlocked) {
 			ERROR("Token is locked. Unlock first.");
 		} else if (!msg->has_wrapped_key) {
 			ERROR("Wrapped key not specified.");
+		} else if ((unwrapped_key = keycache_get_new(msg->token_uuid, msg->container_uuid,
+							     msg->wrapped_key.data,
+							     msg->wrapped_key.len,
+							     &unwrapped_key_len))) {
+			out.has_unwrapped_key = true;
+			out.unwrapped_key.len = unwrapped_key_len;
+			out.unwrapped_key.data = unwrapped_key;
+			out.has_key_cached = true;
+			out.key_cached = true;
+		} else if (token->is_locked(token)) {
+			// only unlocked by the cache, which does not hold this key
+			ERROR("Cached key does not match, unlock the token first.");
+			keycache_invalidate(msg->token_uuid);
 		} else if (token->unwrap_key(token, msg->container_uuid, msg->wrapped_key.data,
 					     msg->wrapped_key.len, &unwrapped_key,
 					     &unwrapped_key_len) == 0) {
 			out.has_unwrapped_key = true;
 			out.unwrapped_key.len = unwrapped_key_len;
 			out.unwrapped_key.data = unwrapped_key;
+			keycache_put(msg->token_uuid, msg->container_uuid, msg->wrapped_key.data,
+				     msg->wrapped_key.len, unwrapped_key, unwrapped_key_len);
 		} else {
 			ERROR("Key unwrapping failed");
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 		if (out.has_unwrapped_key) {
 			memset(unwrapped_key, 0, unwrapped_key_len);
 			mem_free(unwrapped_key);
@@ -341,6 +420,8 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 		out.code = TOKEN_TO_DAEMON__CODE__CHANGE_PIN_FAILED;
 
 		scd_token_t *token = scd_get_token_from_msg(msg);
+		// the cache is bound to the old PIN
+		keycache_invalidate(msg->token_uuid);
 		if (!token) {
 			ERROR("No token loaded, change pass failed");
 		} else if (!msg->token_pin) {
@@ -357,7 +438,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 				out.code = TOKEN_TO_DAEMON__CODE__CHANGE_PIN_FAILED;
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 	} break;
 	case DAEMON_TO_TOKEN__CODE__PROVISION_PIN: {
 		TRACE("SCD: Handle messsage PROVISION_PIN");
@@ -365,6 +446,8 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 		out.code = TOKEN_TO_DAEMON__CODE__CHANGE_PIN_FAILED;
 
 		scd_token_t *token = scd_get_token_from_msg(msg);
+		// the cache is bound to the old PIN
+		keycache_invalidate(msg->token_uuid);
 		if (!token) {
 			ERROR("No token loaded, change pass failed");
 		} else if (!msg->token_pin) {
@@ -384,7 +467,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 			}
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 	} break;
 	case DAEMON_TO_TOKEN__CODE__PULL_DEVICE_CSR: {
 		TRACE("SCD: Handle messsage PULL_DEV_CSR");
@@ -407,7 +490,7 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 				out.device_csr.data = csr;
 			}
 		}
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 		INFO("csr: %p", csr);
 		if (csr)
 			mem_free(csr);
@@ -427,36 +510,58 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 		} else {
 			out.code = TOKEN_TO_DAEMON__CODE__DEVICE_CERT_OK;
 		}
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		scd_control_send_response(msg, fd, &out);
 	} break;
+	default:
+		WARN("DaemonToToken command %d unknown or not implemented yet", msg->code);
+		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
+		out.code = TOKEN_TO_DAEMON__CODE__CMD_UNKNOWN;
+		scd_control_send_response(msg, fd, &out);
+		break;
+	}
+}
+
+static void
+scd_control_conn_unref(scd_control_conn_t *conn)
+{
+	if (--conn->refs == 0)
+		mem_free(conn);
+}
+
+static bool
+scd_control_is_crypto_request(const DaemonToToken *msg)
+{
+	return msg->code == DAEMON_TO_TOKEN__CODE__CRYPTO_HASH_FILE ||
+	       msg->code == DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_BUF ||
+	       msg->code == DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_FILE;
+}
+
+/*
+ * Computes the result of a hash or verify request. Does not touch any token,
+ * thus it may run in a worker thread.
+ */
+static void
+scd_control_job_run(scd_control_job_t *job)
+{
+	const DaemonToToken *msg = job->msg;
+
+	switch (msg->code) {
 	case DAEMON_TO_TOKEN__CODE__CRYPTO_HASH_FILE: {
 		TRACE("SCD: Handle messsage CRYPTO_HASH_FILE");
-		unsigned int hash_len;
-		const char *hash_algo;
-		unsigned char *hash = NULL;
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR;
+		job->code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_ERROR;
 
-		hash_algo = switch_proto_hash_algo(msg->hash_algo);
+		const char *hash_algo = switch_proto_hash_algo(msg->hash_algo);
+		IF_NULL_RETURN(hash_algo);
 
-		if (hash_algo) {
-			if ((hash = ssl_hash_file(msg->hash_file, &hash_len, hash_algo)) == NULL) {
-				ERROR("Hashing file failed");
-			} else {
-				out.has_hash_value = true;
-				out.hash_value.len = hash_len;
-				out.hash_value.data = hash;
-				out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK;
-			}
+		job->hash = ssl_hash_file(msg->hash_file, &job->hash_len, hash_algo);
+		if (job->hash == NULL) {
+			ERROR("Hashing file failed");
+		} else {
+			job->code = TOKEN_TO_DAEMON__CODE__CRYPTO_HASH_OK;
 		}
-
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-		if (hash)
-			mem_free(hash);
 	} break;
 	case DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_BUF: {
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR;
+		job->code = TOKEN_TO_DAEMON__CODE__CRYPTO_VERIFY_ERROR;
 		char *tmp_data_file =
 			write_to_tmpfile_new(msg->verify_data_buf.data, msg->verify_data_buf.len);
 		char *tmp_sig_file =
@@ -464,13 +569,12 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 		char *tmp_cert_file =
 			write_to_tmpfile_new(msg->verify_cert_buf.data, msg->verify_cert_buf.len);
 		if (tmp_data_file && tmp_sig_file && tmp_cert_file) {
-			out.code =
+			job->code =
 				scd_control_handle_verify(tmp_data_file, tmp_sig_file,
 							  tmp_cert_file,
 							  switch_proto_hash_algo(msg->hash_algo));
 		}
 
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
 		if (tmp_data_file) {
 			unlink(tmp_data_file);
 			mem_free(tmp_data_file);
@@ -483,47 +587,158 @@ scd_control_handle_message(const DaemonToToken *msg, int fd)
 			unlink(tmp_cert_file);
 			mem_free(tmp_cert_file);
 		}
-
 	} break;
 	case DAEMON_TO_TOKEN__CODE__CRYPTO_VERIFY_FILE: {
 		TRACE("SCD: Handle messsage CRYPTO_VERIFY_FILE");
-		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = scd_control_handle_verify(msg->verify_data_file, msg->verify_sig_file,
-						     msg->verify_cert_file,
-						     switch_proto_hash_algo(msg->hash_algo));
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		job->code = scd_control_handle_verify(msg->verify_data_file, msg->verify_sig_file,
+						      msg->verify_cert_file,
+						      switch_proto_hash_algo(msg->hash_algo));
 	} break;
 	default:
-		WARN("DaemonToToken command %d unknown or not implemented yet", msg->code);
+		ASSERT(false);
+	}
+}
+
+/*
+ * Sends the result of the job and frees it; runs in the main event loop, so
+ * that responses are never interleaved with others on the same connection.
+ */
+static void
+scd_control_job_done_cb(void *data)
+{
+	scd_control_job_t *job = data;
+
+	if (job->conn->fd >= 0) {
 		TokenToDaemon out = TOKEN_TO_DAEMON__INIT;
-		out.code = TOKEN_TO_DAEMON__CODE__CMD_UNKNOWN;
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-		break;
+		out.code = job->code;
+		if (job->hash) {
+			out.has_hash_value = true;
+			out.hash_value.len = job->hash_len;
+			out.hash_value.data = job->hash;
+		}
+		scd_control_send_response(job->msg, job->conn->fd, &out);
+	} else {
+		DEBUG("Dropping response, control client already disconnected");
+	}
+
+	protobuf_free_message((ProtobufCMessage *)job->msg);
+	if (job->hash)
+		mem_free(job->hash);
+	scd_control_conn_unref(job->conn);
+	mem_free(job);
+}
+
+static void *
+scd_control_worker_main(UNUSED void *arg)
+{
+	for (;;) {
+		pthread_mutex_lock(&scd_control_lock);
+		while (!scd_control_queue)
+			pthread_cond_wait(&scd_control_cond, &scd_control_lock);
+		scd_control_job_t *job = scd_control_queue->data;
+		scd_control_queue = list_unlink(scd_control_queue, scd_control_queue);
+		pthread_mutex_unlock(&scd_control_lock);
+
+		scd_control_job_run(job);
+
+		if (event_base_post(event_base_main_get(), &scd_control_job_done_cb, job) < 0) {
+			// conn is only touched by the main loop, leak the job rather than racing
+			ERROR("Could not deliver crypto result to main loop");
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts the worker threads on first use. Must be called with scd_control_lock held.
+ */
+static int
+scd_control_pool_start(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned n = cpus < 1 ? 1 : MIN((unsigned)cpus, SCD_CONTROL_THREADS_MAX);
+
+	// worker threads must not receive process signals, those are handled by the main loop
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	while (scd_control_threads < n) {
+		pthread_t thread;
+		int ret = pthread_create(&thread, NULL, &scd_control_worker_main, NULL);
+		if (ret != 0) {
+			errno = ret;
+			WARN_ERRNO("Could not start crypto worker thread");
+			break;
+		}
+		pthread_detach(thread);
+		scd_control_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	DEBUG("Started %u crypto worker threads", scd_control_threads);
+	return scd_control_threads ? 0 : -1;
+}
+
+/*
+ * Hands a hash or verify request over to the worker threads, which takes
+ * ownership of msg. Falls back to handling it in place if no thread is available.
+ */
+static void
+scd_control_job_queue(DaemonToToken *msg, scd_control_conn_t *conn)
+{
+	int ret = 0;
+	scd_control_job_t *job = mem_new0(scd_control_job_t, 1);
+	job->msg = msg;
+	job->conn = conn;
+	conn->refs++;
+
+	pthread_mutex_lock(&scd_control_lock);
+	if (!scd_control_threads)
+		ret = scd_control_pool_start();
+	if (!ret) {
+		scd_control_queue = list_append(scd_control_queue, job);
+		pthread_cond_signal(&scd_control_cond);
+	}
+	pthread_mutex_unlock(&scd_control_lock);
+
+	if (ret < 0) {
+		scd_control_job_run(job);
+		scd_control_job_done_cb(job);
 	}
 }
 
 /**
  * Event callback for incoming data that a ControllerToDaemon message.
  *
- * The handle_message function will be called to handle the received message.
+ * The handle_message function will be called to handle the received message,
+ * hash and verify requests are passed to the crypto worker threads.
  *
  * @param fd	    file descriptor of the client connection
  *		    from which the incoming message is read
  * @param events    event flags
  * @param io	    pointer to associated event_io_t struct
- * @param data	    pointer to this scd_control_t struct
+ * @param data	    pointer to the scd_control_conn_t of the connection
  */
 static void
-scd_control_cb_recv_message(int fd, unsigned events, event_io_t *io, UNUSED void *data)
+scd_control_cb_recv_message(int fd, unsigned events, event_io_t *io, void *data)
 {
+	scd_control_conn_t *conn = data;
+	ASSERT(conn);
+
 	if (events & EVENT_IO_READ) {
 		DaemonToToken *msg =
 			(DaemonToToken *)protobuf_recv_message(fd, &daemon_to_token__descriptor);
 		// close connection if client EOF, or protocol parse error
 		IF_NULL_GOTO_TRACE(msg, connection_err);
 
-		scd_control_handle_message(msg, fd);
-		protobuf_free_message((ProtobufCMessage *)msg);
+		// token operations stay serialized in the main loop
+		if (scd_control_is_crypto_request(msg)) {
+			scd_control_job_queue(msg, conn);
+		} else {
+			scd_control_handle_message(msg, fd);
+			protobuf_free_message((ProtobufCMessage *)msg);
+		}
 		DEBUG("Handled control connection %d", fd);
 	}
 	if (events & EVENT_IO_EXCEPT) {
@@ -537,6 +752,8 @@ connection_err:
 	event_io_free(io);
 	if (close(fd) < 0)
 		WARN_ERRNO("Failed to close connected control socket");
+	conn->fd = -1;
+	scd_control_conn_unref(conn);
 	return;
 }
 /**
@@ -573,7 +790,10 @@ scd_control_cb_accept(int fd, unsigned events, event_io_t *io, void *data)
 
 	fd_make_non_blocking(cfd);
 
-	event_io_t *event = event_io_new(cfd, EVENT_IO_READ, scd_control_cb_recv_message, control);
+	scd_control_conn_t *conn = mem_new0(scd_control_conn_t, 1);
+	conn->fd = cfd;
+	conn->refs = 1;
+	event_io_t *event = event_io_new(cfd, EVENT_IO_READ, scd_control_cb_recv_message, conn);
 	event_add_io(event);
 }
 
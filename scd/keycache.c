@@ -0,0 +1,285 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include "keycache.h"
+
+#include "common/macro.h"
+#include "common/mem.h"
+#include "common/list.h"
+#include "common/event.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+#define KEYCACHE_SALT_LEN 16
+#define KEYCACHE_DIGEST_LEN 32
+
+typedef struct keycache_entry {
+	char *token_uuid;
+	// salted digest of PIN and pairing secret of the last unlock by the token
+	unsigned char salt[KEYCACHE_SALT_LEN];
+	unsigned char pin_digest[KEYCACHE_DIGEST_LEN];
+	bool unlocked;
+
+	char *label;
+	unsigned char wrapped_digest[KEYCACHE_DIGEST_LEN];
+	unsigned char *key; // mlock'ed mapping of key_map_len bytes, NULL if none is cached
+	size_t key_len;
+	size_t key_map_len;
+	event_timer_t *timer;
+} keycache_entry_t;
+
+static list_t *keycache_entries = NULL;
+static unsigned int keycache_ttl = 0;
+
+static int
+keycache_digest(unsigned char digest[KEYCACHE_DIGEST_LEN], const unsigned char *salt,
+		const unsigned char *data1, size_t data1_len, const unsigned char *data2,
+		size_t data2_len)
+{
+	int ret = -1;
+	unsigned int len;
+	EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+	IF_NULL_RETVAL(md_ctx, -1);
+
+	IF_FALSE_GOTO(EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL), out);
+	if (salt)
+		IF_FALSE_GOTO(EVP_DigestUpdate(md_ctx, salt, KEYCACHE_SALT_LEN), out);
+	IF_FALSE_GOTO(EVP_DigestUpdate(md_ctx, data1, data1_len), out);
+	if (data2)
+		IF_FALSE_GOTO(EVP_DigestUpdate(md_ctx, data2, data2_len), out);
+	IF_FALSE_GOTO(EVP_DigestFinal_ex(md_ctx, digest, &len), out);
+	ret = (len == KEYCACHE_DIGEST_LEN) ? 0 : -1;
+out:
+	EVP_MD_CTX_free(md_ctx);
+	return ret;
+}
+
+static keycache_entry_t *
+keycache_entry_get(const char *token_uuid)
+{
+	IF_NULL_RETVAL(token_uuid, NULL);
+
+	for (list_t *l = keycache_entries; l; l = l->next) {
+		keycache_entry_t *e = l->data;
+		if (!strcmp(e->token_uuid, token_uuid))
+			return e;
+	}
+	return NULL;
+}
+
+static void
+keycache_entry_drop_key(keycache_entry_t *e)
+{
+	if (e->timer) {
+		event_remove_timer(e->timer);
+		event_timer_free(e->timer);
+		e->timer = NULL;
+	}
+	if (e->key) {
+		OPENSSL_cleanse(e->key, e->key_map_len);
+		munlock(e->key, e->key_map_len);
+		munmap(e->key, e->key_map_len);
+		e->key = NULL;
+	}
+	if (e->label) {
+		mem_free(e->label);
+		e->label = NULL;
+	}
+	e->unlocked = false;
+}
+
+static void
+keycache_entry_free(keycache_entry_t *e)
+{
+	keycache_entries = list_remove(keycache_entries, e);
+	keycache_entry_drop_key(e);
+	OPENSSL_cleanse(e->pin_digest, sizeof(e->pin_digest));
+	mem_free(e->token_uuid);
+	mem_free(e);
+}
+
+static void
+keycache_expire_cb(event_timer_t *timer, void *data)
+{
+	keycache_entry_t *e = data;
+	ASSERT(e);
+
+	event_timer_free(timer);
+	e->timer = NULL;
+
+	INFO("Cached key of token %s expired", e->token_uuid);
+	keycache_entry_free(e);
+}
+
+void
+keycache_init(unsigned int ttl_sec)
+{
+	keycache_ttl = ttl_sec;
+	if (keycache_ttl)
+		INFO("Caching unwrapped keys for %u seconds", keycache_ttl);
+}
+
+void
+keycache_token_unlocked(const char *token_uuid, const char *pin, const unsigned char *pairing,
+			size_t pairing_len)
+{
+	IF_TRUE_RETURN(keycache_ttl == 0);
+	IF_NULL_RETURN(token_uuid);
+	IF_NULL_RETURN(pin);
+
+	keycache_entry_t *e = keycache_entry_get(token_uuid);
+	if (!e) {
+		e = mem_new0(keycache_entry_t, 1);
+		e->token_uuid = mem_strdup(token_uuid);
+		keycache_entries = list_append(keycache_entries, e);
+	}
+
+	if (RAND_bytes(e->salt, sizeof(e->salt)) != 1 ||
+	    keycache_digest(e->pin_digest, e->salt, (const unsigned char *)pin, strlen(pin),
+			    pairing, pairing_len) < 0) {
+		ERROR("Failed to record unlock of token %s for caching", token_uuid);
+		keycache_entry_free(e);
+	}
+}
+
+bool
+keycache_unlock(const char *token_uuid, const char *pin, const unsigned char *pairing,
+		size_t pairing_len)
+{
+	unsigned char digest[KEYCACHE_DIGEST_LEN];
+
+	keycache_entry_t *e = keycache_entry_get(token_uuid);
+	IF_TRUE_RETVAL(!e || !e->key || !pin, false);
+
+	IF_TRUE_RETVAL(keycache_digest(digest, e->salt, (const unsigned char *)pin, strlen(pin),
+				       pairing, pairing_len) < 0,
+		       false);
+	bool match = !CRYPTO_memcmp(digest, e->pin_digest, sizeof(digest));
+	OPENSSL_cleanse(digest, sizeof(digest));
+	IF_FALSE_RETVAL(match, false);
+
+	DEBUG("Unlocked token %s through key cache", token_uuid);
+	e->unlocked = true;
+	return true;
+}
+
+bool
+keycache_is_unlocked(const char *token_uuid)
+{
+	keycache_entry_t *e = keycache_entry_get(token_uuid);
+	return e && e->unlocked;
+}
+
+void
+keycache_lock(const char *token_uuid)
+{
+	keycache_entry_t *e = keycache_entry_get(token_uuid);
+	if (e)
+		e->unlocked = false;
+}
+
+void
+keycache_put(const char *token_uuid, const char *label, const unsigned char *wrapped_key,
+	     size_t wrapped_key_len, const unsigned char *key, size_t key_len)
+{
+	IF_NULL_RETURN(label);
+	IF_TRUE_RETURN(key_len == 0);
+
+	// only tokens recorded by keycache_token_unlocked() have an entry
+	keycache_entry_t *e = keycache_entry_get(token_uuid);
+	IF_NULL_RETURN(e);
+
+	keycache_entry_drop_key(e);
+
+	if (keycache_digest(e->wrapped_digest, NULL, wrapped_key, wrapped_key_len, NULL, 0) < 0) {
+		ERROR("Failed to hash wrapped key of token %s for caching", token_uuid);
+		return;
+	}
+
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t map_len = (key_len + page_size - 1) / page_size * page_size;
+	unsigned char *map =
+		mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		WARN_ERRNO("Failed to map memory for key cache");
+		return;
+	}
+	// never swap out or dump the unwrapped key
+	if (mlock(map, map_len) < 0) {
+		WARN_ERRNO("Failed to lock memory for key cache, not caching key");
+		munmap(map, map_len);
+		return;
+	}
+	madvise(map, map_len, MADV_DONTDUMP);
+
+	memcpy(map, key, key_len);
+	e->key = map;
+	e->key_len = key_len;
+	e->key_map_len = map_len;
+	e->label = mem_strdup(label);
+
+	e->timer = event_timer_new(keycache_ttl * 1000, 1, &keycache_expire_cb, e);
+	event_add_timer(e->timer);
+
+	DEBUG("Cached unwrapped key %s of token %s", label, token_uuid);
+}
+
+unsigned char *
+keycache_get_new(const char *token_uuid, const char *label, const unsigned char *wrapped_key,
+		 size_t wrapped_key_len, int *key_len)
+{
+	unsigned char digest[KEYCACHE_DIGEST_LEN];
+
+	keycache_entry_t *e = keycache_entry_get(token_uuid);
+	IF_TRUE_RETVAL(!e || !e->key || !label || strcmp(e->label, label), NULL);
+
+	IF_TRUE_RETVAL(keycache_digest(digest, NULL, wrapped_key, wrapped_key_len, NULL, 0) < 0,
+		       NULL);
+	IF_TRUE_RETVAL(CRYPTO_memcmp(digest, e->wrapped_digest, sizeof(digest)), NULL);
+
+	unsigned char *key = mem_alloc(e->key_len);
+	memcpy(key, e->key, e->key_len);
+	*key_len = e->key_len;
+	return key;
+}
+
+void
+keycache_invalidate(const char *token_uuid)
+{
+	keycache_entry_t *e = keycache_entry_get(token_uuid);
+	IF_NULL_RETURN(e);
+
+	INFO("Invalidating key cache of token %s", token_uuid);
+	keycache_entry_free(e);
+}
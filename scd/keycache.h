@@ -0,0 +1,103 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2020 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+/**
+ * @file keycache.h
+ *
+ * Optional in-memory cache of unwrapped container keys with a time to live.
+ * A restart of a container whose key is cached skips the token round trips
+ * for unlocking and unwrapping. The cached keys are kept in locked memory,
+ * which is excluded from core dumps and wiped on expiry or invalidation.
+ *
+ * An entry is bound to the token (by its uuid), the key label and the wrapped
+ * key. It is only served after the same PIN and pairing secret have been given
+ * as on the token unlock the key was cached after. A wrong PIN, a PIN change
+ * or the removal of the token drop the entry.
+ */
+
+#ifndef KEYCACHE_H
+#define KEYCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Enables the cache with a time to live of ttl_sec seconds for each key,
+ * 0 disables it.
+ */
+void
+keycache_init(unsigned int ttl_sec);
+
+/**
+ * Records the PIN and pairing secret of a successful unlock of the token, which
+ * authenticate later unlocks through the cache. Keys wrapped or unwrapped
+ * while the token is unlocked are cached via keycache_put().
+ */
+void
+keycache_token_unlocked(const char *token_uuid, const char *pin, const unsigned char *pairing,
+			size_t pairing_len);
+
+/**
+ * Unlocks the token through the cache if a key is cached for it and the PIN
+ * and pairing secret match the ones of the unlock it was cached after.
+ * @return true if the cache unlocked the token
+ */
+bool
+keycache_unlock(const char *token_uuid, const char *pin, const unsigned char *pairing,
+		size_t pairing_len);
+
+/**
+ * Returns true if the token was unlocked through the cache and not locked since.
+ */
+bool
+keycache_is_unlocked(const char *token_uuid);
+
+/**
+ * Ends the unlock of the token through the cache; the cached key stays valid.
+ */
+void
+keycache_lock(const char *token_uuid);
+
+/**
+ * Caches the unwrapped key of the wrapped key with the given label for ttl
+ * seconds, if the token has been unlocked before.
+ */
+void
+keycache_put(const char *token_uuid, const char *label, const unsigned char *wrapped_key,
+	     size_t wrapped_key_len, const unsigned char *key, size_t key_len);
+
+/**
+ * Returns a newly allocated copy of the cached unwrapped key of wrapped_key
+ * with the given label or NULL if none is cached.
+ */
+unsigned char *
+keycache_get_new(const char *token_uuid, const char *label, const unsigned char *wrapped_key,
+		 size_t wrapped_key_len, int *key_len);
+
+/**
+ * Drops and wipes everything cached for the token.
+ */
+void
+keycache_invalidate(const char *token_uuid);
+
+#endif /* KEYCACHE_H */
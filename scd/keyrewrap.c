@@ -21,26 +21,164 @@
  * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
  */
 
+/*
+ * Rewraps container keys from one softtoken to another. Keys are always
+ * wrapped with the KEK of the new token, thus giving the same token twice
+ * migrates keys which have been wrapped directly with the token key pair.
+ * The passphrases of the old and the new token are read from stdin, one per
+ * line (only one if both tokens are the same).
+ *
+ * Usage: keyrewrap <old token> <new token> <wrapped key file>...
+ */
+
 #include "common/macro.h"
+#include "common/mem.h"
+#include "common/file.h"
 #include "common/logf.h"
 #include "common/ssl_util.h"
 
 #include "softtoken.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define KEYREWRAP_KEY_FILE_MAXLEN 4096
+
 static softtoken_t *token_old = NULL;
 static softtoken_t *token_new = NULL;
 
+static char *
+keyrewrap_read_passphrase_new(void)
+{
+	char *line = NULL;
+	size_t len = 0;
+
+	if (getline(&line, &len, stdin) < 0) {
+		free(line);
+		return NULL;
+	}
+	line[strcspn(line, "\n")] = '\0';
+
+	char *passphrase = mem_strdup(line);
+	memset(line, 0, strlen(line));
+	free(line);
+	return passphrase;
+}
+
+static int
+keyrewrap_unlock(softtoken_t *token, const char *name)
+{
+	char *passphrase = keyrewrap_read_passphrase_new();
+	if (!passphrase) {
+		ERROR("No passphrase given for %s", name);
+		return -1;
+	}
+
+	int ret = softtoken_unlock(token, passphrase);
+	memset(passphrase, 0, strlen(passphrase));
+	mem_free(passphrase);
+	if (ret != 0)
+		ERROR("Failed to unlock %s", name);
+	return ret;
+}
+
+static int
+keyrewrap_key_file(const char *key_file)
+{
+	unsigned char *plain_key = NULL, *wrapped_key = NULL;
+	int plain_key_len = 0, wrapped_key_len = 0;
+	char *tmp_file = NULL;
+	int ret = -1;
+
+	off_t size = file_size(key_file);
+	if (size <= 0 || size > KEYREWRAP_KEY_FILE_MAXLEN) {
+		ERROR("Invalid wrapped key file %s", key_file);
+		return -1;
+	}
+	unsigned char *old_key = mem_alloc(size);
+	if (file_read(key_file, (char *)old_key, size) != size) {
+		ERROR("Failed to read wrapped key file %s", key_file);
+		goto out;
+	}
+
+	if (token_old == token_new && softtoken_is_wrapped_with_kek(old_key, size)) {
+		INFO("Key %s is already wrapped with the KEK", key_file);
+		ret = 0;
+		goto out;
+	}
+
+	if (softtoken_unwrap_key(token_old, old_key, size, &plain_key, &plain_key_len) != 0 ||
+	    softtoken_wrap_key(token_new, plain_key, plain_key_len, &wrapped_key,
+			       &wrapped_key_len) != 0) {
+		ERROR("Failed to rewrap key %s", key_file);
+		goto out;
+	}
+
+	// replace the key file at once, a partially written key would be lost
+	tmp_file = mem_printf("%s.tmp", key_file);
+	if (file_write(tmp_file, (char *)wrapped_key, wrapped_key_len) != wrapped_key_len ||
+	    rename(tmp_file, key_file) < 0) {
+		ERROR_ERRNO("Failed to store rewrapped key %s", key_file);
+		unlink(tmp_file);
+		goto out;
+	}
+
+	INFO("Rewrapped key %s", key_file);
+	ret = 0;
+out:
+	if (plain_key) {
+		memset(plain_key, 0, plain_key_len);
+		mem_free(plain_key);
+	}
+	if (wrapped_key)
+		mem_free(wrapped_key);
+	if (tmp_file)
+		mem_free(tmp_file);
+	mem_free(old_key);
+	return ret;
+}
+
 int
 main(int argc, char **argv)
 {
-	ASSERT(argc >= 3);
+	int ret = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <old token> <new token> <wrapped key file>...\n",
+			argv[0]);
+		return 1;
+	}
 	char *token_path_old = argv[1];
 	char *token_path_new = argv[2];
 
 	logf_register(&logf_file_write, stdout);
 
+	if (ssl_init(false, NULL) == -1) {
+		ERROR("Failed to initialize OpenSSL stack");
+		return 1;
+	}
+
 	token_old = softtoken_new_from_p12(token_path_old);
-	token_new = softtoken_new_from_p12(token_path_new);
+	token_new = strcmp(token_path_old, token_path_new) ?
+			    softtoken_new_from_p12(token_path_new) :
+			    token_old;
+
+	if (keyrewrap_unlock(token_old, token_path_old) != 0 ||
+	    (token_new != token_old && keyrewrap_unlock(token_new, token_path_new) != 0)) {
+		ret = 1;
+		goto out;
+	}
+
+	for (int i = 3; i < argc; i++) {
+		if (keyrewrap_key_file(argv[i]) < 0)
+			ret = 1;
+	}
 
-	return 0;
+out:
+	if (token_new != token_old)
+		softtoken_free(token_new);
+	softtoken_free(token_old);
+	ssl_free();
+	return ret;
 }
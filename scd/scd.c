@@ -44,6 +44,8 @@
 #include "common/list.h"
 #include "common/ssl_util.h"
 #include "token.h"
+#include "keycache.h"
+#include "softtoken.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -335,6 +337,14 @@ main(int argc, char **argv)
 		FATAL("Failed to initialize OpenSSL stack for scd runtime");
 	}
 
+	DeviceConfig *dev_cfg = (DeviceConfig *)protobuf_message_new_from_textfile(
+		DEVICE_CONF, &device_config__descriptor);
+	if (dev_cfg) {
+		keycache_init(dev_cfg->scd_key_cache_ttl);
+		softtoken_set_pbe_iter(dev_cfg->scd_softtoken_pbe_iter);
+		protobuf_free_message((ProtobufCMessage *)dev_cfg);
+	}
+
 	DEBUG("Try to create directory for socket if not existing");
 	if (dir_mkdir_p(CMLD_SOCKET_DIR, 0755) < 0) {
 		FATAL("Could not create directory for scd_control socket");
@@ -40,6 +40,7 @@
 #define SCD_TOKEN_DIR DEFAULT_BASE_PATH "/tokens"
 #define SSIG_ROOT_CERT SCD_TOKEN_DIR "/ssig_rootca.cert"
 #define LOCALCA_ROOT_CERT SCD_TOKEN_DIR "/localca_rootca.cert"
+#define MDM_ROOT_CERT SCD_TOKEN_DIR "/mdm_rootca.cert"
 #define TRUSTED_CA_STORE SCD_TOKEN_DIR "/ca"
 
 #define DEVICE_CERT_FILE SCD_TOKEN_DIR "/device.cert"
@@ -29,8 +29,26 @@
 #include "common/file.h"
 
 #include <string.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 #define SOFTTOKEN_MAX_WRONG_UNLOCK_ATTEMPTS 3
+#define SOFTTOKEN_PASS_SALT_LEN 16
+#define SOFTTOKEN_KEK_LEN 32
+#define SOFTTOKEN_KEK_EXT ".kek"
+#define SOFTTOKEN_KEK_FILE_MAXLEN 4096
+
+/*
+ * Container keys are wrapped symmetrically with a per-token key encryption
+ * key (KEK), which itself is wrapped with the token key pair. Thus, only one
+ * asymmetric operation is needed per unlock, independent of the number of
+ * keys. Keys wrapped this way start with the following magic, others have
+ * been wrapped directly with the key pair.
+ */
+static const unsigned char softtoken_kek_magic[] = { 'K', 'E', 'K', '1' };
 
 struct softtoken {
 	char *token_file;		// absolute path to softtoken w. filename
@@ -39,8 +57,50 @@ struct softtoken {
 	EVP_PKEY *pkey;			// holds the token public key pair when unlocked
 	X509 *cert;			// holds the token's certificate, if available
 	STACK_OF(X509) * ca;		// holds the token's certificate chain, if available
+	unsigned unlock_refs;		// sessions which hold the token unlocked
+	// authenticates further sessions while unlocked, without the PBE of the token
+	unsigned char pass_salt[SOFTTOKEN_PASS_SALT_LEN];
+	unsigned char pass_mac[SHA256_DIGEST_LENGTH];
+	char *kek_file;				// KEK wrapped with the token key pair
+	unsigned char kek[SOFTTOKEN_KEK_LEN];	// unwrapped KEK, if has_kek
+	bool has_kek;
 };
 
+// iterations of the PBE softtokens are re-encrypted with on unlock, 0 to keep them
+static int softtoken_pbe_iter = 0;
+
+void
+softtoken_set_pbe_iter(int iter)
+{
+	softtoken_pbe_iter = iter;
+}
+
+static void
+softtoken_pass_mac(const unsigned char *salt, const char *passphrase, unsigned char *mac)
+{
+	HMAC(EVP_sha256(), salt, SOFTTOKEN_PASS_SALT_LEN, (const unsigned char *)passphrase,
+	     strlen(passphrase), mac, NULL);
+}
+
+static int
+softtoken_pass_set(softtoken_t *token, const char *passphrase)
+{
+	IF_FALSE_RETVAL(RAND_bytes(token->pass_salt, SOFTTOKEN_PASS_SALT_LEN) == 1, -1);
+	softtoken_pass_mac(token->pass_salt, passphrase, token->pass_mac);
+	return 0;
+}
+
+static bool
+softtoken_pass_matches(const softtoken_t *token, const char *passphrase)
+{
+	unsigned char mac[SHA256_DIGEST_LENGTH];
+
+	softtoken_pass_mac(token->pass_salt, passphrase, mac);
+	bool ret = !CRYPTO_memcmp(mac, token->pass_mac, SHA256_DIGEST_LENGTH);
+	OPENSSL_cleanse(mac, sizeof(mac));
+	return ret;
+}
+
 /**
  * creates a new pkcs12 softtoken.
  */
@@ -77,6 +137,8 @@ softtoken_remove_p12(softtoken_t *token)
 	int rc = remove(token->token_file);
 	if (rc != 0)
 		ERROR("Failed to remove %s. Return code: %d", token->token_file, rc);
+	if (file_exists(token->kek_file) && remove(token->kek_file) != 0)
+		ERROR_ERRNO("Failed to remove %s", token->kek_file);
 }
 
 softtoken_t *
@@ -86,6 +148,7 @@ softtoken_new_from_p12(const char *filename)
 
 	softtoken_t *token = mem_new0(softtoken_t, 1);
 	token->token_file = mem_strdup(filename);
+	token->kek_file = mem_printf("%s%s", filename, SOFTTOKEN_KEK_EXT);
 	token->locked = true;
 	token->wrong_unlock_attempts = 0;
 	token->pkey = NULL;
@@ -95,13 +158,6 @@ softtoken_new_from_p12(const char *filename)
 	return token;
 }
 
-int
-softtoken_change_passphrase(softtoken_t *token, const char *oldpass, const char *newpass)
-{
-	ASSERT(token);
-	return ssl_newpass_pkcs12_token(token->token_file, oldpass, newpass);
-}
-
 /**
  * Free key and certificate data.
  * TODO distinguish private/secret data (which must be removed when locking)
@@ -124,6 +180,80 @@ softtoken_free_secrets(softtoken_t *token)
 		sk_X509_pop_free(token->ca, X509_free);
 		token->ca = NULL;
 	}
+	OPENSSL_cleanse(token->pass_salt, sizeof(token->pass_salt));
+	OPENSSL_cleanse(token->pass_mac, sizeof(token->pass_mac));
+	OPENSSL_cleanse(token->kek, sizeof(token->kek));
+	token->has_kek = false;
+}
+
+/**
+ * Unwraps the KEK of the unlocked token, which is created on first use.
+ */
+static int
+softtoken_kek_load(softtoken_t *token)
+{
+	unsigned char *wrapped = NULL;
+	int wrapped_len = 0;
+	unsigned char *kek = NULL;
+	int kek_len = 0;
+	int ret = -1;
+
+	IF_TRUE_RETVAL(token->has_kek, 0);
+
+	if (file_exists(token->kek_file)) {
+		off_t size = file_size(token->kek_file);
+		IF_TRUE_RETVAL(size <= 0 || size > SOFTTOKEN_KEK_FILE_MAXLEN, -1);
+		wrapped = mem_alloc(size);
+		if (file_read(token->kek_file, (char *)wrapped, size) != size ||
+		    ssl_unwrap_key(token->pkey, wrapped, size, &kek, &kek_len) != 0 ||
+		    kek_len != SOFTTOKEN_KEK_LEN) {
+			ERROR("Failed to unwrap KEK of token %s", token->token_file);
+			goto out;
+		}
+		memcpy(token->kek, kek, SOFTTOKEN_KEK_LEN);
+	} else {
+		char *tmp_file = mem_printf("%s.tmp", token->kek_file);
+		if (RAND_bytes(token->kek, SOFTTOKEN_KEK_LEN) != 1 ||
+		    ssl_wrap_key(token->pkey, token->kek, SOFTTOKEN_KEK_LEN, &wrapped,
+				 &wrapped_len) != 0 ||
+		    file_write(tmp_file, (char *)wrapped, wrapped_len) != wrapped_len ||
+		    rename(tmp_file, token->kek_file) < 0) {
+			ERROR("Failed to create KEK of token %s", token->token_file);
+			unlink(tmp_file);
+			mem_free(tmp_file);
+			goto out;
+		}
+		mem_free(tmp_file);
+		DEBUG("Created KEK of token %s", token->token_file);
+	}
+
+	token->has_kek = true;
+	ret = 0;
+out:
+	if (ret < 0)
+		OPENSSL_cleanse(token->kek, sizeof(token->kek));
+	if (kek) {
+		OPENSSL_cleanse(kek, kek_len);
+		mem_free(kek);
+	}
+	mem_free(wrapped);
+	return ret;
+}
+
+int
+softtoken_change_passphrase(softtoken_t *token, const char *oldpass, const char *newpass)
+{
+	ASSERT(token);
+
+	int ret = ssl_newpass_pkcs12_token(token->token_file, oldpass, newpass);
+	// further sessions have to authenticate with the new passphrase
+	if (ret == 0 && !softtoken_is_locked(token) && softtoken_pass_set(token, newpass) < 0) {
+		WARN("Could not update session passphrase, locking token");
+		softtoken_free_secrets(token);
+		token->unlock_refs = 0;
+		token->locked = true;
+	}
+	return ret;
 }
 
 void
@@ -135,10 +265,18 @@ softtoken_free(softtoken_t *token)
 
 	if (token->token_file)
 		mem_free(token->token_file);
+	mem_free(token->kek_file);
 
 	mem_free(token);
 }
 
+bool
+softtoken_is_wrapped_with_kek(const unsigned char *wrapped_key, size_t wrapped_key_len)
+{
+	return wrapped_key_len > sizeof(softtoken_kek_magic) &&
+	       !memcmp(wrapped_key, softtoken_kek_magic, sizeof(softtoken_kek_magic));
+}
+
 int
 softtoken_wrap_key(softtoken_t *token, const unsigned char *plain_key, size_t plain_key_len,
 		   unsigned char **wrapped_key, int *wrapped_key_len)
@@ -149,7 +287,20 @@ softtoken_wrap_key(softtoken_t *token, const unsigned char *plain_key, size_t pl
 		WARN("Trying to wrap key with locked token.");
 		return -1;
 	}
-	return ssl_wrap_key(token->pkey, plain_key, plain_key_len, wrapped_key, wrapped_key_len);
+	IF_TRUE_RETVAL(softtoken_kek_load(token) < 0, -1);
+
+	unsigned char *sym_key = NULL;
+	int sym_key_len = 0;
+	IF_TRUE_RETVAL(ssl_wrap_key_sym(token->kek, plain_key, plain_key_len, &sym_key,
+					&sym_key_len) != 0,
+		       -1);
+
+	*wrapped_key_len = sizeof(softtoken_kek_magic) + sym_key_len;
+	*wrapped_key = mem_alloc(*wrapped_key_len);
+	memcpy(*wrapped_key, softtoken_kek_magic, sizeof(softtoken_kek_magic));
+	memcpy(*wrapped_key + sizeof(softtoken_kek_magic), sym_key, sym_key_len);
+	mem_free(sym_key);
+	return 0;
 }
 
 int
@@ -161,9 +312,20 @@ softtoken_unwrap_key(softtoken_t *token, const unsigned char *wrapped_key, size_
 		WARN("Trying to unwrap key with locked token.");
 		return -1;
 	}
-	return ssl_unwrap_key(token->pkey, wrapped_key, wrapped_key_len, plain_key, plain_key_len);
+
+	if (!softtoken_is_wrapped_with_kek(wrapped_key, wrapped_key_len)) {
+		DEBUG("Unwrapping key wrapped with the token key pair");
+		return ssl_unwrap_key(token->pkey, wrapped_key, wrapped_key_len, plain_key,
+				      plain_key_len);
+	}
+
+	IF_TRUE_RETVAL(softtoken_kek_load(token) < 0, -1);
+	return ssl_unwrap_key_sym(token->kek, wrapped_key + sizeof(softtoken_kek_magic),
+				  wrapped_key_len - sizeof(softtoken_kek_magic), plain_key,
+				  plain_key_len);
 }
 
+
 bool
 softtoken_is_locked_till_reboot(softtoken_t *token)
 {
@@ -183,16 +345,23 @@ softtoken_unlock(softtoken_t *token, char *passphrase)
 {
 	ASSERT(token);
 
-	if (!softtoken_is_locked(token)) {
-		WARN("Token is alread unlocked, returning");
-		return 0;
-	}
-
 	if (softtoken_is_locked_till_reboot(token)) {
 		WARN("Token is locked till reboot, returning");
 		return -1;
 	}
 
+	if (!softtoken_is_locked(token)) {
+		if (!softtoken_pass_matches(token, passphrase)) {
+			WARN("Wrong passphrase for already unlocked token");
+			token->wrong_unlock_attempts++;
+			return -1;
+		}
+		token->unlock_refs++;
+		token->wrong_unlock_attempts = 0;
+		DEBUG("Token already unlocked, now held by %u sessions", token->unlock_refs);
+		return 0;
+	}
+
 	if (!file_exists(token->token_file)) {
 		ERROR("No token present");
 		return -1;
@@ -201,9 +370,18 @@ softtoken_unlock(softtoken_t *token, char *passphrase)
 					&token->ca);
 	if (res == -1) // wrong password
 		token->wrong_unlock_attempts++;
+	else if (res == 0 && softtoken_pass_set(token, passphrase) < 0)
+		res = -2;
 	else if (res == 0) {
 		token->locked = false;
+		token->unlock_refs = 1;
 		token->wrong_unlock_attempts = 0;
+
+		if (softtoken_pbe_iter > 0 &&
+		    ssl_reencrypt_pkcs12_token(token->token_file, passphrase, token->pkey,
+					       token->cert, token->ca, softtoken_pbe_iter) < 0)
+			WARN("Could not re-encrypt token with %d PBE iterations",
+			     softtoken_pbe_iter);
 	}
 	// TODO what to do with wrong_unlock_attempts if unlock failed for some other reason?
 
@@ -223,6 +401,11 @@ softtoken_lock(softtoken_t *token)
 		return 0;
 	}
 
+	if (--token->unlock_refs > 0) {
+		DEBUG("Token still held unlocked by %u sessions", token->unlock_refs);
+		return 0;
+	}
+
 	softtoken_free_secrets(token);
 	token->locked = true;
 	return 0;
@@ -59,16 +59,26 @@ softtoken_new_from_p12(const char *filename);
 int
 softtoken_change_passphrase(softtoken_t *token, const char *oldpass, const char *newpass);
 
+/**
+ * Sets the number of iterations of the PBE which protects softtokens. Tokens
+ * are re-encrypted with this count on their next unlock, e.g. to speed up
+ * unlocking tokens in device bound storage. 0 keeps tokens unchanged.
+ */
+void
+softtoken_set_pbe_iter(int iter);
+
 /**
  * unlocks a softtoken with a password.
- * stores the token private key in the structure
+ * stores the token private key in the structure.
+ * Unlocking an already unlocked token opens a further session, which only
+ * requires the password to match the one of the first unlock.
  */
 int
 softtoken_unlock(softtoken_t *token, char *passphrase);
 
 /**
- * locks a softtoken by freeing the private key
- * reference in the softtoken
+ * closes a session of an unlocked softtoken. The last session locks the
+ * token by freeing the private key reference in the softtoken
  */
 int
 softtoken_lock(softtoken_t *token);
@@ -92,19 +102,29 @@ void
 softtoken_free(softtoken_t *token);
 
 /**
- * wraps a symmetric container key plain_key of length plain_key_len with a
- * user public key pubkey into a wrapped key wrapped_key of length wrapped_key_len
+ * wraps a symmetric container key plain_key of length plain_key_len into a
+ * wrapped key wrapped_key of length wrapped_key_len. The key is wrapped with
+ * the KEK of the token, which is wrapped with the user public key and created
+ * on first use.
  */
 int
 softtoken_wrap_key(softtoken_t *token, const unsigned char *plain_key, size_t plain_key_len,
 		   unsigned char **wrapped_key, int *wrapped_key_len);
 
 /**
- * unwraps a symmetric container key wrapped_key of length wrapped_key_len with a
+ * unwraps a symmetric container key wrapped_key of length wrapped_key_len with the
+ * KEK of the token or, for keys wrapped before KEKs were introduced, with the
  * user's private key into the plain key plain_key of length plain_key_len
  */
 int
 softtoken_unwrap_key(softtoken_t *token, const unsigned char *wrapped_key, size_t wrapped_key_len,
 		     unsigned char **plain_key, int *plain_key_len);
 
+/**
+ * checks whether wrapped_key has been wrapped with the KEK of a token, rather
+ * than directly with its key pair
+ */
+bool
+softtoken_is_wrapped_with_kek(const unsigned char *wrapped_key, size_t wrapped_key_len);
+
 #endif /* SOFTTOKEN_H */
@@ -71,6 +71,40 @@ wrapped_remove_event_io(void *elem)
 static void
 scd_tokencontrol_cb_accept(int fd, unsigned events, UNUSED event_io_t *io, void *data);
 
+/**
+ * Sends a batch of APDUs to the token and returns all responses at once.
+ */
+static void
+scd_tokencontrol_handle_send_apdus(scd_token_t *t, const ContainerToToken *msg, int fd)
+{
+	TokenToContainer out = TOKEN_TO_CONTAINER__INIT;
+	out.responses = mem_new0(ProtobufCBinaryData, msg->n_apdus);
+
+	for (size_t i = 0; i < msg->n_apdus; i++) {
+		unsigned char *rsp = mem_alloc0(MAX_APDU_BUF_LEN);
+		int len = t->send_apdu(t, msg->apdus[i].data, msg->apdus[i].len, rsp,
+				       MAX_APDU_BUF_LEN);
+		if (len < 0) {
+			WARN("SEND_APDUS failed at APDU %zu with code %d", i, len);
+			mem_free(rsp);
+			break;
+		}
+		out.responses[out.n_responses].data = rsp;
+		out.responses[out.n_responses].len = len;
+		out.n_responses++;
+	}
+
+	out.return_code = out.n_responses == msg->n_apdus ? TOKEN_TO_CONTAINER__CODE__OK :
+							     TOKEN_TO_CONTAINER__CODE__ERR_TRANS;
+	if ((protobuf_send_message(fd, (ProtobufCMessage *)&out)) < 0) {
+		ERROR("Could not send protobuf response on socket %d", fd);
+	}
+
+	for (size_t i = 0; i < out.n_responses; i++)
+		mem_free(out.responses[i].data);
+	mem_free(out.responses);
+}
+
 static void
 scd_tokencontrol_handle_message(const ContainerToToken *msg, int fd, void *data)
 {
@@ -126,6 +160,13 @@ scd_tokencontrol_handle_message(const ContainerToToken *msg, int fd, void *data)
 		goto out;
 		break;
 
+	case CONTAINER_TO_TOKEN__COMMAND__SEND_APDUS:
+		DEBUG("Handle CONTAINER_TO_TOKEN__COMMAND__SEND_APDUS msg with %zu APDUs",
+		      msg->n_apdus);
+		scd_tokencontrol_handle_send_apdus(t, msg, fd);
+		mem_free(brsp);
+		return;
+
 	default:
 		WARN("ContainerToToken command %d unknown or not implemented yet", msg->command);
 	}
@@ -47,6 +47,11 @@
 
 #define USBTOKEN_SUCCESS 0x9000
 
+// ISO 7816-4 command chaining of extended length APDUs for cards without support
+#define USBTOKEN_SHORT_LC_MAX 255
+#define USBTOKEN_CLA_CHAINING 0x10
+#define USBTOKEN_SW1_MORE_DATA 0x61
+
 //#undef LOGF_LOG_MIN_PRIO
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
@@ -81,6 +86,9 @@ struct usbtoken {
 
 	unsigned char *latr; // ATR of last reset
 	size_t latr_len;
+
+	bool authenticated; // user authentication is valid in the current card session
+	bool ext_length;    // card supports extended length APDUs
 };
 
 /**
@@ -197,25 +205,75 @@ produceKey(usbtoken_t *token, unsigned char *label, size_t label_len, unsigned c
 {
 	int rc;
 
-	if ((rc = (authenticateUser(token->ctn, token->auth_code, token->auth_code_len))) < 0) {
-		// this should not possibly happen; TODO: handle properly if it happens anyway
-		ERROR("Failed to authenticate to token");
-		return rc;
-	}
-
 	if ((NULL == label) || (0 == label_len)) {
 		ERROR("No label was provided for key derivation");
 		return -1;
-	} else {
-		rc = deriveKey(token->ctn, 1, label, label_len, key, key_len);
 	}
 
-	if (rc < 0) {
-		ERROR("USBTOKEN: deriveKey failed");
-		return -1;
+	/*
+	 * The verification of the user stays valid on the card until it is reset,
+	 * thus it is only repeated if the derivation fails, e.g. because a container
+	 * has reset the card in between.
+	 */
+	for (int i = 0; i < 2; i++) {
+		if (!token->authenticated) {
+			rc = authenticateUser(token->ctn, token->auth_code, token->auth_code_len);
+			if (rc < 0) {
+				// this should not possibly happen
+				// TODO: handle properly if it happens anyway
+				ERROR("Failed to authenticate to token");
+				return rc;
+			}
+			token->authenticated = true;
+		}
+
+		rc = deriveKey(token->ctn, 1, label, label_len, key, key_len);
+		if (rc >= 0)
+			return 0;
+
+		DEBUG("USBTOKEN: deriveKey failed, re-authenticating");
+		token->authenticated = false;
 	}
 
-	return 0;
+	ERROR("USBTOKEN: deriveKey failed");
+	return -1;
+}
+
+/**
+ * Checks the card capabilities in the historical bytes of the ATR (ISO 7816-4,
+ * compact-TLV tag 7) for support of extended length APDUs.
+ */
+static bool
+usbtoken_atr_has_ext_length(const unsigned char *atr, size_t atr_len)
+{
+	IF_TRUE_RETVAL(atr_len < 2, false);
+
+	size_t k = atr[1] & 0x0F; // number of historical bytes
+	unsigned char y = atr[1] >> 4;
+	size_t i = 2;
+
+	// skip the interface bytes, y indicates which of TA, TB, TC and TD follow
+	for (;;) {
+		i += (y & 0x1) + ((y >> 1) & 0x1) + ((y >> 2) & 0x1);
+		if (!(y & 0x8))
+			break;
+		IF_TRUE_RETVAL(i >= atr_len, false);
+		y = atr[i++] >> 4;
+	}
+
+	// compact-TLV objects follow the category indicator 0x80
+	IF_TRUE_RETVAL(k < 1 || i + k > atr_len || atr[i] != 0x80, false);
+	for (size_t j = i + 1; j < i + k;) {
+		unsigned char tag = atr[j] >> 4;
+		size_t len = atr[j] & 0x0F;
+		j++;
+		if (j + len > i + k)
+			break;
+		if (tag == 0x7 && len >= 3)
+			return atr[j + 2] & 0x40;
+		j += len;
+	}
+	return false;
 }
 
 /**
@@ -295,6 +353,12 @@ usbtoken_reset_schsm_sess(usbtoken_t *token, unsigned char *brsp, size_t brsp_le
 	token->latr = mem_memcpy(brsp, lr);
 	token->latr_len = lr;
 
+	// the reset drops the user authentication, the response ends with a status word
+	token->authenticated = false;
+	token->ext_length = usbtoken_atr_has_ext_length(brsp, lr >= 2 ? lr - 2 : 0);
+	DEBUG("Token %s extended length APDUs",
+	      token->ext_length ? "supports" : "does not support");
+
 	int rc = queryPIN(token->ctn);
 	if (rc != USBTOKEN_SUCCESS) {
 		rc = selectHSM(token->ctn);
@@ -701,6 +765,7 @@ usbtoken_unlock(usbtoken_t *token, char *passwd, unsigned char *pairing_secret,
 		token->wrong_unlock_attempts = 0;
 		token->auth_code_len = auth_code_len;
 		token->auth_code = mem_memcpy(code, token->auth_code_len);
+		token->authenticated = true;
 		DEBUG("Usbtoken unlock successful");
 	} else {
 		ERROR("Usbtoken unlock failed");
@@ -745,6 +810,7 @@ usbtoken_reset_auth(usbtoken_t *token, unsigned char *brsp, size_t brsp_len)
 	if (rc == -2) { // wrong password
 		ERROR("Usbtoken authenticatio reset failed (wrong PW). This should not happen");
 	} else if (rc == 0) {
+		token->authenticated = true;
 		DEBUG("Usbtoken authenticatio reset successful");
 	} else {
 		ERROR("Usbtoken reset failed");
@@ -775,16 +841,10 @@ usbtoken_lock(usbtoken_t *token)
 	return 0;
 }
 
-int
-usbtoken_send_apdu(usbtoken_t *token, unsigned char *apdu, size_t apdu_len, unsigned char *brsp,
-		   size_t brsp_len)
+static int
+usbtoken_transmit(usbtoken_t *token, const unsigned char *apdu, size_t apdu_len,
+		  unsigned char *brsp, size_t brsp_len)
 {
-	ASSERT(token);
-	ASSERT(apdu);
-	ASSERT(brsp);
-
-	TRACE("usbtoken_send_apdu");
-
 	unsigned short lr;
 	unsigned char dad, sad;
 
@@ -798,7 +858,7 @@ usbtoken_send_apdu(usbtoken_t *token, unsigned char *apdu, size_t apdu_len, unsi
 	str_free(dump, true);
 #endif
 
-	int rc = CT_data(token->ctn, &dad, &sad, apdu_len, apdu, &lr, brsp);
+	int rc = CT_data(token->ctn, &dad, &sad, apdu_len, (unsigned char *)apdu, &lr, brsp);
 	if (rc != 0) {
 		ERROR("CT_data failed with code: %d", rc);
 		return -1;
@@ -813,6 +873,100 @@ usbtoken_send_apdu(usbtoken_t *token, unsigned char *apdu, size_t apdu_len, unsi
 	return lr;
 }
 
+/*
+ * Sends the extended length command APDU (case 3E or 4E) with lc bytes of data
+ * as chain of short APDUs. Expected response data beyond 256 bytes is
+ * announced by the card with SW1 0x61.
+ */
+static int
+usbtoken_send_chained(usbtoken_t *token, const unsigned char *apdu, size_t lc, bool has_le,
+		      size_t le, unsigned char *brsp, size_t brsp_len)
+{
+	unsigned char cmd[5 + USBTOKEN_SHORT_LC_MAX + 1];
+	const unsigned char *data = apdu + 7;
+	int lr = -1;
+
+	while (lc > 0) {
+		size_t n = MIN(lc, USBTOKEN_SHORT_LC_MAX);
+		bool last = n == lc;
+		size_t cmd_len = 5 + n;
+
+		memcpy(cmd, apdu, 4);
+		if (!last)
+			cmd[0] |= USBTOKEN_CLA_CHAINING;
+		cmd[4] = n;
+		memcpy(cmd + 5, data, n);
+		if (last && has_le)
+			cmd[cmd_len++] = (le == 0 || le > 256) ? 0x00 : le;
+
+		lr = usbtoken_transmit(token, cmd, cmd_len, brsp, brsp_len);
+		IF_TRUE_RETVAL(lr < 0, lr);
+		// the card has to acknowledge each part of the chain
+		if (!last && (lr < 2 || brsp[lr - 2] != 0x90 || brsp[lr - 1] != 0x00))
+			return lr;
+
+		data += n;
+		lc -= n;
+	}
+	return lr;
+}
+
+/*
+ * Fetches remaining response data announced by SW1 0x61 with GET RESPONSE and
+ * appends it to the response in brsp, which is lr bytes long.
+ */
+static int
+usbtoken_get_response(usbtoken_t *token, unsigned char cla, unsigned char *brsp, int lr,
+		      size_t brsp_len)
+{
+	unsigned char get_response[] = { cla & 0x03, 0xC0, 0x00, 0x00, 0x00 };
+
+	while (lr >= 2 && brsp[lr - 2] == USBTOKEN_SW1_MORE_DATA) {
+		size_t expected = brsp[lr - 1] ? brsp[lr - 1] : 256;
+		size_t ofs = lr - 2; // the status word is replaced by the next part
+		if (brsp_len - ofs < expected + 2) {
+			DEBUG("Response buffer too small, leaving GET RESPONSE to the caller");
+			break;
+		}
+
+		get_response[4] = brsp[lr - 1];
+		int n = usbtoken_transmit(token, get_response, sizeof(get_response), brsp + ofs,
+					  brsp_len - ofs);
+		IF_TRUE_RETVAL(n < 0, n);
+		lr = ofs + n;
+	}
+	return lr;
+}
+
+int
+usbtoken_send_apdu(usbtoken_t *token, unsigned char *apdu, size_t apdu_len, unsigned char *brsp,
+		   size_t brsp_len)
+{
+	ASSERT(token);
+	ASSERT(apdu);
+	ASSERT(brsp);
+
+	TRACE("usbtoken_send_apdu");
+
+	int lr;
+	IF_TRUE_RETVAL(apdu_len < 4, -1);
+
+	// extended length APDUs with command data are chained for cards without support
+	size_t lc = apdu_len > 7 && apdu[4] == 0x00 ? (size_t)(apdu[5] << 8 | apdu[6]) : 0;
+	if (!token->ext_length && lc > 0 && (apdu_len == 7 + lc || apdu_len == 9 + lc)) {
+		bool has_le = apdu_len == 9 + lc;
+		size_t le = has_le ? (size_t)(apdu[7 + lc] << 8 | apdu[8 + lc]) : 0;
+		TRACE("Sending extended length APDU with %zu bytes of data in a chain", lc);
+		lr = usbtoken_send_chained(token, apdu, lc, has_le, le, brsp, brsp_len);
+	} else {
+		lr = usbtoken_transmit(token, apdu, apdu_len, brsp, brsp_len);
+	}
+	IF_TRUE_RETVAL(lr < 0, lr);
+
+	// saves the caller a round trip per GET RESPONSE
+	return usbtoken_get_response(token, apdu[0], brsp, lr, brsp_len);
+}
+
 int
 usbtoken_get_atr(usbtoken_t *token, unsigned char *buf, size_t buflen)
 {
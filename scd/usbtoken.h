@@ -143,6 +143,9 @@ usbtoken_change_passphrase(usbtoken_t *token, const char *oldpass, const char *n
 
 /**
  * Sends an APDU to the usbtoken and receive the response.
+ * Extended length APDUs are sent as chain of short APDUs if the token does
+ * not support them, and remaining response data announced by the token (SW1
+ * 0x61) is fetched right away and appended to the response.
  * @param token the usbtoken to communicate with
  * @param apdu the apdu byte arry to send to the token
  * @param apdu_len legnth of @param apdu
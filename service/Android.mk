@@ -49,6 +49,7 @@ LOCAL_SRC_FILES := $(CMLD_COMMON_SRC_FILES) \
 
 LOCAL_STATIC_LIBRARIES := \
 	libprotobuf-c-text \
+	libz \
 	liblog \
 	liblogwrap \
 	libcutils \
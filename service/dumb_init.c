@@ -23,6 +23,7 @@
  */
 
 #include "common/macro.h"
+#include "common/event.h"
 
 #include <assert.h>
 #include <string.h>
@@ -126,16 +127,19 @@ dumb_init_set_child_pid(pid_t pid)
 	child_pid = pid;
 }
 
+static void
+dumb_init_signal_cb(int signum, UNUSED event_signal_t *sig, UNUSED void *data)
+{
+	dumb_init_handle_signal(signum);
+}
+
 void
-dumb_init_signal_handler()
+dumb_init_signal_events_register(void)
 {
-	int signum;
-	sigset_t all_signals;
-	sigfillset(&all_signals);
-	sigprocmask(SIG_BLOCK, &all_signals, NULL);
+	// signals caught by the event loop, SIGPIPE and SIGALRM are not meant for the children
+	static const int signals[] = { SIGTERM, SIGQUIT, SIGINT, SIGCHLD,
+				       SIGUSR1, SIGUSR2, SIGHUP };
 
-	for (;;) {
-		sigwait(&all_signals, &signum);
-		dumb_init_handle_signal(signum);
-	}
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+		event_add_signal(event_signal_new(signals[i], &dumb_init_signal_cb, NULL));
 }
@@ -3,7 +3,12 @@
 
 void
 dumb_init_set_child_pid(pid_t pid);
+
+/*
+ * Forwards the signals to the child process(es) from within the event loop,
+ * thus messages from cmld and signals are handled by the same process.
+ */
 void
-dumb_init_signal_handler(void);
+dumb_init_signal_events_register(void);
 
 #endif /* __DUMB_INIT_H */
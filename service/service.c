@@ -38,8 +38,12 @@
 #include "common/fd.h"
 #include "common/dir.h"
 #include "common/str.h"
+#include "common/bcast.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -49,18 +53,31 @@
 
 // clang-format off
 #define SERVICE_SOCKET SOCK_PATH(service)
+#define SERVICE_BCAST_SOCKET SOCK_PATH(service-bcast)
 // clang-format on
 
 #define LOGFILE_DIR "/tmp/log/"
 #define AUDIT_LOGDIR "/var/log/cmld_audit/"
+// number of audit records cmld may send before waiting for an ACK
+#define AUDIT_WINDOW 16
+// number of audit records cmld may send in a single message
+#define AUDIT_BATCH 8
 
 //#undef LOGF_LOG_MIN_PRIO
 //#define LOGF_LOG_MIN_PRIO LOGF_PRIO_TRACE
 
 char *LAST_AUDIT_HASH;
+static uint64_t LAST_AUDIT_SEQ = 0; // 0 if unknown
+static unsigned AUDIT_UNACKED = 0;
 
 static logf_handler_t *service_logfile_handler = NULL;
 
+// host state broadcast by cmld, see common/bcast.h
+static const bcast_page_t *service_bcast_page = NULL;
+static event_io_t *service_bcast_event = NULL;
+static int service_bcast_efd = -1;
+static uint32_t service_bcast_seq = 0;
+
 #ifndef BOOT_COMPLETE_ONLY
 static int
 service_set_hostname(int fd)
@@ -168,6 +185,15 @@ service_fork_execvp(char *prog, char **argv)
 	return 0;
 }
 
+static void
+service_audit_record_append(str_t *records, const AuditRecord *record)
+{
+	char *text = protobuf_c_text_to_string((ProtobufCMessage *)record, NULL);
+	TRACE("Storing audit record %s", text);
+	str_append(records, text);
+	mem_free(text);
+}
+
 static int
 process_audit_record(CmldToServiceMessage *msg, uint8_t *buf, uint32_t buf_len)
 {
@@ -206,14 +232,20 @@ process_audit_record(CmldToServiceMessage *msg, uint8_t *buf, uint32_t buf_len)
 
 	if (!file_is_dir(AUDIT_LOGDIR) && dir_mkdir_p(AUDIT_LOGDIR, 0600)) {
 		ERROR("Failed to create audit log directory");
-	} else if (msg->audit_record) {
-		char *record =
-			protobuf_c_text_to_string((ProtobufCMessage *)msg->audit_record, NULL);
-		TRACE("Storing audit record %s", record);
-		file_write_append(AUDIT_LOGDIR "/audit.log", record, strlen(record));
+	} else if (msg->audit_record || msg->n_audit_records) {
+		// store the whole batch with a single write
+		str_t *records = str_new(NULL);
+		if (msg->audit_record)
+			service_audit_record_append(records, msg->audit_record);
+		for (size_t i = 0; i < msg->n_audit_records; i++)
+			service_audit_record_append(records, msg->audit_records[i]);
+		file_write_append(AUDIT_LOGDIR "/audit.log", str_buffer(records),
+				  str_length(records));
+		str_free(records, true);
 
 		mem_free(LAST_AUDIT_HASH);
 		LAST_AUDIT_HASH = hash_buf;
+		LAST_AUDIT_SEQ = msg->has_audit_seq ? msg->audit_seq : 0;
 		ret = 0;
 	} else {
 		WARN("Got empty audit message from cmld");
@@ -235,6 +267,15 @@ audit_send_ack(int sock, const char *hash)
 	if (hash) {
 		auditmsg.audit_ack = mem_strdup((char *)hash);
 	}
+	if (LAST_AUDIT_SEQ) {
+		auditmsg.has_audit_ack_seq = true;
+		auditmsg.audit_ack_seq = LAST_AUDIT_SEQ;
+	}
+	auditmsg.has_audit_window = true;
+	auditmsg.audit_window = AUDIT_WINDOW;
+	auditmsg.has_audit_batch = true;
+	auditmsg.audit_batch = AUDIT_BATCH;
+	AUDIT_UNACKED = 0;
 
 	ssize_t msg_size = protobuf_send_message(sock, (ProtobufCMessage *)&auditmsg);
 	if (msg_size < 0)
@@ -287,13 +328,29 @@ service_cb_recv_message(int fd, unsigned events, event_io_t *io, UNUSED void *da
 		} else if (CMLD_TO_SERVICE_MESSAGE__CODE__AUDIT_RECORD == msg->code) {
 			TRACE("Got audit record from cmld");
 
-			awaiting_record = false;
-			if (0 != process_audit_record(msg, buf, buf_len)) {
-				ERROR("Failed to process audit record");
+			awaiting_record = true;
+
+			// a batch is acknowledged as a whole with the seq of its last record
+			size_t n_records = MAX(msg->n_audit_records, (size_t)1);
+
+			// records following a failed one are sent again by cmld
+			if (msg->has_audit_seq && LAST_AUDIT_SEQ &&
+			    msg->audit_seq - n_records + 1 > LAST_AUDIT_SEQ + 1) {
+				TRACE("Discarding audit record %" PRIu64 ", expected %" PRIu64,
+				      msg->audit_seq - n_records + 1, LAST_AUDIT_SEQ + 1);
+				goto out;
 			}
 
 			// if processing of the last record failed,
 			// send ACK with old hash to trigger delivery again
+			if (0 != process_audit_record(msg, buf, buf_len)) {
+				ERROR("Failed to process audit record");
+			} else if (msg->has_audit_seq && !msg->audit_ack_request &&
+				   (AUDIT_UNACKED += n_records) < AUDIT_WINDOW / 2) {
+				// ACKs are cumulative, wait for more records
+				goto out;
+			}
+
 			if (0 != audit_send_ack(fd, LAST_AUDIT_HASH)) {
 				ERROR("Failed to send ack to cmld");
 			} else {
@@ -329,6 +386,112 @@ out:
 	return;
 }
 
+static void
+service_bcast_stop(void)
+{
+	if (service_bcast_event) {
+		event_remove_io(service_bcast_event);
+		event_io_free(service_bcast_event);
+		service_bcast_event = NULL;
+	}
+	if (service_bcast_efd >= 0) {
+		close(service_bcast_efd);
+		service_bcast_efd = -1;
+	}
+	bcast_page_unmap(service_bcast_page);
+	service_bcast_page = NULL;
+}
+
+static int
+service_bcast_start(void);
+
+static void
+service_bcast_update(void)
+{
+	bcast_state_t state;
+	uint32_t seq;
+
+	if (bcast_page_read(service_bcast_page, &state, &seq) < 0) {
+		if (errno != ESTALE) {
+			WARN_ERRNO("Failed to read broadcast page");
+			return;
+		}
+		// cmld was restarted and published a new page
+		INFO("Broadcast page abandoned by cmld, fetching the new one");
+		service_bcast_stop();
+		if (service_bcast_start() < 0)
+			WARN("Failed to fetch broadcast page");
+		return;
+	}
+	IF_TRUE_RETURN(seq == service_bcast_seq);
+
+	service_bcast_seq = seq;
+	INFO("Host state changed: connectivity %d, dns '%s', boot time %" PRId64 "%s",
+	     state.connectivity, state.dns, state.btime,
+	     state.flags & BCAST_FLAG_TIME_UNSYNCED ? " (clock unsynchronized)" : "");
+}
+
+static void
+service_bcast_cb(int fd, unsigned events, UNUSED event_io_t *io, UNUSED void *data)
+{
+	if (events & EVENT_IO_EXCEPT) {
+		WARN("Broadcast eventfd failed");
+		service_bcast_stop();
+		return;
+	}
+
+	eventfd_t count;
+	// any number of changes since the last wakeup is handled at once
+	IF_TRUE_RETURN(eventfd_read(fd, &count) < 0);
+
+	service_bcast_update();
+}
+
+/*
+ * Fetches the read-only broadcast page and the eventfd announcing its changes
+ * from cmld. Changes of the host state are thus picked up without a message
+ * of cmld for each container.
+ */
+static int
+service_bcast_start(void)
+{
+	int page_fd = -1, efd = -1;
+	char tag;
+
+	int sock = sock_unix_create_and_connect(SOCK_STREAM, SERVICE_BCAST_SOCKET);
+	IF_TRUE_RETVAL(sock < 0, -1);
+
+	if (sock_unix_recv_fd(sock, &tag, 1, &page_fd) != 1 || page_fd < 0 ||
+	    sock_unix_recv_fd(sock, &tag, 1, &efd) != 1 || efd < 0) {
+		ERROR("Failed to receive broadcast page from cmld");
+		goto error;
+	}
+	close(sock);
+
+	service_bcast_page = bcast_page_map(page_fd);
+	close(page_fd);
+	if (!service_bcast_page) {
+		close(efd);
+		return -1;
+	}
+
+	service_bcast_seq = 0;
+	service_bcast_efd = efd;
+	service_bcast_event = event_io_new(efd, EVENT_IO_READ, service_bcast_cb, NULL);
+	event_add_io(service_bcast_event);
+
+	service_bcast_update();
+	return 0;
+
+error:
+	if (page_fd >= 0)
+		close(page_fd);
+	if (efd >= 0)
+		close(efd);
+	close(sock);
+	return -1;
+}
+
 static int
 open_service_socket()
 {
@@ -371,6 +534,37 @@ service_close_all_fds()
 	return 0;
 }
 
+/*
+ * Connects to cmld and handles its messages in the event loop of the calling process.
+ */
+static int
+service_message_handler_start(void)
+{
+	int sock;
+	if (-1 == (sock = open_service_socket())) {
+		ERROR("Failed to open service socket.");
+		return -1;
+	}
+
+	LAST_AUDIT_HASH = mem_strdup(
+		"00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000");
+
+	/* register socket for receiving data */
+	fd_make_non_blocking(sock);
+
+	event_io_t *event = event_io_new(sock, EVENT_IO_READ, service_cb_recv_message, NULL);
+	event_add_io(event);
+
+	if (0 != audit_send_ack(sock, LAST_AUDIT_HASH)) {
+		ERROR("Failed to send ack to cmld");
+	}
+
+	if (service_bcast_start() < 0)
+		WARN("Failed to fetch broadcast page, host state is not tracked");
+
+	return 0;
+}
+
 static void
 fork_service_message_handler()
 {
@@ -387,28 +581,8 @@ fork_service_message_handler()
 		service_logfile_handler = logf_register(&logf_file_write, stream);
 		logf_handler_set_prio(service_logfile_handler, LOGF_PRIO_TRACE);
 
-		int sock;
-		if (-1 == (sock = open_service_socket())) {
-			FATAL("Failed to open service socket. Aborting.");
-		}
-
-		LAST_AUDIT_HASH = mem_strdup(
-			"00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000");
-
-		int *sock_ptr = mem_alloc(sizeof(int));
-		*sock_ptr = sock;
-
-		WARN("Registering logf handler");
-
-		/* register socket for receiving data */
-		fd_make_non_blocking(sock);
-
-		event_io_t *event =
-			event_io_new(*sock_ptr, EVENT_IO_READ, service_cb_recv_message, NULL);
-		event_add_io(event);
-
-		if (0 != audit_send_ack(*sock_ptr, LAST_AUDIT_HASH)) {
-			ERROR("Failed to send ack to cmld");
+		if (service_message_handler_start()) {
+			FATAL("Failed to start service message handler. Aborting.");
 		}
 
 		event_loop();
@@ -486,10 +660,14 @@ main(int argc, char **argv)
 		WARN("Error starting child!");
 	}
 
-	fork_service_message_handler();
+	// as init, cmld messages are handled by the same process which forwards the signals
+	if (service_message_handler_start()) {
+		WARN("Failed to start service message handler");
+	}
 
-	INFO("Going to handle signals ...");
-	dumb_init_signal_handler();
+	INFO("Going to handle signals and cmld messages ...");
+	dumb_init_signal_events_register();
+	event_loop();
 
 	return 0;
 }
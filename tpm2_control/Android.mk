@@ -43,7 +43,7 @@ LOCAL_SRC_FILES := $(CMLD_COMMON_SRC_FILES) \
 	common/logf.proto \
 	tpm2d_control.c
 
-LOCAL_STATIC_LIBRARIES += libprotobuf-c-text libc
+LOCAL_STATIC_LIBRARIES += libprotobuf-c-text libz libc
 
 LOCAL_CFLAGS += $(CMLD_COMMON_CFLAGS)
 
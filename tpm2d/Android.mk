@@ -35,8 +35,11 @@ LOCAL_MODULE := cml-tpm2d
 LOCAL_MODULE_TAGS := optional
 LOCAL_SRC_FILES := \
 	common/list.c \
+	common/ilist.c \
+	common/hashmap.c \
 	common/logf.c \
 	common/mem.c \
+	common/str.c \
 	common/sock.c \
 	common/event.c \
 	common/dir.c \
@@ -44,6 +47,8 @@ LOCAL_SRC_FILES := \
 	common/fd.c \
 	common/protobuf.c \
 	common/cryptfs.c \
+	common/merkle.c \
+	common/drbg.c \
 	attestation.proto \
 	tpm2d.proto \
 	control.c \
@@ -59,6 +64,7 @@ LOCAL_WHOLE_STATIC_LIBRARIES := \
 
 LOCAL_STATIC_LIBRARIES := \
 	libprotobuf-c-text \
+	libz \
 	openssl_libcrypto_static \
 	libcutils \
 	liblog \
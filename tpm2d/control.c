@@ -34,6 +34,7 @@
 #include "ek.h"
 
 #include "common/macro.h"
+#include "common/drbg.h"
 #include "common/mem.h"
 #include "common/sock.h"
 #include "common/fd.h"
@@ -43,6 +44,7 @@
 #include "common/protobuf.h"
 
 #include <google/protobuf-c/protobuf-c-text.h>
+#include <openssl/crypto.h>
 
 // maximum no. of connections waiting to be accepted on the listening socket
 #define TPM2D_CONTROL_SOCK_LISTEN_BACKLOG 8
@@ -125,7 +127,7 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 		return;
 	}
 
-	if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
+	if (logf_enabled(LOGF_PRIO_TRACE)) {
 		char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
 		TRACE("Handling ControllerToTpm message:\n%s", msg_text ? msg_text : "NULL");
 		if (msg_text)
@@ -160,15 +162,33 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 	case CONTROLLER_TO_TPM__CODE__RANDOM_REQ: {
 		TpmToController out = TPM_TO_CONTROLLER__INIT;
 		out.code = TPM_TO_CONTROLLER__CODE__RANDOM_RESPONSE;
-		uint8_t *rand = tpm2_getrandom_new(msg->rand_size);
-		char *rand_hex = convert_bin_to_hex_new(rand, msg->rand_size);
+		// served by the DRBG which is seeded from the TPM, see tpm2d_init()
+		size_t rand_size = msg->rand_size > 0 ? msg->rand_size : 0;
+		uint8_t *rand = mem_new0(uint8_t, rand_size);
+		char *rand_hex = NULL;
+		if (drbg_bytes(rand, rand_size) == 0)
+			rand_hex = convert_bin_to_hex_new(rand, rand_size);
 		out.rand_data = rand_hex;
 		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-		if (rand)
-			mem_free(rand);
+		mem_free(rand);
 		if (rand_hex)
 			mem_free(rand_hex);
 	} break;
+	case CONTROLLER_TO_TPM__CODE__CACHE_KEY_REQ: {
+		TpmToController out = TPM_TO_CONTROLLER__INIT;
+		out.code = TPM_TO_CONTROLLER__CODE__CACHE_KEY_RESPONSE;
+		uint8_t *key = nvmcrypt_load_cache_key_new();
+		if (key) {
+			out.has_cache_key = true;
+			out.cache_key.data = key;
+			out.cache_key.len = NVMCRYPT_CACHE_KEY_LEN;
+		}
+		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+		if (key) {
+			OPENSSL_cleanse(key, NVMCRYPT_CACHE_KEY_LEN);
+			mem_free(key);
+		}
+	} break;
 	case CONTROLLER_TO_TPM__CODE__CLEAR: {
 		INFO("Received Clear command!");
 		TpmToController out = TPM_TO_CONTROLLER__INIT;
@@ -209,10 +229,31 @@ tpm2d_control_handle_message(const ControllerToTpm *msg, int fd, tpm2d_control_t
 		out.has_response = true;
 		int ret = ml_measurement_list_append(
 			msg->ml_filename, tpm2d_control_get_algid_from_proto(msg->ml_hashalg),
+			msg->ml_digest_type == ML_DIGEST_TYPE__ML_DIGEST_FSVERITY,
 			msg->ml_datahash.data, msg->ml_datahash.len);
 		out.response = tpm2d_control_resp_to_proto(ret ? CMD_FAILED : CMD_OK);
 		protobuf_send_message(fd, (ProtobufCMessage *)&out);
 	} break;
+	case CONTROLLER_TO_TPM__CODE__ML_APPEND_BATCH: {
+		TpmToController out = TPM_TO_CONTROLLER__INIT;
+		out.code = TPM_TO_CONTROLLER__CODE__GENERIC_RESPONSE;
+		out.has_response = true;
+		int ret = 0;
+		// the extends are applied back to back in a single TSS context
+		for (size_t i = 0; i < msg->n_ml_entries; i++) {
+			MlEntry *e = msg->ml_entries[i];
+			TPM_ALG_ID algid = tpm2d_control_get_algid_from_proto(e->hashalg);
+			bool verity = e->digest_type == ML_DIGEST_TYPE__ML_DIGEST_FSVERITY;
+			if (ml_measurement_list_append(e->filename, algid, verity, e->datahash.data,
+						       e->datahash.len)) {
+				ERROR("Failed to append measurement of %s", e->filename);
+				ret = -1;
+			}
+		}
+		DEBUG("Appended %zu measurements to ML", msg->n_ml_entries);
+		out.response = tpm2d_control_resp_to_proto(ret ? CMD_FAILED : CMD_OK);
+		protobuf_send_message(fd, (ProtobufCMessage *)&out);
+	} break;
 	default:
 		WARN("ControllerToTpm command %d unknown or not implemented yet", msg->code);
 		break;
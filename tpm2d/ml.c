@@ -25,8 +25,9 @@
 
 #include "common/macro.h"
 #include "common/mem.h"
-#include "common/list.h"
+#include "common/ilist.h"
 #include "common/file.h"
+#include "common/hashmap.h"
 
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -35,41 +36,223 @@
 #include <fcntl.h>
 #include <errno.h>
 
-#define CONTAINER_PCR_INDEX 11
+#include <openssl/evp.h>
+
 
 #define BINARY_RUNTIME_MEASUREMENTS "/sys/kernel/security/ima/binary_runtime_measurements"
 #define ASCII_RUNTIME_MEASUREMENTS "/sys/kernel/security/ima/ascii_runtime_measurements"
 
+#define ML_BINARY_READ_CHUNK 4096
+// entries of the binary list carry the SHA1 template digest
+#define ML_IMA_DIGEST_LEN 20
+#define ML_IMA_NAME_LEN_MAX 255
+
 typedef struct ml_elem {
 	char *filename;
 	TPM_ALG_ID algid;
+	bool verity; //!< datahash is an fs-verity file digest
 	int hash_len;
 	uint8_t *datahash;
-	tpm2d_pcr_t *template;
+	uint8_t template[EVP_MAX_MD_SIZE]; //!< value of the container PCR after the extend
+	size_t template_len;
+	char *line; //!< the entry in the IMA ASCII format, rendered when appended
+	ilist_node_t node;
 } ml_elem_t;
 
-static list_t *measurement_list = NULL;
-static size_t measurement_list_len = 0;
+static ilist_t measurement_list = ILIST_INITIALIZER;
+// elements of measurement_list by filename and datahash
+static hashmap_t *measurement_index = NULL;
+
+/*
+ * Extending is deterministic, thus the value of the container PCR is tracked in
+ * software. It is read from the TPM once before the first extend and compared
+ * to the value read for a quote, which resynchronizes it on a mismatch.
+ */
+static struct {
+	bool valid;
+	uint8_t value[EVP_MAX_MD_SIZE];
+	size_t len;
+} ml_pcr;
+
+/*
+ * The IMA measurement list only grows. Thus, the binary list read so far is
+ * kept together with the open file, whose seq_file position continues after
+ * the last entry read, and further reads only return new entries.
+ */
+static struct {
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	size_t allocated_len;
+	size_t parsed_len; //!< length of the entries counted in entries
+	size_t entries;
+	bool parse_failed;
+} ml_binary = { .fd = -1 };
+
+/*
+ * The ASCII measurement list is kept the same way. Each '\n' read is replaced
+ * by '\0' and the offset of the line is recorded, lines are only complete
+ * once their '\n' was read.
+ */
+static struct {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t allocated_len;
+	size_t parsed_len; //!< end of the last complete line
+	size_t *lines;	   //!< offsets of the complete lines in buf
+	size_t lines_len;
+	size_t lines_allocated_len;
+} ml_ascii = { .fd = -1 };
+
+// pointers to the lines of both lists returned by ml_get_measurement_list_strings()
+static const char **ml_strings = NULL;
+static size_t ml_strings_allocated_len = 0;
+
+static size_t
+ml_elem_hash(const void *key)
+{
+	const ml_elem_t *ml_elem = key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (const unsigned char *p = (const unsigned char *)ml_elem->filename; *p; p++) {
+		hash ^= *p;
+		hash *= 0x100000001b3ULL;
+	}
+	for (int i = 0; i < ml_elem->hash_len; i++) {
+		hash ^= ml_elem->datahash[i];
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= ml_elem->verity;
+	return (size_t)hash;
+}
+
+static bool
+ml_elem_equal(const void *key1, const void *key2)
+{
+	const ml_elem_t *ml_elem1 = key1;
+	const ml_elem_t *ml_elem2 = key2;
+
+	return ml_elem1->verity == ml_elem2->verity && ml_elem1->hash_len == ml_elem2->hash_len &&
+	       !memcmp(ml_elem1->datahash, ml_elem2->datahash, ml_elem1->hash_len) &&
+	       !strcmp(ml_elem1->filename, ml_elem2->filename);
+}
+
+static const EVP_MD *
+ml_halg_to_evp_md(TPM_ALG_ID halg_id)
+{
+	switch (halg_id) {
+	case TPM_ALG_SHA1:
+		return EVP_sha1();
+	case TPM_ALG_SHA256:
+		return EVP_sha256();
+	case TPM_ALG_SHA384:
+		return EVP_sha384();
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Sets the software PCR to the value read from the TPM.
+ */
+static void
+ml_pcr_set(const tpm2d_pcr_t *pcr)
+{
+	ml_pcr.valid = pcr->pcr_size <= sizeof(ml_pcr.value);
+	IF_FALSE_RETURN_ERROR(ml_pcr.valid);
+
+	memcpy(ml_pcr.value, pcr->pcr_value, pcr->pcr_size);
+	ml_pcr.len = pcr->pcr_size;
+}
+
+/*
+ * Computes the extend of the software PCR the same way as the TPM: data is
+ * padded with zeros or truncated to the digest size of the bank.
+ */
+static int
+ml_pcr_extend(const uint8_t *data, size_t data_len)
+{
+	const EVP_MD *md = ml_halg_to_evp_md(TPM2D_HASH_ALGORITHM);
+	IF_NULL_RETVAL_ERROR(md, -1);
+	IF_FALSE_RETVAL_ERROR((size_t)EVP_MD_size(md) == ml_pcr.len, -1);
+
+	uint8_t buf[2 * EVP_MAX_MD_SIZE] = { 0 };
+	memcpy(buf, ml_pcr.value, ml_pcr.len);
+	memcpy(buf + ml_pcr.len, data, MIN(data_len, ml_pcr.len));
+
+	IF_FALSE_RETVAL_ERROR(EVP_Digest(buf, 2 * ml_pcr.len, ml_pcr.value, NULL, md, NULL), -1);
+	return 0;
+}
+
+void
+ml_pcr_check(const tpm2d_pcr_t *pcr)
+{
+	IF_NULL_RETURN(pcr);
+	IF_FALSE_RETURN(ml_pcr.valid);
+
+	if (pcr->pcr_size != ml_pcr.len || memcmp(pcr->pcr_value, ml_pcr.value, ml_pcr.len)) {
+		WARN("PCR %d differs from the value tracked for the measurement list, resync",
+		     ML_CONTAINER_PCR_INDEX);
+		ml_pcr_set(pcr);
+	}
+}
+
+static const char *
+halg_id_to_ima_string(TPM_ALG_ID alg_id)
+{
+	switch (alg_id) {
+	case TPM_ALG_SHA1:
+		return "sha1";
+	case TPM_ALG_SHA256:
+		return "sha256";
+	case TPM_ALG_SHA384:
+		return "sha384";
+	default:
+		return "none";
+	}
+}
 
 int
-ml_measurement_list_append(const char *filename, TPM_ALG_ID algid, const uint8_t *datahash,
-			   size_t datahash_len)
+ml_measurement_list_append(const char *filename, TPM_ALG_ID algid, bool verity,
+			   const uint8_t *datahash, size_t datahash_len)
 {
 	// input checks
 	IF_NULL_RETVAL(filename, -1);
 	IF_NULL_RETVAL(datahash, -1);
 	IF_FALSE_RETVAL((datahash_len > 0), -1);
 
+	if (!measurement_index)
+		measurement_index = hashmap_new(ml_elem_hash, ml_elem_equal);
+
 	// check if filehash is in list
-	for (list_t *l = measurement_list; l; l = l->next) {
-		ml_elem_t *ml_elem = l->data;
-		if (NULL == ml_elem)
-			continue;
-		if ((0 == memcmp(ml_elem->datahash, datahash, datahash_len)) &&
-		    (0 == memcmp(ml_elem->filename, filename, strlen(filename)))) {
-			return 0; // container image with that name alread in list
-		}
+	ml_elem_t key = { .filename = (char *)filename,
+			  .verity = verity,
+			  .hash_len = datahash_len,
+			  .datahash = (uint8_t *)datahash };
+	if (hashmap_contains(measurement_index, &key))
+		return 0; // container image with that name alread in list
+
+	if (!ml_pcr.valid) {
+		tpm2d_pcr_t *pcr = tpm2_pcrread_new(ML_CONTAINER_PCR_INDEX, TPM2D_HASH_ALGORITHM);
+		IF_NULL_RETVAL_ERROR(pcr, -1);
+		ml_pcr_set(pcr);
+		tpm2_pcrread_free(pcr);
+		IF_FALSE_RETVAL(ml_pcr.valid, -1);
 	}
+
+	// extend to TPM
+	if (tpm2_pcrextend(ML_CONTAINER_PCR_INDEX, TPM2D_HASH_ALGORITHM, datahash, datahash_len)) {
+		ERROR("tpm extend failed");
+		// the PCR value is unknown now
+		ml_pcr.valid = false;
+		return -1;
+	}
+	if (ml_pcr_extend(datahash, datahash_len)) {
+		ml_pcr.valid = false;
+		return -1;
+	}
+
 	INFO("Appending new hash for %s len=%zu", filename, datahash_len);
 	// new hash to be added
 	ml_elem_t *new_ml_elem = mem_new0(ml_elem_t, 1);
@@ -79,129 +262,216 @@ ml_measurement_list_append(const char *filename, TPM_ALG_ID algid, const uint8_t
 	memcpy(new_ml_elem->datahash, datahash, datahash_len);
 
 	new_ml_elem->algid = algid;
+	new_ml_elem->verity = verity;
 
-	// extend to TPM
-	int ret = tpm2_pcrextend(CONTAINER_PCR_INDEX, TPM2D_HASH_ALGORITHM, datahash, datahash_len);
-	if (ret) {
-		ERROR("tpm extend failed");
-	}
 	// store the template as in the ML elem
-	new_ml_elem->template = tpm2_pcrread_new(CONTAINER_PCR_INDEX, TPM2D_HASH_ALGORITHM);
+	memcpy(new_ml_elem->template, ml_pcr.value, ml_pcr.len);
+	new_ml_elem->template_len = ml_pcr.len;
 
-	measurement_list = list_append(measurement_list, new_ml_elem);
-	measurement_list_len++;
+	char *hex_datahash = convert_bin_to_hex_new(datahash, datahash_len);
+	char *hex_template = convert_bin_to_hex_new(new_ml_elem->template, ml_pcr.len);
+	// as IMA, the digest type of fs-verity digests is part of the ima-ngv2 template
+	new_ml_elem->line = mem_printf("%d %s %s %s%s:%s %s", ML_CONTAINER_PCR_INDEX,
+				       hex_template, verity ? "ima-ngv2" : "ima-ng",
+				       verity ? "verity:" : "", halg_id_to_ima_string(algid),
+				       hex_datahash, filename);
+	mem_free(hex_datahash);
+	mem_free(hex_template);
+
+	ilist_append(&measurement_list, &new_ml_elem->node);
+	hashmap_put(measurement_index, new_ml_elem, new_ml_elem);
 
 	return 0;
 }
 
-static const char *
-halg_id_to_ima_string(TPM_ALG_ID alg_id)
+static void
+ml_binary_reset(void)
 {
-	switch (alg_id) {
-	case TPM_ALG_SHA1:
-		return "sha1";
-	case TPM_ALG_SHA256:
-		return "sha256";
-	case TPM_ALG_SHA384:
-		return "sha384";
-	default:
-		return "none";
+	if (ml_binary.fd >= 0)
+		close(ml_binary.fd);
+	if (ml_binary.buf)
+		mem_free(ml_binary.buf);
+	memset(&ml_binary, 0, sizeof(ml_binary));
+	ml_binary.fd = -1;
+}
+
+static uint32_t
+ml_binary_u32(size_t off)
+{
+	uint32_t val;
+	memcpy(&val, ml_binary.buf + off, sizeof(val));
+	return val;
+}
+
+/*
+ * Counts the complete entries (pcr, template digest, template name and
+ * template data) appended since the last call.
+ */
+static void
+ml_binary_count_entries(void)
+{
+	const size_t hdr_len = sizeof(uint32_t) + ML_IMA_DIGEST_LEN + sizeof(uint32_t);
+
+	while (!ml_binary.parse_failed && ml_binary.parsed_len + hdr_len <= ml_binary.len) {
+		size_t off = ml_binary.parsed_len + hdr_len;
+		uint32_t name_len = ml_binary_u32(off - sizeof(uint32_t));
+		if (name_len > ML_IMA_NAME_LEN_MAX) {
+			// e.g. ima_canonical_fmt on a big endian system, the list itself is fine
+			WARN("Unexpected IMA template name length %u, not counting entries",
+			     name_len);
+			ml_binary.parse_failed = true;
+			break;
+		}
+		off += name_len;
+		if (off + sizeof(uint32_t) > ml_binary.len)
+			break;
+		uint32_t data_len = ml_binary_u32(off);
+		off += sizeof(uint32_t);
+		if (data_len > ml_binary.len - off)
+			break;
+
+		ml_binary.parsed_len = off + data_len;
+		ml_binary.entries++;
 	}
 }
 
-static list_t *
-ml_get_ima_ml_string_list_new(void)
+/*
+ * Appends the data added to the measurement list file since the last call to
+ * buf. The files in /sys do not provide a size, so they are read in chunks into
+ * a geometrically growing buffer until EOF.
+ */
+static int
+ml_file_read_new(const char *file, int *fd, void **buf, size_t *len, size_t *allocated_len)
 {
-	FILE *fp;
-	char *line = NULL; // will be malloced by getline
-	size_t line_len = 0;
+	if (*fd < 0) {
+		*fd = open(file, O_RDONLY | O_CLOEXEC);
+		if (*fd < 0) {
+			DEBUG("Could not open file %s", file);
+			return -1;
+		}
+	}
+
+	while (true) {
+		if (*allocated_len - *len < ML_BINARY_READ_CHUNK) {
+			*allocated_len = MAX(2 * *allocated_len, *len + ML_BINARY_READ_CHUNK);
+			*buf = mem_realloc(*buf, *allocated_len);
+		}
 
-	fp = fopen(ASCII_RUNTIME_MEASUREMENTS, "r");
-	IF_NULL_RETVAL(fp, NULL);
+		ssize_t ret = read(*fd, (char *)*buf + *len, *allocated_len - *len);
+		if (ret == 0)
+			break;
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+				TRACE("Reading from fd %d: Blocked, retrying...", *fd);
+				continue;
+			}
+			ERROR_ERRNO("Failed to read %s", file);
+			return -1;
+		}
+		*len += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Appends the entries added to the binary measurement list since the last call.
+ */
+static int
+ml_binary_read_new(void)
+{
+	size_t old_len = ml_binary.len;
 
-	list_t *ima_list = NULL;
-	while (-1 != getline(&line, &line_len, fp)) {
-		line[line_len - 1] = '\0'; // overwrite '\n'
-		ima_list = list_append(ima_list, mem_strdup(line));
+	if (ml_file_read_new(BINARY_RUNTIME_MEASUREMENTS, &ml_binary.fd, (void **)&ml_binary.buf,
+			     &ml_binary.len, &ml_binary.allocated_len) < 0) {
+		ml_binary_reset();
+		return -1;
 	}
 
-	fclose(fp);
-	if (line)
-		mem_free(line);
-	return ima_list;
+	ml_binary_count_entries();
+	DEBUG("Read %zu new bytes of the binary measurement list, %zu bytes and %zu entries total",
+	      ml_binary.len - old_len, ml_binary.len, ml_binary.entries);
+	return 0;
 }
 
-uint8_t *
-ml_get_measurement_list_binary_new(size_t *size)
+const uint8_t *
+ml_get_measurement_list_binary(size_t *size)
 {
-	int fd = 0;
+	ASSERT(size);
 
-	fd = open(BINARY_RUNTIME_MEASUREMENTS, O_RDONLY);
-	if (fd < 0) {
-		DEBUG("Could not open file %s", BINARY_RUNTIME_MEASUREMENTS);
+	if (ml_binary_read_new() < 0) {
 		*size = 0;
 		return NULL;
 	}
 
-	int ret = 0;
-	uint8_t *buf = NULL;
-	size_t s = 0;
+	*size = ml_binary.len;
+	return ml_binary.buf;
+}
 
-	// The binary measurement file in /sys is a special file where the file size cannot
-	// be determined. Therefore it must be read byte by byte
-	while (true) {
-		buf = (uint8_t *)mem_realloc(buf, s + 1);
-		ret = read(fd, buf + s, 1);
+static void
+ml_ascii_reset(void)
+{
+	if (ml_ascii.fd >= 0)
+		close(ml_ascii.fd);
+	mem_free(ml_ascii.buf);
+	mem_free(ml_ascii.lines);
+	memset(&ml_ascii, 0, sizeof(ml_ascii));
+	ml_ascii.fd = -1;
+}
 
-		if (ret == 0) {
-			goto out;
-		}
-		if (ret < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				TRACE("Reading from fd %d: Blocked, retrying...", fd);
-				continue;
-			}
-			mem_free(buf);
-			s = 0;
-			ERROR("Failed to read binary_runtime_measurements");
-			goto out;
+/*
+ * Appends the lines added to the ASCII measurement list since the last call.
+ */
+static int
+ml_ascii_read_new(void)
+{
+	if (ml_file_read_new(ASCII_RUNTIME_MEASUREMENTS, &ml_ascii.fd, (void **)&ml_ascii.buf,
+			     &ml_ascii.len, &ml_ascii.allocated_len) < 0) {
+		ml_ascii_reset();
+		return -1;
+	}
+
+	char *nl;
+	while ((nl = memchr(ml_ascii.buf + ml_ascii.parsed_len, '\n',
+			    ml_ascii.len - ml_ascii.parsed_len))) {
+		if (ml_ascii.lines_len == ml_ascii.lines_allocated_len) {
+			ml_ascii.lines_allocated_len = MAX(2 * ml_ascii.lines_allocated_len, 256u);
+			ml_ascii.lines = mem_renew(size_t, ml_ascii.lines,
+						   ml_ascii.lines_allocated_len);
 		}
-		s++;
+		ml_ascii.lines[ml_ascii.lines_len++] = ml_ascii.parsed_len;
+		*nl = '\0';
+		ml_ascii.parsed_len = nl - ml_ascii.buf + 1;
 	}
 
-out:
-	close(fd);
-	*size = s;
-	return buf;
+	return 0;
 }
 
-char **
-ml_get_measurement_list_strings_new(size_t *strings_len)
+const char *const *
+ml_get_measurement_list_strings(size_t *strings_len)
 {
-	list_t *ima_strings_list = ml_get_ima_ml_string_list_new();
-	*strings_len = measurement_list_len + list_length(ima_strings_list);
-	char **strings = mem_new0(char *, *strings_len);
+	ASSERT(strings_len);
 
-	int i = 0;
-	for (list_t *l = ima_strings_list; l; l = l->next, ++i) {
-		char *ima_ml_string = l->data;
-		strings[i] = ima_ml_string;
-		INFO("ML (%d): %s", i, strings[i]);
+	// without the IMA list, the container measurements are still returned
+	if (ml_ascii_read_new() < 0)
+		DEBUG("Could not read the IMA measurement list");
+
+	size_t len = ml_ascii.lines_len + ilist_length(&measurement_list);
+	if (len > ml_strings_allocated_len) {
+		ml_strings_allocated_len = MAX(2 * ml_strings_allocated_len, len);
+		ml_strings = mem_renew(const char *, ml_strings, ml_strings_allocated_len);
 	}
-	list_delete(ima_strings_list); // only deletes the list elements not the element's data
 
-	for (list_t *l = measurement_list; l; l = l->next, ++i) {
-		ml_elem_t *ml_elem = l->data;
-		char *hex_datahash = convert_bin_to_hex_new(ml_elem->datahash, ml_elem->hash_len);
-		const char *halg_string = halg_id_to_ima_string(ml_elem->algid);
-		char *hex_template = convert_bin_to_hex_new(ml_elem->template->pcr_value,
-							    ml_elem->template->pcr_size);
-		strings[i] = mem_printf("%d %s ima-ng %s:%s %s", CONTAINER_PCR_INDEX, hex_template,
-					halg_string, hex_datahash, ml_elem->filename);
-		INFO("ML (%d): %s", i, strings[i]);
-		mem_free(hex_datahash);
-		mem_free(hex_template);
+	size_t i = 0;
+	for (; i < ml_ascii.lines_len; i++)
+		ml_strings[i] = ml_ascii.buf + ml_ascii.lines[i];
+
+	ilist_foreach(&measurement_list, n) {
+		ml_strings[i++] = ilist_entry(n, ml_elem_t, node)->line;
 	}
 
-	return strings;
+	TRACE("Measurement list with %zu IMA and %zu container entries", ml_ascii.lines_len,
+	      i - ml_ascii.lines_len);
+	*strings_len = i;
+	return ml_strings;
 }
@@ -26,23 +26,49 @@
 
 #include "tpm2d.h"
 
+// PCR extended with the container measurements
+#define ML_CONTAINER_PCR_INDEX 11
+
+/**
+ * Appends a measurement to the container measurement list and extends it to
+ * the container PCR. fs-verity digests are listed in the ima-ngv2 format with
+ * the "verity" digest type, so that verifiers do not mistake them for hashes
+ * of the whole file.
+ *
+ * @param verity true if datahash is an fs-verity file digest
+ * @return 0 on success or if the measurement is listed already, -1 otherwise
+ */
 int
-ml_measurement_list_append(const char *filename, TPM_ALG_ID algid, const uint8_t *datahash,
-			   size_t datahash_len);
+ml_measurement_list_append(const char *filename, TPM_ALG_ID algid, bool verity,
+			   const uint8_t *datahash, size_t datahash_len);
+
+/**
+ * Compares the value of the container PCR, e.g. read for a quote, with the value
+ * tracked by ml while extending it and takes over the read value on a mismatch.
+ */
+void
+ml_pcr_check(const tpm2d_pcr_t *pcr);
 
 /**
- * Return the measurement list in binary format as a buffer
- * @param len A pointer to the variable where the length of the list should be stored in
- * @return The binary measurement list buffer
+ * Return the measurement list in binary format as a buffer. Only entries added
+ * since the previous call are read, the buffer is owned by ml and valid until
+ * the next call.
+ * @param size A pointer to the variable where the length of the list should be stored in
+ * @return The binary measurement list buffer or NULL on error
  */
-uint8_t *
-ml_get_measurement_list_binary_new(size_t *size);
+const uint8_t *
+ml_get_measurement_list_binary(size_t *size);
 
 /**
- * Return the measurement list as string array and uses the inout parameter
- * strings_len to provide the length of the array
+ * Return the measurement list in the IMA ASCII format as string array, the
+ * lines of the IMA list followed by the container measurements. As for the
+ * binary list, only lines added since the previous call are read and the
+ * container measurements are rendered once when they are appended. The array
+ * and its strings are owned by ml and valid until the next call.
+ * @param strings_len A pointer to the variable where the length of the array is stored in
+ * @return The string array
  */
-char **
-ml_get_measurement_list_strings_new(size_t *strings_len);
+const char *const *
+ml_get_measurement_list_strings(size_t *strings_len);
 
 #endif /* ML_H */
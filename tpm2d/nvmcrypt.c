@@ -33,11 +33,17 @@
 #include "common/file.h"
 #include "common/cryptfs.h"
 
+#include <openssl/crypto.h>
+
 #define FDE_KEY_LEN 64
 
 static nvmcrypt_fde_state_t fde_state = FDE_RESET;
 static bool secure_boot = false;
 static uint8_t *nvmcrypt_nvindex_policy = NULL;
+// policy session kept for the boot, see nvmcrypt_policy_session_get()
+static TPMI_SH_AUTH_SESSION nvmcrypt_policy_session = TPM_RH_NULL;
+// the nv index of the key is known to exist, saves a NV_ReadPublic per request
+static bool nvmcrypt_key_exists = false;
 
 static TPM_RC
 nvmcrypt_start_policy_session(TPM_SE session_type, TPMI_SH_AUTH_SESSION *session_handle,
@@ -74,26 +80,81 @@ cleanup:
 	return ret;
 }
 
+/*
+ * Computes the policy digest of the nv index in a trial session. It is only
+ * needed to define the index, thus it is computed on first use and cached for
+ * the boot instead of at each start of tpm2d.
+ */
 static TPM_RC
 nvmcrypt_create_policy(void)
 {
 	TPM_RC ret;
-	TPMI_SH_AUTH_SESSION se_trial;
+	TPMI_SH_AUTH_SESSION se_trial = TPM_RH_NULL;
+
+	IF_TRUE_RETVAL(nvmcrypt_nvindex_policy != NULL, TPM_RC_SUCCESS);
 
-	if (NULL == nvmcrypt_nvindex_policy)
-		nvmcrypt_nvindex_policy = mem_new(uint8_t, TPM2D_DIGEST_SIZE);
+	uint8_t *policy = mem_new0(uint8_t, TPM2D_DIGEST_SIZE);
 
 	ret = nvmcrypt_start_policy_session(TPM_SE_TRIAL, &se_trial, TPM_RH_NULL, NULL);
-	IF_FALSE_RETVAL(TPM_RC_SUCCESS == ret, ret);
+	IF_FALSE_GOTO(TPM_RC_SUCCESS == ret, out);
 
-	ret = tpm2_policygetdigest(se_trial, nvmcrypt_nvindex_policy, TPM2D_DIGEST_SIZE);
-	IF_FALSE_RETVAL(TPM_RC_SUCCESS == ret, ret);
+	ret = tpm2_policygetdigest(se_trial, policy, TPM2D_DIGEST_SIZE);
+	IF_FALSE_GOTO(TPM_RC_SUCCESS == ret, out);
 
 	// cleanup any previous policy states, e.g. form trial session
 	ret = tpm2_policyrestart(se_trial);
-	IF_FALSE_RETVAL(TPM_RC_SUCCESS == ret, ret);
+out:
+	if (se_trial != TPM_RH_NULL && TPM_RC_SUCCESS != tpm2_flushcontext(se_trial))
+		WARN("Failed to flush trial session");
+	if (TPM_RC_SUCCESS == ret)
+		nvmcrypt_nvindex_policy = policy;
+	else
+		mem_free(policy);
+	return ret;
+}
+
+static void
+nvmcrypt_policy_session_drop(void)
+{
+	IF_TRUE_RETURN(nvmcrypt_policy_session == TPM_RH_NULL);
 
-	return tpm2_flushcontext(se_trial);
+	if (TPM_RC_SUCCESS != tpm2_flushcontext(nvmcrypt_policy_session))
+		WARN("Failed to flush policy session %x", nvmcrypt_policy_session);
+	nvmcrypt_policy_session = TPM_RH_NULL;
+}
+
+/*
+ * Returns the policy session to read the key. Starting the (salted) session
+ * is expensive on slow TPMs, thus it is kept for the boot. The TPM resets its
+ * policy after each authorization, so PolicyPCR is still run for each read and
+ * the key is only released while PCR 7 matches.
+ */
+static TPM_RC
+nvmcrypt_policy_session_get(TPMI_SH_AUTH_SESSION *se_handle)
+{
+	TPM_RC ret;
+
+	if (nvmcrypt_policy_session != TPM_RH_NULL) {
+		// mask PCR 7
+		ret = tpm2_policypcr(nvmcrypt_policy_session, 0x80, NULL, 0);
+		if (TPM_RC_SUCCESS == ret) {
+			*se_handle = nvmcrypt_policy_session;
+			return ret;
+		}
+		// the session may be gone, e.g., flushed by another TPM user
+		DEBUG("Kept policy session not usable (%08x), starting a new one", ret);
+		nvmcrypt_policy_session_drop();
+	}
+
+	ret = nvmcrypt_start_policy_session(TPM_SE_POLICY, &nvmcrypt_policy_session, TPM_RH_NULL,
+					    NULL);
+	if (TPM_RC_SUCCESS != ret) {
+		nvmcrypt_policy_session_drop();
+		return ret;
+	}
+
+	*se_handle = nvmcrypt_policy_session;
+	return ret;
 }
 
 static uint8_t *
@@ -105,11 +166,10 @@ nvmcrypt_load_key_new(const char *fde_key_pw)
 	uint8_t *fde_key;
 
 	// check if nv index exists by requesting size of index which does a nv_read_public
-	if (tpm2_nv_get_data_size(TPM2D_FDE_NV_HANDLE) != 0) {
+	if (nvmcrypt_key_exists || tpm2_nv_get_data_size(TPM2D_FDE_NV_HANDLE) != 0) {
+		nvmcrypt_key_exists = true;
 		if (secure_boot) {
-			//ret = nvmcrypt_start_policy_session(TPM_SE_POLICY, &se_handle, TPM2D_FDE_NV_HANDLE, fde_key_pw);
-			ret = nvmcrypt_start_policy_session(TPM_SE_POLICY, &se_handle, TPM_RH_NULL,
-							    NULL);
+			ret = nvmcrypt_policy_session_get(&se_handle);
 		} else {
 			// let nv_read do its own auth session
 			se_handle = TPM_RH_NULL;
@@ -123,13 +183,12 @@ nvmcrypt_load_key_new(const char *fde_key_pw)
 			if (TPM_RC_SUCCESS == ret) {
 				fde_state = FDE_OK;
 				INFO("Loaded FDE Key from NVRAM");
-				//ret = tpm2_flushcontext(se_handle);
-				if (TPM_RC_SUCCESS != ret)
-					WARN("Failed flush policy session after nvread with error code: %08x",
-					     ret);
 				return fde_key;
 			}
 
+			// do not reuse a session whose authorization failed
+			nvmcrypt_policy_session_drop();
+
 			if ((ret & TPM_RC_AUTH_FAIL) == TPM_RC_AUTH_FAIL) {
 				fde_state = FDE_AUTH_FAILED;
 			} else if ((ret & TPM_RC_POLICY_FAIL) == TPM_RC_POLICY_FAIL) {
@@ -158,6 +217,11 @@ nvmcrypt_load_key_new(const char *fde_key_pw)
 		goto err;
 	}
 
+	if (secure_boot && TPM_RC_SUCCESS != (ret = nvmcrypt_create_policy())) {
+		ERROR("Failed to create policy for fde key with error code: %08x", ret);
+		goto err;
+	}
+
 	if (TPM_RC_SUCCESS !=
 	    (ret = tpm2_nv_definespace(TPM2D_KEY_HIERARCHY, TPM2D_FDE_NV_HANDLE, key_len, NULL,
 				       fde_key_pw, nvmcrypt_nvindex_policy))) {
@@ -170,10 +234,10 @@ nvmcrypt_load_key_new(const char *fde_key_pw)
 		ERROR("Failed to write fde key to nv area with error code: %08x", ret);
 		goto err;
 	}
+	nvmcrypt_key_exists = true;
 
 	if (secure_boot) {
-		if (TPM_RC_SUCCESS != (ret = nvmcrypt_start_policy_session(
-					       TPM_SE_POLICY, &se_handle, TPM_RH_NULL, NULL))) {
+		if (TPM_RC_SUCCESS != (ret = nvmcrypt_policy_session_get(&se_handle))) {
 			ERROR("Failed to start policy session for nvread! with error code: %08x",
 			      ret);
 			goto err;
@@ -186,6 +250,7 @@ nvmcrypt_load_key_new(const char *fde_key_pw)
 	if (TPM_RC_SUCCESS != (ret = tpm2_nv_read(se_handle, TPM2D_FDE_NV_HANDLE, fde_key_pw,
 						  verify_key, &verify_key_len))) {
 		ERROR("Failed to read fde key from nv area with error code: %08x", ret);
+		nvmcrypt_policy_session_drop();
 		goto err;
 	}
 
@@ -212,6 +277,65 @@ err:
 	return NULL;
 }
 
+uint8_t *
+nvmcrypt_load_cache_key_new(void)
+{
+	TPMI_SH_AUTH_SESSION se_handle = TPM_RH_NULL;
+	size_t key_len = NVMCRYPT_CACHE_KEY_LEN;
+	uint8_t *key = NULL;
+	TPM_RC ret;
+
+	if (tpm2_nv_get_data_size(TPM2D_CACHE_KEY_NV_HANDLE) == 0) {
+		INFO("The Handle %x does not yet exist, creating a new cache key",
+		     TPM2D_CACHE_KEY_NV_HANDLE);
+
+		key = tpm2_getrandom_new(key_len);
+		IF_NULL_RETVAL_ERROR(key, NULL);
+
+		if (secure_boot && TPM_RC_SUCCESS != (ret = nvmcrypt_create_policy())) {
+			ERROR("Failed to create policy for cache key with error code: %08x", ret);
+			goto err;
+		}
+		if (TPM_RC_SUCCESS != (ret = tpm2_nv_definespace(TPM2D_KEY_HIERARCHY,
+								 TPM2D_CACHE_KEY_NV_HANDLE, key_len,
+								 NULL, NULL,
+								 nvmcrypt_nvindex_policy))) {
+			ERROR("Failed to generate nv area for cache key with error code: %08x", ret);
+			goto err;
+		}
+		if (TPM_RC_SUCCESS !=
+		    (ret = tpm2_nv_write(TPM2D_CACHE_KEY_NV_HANDLE, NULL, key, key_len))) {
+			ERROR("Failed to write cache key to nv area with error code: %08x", ret);
+			goto err;
+		}
+		OPENSSL_cleanse(key, NVMCRYPT_CACHE_KEY_LEN);
+		mem_free(key);
+	}
+
+	// read the key back, also after its creation, to check the access policy
+	if (secure_boot && TPM_RC_SUCCESS != (ret = nvmcrypt_policy_session_get(&se_handle))) {
+		ERROR("Failed to start policy session for nvread! with error code: %08x", ret);
+		return NULL;
+	}
+	key = mem_new0(uint8_t, NVMCRYPT_CACHE_KEY_LEN);
+	ret = tpm2_nv_read(se_handle, TPM2D_CACHE_KEY_NV_HANDLE, NULL, key, &key_len);
+	if (TPM_RC_SUCCESS != ret || key_len != NVMCRYPT_CACHE_KEY_LEN) {
+		ERROR("Failed to read cache key from nv area with error code: %08x", ret);
+		if (TPM_RC_SUCCESS != ret)
+			nvmcrypt_policy_session_drop();
+		goto err;
+	}
+
+	INFO("Loaded cache key from NVRAM");
+	return key;
+err:
+	if (key) {
+		OPENSSL_cleanse(key, NVMCRYPT_CACHE_KEY_LEN);
+		mem_free(key);
+	}
+	return NULL;
+}
+
 nvmcrypt_fde_state_t
 nvmcrypt_dm_setup(const char *device_path, const char *fde_pw)
 {
@@ -226,7 +350,8 @@ nvmcrypt_dm_setup(const char *device_path, const char *fde_pw)
 
 	INFO("Setting up crypto device mapping for %s to %s", device_path, dev_name);
 
-	char *mapped_path = cryptfs_setup_volume_new(dev_name, device_path, ascii_key, NULL);
+	char *mapped_path =
+		cryptfs_setup_volume_new(dev_name, device_path, ascii_key, NULL, 0, 512);
 
 	if (mapped_path == NULL) {
 		ERROR("Failed to setup device mapping for %s", device_path);
@@ -251,18 +376,22 @@ nvmcrypt_fde_state_t
 nvmcrypt_dm_reset(const char *hierarchy_pw)
 {
 	if (TPM_RC_SUCCESS ==
-	    tpm2_nv_undefinespace(TPM2D_KEY_HIERARCHY, TPM2D_FDE_NV_HANDLE, hierarchy_pw))
+	    tpm2_nv_undefinespace(TPM2D_KEY_HIERARCHY, TPM2D_FDE_NV_HANDLE, hierarchy_pw)) {
 		fde_state = FDE_RESET;
+		nvmcrypt_key_exists = false;
+	}
 	return fde_state;
 }
 
 void
 nvmcrypt_init(bool use_secure_boot_policy)
 {
+	// the policy is created when the key is generated, see nvmcrypt_create_policy()
 	secure_boot = use_secure_boot_policy;
+}
 
-	if (use_secure_boot_policy) {
-		if (TPM_RC_SUCCESS != nvmcrypt_create_policy())
-			FATAL("Cannot setup nvmcrypt policy!");
-	}
+void
+nvmcrypt_exit(void)
+{
+	nvmcrypt_policy_session_drop();
 }
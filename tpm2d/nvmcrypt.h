@@ -32,6 +32,10 @@
 #define NVMCRYPT_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+// length of the key returned by nvmcrypt_load_cache_key_new()
+#define NVMCRYPT_CACHE_KEY_LEN 32
 
 /**
  * Enum defining the error states of the key generation process
@@ -58,6 +62,12 @@ typedef enum nvmcrypt_fde_state {
 void
 nvmcrypt_init(bool use_secure_boot_policy);
 
+/**
+ * Flushes the policy session which is kept for reading the key.
+ */
+void
+nvmcrypt_exit(void);
+
 /**
  * Setup an encrypted device mapping for a given block device
  * e.g. /dev/sda using the given password (which can be NULL)
@@ -102,4 +112,17 @@ nvmcrypt_dm_lock(const char *fde_pw);
 nvmcrypt_fde_state_t
 nvmcrypt_dm_reset(const char *hierarchy_pw);
 
+/**
+ * Returns the key which authenticates caches of cmld stored on its data
+ * partition, e.g. of verified image hashes. The key is created at random on
+ * first use and stored in its own nvindex of the TPM, with the same access
+ * policy as the FDE key. Thus it is bound to the device and, with secure boot,
+ * to its boot state and cannot be read by an offline attacker.
+ *
+ * @return the NVMCRYPT_CACHE_KEY_LEN bytes of the key, which have to be
+ *         freed by the caller, or NULL on error
+ */
+uint8_t *
+nvmcrypt_load_cache_key_new(void);
+
 #endif // NVMCRYPT_H
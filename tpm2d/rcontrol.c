@@ -42,13 +42,92 @@
 #include "common/event.h"
 #include "common/file.h"
 #include "common/protobuf.h"
+#include "common/list.h"
+#include "common/merkle.h"
 
 #include <google/protobuf-c/protobuf-c-text.h>
 
+// time in ms to collect further requests for a shared quote after an aggregated request
+#define TPM2D_RCONTROL_AGGREGATE_WINDOW 50
+// maximum number of requests answered by one quote
+#define TPM2D_RCONTROL_AGGREGATE_MAX 64
+// number of PCRs of a TPM
+#define TPM2D_RCONTROL_PCRS_MAX 24
+
 struct tpm2d_rcontrol {
 	int sock; // listen ip socket fd
+	list_t *aggregated; // pending requests to be answered by a shared quote
+	event_timer_t *aggregate_timer;
 };
 
+/*
+ * Attestation request, kept until it is answered if aggregated.
+ */
+typedef struct {
+	int fd;
+	IdsAttestationType atype;
+	int pcr_regs;
+	uint8_t *nonce;
+	size_t nonce_len;
+} tpm2d_rcontrol_req_t;
+
+/*
+ * The device certificate sent with each response, read again only if the
+ * file was replaced or modified.
+ */
+static struct {
+	uint8_t *buf;
+	size_t len;
+	struct stat st;
+} tpm2d_rcontrol_att_cert;
+
+static const uint8_t *
+tpm2d_rcontrol_att_cert_get(size_t *len)
+{
+	FILE *fp;
+	struct stat stat_buf;
+	if (!(fp = fopen(TPM2D_ATT_CERT_FILE, "rb"))) {
+		ERROR("Error opening device cert file");
+		return NULL;
+	}
+	if (fstat(fileno(fp), &stat_buf) == -1) {
+		ERROR("Error accessing device cert file");
+		fclose(fp);
+		return NULL;
+	}
+
+	if (tpm2d_rcontrol_att_cert.buf && stat_buf.st_dev == tpm2d_rcontrol_att_cert.st.st_dev &&
+	    stat_buf.st_ino == tpm2d_rcontrol_att_cert.st.st_ino &&
+	    stat_buf.st_size == tpm2d_rcontrol_att_cert.st.st_size &&
+	    stat_buf.st_mtim.tv_sec == tpm2d_rcontrol_att_cert.st.st_mtim.tv_sec &&
+	    stat_buf.st_mtim.tv_nsec == tpm2d_rcontrol_att_cert.st.st_mtim.tv_nsec) {
+		fclose(fp);
+		*len = tpm2d_rcontrol_att_cert.len;
+		return tpm2d_rcontrol_att_cert.buf;
+	}
+
+	size_t att_cert_len = stat_buf.st_size;
+	uint8_t *attestation_cert = mem_new(uint8_t, att_cert_len);
+
+	if ((fread(attestation_cert, sizeof(uint8_t), att_cert_len, fp)) != att_cert_len) {
+		ERROR("Error reading out device cert file");
+		fclose(fp);
+		mem_free(attestation_cert);
+		return NULL;
+	}
+	fclose(fp);
+
+	if (tpm2d_rcontrol_att_cert.buf)
+		mem_free(tpm2d_rcontrol_att_cert.buf);
+	tpm2d_rcontrol_att_cert.buf = attestation_cert;
+	tpm2d_rcontrol_att_cert.len = att_cert_len;
+	tpm2d_rcontrol_att_cert.st = stat_buf;
+	INFO("att cert done: size=%zu", att_cert_len);
+
+	*len = att_cert_len;
+	return attestation_cert;
+}
+
 /**
  * Returns the HashAlgLen (proto) for the given TPM_ALG_ID alg_id.
  */
@@ -68,6 +147,239 @@ tpm2d_rcontrol_hash_algo_get_len_proto(TPM_ALG_ID alg_id)
 	}
 }
 
+/*
+ * Answers the attestation requests in reqs, which all ask for the same PCRs,
+ * with one quote. For a single request, the quote is over its nonce, otherwise
+ * over the root of a Merkle tree over all nonces and each response carries the
+ * inclusion proof of its nonce.
+ */
+static void
+tpm2d_rcontrol_attest(tpm2d_rcontrol_req_t *reqs[], size_t n)
+{
+	Pcr out_pcr_values[TPM2D_RCONTROL_PCRS_MAX];
+	Pcr *out_pcrs[TPM2D_RCONTROL_PCRS_MAX];
+	int pcr_regs = reqs[0]->pcr_regs;
+	int pcr_indices = pcr_regs - 1;
+	tpm2d_pcr_t *pcr_array[TPM2D_RCONTROL_PCRS_MAX] = { NULL };
+	tpm2d_quote_t *quote = NULL;
+	const uint8_t *attestation_cert = NULL;
+	size_t att_cert_len = 0;
+	merkle_tree_t *tree = NULL;
+	const uint8_t **proof = NULL;
+	ProtobufCBinaryData *out_proof = NULL;
+	const uint8_t *qualifying_data = reqs[0]->nonce;
+	size_t qualifying_data_len = reqs[0]->nonce_len;
+
+	TPMI_DH_OBJECT att_key_handle = tpm2d_get_as_key_handle();
+	if (att_key_handle == TPM_RH_NULL)
+		goto err_att_req;
+
+	Tpm2dToRemote out = TPM2D_TO_REMOTE__INIT;
+	out.code = TPM2D_TO_REMOTE__CODE__ATTESTATION_RES;
+
+	if (n > 1) {
+		const uint8_t *leaves[TPM2D_RCONTROL_AGGREGATE_MAX];
+		size_t leaves_len[TPM2D_RCONTROL_AGGREGATE_MAX];
+		for (size_t i = 0; i < n; i++) {
+			leaves[i] = reqs[i]->nonce;
+			leaves_len[i] = reqs[i]->nonce_len;
+		}
+		tree = merkle_tree_new(leaves, leaves_len, n);
+		IF_NULL_GOTO_ERROR(tree, err_att_req);
+		qualifying_data = merkle_tree_get_root(tree);
+		qualifying_data_len = MERKLE_HASH_LEN;
+		INFO("Answering %zu aggregated attestation requests with one quote", n);
+	}
+
+	if (tpm2_pcrread_multi(TPM2D_HASH_ALGORITHM, pcr_array, pcr_regs)) {
+		ERROR("Failed to read PCRs for attestation");
+		goto err_att_req;
+	}
+	if (pcr_regs > ML_CONTAINER_PCR_INDEX)
+		ml_pcr_check(pcr_array[ML_CONTAINER_PCR_INDEX]);
+
+	quote = tpm2_quote_new(pcr_indices, att_key_handle, TPM2D_ATT_KEY_PW,
+			       (uint8_t *)qualifying_data, qualifying_data_len);
+	if (!quote) {
+		// the (persisted) key may be gone, it is validated again for the next request
+		tpm2d_invalidate_key_handle(att_key_handle);
+		goto err_att_req;
+	}
+
+	// add device certificate to quote
+	attestation_cert = tpm2d_rcontrol_att_cert_get(&att_cert_len);
+	IF_NULL_GOTO_ERROR(attestation_cert, err_att_req);
+
+	// the response only references the PCR values, certificate and measurement list
+	for (int i = 0; i < pcr_regs; ++i) {
+		pcr__init(&out_pcr_values[i]);
+		out_pcr_values[i].has_value = true;
+		out_pcr_values[i].value.data = pcr_array[i]->pcr_value;
+		out_pcr_values[i].value.len = pcr_array[i]->pcr_size;
+		out_pcr_values[i].has_number = true;
+		out_pcr_values[i].number = i;
+		out_pcrs[i] = &out_pcr_values[i];
+	}
+
+	out.has_atype = true;
+	out.atype = reqs[0]->atype;
+	out.has_halg = true;
+	out.halg = tpm2d_rcontrol_hash_algo_get_len_proto(quote->halg_id);
+	out.has_quoted = true;
+	out.quoted.data = quote->quoted_value;
+	out.quoted.len = quote->quoted_size;
+	out.has_signature = true;
+	out.signature.data = quote->signature_value;
+	out.signature.len = quote->signature_size;
+
+	out.n_pcr_values = pcr_regs;
+	out.pcr_values = out_pcrs;
+
+	out.has_certificate = true;
+	out.certificate.data = (uint8_t *)attestation_cert;
+	out.certificate.len = att_cert_len;
+
+	out.ml_entry.data = (uint8_t *)ml_get_measurement_list_binary(&out.ml_entry.len);
+	if (!out.ml_entry.data) {
+		WARN("Failed to retrieve binary measurement list");
+		goto err_att_req;
+	}
+
+	if (tree) {
+		proof = mem_new(const uint8_t *, merkle_proof_max_len(n));
+		out_proof = mem_new(ProtobufCBinaryData, merkle_proof_max_len(n));
+		out.has_nonce_count = true;
+		out.nonce_count = n;
+		out.has_nonce_index = true;
+		out.nonce_proof = out_proof;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (tree) {
+			out.nonce_index = i;
+			out.n_nonce_proof = merkle_tree_get_proof(tree, i, proof);
+			for (size_t j = 0; j < out.n_nonce_proof; j++) {
+				out_proof[j].data = (uint8_t *)proof[j];
+				out_proof[j].len = MERKLE_HASH_LEN;
+			}
+		}
+		DEBUG("Received INTERNAL_ATTESTATION_RES, now sending reply");
+		protobuf_send_message(reqs[i]->fd, (ProtobufCMessage *)&out);
+	}
+
+err_att_req:
+	for (int i = 0; i < pcr_regs; ++i) {
+		if (pcr_array[i])
+			tpm2_pcrread_free(pcr_array[i]);
+	}
+	if (quote)
+		tpm2_quote_free(quote);
+	if (proof)
+		mem_free(proof);
+	if (out_proof)
+		mem_free(out_proof);
+	merkle_tree_free(tree);
+}
+
+static tpm2d_rcontrol_req_t *
+tpm2d_rcontrol_req_new(const RemoteToTpm2d *msg, int fd)
+{
+	int pcr_regs;
+
+	switch (msg->atype) {
+	case IDS_ATTESTATION_TYPE__BASIC:
+		TRACE("atype BASIC");
+		pcr_regs = 12;
+		break;
+	case IDS_ATTESTATION_TYPE__ALL:
+		TRACE("atype ALL");
+		pcr_regs = 24;
+		break;
+	case IDS_ATTESTATION_TYPE__ADVANCED:
+		TRACE("atype ADVACE");
+		pcr_regs = (msg->has_pcrs) ? msg->pcrs : 0;
+		if (pcr_regs < 1 || pcr_regs > TPM2D_RCONTROL_PCRS_MAX) {
+			WARN("Invalid number of PCRs %d requested", pcr_regs);
+			return NULL;
+		}
+		break;
+	default:
+		return NULL;
+	}
+
+	tpm2d_rcontrol_req_t *req = mem_new0(tpm2d_rcontrol_req_t, 1);
+	req->fd = fd;
+	req->atype = msg->atype;
+	req->pcr_regs = pcr_regs;
+	req->nonce_len = msg->has_qualifyingdata ? msg->qualifyingdata.len : 0;
+	req->nonce = mem_alloc0(req->nonce_len + 1);
+	if (req->nonce_len)
+		memcpy(req->nonce, msg->qualifyingdata.data, req->nonce_len);
+	return req;
+}
+
+static void
+tpm2d_rcontrol_req_free(tpm2d_rcontrol_req_t *req)
+{
+	mem_free(req->nonce);
+	mem_free(req);
+}
+
+/*
+ * Answers the aggregated requests received within the window, grouped by the
+ * requested PCRs.
+ */
+static void
+tpm2d_rcontrol_aggregate_cb(event_timer_t *timer, void *data)
+{
+	tpm2d_rcontrol_t *rcontrol = data;
+	ASSERT(rcontrol);
+
+	event_timer_free(timer);
+	rcontrol->aggregate_timer = NULL;
+
+	tss2_init();
+	while (rcontrol->aggregated) {
+		tpm2d_rcontrol_req_t *reqs[TPM2D_RCONTROL_AGGREGATE_MAX];
+		size_t n = 0;
+
+		reqs[n++] = rcontrol->aggregated->data;
+		rcontrol->aggregated = list_unlink(rcontrol->aggregated, rcontrol->aggregated);
+
+		for (list_t *l = rcontrol->aggregated; l && n < TPM2D_RCONTROL_AGGREGATE_MAX;) {
+			tpm2d_rcontrol_req_t *req = l->data;
+			list_t *next = l->next;
+			if (req->atype == reqs[0]->atype && req->pcr_regs == reqs[0]->pcr_regs) {
+				reqs[n++] = req;
+				rcontrol->aggregated = list_unlink(rcontrol->aggregated, l);
+			}
+			l = next;
+		}
+
+		tpm2d_rcontrol_attest(reqs, n);
+		for (size_t i = 0; i < n; i++)
+			tpm2d_rcontrol_req_free(reqs[i]);
+	}
+	tss2_destroy();
+}
+
+/*
+ * Drops the pending requests of a closed connection.
+ */
+static void
+tpm2d_rcontrol_aggregate_drop(tpm2d_rcontrol_t *rcontrol, int fd)
+{
+	for (list_t *l = rcontrol->aggregated; l;) {
+		tpm2d_rcontrol_req_t *req = l->data;
+		list_t *next = l->next;
+		if (req->fd == fd) {
+			tpm2d_rcontrol_req_free(req);
+			rcontrol->aggregated = list_unlink(rcontrol->aggregated, l);
+		}
+		l = next;
+	}
+}
+
 static void
 tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t *rcontrol)
 {
@@ -80,7 +392,7 @@ tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t
 		return;
 	}
 
-	if (LOGF_PRIO_TRACE >= LOGF_LOG_MIN_PRIO) {
+	if (logf_enabled(LOGF_PRIO_TRACE)) {
 		char *msg_text = protobuf_c_text_to_string((ProtobufCMessage *)msg, NULL);
 		TRACE("Handling RemoteToTpmd message:\n%s", msg_text ? msg_text : "NULL");
 		if (msg_text)
@@ -91,138 +403,25 @@ tpm2d_rcontrol_handle_message(const RemoteToTpm2d *msg, int fd, tpm2d_rcontrol_t
 
 	switch (msg->code) {
 	case REMOTE_TO_TPM2D__CODE__ATTESTATION_REQ: {
-		Pcr **out_pcrs = NULL;
-		int pcr_regs = 0;
-		int pcr_indices = 0;
-		tpm2d_pcr_t **pcr_array = NULL;
-		tpm2d_quote_t *quote = NULL;
-		uint8_t *attestation_cert = NULL;
-		size_t att_cert_len = 0;
-
-		TPMI_DH_OBJECT att_key_handle = tpm2d_get_as_key_handle();
-		if (att_key_handle == TPM_RH_NULL)
-			goto err_att_req;
-
-		Tpm2dToRemote out = TPM2D_TO_REMOTE__INIT;
-		out.code = TPM2D_TO_REMOTE__CODE__ATTESTATION_RES;
-
-		switch (msg->atype) {
-		case IDS_ATTESTATION_TYPE__BASIC:
-			TRACE("atype BASIC");
-			pcr_regs = 12;
-			break;
-		case IDS_ATTESTATION_TYPE__ALL:
-			TRACE("atype ALL");
-			pcr_regs = 24;
-			break;
-		case IDS_ATTESTATION_TYPE__ADVANCED:
-			TRACE("atype ADVACE");
-			pcr_regs = (msg->has_pcrs) ? msg->pcrs : 0;
-			break;
-		default:
-			goto err_att_req;
+		tpm2d_rcontrol_req_t *req = tpm2d_rcontrol_req_new(msg, fd);
+		if (!req) {
+			WARN("Invalid attestation type %d", msg->atype);
 			break;
 		}
-		pcr_indices = pcr_regs - 1;
-
-		pcr_array = mem_alloc0(
-			MUL_WITH_OVERFLOW_CHECK((size_t)sizeof(tpm2d_pcr_t *), pcr_regs));
-		for (int i = 0; i < pcr_regs; ++i) {
-			pcr_array[i] = tpm2_pcrread_new(i, TPM2D_HASH_ALGORITHM);
-
-			IF_NULL_GOTO_ERROR(pcr_array[i], err_att_req);
-			INFO("PCR%d: size %zu", i, pcr_array[i]->pcr_size);
-		}
-
-		quote = tpm2_quote_new(pcr_indices, att_key_handle, TPM2D_ATT_KEY_PW,
-				       msg->qualifyingdata.data, msg->qualifyingdata.len);
-		IF_NULL_GOTO_ERROR(quote, err_att_req);
-
-		// add device certificate to quote
-		FILE *fp;
-		struct stat stat_buf;
-		if (!(fp = fopen(TPM2D_ATT_CERT_FILE, "rb"))) {
-			ERROR("Error opening device cert file");
-			goto err_att_req;
-		}
-		if (fstat(fileno(fp), &stat_buf) == -1) {
-			ERROR("Error accessing device cert file");
-			fclose(fp);
-			goto err_att_req;
-		}
-		att_cert_len = stat_buf.st_size;
-		attestation_cert = mem_new(uint8_t, att_cert_len);
-
-		if ((fread(attestation_cert, sizeof(uint8_t), att_cert_len, fp)) != att_cert_len) {
-			ERROR("Error reading out device cert file");
-			fclose(fp);
-			goto err_att_req;
-		}
-		fclose(fp);
 
-		IF_NULL_GOTO_ERROR(attestation_cert, err_att_req);
-		INFO("att cert done: size=%zu", att_cert_len);
-
-		Pcr out_pcr = PCR__INIT;
-		out_pcrs = mem_new(Pcr *, pcr_regs);
-		for (int i = 0; i < pcr_regs; ++i) {
-			out_pcr.has_value = true;
-			out_pcr.value.data = pcr_array[i]->pcr_value;
-			out_pcr.value.len = pcr_array[i]->pcr_size;
-			INFO("pcr: %zu", out_pcr.value.len);
-			out_pcr.has_number = true;
-			out_pcr.number = i;
-			out_pcrs[i] = mem_alloc(sizeof(Pcr));
-			memcpy(out_pcrs[i], &out_pcr, sizeof(Pcr));
-		}
-
-		out.has_atype = true;
-		out.atype = msg->atype;
-		out.has_halg = true;
-		out.halg = tpm2d_rcontrol_hash_algo_get_len_proto(quote->halg_id);
-		out.has_quoted = true;
-		out.quoted.data = quote->quoted_value;
-		out.quoted.len = quote->quoted_size;
-		out.has_signature = true;
-		out.signature.data = quote->signature_value;
-		out.signature.len = quote->signature_size;
-
-		out.n_pcr_values = pcr_regs;
-		out.pcr_values = out_pcrs;
-
-		out.has_certificate = true;
-		out.certificate.data = attestation_cert;
-		out.certificate.len = att_cert_len;
-
-		out.ml_entry.data = ml_get_measurement_list_binary_new(&out.ml_entry.len);
-		if (!out.ml_entry.data) {
-			WARN("Failed to retrieve binary measurement list");
-			goto err_att_req;
+		if (msg->has_aggregate && msg->aggregate) {
+			rcontrol->aggregated = list_append(rcontrol->aggregated, req);
+			if (!rcontrol->aggregate_timer) {
+				rcontrol->aggregate_timer =
+					event_timer_new(TPM2D_RCONTROL_AGGREGATE_WINDOW, 1,
+							tpm2d_rcontrol_aggregate_cb, rcontrol);
+				event_add_timer(rcontrol->aggregate_timer);
+			}
+			break;
 		}
 
-		DEBUG("Received INTERNAL_ATTESTATION_RES, now sending reply");
-		protobuf_send_message(fd, (ProtobufCMessage *)&out);
-
-		mem_free(out.ml_entry.data);
-
-	err_att_req:
-		tpm2d_flush_as_key_handle();
-
-		if (pcr_array)
-			for (int i = 0; i < pcr_regs; ++i) {
-				if (pcr_array[i])
-					tpm2_pcrread_free(pcr_array[i]);
-				if (out_pcrs && out_pcrs[i])
-					mem_free(out_pcrs[i]);
-			}
-		if (out_pcrs)
-			mem_free(out_pcrs);
-		if (pcr_array)
-			mem_free(pcr_array);
-		if (quote)
-			tpm2_quote_free(quote);
-		if (attestation_cert)
-			mem_free(attestation_cert);
+		tpm2d_rcontrol_attest(&req, 1);
+		tpm2d_rcontrol_req_free(req);
 	} break;
 	default:
 		WARN("RemoteToTpm2d command %d unknown or not implemented yet", msg->code);
@@ -265,6 +464,7 @@ tpm2d_rcontrol_cb_recv_message(int fd, unsigned events, event_io_t *io, void *da
 	return;
 
 connection_err:
+	tpm2d_rcontrol_aggregate_drop(rcontrol, fd);
 	event_remove_io(io);
 	event_io_free(io);
 	if (close(fd) < 0)
@@ -25,7 +25,10 @@
 
 #include "common/mem.h"
 #include "common/macro.h"
+#include "common/probe.h"
 #include "common/file.h"
+#include "common/str.h"
+#include "common/event.h"
 
 #include <ibmtss/tss.h>
 #include <ibmtss/tssutils.h>
@@ -42,6 +45,18 @@
 
 static TSS_CONTEXT *tss_context = NULL;
 
+/*
+ * The context is not deleted with the last tss2_destroy() but kept open until it
+ * was idle for TSS_CONTEXT_IDLE_TIMEOUT ms, thus bursts of requests, e.g. the
+ * measurements during container starts, share one context and the transient
+ * attestation key loaded with it.
+ */
+#define TSS_CONTEXT_IDLE_TIMEOUT 2000
+
+static unsigned int tss_context_users = 0;
+static event_timer_t *tss_context_idle_timer = NULL;
+static bool tss_context_idle_pending = false;
+
 #define TSS_TPM_CMD_ERROR(rc, cc_string)                                                           \
 	{                                                                                          \
 		const char *msg;                                                                   \
@@ -58,8 +73,14 @@ tss2_init(void)
 {
 	int ret;
 
+	if (tss_context_idle_pending) {
+		event_remove_timer(tss_context_idle_timer);
+		tss_context_idle_pending = false;
+	}
+	tss_context_users++;
+
 	if (tss_context) {
-		INFO("Context already exists.");
+		TRACE("Context already exists.");
 		return;
 	}
 
@@ -69,12 +90,45 @@ tss2_init(void)
 	TSS_SetProperty(NULL, TPM_TRACE_LEVEL, "1");
 }
 
+static void
+tss2_idle_cb(UNUSED event_timer_t *timer, UNUSED void *data)
+{
+	tss_context_idle_pending = false;
+	TRACE("TSS context idle, closing it");
+	tss2_close();
+}
+
 void
 tss2_destroy(void)
 {
-	int ret;
 	IF_NULL_RETURN_ERROR(tss_context);
 
+	if (tss_context_users > 0)
+		tss_context_users--;
+	IF_TRUE_RETURN(tss_context_users > 0 || tss_context_idle_pending);
+
+	if (!tss_context_idle_timer)
+		tss_context_idle_timer =
+			event_timer_new(TSS_CONTEXT_IDLE_TIMEOUT, 1, &tss2_idle_cb, NULL);
+	event_add_timer(tss_context_idle_timer);
+	tss_context_idle_pending = true;
+}
+
+void
+tss2_close(void)
+{
+	int ret;
+
+	if (tss_context_idle_pending) {
+		event_remove_timer(tss_context_idle_timer);
+		tss_context_idle_pending = false;
+	}
+	tss_context_users = 0;
+	IF_NULL_RETURN(tss_context);
+
+	// transient keys are kept loaded as long as the context, persistent ones stay
+	tpm2d_flush_key_handles(false);
+
 	if (TPM_RC_SUCCESS != (ret = TSS_Delete(tss_context)))
 		FATAL("Cannot destroy tss context error code: %08x", ret);
 
@@ -84,43 +138,24 @@ tss2_destroy(void)
 char *
 convert_bin_to_hex_new(const uint8_t *bin, int length)
 {
-	size_t len = MUL_WITH_OVERFLOW_CHECK(length, (size_t)2);
-	len = MUL_WITH_OVERFLOW_CHECK(len, sizeof(char));
-	len = ADD_WITH_OVERFLOW_CHECK(len, 1);
-	char *hex = mem_alloc0(len);
-
-	for (int i = 0; i < length; ++i) {
-		// remember snprintf additionally writs a '0' byte
-		snprintf(hex + i * 2, 3, "%.2x", bin[i]);
-	}
+	IF_TRUE_RETVAL(0 > length, NULL);
 
-	return hex;
+	return str_hex_encode_new(bin, length);
 }
 
 uint8_t *
 convert_hex_to_bin_new(const char *hex_str, int *out_length)
 {
-	int len = strlen(hex_str);
-	int i = 0, j = 0;
-	*out_length = (len + 1) / 2;
-
-	uint8_t *bin = mem_alloc0(*out_length);
+	size_t len = 0;
+	uint8_t *bin = str_hex_decode_new(hex_str, &len);
 
-	if (len % 2 == 1) {
-		// odd length -> we need to pad
-		IF_FALSE_GOTO(sscanf(&(hex_str[0]), "%1hhx", &(bin[0])) == 1, err);
-		i = j = 1;
-	}
-
-	for (; i < len; i += 2, j++) {
-		IF_FALSE_GOTO(sscanf(&(hex_str[i]), "%2hhx", &(bin[j])) == 1, err);
+	if (!bin) {
+		ERROR("Converstion of hex string to bin failed!");
+		return NULL;
 	}
 
+	*out_length = len;
 	return bin;
-err:
-	ERROR("Converstion of hex string to bin failed!");
-	mem_free(bin);
-	return NULL;
 }
 
 #ifndef TPM2D_NVMCRYPT_ONLY
@@ -298,6 +333,8 @@ tpm2_startauthsession(TPM_SE session_type, TPMI_SH_AUTH_SESSION *out_session_han
 
 	if (TPM_RC_SUCCESS != rc) {
 		TSS_TPM_CMD_ERROR(rc, "CC_StartAuthSession");
+		// the salt key is validated again on the next session
+		tpm2d_invalidate_key_handle(in.tpmKey);
 		return rc;
 	}
 
@@ -466,6 +503,73 @@ tpm2_flushcontext(TPMI_DH_CONTEXT handle)
 	return rc;
 }
 
+bool
+tpm2_readpublic_matches(TPMI_DH_OBJECT handle, const char *file_name_pub_key)
+{
+	ReadPublic_In in;
+	ReadPublic_Out out;
+	TPM2B_PUBLIC file_public;
+	uint8_t *object_bin = NULL, *file_bin = NULL;
+	uint16_t object_len, file_len;
+	bool match = false;
+
+	IF_NULL_RETVAL_ERROR(tss_context, false);
+
+	in.objectHandle = handle;
+
+	// an empty handle is expected when probing, thus no error is logged
+	if (TPM_RC_SUCCESS != TSS_Execute(tss_context, (RESPONSE_PARAMETERS *)&out,
+					  (COMMAND_PARAMETERS *)&in, NULL, TPM_CC_ReadPublic,
+					  TPM_RH_NULL, NULL, 0))
+		return false;
+	IF_NULL_RETVAL_TRACE(file_name_pub_key, true);
+
+	if (TPM_RC_SUCCESS !=
+	    TSS_File_ReadStructureFlag(&file_public,
+				       (UnmarshalFunctionFlag_t)TSS_TPM2B_PUBLIC_Unmarshalu, false,
+				       file_name_pub_key))
+		return false;
+
+	if (TPM_RC_SUCCESS == TSS_Structure_Marshal(&object_bin, &object_len, &out.outPublic,
+						    (MarshalFunction_t)TSS_TPM2B_PUBLIC_Marshal) &&
+	    TPM_RC_SUCCESS == TSS_Structure_Marshal(&file_bin, &file_len, &file_public,
+						    (MarshalFunction_t)TSS_TPM2B_PUBLIC_Marshal))
+		match = object_len == file_len && !memcmp(object_bin, file_bin, file_len);
+
+	free(object_bin);
+	free(file_bin);
+	return match;
+}
+
+TPM_RC
+tpm2_getproperty(TPM_PT property, uint32_t *out_value)
+{
+	TPM_RC rc;
+	GetCapability_In in;
+	GetCapability_Out out;
+
+	IF_NULL_RETVAL_ERROR(tss_context, TSS_RC_NULL_PARAMETER);
+
+	in.capability = TPM_CAP_TPM_PROPERTIES;
+	in.property = property;
+	in.propertyCount = 1;
+
+	rc = TSS_Execute(tss_context, (RESPONSE_PARAMETERS *)&out, (COMMAND_PARAMETERS *)&in, NULL,
+			 TPM_CC_GetCapability, TPM_RH_NULL, NULL, 0);
+	if (TPM_RC_SUCCESS != rc) {
+		TSS_TPM_CMD_ERROR(rc, "CC_GetCapability");
+		return rc;
+	}
+
+	if (out.capabilityData.data.tpmProperties.count < 1 ||
+	    out.capabilityData.data.tpmProperties.tpmProperty[0].property != property) {
+		ERROR("TPM did not report property %08x", property);
+		return TPM_RC_VALUE;
+	}
+	*out_value = out.capabilityData.data.tpmProperties.tpmProperty[0].value;
+	return rc;
+}
+
 static TPM_RC
 tpm2_fill_rsa_details(TPMT_PUBLIC *out_public_area, tpm2d_key_type_t key_type)
 {
@@ -831,8 +935,10 @@ tpm2_pcrextend(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg, const uint8_t *dat
 	memset((uint8_t *)&in.digests.digests[0].digest, 0, sizeof(TPMU_HA));
 	memcpy((uint8_t *)&in.digests.digests[0].digest, data, data_len);
 
+	PROBE2(tpm2_pcrextend_begin, pcr_index, hash_alg);
 	rc = TSS_Execute(tss_context, NULL, (COMMAND_PARAMETERS *)&in, NULL, TPM_CC_PCR_Extend,
 			 TPM_RS_PW, NULL, 0, TPM_RH_NULL, NULL, 0);
+	PROBE2(tpm2_pcrextend_end, pcr_index, rc);
 
 	if (TPM_RC_SUCCESS != rc)
 		TSS_TPM_CMD_ERROR(rc, "CC_PCR_Extend");
@@ -1142,6 +1248,18 @@ tpm2_getrandom_new(size_t rand_length)
 	return rand;
 }
 
+static tpm2d_pcr_t *
+tpm2_pcr_new(TPMI_ALG_HASH hash_alg, const TPM2B_DIGEST *digest)
+{
+	tpm2d_pcr_t *pcr = mem_alloc0(sizeof(tpm2d_pcr_t));
+	pcr->halg_id = hash_alg;
+	pcr->pcr_value =
+		mem_alloc0(MUL_WITH_OVERFLOW_CHECK((size_t)sizeof(uint8_t), digest->t.size));
+	memcpy(pcr->pcr_value, digest->t.buffer, digest->t.size);
+	pcr->pcr_size = digest->t.size;
+	return pcr;
+}
+
 tpm2d_pcr_t *
 tpm2_pcrread_new(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg)
 {
@@ -1181,15 +1299,80 @@ tpm2_pcrread_new(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg)
 	INFO("out.pcrValues.digests[0].t.size %d", out.pcrValues.digests[0].t.size);
 
 	// finally fill the output structure needed for protobuf
-	pcr = mem_alloc0(sizeof(tpm2d_pcr_t));
-	pcr->halg_id = in.pcrSelectionIn.pcrSelections[0].hash;
-	pcr->pcr_value = mem_alloc0(
-		MUL_WITH_OVERFLOW_CHECK((size_t)sizeof(uint8_t), out.pcrValues.digests[0].t.size));
-	memcpy(pcr->pcr_value, out.pcrValues.digests[0].t.buffer, out.pcrValues.digests[0].t.size);
-	pcr->pcr_size = out.pcrValues.digests[0].t.size;
+	pcr = tpm2_pcr_new(hash_alg, &out.pcrValues.digests[0]);
 	return pcr;
 }
 
+int
+tpm2_pcrread_multi(TPMI_ALG_HASH hash_alg, tpm2d_pcr_t *pcrs[], size_t pcrs_len)
+{
+	TPM_RC rc = TPM_RC_SUCCESS;
+	PCR_Read_In in;
+	PCR_Read_Out out;
+	uint32_t pending;
+
+	IF_NULL_RETVAL_ERROR(tss_context, -1);
+	IF_TRUE_RETVAL_ERROR(pcrs_len > 24, -1);
+
+	memset(pcrs, 0, pcrs_len * sizeof(tpm2d_pcr_t *));
+	pending = (1U << pcrs_len) - 1;
+
+	/*
+	 * The TPM returns the values of as many of the selected PCRs as fit into
+	 * one response (8 digests) in ascending order and the selection of the
+	 * returned ones, thus the remaining ones are requested again.
+	 */
+	while (pending) {
+		in.pcrSelectionIn.count = 1;
+		in.pcrSelectionIn.pcrSelections[0].hash = hash_alg;
+		in.pcrSelectionIn.pcrSelections[0].sizeofSelect = 3;
+		for (int i = 0; i < 3; i++)
+			in.pcrSelectionIn.pcrSelections[0].pcrSelect[i] =
+				(pending >> (8 * i)) & 0xff;
+
+		do {
+			rc = TSS_Execute(tss_context, (RESPONSE_PARAMETERS *)&out,
+					 (COMMAND_PARAMETERS *)&in, NULL, TPM_CC_PCR_Read,
+					 TPM_RH_NULL, NULL, 0);
+		} while (TPM_RC_RETRY == rc);
+
+		if (TPM_RC_SUCCESS != rc) {
+			TSS_TPM_CMD_ERROR(rc, "CC_PCR_Read");
+			goto err;
+		}
+
+		uint32_t returned = 0;
+		if (out.pcrSelectionOut.count > 0) {
+			TPMS_PCR_SELECTION *sel = &out.pcrSelectionOut.pcrSelections[0];
+			for (int i = 0; i < sel->sizeofSelect && i < 3; i++)
+				returned |= (uint32_t)sel->pcrSelect[i] << (8 * i);
+		}
+		returned &= pending;
+
+		if (out.pcrValues.count == 0 || returned == 0) {
+			WARN("CC_PCR_Read returned no values. "
+			     "Seems PCRs are not initialized, reboot System!");
+			goto err;
+		}
+
+		for (size_t i = 0, d = 0; i < pcrs_len && d < out.pcrValues.count; i++) {
+			if (returned & (1U << i))
+				pcrs[i] = tpm2_pcr_new(hash_alg, &out.pcrValues.digests[d++]);
+		}
+		pending &= ~returned;
+	}
+
+	return 0;
+
+err:
+	for (size_t i = 0; i < pcrs_len; i++) {
+		if (pcrs[i])
+			tpm2_pcrread_free(pcrs[i]);
+		pcrs[i] = NULL;
+	}
+	return -1;
+}
+
 void
 tpm2_pcrread_free(tpm2d_pcr_t *pcr)
 {
@@ -1242,7 +1425,10 @@ tpm2_nv_get_max_buffer_size(TSS_CONTEXT *tss_context)
 
 	// set a small default fallback value;
 	size_t buffer_size = 512;
+	// a property of the TPM, thus only queried once
+	static size_t buffer_size_cached = 0;
 
+	IF_TRUE_RETVAL_TRACE(buffer_size_cached > 0, buffer_size_cached);
 	IF_NULL_RETVAL_WARN(tss_context, buffer_size);
 
 	if (TPM_RC_SUCCESS != TSS_Execute(tss_context, (RESPONSE_PARAMETERS *)&out,
@@ -1254,7 +1440,8 @@ tpm2_nv_get_max_buffer_size(TSS_CONTEXT *tss_context)
 
 	if (out.capabilityData.data.tpmProperties.count > 0 &&
 	    out.capabilityData.data.tpmProperties.tpmProperty[0].property == TPM_PT_NV_BUFFER_MAX)
-		buffer_size = out.capabilityData.data.tpmProperties.tpmProperty[0].value;
+		buffer_size = buffer_size_cached =
+			out.capabilityData.data.tpmProperties.tpmProperty[0].value;
 	else
 		ERROR("GetCapability failed, returning default value %zd", buffer_size);
 
@@ -1513,7 +1700,9 @@ tpm2_nv_read(TPMI_SH_POLICY se_handle, TPMI_RH_NV_INDEX nv_index_handle, const c
 	TSS_PrintAll("nv_read data: ", out_buffer, *out_length);
 
 flush:
-	rc_flush = tpm2_flushcontext(auth_se_handle);
+	// a session provided by the caller is kept, e.g., to be reused for the next read
+	if (se_handle == TPM_RH_NULL)
+		rc_flush = tpm2_flushcontext(auth_se_handle);
 
 err:
 	if (TPM_RC_SUCCESS != rc) {
@@ -29,6 +29,7 @@
 #include "rcontrol.h"
 
 #include "common/macro.h"
+#include "common/drbg.h"
 #include "common/mem.h"
 #include "common/event.h"
 #include "common/logf.h"
@@ -37,6 +38,7 @@
 #include "common/sock.h"
 #include "common/protobuf.h"
 
+#include <openssl/crypto.h>
 #include <signal.h>
 #include <getopt.h>
 
@@ -52,11 +54,7 @@ static tpm2d_control_t *tpm2d_control_cmld = NULL;
 static tpm2d_rcontrol_t *tpm2d_rcontrol_attest = NULL;
 static logf_handler_t *tpm2d_logfile_handler = NULL;
 
-static uint32_t tpm2d_salt_key_handle = TPM_RH_NULL;
-
 #ifndef TPM2D_NVMCRYPT_ONLY
-// transient (tr) attestation key (as) handle
-static uint32_t tpm2d_as_key_handle_tr = TPM_RH_NULL;
 // transient (tr) parent handle (pt) for attestation key (as)
 static uint32_t tpm2d_as_key_handle_pt_tr = TPM_RH_NULL;
 // persistent (ps) parent handle (pt) for attestation key (as)
@@ -75,55 +73,193 @@ tpm2d_logfile_rename_cb(UNUSED event_timer_t *timer, UNUSED void *data)
 	logf_handler_set_prio(tpm2d_logfile_handler, LOGF_PRIO_WARN);
 }
 
-static void
-tpm2d_setup_salt_key(void)
+/*
+ * Keys tpm2d uses over and over again are kept in persistent handles of the
+ * owner hierarchy, so that they neither have to be loaded (or created) again
+ * after their transient objects are flushed nor on each start. Persistent
+ * handles are a scarce resource of the TPM, a few slots shared with other
+ * users, thus a key is only persisted if the TPM reports a free slot and is
+ * kept as transient object otherwise.
+ */
+typedef struct tpm2d_key {
+	const char *name;
+	TPMI_DH_PERSISTENT persist_handle;
+	const char *pub_file; ///< public area a persisted key has to match, NULL for any
+	TPM_RC (*load)(TPMI_DH_OBJECT *out_handle); ///< loads the key as transient object
+	bool flush_on_close; ///< a transient handle is flushed with the TSS context
+	TPMI_DH_OBJECT handle; ///< TPM_RH_NULL until validated on first use
+} tpm2d_key_t;
+
+static TPM_RC
+tpm2d_load_salt_key(TPMI_DH_OBJECT *out_handle)
 {
-	// create primary key in NULL hierarchy wwhcih is used for session encryption
-	int ret;
+	// the primary key is the same on each start if it can be created in the owner hierarchy
+	if (TPM_RC_SUCCESS == tpm2_createprimary_asym(TPM2D_KEY_HIERARCHY, TPM2D_KEY_TYPE_STORAGE_R,
+						      NULL, NULL, NULL, out_handle))
+		return TPM_RC_SUCCESS;
+	WARN("Creating salt key in owner hierarchy failed, using NULL hierarchy");
+	return tpm2_createprimary_asym(TPM_RH_NULL, TPM2D_KEY_TYPE_STORAGE_R, NULL, NULL, NULL,
+				       out_handle);
+}
+
+#ifndef TPM2D_NVMCRYPT_ONLY
+static TPM_RC
+tpm2d_load_as_key(TPMI_DH_OBJECT *out_handle)
+{
+	return tpm2_load(tpm2d_as_key_handle_pt_ps, tpm2d_as_key_pwd_pt, TPM2D_ATT_PRIV_FILE,
+			 TPM2D_ATT_PUB_FILE, out_handle);
+}
+#endif
+
+static tpm2d_key_t tpm2d_salt_key = {
+	.name = "salt key",
+	.persist_handle = TPM2D_SALT_KEY_PERSIST_HANDLE,
+	.pub_file = NULL,
+	.load = tpm2d_load_salt_key,
+	.flush_on_close = false, // creating a primary key takes long
+	.handle = TPM_RH_NULL,
+};
+
+#ifndef TPM2D_NVMCRYPT_ONLY
+static tpm2d_key_t tpm2d_as_key = {
+	.name = "attestation key",
+	.persist_handle = TPM2D_ATT_KEY_PERSIST_HANDLE,
+	.pub_file = TPM2D_ATT_PUB_FILE,
+	.load = tpm2d_load_as_key,
+	.flush_on_close = true,
+	.handle = TPM_RH_NULL,
+};
+#endif
+
+static tpm2d_key_t *const tpm2d_keys[] = {
+	&tpm2d_salt_key,
+#ifndef TPM2D_NVMCRYPT_ONLY
+	&tpm2d_as_key,
+#endif
+};
+
+static bool
+tpm2d_key_is_persistent(const tpm2d_key_t *key)
+{
+	return key->handle == key->persist_handle;
+}
+
+/*
+ * Moves the transient object of a key into its persistent handle, replacing a
+ * stale key, e.g., of a former provisioning. Returns the handle to be used.
+ */
+static TPMI_DH_OBJECT
+tpm2d_key_persist(tpm2d_key_t *key, TPMI_DH_OBJECT transient)
+{
+	uint32_t avail = 0;
+
+	if (tpm2_readpublic_matches(key->persist_handle, NULL)) {
+		INFO("Evicting stale %s from persistent handle %08x", key->name,
+		     key->persist_handle);
+		IF_TRUE_RETVAL(TPM_RC_SUCCESS != tpm2_evictcontrol(TPM2D_KEY_HIERARCHY, NULL,
+								   key->persist_handle,
+								   key->persist_handle),
+			       transient);
+	}
+
+	if (TPM_RC_SUCCESS != tpm2_getproperty(TPM_PT_HR_PERSISTENT_AVAIL, &avail) || !avail) {
+		INFO("No persistent handle available, keeping %s transient", key->name);
+		return transient;
+	}
+
 	if (TPM_RC_SUCCESS !=
-	    (ret = tpm2_createprimary_asym(TPM_RH_NULL, TPM2D_KEY_TYPE_STORAGE_R, NULL, NULL, NULL,
-					   &tpm2d_salt_key_handle))) {
-		FATAL("Failed to create primary key for session encryption with error code: %08x",
-		      ret);
+	    tpm2_evictcontrol(TPM2D_KEY_HIERARCHY, NULL, transient, key->persist_handle)) {
+		WARN("Could not persist %s, keeping it transient", key->name);
+		return transient;
 	}
+	INFO("Persisted %s with handle %08x -> %08x", key->name, transient, key->persist_handle);
+
+	if (TPM_RC_SUCCESS != tpm2_flushcontext(transient))
+		WARN("Failed to flush transient object handle of %s", key->name);
+	return key->persist_handle;
 }
 
-TPMI_DH_OBJECT
-tpm2d_get_salt_key_handle(void)
+/*
+ * Returns the handle of a key. On first use, the persisted key is validated
+ * and, if it is missing or stale, the key is loaded and persisted again.
+ */
+static TPMI_DH_OBJECT
+tpm2d_key_get(tpm2d_key_t *key)
+{
+	TPMI_DH_OBJECT transient;
+	int ret;
+
+	IF_TRUE_RETVAL_TRACE(key->handle != TPM_RH_NULL, key->handle);
+
+	if (tpm2_readpublic_matches(key->persist_handle, key->pub_file)) {
+		DEBUG("Using %s with persistent handle %08x", key->name, key->persist_handle);
+		key->handle = key->persist_handle;
+		return key->handle;
+	}
+
+	if (TPM_RC_SUCCESS != (ret = key->load(&transient))) {
+		ERROR("Failed to load %s with error code: %08x", key->name, ret);
+		return TPM_RH_NULL;
+	}
+	INFO("Loaded %s with handle %08x", key->name, transient);
+
+	key->handle = tpm2d_key_persist(key, transient);
+	return key->handle;
+}
+
+static void
+tpm2d_key_flush(tpm2d_key_t *key)
 {
-	return tpm2d_salt_key_handle;
+	if (key->handle != TPM_RH_NULL && !tpm2d_key_is_persistent(key))
+		tpm2_flushcontext(key->handle);
+	key->handle = TPM_RH_NULL;
 }
 
-#ifndef TPM2D_NVMCRYPT_ONLY
-TPMI_DH_OBJECT
-tpm2d_get_as_key_handle(void)
+void
+tpm2d_invalidate_key_handle(TPMI_DH_OBJECT handle)
 {
-	if (TPM_RH_NULL == tpm2d_as_key_handle_tr) {
-		int ret;
-		// load attestation key
-		if (TPM_RC_SUCCESS !=
-		    (ret = tpm2_load(tpm2d_as_key_handle_pt_ps, tpm2d_as_key_pwd_pt,
-				     TPM2D_ATT_PRIV_FILE, TPM2D_ATT_PUB_FILE,
-				     &tpm2d_as_key_handle_tr))) {
-			ERROR("Failed to load attestation key with error code: %08x", ret);
-			return TPM_RH_NULL;
-		} else {
-			INFO("Loaded signing key for attestation with handle %08x from parent handle %08x.",
-			     tpm2d_as_key_handle_tr, tpm2d_as_key_handle_pt_ps);
+	IF_TRUE_RETURN(handle == TPM_RH_NULL);
+
+	for (size_t i = 0; i < ELEMENTSOF(tpm2d_keys); i++) {
+		if (tpm2d_keys[i]->handle == handle) {
+			DEBUG("Invalidating handle %08x of %s", handle, tpm2d_keys[i]->name);
+			tpm2d_key_flush(tpm2d_keys[i]);
 		}
 	}
-	return tpm2d_as_key_handle_tr;
 }
 
 void
-tpm2d_flush_as_key_handle(void)
+tpm2d_flush_key_handles(bool all)
 {
-	if (tpm2d_as_key_handle_tr != TPM_RH_NULL) {
-		tpm2_flushcontext(tpm2d_as_key_handle_tr);
-		tpm2d_as_key_handle_tr = TPM_RH_NULL;
+	for (size_t i = 0; i < ELEMENTSOF(tpm2d_keys); i++) {
+		tpm2d_key_t *key = tpm2d_keys[i];
+		// persistent handles stay valid, they are only validated again after a restart
+		if (all || (key->flush_on_close && !tpm2d_key_is_persistent(key)))
+			tpm2d_key_flush(key);
 	}
 }
 
+static void
+tpm2d_setup_salt_key(void)
+{
+	// the salt key is used for session encryption
+	if (TPM_RH_NULL == tpm2d_key_get(&tpm2d_salt_key))
+		FATAL("Failed to set up key for session encryption");
+}
+
+TPMI_DH_OBJECT
+tpm2d_get_salt_key_handle(void)
+{
+	return tpm2d_key_get(&tpm2d_salt_key);
+}
+
+#ifndef TPM2D_NVMCRYPT_ONLY
+TPMI_DH_OBJECT
+tpm2d_get_as_key_handle(void)
+{
+	return tpm2d_key_get(&tpm2d_as_key);
+}
+
 static void
 tpm2d_setup_keys(void)
 {
@@ -192,6 +328,24 @@ retry:
 }
 #endif /* ifndef TPM2D_NVMCRYPT_ONLY */
 
+/*
+ * Seed source for the DRBG which serves random bytes from memory instead of
+ * a TPM round trip per request. It is invoked on each (re)seed.
+ */
+static int
+tpm2d_drbg_source_tpm(uint8_t *buf, size_t len, UNUSED void *data)
+{
+	tss2_init();
+	uint8_t *rand = tpm2_getrandom_new(len);
+	tss2_destroy();
+	IF_NULL_RETVAL(rand, -1);
+
+	memcpy(buf, rand, len);
+	OPENSSL_cleanse(rand, len);
+	mem_free(rand);
+	return 0;
+}
+
 static void
 tpm2d_init(void)
 {
@@ -231,6 +385,9 @@ tpm2d_init(void)
 	// create salt key for session encryption
 	tpm2d_setup_salt_key();
 
+	if (drbg_add_source("tpm", tpm2d_drbg_source_tpm, NULL) < 0)
+		WARN("Failed to add the TPM as seed source, seeding from the kernel only");
+
 #ifndef TPM2D_NVMCRYPT_ONLY
 	// initialize nvm_crypt_submodule
 	nvmcrypt_init(true);
@@ -252,14 +409,10 @@ tpm2d_exit(void)
 	INFO("Cleaning up tss2 and exit");
 	// When called tss2 library context may not be
 	tss2_init();
-	if (tpm2d_salt_key_handle != TPM_RH_NULL)
-		tpm2_flushcontext(tpm2d_salt_key_handle);
-#ifndef TPM2D_NVMCRYPT_ONLY
-	if (tpm2d_as_key_handle_tr != TPM_RH_NULL)
-		tpm2_flushcontext(tpm2d_as_key_handle_tr);
-#endif
+	nvmcrypt_exit();
+	tpm2d_flush_key_handles(true);
 
-	tss2_destroy();
+	tss2_close();
 	exit(0);
 }
 
@@ -357,7 +510,7 @@ main(UNUSED int argc, char **argv)
 
 	event_loop();
 
-	tss2_destroy();
+	tss2_close();
 
 	return 0;
 }
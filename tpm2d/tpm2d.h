@@ -40,6 +40,11 @@
 #define TPM2D_KEY_HIERARCHY TPM_RH_OWNER
 
 #define TPM2D_FDE_NV_HANDLE 0x01000000
+#define TPM2D_CACHE_KEY_NV_HANDLE 0x01000001
+
+// persistent handles of the keys kept by tpm2d, see tpm2d_get_salt_key_handle()
+#define TPM2D_SALT_KEY_PERSIST_HANDLE 0x81000001
+#define TPM2D_ATT_KEY_PERSIST_HANDLE 0x81000002
 
 #ifndef TPM2D_NVMCRYPT_ONLY
 
@@ -75,15 +80,50 @@ typedef struct tpm2d_pcr {
 void
 tpm2d_exit(void);
 
+/**
+ * Returns the handle of the key used to salt sessions. Like the attestation
+ * key, it is kept in a persistent handle if the TPM has a free one, so that
+ * it does not have to be created again on each start. The persisted key is
+ * validated on its first use.
+ *
+ * @return the handle or TPM_RH_NULL on error
+ */
 TPMI_DH_OBJECT
 tpm2d_get_salt_key_handle(void);
 
+/**
+ * Marks the key with the given handle for validation on its next use, e.g.,
+ * because a command using it failed. A transient handle is flushed.
+ */
+void
+tpm2d_invalidate_key_handle(TPMI_DH_OBJECT handle);
+
+/**
+ * Flushes the transient handles of keys which could not be persisted. Unless
+ * all is set, only those which are cheap to load again are flushed.
+ */
+void
+tpm2d_flush_key_handles(bool all);
+
+/**
+ * Acquires the TSS context used by all tpm2_* commands, creating it if needed.
+ */
 void
 tss2_init(void);
 
+/**
+ * Releases the context acquired by tss2_init(). After the last release, the
+ * context stays open until it has been idle for a while.
+ */
 void
 tss2_destroy(void);
 
+/**
+ * Flushes the transient attestation key and deletes the context immediately.
+ */
+void
+tss2_close(void);
+
 /**
  * Helper function to convert a binary buffer to an hex string
  *
@@ -168,6 +208,19 @@ tpm2_createprimary_asym(TPMI_RH_HIERARCHY hierachy, tpm2d_key_type_t key_type,
 TPM_RC
 tpm2_flushcontext(TPMI_DH_CONTEXT handle);
 
+/**
+ * Returns true if handle refers to an object and, if file_name_pub_key is not
+ * NULL, its public area matches the one stored in that file.
+ */
+bool
+tpm2_readpublic_matches(TPMI_DH_OBJECT handle, const char *file_name_pub_key);
+
+/**
+ * Reads a single TPM property, e.g., TPM_PT_HR_PERSISTENT_AVAIL.
+ */
+TPM_RC
+tpm2_getproperty(TPM_PT property, uint32_t *out_value);
+
 #ifndef TPM2D_NVMCRYPT_ONLY
 /**
  * Creates an asymmetric key as part of the hierarchy designated by the parent handle
@@ -187,9 +240,6 @@ tpm2_load(TPMI_DH_OBJECT parent_handle, const char *parent_pwd, const char *file
 TPMI_DH_OBJECT
 tpm2d_get_as_key_handle(void);
 
-void
-tpm2d_flush_as_key_handle(void);
-
 TPM_RC
 tpm2_pcrextend(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg, const uint8_t *data, size_t data_len);
 
@@ -222,6 +272,14 @@ tpm2_pcrread_new(TPMI_DH_PCR pcr_index, TPMI_ALG_HASH hash_alg);
 void
 tpm2_pcrread_free(tpm2d_pcr_t *pcr);
 
+/**
+ * Reads the PCRs 0 to pcrs_len - 1 (at most 24) into pcrs with as few
+ * TPM2_PCR_Read commands as possible.
+ * @return 0 on success, -1 on error, in which case pcrs contains no values
+ */
+int
+tpm2_pcrread_multi(TPMI_ALG_HASH hash_alg, tpm2d_pcr_t *pcrs[], size_t pcrs_len);
+
 uint8_t *
 tpm2_getrandom_new(size_t rand_length);
 